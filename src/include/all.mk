@@ -17,6 +17,7 @@ SUBDIRS		:= util
 
 HEADERS	= \
 	build.h \
+	cmap.h \
 	conf.h \
 	conffile.h \
 	detail.h \
@@ -43,11 +44,15 @@ HEADERS	= \
 	udp.h \
 	tcp.h \
 	threads.h \
+	job_pool.h \
+	mem_account.h \
+	trace.h \
 	regex.h \
 	inet.h \
 	dict.h \
 	pair.h \
 	proto.h \
+	sbuff.h \
 	$(HEADERS_DY)
 
 #
@@ -29,6 +29,8 @@ RCSIDH(clients_h, "$Id$")
 #ifdef __cplusplus
 extern "C" {
 #endif
+typedef struct client_file_t client_file_t;
+
 /** Describes a host allowed to send packets to the server
  *
  */
@@ -55,15 +57,19 @@ typedef struct radclient {
 	int			number;			//!< Unique client number.
 
 	CONF_SECTION	 	*cs;			//!< CONF_SECTION that was parsed to generate the client.
+							//!< NULL for clients loaded from a client_file.
+
+	client_file_t		*file;			//!< client_file the client was loaded from, or NULL.
+	uint32_t		file_generation;	//!< Load of the file which last saw the client.
 
 #ifdef WITH_STATS
-	fr_stats_t		auth;			//!< Authentication stats.
+	fr_stats_block_t	auth;			//!< Authentication stats.
 #  ifdef WITH_ACCOUNTING
-	fr_stats_t		acct;			//!< Accounting stats.
+	fr_stats_block_t	acct;			//!< Accounting stats.
 #  endif
 #  ifdef WITH_COA
-	fr_stats_t		coa;			//!< Change of Authorization stats.
-	fr_stats_t		dsc;			//!< Disconnect-Request stats.
+	fr_stats_block_t	coa;			//!< Change of Authorization stats.
+	fr_stats_block_t	dsc;			//!< Disconnect-Request stats.
 #  endif
 #endif
 
@@ -89,6 +95,11 @@ typedef struct radclient {
 	CONF_SECTION		*client_server_cs;	//!< Virtual server for creating dynamic clients
 
 	bool			rate_limit;		//!< Where addition of clients should be rate limited.
+
+	uint32_t		negative_ttl;		//!< How long to ignore addresses which failed lookup.
+	uint32_t		negative_prefix;	//!< Prefix length failed addresses are aggregated to.
+	uint32_t		lookup_rate;		//!< Maximum lookups per second per prefix.
+	fr_hash_table_t		*negative;		//!< Recent lookups, indexed by (masked) address.
 #endif
 
 #ifdef WITH_COA
@@ -135,6 +146,18 @@ typedef struct radclient_list RADCLIENT_LIST;
  */
 typedef int (*client_value_cb_t)(char **out, CONF_PAIR const *cp, void *data);
 
+/** Callback for #client_list_walk_prefixes
+ *
+ * @param[in] uctx	passed to #client_list_walk_prefixes.
+ * @param[in] af	of the prefix, AF_INET or AF_INET6.
+ * @param[in] key	Address bytes in network order, masked to the prefix.
+ * @param[in] prefix	Number of significant bits in key.
+ * @return
+ *	- 0 to continue walking.
+ *	- <0 to stop.
+ */
+typedef int (*client_prefix_cb_t)(void *uctx, int af, uint8_t const *key, int prefix);
+
 RADCLIENT_LIST	*client_list_init(CONF_SECTION *cs);
 
 void		client_list_free(void);
@@ -163,11 +186,23 @@ RADCLIENT	*client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 
 RADCLIENT	*client_findbynumber(RADCLIENT_LIST const *clients, int number);
 
+int		client_list_walk_prefixes(RADCLIENT_LIST const *clients, client_prefix_cb_t func, void *uctx);
+
 RADCLIENT	*client_find_old(fr_ipaddr_t const *ipaddr);
 
 bool		client_add_dynamic(RADCLIENT_LIST *clients, RADCLIENT *master, RADCLIENT *c);
 
+#ifdef WITH_DYNAMIC_CLIENTS
+bool		client_dynamic_lookup_allowed(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now);
+
+void		client_dynamic_lookup_failed(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now);
+#endif
+
 RADCLIENT	*client_read(char const *filename, CONF_SECTION *server_cs, bool check_dns);
+
+int		client_file_load(RADCLIENT_LIST *clients, char const *filename, CONF_SECTION *server_cs);
+
+int		client_file_reload(char const *filename);
 #ifdef __cplusplus
 }
 #endif
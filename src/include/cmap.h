@@ -0,0 +1,59 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_CMAP_H
+#define _FR_CMAP_H
+/**
+ * $Id$
+ *
+ * @file include/cmap.h
+ * @brief Structures and prototypes for concurrent hash maps.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSIDH(cmap_h, "$Id$")
+
+#include <freeradius-devel/hash.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_cmap_t fr_cmap_t;
+
+/**
+ *  Called with the entry which was found.  The entry can't be
+ *  deleted until the callback returns.
+ */
+typedef int (*fr_cmap_find_t)(void *ctx, void *data);
+
+fr_cmap_t	*fr_cmap_create(TALLOC_CTX *ctx, uint32_t num_stripes,
+				fr_hash_table_hash_t hash_node,
+				fr_hash_table_cmp_t cmp_node,
+				fr_hash_table_free_t free_node);
+int		fr_cmap_insert(fr_cmap_t *cmap, void const *data) CC_HINT(nonnull);
+int		fr_cmap_replace(fr_cmap_t *cmap, void const *data) CC_HINT(nonnull);
+int		fr_cmap_delete(fr_cmap_t *cmap, void const *data) CC_HINT(nonnull);
+void		*fr_cmap_yank(fr_cmap_t *cmap, void const *data) CC_HINT(nonnull);
+void		*fr_cmap_finddata(fr_cmap_t *cmap, void const *data) CC_HINT(nonnull);
+int		fr_cmap_find(fr_cmap_t *cmap, void const *data,
+			     fr_cmap_find_t callback, void *ctx) CC_HINT(nonnull(1,2,3));
+int		fr_cmap_num_elements(fr_cmap_t *cmap) CC_HINT(nonnull);
+int		fr_cmap_walk(fr_cmap_t *cmap, fr_hash_table_walk_t callback, void *ctx) CC_HINT(nonnull(1,2));
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_CMAP_H */
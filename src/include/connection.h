@@ -121,6 +121,15 @@ typedef void *(*fr_connection_create_t)(TALLOC_CTX *ctx, void *opaque, struct ti
  */
 typedef int (*fr_connection_alive_t)(void *opaque, void *connection);
 
+/** Mark a request waiting for a connection as runnable again
+ *
+ * The pool library can't call the interpreter directly, so modules using
+ * #fr_connection_get_async pass unlang_resumable() here.
+ *
+ * @param[in] request	which has been given a connection, or has given up waiting.
+ */
+typedef void (*fr_connection_wake_t)(REQUEST *request);
+
 /*
  *	Pool allocation/initialisation
  */
@@ -150,6 +159,9 @@ fr_connection_pool_state_t const *fr_connection_pool_state(fr_connection_pool_t
 
 void	fr_connection_pool_reconnect_func(fr_connection_pool_t *pool, fr_connection_pool_reconnect_t reconnect);
 
+void	fr_connection_pool_thread_local(fr_connection_pool_t *pool, fr_event_list_t *el,
+				fr_connection_wake_t wake);
+
 /*
  *	Pool management
  */
@@ -162,6 +174,8 @@ void	fr_connection_pool_free(fr_connection_pool_t *pool);
  */
 void	*fr_connection_get(fr_connection_pool_t *pool, REQUEST *request);
 
+int	fr_connection_get_async(void **out, fr_connection_pool_t *pool, REQUEST *request);
+
 void	fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *conn);
 
 void	*fr_connection_reconnect(fr_connection_pool_t *pool, REQUEST *request, void *conn);
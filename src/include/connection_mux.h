@@ -0,0 +1,114 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_CONNECTION_MUX_H
+#define _FR_CONNECTION_MUX_H
+/**
+ * $Id$
+ *
+ * @file include/connection_mux.h
+ * @brief Multiplex many requests over a small number of connections.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSIDH(connection_mux_h, "$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_mux fr_mux_t;
+typedef struct fr_mux_conn fr_mux_conn_t;
+
+/** Open a new connection
+ *
+ * There is no close callback.  Closing sockets and freeing library handles
+ * should be done by a destructor attached to memory allocated beneath ctx.
+ *
+ * @param[in,out] ctx	to allocate the connection handle in.
+ * @param[out] fd	the event loop should watch for replies.
+ * @param[in] uctx	passed to #fr_mux_alloc.
+ * @param[in] timeout	The maximum time the function has to complete the connection.
+ * @return
+ *	- NULL on error.
+ *	- A connection handle on success.
+ */
+typedef void *(*fr_mux_open_t)(TALLOC_CTX *ctx, int *fd, void *uctx, struct timeval const *timeout);
+
+/** Write a request to a connection
+ *
+ * @param[out] id	to match the reply against.  Protocols which reply in
+ *			the order requests were sent (e.g. Redis) can use seq.
+ *			Others should use their own message ID (e.g. LDAP msgid).
+ * @param[in] handle	returned by #fr_mux_open_t.
+ * @param[in] uctx	passed to #fr_mux_alloc.
+ * @param[in] request	The current request.
+ * @param[in] rctx	passed to #fr_mux_enqueue.
+ * @param[in] seq	number of requests previously written to this connection.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection is unusable, and should be re-opened.
+ */
+typedef int (*fr_mux_send_t)(uint64_t *id, void *handle, void *uctx, REQUEST *request, void *rctx, uint64_t seq);
+
+/** Read replies from a connection
+ *
+ * Called by the event loop when the connection's fd is readable.  Should read
+ * everything which is available, and call #fr_mux_reply for each complete reply.
+ *
+ * @param[in] mc	connection the replies were read from.
+ * @param[in] handle	returned by #fr_mux_open_t.
+ * @param[in] uctx	passed to #fr_mux_alloc.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection is unusable, and should be re-opened.
+ */
+typedef int (*fr_mux_recv_t)(fr_mux_conn_t *mc, void *handle, void *uctx);
+
+/** Mark a request as runnable again
+ *
+ * The mux can't call the interpreter directly, so modules pass unlang_resumable().
+ *
+ * @param[in] request	which has a reply, has timed out, or whose connection failed.
+ */
+typedef void (*fr_mux_wake_t)(REQUEST *request);
+
+/** Protocol specific callbacks for a multiplexed connection set
+ *
+ */
+typedef struct {
+	fr_mux_open_t		open;		//!< Open a new connection.
+	fr_mux_send_t		send;		//!< Write a request.
+	fr_mux_recv_t		recv;		//!< Read replies.
+} fr_mux_funcs_t;
+
+fr_mux_t	*fr_mux_alloc(TALLOC_CTX *ctx, CONF_SECTION *cs, fr_event_list_t *el, fr_mux_wake_t wake,
+			      fr_mux_funcs_t const *funcs, void *uctx, char const *log_prefix);
+
+int		fr_mux_enqueue(fr_mux_t *mux, REQUEST *request, void *rctx);
+
+void		*fr_mux_result(fr_mux_t *mux, REQUEST *request);
+
+int		fr_mux_reply(fr_mux_conn_t *mc, uint64_t id, void *reply);
+
+uint32_t	fr_mux_inflight(fr_mux_t const *mux);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_CONNECTION_MUX_H */
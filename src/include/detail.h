@@ -38,12 +38,76 @@ typedef enum detail_file_state_t {
 typedef enum detail_entry_state_t {
 	STATE_HEADER = 0,
 	STATE_VPS,
-	STATE_QUEUED,
-	STATE_RUNNING,
-	STATE_NO_REPLY,
-	STATE_REPLIED
+	STATE_QUEUED
 } detail_entry_state_t;
 
+/*
+ *	Binary detail files are a series of records, each of which is a
+ *	fixed size header, followed by the attributes in RADIUS wire
+ *	format.  All numbers are in network byte order.
+ *
+ *	Every record starts with the magic number, so files can be
+ *	rotated, concatenated, and written by several servers, the same
+ *	as text detail files.
+ */
+#define DETAIL_BINARY_MAGIC		"FRDB"
+#define DETAIL_BINARY_VERSION		1
+
+#define DETAIL_BINARY_FLAGS_OFFSET	5	//!< Offset of the flags in the record header.
+#define DETAIL_BINARY_HDR_LEN		52	//!< Length of the record header.
+#define DETAIL_BINARY_MAX_LEN		65535	//!< Maximum length of the attributes in a record.
+
+#define DETAIL_BINARY_FLAG_DONE		0x01	//!< The entry has been processed.
+
+/** The header of a binary detail record
+ *
+ * On disk, this is:
+ *
+ @verbatim
+   0  magic (4)  version (1)  flags (1)  code (1)  address family (1)
+   8  length of attributes (4)
+  12  timestamp (4)
+  16  source port (2)  destination port (2)
+  20  source address (16)
+  36  destination address (16)
+  52  attributes...
+ @endverbatim
+ */
+typedef struct detail_binary_t {
+	uint8_t		flags;			//!< DETAIL_BINARY_FLAG_* values.
+	uint8_t		code;			//!< Packet code.
+	uint32_t	length;			//!< Length of the attributes which follow.
+	time_t		timestamp;		//!< When the entry was written.
+	fr_ipaddr_t	src_ipaddr;		//!< Where the packet came from.
+	fr_ipaddr_t	dst_ipaddr;		//!< Where the packet was sent to.
+	uint16_t	src_port;
+	uint16_t	dst_port;
+} detail_binary_t;
+
+/** An entry read from the detail file, which is waiting for a reply
+ *
+ */
+typedef struct detail_entry_t {
+	RADIUS_PACKET const	*packet;		//!< The packet in flight.  Only used to match
+						//!< acks, as it may have been freed.  NULL if unused.
+	VALUE_PAIR		*vps;			//!< Attributes as read from the file, so we can
+						//!< retransmit the original packet.
+	off_t			timestamp_offset;	//!< Where to mark the entry as done.
+	time_t			timestamp;		//!< When the entry was written to the file.
+	fr_ipaddr_t		client_ip;		//!< Original client address.
+	int			tries;			//!< How many times we've sent it.
+	uint32_t		session_hash;		//!< Hash of the Acct-Session-Id, or 0.
+} detail_entry_t;
+
+/** Sent back to the reader thread when a packet has been processed
+ *
+ */
+typedef struct detail_ack_t {
+	RADIUS_PACKET const	*packet;		//!< The packet we're acknowledging.
+	bool			replied;		//!< False if the packet should be retransmitted.
+	int			rtt;			//!< Round trip time in microseconds, or -1.
+} detail_ack_t;
+
 typedef struct listen_detail_t {
 	fr_event_timer_t	*ev;	/* has to be first entry (ugh) */
 	char const 	*name;			//!< Identifier used in log messages
@@ -62,7 +126,6 @@ typedef struct listen_detail_t {
 	detail_file_state_t 	file_state;
 	detail_entry_state_t 	entry_state;
 	time_t		timestamp;
-	time_t		running;
 	fr_ipaddr_t	client_ip;
 
 	off_t		last_offset;
@@ -73,6 +136,18 @@ typedef struct listen_detail_t {
 	uint32_t	load_factor; /* 1..100 */
 	uint32_t	poll_interval;
 	uint32_t	retry_interval;
+	uint32_t	max_outstanding;	//!< How many packets we may have in flight.
+	detail_entry_t	*entries;		//!< Entries in flight, max_outstanding of them.
+	bool		draining;		//!< Finished reading the file, waiting for
+						//!< the outstanding packets to be answered.
+	bool		binary;			//!< The file is in the binary format.
+	detail_entry_t	*blocked;		//!< Entry waiting for another entry with the same
+						//!< session to be answered.
+
+	uint32_t	num_readers;		//!< How many reader threads to run.
+	uint32_t	reader;			//!< Which reader this is.
+	struct listen_detail_t **readers;	//!< All of the readers.  The first one is the
+						//!< listener's own data.
 
 	int		signal;
 	int		packets;
@@ -87,6 +162,19 @@ typedef struct listen_detail_t {
 	RADCLIENT	detail_client;
 } listen_detail_t;
 
+/*
+ *	detail.c
+ */
+void	detail_binary_header_encode(uint8_t out[DETAIL_BINARY_HDR_LEN], detail_binary_t const *hdr);
+
+int	detail_binary_header_decode(detail_binary_t *hdr, uint8_t const in[DETAIL_BINARY_HDR_LEN]);
+
+ssize_t	detail_binary_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor);
+
+int	detail_binary_decode_pairs(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const *data, size_t data_len);
+
+int	detail_binary_fprint(FILE *fp, detail_binary_t const *hdr, VALUE_PAIR *vps);
+
 #ifdef __cplusplus
 }
 #endif
@@ -58,12 +58,20 @@ ssize_t		fr_dhcp_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 
 int		fr_dhcp_decode(RADIUS_PACKET *packet);
 
+RADIUS_PACKET	*fr_dhcp_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipaddr_t src_ipaddr,
+				   uint16_t src_port, fr_ipaddr_t dst_ipaddr, uint16_t dst_port);
+
 #ifdef HAVE_LINUX_IF_PACKET_H
 #include <linux/if_packet.h>
 int		fr_socket_packet(int iface_index, struct sockaddr_ll *p_ll);
 
 int		fr_dhcp_send_raw_packet(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *packet);
 
+int		fr_dhcp_raw_reply_socket(char const *interface, struct sockaddr_ll *p_ll, uint8_t ether_addr[6]);
+
+int		fr_dhcp_send_raw_reply(int sockfd, struct sockaddr_ll const *p_ll, uint8_t const *src_ether_addr,
+				       uint8_t const *dst_ether_addr, RADIUS_PACKET *packet);
+
 RADIUS_PACKET	*fr_dhcp_recv_raw_packet(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *request);
 #endif
 
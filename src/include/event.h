@@ -28,7 +28,37 @@ RCSIDH(event_h, "$Id$")
 
 #include <freeradius-devel/missing.h>
 #include <stdbool.h>
-#include <sys/event.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ *	On Linux we use epoll and eventfd directly, instead of going
+ *	through libkqueue.  The events are still handed to the callers
+ *	as a "struct kevent", so that they don't have to care which
+ *	backend is in use.
+ */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#  define FR_EVENT_EPOLL (1)
+
+struct kevent {
+	uintptr_t		ident;			//!< FD, or ident of the user event.
+	int16_t			filter;			//!< EVFILT_READ, EVFILT_WRITE, or EVFILT_USER.
+	uint16_t		flags;			//!< EV_EOF and / or EV_ERROR.
+	uint32_t		fflags;			//!< Always zero.
+	intptr_t		data;			//!< Always zero.
+	void			*udata;			//!< Opaque data for the event list.
+};
+
+#  define EVFILT_READ		(-1)
+#  define EVFILT_WRITE		(-2)
+#  define EVFILT_USER		(-11)
+#  define EVFILT_SYSCOUNT	(11)
+
+#  define EV_ERROR		(0x4000)
+#  define EV_EOF		(0x8000)
+#else
+#  include <sys/event.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -78,6 +108,20 @@ typedef void (*fr_event_fd_handler_t)(fr_event_list_t *el, int sock, void *ctx);
  */
 typedef void (*fr_event_user_handler_t)(int kq, struct kevent const *kev, void *ctx);
 
+/** Called when a datagram has been received by #fr_event_recv_insert
+ *
+ * The data is only valid until the callback returns.
+ *
+ * @param[in] el	Event list the socket was inserted into.
+ * @param[in] sock	the datagram was received on.
+ * @param[in] msg	msg_name and msg_control, as filled in by recvmsg().
+ * @param[in] data	the datagram.
+ * @param[in] data_len	length of the datagram.
+ * @param[in] ctx	User ctx passed to #fr_event_recv_insert.
+ */
+typedef void (*fr_event_recv_handler_t)(fr_event_list_t *el, int sock, struct msghdr *msg,
+					uint8_t *data, size_t data_len, void *ctx);
+
 int		fr_event_list_num_fds(fr_event_list_t *el);
 int		fr_event_list_num_elements(fr_event_list_t *el);
 int		fr_event_list_kq(fr_event_list_t *el);
@@ -90,6 +134,10 @@ int		fr_event_fd_insert(fr_event_list_t *el, int fd,
 				   fr_event_fd_handler_t error,
 				   void *ctx);
 
+int		fr_event_recv_insert(fr_event_list_t *el, int fd, size_t packet_size, size_t control_size,
+				     fr_event_recv_handler_t recv_fn, fr_event_fd_handler_t error, void *ctx);
+int		fr_event_recv_delete(fr_event_list_t *el, int fd);
+
 int		fr_event_timer_delete(fr_event_list_t *el, fr_event_timer_t **parent);
 int		fr_event_timer_insert(fr_event_list_t *el,
 				      fr_event_callback_t callback,
@@ -108,6 +156,13 @@ int		fr_event_loop(fr_event_list_t *el);
 
 fr_event_list_t	*fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status, void *status_ctx);
 
+int		fr_event_kq_create(void);
+int		fr_event_kq_wait(int kq, struct kevent *events, int num, struct timespec const *ts) CC_HINT(nonnull(2));
+int		fr_event_kq_fd_add(int kq, int fd, int filter);
+int		fr_event_kq_user_add(int kq, uintptr_t ident);
+int		fr_event_kq_user_trigger(int handle, uintptr_t ident);
+int		fr_event_kq_user_delete(int kq, int handle, uintptr_t ident);
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,6 +25,8 @@
  */
 RCSIDH(exfile_h, "$Id$")
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,6 +37,9 @@ extern "C" {
  */
 typedef struct exfile_t exfile_t;
 
+#define EXFILE_ASYNC_INTERVAL		(100)		//!< Default time data is buffered for, in milliseconds.
+#define EXFILE_ASYNC_MAX_PENDING	(1024 * 1024)	//!< Default amount of data buffered before writers block.
+
 exfile_t	*exfile_init(TALLOC_CTX *ctx, uint32_t entries, uint32_t idle, bool locking);
 
 void		exfile_enable_triggers(exfile_t *ef, CONF_SECTION *cs, char const *trigger_prefix,
@@ -47,6 +52,11 @@ int		exfile_close(exfile_t *lf, REQUEST *request, int fd);
 
 int		exfile_unlock(exfile_t *lf, REQUEST *request, int fd);
 
+int		exfile_async_enable(exfile_t *ef, uint32_t interval, size_t max_pending, bool sync);
+
+int		exfile_write(exfile_t *ef, REQUEST *request, char const *filename, mode_t permissions, gid_t gid,
+			     struct iovec const *vector, int vector_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -111,6 +111,10 @@ extern fr_log_t default_log;
 
 int	fr_log_init(fr_log_t *log, bool daemonize);
 
+int	fr_log_async_start(void);
+
+void	fr_log_async_stop(void);
+
 int	fr_vlog(fr_log_t const *log, log_type_t lvl, char const *fmt, va_list ap)
 	CC_HINT(format (printf, 3, 0)) CC_HINT(nonnull (1,3));
 int	fr_log(fr_log_t const *log, log_type_t lvl, char const *fmt, ...)
@@ -35,9 +35,11 @@ typedef int (*fr_heap_cmp_t)(void const *, void const *);
 
 typedef struct fr_heap_t fr_heap_t;
 fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset);
+fr_heap_t *fr_heap_create_arity(fr_heap_cmp_t cmp, size_t offset, unsigned int arity);
 void fr_heap_delete(fr_heap_t *hp);
 
 int fr_heap_insert(fr_heap_t *hp, void *data);
+int fr_heap_insert_bulk(fr_heap_t *hp, void **data, size_t num);
 int fr_heap_extract(fr_heap_t *hp, void *data);
 void *fr_heap_pop(fr_heap_t *hp) CC_HINT(nonnull);
 void *fr_heap_peek(fr_heap_t *hp);
@@ -133,9 +133,24 @@ typedef struct {
 	fr_cond_t		*cond;		//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF.
 
 	map_proc_inst_t		*proc_inst;	//!< Instantiation data for #UNLANG_TYPE_MAP.
+	bool			parallel_any;	//!< #UNLANG_TYPE_PARALLEL resumes when the first child
+						//!< finishes, instead of waiting for all of them.
+	fr_hash_table_t		*cases;		//!< #UNLANG_TYPE_SWITCH, case values to case statements.
+						//!< NULL if the cases have to be checked one by one.
+	bool			static_update;	//!< #UNLANG_TYPE_UPDATE, all of the maps are static, and
+						//!< can be applied in a single pass.
 	bool			done_pass2;
 } unlang_group_t;
 
+/** The value of a 'case' statement, as stored in a switch hash table
+ *
+ */
+typedef struct {
+	value_box_t const	*value;		//!< Pre-parsed value of the case statement.
+	unlang_t		*instruction;	//!< The case statement.
+	int			index;		//!< Position of the case statement in the switch section.
+} unlang_switch_case_t;
+
 /** A call to a module method
  *
  */
@@ -143,6 +158,7 @@ typedef struct {
 	unlang_t		self;
 	module_instance_t	*module_instance;	//!< Instance of the module we're calling.
 	module_method_t		method;
+	rlm_components_t	component;		//!< Which method we're calling, for statistics.
 } unlang_module_call_t;
 
 /** Pushed onto the interpreter stack by a yielding module, indicates the resumption point
@@ -170,6 +186,8 @@ typedef struct {
 						//!< be called when the request is poked via an action
 	void const		*ctx;		//!< Context data for the callback.  Usually represents
 						//!< the module's internal state at the time of yielding.
+	struct timeval		start;		//!< When the module was called, for statistics.
+	int			trace_span;	//!< Span recording the module call, or -1.
 } unlang_resumption_t;
 
 /** A naked xlat
@@ -207,6 +225,15 @@ typedef struct {
 	unlang_t		*found;
 } unlang_stack_entry_redundant_t;
 
+typedef struct unlang_parallel_t unlang_parallel_t;
+
+/** State of a parallel section
+ *
+ */
+typedef struct {
+	unlang_parallel_t	*state;		//!< Children, and their results so far.
+} unlang_stack_entry_parallel_t;
+
 /** Our interpreter stack, as distinct from the C stack
  *
  * We don't call the modules recursively.  Instead we iterate over a list of unlang_t and
@@ -234,6 +261,7 @@ typedef struct {
 		unlang_stack_entry_modcall_t	modcall;
 		unlang_stack_entry_foreach_t	foreach;
 		unlang_stack_entry_redundant_t	redundant;
+		unlang_stack_entry_parallel_t	parallel;
 	};
 } unlang_stack_frame_t;
 
@@ -0,0 +1,109 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_JOB_POOL_H
+#define _FR_JOB_POOL_H
+/**
+ * $Id$
+ *
+ * @file include/job_pool.h
+ * @brief Run blocking work in a pool of threads, and resume requests when it completes.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSIDH(job_pool_h, "$Id$")
+
+#include <freeradius-devel/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_job_pool fr_job_pool_t;
+typedef struct fr_job_return fr_job_return_t;
+typedef struct fr_job fr_job_t;
+
+/** Create the state a pool thread runs its jobs with, e.g. a library context
+ *
+ * Called from the thread creating the pool, once for each pool thread.
+ *
+ * @param[in] ctx	to allocate the state in.
+ * @param[in] uctx	passed to #fr_job_pool_alloc.
+ * @return
+ *	- The state of the thread.
+ *	- NULL on error.
+ */
+typedef void *(*fr_job_thread_alloc_t)(TALLOC_CTX *ctx, void *uctx);
+
+/** Free state created by #fr_job_thread_alloc_t
+ *
+ * @param[in] thread	state of the thread.
+ * @param[in] uctx	passed to #fr_job_pool_alloc.
+ */
+typedef void (*fr_job_thread_free_t)(void *thread, void *uctx);
+
+/** Run a job in a pool thread
+ *
+ * Must only use the job data, not the request.
+ *
+ * @param[in] thread	state of the pool thread, or NULL if there's no #fr_job_thread_alloc_t.
+ * @param[in] data	passed to #fr_job_send.
+ * @param[in] uctx	passed to #fr_job_pool_alloc.
+ */
+typedef void (*fr_job_run_t)(void *thread, void *data, void *uctx);
+
+/** Fill in the result of a job which will never be run, because the pool is being freed
+ *
+ * @param[in] data	passed to #fr_job_send.
+ * @param[in] uctx	passed to #fr_job_pool_alloc.
+ */
+typedef void (*fr_job_fail_t)(void *data, void *uctx);
+
+/** Mark the request of a completed job as runnable again
+ *
+ * The pool can't call the interpreter directly, so modules pass unlang_resumable().
+ *
+ * @param[in] request	whose job has completed.
+ */
+typedef void (*fr_job_wake_t)(REQUEST *request);
+
+fr_job_pool_t		*fr_job_pool_alloc(TALLOC_CTX *ctx, char const *name, uint32_t num_threads,
+					   fr_job_run_t run, fr_job_fail_t fail,
+					   fr_job_thread_alloc_t thread_alloc, fr_job_thread_free_t thread_free,
+					   void *uctx);
+
+void			fr_job_pool_free(fr_job_pool_t *pool);
+
+fr_job_return_t		*fr_job_return_alloc(fr_job_pool_t *pool, fr_event_list_t *el, fr_job_wake_t wake);
+
+void			fr_job_return_free(fr_job_return_t *r);
+
+void			fr_job_return_detach(fr_job_return_t *r);
+
+fr_job_t		*fr_job_alloc(fr_job_return_t *r, REQUEST *request);
+
+void			fr_job_send(fr_job_pool_t *pool, fr_job_t *job, void *data);
+
+void			*fr_job_data(fr_job_t *job);
+
+void			fr_job_cancel(fr_job_t *job);
+
+void			fr_job_cancel_wait(fr_job_t *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_JOB_POOL_H */
@@ -73,6 +73,7 @@ RCSIDH(libradius_h, "$Id$")
 #include <freeradius-devel/dict.h>
 #include <freeradius-devel/pair.h>
 #include <freeradius-devel/proto.h>
+#include <freeradius-devel/sbuff.h>
 #include <freeradius-devel/conf.h>
 #include <freeradius-devel/radpaths.h>
 #include <freeradius-devel/rbtree.h>
@@ -124,6 +125,8 @@ typedef void (*sig_t)(int);
  *
  *	data,data_len:	Used between fr_radius_recv and fr_radius_decode.
  */
+typedef struct fr_radius_lazy_t fr_radius_lazy_t;
+
 typedef struct radius_packet {
 	int			sockfd;			//!< Socket this packet was read from.
 	int			if_index;		//!< Index of receiving interface.
@@ -142,6 +145,7 @@ typedef struct radius_packet {
 	uint8_t			*data;			//!< Packet data (body).
 	size_t			data_len;		//!< Length of packet data.
 	VALUE_PAIR		*vps;			//!< Result of decoding the packet into VALUE_PAIRs.
+	fr_radius_lazy_t	*lazy;			//!< Attributes which haven't been decoded yet.
 	ssize_t			offset;
 
 	uint32_t       		rounds;			//!< for State[0]
@@ -225,12 +229,25 @@ RADIUS_PACKET	*fr_radius_recv(TALLOC_CTX *ctx, int fd, int flags, bool require_m
 ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code);
 
 int		fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
+int		fr_radius_verify_multi(RADIUS_PACKET **packets, RADIUS_PACKET **originals,
+				       char const **secrets, int *rcodes, int num);
 
 int		fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
+int		fr_radius_decode_lazy(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
+int		fr_radius_decode_pending(RADIUS_PACKET *packet);
+VALUE_PAIR	*fr_radius_pair_find_by_da(RADIUS_PACKET *packet, fr_dict_attr_t const *da, int8_t tag);
+
+typedef struct fr_radius_encode_plan_t fr_radius_encode_plan_t;
 
 int		fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
+int		fr_radius_encode_proxy(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+				       char const *original_secret, char const *secret);
+int		fr_radius_encode_plan(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret,
+				      fr_radius_encode_plan_t *plan);
 
 int		fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
+int		fr_radius_sign_multi(RADIUS_PACKET **packets, RADIUS_PACKET const **originals,
+				     char const **secrets, int *rcodes, int num);
 
 int		fr_radius_digest_cmp(uint8_t const *a, uint8_t const *b, size_t length);
 
@@ -238,11 +255,14 @@ RADIUS_PACKET	*fr_radius_alloc(TALLOC_CTX *ctx, bool new_vector);
 RADIUS_PACKET	*fr_radius_alloc_reply(TALLOC_CTX *ctx, RADIUS_PACKET *);
 RADIUS_PACKET	*fr_radius_copy(TALLOC_CTX *ctx, RADIUS_PACKET const *in);
 void		fr_radius_free(RADIUS_PACKET **);
+uint8_t		*fr_radius_data_alloc(RADIUS_PACKET *packet, size_t len);
 
 typedef struct fr_radius_ctx {
 	RADIUS_PACKET const	*packet;
 	RADIUS_PACKET const	*original;
 	char const		*secret;
+	bool			borrow_octets;	//!< Point large "octets" values into packet->data.
+	fr_radius_encode_plan_t	*plan;		//!< Pre-computed attribute headers, may be NULL.
 } fr_radius_ctx_t;
 
 /*
@@ -258,6 +278,8 @@ ssize_t		fr_radius_encode_value_hton(uint8_t *out, size_t outlen, VALUE_PAIR con
 
 int		fr_radius_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor, void *encoder_ctx);
 
+fr_radius_encode_plan_t *fr_radius_encode_plan_alloc(TALLOC_CTX *ctx);
+
 /*
  *	radius_decode.c
  */
@@ -266,6 +288,7 @@ int		fr_radius_decode_tlv_ok(uint8_t const *data, size_t length, size_t dv_type,
 ssize_t		fr_radius_decode_password(char *encpw, size_t len, char const *secret, uint8_t const *vector);
 
 extern bool fr_tunnel_password_zeros; /* security check */
+extern bool fr_radius_borrow_octets; /* don't copy large octets values */
 
 ssize_t		fr_radius_decode_tunnel_password(uint8_t *encpw, size_t *len, char const *secret,
 						 uint8_t const *vector);
@@ -344,6 +367,7 @@ int		value_box_steal(TALLOC_CTX *ctx, value_box_t *dst, value_box_t const *src);
 char		*value_box_asprint(TALLOC_CTX *ctx, value_box_t const *data, char quote);
 
 extern uint32_t	fr_max_attributes; /* per incoming packet */
+extern bool	fr_radius_ok_index; /* fr_radius_ok() indexes attributes for lazy decoding */
 #define	FR_MAX_PACKET_CODE (52)
 extern char const *fr_packet_codes[FR_MAX_PACKET_CODE];
 #define is_radius_code(_x) ((_x > 0) && (_x < FR_MAX_PACKET_CODE))
@@ -424,6 +448,7 @@ typedef struct fr_randctx {
 void		fr_isaac(fr_randctx *ctx);
 void		fr_randinit(fr_randctx *ctx, int flag);
 uint32_t	fr_rand(void);	/* like rand(), but better. */
+void		fr_rand_buffer(void *start, size_t length);
 void		fr_rand_seed(void const *, size_t ); /* seed the random pool */
 
 
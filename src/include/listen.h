@@ -52,12 +52,17 @@ typedef enum RAD_LISTEN_TYPE {
 typedef enum RAD_LISTEN_STATUS {
 	RAD_LISTEN_STATUS_INIT = 0,
 	RAD_LISTEN_STATUS_KNOWN,
+	RAD_LISTEN_STATUS_PAUSE,		//!< Being used by another thread, don't read from it.
+	RAD_LISTEN_STATUS_RESUME,		//!< Start reading from it again.
 	RAD_LISTEN_STATUS_FROZEN,
 	RAD_LISTEN_STATUS_EOL,
 	RAD_LISTEN_STATUS_REMOVE_NOW
 } RAD_LISTEN_STATUS;
 
 typedef struct rad_listen rad_listen_t;
+
+typedef struct request_dup_hash request_dup_hash_t;
+typedef struct listen_status_reply listen_status_reply_t;
 typedef struct rad_protocol_t rad_protocol_t;
 
 typedef int (*rad_listen_recv_t)(rad_listen_t *);
@@ -67,6 +72,7 @@ typedef int (*rad_listen_print_t)(rad_listen_t const *, char *, size_t);
 typedef void (*rad_listen_debug_t)(REQUEST *, RADIUS_PACKET *, bool received);
 typedef int (*rad_listen_encode_t)(rad_listen_t *, REQUEST *);
 typedef int (*rad_listen_decode_t)(rad_listen_t *, REQUEST *);
+typedef uint32_t (*rad_listen_affinity_t)(rad_listen_t const *, RADIUS_PACKET const *);
 
 struct rad_listen {
 	rad_listen_t		*next; /* should be rbtree stuff */
@@ -89,6 +95,8 @@ struct rad_listen {
 	rad_listen_t		*parent;
 #endif
 	bool			nodup;
+	uint32_t		num_sockets;	//!< Number of UDP sockets sharing this address
+						//!< and port via SO_REUSEPORT.
 
 #ifdef WITH_TLS
 	fr_tls_conf_t	*tls;
@@ -101,6 +109,8 @@ struct rad_listen {
 	rad_listen_decode_t	decode;
 	rad_listen_debug_t	debug;
 	rad_listen_print_t	print;
+	rad_listen_affinity_t	affinity;	//!< Picks the worker thread for a request, or NULL
+						//!< to use the least busy one.
 
 	/*
 	 *	Events associated with this listener
@@ -112,7 +122,7 @@ struct rad_listen {
 	void			*data;
 
 #ifdef WITH_STATS
-	fr_stats_t		stats;
+	fr_stats_block_t	stats;
 #endif
 };
 
@@ -143,6 +153,8 @@ typedef struct listen_socket_t {
 	uint32_t		rate_pps_old;
 	uint32_t		rate_pps_now;
 	uint32_t		max_rate;
+	bool			client_filter;	//!< Attach a socket filter which drops packets
+						//!< from addresses which aren't clients.
 
 	/* for outgoing sockets */
 	home_server_t		*home;
@@ -155,8 +167,17 @@ typedef struct listen_socket_t {
 	uint32_t		recv_buff;	//!< Socket receive buffer size we only allow
 						//!< configuration of SO_RCVBUF, as SO_SNDBUF
 						//!< controls the maximum datagram size.
+	uint32_t		recv_buff_max;	//!< Grow SO_RCVBUF up to this size when the
+						//!< kernel drops packets.  0 means don't grow it.
+	uint32_t		recv_buff_now;	//!< Current size of SO_RCVBUF.
+
+	uint32_t		drops_last;	//!< Last value of the kernel's drop counter.
+	uint64_t		drops;		//!< Packets the kernel has dropped on this socket.
+	time_t			drops_checked;	//!< When we last read the drop counter.
 
-	rbtree_t		*dup_tree;	//!< only for auth packets
+	request_dup_hash_t	*dup_hash;	//!< only for auth packets
+
+	listen_status_reply_t	*status_reply;	//!< Cached reply to Status-Server.
 
 #ifdef WITH_TCP
 	/* for a proxy connecting to home servers */
@@ -166,8 +187,17 @@ typedef struct listen_socket_t {
 	fr_socket_limit_t	limit;
 	struct listen_socket_t	*parent;
 	RADCLIENT		*client;
+	bool			metrics;	//!< Control sockets only.  Answer HTTP requests
+						//!< for /metrics.
 
 	RADIUS_PACKET  	 	*packet; /* for reading partial packets */
+
+	/* for batching writes to home servers */
+	pthread_mutex_t		write_mutex;	//!< Protects the write queue.
+	bool			writing;	//!< A thread is writing the queue to the socket.
+	uint8_t			*write_queue;	//!< Packets waiting to be written.
+	uint8_t			*write_spare;	//!< Being written, swapped with write_queue.
+	size_t			write_queued;	//!< How much data is in write_queue.
 #endif
 
 #ifdef WITH_TLS
@@ -187,7 +217,15 @@ int listen_compile(CONF_SECTION *server_cs, CONF_SECTION *listen_cs);
 void listen_free(rad_listen_t **head);
 int listen_init(rad_listen_t **head, bool spawn_flag);
 rad_listen_t *proxy_new_listener(TALLOC_CTX *ctx, home_server_t *home, uint16_t src_port);
+#ifdef WITH_TCP
+typedef ssize_t (*listen_write_t)(rad_listen_t *listener, uint8_t const *data, size_t data_len);
+
+int listen_write_batched(rad_listen_t *listener, uint8_t const *data, size_t data_len, listen_write_t write_fn);
+#endif
 RADCLIENT *client_listener_find(rad_listen_t *listener, fr_ipaddr_t const *ipaddr, uint16_t src_port);
+void listen_client_filter_update(void);
+uint32_t listen_socket_drops(rad_listen_t *this, time_t now);
+void listen_status_reply_update(REQUEST *request);
 
 #ifdef __cplusplus
 }
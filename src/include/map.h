@@ -95,6 +95,10 @@ int		map_to_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 int		map_to_request(REQUEST *request, vp_map_t const *map,
 			       radius_map_getvalue_t func, void *ctx);
 
+bool		map_list_is_static(vp_map_t const *head);
+
+int		map_list_static_to_request(REQUEST *request, vp_map_t const *head);
+
 bool		map_dst_valid(REQUEST *request, vp_map_t const *map);
 
 size_t		map_snprint(char *out, size_t outlen, vp_map_t const *map);
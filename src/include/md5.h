@@ -78,7 +78,20 @@ USES_APPLE_DEPRECATED_API
 #  define fr_md5_copy(_out, _in)	memcpy(_out, _in, sizeof(*_out))
 #endif
 
+/** MD5 states for a shared secret, which can be re-used for many packets
+ *
+ */
+typedef struct fr_md5_secret_t {
+	FR_MD5_CTX	prefix;				//!< State after MD5(secret ...
+	FR_MD5_CTX	inner;				//!< HMAC-MD5 state after the inner pad.
+	FR_MD5_CTX	outer;				//!< HMAC-MD5 state after the outer pad.
+} fr_md5_secret_t;
+
 /* hmac.c */
+void	fr_md5_secret_init(fr_md5_secret_t *ms, uint8_t const *key, size_t key_len);
+void	fr_hmac_md5_secret(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			   fr_md5_secret_t const *ms)
+	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
 void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		    uint8_t const *key, size_t key_len)
 	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
@@ -86,6 +99,22 @@ void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
 
+/** One message for fr_md5_calc_multi()
+ *
+ */
+typedef struct fr_md5_job_t {
+	uint8_t const	*in;				//!< Data to hash.
+	size_t		inlen;				//!< Length of the data.
+	uint8_t const	*suffix;			//!< Hashed after the data, e.g. a shared secret.
+	size_t		suffix_len;			//!< Length of the suffix.
+	uint8_t		out[MD5_DIGEST_LENGTH];		//!< Where the digest is written.
+} fr_md5_job_t;
+
+void	fr_md5_calc_multi(fr_md5_job_t *jobs, int num);
+
+/* radius.c */
+fr_md5_secret_t const *fr_radius_secret_md5(char const *secret);
+
 #ifdef __cplusplus
 }
 #endif
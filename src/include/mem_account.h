@@ -0,0 +1,59 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_MEM_ACCOUNT_H
+#define _FR_MEM_ACCOUNT_H
+/**
+ * $Id$
+ *
+ * @file include/mem_account.h
+ * @brief Memory accounting for modules and subsystems.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSIDH(mem_account_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mem_account mem_account_t;
+
+/** A copy of the counters of one account
+ *
+ */
+typedef struct {
+	char const		*type;		//!< Of module or subsystem, e.g. "module" or "state".
+	char const		*name;		//!< Of the instance.
+	uint64_t		bytes;		//!< Memory in use.
+	uint64_t		objects;	//!< Objects (entries, sessions, etc.) in use.
+	uint64_t		limit;		//!< Soft limit on bytes, 0 if there's no limit.
+} mem_account_stats_t;
+
+mem_account_t		*mem_account_alloc(TALLOC_CTX *ctx, char const *type, char const *name, size_t limit);
+
+void			mem_account_add(mem_account_t *acct, int64_t bytes, int64_t objects);
+
+uint64_t		mem_account_bytes(mem_account_t const *acct);
+
+bool			mem_account_over(mem_account_t const *acct, size_t bytes);
+
+mem_account_stats_t	*mem_account_snapshot(TALLOC_CTX *ctx, size_t *num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_MEM_ACCOUNT_H */
@@ -28,11 +28,29 @@ RCSIDH(modpriv_h, "$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/mem_account.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define MODULE_STATS_BUCKETS	(24)		//!< Latency buckets.  Bucket N counts calls which took
+						//!< less than 2^N microseconds, the last bucket counts
+						//!< everything else.
+
+/** Statistics for one method of a module instance
+ *
+ * Updated by every worker, so all fields are updated and read atomically.
+ */
+typedef struct {
+	uint64_t			calls;		//!< Calls which have completed.
+	uint64_t			yields;		//!< Calls which yielded at least once.
+	uint64_t			rcodes[RLM_MODULE_NUMCODES];	//!< Results of completed calls.
+	uint64_t			usec;		//!< Total latency of completed calls, including the time
+							//!< spent waiting after yielding.
+	uint64_t			latency[MODULE_STATS_BUCKETS];	//!< Latency histogram.
+} module_method_stats_t;
+
 /** Per instance data
  *
  * Per-instance data structure, to correlate the modules with the
@@ -58,6 +76,14 @@ typedef struct {
 
 	rlm_rcode_t			code;		//!< Code module will return when 'force' has
 							//!< has been set to true.
+
+	vp_map_t			*force_maps;	//!< Updates applied to the request when 'force'
+							//!< has been set to true.  Used to stub out backends.
+
+	module_method_stats_t		stats[MOD_COUNT];	//!< Per method call statistics.
+
+	mem_account_t			*mem;		//!< Memory used by the instance data, and the
+							//!< thread specific instance data of every thread.
 } module_instance_t;
 
 /** Per thread per instance data
@@ -68,6 +94,7 @@ typedef struct {
 	module_instance_t		*inst;		//!< Non-thread local instance of this
 
 	void				*data;		//!< Thread specific instance data.
+	size_t				mem_size;	//!< What we added to the module's memory account.
 } module_thread_instance_t;
 
 module_instance_t	*module_find_with_method(rlm_components_t *method,
@@ -76,6 +103,12 @@ module_instance_t	*module_find(CONF_SECTION *modules, char const *asked_name);
 int			module_sibling_section_find(CONF_SECTION **out, CONF_SECTION *module, char const *name);
 int			unlang_fixup_update(vp_map_t *map, void *ctx);
 
+void			module_stats_yield(module_instance_t *mi, rlm_components_t method);
+void			module_stats_done(module_instance_t *mi, rlm_components_t method,
+					  rlm_rcode_t rcode, struct timeval const *start);
+void			module_stats_get(module_method_stats_t *out, module_instance_t const *mi, int method);
+uint64_t		module_stats_percentile(module_method_stats_t const *stats, unsigned int percent);
+
 #ifdef __cplusplus
 }
 #endif
@@ -79,6 +79,9 @@ extern const section_type_value_t section_type_value[];
 						//!< Server will protect calls
 						//!< with mutex.
 #define RLM_TYPE_RESUMABLE     	(1 << 2) 	//!< does yield / resume
+#define RLM_TYPE_PARALLEL_INSTANTIATE (1 << 3)	//!< instantiate only touches the module's own
+						//!< instance data, so may be called at the same
+						//!< time as other modules' instantiate methods.
 
 /** Module section callback
  *
@@ -184,6 +187,29 @@ int		modules_bootstrap(CONF_SECTION *root) CC_HINT(nonnull);
 int		modules_free(void);
 int		module_instance_read_only(TALLOC_CTX *ctx, char const *name);
 
+/*
+ *	Reload module data when the files it was built from change
+ */
+typedef struct module_reload module_reload_t;
+
+/** Build a new version of a module's data
+ *
+ * @param[in] ctx	to allocate the data in.  Freed when the version is no longer in use.
+ * @param[out] out	Where to write the new data.
+ * @param[in] instance	passed to #module_reload_alloc.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int (*module_reload_load_t)(TALLOC_CTX *ctx, void **out, void const *instance);
+
+module_reload_t	*module_reload_alloc(TALLOC_CTX *ctx, char const *name, void const *instance,
+				     module_reload_load_t load, uint32_t interval);
+int		module_reload_watch(module_reload_t *mr, char const *filename);
+int		module_reload_start(module_reload_t *mr);
+void		*module_reload_current(module_reload_t const *mr);
+int		module_reload_now(module_reload_t *mr);
+
 /*
  *	Call various module sections
  */
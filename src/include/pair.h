@@ -146,6 +146,12 @@ typedef struct value_pair {
 
 	value_type_t		type;				//!< Type of pointer in value union.
 	value_box_t		data;
+
+	void			*borrowed;			//!< If set, vp_octets points into a buffer owned by
+								//!< something else, and this holds a reference to it.
+
+	bool			cached;				//!< A lookup cache may hold a pointer to this pair.
+								//!< See #fr_pair_list_changed.
 } VALUE_PAIR;
 
 /** Abstraction to allow iterating over different configurations of VALUE_PAIRs
@@ -156,12 +162,15 @@ typedef struct value_pair {
  * Field within a vp_cursor should not be accessed directly, and vp_cursors should only be
  * manipulated with the pair* functions.
  */
+typedef struct fr_pair_index_t fr_pair_index_t;
+
 typedef struct vp_cursor {
 	VALUE_PAIR	**first;
 	VALUE_PAIR	*found;					//!< pairfind marker.
 	VALUE_PAIR	*last;					//!< Temporary only used for fr_pair_cursor_append
 	VALUE_PAIR	*current;				//!< The current attribute.
 	VALUE_PAIR	*next;					//!< Next attribute to process.
+	fr_pair_index_t	*index;					//!< Updated when pairs are added or removed.
 } vp_cursor_t;
 
 /** A VALUE_PAIR in string format.
@@ -252,6 +261,23 @@ int		fr_pair_update_by_num(TALLOC_CTX *ctx, VALUE_PAIR **list,
 
 void		fr_pair_delete_by_num(VALUE_PAIR **head, unsigned int vendor, unsigned int attr, int8_t tag);
 
+/* Indexing */
+void		fr_pair_list_changed(void);
+
+uint64_t	fr_pair_list_generation(void);
+
+fr_pair_index_t	*fr_pair_index_alloc(TALLOC_CTX *ctx, VALUE_PAIR **head);
+
+void		fr_pair_index_rebuild(fr_pair_index_t *index);
+
+VALUE_PAIR	*fr_pair_index_find(fr_pair_index_t *index, fr_dict_attr_t const *da, int8_t tag);
+
+VALUE_PAIR	*fr_pair_index_cursor_init(vp_cursor_t *cursor, fr_pair_index_t *index);
+
+void		fr_pair_index_inserted(fr_pair_index_t *index, VALUE_PAIR *vp, bool at_end);
+
+void		fr_pair_index_removed(fr_pair_index_t *index, VALUE_PAIR *vp);
+
 /* Sorting */
 typedef		int8_t (*fr_cmp_t)(void const *a, void const *b);
 
@@ -290,6 +316,8 @@ void		fr_pair_list_mcopy_by_num(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **f
 int		fr_pair_value_from_str(VALUE_PAIR *vp, char const *value, size_t len);
 void		fr_pair_value_memcpy(VALUE_PAIR *vp, uint8_t const *src, size_t len);
 void		fr_pair_value_memsteal(VALUE_PAIR *vp, uint8_t const *src);
+int		fr_pair_value_memborrow(VALUE_PAIR *vp, uint8_t const *src, size_t len, void const *buffer);
+int		fr_pair_value_unborrow(VALUE_PAIR *vp);
 void		fr_pair_value_strsteal(VALUE_PAIR *vp, char const *src);
 void		fr_pair_value_strnsteal(VALUE_PAIR *vp, char *src, size_t len);
 void		fr_pair_value_strcpy(VALUE_PAIR *vp, char const *src);
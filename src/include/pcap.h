@@ -86,6 +86,10 @@ struct fr_pcap {
 	int			buffer_pkts;			//!< How big to make the PCAP ring buffer.
 								//!< Actual buffer size is SNAPLEN * buffer.
 								//!< Only valid for live capture handles.
+	bool			fanout;				//!< Join a PACKET_FANOUT group, so packets are
+								//!< spread over several handles by flow hash.
+								//!< Only valid for live capture handles on Linux.
+	uint16_t		fanout_id;			//!< The fanout group to join.
 
 	pcap_t			*handle;			//!< libpcap handle.
 	pcap_dumper_t		*dumper;			//!< libpcap dumper handle.
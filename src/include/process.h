@@ -72,7 +72,19 @@ bool request_thread_active(REQUEST *request);
 void request_delete(REQUEST *request);
 void request_free(REQUEST *request);
 void request_thread_done(REQUEST *request);
-bool request_dup_received(rad_listen_t *listener, rbtree_t *dup_tree, RADCLIENT *client, RADIUS_PACKET *packet);
+
+/*
+ *	Duplicate detection.
+ */
+typedef int (*request_dup_walk_t)(void *ctx, REQUEST *request);
+
+request_dup_hash_t *request_dup_hash_alloc(TALLOC_CTX *ctx, bool lock);
+bool request_dup_hash_insert(request_dup_hash_t *dh, REQUEST *request);
+bool request_dup_hash_remove(request_dup_hash_t *dh, REQUEST *request);
+REQUEST *request_dup_hash_find(request_dup_hash_t *dh, RADIUS_PACKET const *packet);
+uint32_t request_dup_hash_num_elements(request_dup_hash_t *dh);
+int request_dup_hash_walk(request_dup_hash_t *dh, request_dup_walk_t walker, void *ctx);
+bool request_dup_received(rad_listen_t *listener, request_dup_hash_t *dh, RADCLIENT *client, RADIUS_PACKET *packet);
 
 
 #ifdef __cplusplus
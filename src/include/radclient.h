@@ -63,6 +63,15 @@ typedef struct rc_file_pair {
 					//!< packet we want to match.
 } rc_file_pair_t;
 
+/** Requests outstanding to one destination
+ *
+ */
+typedef struct rc_dst {
+	fr_ipaddr_t	ipaddr;		//!< Where the requests are sent.
+	uint16_t	port;
+	int		outstanding;	//!< Requests which have been sent, and are waiting for a reply.
+} rc_dst_t;
+
 typedef struct rc_request rc_request_t;
 
 struct rc_request {
@@ -81,6 +90,10 @@ struct rc_request {
 	VALUE_PAIR	*filter;	//!< If the reply passes the filter, then the request passes.
 	PW_CODE		filter_code;	//!< Expected code of the response packet.
 
+	rc_dst_t	*dst;		//!< Destination, if the number of outstanding requests
+					//!< to each destination is limited.
+	bool		outstanding;	//!< Whether the request is counted in dst->outstanding.
+
 	int		resend;
 	int		tries;
 	bool		done;		//!< Whether the request is complete.
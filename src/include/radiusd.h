@@ -111,6 +111,7 @@ typedef struct main_config {
 	bool		log_auth;			//!< Log authentication attempts.
 	bool		log_auth_badpass;		//!< Log successful authentications.
 	bool		log_auth_goodpass;		//!< Log failed authentications.
+	bool		log_async;			//!< Write log messages from a separate thread.
 	char const	*auth_badpass_msg;		//!< Additional text to append to successful auth messages.
 	char const	*auth_goodpass_msg;		//!< Additional text to append to failed auth messages.
 
@@ -126,6 +127,10 @@ typedef struct main_config {
 #endif
 	struct timeval	reject_delay;			//!< How long to wait before sending an Access-Reject.
 	bool		status_server;			//!< Whether to respond to status-server messages.
+	uint32_t	status_server_cache;		//!< How long the reply to Status-Server is re-used for,
+							//!< without running the virtual server.  0 to disable.
+	bool		status_server_overload;		//!< Don't respond to Status-Server while the kernel
+							//!< is dropping packets.
 
 
 	uint32_t	max_request_time;		//!< How long a request can be processed for before
@@ -183,6 +188,9 @@ typedef struct main_config {
 
 	size_t		talloc_memory_limit;		//!< Limit the amount of talloced memory the server uses.
 							//!< Only applicable in single threaded mode.
+
+	uint32_t	trace_sample_rate;		//!< Trace one in this many requests, 0 to disable.
+	uint32_t	trace_buffer_size;		//!< How many traces to keep for radmin.
 } main_config_t;
 
 #ifdef WITH_VERIFY_PTR
@@ -225,38 +233,74 @@ typedef enum fr_request_state_t {
 } fr_request_state_t;
 
 struct rad_request {
+	/*
+	 *	Hot fields.  These are touched on every module call,
+	 *	interpreter step, or log message, so are kept together
+	 *	at the start of the struct to share as few cache lines
+	 *	as possible.
+	 */
 #ifndef NDEBUG
 	uint32_t		magic; 		//!< Magic number used to detect memory corruption,
 						//!< or request structs that have not been properly initialised.
 #endif
+	rlm_rcode_t		rcode;		//!< Last rcode returned by a module
 	uint64_t		number; 	//!< Monotonically increasing request number. Reset on server restart.
 
-	fr_event_list_t		*el;		//!< thread-specific event list.
-	fr_heap_t		*backlog;	//!< thread-specific backlog
-	fr_request_state_t	request_state;	//!< state for the various protocol handlers.
+	struct {
+		radlog_func_t	func;		//!< Function to call to output log messages about this
+						//!< request.
 
-	request_data_t		*data;		//!< Request metadata.
+		log_lvl_t	lvl;		//!< Controls the verbosity of debug statements regarding
+						//!< the request.
 
-	RAD_LISTEN_TYPE		priority;
+		uint8_t		unlang_indent;	//!< By how much to indent log messages. uin8_t so it's obvious
+						//!< when a request has been exdented too much.
+		uint8_t		module_indent;	//!< Indentation after the module prefix name.
 
-	rad_listen_t		*listener;	//!< The listener that received the request.
-	RADCLIENT		*client;	//!< The client that originally sent us the request.
+		fr_log_t	*output;	//!< Output log destination.  Over-rides the global one.
+	} log;
 
 	RADIUS_PACKET		*packet;	//!< Incoming request.
-	VALUE_PAIR		*username;	//!< Cached username #VALUE_PAIR from request #RADIUS_PACKET.
-	VALUE_PAIR		*password;	//!< Cached password #VALUE_PAIR from request #RADIUS_PACKET.
-
 	RADIUS_PACKET		*reply;		//!< Outgoing response.
 
 	VALUE_PAIR		*control;	//!< #VALUE_PAIR (s) used to set per request parameters
 						//!< for modules and the server core at runtime.
+	VALUE_PAIR		*state;		//!< #VALUE_PAIR (s) available over the lifetime of the authentication
+						//!< attempt. Useful where the attempt involves a sequence of
+						//!< many request/challenge packets, like OTP, and EAP.
+	VALUE_PAIR		*username;	//!< Cached username #VALUE_PAIR from request #RADIUS_PACKET.
+	VALUE_PAIR		*password;	//!< Cached password #VALUE_PAIR from request #RADIUS_PACKET.
+
+	void			*stack;		//!< unlang interpreter stack.
+	struct tmpl_find_cache	*tmpl_cache;	//!< Recent results of tmpl_find_vp().
+	struct trace_t		*trace;		//!< Spans recorded for this request, if it was sampled.
+
+	char const		*server;	//!< name of the virtual server which is processing the request.
+	CONF_SECTION		*server_cs;	//!< virtual server which is processing the request.
+	char const		*component; 	//!< Section the request is in.
+	char const		*module;	//!< Module the request is currently being processed by.
+
+	fr_event_list_t		*el;		//!< thread-specific event list.
+	request_data_t		**data;		//!< Request metadata, hashed by unique_ptr and unique_int.
+						//!< Allocated when the first entry is added.
+	REQUEST			*parent;
+	RADCLIENT		*client;	//!< The client that originally sent us the request.
+	main_config_t		*root;		//!< Pointer to the main config hack to try and deal with hup.
+
+	/*
+	 *	Cold fields.  Used when the request is received,
+	 *	scheduled, proxied, or finished.
+	 */
+	fr_heap_t		*backlog;	//!< thread-specific backlog
+	fr_request_state_t	request_state;	//!< state for the various protocol handlers.
+
+	RAD_LISTEN_TYPE		priority;
+
+	rad_listen_t		*listener;	//!< The listener that received the request.
 
 	uint64_t		seq_start;	//!< State sequence ID.  Stable identifier for a sequence of requests
 						//!< and responses.
 	TALLOC_CTX		*state_ctx;	//!< for request->state
-	VALUE_PAIR		*state;		//!< #VALUE_PAIR (s) available over the lifetime of the authentication
-						//!< attempt. Useful where the attempt involves a sequence of
-						//!< many request/challenge packets, like OTP, and EAP.
 
 	rad_master_state_t	master_state;	//!< Set by the master thread to signal the child that's currently
 						//!< working with the request, to do something.
@@ -264,23 +308,14 @@ struct rad_request {
 
 	pthread_t    		child_pid;	//!< Current thread handling the request.
 	void			*thread_ctx;	//!< for request_queue_extract()
+	uint32_t		affinity;	//!< If non-zero, requests with the same affinity are
+						//!< always given to the same worker thread.
 
 	fr_request_process_t	process;	//!< The function to call to move the request through the state machine.
 
 	RAD_REQUEST_FUNP	handle;		//!< The function to call to move the request through the
 						//!< various server configuration sections.
 
-	rlm_rcode_t		rcode;		//!< Last rcode returned by a module
-	char const		*server;	//!< name of the virtual server which is processing the request.
-	CONF_SECTION		*server_cs;	//!< virtual server which is processing the request.
-
-	char const		*component; 	//!< Section the request is in.
-	char const		*module;	//!< Module the request is currently being processed by.
-
-	void			*stack;		//!< unlang interpreter stack.
-
-	REQUEST			*parent;
-
 #ifdef WITH_PROXY
 	REQUEST			*proxy;		//!< proxied packet
 
@@ -294,8 +329,6 @@ struct rad_request {
 	int			delay;		//!< incrementing delay for various timers
 	int			heap_id;	//!< entry in the queue / heap of incoming packets
 
-	main_config_t		*root;		//!< Pointer to the main config hack to try and deal with hup.
-
 	int			simul_max;	//!< Maximum number of concurrent sessions for this user.
 #ifdef WITH_SESSION_MGMT
 	int			simul_count;	//!< The current number of sessions for this user.
@@ -306,20 +339,8 @@ struct rad_request {
 #ifdef WITH_PROXY
 	bool			in_proxy_hash;
 #endif
-
-	struct {
-		radlog_func_t	func;		//!< Function to call to output log messages about this
-						//!< request.
-
-		log_lvl_t	lvl;		//!< Controls the verbosity of debug statements regarding
-						//!< the request.
-
-		uint8_t		unlang_indent;	//!< By how much to indent log messages. uin8_t so it's obvious
-						//!< when a request has been exdented too much.
-		uint8_t		module_indent;	//!< Indentation after the module prefix name.
-
-		fr_log_t	*output;	//!< Output log destination.  Over-rides the global one.
-	} log;
+	uint64_t		dup_fingerprint; //!< Of the packet tuple, for duplicate detection.
+	REQUEST			*dup_next;	//!< Next request in the same duplicate hash bucket.
 
 	uint32_t		options;	//!< mainly for proxying EAP-MSCHAPv2.
 
@@ -424,6 +445,7 @@ void		talloc_const_free(void const *ptr);
 char		*rad_ajoin(TALLOC_CTX *ctx, char const **argv, int argc, char c);
 REQUEST		*request_alloc(TALLOC_CTX *ctx);
 REQUEST		*request_alloc_fake(REQUEST *oldreq);
+REQUEST		*request_alloc_fake_ctx(TALLOC_CTX *ctx, REQUEST *oldreq);
 REQUEST		*request_alloc_coa(REQUEST *request);
 REQUEST		*request_alloc_proxy(REQUEST *request);
 int		request_data_add(REQUEST *request, void const *unique_ptr, int unique_int, void *opaque,
@@ -487,6 +509,9 @@ void	regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value,
 
 int	regex_request_to_sub(TALLOC_CTX *ctx, char **out, REQUEST *request, uint32_t num);
 
+int	regex_exec_request(REQUEST *request, regex_t *preg, char const *subject, size_t len,
+			   regmatch_t pmatch[], size_t *nmatch);
+
 /*
  *	Named capture groups only supported by PCRE.
  */
@@ -530,6 +555,9 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
 			REQUEST *request, char const *cmd, VALUE_PAIR *input_pairs,
 			bool exec_wait, bool shell_escape, int timeout) CC_HINT(nonnull (5, 6));
+int radius_exec_program_finish(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
+			       REQUEST *request, char const *cmd, pid_t pid, char *answer, size_t len)
+			       CC_HINT(nonnull (5, 6, 8));
 void trigger_exec_init(CONF_SECTION const *cs);
 int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, bool quench, VALUE_PAIR *args)
 		  CC_HINT(nonnull (3));
@@ -577,6 +605,9 @@ int radius_copy_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, char con
 int		thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers);
 int		thread_pool_init(void);
 void		thread_pool_stop(void);
+void		thread_pool_overloaded(time_t now);
+bool		thread_pool_limit_acct(time_t now);
+bool		thread_pool_is_overloaded(time_t now);
 
 /*
  *	In threads.c
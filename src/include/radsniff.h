@@ -28,6 +28,7 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/pcap.h>
@@ -44,6 +45,10 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_STATS_MERGE_DELAY	100000		//!< How many microseconds after the end of an interval we
+						//!< wait for capture threads to merge their stats.
+#define RS_MAX_THREADS		64		//!< Maximum number of capture threads.
+#define RS_LATENCY_BUCKETS	13		//!< Number of latency histogram buckets, see rs_latency_buckets.
 
 /*
  *	Logging macros
@@ -82,7 +87,8 @@ typedef enum {
 	RS_STATS_OUT_COLLECTD = 1,
 #endif
 	RS_STATS_OUT_STDIO_FANCY,
-	RS_STATS_OUT_STDIO_CSV
+	RS_STATS_OUT_STDIO_CSV,
+	RS_STATS_OUT_OPENMETRICS
 } stats_out_t;
 
 typedef struct rs rs_t;
@@ -130,7 +136,25 @@ typedef struct rs_latency {
 
 		double			latency_high;		//!< Latency high water mark.
 		double			latency_low;		//!< Latency low water mark.
+
+		uint64_t		latency_buckets[RS_LATENCY_BUCKETS];	//!< Latency histogram for
+										//!< the interval.
 	} interval;
+
+	/** Counters since we started, for exporting to systems which calculate their own rates
+	 *
+	 */
+	struct {
+		uint64_t		received;		//!< Total received.
+		uint64_t		linked;			//!< Total request/response pairs.
+		uint64_t		unlinked;		//!< Total unlinked.
+		uint64_t		reused;			//!< Total reused.
+		uint64_t		lost;			//!< Total lost.
+		uint64_t		rt[RS_RETRANSMIT_MAX + 1];	//!< Number of RTX until complete.
+
+		long double		latency_total;		//!< Total latency of linked packets.
+		uint64_t		latency_buckets[RS_LATENCY_BUCKETS];	//!< Latency histogram.
+	} total;
 } rs_latency_t;
 
 typedef struct rs_malformed {
@@ -218,6 +242,31 @@ typedef struct rs_event {
 	rs_stats_t		*stats;			//!< Where to write stats.
 } rs_event_t;
 
+/** A capture thread
+ *
+ * Each thread reads from its own set of capture handles, which are in the same fanout group
+ * as the handles of the other threads.  Requests are correlated with their responses using
+ * a request tree private to the thread, and the interval stats are merged into the global
+ * stats at the end of every interval.
+ */
+typedef struct rs_worker {
+	int			id;			//!< Thread number, used in log messages.
+	pthread_t		pthread_id;		//!< The thread.
+	bool			running;		//!< Whether the thread was started.
+
+	TALLOC_CTX		*ctx;			//!< Everything the thread allocates lives in here.
+	fr_event_list_t		*list;			//!< The thread's event list.
+	rbtree_t		*request_tree;		//!< Requests waiting for responses.
+	rbtree_t		*link_tree;		//!< Requests we're checking for retransmissions.
+
+	fr_pcap_t		*in;			//!< Capture handles the thread reads from.
+	rs_stats_t		*stats;			//!< Stats for the current interval.
+	rs_stats_t		*total;			//!< The global stats we merge into.
+	fr_event_timer_t	*merge_ev;		//!< When we next merge our stats.
+
+	int			pipe[2];		//!< Used to tell the thread to exit.
+} rs_worker_t;
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -286,6 +335,7 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	int			threads;		//!< Number of capture threads.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
 	struct {
@@ -293,6 +343,8 @@ struct rs {
 		stats_out_t		out;			//!< Where to write stats.
 		int			timeout;		//!< Maximum length of time we wait for a response.
 
+		char const		*metrics_file;		//!< Write OpenMetrics to this file.
+
 #ifdef HAVE_COLLECTDC_H
 		char const		*collectd;		//!< Collectd server/port/unixsocket
 		char const		*prefix;		//!< Prefix collectd stats with this value.
@@ -25,6 +25,7 @@
  */
 RCSIDH(rbtree_h, "$Id$")
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <talloc.h>
@@ -33,6 +34,19 @@ RCSIDH(rbtree_h, "$Id$")
 typedef struct rbtree_t rbtree_t;
 typedef struct rbnode_t rbnode_t;
 
+/** A node in the tree
+ *
+ *  This is only public so that it can be embedded in user data,
+ *  for rbtree_create_intrusive().  The fields are private to rbtree.c.
+ */
+struct rbnode_t {
+	rbnode_t		*left;		//!< Left child
+	rbnode_t		*right;		//!< Right child
+	rbnode_t		*parent;	//!< Parent
+	int			colour;		//!< Node colour (BLACK, RED)
+	void			*data;		//!< data stored in node
+};
+
 /* callback order for walking  */
 typedef enum {
 	RBTREE_PRE_ORDER,
@@ -44,12 +58,15 @@ typedef enum {
 #define RBTREE_FLAG_NONE    (0)
 #define RBTREE_FLAG_REPLACE (1 << 0)
 #define RBTREE_FLAG_LOCK    (1 << 1)
+#define RBTREE_FLAG_POOL    (1 << 2)
 
 typedef int (*rb_comparator_t)(void const *one, void const *two);
 typedef int (*rb_walker_t)(void *ctx, void *data);
 typedef void (*rb_free_t)(void *data);
 
 rbtree_t	*rbtree_create(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free, int flags);
+rbtree_t	*rbtree_create_intrusive(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free,
+					 size_t offset, int flags);
 void		rbtree_node_talloc_free(void *data);
 void		rbtree_free(rbtree_t *tree);
 bool		rbtree_insert(rbtree_t *tree, void *data);
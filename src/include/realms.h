@@ -106,6 +106,11 @@ typedef struct home_server {
 	uint32_t		max_outstanding;	//!< Maximum outstanding requests.
 	uint32_t		currently_outstanding;
 
+	uint32_t		rtt;			//!< Smoothed response time in microseconds,
+							//!< scaled by 2^HOME_RTT_SHIFT.  0 if unknown.
+	uint32_t		concurrency;		//!< Adaptive limit on outstanding requests,
+							//!< used by latency-balance pools.
+
 	time_t			last_packet_sent;
 	time_t			last_packet_recv;
 	time_t			last_failed_open;
@@ -143,7 +148,7 @@ typedef struct home_server {
 #ifdef WITH_STATS
 	int			number;
 
-	fr_stats_t		stats;
+	fr_stats_block_t	stats;
 
 	fr_stats_ema_t  	ema;
 #endif
@@ -156,9 +161,13 @@ typedef enum home_pool_type_t {
 	HOME_POOL_FAIL_OVER,
 	HOME_POOL_CLIENT_BALANCE,
 	HOME_POOL_CLIENT_PORT_BALANCE,
-	HOME_POOL_KEYED_BALANCE
+	HOME_POOL_KEYED_BALANCE,
+	HOME_POOL_LATENCY_BALANCE
 } home_pool_type_t;
 
+#define HOME_RTT_SHIFT		(3)	//!< Weight of a new response time sample is 1/8.
+#define HOME_CONCURRENCY_MIN	(8)	//!< Adaptive concurrency never drops below this.
+
 
 typedef struct home_pool_t {
 	char const		*name;
@@ -168,6 +177,8 @@ typedef struct home_pool_t {
 	CONF_SECTION		*cs;
 
 	char const		*virtual_server; /* for pre/post-proxy */
+	bool			transparent;	//!< Don't run pre/post-proxy, and forward the
+						//!< request as it was received.
 
 	home_server_t		*fallback;
 	int			in_fallback;
@@ -205,6 +216,8 @@ int		realm_realm_add( REALM *r, CONF_SECTION *cs);
 
 void		home_server_update_request(home_server_t *home, REQUEST *request);
 home_server_t	*home_server_ldb(char const *realmname, home_pool_t *pool, REQUEST *request);
+void		home_server_rtt_update(home_server_t *home, struct timeval const *sent, struct timeval const *received);
+void		home_server_rtt_timeout(home_server_t *home);
 home_server_t	*home_server_find(fr_ipaddr_t *ipaddr, uint16_t port, int proto);
 
 home_server_t	*home_server_afrom_cs(TALLOC_CTX *ctx, realm_config_t *rc, CONF_SECTION *cs);
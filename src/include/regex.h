@@ -54,7 +54,12 @@ typedef struct regex {
 
 	bool		jitd;		//!< Whether JIT data is available.
 	pcre_extra	*extra;		//!< Result of studying a regular expression.
+
+	struct regex_cache_entry *cached;	//!< Compile cache entry which owns this regex,
+						//!< NULL if it isn't cached.
 } regex_t;
+
+void	regex_cache_reference(regex_t *preg);
 #  else
 #    include <regex.h>
 /*
@@ -72,6 +77,10 @@ typedef struct regex {
 ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
 		      bool ignore_case, bool multiline, bool subcaptures, bool runtime);
 int	regex_exec(regex_t *preg, char const *string, size_t len, regmatch_t pmatch[], size_t *nmatch);
+
+ssize_t	regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     bool ignore_case, bool multiline, bool subcaptures);
+void	regex_cache_release(regex_t *preg);
 #  ifdef __cplusplus
 }
 #  endif
@@ -0,0 +1,72 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_SBUFF_H
+#define _FR_SBUFF_H
+/**
+ * $Id$
+ *
+ * @file include/sbuff.h
+ * @brief Print strings, values and attributes into a growing buffer.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSIDH(sbuff_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A string buffer which grows as it's printed to
+ *
+ * The contents are always '\0' terminated.
+ */
+typedef struct {
+	char		*buff;		//!< Start of the buffer.
+	size_t		size;		//!< How much memory is allocated for the buffer.
+	size_t		used;		//!< Bytes printed, not including the '\0'.
+} fr_sbuff_t;
+
+#define fr_sbuff_start(_sb)	((_sb)->buff)
+#define fr_sbuff_used(_sb)	((_sb)->used)
+
+fr_sbuff_t	*fr_sbuff_alloc(TALLOC_CTX *ctx, size_t size);
+
+fr_sbuff_t	*fr_sbuff_thread_local(void);
+
+void		fr_sbuff_reset(fr_sbuff_t *sb);
+
+int		fr_sbuff_reserve(fr_sbuff_t *sb, size_t len);
+
+ssize_t		fr_sbuff_in_bstrncpy(fr_sbuff_t *sb, char const *in, size_t inlen);
+
+ssize_t		fr_sbuff_in_strcpy(fr_sbuff_t *sb, char const *in);
+
+ssize_t		fr_sbuff_in_char(fr_sbuff_t *sb, char c);
+
+ssize_t		fr_sbuff_in_sprintf(fr_sbuff_t *sb, char const *fmt, ...) CC_HINT(format (printf, 2, 3));
+
+ssize_t		fr_sbuff_in_escape(fr_sbuff_t *sb, char const *in, size_t inlen, char quote);
+
+ssize_t		fr_sbuff_in_value_box(fr_sbuff_t *sb, value_box_t const *data, char quote);
+
+ssize_t		fr_sbuff_in_pair_value(fr_sbuff_t *sb, VALUE_PAIR const *vp, char quote);
+
+ssize_t		fr_sbuff_in_pair(fr_sbuff_t *sb, VALUE_PAIR const *vp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_SBUFF_H */
@@ -33,6 +33,56 @@ extern "C" {
 typedef struct fr_state_tree_t fr_state_tree_t;
 extern fr_state_tree_t *global_state;
 
+/** Somewhere to share state entries with other servers
+ *
+ */
+typedef struct fr_state_backend_t {
+	char const	*name;		//!< Of the backend, used in debug messages.
+
+	/** Store serialised session-state
+	 *
+	 * @param[in] uctx passed to fr_state_backend_register().
+	 * @param[in] request the state belongs to.
+	 * @param[in] key the state value.
+	 * @param[in] key_len length of the state value.
+	 * @param[in] data serialised session-state.
+	 * @param[in] data_len length of data.
+	 * @param[in] ttl how many seconds to keep it for.
+	 * @return
+	 *	- 0 on success.
+	 *	- -1 on failure.
+	 */
+	int		(*store)(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len,
+				 uint8_t const *data, size_t data_len, uint32_t ttl);
+
+	/** Retrieve serialised session-state
+	 *
+	 * @param[in] ctx to allocate the data in.
+	 * @param[out] out where to write the data.
+	 * @param[in] uctx passed to fr_state_backend_register().
+	 * @param[in] request the state is wanted for.
+	 * @param[in] key the state value.
+	 * @param[in] key_len length of the state value.
+	 * @return
+	 *	- Length of the data.
+	 *	- 0 if there's no state for the key.
+	 *	- -1 on failure.
+	 */
+	ssize_t		(*fetch)(TALLOC_CTX *ctx, uint8_t **out, void *uctx, REQUEST *request,
+				 uint8_t const *key, size_t key_len);
+
+	/** Remove session-state
+	 *
+	 * @param[in] uctx passed to fr_state_backend_register().
+	 * @param[in] request the state belonged to.
+	 * @param[in] key the state value.
+	 * @param[in] key_len length of the state value.
+	 */
+	void		(*remove)(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len);
+} fr_state_backend_t;
+
+void fr_state_backend_register(fr_state_backend_t const *backend, void *uctx);
+
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout);
 
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original);
@@ -54,6 +54,39 @@ typedef struct fr_stats_t {
 	fr_uint_t	elapsed[8];
 } fr_stats_t;
 
+/*
+ *	Counters are written from every worker thread, so each thread
+ *	counts into its own shard of a block, and readers add the
+ *	shards together.  Threads are assigned shards round robin, so
+ *	if there are more threads than shards, some shards are shared,
+ *	and the counters are still updated atomically.
+ */
+#ifndef FR_STATS_SHARDS
+#  define FR_STATS_SHARDS		(8)
+#endif
+#define FR_STATS_CACHE_LINE	(64)
+
+/** One thread's copy of the counters
+ *
+ * Blocks are embedded in talloced structures, so they can't be aligned
+ * to a cache line.  Instead the counters are followed by a full
+ * cache line of padding, so the counters of two shards are never on
+ * the same line.
+ */
+typedef struct {
+	fr_stats_t	stats;
+	uint8_t		pad[FR_STATS_CACHE_LINE];
+} fr_stats_shard_t;
+
+/** Counters for a client, listener, home server, or the whole server
+ *
+ * Only ever written with the FR_STATS_* macros, and only read with
+ * #fr_stats_merge.
+ */
+typedef struct fr_stats_block_t {
+	fr_stats_shard_t	shard[FR_STATS_SHARDS];
+} fr_stats_block_t;
+
 typedef struct fr_stats_ema_t {
 	uint32_t	window;
 
@@ -61,22 +94,22 @@ typedef struct fr_stats_ema_t {
 	uint32_t	ema1, ema10;
 } fr_stats_ema_t;
 
-extern fr_stats_t	radius_auth_stats;
+extern fr_stats_block_t	radius_auth_stats;
 #ifdef WITH_ACCOUNTING
-extern fr_stats_t	radius_acct_stats;
+extern fr_stats_block_t	radius_acct_stats;
 #endif
 #ifdef WITH_COA
-extern fr_stats_t	radius_coa_stats;
-extern fr_stats_t	radius_dsc_stats;
+extern fr_stats_block_t	radius_coa_stats;
+extern fr_stats_block_t	radius_dsc_stats;
 #endif
 #ifdef WITH_PROXY
-extern fr_stats_t	proxy_auth_stats;
+extern fr_stats_block_t	proxy_auth_stats;
 #ifdef WITH_ACCOUNTING
-extern fr_stats_t	proxy_acct_stats;
+extern fr_stats_block_t	proxy_acct_stats;
 #endif
 #ifdef WITH_COA
-extern fr_stats_t	proxy_coa_stats;
-extern fr_stats_t	proxy_dsc_stats;
+extern fr_stats_block_t	proxy_coa_stats;
+extern fr_stats_block_t	proxy_dsc_stats;
 #endif
 #endif
 
@@ -86,20 +119,33 @@ void request_stats_reply(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end);
 void fr_stats_bins(fr_stats_t *stats, struct timeval *start, struct timeval *end);
+unsigned int fr_stats_shard(void);
+void fr_stats_merge(fr_stats_t *out, fr_stats_block_t const *block);
+char *radius_stats_openmetrics(TALLOC_CTX *ctx);
 int fr_snmp_process(REQUEST *request);
 int fr_snmp_init(void);
 
 
-#define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
-#define FR_STATS_TYPE_INC(_x) _x++
+/*
+ *	The counters of the calling thread's shard in a block.
+ */
+#define FR_STATS_LOCAL(_block) (&(_block)->shard[fr_stats_shard()].stats)
+
+#define FR_STATS_ADD(_block, _field, _n) __atomic_add_fetch(&FR_STATS_LOCAL(_block)->_field, (_n), __ATOMIC_RELAXED)
+#define FR_STATS_LAST_PACKET(_block, _when) __atomic_store_n(&FR_STATS_LOCAL(_block)->last_packet, (_when), __ATOMIC_RELAXED)
+
+#define FR_STATS_INC(_x, _y) FR_STATS_ADD(&radius_ ## _x ## _stats, _y, 1);if (listener) FR_STATS_ADD(&listener->stats, _y, 1);if (client) FR_STATS_ADD(&client->_x, _y, 1);
+#define FR_STATS_TYPE_INC(_block, _field) FR_STATS_ADD(_block, _field, 1)
 
 #else  /* WITH_STATS */
 #define request_stats_init(_x)
 #define request_stats_final(_x)
 #define fr_stats_bins(_x, _y, _z)
 
+#define FR_STATS_ADD(_block, _field, _n)
+#define FR_STATS_LAST_PACKET(_block, _when)
 #define FR_STATS_INC(_x, _y)
-#define FR_STATS_TYPE_INC(_x)
+#define FR_STATS_TYPE_INC(_block, _field)
 
 #endif
 
@@ -0,0 +1,128 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_TRACE_H
+#define _FR_TRACE_H
+/**
+ * $Id$
+ *
+ * @file include/trace.h
+ * @brief Static probes, and sampled per-request tracing.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	USDT probes, for DTrace, SystemTap, bpftrace etc.  They're
+ *	a single nop when nothing is attached, so they're always
+ *	compiled in if <sys/sdt.h> is available.
+ *
+ *	Probes are in the "freeradius" provider.  Double underscores
+ *	in probe names are shown as dashes by the tracing tools.
+ */
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define FR_PROBE(_name)				DTRACE_PROBE(freeradius, _name)
+#  define FR_PROBE1(_name, _a)				DTRACE_PROBE1(freeradius, _name, _a)
+#  define FR_PROBE2(_name, _a, _b)			DTRACE_PROBE2(freeradius, _name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)			DTRACE_PROBE3(freeradius, _name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)		DTRACE_PROBE4(freeradius, _name, _a, _b, _c, _d)
+#else
+#  define FR_PROBE(_name)
+#  define FR_PROBE1(_name, _a)
+#  define FR_PROBE2(_name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)
+#endif
+
+#define TRACE_SPANS_MAX		32		//!< Maximum number of spans recorded per request.
+#define TRACE_NAME_LEN		32		//!< Span names are truncated to this length.
+
+/** What a span is recording
+ *
+ */
+typedef enum {
+	TRACE_SPAN_SECTION = 0,				//!< A section of a virtual server.
+	TRACE_SPAN_MODULE,				//!< A module call.
+	TRACE_SPAN_XLAT,				//!< An xlat function.
+	TRACE_SPAN_POOL,				//!< Reserving a connection from a pool.
+	TRACE_SPAN_MAX
+} trace_span_type_t;
+
+/** A section, module call, xlat function, or connection reservation
+ *
+ */
+typedef struct {
+	char			name[TRACE_NAME_LEN];	//!< Copied, as modules may be freed on HUP.
+	trace_span_type_t	type;		//!< What the span is recording.
+	uint8_t			depth;		//!< Nesting depth, 0 for sections.
+	bool			done;		//!< Whether we've seen the end of the span.
+	rlm_rcode_t		rcode;		//!< What the section or module returned.
+	uint32_t		start;		//!< Microseconds since the request started.
+	uint32_t		usec;		//!< How long the span lasted.
+} trace_span_t;
+
+/** The trace of a single request
+ *
+ */
+typedef struct trace_t {
+	uint64_t		number;		//!< Of the request.
+	char			server[TRACE_NAME_LEN];	//!< Virtual server which processed the request.
+	unsigned int		code;		//!< Of the request packet.
+	unsigned int		reply_code;	//!< Of the reply packet, or 0 if there was no reply.
+
+	struct timeval		start;		//!< When the trace started.
+	struct timeval		queued;		//!< When the request was put in the queue.
+	uint32_t		queue_usec;	//!< How long the request waited for a thread.
+	uint32_t		usec;		//!< Total time taken to process the request.
+
+	uint8_t			depth;		//!< Depth of the next span to be started.
+	bool			truncated;	//!< More than #TRACE_SPANS_MAX spans were started.
+	int			num_spans;
+	trace_span_t		span[TRACE_SPANS_MAX];
+} trace_t;
+
+int		trace_init(uint32_t sample_rate, uint32_t buffer_size);
+
+void		trace_free(void);
+
+void		trace_sample_rate_set(uint32_t sample_rate);
+
+uint32_t	trace_sample_rate(void);
+
+void		trace_request_start(REQUEST *request);
+
+void		trace_request_queued(REQUEST *request);
+
+void		trace_request_dequeued(REQUEST *request);
+
+void		trace_request_done(REQUEST *request);
+
+int		trace_span_start(REQUEST *request, trace_span_type_t type, char const *name);
+
+void		trace_span_done(REQUEST *request, int span, rlm_rcode_t rcode);
+
+trace_t		*trace_buffer_copy(TALLOC_CTX *ctx, uint32_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_TRACE_H */
@@ -41,6 +41,44 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen,
 	       int if_index);
+
+void udpfromto_cmsg_to(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+		       int *if_index, struct timeval *when);
+void udpfromto_cmsg_from(struct msghdr *msgh, char *cbuf, size_t cbuf_len,
+			 struct sockaddr const *from, int if_index);
+
+/** Room for the control messages of one datagram
+ *
+ * Enough for an IPv6 PKTINFO header and a timestamp, which is the most
+ * recvmsg() will return on a socket set up with #udpfromto_init.
+ */
+#define UDPFROMTO_CMSG_SIZE	(128)
+
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+/** Addressing information for one datagram of a batch
+ *
+ * As with #recvfromto and #sendfromto, "from" is the source of the
+ * datagram, and "to" is its destination.
+ */
+typedef struct {
+	struct sockaddr_storage	from;		//!< Source address.
+	socklen_t		from_len;	//!< Length of the source address, 0 if there isn't one.
+	struct sockaddr_storage	to;		//!< Destination address.
+	socklen_t		to_len;		//!< Length of the destination address.
+	int			if_index;	//!< Interface the datagram was received on, or is sent from.
+	struct timeval		when;		//!< When the datagram was received.
+	char			cbuf[UDPFROMTO_CMSG_SIZE];	//!< Control messages for this datagram.
+} udpfromto_mmsg_t;
+#endif
+
+#ifdef HAVE_RECVMMSG
+int recvmmsgfromto(int fd, struct mmsghdr *msgs, udpfromto_mmsg_t *addr, unsigned int num, int flags,
+		   struct sockaddr const *local, socklen_t local_len);
+#endif
+
+#ifdef HAVE_SENDMMSG
+int sendmmsgfromto(int fd, struct mmsghdr *msgs, udpfromto_mmsg_t *addr, unsigned int num, int flags);
+#endif
 #endif
 
 #ifdef __cplusplus
@@ -6,6 +6,7 @@
 TARGET		:= libfreeradius-radius.a
 
 SOURCES		:= cbuff.c \
+		   cmap.c \
 		   cursor.c \
 		   debug.c \
 		   dict.c \
@@ -23,6 +24,7 @@ SOURCES		:= cbuff.c \
 		   net.c \
 		   pair.c \
 		   pair_cursor.c \
+		   pair_index.c \
 		   pcap.c \
 		   print.c \
 		   proto.c \
@@ -31,6 +33,7 @@ SOURCES		:= cbuff.c \
 		   radius_decode.c \
 		   rbtree.c \
 		   regex.c \
+		   sbuff.c \
 		   sha1.c \
 		   snprintf.c \
 		   strlcat.c \
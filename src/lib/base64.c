@@ -32,6 +32,185 @@ RCSID("$Id$")
 
 #define us(x) (uint8_t) x
 
+static char const b64str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ *	SSSE3 isn't part of the base x86_64 instruction set, so the
+ *	SSSE3 codecs are compiled for it explicitly, and only used if
+ *	the CPU supports it.  NEON is part of the base aarch64
+ *	instruction set.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <tmmintrin.h>
+#  define BASE64_SSSE3
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define BASE64_NEON
+#endif
+
+#ifdef BASE64_SSSE3
+/** Whether the CPU supports SSSE3
+ *
+ * The result is cached, threads racing to set it all write the same value.
+ */
+static bool base64_ssse3(void)
+{
+	static int supported = -1;
+
+	if (supported < 0) {
+		__builtin_cpu_init();
+		supported = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	}
+
+	return supported == 1;
+}
+
+/** Encode 12 bytes at a time, as long as 16 bytes can be read
+ *
+ * @return how many bytes were encoded.  Always a multiple of 3.
+ */
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(char *out, uint8_t const *in, size_t inlen)
+{
+	size_t done = 0;
+
+	while ((inlen - done) >= 16) {
+		__m128i data, hi, lo, idx, off;
+
+		data = _mm_loadu_si128((__m128i const *) (in + done));
+
+		/*
+		 *	Spread each group of 3 bytes over a 32 bit
+		 *	lane, then shift each 6 bit index into its
+		 *	own byte.
+		 */
+		data = _mm_shuffle_epi8(data, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+		hi = _mm_mulhi_epu16(_mm_and_si128(data, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		lo = _mm_mullo_epi16(_mm_and_si128(data, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+		idx = _mm_or_si128(hi, lo);
+
+		/*
+		 *	Map each index to the offset between it and
+		 *	its character, by the range it falls in.
+		 */
+		off = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		off = _mm_or_si128(off, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+		off = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+						     '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+						     '/' - 63, 'A', 0, 0), off);
+
+		_mm_storeu_si128((__m128i *) out, _mm_add_epi8(idx, off));
+		out += 16;
+		done += 12;
+	}
+
+	return done;
+}
+
+/** Decode 16 characters at a time, until a block contains padding or invalid characters
+ *
+ * @return how many characters were decoded.  Always a multiple of 16.
+ */
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(uint8_t *out, char const *in, size_t inlen)
+{
+	size_t	done = 0;
+
+	while ((inlen - done) >= 16) {
+		__m128i		data, hi_nibbles, lo_nibbles, lo, hi, roll;
+		uint8_t		tmp[16];
+
+		data = _mm_loadu_si128((__m128i const *) (in + done));
+
+		/*
+		 *	Each character is valid if the bits selected by
+		 *	its high nibble and its low nibble don't overlap.
+		 */
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(data, 4), _mm_set1_epi8(0x2f));
+		lo_nibbles = _mm_and_si128(data, _mm_set1_epi8(0x2f));
+		lo = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+						    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo_nibbles);
+		hi = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+						    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) break;
+
+		/*
+		 *	Map each character to its index, by adding
+		 *	the offset for its range.  '/' is the only
+		 *	character which needs a different offset to the
+		 *	rest of its range.
+		 */
+		roll = _mm_add_epi8(_mm_cmpeq_epi8(data, _mm_set1_epi8('/')), hi_nibbles);
+		roll = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0), roll);
+		data = _mm_add_epi8(data, roll);
+
+		/*
+		 *	Pack the 6 bit indexes into 3 bytes per 32 bit lane,
+		 *	then pull the bytes out in order.
+		 */
+		data = _mm_maddubs_epi16(data, _mm_set1_epi32(0x01400140));
+		data = _mm_madd_epi16(data, _mm_set1_epi32(0x00011000));
+		data = _mm_shuffle_epi8(data, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+		/*
+		 *	Only 12 bytes are valid, and the caller only
+		 *	guarantees there's room for those.
+		 */
+		_mm_storeu_si128((__m128i *) tmp, data);
+		memcpy(out, tmp, 12);
+		out += 12;
+		done += 16;
+	}
+
+	return done;
+}
+#endif
+
+#ifdef BASE64_NEON
+/** Encode 48 bytes at a time
+ *
+ * @return how many bytes were encoded.  Always a multiple of 3.
+ */
+static size_t base64_encode_neon(char *out, uint8_t const *in, size_t inlen)
+{
+	uint8x16x4_t	table, idx;
+	size_t		done = 0;
+
+	table.val[0] = vld1q_u8((uint8_t const *) b64str);
+	table.val[1] = vld1q_u8((uint8_t const *) b64str + 16);
+	table.val[2] = vld1q_u8((uint8_t const *) b64str + 32);
+	table.val[3] = vld1q_u8((uint8_t const *) b64str + 48);
+
+	while ((inlen - done) >= 48) {
+		uint8x16x3_t data;
+
+		/*
+		 *	De-interleaves the input, so each register
+		 *	holds one byte from each group of 3.
+		 */
+		data = vld3q_u8(in + done);
+
+		idx.val[0] = vshrq_n_u8(data.val[0], 2);
+		idx.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(data.val[0], 4), vshrq_n_u8(data.val[1], 4)),
+				      vdupq_n_u8(0x3f));
+		idx.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(data.val[1], 2), vshrq_n_u8(data.val[2], 6)),
+				      vdupq_n_u8(0x3f));
+		idx.val[3] = vandq_u8(data.val[2], vdupq_n_u8(0x3f));
+
+		idx.val[0] = vqtbl4q_u8(table, idx.val[0]);
+		idx.val[1] = vqtbl4q_u8(table, idx.val[1]);
+		idx.val[2] = vqtbl4q_u8(table, idx.val[2]);
+		idx.val[3] = vqtbl4q_u8(table, idx.val[3]);
+
+		vst4q_u8((uint8_t *) out, idx);
+		out += 64;
+		done += 48;
+	}
+
+	return done;
+}
+#endif
+
 /** Base 64 encode binary data
  *
  * Base64 encode IN array of size INLEN into OUT array of size OUTLEN.
@@ -46,14 +225,30 @@ RCSID("$Id$")
  */
 size_t fr_base64_encode(char *out, size_t outlen, uint8_t const *in, size_t inlen)
 {
-	static char const b64str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
 	char *p = out;
 	if (outlen < (FR_BASE64_ENC_LENGTH(inlen) + 1)) {
 		*out = '\0';
 		return -1;
 	}
 
+	/*
+	 *	Encode whole blocks with SIMD, and the rest below.
+	 */
+#if defined(BASE64_SSSE3) || defined(BASE64_NEON)
+	{
+		size_t done = 0;
+
+#  ifdef BASE64_SSSE3
+		if ((inlen >= 16) && base64_ssse3()) done = base64_encode_ssse3(p, in, inlen);
+#  else
+		done = base64_encode_neon(p, in, inlen);
+#  endif
+		p += (done / 3) * 4;
+		in += done;
+		inlen -= done;
+	}
+#endif
+
 	while (inlen) {
 		*p++ = b64str[(in[0] >> 2) & 0x3f];
 		*p++ = b64str[((in[0] << 4) + (--inlen ? in[1] >> 4 : 0)) & 0x3f];
@@ -259,6 +454,22 @@ ssize_t fr_base64_decode(uint8_t *out, size_t outlen, char const *in, size_t inl
 		return -1;
 	}
 
+	/*
+	 *	Decode whole blocks with SIMD.  If a block has padding
+	 *	or anything invalid, the loop below works out what to
+	 *	do with it.
+	 */
+#ifdef BASE64_SSSE3
+	if ((inlen >= 16) && base64_ssse3()) {
+		size_t done;
+
+		done = base64_decode_ssse3(p, in, inlen);
+		p += (done / 4) * 3;
+		in += done;
+		inlen -= done;
+	}
+#endif
+
 	while (inlen >= 2) {
 		if (!fr_is_base64(in[0]) || !fr_is_base64(in[1])) {
 			break;
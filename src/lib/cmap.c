@@ -0,0 +1,333 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file lib/cmap.c
+ * @brief Concurrent hash maps, for tables which are shared between threads.
+ *
+ *  The map is split into a number of stripes.  Each stripe is a
+ *  normal hash table, with its own read / write lock.  The top bits
+ *  of the hash select the stripe, and the hash table uses the low
+ *  bits to select the slot.
+ *
+ *  Lookups take a read lock on one stripe, so many threads can look
+ *  up entries at the same time.  Writers only block readers of the
+ *  same stripe.  Each stripe is on its own cache line, so that
+ *  threads using different stripes don't fight over the locks.
+ *
+ *  This works best for tables which are read much more often than
+ *  they are written.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/cmap.h>
+
+#include <pthread.h>
+
+/*
+ *	The default number of stripes.  MUST be a power of two.
+ */
+#define FR_CMAP_NUM_STRIPES	(64)
+
+#define FR_CMAP_CACHE_LINE	(64)
+
+typedef struct fr_cmap_stripe_t {
+	pthread_rwlock_t	lock;
+	fr_hash_table_t		*ht;
+} CC_HINT(aligned(FR_CMAP_CACHE_LINE)) fr_cmap_stripe_t;
+
+struct fr_cmap_t {
+	uint32_t		num_stripes;
+	uint32_t		shift;		//!< 32 - log2(num_stripes)
+
+	fr_hash_table_hash_t	hash;
+
+	fr_cmap_stripe_t	*stripes;
+	uint8_t			*memory;	//!< unaligned memory which holds the stripes
+};
+
+static int _cmap_free(fr_cmap_t *cmap)
+{
+	uint32_t i;
+
+	for (i = 0; i < cmap->num_stripes; i++) {
+		fr_hash_table_free(cmap->stripes[i].ht);
+		pthread_rwlock_destroy(&cmap->stripes[i].lock);
+	}
+
+	return 0;
+}
+
+/** Create a concurrent hash map
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] num_stripes how many locks the map is split into.  It is rounded up to
+ *	a power of two.  0 means use the default.
+ * @param[in] hash_node the hash function for entries
+ * @param[in] cmp_node the comparison function for entries
+ * @param[in] free_node called when an entry is deleted, or the map is freed
+ * @return
+ *	- NULL on error
+ *	- fr_cmap_t on success
+ */
+fr_cmap_t *fr_cmap_create(TALLOC_CTX *ctx, uint32_t num_stripes,
+			  fr_hash_table_hash_t hash_node,
+			  fr_hash_table_cmp_t cmp_node,
+			  fr_hash_table_free_t free_node)
+{
+	uint32_t i, bits;
+	fr_cmap_t *cmap;
+
+	if (!hash_node) return NULL;
+
+	if (!num_stripes) num_stripes = FR_CMAP_NUM_STRIPES;
+	if (num_stripes > (1 << 16)) return NULL;
+
+	for (bits = 0; (1U << bits) < num_stripes; bits++) {
+		/* nothing */
+	}
+
+	cmap = talloc_zero(ctx, fr_cmap_t);
+	if (!cmap) return NULL;
+
+	cmap->num_stripes = 1U << bits;
+	cmap->shift = 32 - bits;
+	cmap->hash = hash_node;
+
+	cmap->memory = talloc_zero_array(cmap, uint8_t,
+					 (cmap->num_stripes * sizeof(fr_cmap_stripe_t)) + FR_CMAP_CACHE_LINE);
+	if (!cmap->memory) {
+	error:
+		talloc_free(cmap);
+		return NULL;
+	}
+	cmap->stripes = (fr_cmap_stripe_t *) (((uintptr_t) cmap->memory + FR_CMAP_CACHE_LINE - 1) &
+					      ~((uintptr_t) FR_CMAP_CACHE_LINE - 1));
+
+	for (i = 0; i < cmap->num_stripes; i++) {
+		if (pthread_rwlock_init(&cmap->stripes[i].lock, NULL) != 0) {
+			cmap->num_stripes = i;
+			talloc_set_destructor(cmap, _cmap_free);
+			goto error;
+		}
+
+		cmap->stripes[i].ht = fr_hash_table_create(NULL, hash_node, cmp_node, free_node);
+		if (!cmap->stripes[i].ht) {
+			cmap->num_stripes = i + 1;
+			talloc_set_destructor(cmap, _cmap_free);
+			goto error;
+		}
+	}
+	talloc_set_destructor(cmap, _cmap_free);
+
+	return cmap;
+}
+
+/*
+ *	Find the stripe for some data.
+ */
+static inline fr_cmap_stripe_t *cmap_stripe(fr_cmap_t *cmap, void const *data)
+{
+	if (cmap->num_stripes == 1) return &cmap->stripes[0];
+
+	return &cmap->stripes[cmap->hash(data) >> cmap->shift];
+}
+
+/** Insert data into the map
+ *
+ * @param[in] cmap the map
+ * @param[in] data to insert
+ * @return
+ *	- 0 if the data is already in the map, or on error.
+ *	- 1 on success.
+ */
+int fr_cmap_insert(fr_cmap_t *cmap, void const *data)
+{
+	int rcode;
+	fr_cmap_stripe_t *stripe = cmap_stripe(cmap, data);
+
+	pthread_rwlock_wrlock(&stripe->lock);
+	rcode = fr_hash_table_insert(stripe->ht, data);
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return rcode;
+}
+
+/** Replace old data with new data, or insert if there is no old data
+ *
+ * @param[in] cmap the map
+ * @param[in] data to insert
+ * @return
+ *	- 0 on error.
+ *	- 1 on success.
+ */
+int fr_cmap_replace(fr_cmap_t *cmap, void const *data)
+{
+	int rcode;
+	fr_cmap_stripe_t *stripe = cmap_stripe(cmap, data);
+
+	pthread_rwlock_wrlock(&stripe->lock);
+	rcode = fr_hash_table_replace(stripe->ht, data);
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return rcode;
+}
+
+/** Remove data from the map, without freeing it
+ *
+ * @param[in] cmap the map
+ * @param[in] data a template for the data to remove
+ * @return
+ *	- NULL if the data wasn't found.
+ *	- the data which was removed.
+ */
+void *fr_cmap_yank(fr_cmap_t *cmap, void const *data)
+{
+	void *old;
+	fr_cmap_stripe_t *stripe = cmap_stripe(cmap, data);
+
+	pthread_rwlock_wrlock(&stripe->lock);
+	old = fr_hash_table_yank(stripe->ht, data);
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return old;
+}
+
+/** Remove data from the map, and free it
+ *
+ * @param[in] cmap the map
+ * @param[in] data a template for the data to remove
+ * @return
+ *	- 0 if the data wasn't found.
+ *	- 1 on success.
+ */
+int fr_cmap_delete(fr_cmap_t *cmap, void const *data)
+{
+	int rcode;
+	fr_cmap_stripe_t *stripe = cmap_stripe(cmap, data);
+
+	pthread_rwlock_wrlock(&stripe->lock);
+	rcode = fr_hash_table_delete(stripe->ht, data);
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return rcode;
+}
+
+/** Find data in the map
+ *
+ *  The caller MUST ensure that no other thread deletes the data
+ *  while it's being used.  If that can't be guaranteed, use
+ *  fr_cmap_find() instead.
+ *
+ * @param[in] cmap the map
+ * @param[in] data a template for the data to find
+ * @return
+ *	- NULL if the data wasn't found.
+ *	- the data.
+ */
+void *fr_cmap_finddata(fr_cmap_t *cmap, void const *data)
+{
+	void *found;
+	fr_cmap_stripe_t *stripe = cmap_stripe(cmap, data);
+
+	pthread_rwlock_rdlock(&stripe->lock);
+	found = fr_hash_table_finddata(stripe->ht, data);
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return found;
+}
+
+/** Find data in the map, and call a function with it
+ *
+ *  The stripe is locked while the callback runs, so the data can't
+ *  be deleted by another thread.  The callback MUST NOT modify the
+ *  map, and it should be quick.
+ *
+ * @param[in] cmap the map
+ * @param[in] data a template for the data to find
+ * @param[in] callback to call with the data
+ * @param[in] ctx for the callback
+ * @return
+ *	- -1 if the data wasn't found.
+ *	- the return code of the callback.
+ */
+int fr_cmap_find(fr_cmap_t *cmap, void const *data, fr_cmap_find_t callback, void *ctx)
+{
+	int rcode = -1;
+	void *found;
+	fr_cmap_stripe_t *stripe = cmap_stripe(cmap, data);
+
+	pthread_rwlock_rdlock(&stripe->lock);
+	found = fr_hash_table_finddata(stripe->ht, data);
+	if (found) rcode = callback(ctx, found);
+	pthread_rwlock_unlock(&stripe->lock);
+
+	return rcode;
+}
+
+/** Count the number of entries in the map
+ *
+ *  Other threads may change the map while we count, so the result
+ *  is only a snapshot.
+ *
+ * @param[in] cmap the map
+ * @return the number of entries.
+ */
+int fr_cmap_num_elements(fr_cmap_t *cmap)
+{
+	uint32_t i;
+	int num = 0;
+
+	for (i = 0; i < cmap->num_stripes; i++) {
+		pthread_rwlock_rdlock(&cmap->stripes[i].lock);
+		num += fr_hash_table_num_elements(cmap->stripes[i].ht);
+		pthread_rwlock_unlock(&cmap->stripes[i].lock);
+	}
+
+	return num;
+}
+
+/** Walk over the entries in the map
+ *
+ *  Each stripe is write locked while its entries are walked, as
+ *  the walk changes the state of the hash table.  The callback MUST
+ *  NOT modify the map.
+ *
+ * @param[in] cmap the map
+ * @param[in] callback to call for each entry.  Returning non-zero stops the walk.
+ * @param[in] ctx for the callback
+ * @return
+ *	- 0 if all entries were walked.
+ *	- the return code of the callback which stopped the walk.
+ */
+int fr_cmap_walk(fr_cmap_t *cmap, fr_hash_table_walk_t callback, void *ctx)
+{
+	uint32_t i;
+	int rcode = 0;
+
+	for (i = 0; i < cmap->num_stripes; i++) {
+		pthread_rwlock_wrlock(&cmap->stripes[i].lock);
+		rcode = fr_hash_table_walk(cmap->stripes[i].ht, callback, ctx);
+		pthread_rwlock_unlock(&cmap->stripes[i].lock);
+
+		if (rcode != 0) break;
+	}
+
+	return rcode;
+}
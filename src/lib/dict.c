@@ -34,6 +34,9 @@ RCSID("$Id$")
 #  include <sys/stat.h>
 #endif
 
+#include <fcntl.h>
+#include <sys/mman.h>
+
 #define MAX_ARGV (16)
 
 /** Magic internal dictionary
@@ -55,12 +58,34 @@ typedef struct dict_stat_t {
 	struct stat stat_buf;
 } dict_stat_t;
 
+/** Records what was loaded, so it can be written to a dictionary cache
+ *
+ */
+typedef struct dict_cache_t {
+	uint8_t			*buf;		//!< Records.
+	size_t			used;		//!< How much of buf has been written.
+	bool			failed;		//!< We ran out of memory, and the records are incomplete.
+} dict_cache_t;
+
 typedef struct dict_enum_fixup_t {
 	char				attrstr[FR_DICT_ATTR_MAX_NAME_LEN];
 	fr_dict_enum_t			*dval;
 	struct dict_enum_fixup_t	*next;
 } dict_enum_fixup_t;
 
+/** Read-only name index, built by fr_dict_freeze()
+ *
+ * Names are hashed into buckets, and each bucket has a displacement
+ * which was chosen so that every name lands in its own slot.  A
+ * lookup is then one hash, and one string comparison.
+ */
+typedef struct dict_frozen_t {
+	uint32_t		num_slots;		//!< One per attribute name.
+	uint32_t		num_buckets;
+	uint32_t		*disp;			//!< Displacement for each bucket.
+	fr_dict_attr_t const	**slots;		//!< Attributes, by perfect hash of their name.
+} dict_frozen_t;
+
 /** Vendors and attribute names
  *
  * It's very likely that the same vendors will operate in multiple
@@ -79,6 +104,7 @@ struct fr_dict {
 	fr_hash_table_t		*vendors_by_num;	//!< Lookup vendor by PEN.
 
 	fr_hash_table_t		*attributes_by_name;	//!< Allow attribute lookup by unique name.
+	dict_frozen_t		*frozen;		//!< Faster lookup by name, if the dictionary is frozen.
 
 	fr_hash_table_t		*attributes_combo;	//!< Lookup variants of polymorphic attributes.
 
@@ -87,6 +113,8 @@ struct fr_dict {
 
 	fr_dict_attr_t		*root;			//!< Root attribute of this dictionary.
 	TALLOC_CTX		*pool;			//!< Talloc memory pool to reduce allocs.
+
+	dict_cache_t		*cache;			//!< Recording what we load, if that's wanted.
 };
 
 /** Map data types to names representing those types
@@ -490,6 +518,88 @@ static int dict_stat_check(fr_dict_t *dict, char const *dir, char const *file)
 	return 0;
 }
 
+/*
+ *	Dictionary cache records.  Each one is a uint8_t record type,
+ *	followed by the fields in the order written below.
+ */
+#define DICT_CACHE_SOURCE	(1)	//!< dir, file and root name passed to fr_dict_from_file().
+#define DICT_CACHE_FILE		(2)	//!< path, size, mtime and hash of a file we read.
+#define DICT_CACHE_VENDOR	(3)	//!< name, vendor, type, length and continuation.
+#define DICT_CACHE_VSA		(4)	//!< parent of an automatically created Vendor-Specific.
+#define DICT_CACHE_VENDOR_DA	(5)	//!< parent, name and vendor, from BEGIN-VENDOR.
+#define DICT_CACHE_ATTR		(6)	//!< parent, name, attr, type and flags.
+#define DICT_CACHE_ENUM		(7)	//!< attribute name, alias and value.
+
+static void dict_cache_put(fr_dict_t *dict, void const *data, size_t len)
+{
+	dict_cache_t *cache = dict->cache;
+
+	if (cache->failed) return;
+
+	if ((cache->used + len) > talloc_array_length(cache->buf)) {
+		size_t		size = talloc_array_length(cache->buf) * 2;
+		uint8_t		*buf;
+
+		if (size < (cache->used + len)) size = cache->used + len;
+
+		buf = talloc_realloc(cache, cache->buf, uint8_t, size);
+		if (!buf) {
+			cache->failed = true;
+			return;
+		}
+		cache->buf = buf;
+	}
+
+	memcpy(cache->buf + cache->used, data, len);
+	cache->used += len;
+}
+
+static void dict_cache_put_byte(fr_dict_t *dict, uint8_t value)
+{
+	dict_cache_put(dict, &value, sizeof(value));
+}
+
+static void dict_cache_put_num(fr_dict_t *dict, uint32_t value)
+{
+	dict_cache_put(dict, &value, sizeof(value));
+}
+
+/*
+ *	Strings are written with their trailing '\0'.
+ */
+static void dict_cache_put_str(fr_dict_t *dict, char const *str)
+{
+	uint16_t len = strlen(str) + 1;
+
+	dict_cache_put(dict, &len, sizeof(len));
+	dict_cache_put(dict, str, len);
+}
+
+/*
+ *	Attributes are written as the attribute numbers and types
+ *	which lead to them from the root.
+ */
+static void dict_cache_put_da(fr_dict_t *dict, fr_dict_attr_t const *da)
+{
+	fr_dict_attr_t const	*stack[FR_DICT_MAX_TLV_STACK + 1];
+	int			depth = 0;
+
+	for (; da && !da->flags.is_root; da = da->parent) {
+		if (depth >= FR_DICT_MAX_TLV_STACK) {
+			dict->cache->failed = true;
+			return;
+		}
+		stack[depth++] = da;
+	}
+
+	dict_cache_put_byte(dict, depth);
+	while (depth > 0) {
+		depth--;
+		dict_cache_put_num(dict, stack[depth]->attr);
+		dict_cache_put_byte(dict, stack[depth]->type);
+	}
+}
+
 static void _fr_dict_dump(fr_dict_attr_t const *da, unsigned int lvl)
 {
 	unsigned int		i;
@@ -1420,6 +1530,11 @@ static fr_dict_attr_t *fr_dict_attr_add_by_name(fr_dict_t *dict, fr_dict_attr_t
 		goto error;
 	}
 
+	/*
+	 *	The frozen index doesn't know about new names.
+	 */
+	TALLOC_FREE(dict->frozen);
+
 	/*
 	 *	Insert the attribute, only if it's not a duplicate.
 	 */
@@ -1510,6 +1625,15 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 
 	if (fr_dict_attr_child_add(mutable, n) < 0) return -1;
 
+	if (dict && dict->cache) {
+		dict_cache_put_byte(dict, DICT_CACHE_ATTR);
+		dict_cache_put_da(dict, parent);
+		dict_cache_put_str(dict, name);
+		dict_cache_put_num(dict, attr);
+		dict_cache_put_num(dict, type);
+		dict_cache_put(dict, &flags, sizeof(flags));
+	}
+
 	return 0;
 }
 
@@ -1981,7 +2105,7 @@ static int dict_read_process_named_attribute(fr_dict_t *dict, fr_dict_attr_t con
 		}
 	}
 
-	hash = fr_hash_string(normalized);
+	hash = fr_hash_fnv_string(normalized);
 	attr = hash;
 
 	/*
@@ -2015,6 +2139,14 @@ static int dict_read_process_value(fr_dict_t *dict, char **argv, int argc)
 	}
 
 	if (fr_dict_enum_add(dict, argv[0], argv[1], value) < 0) return -1;
+
+	if (dict->cache) {
+		dict_cache_put_byte(dict, DICT_CACHE_ENUM);
+		dict_cache_put_str(dict, argv[0]);
+		dict_cache_put_str(dict, argv[1]);
+		dict_cache_put_num(dict, value);
+	}
+
 	return 0;
 }
 
@@ -2177,6 +2309,15 @@ static int dict_read_process_vendor(fr_dict_t *dict, char **argv, int argc)
 	mutable->length = length;
 	mutable->flags = continuation;
 
+	if (dict->cache) {
+		dict_cache_put_byte(dict, DICT_CACHE_VENDOR);
+		dict_cache_put_str(dict, argv[0]);
+		dict_cache_put_num(dict, dv->vendorpec);
+		dict_cache_put_byte(dict, type);
+		dict_cache_put_byte(dict, length);
+		dict_cache_put_byte(dict, continuation);
+	}
+
 	return 0;
 }
 
@@ -2195,6 +2336,74 @@ typedef struct dict_from_file_ctx {
 /*
  *	Initialize the dictionary.
  */
+/** Create the Vendor-Specific attribute, for dictionaries which don't define it
+ *
+ */
+static fr_dict_attr_t const *dict_vsa_da_alloc(fr_dict_t *dict, fr_dict_attr_t const *parent)
+{
+	fr_dict_attr_flags_t	flags;
+	fr_dict_attr_t		*new;
+	fr_dict_attr_t		*mutable;
+
+	memset(&flags, 0, sizeof(flags));
+
+	memcpy(&mutable, &parent, sizeof(mutable));
+	new = fr_dict_attr_alloc(mutable, fr_dict_root(dict), "Vendor-Specific", 0,
+				 PW_VENDOR_SPECIFIC, PW_TYPE_VSA, &flags);
+	fr_dict_attr_child_add(mutable, new);
+
+	if (dict->cache) {
+		dict_cache_put_byte(dict, DICT_CACHE_VSA);
+		dict_cache_put_da(dict, parent);
+	}
+
+	return new;
+}
+
+/** Create a vendor attribute for BEGIN-VENDOR
+ *
+ */
+static fr_dict_attr_t const *dict_vendor_da_alloc(fr_dict_t *dict, fr_dict_attr_t const *vsa_da,
+						  char const *name, unsigned int vendor)
+{
+	fr_dict_attr_flags_t	flags;
+	fr_dict_attr_t		*new;
+	fr_dict_attr_t		*mutable;
+
+	memset(&flags, 0, sizeof(flags));
+
+	if (vsa_da->type == PW_TYPE_VSA) {
+		fr_dict_vendor_t const *dv;
+
+		dv = fr_dict_vendor_by_num(dict, vendor);
+		if (dv) {
+			flags.type_size = dv->type;
+			flags.length = dv->length;
+
+		} else { /* unknown vendor, shouldn't happen */
+			flags.type_size = 1;
+			flags.length = 1;
+		}
+
+	} else { /* EVS are always "format=1,1" */
+		flags.type_size = 1;
+		flags.length = 1;
+	}
+
+	memcpy(&mutable, &vsa_da, sizeof(mutable));
+	new = fr_dict_attr_alloc(mutable, vsa_da, name, 0, vendor, PW_TYPE_VENDOR, &flags);
+	fr_dict_attr_child_add(mutable, new);
+
+	if (dict->cache) {
+		dict_cache_put_byte(dict, DICT_CACHE_VENDOR_DA);
+		dict_cache_put_da(dict, vsa_da);
+		dict_cache_put_str(dict, name);
+		dict_cache_put_num(dict, vendor);
+	}
+
+	return new;
+}
+
 static int _dict_from_file(dict_from_file_ctx_t *ctx,
 			   char const *dir_name, char const *filename,
 			   char const *src_file, int src_line)
@@ -2204,6 +2413,7 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 	char			buf[256];
 	char			*p;
 	int			line = 0;
+	uint32_t		hash = 0;
 
 	struct stat		statbuf;
 	char			*argv[MAX_ARGV];
@@ -2322,6 +2532,8 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 	while (fgets(buf, sizeof(buf), fp) != NULL) {
 		line++;
 
+		if (ctx->dict->cache) hash = fr_hash_update(buf, strlen(buf), hash);
+
 		switch (buf[0]) {
 		case '#':
 		case '\0':
@@ -2479,12 +2691,9 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 
 		if (strcasecmp(argv[0], "BEGIN-VENDOR") == 0) {
 			unsigned int		vendor;
-			fr_dict_attr_flags_t	flags;
 
 			fr_dict_attr_t const	*vsa_da;
 			fr_dict_attr_t const	*vendor_da;
-			fr_dict_attr_t		*new;
-			fr_dict_attr_t		*mutable;
 
 			if (argc < 2) {
 				fr_strerror_printf("Invalid BEGIN-VENDOR entry");
@@ -2533,15 +2742,7 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 				 *	it doesn't.
 				 */
 				vsa_da = fr_dict_attr_child_by_num(ctx->parent, PW_VENDOR_SPECIFIC);
-				if (!vsa_da) {
-					memset(&flags, 0, sizeof(flags));
-
-					memcpy(&mutable, &ctx->parent, sizeof(mutable));
-					new = fr_dict_attr_alloc(mutable, fr_dict_root(ctx->dict), "Vendor-Specific", 0,
-								 PW_VENDOR_SPECIFIC, PW_TYPE_VSA, &flags);
-					fr_dict_attr_child_add(mutable, new);
-					vsa_da = new;
-				}
+				if (!vsa_da) vsa_da = dict_vsa_da_alloc(ctx->dict, ctx->parent);
 			}
 
 			/*
@@ -2549,34 +2750,7 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 			 *	of the EVS attribute, or the VSA (26) attribute.
 			 */
 			vendor_da = fr_dict_attr_child_by_num(vsa_da, vendor);
-			if (!vendor_da) {
-				memset(&flags, 0, sizeof(flags));
-
-				if (vsa_da->type == PW_TYPE_VSA) {
-					fr_dict_vendor_t const *dv;
-
-					dv = fr_dict_vendor_by_num(ctx->dict, vendor);
-					if (dv) {
-						flags.type_size = dv->type;
-						flags.length = dv->length;
-
-					} else { /* unknown vendor, shouldn't happen */
-						flags.type_size = 1;
-						flags.length = 1;
-					}
-
-				} else { /* EVS are always "format=1,1" */
-					flags.type_size = 1;
-					flags.length = 1;
-				}
-
-				memcpy(&mutable, &vsa_da, sizeof(mutable));
-				new = fr_dict_attr_alloc(mutable, ctx->parent,
-							 argv[1], 0, vendor, PW_TYPE_VENDOR, &flags);
-				fr_dict_attr_child_add(mutable, new);
-
-				vendor_da = new;
-			}
+			if (!vendor_da) vendor_da = dict_vendor_da_alloc(ctx->dict, vsa_da, argv[1], vendor);
 			ctx->parent = vendor_da;
 			ctx->block_vendor = vendor;
 			continue;
@@ -2613,6 +2787,18 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 		goto error;
 	}
 	fclose(fp);
+
+	if (ctx->dict->cache) {
+		uint64_t size = statbuf.st_size;
+		int64_t mtime = statbuf.st_mtime;
+
+		dict_cache_put_byte(ctx->dict, DICT_CACHE_FILE);
+		dict_cache_put_str(ctx->dict, fn);
+		dict_cache_put(ctx->dict, &size, sizeof(size));
+		dict_cache_put(ctx->dict, &mtime, sizeof(mtime));
+		dict_cache_put_num(ctx->dict, hash);
+	}
+
 	return 0;
 }
 
@@ -2630,6 +2816,352 @@ static int dict_from_file(fr_dict_t *dict,
 	return _dict_from_file(&ctx, dir_name, filename, src_file, src_line);
 }
 
+/*
+ *	The cache is only read by the same build which wrote it, so
+ *	everything is in host byte order.
+ */
+#define DICT_CACHE_VERSION	(1)
+
+typedef struct dict_cache_hdr_t {
+	uint64_t		magic;		//!< RADIUSD_MAGIC_NUMBER.
+	uint32_t		version;	//!< DICT_CACHE_VERSION.
+	uint32_t		flags_size;	//!< sizeof(fr_dict_attr_flags_t).
+	uint64_t		len;		//!< Of the records which follow.
+	uint32_t		hash;		//!< Of the records which follow.
+	uint32_t		pad;
+} dict_cache_hdr_t;
+
+typedef struct dict_cache_cursor_t {
+	uint8_t const		*p;
+	uint8_t const		*end;
+} dict_cache_cursor_t;
+
+static int dict_cache_get(dict_cache_cursor_t *c, void *out, size_t len)
+{
+	if ((size_t) (c->end - c->p) < len) {
+		fr_strerror_printf("Dictionary cache is truncated");
+		return -1;
+	}
+
+	memcpy(out, c->p, len);
+	c->p += len;
+
+	return 0;
+}
+
+static int dict_cache_get_byte(dict_cache_cursor_t *c, uint8_t *out)
+{
+	return dict_cache_get(c, out, sizeof(*out));
+}
+
+static int dict_cache_get_num(dict_cache_cursor_t *c, uint32_t *out)
+{
+	return dict_cache_get(c, out, sizeof(*out));
+}
+
+/*
+ *	Strings point into the mapped file.
+ */
+static int dict_cache_get_str(dict_cache_cursor_t *c, char const **out)
+{
+	uint16_t len;
+
+	if (dict_cache_get(c, &len, sizeof(len)) < 0) return -1;
+
+	if ((len == 0) || ((size_t) (c->end - c->p) < len) || (c->p[len - 1] != '\0')) {
+		fr_strerror_printf("Dictionary cache contains an invalid string");
+		return -1;
+	}
+
+	*out = (char const *) c->p;
+	c->p += len;
+
+	return 0;
+}
+
+/*
+ *	With dict == NULL, just skip over the attribute.
+ */
+static int dict_cache_get_da(dict_cache_cursor_t *c, fr_dict_t *dict, fr_dict_attr_t const **out)
+{
+	fr_dict_attr_t const	*da = dict ? dict->root : NULL;
+	uint8_t			depth, type;
+	uint32_t		attr;
+
+	if (dict_cache_get_byte(c, &depth) < 0) return -1;
+	if (depth > FR_DICT_MAX_TLV_STACK) {
+		fr_strerror_printf("Dictionary cache contains an invalid attribute");
+		return -1;
+	}
+
+	while (depth-- > 0) {
+		fr_dict_attr_t const *child;
+
+		if ((dict_cache_get_num(c, &attr) < 0) || (dict_cache_get_byte(c, &type) < 0)) return -1;
+		if (!dict) continue;
+
+		/*
+		 *	Attributes with the same number can have
+		 *	different types, so check both.
+		 */
+		child = da->children ? da->children[attr & 0xff] : NULL;
+		while (child && ((child->attr != attr) || (child->type != type))) child = child->next;
+		if (!child) {
+			fr_strerror_printf("Dictionary cache refers to an unknown attribute %u", attr);
+			return -1;
+		}
+		da = child;
+	}
+
+	if (out) *out = da;
+
+	return 0;
+}
+
+/** Hash a dictionary file the same way _dict_from_file() does
+ *
+ */
+static int dict_cache_file_hash(char const *file, uint32_t *out)
+{
+	FILE		*fp;
+	char		buf[256];
+	uint32_t	hash = 0;
+
+	fp = fopen(file, "r");
+	if (!fp) return -1;
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) hash = fr_hash_update(buf, strlen(buf), hash);
+	fclose(fp);
+
+	*out = hash;
+
+	return 0;
+}
+
+/** Check, and then replay, the records in a dictionary cache
+ *
+ * @param[in] dict	to load records into.  If NULL, the records are only checked.
+ * @param[in] c		cursor over the records.
+ * @param[in] dir	passed to fr_dict_from_file().
+ * @param[in] fn	passed to fr_dict_from_file().
+ * @param[in] name	passed to fr_dict_from_file().
+ * @return
+ *	- 1 if the records were loaded, or would be.
+ *	- 0 if the cache doesn't match the dictionary files.
+ *	- -1 on error.
+ */
+static int dict_cache_records(fr_dict_t *dict, dict_cache_cursor_t *c,
+			      char const *dir, char const *fn, char const *name)
+{
+	uint8_t			op, type, length, continuation;
+	uint32_t		num, attr_type;
+	char const		*str, *str2, *str3;
+	fr_dict_attr_t const	*parent;
+	fr_dict_attr_flags_t	flags;
+	bool			source = false;
+
+	while (c->p < c->end) {
+		if (dict_cache_get_byte(c, &op) < 0) return -1;
+
+		switch (op) {
+		case DICT_CACHE_SOURCE:
+			if ((dict_cache_get_str(c, &str) < 0) || (dict_cache_get_str(c, &str2) < 0) ||
+			    (dict_cache_get_str(c, &str3) < 0)) return -1;
+			if ((strcmp(str, dir) != 0) || (strcmp(str2, fn) != 0) || (strcmp(str3, name) != 0)) return 0;
+			source = true;
+			break;
+
+		case DICT_CACHE_FILE:
+		{
+			uint64_t	size;
+			int64_t		mtime;
+			uint32_t	hash;
+			struct stat	statbuf;
+
+			if ((dict_cache_get_str(c, &str) < 0) || (dict_cache_get(c, &size, sizeof(size)) < 0) ||
+			    (dict_cache_get(c, &mtime, sizeof(mtime)) < 0) || (dict_cache_get_num(c, &num) < 0)) return -1;
+
+			if (stat(str, &statbuf) < 0) return 0;
+
+			if (dict) {
+				dict_stat_add(dict, &statbuf);
+				fr_rand_seed(&statbuf, sizeof(statbuf));
+				break;
+			}
+
+			/*
+			 *	Deployment tools sometimes preserve
+			 *	mtimes, so check the contents too.
+			 */
+			if (((uint64_t) statbuf.st_size != size) || ((int64_t) statbuf.st_mtime != mtime)) return 0;
+			if ((dict_cache_file_hash(str, &hash) < 0) || (hash != num)) return 0;
+		}
+			break;
+
+		case DICT_CACHE_VENDOR:
+			if ((dict_cache_get_str(c, &str) < 0) || (dict_cache_get_num(c, &num) < 0) ||
+			    (dict_cache_get_byte(c, &type) < 0) || (dict_cache_get_byte(c, &length) < 0) ||
+			    (dict_cache_get_byte(c, &continuation) < 0)) return -1;
+
+			if (dict) {
+				fr_dict_vendor_t const	*dv;
+				fr_dict_vendor_t	*mutable;
+
+				if (fr_dict_vendor_add(dict, str, num) < 0) return -1;
+
+				dv = fr_dict_vendor_by_num(dict, num);
+				if (!dv) return -1;
+
+				memcpy(&mutable, &dv, sizeof(mutable));
+				mutable->type = type;
+				mutable->length = length;
+				mutable->flags = continuation;
+			}
+			break;
+
+		case DICT_CACHE_VSA:
+			if (dict_cache_get_da(c, dict, &parent) < 0) return -1;
+
+			if (dict) dict_vsa_da_alloc(dict, parent);
+			break;
+
+		case DICT_CACHE_VENDOR_DA:
+			if ((dict_cache_get_da(c, dict, &parent) < 0) || (dict_cache_get_str(c, &str) < 0) ||
+			    (dict_cache_get_num(c, &num) < 0)) return -1;
+
+			if (dict) dict_vendor_da_alloc(dict, parent, str, num);
+			break;
+
+		case DICT_CACHE_ATTR:
+			if ((dict_cache_get_da(c, dict, &parent) < 0) || (dict_cache_get_str(c, &str) < 0) ||
+			    (dict_cache_get_num(c, &num) < 0) || (dict_cache_get_num(c, &attr_type) < 0) ||
+			    (dict_cache_get(c, &flags, sizeof(flags)) < 0)) return -1;
+
+			if (dict && (fr_dict_attr_add(dict, parent, str, (int) num, attr_type, flags) < 0)) return -1;
+			break;
+
+		case DICT_CACHE_ENUM:
+			if ((dict_cache_get_str(c, &str) < 0) || (dict_cache_get_str(c, &str2) < 0) ||
+			    (dict_cache_get_num(c, &num) < 0)) return -1;
+
+			if (dict && (fr_dict_enum_add(dict, str, str2, (int) num) < 0)) return -1;
+			break;
+
+		default:
+			fr_strerror_printf("Dictionary cache contains an invalid record %u", op);
+			return -1;
+		}
+	}
+
+	return source ? 1 : 0;
+}
+
+/** Load a dictionary from a cache written by dict_cache_write()
+ *
+ * @return
+ *	- 1 if the dictionary was loaded.
+ *	- 0 if the cache is missing, or out of date.
+ *	- -1 if the cache was partially loaded.  The dictionary is unusable.
+ */
+static int dict_cache_load(fr_dict_t *dict, char const *file, char const *dir, char const *fn, char const *name)
+{
+	int			fd, rcode;
+	struct stat		statbuf;
+	uint8_t			*map;
+	dict_cache_hdr_t	hdr;
+	dict_cache_cursor_t	c;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) return 0;
+
+	if ((fstat(fd, &statbuf) < 0) || !S_ISREG(statbuf.st_mode) ||
+	    ((size_t) statbuf.st_size < sizeof(hdr))) {
+		close(fd);
+		return 0;
+	}
+
+#ifdef S_IWOTH
+	/*
+	 *	Same rules as for the dictionaries.
+	 */
+	if ((statbuf.st_mode & S_IWOTH) != 0) {
+		close(fd);
+		return 0;
+	}
+#endif
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if ((hdr.magic != RADIUSD_MAGIC_NUMBER) || (hdr.version != DICT_CACHE_VERSION) ||
+	    (hdr.flags_size != sizeof(fr_dict_attr_flags_t)) ||
+	    (hdr.len != (statbuf.st_size - sizeof(hdr))) ||
+	    (hdr.hash != fr_hash(map + sizeof(hdr), hdr.len))) {
+		rcode = 0;
+		goto done;
+	}
+
+	/*
+	 *	Check everything before changing the dictionary,
+	 *	so that we can still fall back to the files.
+	 */
+	c.p = map + sizeof(hdr);
+	c.end = c.p + hdr.len;
+	rcode = dict_cache_records(NULL, &c, dir, fn, name);
+	if (rcode <= 0) {
+		rcode = 0;
+		goto done;
+	}
+
+	c.p = map + sizeof(hdr);
+	rcode = dict_cache_records(dict, &c, dir, fn, name);
+	if (rcode <= 0) rcode = -1;
+
+done:
+	munmap(map, statbuf.st_size);
+
+	return rcode;
+}
+
+/** Write the records for a dictionary to a cache file
+ *
+ * The file is written to a temporary name, and then renamed, so
+ * processes starting at the same time never see a partial cache.
+ */
+static void dict_cache_write(dict_cache_t *cache, char const *file)
+{
+	char			*tmp;
+	int			fd;
+	dict_cache_hdr_t	hdr;
+
+	if (cache->failed) return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RADIUSD_MAGIC_NUMBER;
+	hdr.version = DICT_CACHE_VERSION;
+	hdr.flags_size = sizeof(fr_dict_attr_flags_t);
+	hdr.len = cache->used;
+	hdr.hash = fr_hash(cache->buf, cache->used);
+
+	tmp = talloc_asprintf(cache, "%s.XXXXXX", file);
+	if (!tmp) return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) return;
+
+	if ((fchmod(fd, 0644) < 0) ||
+	    (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+	    (write(fd, cache->buf, cache->used) != (ssize_t) cache->used)) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp, file) < 0) unlink(tmp);
+}
 
 static bool defined_cast_types = false;
 
@@ -2639,6 +3171,11 @@ static bool defined_cast_types = false;
  *
  * First dictionary initialised will be set as the default internal dictionary.
  *
+ * If the FR_DICTIONARY_CACHE environment variable is set, it names a
+ * cache file.  The cache is used instead of the dictionary files if
+ * none of them have changed.  Otherwise it is re-written after the
+ * files have been read.
+ *
  * @param[in] ctx to allocate the dictionary from.
  * @param[out] out Where to write a pointer to the new dictionary.  Will free existing
  *	dictionary if files have changed and *out is not NULL.
@@ -2651,7 +3188,8 @@ static bool defined_cast_types = false;
  */
 int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *fn, char const *name)
 {
-	fr_dict_t *dict;
+	fr_dict_t	*dict;
+	char const	*cache_file;
 
 	if (!*out) {
 		/* Pre-Allocate 5MB of pool memory for rapid startup */
@@ -2762,8 +3300,44 @@ int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char co
 		defined_cast_types = true;
 	}
 
+	/*
+	 *	Loading a dictionary cache is faster than parsing
+	 *	the files.  If there's no usable cache, we parse the
+	 *	files, recording what they define, and write a new
+	 *	cache.
+	 */
+	cache_file = getenv("FR_DICTIONARY_CACHE");
+	if (cache_file && *cache_file) {
+		switch (dict_cache_load(dict, cache_file, dir, fn, name)) {
+		case 1:
+			goto fixup;
+
+		case 0:
+			break;
+
+		default:
+			fr_strerror_printf("Failed loading dictionary cache %s: %s", cache_file, fr_strerror());
+			goto error;
+		}
+
+		dict->cache = talloc_zero(dict, dict_cache_t);
+		if (dict->cache) {
+			dict_cache_put_byte(dict, DICT_CACHE_SOURCE);
+			dict_cache_put_str(dict, dir);
+			dict_cache_put_str(dict, fn);
+			dict_cache_put_str(dict, name);
+		}
+	}
+
 	if (dict_from_file(dict, dir, fn, NULL, 0) < 0) goto error;
 
+	if (dict->cache) {
+		dict_cache_write(dict->cache, cache_file);
+		TALLOC_FREE(dict->cache);
+	}
+
+fixup:
+
 	if (dict->enum_fixup) {
 		fr_dict_attr_t const *a;
 		dict_enum_fixup_t *this, *next;
@@ -3918,6 +4492,234 @@ fr_dict_attr_t const *fr_dict_vendor_attr_by_num(fr_dict_t *dict, unsigned int v
 	return da;
 }
 
+/** Case insensitive 64-bit FNV-1a hash of an attribute name
+ *
+ */
+static uint64_t dict_frozen_hash(char const *name, size_t len)
+{
+	uint64_t	hash = 0xcbf29ce484222325ULL;
+	size_t		i;
+
+	for (i = 0; i < len; i++) {
+		int c = ((uint8_t const *) name)[i];
+
+		if (isalpha(c)) c = tolower(c);
+		hash ^= (uint64_t) c;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static inline uint32_t dict_frozen_bucket(dict_frozen_t const *frozen, uint64_t hash)
+{
+	return (uint32_t) hash % frozen->num_buckets;
+}
+
+static inline uint32_t dict_frozen_slot(dict_frozen_t const *frozen, uint64_t hash, uint32_t disp)
+{
+	uint64_t x = (hash >> 32) ^ ((uint64_t) disp * 0x9e3779b97f4a7c15ULL);
+
+	x ^= x >> 29;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 32;
+
+	return (uint32_t) (x % frozen->num_slots);
+}
+
+/** Find an attribute in the frozen index
+ *
+ * @param[in] frozen index.
+ * @param[in] name to find.  Does not have to be '\0' terminated.
+ * @param[in] len of the name.
+ * @return
+ *	- The attribute.
+ *	- NULL if no attribute has that name.
+ */
+static fr_dict_attr_t const *dict_frozen_find(dict_frozen_t const *frozen, char const *name, size_t len)
+{
+	uint64_t		hash;
+	fr_dict_attr_t const	*da;
+
+	hash = dict_frozen_hash(name, len);
+	da = frozen->slots[dict_frozen_slot(frozen, hash, frozen->disp[dict_frozen_bucket(frozen, hash)])];
+	if (!da || (strncasecmp(da->name, name, len) != 0) || (da->name[len] != '\0')) return NULL;
+
+	return da;
+}
+
+typedef struct {
+	fr_dict_attr_t const	*da;
+	uint64_t		hash;
+	uint32_t		bucket;
+} dict_frozen_key_t;
+
+typedef struct {
+	dict_frozen_key_t	*keys;
+	uint32_t		num;
+} dict_frozen_walk_t;
+
+static int _dict_frozen_collect(void *ctx, void *data)
+{
+	dict_frozen_walk_t	*walk = ctx;
+	fr_dict_attr_t const	*da = data;
+
+	walk->keys[walk->num].da = da;
+	walk->keys[walk->num].hash = dict_frozen_hash(da->name, strlen(da->name));
+	walk->num++;
+
+	return 0;
+}
+
+/** Sort keys so that the largest buckets are placed first
+ *
+ */
+static int dict_frozen_key_cmp(void const *one, void const *two)
+{
+	dict_frozen_key_t const *a = one, *b = two;
+
+	if (a->bucket < b->bucket) return -1;
+	if (a->bucket > b->bucket) return +1;
+	return 0;
+}
+
+typedef struct {
+	uint32_t	start;
+	uint32_t	num;
+} dict_frozen_bucket_t;
+
+static int dict_frozen_bucket_cmp(void const *one, void const *two)
+{
+	dict_frozen_bucket_t const *a = one, *b = two;
+
+	if (a->num > b->num) return -1;
+	if (a->num < b->num) return +1;
+	return 0;
+}
+
+/** Build a read-only index of attribute names
+ *
+ * Should be called once all dictionaries have been loaded, and all
+ * dynamic attributes have been defined.  Lookups by name then use a
+ * minimal perfect hash, instead of the hash table.
+ *
+ * Adding an attribute after the dictionary has been frozen discards
+ * the index, and lookups go back to using the hash table.  Calling
+ * this function again re-builds the index.
+ *
+ * @param[in] dict to freeze.  If NULL the internal dictionary will be used.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The dictionary is still usable.
+ */
+int fr_dict_freeze(fr_dict_t *dict)
+{
+	dict_frozen_t		*frozen;
+	dict_frozen_walk_t	walk;
+	dict_frozen_bucket_t	*buckets;
+	uint32_t		i, j, num;
+	uint32_t		*slot_of;
+
+	INTERNAL_IF_NULL(dict);
+
+	TALLOC_FREE(dict->frozen);
+
+	num = fr_hash_table_num_elements(dict->attributes_by_name);
+	if (num == 0) return 0;
+
+	frozen = talloc_zero(dict, dict_frozen_t);
+	if (!frozen) {
+	oom:
+		fr_strerror_printf("Out of memory");
+	error:
+		talloc_free(frozen);
+		return -1;
+	}
+
+	frozen->num_slots = num;
+	frozen->num_buckets = (num / 4) + 1;
+
+	frozen->slots = talloc_zero_array(frozen, fr_dict_attr_t const *, frozen->num_slots);
+	frozen->disp = talloc_zero_array(frozen, uint32_t, frozen->num_buckets);
+	walk.keys = talloc_array(frozen, dict_frozen_key_t, num);
+	buckets = talloc_zero_array(frozen, dict_frozen_bucket_t, frozen->num_buckets);
+	slot_of = talloc_array(frozen, uint32_t, num);
+	if (!frozen->slots || !frozen->disp || !walk.keys || !buckets || !slot_of) goto oom;
+
+	walk.num = 0;
+	(void) fr_hash_table_walk(dict->attributes_by_name, _dict_frozen_collect, &walk);
+	if (!fr_cond_assert(walk.num == num)) goto error;
+
+	/*
+	 *	Group the keys by bucket, and place the largest
+	 *	buckets first, while there are lots of free slots.
+	 */
+	for (i = 0; i < num; i++) walk.keys[i].bucket = dict_frozen_bucket(frozen, walk.keys[i].hash);
+	qsort(walk.keys, num, sizeof(walk.keys[0]), dict_frozen_key_cmp);
+
+	for (i = 0; i < num; i++) {
+		dict_frozen_bucket_t *b = &buckets[walk.keys[i].bucket];
+
+		if (!b->num) b->start = i;
+		b->num++;
+	}
+
+	/*
+	 *	The keys still record which bucket they're in, so the
+	 *	buckets can be sorted by size.
+	 */
+	qsort(buckets, frozen->num_buckets, sizeof(buckets[0]), dict_frozen_bucket_cmp);
+
+	for (i = 0; (i < frozen->num_buckets) && buckets[i].num; i++) {
+		dict_frozen_key_t	*keys = &walk.keys[buckets[i].start];
+		uint32_t		disp;
+
+		/*
+		 *	Names with the same hash always collide.
+		 */
+		for (j = 1; j < buckets[i].num; j++) {
+			uint32_t k;
+
+			for (k = 0; k < j; k++) if (keys[k].hash == keys[j].hash) break;
+			if (k < j) {
+				fr_strerror_printf("Attributes \"%s\" and \"%s\" have the same hash",
+						   keys[k].da->name, keys[j].da->name);
+				goto error;
+			}
+		}
+
+		for (disp = 0; disp < (1 << 24); disp++) {
+			for (j = 0; j < buckets[i].num; j++) {
+				uint32_t k, slot = dict_frozen_slot(frozen, keys[j].hash, disp);
+
+				if (frozen->slots[slot]) break;
+
+				for (k = 0; k < j; k++) if (slot_of[k] == slot) break;
+				if (k < j) break;
+
+				slot_of[j] = slot;
+			}
+			if (j == buckets[i].num) break;
+		}
+
+		if (disp == (1 << 24)) {
+			fr_strerror_printf("Failed finding perfect hash for attribute names");
+			goto error;
+		}
+
+		frozen->disp[keys[0].bucket] = disp;
+		for (j = 0; j < buckets[i].num; j++) frozen->slots[slot_of[j]] = keys[j].da;
+	}
+
+	talloc_free(walk.keys);
+	talloc_free(buckets);
+	talloc_free(slot_of);
+
+	dict->frozen = frozen;
+
+	return 0;
+}
+
 /** Look up a dictionary attribute by a name embedded in another string
  *
  * Find the first invalid attribute name char in the string pointed
@@ -3964,6 +4766,18 @@ fr_dict_attr_t const *fr_dict_attr_by_name_substr(fr_dict_t *dict, char const **
 		fr_strerror_printf("Attribute name too long");
 		return NULL;
 	}
+
+	/*
+	 *	The frozen index doesn't need a copy of the name.
+	 */
+	if (dict->frozen) {
+		da = dict_frozen_find(dict->frozen, *name, len);
+		if (da) {
+			*name = p;
+			return da;
+		}
+	}
+
 	strlcpy(find->name, *name, len + 1);
 
 	da = fr_hash_table_finddata(dict->attributes_by_name, find);
@@ -3995,6 +4809,14 @@ fr_dict_attr_t const *fr_dict_attr_by_name(fr_dict_t *dict, char const *name)
 	if (!name) return NULL;
 	INTERNAL_IF_NULL(dict);
 
+	if (dict->frozen) {
+		size_t len = strlen(name);
+
+		if (len > FR_DICT_ATTR_MAX_NAME_LEN) len = FR_DICT_ATTR_MAX_NAME_LEN;
+
+		return dict_frozen_find(dict->frozen, name, len);
+	}
+
 	da = (fr_dict_attr_t *)buffer;
 	strlcpy(da->name, name, FR_DICT_ATTR_MAX_NAME_LEN + 1);
 
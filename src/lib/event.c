@@ -31,11 +31,90 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/event.h>
 
+#ifdef FR_EVENT_EPOLL
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+
+/*
+ *	The epoll data for each registration says what it is.  Talloc
+ *	pointers are aligned, so the low two bits are free.
+ *
+ *	- fr_event_fd_t pointers, for FDs in an event list.
+ *	- (fd << 2), for FDs added with fr_event_kq_fd_add().
+ *	- (ident << 34) | (eventfd << 2), for user events.
+ */
+#  define FR_EVENT_EPOLL_PTR	(0)
+#  define FR_EVENT_EPOLL_FD	(1)
+#  define FR_EVENT_EPOLL_USER	(2)
+#  define FR_EVENT_EPOLL_MASK	(3)
+#  define FR_EVENT_EPOLL_IDENT_MAX	((uintptr_t) 1 << 30)
+#endif
+
+/*
+ *	io_uring is used for receiving datagrams, if the kernel headers
+ *	know about multishot receives.  Everything else still goes
+ *	through epoll.
+ */
+#if defined(FR_EVENT_EPOLL) && defined(HAVE_LINUX_IO_URING_H)
+#  include <linux/io_uring.h>
+#  ifdef IORING_RECV_MULTISHOT
+#    define FR_EVENT_URING (1)
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+
+#    ifndef MAP_ANONYMOUS
+#      define MAP_ANONYMOUS MAP_ANON
+#    endif
+
+/*
+ *	The number of submission queue entries.  We only submit when a
+ *	receive is added, re-armed, or cancelled, so this can be small.
+ *	The completion queue is much larger, as each datagram is a
+ *	completion.
+ */
+#    define FR_EVENT_URING_ENTRIES	(64)
+#    define FR_EVENT_URING_CQ_ENTRIES	(4096)
+
+/*
+ *	The number of buffers for each socket.  It must be a power
+ *	of 2.
+ */
+#    define FR_EVENT_RECV_BUFFERS	(256)
+
+typedef struct fr_event_uring_t fr_event_uring_t;
+typedef struct fr_event_recv_t fr_event_recv_t;
+#  endif
+#endif
+
 #define FR_EV_BATCH_FDS (256)
 
 #undef USEC
 #define USEC (1000000)
 
+/*
+ *	Timers are kept in a hierarchical timing wheel, with a tick of
+ *	one millisecond.  Each level has 256 slots.  Level 0 holds the
+ *	timers for the next 256 ticks, one tick per slot.  Each slot in
+ *	level 1 holds 256 ticks, and each slot in level 2 holds 65536
+ *	ticks.  So the wheel covers about 4.6 hours.
+ *
+ *	Inserting or deleting a timer in the wheel is O(1).  As time
+ *	moves forward, the slots of the higher levels are "cascaded"
+ *	down into the lower levels.  When a level 0 slot becomes due,
+ *	its timers are moved to the heap, which orders them exactly.
+ *
+ *	The heap also holds timers which are in the past when they are
+ *	inserted, and timers which are too far away for the wheel.  So
+ *	it stays small, even when there are many timers.
+ */
+#define FR_EVENT_WHEEL_TICK_USEC	(1000)
+#define FR_EVENT_WHEEL_BITS		(8)
+#define FR_EVENT_WHEEL_SLOTS		(1 << FR_EVENT_WHEEL_BITS)
+#define FR_EVENT_WHEEL_MASK		(FR_EVENT_WHEEL_SLOTS - 1)
+#define FR_EVENT_WHEEL_LEVELS		(3)
+
+#define FR_EVENT_IN_HEAP		(-1)
+
 /** A timer event
  *
  */
@@ -46,6 +125,10 @@ struct fr_event_timer_t {
 
 	fr_event_timer_t	**parent;		//!< Previous timer.
 	int			heap;			//!< Where to store opaque heap data.
+
+	int			level;			//!< Wheel level, or FR_EVENT_IN_HEAP.
+	fr_event_timer_t	*wheel_next;		//!< Next timer in the same wheel slot.
+	fr_event_timer_t	**wheel_prev;		//!< Pointer to us, in the previous timer of the slot.
 };
 
 /** A file descriptor event
@@ -75,6 +158,11 @@ typedef struct fr_event_fd_t {
  */
 struct fr_event_list_t {
 	fr_heap_t		*times;			//!< of timer events to be executed.
+
+	uint64_t		wheel_now;		//!< The first tick which hasn't been processed.
+	int			wheel_count[FR_EVENT_WHEEL_LEVELS];	//!< Number of timers in each level.
+	fr_event_timer_t	*wheel[FR_EVENT_WHEEL_LEVELS][FR_EVENT_WHEEL_SLOTS];	//!< Timers in the wheel.
+
 	rbtree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 
 	int			exit;
@@ -90,12 +178,74 @@ struct fr_event_list_t {
 	int			num_fd_events;		//!< Number of events in this event list.
 
 	int			kq;			//!< instance associated with this event list.
+	int			exit_fd;		//!< handle for the "exit" user event.
 
 	fr_event_user_handler_t user;			//!< callback for EVFILT_USER events
 	void			*user_ctx;		//!< Context pointer to pass to the user callback.
 
 	struct kevent		events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#ifdef FR_EVENT_EPOLL
+	struct epoll_event	epoll_events[FR_EV_BATCH_FDS];
+#endif
+
+#ifdef FR_EVENT_URING
+	fr_event_uring_t	*uring;			//!< io_uring for receiving datagrams, created on first use.
+	rbtree_t		*recvs;			//!< sockets which are being read by io_uring.
+#endif
+};
+
+#ifdef FR_EVENT_URING
+/** An io_uring instance
+ *
+ */
+struct fr_event_uring_t {
+	int			fd;			//!< the io_uring.
+	fr_event_list_t		*el;			//!< the event list we belong to.
+
+	void			*sq_ring;		//!< mapped submission queue ring.
+	size_t			sq_ring_size;		//!< size of the submission queue mapping.
+	uint32_t		*sq_head;		//!< consumed by the kernel.
+	uint32_t		*sq_tail;		//!< produced by us.
+	uint32_t		sq_mask;		//!< for indexing the submission queue.
+	uint32_t		sq_entries;		//!< size of the submission queue.
+	uint32_t		*sq_array;		//!< indexes into sqes.
+	struct io_uring_sqe	*sqes;			//!< submission queue entries.
+	size_t			sqes_size;		//!< size of the sqes mapping.
+	uint32_t		pending;		//!< entries which haven't been submitted.
+
+	void			*cq_ring;		//!< mapped completion queue ring.
+	size_t			cq_ring_size;		//!< size of the completion queue mapping.
+	uint32_t		*cq_head;		//!< consumed by us.
+	uint32_t		*cq_tail;		//!< produced by the kernel.
+	uint32_t		cq_mask;		//!< for indexing the completion queue.
+	struct io_uring_cqe	*cqes;			//!< completion queue entries.
+
+	uint16_t		next_bgid;		//!< next buffer group ID.
+};
+
+/** A socket which is being read with a multishot receive
+ *
+ */
+struct fr_event_recv_t {
+	int			fd;			//!< socket we're receiving datagrams on.
+	int			uring_fd;		//!< io_uring the buffers are registered with.
+
+	fr_event_recv_handler_t	recv;			//!< callback for each datagram.
+	fr_event_fd_handler_t	error;			//!< callback for when the receive fails.
+	void			*ctx;			//!< context pointer for the callbacks.
+
+	struct msghdr		msg;			//!< how much room to leave for the name and control data.
+
+	uint16_t		bgid;			//!< buffer group ID.
+	struct io_uring_buf_ring *br;			//!< ring of buffers for the kernel to use.
+	size_t			br_size;		//!< size of the ring mapping.
+	uint8_t			*buffers;		//!< the buffers themselves.
+	size_t			buffer_size;		//!< size of each buffer.
+
+	bool			armed;			//!< the kernel has a receive outstanding.
+	bool			deleted;		//!< waiting for the receive to be cancelled.
 };
+#endif
 
 /** Compare two timer events to see which one should occur first
  *
@@ -156,9 +306,14 @@ int fr_event_list_num_fds(fr_event_list_t *el)
  */
 int fr_event_list_num_elements(fr_event_list_t *el)
 {
+	int i, num;
+
 	if (!el) return -1;
 
-	return fr_heap_num_elements(el->times);
+	num = fr_heap_num_elements(el->times);
+	for (i = 0; i < FR_EVENT_WHEEL_LEVELS; i++) num += el->wheel_count[i];
+
+	return num;
 }
 
 /** Return the kq associated with an event list.
@@ -191,213 +346,1323 @@ int fr_event_list_time(struct timeval *when, fr_event_list_t *el)
 {
 	if (!when) return -1;
 
-	if (el && el->dispatch) {
-		*when = el->now;
-	} else {
-		gettimeofday(when, NULL);
+	if (el && el->dispatch) {
+		*when = el->now;
+	} else {
+		gettimeofday(when, NULL);
+	}
+
+	return 1;
+}
+
+#ifdef FR_EVENT_EPOLL
+/** Convert epoll events to kevents
+ *
+ *  One epoll event may become two kevents, one for reading and one
+ *  for writing.  If there isn't room for them all, the rest are left
+ *  alone.  Everything is level triggered, so epoll will return them
+ *  again next time.
+ *
+ *  User events are cleared here, by reading their eventfd.
+ *
+ * @param[out] out	where the kevents are written.
+ * @param[in] num	the maximum number of kevents to write.
+ * @param[in] in	the epoll events.
+ * @param[in] num_in	the number of epoll events.
+ * @return the number of kevents written.
+ */
+static int fr_event_epoll_to_kevent(struct kevent *out, int num, struct epoll_event const *in, int num_in)
+{
+	int		i, n = 0;
+
+	for (i = 0; (i < num_in) && (n < num); i++) {
+		uint64_t	data = in[i].data.u64;
+		uint16_t	flags = 0;
+		uintptr_t	ident;
+		void		*udata = NULL;
+
+		if ((data & FR_EVENT_EPOLL_MASK) == FR_EVENT_EPOLL_USER) {
+			uint64_t count;
+
+			(void) read((int) ((data >> 2) & 0xffffffff), &count, sizeof(count));
+
+			memset(&out[n], 0, sizeof(out[n]));
+			out[n].ident = data >> 34;
+			out[n].filter = EVFILT_USER;
+			n++;
+			continue;
+		}
+
+		if ((data & FR_EVENT_EPOLL_MASK) == FR_EVENT_EPOLL_FD) {
+			ident = data >> 2;
+		} else {
+			udata = (void *) (uintptr_t) data;
+			ident = ((fr_event_fd_t *) udata)->fd;
+		}
+
+		if (in[i].events & EPOLLERR) flags |= EV_ERROR;
+		if (in[i].events & (EPOLLHUP | EPOLLRDHUP)) flags |= EV_EOF;
+
+		/*
+		 *	Errors are reported once, on the read filter if
+		 *	there is one.
+		 */
+		if ((in[i].events & EPOLLIN) || (flags && !(in[i].events & EPOLLOUT))) {
+			memset(&out[n], 0, sizeof(out[n]));
+			out[n].ident = ident;
+			out[n].filter = EVFILT_READ;
+			out[n].flags = flags;
+			out[n].udata = udata;
+			n++;
+
+			if (flags) continue;
+		}
+
+		if ((in[i].events & EPOLLOUT) && (n < num)) {
+			memset(&out[n], 0, sizeof(out[n]));
+			out[n].ident = ident;
+			out[n].filter = EVFILT_WRITE;
+			out[n].flags = flags;
+			out[n].udata = udata;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/** Wait for epoll events, and convert them to kevents
+ *
+ * @param[in] kq	the epoll instance.
+ * @param[in] buffer	for the epoll events.
+ * @param[in] events	where the kevents are written.
+ * @param[in] num	the size of buffer, and of events.
+ * @param[in] ts	how long to wait.  NULL means forever.
+ * @return
+ *	- <0 on error.
+ *	- the number of kevents.
+ */
+static int fr_event_epoll_wait(int kq, struct epoll_event *buffer, struct kevent *events, int num,
+			       struct timespec const *ts)
+{
+	int timeout = -1;
+	int rcode;
+
+	/*
+	 *	Round the timeout up, so that we don't wake up just
+	 *	before a timer is due, and then spin.
+	 */
+	if (ts) timeout = (ts->tv_sec * 1000) + ((ts->tv_nsec + 999999) / 1000000);
+
+	rcode = epoll_wait(kq, buffer, num, timeout);
+	if (rcode <= 0) return rcode;
+
+	return fr_event_epoll_to_kevent(events, num, buffer, rcode);
+}
+#endif
+
+/** Create a new kqueue
+ *
+ *  On Linux, this is an epoll instance.  It can only be used with the
+ *  fr_event_kq_* functions, and not with kevent().
+ *
+ * @return
+ *	- <0 on error.
+ *	- the new kqueue.
+ */
+int fr_event_kq_create(void)
+{
+#ifdef FR_EVENT_EPOLL
+	return epoll_create1(EPOLL_CLOEXEC);
+#else
+	return kqueue();
+#endif
+}
+
+/** Wait for events on a kqueue which isn't part of an event list
+ *
+ * @param[in] kq	from #fr_event_kq_create.
+ * @param[out] events	where the events are written.
+ * @param[in] num	the maximum number of events to return.
+ * @param[in] ts	how long to wait.  NULL means forever.
+ * @return
+ *	- <0 on error.
+ *	- the number of events.
+ */
+int fr_event_kq_wait(int kq, struct kevent *events, int num, struct timespec const *ts)
+{
+#ifdef FR_EVENT_EPOLL
+	struct epoll_event buffer[64];
+
+	if (num > (int) (sizeof(buffer) / sizeof(buffer[0]))) num = sizeof(buffer) / sizeof(buffer[0]);
+
+	return fr_event_epoll_wait(kq, buffer, events, num, ts);
+#else
+	return kevent(kq, NULL, 0, events, num, ts);
+#endif
+}
+
+/** Add a read or write filter for an FD to a kqueue which isn't part of an event list
+ *
+ *  The events for the FD have ident set to the FD, and udata set to NULL.
+ *
+ * @param[in] kq	from #fr_event_kq_create.
+ * @param[in] fd	to add.
+ * @param[in] filter	EVFILT_READ or EVFILT_WRITE.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+int fr_event_kq_fd_add(int kq, int fd, int filter)
+{
+#ifdef FR_EVENT_EPOLL
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (filter == EVFILT_WRITE) ? EPOLLOUT : EPOLLIN;
+	ev.data.u64 = ((uint64_t) fd << 2) | FR_EVENT_EPOLL_FD;
+
+	if (epoll_ctl(kq, EPOLL_CTL_ADD, fd, &ev) == 0) return 0;
+	if (errno != EEXIST) return -1;
+
+	/*
+	 *	Already there with the other filter, so it now has both.
+	 */
+	ev.events = EPOLLIN | EPOLLOUT;
+	return epoll_ctl(kq, EPOLL_CTL_MOD, fd, &ev);
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, fd, filter, EV_ADD | EV_ENABLE, 0, 0, NULL);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/** Add a user event to a kqueue
+ *
+ *  Triggering a user event more than once before it's seen results in
+ *  one event.  That event has filter EVFILT_USER, and the ident
+ *  given here.
+ *
+ * @param[in] kq	to add the user event to.
+ * @param[in] ident	of the user event.
+ * @return
+ *	- <0 on error.
+ *	- a handle to pass to #fr_event_kq_user_trigger and #fr_event_kq_user_delete.
+ */
+int fr_event_kq_user_add(int kq, uintptr_t ident)
+{
+#ifdef FR_EVENT_EPOLL
+	int fd;
+	struct epoll_event ev;
+
+	if (ident >= FR_EVENT_EPOLL_IDENT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t) ident << 34) | ((uint64_t) fd << 2) | FR_EVENT_EPOLL_USER;
+
+	if (epoll_ctl(kq, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) return -1;
+
+	return kq;
+#endif
+}
+
+/** Trigger a user event
+ *
+ *  This function can be called from any thread.
+ *
+ * @param[in] handle	from #fr_event_kq_user_add.
+ * @param[in] ident	of the user event.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+int fr_event_kq_user_trigger(int handle, uintptr_t ident)
+{
+#ifdef FR_EVENT_EPOLL
+	uint64_t one = 1;
+
+	(void) ident;
+
+	/*
+	 *	EAGAIN means the counter is full, so the event is
+	 *	already pending.
+	 */
+	if ((write(handle, &one, sizeof(one)) < 0) && (errno != EAGAIN)) return -1;
+
+	return 0;
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
+	return kevent(handle, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/** Delete a user event
+ *
+ * @param[in] kq	the user event was added to.
+ * @param[in] handle	from #fr_event_kq_user_add.
+ * @param[in] ident	of the user event.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+int fr_event_kq_user_delete(int kq, int handle, uintptr_t ident)
+{
+#ifdef FR_EVENT_EPOLL
+	(void) kq;
+	(void) ident;
+
+	/*
+	 *	Closing the eventfd removes it from the epoll set.
+	 */
+	return close(handle);
+#else
+	struct kevent kev;
+
+	(void) handle;
+
+	EV_SET(&kev, ident, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+	return kevent(kq, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/** Remove a file descriptor from the event loop
+ *
+ * @param[in] el	to remove file descriptor from.
+ * @param[in] fd	to remove.
+ * @return
+ *	- 0 if file descriptor was removed.
+ *	- <0 on error.
+ */
+int fr_event_fd_delete(fr_event_list_t *el, int fd)
+{
+	fr_event_fd_t *ef, find;
+
+	memset(&find, 0, sizeof(find));
+	find.fd = fd;
+
+	ef = rbtree_finddata(el->fds, &find);
+	if (!ef) {
+		fr_strerror_printf("No events is_registered for fd %i", fd);
+		return -1;
+	}
+
+	/*
+	 *	Defer the delete, so we don't free
+	 *	an ef structure that might still be
+	 *	in use within fr_event_service.
+	 */
+	if (ef->in_handler) {
+		ef->do_delete = true;
+
+		return 0;
+	}
+
+	/*
+	 *	Destructor may prevent ef from being
+	 *	freed if kevent de-registration fails.
+	 */
+	if (talloc_free(ef) < 0) return -1;
+
+	return 0;
+}
+
+/** Remove a file descriptor from the event loop
+ *
+ * @param[in] ef	to remove.
+ * @return 0;
+ */
+static int _fr_event_fd_free(fr_event_fd_t *ef)
+{
+	fr_event_list_t	*el = talloc_parent(ef);
+
+#ifdef FR_EVENT_EPOLL
+	/*
+	 *	If the FD has already been closed, epoll has already
+	 *	forgotten about it.
+	 */
+	if (ef->is_registered &&
+	    (epoll_ctl(el->kq, EPOLL_CTL_DEL, ef->fd, NULL) < 0) && (errno != EBADF) && (errno != ENOENT)) {
+		fr_strerror_printf("Failed removing filters for FD %i: %s", ef->fd, fr_syserror(errno));
+		return -1;
+	}
+#else
+	int		filter = 0;
+	struct kevent	evset;
+
+	if (ef->read) filter |= EVFILT_READ;
+	if (ef->write) filter |= EVFILT_WRITE;
+
+	if (ef->is_registered) {
+		EV_SET(&evset, ef->fd, filter, EV_DELETE, 0, 0, 0);
+		if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
+			fr_strerror_printf("Failed removing filters for FD %i: %s", ef->fd, fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+	rbtree_deletebydata(el->fds, ef);
+	ef->is_registered = false;
+
+	el->num_fds--;
+
+	return 0;
+}
+
+/** Associate a callback with an file descriptor
+ *
+ * @param[in] el	to insert fd callback into.
+ * @param[in] fd	to read from.
+ * @param[in] read_fn	function to call when fd is readable.
+ * @param[in] write_fn	function to call when fd is writable.
+ * @param[in] error	function to call when an error occurs on the fd.
+ * @param[in] ctx	to pass to handler.
+ * @return
+ *	- 0 on succes.
+ *	- -1 on failure.
+ */
+int fr_event_fd_insert(fr_event_list_t *el, int fd,
+		       fr_event_fd_handler_t read_fn,
+		       fr_event_fd_handler_t write_fn,
+		       fr_event_fd_handler_t error,
+		       void *ctx)
+{
+#ifdef FR_EVENT_EPOLL
+	struct epoll_event evset;
+#else
+	int	      	filter = 0;
+	struct kevent	evset;
+#endif
+	fr_event_fd_t	*ef, find;
+	bool		pre_existing;
+
+	if (!el) {
+		fr_strerror_printf("Invalid argument: NULL event list");
+		return -1;
+	}
+
+	if (!read_fn && !write_fn) {
+		fr_strerror_printf("Invalid arguments: NULL read and write callbacks");
+		return -1;
+	}
+
+	if (fd < 0) {
+		fr_strerror_printf("Invalid arguments: Bad FD %i", fd);
+		return -1;
+	}
+
+	if (el->exit) {
+		fr_strerror_printf("Event loop exiting");
+		return -1;
+	}
+
+	memset(&find, 0, sizeof(find));
+
+	/*
+	 *	Get the existing fr_event_fd_t if it exists.
+	 */
+	find.fd = fd;
+	ef = rbtree_finddata(el->fds, &find);
+	if (!ef) {
+		pre_existing = false;
+
+		ef = talloc_zero(el, fr_event_fd_t);
+		if (!ef) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		talloc_set_destructor(ef, _fr_event_fd_free);
+
+		el->num_fds++;
+
+		ef->fd = fd;
+
+		rbtree_insert(el->fds, ef);
+
+	/*
+	 *	Existing filters will be overwritten if there's
+	 *	a new filter which takes their place.  If there
+	 *	is no new filter however, we need to delete the
+	 *	existing one.
+	 */
+	} else {
+		pre_existing = true;
+
+#ifndef FR_EVENT_EPOLL
+		if (ef->read && !read_fn) filter |= EVFILT_READ;
+		if (ef->write && !write_fn) filter |= EVFILT_WRITE;
+
+		if (filter) {
+			EV_SET(&evset, ef->fd, filter, EV_DELETE, 0, 0, 0);
+
+			/*
+			 *	kevent on macOS sierra (and possibly others)
+			 *	is broken, and doesn't allow us to perform
+			 *	an EVILT_* add and delete in the same
+			 *	call.
+			 */
+			if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
+				fr_strerror_printf("Failed deleting filter for FD %i: %s", fd, fr_syserror(errno));
+				return -1;
+			}
+			filter = 0;
+		}
+#endif
+
+		/*
+		 *	I/O handler may delete an event, then
+		 *	re-add it.  To avoid deleting modified
+		 *	events we unset the do_delete flag.
+		 */
+		ef->do_delete = false;
+	}
+
+	ef->ctx = ctx;
+
+#ifdef FR_EVENT_EPOLL
+	/*
+	 *	epoll has one registration per FD, so modifying it
+	 *	replaces both filters at once.
+	 */
+	memset(&evset, 0, sizeof(evset));
+	if (read_fn) {
+		ef->read = read_fn;
+		evset.events |= EPOLLIN | EPOLLRDHUP;
+	}
+
+	if (write_fn) {
+		ef->write = write_fn;
+		evset.events |= EPOLLOUT;
+	}
+	ef->error = error;
+
+	evset.data.ptr = ef;
+	if (epoll_ctl(el->kq, ef->is_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &evset) < 0) {
+		fr_strerror_printf("Failed adding filter for FD %i: %s", fd, fr_syserror(errno));
+		if (!pre_existing) talloc_free(ef);
+		return -1;
+	}
+#else
+	if (read_fn) {
+		ef->read = read_fn;
+		filter |= EVFILT_READ;
+	}
+
+	if (write_fn) {
+		ef->write = write_fn;
+		filter |= EVFILT_WRITE;
+	}
+	ef->error = error;
+
+	EV_SET(&evset, fd, filter, EV_ADD | EV_ENABLE, 0, 0, ef);
+	if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed adding filter for FD %i: %s", fd, fr_syserror(errno));
+		if (!pre_existing) talloc_free(ef);
+		return -1;
+	}
+#endif
+	ef->is_registered = true;
+
+	return 0;
+}
+
+
+#ifdef FR_EVENT_URING
+static int fr_event_recv_cmp(void const *a, void const *b)
+{
+	fr_event_recv_t const *r_a = a;
+	fr_event_recv_t const *r_b = b;
+
+	if (r_a->fd < r_b->fd) return -1;
+	if (r_a->fd > r_b->fd) return +1;
+
+	return 0;
+}
+
+/** Submit any queued submission queue entries
+ *
+ * @param[in] uring	to submit entries for.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+static int fr_event_uring_submit(fr_event_uring_t *uring)
+{
+	int rcode;
+
+	while (uring->pending > 0) {
+		rcode = syscall(__NR_io_uring_enter, uring->fd, uring->pending, 0, 0, NULL, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	The completion queue is full.  The entries
+			 *	are submitted after we've reaped it.
+			 */
+			if ((errno == EAGAIN) || (errno == EBUSY)) return 0;
+
+			fr_strerror_printf("Failed submitting to io_uring: %s", fr_syserror(errno));
+			return -1;
+		}
+		uring->pending -= rcode;
+	}
+
+	return 0;
+}
+
+/** Queue a submission queue entry
+ *
+ *  The entry is submitted on the next call to fr_event_corral().
+ *
+ * @param[in] uring	to queue the entry for.
+ * @param[in] in	the entry to queue.
+ * @return
+ *	- <0 if the submission queue is full.
+ *	- 0 on success.
+ */
+static int fr_event_uring_push(fr_event_uring_t *uring, struct io_uring_sqe const *in)
+{
+	uint32_t tail = *uring->sq_tail;
+	uint32_t idx;
+
+	if ((tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE)) >= uring->sq_entries) {
+		if (fr_event_uring_submit(uring) < 0) return -1;
+
+		if ((tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE)) >= uring->sq_entries) {
+			fr_strerror_printf("io_uring submission queue is full");
+			return -1;
+		}
+	}
+
+	idx = tail & uring->sq_mask;
+	memcpy(&uring->sqes[idx], in, sizeof(*in));
+	uring->sq_array[idx] = idx;
+
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->pending++;
+
+	return 0;
+}
+
+/** Give a buffer back to the kernel
+ *
+ */
+static inline void fr_event_recv_buffer_add(fr_event_recv_t *r, uint16_t bid, int offset)
+{
+	struct io_uring_buf *buf;
+
+	buf = &r->br->bufs[(r->br->tail + offset) & (FR_EVENT_RECV_BUFFERS - 1)];
+	buf->addr = (uintptr_t) (r->buffers + (bid * r->buffer_size));
+	buf->len = r->buffer_size;
+	buf->bid = bid;
+}
+
+/** Ask the kernel to start receiving datagrams on a socket
+ *
+ */
+static int fr_event_recv_arm(fr_event_uring_t *uring, fr_event_recv_t *r)
+{
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_RECVMSG;
+	sqe.fd = r->fd;
+	sqe.addr = (uintptr_t) &r->msg;
+	sqe.len = 1;
+	sqe.ioprio = IORING_RECV_MULTISHOT;
+	sqe.flags = IOSQE_BUFFER_SELECT;
+	sqe.buf_group = r->bgid;
+	sqe.user_data = (uintptr_t) r;
+
+	if (fr_event_uring_push(uring, &sqe) < 0) return -1;
+
+	r->armed = true;
+
+	return 0;
+}
+
+/** Unregister and unmap the buffers for a socket
+ *
+ *  This is only done once the kernel has stopped receiving into them.
+ */
+static int _fr_event_recv_free(fr_event_recv_t *r)
+{
+	struct io_uring_buf_reg reg;
+
+	if (!r->br) return 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = r->bgid;
+	(void) syscall(__NR_io_uring_register, r->uring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+	(void) munmap(r->br, r->br_size);
+
+	return 0;
+}
+
+/** Service the io_uring completion queue
+ *
+ *  This is the read callback for the io_uring FD.
+ */
+static void fr_event_uring_read(fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_event_uring_t	*uring = ctx;
+	uint32_t		head, tail;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe	*cqe = &uring->cqes[head & uring->cq_mask];
+		fr_event_recv_t		*r = (fr_event_recv_t *) (uintptr_t) cqe->user_data;
+		int32_t			res = cqe->res;
+		uint32_t		flags = cqe->flags;
+
+		head++;
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		/*
+		 *	Cancellations have no user data.
+		 */
+		if (!r) continue;
+
+		if (!(flags & IORING_CQE_F_MORE)) r->armed = false;
+
+		if ((res >= 0) && (flags & IORING_CQE_F_BUFFER) && !r->deleted) {
+			uint16_t			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			uint8_t				*p = r->buffers + (bid * r->buffer_size);
+			struct io_uring_recvmsg_out	*out = (struct io_uring_recvmsg_out *) p;
+			struct msghdr			msg;
+			struct iovec			iov;
+			size_t				hdr_len;
+
+			/*
+			 *	The kernel writes the header, then leaves
+			 *	room for the name and control data we
+			 *	asked for, followed by the datagram.
+			 */
+			hdr_len = sizeof(*out) + r->msg.msg_namelen + r->msg.msg_controllen;
+			if (((size_t) res >= hdr_len) && ((hdr_len + out->payloadlen) <= (size_t) res)) {
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_name = p + sizeof(*out);
+				msg.msg_namelen = out->namelen;
+				msg.msg_control = p + sizeof(*out) + r->msg.msg_namelen;
+				msg.msg_controllen = out->controllen;
+				msg.msg_flags = out->flags;
+				iov.iov_base = p + hdr_len;
+				iov.iov_len = out->payloadlen;
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+
+				r->recv(el, r->fd, &msg, iov.iov_base, iov.iov_len, r->ctx);
+			}
+
+			fr_event_recv_buffer_add(r, bid, 0);
+			__atomic_store_n(&r->br->tail, r->br->tail + 1, __ATOMIC_RELEASE);
+		}
+
+		if (r->armed) continue;
+
+		/*
+		 *	The receive has finished.  If we were waiting
+		 *	for that, we can free the buffers.
+		 */
+		if (r->deleted) {
+			talloc_free(r);
+			continue;
+		}
+
+		/*
+		 *	Running out of buffers isn't an error.  The
+		 *	kernel has them all back now, so we start
+		 *	again.
+		 */
+		if (((res >= 0) || (res == -ENOBUFS)) && (fr_event_recv_arm(uring, r) == 0)) continue;
+
+		if (res < 0) {
+			fr_strerror_printf("io_uring receive failed for FD %i: %s", r->fd, fr_syserror(-res));
+		}
+
+		rbtree_deletebydata(el->recvs, r);
+		r->deleted = true;
+		if (r->error) r->error(el, r->fd, r->ctx);
+		talloc_free(r);
+	}
+}
+
+/** Unmap and close an io_uring
+ *
+ */
+static int _fr_event_uring_free(fr_event_uring_t *uring)
+{
+	if (uring->sqes) (void) munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring && (uring->cq_ring != uring->sq_ring)) (void) munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring) (void) munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->fd >= 0) close(uring->fd);
+
+	return 0;
+}
+
+/** Create the io_uring for an event list
+ *
+ * @param[in] el	to create the io_uring for.
+ * @return
+ *	- NULL on error.
+ *	- the io_uring on success.
+ */
+static fr_event_uring_t *fr_event_uring_create(fr_event_list_t *el)
+{
+	fr_event_uring_t	*uring;
+	struct io_uring_params	p;
+	uint8_t			*sq, *cq;
+
+	uring = talloc_zero(el, fr_event_uring_t);
+	if (!uring) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	uring->fd = -1;
+	uring->el = el;
+	talloc_set_destructor(uring, _fr_event_uring_free);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = FR_EVENT_URING_CQ_ENTRIES;
+
+	uring->fd = syscall(__NR_io_uring_setup, FR_EVENT_URING_ENTRIES, &p);
+	if (uring->fd < 0) {
+		fr_strerror_printf("Failed creating io_uring: %s", fr_syserror(errno));
+	error:
+		talloc_free(uring);
+		return NULL;
+	}
+
+	uring->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+	uring->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+
+	/*
+	 *	Newer kernels map both rings at once.
+	 */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_size > uring->sq_ring_size) uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+	map_error:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				      uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			goto map_error;
+		}
+	}
+
+	uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto map_error;
+	}
+
+	sq = uring->sq_ring;
+	uring->sq_head = (uint32_t *) (sq + p.sq_off.head);
+	uring->sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+	uring->sq_mask = *(uint32_t *) (sq + p.sq_off.ring_mask);
+	uring->sq_entries = *(uint32_t *) (sq + p.sq_off.ring_entries);
+	uring->sq_array = (uint32_t *) (sq + p.sq_off.array);
+
+	cq = uring->cq_ring;
+	uring->cq_head = (uint32_t *) (cq + p.cq_off.head);
+	uring->cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+	uring->cq_mask = *(uint32_t *) (cq + p.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/*
+	 *	The io_uring FD is readable when there are
+	 *	completions, so we wait for it with everything else.
+	 */
+	if (fr_event_fd_insert(el, uring->fd, fr_event_uring_read, NULL, NULL, uring) < 0) goto error;
+
+	return uring;
+}
+#endif
+
+/** Receive datagrams from a socket, without a system call for each one
+ *
+ *  On Linux, the kernel receives datagrams into buffers which belong
+ *  to the event list, using io_uring.  The callback is run for each
+ *  datagram.  The buffer is re-used as soon as the callback returns.
+ *
+ *  The socket MUST NOT also be inserted with #fr_event_fd_insert.
+ *
+ * @param[in] el		to insert the socket into.
+ * @param[in] fd		to receive datagrams from.
+ * @param[in] packet_size	the largest datagram we expect.
+ * @param[in] control_size	room for control messages, as with msg_controllen.
+ * @param[in] recv_fn		function to call for each datagram.
+ * @param[in] error		function to call when the socket can't be read.
+ *				The socket has already been removed.
+ * @param[in] ctx		to pass to the callbacks.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if it isn't supported.  The caller should
+ *	  use #fr_event_fd_insert instead.
+ */
+int fr_event_recv_insert(fr_event_list_t *el, int fd, size_t packet_size, size_t control_size,
+			 fr_event_recv_handler_t recv_fn, fr_event_fd_handler_t error, void *ctx)
+{
+#ifdef FR_EVENT_URING
+	fr_event_recv_t		*r, find;
+	struct io_uring_buf_reg	reg;
+	int			i;
+
+	if (!el || !recv_fn || (fd < 0)) {
+		fr_strerror_printf("Invalid arguments");
+		return -1;
+	}
+
+	if (el->exit) {
+		fr_strerror_printf("Event loop exiting");
+		return -1;
+	}
+
+	memset(&find, 0, sizeof(find));
+	find.fd = fd;
+	if (rbtree_finddata(el->recvs, &find)) {
+		fr_strerror_printf("FD %i is already being received from", fd);
+		return -1;
+	}
+
+	if (!el->uring) {
+		el->uring = fr_event_uring_create(el);
+		if (!el->uring) return -1;
+	}
+
+	r = talloc_zero(el, fr_event_recv_t);
+	if (!r) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	r->fd = fd;
+	r->uring_fd = el->uring->fd;
+	r->recv = recv_fn;
+	r->error = error;
+	r->ctx = ctx;
+	r->msg.msg_namelen = sizeof(struct sockaddr_storage);
+	r->msg.msg_controllen = control_size;
+
+	/*
+	 *	Each buffer has the header and the name and control
+	 *	data in front of the datagram.
+	 */
+	r->buffer_size = sizeof(struct io_uring_recvmsg_out) + r->msg.msg_namelen + control_size + packet_size;
+	r->buffer_size = (r->buffer_size + 15) & ~(size_t) 15;
+
+	r->buffers = talloc_array(r, uint8_t, r->buffer_size * FR_EVENT_RECV_BUFFERS);
+	if (!r->buffers) {
+		fr_strerror_printf("Out of memory");
+		talloc_free(r);
+		return -1;
+	}
+
+	/*
+	 *	The ring has to be page aligned.
+	 */
+	r->br_size = FR_EVENT_RECV_BUFFERS * sizeof(struct io_uring_buf);
+	r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED) {
+		r->br = NULL;
+		fr_strerror_printf("Failed mapping buffer ring: %s", fr_syserror(errno));
+		talloc_free(r);
+		return -1;
+	}
+
+	r->bgid = el->uring->next_bgid++;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) r->br;
+	reg.ring_entries = FR_EVENT_RECV_BUFFERS;
+	reg.bgid = r->bgid;
+	if (syscall(__NR_io_uring_register, r->uring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fr_strerror_printf("Failed registering buffer ring: %s", fr_syserror(errno));
+		(void) munmap(r->br, r->br_size);
+		r->br = NULL;
+		talloc_free(r);
+		return -1;
 	}
+	talloc_set_destructor(r, _fr_event_recv_free);
 
-	return 1;
+	for (i = 0; i < FR_EVENT_RECV_BUFFERS; i++) fr_event_recv_buffer_add(r, i, i);
+	__atomic_store_n(&r->br->tail, r->br->tail + FR_EVENT_RECV_BUFFERS, __ATOMIC_RELEASE);
+
+	if (fr_event_recv_arm(el->uring, r) < 0) {
+		talloc_free(r);
+		return -1;
+	}
+
+	rbtree_insert(el->recvs, r);
+
+	return 0;
+#else
+	(void) el;
+	(void) fd;
+	(void) packet_size;
+	(void) control_size;
+	(void) recv_fn;
+	(void) error;
+	(void) ctx;
+
+	fr_strerror_printf("Receiving with io_uring is not supported");
+	return -1;
+#endif
 }
 
-/** Remove a file descriptor from the event loop
+/** Stop receiving datagrams from a socket
  *
- * @param[in] el	to remove file descriptor from.
+ *  Datagrams which the kernel has already received, but which haven't
+ *  been passed to the callback, are discarded.
+ *
+ * @param[in] el	to remove the socket from.
  * @param[in] fd	to remove.
  * @return
- *	- 0 if file descriptor was removed.
+ *	- 0 if the socket was removed.
  *	- <0 on error.
  */
-int fr_event_fd_delete(fr_event_list_t *el, int fd)
+int fr_event_recv_delete(fr_event_list_t *el, int fd)
 {
-	fr_event_fd_t *ef, find;
+#ifdef FR_EVENT_URING
+	fr_event_recv_t		*r, find;
+	struct io_uring_sqe	sqe;
 
 	memset(&find, 0, sizeof(find));
 	find.fd = fd;
 
-	ef = rbtree_finddata(el->fds, &find);
-	if (!ef) {
-		fr_strerror_printf("No events is_registered for fd %i", fd);
+	r = rbtree_finddata(el->recvs, &find);
+	if (!r) {
+		fr_strerror_printf("No receive is registered for fd %i", fd);
 		return -1;
 	}
 
+	rbtree_deletebydata(el->recvs, r);
+	r->deleted = true;
+
 	/*
-	 *	Defer the delete, so we don't free
-	 *	an ef structure that might still be
-	 *	in use within fr_event_service.
+	 *	The buffers are freed once the kernel tells us that
+	 *	it has stopped using them.
 	 */
-	if (ef->in_handler) {
-		ef->do_delete = true;
+	if (r->armed) {
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_ASYNC_CANCEL;
+		sqe.fd = -1;
+		sqe.addr = (uintptr_t) r;
+
+		if (fr_event_uring_push(el->uring, &sqe) < 0) return -1;
 
 		return 0;
 	}
 
-	/*
-	 *	Destructor may prevent ef from being
-	 *	freed if kevent de-registration fails.
-	 */
-	if (talloc_free(ef) < 0) return -1;
+	talloc_free(r);
 
 	return 0;
+#else
+	(void) el;
+	(void) fd;
+
+	fr_strerror_printf("Receiving with io_uring is not supported");
+	return -1;
+#endif
 }
 
-/** Remove a file descriptor from the event loop
+/** Convert a time to a wheel tick
  *
- * @param[in] ef	to remove.
- * @return 0;
  */
-static int _fr_event_fd_free(fr_event_fd_t *ef)
+static inline uint64_t fr_event_wheel_tick(struct timeval const *when)
 {
-	int		filter = 0;
-	struct kevent	evset;
+	return (((uint64_t) when->tv_sec) * (USEC / FR_EVENT_WHEEL_TICK_USEC)) +
+		(when->tv_usec / FR_EVENT_WHEEL_TICK_USEC);
+}
 
-	fr_event_list_t	*el = talloc_parent(ef);
+/** Add a timer to a wheel slot
+ *
+ */
+static inline void fr_event_wheel_push(fr_event_list_t *el, fr_event_timer_t *ev, int level, int slot)
+{
+	fr_event_timer_t **head = &el->wheel[level][slot];
 
-	if (ef->read) filter |= EVFILT_READ;
-	if (ef->write) filter |= EVFILT_WRITE;
+	ev->level = level;
+	ev->wheel_next = *head;
+	if (*head) (*head)->wheel_prev = &ev->wheel_next;
+	ev->wheel_prev = head;
+	*head = ev;
 
-	if (ef->is_registered) {
-		EV_SET(&evset, ef->fd, filter, EV_DELETE, 0, 0, 0);
-		if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
-			fr_strerror_printf("Failed removing filters for FD %i: %s", ef->fd, fr_syserror(errno));
-			return -1;
+	el->wheel_count[level]++;
+}
+
+/** Put a timer into the wheel or the heap, depending on when it fires
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the timer couldn't be inserted into the heap.
+ */
+static int fr_event_timer_link(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	int level;
+	uint64_t tick, delta;
+
+	tick = fr_event_wheel_tick(&ev->when);
+
+	if (tick >= el->wheel_now) {
+		delta = tick - el->wheel_now;
+
+		for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+			if (delta >= ((uint64_t) 1 << (FR_EVENT_WHEEL_BITS * (level + 1)))) continue;
+
+			fr_event_wheel_push(el, ev, level,
+					    (tick >> (FR_EVENT_WHEEL_BITS * level)) & FR_EVENT_WHEEL_MASK);
+			return 0;
 		}
 	}
-	rbtree_deletebydata(el->fds, ef);
-	ef->is_registered = false;
 
-	el->num_fds--;
+	/*
+	 *	In the past, or too far in the future.
+	 */
+	ev->level = FR_EVENT_IN_HEAP;
+	if (!fr_heap_insert(el->times, ev)) return -1;
 
 	return 0;
 }
 
-/** Associate a callback with an file descriptor
+/** Remove a timer from the wheel or the heap
  *
- * @param[in] el	to insert fd callback into.
- * @param[in] fd	to read from.
- * @param[in] read_fn	function to call when fd is readable.
- * @param[in] write_fn	function to call when fd is writable.
- * @param[in] error	function to call when an error occurs on the fd.
- * @param[in] ctx	to pass to handler.
  * @return
- *	- 0 on succes.
- *	- -1 on failure.
+ *	- 1 on success.
+ *	- 0 if the timer wasn't found.
  */
-int fr_event_fd_insert(fr_event_list_t *el, int fd,
-		       fr_event_fd_handler_t read_fn,
-		       fr_event_fd_handler_t write_fn,
-		       fr_event_fd_handler_t error,
-		       void *ctx)
+static int fr_event_timer_unlink(fr_event_list_t *el, fr_event_timer_t *ev)
 {
-	int	      	filter = 0;
-	struct kevent	evset;
-	fr_event_fd_t	*ef, find;
-	bool		pre_existing;
+	if (ev->level == FR_EVENT_IN_HEAP) return fr_heap_extract(el->times, ev);
 
-	if (!el) {
-		fr_strerror_printf("Invalid argument: NULL event list");
-		return -1;
-	}
+	if (!ev->wheel_prev) return 0;
 
-	if (!read_fn && !write_fn) {
-		fr_strerror_printf("Invalid arguments: NULL read and write callbacks");
-		return -1;
-	}
+	*ev->wheel_prev = ev->wheel_next;
+	if (ev->wheel_next) ev->wheel_next->wheel_prev = ev->wheel_prev;
+	ev->wheel_next = NULL;
+	ev->wheel_prev = NULL;
 
-	if (fd < 0) {
-		fr_strerror_printf("Invalid arguments: Bad FD %i", fd);
-		return -1;
-	}
+	el->wheel_count[ev->level]--;
 
-	if (el->exit) {
-		fr_strerror_printf("Event loop exiting");
+	return 1;
+}
+
+/** Move all of the timers in a slot to where they belong now
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if a timer couldn't be inserted into the heap.  It is left in the slot.
+ */
+static int fr_event_wheel_cascade(fr_event_list_t *el, int level, int slot)
+{
+	fr_event_timer_t *ev;
+
+	while ((ev = el->wheel[level][slot]) != NULL) {
+		(void) fr_event_timer_unlink(el, ev);
+
+		/*
+		 *	Level 0 timers are due, so they always go into
+		 *	the heap.
+		 */
+		if (level == 0) {
+			ev->level = FR_EVENT_IN_HEAP;
+			if (fr_heap_insert(el->times, ev)) continue;
+
+		} else if (fr_event_timer_link(el, ev) == 0) {
+			continue;
+		}
+
+		fr_event_wheel_push(el, ev, level, slot);
 		return -1;
 	}
 
-	memset(&find, 0, sizeof(find));
+	return 0;
+}
 
-	/*
-	 *	Get the existing fr_event_fd_t if it exists.
-	 */
-	find.fd = fd;
-	ef = rbtree_finddata(el->fds, &find);
-	if (!ef) {
-		pre_existing = false;
+/** Process all of the wheel ticks up to, and including, "tick"
+ *
+ *  The timers which are due are moved from the wheel to the heap.
+ */
+static void fr_event_wheel_advance(fr_event_list_t *el, uint64_t tick)
+{
+	while (el->wheel_now <= tick) {
+		int level;
 
-		ef = talloc_zero(el, fr_event_fd_t);
-		if (!ef) {
-			fr_strerror_printf("Out of memory");
-			return -1;
+		/*
+		 *	Nothing in the wheel, we can skip ahead.
+		 */
+		if (!el->wheel_count[0] && !el->wheel_count[1] && !el->wheel_count[2]) {
+			el->wheel_now = tick + 1;
+			return;
 		}
-		talloc_set_destructor(ef, _fr_event_fd_free);
 
-		el->num_fds++;
+		/*
+		 *	At a boundary of a higher level, bring its
+		 *	timers down.  The highest level goes first, as
+		 *	its timers may land in a lower level slot which
+		 *	is also due.
+		 */
+		for (level = FR_EVENT_WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((el->wheel_now & (((uint64_t) 1 << (FR_EVENT_WHEEL_BITS * level)) - 1)) != 0) continue;
 
-		ef->fd = fd;
+			if (fr_event_wheel_cascade(el, level,
+						   (el->wheel_now >> (FR_EVENT_WHEEL_BITS * level)) & FR_EVENT_WHEEL_MASK) < 0) return;
+		}
 
-		rbtree_insert(el->fds, ef);
+		/*
+		 *	Timers in this level 0 slot fire during this
+		 *	tick.  They're now in the past (or close to
+		 *	it), so they go into the heap.
+		 */
+		if (fr_event_wheel_cascade(el, 0, el->wheel_now & FR_EVENT_WHEEL_MASK) < 0) return;
+
+		/*
+		 *	Nothing left in level 0, skip to the next
+		 *	boundary, where we may have to cascade.
+		 */
+		if (!el->wheel_count[0]) {
+			uint64_t next = (el->wheel_now | FR_EVENT_WHEEL_MASK) + 1;
+
+			el->wheel_now = (next > tick) ? tick + 1 : next;
+			continue;
+		}
+
+		el->wheel_now++;
+	}
+}
+
+/** Find the earliest time at which the wheel may have a timer to run
+ *
+ * @return
+ *	- false if the wheel is empty.
+ *	- true, and "tick" is set, if it isn't.
+ */
+static bool fr_event_wheel_next(fr_event_list_t *el, uint64_t *tick)
+{
+	int level, i;
+	bool found = false;
+	uint64_t best = 0;
 
 	/*
-	 *	Existing filters will be overwritten if there's
-	 *	a new filter which takes their place.  If there
-	 *	is no new filter however, we need to delete the
-	 *	existing one.
+	 *	Level 0 slots hold timers for exactly one tick.
 	 */
-	} else {
-		pre_existing = true;
+	if (el->wheel_count[0]) {
+		for (i = 0; i < FR_EVENT_WHEEL_SLOTS; i++) {
+			if (!el->wheel[0][(el->wheel_now + i) & FR_EVENT_WHEEL_MASK]) continue;
 
-		if (ef->read && !read_fn) filter |= EVFILT_READ;
-		if (ef->write && !write_fn) filter |= EVFILT_WRITE;
+			best = el->wheel_now + i;
+			found = true;
+			break;
+		}
+	}
 
-		if (filter) {
-			EV_SET(&evset, ef->fd, filter, EV_DELETE, 0, 0, 0);
+	/*
+	 *	Higher level timers can't fire before their slot is
+	 *	cascaded.
+	 */
+	for (level = 1; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		int shift = FR_EVENT_WHEEL_BITS * level;
+		uint64_t first;
 
-			/*
-			 *	kevent on macOS sierra (and possibly others)
-			 *	is broken, and doesn't allow us to perform
-			 *	an EVILT_* add and delete in the same
-			 *	call.
-			 */
-			if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
-				fr_strerror_printf("Failed deleting filter for FD %i: %s", fd, fr_syserror(errno));
-				return -1;
-			}
-			filter = 0;
-		}
+		if (!el->wheel_count[level]) continue;
 
 		/*
-		 *	I/O handler may delete an event, then
-		 *	re-add it.  To avoid deleting modified
-		 *	events we unset the do_delete flag.
+		 *	The next boundary of this level, which may be
+		 *	"now", if we haven't processed it yet.
 		 */
-		ef->do_delete = false;
-	}
+		first = (el->wheel_now + ((uint64_t) 1 << shift) - 1) >> shift;
 
-	ef->ctx = ctx;
+		for (i = 0; i < FR_EVENT_WHEEL_SLOTS; i++) {
+			uint64_t when = (first + i) << shift;
 
-	if (read_fn) {
-		ef->read = read_fn;
-		filter |= EVFILT_READ;
+			if (found && (when >= best)) break;
+
+			if (!el->wheel[level][(when >> shift) & FR_EVENT_WHEEL_MASK]) continue;
+
+			best = when;
+			found = true;
+			break;
+		}
 	}
 
-	if (write_fn) {
-		ef->write = write_fn;
-		filter |= EVFILT_WRITE;
+	if (found) *tick = best;
+
+	return found;
+}
+
+/** Find when the next timer event should run
+ *
+ * @param[in] el	containing the timer events.
+ * @param[out] when	the time of the next event.  For timers in the wheel, this
+ *			may be a little earlier than the timer.
+ * @return
+ *	- false if there are no timer events.
+ *	- true if there are.
+ */
+static bool fr_event_timer_next(fr_event_list_t *el, struct timeval *when)
+{
+	uint64_t tick;
+	fr_event_timer_t *ev;
+	bool found = false;
+
+	ev = fr_heap_peek(el->times);
+	if (ev) {
+		*when = ev->when;
+		found = true;
 	}
-	ef->error = error;
 
-	EV_SET(&evset, fd, filter, EV_ADD | EV_ENABLE, 0, 0, ef);
-	if (kevent(el->kq, &evset, 1, NULL, 0, NULL) < 0) {
-		fr_strerror_printf("Failed adding filter for FD %i: %s", fd, fr_syserror(errno));
-		if (!pre_existing) talloc_free(ef);
-		return -1;
+	if (fr_event_wheel_next(el, &tick)) {
+		struct timeval wheel;
+
+		wheel.tv_sec = tick / (USEC / FR_EVENT_WHEEL_TICK_USEC);
+		wheel.tv_usec = (tick % (USEC / FR_EVENT_WHEEL_TICK_USEC)) * FR_EVENT_WHEEL_TICK_USEC;
+
+		if (!found || (fr_timeval_cmp(&wheel, when) < 0)) *when = wheel;
+		found = true;
 	}
-	ef->is_registered = true;
 
-	return 0;
+	return found;
 }
 
-
 /** Delete a timer event from the event list
  *
  * @param[in] el	to delete event from.
@@ -440,10 +1705,10 @@ int fr_event_timer_delete(fr_event_list_t *el, fr_event_timer_t **parent)
 	}
 	*parent = NULL;
 
-	ret = fr_heap_extract(el->times, ev);
+	ret = fr_event_timer_unlink(el, ev);
 
 	/*
-	 *	Events MUST be in the heap
+	 *	Events MUST be in the heap, or the wheel
 	 */
 	if (!fr_cond_assert(ret == 1)) {
 		fr_strerror_printf("Event not found in heap");
@@ -510,8 +1775,8 @@ int fr_event_timer_insert(fr_event_list_t *el, fr_event_callback_t callback, voi
 		ev = *parent;
 #endif
 
-		ret = fr_heap_extract(el->times, ev);
-		if (!fr_cond_assert(ret == 1)) return -1;	/* events MUST be in the heap */
+		ret = fr_event_timer_unlink(el, ev);
+		if (!fr_cond_assert(ret == 1)) return -1;	/* events MUST be in the heap, or the wheel */
 
 		memset(ev, 0, sizeof(*ev));
 	} else {
@@ -524,7 +1789,7 @@ int fr_event_timer_insert(fr_event_list_t *el, fr_event_callback_t callback, voi
 	ev->when = *when;
 	ev->parent = parent;
 
-	if (!fr_heap_insert(el->times, ev)) {
+	if (fr_event_timer_link(el, ev) < 0) {
 		fr_strerror_printf("Failed inserting event into heap");
 		talloc_free(ev);
 		return -1;
@@ -590,26 +1855,25 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 
 	if (!el) return 0;
 
-	if (fr_heap_num_elements(el->times) == 0) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-		return 0;
-	}
+	/*
+	 *	Move the timers which are due from the wheel to the
+	 *	heap.
+	 */
+	fr_event_wheel_advance(el, fr_event_wheel_tick(when));
 
 	ev = fr_heap_peek(el->times);
-	if (!ev) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-		return 0;
-	}
 
 	/*
 	 *	See if it's time to do this one.
 	 */
-	if ((ev->when.tv_sec > when->tv_sec) ||
+	if (!ev ||
+	    (ev->when.tv_sec > when->tv_sec) ||
 	    ((ev->when.tv_sec == when->tv_sec) &&
 	     (ev->when.tv_usec > when->tv_usec))) {
-		*when = ev->when;
+		if (!fr_event_timer_next(el, when)) {
+			when->tv_sec = 0;
+			when->tv_usec = 0;
+		}
 		return 0;
 	}
 
@@ -653,19 +1917,16 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	wake = &when;
 
 	if (wait) {
-		if (fr_heap_num_elements(el->times) > 0) {
-			fr_event_timer_t *ev;
-
-			ev = fr_heap_peek(el->times);
-			if (!fr_cond_assert(ev)) return -1;
+		struct timeval next;
 
+		if (fr_event_timer_next(el, &next)) {
 			gettimeofday(&el->now, NULL);
 
 			/*
 			 *	Next event is in the future, get the time
 			 *	between now and that event.
 			 */
-			if (fr_timeval_cmp(&ev->when, &el->now) > 0) fr_timeval_subtract(&when, &ev->when, &el->now);
+			if (fr_timeval_cmp(&next, &el->now) > 0) fr_timeval_subtract(&when, &next, &el->now);
 		} else {
 			wake = NULL;
 		}
@@ -697,7 +1958,19 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	 *	that occurred since this function was last called
 	 *	or wait for the next timer event.
 	 */
+#ifdef FR_EVENT_URING
+	/*
+	 *	Receives which were added, re-armed, or cancelled
+	 *	since the last time around.
+	 */
+	if (el->uring && el->uring->pending) (void) fr_event_uring_submit(el->uring);
+#endif
+
+#ifdef FR_EVENT_EPOLL
+	el->num_fd_events = fr_event_epoll_wait(el->kq, el->epoll_events, el->events, FR_EV_BATCH_FDS, ts_wake);
+#else
 	el->num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
+#endif
 
 	/*
 	 *	Interrupt is different from timeout / FD events.
@@ -771,7 +2044,7 @@ void fr_event_service(fr_event_list_t *el)
 		if (ev->do_delete) fr_event_fd_delete(el, ev->fd);
 	}
 
-	if (fr_heap_num_elements(el->times) > 0) {
+	if (fr_event_list_num_elements(el) > 0) {
 		struct timeval when;
 
 		do {
@@ -790,8 +2063,6 @@ void fr_event_service(fr_event_list_t *el)
  */
 void fr_event_loop_exit(fr_event_list_t *el, int code)
 {
-	struct kevent kev;
-
 	if (!el) return;
 
 	el->exit = code;
@@ -799,8 +2070,7 @@ void fr_event_loop_exit(fr_event_list_t *el, int code)
 	/*
 	 *	Signal the control plane to exit.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	(void) kevent(el->kq, &kev, 1, NULL, 0, NULL);
+	(void) fr_event_kq_user_trigger(el->exit_fd, 0);
 }
 
 /** Check to see whether the event loop is in the process of exiting
@@ -841,15 +2111,33 @@ int fr_event_loop(fr_event_list_t *el)
  */
 static int _event_list_free(fr_event_list_t *el)
 {
+	int level, slot;
 	fr_event_timer_t *ev;
 
 	while ((ev = fr_heap_peek(el->times)) != NULL) {
 		fr_event_timer_delete(el, &ev);
 	}
 
+	for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FR_EVENT_WHEEL_SLOTS; slot++) {
+			while ((ev = el->wheel[level][slot]) != NULL) {
+				fr_event_timer_delete(el, &ev);
+			}
+		}
+	}
+
 	fr_heap_delete(el->times);
 
-	close(el->kq);
+#ifdef FR_EVENT_URING
+	/*
+	 *	Closing the io_uring stops the kernel from using the
+	 *	receive buffers, before they're freed.
+	 */
+	TALLOC_FREE(el->uring);
+#endif
+
+	if (el->exit_fd >= 0) (void) fr_event_kq_user_delete(el->kq, el->exit_fd, 0);
+	if (el->kq >= 0) close(el->kq);
 
 	return 0;
 }
@@ -866,22 +2154,29 @@ static int _event_list_free(fr_event_list_t *el)
 fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status, void *status_ctx)
 {
 	fr_event_list_t *el;
-	struct kevent kev;
 
 	el = talloc_zero(ctx, fr_event_list_t);
 	if (!fr_cond_assert(el)) {
 		return NULL;
 	}
+	el->kq = -1;
+	el->exit_fd = -1;
 	talloc_set_destructor(el, _event_list_free);
 
-	el->times = fr_heap_create(fr_event_timer_cmp, offsetof(fr_event_timer_t, heap));
+	el->times = fr_heap_create_arity(fr_event_timer_cmp, offsetof(fr_event_timer_t, heap), 4);
 	if (!el->times) {
 		talloc_free(el);
 		return NULL;
 	}
 	el->fds = rbtree_create(el, fr_event_fd_cmp, NULL, 0);
+#ifdef FR_EVENT_URING
+	el->recvs = rbtree_create(el, fr_event_recv_cmp, NULL, 0);
+#endif
+
+	gettimeofday(&el->now, NULL);
+	el->wheel_now = fr_event_wheel_tick(&el->now);
 
-	el->kq = kqueue();
+	el->kq = fr_event_kq_create();
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
@@ -893,8 +2188,8 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status,
 	/*
 	 *	Set our "exit" callback as ident 0.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
-	if (kevent(el->kq, &kev, 1, NULL, 0, NULL) < 0) {
+	el->exit_fd = fr_event_kq_user_add(el->kq, 0);
+	if (el->exit_fd < 0) {
 		talloc_free(el);
 		return NULL;
 	}
@@ -18,15 +18,21 @@
  * @file lib/hash.c
  * @brief Resizable hash tables.
  *
- *  The weird "reverse" function is based on an idea from
- *  "Split-Ordered Lists - Lock-free Resizable Hash Tables", with
- *  modifications so that they're not lock-free. :(
+ *  The table uses open addressing with "Robin Hood" linear probing.
+ *  Each slot holds the full 32-bit hash of its entry, and the
+ *  distance of the entry from its home slot.  All of the slots are
+ *  in one array, so a lookup walks adjacent memory instead of chasing
+ *  a pointer per entry, and it only calls the comparison function
+ *  when the hashes match.
  *
- *  However, the split-order idea allows a fast & easy splitting of the
- *  hash bucket chain when the hash table is resized.  Without it, we'd
- *  have to check & update the pointers for every node in the buck chain,
- *  rather than being able to move 1/2 of the entries in the chain with
- *  one update.
+ *  On insert, an entry which is further from its home slot than the
+ *  current occupant takes that slot, and the occupant moves on.  This
+ *  keeps the probe sequences short and even, and it means that a
+ *  lookup can stop as soon as it finds an entry which is closer to
+ *  its home slot than the key would be.
+ *
+ *  Deletes shift the following entries back by one slot, so there
+ *  are no tombstones, and lookups don't get slower over time.
  *
  * @copyright 2005,2006  The FreeRADIUS server project
  */
@@ -35,246 +41,49 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 
 /*
- *	A reasonable number of buckets to start off with.
- *	Should be a power of two.
+ *	A reasonable number of slots to start off with.
+ *	MUST be a power of two.
+ */
+#define FR_HASH_NUM_SLOTS (64)
+
+/*
+ *	Grow the table when it is this full, as num / 8.  Robin Hood
+ *	probing copes well with high loads, but lookups for missing
+ *	keys get slower as the table fills up.
  */
-#define FR_HASH_NUM_BUCKETS (64)
+#define FR_HASH_LOAD_FACTOR (6)
 
-typedef struct fr_hash_entry_t {
-	struct fr_hash_entry_t *next;
-	uint32_t	reversed;
-	uint32_t	key;
-	void const 	*data;
-} fr_hash_entry_t;
+typedef struct fr_hash_slot_t {
+	uint32_t	key;		//!< the full hash of the data
+	uint32_t	dist;		//!< 1 + distance from the home slot.  0 means the slot is empty.
+	void const	*data;
+} fr_hash_slot_t;
 
 
 struct fr_hash_table_t {
-	int			num_elements;
-	int			num_buckets; /* power of 2 */
-	int			next_grow;
-	int			mask;
+	uint32_t		num_elements;
+	uint32_t		num_slots; /* power of 2 */
+	uint32_t		next_grow;
+	uint32_t		mask;
+
+	int			walking;	//!< we're inside of fr_hash_table_walk()
 
 	fr_hash_table_free_t	free;
 	fr_hash_table_hash_t	hash;
 	fr_hash_table_cmp_t	cmp;
 
-	fr_hash_entry_t	null;
-
-	fr_hash_entry_t	**buckets;
+	fr_hash_slot_t		*slots;
 };
 
 #ifdef TESTING
 static int grow = 0;
 #endif
 
-/*
- * perl -e 'foreach $i (0..255) {$r = 0; foreach $j (0 .. 7 ) { if (($i & ( 1<< $j)) != 0) { $r |= (1 << (7 - $j));}} print $r, ", ";if (($i & 7) == 7) {print "\n";}}'
- */
-static const uint8_t reversed_byte[256] = {
-	0,  128, 64, 192, 32, 160, 96,  224,
-	16, 144, 80, 208, 48, 176, 112, 240,
-	8,  136, 72, 200, 40, 168, 104, 232,
-	24, 152, 88, 216, 56, 184, 120, 248,
-	4,  132, 68, 196, 36, 164, 100, 228,
-	20, 148, 84, 212, 52, 180, 116, 244,
-	12, 140, 76, 204, 44, 172, 108, 236,
-	28, 156, 92, 220, 60, 188, 124, 252,
-	2,  130, 66, 194, 34, 162, 98,  226,
-	18, 146, 82, 210, 50, 178, 114, 242,
-	10, 138, 74, 202, 42, 170, 106, 234,
-	26, 154, 90, 218, 58, 186, 122, 250,
-	6,  134, 70, 198, 38, 166, 102, 230,
-	22, 150, 86, 214, 54, 182, 118, 246,
-	14, 142, 78, 206, 46, 174, 110, 238,
-	30, 158, 94, 222, 62, 190, 126, 254,
-	1,  129, 65, 193, 33, 161, 97,  225,
-	17, 145, 81, 209, 49, 177, 113, 241,
-	9,  137, 73, 201, 41, 169, 105, 233,
-	25, 153, 89, 217, 57, 185, 121, 249,
-	5,  133, 69, 197, 37, 165, 101, 229,
-	21, 149, 85, 213, 53, 181, 117, 245,
-	13, 141, 77, 205, 45, 173, 109, 237,
-	29, 157, 93, 221, 61, 189, 125, 253,
-	3,  131, 67, 195, 35, 163, 99,  227,
-	19, 147, 83, 211, 51, 179, 115, 243,
-	11, 139, 75, 203, 43, 171, 107, 235,
-	27, 155, 91, 219, 59, 187, 123, 251,
-	7,  135, 71, 199, 39, 167, 103, 231,
-	23, 151, 87, 215, 55, 183, 119, 247,
-	15, 143, 79, 207, 47, 175, 111, 239,
-	31, 159, 95, 223, 63, 191, 127, 255
-};
-
-
-/*
- * perl -e 'foreach $i (0..255) {$r = 0;foreach $j (0 .. 7) { $r = $i & (1 << (7 - $j)); last if ($r)} print $i & ~($r), ", ";if (($i & 7) == 7) {print "\n";}}'
- */
-static uint8_t parent_byte[256] = {
-	0, 0, 0, 1, 0, 1, 2, 3,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	32, 33, 34, 35, 36, 37, 38, 39,
-	40, 41, 42, 43, 44, 45, 46, 47,
-	48, 49, 50, 51, 52, 53, 54, 55,
-	56, 57, 58, 59, 60, 61, 62, 63,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	32, 33, 34, 35, 36, 37, 38, 39,
-	40, 41, 42, 43, 44, 45, 46, 47,
-	48, 49, 50, 51, 52, 53, 54, 55,
-	56, 57, 58, 59, 60, 61, 62, 63,
-	64, 65, 66, 67, 68, 69, 70, 71,
-	72, 73, 74, 75, 76, 77, 78, 79,
-	80, 81, 82, 83, 84, 85, 86, 87,
-	88, 89, 90, 91, 92, 93, 94, 95,
-	96, 97, 98, 99, 100, 101, 102, 103,
-	104, 105, 106, 107, 108, 109, 110, 111,
-	112, 113, 114, 115, 116, 117, 118, 119,
-	120, 121, 122, 123, 124, 125, 126, 127
-};
-
-
-/*
- *	Reverse a key.
- */
-static uint32_t reverse(uint32_t key)
-{
-	return ((reversed_byte[key & 0xff] << 24) |
-		(reversed_byte[(key >> 8) & 0xff] << 16) |
-		(reversed_byte[(key >> 16) & 0xff] << 8) |
-		(reversed_byte[(key >> 24) & 0xff]));
-}
-
-/*
- *	Take the parent by discarding the highest bit that is set.
- */
-static uint32_t parent_of(uint32_t key)
-{
-	if (key > 0x00ffffff)
-		return (key & 0x00ffffff) | (parent_byte[key >> 24] << 24);
-
-	if (key > 0x0000ffff)
-		return (key & 0x0000ffff) | (parent_byte[key >> 16] << 16);
-
-	if (key > 0x000000ff)
-		return (key & 0x000000ff) | (parent_byte[key >> 8] << 8);
-
-	return parent_byte[key];
-}
-
-
-static fr_hash_entry_t *list_find(fr_hash_table_t *ht,
-				    fr_hash_entry_t *head,
-				    uint32_t reversed,
-				    void const *data)
-{
-	fr_hash_entry_t *cur;
-
-	for (cur = head; cur != &ht->null; cur = cur->next) {
-		if (cur->reversed == reversed) {
-			if (ht->cmp) {
-				int cmp = ht->cmp(data, cur->data);
-				if (cmp > 0) break;
-				if (cmp < 0) continue;
-			}
-			return cur;
-		}
-		if (cur->reversed > reversed) break;
-	}
-
-	return NULL;
-}
-
-
-/*
- *	Inserts a new entry into the list, in order.
- */
-static int list_insert(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
-{
-	fr_hash_entry_t **last, *cur;
-
-	last = head;
-
-	for (cur = *head; cur != &ht->null; cur = cur->next) {
-		if (cur->reversed > node->reversed) break;
-		last = &(cur->next);
-
-		if (cur->reversed == node->reversed) {
-			if (ht->cmp) {
-				int cmp = ht->cmp(node->data, cur->data);
-				if (cmp > 0) break;
-				if (cmp < 0) continue;
-			}
-			return 0;
-		}
-	}
-
-	node->next = *last;
-	*last = node;
-
-	return 1;
-}
-
-
-/*
- *	Delete an entry from the list.
- */
-static int list_delete(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
-{
-	fr_hash_entry_t **last, *cur;
-
-	last = head;
-
-	for (cur = *head; cur != &ht->null; cur = cur->next) {
-		if (cur == node) break;
-		last = &(cur->next);
-	}
-
-	*last = node->next;
-	return 1;
-}
-
-
-static int _fr_hash_table_free(fr_hash_table_t *ht)
-{
-	int i;
-	fr_hash_entry_t *node, *next;
-
-	/*
-	 *	Walk over the buckets, freeing them all.
-	 */
-	for (i = 0; i < ht->num_buckets; i++) {
-		if (ht->buckets[i]) for (node = ht->buckets[i];
-					 node != &ht->null;
-					 node = next) {
-			next = node->next;
-			if (!node->data) continue; /* dummy entry */
-
-			talloc_free(node);
-		}
-	}
-	talloc_free(ht->buckets);
-
-	return 0;
-}
-
 /*
  *	Create the table.
  *
- *	Memory usage in bytes is (20/3) * number of entries.
+ *	Memory usage in bytes is 16 * number of slots, on 64-bit
+ *	systems.  The table is between 3/8 and 3/4 full.
  */
 fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 				      fr_hash_table_hash_t hashNode,
@@ -287,115 +96,134 @@ fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 
 	ht = talloc_zero(NULL, fr_hash_table_t);
 	if (!ht) return NULL;
-	talloc_set_destructor(ht, _fr_hash_table_free);
 	fr_talloc_link_ctx(ctx, ht);
 
 	ht->free = freeNode;
 	ht->hash = hashNode;
 	ht->cmp = cmpNode;
-	ht->num_buckets = FR_HASH_NUM_BUCKETS;
-	ht->mask = ht->num_buckets - 1;
+	ht->num_slots = FR_HASH_NUM_SLOTS;
+	ht->mask = ht->num_slots - 1;
+	ht->next_grow = (ht->num_slots * FR_HASH_LOAD_FACTOR) / 8;
 
-	/*
-	 *	Have a default load factor of 2.5.  In practice this
-	 *	means that the average load will hit 3 before the
-	 *	table grows.
-	 */
-	ht->next_grow = (ht->num_buckets << 1) + (ht->num_buckets >> 1);
-
-	ht->buckets = talloc_zero_array(NULL, fr_hash_entry_t *, ht->num_buckets);
-	if (!ht->buckets) {
+	ht->slots = talloc_zero_array(ht, fr_hash_slot_t, ht->num_slots);
+	if (!ht->slots) {
 		talloc_free(ht);
 		return NULL;
 	}
 
-	ht->null.reversed = ~0;
-	ht->null.key = ~0;
-	ht->null.next = &ht->null;
-	ht->buckets[0] = &ht->null;
-
 	return ht;
 }
 
 
 /*
- *	If the current bucket is uninitialized, initialize it
- *	by recursively copying information from the parent.
- *
- *	We may have a situation where entry E is a parent to 2 other
- *	entries E' and E".  If we split E into E and E', then the
- *	nodes meant for E" end up in E or E', either of which is
- *	wrong.  To solve that problem, we walk down the whole chain,
- *	inserting the elements into the correct place.
+ *	Find the slot which holds the data, or -1 if there isn't one.
  */
-static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
+static int64_t fr_hash_table_find_slot(fr_hash_table_t *ht, uint32_t key, void const *data)
 {
-	uint32_t parent_entry;
-	fr_hash_entry_t **last, *cur;
-	uint32_t this;
+	uint32_t	i, dist;
+	fr_hash_slot_t	*slot;
+
+	i = key & ht->mask;
+
+	for (dist = 1; ; dist++, i = (i + 1) & ht->mask) {
+		slot = &ht->slots[i];
 
-	parent_entry = parent_of(entry);
+		/*
+		 *	An empty slot, or an entry which is closer to
+		 *	its home than we would be.  If our data was
+		 *	in the table, it would have taken this slot.
+		 */
+		if (slot->dist < dist) return -1;
 
-	/* parent_entry == entry if and only if entry == 0 */
+		if (slot->key != key) continue;
 
-	if (!ht->buckets[parent_entry]) {
-		fr_hash_table_fixup(ht, parent_entry);
+		if (!ht->cmp || (ht->cmp(data, slot->data) == 0)) return i;
 	}
+}
 
-	/*
-	 *	Keep walking down cur, trying to find entries that
-	 *	don't belong here any more.  There may be multiple
-	 *	ones, so we can't have a naive algorithm...
-	 */
-	last = &ht->buckets[parent_entry];
-	this = parent_entry;
 
-	for (cur = *last; cur != &ht->null; cur = cur->next) {
-		uint32_t real_entry;
+/*
+ *	Put an entry into the table, which we know isn't already
+ *	there, and which has room for it.
+ */
+static void fr_hash_table_place(fr_hash_table_t *ht, uint32_t key, void const *data)
+{
+	uint32_t	i;
+	fr_hash_slot_t	entry, tmp;
 
-		real_entry = cur->key & ht->mask;
-		if (real_entry != this) { /* ht->buckets[real_entry] == NULL */
-			*last = &ht->null;
-			ht->buckets[real_entry] = cur;
-			this = real_entry;
+	entry.key = key;
+	entry.dist = 1;
+	entry.data = data;
+
+	i = key & ht->mask;
+
+	for (;;) {
+		fr_hash_slot_t *slot = &ht->slots[i];
+
+		if (!slot->dist) {
+			*slot = entry;
+			return;
 		}
 
-		last = &(cur->next);
-	}
+		/*
+		 *	Take from the rich, give to the poor.  The
+		 *	entry which is closer to its home slot moves
+		 *	on, and we carry it forward instead.
+		 */
+		if (slot->dist < entry.dist) {
+			tmp = *slot;
+			*slot = entry;
+			entry = tmp;
+		}
 
-	/*
-	 *	We may NOT have initialized this bucket, so do it now.
-	 */
-	if (!ht->buckets[entry]) ht->buckets[entry] = &ht->null;
+		entry.dist++;
+		i = (i + 1) & ht->mask;
+	}
 }
 
-/*
- *	This should be a power of two.  Changing it to 4 doesn't seem
- *	to make any difference.
- */
-#define GROW_FACTOR (2)
 
 /*
  *	Grow the hash table.
  */
-static void fr_hash_table_grow(fr_hash_table_t *ht)
+static int fr_hash_table_grow(fr_hash_table_t *ht)
 {
-	fr_hash_entry_t **buckets;
+	uint32_t	i, num_slots;
+	fr_hash_slot_t	*slots;
+
+	num_slots = ht->num_slots * 2;
+	if (num_slots < ht->num_slots) return -1;
 
-	buckets = talloc_zero_array(NULL, fr_hash_entry_t *, GROW_FACTOR * ht->num_buckets);
-	if (!buckets) return;
+	slots = talloc_zero_array(ht, fr_hash_slot_t, num_slots);
+	if (!slots) return -1;
 
-	memcpy(buckets, ht->buckets, sizeof(*buckets) * ht->num_buckets);
-	talloc_free(ht->buckets); /* Free the old buckets */
+	num_slots = ht->num_slots;
+	ht->num_slots *= 2;
+	ht->mask = ht->num_slots - 1;
+	ht->next_grow = (ht->num_slots / 8) * FR_HASH_LOAD_FACTOR;
+
+	/*
+	 *	Re-insert everything into the new slots.
+	 */
+	{
+		fr_hash_slot_t *old = ht->slots;
+
+		ht->slots = slots;
+
+		for (i = 0; i < num_slots; i++) {
+			if (!old[i].dist) continue;
+
+			fr_hash_table_place(ht, old[i].key, old[i].data);
+		}
+
+		talloc_free(old);
+	}
 
-	ht->buckets = buckets;
-	ht->num_buckets *= GROW_FACTOR;
-	ht->next_grow *= GROW_FACTOR;
-	ht->mask = ht->num_buckets - 1;
 #ifdef TESTING
 	grow = 1;
-	fprintf(stderr, "GROW TO %d\n", ht->num_buckets);
+	fprintf(stderr, "GROW TO %u\n", ht->num_slots);
 #endif
+
+	return 0;
 }
 
 
@@ -405,86 +233,53 @@ static void fr_hash_table_grow(fr_hash_table_t *ht)
 int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 {
 	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-	fr_hash_entry_t *node;
 
 	if (!ht || !data) return 0;
 
 	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
-
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
-
-	/*
-	 *	If we try to do our own memory allocation here, the
-	 *	speedup is only ~15% or so, which isn't worth it.
-	 */
-	node = talloc_zero(NULL, fr_hash_entry_t);
-	if (!node) return 0;
-
-	node->next = &ht->null;
-	node->reversed = reversed;
-	node->key = key;
-	node->data = data;
 
 	/* already in the table, can't insert it */
-	if (!list_insert(ht, &ht->buckets[entry], node)) {
-		talloc_free(node);
-		return 0;
-	}
+	if (fr_hash_table_find_slot(ht, key, data) >= 0) return 0;
 
 	/*
 	 *	Check the load factor, and grow the table if
-	 *	necessary.
+	 *	necessary.  We don't move entries around while
+	 *	walking the table, unless we really have to.
+	 *
+	 *	There is always at least one empty slot, so
+	 *	that lookups of missing keys terminate.
 	 */
+	if (((ht->num_elements >= ht->next_grow) && !ht->walking) ||
+	    ((ht->num_elements + 2) > ht->num_slots)) {
+		if ((fr_hash_table_grow(ht) < 0) &&
+		    ((ht->num_elements + 2) > ht->num_slots)) return 0;
+	}
+
+	fr_hash_table_place(ht, key, data);
 	ht->num_elements++;
-	if (ht->num_elements >= ht->next_grow) fr_hash_table_grow(ht);
 
 	return 1;
 }
 
 
-/*
- *	Internal find a node routine.
- */
-static fr_hash_entry_t *fr_hash_table_find(fr_hash_table_t *ht, void const *data)
-{
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-
-	if (!ht) return NULL;
-
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
-
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
-
-	return list_find(ht, ht->buckets[entry], reversed, data);
-}
-
-
 /*
  *	Replace old data with new data, OR insert if there is no old.
  */
 int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
+	int64_t i;
 	void *tofree;
 
 	if (!ht || !data) return 0;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return fr_hash_table_insert(ht, data);
+	i = fr_hash_table_find_slot(ht, ht->hash(data), data);
+	if (i < 0) return fr_hash_table_insert(ht, data);
 
 	if (ht->free) {
-		memcpy(&tofree, &node->data, sizeof(tofree));
+		memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
 		ht->free(tofree);
 	}
-	node->data = data;
+	ht->slots[i].data = data;
 
 	return 1;
 }
@@ -495,13 +290,15 @@ int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
  */
 void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
+	int64_t i;
 	void *out;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return NULL;
+	if (!ht) return NULL;
 
-	memcpy(&out, &node->data, sizeof(out));
+	i = fr_hash_table_find_slot(ht, ht->hash(data), data);
+	if (i < 0) return NULL;
+
+	memcpy(&out, &ht->slots[i].data, sizeof(out));
 
 	return out;
 }
@@ -513,29 +310,32 @@ void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
  */
 void *fr_hash_table_yank(fr_hash_table_t *ht, void const *data)
 {
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
+	int64_t i;
+	uint32_t next;
 	void *old;
-	fr_hash_entry_t *node;
 
 	if (!ht) return NULL;
 
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
+	i = fr_hash_table_find_slot(ht, ht->hash(data), data);
+	if (i < 0) return NULL;
 
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	memcpy(&old, &ht->slots[i].data, sizeof(old));
 
-	node = list_find(ht, ht->buckets[entry], reversed, data);
-	if (!node) return NULL;
+	/*
+	 *	Shift the following entries back one slot, until we
+	 *	find an empty slot, or an entry which is already in
+	 *	its home slot.
+	 */
+	for (next = (i + 1) & ht->mask;
+	     ht->slots[next].dist > 1;
+	     i = next, next = (next + 1) & ht->mask) {
+		ht->slots[i] = ht->slots[next];
+		ht->slots[i].dist--;
+	}
 
-	list_delete(ht, &ht->buckets[entry], node);
+	memset(&ht->slots[i], 0, sizeof(ht->slots[i]));
 	ht->num_elements--;
 
-	memcpy(&old, &node->data, sizeof(old));
-	talloc_free(node);
-
 	return old;
 }
 
@@ -561,32 +361,23 @@ int fr_hash_table_delete(fr_hash_table_t *ht, void const *data)
  */
 void fr_hash_table_free(fr_hash_table_t *ht)
 {
-	int i;
-	fr_hash_entry_t *node, *next;
+	uint32_t i;
 
 	if (!ht) return;
 
-	/*
-	 *	Walk over the buckets, freeing them all.
-	 */
 	if (ht->free) {
-		for (i = 0; i < ht->num_buckets; i++) {
-			if (ht->buckets[i]) for (node = ht->buckets[i];
-						 node != &ht->null;
-						 node = next) {
-				void *tofree;
+		for (i = 0; i < ht->num_slots; i++) {
+			void *tofree;
 
-				next = node->next;
-				if (!node->data) continue; /* dummy entry */
+			if (!ht->slots[i].dist) continue;
 
-				memcpy(&tofree, &node->data, sizeof(tofree));
-				ht->free(tofree);
-			}
+			memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
+			ht->free(tofree);
 		}
 	}
 
 	/*
-	 *	Also frees nodes and buckets
+	 *	Also frees the slots
 	 */
 	talloc_free(ht);
 }
@@ -604,37 +395,62 @@ int fr_hash_table_num_elements(fr_hash_table_t *ht)
 
 
 /*
- *	Walk over the nodes, allowing deletes & inserts to happen.
+ *	Walk over the nodes, allowing the callback to delete any
+ *	node.
+ *
+ *	We start from an empty slot.  A delete only shifts entries
+ *	between the deleted one and the next empty slot back by one,
+ *	so it never moves an unvisited entry behind us, or one past
+ *	the start.  If the current slot no longer holds the entry we
+ *	passed to the callback, then it (or an entry before it) was
+ *	deleted, and the next entry has shifted into the slot, so we
+ *	look at the same slot again.
+ *
+ *	Inserts don't grow the table during a walk, unless it's full.
+ *	Entries inserted during a walk may, or may not be visited.
  */
 int fr_hash_table_walk(fr_hash_table_t *ht,
 		       fr_hash_table_walk_t callback,
 		       void *context)
 {
-	int i, rcode;
+	uint32_t i, start, num_slots;
+	int rcode = 0;
 
 	if (!ht || !callback) return 0;
 
-	for (i = ht->num_buckets - 1; i >= 0; i--) {
-		fr_hash_entry_t *node, *next;
+	for (start = 0; start < ht->num_slots; start++) {
+		if (!ht->slots[start].dist) break;
+	}
 
-		/*
-		 *	Ensure that the current bucket is filled.
-		 */
-		if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
+	ht->walking++;
+	num_slots = ht->num_slots;
 
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			void *arg;
+	for (i = 0; i < num_slots; ) {
+		fr_hash_slot_t *slot;
+		void *arg;
 
-			next = node->next;
+		slot = &ht->slots[(start + i) & ht->mask];
+		if (!slot->dist) {
+			i++;
+			continue;
+		}
 
-			memcpy(&arg, &node->data, sizeof(arg));
-			rcode = callback(context, arg);
+		memcpy(&arg, &slot->data, sizeof(arg));
+		rcode = callback(context, arg);
+		if (rcode != 0) break;
 
-			if (rcode != 0) return rcode;
-		}
+		/*
+		 *	The callback forced the table to grow, so
+		 *	our position means nothing any more.
+		 */
+		if (ht->num_slots != num_slots) break;
+
+		if (slot->dist && (slot->data == arg)) i++;
 	}
 
-	return 0;
+	ht->walking--;
+
+	return rcode;
 }
 
 
@@ -644,115 +460,204 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
  */
 int fr_hash_table_info(fr_hash_table_t *ht)
 {
-	int i, a, collisions, uninitialized;
+	uint32_t i, max_dist, collisions;
+	uint64_t total;
 	int array[256];
 
 	if (!ht) return 0;
 
-	uninitialized = collisions = 0;
+	max_dist = collisions = 0;
+	total = 0;
 	memset(array, 0, sizeof(array));
 
-	for (i = 0; i < ht->num_buckets; i++) {
-		uint32_t key;
-		int load;
-		fr_hash_entry_t *node, *next;
+	for (i = 0; i < ht->num_slots; i++) {
+		uint32_t dist = ht->slots[i].dist;
 
-		/*
-		 *	If we haven't inserted or looked up an entry
-		 *	in a bucket, it's uninitialized.
-		 */
-		if (!ht->buckets[i]) {
-			uninitialized++;
-			continue;
-		}
+		if (!dist) continue;
 
-		load = 0;
-		key = ~0;
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			if (node->reversed == key) {
-				collisions++;
-			} else {
-				key = node->reversed;
-			}
-			next = node->next;
-			load++;
-		}
+		if ((i > 0) && ht->slots[i - 1].dist &&
+		    (ht->slots[i - 1].key == ht->slots[i].key)) collisions++;
+
+		if (dist > max_dist) max_dist = dist;
+		total += dist;
 
-		if (load > 255) load = 255;
-		array[load]++;
+		if (dist > 255) dist = 255;
+		array[dist]++;
 	}
 
-	printf("HASH TABLE %p\tbuckets: %d\t(%d uninitialized)\n", ht,
-		ht->num_buckets, uninitialized);
-	printf("\tnum entries %d\thash collisions %d\n",
-		ht->num_elements, collisions);
+	printf("HASH TABLE %p\tslots: %u\t(%u used)\n", ht,
+	       ht->num_slots, ht->num_elements);
+	printf("\thash collisions %u\tlongest probe %u\n",
+	       collisions, max_dist);
 
-	a = 0;
 	for (i = 1; i < 256; i++) {
 		if (!array[i]) continue;
-		printf("%d\t%d\n", i, array[i]);
-
-		/*
-		 *	Since the entries are ordered, the lookup cost
-		 *	for any one element in a chain is (on average)
-		 *	the cost of walking half of the chain.
-		 */
-		if (i > 1) {
-			a += array[i] * i;
-		}
+		printf("%u\t%d\n", i, array[i]);
 	}
-	a /= 2;
-	a += array[1];
 
-	printf("\texpected lookup cost = %d/%d or %f\n\n",
-	       ht->num_elements, a,
-	       (float) ht->num_elements / (float) a);
+	if (ht->num_elements) {
+		printf("\texpected lookup cost = %f\n\n",
+		       (double) total / (double) ht->num_elements);
+	}
 
 	return 0;
 }
 #endif
 
 
-#define FNV_MAGIC_INIT (0x811c9dc5)
-#define FNV_MAGIC_PRIME (0x01000193)
-
 /*
- *	A fast hash function.  For details, see:
+ *	The hash functions below read the data 8 bytes at a time, and
+ *	mix it with 64x64->128 bit multiplies, in the style of
+ *	"wyhash".  For short keys the cost is a few multiplies, no
+ *	matter how long the key is.  For keys longer than 48 bytes,
+ *	three independent lanes are mixed in parallel, which keeps the
+ *	CPU pipeline full.
  *
- *	http://www.isthe.com/chongo/tech/comp/fnv/
- *
- *	Which also includes public domain source.  We've re-written
- *	it here for our purposes.
+ *	The output depends on the byte order of the CPU, and may
+ *	change between releases.  It MUST NOT be stored, or sent over
+ *	the network.  Use fr_hash_fnv_string() for values which have
+ *	to be stable.
  */
-uint32_t fr_hash(void const *data, size_t size)
+#define HASH_SECRET0	(0xa0761d6478bd642fULL)
+#define HASH_SECRET1	(0xe7037ed1a0b428dbULL)
+#define HASH_SECRET2	(0x8ebc6af09c88c6e3ULL)
+#define HASH_SECRET3	(0x589965cc75374cc3ULL)
+
+/*
+ *	The seed used by fr_hash() and fr_hash_string().
+ */
+#define HASH_SEED	(0x811c9dc5ULL)
+
+/*
+ *	Multiply two 64-bit numbers, and return the low and high
+ *	halves of the 128-bit result.
+ */
+static inline void hash_mum(uint64_t *a, uint64_t *b)
 {
-	uint8_t const *p = data;
-	uint8_t const *q = p + size;
-	uint32_t      hash = FNV_MAGIC_INIT;
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) *a * *b;
+
+	*a = (uint64_t) r;
+	*b = (uint64_t) (r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+
+	*a = lo;
+	*b = hi;
+#endif
+}
 
-	/*
-	 *	FNV-1 hash each octet in the buffer
-	 */
-	while (p != q) {
-		/*
-		 *	XOR the 8-bit quantity into the bottom of
-		 *	the hash.
-		 */
-		hash ^= (uint32_t) (*p++);
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+	hash_mum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t hash_read64(uint8_t const *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_read32(uint8_t const *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ *	Read 1..3 bytes.
+ */
+static inline uint64_t hash_read_small(uint8_t const *p, size_t k)
+{
+	return (((uint64_t) p[0]) << 16) | (((uint64_t) p[k >> 1]) << 8) | p[k - 1];
+}
+
+/*
+ *	Hash a buffer into 64 bits.
+ */
+static uint64_t hash64(void const *data, size_t size, uint64_t seed)
+{
+	uint8_t const	*p = data;
+	uint64_t	a, b;
+
+	seed ^= hash_mix(seed ^ HASH_SECRET0, HASH_SECRET1);
+
+	if (size <= 16) {
+		if (size >= 4) {
+			size_t off = (size >> 3) << 2;
+
+			a = (hash_read32(p) << 32) | hash_read32(p + off);
+			b = (hash_read32(p + size - 4) << 32) | hash_read32(p + size - 4 - off);
+
+		} else if (size > 0) {
+			a = hash_read_small(p, size);
+			b = 0;
+
+		} else {
+			a = b = 0;
+		}
+
+	} else {
+		size_t i = size;
+
+		if (i > 48) {
+			uint64_t lane1 = seed, lane2 = seed;
+
+			do {
+				seed = hash_mix(hash_read64(p) ^ HASH_SECRET1, hash_read64(p + 8) ^ seed);
+				lane1 = hash_mix(hash_read64(p + 16) ^ HASH_SECRET2, hash_read64(p + 24) ^ lane1);
+				lane2 = hash_mix(hash_read64(p + 32) ^ HASH_SECRET3, hash_read64(p + 40) ^ lane2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+
+			seed ^= lane1 ^ lane2;
+		}
+
+		while (i > 16) {
+			seed = hash_mix(hash_read64(p) ^ HASH_SECRET1, hash_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
 
 		/*
-		 *	Multiple by 32-bit magic FNV prime, mod 2^32
-		 */
-		hash *= FNV_MAGIC_PRIME;
-#if 0
-		/*
-		 *	Potential optimization.
+		 *	The last 16 bytes, which may overlap with the
+		 *	bytes we've already hashed.
 		 */
-		hash += (hash<<1) + (hash<<4) + (hash<<7) + (hash<<8) + (hash<<24);
-#endif
-    }
+		a = hash_read64(p + i - 16);
+		b = hash_read64(p + i - 8);
+	}
+
+	a ^= HASH_SECRET1;
+	b ^= seed;
+	hash_mum(&a, &b);
+
+	return hash_mix(a ^ HASH_SECRET0 ^ size, b ^ HASH_SECRET1);
+}
 
-    return hash;
+static inline uint32_t hash_fold(uint64_t hash)
+{
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+/*
+ *	A fast hash function.  Don't use it for cryptography, it's
+ *	just for hashing internal data.
+ */
+uint32_t fr_hash(void const *data, size_t size)
+{
+	return hash_fold(hash64(data, size, HASH_SEED));
 }
 
 /*
@@ -760,22 +665,44 @@ uint32_t fr_hash(void const *data, size_t size)
  */
 uint32_t fr_hash_update(void const *data, size_t size, uint32_t hash)
 {
-	uint8_t const *p = data;
-	uint8_t const *q = p + size;
-
-	while (p != q) {
-		hash *= FNV_MAGIC_PRIME;
-		hash ^= (uint32_t) (*p++);
-    }
-
-    return hash;
+	return hash_fold(hash64(data, size, hash));
+}
 
+/*
+ *	Hash a buffer with a secret seed.
+ *
+ *	Tables which are keyed on data from the network should use a
+ *	random seed, so that nobody can pick keys which all land in
+ *	the same slot.
+ */
+uint32_t fr_hash_seeded(void const *data, size_t size, uint64_t seed)
+{
+	return hash_fold(hash64(data, size, seed));
 }
 
 /*
- *	Hash a C string, so we loop over it once.
+ *	Hash a C string.
  */
 uint32_t fr_hash_string(char const *p)
+{
+	return hash_fold(hash64(p, strlen(p), HASH_SEED));
+}
+
+
+#define FNV_MAGIC_INIT (0x811c9dc5)
+#define FNV_MAGIC_PRIME (0x01000193)
+
+/*
+ *	Hash a C string with FNV-1.  For details, see:
+ *
+ *	http://www.isthe.com/chongo/tech/comp/fnv/
+ *
+ *	This is slower than fr_hash_string(), but the output never
+ *	changes.  Use it for things like attribute numbers, which are
+ *	derived from a name, and which are visible outside of the
+ *	server.
+ */
+uint32_t fr_hash_fnv_string(char const *p)
 {
 	uint32_t      hash = FNV_MAGIC_INIT;
 
@@ -799,6 +726,82 @@ static uint32_t hash_int(void const *data)
 	return fr_hash((int *) data, sizeof(int));
 }
 
+static int hash_int_cmp(void const *one, void const *two)
+{
+	int a = *(int const *) one;
+	int b = *(int const *) two;
+
+	return (a > b) - (a < b);
+}
+
+/*
+ *	The old byte-at-a-time FNV-1a hash, to compare against.
+ */
+static uint32_t hash_fnv(void const *data, size_t size)
+{
+	uint8_t const *p = data;
+	uint8_t const *q = p + size;
+	uint32_t      hash = FNV_MAGIC_INIT;
+
+	while (p != q) {
+		hash ^= (uint32_t) (*p++);
+		hash *= FNV_MAGIC_PRIME;
+	}
+
+	return hash;
+}
+
+#define BENCH_LOOPS (1000000)
+
+static double hash_bench_usec(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((now.tv_sec - start->tv_sec) * 1000000.0) + (now.tv_usec - start->tv_usec);
+}
+
+/*
+ *	Hash keys of various sizes, and print the time per hash.
+ */
+static void hash_bench(void)
+{
+	static size_t const sizes[] = { 4, 8, 16, 24, 40, 64, 128, 256, 1024 };
+	uint8_t buffer[1024 + 16];
+	uint32_t sink = 0;
+	size_t i, j;
+
+	for (i = 0; i < sizeof(buffer); i++) buffer[i] = i * 7;
+
+	printf("size\tfnv ns\tfr_hash ns\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct timeval start;
+		double fnv, fast;
+
+		gettimeofday(&start, NULL);
+		for (j = 0; j < BENCH_LOOPS; j++) {
+			sink += hash_fnv(buffer + (j & 15), sizes[i]);
+		}
+		fnv = hash_bench_usec(&start);
+
+		gettimeofday(&start, NULL);
+		for (j = 0; j < BENCH_LOOPS; j++) {
+			sink += fr_hash(buffer + (j & 15), sizes[i]);
+		}
+		fast = hash_bench_usec(&start);
+
+		printf("%zu\t%.2f\t%.2f\n", sizes[i],
+		       (fnv * 1000.0) / BENCH_LOOPS, (fast * 1000.0) / BENCH_LOOPS);
+	}
+
+	/*
+	 *	Make sure the compiler doesn't optimize the loops away.
+	 */
+	if (sink == 0x12345678) printf("\n");
+}
+
 #define MAX 1024*1024
 int main(int argc, char **argv)
 {
@@ -806,7 +809,7 @@ int main(int argc, char **argv)
 	fr_hash_table_t *ht;
 	int *array;
 
-	ht = fr_hash_table_create(NULL, hash_int, NULL, NULL);
+	ht = fr_hash_table_create(NULL, hash_int, hash_int_cmp, NULL);
 	if (!ht) {
 		fprintf(stderr, "Hash create failed\n");
 		fr_exit(1);
@@ -846,25 +849,47 @@ int main(int argc, char **argv)
 				fr_exit(1);
 			}
 
-#if 0
-			if (!fr_hash_table_delete(ht, &i)) {
-				fprintf(stderr, "Failed deleting %d\n", i);
-				fr_exit(1);
-			}
-			q = fr_hash_table_finddata(ht, &i);
-			if (q) {
-				fprintf(stderr, "Failed to delete %08x\n", i);
-				fr_exit(1);
-			}
-#endif
 		}
 
 		fr_hash_table_info(ht);
 	}
 
+	/*
+	 *	Delete every other entry, and check that the rest are
+	 *	still there.
+	 */
+	for (i = 0; i < MAX; i += 2) {
+		if (!fr_hash_table_delete(ht, &i)) {
+			fprintf(stderr, "Failed deleting %d\n", i);
+			fr_exit(1);
+		}
+		q = fr_hash_table_finddata(ht, &i);
+		if (q) {
+			fprintf(stderr, "Failed to delete %08x\n", i);
+			fr_exit(1);
+		}
+	}
+
+	for (i = 1; i < MAX; i += 2) {
+		q = fr_hash_table_finddata(ht, &i);
+		if (!q || *q != i) {
+			fprintf(stderr, "Failed finding %d after deletes\n", i);
+			fr_exit(1);
+		}
+	}
+
+	if (fr_hash_table_num_elements(ht) != (MAX / 2)) {
+		fprintf(stderr, "Wrong number of elements %d\n", fr_hash_table_num_elements(ht));
+		fr_exit(1);
+	}
+
+	fr_hash_table_info(ht);
+
 	fr_hash_table_free(ht);
 	talloc_free(array);
 
+	hash_bench();
+
 	fr_exit(0);
 }
 #endif
@@ -38,18 +38,24 @@ struct fr_heap_t {
 	size_t size;
 	size_t num_elements;
 	size_t offset;
+	unsigned int arity;	/* children per node: 2, 4 or 8 */
+	unsigned int shift;	/* log2(arity) */
 	fr_heap_cmp_t cmp;
 	void **p;
 };
 
 /*
- *	First node in a heap is element 0. Children of i are 2i+1 and
- *	2i+2.  These macros wrap the logic, so the code is more
- *	descriptive.
+ *	First node in a heap is element 0. Children of i are d*i+1
+ *	through d*i+d, where "d" is the arity of the heap.  These
+ *	macros wrap the logic, so the code is more descriptive.
+ *
+ *	Wider heaps are shallower, so an insert does fewer compares,
+ *	and the children of a node are next to each other in memory.
+ *	An extract does more compares per level, but touches fewer
+ *	cache lines on deep heaps.
  */
-#define HEAP_PARENT(x) ( ( (x) - 1 ) / 2 )
-#define HEAP_LEFT(x) ( 2*(x) + 1 )
-/* #define HEAP_RIGHT(x) ( 2*(x) + 2 ) */
+#define HEAP_PARENT(hp, x) ( ( (x) - 1 ) >> (hp)->shift )
+#define HEAP_LEFT(hp, x) ( ( (x) << (hp)->shift ) + 1 )
 #define	HEAP_SWAP(a, b) { void *_tmp = a; a = b; b = _tmp; }
 
 static int fr_heap_bubble(fr_heap_t *hp, size_t child);
@@ -62,11 +68,27 @@ void fr_heap_delete(fr_heap_t *hp)
 }
 
 fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
+{
+	return fr_heap_create_arity(cmp, offset, 2);
+}
+
+/** Create a heap where each node has more than two children
+ *
+ * @param[in] cmp the comparison function
+ * @param[in] offset of the "int" index in each element, or 0 for no index
+ * @param[in] arity how many children each node has.  MUST be 2, 4 or 8.
+ * @return
+ *	- NULL on error
+ *	- fr_heap_t on success
+ */
+fr_heap_t *fr_heap_create_arity(fr_heap_cmp_t cmp, size_t offset, unsigned int arity)
 {
 	fr_heap_t *fh;
 
 	if (!cmp) return NULL;
 
+	if ((arity != 2) && (arity != 4) && (arity != 8)) return NULL;
+
 	fh = talloc_zero(NULL, fr_heap_t);
 	if (!fh) return NULL;
 
@@ -79,6 +101,8 @@ fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
 
 	fh->cmp = cmp;
 	fh->offset = offset;
+	fh->arity = arity;
+	fh->shift = (arity == 2) ? 1 : (arity == 4) ? 2 : 3;
 
 	return fh;
 }
@@ -89,7 +113,7 @@ fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
  *	already in place, and key is the position where to start the
  *	bubble-up.
  *
- *	Returns 1 on failure (cannot allocate new heap entry)
+ *	Returns 0 on failure (cannot allocate new heap entry)
  *
  *	If offset > 0 the position (index, int) of the element in the
  *	heap is also stored in the element itself at the given offset
@@ -107,6 +131,27 @@ fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
     if (heap->offset) \
 	    *((int *)(((uint8_t *)heap->p[node]) + heap->offset)) = -1
 
+/*
+ *	Make room for at least "num" more elements.
+ */
+static int fr_heap_grow(fr_heap_t *hp, size_t num)
+{
+	size_t size = hp->size;
+	void **p;
+
+	while ((size - hp->num_elements) < num) size *= 2;
+
+	if (size == hp->size) return 0;
+
+	p = talloc_realloc(hp, hp->p, void *, size);
+	if (!p) return -1;
+
+	hp->p = p;
+	hp->size = size;
+
+	return 0;
+}
+
 int fr_heap_insert(fr_heap_t *hp, void *data)
 {
 	size_t child = hp->num_elements;
@@ -114,10 +159,7 @@ int fr_heap_insert(fr_heap_t *hp, void *data)
 	/*
 	 *	Heap is full.  Double it's size.
 	 */
-	if (child == hp->size) {
-		hp->size *= 2;
-		hp->p = talloc_realloc(hp, hp->p, void *, hp->size);
-	}
+	if ((child == hp->size) && (fr_heap_grow(hp, 1) < 0)) return 0;
 
 	hp->p[child] = data;
 	hp->num_elements++;
@@ -125,6 +167,93 @@ int fr_heap_insert(fr_heap_t *hp, void *data)
 	return fr_heap_bubble(hp, child);
 }
 
+/*
+ *	Push the element at "parent" down, until it's smaller than
+ *	all of its children.
+ */
+static void fr_heap_sift(fr_heap_t *hp, size_t parent)
+{
+	size_t child, last, i;
+	void *data = hp->p[parent];
+
+	while ((child = HEAP_LEFT(hp, parent)) < hp->num_elements) {
+		size_t smallest = child;
+
+		last = child + hp->arity;
+		if (last > hp->num_elements) last = hp->num_elements;
+
+		for (i = child + 1; i < last; i++) {
+			if (hp->cmp(hp->p[i], hp->p[smallest]) < 0) smallest = i;
+		}
+
+		if (hp->cmp(hp->p[smallest], data) >= 0) break;
+
+		hp->p[parent] = hp->p[smallest];
+		SET_OFFSET(hp, parent);
+		parent = smallest;
+	}
+
+	hp->p[parent] = data;
+	SET_OFFSET(hp, parent);
+}
+
+/** Insert many elements at once
+ *
+ *  When the number of new elements is large compared to the size of
+ *  the heap, the whole heap is rebuilt in O(n), instead of doing
+ *  O(log n) work for each element.
+ *
+ * @param[in] hp the heap
+ * @param[in] data array of elements to insert
+ * @param[in] num the number of elements in the array
+ * @return
+ *	- 0 on failure (cannot allocate new heap entries)
+ *	- 1 on success
+ */
+int fr_heap_insert_bulk(fr_heap_t *hp, void **data, size_t num)
+{
+	size_t i, old;
+
+	if (!num) return 1;
+
+	if (fr_heap_grow(hp, num) < 0) return 0;
+
+	old = hp->num_elements;
+
+	/*
+	 *	Only a few new elements, insert them one by one.
+	 */
+	if (num < (old >> 2)) {
+		for (i = 0; i < num; i++) {
+			hp->p[hp->num_elements] = data[i];
+			hp->num_elements++;
+			(void) fr_heap_bubble(hp, hp->num_elements - 1);
+		}
+		return 1;
+	}
+
+	memcpy(&hp->p[old], data, num * sizeof(*data));
+	hp->num_elements += num;
+
+	/*
+	 *	Sift down every node which has children, starting
+	 *	from the last one.
+	 */
+	for (i = HEAP_PARENT(hp, hp->num_elements - 1) + 1; i > 0; i--) {
+		fr_heap_sift(hp, i - 1);
+	}
+
+	/*
+	 *	The leaves weren't sifted, so they may not have their
+	 *	index set.
+	 */
+	for (i = HEAP_PARENT(hp, hp->num_elements - 1) + 1; i < hp->num_elements; i++) {
+		SET_OFFSET(hp, i);
+	}
+
+	return 1;
+}
+
 
 static int fr_heap_bubble(fr_heap_t *hp, size_t child)
 {
@@ -132,7 +261,7 @@ static int fr_heap_bubble(fr_heap_t *hp, size_t child)
 	 *	Bubble up the element.
 	 */
 	while (child > 0) {
-		size_t parent = HEAP_PARENT(child);
+		size_t parent = HEAP_PARENT(hp, child);
 
 		/*
 		 *	Parent is smaller than the child.  We're done.
@@ -157,7 +286,7 @@ static int fr_heap_bubble(fr_heap_t *hp, size_t child)
  */
 int fr_heap_extract(fr_heap_t *hp, void *data)
 {
-	int parent, child, max;
+	int parent, child, max, last, i;
 
 	if (!hp || (hp->num_elements == 0)) return 0;
 
@@ -181,19 +310,24 @@ int fr_heap_extract(fr_heap_t *hp, void *data)
 	}
 
 	RESET_OFFSET(hp, parent);
-	child = HEAP_LEFT(parent);
+	child = HEAP_LEFT(hp, parent);
 	while (child <= max) {
+		int smallest = child;
+
 		/*
-		 *	Maybe take the right child.
+		 *	Take the smallest child.
 		 */
-		if ((child != max) &&
-		    (hp->cmp(hp->p[child + 1], hp->p[child]) < 0)) {
-			child = child + 1;
+		last = child + hp->arity - 1;
+		if (last > max) last = max;
+
+		for (i = child + 1; i <= last; i++) {
+			if (hp->cmp(hp->p[i], hp->p[smallest]) < 0) smallest = i;
 		}
-		hp->p[parent] = hp->p[child];
+
+		hp->p[parent] = hp->p[smallest];
 		SET_OFFSET(hp, parent);
-		parent = child;
-		child = HEAP_LEFT(child);
+		parent = smallest;
+		child = HEAP_LEFT(hp, smallest);
 	}
 	hp->num_elements--;
 
@@ -297,19 +431,17 @@ static int heap_cmp(void const *one, void const *two)
 
 #define ARRAY_SIZE (1024)
 
-int main(int argc, char **argv)
+static void heap_test(unsigned int arity, bool bulk, int skip)
 {
 	fr_heap_t *hp;
 	int i;
 	heap_thing array[ARRAY_SIZE];
-	int skip = 0;
-	int left;
+	void *ptrs[ARRAY_SIZE];
+	int left, last;
 
-	if (argc > 1) {
-		skip = atoi(argv[1]);
-	}
+	printf("arity %u, %s insert\n", arity, bulk ? "bulk" : "single");
 
-	hp = fr_heap_create(heap_cmp, offsetof(heap_thing, heap));
+	hp = fr_heap_create_arity(heap_cmp, offsetof(heap_thing, heap), arity);
 	if (!hp) {
 		fprintf(stderr, "Failed creating heap!\n");
 		fr_exit(1);
@@ -317,7 +449,28 @@ int main(int argc, char **argv)
 
 	for (i = 0; i < ARRAY_SIZE; i++) {
 		array[i].data = rand() % 65537;
-		if (!fr_heap_insert(hp, &array[i])) {
+		ptrs[i] = &array[i];
+	}
+
+	if (bulk) {
+		/*
+		 *	A few single inserts, and then one big bulk insert.
+		 */
+		for (i = 0; i < 10; i++) {
+			if (!fr_heap_insert(hp, &array[i])) {
+				fprintf(stderr, "Failed inserting %d\n", i);
+				fr_exit(1);
+			}
+		}
+
+		if (!fr_heap_insert_bulk(hp, ptrs + 10, ARRAY_SIZE - 10)) {
+			fprintf(stderr, "Failed bulk insert\n");
+			fr_exit(1);
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE; i++) {
+		if (!bulk && !fr_heap_insert(hp, &array[i])) {
 			fprintf(stderr, "Failed inserting %d\n", i);
 			fr_exit(1);
 		}
@@ -326,6 +479,11 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Inserted but not in heap %d\n", i);
 			fr_exit(1);
 		}
+
+		if (hp->p[array[i].heap] != &array[i]) {
+			fprintf(stderr, "heap offset is wrong %d\n", i);
+			fr_exit(1);
+		}
 	}
 
 #if 0
@@ -362,6 +520,7 @@ int main(int argc, char **argv)
 	left = fr_heap_num_elements(hp);
 	printf("%d elements left in the heap\n", left);
 
+	last = -1;
 	for (i = 0; i < left; i++) {
 		heap_thing *t = fr_heap_peek(hp);
 
@@ -370,7 +529,11 @@ int main(int argc, char **argv)
 			fr_exit(1);
 		}
 
-		printf("%d\t%d\n", i, t->data);
+		if (t->data < last) {
+			fprintf(stderr, "Extracted %d after %d\n", t->data, last);
+			fr_exit(1);
+		}
+		last = t->data;
 
 		if (!fr_heap_extract(hp, NULL)) {
 			fprintf(stderr, "Failed extracting %d\n", i);
@@ -384,6 +547,21 @@ int main(int argc, char **argv)
 	}
 
 	fr_heap_delete(hp);
+}
+
+int main(int argc, char **argv)
+{
+	int skip = 0;
+	unsigned int arity;
+
+	if (argc > 1) {
+		skip = atoi(argv[1]);
+	}
+
+	for (arity = 2; arity <= 8; arity *= 2) {
+		heap_test(arity, false, skip);
+		heap_test(arity, true, skip);
+	}
 
 	return 0;
 }
@@ -33,24 +33,27 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/md5.h>
 
-/** Calculate HMAC using MD5
+/** Pre-compute the MD5 states for a shared secret
  *
- * @param digest Caller digest to be filled in.
- * @param text Pointer to data stream.
- * @param text_len length of data stream.
- * @param key Pointer to authentication key.
- * @param key_len Length of authentication key.
+ *  The HMAC-MD5 inner and outer pads are each a full MD5 block, so
+ *  absorbing them once saves two MD5 transforms for every later
+ *  HMAC with the same key.  The prefix state is for "MD5(secret + ...)"
+ *  as used by RADIUS password encryption.
  *
+ * @param[out] ms where the states are written.
+ * @param[in] key the shared secret.
+ * @param[in] key_len the length of the shared secret.
  */
-void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
-		 uint8_t const *key, size_t key_len)
+void fr_md5_secret_init(fr_md5_secret_t *ms, uint8_t const *key, size_t key_len)
 {
-	FR_MD5_CTX context;
 	uint8_t k_ipad[65];    /* inner padding - key XORd with ipad */
 	uint8_t k_opad[65];    /* outer padding - key XORd with opad */
 	uint8_t tk[16];
 	int i;
 
+	fr_md5_init(&ms->prefix);
+	fr_md5_update(&ms->prefix, key, key_len);
+
 	/* if key is longer than 64 bytes reset it to key=MD5(key) */
 	if (key_len > 64) {
 		FR_MD5_CTX tctx;
@@ -86,25 +89,59 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 		k_ipad[i] ^= 0x36;
 		k_opad[i] ^= 0x5c;
 	}
+
+	fr_md5_init(&ms->inner);
+	fr_md5_update(&ms->inner, k_ipad, 64);	/* start with inner pad */
+
+	fr_md5_init(&ms->outer);
+	fr_md5_update(&ms->outer, k_opad, 64);	/* start with outer pad */
+}
+
+/** Calculate HMAC-MD5 using pre-computed states from fr_md5_secret_init()
+ *
+ * @param[out] digest Caller digest to be filled in.
+ * @param[in] text Pointer to data stream.
+ * @param[in] text_len length of data stream.
+ * @param[in] ms the pre-computed states for the key.
+ */
+void fr_hmac_md5_secret(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			fr_md5_secret_t const *ms)
+{
+	FR_MD5_CTX context;
+
 	/*
 	 * perform inner MD5
 	 */
-	fr_md5_init(&context);		   /* init context for 1st
-					      * pass */
-	fr_md5_update(&context, k_ipad, 64);      /* start with inner pad */
+	fr_md5_copy(&context, &ms->inner);
 	fr_md5_update(&context, text, text_len); /* then text of datagram */
 	fr_md5_final(digest, &context);	  /* finish up 1st pass */
 	/*
 	 * perform outer MD5
 	 */
-	fr_md5_init(&context);		   /* init context for 2nd
-					      * pass */
-	fr_md5_update(&context, k_opad, 64);     /* start with outer pad */
+	fr_md5_copy(&context, &ms->outer);
 	fr_md5_update(&context, digest, 16);     /* then results of 1st
 					      * hash */
 	fr_md5_final(digest, &context);	  /* finish up 2nd pass */
 }
 
+/** Calculate HMAC using MD5
+ *
+ * @param digest Caller digest to be filled in.
+ * @param text Pointer to data stream.
+ * @param text_len length of data stream.
+ * @param key Pointer to authentication key.
+ * @param key_len Length of authentication key.
+ *
+ */
+void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+		 uint8_t const *key, size_t key_len)
+{
+	fr_md5_secret_t ms;
+
+	fr_md5_secret_init(&ms, key, key_len);
+	fr_hmac_md5_secret(digest, text, text_len, &ms);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
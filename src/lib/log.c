@@ -37,11 +37,51 @@ RCSID("$Id$")
 #endif
 
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
 
 #define FR_STRERROR_BUFSIZE (2048)
 
+#define LOG_RING_SIZE		(256 * 1024)	//!< Bytes of log messages buffered per thread.
+#define LOG_RING_ALIGN(_x)	(((_x) + 7) & ~((size_t) 7))
+
+/** Header for a message in a log ring
+ *
+ */
+typedef struct log_ring_msg_t {
+	int			fd;		//!< To write the message to.  -1 means skip to the start of the ring.
+	uint32_t		len;		//!< Length of the message, which follows the header.
+} log_ring_msg_t;
+
+/** Messages written by one thread, waiting to be written by the log thread
+ *
+ * There is one producer (the thread which owns the ring), and one
+ * consumer (the log thread), so head and tail are only ever written by
+ * one thread each, and no locks are needed.
+ */
+typedef struct log_ring_t log_ring_t;
+struct log_ring_t {
+	log_ring_t		*next;		//!< Next ring in the list of all rings.
+	bool			orphaned;	//!< The owning thread has exited.
+	size_t			head;		//!< Total bytes written.  Only changed by the producer.
+	size_t			tail;		//!< Total bytes consumed.  Only changed by the consumer.
+	uint8_t			data[LOG_RING_SIZE];
+};
+
 fr_thread_local_setup(char *, fr_strerror_buffer)	/* macro */
 fr_thread_local_setup(char *, fr_syserror_buffer)	/* macro */
+fr_thread_local_setup(log_ring_t *, fr_log_ring)	/* macro */
+
+static bool		log_async;		//!< Messages for file descriptors go via the log thread.
+static bool		log_async_stop;		//!< Tell the log thread to write everything, and exit.
+static pthread_t	log_async_thread;
+static pthread_mutex_t	log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Protects log_rings.
+static log_ring_t	*log_rings;		//!< All rings, including orphaned ones.
 
 #ifndef NDEBUG
 /** POSIX-2008 errno macros
@@ -454,6 +494,239 @@ static const FR_NAME_NUMBER colours[] = {
 };
 
 
+/** Mark a thread's ring as orphaned, so the log thread frees it once it's empty
+ *
+ */
+static void _log_ring_orphan(void *arg)
+{
+	log_ring_t *ring = arg;
+
+	__atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+/** Write all of a vector
+ *
+ */
+static void log_writev(int fd, struct iovec *vector, int vector_len)
+{
+	while (vector_len > 0) {
+		ssize_t slen;
+
+		slen = writev(fd, vector, vector_len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return;		/* Nowhere to report the error */
+		}
+
+		while ((vector_len > 0) && ((size_t) slen >= vector->iov_len)) {
+			slen -= vector->iov_len;
+			vector++;
+			vector_len--;
+		}
+
+		if (slen > 0) {
+			vector->iov_base = ((uint8_t *) vector->iov_base) + slen;
+			vector->iov_len -= slen;
+		}
+	}
+}
+
+/** Write out everything in a ring
+ *
+ * @return the number of bytes consumed from the ring.
+ */
+static size_t log_ring_drain(log_ring_t *ring)
+{
+	struct iovec	vector[IOV_MAX];
+	int		vector_len = 0;
+	int		fd = -1;
+	size_t		head, tail, start;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	start = tail = ring->tail;
+
+	while (tail != head) {
+		log_ring_msg_t *msg = (log_ring_msg_t *) (ring->data + (tail % LOG_RING_SIZE));
+
+		if (msg->fd < 0) {
+			tail += LOG_RING_SIZE - (tail % LOG_RING_SIZE);
+			continue;
+		}
+
+		/*
+		 *	Batch up consecutive messages for the same fd.
+		 */
+		if ((vector_len == IOV_MAX) || ((vector_len > 0) && (msg->fd != fd))) {
+			log_writev(fd, vector, vector_len);
+			vector_len = 0;
+		}
+
+		fd = msg->fd;
+		vector[vector_len].iov_base = (uint8_t *) (msg + 1);
+		vector[vector_len].iov_len = msg->len;
+		vector_len++;
+
+		tail += LOG_RING_ALIGN(sizeof(*msg) + msg->len);
+	}
+
+	if (vector_len > 0) log_writev(fd, vector, vector_len);
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	return tail - start;
+}
+
+/** Write the messages from all rings
+ *
+ */
+static void *log_async_writer(UNUSED void *arg)
+{
+	for (;;) {
+		log_ring_t	*ring, **last;
+		size_t		written = 0;
+		bool		stop;
+
+		stop = __atomic_load_n(&log_async_stop, __ATOMIC_ACQUIRE);
+
+		pthread_mutex_lock(&log_rings_mutex);
+		last = &log_rings;
+		for (ring = log_rings; ring; ring = *last) {
+			written += log_ring_drain(ring);
+
+			/*
+			 *	The thread has exited, and we've
+			 *	written everything it logged.
+			 */
+			if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+			    (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)) {
+				*last = ring->next;
+				talloc_free(ring);
+				continue;
+			}
+			last = &ring->next;
+		}
+		pthread_mutex_unlock(&log_rings_mutex);
+
+		if (written) continue;
+		if (stop) break;
+
+		/*
+		 *	Nothing to do.  Waking up a few times a
+		 *	second is cheaper than signalling on
+		 *	every message.
+		 */
+		{
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/** Add a message to this thread's ring
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the message should be written directly.
+ */
+static int log_ring_write(int fd, char const *buffer, size_t len)
+{
+	log_ring_t	*ring = fr_log_ring;
+	log_ring_msg_t	*msg;
+	size_t		need, skip, head, off;
+
+	need = LOG_RING_ALIGN(sizeof(*msg) + len);
+	if (need > (LOG_RING_SIZE / 4)) return -1;
+
+	if (!ring) {
+		ring = talloc_zero(NULL, log_ring_t);
+		if (!ring) return -1;
+
+		fr_thread_local_set_destructor(fr_log_ring, _log_ring_orphan, ring);
+
+		pthread_mutex_lock(&log_rings_mutex);
+		ring->next = log_rings;
+		log_rings = ring;
+		pthread_mutex_unlock(&log_rings_mutex);
+	}
+
+	head = ring->head;
+	off = head % LOG_RING_SIZE;
+
+	/*
+	 *	Messages are contiguous.  If this one doesn't fit
+	 *	before the end of the ring, skip to the start.
+	 */
+	skip = ((off + need) > LOG_RING_SIZE) ? (LOG_RING_SIZE - off) : 0;
+
+	/*
+	 *	The log thread is behind.  Wait for it, rather than
+	 *	losing messages.
+	 */
+	while ((LOG_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))) < (skip + need)) {
+		struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000 };
+
+		nanosleep(&ts, NULL);
+	}
+
+	if (skip) {
+		((log_ring_msg_t *) (ring->data + off))->fd = -1;
+		head += skip;
+		off = 0;
+	}
+
+	msg = (log_ring_msg_t *) (ring->data + off);
+	msg->fd = fd;
+	msg->len = len;
+	memcpy(msg + 1, buffer, len);
+
+	__atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/** Write log messages for files and stdio from a separate thread
+ *
+ * Each thread which logs gets its own ring of formatted messages.  A log
+ * thread copies messages out of the rings in batches with writev(), so
+ * threads which log don't make a system call per message, or contend on
+ * the log file.
+ *
+ * Syslog is unaffected.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(void)
+{
+	if (log_async) return 0;
+
+	log_async_stop = false;
+	if (pthread_create(&log_async_thread, NULL, log_async_writer, NULL) != 0) {
+		fr_strerror_printf("Failed creating log thread: %s", fr_syserror(errno));
+		return -1;
+	}
+	log_async = true;
+
+	return 0;
+}
+
+/** Write any buffered messages, and stop the log thread
+ *
+ * Messages logged after this is called are written directly.
+ */
+void fr_log_async_stop(void)
+{
+	if (!log_async) return;
+
+	log_async = false;
+	__atomic_store_n(&log_async_stop, true, __ATOMIC_RELEASE);
+	pthread_join(log_async_thread, NULL);
+}
+
 bool log_dates_utc = false;
 
 fr_log_t default_log = {
@@ -654,7 +927,10 @@ int fr_vlog(fr_log_t const *log, log_type_t type, char const *msg, va_list ap)
 	case L_DST_FILES:
 	case L_DST_STDOUT:
 	case L_DST_STDERR:
-		return write(log->fd, buffer, strlen(buffer));
+		len = strlen(buffer);
+		if (log_async && (log_ring_write(log->fd, buffer, len) == 0)) return len;
+
+		return write(log->fd, buffer, len);
 
 	default:
 	case L_DST_NULL:	/* should have been caught above */
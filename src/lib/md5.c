@@ -34,6 +34,99 @@ void fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen)
 	fr_md5_final(out, &ctx);
 }
 
+/*
+ *	These are also used by the multi-buffer code below, which works
+ *	on vectors of lanes.
+ */
+#define PUT_32BIT_LE(cp, value) do {\
+	(cp)[3] = (value) >> 24;\
+	(cp)[2] = (value) >> 16;\
+	(cp)[1] = (value) >> 8;\
+	(cp)[0] = (value);\
+} while (0)
+
+/* The four core functions - F1 is optimized somewhat */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/* This is the central step in the MD5 algorithm. */
+#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
+
+/*
+ *	The 64 steps, shared by the scalar and the multi-buffer transforms.
+ */
+#define MD5_ROUNDS(a, b, c, d, in) do {\
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23); \
+\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21); \
+} while (0)
+
 #ifndef HAVE_OPENSSL_EVP_H
 /*
  * This code implements the MD5 message-digest algorithm.
@@ -62,13 +155,6 @@ void fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen)
 	(cp)[0] = (value)[0];\
 } while (0)
 
-#define PUT_32BIT_LE(cp, value) do {\
-	(cp)[3] = (value) >> 24;\
-	(cp)[2] = (value) >> 16;\
-	(cp)[1] = (value) >> 8;\
-	(cp)[0] = (value);\
-} while (0)
-
 static const uint8_t PADDING[MD5_BLOCK_LENGTH] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -166,15 +252,6 @@ void fr_md5_final(uint8_t out[MD5_DIGEST_LENGTH], FR_MD5_CTX *ctx)
 	memset(ctx, 0, sizeof(*ctx));	/* in case it's sensitive */
 }
 
-/* The four core functions - F1 is optimized somewhat */
-#define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
-#define F4(x, y, z) (y ^ (x | ~z))
-
-/* This is the central step in the MD5 algorithm. */
-#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
-
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -201,73 +278,7 @@ void fr_md5_transform(uint32_t state[4], uint8_t const block[MD5_BLOCK_LENGTH])
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_ROUNDS(a, b, c, d, in);
 
 	state[0] += a;
 	state[1] += b;
@@ -275,3 +286,217 @@ void fr_md5_transform(uint32_t state[4], uint8_t const block[MD5_BLOCK_LENGTH])
 	state[3] += d;
 }
 #endif
+
+/*
+ *	Multi-buffer MD5.
+ *
+ *	MD5 is a serial chain of dependent operations, so one message
+ *	can't use more than one ALU lane.  Instead, we hash up to
+ *	FR_MD5_LANES independent messages at once, with the state for
+ *	each message held in one lane of a vector.  The compiler turns
+ *	the vector operations into SSE2, AVX2, or NEON instructions as
+ *	appropriate.
+ */
+#define FR_MD5_LANES	(8)
+
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+typedef uint32_t fr_md5_vec_t __attribute__ ((vector_size(FR_MD5_LANES * sizeof(uint32_t))));
+
+/** Copy part of the input for a job into a block
+ *
+ * @param[out] block to write to.
+ * @param[in] offset of the block in the message.
+ * @param[in] data to copy from.
+ * @param[in] start offset of the data in the message.
+ * @param[in] len of the data.
+ */
+static inline void fr_md5_job_copy(uint8_t block[MD5_BLOCK_LENGTH], size_t offset,
+				   uint8_t const *data, size_t start, size_t len)
+{
+	size_t from, to;
+
+	from = (start > offset) ? start : offset;
+	to = start + len;
+	if (to > offset + MD5_BLOCK_LENGTH) to = offset + MD5_BLOCK_LENGTH;
+	if (from >= to) return;
+
+	memcpy(block + (from - offset), data + (from - start), to - from);
+}
+
+/** Build one block of the padded message for a job
+ *
+ *  The message is the input, followed by the suffix, followed by
+ *  the usual MD5 padding.
+ *
+ * @param[out] block to write to.
+ * @param[in] job to build the block for.
+ * @param[in] blk the block number.
+ * @param[in] nblocks the total number of blocks in the padded message.
+ */
+static void fr_md5_job_block(uint8_t block[MD5_BLOCK_LENGTH], fr_md5_job_t const *job, size_t blk, size_t nblocks)
+{
+	size_t		offset = blk * MD5_BLOCK_LENGTH;
+	size_t		total = job->inlen + job->suffix_len;
+	uint64_t	bits;
+	int		i;
+
+	memset(block, 0, MD5_BLOCK_LENGTH);
+
+	fr_md5_job_copy(block, offset, job->in, 0, job->inlen);
+	if (job->suffix_len) fr_md5_job_copy(block, offset, job->suffix, job->inlen, job->suffix_len);
+
+	if ((total >= offset) && (total < offset + MD5_BLOCK_LENGTH)) block[total - offset] = 0x80;
+
+	if (blk != (nblocks - 1)) return;
+
+	bits = ((uint64_t) total) << 3;
+	for (i = 0; i < 8; i++) block[MD5_BLOCK_LENGTH - 8 + i] = bits >> (i * 8);
+}
+
+/** Hash 2..FR_MD5_LANES jobs in parallel
+ *
+ *  Lanes which have finished, or which are unused, still run
+ *  through the rounds, but their results are masked out.
+ */
+static inline CC_HINT(always_inline) void fr_md5_multi_lanes(fr_md5_job_t *jobs, int num)
+{
+	fr_md5_vec_t	a, b, c, d, sa, sb, sc, sd, mask, in[MD5_BLOCK_LENGTH / 4];
+	uint8_t		block[FR_MD5_LANES][MD5_BLOCK_LENGTH];
+	size_t		nblocks[FR_MD5_LANES], max = 0, blk;
+	int		i, w;
+
+	for (i = 0; i < FR_MD5_LANES; i++) {
+		if (i >= num) {
+			nblocks[i] = 0;
+			continue;
+		}
+
+		nblocks[i] = ((jobs[i].inlen + jobs[i].suffix_len + 8) / MD5_BLOCK_LENGTH) + 1;
+		if (nblocks[i] > max) max = nblocks[i];
+	}
+
+	sa = (fr_md5_vec_t){ 0 } + 0x67452301;
+	sb = (fr_md5_vec_t){ 0 } + 0xefcdab89;
+	sc = (fr_md5_vec_t){ 0 } + 0x98badcfe;
+	sd = (fr_md5_vec_t){ 0 } + 0x10325476;
+
+	for (blk = 0; blk < max; blk++) {
+		for (i = 0; i < FR_MD5_LANES; i++) {
+			if (blk < nblocks[i]) {
+				fr_md5_job_block(block[i], &jobs[i], blk, nblocks[i]);
+				mask[i] = ~((uint32_t) 0);
+			} else {
+				memset(block[i], 0, sizeof(block[i]));
+				mask[i] = 0;
+			}
+		}
+
+		/*
+		 *	Transpose the blocks, so that each vector
+		 *	holds the same word from every lane.
+		 */
+		for (w = 0; w < MD5_BLOCK_LENGTH / 4; w++) {
+			for (i = 0; i < FR_MD5_LANES; i++) {
+				uint8_t const *p = block[i] + (w * 4);
+
+				in[w][i] = (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+					   (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+			}
+		}
+
+		a = sa;
+		b = sb;
+		c = sc;
+		d = sd;
+
+		MD5_ROUNDS(a, b, c, d, in);
+
+		sa += a & mask;
+		sb += b & mask;
+		sc += c & mask;
+		sd += d & mask;
+	}
+
+	for (i = 0; i < num; i++) {
+		PUT_32BIT_LE(jobs[i].out, sa[i]);
+		PUT_32BIT_LE(jobs[i].out + 4, sb[i]);
+		PUT_32BIT_LE(jobs[i].out + 8, sc[i]);
+		PUT_32BIT_LE(jobs[i].out + 12, sd[i]);
+	}
+}
+
+static void fr_md5_multi_generic(fr_md5_job_t *jobs, int num)
+{
+	fr_md5_multi_lanes(jobs, num);
+}
+
+#  if defined(__x86_64__) && (defined(__clang__) || (__GNUC__ >= 5))
+/*
+ *	The default x86_64 target only has SSE2, which needs two
+ *	instructions per vector operation.  Build a second copy for
+ *	AVX2, and pick one at run time.
+ */
+static CC_HINT(target("avx2")) void fr_md5_multi_avx2(fr_md5_job_t *jobs, int num)
+{
+	fr_md5_multi_lanes(jobs, num);
+}
+
+static void fr_md5_multi(fr_md5_job_t *jobs, int num)
+{
+	static int have_avx2 = -1;
+
+	if (have_avx2 < 0) have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+
+	if (have_avx2) {
+		fr_md5_multi_avx2(jobs, num);
+		return;
+	}
+
+	fr_md5_multi_generic(jobs, num);
+}
+#  else
+#    define fr_md5_multi fr_md5_multi_generic
+#  endif
+#endif	/* __GNUC__ || __clang__ */
+
+/** Calculate the MD5 hashes of multiple independent messages
+ *
+ *  Each message is job->in, followed by job->suffix (which may be
+ *  empty).  The suffix lets callers hash "packet + secret" without
+ *  copying the secret into the packet buffer.
+ *
+ *  Batches of messages are hashed in parallel, which is much faster
+ *  than calling fr_md5_calc() for each one.  The batches work best
+ *  when the messages are of similar lengths.
+ *
+ * @param[in,out] jobs to hash.  The digests are written to jobs[i].out.
+ * @param[in] num the number of jobs.
+ */
+void fr_md5_calc_multi(fr_md5_job_t *jobs, int num)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	while (num > 1) {
+		int n = (num > FR_MD5_LANES) ? FR_MD5_LANES : num;
+
+		fr_md5_multi(jobs, n);
+		jobs += n;
+		num -= n;
+	}
+#endif
+
+	while (num > 0) {
+		FR_MD5_CTX ctx;
+
+		fr_md5_init(&ctx);
+		fr_md5_update(&ctx, jobs->in, jobs->inlen);
+		if (jobs->suffix_len) fr_md5_update(&ctx, jobs->suffix, jobs->suffix_len);
+		fr_md5_final(jobs->out, &ctx);
+
+		jobs++;
+		num--;
+	}
+}
@@ -31,6 +31,19 @@ RCSID("$Id$")
 #include <pwd.h>
 #include <sys/uio.h>
 
+/*
+ *	SSE2 and NEON are part of the base x86_64 and aarch64
+ *	instruction sets, so the hex codecs can use them without
+ *	checking the CPU at run time.
+ */
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define HEX_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define HEX_NEON
+#endif
+
 #ifdef HAVE_DIRENT_H
 #include <dirent.h>
 
@@ -253,6 +266,89 @@ int rad_unlockfd(int fd, int lock_len)
 
 static char const hextab[] = "0123456789abcdef";
 
+#ifdef HEX_SSE2
+/** Convert 32 hex digits to 16 bytes
+ *
+ * @return false if any of the characters isn't a hex digit.
+ */
+static inline bool hex2bin_sse2(uint8_t *bin, char const *hex)
+{
+	__m128i	in[2], val[2];
+	int	i;
+
+	in[0] = _mm_loadu_si128((__m128i const *) hex);
+	in[1] = _mm_loadu_si128((__m128i const *) (hex + 16));
+
+	for (i = 0; i < 2; i++) {
+		__m128i digit, alpha, is_digit, is_alpha;
+
+		/*
+		 *	There are no unsigned byte comparisons, but
+		 *	x <= max is the same as min(x, max) == x.
+		 */
+		digit = _mm_sub_epi8(in[i], _mm_set1_epi8('0'));
+		is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+
+		alpha = _mm_sub_epi8(_mm_or_si128(in[i], _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+		is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+
+		if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) return false;
+
+		val[i] = _mm_or_si128(_mm_and_si128(is_digit, digit),
+				      _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+
+		/*
+		 *	Each 16 bit lane holds the high nibble in its
+		 *	low byte, and the low nibble in its high byte.
+		 */
+		val[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(val[i], _mm_set1_epi16(0x00ff)), 4),
+				      _mm_srli_epi16(val[i], 8));
+	}
+
+	_mm_storeu_si128((__m128i *) bin, _mm_packus_epi16(val[0], val[1]));
+
+	return true;
+}
+#endif
+
+#ifdef HEX_NEON
+/** Convert 32 hex digits to 16 bytes
+ *
+ * @return false if any of the characters isn't a hex digit.
+ */
+static inline bool hex2bin_neon(uint8_t *bin, char const *hex)
+{
+	uint8x16x2_t	in;
+	uint8x16_t	val[2], valid;
+	int		i;
+
+	/*
+	 *	De-interleaves the characters, so in.val[0] has
+	 *	the high nibbles, and in.val[1] the low nibbles.
+	 */
+	in = vld2q_u8((uint8_t const *) hex);
+
+	valid = vdupq_n_u8(0xff);
+	for (i = 0; i < 2; i++) {
+		uint8x16_t digit, alpha, is_digit, is_alpha;
+
+		digit = vsubq_u8(in.val[i], vdupq_n_u8('0'));
+		is_digit = vcleq_u8(digit, vdupq_n_u8(9));
+
+		alpha = vsubq_u8(vorrq_u8(in.val[i], vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+		is_alpha = vcleq_u8(alpha, vdupq_n_u8(5));
+
+		valid = vandq_u8(valid, vorrq_u8(is_digit, is_alpha));
+		val[i] = vbslq_u8(is_digit, digit, vaddq_u8(alpha, vdupq_n_u8(10)));
+	}
+	if (vminvq_u8(valid) != 0xff) return false;
+
+	vst1q_u8(bin, vorrq_u8(vshlq_n_u8(val[0], 4), val[1]));
+
+	return true;
+}
+#endif
+
 /** Convert hex strings to binary data
  *
  * @param bin Buffer to write output to.
@@ -263,7 +359,7 @@ static char const hextab[] = "0123456789abcdef";
  */
 size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 {
-	size_t i;
+	size_t i = 0;
 	size_t len;
 	char *c1, *c2;
 
@@ -274,7 +370,18 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 	len = inlen >> 1;
 	if (len > outlen) len = outlen;
 
-	for (i = 0; i < len; i++) {
+	/*
+	 *	Convert 16 bytes at a time, until there's a block
+	 *	with something which isn't a hex digit.  The loop
+	 *	below then finds exactly where conversion stops.
+	 */
+#if defined(HEX_SSE2)
+	while (((len - i) >= 16) && hex2bin_sse2(bin + i, hex + (i << 1))) i += 16;
+#elif defined(HEX_NEON)
+	while (((len - i) >= 16) && hex2bin_neon(bin + i, hex + (i << 1))) i += 16;
+#endif
+
+	for (; i < len; i++) {
 		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
 		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
 			break;
@@ -297,9 +404,49 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
  */
 size_t fr_bin2hex(char *hex, uint8_t const *bin, size_t inlen)
 {
-	size_t i;
+	size_t i = 0;
 
-	for (i = 0; i < inlen; i++) {
+#if defined(HEX_SSE2)
+	for (; (inlen - i) >= 16; i += 16) {
+		__m128i in, hi, lo;
+
+		in = _mm_loadu_si128((__m128i const *) bin);
+		hi = _mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(0x0f));
+		lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+		/*
+		 *	'a' is 39 more than the character after '9'.
+		 */
+		hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')),
+				  _mm_and_si128(_mm_cmpgt_epi8(hi, _mm_set1_epi8(9)), _mm_set1_epi8(39)));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')),
+				  _mm_and_si128(_mm_cmpgt_epi8(lo, _mm_set1_epi8(9)), _mm_set1_epi8(39)));
+
+		_mm_storeu_si128((__m128i *) hex, _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *) (hex + 16), _mm_unpackhi_epi8(hi, lo));
+		hex += 32;
+		bin += 16;
+	}
+#elif defined(HEX_NEON)
+	{
+		uint8x16_t table = vld1q_u8((uint8_t const *) hextab);
+
+		for (; (inlen - i) >= 16; i += 16) {
+			uint8x16_t	in;
+			uint8x16x2_t	out;
+
+			in = vld1q_u8(bin);
+			out.val[0] = vqtbl1q_u8(table, vshrq_n_u8(in, 4));
+			out.val[1] = vqtbl1q_u8(table, vandq_u8(in, vdupq_n_u8(0x0f)));
+
+			vst2q_u8((uint8_t *) hex, out);
+			hex += 32;
+			bin += 16;
+		}
+	}
+#endif
+
+	for (; i < inlen; i++) {
 		hex[0] = hextab[((*bin) >> 4) & 0x0f];
 		hex[1] = hextab[*bin & 0x0f];
 		hex += 2;
@@ -794,6 +941,135 @@ static char *mystrtok(char **ptr, char const *sep)
 	return res;
 }
 
+/** The start of the last hour converted by #time_from_str_fast
+ *
+ */
+typedef struct {
+	int		year;			//!< tm_year.
+	int		mon;			//!< tm_mon.
+	int		mday;			//!< tm_mday.
+	int		hour;			//!< tm_hour.
+	time_t		start;			//!< Of the hour, as returned by mktime().
+} time_from_str_cache_t;
+
+fr_thread_local_setup(time_from_str_cache_t *, time_from_str_cache)	/* macro */
+
+static void _time_from_str_cache_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Parse exactly n digits
+ *
+ */
+static inline bool time_digits(int *out, char const *p, int n)
+{
+	int i, num = 0;
+
+	for (i = 0; i < n; i++) {
+		unsigned int digit = (uint8_t) p[i] - '0';
+
+		if (digit > 9) return false;
+		num = (num * 10) + digit;
+	}
+
+	*out = num;
+	return true;
+}
+
+/** Convert "%b %e %Y %H:%M:%S [%Z]" to a time_t
+ *
+ * This is the format the server prints dates in, so it's what we
+ * read back from detail files, and other places dates are stored.
+ *
+ * mktime() is slow, as it has to check the timezone rules.  The
+ * offset only changes on the hour, so we remember the last hour
+ * converted, and add the minutes and seconds to it.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the string isn't in the expected format.
+ */
+static int time_from_str_fast(time_t *date, char const *p)
+{
+	time_from_str_cache_t	*cache;
+	int			mon, mday, year, hour, min, sec;
+
+	for (mon = 0; mon < 12; mon++) {
+		if (strncasecmp(months[mon], p, 3) == 0) break;
+	}
+	if ((mon == 12) || (p[3] != ' ')) return -1;
+	p += 3;
+	while (*p == ' ') p++;
+
+	/*
+	 *	%e is space padded, so the day is one or two digits.
+	 */
+	if (time_digits(&mday, p, 2)) {
+		p += 2;
+	} else if (time_digits(&mday, p, 1)) {
+		p += 1;
+	} else {
+		return -1;
+	}
+	if ((mday < 1) || (mday > 31) || (*p != ' ')) return -1;
+	while (*p == ' ') p++;
+
+	if (!time_digits(&year, p, 4) || (year < 1900) || (p[4] != ' ')) return -1;
+	p += 4;
+	while (*p == ' ') p++;
+
+	if (!time_digits(&hour, p, 2) || (p[2] != ':') ||
+	    !time_digits(&min, p + 3, 2) || (p[5] != ':') ||
+	    !time_digits(&sec, p + 6, 2)) return -1;
+	if ((hour > 23) || (min > 59) || (sec > 59)) return -1;
+	p += 8;
+
+	/*
+	 *	The timezone is ignored, as it is by the generic parser.
+	 */
+	if ((*p != '\0') && (*p != ' ') && (*p != '\t')) return -1;
+
+	cache = time_from_str_cache;
+	if (!cache) {
+		cache = talloc_zero(NULL, time_from_str_cache_t);
+		if (!cache) return -1;
+
+		cache->year = -1;
+		fr_thread_local_set_destructor(time_from_str_cache, _time_from_str_cache_free, cache);
+	}
+
+	if ((cache->year != year) || (cache->mon != mon) || (cache->mday != mday) || (cache->hour != hour)) {
+		struct tm	s_tm;
+		time_t		t;
+
+		memset(&s_tm, 0, sizeof(s_tm));
+		s_tm.tm_isdst = -1;
+		s_tm.tm_year = year - 1900;
+		s_tm.tm_mon = mon;
+		s_tm.tm_mday = mday;
+		s_tm.tm_hour = hour;
+
+		/*
+		 *	If the start of the hour doesn't exist, because
+		 *	the clocks went forward, mktime() normalises it.
+		 *	The generic parser copes with that.
+		 */
+		t = mktime(&s_tm);
+		if ((t == (time_t) -1) || (s_tm.tm_hour != hour) || (s_tm.tm_min != 0)) return -1;
+
+		cache->year = year;
+		cache->mon = mon;
+		cache->mday = mday;
+		cache->hour = hour;
+		cache->start = t;
+	}
+
+	*date = cache->start + (min * 60) + sec;
+
+	return 0;
+}
+
 /** Convert string in various formats to a time_t
  *
  * @param date_str input date string.
@@ -820,6 +1096,8 @@ int fr_time_from_str(time_t *date, char const *date_str)
 		return 0;
 	}
 
+	if (time_from_str_fast(date, date_str) == 0) return 0;
+
 	tm = &s_tm;
 	memset(tm, 0, sizeof(*tm));
 	tm->tm_isdst = -1;	/* don't know, and don't care about DST */
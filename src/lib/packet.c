@@ -255,7 +255,10 @@ typedef struct fr_packet_socket_t {
 	int		proto;
 #endif
 
-	uint8_t		id[32];
+	int		pool;		//!< Which pool the socket is in.
+	int		next;		//!< Next socket in the same pool, or -1.
+
+	uint64_t	id[4];		//!< Bitmap of allocated IDs.
 } fr_packet_socket_t;
 
 
@@ -264,6 +267,18 @@ typedef struct fr_packet_socket_t {
 #define SOCKOFFSET_MASK (MAX_SOCKETS - 1)
 #define SOCK2OFFSET(sockfd) ((sockfd * FNV_MAGIC_PRIME) & SOCKOFFSET_MASK)
 
+/*
+ *	Sockets are grouped into pools by destination IP and port,
+ *	so that allocating an ID only looks at sockets which can
+ *	reach the destination.  Sockets with a wildcard destination
+ *	go into their own pool, which is searched last.
+ */
+#define MAX_POOLS (64)
+#define POOL_ANY MAX_POOLS
+
+#define ID_WORD(_id) (((_id) >> 6) & 0x03)
+#define ID_BIT(_id) (((uint64_t) 1) << ((_id) & 0x3f))
+
 /*
  *	Structure defining a list of packets (incoming or outgoing)
  *	that should be managed.
@@ -276,9 +291,38 @@ struct fr_packet_list_t {
 	int		last_recv;
 	int		num_sockets;
 
+	int		pools[MAX_POOLS + 1];	//!< First socket in each pool, or -1.
+
 	fr_packet_socket_t sockets[MAX_SOCKETS];
 };
 
+/** Find which pool a destination belongs in
+ *
+ */
+static int packet_pool(fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&port, sizeof(port));
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		hash = fr_hash_update(&ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr), hash);
+		break;
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		hash = fr_hash_update(&ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr), hash);
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	return hash & (MAX_POOLS - 1);
+}
+
 
 /*
  *	Ugh.  Doing this on every sent/received packet is not nice.
@@ -335,6 +379,7 @@ bool fr_packet_list_socket_thaw(fr_packet_list_t *pl, int sockfd)
 bool fr_packet_list_socket_del(fr_packet_list_t *pl, int sockfd)
 {
 	fr_packet_socket_t *ps;
+	int *last;
 
 	if (!pl) return false;
 
@@ -343,6 +388,13 @@ bool fr_packet_list_socket_del(fr_packet_list_t *pl, int sockfd)
 
 	if (ps->num_outgoing != 0) return false;
 
+	for (last = &pl->pools[ps->pool]; *last >= 0; last = &pl->sockets[*last].next) {
+		if (&pl->sockets[*last] != ps) continue;
+
+		*last = ps->next;
+		break;
+	}
+
 	ps->sockfd = -1;
 	pl->num_sockets--;
 
@@ -429,6 +481,14 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	ps->dst_any = fr_is_inaddr_any(&ps->dst_ipaddr);
 	if (ps->dst_any < 0) return false;
 
+	if (ps->dst_any || !ps->dst_port) {
+		ps->pool = POOL_ANY;
+	} else {
+		ps->pool = packet_pool(&ps->dst_ipaddr, ps->dst_port);
+	}
+	ps->next = pl->pools[ps->pool];
+	pl->pools[ps->pool] = ps - pl->sockets;
+
 	/*
 	 *	As the last step before returning.
 	 */
@@ -475,6 +535,10 @@ fr_packet_list_t *fr_packet_list_create(int alloc_id)
 		pl->sockets[i].sockfd = -1;
 	}
 
+	for (i = 0; i <= MAX_POOLS; i++) {
+		pl->pools[i] = -1;
+	}
+
 	pl->alloc_id = alloc_id;
 
 	return pl;
@@ -584,6 +648,126 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 }
 
 
+/** Check whether a socket can be used to send a packet
+ *
+ */
+static bool packet_socket_usable(fr_packet_socket_t const *ps, int proto,
+				 RADIUS_PACKET const *request, int src_any)
+{
+	/*
+	 *	This socket is marked as "don't use for new
+	 *	packets".  But we can still receive packets
+	 *	that are outstanding.
+	 */
+	if (ps->dont_use) return false;
+
+	/*
+	 *	All IDs are allocated: ignore it.
+	 */
+	if (ps->num_outgoing == 256) return false;
+
+#ifdef WITH_TCP
+	if (ps->proto != proto) return false;
+#endif
+
+	/*
+	 *	Address families don't match, skip it.
+	 */
+	if (ps->src_ipaddr.af != request->dst_ipaddr.af) return false;
+
+	/*
+	 *	MUST match dst port, if we have one.
+	 */
+	if ((ps->dst_port != 0) &&
+	    (ps->dst_port != request->dst_port)) return false;
+
+	/*
+	 *	MUST match requested src port, if one has been given.
+	 */
+	if ((request->src_port != 0) &&
+	    (ps->src_port != request->src_port)) return false;
+
+	/*
+	 *	We don't care about the source IP, but this
+	 *	socket is link local, and the requested
+	 *	destination is not link local.  Ignore it.
+	 */
+	if (src_any && (ps->src_ipaddr.af == AF_INET) &&
+	    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
+	    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) return false;
+
+	/*
+	 *	We're sourcing from *, and they asked for a
+	 *	specific source address: ignore it.
+	 */
+	if (ps->src_any && !src_any) return false;
+
+	/*
+	 *	We're sourcing from a specific IP, and they
+	 *	asked for a source IP that isn't us: ignore
+	 *	it.
+	 */
+	if (!ps->src_any && !src_any &&
+	    (fr_ipaddr_cmp(&request->src_ipaddr,
+			   &ps->src_ipaddr) != 0)) return false;
+
+	/*
+	 *	UDP sockets are allowed to match
+	 *	destination IPs exactly, OR a socket
+	 *	with destination * is allowed to match
+	 *	any requested destination.
+	 *
+	 *	TCP sockets must match the destination
+	 *	exactly.  They *always* have dst_any=0,
+	 *	so the first check always matches.
+	 */
+	if (!ps->dst_any &&
+	    (fr_ipaddr_cmp(&request->dst_ipaddr,
+			   &ps->dst_ipaddr) != 0)) return false;
+
+	return true;
+}
+
+/** Allocate a free ID on a socket
+ *
+ *  Starts from a random word and bit, so that IDs aren't re-used
+ *  in order.
+ *
+ * @param[in] ps to allocate the ID on.
+ * @return
+ *	- -1 if all IDs are in use.
+ *	- the ID.
+ */
+static int packet_socket_id_alloc(fr_packet_socket_t *ps)
+{
+	int		i, word, bit, rot;
+	uint32_t	start;
+	uint64_t	ids;
+
+	start = fr_rand();
+	rot = (start >> 2) & 0x3f;
+
+	for (i = 0; i < 4; i++) {
+		word = (i + start) & 0x03;
+
+		ids = ~ps->id[word];
+		if (!ids) continue;
+
+		/*
+		 *	Rotate the free IDs right by "rot", so the
+		 *	lowest set bit is the first free ID at or
+		 *	after "rot".
+		 */
+		if (rot) ids = (ids >> rot) | (ids << (64 - rot));
+		bit = (__builtin_ctzll(ids) + rot) & 0x3f;
+
+		ps->id[word] |= ID_BIT(bit);
+		return (word * 64) + bit;
+	}
+
+	return -1;
+}
+
 /*
  *	1 == ID was allocated & assigned
  *	0 == couldn't allocate ID.
@@ -606,7 +790,7 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, id, pool;
 	int src_any = 0;
 	fr_packet_socket_t *ps= NULL;
 	RADIUS_PACKET *request = *request_p;
@@ -657,130 +841,42 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	 *	Id's only when all responses have been received, OR after
 	 *	a timeout.
 	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
+	 *	Right now, the random approach is almost OK... each
+	 *	socket starts its search for a free ID at a random
+	 *	place in its bitmap, which spreads the load a bit.
 	 */
 
-	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
-
-#define ID_i ((i + start_i) & SOCKOFFSET_MASK)
-	for (i = 0; i < MAX_SOCKETS; i++) {
-		if (pl->sockets[ID_i].sockfd == -1) continue; /* paranoia */
-
-		ps = &(pl->sockets[ID_i]);
-
-		/*
-		 *	This socket is marked as "don't use for new
-		 *	packets".  But we can still receive packets
-		 *	that are outstanding.
-		 */
-		if (ps->dont_use) continue;
-
-		/*
-		 *	All IDs are allocated: ignore it.
-		 */
-		if (ps->num_outgoing == 256) continue;
-
-#ifdef WITH_TCP
-		if (ps->proto != proto) continue;
-#endif
-
-		/*
-		 *	Address families don't match, skip it.
-		 */
-		if (ps->src_ipaddr.af != request->dst_ipaddr.af) continue;
-
-		/*
-		 *	MUST match dst port, if we have one.
-		 */
-		if ((ps->dst_port != 0) &&
-		    (ps->dst_port != request->dst_port)) continue;
-
-		/*
-		 *	MUST match requested src port, if one has been given.
-		 */
-		if ((request->src_port != 0) &&
-		    (ps->src_port != request->src_port)) continue;
-
-		/*
-		 *	We don't care about the source IP, but this
-		 *	socket is link local, and the requested
-		 *	destination is not link local.  Ignore it.
-		 */
-		if (src_any && (ps->src_ipaddr.af == AF_INET) &&
-		    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
-		    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) continue;
-
-		/*
-		 *	We're sourcing from *, and they asked for a
-		 *	specific source address: ignore it.
-		 */
-		if (ps->src_any && !src_any) continue;
-
-		/*
-		 *	We're sourcing from a specific IP, and they
-		 *	asked for a source IP that isn't us: ignore
-		 *	it.
-		 */
-		if (!ps->src_any && !src_any &&
-		    (fr_ipaddr_cmp(&request->src_ipaddr,
-				   &ps->src_ipaddr) != 0)) continue;
-
-		/*
-		 *	UDP sockets are allowed to match
-		 *	destination IPs exactly, OR a socket
-		 *	with destination * is allowed to match
-		 *	any requested destination.
-		 *
-		 *	TCP sockets must match the destination
-		 *	exactly.  They *always* have dst_any=0,
-		 *	so the first check always matches.
-		 */
-		if (!ps->dst_any &&
-		    (fr_ipaddr_cmp(&request->dst_ipaddr,
-				   &ps->dst_ipaddr) != 0)) continue;
-
-		/*
-		 *	Otherwise, this socket is OK to use.
-		 */
-
-		/*
-		 *	Look for a free Id, starting from a random number.
-		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
+	/*
+	 *	Sockets for this destination are always tried before
+	 *	sockets with a wildcard destination.
+	 *
+	 *	Within a pool, we use the first socket with free IDs.
+	 *	That way the caller only has to open a new socket when
+	 *	all of the existing ones are full.  Finding a free ID
+	 *	is a few bit operations, so the cost of allocation
+	 *	depends on the number of sockets for this destination,
+	 *	and not on the number of IDs in use.
+	 */
+	id = -1;
+	pool = packet_pool(&request->dst_ipaddr, request->dst_port);
+	for (;;) {
+		for (i = pl->pools[pool]; i >= 0; i = pl->sockets[i].next) {
+			ps = &pl->sockets[i];
 
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+			if (!packet_socket_usable(ps, proto, request, src_any)) continue;
 
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
-			}
-			if (fd >= 0) break;
+			id = packet_socket_id_alloc(ps);
+			if (id >= 0) break;
 		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
-		break;
+		if ((id >= 0) || (pool == POOL_ANY)) break;
+
+		pool = POOL_ANY;
 	}
 
 	/*
 	 *	Ask the caller to allocate a new ID.
 	 */
-	if (fd < 0) {
+	if (id < 0) {
 		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
 		return false;
 	}
@@ -808,7 +904,7 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	 *	Mark the ID as free.  This is the one line from
 	 *	id_free() that we care about here.
 	 */
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->id[ID_WORD(request->id)] &= ~ID_BIT(request->id);
 
 	request->id = -1;
 	request->sockfd = -1;
@@ -834,13 +930,7 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	ps = fr_socket_find(pl, request->sockfd);
 	if (!ps) return false;
 
-#if 0
-	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
-		fr_exit(1);
-	}
-#endif
-
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->id[ID_WORD(request->id)] &= ~ID_BIT(request->id);
 
 	ps->num_outgoing--;
 	pl->num_outgoing--;
@@ -27,6 +27,38 @@ RCSID("$Id$")
 
 #include <ctype.h>
 
+/*
+ *	Bumped whenever a cached VALUE_PAIR might no longer be the
+ *	first match for its attribute in its list.
+ */
+static uint64_t pair_list_generation;
+
+/** Invalidate any cached lookups of VALUE_PAIRs
+ *
+ *  Lookup caches only remember the first VALUE_PAIR matching an
+ *  attribute, and mark it as #VALUE_PAIR.cached.  The entries stay
+ *  valid while the generation number stays the same.
+ *
+ *  The generation is changed when a cached VALUE_PAIR is freed or
+ *  removed from its list, when a VALUE_PAIR is inserted anywhere other
+ *  than the end of a list, or when a list is re-ordered.  The list
+ *  and cursor functions do this automatically.  Code which re-links
+ *  VALUE_PAIRs by hand MUST call this function.
+ */
+void fr_pair_list_changed(void)
+{
+	__atomic_add_fetch(&pair_list_generation, 1, __ATOMIC_RELAXED);
+}
+
+/** Return the current generation of all VALUE_PAIR lists
+ *
+ * @return the generation number.
+ */
+uint64_t fr_pair_list_generation(void)
+{
+	return __atomic_load_n(&pair_list_generation, __ATOMIC_RELAXED);
+}
+
 /** Free a VALUE_PAIR
  *
  * @note Do not call directly, use talloc_free instead.
@@ -34,8 +66,10 @@ RCSID("$Id$")
  * @param vp to free.
  * @return 0
  */
-static int _fr_pair_free(NDEBUG_UNUSED VALUE_PAIR *vp)
+static int _fr_pair_free(VALUE_PAIR *vp)
 {
+	if (vp->cached) fr_pair_list_changed();
+
 #ifndef NDEBUG
 	vp->vp_integer = FREE_MAGIC;
 #endif
@@ -226,6 +260,8 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	if (!n) return NULL;
 
 	memcpy(n, vp, sizeof(*n));
+	n->borrowed = NULL;
+	n->cached = false;
 
 	/*
 	 *	Copy the unknown attribute hierarchy
@@ -1078,7 +1114,7 @@ int fr_pair_cmp(VALUE_PAIR *a, VALUE_PAIR *b)
 
 			if (!fr_cond_assert(a->vp_type == PW_TYPE_STRING)) return -1;
 
-			slen = regex_compile(NULL, &preg, a->xlat, talloc_array_length(a->xlat) - 1, false, false, false, true);
+			slen = regex_compile_cached(&preg, a->xlat, talloc_array_length(a->xlat) - 1, false, false, false);
 			if (slen <= 0) {
 				fr_strerror_printf("Error at offset %zu compiling regex for %s: %s",
 						   -slen, a->da->name, fr_strerror());
@@ -1086,7 +1122,7 @@ int fr_pair_cmp(VALUE_PAIR *a, VALUE_PAIR *b)
 			}
 			value = fr_pair_asprint(NULL, b, '\0');
 			if (!value) {
-				talloc_free(preg);
+				regex_cache_release(preg);
 				return -1;
 			}
 
@@ -1094,7 +1130,7 @@ int fr_pair_cmp(VALUE_PAIR *a, VALUE_PAIR *b)
 			 *	Don't care about substring matches, oh well...
 			 */
 			slen = regex_exec(preg, value, talloc_array_length(value) - 1, NULL, NULL);
-			talloc_free(preg);
+			regex_cache_release(preg);
 			talloc_free(value);
 
 			if (slen < 0) return -1;
@@ -1242,6 +1278,8 @@ void fr_pair_list_sort(VALUE_PAIR **vps, fr_cmp_t cmp)
 	 */
 	if (!head || !head->next) return;
 
+	fr_pair_list_changed();
+
 	_pair_list_sort_split(head, &a, &b);	/* Split into sublists */
 	fr_pair_list_sort(&a, cmp);		/* Traverse left */
 	fr_pair_list_sort(&b, cmp);		/* Traverse right */
@@ -1717,6 +1755,8 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 
 	if (!to || !from || !*from) return;
 
+	fr_pair_list_changed();
+
 	/*
 	 *	We're editing the "to" list while we're adding new
 	 *	attributes to it.  We don't want the new attributes to
@@ -1798,6 +1838,10 @@ void fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from)
 				break;
 
 			case PW_TYPE_OCTETS:
+				if (i->borrowed) {
+					fr_pair_value_memcpy(found, i->vp_octets, i->vp_length);
+					break;
+				}
 				fr_pair_value_memsteal(found, i->vp_octets);
 				i->vp_octets = NULL;
 				break;
@@ -1870,6 +1914,8 @@ static void fr_pair_list_move_by_num_internal(TALLOC_CTX *ctx, VALUE_PAIR **to,
 	VALUE_PAIR *to_tail, *i, *next, *this;
 	VALUE_PAIR *iprev = NULL;
 
+	fr_pair_list_changed();
+
 	/*
 	 *	Find the last pair in the "to" list and put it in "to_tail".
 	 *
@@ -2092,6 +2138,22 @@ int fr_pair_value_from_str(VALUE_PAIR *vp, char const *value, size_t inlen)
 	return 0;
 }
 
+/** Free the value of a VALUE_PAIR
+ *
+ * Borrowed buffers aren't ours to free, so we just drop our reference.
+ *
+ * @param[in,out] vp	to clear.
+ */
+static void fr_pair_value_clear(VALUE_PAIR *vp)
+{
+	if (vp->borrowed) {
+		vp->vp_ptr = NULL;
+		TALLOC_FREE(vp->borrowed);
+	}
+
+	value_box_clear(&vp->data);
+}
+
 /** Copy data into an "octets" data type.
  *
  * @param[in,out] vp	to update
@@ -2105,7 +2167,7 @@ void fr_pair_value_memcpy(VALUE_PAIR *vp, uint8_t const *src, size_t size)
 	p = talloc_memdup(vp, src, size);
 	if (!p) return;
 
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	vp->vp_octets = p;
 	vp->vp_length = size;
@@ -2124,7 +2186,7 @@ void fr_pair_value_memcpy(VALUE_PAIR *vp, uint8_t const *src, size_t size)
  */
 void fr_pair_value_memsteal(VALUE_PAIR *vp, uint8_t const *src)
 {
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	vp->vp_octets = talloc_steal(vp, src);
 	vp->vp_length = talloc_array_length(vp->vp_octets);
@@ -2136,6 +2198,70 @@ void fr_pair_value_memsteal(VALUE_PAIR *vp, uint8_t const *src)
 	VERIFY_VP(vp);
 }
 
+/** Point an "octets" VALUE_PAIR at data in someone else's buffer
+ *
+ * No copy is made.  Instead, the VALUE_PAIR takes a talloc reference
+ * to the buffer, so the buffer lives at least as long as the
+ * VALUE_PAIR does.  The data MUST NOT be modified in place, call
+ * #fr_pair_value_unborrow first.
+ *
+ * @param[in,out] vp	to update.
+ * @param[in] src	data in the buffer.
+ * @param[in] size	of the data.
+ * @param[in] buffer	talloced buffer which contains src.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+int fr_pair_value_memborrow(VALUE_PAIR *vp, uint8_t const *src, size_t size, void const *buffer)
+{
+	void *ref;
+
+	ref = talloc_named_const(vp, 0, "borrowed");
+	if (!ref) return -1;
+
+	if (!talloc_reference(ref, buffer)) {
+		talloc_free(ref);
+		return -1;
+	}
+
+	fr_pair_value_clear(vp);
+
+	memcpy(&vp->vp_ptr, &src, sizeof(vp->vp_ptr));
+	vp->vp_length = size;
+	vp->vp_type = PW_TYPE_OCTETS;
+	vp->borrowed = ref;
+
+	vp->type = VT_DATA;
+
+	VERIFY_VP(vp);
+
+	return 0;
+}
+
+/** Give a VALUE_PAIR its own copy of borrowed data
+ *
+ * @param[in,out] vp	to update.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success, or if the data wasn't borrowed.
+ */
+int fr_pair_value_unborrow(VALUE_PAIR *vp)
+{
+	uint8_t *p;
+
+	if (!vp->borrowed) return 0;
+
+	p = talloc_memdup(vp, vp->vp_octets, vp->vp_length);
+	if (!p) return -1;
+	talloc_set_type(p, uint8_t);
+
+	vp->vp_octets = p;
+	TALLOC_FREE(vp->borrowed);
+
+	return 0;
+}
+
 /** Reparent an allocated char buffer to a VALUE_PAIR
  *
  * @param[in,out] vp	to update
@@ -2145,7 +2271,7 @@ void fr_pair_value_strsteal(VALUE_PAIR *vp, char const *src)
 {
 	if (!fr_cond_assert(vp->da->type == PW_TYPE_STRING)) return;
 
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	vp->vp_strvalue = talloc_steal(vp, src);
 	vp->vp_length = talloc_array_length(vp->vp_strvalue) - 1;
@@ -2174,7 +2300,7 @@ void fr_pair_value_strnsteal(VALUE_PAIR *vp, char *src, size_t len)
 
 	if (!fr_cond_assert(vp->da->type == PW_TYPE_STRING)) return;
 
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	buf_len = talloc_array_length(src);
 	if (buf_len > (len + 1)) {
@@ -2210,7 +2336,7 @@ void fr_pair_value_strcpy(VALUE_PAIR *vp, char const *src)
 	p = talloc_strdup(vp, src);
 	if (!p) return;
 
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
@@ -2244,7 +2370,7 @@ void fr_pair_value_bstrncpy(VALUE_PAIR *vp, void const *src, size_t len)
 	memcpy(p, src, len);	/* embdedded \0 safe */
 	p[len] = '\0';
 
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	vp->vp_strvalue = p;
 	vp->vp_length = len;
@@ -2275,7 +2401,7 @@ void fr_pair_value_snprintf(VALUE_PAIR *vp, char const *fmt, ...)
 	va_end(ap);
 	if (!p) return;
 
-	value_box_clear(&vp->data);
+	fr_pair_value_clear(vp);
 
 	vp->vp_strvalue = p;
 	vp->vp_length = talloc_array_length(vp->vp_strvalue) - 1;
@@ -2784,6 +2910,8 @@ inline void fr_pair_verify(char const *file, int line, VALUE_PAIR const *vp)
 		size_t len;
 		TALLOC_CTX *parent;
 
+		if (vp->borrowed) break;
+
 		if (!talloc_get_type(vp->vp_ptr, uint8_t)) {
 			FR_FAULT_LOG("CONSISTENCY CHECK FAILED %s[%u]: VALUE_PAIR \"%s\" data buffer type should be "
 				     "uint8_t but is %s\n", file, line, vp->da->name, talloc_get_name(vp->vp_ptr));
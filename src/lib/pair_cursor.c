@@ -430,6 +430,7 @@ void fr_pair_cursor_prepend(vp_cursor_t *cursor, VALUE_PAIR *vp)
 	if (!*(cursor->first)) {
 		*cursor->first = vp;
 		cursor->current = vp;
+		if (cursor->index) fr_pair_index_inserted(cursor->index, vp, true);
 
 		return;
 	}
@@ -439,6 +440,8 @@ void fr_pair_cursor_prepend(vp_cursor_t *cursor, VALUE_PAIR *vp)
 	 */
 	vp->next = *cursor->first;
 	*cursor->first = vp;
+	if (cursor->index) fr_pair_index_inserted(cursor->index, vp, false);
+	fr_pair_list_changed();
 
 	/*
 	 *	Either current was never set, or something iterated to the
@@ -489,6 +492,7 @@ void fr_pair_cursor_append(vp_cursor_t *cursor, VALUE_PAIR *vp)
 	if (!*(cursor->first)) {
 		*cursor->first = vp;
 		cursor->current = vp;
+		if (cursor->index) fr_pair_index_inserted(cursor->index, vp, true);
 
 		return;
 	}
@@ -525,6 +529,7 @@ void fr_pair_cursor_append(vp_cursor_t *cursor, VALUE_PAIR *vp)
 	 */
 	cursor->last->next = vp;
 	cursor->last = vp;	/* Wind it forward a little more */
+	if (cursor->index) fr_pair_index_inserted(cursor->index, vp, true);
 
 	/*
 	 *	If the next pointer was NULL, and the VALUE_PAIR
@@ -618,6 +623,8 @@ VALUE_PAIR *fr_pair_cursor_remove(vp_cursor_t *cursor)
 
 fixup:
 	vp->next = NULL;			/* limit scope of fr_pair_list_free() */
+	if (cursor->index) fr_pair_index_removed(cursor->index, vp);
+	if (vp->cached) fr_pair_list_changed();
 
 	/*
 	 *	Fixup cursor->found if we removed the VP it was referring to,
@@ -650,9 +657,12 @@ VALUE_PAIR *fr_pair_cursor_replace(vp_cursor_t *cursor, VALUE_PAIR *new)
 
 	if (!fr_cond_assert(cursor->first)) return NULL;	/* cursor must have been initialised */
 
+	fr_pair_list_changed();
+
 	vp = cursor->current;
 	if (!vp) {
 		*cursor->first = new;
+		if (cursor->index) fr_pair_index_rebuild(cursor->index);
 		return NULL;
 	}
 
@@ -667,6 +677,11 @@ VALUE_PAIR *fr_pair_cursor_replace(vp_cursor_t *cursor, VALUE_PAIR *new)
 	new->next = vp->next;
 	vp->next = NULL;
 
+	if (cursor->index) {
+		fr_pair_index_removed(cursor->index, vp);
+		fr_pair_index_inserted(cursor->index, new, false);
+	}
+
 	VERIFY_LIST(*(cursor->first));
 
 	return vp;
@@ -699,6 +714,7 @@ void fr_pair_cursor_free(vp_cursor_t *cursor)
 		cursor->found = NULL;
 		cursor->last = NULL;
 		fr_pair_list_free(cursor->first);
+		if (cursor->index) fr_pair_index_rebuild(cursor->index);
 	}
 
 	vp = cursor->current;
@@ -720,6 +736,7 @@ void fr_pair_cursor_free(vp_cursor_t *cursor)
 	}
 
 	fr_pair_list_free(&before->next);
+	if (cursor->index) fr_pair_index_rebuild(cursor->index);
 
 	cursor->current = before;		/* current jumps back one, but this is usually desirable */
 	cursor->next = NULL;			/* we just truncated the list, there is no next... */
@@ -0,0 +1,266 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/pair_index.c
+ * @brief Index VALUE_PAIR lists by fr_dict_attr_t.
+ *
+ *  An index remembers the first VALUE_PAIR in a list for each
+ *  attribute.  RFC attributes are kept in an array indexed by
+ *  attribute number, everything else is kept in a hash table.
+ *
+ *  The index is only kept up to date by cursors which were
+ *  initialised with #fr_pair_index_cursor_init.  Anything else which
+ *  changes the list MUST call #fr_pair_index_rebuild afterwards.
+ *
+ *  When the first VALUE_PAIR for an attribute is removed, or a
+ *  VALUE_PAIR is inserted before the end of the list, the entry for
+ *  that attribute is marked as stale.  The next lookup for that
+ *  attribute scans the list, and refreshes the entry.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define PAIR_INDEX_RFC_MAX	(256)
+
+typedef struct fr_pair_index_entry_t {
+	fr_dict_attr_t const	*da;		//!< The attribute, NULL if the entry is unused.
+	VALUE_PAIR		*vp;		//!< The first VALUE_PAIR for this attribute.
+	bool			stale;		//!< vp may be wrong, and the list must be searched.
+} fr_pair_index_entry_t;
+
+struct fr_pair_index_t {
+	VALUE_PAIR		**head;		//!< The list we're indexing.
+	fr_pair_index_entry_t	rfc[PAIR_INDEX_RFC_MAX];	//!< Top level attributes, by number.
+	fr_hash_table_t		*other;		//!< Everything else.
+};
+
+static uint32_t pair_index_hash(void const *data)
+{
+	fr_pair_index_entry_t const *entry = data;
+
+	return fr_hash(&entry->da, sizeof(entry->da));
+}
+
+static int pair_index_cmp(void const *one, void const *two)
+{
+	fr_pair_index_entry_t const *a = one, *b = two;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+	return 0;
+}
+
+/** Find the entry for an attribute
+ *
+ * @param[in] index to search.
+ * @param[in] da to find.
+ * @param[in] create the entry if it does not exist.
+ * @return
+ *	- NULL if there is no entry, or we failed creating one.
+ *	- the entry.
+ */
+static fr_pair_index_entry_t *pair_index_entry(fr_pair_index_t *index, fr_dict_attr_t const *da, bool create)
+{
+	fr_pair_index_entry_t *entry, my_entry;
+
+	if (da->parent && da->parent->flags.is_root && (da->attr < PAIR_INDEX_RFC_MAX)) {
+		entry = &index->rfc[da->attr];
+
+		/*
+		 *	Unknown attributes have the same number as
+		 *	the real one, but a different da.
+		 */
+		if (entry->da && (entry->da != da)) goto hash;
+
+		if (!entry->da) {
+			if (!create) return NULL;
+			entry->da = da;
+			entry->vp = NULL;
+			entry->stale = false;
+		}
+		return entry;
+	}
+
+hash:
+	if (!index->other) return NULL;
+
+	my_entry.da = da;
+	entry = fr_hash_table_finddata(index->other, &my_entry);
+	if (entry || !create) return entry;
+
+	entry = talloc_zero(index->other, fr_pair_index_entry_t);
+	if (!entry) return NULL;
+	entry->da = da;
+
+	if (!fr_hash_table_insert(index->other, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/** Remember that a VALUE_PAIR was added to the list
+ *
+ * @param[in] index to update.
+ * @param[in] vp which was added.
+ * @param[in] at_end whether vp was added to the end of the list.
+ */
+void fr_pair_index_inserted(fr_pair_index_t *index, VALUE_PAIR *vp, bool at_end)
+{
+	fr_pair_index_entry_t *entry;
+
+	entry = pair_index_entry(index, vp->da, true);
+	if (!entry) {
+		/*
+		 *	Out of memory.  Everything is stale.
+		 */
+		fr_pair_index_rebuild(index);
+		return;
+	}
+
+	if (!entry->vp && !entry->stale) {
+		entry->vp = vp;
+		return;
+	}
+
+	if (!at_end) entry->stale = true;
+}
+
+/** Remember that a VALUE_PAIR was removed from the list
+ *
+ * @param[in] index to update.
+ * @param[in] vp which was removed.
+ */
+void fr_pair_index_removed(fr_pair_index_t *index, VALUE_PAIR *vp)
+{
+	fr_pair_index_entry_t *entry;
+
+	entry = pair_index_entry(index, vp->da, false);
+	if (!entry || (entry->vp != vp)) return;
+
+	entry->vp = NULL;
+	entry->stale = true;
+}
+
+/** Re-build an index after its list was changed without an indexed cursor
+ *
+ * @param[in] index to rebuild.
+ */
+void fr_pair_index_rebuild(fr_pair_index_t *index)
+{
+	VALUE_PAIR *vp;
+
+	memset(index->rfc, 0, sizeof(index->rfc));
+	TALLOC_FREE(index->other);
+
+	index->other = fr_hash_table_create(index, pair_index_hash, pair_index_cmp, NULL);
+
+	for (vp = *index->head; vp; vp = vp->next) {
+		fr_pair_index_entry_t *entry;
+
+		entry = pair_index_entry(index, vp->da, true);
+		if (entry && !entry->vp) entry->vp = vp;
+	}
+}
+
+/** Create an index for a list of VALUE_PAIRs
+ *
+ * @param[in] ctx to allocate the index in.
+ * @param[in] head of the list.  This MUST remain valid while the index exists.
+ * @return
+ *	- NULL on error
+ *	- fr_pair_index_t on success
+ */
+fr_pair_index_t *fr_pair_index_alloc(TALLOC_CTX *ctx, VALUE_PAIR **head)
+{
+	fr_pair_index_t *index;
+
+	index = talloc_zero(ctx, fr_pair_index_t);
+	if (!index) return NULL;
+
+	index->head = head;
+
+	fr_pair_index_rebuild(index);
+	if (!index->other) {
+		talloc_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+/** Find a VALUE_PAIR in an indexed list
+ *
+ *  This is the same as fr_pair_find_by_da(*head, da, tag).
+ *
+ * @param[in] index to search.
+ * @param[in] da to find.
+ * @param[in] tag to match. Either a tag number or TAG_ANY to match any tagged or
+ *	  untagged attribute, TAG_NONE to match attributes without tags.
+ * @return
+ *	- NULL if no VALUE_PAIR matches.
+ *	- the first matching VALUE_PAIR.
+ */
+VALUE_PAIR *fr_pair_index_find(fr_pair_index_t *index, fr_dict_attr_t const *da, int8_t tag)
+{
+	fr_pair_index_entry_t	*entry;
+	VALUE_PAIR		*vp;
+
+	if (!fr_cond_assert(da)) return NULL;
+
+	entry = pair_index_entry(index, da, false);
+	if (!entry) return NULL;
+
+	if (entry->stale) {
+		for (vp = *index->head; vp; vp = vp->next) if (vp->da == da) break;
+
+		entry->vp = vp;
+		entry->stale = false;
+	}
+
+	/*
+	 *	Tagged attributes may not match the first one.
+	 */
+	for (vp = entry->vp; vp; vp = vp->next) {
+		VERIFY_VP(vp);
+		if ((vp->da == da) && (!vp->da->flags.has_tag || TAG_EQ(tag, vp->tag))) return vp;
+	}
+
+	return NULL;
+}
+
+/** Setup a cursor which keeps an index up to date
+ *
+ * @param[in] cursor to initialise.
+ * @param[in] index of the list to iterate over.
+ * @return the first VALUE_PAIR in the list.
+ */
+VALUE_PAIR *fr_pair_index_cursor_init(vp_cursor_t *cursor, fr_pair_index_t *index)
+{
+	VALUE_PAIR *vp;
+
+	vp = fr_pair_cursor_init(cursor, index->head);
+	cursor->index = index;
+
+	return vp;
+}
@@ -33,6 +33,10 @@
   #include <net/if.h>
 #endif
 
+#ifdef __linux__
+#  include <linux/if_packet.h>
+#endif
+
 #include <freeradius-devel/pcap.h>
 #include <freeradius-devel/net.h>
 #include <freeradius-devel/rad_assert.h>
@@ -266,6 +270,33 @@ int fr_pcap_open(fr_pcap_t *pcap)
 			return -1;
 		}
 
+		/*
+		 *	Spread packets over all the handles in the group.
+		 *	The kernel's flow hash is symmetric, so a request
+		 *	and its response are always delivered to the same
+		 *	handle.  Fragments are reassembled first, otherwise
+		 *	they'd hash differently to the first fragment.
+		 */
+		if (pcap->fanout) {
+#ifdef PACKET_FANOUT
+			int value = pcap->fanout_id | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+			if (setsockopt(pcap_fileno(pcap->handle), SOL_PACKET, PACKET_FANOUT,
+				       &value, sizeof(value)) < 0) {
+				fr_strerror_printf("Failed joining fanout group %u: %s",
+						   pcap->fanout_id, fr_syserror(errno));
+				pcap_close(pcap->handle);
+				pcap->handle = NULL;
+				return -1;
+			}
+#else
+			fr_strerror_printf("Capture fanout is not supported on this platform");
+			pcap_close(pcap->handle);
+			pcap->handle = NULL;
+			return -1;
+#endif
+		}
+
 		pcap->fd = pcap_get_selectable_fd(pcap->handle);
 		pcap->link_layer = pcap_datalink(pcap->handle);
 #ifndef __linux__
@@ -75,6 +75,32 @@ FR_NAME_NUMBER const fr_request_types[] = {
 uint32_t fr_max_attributes = 0;
 FILE *fr_log_fp = NULL;
 
+/*
+ *	When set, fr_radius_ok() keeps the offsets of the attributes
+ *	it walked over, so that fr_radius_decode_lazy() doesn't have
+ *	to walk the packet again.
+ */
+bool fr_radius_ok_index = false;
+
+/*
+ *	The most attributes fr_radius_ok() will index.  Packets with
+ *	more attributes are indexed by fr_radius_decode_lazy().
+ */
+#define RADIUS_OK_INDEX_MAX	(256)
+
+/*
+ *	Attributes which fr_radius_ok() has to look at more closely.
+ *	Everything else only needs its length checked.
+ */
+static bool const radius_ok_special[256] = {
+	[0]				= true,
+	[PW_STATE]			= true,
+	[PW_EAP_MESSAGE]		= true,
+	[PW_MESSAGE_AUTHENTICATOR]	= true
+};
+
+static int radius_lazy_index(RADIUS_PACKET *packet, uint16_t const *offsets, int num);
+
 
 static void print_hex_data(uint8_t const *ptr, int attrlen, int depth)
 {
@@ -367,8 +393,7 @@ static ssize_t rad_recvfrom(int sockfd, RADIUS_PACKET *packet, int flags)
 
 	if (data_len == 0) return -1; /* invalid packet */
 
-	packet->data = talloc_array(packet, uint8_t, data_len);
-	if (!packet->data) return -1;
+	if (!fr_radius_data_alloc(packet, data_len)) return -1;
 
 	packet->data_len = data_len;
 
@@ -378,11 +403,76 @@ static ssize_t rad_recvfrom(int sockfd, RADIUS_PACKET *packet, int flags)
 			&packet->if_index, &packet->timestamp);
 }
 
-/** Sign a previously encoded packet
+/*
+ *	How many packets fr_radius_sign_multi() and fr_radius_verify_multi()
+ *	hash at once.
+ */
+#define RADIUS_MULTI_BATCH	(32)
+
+/*
+ *	A small cache of pre-computed MD5 states for shared secrets.
+ *	Each RADCLIENT and home_server_t owns its secret, so the
+ *	pointer identifies the client.  We still compare the contents,
+ *	as a freed secret may have its memory re-used for another one.
+ */
+#define RADIUS_SECRET_CACHE_SIZE	(8)
+#define RADIUS_SECRET_CACHE_MAX_LEN	(64)
+
+typedef struct radius_secret_cache_t {
+	char const		*secret;				//!< The secret this entry is for.
+	size_t			secret_len;				//!< Length of the secret.
+	char			copy[RADIUS_SECRET_CACHE_MAX_LEN];	//!< To check the secret hasn't changed.
+	fr_md5_secret_t		md5;					//!< The pre-computed states.
+} radius_secret_cache_t;
+
+static _Thread_local radius_secret_cache_t fr_radius_secret_cache[RADIUS_SECRET_CACHE_SIZE];
+static _Thread_local fr_md5_secret_t fr_radius_secret_scratch;
+
+/** Get the pre-computed MD5 states for a shared secret
  *
+ *  The states are cached per thread, so signing or verifying many
+ *  packets for the same client only absorbs the secret once.
+ *
+ * @param[in] secret a talloc'd shared secret.
+ * @return the pre-computed states.  They are valid until the next call on this thread.
  */
-int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
-		   char const *secret)
+fr_md5_secret_t const *fr_radius_secret_md5(char const *secret)
+{
+	radius_secret_cache_t	*entry;
+	size_t			secret_len = talloc_array_length(secret) - 1;
+
+	/*
+	 *	Long secrets are rare, don't bother caching them.
+	 */
+	if (secret_len > RADIUS_SECRET_CACHE_MAX_LEN) {
+		fr_md5_secret_init(&fr_radius_secret_scratch, (uint8_t const *) secret, secret_len);
+		return &fr_radius_secret_scratch;
+	}
+
+	entry = &fr_radius_secret_cache[(((uintptr_t) secret) >> 4) % RADIUS_SECRET_CACHE_SIZE];
+	if ((entry->secret == secret) && (entry->secret_len == secret_len) &&
+	    (memcmp(entry->copy, secret, secret_len) == 0)) return &entry->md5;
+
+	entry->secret = secret;
+	entry->secret_len = secret_len;
+	memcpy(entry->copy, secret, secret_len);
+	fr_md5_secret_init(&entry->md5, (uint8_t const *) secret, secret_len);
+
+	return &entry->md5;
+}
+
+/** Prepare a previously encoded packet for signing
+ *
+ *  This does everything except for the final MD5 of the packet and
+ *  the secret.
+ *
+ * @return
+ *	- <0 on error
+ *	- 0 if the packet is now signed
+ *	- 1 if the caller has to calculate MD5(packet + secret), and call radius_sign_finish().
+ */
+static int radius_sign_start(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			     char const *secret)
 {
 	radius_packet_t	*hdr = (radius_packet_t *)packet->data;
 
@@ -471,8 +561,8 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		 *	into the Message-Authenticator
 		 *	attribute.
 		 */
-		fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
-			    (uint8_t const *) secret, talloc_array_length(secret) - 1);
+		fr_hmac_md5_secret(calc_auth_vector, packet->data, packet->data_len,
+				   fr_radius_secret_md5(secret));
 		memcpy(packet->data + packet->offset + 2,
 		       calc_auth_vector, AUTH_VECTOR_LEN);
 	}
@@ -500,25 +590,92 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		 *	authentication vector of the request.
 		 */
 	default:
-		{
-			uint8_t digest[16];
-
-			FR_MD5_CTX	context;
-			fr_md5_init(&context);
-			fr_md5_update(&context, packet->data, packet->data_len);
-			fr_md5_update(&context, (uint8_t const *) secret,
-				     talloc_array_length(secret) - 1);
-			fr_md5_final(digest, &context);
-
-			memcpy(hdr->vector, digest, AUTH_VECTOR_LEN);
-			memcpy(packet->vector, digest, AUTH_VECTOR_LEN);
-			break;
-		}
+		return 1;
 	}/* switch over packet codes */
 
 	return 0;
 }
 
+/** Copy the digest to a packet which radius_sign_start() prepared
+ *
+ */
+static void radius_sign_finish(RADIUS_PACKET *packet, uint8_t const digest[AUTH_VECTOR_LEN])
+{
+	memcpy(packet->data + 4, digest, AUTH_VECTOR_LEN);
+	memcpy(packet->vector, digest, AUTH_VECTOR_LEN);
+}
+
+/** Sign a previously encoded packet
+ *
+ */
+int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+		   char const *secret)
+{
+	int		rcode;
+	uint8_t		digest[AUTH_VECTOR_LEN];
+	FR_MD5_CTX	context;
+
+	rcode = radius_sign_start(packet, original, secret);
+	if (rcode <= 0) return rcode;
+
+	fr_md5_init(&context);
+	fr_md5_update(&context, packet->data, packet->data_len);
+	fr_md5_update(&context, (uint8_t const *) secret,
+		      talloc_array_length(secret) - 1);
+	fr_md5_final(digest, &context);
+
+	radius_sign_finish(packet, digest);
+
+	return 0;
+}
+
+/** Sign multiple previously encoded packets
+ *
+ *  This is the same as calling fr_radius_sign() for each packet,
+ *  but the MD5 digests are calculated in parallel.
+ *
+ * @param[in] packets to sign.
+ * @param[in] originals the request for each packet, or NULL.  originals may be NULL.
+ * @param[in] secrets the shared secret for each packet.
+ * @param[out] rcodes what fr_radius_sign() would have returned for each packet.
+ * @param[in] num the number of packets.
+ * @return
+ *	- <0 if any packet could not be signed.
+ *	- 0 if all of the packets were signed.
+ */
+int fr_radius_sign_multi(RADIUS_PACKET **packets, RADIUS_PACKET const **originals,
+			 char const **secrets, int *rcodes, int num)
+{
+	fr_md5_job_t	jobs[RADIUS_MULTI_BATCH];
+	int		idx[RADIUS_MULTI_BATCH];
+	int		i, j, n, ret = 0;
+
+	for (i = 0; i < num; i += RADIUS_MULTI_BATCH) {
+		n = 0;
+
+		for (j = i; (j < num) && (j < (i + RADIUS_MULTI_BATCH)); j++) {
+			rcodes[j] = radius_sign_start(packets[j], originals ? originals[j] : NULL, secrets[j]);
+			if (rcodes[j] < 0) ret = -1;
+			if (rcodes[j] <= 0) continue;
+
+			jobs[n].in = packets[j]->data;
+			jobs[n].inlen = packets[j]->data_len;
+			jobs[n].suffix = (uint8_t const *) secrets[j];
+			jobs[n].suffix_len = talloc_array_length(secrets[j]) - 1;
+			idx[n++] = j;
+		}
+
+		fr_md5_calc_multi(jobs, n);
+
+		for (j = 0; j < n; j++) {
+			radius_sign_finish(packets[idx[j]], jobs[j].out);
+			rcodes[idx[j]] = 0;
+		}
+	}
+
+	return ret;
+}
+
 /** Reply to the request
  *
  * Also attach reply attribute value pairs and any user message provided.
@@ -608,83 +765,6 @@ int fr_radius_digest_cmp(uint8_t const *a, uint8_t const *b, size_t length)
 }
 
 
-/** Validates the requesting client NAS
- *
- * Calculates the request Authenticator based on the clients private key.
- */
-static int calc_acctdigest(RADIUS_PACKET *packet, char const *secret)
-{
-	uint8_t		digest[AUTH_VECTOR_LEN];
-	FR_MD5_CTX		context;
-
-	/*
-	 *	Zero out the auth_vector in the received packet.
-	 *	Then append the shared secret to the received packet,
-	 *	and calculate the MD5 sum. This must be the same
-	 *	as the original MD5 sum (packet->vector).
-	 */
-	memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
-
-	/*
-	 *  MD5(packet + secret);
-	 */
-	fr_md5_init(&context);
-	fr_md5_update(&context, packet->data, packet->data_len);
-	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
-	fr_md5_final(digest, &context);
-
-	/*
-	 *	Return 0 if OK, 2 if not OK.
-	 */
-	if (fr_radius_digest_cmp(digest, packet->vector, AUTH_VECTOR_LEN) != 0) return 2;
-	return 0;
-}
-
-
-/** Validates the requesting client NAS
- *
- * Calculates the response Authenticator based on the clients
- * private key.
- */
-static int calc_replydigest(RADIUS_PACKET *packet, RADIUS_PACKET *original,
-			    char const *secret)
-{
-	uint8_t		calc_digest[AUTH_VECTOR_LEN];
-	FR_MD5_CTX		context;
-
-	/*
-	 *	Very bad!
-	 */
-	if (original == NULL) {
-		return 3;
-	}
-
-	/*
-	 *  Copy the original vector in place.
-	 */
-	memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
-
-	/*
-	 *  MD5(packet + secret);
-	 */
-	fr_md5_init(&context);
-	fr_md5_update(&context, packet->data, packet->data_len);
-	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
-	fr_md5_final(calc_digest, &context);
-
-	/*
-	 *  Copy the packet's vector back to the packet.
-	 */
-	memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
-
-	/*
-	 *	Return 0 if OK, 2 if not OK.
-	 */
-	if (fr_radius_digest_cmp(packet->vector, calc_digest, AUTH_VECTOR_LEN) != 0) return 2;
-	return 0;
-}
-
-
 /** See how big of a packet is in the buffer.
  *
  * Packet is not 'const * const' because we may update data_len, if there's more data
@@ -758,6 +838,7 @@ bool fr_radius_ok(RADIUS_PACKET *packet, bool require_ma, decode_fail_t *reason)
 	bool			seen_ma = false;
 	uint32_t		num_attributes;
 	decode_fail_t		failure = DECODE_FAIL_NONE;
+	uint16_t		offsets[RADIUS_OK_INDEX_MAX];
 
 	/*
 	 *	Check for packets smaller than the packet header.
@@ -905,6 +986,13 @@ bool fr_radius_ok(RADIUS_PACKET *packet, bool require_ma, decode_fail_t *reason)
 			goto finish;
 		}
 
+		/*
+		 *	Most attributes are only checked for length.
+		 *	Do that with as few branches as possible, and
+		 *	leave everything else to the checks below.
+		 */
+		if (!radius_ok_special[attr[0]] && (attr[1] >= 2) && (attr[1] <= count)) goto next;
+
 		/*
 		 *	Attribute number zero is NOT defined.
 		 */
@@ -987,6 +1075,9 @@ bool fr_radius_ok(RADIUS_PACKET *packet, bool require_ma, decode_fail_t *reason)
 		 *	integer/date/ip, the attribute length SHOULD
 		 *	be 6.
 		 */
+	next:
+		if (num_attributes < RADIUS_OK_INDEX_MAX) offsets[num_attributes] = attr - packet->data;
+
 		count -= attr[1];	/* grab the attribute length */
 		attr += attr[1];
 		num_attributes++;	/* seen one more attribute */
@@ -1049,6 +1140,14 @@ bool fr_radius_ok(RADIUS_PACKET *packet, bool require_ma, decode_fail_t *reason)
 	packet->id = hdr->id;
 	memcpy(packet->vector, hdr->vector, AUTH_VECTOR_LEN);
 
+	/*
+	 *	Keep the offsets for fr_radius_decode_lazy().  This is
+	 *	only an optimisation, so failing here isn't an error.
+	 */
+	if (fr_radius_ok_index && (num_attributes <= RADIUS_OK_INDEX_MAX)) {
+		(void) radius_lazy_index(packet, offsets, num_attributes);
+	}
+
 
 	finish:
 
@@ -1152,15 +1251,21 @@ RADIUS_PACKET *fr_radius_recv(TALLOC_CTX *ctx, int fd, int flags, bool require_m
 	return packet;
 }
 
-/** Verify the Request/Response Authenticator (and Message-Authenticator if present) of a packet
+/** Verify the Message-Authenticator of a packet, and prepare to verify the Request/Response Authenticator
+ *
+ *  The packet has the original vector (or zeros) written over its
+ *  authenticator, so that the caller can calculate MD5(packet + secret).
  *
+ * @return
+ *	- <0 on error
+ *	- 0 if the packet is valid, and has no Request/Response Authenticator.
+ *	- 1 if the caller has to calculate MD5(packet + secret), and call radius_verify_finish().
  */
-int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+static int radius_verify_start(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
 {
 	uint8_t		*ptr;
 	int		length;
 	int		attrlen;
-	int		rcode;
 	char		buffer[INET6_ADDRSTRLEN];
 
 	if (!packet || !packet->data) return -1;
@@ -1222,8 +1327,8 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 				break;
 			}
 
-			fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
-				    (uint8_t const *) secret, talloc_array_length(secret) - 1);
+			fr_hmac_md5_secret(calc_auth_vector, packet->data, packet->data_len,
+					   fr_radius_secret_md5(secret));
 			if (fr_radius_digest_cmp(calc_auth_vector, msg_auth_vector,
 						 sizeof(calc_auth_vector)) != 0) {
 				fr_strerror_printf("Received packet from %s with invalid Message-Authenticator!  "
@@ -1263,7 +1368,7 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	}
 
 	/*
-	 *	Calculate and/or verify Request or Response Authenticator.
+	 *	Set up the packet to calculate the Request or Response Authenticator.
 	 */
 	switch (packet->code) {
 	case PW_CODE_ACCESS_REQUEST:
@@ -1272,24 +1377,22 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 		 *	The authentication vector is random
 		 *	nonsense, invented by the client.
 		 */
-		break;
+		return 0;
 
+		/*
+		 *	Zero out the auth_vector in the received
+		 *	packet.  MD5(packet + secret) must be the
+		 *	same as the original vector.
+		 */
 	case PW_CODE_COA_REQUEST:
 	case PW_CODE_DISCONNECT_REQUEST:
 	case PW_CODE_ACCOUNTING_REQUEST:
-		if (calc_acctdigest(packet, secret) > 1) {
-			fr_strerror_printf("Received %s packet "
-					   "from client %s with invalid Request-Authenticator!  "
-					   "(Shared secret is incorrect.)",
-					   fr_packet_codes[packet->code],
-					   inet_ntop(packet->src_ipaddr.af,
-						     &packet->src_ipaddr.ipaddr,
-						     buffer, sizeof(buffer)));
-			return -1;
-		}
-		break;
+		memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
+		return 1;
 
-		/* Verify the reply digest */
+		/*
+		 *	Copy the original vector in place.
+		 */
 	case PW_CODE_ACCESS_ACCEPT:
 	case PW_CODE_ACCESS_REJECT:
 	case PW_CODE_ACCESS_CHALLENGE:
@@ -1298,8 +1401,7 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	case PW_CODE_DISCONNECT_NAK:
 	case PW_CODE_COA_ACK:
 	case PW_CODE_COA_NAK:
-		rcode = calc_replydigest(packet, original, secret);
-		if (rcode > 1) {
+		if (!original) {
 			fr_strerror_printf("Received %s packet "
 					   "from home server %s port %d with invalid Response-Authenticator!  "
 					   "(Shared secret is incorrect.)",
@@ -1310,7 +1412,8 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 					   packet->src_port);
 			return -1;
 		}
-		break;
+		memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
+		return 1;
 
 	default:
 		fr_strerror_printf("Received Unknown packet code %d "
@@ -1322,15 +1425,155 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 				   packet->src_port);
 		return -1;
 	}
+}
+
+/** Check the Request/Response Authenticator of a packet which radius_verify_start() prepared
+ *
+ * @param[in] packet to check.
+ * @param[in] digest MD5(packet + secret).
+ * @return
+ *	- <0 if the authenticator is wrong.
+ *	- 0 if the authenticator is correct.
+ */
+static int radius_verify_finish(RADIUS_PACKET *packet, uint8_t const digest[AUTH_VECTOR_LEN])
+{
+	char		buffer[INET6_ADDRSTRLEN];
+
+	switch (packet->code) {
+	case PW_CODE_COA_REQUEST:
+	case PW_CODE_DISCONNECT_REQUEST:
+	case PW_CODE_ACCOUNTING_REQUEST:
+		if (fr_radius_digest_cmp(digest, packet->vector, AUTH_VECTOR_LEN) != 0) {
+			fr_strerror_printf("Received %s packet "
+					   "from client %s with invalid Request-Authenticator!  "
+					   "(Shared secret is incorrect.)",
+					   fr_packet_codes[packet->code],
+					   inet_ntop(packet->src_ipaddr.af,
+						     &packet->src_ipaddr.ipaddr,
+						     buffer, sizeof(buffer)));
+			return -1;
+		}
+		break;
+
+	default:
+		/*
+		 *	Copy the packet's vector back to the packet.
+		 */
+		memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+
+		if (fr_radius_digest_cmp(packet->vector, digest, AUTH_VECTOR_LEN) != 0) {
+			fr_strerror_printf("Received %s packet "
+					   "from home server %s port %d with invalid Response-Authenticator!  "
+					   "(Shared secret is incorrect.)",
+					   fr_packet_codes[packet->code],
+					   inet_ntop(packet->src_ipaddr.af,
+						     &packet->src_ipaddr.ipaddr,
+						     buffer, sizeof(buffer)),
+					   packet->src_port);
+			return -1;
+		}
+		break;
+	}
 
 	return 0;
 }
 
+/** Verify the Request/Response Authenticator (and Message-Authenticator if present) of a packet
+ *
+ */
+int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+{
+	int		rcode;
+	uint8_t		digest[AUTH_VECTOR_LEN];
+	FR_MD5_CTX	context;
+
+	rcode = radius_verify_start(packet, original, secret);
+	if (rcode <= 0) return rcode;
+
+	/*
+	 *  MD5(packet + secret);
+	 */
+	fr_md5_init(&context);
+	fr_md5_update(&context, packet->data, packet->data_len);
+	fr_md5_update(&context, (uint8_t const *) secret, talloc_array_length(secret) - 1);
+	fr_md5_final(digest, &context);
+
+	return radius_verify_finish(packet, digest);
+}
+
+/** Verify multiple packets
+ *
+ *  This is the same as calling fr_radius_verify() for each packet,
+ *  but the MD5 digests are calculated in parallel.  fr_strerror()
+ *  only holds the error for the last packet which failed.
+ *
+ * @param[in] packets to verify.
+ * @param[in] originals the request for each packet, or NULL.  originals may be NULL.
+ * @param[in] secrets the shared secret for each packet.
+ * @param[out] rcodes what fr_radius_verify() would have returned for each packet.
+ * @param[in] num the number of packets.
+ * @return
+ *	- <0 if any packet failed verification.
+ *	- 0 if all of the packets are valid.
+ */
+int fr_radius_verify_multi(RADIUS_PACKET **packets, RADIUS_PACKET **originals,
+			   char const **secrets, int *rcodes, int num)
+{
+	fr_md5_job_t	jobs[RADIUS_MULTI_BATCH];
+	int		idx[RADIUS_MULTI_BATCH];
+	int		i, j, n, ret = 0;
+
+	for (i = 0; i < num; i += RADIUS_MULTI_BATCH) {
+		n = 0;
+
+		for (j = i; (j < num) && (j < (i + RADIUS_MULTI_BATCH)); j++) {
+			rcodes[j] = radius_verify_start(packets[j], originals ? originals[j] : NULL, secrets[j]);
+			if (rcodes[j] < 0) ret = -1;
+			if (rcodes[j] <= 0) continue;
+
+			jobs[n].in = packets[j]->data;
+			jobs[n].inlen = packets[j]->data_len;
+			jobs[n].suffix = (uint8_t const *) secrets[j];
+			jobs[n].suffix_len = talloc_array_length(secrets[j]) - 1;
+			idx[n++] = j;
+		}
+
+		fr_md5_calc_multi(jobs, n);
+
+		for (j = 0; j < n; j++) {
+			rcodes[idx[j]] = radius_verify_finish(packets[idx[j]], jobs[j].out);
+			if (rcodes[idx[j]] < 0) ret = -1;
+		}
+	}
+
+	return ret;
+}
+
 /** Encode a packet
  *
  */
 int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		     char const *secret)
+{
+	return fr_radius_encode_plan(packet, original, secret, NULL);
+}
+
+/** Encode a packet, using pre-computed attribute headers where possible
+ *
+ * Replies usually contain the same attributes, with different values.
+ * The plan remembers the headers for those attributes, so most of
+ * them are encoded by copying a header and a value.
+ *
+ * @param[in,out] packet	to encode.
+ * @param[in] original		request, if packet is a reply.
+ * @param[in] secret		shared with the other end.
+ * @param[in] plan		from fr_radius_encode_plan_alloc(), or NULL.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+int fr_radius_encode_plan(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			  char const *secret, fr_radius_encode_plan_t *plan)
 {
 	radius_packet_t		*hdr;
 	uint8_t			*ptr;
@@ -1338,7 +1581,7 @@ int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	int			len;
 	VALUE_PAIR const	*vp;
 	vp_cursor_t		cursor;
-	fr_radius_ctx_t encoder_ctx = { .packet = packet, .original = original, .secret = secret };
+	fr_radius_ctx_t encoder_ctx = { .packet = packet, .original = original, .secret = secret, .plan = plan };
 
 	/*
 	 *	A 4K packet, aligned on 64-bits.
@@ -1484,8 +1727,7 @@ int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	 *	memory for a request.
 	 */
 	packet->data_len = total_length;
-	packet->data = talloc_array(packet, uint8_t, packet->data_len);
-	if (!packet->data) {
+	if (!fr_radius_data_alloc(packet, packet->data_len)) {
 		fr_strerror_printf("Out of memory");
 		return -1;
 	}
@@ -1499,6 +1741,149 @@ int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	return 0;
 }
 
+/** Check whether a raw attribute has data encrypted with the shared secret
+ *
+ *  User-Password isn't counted, as fr_radius_encode_proxy() re-encrypts it.
+ */
+static bool radius_attr_encrypted(uint8_t const *attr)
+{
+	fr_dict_attr_t const	*da;
+	fr_dict_vendor_t const	*dv;
+	uint8_t const		*p, *end;
+	unsigned int		vendor;
+
+	if (attr[0] == PW_USER_PASSWORD) return false;
+
+	if (attr[0] != PW_VENDOR_SPECIFIC) {
+		da = fr_dict_attr_by_num(NULL, 0, attr[0]);
+		return da && (da->flags.encrypt != FLAG_ENCRYPT_NONE);
+	}
+
+	if (attr[1] < 6) return false;
+
+	vendor = (attr[3] << 16) | (attr[4] << 8) | attr[5];
+	if (attr[2] != 0) return true;
+
+	/*
+	 *	We only know how to walk the standard 1/1 VSA
+	 *	format.  Anything else might be encrypted.
+	 */
+	dv = fr_dict_vendor_by_num(NULL, vendor);
+	if (!dv) return false;
+	if ((dv->type != 1) || (dv->length != 1)) return true;
+
+	end = attr + attr[1];
+	for (p = attr + 6; (p + 2) <= end; p += p[1]) {
+		if (p[1] < 2) return true;
+
+		da = fr_dict_attr_by_num(NULL, vendor, p[0]);
+		if (da && (da->flags.encrypt != FLAG_ENCRYPT_NONE)) return true;
+	}
+
+	return false;
+}
+
+/** Encode a proxied request by copying the packet it was received as
+ *
+ *  The attributes are copied as-is, so any changes to packet->vps
+ *  are ignored.  Only the ID changes, and User-Password, which is
+ *  re-encrypted with the new secret.  The Request Authenticator of
+ *  an Access-Request is kept, as CHAP-Password may depend on it.
+ *
+ *  The packet must then be signed with fr_radius_sign() as usual.
+ *
+ * @param[in,out] packet	to encode.  Must have the same code as the original.
+ * @param[in] original		request that was received, which must have passed fr_radius_ok().
+ * @param[in] original_secret	shared with the client which sent the original.
+ * @param[in] secret		shared with the home server.
+ * @return
+ *	- <0 on error.
+ *	- 0 if the packet can't be copied, and must be encoded with fr_radius_encode().
+ *	- 1 on success.
+ */
+int fr_radius_encode_proxy(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			   char const *original_secret, char const *secret)
+{
+	uint8_t		*data, *attr, *end;
+	bool		same_secret;
+
+	if (!original->data || (original->data_len < RADIUS_HDR_LEN) ||
+	    (packet->code != original->code)) return 0;
+
+	switch (packet->code) {
+	case PW_CODE_ACCESS_REQUEST:
+	case PW_CODE_ACCOUNTING_REQUEST:
+	case PW_CODE_COA_REQUEST:
+	case PW_CODE_DISCONNECT_REQUEST:
+		break;
+
+	default:
+		return 0;
+	}
+
+	same_secret = (strcmp(original_secret, secret) == 0);
+
+	/*
+	 *	We can't re-encrypt other attributes in place, so
+	 *	they have to go through the normal encoder.
+	 */
+	end = original->data + original->data_len;
+	if (!same_secret) for (attr = original->data + RADIUS_HDR_LEN; attr < end; attr += attr[1]) {
+		if (radius_attr_encrypted(attr)) return 0;
+	}
+
+	data = fr_radius_data_alloc(packet, original->data_len);
+	if (!data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	memcpy(data, original->data, original->data_len);
+	packet->data_len = original->data_len;
+	packet->offset = 0;
+
+	data[1] = packet->id;
+	if (packet->code == PW_CODE_ACCESS_REQUEST) memcpy(packet->vector, original->vector, AUTH_VECTOR_LEN);
+
+	end = data + packet->data_len;
+	for (attr = data + RADIUS_HDR_LEN; attr < end; attr += attr[1]) {
+		size_t	len;
+		char	buffer[128 + 1];
+
+		switch (attr[0]) {
+		case PW_MESSAGE_AUTHENTICATOR:
+			packet->offset = attr - data;
+			break;
+
+		case PW_USER_PASSWORD:
+			if (same_secret) break;
+
+			len = attr[1] - 2;
+			if ((len == 0) || (len > 128) || ((len % AUTH_PASS_LEN) != 0)) {
+				TALLOC_FREE(packet->data);
+				packet->data_len = 0;
+				return 0;
+			}
+
+			/*
+			 *	Decrypting and encrypting all of the
+			 *	blocks keeps the length the same.  The
+			 *	decoder adds a trailing zero, so we
+			 *	can't do it in place.
+			 */
+			memcpy(buffer, attr + 2, len);
+			fr_radius_decode_password(buffer, len, original_secret, packet->vector);
+			fr_radius_encode_password(buffer, &len, secret, packet->vector);
+			memcpy(attr + 2, buffer, len);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 1;
+}
+
 /** Calculate/check digest, and decode radius attributes
  *
  * @return
@@ -1516,7 +1901,8 @@ int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	fr_radius_ctx_t		decoder_ctx = {
 					.original = original,
 					.packet = packet,
-					.secret = secret
+					.secret = secret,
+					.borrow_octets = fr_radius_borrow_octets
 				};
 	/*
 	 *	Extract attribute-value pairs
@@ -1590,6 +1976,265 @@ int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	return 0;
 }
 
+/** One raw attribute in a packet which is being decoded lazily
+ *
+ */
+typedef struct fr_radius_lazy_attr_t {
+	uint16_t		offset;			//!< From the start of packet->data.
+	uint8_t			type;			//!< The RADIUS attribute number.
+	bool			decoded;		//!< Whether it's in packet->vps.
+} fr_radius_lazy_attr_t;
+
+struct fr_radius_lazy_t {
+	fr_radius_ctx_t		decoder_ctx;		//!< For decrypting attributes.
+	uint32_t		num_attributes;		//!< Number of VPs decoded so far.
+	int			num;			//!< Number of raw attributes.
+	int			pending;		//!< Number of raw attributes which haven't been decoded.
+	fr_radius_lazy_attr_t	*attr;			//!< The raw attributes, in packet order.
+};
+
+/** Save the attribute offsets found by fr_radius_ok()
+ *
+ *  The index isn't used until fr_radius_decode_lazy() is called,
+ *  and until then nothing is pending.
+ *
+ * @param[in] packet which was checked.
+ * @param[in] offsets of the attributes, from the start of packet->data.
+ * @param[in] num of attributes.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int radius_lazy_index(RADIUS_PACKET *packet, uint16_t const *offsets, int num)
+{
+	fr_radius_lazy_t	*lazy;
+	int			i;
+
+	TALLOC_FREE(packet->lazy);
+
+	lazy = talloc_zero(packet, fr_radius_lazy_t);
+	if (!lazy) return -1;
+
+	lazy->attr = talloc_array(lazy, fr_radius_lazy_attr_t, num);
+	if (!lazy->attr) {
+		talloc_free(lazy);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		lazy->attr[i].offset = offsets[i];
+		lazy->attr[i].type = packet->data[offsets[i]];
+		lazy->attr[i].decoded = false;
+	}
+	lazy->num = num;
+
+	packet->lazy = lazy;
+
+	return 0;
+}
+
+/** Index the attributes in a packet, without decoding them
+ *
+ *  The packet MUST have been checked by fr_radius_ok().  If
+ *  #fr_radius_ok_index is set, the offsets found by fr_radius_ok()
+ *  are used, instead of walking over the packet again.
+ *
+ *  VALUE_PAIRs are only created for an attribute when something
+ *  asks for it via fr_radius_pair_find_by_da().  Anything which
+ *  walks packet->vps directly MUST call fr_radius_decode_pending()
+ *  first.
+ *
+ *  The attributes are decoded in the order they are asked for, so
+ *  packet->vps may not be in packet order.  The original packet and
+ *  the secret MUST remain valid until all of the attributes are
+ *  decoded.
+ *
+ * @return
+ *	- 0 on success
+ *	- -1 on error.
+ */
+int fr_radius_decode_lazy(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+{
+	fr_radius_lazy_t	*lazy;
+	uint8_t			*ptr, *end;
+	int			num = 0;
+
+	/*
+	 *	fr_radius_ok() has already indexed the packet.
+	 */
+	lazy = packet->lazy;
+	if (lazy && !lazy->decoder_ctx.packet) {
+		lazy->pending = lazy->num;
+		goto done;
+	}
+
+	TALLOC_FREE(packet->lazy);
+
+	ptr = packet->data + RADIUS_HDR_LEN;
+	end = packet->data + packet->data_len;
+
+	while ((ptr + 2) <= end) {
+		if (ptr[1] < 2) break;
+		num++;
+		ptr += ptr[1];
+	}
+
+	lazy = talloc_zero(packet, fr_radius_lazy_t);
+	if (!lazy) return -1;
+
+	lazy->attr = talloc_array(lazy, fr_radius_lazy_attr_t, num);
+	if (!lazy->attr) {
+		talloc_free(lazy);
+		return -1;
+	}
+
+	ptr = packet->data + RADIUS_HDR_LEN;
+	for (lazy->num = 0; lazy->num < num; lazy->num++) {
+		lazy->attr[lazy->num].offset = ptr - packet->data;
+		lazy->attr[lazy->num].type = ptr[0];
+		lazy->attr[lazy->num].decoded = false;
+		ptr += ptr[1];
+	}
+	lazy->pending = num;
+
+	packet->lazy = lazy;
+
+done:
+	lazy->decoder_ctx.packet = packet;
+	lazy->decoder_ctx.original = original;
+	lazy->decoder_ctx.secret = secret;
+	lazy->decoder_ctx.borrow_octets = fr_radius_borrow_octets;
+
+	fr_rand_seed(packet->data, RADIUS_HDR_LEN);
+
+	return 0;
+}
+
+/** Decode the raw attributes of one type, or all of them
+ *
+ * @param[in] packet being decoded.
+ * @param[in] type the RADIUS attribute number, or -1 for all attributes.
+ * @return
+ *	- 0 on success
+ *	- -1 on decoding error.
+ */
+static int radius_decode_lazy_attrs(RADIUS_PACKET *packet, int type)
+{
+	fr_radius_lazy_t	*lazy = packet->lazy;
+	VALUE_PAIR		*head = NULL;
+	vp_cursor_t		cursor, out;
+	int			i, j;
+
+	fr_pair_cursor_init(&cursor, &head);
+
+	for (i = 0; i < lazy->num; i++) {
+		uint8_t		*ptr;
+		size_t		len;
+		ssize_t		my_len;
+
+		if (lazy->attr[i].decoded) continue;
+		if ((type >= 0) && (lazy->attr[i].type != type)) continue;
+
+		ptr = packet->data + lazy->attr[i].offset;
+		len = packet->data_len - lazy->attr[i].offset;
+
+		/*
+		 *	This may return many VPs, and it may use
+		 *	more than one attribute.
+		 */
+		my_len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal),
+					       ptr, len, &lazy->decoder_ctx);
+		if (my_len < 0) {
+			fr_pair_list_free(&head);
+			return -1;
+		}
+
+		for (j = i; (j < lazy->num) && (lazy->attr[j].offset < (lazy->attr[i].offset + my_len)); j++) {
+			if (lazy->attr[j].decoded) continue;
+
+			lazy->attr[j].decoded = true;
+			lazy->pending--;
+		}
+
+		while (fr_pair_cursor_next(&cursor)) lazy->num_attributes++;
+
+		if ((fr_max_attributes > 0) && (lazy->num_attributes > fr_max_attributes)) {
+			char host_ipaddr[INET6_ADDRSTRLEN];
+
+			fr_pair_list_free(&head);
+			fr_strerror_printf("Possible DoS attack from host %s: Too many attributes in request "
+					   "(received %d, max %d are allowed)",
+					   inet_ntop(packet->src_ipaddr.af,
+						     &packet->src_ipaddr.ipaddr,
+						     host_ipaddr, sizeof(host_ipaddr)),
+					   lazy->num_attributes, fr_max_attributes);
+			return -1;
+		}
+
+		/*
+		 *	Stop if we've seen all of the attributes.
+		 */
+		if (my_len == 0) break;
+	}
+
+	fr_pair_cursor_init(&out, &packet->vps);
+	fr_pair_cursor_last(&out);
+	fr_pair_cursor_merge(&out, head);
+
+	return 0;
+}
+
+/** Decode all of the attributes which haven't been decoded yet
+ *
+ * @return
+ *	- 0 on success
+ *	- -1 on decoding error.
+ */
+int fr_radius_decode_pending(RADIUS_PACKET *packet)
+{
+	int rcode;
+
+	if (!packet->lazy) return 0;
+
+	rcode = 0;
+	if (packet->lazy->pending > 0) rcode = radius_decode_lazy_attrs(packet, -1);
+
+	TALLOC_FREE(packet->lazy);
+
+	return rcode;
+}
+
+/** Find a VALUE_PAIR in a packet, decoding it if necessary
+ *
+ *  If the packet is not being decoded lazily, this is the same as
+ *  fr_pair_find_by_da(packet->vps, ...).
+ *
+ * @param[in] packet to search.
+ * @param[in] da to look for.
+ * @param[in] tag to look for.
+ * @return
+ *	- NULL if the attribute wasn't found, or couldn't be decoded.
+ *	- the first matching VALUE_PAIR.
+ */
+VALUE_PAIR *fr_radius_pair_find_by_da(RADIUS_PACKET *packet, fr_dict_attr_t const *da, int8_t tag)
+{
+	fr_dict_attr_t const *top;
+
+	if (!packet->lazy || !packet->lazy->pending) goto find;
+
+	/*
+	 *	Find the RADIUS attribute which holds this one.
+	 *	e.g. Vendor-Specific for a VSA.
+	 */
+	for (top = da; top->parent && !top->parent->flags.is_root; top = top->parent);
+	if (top->attr > 255) goto find;
+
+	if (radius_decode_lazy_attrs(packet, top->attr) < 0) return NULL;
+
+find:
+	return fr_pair_find_by_da(packet->vps, da, tag);
+}
+
 /** Seed the random number generator
  *
  * May be called any number of times.
@@ -1666,6 +2311,138 @@ uint32_t fr_rand(void)
 	return num;
 }
 
+/** Fill a buffer with random data
+ *
+ *  Copies whole results from the pool, instead of calling fr_rand()
+ *  once per octet.
+ *
+ * @param[out] start of the buffer to fill.
+ * @param[in] length of the buffer.
+ */
+void fr_rand_buffer(void *start, size_t length)
+{
+	uint8_t *p = start;
+
+	if (!fr_rand_initialized) {
+		fr_rand_seed(NULL, 0);
+	}
+
+	while (length > 0) {
+		size_t avail, len;
+
+		avail = (256 - fr_rand_pool.randcnt) * sizeof(fr_rand_pool.randrsl[0]);
+		len = (length < avail) ? length : avail;
+
+		memcpy(p, &fr_rand_pool.randrsl[fr_rand_pool.randcnt], len);
+		p += len;
+		length -= len;
+
+		/*
+		 *	Never re-use part of a result.
+		 */
+		fr_rand_pool.randcnt += (len + sizeof(fr_rand_pool.randrsl[0]) - 1) / sizeof(fr_rand_pool.randrsl[0]);
+		if (fr_rand_pool.randcnt >= 256) {
+			fr_rand_pool.randcnt = 0;
+			fr_isaac(&fr_rand_pool);
+		}
+	}
+}
+
+
+/*
+ *	Most packets fit in a buffer of MAX_PACKET_LEN octets.  Each
+ *	thread keeps some of those buffers around after the packets
+ *	using them are freed, instead of going back to malloc.
+ */
+#define RADIUS_DATA_POOL_SIZE	(64)
+
+typedef struct radius_data_pool_t {
+	int			num;				//!< Number of free buffers.
+	uint8_t			*free[RADIUS_DATA_POOL_SIZE];	//!< Buffers which can be re-used.
+} radius_data_pool_t;
+
+fr_thread_local_setup(radius_data_pool_t *, radius_data_pool)	/* macro */
+
+/** Return a buffer to the pool, instead of freeing it
+ *
+ *  The buffer is moved out of the packet, so freeing the packet
+ *  continues as normal.
+ */
+static int _radius_data_free(uint8_t *data)
+{
+	radius_data_pool_t *pool = radius_data_pool;
+
+	if (!pool || (pool->num >= RADIUS_DATA_POOL_SIZE)) return 0;
+
+	talloc_steal(pool, data);
+	pool->free[pool->num++] = data;
+
+	return -1;
+}
+
+static int _radius_data_pool_free(radius_data_pool_t *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->num; i++) talloc_set_destructor(pool->free[i], NULL);
+	pool->num = 0;
+
+	return 0;
+}
+
+static void _radius_data_pool_thread_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Allocate packet->data
+ *
+ *  Buffers of up to MAX_PACKET_LEN octets come from a per-thread
+ *  pool, and go back to it when they're freed.  Anything larger is
+ *  allocated as normal.
+ *
+ *  The buffer is parented by the packet, and may be freed with
+ *  talloc_free() as usual.  Unlike talloc_array(), the buffer may
+ *  be larger than requested.
+ *
+ * @param[in] packet to allocate the buffer for.
+ * @param[in] len of the data.
+ * @return
+ *	- NULL on error.
+ *	- The new buffer, which is also assigned to packet->data.
+ */
+uint8_t *fr_radius_data_alloc(RADIUS_PACKET *packet, size_t len)
+{
+	radius_data_pool_t	*pool;
+	uint8_t			*data;
+
+	if (len > MAX_PACKET_LEN) {
+		packet->data = talloc_array(packet, uint8_t, len);
+		return packet->data;
+	}
+
+	pool = radius_data_pool;
+	if (!pool) {
+		pool = talloc_zero(NULL, radius_data_pool_t);
+		if (!pool) return NULL;
+		talloc_set_destructor(pool, _radius_data_pool_free);
+
+		fr_thread_local_set_destructor(radius_data_pool, _radius_data_pool_thread_free, pool);
+	}
+
+	if (pool->num > 0) {
+		data = pool->free[--pool->num];
+		talloc_steal(packet, data);
+	} else {
+		data = talloc_array(packet, uint8_t, MAX_PACKET_LEN);
+		if (!data) return NULL;
+		talloc_set_destructor(data, _radius_data_free);
+	}
+
+	packet->data = data;
+
+	return data;
+}
 
 /** Allocate a new RADIUS_PACKET
  *
@@ -1797,6 +2574,7 @@ RADIUS_PACKET *fr_radius_copy(TALLOC_CTX *ctx, RADIUS_PACKET const *in)
 	out->data_len = 0;
 
 	out->vps = fr_pair_list_copy(out, in->vps);
+	out->lazy = NULL;
 	out->offset = 0;
 
 	return out;
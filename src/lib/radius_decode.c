@@ -28,6 +28,12 @@
 static uint8_t nullvector[AUTH_VECTOR_LEN] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }; /* for CoA decode */
 
 bool fr_tunnel_password_zeros = true;
+bool fr_radius_borrow_octets = false;
+
+/*
+ *	Smaller values are cheaper to copy than to reference.
+ */
+#define BORROW_OCTETS_MIN	(64)
 
 /** Decode Tunnel-Password encrypted attributes
  *
@@ -39,7 +45,6 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 {
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
-	int		secretlen;
 	size_t		i, n, encrypted_len, embedded_len;
 
 	encrypted_len = *pwlen;
@@ -73,10 +78,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_md5_copy(&context, &fr_radius_secret_md5(secret)->prefix);
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -160,7 +162,7 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	FR_MD5_CTX	context, old;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	int		i;
-	size_t		n, secretlen;
+	size_t		n;
 
 	/*
 	 *	The RFC's say that the maximum is 128.
@@ -177,10 +179,7 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = talloc_array_length(secret) - 1;
-
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_md5_copy(&context, &fr_radius_secret_md5(secret)->prefix);
 	fr_md5_copy(&old, &context);	/* save intermediate work */
 
 	/*
@@ -1309,6 +1308,15 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 		break;
 
 	case PW_TYPE_OCTETS:
+		/*
+		 *	Decrypted data lives on our stack, so only
+		 *	data which is still in the packet can be
+		 *	borrowed.
+		 */
+		if (this->borrow_octets && (data_len >= BORROW_OCTETS_MIN) && this->packet->data &&
+		    (p >= this->packet->data) && ((p + data_len) <= (this->packet->data + this->packet->data_len)) &&
+		    (fr_pair_value_memborrow(vp, p, data_len, this->packet->data) == 0)) break;
+
 		fr_pair_value_memcpy(vp, p, data_len);
 		break;
 
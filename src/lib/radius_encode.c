@@ -1560,6 +1560,202 @@ static int encode_rfc_hdr(uint8_t *out, size_t outlen, fr_dict_attr_t const **tl
 	return encode_rfc_hdr_internal(out, outlen, tlv_stack, depth, cursor, encoder_ctx);
 }
 
+/** A pre-computed header for one attribute
+ *
+ */
+typedef struct radius_encode_plan_entry_t {
+	fr_dict_attr_t const	*da;		//!< The attribute this entry is for.
+	bool			simple;		//!< Whether we can use the pre-computed header.
+	uint8_t			hdr_len;	//!< Length of the header.
+	uint8_t			vsa_len;	//!< Offset of the Vendor-Specific length field, or 0.
+	uint8_t			hdr[8];	//!< The header, with lengths set to cover only the header.
+} radius_encode_plan_entry_t;
+
+struct fr_radius_encode_plan_t {
+	fr_hash_table_t		*ht;		//!< Entries, by fr_dict_attr_t.
+};
+
+static uint32_t encode_plan_hash(void const *data)
+{
+	radius_encode_plan_entry_t const *entry = data;
+
+	return fr_hash(&entry->da, sizeof(entry->da));
+}
+
+static int encode_plan_cmp(void const *one, void const *two)
+{
+	radius_encode_plan_entry_t const *a = one, *b = two;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+	return 0;
+}
+
+/** Create a cache of pre-computed attribute headers
+ *
+ * Headers for RFC attributes, and for VSAs in the standard format,
+ * depend only on the dictionary.  Once they have been worked out, an
+ * attribute can be encoded by copying its header, and then its value.
+ *
+ * The plan caches pointers to fr_dict_attr_t, so it MUST be freed
+ * before the dictionary is.
+ *
+ * @param[in] ctx to allocate the plan in.
+ * @return
+ *	- NULL on error.
+ *	- fr_radius_encode_plan_t on success.
+ */
+fr_radius_encode_plan_t *fr_radius_encode_plan_alloc(TALLOC_CTX *ctx)
+{
+	fr_radius_encode_plan_t *plan;
+
+	plan = talloc_zero(ctx, fr_radius_encode_plan_t);
+	if (!plan) return NULL;
+
+	plan->ht = fr_hash_table_create(plan, encode_plan_hash, encode_plan_cmp, NULL);
+	if (!plan->ht) {
+		talloc_free(plan);
+		return NULL;
+	}
+
+	return plan;
+}
+
+/** Work out whether an attribute has a fixed header, and what it is
+ *
+ * Anything which needs the full encoder (TLVs, extended attributes,
+ * encryption, tags, fragmentation, etc.) is marked as not simple.
+ */
+static void encode_plan_entry_init(radius_encode_plan_entry_t *entry, fr_dict_attr_t const *da)
+{
+	fr_dict_attr_t const	*dv;
+	uint32_t		lvalue;
+
+	entry->da = da;
+	entry->simple = false;
+
+	if (da->flags.internal || da->flags.encrypt || da->flags.has_tag || da->flags.concat ||
+	    da->flags.length) return;
+
+	switch (da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_IFID:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IPV4_PREFIX:
+	case PW_TYPE_ABINARY:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_BOOLEAN:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_DATE:
+	case PW_TYPE_SIGNED:
+		break;
+
+	default:
+		return;
+	}
+
+	if ((da->attr == 0) || (da->attr > 255)) return;
+
+	if (da->parent->flags.is_root) {
+		if ((da->attr == PW_MESSAGE_AUTHENTICATOR) || (da->attr == PW_VENDOR_SPECIFIC)) return;
+
+		entry->hdr[0] = da->attr;
+		entry->hdr[1] = 2;
+		entry->hdr_len = 2;
+		entry->vsa_len = 0;
+		entry->simple = true;
+		return;
+	}
+
+	/*
+	 *	Vendor-Specific, Vendor, attribute.
+	 */
+	dv = da->parent;
+	if ((dv->type != PW_TYPE_VENDOR) || !dv->parent || (dv->parent->type != PW_TYPE_VSA) ||
+	    !dv->parent->parent || !dv->parent->parent->flags.is_root) return;
+
+	if ((dv->attr == VENDORPEC_WIMAX) || (dv->flags.type_size != 1) || (dv->flags.length != 1)) return;
+
+	entry->hdr[0] = PW_VENDOR_SPECIFIC;
+	entry->hdr[1] = 8;
+	lvalue = htonl(dv->attr);
+	memcpy(entry->hdr + 2, &lvalue, sizeof(lvalue));
+	entry->hdr[6] = da->attr;
+	entry->hdr[7] = 2;
+	entry->hdr_len = 8;
+	entry->vsa_len = 1;
+	entry->simple = true;
+}
+
+/** Encode one attribute using a pre-computed header
+ *
+ * @return
+ *	- 0 if the attribute can't be encoded this way.  The cursor is unchanged.
+ *	- >0 the number of bytes written.
+ */
+static ssize_t encode_planned(uint8_t *out, size_t outlen, vp_cursor_t *cursor, fr_radius_encode_plan_t *plan)
+{
+	VALUE_PAIR const		*vp;
+	radius_encode_plan_entry_t	*entry, my_entry;
+	ssize_t				len;
+	size_t				hdr_len;
+
+	vp = first_encodable(cursor);
+	if (!vp) return 0;
+
+	/*
+	 *	Zero-length attributes have special rules.
+	 */
+	if (vp->vp_length == 0) return 0;
+
+	/*
+	 *	Unknown attributes are freed with the VALUE_PAIR,
+	 *	and their pointers re-used, so they can't be cached.
+	 */
+	if (vp->da->flags.is_unknown) return 0;
+
+	my_entry.da = vp->da;
+	entry = fr_hash_table_finddata(plan->ht, &my_entry);
+	if (!entry) {
+		entry = talloc_zero(plan->ht, radius_encode_plan_entry_t);
+		if (!entry) return 0;
+
+		encode_plan_entry_init(entry, vp->da);
+		if (!fr_hash_table_insert(plan->ht, entry)) {
+			talloc_free(entry);
+			return 0;
+		}
+	}
+	if (!entry->simple) return 0;
+
+	/*
+	 *	The full encoder truncates values which don't fit.
+	 *	Let it deal with them.
+	 */
+	hdr_len = entry->hdr_len;
+	if (outlen > UINT8_MAX) outlen = UINT8_MAX;
+	if ((hdr_len + vp->vp_length) > outlen) return 0;
+
+	if (((vp->vp_type == PW_TYPE_STRING) || (vp->vp_type == PW_TYPE_OCTETS)) && !vp->vp_ptr) return 0;
+
+	len = fr_radius_encode_value_hton(out + hdr_len, outlen - hdr_len, vp);
+	if (len <= 0) return 0;
+
+	memcpy(out, entry->hdr, hdr_len);
+	out[hdr_len - 1] += len;
+	if (entry->vsa_len) out[entry->vsa_len] += len;
+
+	next_encodable(cursor);
+
+	return hdr_len + len;
+}
+
 /** Encode a data structure into a RADIUS attribute
  *
  * This is the main entry point into the encoder.  It sets up the encoder array
@@ -1576,6 +1772,17 @@ int fr_radius_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor, void
 	fr_dict_attr_t const *da = NULL;
 
 	if (!cursor || !out || (outlen <= 2)) return -1;
+
+	/*
+	 *	Use the pre-computed header if we can.
+	 */
+	if (encoder_ctx && ((fr_radius_ctx_t *) encoder_ctx)->plan) {
+		ssize_t slen;
+
+		slen = encode_planned(out, outlen, cursor, ((fr_radius_ctx_t *) encoder_ctx)->plan);
+		if (slen > 0) return slen;
+	}
+
 	vp = first_encodable(cursor);
 	if (!vp) return -1;
 
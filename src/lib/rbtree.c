@@ -27,18 +27,13 @@ RCSID("$Id$")
 #include <pthread.h>
 
 /* Red-Black tree description */
-typedef enum {
-	BLACK,
-	RED
-} node_colour_t;
-
-struct rbnode_t {
-	rbnode_t		*left;		//!< Left child
-	rbnode_t		*right;		//!< Right child
-	rbnode_t		*parent;	//!< Parent
-	node_colour_t		colour;		//!< Node colour (BLACK, RED)
-	void			*data;		//!< data stored in node
-};
+#define BLACK	(0)
+#define RED	(1)
+
+/*
+ *	How many nodes to allocate at a time, for RBTREE_FLAG_POOL.
+ */
+#define RBTREE_POOL_CHUNK (64)
 
 #define NIL &sentinel	   /* all leafs are sentinels */
 static rbnode_t sentinel = { NIL, NIL, NULL, BLACK, NULL};
@@ -54,24 +49,91 @@ struct rbtree_t {
 	bool			replace;
 	bool			lock;
 	pthread_mutex_t		mutex;
+
+	bool			pool;		//!< re-use deleted nodes
+	rbnode_t		*spare;		//!< deleted nodes, linked via ->right
+
+	bool			intrusive;	//!< nodes are embedded in the user data
+	size_t			offset;		//!< of the node in the user data
 };
 
 #ifndef NDEBUG
 #  define RBTREE_MAGIC (0x5ad09c42)
 #endif
 
+/** Get a node for some data
+ *
+ *  Nodes are either embedded in the data, taken from the spare
+ *  list, or allocated.
+ */
+static rbnode_t *rbtree_node_alloc(rbtree_t *tree, void *data)
+{
+	rbnode_t *x;
+
+	if (tree->intrusive) {
+		x = (rbnode_t *) (((uint8_t *) data) + tree->offset);
+		memset(x, 0, sizeof(*x));
+		return x;
+	}
+
+	if (!tree->pool) return talloc_zero(tree, rbnode_t);
+
+	if (!tree->spare) {
+		int i;
+		rbnode_t *chunk;
+
+		chunk = talloc_array(tree, rbnode_t, RBTREE_POOL_CHUNK);
+		if (!chunk) return NULL;
+
+		for (i = 0; i < RBTREE_POOL_CHUNK; i++) {
+			chunk[i].right = tree->spare;
+			tree->spare = &chunk[i];
+		}
+	}
+
+	x = tree->spare;
+	tree->spare = x->right;
+	memset(x, 0, sizeof(*x));
+
+	return x;
+}
+
+/** Release a node which is no longer in the tree
+ *
+ */
+static void rbtree_node_release(rbtree_t *tree, rbnode_t *x)
+{
+	if (tree->intrusive) return;
+
+	if (!tree->pool) {
+		talloc_free(x);
+		return;
+	}
+
+	x->data = NULL;
+	x->right = tree->spare;
+	tree->spare = x;
+}
+
 /** Walks the tree to delete all nodes Does NOT re-balance it!
  *
  */
 static void free_walker(rbtree_t *tree, rbnode_t *x)
 {
-	(void) talloc_get_type_abort(x, rbnode_t);
+	void *data;
+
+	if (!tree->pool && !tree->intrusive) (void) talloc_get_type_abort(x, rbnode_t);
 
 	if (x->left != NIL) free_walker(tree, x->left);
 	if (x->right != NIL) free_walker(tree, x->right);
 
-	if (tree->free) tree->free(x->data);
-	talloc_free(x);
+	/*
+	 *	The node may be inside of the data, so we release
+	 *	it before freeing the data.
+	 */
+	data = x->data;
+	rbtree_node_release(tree, x);
+	if (tree->free) tree->free(data);
 }
 
 /** Wrapper function for rbtree_create to allow talloc node data to be freed
@@ -120,6 +182,9 @@ static int _rbtree_free(rbtree_t *tree)
 
 /** Create a new RED-BLACK tree
  *
+ *  With RBTREE_FLAG_POOL, nodes are allocated in chunks, and deleted
+ *  nodes are kept for re-use, instead of being freed.  The memory is
+ *  only returned when the tree is freed.
  */
 rbtree_t *rbtree_create(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free, int flags)
 {
@@ -141,12 +206,64 @@ rbtree_t *rbtree_create(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node
 		pthread_mutex_init(&tree->mutex, NULL);
 	}
 
+	tree->pool = (flags & RBTREE_FLAG_POOL) != 0 ? true : false;
+
 	talloc_set_destructor(tree, _rbtree_free);
 	tree->free = node_free;
 
 	return tree;
 }
 
+/** Create a new RED-BLACK tree, where the nodes are embedded in the user data
+ *
+ *  The tree doesn't allocate any memory for nodes.  Instead, each
+ *  piece of data MUST contain an rbnode_t at the given offset.  The
+ *  data can only be in one tree at a time, using that node.
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] compare the comparison function
+ * @param[in] node_free called when data is deleted from the tree
+ * @param[in] offset of the rbnode_t in the data, usually from offsetof()
+ * @param[in] flags RBTREE_FLAG_REPLACE and / or RBTREE_FLAG_LOCK
+ * @return
+ *	- NULL on error
+ *	- rbtree_t on success
+ */
+rbtree_t *rbtree_create_intrusive(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free,
+				  size_t offset, int flags)
+{
+	rbtree_t *tree;
+
+	tree = rbtree_create(ctx, compare, node_free, flags & ~RBTREE_FLAG_POOL);
+	if (!tree) return NULL;
+
+	tree->intrusive = true;
+	tree->offset = offset;
+
+	return tree;
+}
+
+/** Put node "to" into the tree, where node "from" was
+ *
+ *  The data pointer of "to" is left unchanged.
+ */
+static void rbtree_node_transplant(rbtree_t *tree, rbnode_t *from, rbnode_t *to)
+{
+	void *data = to->data;
+
+	memcpy(to, from, sizeof(*to));
+	to->data = data;
+
+	if (!to->parent) {
+		tree->root = to;
+	} else {
+		if (to->parent->left == from) to->parent->left = to;
+		if (to->parent->right == from) to->parent->right = to;
+	}
+	if (to->left != NIL) to->left->parent = to;
+	if (to->right != NIL) to->right->parent = to;
+}
+
 /** Rotate Node x to left
  *
  */
@@ -293,8 +410,22 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 			}
 
 			/*
-			 *	Do replace the entry.
+			 *	Do replace the entry.  If the nodes are
+			 *	in the data, the new node takes the
+			 *	place of the old one.
 			 */
+			if (tree->intrusive) {
+				void *old = current->data;
+
+				x = rbtree_node_alloc(tree, data);
+				x->data = data;
+				rbtree_node_transplant(tree, current, x);
+
+				if (tree->free) tree->free(old);
+				if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+				return x;
+			}
+
 			if (tree->free) tree->free(current->data);
 			current->data = data;
 			if (tree->lock) pthread_mutex_unlock(&tree->mutex);
@@ -306,7 +437,7 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 	}
 
 	/* setup new node */
-	x = talloc_zero(tree, rbnode_t);
+	x = rbtree_node_alloc(tree, data);
 	if (!x) {
 		fr_strerror_printf("No memory for new rbtree node");
 		if (tree->lock) pthread_mutex_unlock(&tree->mutex);
@@ -417,6 +548,7 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 {
 	rbnode_t *x, *y;
 	rbnode_t *parent;
+	void *data;
 
 	if (!z || z == NIL) return;
 
@@ -454,10 +586,14 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 		tree->root = x;
 	}
 
+	/*
+	 *	The data may contain the node, so we can only free
+	 *	the data once we're done with the node.
+	 */
+	data = z->data;
+
 	if (y != z) {
-		if (tree->free) tree->free(z->data);
 		z->data = y->data;
-		y->data = NULL;
 
 		if ((y->colour == BLACK) && parent) {
 			delete_fixup(tree, x, parent);
@@ -470,28 +606,19 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 		 *	tree) to y, and fix up the parent/child
 		 *	pointers.
 		 */
-		memcpy(y, z, sizeof(*y));
-
-		if (!y->parent) {
-			tree->root = y;
-		} else {
-			if (y->parent->left == z) y->parent->left = y;
-			if (y->parent->right == z) y->parent->right = y;
-		}
-		if (y->left->parent == z) y->left->parent = y;
-		if (y->right->parent == z) y->right->parent = y;
+		rbtree_node_transplant(tree, z, y);
 
-		talloc_free(z);
+		rbtree_node_release(tree, z);
 
 	} else {
-		if (tree->free) tree->free(y->data);
-
 		if (y->colour == BLACK)
 			delete_fixup(tree, x, parent);
 
-		talloc_free(y);
+		rbtree_node_release(tree, y);
 	}
 
+	if (tree->free) tree->free(data);
+
 	tree->num_elements--;
 	if (!skiplock) {
 		if (tree->lock) pthread_mutex_unlock(&tree->mutex);
@@ -26,6 +26,8 @@
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/regex.h>
 
+#include <pthread.h>
+
 /*
  *	Wrapper functions for libpcre. Much more powerful, and guaranteed
  *	to be binary safe but require libpcre.
@@ -178,6 +180,251 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 	return len;
 }
 
+/*
+ *	Patterns which are only known at runtime (conditions with
+ *	expansions on the RHS, check items with =~) would otherwise be
+ *	compiled, used once, and freed, on every evaluation.  Keep the
+ *	most recently used ones, compiled and JIT'd, in a global cache.
+ */
+#define REGEX_COMPILE_CACHE_SIZE	(256)
+
+/** An entry in the compile cache
+ *
+ */
+typedef struct regex_cache_entry {
+	regex_t				*preg;		//!< The compiled expression.
+	char				*pattern;	//!< Copy of the pattern.
+	size_t				len;		//!< Length of the pattern.
+	int				cflags;		//!< Flags the pattern was compiled with.
+
+	uint32_t			refs;		//!< References held by callers.
+	bool				evicted;	//!< No longer in the cache, free when
+							//!< the last reference is released.
+
+	struct regex_cache_entry	*prev;		//!< More recently used.
+	struct regex_cache_entry	*next;		//!< Less recently used.
+} regex_cache_entry_t;
+
+static pthread_mutex_t		regex_cache_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Protects everything below.
+static rbtree_t			*regex_cache_tree;	//!< Entries, indexed by flags and pattern.
+static regex_cache_entry_t	*regex_cache_head;	//!< Most recently used.
+static regex_cache_entry_t	*regex_cache_tail;	//!< Least recently used, evicted first.
+static uint32_t			regex_cache_num;	//!< Number of entries in the cache.
+
+static int regex_cache_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	if (a->cflags != b->cflags) return a->cflags - b->cflags;
+	if (a->len != b->len) return (a->len < b->len) ? -1 : 1;
+
+	ret = memcmp(a->pattern, b->pattern, a->len);
+	return (ret > 0) - (ret < 0);
+}
+
+static void regex_cache_unlink(regex_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		regex_cache_head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		regex_cache_tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void regex_cache_push(regex_cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = regex_cache_head;
+	if (regex_cache_head) regex_cache_head->prev = entry;
+	regex_cache_head = entry;
+	if (!regex_cache_tail) regex_cache_tail = entry;
+}
+
+/** Remove the least recently used entries, until there's space for another
+ *
+ * Entries which are still referenced are freed when their last
+ * reference is released.
+ *
+ * @note Must be called with regex_cache_mutex held.
+ */
+static void regex_cache_evict(void)
+{
+	while (regex_cache_tail && (regex_cache_num >= REGEX_COMPILE_CACHE_SIZE)) {
+		regex_cache_entry_t *entry = regex_cache_tail;
+
+		regex_cache_unlink(entry);
+		rbtree_deletebydata(regex_cache_tree, entry);
+		regex_cache_num--;
+
+		entry->evicted = true;
+		if (entry->refs == 0) talloc_free(entry);
+	}
+}
+
+/** Compile a pattern, or return the compiled version from the cache
+ *
+ * Unlike #regex_compile, expressions are always studied and run
+ * through the JIT (if it's available), as they're expected to be
+ * used many times.
+ *
+ * @note The expression must be released with #regex_cache_release,
+ *	and not freed.
+ *
+ * @param[out] out		Where to write out a pointer to the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] ignore_case	Whether to do case insensitive matching.
+ * @param[in] multiline		If true $ matches newlines.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     bool ignore_case, bool multiline, bool subcaptures)
+{
+	regex_cache_entry_t	find, *entry, *found;
+	regex_t			*preg;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	memset(&find, 0, sizeof(find));
+	memcpy(&find.pattern, &pattern, sizeof(find.pattern));
+	find.len = len;
+	find.cflags = (ignore_case << 0) | (multiline << 1) | (subcaptures << 2);
+
+	pthread_mutex_lock(&regex_cache_mutex);
+	if (!regex_cache_tree) {
+		regex_cache_tree = rbtree_create(NULL, regex_cache_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!regex_cache_tree) {
+			pthread_mutex_unlock(&regex_cache_mutex);
+			fr_strerror_printf("Failed creating regex cache");
+			return 0;
+		}
+	}
+
+	entry = rbtree_finddata(regex_cache_tree, &find);
+	if (entry) {
+	found:
+		regex_cache_unlink(entry);
+		regex_cache_push(entry);
+		entry->refs++;
+		pthread_mutex_unlock(&regex_cache_mutex);
+
+		*out = entry->preg;
+		return len;
+	}
+	pthread_mutex_unlock(&regex_cache_mutex);
+
+	/*
+	 *	Compile without the lock held, it's the expensive bit.
+	 */
+	entry = talloc_zero(NULL, regex_cache_entry_t);
+	if (!entry) {
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
+
+	slen = regex_compile(entry, &preg, pattern, len, ignore_case, multiline, subcaptures, false);
+	if (slen <= 0) {
+		talloc_free(entry);
+		return slen;
+	}
+
+	entry->pattern = talloc_memdup(entry, pattern, len);
+	if (!entry->pattern) {
+		talloc_free(entry);
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
+	entry->preg = preg;
+	entry->len = len;
+	entry->cflags = find.cflags;
+	entry->refs = 1;
+	preg->cached = entry;
+
+	pthread_mutex_lock(&regex_cache_mutex);
+
+	/*
+	 *	Another thread compiled the same pattern while
+	 *	we were, use theirs.
+	 */
+	found = rbtree_finddata(regex_cache_tree, entry);
+	if (found) {
+		talloc_free(entry);
+		entry = found;
+		goto found;
+	}
+
+	regex_cache_evict();
+
+	if (!rbtree_insert(regex_cache_tree, entry)) {
+		pthread_mutex_unlock(&regex_cache_mutex);
+
+		/*
+		 *	Not cached, but still usable.  It's freed
+		 *	when the reference is released.
+		 */
+		entry->evicted = true;
+		*out = preg;
+		return len;
+	}
+	regex_cache_push(entry);
+	regex_cache_num++;
+	pthread_mutex_unlock(&regex_cache_mutex);
+
+	*out = preg;
+
+	return len;
+}
+
+/** Add a reference to an expression returned by #regex_compile_cached
+ *
+ * @param[in] preg to reference.
+ */
+void regex_cache_reference(regex_t *preg)
+{
+	if (!fr_cond_assert(preg->cached)) return;
+
+	pthread_mutex_lock(&regex_cache_mutex);
+	preg->cached->refs++;
+	pthread_mutex_unlock(&regex_cache_mutex);
+}
+
+/** Release a reference to an expression returned by #regex_compile_cached
+ *
+ * @param[in] preg to release.  May be NULL.
+ */
+void regex_cache_release(regex_t *preg)
+{
+	regex_cache_entry_t *entry;
+
+	if (!preg) return;
+	if (!fr_cond_assert(preg->cached)) return;
+
+	entry = preg->cached;
+
+	pthread_mutex_lock(&regex_cache_mutex);
+	if (!fr_cond_assert(entry->refs > 0)) {
+		pthread_mutex_unlock(&regex_cache_mutex);
+		return;
+	}
+	entry->refs--;
+	if ((entry->refs == 0) && entry->evicted) talloc_free(entry);
+	pthread_mutex_unlock(&regex_cache_mutex);
+}
+
 static const FR_NAME_NUMBER regex_pcre_error_str[] = {
 	{ "PCRE_ERROR_NOMATCH",		PCRE_ERROR_NOMATCH },
 	{ "PCRE_ERROR_NULL",		PCRE_ERROR_NULL },
@@ -460,5 +707,28 @@ int regex_exec(regex_t *preg, char const *subject, size_t len, regmatch_t pmatch
 
 	return 1;
 }
+
+/** Compile a pattern which is only known at runtime
+ *
+ * The system regex library gives us nowhere to keep a reference
+ * count, so expressions are not cached, and this is the same as
+ * calling #regex_compile.
+ *
+ * @note The expression must be released with #regex_cache_release.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     bool ignore_case, bool multiline, bool subcaptures)
+{
+	return regex_compile(NULL, out, pattern, len, ignore_case, multiline, subcaptures, true);
+}
+
+/** Release an expression returned by #regex_compile_cached
+ *
+ * @param[in] preg to release.  May be NULL.
+ */
+void regex_cache_release(regex_t *preg)
+{
+	talloc_free(preg);
+}
 #  endif
 #endif
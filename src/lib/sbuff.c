@@ -0,0 +1,402 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/sbuff.c
+ * @brief Print strings, values and attributes into a growing buffer.
+ *
+ * The asprint functions allocate a new string for every value they print,
+ * which the caller usually frees as soon as it's been written somewhere.
+ * These functions instead append to a buffer which is reused, and only
+ * grows when something doesn't fit.
+ *
+ * Values are printed the same way as #value_box_asprint, and attributes
+ * the same way as #fr_pair_snprint, except that nothing is truncated.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define SBUFF_SIZE_INIT		(1024)
+
+fr_thread_local_setup(fr_sbuff_t *, fr_sbuff_local)	/* macro */
+
+static void _fr_sbuff_local_free(void *arg)
+{
+	fr_sbuff_t *sb = talloc_get_type_abort(arg, fr_sbuff_t);
+	talloc_free(sb);
+}
+
+/** Allocate a new buffer
+ *
+ * @param[in] ctx	to allocate the buffer in.
+ * @param[in] size	to allocate initially, 0 for the default.
+ * @return
+ *	- A new, empty, buffer.
+ *	- NULL on error.
+ */
+fr_sbuff_t *fr_sbuff_alloc(TALLOC_CTX *ctx, size_t size)
+{
+	fr_sbuff_t *sb;
+
+	if (!size) size = SBUFF_SIZE_INIT;
+
+	sb = talloc_zero(ctx, fr_sbuff_t);
+	if (!sb) return NULL;
+
+	sb->buff = talloc_array(sb, char, size);
+	if (!sb->buff) {
+		talloc_free(sb);
+		return NULL;
+	}
+	sb->buff[0] = '\0';
+	sb->size = size;
+
+	return sb;
+}
+
+/** Get this thread's buffer, emptied
+ *
+ * The contents must be used before calling anything else which might use
+ * the buffer, and only grows the buffer, it's never shrunk.
+ *
+ * @return
+ *	- The buffer.
+ *	- NULL on error.
+ */
+fr_sbuff_t *fr_sbuff_thread_local(void)
+{
+	fr_sbuff_t *sb;
+
+	sb = fr_sbuff_local;
+	if (!sb) {
+		sb = fr_sbuff_alloc(NULL, 0);
+		if (!sb) return NULL;
+
+		fr_thread_local_set_destructor(fr_sbuff_local, _fr_sbuff_local_free, sb);
+	}
+
+	fr_sbuff_reset(sb);
+
+	return sb;
+}
+
+/** Empty a buffer, without freeing any memory
+ *
+ */
+void fr_sbuff_reset(fr_sbuff_t *sb)
+{
+	sb->used = 0;
+	sb->buff[0] = '\0';
+}
+
+/** Ensure there's room for len more bytes, and a trailing '\0'
+ *
+ * @param[in] sb	to grow.
+ * @param[in] len	bytes we're about to print.
+ * @return
+ *	- 0 on success.
+ *	- -1 if we ran out of memory.
+ */
+int fr_sbuff_reserve(fr_sbuff_t *sb, size_t len)
+{
+	size_t	needed = sb->used + len + 1;
+	char	*p;
+
+	if (needed <= sb->size) return 0;
+
+	if (needed < (sb->size * 2)) needed = sb->size * 2;
+
+	p = talloc_realloc(sb, sb->buff, char, needed);
+	if (!p) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	sb->buff = p;
+	sb->size = needed;
+
+	return 0;
+}
+
+/** Append a string of a given length
+ *
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 if we ran out of memory.
+ */
+ssize_t fr_sbuff_in_bstrncpy(fr_sbuff_t *sb, char const *in, size_t inlen)
+{
+	if (fr_sbuff_reserve(sb, inlen) < 0) return -1;
+
+	memcpy(sb->buff + sb->used, in, inlen);
+	sb->used += inlen;
+	sb->buff[sb->used] = '\0';
+
+	return inlen;
+}
+
+/** Append a '\0' terminated string
+ *
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 if we ran out of memory.
+ */
+ssize_t fr_sbuff_in_strcpy(fr_sbuff_t *sb, char const *in)
+{
+	return fr_sbuff_in_bstrncpy(sb, in, strlen(in));
+}
+
+/** Append a single character
+ *
+ * @return
+ *	- 1.
+ *	- -1 if we ran out of memory.
+ */
+ssize_t fr_sbuff_in_char(fr_sbuff_t *sb, char c)
+{
+	if (fr_sbuff_reserve(sb, 1) < 0) return -1;
+
+	sb->buff[sb->used++] = c;
+	sb->buff[sb->used] = '\0';
+
+	return 1;
+}
+
+/** Append a printf style formatted string
+ *
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 if we ran out of memory.
+ */
+ssize_t fr_sbuff_in_sprintf(fr_sbuff_t *sb, char const *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(sb->buff + sb->used, sb->size - sb->used, fmt, ap);
+	va_end(ap);
+	if (len < 0) return -1;
+
+	/*
+	 *	Didn't fit, grow the buffer and try again.
+	 */
+	if ((size_t) len >= (sb->size - sb->used)) {
+		if (fr_sbuff_reserve(sb, len) < 0) {
+			sb->buff[sb->used] = '\0';
+			return -1;
+		}
+
+		va_start(ap, fmt);
+		len = vsnprintf(sb->buff + sb->used, sb->size - sb->used, fmt, ap);
+		va_end(ap);
+		if (len < 0) return -1;
+	}
+
+	sb->used += len;
+
+	return len;
+}
+
+/** Append a string, escaped as #fr_snprint would
+ *
+ * @param[in] sb	to append to.
+ * @param[in] in	String to escape.
+ * @param[in] inlen	Length of the string.
+ * @param[in] quote	the quotation character.  Not added around the string.
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 if we ran out of memory.
+ */
+ssize_t fr_sbuff_in_escape(fr_sbuff_t *sb, char const *in, size_t inlen, char quote)
+{
+	size_t len;
+
+	if (!quote) return fr_sbuff_in_bstrncpy(sb, in, inlen);
+
+	len = fr_snprint_len(in, inlen, quote);
+	if (fr_sbuff_reserve(sb, len) < 0) return -1;
+
+	len = fr_snprint(sb->buff + sb->used, sb->size - sb->used, in, inlen, quote);
+	sb->used += len;
+
+	return len;
+}
+
+/** Append a value, printed as #value_box_asprint would
+ *
+ * @param[in] sb	to append to.
+ * @param[in] data	to print.
+ * @param[in] quote	the quotation character.  Strings are escaped for it,
+ *			but it isn't added around them.
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 on error.
+ */
+ssize_t fr_sbuff_in_value_box(fr_sbuff_t *sb, value_box_t const *data, char quote)
+{
+	char		buff[1024];
+	size_t		len;
+
+	if (!fr_cond_assert(data->type != PW_TYPE_INVALID)) return -1;
+
+	switch (data->type) {
+	case PW_TYPE_STRING:
+		return fr_sbuff_in_escape(sb, data->datum.strvalue, data->length, quote);
+
+#ifndef WITH_ASCEND_BINARY
+	case PW_TYPE_ABINARY:
+#endif
+	case PW_TYPE_OCTETS:
+		len = 2 + (data->length * 2);
+		if (fr_sbuff_reserve(sb, len) < 0) return -1;
+
+		sb->buff[sb->used] = '0';
+		sb->buff[sb->used + 1] = 'x';
+		fr_bin2hex(sb->buff + sb->used + 2, data->datum.octets, data->length);
+		sb->used += len;
+
+		return len;
+
+	case PW_TYPE_DATE:
+	{
+		time_t		t = data->datum.date;
+		struct tm	s_tm;
+
+		len = strftime(buff, sizeof(buff), "%b %e %Y %H:%M:%S %Z", localtime_r(&t, &s_tm));
+		return fr_sbuff_in_bstrncpy(sb, buff, len);
+	}
+
+	case PW_TYPE_BOOLEAN:
+		return fr_sbuff_in_strcpy(sb, data->datum.byte ? "yes" : "no");
+
+#ifdef WITH_ASCEND_BINARY
+	case PW_TYPE_ABINARY:
+		/*
+		 *	Matches the buffer size value_box_asprint uses.
+		 */
+		print_abinary(buff, 128, (uint8_t const *) &data->datum.filter, data->length, 0);
+		return fr_sbuff_in_strcpy(sb, buff);
+#endif
+
+	case PW_TYPE_COMBO_IP_ADDR:
+	case PW_TYPE_COMBO_IP_PREFIX:
+	case PW_TYPE_STRUCTURAL:
+	case PW_TYPE_BAD:
+		(void)fr_cond_assert(0);
+		return -1;
+
+	/*
+	 *	Everything else prints to a short string, with
+	 *	names for enumerated values.
+	 */
+	default:
+		break;
+	}
+
+	len = value_box_snprint(buff, sizeof(buff), data, '\0');
+	if (is_truncated(len, sizeof(buff))) len = sizeof(buff) - 1;
+
+	return fr_sbuff_in_bstrncpy(sb, buff, len);
+}
+
+/** Append the value of an attribute, printed as #fr_pair_value_asprint would
+ *
+ * @param[in] sb	to append to.
+ * @param[in] vp	to print.  May be on the stack.
+ * @param[in] quote	the quotation character.
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 on error.
+ */
+ssize_t fr_sbuff_in_pair_value(fr_sbuff_t *sb, VALUE_PAIR const *vp, char quote)
+{
+	if (vp->type == VT_XLAT) return fr_sbuff_in_escape(sb, vp->xlat, strlen(vp->xlat), quote);
+
+	return fr_sbuff_in_value_box(sb, &vp->data, quote);
+}
+
+/** Append an attribute and its value, printed as #fr_pair_snprint would
+ *
+ * Print a VALUE_PAIR in the format:
+@verbatim
+	<attribute_name>[:tag] <op> <value>
+@endverbatim
+ *
+ * @param[in] sb	to append to.
+ * @param[in] vp	to print.  May be on the stack.
+ * @return
+ *	- The number of bytes appended.
+ *	- -1 on error.
+ */
+ssize_t fr_sbuff_in_pair(fr_sbuff_t *sb, VALUE_PAIR const *vp)
+{
+	char const	*token;
+	size_t		start = sb->used;
+	ssize_t		slen;
+
+	if (!vp || !vp->da) return 0;
+
+	if ((vp->op > T_INVALID) && (vp->op < T_TOKEN_LAST)) {
+		token = fr_tokens[vp->op];
+	} else {
+		token = "<INVALID-TOKEN>";
+	}
+
+	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
+		slen = fr_sbuff_in_sprintf(sb, "%s:%d %s ", vp->da->name, vp->tag, token);
+	} else {
+		slen = fr_sbuff_in_sprintf(sb, "%s %s ", vp->da->name, token);
+	}
+	if (slen < 0) goto error;
+
+	if (vp->type == VT_XLAT) {
+		slen = fr_sbuff_in_sprintf(sb, "\"%s\"", vp->xlat);
+
+	} else switch (vp->vp_type) {
+	/*
+	 *	Strings and dates are quoted, everything else isn't.
+	 */
+	case PW_TYPE_STRING:
+		if ((fr_sbuff_in_char(sb, '"') < 0) ||
+		    (fr_sbuff_in_escape(sb, vp->vp_strvalue, vp->vp_length, '"') < 0)) goto error;
+		slen = fr_sbuff_in_char(sb, '"');
+		break;
+
+	case PW_TYPE_DATE:
+		if (fr_sbuff_in_char(sb, '"') < 0) goto error;
+		if (fr_sbuff_in_value_box(sb, &vp->data, '"') < 0) goto error;
+		slen = fr_sbuff_in_char(sb, '"');
+		break;
+
+	default:
+		slen = fr_sbuff_in_value_box(sb, &vp->data, '"');
+		break;
+	}
+	if (slen < 0) goto error;
+
+	return sb->used - start;
+
+error:
+	sb->used = start;
+	sb->buff[start] = '\0';
+	return -1;
+}
@@ -102,8 +102,7 @@ int fr_tcp_read_packet(RADIUS_PACKET *packet, bool require_ma)
 			return -1;
 		}
 
-		packet->data = talloc_array(packet, uint8_t, packet_len);
-		if (!packet->data) {
+		if (!fr_radius_data_alloc(packet, packet_len)) {
 			fr_strerror_printf("Out of memory");
 			return -1;
 		}
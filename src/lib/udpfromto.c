@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/udpfromto.h>
+#include <freeradius-devel/rad_assert.h>
 
 #ifdef WITH_UDPFROMTO
 
@@ -90,6 +91,11 @@ RCSID("$Id$")
 #  endif
 #endif
 
+#ifdef IPV6_PKTINFO
+static_assert((CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(struct timeval))) <= UDPFROMTO_CMSG_SIZE,
+	      "UDPFROMTO_CMSG_SIZE is too small for the control messages");
+#endif
+
 int udpfromto_init(int s)
 {
 	int proto, flag = 0, opt = 1;
@@ -157,6 +163,84 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Get the destination address of a packet from the control messages of recvmsg()
+ *
+ * This is the common part of recvfromto(), and is also used by callers
+ * which read packets via recvmmsg().
+ *
+ * @param[in] msgh	The message header filled in by recvmsg() or recvmmsg().
+ * @param[in,out] to	The destination address.  It should be initialised to the
+ *			address the socket is bound to, and will be updated with
+ *			the address from the control messages.
+ * @param[out] to_len	Length of the destination address.
+ * @param[out] if_index	The interface which received the datagram (may be NULL).
+ * @param[out] when	the packet was received (may be NULL).
+ */
+void udpfromto_cmsg_to(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+		       int *if_index, struct timeval *when)
+{
+	struct cmsghdr		*cmsg;
+
+	if (if_index) *if_index = 0;
+	if (when) {
+		when->tv_sec = 0;
+		when->tv_usec = 0;
+	}
+
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*to_len = sizeof(struct sockaddr_in);
+
+			if (if_index) *if_index = i->ipi_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = *i;
+
+			*to_len = sizeof(struct sockaddr_in);
+
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*to_len = sizeof(struct sockaddr_in6);
+
+			if (if_index) *if_index = i->ipi6_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
+		}
+#endif
+	}
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -190,7 +274,6 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	       int *if_index, struct timeval *when)
 {
 	struct msghdr		msgh;
-	struct cmsghdr		*cmsg;
 	struct iovec		iov;
 	char			cbuf[256];
 	int			ret;
@@ -293,68 +376,148 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 
 	if (from_len) *from_len = msgh.msg_namelen;
 
-	if (if_index) *if_index = 0;
-	if (when) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-	}
+	udpfromto_cmsg_to(&msgh, to, to_len, if_index, when);
 
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+	if (when && !when->tv_sec) gettimeofday(when, NULL);
 
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+	return ret;
+}
 
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*to_len = sizeof(struct sockaddr_in);
+/** Set the source address and outbound interface in the control messages for sendmsg()
+ *
+ * This is the common part of sendfromto(), and is also used by callers
+ * which send packets via sendmmsg().
+ *
+ * @param[in,out] msgh	The message header to update.
+ * @param[in] cbuf	Buffer for the control messages.
+ * @param[in] cbuf_len	Length of the buffer.  Should be at least #UDPFROMTO_CMSG_SIZE bytes.
+ * @param[in] from	The source address.
+ * @param[in] if_index	The interface on which to send the datagram.
+ *			If automatic interface selection is desired, value should be 0.
+ */
+void udpfromto_cmsg_from(struct msghdr *msgh, char *cbuf, size_t cbuf_len,
+			 struct sockaddr const *from, int if_index)
+{
+	memset(cbuf, 0, cbuf_len);
 
-			if (if_index) *if_index = i->ipi_ifindex;
+# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
+	if (from->sa_family == AF_INET) {
+		struct sockaddr_in const *s4 = (struct sockaddr_in const *) from;
 
-			break;
-		}
-#endif
+#  ifdef IP_PKTINFO
+		struct cmsghdr *cmsg;
+		struct in_pktinfo *pkt;
 
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-			((struct sockaddr_in *)to)->sin_addr = *i;
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
 
-			*to_len = sizeof(struct sockaddr_in);
+		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi_spec_dst = s4->sin_addr;
+		pkt->ipi_ifindex = if_index;
+#  endif
 
-			break;
-		}
+#  ifdef IP_SENDSRCADDR
+		struct cmsghdr *cmsg;
+		struct in_addr *in;
+
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_SENDSRCADDR;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
+
+		in = (struct in_addr *) CMSG_DATA(cmsg);
+		*in = s4->sin_addr;
+#  endif
+	}
 #endif
 
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+#  if defined(IPV6_PKTINFO)
+	if (from->sa_family == AF_INET6) {
+		struct sockaddr_in6 const *s6 = (struct sockaddr_in6 const *) from;
 
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*to_len = sizeof(struct sockaddr_in6);
+		struct cmsghdr *cmsg;
+		struct in6_pktinfo *pkt;
 
-			if (if_index) *if_index = i->ipi6_ifindex;
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-			break;
-		}
-#endif
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
 
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
-		}
-#endif
+		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi6_addr = s6->sin6_addr;
+		pkt->ipi6_ifindex = if_index;
 	}
+#  endif	/* IPV6_PKTINFO */
+}
 
-	if (when && !when->tv_sec) gettimeofday(when, NULL);
+/** Check whether a source address can be set on a socket
+ *
+ * FreeBSD is extra pedantic about the use of IP_SENDSRCADDR, and
+ * sendmsg will fail with EINVAL if IP_SENDSRCADDR is used with a
+ * socket which is bound to something other than INADDR_ANY.
+ *
+ * @param[in] fd	The file descriptor to check.
+ * @return
+ *	- 1 if the source address can be set.
+ *	- 0 if it can't.
+ *	- -1 on failure.
+ */
+static int udpfromto_can_send_from(UNUSED int fd)
+{
+#ifdef __FreeBSD__
+	struct sockaddr_storage bound;
+	socklen_t bound_len = sizeof(bound);
 
-	return ret;
+	if (getsockname(fd, (struct sockaddr *) &bound, &bound_len) < 0) {
+		return -1;
+	}
+
+	switch (bound.ss_family) {
+	case AF_INET:
+		if (((struct sockaddr_in *) &bound)->sin_addr.s_addr != INADDR_ANY) return 0;
+		break;
+
+	case AF_INET6:
+		if (!IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr)) return 0;
+		break;
+	}
+#endif	/* !__FreeBSD__ */
+
+	return 1;
+}
+
+/** Check whether the source address of an address family can be set with sendmsg()
+ *
+ */
+static inline bool udpfromto_family_ok(int af)
+{
+	switch (af) {
+#if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
+	case AF_INET:
+		return true;
+#endif
+
+#ifdef IPV6_PKTINFO
+	case AF_INET6:
+		return true;
+#endif
+
+	default:
+		return false;
+	}
 }
 
 /** Send packet via a file descriptor, setting the src address and outbound interface
@@ -391,34 +554,17 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		return -1;
 	}
 
-#ifdef __FreeBSD__
-	/*
-	 *	FreeBSD is extra pedantic about the use of IP_SENDSRCADDR,
-	 *	and sendmsg will fail with EINVAL if IP_SENDSRCADDR is used
-	 *	with a socket which is bound to something other than
-	 *	INADDR_ANY
-	 */
-	struct sockaddr bound;
-	socklen_t bound_len = sizeof(bound);
-
-	if (getsockname(fd, &bound, &bound_len) < 0) {
+	switch (udpfromto_can_send_from(fd)) {
+	case -1:
 		return -1;
-	}
 
-	switch (bound.sa_family) {
-	case AF_INET:
-		if (((struct sockaddr_in *) &bound)->sin_addr.s_addr != INADDR_ANY) {
-			from = NULL;
-		}
+	case 0:
+		from = NULL;
 		break;
 
-	case AF_INET6:
-		if (!IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr)) {
-			from = NULL;
-		}
+	default:
 		break;
 	}
-#endif	/* !__FreeBSD__ */
 
 	/*
 	 *	If the sendmsg() flags aren't defined, fall back to
@@ -426,13 +572,7 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	 *	but laying it out this way simplifies the look of the
 	 *	code.
 	 */
-#  if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR)
-	if (from && from->sa_family == AF_INET) from = NULL;
-#  endif
-
-#  if !defined(IPV6_PKTINFO)
-	if (from && from->sa_family == AF_INET6) from = NULL;
-#  endif
+	if (from && !udpfromto_family_ok(from->sa_family)) from = NULL;
 
 	/*
 	 *	No "from", just use regular sendto.
@@ -440,7 +580,6 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	if (!from || (from_len == 0)) return sendto(fd, buf, len, flags, to, to_len);
 
 	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
 	memset(&msgh, 0, sizeof(msgh));
 	memset(&iov, 0, sizeof(iov));
 	iov.iov_base = buf;
@@ -451,70 +590,156 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	msgh.msg_name = to;
 	msgh.msg_namelen = to_len;
 
-# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
-	if (from->sa_family == AF_INET) {
-		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
+	udpfromto_cmsg_from(&msgh, cbuf, sizeof(cbuf), from, if_index);
 
-#  ifdef IP_PKTINFO
-		struct cmsghdr *cmsg;
-		struct in_pktinfo *pkt;
+	return sendmsg(fd, &msgh, flags);
+}
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+#ifdef HAVE_RECVMMSG
+/** Read a batch of packets from a file descriptor, retrieving additional header information
+ *
+ * The batched version of #recvfromto.  Each message gets its own control
+ * buffer, so the destination address and interface of every datagram are
+ * retrieved, even on sockets bound to a wildcard address.
+ *
+ * The caller sets up msg_iov and msg_iovlen of each message.  The name and
+ * control fields are set here, to point to the matching entry of addr.
+ *
+ * @param[in] fd	The file descriptor to read from.
+ * @param[in,out] msgs	The messages to read into.
+ * @param[out] addr	Where to write the addressing information of each message.
+ * @param[in] num	Number of entries in msgs and addr.
+ * @param[in] flags	passed unmolested to recvmmsg.
+ * @param[in] local	The address the socket is bound to.  If NULL,
+ *			getsockname() is called to find it.  Callers reading
+ *			in a loop should find it once, and pass it in.
+ * @param[in] local_len	Length of the structure pointed to by local.
+ * @return
+ *	- The number of messages read.
+ *	- -1 on failure.
+ */
+int recvmmsgfromto(int fd, struct mmsghdr *msgs, udpfromto_mmsg_t *addr, unsigned int num, int flags,
+		   struct sockaddr const *local, socklen_t local_len)
+{
+	struct sockaddr_storage	si;
+	socklen_t		si_len = sizeof(si);
+	struct timeval		now = { 0, 0 };
+	unsigned int		i;
+	int			ret;
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = SOL_IP;
-		cmsg->cmsg_type = IP_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+	if (!local) {
+		/*
+		 *	Clang analyzer doesn't see that getsockname initialises
+		 *	the memory passed to it.
+		 */
+#ifdef __clang_analyzer__
+		memset(&si, 0, sizeof(si));
+#endif
+		if (getsockname(fd, (struct sockaddr *) &si, &si_len) < 0) return -1;
 
-		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi_spec_dst = s4->sin_addr;
-		pkt->ipi_ifindex = if_index;
-#  endif
+		local = (struct sockaddr const *) &si;
+		local_len = si_len;
+	}
 
-#  ifdef IP_SENDSRCADDR
-		struct cmsghdr *cmsg;
-		struct in_addr *in;
+	if (((local->sa_family != AF_INET) && (local->sa_family != AF_INET6)) ||
+	    (local_len > sizeof(addr[0].to))) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+	for (i = 0; i < num; i++) {
+		msgs[i].msg_hdr.msg_name = &addr[i].from;
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr[i].from);
+		msgs[i].msg_hdr.msg_control = addr[i].cbuf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(addr[i].cbuf);
+		msgs[i].msg_hdr.msg_flags = 0;
+		msgs[i].msg_len = 0;
+	}
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IP;
-		cmsg->cmsg_type = IP_SENDSRCADDR;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
+	ret = recvmmsg(fd, msgs, num, flags, NULL);
+	if (ret <= 0) return ret;
 
-		in = (struct in_addr *) CMSG_DATA(cmsg);
-		*in = s4->sin_addr;
-#  endif
+	for (i = 0; i < (unsigned int) ret; i++) {
+		addr[i].from_len = msgs[i].msg_hdr.msg_namelen;
+
+		/*
+		 *	Start with the address the socket is bound to,
+		 *	which may be INADDR_ANY.  The control messages
+		 *	give the more specific address.
+		 */
+		memcpy(&addr[i].to, local, local_len);
+		addr[i].to_len = local_len;
+
+		udpfromto_cmsg_to(&msgs[i].msg_hdr, (struct sockaddr *) &addr[i].to, &addr[i].to_len,
+				  &addr[i].if_index, &addr[i].when);
+
+		if (!addr[i].when.tv_sec) {
+			if (!now.tv_sec) gettimeofday(&now, NULL);
+			addr[i].when = now;
+		}
 	}
-#endif
 
-#  if defined(IPV6_PKTINFO)
-	if (from->sa_family == AF_INET6) {
-		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
+	return ret;
+}
+#endif	/* HAVE_RECVMMSG */
 
-		struct cmsghdr *cmsg;
-		struct in6_pktinfo *pkt;
+#ifdef HAVE_SENDMMSG
+/** Send a batch of packets via a file descriptor, setting the src address and outbound interface
+ *
+ * The batched version of #sendfromto.  Each message gets its own control
+ * buffer, so every reply can be sent from the address the request was
+ * received on.
+ *
+ * The caller sets up msg_iov and msg_iovlen of each message, and the
+ * from, to and if_index fields of each entry of addr.  Entries with
+ * from_len set to 0 are sent from whichever address the kernel picks.
+ *
+ * sendmmsg() may send only part of the batch.  This function keeps
+ * going until the whole batch is sent, or sendmmsg() fails.
+ *
+ * @param[in] fd	The file descriptor to write to.
+ * @param[in,out] msgs	The messages to send.
+ * @param[in] addr	The addressing information of each message.
+ * @param[in] num	Number of entries in msgs and addr.
+ * @param[in] flags	passed unmolested to sendmmsg.
+ * @return
+ *	- The number of messages sent.
+ *	- -1 if none could be sent.
+ */
+int sendmmsgfromto(int fd, struct mmsghdr *msgs, udpfromto_mmsg_t *addr, unsigned int num, int flags)
+{
+	unsigned int	i, sent = 0;
+	int		ret, can_send_from;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+	can_send_from = udpfromto_can_send_from(fd);
+	if (can_send_from < 0) return -1;
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IPV6;
-		cmsg->cmsg_type = IPV6_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+	for (i = 0; i < num; i++) {
+		msgs[i].msg_hdr.msg_name = &addr[i].to;
+		msgs[i].msg_hdr.msg_namelen = addr[i].to_len;
+		msgs[i].msg_hdr.msg_control = NULL;
+		msgs[i].msg_hdr.msg_controllen = 0;
+		msgs[i].msg_hdr.msg_flags = 0;
 
-		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi6_addr = s6->sin6_addr;
-		pkt->ipi6_ifindex = if_index;
+		if (!can_send_from || !addr[i].from_len ||
+		    !udpfromto_family_ok(addr[i].from.ss_family)) continue;
+
+		udpfromto_cmsg_from(&msgs[i].msg_hdr, addr[i].cbuf, sizeof(addr[i].cbuf),
+				    (struct sockaddr const *) &addr[i].from, addr[i].if_index);
 	}
-#  endif	/* IPV6_PKTINFO */
 
-	return sendmsg(fd, &msgh, flags);
+	while (sent < num) {
+		ret = sendmmsg(fd, &msgs[sent], num - sent, flags);
+		if (ret <= 0) break;
+
+		sent += ret;
+	}
+
+	if (!sent && num) return -1;
+
+	return sent;
 }
+#endif	/* HAVE_SENDMMSG */
 
 
 #ifdef TESTING
@@ -733,6 +733,286 @@ void value_box_clear(value_box_t *data)
 	data->length = 0;
 }
 
+/*
+ *	Fast parsers for the most common string representations of
+ *	fixed size values.  They don't allocate, or copy the input,
+ *	and they're strict.  Anything they don't recognise exactly is
+ *	left to the generic parsers in value_box_from_str(), which
+ *	produce the errors, so the results are always the same.
+ */
+
+/** Parse an unsigned decimal integer, with no sign, prefix or whitespace
+ *
+ * @return
+ *	- true if the whole string was a decimal integer which fits in 64 bits.
+ *	- false if the generic parser should be used.
+ */
+static inline bool value_uint64_from_str(uint64_t *out, char const *in, size_t len)
+{
+	uint64_t	num = 0;
+	size_t		i;
+	unsigned int	digit;
+
+	if (!len || (len > 20)) return false;
+
+	/*
+	 *	19 digits can't overflow, so only the last digit of
+	 *	a 20 digit number needs checking.
+	 */
+	for (i = 0; i < (len < 20 ? len : 19); i++) {
+		digit = (uint8_t) in[i] - '0';
+		if (digit > 9) return false;
+		num = (num * 10) + digit;
+	}
+
+	if (len == 20) {
+		digit = (uint8_t) in[19] - '0';
+		if ((digit > 9) || (num > ((UINT64_MAX - digit) / 10))) return false;
+		num = (num * 10) + digit;
+	}
+
+	*out = num;
+	return true;
+}
+
+/** Parse a decimal number of at most max_digits, without leading zeros, at the start of a string
+ *
+ * @return
+ *	- The number of digits parsed.
+ *	- 0 if there weren't any, or there was a leading zero.
+ */
+static inline size_t value_small_uint_from_str(unsigned int *out, char const *in, char const *end, size_t max_digits)
+{
+	unsigned int	num = 0, digit;
+	size_t		i;
+
+	for (i = 0; (i < max_digits) && ((in + i) < end); i++) {
+		digit = (uint8_t) in[i] - '0';
+		if (digit > 9) break;
+		num = (num * 10) + digit;
+	}
+
+	/*
+	 *	inet_aton treats leading zeros as octal, and
+	 *	inet_pton rejects them.  Let the generic parsers
+	 *	decide.
+	 */
+	if ((i > 1) && (in[0] == '0')) return 0;
+	if (((in + i) < end) && ((uint8_t) (in[i] - '0') <= 9)) return 0;
+
+	*out = num;
+	return i;
+}
+
+/** Parse an optional "/<prefix>" at the end of an address
+ *
+ * @return
+ *	- true if there's no prefix, or a valid one which ends the string.
+ *	- false if the generic parser should be used.
+ */
+static inline bool value_prefix_from_str(uint8_t *prefix, char const *p, char const *end, unsigned int max)
+{
+	unsigned int	num;
+	size_t		digits;
+
+	if (p == end) {
+		*prefix = max;
+		return true;
+	}
+
+	if (*p++ != '/') return false;
+
+	digits = value_small_uint_from_str(&num, p, end, 3);
+	if (!digits || ((p + digits) != end) || (num > max)) return false;
+
+	*prefix = num;
+	return true;
+}
+
+/** Parse a dotted quad IPv4 address, with an optional prefix
+ *
+ */
+static inline bool value_ipv4_from_str(fr_ipaddr_t *out, char const *in, size_t len)
+{
+	char const	*p = in, *end = in + len;
+	uint32_t	addr = 0;
+	unsigned int	octet;
+	size_t		digits;
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		if (i > 0) {
+			if ((p >= end) || (*p != '.')) return false;
+			p++;
+		}
+
+		digits = value_small_uint_from_str(&octet, p, end, 3);
+		if (!digits || (octet > 255)) return false;
+
+		addr = (addr << 8) | octet;
+		p += digits;
+	}
+
+	if (!value_prefix_from_str(&out->prefix, p, end, 32)) return false;
+
+	out->af = AF_INET;
+	out->ipaddr.ip4addr.s_addr = htonl(addr);
+	if (out->prefix < 32) fr_ipaddr_mask(out, out->prefix);
+
+	return true;
+}
+
+/** Parse a numeric IPv6 address, with an optional prefix
+ *
+ */
+static inline bool value_ipv6_from_str(fr_ipaddr_t *out, char const *in, size_t len)
+{
+	char		buffer[INET6_ADDRSTRLEN];
+	char const	*p, *end = in + len;
+
+	p = memchr(in, '/', len);
+	if (!p) p = end;
+
+	if (((size_t) (p - in) >= sizeof(buffer)) || (p == in)) return false;
+
+	memcpy(buffer, in, p - in);
+	buffer[p - in] = '\0';
+
+	if (inet_pton(AF_INET6, buffer, out->ipaddr.ip6addr.s6_addr) <= 0) return false;
+
+	if (!value_prefix_from_str(&out->prefix, p, end, 128)) return false;
+
+	out->af = AF_INET6;
+	if (out->prefix < 128) fr_ipaddr_mask(out, out->prefix);
+
+	return true;
+}
+
+/** Convert a hex digit to its value
+ *
+ * @return
+ *	- 0-15 for a valid hex digit.
+ *	- > 15 otherwise.
+ */
+static inline unsigned int value_hex_nibble(uint8_t c)
+{
+	unsigned int digit = (uint8_t) (c - '0');
+
+	if (digit <= 9) return digit;
+
+	digit = (uint8_t) ((c | 0x20) - 'a');
+	if (digit <= 5) return digit + 10;
+
+	return 16;
+}
+
+/** Parse a colon separated Ethernet address, e.g. 00:11:22:aa:bb:cc
+ *
+ */
+static inline bool value_ether_from_str(uint8_t out[6], char const *in, size_t len)
+{
+	uint8_t		ether[6];
+	unsigned int	hi, lo;
+	int		i;
+
+	if (len != 17) return false;
+
+	for (i = 0; i < 6; i++) {
+		char const *p = in + (i * 3);
+
+		if ((i < 5) && (p[2] != ':')) return false;
+
+		hi = value_hex_nibble(p[0]);
+		lo = value_hex_nibble(p[1]);
+		if ((hi | lo) > 15) return false;
+
+		ether[i] = (hi << 4) | lo;
+	}
+
+	memcpy(out, ether, sizeof(ether));
+
+	return true;
+}
+
+/** Try the fast parsers for fixed size types
+ *
+ * @param[out] dst	where to write the value.  Is only written to on success.
+ * @param[in] type	of value to parse.
+ * @param[in] in	String to parse.  Needn't be \0 terminated.
+ * @param[in] len	of the string.
+ * @return
+ *	- true if the string was parsed.
+ *	- false if the generic parser should be used.
+ */
+static bool value_box_from_str_fast(value_box_t *dst, PW_TYPE type, char const *in, size_t len)
+{
+	uint64_t	num;
+	fr_ipaddr_t	addr;
+
+	switch (type) {
+	case PW_TYPE_BYTE:
+		if (!value_uint64_from_str(&num, in, len) || (num > UINT8_MAX)) return false;
+		dst->datum.byte = num;
+		return true;
+
+	case PW_TYPE_SHORT:
+		if (!value_uint64_from_str(&num, in, len) || (num > UINT16_MAX)) return false;
+		dst->datum.ushort = num;
+		return true;
+
+	case PW_TYPE_INTEGER:
+		if (!value_uint64_from_str(&num, in, len) || (num > UINT32_MAX)) return false;
+		dst->datum.integer = num;
+		return true;
+
+	case PW_TYPE_INTEGER64:
+		if (!value_uint64_from_str(&num, in, len)) return false;
+		dst->datum.integer64 = num;
+		return true;
+
+	case PW_TYPE_SIZE:
+		if (!value_uint64_from_str(&num, in, len) || (num > SIZE_MAX)) return false;
+		dst->datum.size = num;
+		return true;
+
+	/*
+	 *	Unix timestamps, as written by SQL modules.
+	 */
+	case PW_TYPE_DATE:
+		if (!value_uint64_from_str(&num, in, len) || (num > UINT32_MAX)) return false;
+		dst->datum.date = num;
+		return true;
+
+	case PW_TYPE_IPV4_ADDR:
+		if (!value_ipv4_from_str(&addr, in, len) || (addr.prefix != 32)) return false;
+		dst->datum.ipaddr.s_addr = addr.ipaddr.ip4addr.s_addr;
+		return true;
+
+	case PW_TYPE_IPV4_PREFIX:
+		if (!value_ipv4_from_str(&addr, in, len)) return false;
+		dst->datum.ipv4prefix[1] = addr.prefix;
+		memcpy(&dst->datum.ipv4prefix[2], &addr.ipaddr.ip4addr.s_addr, sizeof(dst->datum.ipv4prefix) - 2);
+		return true;
+
+	case PW_TYPE_IPV6_ADDR:
+		if (!value_ipv6_from_str(&addr, in, len) || (addr.prefix != 128)) return false;
+		memcpy(&dst->datum.ipv6addr, addr.ipaddr.ip6addr.s6_addr, sizeof(dst->datum.ipv6addr));
+		return true;
+
+	case PW_TYPE_IPV6_PREFIX:
+		if (!value_ipv6_from_str(&addr, in, len)) return false;
+		dst->datum.ipv6prefix[1] = addr.prefix;
+		memcpy(&dst->datum.ipv6prefix[2], addr.ipaddr.ip6addr.s6_addr, sizeof(dst->datum.ipv6prefix) - 2);
+		return true;
+
+	case PW_TYPE_ETHERNET:
+		return value_ether_from_str(dst->datum.ether, in, len);
+
+	default:
+		return false;
+	}
+}
+
 /** Convert string value to a value_box_t type
  *
  * @todo Should take taint param.
@@ -771,6 +1051,13 @@ int value_box_from_str(TALLOC_CTX *ctx, value_box_t *dst,
 	 */
 	ret = dict_attr_sizes[*dst_type][1];	/* Max length */
 
+	/*
+	 *	Most values in configuration files, SQL rows and detail
+	 *	files are in their canonical form.  Parse those quickly,
+	 *	without copying them or looking up hostnames.
+	 */
+	if (value_box_from_str_fast(dst, *dst_type, in, len)) goto finish;
+
 	/*
 	 *	It's a variable ret src->dst_type so we just alloc a new buffer
 	 *	of size len and copy.
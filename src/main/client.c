@@ -40,13 +40,34 @@ RCSID("$Id$")
 #endif
 #endif
 
+/*
+ *	How many clients may share one address and prefix.  They must
+ *	differ by protocol, or by IPv6 zone.
+ */
+#define CLIENT_NODE_SLOTS	(4)
+
+/** One prefix in the client trie
+ *
+ *  The trie is path compressed.  Nodes only exist for prefixes which
+ *  have clients, and where two prefixes diverge.
+ *
+ *  Nodes are only ever added, and are fully initialised before they
+ *  are linked into the trie, so client_find() doesn't need a lock.
+ */
+typedef struct client_node_t client_node_t;
+struct client_node_t {
+	uint8_t		key[16];			//!< Address, masked to prefix.
+	uint8_t		prefix;				//!< Number of significant bits in key.
+	RADCLIENT	*client[CLIENT_NODE_SLOTS];	//!< Clients for exactly this prefix.
+	client_node_t	*child[2];			//!< By the value of the next bit.
+};
+
 /** Group of clients
  *
  */
 struct radclient_list {
 	char const	*name;			//!< Name of the client list.
-	rbtree_t	*trees[129];		//!< For 0..128, inclusive.
-	uint32_t       	min_prefix;
+	client_node_t	*trie[2];		//!< IPv4 and IPv6 prefixes.
 };
 
 #ifdef WITH_STATS
@@ -107,30 +128,193 @@ void client_free(RADCLIENT *client)
 	talloc_free(client);
 }
 
-/** Compare clients by IP address
+#define CLIENT_KEY_BIT(_key, _bit) (((_key)[(_bit) >> 3] >> (7 - ((_bit) & 0x07))) & 0x01)
+
+/** Check whether a client matches a protocol and zone
  *
+ *  Clients with a protocol of IPPROTO_IP match any protocol.
  */
-static int client_ipaddr_cmp(void const *one, void const *two)
+static inline bool client_node_cmp(RADCLIENT const *client, fr_ipaddr_t const *ipaddr, int proto)
 {
-	RADCLIENT const *a = one;
-	RADCLIENT const *b = two;
-#ifndef WITH_TCP
+	if ((ipaddr->af == AF_INET6) && (client->ipaddr.zone_id != ipaddr->zone_id)) return false;
 
-	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+#ifdef WITH_TCP
+	/*
+	 *	Wildcard match
+	 */
+	if ((client->proto == IPPROTO_IP) || (proto == IPPROTO_IP)) return true;
+
+	return (client->proto == proto);
 #else
-	int rcode;
+	return true;
+#endif
+}
+
+static RADCLIENT *client_node_find(client_node_t const *node, fr_ipaddr_t const *ipaddr, int proto)
+{
+	int i;
+
+	for (i = 0; i < CLIENT_NODE_SLOTS; i++) {
+		RADCLIENT *client;
+
+		client = __atomic_load_n(&node->client[i], __ATOMIC_ACQUIRE);
+		if (client && client_node_cmp(client, ipaddr, proto)) return client;
+	}
+
+	return NULL;
+}
+
+/** Check whether the bits of a node's prefix match an address
+ *
+ */
+static inline bool client_node_key_cmp(client_node_t const *node, uint8_t const *key)
+{
+	int bytes = node->prefix >> 3;
+	int bits = node->prefix & 0x07;
+
+	if (memcmp(node->key, key, bytes) != 0) return false;
+	if (bits && ((key[bytes] & (0xff << (8 - bits))) != node->key[bytes])) return false;
+
+	return true;
+}
+
+/** Return the address bytes and the trie for an address
+ *
+ */
+static client_node_t **client_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
+				   uint8_t const **key, int *max_prefix)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		*key = (uint8_t const *) &ipaddr->ipaddr.ip4addr;
+		*max_prefix = 32;
+		return (client_node_t **) &clients->trie[0];
+
+	case AF_INET6:
+		*key = (uint8_t const *) &ipaddr->ipaddr.ip6addr;
+		*max_prefix = 128;
+		return (client_node_t **) &clients->trie[1];
+
+	default:
+		return NULL;
+	}
+}
+
+/** Allocate a trie node for a prefix of an address
+ *
+ */
+static client_node_t *client_node_alloc(RADCLIENT_LIST *clients, uint8_t const *key, int prefix)
+{
+	client_node_t *node;
+	int bytes;
+
+	node = talloc_zero(clients, client_node_t);
+	if (!node) return NULL;
 
-	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-	if (rcode != 0) return rcode;
+	bytes = prefix >> 3;
+	memcpy(node->key, key, bytes);
+	if (prefix & 0x07) node->key[bytes] = key[bytes] & (0xff << (8 - (prefix & 0x07)));
+	node->prefix = prefix;
+
+	return node;
+}
+
+/** Find the node for a prefix, creating it and any parents if needed
+ *
+ *  New nodes are linked in with a single store, once they are
+ *  complete.
+ */
+static client_node_t *client_trie_insert(RADCLIENT_LIST *clients, fr_ipaddr_t const *ipaddr)
+{
+	client_node_t	**trie, *node, *child, *mid, *leaf;
+	uint8_t const	*key;
+	int		max_prefix, prefix, common, bit;
+
+	trie = client_trie(clients, ipaddr, &key, &max_prefix);
+	if (!trie) return NULL;
+
+	prefix = ipaddr->prefix;
+	if (prefix > max_prefix) return NULL;
+
+	if (!*trie) {
+		node = client_node_alloc(clients, key, 0);
+		if (!node) return NULL;
+		__atomic_store_n(trie, node, __ATOMIC_RELEASE);
+	}
+	node = *trie;
 
 	/*
-	 *	Wildcard match
+	 *	node->prefix is always <= prefix, and its key always
+	 *	matches the first node->prefix bits of ours.
 	 */
-	if ((a->proto == IPPROTO_IP) ||
-	    (b->proto == IPPROTO_IP)) return 0;
+	while (node->prefix < prefix) {
+		bit = CLIENT_KEY_BIT(key, node->prefix);
+		child = node->child[bit];
 
-	return (a->proto - b->proto);
-#endif
+		if (!child) {
+			leaf = client_node_alloc(clients, key, prefix);
+			if (!leaf) return NULL;
+
+			__atomic_store_n(&node->child[bit], leaf, __ATOMIC_RELEASE);
+			return leaf;
+		}
+
+		for (common = node->prefix + 1;
+		     (common < child->prefix) && (common < prefix) &&
+		     (CLIENT_KEY_BIT(key, common) == CLIENT_KEY_BIT(child->key, common));
+		     common++);
+
+		if (common == child->prefix) {
+			node = child;
+			continue;
+		}
+
+		/*
+		 *	The child has a longer prefix which diverges
+		 *	from ours (or contains it).  Put a new node
+		 *	where they split.
+		 */
+		mid = client_node_alloc(clients, key, common);
+		if (!mid) return NULL;
+		mid->child[CLIENT_KEY_BIT(child->key, common)] = child;
+
+		if (common < prefix) {
+			leaf = client_node_alloc(clients, key, prefix);
+			if (!leaf) {
+				talloc_free(mid);
+				return NULL;
+			}
+			mid->child[CLIENT_KEY_BIT(key, common)] = leaf;
+		} else {
+			leaf = mid;
+		}
+
+		__atomic_store_n(&node->child[bit], mid, __ATOMIC_RELEASE);
+		return leaf;
+	}
+
+	return node;
+}
+
+/** Find the node for exactly this prefix
+ *
+ */
+static client_node_t *client_trie_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr)
+{
+	client_node_t	**trie, *node;
+	uint8_t const	*key;
+	int		max_prefix;
+
+	trie = client_trie(clients, ipaddr, &key, &max_prefix);
+	if (!trie) return NULL;
+
+	for (node = __atomic_load_n(trie, __ATOMIC_ACQUIRE);
+	     node && (node->prefix < ipaddr->prefix);
+	     node = __atomic_load_n(&node->child[CLIENT_KEY_BIT(key, node->prefix)], __ATOMIC_ACQUIRE));
+
+	if (!node || (node->prefix != ipaddr->prefix) || !client_node_key_cmp(node, key)) return NULL;
+
+	return node;
 }
 
 #ifdef WITH_STATS
@@ -161,7 +345,6 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 	if (!clients) return NULL;
 
 	clients->name = talloc_strdup(clients, cs ? cf_section_name1(cs) : "root");
-	clients->min_prefix = 128;
 
 	return clients;
 }
@@ -174,33 +357,38 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
  *	- true on success.
  *	- false on failure.
  */
-bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
+/** Hack to fixup wildcard clients
+ *
+ * If the IP is all zeros, with a 32 or 128 bit netmask assume the user
+ * meant to configure 0.0.0.0/0 instead of 0.0.0.0/32 - which would require
+ * the src IP of the client to be all zeros.
+ */
+static void client_wildcard_fixup(fr_ipaddr_t *ipaddr)
 {
-	RADCLIENT *old;
-	char buffer[FR_IPADDR_PREFIX_STRLEN];
-
-	if (!client) return false;
-
-	/*
-	 *	Hack to fixup wildcard clients
-	 *
-	 *	If the IP is all zeros, with a 32 or 128 bit netmask
-	 *	assume the user meant to configure 0.0.0.0/0 instead
-	 *	of 0.0.0.0/32 - which would require the src IP of
-	 *	the client to be all zeros.
-	 */
-	if (fr_is_inaddr_any(&client->ipaddr) == 1) switch (client->ipaddr.af) {
+	if (fr_is_inaddr_any(ipaddr) == 1) switch (ipaddr->af) {
 	case AF_INET:
-		if (client->ipaddr.prefix == 32) client->ipaddr.prefix = 0;
+		if (ipaddr->prefix == 32) ipaddr->prefix = 0;
 		break;
 
 	case AF_INET6:
-		if (client->ipaddr.prefix == 128) client->ipaddr.prefix = 0;
+		if (ipaddr->prefix == 128) ipaddr->prefix = 0;
 		break;
 
 	default:
 		rad_assert(0);
 	}
+}
+
+bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	RADCLIENT	*old;
+	client_node_t	*node;
+	int		i;
+	char		buffer[FR_IPADDR_PREFIX_STRLEN];
+
+	if (!client) return false;
+
+	client_wildcard_fixup(&client->ipaddr);
 
 	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
 	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
@@ -265,13 +453,12 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	}
 
 	/*
-	 *	Create a tree for it.
+	 *	Find or create the node for the client's prefix.
 	 */
-	if (!clients->trees[client->ipaddr.prefix]) {
-		clients->trees[client->ipaddr.prefix] = rbtree_create(clients, client_ipaddr_cmp, NULL, 0);
-		if (!clients->trees[client->ipaddr.prefix]) {
-			return false;
-		}
+	node = client_trie_insert(clients, &client->ipaddr);
+	if (!node) {
+		ERROR("Failed adding client %s", client->shortname);
+		return false;
 	}
 
 #define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
@@ -279,7 +466,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Cannot insert the same client twice.
 	 */
-	old = rbtree_finddata(clients->trees[client->ipaddr.prefix], client);
+	old = client_node_find(node, &client->ipaddr, client->proto);
 	if (old) {
 		/*
 		 *	If it's a complete duplicate, then free the new
@@ -313,10 +500,15 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	/*
 	 *	Other error adding client: likely is fatal.
 	 */
-	if (!rbtree_insert(clients->trees[client->ipaddr.prefix], client)) {
+	for (i = 0; i < CLIENT_NODE_SLOTS; i++) if (!node->client[i]) break;
+	if (i == CLIENT_NODE_SLOTS) {
+		ERROR("Failed to add client %s: Too many clients for %s", client->shortname, buffer);
 		return false;
 	}
 
+	(void) talloc_steal(clients, client); /* reparent it */
+	__atomic_store_n(&node->client[i], client, __ATOMIC_RELEASE);
+
 #ifdef WITH_STATS
 	if (!tree_num) {
 		tree_num = rbtree_create(clients, client_num_cmp, NULL, 0);
@@ -349,12 +541,6 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	if (tree_num) rbtree_insert(tree_num, client);
 #endif
 
-	if (client->ipaddr.prefix < clients->min_prefix) {
-		clients->min_prefix = client->ipaddr.prefix;
-	}
-
-	(void) talloc_steal(clients, client); /* reparent it */
-
 	return true;
 }
 
@@ -362,11 +548,14 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_DYNAMIC_CLIENTS
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
+	client_node_t	*node;
+	int		i;
+
 	if (!client) return;
 
 	if (!clients) clients = root_clients;
 
-	if (!client->dynamic) return;
+	if (!client->dynamic && !client->file) return;
 
 	rad_assert(client->ipaddr.prefix <= 128);
 
@@ -375,7 +564,12 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_STATS
 	rbtree_deletebydata(tree_num, client);
 #endif
-	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+	node = client_trie_find(clients, &client->ipaddr);
+	if (!node) return;
+
+	for (i = 0; i < CLIENT_NODE_SLOTS; i++) {
+		if (node->client[i] == client) __atomic_store_n(&node->client[i], NULL, __ATOMIC_RELEASE);
+	}
 }
 #endif
 
@@ -412,43 +606,102 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 
 /*
  *	Find a client in the RADCLIENTS list.
+ *
+ *	Walks down the trie for the address, remembering the client
+ *	with the longest matching prefix.
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-	int32_t i, max_prefix;
-	RADCLIENT myclient;
+	client_node_t	**trie, *node;
+	uint8_t const	*key;
+	int		max_prefix;
+	RADCLIENT	*client, *found = NULL;
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
+	trie = client_trie(clients, ipaddr, &key, &max_prefix);
+	if (!trie) return NULL;
 
-	case AF_INET6:
-		max_prefix = 128;
+	node = __atomic_load_n(trie, __ATOMIC_ACQUIRE);
+	while (node) {
+		/*
+		 *	Path compression means we skipped some bits
+		 *	to get here, so check that they match.
+		 */
+		if (!client_node_key_cmp(node, key)) break;
+
+		client = client_node_find(node, ipaddr, proto);
+		if (client) found = client;
+
+		if (node->prefix >= max_prefix) break;
+
+		node = __atomic_load_n(&node->child[CLIENT_KEY_BIT(key, node->prefix)], __ATOMIC_ACQUIRE);
+	}
+
+	return found;
+}
+
+/** Visit a node and its children
+ *
+ */
+static int client_node_walk(client_node_t const *node, int af, client_prefix_cb_t func, void *uctx)
+{
+	int i, ret;
+
+	for (i = 0; i < CLIENT_NODE_SLOTS; i++) {
+		if (!__atomic_load_n(&node->client[i], __ATOMIC_ACQUIRE)) continue;
+
+		ret = func(uctx, af, node->key, node->prefix);
+		if (ret < 0) return ret;
 		break;
+	}
 
-	default :
-		return NULL;
+	for (i = 0; i < 2; i++) {
+		client_node_t const *child;
+
+		child = __atomic_load_n(&node->child[i], __ATOMIC_ACQUIRE);
+		if (!child) continue;
+
+		ret = client_node_walk(child, af, func, uctx);
+		if (ret < 0) return ret;
 	}
 
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
+	return 0;
+}
+
+/** Call a function for every prefix which has at least one client
+ *
+ * Each prefix is only visited once, however many clients share it.
+ * Shorter prefixes are visited before the longer prefixes they contain.
+ *
+ * @param[in] clients	to walk, or NULL for the global list.
+ * @param[in] func	to call for each prefix.
+ * @param[in] uctx	to pass to func.
+ * @return
+ *	- 0 if every prefix was visited.
+ *	- The negative value returned by func, if it stopped the walk.
+ */
+int client_list_walk_prefixes(RADCLIENT_LIST const *clients, client_prefix_cb_t func, void *uctx)
+{
+	static int const	af[] = { AF_INET, AF_INET6 };
+	int			i, ret;
+
+	if (!clients) clients = root_clients;
+	if (!clients) return 0;
 
-		if (!clients->trees[i]) continue;
+	for (i = 0; i < 2; i++) {
+		client_node_t const *node;
 
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
+		node = __atomic_load_n(&clients->trie[i], __ATOMIC_ACQUIRE);
+		if (!node) continue;
 
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
+		ret = client_node_walk(node, af[i], func, uctx);
+		if (ret < 0) return ret;
 	}
 
-	return NULL;
+	return 0;
 }
 
 /*
@@ -504,6 +757,9 @@ static const CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("dynamic_clients", PW_TYPE_STRING, RADCLIENT, client_server) },
 	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, RADCLIENT, lifetime) },
 	{ FR_CONF_OFFSET("rate_limit", PW_TYPE_BOOLEAN, RADCLIENT, rate_limit) },
+	{ FR_CONF_OFFSET("negative_ttl", PW_TYPE_INTEGER, RADCLIENT, negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_prefix", PW_TYPE_INTEGER, RADCLIENT, negative_prefix), .dflt = "0" },
+	{ FR_CONF_OFFSET("lookup_rate", PW_TYPE_INTEGER, RADCLIENT, lookup_rate), .dflt = "0" },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -520,6 +776,7 @@ RADCLIENT_LIST *client_list_parse_section(CONF_SECTION *section, UNUSED bool tls
 {
 	bool		global = false;
 	CONF_SECTION	*cs;
+	CONF_PAIR	*cp;
 	RADCLIENT	*c = NULL;
 	RADCLIENT_LIST	*clients = NULL;
 	CONF_SECTION	*server_cs = NULL;
@@ -581,7 +838,6 @@ RADCLIENT_LIST *client_list_parse_section(CONF_SECTION *section, UNUSED bool tls
 #ifdef HAVE_DIRENT_H
 		if (c->client_server) {
 			char const	*value;
-			CONF_PAIR	*cp;
 			DIR		*dir;
 			struct dirent	*dp;
 			struct stat	stat_buf;
@@ -661,6 +917,35 @@ RADCLIENT_LIST *client_list_parse_section(CONF_SECTION *section, UNUSED bool tls
 
 	}
 
+	/*
+	 *	Add the clients from files in the compact format.
+	 */
+	for (cp = cf_pair_find(section, "client_file");
+	     cp;
+	     cp = cf_pair_find_next(section, cp, "client_file")) {
+		char const *value = cf_pair_value(cp);
+
+		if (!value || !*value) {
+			cf_log_err_cp(cp, "The \"client_file\" entry must not be empty");
+			talloc_free(clients);
+			return NULL;
+		}
+
+#ifdef WITH_TLS
+		if (tls_required) {
+			cf_log_err_cp(cp, "Clients in a client_file cannot use TLS listeners");
+			talloc_free(clients);
+			return NULL;
+		}
+#endif
+
+		if (client_file_load(clients, value, server_cs) < 0) {
+			cf_log_err_cp(cp, "Failed loading clients from %s", value);
+			talloc_free(clients);
+			return NULL;
+		}
+	}
+
 	/*
 	 *	Associate the clients structure with the section.
 	 */
@@ -701,6 +986,186 @@ static const CONF_PARSER dynamic_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/** A prefix inside of a dynamic client network which was recently looked up
+ *
+ */
+typedef struct client_lookup_t {
+	fr_ipaddr_t	prefix;				//!< Masked to the network's negative_prefix.
+	time_t		expires;			//!< Lookups fail until then.  0 if lookup didn't fail.
+	time_t		second;				//!< Which second lookups are being counted in.
+	uint32_t	lookups;			//!< Lookups done in that second.
+} client_lookup_t;
+
+/*
+ *	How many prefixes we add to a network, between cleaning up
+ *	old ones.
+ */
+#define CLIENT_LOOKUP_CLEANUP	(4096)
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	client_lookup_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define LOOKUP_LOCK	pthread_mutex_lock(&client_lookup_mutex)
+#  define LOOKUP_UNLOCK	pthread_mutex_unlock(&client_lookup_mutex)
+#else
+#  define LOOKUP_LOCK
+#  define LOOKUP_UNLOCK
+#endif
+
+static uint32_t client_lookup_hash(void const *data)
+{
+	client_lookup_t const *a = data;
+
+	if (a->prefix.af == AF_INET) return fr_hash(&a->prefix.ipaddr.ip4addr, sizeof(a->prefix.ipaddr.ip4addr));
+
+	return fr_hash(&a->prefix.ipaddr.ip6addr, sizeof(a->prefix.ipaddr.ip6addr));
+}
+
+static int client_lookup_cmp(void const *one, void const *two)
+{
+	client_lookup_t const *a = one;
+	client_lookup_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->prefix, &b->prefix);
+}
+
+typedef struct client_lookup_expire_t {
+	fr_hash_table_t	*ht;
+	time_t		now;
+} client_lookup_expire_t;
+
+/** Remove prefixes which we no longer need to remember
+ *
+ */
+static int client_lookup_expire(void *ctx, void *data)
+{
+	client_lookup_expire_t	*expire = ctx;
+	client_lookup_t		*lookup = data;
+
+	if ((lookup->expires > expire->now) || (lookup->second == expire->now)) return 0;
+
+	fr_hash_table_delete(expire->ht, lookup);
+	talloc_free(lookup);
+
+	return 0;
+}
+
+/** Find the entry for the prefix an address is in, creating it if necessary
+ *
+ * Must be called with the lock held.
+ */
+static client_lookup_t *client_lookup_find(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now)
+{
+	client_lookup_t	my_lookup, *lookup;
+	int		num;
+
+	if (!network->negative) {
+		network->negative = fr_hash_table_create(network, client_lookup_hash, client_lookup_cmp, NULL);
+		if (!network->negative) return NULL;
+	}
+
+	memset(&my_lookup, 0, sizeof(my_lookup));
+	my_lookup.prefix.af = ipaddr->af;
+	my_lookup.prefix.ipaddr = ipaddr->ipaddr;
+	fr_ipaddr_mask(&my_lookup.prefix, network->negative_prefix);
+
+	lookup = fr_hash_table_finddata(network->negative, &my_lookup);
+	if (lookup) return lookup;
+
+	/*
+	 *	Clean up old entries every so often, so that a flood
+	 *	from random addresses doesn't use unbounded memory.
+	 *	The table only holds prefixes which failed within
+	 *	negative_ttl, or were looked up in this second.
+	 */
+	num = fr_hash_table_num_elements(network->negative);
+	if (num && ((num % CLIENT_LOOKUP_CLEANUP) == 0)) {
+		client_lookup_expire_t expire = { .ht = network->negative, .now = now };
+
+		fr_hash_table_walk(network->negative, client_lookup_expire, &expire);
+	}
+
+	lookup = talloc_memdup(network, &my_lookup, sizeof(my_lookup));
+	if (!lookup) return NULL;
+
+	if (!fr_hash_table_insert(network->negative, lookup)) {
+		talloc_free(lookup);
+		return NULL;
+	}
+
+	return lookup;
+}
+
+/** Check whether we should look up a dynamic client
+ *
+ * Addresses in a prefix which recently failed lookup are ignored for
+ * negative_ttl seconds, and each prefix may only be looked up
+ * lookup_rate times a second.  This protects the databases used by
+ * the dynamic client virtual server against floods from unknown
+ * sources.
+ *
+ * @param[in] network	the client which defines the dynamic client network.
+ * @param[in] ipaddr	of the unknown client.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if the lookup should be done.
+ *	- false if it should not.
+ */
+bool client_dynamic_lookup_allowed(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now)
+{
+	client_lookup_t	*lookup;
+	bool		allowed = true;
+
+	if (!network->negative_ttl && !network->lookup_rate) return true;
+
+	LOOKUP_LOCK;
+
+	lookup = client_lookup_find(network, ipaddr, now);
+	if (!lookup) goto done;		/* out of memory, fail open */
+
+	if (lookup->expires > now) {
+		allowed = false;
+		goto done;
+	}
+
+	if (network->lookup_rate) {
+		if (lookup->second != now) {
+			lookup->second = now;
+			lookup->lookups = 0;
+		}
+
+		if (lookup->lookups >= network->lookup_rate) {
+			allowed = false;
+			goto done;
+		}
+		lookup->lookups++;
+	}
+
+done:
+	LOOKUP_UNLOCK;
+
+	return allowed;
+}
+
+/** Remember that looking up a dynamic client failed
+ *
+ * @param[in] network	the client which defines the dynamic client network.
+ * @param[in] ipaddr	of the unknown client.
+ * @param[in] now	the current time.
+ */
+void client_dynamic_lookup_failed(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now)
+{
+	client_lookup_t	*lookup;
+
+	if (!network->negative_ttl) return;
+
+	LOOKUP_LOCK;
+
+	lookup = client_lookup_find(network, ipaddr, now);
+	if (lookup) lookup->expires = now + network->negative_ttl;
+
+	LOOKUP_UNLOCK;
+}
+
 /** Add a dynamic client
  *
  */
@@ -1039,6 +1504,20 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 			goto error;
 		}
 
+		/*
+		 *	Failed addresses are aggregated to a prefix
+		 *	inside of the network.  0 means the address.
+		 */
+		if ((c->negative_prefix == 0) || (c->negative_prefix > ((c->ipaddr.af == AF_INET) ? 32 : 128))) {
+			c->negative_prefix = (c->ipaddr.af == AF_INET) ? 32 : 128;
+		}
+
+		if (c->negative_prefix < c->ipaddr.prefix) {
+			cf_log_err_cs(cs, "negative_prefix must be at least the prefix of the network (%u)",
+				      c->ipaddr.prefix);
+			goto error;
+		}
+
 		return c;
 	}
 #endif
@@ -1538,3 +2017,398 @@ RADCLIENT *client_read(char const *filename, CONF_SECTION *server_cs, bool check
 }
 #endif
 
+
+/** A file of clients in the compact format
+ *
+ * The clients are built directly from the lines of the file, without a
+ * CONF_SECTION, so that very large numbers of clients load quickly.
+ */
+struct client_file_t {
+	char const		*filename;	//!< Of the file.
+	RADCLIENT_LIST		*clients;	//!< List the clients were added to.
+	CONF_SECTION		*server_cs;	//!< Virtual server the file was loaded from, or NULL.
+	uint32_t		generation;	//!< Incremented each time the file is loaded.
+
+	client_file_t		*next;		//!< Next loaded file.
+};
+
+static client_file_t	*client_files = NULL;	//!< All loaded client files.
+
+/** Forget a client file when its client list is freed
+ *
+ */
+static int _client_file_free(client_file_t *file)
+{
+	client_file_t **last;
+
+	for (last = &client_files; *last; last = &(*last)->next) {
+		if (*last != file) continue;
+
+		*last = file->next;
+		break;
+	}
+
+	return 0;
+}
+
+/** Find a client with exactly this address, prefix and protocol
+ *
+ */
+static RADCLIENT *client_exact_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
+{
+	client_node_t *node;
+
+	node = client_trie_find(clients, ipaddr);
+	if (!node) return NULL;
+
+	return client_node_find(node, ipaddr, proto);
+}
+
+/** Check whether a client from a file has changed since it was last loaded
+ *
+ */
+static bool client_file_same(RADCLIENT const *a, RADCLIENT const *b)
+{
+#define namecmp(_x) ((!a->_x && !b->_x) || (a->_x && b->_x && (strcmp(a->_x, b->_x) == 0)))
+	return (a->proto == b->proto) && (a->message_authenticator == b->message_authenticator) &&
+	       namecmp(secret) && namecmp(shortname) && namecmp(nas_type) && namecmp(server);
+#undef namecmp
+}
+
+#ifdef WITH_DYNAMIC_CLIENTS
+/** Delete the clients of a file which weren't seen when it was last loaded
+ *
+ */
+static void client_file_sweep(RADCLIENT_LIST *clients, client_node_t *node, client_file_t *file)
+{
+	int i;
+
+	for (i = 0; i < CLIENT_NODE_SLOTS; i++) {
+		RADCLIENT *client = node->client[i];
+
+		if (!client || (client->file != file) || (client->file_generation == file->generation)) continue;
+
+		DEBUG2("%s: Deleting client %s", file->filename, client->longname);
+		client_delete(clients, client);
+		client->file = NULL;
+		client_free(client);
+	}
+
+	for (i = 0; i < 2; i++) if (node->child[i]) client_file_sweep(clients, node->child[i], file);
+}
+#endif
+
+/** Parse one line of a client file
+ *
+ * The format is:
+ @verbatim
+   <ipaddr>[/<prefix>] <secret> [<option>=<value> ...]
+ @endverbatim
+ *
+ * Where the options are "shortname", "nas_type", "virtual_server",
+ * "require_message_authenticator" and "proto".  Values containing spaces
+ * must be quoted.  Blank lines, and lines starting with '#' are ignored.
+ *
+ * @param[out] out	The new client, or NULL if the line is blank.
+ * @param[in] file	being loaded.
+ * @param[in] line	to parse.
+ * @param[in] lineno	for error messages.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int client_file_parse(RADCLIENT **out, client_file_t *file, char const *line, int lineno)
+{
+	char const	*p = line, *q;
+	char		buffer[1024];
+	char		key[32];
+	RADCLIENT	*c;
+
+	*out = NULL;
+
+	while (isspace((int) *p)) p++;
+	if (!*p || (*p == '#')) return 0;
+
+	c = talloc_zero(file->clients, RADCLIENT);
+	if (!c) {
+		ERROR("%s[%d]: Out of memory", file->filename, lineno);
+		return -1;
+	}
+
+	/*
+	 *	The address is used as the long name.
+	 */
+	for (q = p; *q && !isspace((int) *q); q++);
+	if (fr_inet_pton(&c->ipaddr, p, q - p, AF_UNSPEC, false, true) < 0) {
+		ERROR("%s[%d]: Invalid client address: %s", file->filename, lineno, fr_strerror());
+	error:
+		talloc_free(c);
+		return -1;
+	}
+	client_wildcard_fixup(&c->ipaddr);
+	c->longname = talloc_bstrndup(c, p, q - p);
+	p = q;
+
+	if (!getword(&p, buffer, sizeof(buffer), true) || !buffer[0]) {
+		ERROR("%s[%d]: Missing secret for client %s", file->filename, lineno, c->longname);
+		goto error;
+	}
+	c->secret = talloc_typed_strdup(c, buffer);
+	c->proto = IPPROTO_UDP;
+
+	while (*p && (*p != '#')) {
+		size_t len;
+
+		for (q = p; *q && (*q != '=') && !isspace((int) *q); q++);
+		len = q - p;
+		if ((*q != '=') || !len || (len >= sizeof(key))) {
+			ERROR("%s[%d]: Expected <option>=<value>, got \"%s\"", file->filename, lineno, p);
+			goto error;
+		}
+		strlcpy(key, p, len + 1);
+
+		p = q + 1;
+		(void) getword(&p, buffer, sizeof(buffer), true);
+
+		if (strcmp(key, "shortname") == 0) {
+			c->shortname = talloc_typed_strdup(c, buffer);
+
+		} else if (strcmp(key, "nas_type") == 0) {
+			c->nas_type = talloc_typed_strdup(c, buffer);
+
+		} else if (strcmp(key, "virtual_server") == 0) {
+			if (file->server_cs) {
+				ERROR("%s[%d]: Clients inside of a 'server' section cannot point to a server",
+				      file->filename, lineno);
+				goto error;
+			}
+
+			c->server_cs = cf_section_sub_find_name2(main_config.config, "server", buffer);
+			if (!c->server_cs) {
+				ERROR("%s[%d]: Failed to find virtual server %s", file->filename, lineno, buffer);
+				goto error;
+			}
+			c->server = cf_section_name2(c->server_cs);
+
+		} else if (strcmp(key, "require_message_authenticator") == 0) {
+			if ((strcmp(buffer, "yes") == 0) || (strcmp(buffer, "true") == 0)) {
+				c->message_authenticator = true;
+
+			} else if ((strcmp(buffer, "no") != 0) && (strcmp(buffer, "false") != 0)) {
+				ERROR("%s[%d]: Invalid value \"%s\" for require_message_authenticator",
+				      file->filename, lineno, buffer);
+				goto error;
+			}
+
+		} else if (strcmp(key, "proto") == 0) {
+			if (strcmp(buffer, "udp") == 0) {
+				c->proto = IPPROTO_UDP;
+#ifdef WITH_TCP
+			} else if (strcmp(buffer, "tcp") == 0) {
+				c->proto = IPPROTO_TCP;
+
+			} else if (strcmp(buffer, "*") == 0) {
+				c->proto = IPPROTO_IP; /* fake for dual */
+#endif
+			} else {
+				ERROR("%s[%d]: Unknown proto \"%s\"", file->filename, lineno, buffer);
+				goto error;
+			}
+
+		} else {
+			ERROR("%s[%d]: Unknown client option \"%s\"", file->filename, lineno, key);
+			goto error;
+		}
+	}
+
+	if (!c->shortname) c->shortname = talloc_typed_strdup(c, c->longname);
+
+	if (!c->server && file->server_cs) {
+		c->server = cf_section_name2(file->server_cs);
+		c->server_cs = file->server_cs;
+	}
+
+	*out = c;
+
+	return 0;
+}
+
+/** Load, or reload clients from a file in the compact format
+ *
+ * Each line of the file defines one client, see #client_file_parse.  The
+ * clients are added directly to the client list, so loading a very large
+ * number of clients doesn't need much more memory than the clients do.
+ *
+ * If the file has already been loaded into the list, only the differences
+ * are applied.  New clients are added, changed clients are replaced, and
+ * clients which are no longer in the file are deleted.  Clients which
+ * haven't changed aren't touched.  When reloading, invalid lines are
+ * logged and skipped.
+ *
+ * @param[in] clients	to add the clients to.
+ * @param[in] filename	to read.
+ * @param[in] server_cs	virtual server the clients are in, or NULL.
+ * @return
+ *	- The number of clients in the file.
+ *	- -1 on failure.
+ */
+int client_file_load(RADCLIENT_LIST *clients, char const *filename, CONF_SECTION *server_cs)
+{
+	FILE		*fp;
+	client_file_t	*file;
+	RADCLIENT	*c, *old;
+	char		line[8192];
+	int		lineno = 0, num = 0, errors = 0;
+	bool		reload = false;
+
+	for (file = client_files; file; file = file->next) {
+		if ((file->clients == clients) && (strcmp(file->filename, filename) == 0)) break;
+	}
+
+	if (file) {
+#ifndef WITH_DYNAMIC_CLIENTS
+		ERROR("Reloading %s needs dynamic clients support", filename);
+		return -1;
+#endif
+		reload = true;
+
+	} else {
+		file = talloc_zero(clients, client_file_t);
+		if (!file) return -1;
+
+		file->filename = talloc_typed_strdup(file, filename);
+		file->clients = clients;
+		file->server_cs = server_cs;
+		file->next = client_files;
+		client_files = file;
+		talloc_set_destructor(file, _client_file_free);
+	}
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		ERROR("Failed opening client file %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	file->generation++;
+
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len;
+
+		lineno++;
+
+		len = strlen(line);
+		if (len && (line[len - 1] == '\n')) {
+			line[--len] = '\0';
+		} else if (!feof(fp)) {
+			ERROR("%s[%d]: Line too long", filename, lineno);
+			fclose(fp);
+			return -1;
+		}
+
+		if (client_file_parse(&c, file, line, lineno) < 0) goto next;
+		if (!c) continue;
+
+		old = client_exact_find(clients, &c->ipaddr, c->proto);
+		if (old) {
+			if (old->file != file) {
+				ERROR("%s[%d]: Client %s is already defined %s", filename, lineno, c->longname,
+				      old->file ? "in another client_file" : "in the configuration");
+			discard:
+				talloc_free(c);
+				goto next;
+			}
+
+			if (old->file_generation == file->generation) {
+				ERROR("%s[%d]: Duplicate client %s", filename, lineno, c->longname);
+				goto discard;
+			}
+
+			/*
+			 *	Unchanged.  Keep the old one.
+			 */
+			if (client_file_same(old, c)) {
+				old->file_generation = file->generation;
+				talloc_free(c);
+				num++;
+				continue;
+			}
+
+#ifdef WITH_DYNAMIC_CLIENTS
+			/*
+			 *	Changed.  It's freed when it's no
+			 *	longer used by any request.
+			 */
+			DEBUG2("%s[%d]: Replacing client %s", filename, lineno, c->longname);
+			client_delete(clients, old);
+			old->file = NULL;
+			client_free(old);
+#endif
+		}
+
+		c->file = file;
+		c->file_generation = file->generation;
+		if (!client_add(clients, c)) {
+			ERROR("%s[%d]: Failed adding client %s", filename, lineno, c->longname);
+			goto discard;
+		}
+		num++;
+		continue;
+
+	next:
+		/*
+		 *	The clients which were already added stay in
+		 *	the list, and are freed with it.
+		 */
+		if (!reload) {
+			fclose(fp);
+			return -1;
+		}
+		errors++;
+	}
+	fclose(fp);
+
+#ifdef WITH_DYNAMIC_CLIENTS
+	/*
+	 *	Delete the clients which were removed from the file.
+	 */
+	if (reload) for (lineno = 0; lineno < 2; lineno++) {
+		client_node_t *node;
+
+		node = __atomic_load_n(&clients->trie[lineno], __ATOMIC_ACQUIRE);
+		if (node) client_file_sweep(clients, node, file);
+	}
+#endif
+
+	if (errors) {
+		WARN("Ignored %d invalid lines in %s", errors, filename);
+	} else {
+		DEBUG("Loaded %d clients from %s", num, filename);
+	}
+
+	return num;
+}
+
+/** Reload every copy of a client file which was loaded at startup
+ *
+ * @param[in] filename	of the client file.
+ * @return
+ *	- The number of clients in the file.
+ *	- -1 if the file wasn't loaded at startup, or on failure.
+ */
+int client_file_reload(char const *filename)
+{
+	client_file_t	*file;
+	int		rcode = -1;
+
+	for (file = client_files; file; file = file->next) {
+		if (strcmp(file->filename, filename) != 0) continue;
+
+		rcode = client_file_load(file->clients, file->filename, file->server_cs);
+		if (rcode < 0) return -1;
+	}
+
+	if (rcode < 0) ERROR("Client file %s was not loaded at startup", filename);
+
+	return rcode;
+}
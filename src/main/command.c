@@ -27,6 +27,8 @@
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/conduit.h>
 #include <freeradius-devel/state.h>
+#include <freeradius-devel/trace.h>
+#include <freeradius-devel/mem_account.h>
 
 #include <libgen.h>
 #ifdef HAVE_INTTYPES_H
@@ -57,6 +59,7 @@ typedef int (*fr_command_func_t)(rad_listen_t *, int, char *argv[]);
 
 #define FR_READ  (1)
 #define FR_WRITE (2)
+#define FR_ASYNC (4)	//!< Command is run on a helper thread, so it doesn't block the event loop.
 
 #define CMD_FAIL FR_CONDUIT_FAIL
 #define CMD_OK   FR_CONDUIT_SUCCESS
@@ -94,6 +97,25 @@ typedef struct fr_command_socket_t {
 	fr_cs_buffer_t  co;
 } fr_command_socket_t;
 
+/** A command running on a helper thread
+ *
+ * While the command is running, the socket is removed from the event
+ * loop, and the helper thread writes the output directly to it.  When
+ * the command is done, the main thread is told via command_async_pipe,
+ * and it puts the socket back into the event loop.
+ */
+typedef struct command_async_t {
+	rad_listen_t		*listener;	//!< The command is for.
+	fr_command_func_t	func;		//!< To run.
+	int			argc;
+	char			**argv;		//!< Copied, as the command buffer may be re-used.
+	bool			failed;		//!< Writing to the socket failed, close it when done.
+} command_async_t;
+
+static int			command_async_pipe[2] = { -1, -1 };
+static int			command_async_running;	//!< Only accessed from the main thread.
+static _Thread_local command_async_t *command_async_current;	//!< Set in helper threads.
+
 static const CONF_PARSER command_config[] = {
 	{ FR_CONF_OFFSET("socket", PW_TYPE_STRING, fr_command_socket_t, path), .dflt = "${run_dir}/radiusd.sock" },
 	{ FR_CONF_DEPRECATED("uid", PW_TYPE_STRING, fr_command_socket_t, NULL) },
@@ -104,6 +126,13 @@ static const CONF_PARSER command_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+#if defined(WITH_STATS) && defined(WITH_TCP)
+static const CONF_PARSER command_tcp_config[] = {
+	{ FR_CONF_OFFSET("metrics", PW_TYPE_BOOLEAN, listen_socket_t, metrics), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+#endif
+
 static FR_NAME_NUMBER mode_names[] = {
 	{ "ro", FR_READ },
 	{ "read-only", FR_READ },
@@ -747,6 +776,22 @@ static void command_close_socket(rad_listen_t *this)
 	radius_update_listener(this);
 }
 
+/** Deal with a write to the socket failing
+ *
+ * Helper threads can't close the socket, as the main thread might free
+ * it while the command is still running.  So they just remember that it
+ * failed, and the main thread closes it when the command is done.
+ */
+static void command_write_failed(rad_listen_t *this)
+{
+	if (command_async_current) {
+		command_async_current->failed = true;
+		return;
+	}
+
+	command_close_socket(this);
+}
+
 
 #if defined(HAVE_FOPENCOOKIE) || defined (HAVE_FUNOPEN)
 static pthread_mutex_t debug_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -793,9 +838,10 @@ static ssize_t CC_HINT(format (printf, 2, 3)) cprintf(rad_listen_t *listener, ch
 	va_end(ap);
 
 	if (listener->status == RAD_LISTEN_STATUS_EOL) return 0;
+	if (command_async_current && command_async_current->failed) return 0;
 
 	r = fr_conduit_write(listener->fd, FR_CONDUIT_STDOUT, buffer, len);
-	if (r <= 0) command_close_socket(listener);
+	if (r <= 0) command_write_failed(listener);
 
 	/*
 	 *	FIXME: Keep writing until done?
@@ -814,9 +860,10 @@ static ssize_t CC_HINT(format (printf, 2, 3)) cprintf_error(rad_listen_t *listen
 	va_end(ap);
 
 	if (listener->status == RAD_LISTEN_STATUS_EOL) return 0;
+	if (command_async_current && command_async_current->failed) return 0;
 
 	r = fr_conduit_write(listener->fd, FR_CONDUIT_STDERR, buffer, len);
-	if (r <= 0) command_close_socket(listener);
+	if (r <= 0) command_write_failed(listener);
 
 	/*
 	 *	FIXME: Keep writing until done?
@@ -1032,6 +1079,11 @@ static char const *method_names[MOD_COUNT] = {
 	"pre-proxy",
 	"post-proxy",
 	"post-auth"
+#ifdef WITH_COA
+	,
+	"recv-coa",
+	"send-coa"
+#endif
 };
 
 
@@ -1273,6 +1325,107 @@ static int command_show_version(rad_listen_t *listener, UNUSED int argc, UNUSED
 	return CMD_OK;
 }
 
+static char const *command_trace_code(unsigned int code)
+{
+	if (!code) return "no reply";
+	if (code < FR_MAX_PACKET_CODE) return fr_packet_codes[code];
+
+	return "<invalid>";
+}
+
+static int command_show_trace(rad_listen_t *listener, int argc, char *argv[])
+{
+	trace_t		*traces;
+	uint32_t	count = 0, i, shown = 0, max = 10;
+	uint32_t	min_usec = 0;
+	int		j;
+
+	if (argc > 0) max = atoi(argv[0]);
+	if (argc > 1) min_usec = atoi(argv[1]);
+
+	traces = trace_buffer_copy(NULL, &count);
+	if (!traces) {
+		cprintf(listener, "No requests have been traced (sample_rate = %u)\n", trace_sample_rate());
+		return CMD_OK;
+	}
+
+	for (i = 0; (i < count) && (!max || (shown < max)); i++) {
+		trace_t const *trace = &traces[i];
+
+		if (trace->usec < min_usec) continue;
+		shown++;
+
+		cprintf(listener, "(%" PRIu64 ") %s -> %s, server %s, %uus, queued %uus%s\n",
+			trace->number, command_trace_code(trace->code), command_trace_code(trace->reply_code),
+			trace->server[0] ? trace->server : "<none>", trace->usec, trace->queue_usec,
+			trace->truncated ? ", truncated" : "");
+
+		for (j = 0; j < trace->num_spans; j++) {
+			trace_span_t const *span = &trace->span[j];
+
+			if (!span->done) {
+				cprintf(listener, "%.*s%s +%uus, not finished\n",
+					span->depth + 1, tabs, span->name, span->start);
+				continue;
+			}
+
+			cprintf(listener, "%.*s%s +%uus, %uus, %s\n",
+				span->depth + 1, tabs, span->name, span->start, span->usec,
+				fr_int2str(mod_rcode_table, span->rcode, "<invalid>"));
+		}
+	}
+	talloc_free(traces);
+
+	return CMD_OK;
+}
+
+static int command_show_memory_accounts(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	mem_account_stats_t	*acct;
+	size_t			num, i;
+
+	acct = mem_account_snapshot(NULL, &num);
+	if (!acct) {
+		cprintf(listener, "No memory accounts\n");
+		return CMD_OK;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (acct[i].limit) {
+			cprintf(listener, "%s\t%s\t%" PRIu64 " bytes\t%" PRIu64 " objects\tlimit %" PRIu64 " bytes\n",
+				acct[i].type, acct[i].name, acct[i].bytes, acct[i].objects, acct[i].limit);
+			continue;
+		}
+
+		cprintf(listener, "%s\t%s\t%" PRIu64 " bytes\t%" PRIu64 " objects\n",
+			acct[i].type, acct[i].name, acct[i].bytes, acct[i].objects);
+	}
+	talloc_free(acct);
+
+	return CMD_OK;
+}
+
+static int command_set_trace_sample_rate(rad_listen_t *listener, int argc, char *argv[])
+{
+	int rate;
+
+	if (argc == 0) {
+		cprintf_error(listener, "Must specify <rate>\n");
+		return -1;
+	}
+
+	rate = atoi(argv[0]);
+	if (rate < 0) {
+		cprintf_error(listener, "<rate> must be 0 or more\n");
+		return -1;
+	}
+
+	INFO("Trace sample rate set to %i, was %u", rate, trace_sample_rate());
+	trace_sample_rate_set(rate);
+
+	return CMD_OK;
+}
+
 static int command_debug_level_global(rad_listen_t *listener, int argc, char *argv[])
 {
 	int number;
@@ -2357,7 +2510,7 @@ static fr_command_table_t command_table_show_module[] = {
 };
 
 static fr_command_table_t command_table_show_client[] = {
-	{ "list", FR_READ,
+	{ "list", FR_READ | FR_ASYNC,
 	  "show client list - shows list of global clients",
 	  command_show_clients, NULL },
 
@@ -2366,7 +2519,7 @@ static fr_command_table_t command_table_show_client[] = {
 
 #ifdef WITH_PROXY
 static fr_command_table_t command_table_show_home[] = {
-	{ "list", FR_READ,
+	{ "list", FR_READ | FR_ASYNC,
 	  "show home_server list - shows list of home servers",
 	  command_show_home_servers, NULL },
 
@@ -2449,6 +2602,10 @@ static fr_command_table_t command_table_show[] = {
 	  command_show_memory_report, NULL },
 #endif
 
+	{ "memory-accounts", FR_READ | FR_ASYNC,
+	  "show memory-accounts - show memory used by modules and subsystems",
+	  command_show_memory_accounts, NULL },
+
 	{ "module", FR_READ,
 	  "show module <command> - do sub-command of module",
 	  NULL, command_table_show_module },
@@ -2459,6 +2616,9 @@ static fr_command_table_t command_table_show[] = {
 	  NULL, command_table_show_profiler },
 #endif
 
+	{ "trace", FR_READ | FR_ASYNC,
+	  "show trace [<count> [<usec>]] - show the most recent traced requests which took at least <usec>",
+	  command_show_trace, NULL },
 	{ "uptime", FR_READ,
 	  "show uptime - shows time at which server started",
 	  command_uptime, NULL },
@@ -2631,10 +2791,13 @@ static char const *elapsed_names[8] = {
 #endif
 #endif
 
-static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
+static int command_print_stats(rad_listen_t *listener, fr_stats_block_t const *block,
 			       int auth, int server)
 {
 	int i;
+	fr_stats_t merged, *stats = &merged;
+
+	fr_stats_merge(stats, block);
 
 	cprintf(listener, "requests\t" PU "\n", stats->total_requests);
 	cprintf(listener, "responses\t" PU "\n", stats->total_responses);
@@ -2668,6 +2831,54 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 	return CMD_OK;
 }
 
+static int command_stats_module(rad_listen_t *listener, int argc, char *argv[])
+{
+	int			i, j;
+	CONF_SECTION		*cs;
+	module_instance_t const	*instance;
+
+	if (argc != 1) {
+		cprintf_error(listener, "No module name was given\n");
+		return CMD_FAIL;
+	}
+
+	cs = cf_section_sub_find(main_config.config, "modules");
+	if (!cs) return CMD_FAIL;
+
+	instance = module_find(cs, argv[0]);
+	if (!instance) {
+		cprintf_error(listener, "No such module \"%s\"\n", argv[0]);
+		return CMD_FAIL;
+	}
+
+	for (i = 0; i < MOD_COUNT; i++) {
+		module_method_stats_t stats;
+
+		if (!instance->module->methods[i]) continue;
+
+		module_stats_get(&stats, instance, i);
+
+		cprintf(listener, "%s\n", method_names[i]);
+		cprintf(listener, "\tcalls\t\t%" PRIu64 "\n", stats.calls);
+		cprintf(listener, "\tyields\t\t%" PRIu64 "\n", stats.yields);
+
+		for (j = 0; j < RLM_MODULE_NUMCODES; j++) {
+			if (!stats.rcodes[j]) continue;
+
+			cprintf(listener, "\t%s\t\t%" PRIu64 "\n", fr_int2str(mod_rcode_table, j, "<invalid>"),
+				stats.rcodes[j]);
+		}
+
+		if (!stats.calls) continue;
+
+		cprintf(listener, "\tusec_average\t%" PRIu64 "\n", stats.usec / stats.calls);
+		cprintf(listener, "\tusec_p50\t%" PRIu64 "\n", module_stats_percentile(&stats, 50));
+		cprintf(listener, "\tusec_p99\t%" PRIu64 "\n", module_stats_percentile(&stats, 99));
+	}
+
+	return CMD_OK;
+}
+
 static int command_stats_state(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
 	cprintf(listener, "states_created\t\t%" PRIu64 "\n", fr_state_entries_created(global_state));
@@ -2712,9 +2923,6 @@ static FR_NAME_NUMBER state_names[] = {
 	{ "header", STATE_HEADER },
 	{ "vps", STATE_VPS },
 	{ "queued", STATE_QUEUED },
-	{ "running", STATE_RUNNING },
-	{ "no-reply", STATE_NO_REPLY },
-	{ "replied", STATE_REPLIED },
 
 	{ NULL, 0 }
 };
@@ -2828,44 +3036,31 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 {
 	bool auth = true;
-	fr_stats_t *stats;
-	RADCLIENT *client, fake;
+	fr_stats_block_t *stats;
+	RADCLIENT *client = NULL;
 
 	if (argc < 1) {
 		cprintf_error(listener, "Must specify [auth/acct]\n");
 		return 0;
 	}
 
-	if (argc == 1) {
-		/*
-		 *	Global statistics.
-		 */
-		fake.auth = radius_auth_stats;
-#ifdef WITH_ACCOUNTING
-		fake.acct = radius_acct_stats;
-#endif
-#ifdef WITH_COA
-		fake.coa = radius_coa_stats;
-		fake.dsc = radius_dsc_stats;
-#endif
-		client = &fake;
-
-	} else {
-		/*
-		 *	Per-client statistics.
-		 */
+	/*
+	 *	Per-client statistics.  If there's no client,
+	 *	the global statistics are used instead.
+	 */
+	if (argc > 1) {
 		client = get_client(listener, argc - 1, argv + 1);
 		if (!client) return 0;
 	}
 
 	if (strcmp(argv[0], "auth") == 0) {
 		auth = true;
-		stats = &client->auth;
+		stats = client ? &client->auth : &radius_auth_stats;
 
 	} else if (strcmp(argv[0], "acct") == 0) {
 #ifdef WITH_ACCOUNTING
 		auth = false;
-		stats = &client->acct;
+		stats = client ? &client->acct : &radius_acct_stats;
 #else
 		cprintf_error(listener, "This server was built without accounting support.\n");
 		return 0;
@@ -2874,7 +3069,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	} else if (strcmp(argv[0], "coa") == 0) {
 #ifdef WITH_COA
 		auth = false;
-		stats = &client->coa;
+		stats = client ? &client->coa : &radius_coa_stats;
 #else
 		cprintf_error(listener, "This server was built without CoA support.\n");
 		return 0;
@@ -2883,7 +3078,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	} else if (strcmp(argv[0], "disconnect") == 0) {
 #ifdef WITH_COA
 		auth = false;
-		stats = &client->dsc;
+		stats = client ? &client->dsc : &radius_dsc_stats;
 #else
 		cprintf_error(listener, "This server was built without CoA support.\n");
 		return 0;
@@ -2894,19 +3089,6 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 		return 0;
 	}
 
-	/*
-	 *	Global results for all client.
-	 */
-	if (argc == 1) {
-#ifdef WITH_ACCOUNTING
-		if (!auth) {
-			return command_print_stats(listener,
-						   &radius_acct_stats, auth, 0);
-		}
-#endif
-		return command_print_stats(listener, &radius_auth_stats, auth, 0);
-	}
-
 	return command_print_stats(listener, stats, auth, 0);
 }
 
@@ -2914,14 +3096,24 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 static int command_stats_socket(rad_listen_t *listener, int argc, char *argv[])
 {
 	bool auth = true;
+	int rcode;
 	rad_listen_t *sock;
+	listen_socket_t *data;
 
 	sock = get_socket(listener, argc, argv, NULL);
 	if (!sock) return 0;
 
 	if (sock->type != RAD_LISTEN_AUTH) auth = false;
 
-	return command_print_stats(listener, &sock->stats, auth, 0);
+	rcode = command_print_stats(listener, &sock->stats, auth, 0);
+
+	data = sock->data;
+	if (data->proto == IPPROTO_UDP) {
+		cprintf(listener, "kernel_drops\t%" PRIu64 "\n", __atomic_load_n(&data->drops, __ATOMIC_RELAXED));
+		cprintf(listener, "recv_buff\t%u\n", __atomic_load_n(&data->recv_buff_now, __ATOMIC_RELAXED));
+	}
+
+	return rcode;
 }
 #endif	/* WITH_STATS */
 
@@ -2951,6 +3143,35 @@ static int command_add_client_file(rad_listen_t *listener, int argc, char *argv[
 		return 0;
 	}
 
+	listen_client_filter_update();
+
+	return CMD_OK;
+}
+
+
+static int command_add_client_reload(rad_listen_t *listener, int argc, char *argv[])
+{
+	int num;
+
+	if (argc < 1) {
+		cprintf_error(listener, "<file> is required\n");
+		return 0;
+	}
+
+	/*
+	 *	Only the changes are applied.  Unchanged clients
+	 *	are left alone.
+	 */
+	num = client_file_reload(argv[0]);
+	if (num < 0) {
+		cprintf_error(listener, "Failed reloading %s: see the server logs for details.\n", argv[0]);
+		return 0;
+	}
+
+	listen_client_filter_update();
+
+	cprintf(listener, "%d clients\n", num);
+
 	return CMD_OK;
 }
 
@@ -3004,6 +3225,10 @@ static fr_command_table_t command_table_add_client[] = {
 	  "add client file <filename> - Add new client definition from <filename>",
 	  command_add_client_file, NULL },
 
+	{ "reload", FR_WRITE,
+	  "add client reload <filename> - Add, change and delete clients to match a client_file",
+	  command_add_client_reload, NULL },
+
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
@@ -3055,6 +3280,14 @@ static fr_command_table_t command_table_set_listeners[] = {
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
+static fr_command_table_t command_table_set_trace[] = {
+	{ "sample_rate", FR_WRITE,
+	  "set trace sample_rate <rate> - trace one in every <rate> requests, 0 to disable",
+	  command_set_trace_sample_rate, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
 static fr_command_table_t command_table_set[] = {
 	{ "module", FR_WRITE,
 	  "set module <command> - set module commands",
@@ -3067,6 +3300,9 @@ static fr_command_table_t command_table_set[] = {
 	{ "listener", FR_WRITE,
 	  "set listener <command> - set listener commands",
 	  NULL, command_table_set_listeners },
+	{ "trace", FR_WRITE,
+	  "set trace <command> - set request tracing commands",
+	  NULL, command_table_set_trace },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
@@ -3074,7 +3310,7 @@ static fr_command_table_t command_table_set[] = {
 
 #ifdef WITH_STATS
 static fr_command_table_t command_table_stats[] = {
-	{ "client", FR_READ,
+	{ "client", FR_READ | FR_ASYNC,
 	  "stats client [auth/acct] <ipaddr> [udp|tcp] [listen <ipaddr> <port>] "
 	  "- show statistics for given client, or for all clients (auth or acct)",
 	  command_stats_client, NULL },
@@ -3086,11 +3322,15 @@ static fr_command_table_t command_table_stats[] = {
 #endif
 
 #ifdef WITH_PROXY
-	{ "home_server", FR_READ,
+	{ "home_server", FR_READ | FR_ASYNC,
 	  "stats home_server [<ipaddr>|auth|acct|coa|disconnect] <port> [udp|tcp] - show statistics for given home server (ipaddr and port), or for all home servers (auth or acct)",
 	  command_stats_home_server, NULL },
 #endif
 
+	{ "module", FR_READ,
+	  "stats module <module> - show call counts, results and latency for each method of a module",
+	  command_stats_module, NULL },
+
 	{ "state", FR_READ,
 	  "stats state - show statistics for states",
 	  command_stats_state, NULL },
@@ -3256,6 +3496,10 @@ static int command_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+#if defined(WITH_STATS) && defined(WITH_TCP)
+	if (cf_section_parse(cs, sock, command_tcp_config) < 0) return -1;
+#endif
+
 	return 0;
 }
 
@@ -3384,6 +3628,151 @@ static void print_help(rad_listen_t *listener, int argc, char *argv[],
 
 #define MAX_ARGV (16)
 
+/** Called in the main thread when a helper thread has finished a command
+ *
+ */
+static void command_async_done(UNUSED fr_event_list_t *el, int fd, UNUSED void *ctx)
+{
+	command_async_t *job;
+
+	while (read(fd, &job, sizeof(job)) == sizeof(job)) {
+		command_async_running--;
+
+		if (job->failed) {
+			command_close_socket(job->listener);
+		} else {
+			/*
+			 *	Start reading commands from the socket again.
+			 */
+			job->listener->status = RAD_LISTEN_STATUS_RESUME;
+			radius_update_listener(job->listener);
+		}
+
+		talloc_free(job);
+	}
+}
+
+static void *command_async_thread(void *arg)
+{
+	command_async_t	*job = arg;
+	int		fd = job->listener->fd;
+	int		flags;
+	uint32_t	status;
+
+	command_async_current = job;
+
+	/*
+	 *	Nothing else is using the socket, so we can block
+	 *	until the client has read the output, instead of
+	 *	dropping it.
+	 */
+	flags = fcntl(fd, F_GETFL, NULL);
+	fr_blocking(fd);
+
+	status = job->func(job->listener, job->argc, job->argv);
+
+	if (!job->failed &&
+	    (fr_conduit_write(fd, FR_CONDUIT_CMD_STATUS, &status, sizeof(status)) <= 0)) job->failed = true;
+
+	if (flags >= 0) (void) fcntl(fd, F_SETFL, flags);
+
+	command_async_current = NULL;
+
+	while (write(command_async_pipe[1], &job, sizeof(job)) < 0) {
+		if (errno == EINTR) continue;
+
+		/*
+		 *	The socket can never be used again, but at
+		 *	least the server keeps running.
+		 */
+		ERROR("Failed signalling end of command: %s", fr_syserror(errno));
+		break;
+	}
+
+	return NULL;
+}
+
+/** Run a command on a helper thread
+ *
+ * @param[in] listener	the command was read from.
+ * @param[in] func	to run.
+ * @param[in] argc	number of arguments.
+ * @param[in] argv	arguments.
+ * @return
+ *	- 0 if the command is running on a helper thread.
+ *	- -1 if it couldn't be started, and should be run inline.
+ */
+static int command_async_start(rad_listen_t *listener, fr_command_func_t func, int argc, char *argv[])
+{
+	command_async_t	*job;
+	pthread_attr_t	attr;
+	pthread_t	pthread_id;
+	int		i, rcode;
+
+	if (command_async_pipe[0] < 0) {
+		fr_event_list_t *el = radius_event_list_corral(EVENT_CORRAL_MAIN);
+
+		if (!el) return -1;
+
+		if (pipe(command_async_pipe) < 0) {
+			ERROR("Failed creating pipe for commands: %s", fr_syserror(errno));
+			return -1;
+		}
+		fr_nonblock(command_async_pipe[0]);
+
+		if (fr_event_fd_insert(el, command_async_pipe[0], command_async_done, NULL, NULL, NULL) < 0) {
+			ERROR("Failed adding command pipe to event loop: %s", fr_strerror());
+			close(command_async_pipe[0]);
+			close(command_async_pipe[1]);
+			command_async_pipe[0] = command_async_pipe[1] = -1;
+			return -1;
+		}
+	}
+
+	job = talloc_zero(NULL, command_async_t);
+	if (!job) return -1;
+
+	job->listener = listener;
+	job->func = func;
+	job->argc = argc;
+	job->argv = talloc_array(job, char *, argc + 1);
+	if (!job->argv) {
+	error:
+		talloc_free(job);
+		return -1;
+	}
+
+	for (i = 0; i < argc; i++) {
+		job->argv[i] = talloc_typed_strdup(job->argv, argv[i]);
+		if (!job->argv[i]) goto error;
+	}
+	job->argv[argc] = NULL;
+
+	/*
+	 *	Stop reading from the socket, so the next command
+	 *	isn't run in the main thread, while this one is still
+	 *	writing its output.
+	 */
+	listener->status = RAD_LISTEN_STATUS_PAUSE;
+	radius_update_listener(listener);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rcode = pthread_create(&pthread_id, &attr, command_async_thread, job);
+	pthread_attr_destroy(&attr);
+
+	if (rcode != 0) {
+		ERROR("Failed creating thread for command: %s", fr_syserror(rcode));
+		listener->status = RAD_LISTEN_STATUS_RESUME;
+		radius_update_listener(listener);
+		goto error;
+	}
+
+	command_async_running++;
+
+	return 0;
+}
+
 /*
  *	Check if an incoming request is "ok"
  *
@@ -3483,6 +3872,26 @@ static int command_domain_recv_co(rad_listen_t *listener, fr_cs_buffer_t *co)
 				goto do_next;
 			}
 
+			/*
+			 *	Commands which walk large structures are
+			 *	run on a helper thread, which also sends
+			 *	the status.
+			 */
+			if (((table[i].mode & FR_ASYNC) != 0) &&
+			    (command_async_start(listener, table[i].func, argc - 1, argv + 1) == 0)) {
+				co->offset = 0;
+				return 0;
+			}
+
+			/*
+			 *	Don't change anything a helper thread may
+			 *	be reading.
+			 */
+			if (((table[i].mode & FR_WRITE) != 0) && (command_async_running > 0)) {
+				cprintf_error(listener, "A command is running in the background.  Try again later.\n");
+				goto do_next;
+			}
+
 			status = table[i].func(listener, argc - 1, argv + 1);
 			goto do_next;
 		}
@@ -3658,6 +4067,85 @@ static int command_magic_recv(rad_listen_t *this, fr_cs_buffer_t *co, bool chall
 	return 1;
 }
 
+#if defined(WITH_STATS) && defined(WITH_TCP)
+/** Write all of a buffer to a socket, giving up if the peer is too slow
+ *
+ */
+static int command_metrics_write(int fd, char const *buffer, size_t len)
+{
+	while (len > 0) {
+		ssize_t r;
+
+		r = write(fd, buffer, len);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		buffer += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/** Answer an HTTP request for the server statistics
+ *
+ * Only "GET /metrics" is supported.  We answer with HTTP/1.0, and close the connection after
+ * the response, so we don't need to parse anything after the request line.
+ */
+static int command_metrics_recv(rad_listen_t *this)
+{
+	char		buffer[1024];
+	char		header[256];
+	char		*metrics = NULL;
+	char const	*status = "200 OK";
+	size_t		len = 0;
+	ssize_t		r;
+	struct timeval	tv = { 1, 0 };
+
+	r = read(this->fd, buffer, sizeof(buffer) - 1);
+	if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN))) return 0;
+	if (r <= 0) goto done;
+	buffer[r] = '\0';
+
+	if ((strncmp(buffer, "GET /metrics", 12) != 0) ||
+	    ((buffer[12] != ' ') && (buffer[12] != '?') && (buffer[12] != '\r'))) {
+		status = "404 Not Found";
+	} else {
+		metrics = radius_stats_openmetrics(NULL);
+		if (!metrics) {
+			status = "500 Internal Server Error";
+		} else {
+			len = talloc_array_length(metrics) - 1;
+		}
+	}
+
+	snprintf(header, sizeof(header),
+		 "HTTP/1.0 %s\r\n"
+		 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n\r\n", status, len);
+
+	/*
+	 *	We're in the main thread, so don't let a slow
+	 *	client stop us from doing anything else.
+	 */
+	fr_blocking(this->fd);
+	(void) setsockopt(this->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if ((command_metrics_write(this->fd, header, strlen(header)) < 0) ||
+	    (metrics && (command_metrics_write(this->fd, metrics, len) < 0))) {
+		ERROR("Failed writing metrics: %s", fr_syserror(errno));
+	}
+	talloc_free(metrics);
+
+done:
+	command_close_socket(this);
+	return 0;
+}
+#endif
+
 static int command_init_recv(rad_listen_t *this)
 {
 	int rcode;
@@ -3671,6 +4159,27 @@ static int command_init_recv(rad_listen_t *this)
 	} else {
 		listen_socket_t *sock2 = this->data;
 
+#if defined(WITH_STATS) && defined(WITH_TCP)
+		/*
+		 *	radmin starts with binary magic, so it's
+		 *	easy to tell a metrics scraper apart.
+		 */
+		if (sock2->metrics) {
+			char	peek[4];
+			ssize_t	r;
+
+			r = recv(this->fd, peek, sizeof(peek), MSG_PEEK);
+			if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN))) return 0;
+
+			if ((r > 0) && (memcmp(peek, "GET ", r) == 0)) {
+				if (r < (ssize_t) sizeof(peek)) return 0;
+
+				this->recv = command_metrics_recv;
+				return command_metrics_recv(this);
+			}
+		}
+#endif
+
 		rcode = command_magic_recv(this, (fr_cs_buffer_t *) sock2->packet, true);
 		if (rcode <= 0) return rcode;
 
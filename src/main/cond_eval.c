@@ -185,8 +185,8 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	default:
 		if (!rad_cond_assert(rhs && rhs->type == PW_TYPE_STRING)) return -1;
 		if (!rad_cond_assert(rhs && rhs->datum.strvalue)) return -1;
-		slen = regex_compile(request, &rreg, rhs->datum.strvalue, rhs->length,
-				     map->rhs->tmpl_iflag, map->rhs->tmpl_mflag, true, true);
+		slen = regex_compile_cached(&rreg, rhs->datum.strvalue, rhs->length,
+					    map->rhs->tmpl_iflag, map->rhs->tmpl_mflag, true);
 		if (slen <= 0) {
 			REMARKER(rhs->datum.strvalue, -slen, fr_strerror());
 			EVAL_DEBUG("FAIL %d", __LINE__);
@@ -197,7 +197,15 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 		break;
 	}
 
-	ret = regex_exec(preg, lhs->datum.strvalue, lhs->length, rxmatch, &nmatch);
+	/*
+	 *	Remember the results of pre-compiled patterns, as
+	 *	policies often test the same values many times.
+	 */
+	if (!rreg) {
+		ret = regex_exec_request(request, preg, lhs->datum.strvalue, lhs->length, rxmatch, &nmatch);
+	} else {
+		ret = regex_exec(preg, lhs->datum.strvalue, lhs->length, rxmatch, &nmatch);
+	}
 	switch (ret) {
 	case 0:
 		EVAL_DEBUG("CLEARING SUBCAPTURES");
@@ -218,7 +226,7 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 		break;
 	}
 
-	if (preg) talloc_free(rreg);
+	regex_cache_release(rreg);
 
 	return ret;
 }
@@ -381,6 +389,88 @@ done:
 }
 
 
+/** Compare an attribute with pre-parsed data of the same type
+ *
+ * Avoids the casting and the generic comparison code for the common case
+ * of <attribute> <op> <value>, where pass2 has already converted the value
+ * to the type of the attribute.
+ *
+ * @param[in] op	to apply.
+ * @param[in] lhs	value of the attribute.
+ * @param[in] rhs	pre-parsed value.
+ * @return
+ *	- -1 if the types or operator can't be handled here.
+ *	- 0 for "no match".
+ *	- 1 for "match".
+ */
+static inline int cond_cmp_fast(FR_TOKEN op, value_box_t const *lhs, value_box_t const *rhs)
+{
+	uint64_t a, b;
+
+	if (lhs->type != rhs->type) return -1;
+
+	switch (lhs->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		if ((op != T_OP_CMP_EQ) && (op != T_OP_NE)) return -1;
+
+		a = ((lhs->length == rhs->length) &&
+		     (memcmp(lhs->datum.octets, rhs->datum.octets, lhs->length) == 0));
+		return (op == T_OP_CMP_EQ) ? a : !a;
+
+	case PW_TYPE_BYTE:
+		a = lhs->datum.byte;
+		b = rhs->datum.byte;
+		break;
+
+	case PW_TYPE_SHORT:
+		a = lhs->datum.ushort;
+		b = rhs->datum.ushort;
+		break;
+
+	case PW_TYPE_INTEGER:
+		a = lhs->datum.integer;
+		b = rhs->datum.integer;
+		break;
+
+	case PW_TYPE_DATE:
+		a = lhs->datum.date;
+		b = rhs->datum.date;
+		break;
+
+	case PW_TYPE_INTEGER64:
+		a = lhs->datum.integer64;
+		b = rhs->datum.integer64;
+		break;
+
+	default:
+		return -1;
+	}
+
+	switch (op) {
+	case T_OP_CMP_EQ:
+		return (a == b);
+
+	case T_OP_NE:
+		return (a != b);
+
+	case T_OP_LT:
+		return (a < b);
+
+	case T_OP_LE:
+		return (a <= b);
+
+	case T_OP_GT:
+		return (a > b);
+
+	case T_OP_GE:
+		return (a >= b);
+
+	default:
+		return -1;
+	}
+}
+
 /** Convert both operands to the same type
  *
  * If casting is successful, we call cond_cmp_values to do the comparison
@@ -634,6 +724,8 @@ int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_c
 	{
 		VALUE_PAIR *vp;
 		vp_cursor_t cursor;
+		bool fast;
+
 		/*
 		 *	Legacy paircompare call, skip processing the magic attribute
 		 *	if it's the LHS and cast RHS to the same type.
@@ -645,6 +737,16 @@ int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_c
 			rcode = cond_normalise_and_cmp(request, c, NULL);
 			break;
 		}
+
+		/*
+		 *	The RHS was converted to the type of the LHS
+		 *	when the condition was compiled, so we can
+		 *	usually compare the values directly.
+		 */
+		fast = ((map->lhs->type == TMPL_TYPE_ATTR) && (map->rhs->type == TMPL_TYPE_DATA) &&
+			(map->rhs->tmpl_value_box_type == map->lhs->tmpl_da->type) &&
+			(!c->cast || (c->cast->type == map->lhs->tmpl_da->type)));
+
 		for (vp = tmpl_cursor_init(&rcode, &cursor, request, map->lhs);
 		     vp;
 	     	     vp = tmpl_cursor_next(&cursor, map->lhs)) {
@@ -653,6 +755,11 @@ int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_c
 			 *	if we get at least one set of operands that
 			 *	evaluates to true.
 			 */
+			if (fast) {
+				rcode = cond_cmp_fast(map->op, &vp->data, &map->rhs->tmpl_value_box);
+				if (rcode > 0) break;
+				if (rcode == 0) continue;
+			}
 	     		rcode = cond_normalise_and_cmp(request, c, &vp->data);
 	     		if (rcode != 0) break;
 		}
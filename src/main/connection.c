@@ -32,11 +32,28 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trace.h>
 
 typedef struct fr_connection fr_connection_t;
+typedef struct fr_connection_waiter fr_connection_waiter_t;
 
 static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request);
 
+/*
+ *	Pools which are only used by a single thread don't need locking.
+ */
+#define POOL_LOCK(_pool)	do { if (!(_pool)->el) pthread_mutex_lock(&(_pool)->mutex); } while (0)
+#define POOL_UNLOCK(_pool)	do { if (!(_pool)->el) pthread_mutex_unlock(&(_pool)->mutex); } while (0)
+
+#define CONNECTION_WARMUP_THREADS	(16)	//!< Maximum number of threads opening the initial connections.
+#define CONNECTION_RATE_SCALE		(256)	//!< Fixed point scale for the reservation rate.
+
+/*
+ *	The condition waits are never reached for these pools, as
+ *	nothing else can be spawning connections, or reconnecting
+ *	the pool, whilst the owning thread is running.
+ */
+
 /** An individual connection within the connection pool
  *
  * Defines connection counters, timestamps, and holds a pointer to the
@@ -70,6 +87,22 @@ struct fr_connection {
 #endif
 };
 
+/** A request waiting for a connection in a thread local pool
+ *
+ */
+struct fr_connection_waiter {
+	fr_connection_waiter_t	*prev;		//!< Previous waiter in list.
+	fr_connection_waiter_t	*next;		//!< Next waiter in list.
+
+	fr_connection_pool_t	*pool;		//!< The pool we're waiting on.
+	REQUEST			*request;	//!< The request which is waiting.
+
+	fr_connection_t		*this;		//!< The connection reserved for the request.
+						//!< NULL if we gave up waiting.
+	fr_event_timer_t	*ev;		//!< When we give up waiting.
+	bool			done;		//!< The request has been woken up.
+};
+
 /** A connection pool
  *
  * Defines the configuration of the connection pool, all the counters and
@@ -105,6 +138,14 @@ struct fr_connection_pool_t {
 
 	bool		spread;			//!< If true we spread requests over the connections,
 						//!< using the connection released longest ago, first.
+	bool		parallel_start;		//!< Open the initial connections in parallel.
+	bool		predictive;		//!< Open connections based on how many we expect to need.
+
+	time_t		rate_second;		//!< The second rate_count is for.
+	uint32_t	rate_count;		//!< Number of connections reserved during rate_second.
+	uint64_t	rate_ewma;		//!< Moving average of connections reserved per second,
+						//!< multiplied by CONNECTION_RATE_SCALE.
+	uint64_t	held_ewma;		//!< Moving average of how long connections are held for (usec).
 
 	fr_heap_t	*heap;			//!< For the next connection heap
 
@@ -139,6 +180,14 @@ struct fr_connection_pool_t {
 	fr_connection_pool_reconnect_t	reconnect;	//!< Called during connection pool reconnect.
 
 	fr_connection_pool_state_t	state;	//!< Stats and state of the connection pool.
+
+	fr_event_list_t	*el;			//!< If set, the pool is only used by the thread servicing
+						//!< this event list.  No locking is done, and requests
+						//!< may wait for connections via #fr_connection_get_async.
+	fr_connection_wake_t wake;		//!< Resumes requests which were waiting.
+	fr_event_timer_t *spawn_ev;		//!< Spawn a connection for waiting requests.
+	fr_connection_waiter_t *wait_head;	//!< Requests waiting for a connection, oldest first.
+	fr_connection_waiter_t *wait_tail;	//!< Requests waiting for a connection, newest last.
 };
 
 static const CONF_PARSER connection_config[] = {
@@ -157,6 +206,8 @@ static const CONF_PARSER connection_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", PW_TYPE_TIMEVAL, fr_connection_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", PW_TYPE_INTEGER, fr_connection_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", PW_TYPE_BOOLEAN, fr_connection_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("parallel_start", PW_TYPE_BOOLEAN, fr_connection_pool_t, parallel_start), .dflt = "yes" },
+	{ FR_CONF_OFFSET("predictive", PW_TYPE_BOOLEAN, fr_connection_pool_t, predictive), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -288,7 +339,7 @@ static fr_connection_t *fr_connection_find(fr_connection_pool_t *pool, void *con
 
 	if (!pool || !conn) return NULL;
 
-	pthread_mutex_lock(&pool->mutex);
+	POOL_LOCK(pool);
 
 	/*
 	 *	FIXME: This loop could be avoided if we passed a 'void
@@ -309,7 +360,7 @@ static fr_connection_t *fr_connection_find(fr_connection_pool_t *pool, void *con
 		}
 	}
 
-	pthread_mutex_unlock(&pool->mutex);
+	POOL_UNLOCK(pool);
 	return NULL;
 }
 
@@ -348,14 +399,14 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 	 */
 	if ((pool->state.num == 0) && pool->state.pending && pool->state.last_failed) return NULL;
 
-	pthread_mutex_lock(&pool->mutex);
+	POOL_LOCK(pool);
 	rad_assert(pool->state.num <= pool->max);
 
 	/*
 	 *	Don't spawn too many connections at the same time.
 	 */
 	if ((pool->state.num + pool->state.pending) >= pool->max) {
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 
 		ROPTIONAL(RERROR, ERROR, "Cannot open new connection, already at max");
 		return NULL;
@@ -374,7 +425,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 			pool->state.last_throttled = now;
 		}
 
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 
 		if (!RATE_LIMIT_ENABLED || complain) {
 			ROPTIONAL(RERROR, ERROR, "Last connection attempt failed, waiting %d seconds before retrying",
@@ -388,7 +439,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 	 *	We limit the rate of new connections after a failed attempt.
 	 */
 	if (pool->state.pending > pool->pending_window) {
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 		RATE_LIMIT(ROPTIONAL(RWARN, WARN, "Cannot open a new connection due to rate limit after failure"));
 
 		return NULL;
@@ -410,7 +461,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 	 *	that case, we want the other connections to continue
 	 *	to be used.
 	 */
-	pthread_mutex_unlock(&pool->mutex);
+	POOL_UNLOCK(pool);
 
 	/*
 	 *	The true value for pending_window is the smaller of
@@ -439,7 +490,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 		ROPTIONAL(RERROR, ERROR, "Opening connection failed (%" PRIu64 ")", number);
 
 		pool->state.last_failed = now;
-		pthread_mutex_lock(&pool->mutex);
+		POOL_LOCK(pool);
 		pool->pending_window = 1;
 		pool->state.pending--;
 
@@ -449,7 +500,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 		 */
 		fr_connection_trigger_exec(pool, request, "fail");
 		pthread_cond_broadcast(&pool->done_spawn);
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 
 		talloc_free(ctx);
 
@@ -460,12 +511,12 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 	 *	And lock the mutex again while we link the new
 	 *	connection back into the pool.
 	 */
-	pthread_mutex_lock(&pool->mutex);
+	POOL_LOCK(pool);
 
 	this = talloc_zero(pool, fr_connection_t);
 	if (!this) {
 		pthread_cond_broadcast(&pool->done_spawn);
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 
 		talloc_free(ctx);
 
@@ -520,7 +571,7 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, REQUEST
 	fr_connection_trigger_exec(pool, request, "open");
 
 	pthread_cond_broadcast(&pool->done_spawn);
-	if (unlock) pthread_mutex_unlock(&pool->mutex);
+	if (unlock) POOL_UNLOCK(pool);
 
 	return this;
 }
@@ -634,6 +685,67 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
 }
 
 
+/** Fold the reservations counted so far into the moving average
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	to update.
+ * @param[in] now	Current time.
+ */
+static void fr_connection_rate_update(fr_connection_pool_t *pool, time_t now)
+{
+	time_t		elapsed;
+	uint64_t	sample;
+
+	if (now == pool->rate_second) return;
+
+	if (!pool->rate_second) {
+		pool->rate_second = now;
+		pool->rate_count = 0;
+		return;
+	}
+
+	/*
+	 *	Each second with no reservations is a zero sample.
+	 *	After 32 of them the average is close enough to zero.
+	 */
+	elapsed = now - pool->rate_second;
+	if (elapsed > 32) elapsed = 32;
+
+	sample = (uint64_t)pool->rate_count * CONNECTION_RATE_SCALE;
+	while (elapsed-- > 0) {
+		pool->rate_ewma = pool->rate_ewma - (pool->rate_ewma >> 3) + (sample >> 3);
+		sample = 0;
+	}
+
+	pool->rate_second = now;
+	pool->rate_count = 0;
+}
+
+/** Predict how many connections we'll need
+ *
+ * The average number of connections in use is the rate they're reserved
+ * at, multiplied by how long they're held for (Little's law).  We add
+ * "spare" to that, so that bursts don't have to wait for new connections.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	to predict connections for.
+ * @return the number of connections we should have open.
+ */
+static uint32_t fr_connection_pool_predict(fr_connection_pool_t *pool)
+{
+	uint64_t	in_use;
+	uint64_t	scale = (uint64_t)CONNECTION_RATE_SCALE * 1000000;
+
+	in_use = ((pool->rate_ewma * pool->held_ewma) + scale - 1) / scale;
+	in_use += pool->spare;
+
+	if (in_use > pool->max) return pool->max;
+
+	return in_use;
+}
+
 /** Check whether any connections need to be removed from the pool
  *
  * Maintains the number of connections in the pool as per the configuration
@@ -655,7 +767,7 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 	fr_connection_t *this, *next;
 
 	if (pool->state.last_checked == now) {
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 		return 1;
 	}
 
@@ -744,14 +856,45 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 		/* leave extra alone from above */
 	}
 
+	/*
+	 *	Open the connections we expect to need, before
+	 *	requests have to wait for them.  And don't close
+	 *	connections we expect to need soon.
+	 */
+	if (pool->predictive) {
+		uint32_t predicted, total;
+
+		fr_connection_rate_update(pool, now);
+
+		predicted = fr_connection_pool_predict(pool);
+		total = pool->state.num + pool->state.pending;
+
+		if (total < predicted) {
+			if (spawn < (predicted - total)) {
+				spawn = predicted - total;
+				ROPTIONAL(RDEBUG2, DEBUG2, "Need %i more connections to reach %i predicted",
+					  spawn, predicted);
+			}
+			extra = 0;
+
+		} else if (extra && ((pool->state.num - extra) < predicted)) {
+			extra = (pool->state.num > predicted) ? (pool->state.num - predicted) : 0;
+		}
+	}
+
 	/*
 	 *	Only try to open spares if we're not already attempting to open
 	 *	a connection. Avoids spurious log messages.
+	 *
+	 *	When predicting, open all of the connections we need,
+	 *	so that ramp-ups don't open one connection a second.
 	 */
 	if (spawn) {
-		pthread_mutex_unlock(&pool->mutex);
-		(void) fr_connection_spawn(pool, request, now, false, true);
-		pthread_mutex_lock(&pool->mutex);
+		POOL_UNLOCK(pool);
+		do {
+			if (!fr_connection_spawn(pool, request, now, false, true)) break;
+		} while (pool->predictive && (--spawn > 0));
+		POOL_LOCK(pool);
 	}
 
 	/*
@@ -795,33 +938,26 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 
 	pool->state.last_checked = now;
 done:
-	pthread_mutex_unlock(&pool->mutex);
+	POOL_UNLOCK(pool);
 
 	return 1;
 }
 
-/** Get a connection from the connection pool
+/** Find a free connection which is still usable
  *
- * @note Must be called with the mutex free.
+ * @note Must be called with the mutex held.
  *
- * @param[in] pool	to reserve the connection from.
+ * @param[in] pool	to search.
  * @param[in] request	The current request.
- * @param[in] spawn	whether to spawn a new connection
+ * @param[in] now	Current time.
  * @return
- *	- A pointer to the connection handle.
- *	- NULL on error.
+ *	- A connection, which has been removed from the heap.
+ *	- NULL if there are no free connections.
  */
-static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *request, bool spawn)
+static fr_connection_t *fr_connection_get_free(fr_connection_pool_t *pool, REQUEST *request, time_t now)
 {
-	time_t now;
 	fr_connection_t *this;
 
-	if (!pool) return NULL;
-
-	pthread_mutex_lock(&pool->mutex);
-
-	now = time(NULL);
-
 	/*
 	 *	Grab the link with the lowest latency, and check it
 	 *	for limits.  If "connection manage" says the link is
@@ -829,17 +965,64 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 	 */
 	do {
 		this = fr_heap_peek(pool->heap);
-		if (!this) break;
+		if (!this) return NULL;
 	} while (!fr_connection_manage(pool, request, this, now));
 
 	/*
 	 *	We have a working connection.  Extract it from the
 	 *	heap and use it.
 	 */
-	if (this) {
-		fr_heap_extract(pool->heap, this);
-		goto do_return;
-	}
+	fr_heap_extract(pool->heap, this);
+
+	return this;
+}
+
+/** Mark a connection as reserved
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] this	connection to reserve.
+ */
+static void fr_connection_reserve(fr_connection_pool_t *pool, fr_connection_t *this)
+{
+	pool->state.active++;
+	this->num_uses++;
+	gettimeofday(&this->last_reserved, NULL);
+	this->in_use = true;
+
+	fr_connection_rate_update(pool, this->last_reserved.tv_sec);
+	pool->rate_count++;
+
+#ifdef PTHREAD_DEBUG
+	this->pthread_id = pthread_self();
+#endif
+}
+
+/** Get a connection from the connection pool
+ *
+ * @note Must be called with the mutex free.
+ *
+ * @param[in] pool	to reserve the connection from.
+ * @param[in] request	The current request.
+ * @param[in] spawn	whether to spawn a new connection
+ * @return
+ *	- A pointer to the connection handle.
+ *	- NULL on error.
+ */
+static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *request, bool spawn)
+{
+	time_t now;
+	fr_connection_t *this;
+
+	if (!pool) return NULL;
+
+	POOL_LOCK(pool);
+
+	now = time(NULL);
+
+	this = fr_connection_get_free(pool, request, now);
+	if (this) goto do_return;
 
 	/*
 	 *	We don't have a connection.  Try to open a new one.
@@ -857,7 +1040,7 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 			pool->state.last_at_max = now;
 		}
 
-		pthread_mutex_unlock(&pool->mutex);
+		POOL_UNLOCK(pool);
 		if (!RATE_LIMIT_ENABLED || complain) {
 			ROPTIONAL(RERROR, ERROR, "No connections available and at max connection limit");
 			/*
@@ -870,7 +1053,7 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 		return NULL;
 	}
 
-	pthread_mutex_unlock(&pool->mutex);
+	POOL_UNLOCK(pool);
 
 	if (!spawn) return NULL;
 
@@ -884,21 +1067,220 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 	if (!this) return NULL;
 
 do_return:
-	pool->state.active++;
-	this->num_uses++;
-	gettimeofday(&this->last_reserved, NULL);
-	this->in_use = true;
-
-#ifdef PTHREAD_DEBUG
-	this->pthread_id = pthread_self();
-#endif
-	pthread_mutex_unlock(&pool->mutex);
+	fr_connection_reserve(pool, this);
+	POOL_UNLOCK(pool);
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
 
 	return this->connection;
 }
 
+/** Remove a waiter from the pool's list of waiters
+ *
+ * @param[in] pool	the request was waiting on.
+ * @param[in] w		waiter to remove.
+ */
+static void fr_connection_waiter_unlink(fr_connection_pool_t *pool, fr_connection_waiter_t *w)
+{
+	if (w->prev) {
+		w->prev->next = w->next;
+	} else {
+		rad_assert(pool->wait_head == w);
+		pool->wait_head = w->next;
+	}
+	if (w->next) {
+		w->next->prev = w->prev;
+	} else {
+		rad_assert(pool->wait_tail == w);
+		pool->wait_tail = w->prev;
+	}
+
+	w->prev = w->next = NULL;
+}
+
+/** Stop a request waiting, and mark it as resumable
+ *
+ * @param[in] w		waiter to wake up.
+ * @param[in] this	connection reserved for the request, or NULL if it's not getting one.
+ */
+static void fr_connection_waiter_wake(fr_connection_waiter_t *w, fr_connection_t *this)
+{
+	fr_connection_pool_t *pool = w->pool;
+
+	rad_assert(!w->done);
+
+	fr_connection_waiter_unlink(pool, w);
+	if (w->ev) fr_event_timer_delete(pool->el, &w->ev);
+
+	w->this = this;
+	w->done = true;
+
+	pool->wake(w->request);
+}
+
+/** Free a waiter, returning any connection the request didn't collect
+ *
+ */
+static int _fr_connection_waiter_free(fr_connection_waiter_t *w)
+{
+	fr_connection_pool_t *pool = w->pool;
+
+	if (!w->done) {
+		fr_connection_waiter_unlink(pool, w);
+		if (w->ev) fr_event_timer_delete(pool->el, &w->ev);
+	}
+
+	if (w->this) fr_connection_release(pool, NULL, w->this->connection);
+
+	return 0;
+}
+
+/** Hand free connections to waiting requests
+ *
+ * @note Only called for thread local pools.
+ *
+ * @param[in] pool	to service.
+ */
+static void fr_connection_waiters_service(fr_connection_pool_t *pool)
+{
+	fr_connection_t	*this;
+	time_t		now = time(NULL);
+
+	while (pool->wait_head) {
+		REQUEST *request = pool->wait_head->request;
+
+		this = fr_connection_get_free(pool, request, now);
+		if (!this) break;
+
+		fr_connection_reserve(pool, this);
+		RDEBUG2("Reserved connection (%" PRIu64 ") after waiting", this->number);
+
+		fr_connection_waiter_wake(pool->wait_head, this);
+	}
+}
+
+/** Called when a waiting request gives up
+ *
+ */
+static void fr_connection_waiter_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	fr_connection_waiter_t	*w = talloc_get_type_abort(ctx, fr_connection_waiter_t);
+	REQUEST			*request = w->request;
+
+	RERROR("Timed out waiting for a connection");
+
+	fr_connection_waiter_wake(w, NULL);
+}
+
+static void fr_connection_spawn_event(struct timeval *now, void *ctx);
+
+/** Schedule a connection to be spawned from the event loop
+ *
+ * @param[in] pool	to spawn a connection in.
+ * @param[in] now	Current time.
+ * @return
+ *	- 0 on success (or if a connection didn't need to be spawned).
+ *	- -1 on failure.
+ */
+static int fr_connection_spawn_schedule(fr_connection_pool_t *pool, struct timeval *now)
+{
+	if (pool->spawn_ev) return 0;
+
+	if ((pool->state.num + pool->state.pending) >= pool->max) return 0;
+
+	return fr_event_timer_insert(pool->el, fr_connection_spawn_event, pool, now, &pool->spawn_ev);
+}
+
+/** Spawn a connection for waiting requests
+ *
+ * Runs from the event loop, so that the request which needed the
+ * connection isn't the one blocked opening it.
+ */
+static void fr_connection_spawn_event(struct timeval *now, void *ctx)
+{
+	fr_connection_pool_t	*pool = talloc_get_type_abort(ctx, fr_connection_pool_t);
+	fr_connection_t		*this;
+
+	if (!pool->wait_head) return;
+
+	this = fr_connection_spawn(pool, NULL, now->tv_sec, false, true);
+	if (!this) {
+		/*
+		 *	Nothing is going to be released, so there's
+		 *	no point in the requests waiting.
+		 */
+		if (pool->state.num == 0) while (pool->wait_head) fr_connection_waiter_wake(pool->wait_head, NULL);
+		return;
+	}
+
+	fr_connection_waiters_service(pool);
+
+	if (pool->wait_head) (void) fr_connection_spawn_schedule(pool, now);
+}
+
+/** Shared state for the threads opening a pool's initial connections
+ *
+ */
+typedef struct {
+	fr_connection_pool_t	*pool;		//!< Pool being warmed up.
+	time_t			now;		//!< When we started.
+	uint32_t		next;		//!< Number of connections claimed by the threads.
+	uint32_t		failed;		//!< Number of connections which failed to open.
+} fr_connection_warmup_t;
+
+static void *fr_connection_warmup_thread(void *arg)
+{
+	fr_connection_warmup_t *warmup = arg;
+
+	while (__atomic_fetch_add(&warmup->next, 1, __ATOMIC_RELAXED) < warmup->pool->start) {
+		if (!fr_connection_spawn(warmup->pool, NULL, warmup->now, false, true)) {
+			__atomic_fetch_add(&warmup->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+/** Open a pool's initial connections
+ *
+ * When parallel_start is set, the connections are opened by several threads
+ * at once, so that startup time isn't the sum of all the connection setup
+ * times.  The create callback must already be thread safe, as connections
+ * are opened by worker threads once the server is running.
+ *
+ * @param[in] pool	to open connections for.
+ * @param[in] now	Current time.
+ * @return
+ *	- 0 if all 'start' connections were opened.
+ *	- -1 on failure.
+ */
+static int fr_connection_pool_warmup(fr_connection_pool_t *pool, time_t now)
+{
+	fr_connection_warmup_t	warmup = { .pool = pool, .now = now };
+	pthread_t		threads[CONNECTION_WARMUP_THREADS];
+	uint32_t		i, num = 0;
+
+	if (pool->parallel_start && (pool->start > 1)) {
+		num = pool->start;
+		if (num > CONNECTION_WARMUP_THREADS) num = CONNECTION_WARMUP_THREADS;
+
+		for (i = 0; i < num; i++) {
+			if (pthread_create(&threads[i], NULL, fr_connection_warmup_thread, &warmup) != 0) break;
+		}
+		num = i;
+	}
+
+	/*
+	 *	Open whatever the threads haven't claimed, which
+	 *	is everything if we couldn't create any threads.
+	 */
+	fr_connection_warmup_thread(&warmup);
+
+	for (i = 0; i < num; i++) pthread_join(threads[i], NULL);
+
+	return warmup.failed ? -1 : 0;
+}
+
 /** Enable triggers for a connection pool
  *
  * @param[in] pool		to enable triggers for.
@@ -953,9 +1335,7 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 					      fr_connection_alive_t a,
 					      char const *log_prefix)
 {
-	uint32_t i;
 	fr_connection_pool_t *pool = NULL;
-	fr_connection_t *this;
 	time_t now;
 
 	if (!cs || !opaque || !c) return NULL;
@@ -1105,14 +1485,11 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	 *	Create all of the connections, unless the admin says
 	 *	not to.
 	 */
-	for (i = 0; i < pool->start; i++) {
-		this = fr_connection_spawn(pool, NULL, now, false, true);
-		if (!this) {
-			ERROR("Failed spawning initial connections");
-		error:
-			fr_connection_pool_free(pool);
-			return NULL;
-		}
+	if (fr_connection_pool_warmup(pool, now) < 0) {
+		ERROR("Failed spawning initial connections");
+	error:
+		fr_connection_pool_free(pool);
+		return NULL;
 	}
 
 	fr_connection_trigger_exec(pool, NULL, "start");
@@ -1192,6 +1569,30 @@ void fr_connection_pool_reconnect_func(fr_connection_pool_t *pool, fr_connection
 	pool->reconnect = reconnect;
 }
 
+/** Mark a connection pool as only being used by one thread
+ *
+ * The pool will no longer lock its mutex, and requests may wait for
+ * connections with #fr_connection_get_async, instead of failing when
+ * none are free.  New connections for waiting requests are opened
+ * from the event loop, instead of by the request which needed them.
+ *
+ * @note Should be called from a module's thread_instantiate callback,
+ *	immediately after creating the pool.
+ *
+ * @param[in] pool	to modify.
+ * @param[in] el	The event list serviced by the thread which owns the pool.
+ * @param[in] wake	Called to resume requests which were waiting for a connection,
+ *			usually unlang_resumable().
+ */
+void fr_connection_pool_thread_local(fr_connection_pool_t *pool, fr_event_list_t *el,
+				     fr_connection_wake_t wake)
+{
+	rad_assert(wake);
+
+	pool->el = el;
+	pool->wake = wake;
+}
+
 /** Mark connections for reconnection, and spawn at least 'start' connections
  *
  * @note This call may block whilst waiting for pending connection attempts to complete.
@@ -1213,7 +1614,7 @@ int fr_connection_pool_reconnect(fr_connection_pool_t *pool, REQUEST *request)
 	fr_connection_t	*this;
 	time_t		now;
 
-	pthread_mutex_lock(&pool->mutex);
+	POOL_LOCK(pool);
 
 	/*
 	 *	Pause new spawn attempts (we release the mutex
@@ -1267,7 +1668,7 @@ int fr_connection_pool_reconnect(fr_connection_pool_t *pool, REQUEST *request)
 	 */
 	pool->state.reconnecting = false;
 	pthread_cond_broadcast(&pool->done_reconnecting);
-	pthread_mutex_unlock(&pool->mutex);
+	POOL_UNLOCK(pool);
 
 	now = time(NULL);
 
@@ -1309,7 +1710,12 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 
 	DEBUG2("Removing connection pool");
 
-	pthread_mutex_lock(&pool->mutex);
+	if (pool->el) {
+		if (pool->spawn_ev) fr_event_timer_delete(pool->el, &pool->spawn_ev);
+		while (pool->wait_head) fr_connection_waiter_wake(pool->wait_head, NULL);
+	}
+
+	POOL_LOCK(pool);
 
 	/*
 	 *	Don't loop over the list.  Just keep removing the head
@@ -1358,7 +1764,136 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
  */
 void *fr_connection_get(fr_connection_pool_t *pool, REQUEST *request)
 {
-	return fr_connection_get_internal(pool, request, true);
+	void	*conn;
+	int	span;
+
+	if (!pool) return NULL;
+
+	span = trace_span_start(request, TRACE_SPAN_POOL, pool->log_prefix);
+	FR_PROBE2(pool__get__start, request ? request->number : 0, pool->log_prefix);
+
+	conn = fr_connection_get_internal(pool, request, true);
+
+	trace_span_done(request, span, conn ? RLM_MODULE_OK : RLM_MODULE_FAIL);
+	FR_PROBE3(pool__get__done, request ? request->number : 0, pool->log_prefix, conn != NULL);
+
+	return conn;
+}
+
+/** Reserve a connection, or wait for one to become available
+ *
+ * For thread local pools, if there are no free connections the request
+ * is queued, and 1 is returned.  The caller should then yield,
+ * and call this function again when the request is resumed.  By that
+ * time a connection will either have been released by another request,
+ * or opened from the event loop, or the request will have given up
+ * after waiting for connect_timeout.
+ *
+ * @note For pools which aren't thread local, this is the same as
+ *	#fr_connection_get.
+ *
+@verbatim
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	...
+	switch (fr_connection_get_async(&handle, t->pool, request)) {
+	case 0:
+		break;
+
+	case 1:
+		return unlang_yield(request, mod_authorize_resume, NULL, NULL);
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+	...
+}
+@endverbatim
+ *
+ * @see fr_connection_pool_thread_local
+ * @param[out] out	Where to write the connection handle.
+ * @param[in] pool	to reserve the connection from.
+ * @param[in] request	The current request.
+ * @return
+ *	- 0 if a connection was reserved.
+ *	- 1 if the request must yield, and try again when resumed.
+ *	- -1 on error.
+ */
+int fr_connection_get_async(void **out, fr_connection_pool_t *pool, REQUEST *request)
+{
+	fr_connection_waiter_t	*w;
+	fr_connection_t		*this;
+	struct timeval		now, when;
+
+	*out = NULL;
+
+	if (!pool->el) {
+		*out = fr_connection_get_internal(pool, request, true);
+		return *out ? 0 : -1;
+	}
+
+	/*
+	 *	We've been resumed after waiting.
+	 */
+	w = request_data_get(request, pool, 0);
+	if (w) {
+		rad_assert(w->done);
+
+		this = w->this;
+		w->this = NULL;
+		talloc_free(w);
+
+		if (!this) return -1;
+
+		*out = this->connection;
+		return 0;
+	}
+
+	this = fr_connection_get_free(pool, request, time(NULL));
+	if (this) {
+		fr_connection_reserve(pool, this);
+		RDEBUG2("Reserved connection (%" PRIu64 ")", this->number);
+
+		*out = this->connection;
+		return 0;
+	}
+
+	gettimeofday(&now, NULL);
+
+	if (fr_connection_spawn_schedule(pool, &now) < 0) {
+		REDEBUG("Failed scheduling new connection: %s", fr_strerror());
+		return -1;
+	}
+
+	w = talloc_zero(request, fr_connection_waiter_t);
+	if (!w) return -1;
+
+	w->pool = pool;
+	w->request = request;
+
+	fr_timeval_add(&when, &now, &pool->connect_timeout);
+	if (fr_event_timer_insert(pool->el, fr_connection_waiter_timeout, w, &when, &w->ev) < 0) {
+		REDEBUG("Failed inserting wait timeout: %s", fr_strerror());
+		talloc_free(w);
+		return -1;
+	}
+
+	if (pool->wait_tail) {
+		pool->wait_tail->next = w;
+		w->prev = pool->wait_tail;
+	} else {
+		pool->wait_head = w;
+	}
+	pool->wait_tail = w;
+
+	talloc_set_destructor(w, _fr_connection_waiter_free);
+
+	(void) request_data_add(request, pool, 0, w, true, false, false);
+
+	RDEBUG2("No connections available (%u of %u in use), waiting", pool->state.active, pool->state.num);
+	FR_PROBE2(pool__wait, request->number, pool->log_prefix);
+
+	return 1;
 }
 
 /** Release a connection
@@ -1380,6 +1915,8 @@ void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *c
 	this = fr_connection_find(pool, conn);
 	if (!this) return;
 
+	FR_PROBE2(pool__release, request ? request->number : 0, pool->log_prefix);
+
 	this->in_use = false;
 
 	/*
@@ -1413,6 +1950,20 @@ void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *c
 
 	fr_stats_bins(&pool->state.held_stats, &this->last_reserved, &this->last_released);
 
+	/*
+	 *	Moving average of the hold time, for predicting
+	 *	how many connections we need.
+	 */
+	{
+		uint64_t usec = ((uint64_t)held.tv_sec * 1000000) + held.tv_usec;
+
+		if (!pool->held_ewma) {
+			pool->held_ewma = usec;
+		} else {
+			pool->held_ewma = pool->held_ewma - (pool->held_ewma >> 3) + (usec >> 3);
+		}
+	}
+
 	/*
 	 *	Insert the connection in the heap.
 	 *
@@ -1428,6 +1979,11 @@ void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *c
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Released connection (%" PRIu64 ")", this->number);
 
+	/*
+	 *	Give the connection to a request which is waiting for one.
+	 */
+	if (pool->wait_head) fr_connection_waiters_service(pool);
+
 	/*
 	 *	We mirror the "spawn on get" functionality by having
 	 *	"delete on release".  If there are too many spare
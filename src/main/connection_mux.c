@@ -0,0 +1,523 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file connection_mux.c
+ * @brief Multiplex many requests over a small number of connections.
+ *
+ * Where a connection pool hands a whole connection to one request, a mux
+ * writes requests from many requests to the same connection, and matches
+ * the replies by ID.  This suits protocols which can pipeline requests,
+ * such as Redis, LDAP and HTTP/2.
+ *
+ * A mux is owned by a single worker thread, and driven by its event list.
+ * No locking is done.  Modules should create one in their thread_instantiate
+ * callback.
+ *
+ * A module calls #fr_mux_enqueue, and yields.  When the reply arrives (or
+ * the request times out, or the connection fails) the request is resumed,
+ * and the module calls #fr_mux_result to get the reply.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "%s - "
+#define LOG_PREFIX_ARGS mux->log_prefix
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/connection_mux.h>
+#include <freeradius-devel/rad_assert.h>
+
+typedef struct fr_mux_entry fr_mux_entry_t;
+
+/** A request which has been written to a connection
+ *
+ */
+struct fr_mux_entry {
+	fr_mux_entry_t		*prev;		//!< Previous entry on the connection.
+	fr_mux_entry_t		*next;		//!< Next entry on the connection.
+
+	fr_mux_conn_t		*mc;		//!< Connection we're waiting on, NULL once we're done.
+	uint64_t		id;		//!< To match the reply against.
+
+	REQUEST			*request;	//!< The request which is waiting.
+	void			*reply;		//!< The reply, NULL if we didn't get one.
+	fr_event_timer_t	*ev;		//!< When we give up waiting.
+};
+
+/** A connection which can have many requests in flight
+ *
+ */
+struct fr_mux_conn {
+	fr_mux_t		*mux;		//!< The mux this connection belongs to.
+	uint32_t		number;		//!< Index of this connection.
+
+	TALLOC_CTX		*ctx;		//!< Freeing this closes the connection.
+	void			*handle;	//!< Returned by the open callback.  NULL if the
+						//!< connection is down.
+	int			fd;		//!< Watched for replies.
+
+	uint64_t		seq;		//!< Number of requests written to this connection.
+	uint32_t		inflight;	//!< Number of requests waiting for replies.
+
+	rbtree_t		*tree;		//!< Entries, by ID.
+	fr_mux_entry_t		*head;		//!< Oldest entry.
+	fr_mux_entry_t		*tail;		//!< Newest entry.
+
+	fr_event_timer_t	*ev;		//!< When we try to re-open the connection.
+};
+
+/** A set of multiplexed connections
+ *
+ */
+struct fr_mux {
+	uint32_t		connections;	//!< Number of connections to open.
+	uint32_t		max_inflight;	//!< Maximum number of requests in flight per connection.
+	struct timeval		timeout;	//!< How long a request waits for its reply.
+	struct timeval		connect_timeout;	//!< Passed to the open callback.
+	uint32_t		retry_delay;	//!< Seconds to wait before re-opening a failed connection.
+
+	fr_event_list_t		*el;		//!< Event list the connections are serviced by.
+	fr_mux_wake_t		wake;		//!< Resumes requests.
+	fr_mux_funcs_t		funcs;		//!< Protocol specific callbacks.
+	void			*uctx;		//!< Passed to the callbacks.
+	char const		*log_prefix;	//!< Prepended to log messages.
+
+	fr_mux_conn_t		*conns;		//!< Array of connections.
+};
+
+static const CONF_PARSER mux_config[] = {
+	{ FR_CONF_OFFSET("connections", PW_TYPE_INTEGER, fr_mux_t, connections), .dflt = "1" },
+	{ FR_CONF_OFFSET("max_inflight", PW_TYPE_INTEGER, fr_mux_t, max_inflight), .dflt = "1000" },
+	{ FR_CONF_OFFSET("timeout", PW_TYPE_TIMEVAL, fr_mux_t, timeout), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("connect_timeout", PW_TYPE_TIMEVAL, fr_mux_t, connect_timeout), .dflt = "3.0" },
+	{ FR_CONF_OFFSET("retry_delay", PW_TYPE_INTEGER, fr_mux_t, retry_delay), .dflt = "1" },
+	CONF_PARSER_TERMINATOR
+};
+
+static int mux_entry_cmp(void const *one, void const *two)
+{
+	fr_mux_entry_t const *a = one, *b = two;
+
+	if (a->id < b->id) return -1;
+	if (a->id > b->id) return +1;
+
+	return 0;
+}
+
+/** Remove an entry from its connection
+ *
+ * @param[in] entry	to remove.
+ */
+static void mux_entry_unlink(fr_mux_entry_t *entry)
+{
+	fr_mux_conn_t *mc = entry->mc;
+
+	rad_assert(mc != NULL);
+
+	rbtree_deletebydata(mc->tree, entry);
+
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		rad_assert(mc->head == entry);
+		mc->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		rad_assert(mc->tail == entry);
+		mc->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+	entry->mc = NULL;
+
+	rad_assert(mc->inflight > 0);
+	mc->inflight--;
+}
+
+/** Finish waiting, and mark the request as resumable
+ *
+ * @param[in] entry	which is done.
+ * @param[in] reply	for the request, or NULL if it's not getting one.
+ */
+static void mux_entry_done(fr_mux_entry_t *entry, void *reply)
+{
+	fr_mux_t *mux = entry->mc->mux;
+
+	mux_entry_unlink(entry);
+	if (entry->ev) fr_event_timer_delete(mux->el, &entry->ev);
+
+	if (reply) entry->reply = talloc_steal(entry, reply);
+
+	mux->wake(entry->request);
+}
+
+static int _mux_entry_free(fr_mux_entry_t *entry)
+{
+	fr_mux_t *mux;
+
+	if (!entry->mc) return 0;
+
+	/*
+	 *	The request went away while the request was still
+	 *	in flight.  Any reply which arrives later is discarded.
+	 */
+	mux = entry->mc->mux;
+	mux_entry_unlink(entry);
+	if (entry->ev) fr_event_timer_delete(mux->el, &entry->ev);
+
+	return 0;
+}
+
+static void mux_entry_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	fr_mux_entry_t	*entry = talloc_get_type_abort(ctx, fr_mux_entry_t);
+	REQUEST		*request = entry->request;
+
+	RERROR("Timed out waiting for reply (%" PRIu64 ") on connection %u", entry->id, entry->mc->number);
+
+	mux_entry_done(entry, NULL);
+}
+
+static int mux_conn_open(fr_mux_conn_t *mc);
+
+static void mux_conn_reopen(UNUSED struct timeval *now, void *ctx)
+{
+	fr_mux_conn_t *mc = ctx;
+
+	(void) mux_conn_open(mc);
+}
+
+/** Close a connection, failing all of the requests in flight
+ *
+ * @param[in] mc	to close.
+ * @param[in] reopen	whether we should try to re-open the connection later.
+ */
+static void mux_conn_close(fr_mux_conn_t *mc, bool reopen)
+{
+	fr_mux_t	*mux = mc->mux;
+	struct timeval	when;
+
+	if (mc->handle) {
+		DEBUG2("Closing connection %u, %u requests in flight", mc->number, mc->inflight);
+
+		fr_event_fd_delete(mux->el, mc->fd);
+		TALLOC_FREE(mc->ctx);
+		mc->handle = NULL;
+		mc->fd = -1;
+	}
+
+	while (mc->head) mux_entry_done(mc->head, NULL);
+
+	if (mc->ev) fr_event_timer_delete(mux->el, &mc->ev);
+	if (!reopen) return;
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += mux->retry_delay;
+
+	if (fr_event_timer_insert(mux->el, mux_conn_reopen, mc, &when, &mc->ev) < 0) {
+		ERROR("Failed scheduling re-open of connection %u: %s", mc->number, fr_strerror());
+	}
+}
+
+static void mux_conn_read(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_mux_conn_t	*mc = ctx;
+	fr_mux_t	*mux = mc->mux;
+
+	if (mux->funcs.recv(mc, mc->handle, mux->uctx) < 0) {
+		ERROR("Failed reading from connection %u", mc->number);
+		mux_conn_close(mc, true);
+	}
+}
+
+static void mux_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_mux_conn_t	*mc = ctx;
+	fr_mux_t	*mux = mc->mux;
+
+	ERROR("Connection %u failed", mc->number);
+	mux_conn_close(mc, true);
+}
+
+/** Open a connection, and start watching it for replies
+ *
+ * @param[in] mc	to open.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  A re-open attempt will have been scheduled.
+ */
+static int mux_conn_open(fr_mux_conn_t *mc)
+{
+	fr_mux_t *mux = mc->mux;
+
+	rad_assert(!mc->handle);
+
+	mc->ctx = talloc_init("fr_mux_conn_ctx");
+	if (!mc->ctx) return -1;
+
+	mc->handle = mux->funcs.open(mc->ctx, &mc->fd, mux->uctx, &mux->connect_timeout);
+	if (!mc->handle) {
+		ERROR("Opening connection %u failed", mc->number);
+	error:
+		TALLOC_FREE(mc->ctx);
+		mc->handle = NULL;
+		mc->fd = -1;
+		mux_conn_close(mc, true);
+		return -1;
+	}
+
+	if (fr_event_fd_insert(mux->el, mc->fd, mux_conn_read, NULL, mux_conn_error, mc) < 0) {
+		ERROR("Failed inserting connection %u into event loop: %s", mc->number, fr_strerror());
+		goto error;
+	}
+
+	mc->seq = 0;
+
+	DEBUG2("Opened connection %u", mc->number);
+
+	return 0;
+}
+
+static int _mux_free(fr_mux_t *mux)
+{
+	uint32_t i;
+
+	for (i = 0; i < mux->connections; i++) mux_conn_close(&mux->conns[i], false);
+
+	return 0;
+}
+
+/** Create a set of multiplexed connections
+ *
+ * Opens all of the connections.  Connections which fail to open are
+ * retried every retry_delay seconds.
+ *
+ * @param[in] ctx		to allocate the mux in.
+ * @param[in] cs		containing the mux configuration.
+ * @param[in] el		The event list serviced by this thread.
+ * @param[in] wake		Called to resume requests, usually unlang_resumable().
+ * @param[in] funcs		Protocol specific callbacks.
+ * @param[in] uctx		to pass to the callbacks.
+ * @param[in] log_prefix	to prepend to all log messages.
+ * @return
+ *	- New mux.
+ *	- NULL on error.
+ */
+fr_mux_t *fr_mux_alloc(TALLOC_CTX *ctx, CONF_SECTION *cs, fr_event_list_t *el, fr_mux_wake_t wake,
+		       fr_mux_funcs_t const *funcs, void *uctx, char const *log_prefix)
+{
+	fr_mux_t	*mux;
+	uint32_t	i;
+
+	if (!wake || !funcs->open || !funcs->send || !funcs->recv) return NULL;
+
+	mux = talloc_zero(ctx, fr_mux_t);
+	if (!mux) return NULL;
+
+	mux->el = el;
+	mux->wake = wake;
+	mux->funcs = *funcs;
+	mux->uctx = uctx;
+	mux->log_prefix = log_prefix ? talloc_typed_strdup(mux, log_prefix) : "core";
+
+	if (cf_section_parse(cs, mux, mux_config) < 0) {
+		ERROR("Configuration parsing failed: %s", fr_strerror());
+	error:
+		talloc_free(mux);
+		return NULL;
+	}
+
+	FR_INTEGER_BOUND_CHECK("connections", mux->connections, >=, 1);
+	FR_INTEGER_BOUND_CHECK("connections", mux->connections, <=, 64);
+	FR_INTEGER_BOUND_CHECK("max_inflight", mux->max_inflight, >=, 1);
+	FR_TIMEVAL_BOUND_CHECK("timeout", &mux->timeout, >=, 0, 1000);
+	FR_TIMEVAL_BOUND_CHECK("connect_timeout", &mux->connect_timeout, >=, 0, 100000);
+
+	mux->conns = talloc_zero_array(mux, fr_mux_conn_t, mux->connections);
+	if (!mux->conns) goto error;
+
+	for (i = 0; i < mux->connections; i++) {
+		fr_mux_conn_t *mc = &mux->conns[i];
+
+		mc->mux = mux;
+		mc->number = i;
+		mc->fd = -1;
+
+		mc->tree = rbtree_create(mux->conns, mux_entry_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!mc->tree) goto error;
+	}
+
+	talloc_set_destructor(mux, _mux_free);
+
+	if (check_config) return mux;
+
+	for (i = 0; i < mux->connections; i++) (void) mux_conn_open(&mux->conns[i]);
+
+	return mux;
+}
+
+/** Write a request to the least loaded connection
+ *
+ * Once this function returns 0, the caller should yield, and call
+ * #fr_mux_result when the request is resumed.
+ *
+ * @param[in] mux	to write the request to.
+ * @param[in] request	The current request.
+ * @param[in] rctx	Describes what to send.  Passed to the send callback.
+ * @return
+ *	- 0 if the request was sent.
+ *	- -1 on error.
+ */
+int fr_mux_enqueue(fr_mux_t *mux, REQUEST *request, void *rctx)
+{
+	fr_mux_conn_t	*mc = NULL;
+	fr_mux_entry_t	*entry;
+	struct timeval	now, when;
+	uint32_t	i;
+
+	for (i = 0; i < mux->connections; i++) {
+		fr_mux_conn_t *this = &mux->conns[i];
+
+		if (!this->handle || (this->inflight >= mux->max_inflight)) continue;
+		if (!mc || (this->inflight < mc->inflight)) mc = this;
+	}
+
+	if (!mc) {
+		REDEBUG("No connections available");
+		return -1;
+	}
+
+	entry = talloc_zero(request, fr_mux_entry_t);
+	if (!entry) return -1;
+
+	entry->request = request;
+
+	if (mux->funcs.send(&entry->id, mc->handle, mux->uctx, request, rctx, mc->seq) < 0) {
+		REDEBUG("Failed writing to connection %u", mc->number);
+		talloc_free(entry);
+		mux_conn_close(mc, true);
+		return -1;
+	}
+	mc->seq++;
+
+	if (!rbtree_insert(mc->tree, entry)) {
+		REDEBUG("Reply ID (%" PRIu64 ") is already in use on connection %u", entry->id, mc->number);
+		talloc_free(entry);
+		return -1;
+	}
+
+	if (mc->tail) {
+		mc->tail->next = entry;
+		entry->prev = mc->tail;
+	} else {
+		mc->head = entry;
+	}
+	mc->tail = entry;
+	entry->mc = mc;
+	mc->inflight++;
+
+	talloc_set_destructor(entry, _mux_entry_free);
+
+	gettimeofday(&now, NULL);
+	fr_timeval_add(&when, &now, &mux->timeout);
+	if (fr_event_timer_insert(mux->el, mux_entry_timeout, entry, &when, &entry->ev) < 0) {
+		REDEBUG("Failed inserting reply timeout: %s", fr_strerror());
+		talloc_free(entry);
+		return -1;
+	}
+
+	(void) request_data_add(request, mux, 0, entry, true, false, false);
+
+	RDEBUG3("Sent request (%" PRIu64 ") on connection %u, %u in flight", entry->id, mc->number, mc->inflight);
+
+	return 0;
+}
+
+/** Get the reply for a request which has been resumed
+ *
+ * @param[in] mux	the request was written to.
+ * @param[in] request	The current request.
+ * @return
+ *	- The reply, which is now parented by the request.
+ *	- NULL if there was no reply.
+ */
+void *fr_mux_result(fr_mux_t *mux, REQUEST *request)
+{
+	fr_mux_entry_t	*entry;
+	void		*reply;
+
+	entry = request_data_get(request, mux, 0);
+	if (!entry) return NULL;
+
+	rad_assert(!entry->mc);
+
+	reply = entry->reply;
+	if (reply) talloc_steal(request, reply);
+	talloc_free(entry);
+
+	return reply;
+}
+
+/** Deliver a reply to the request which is waiting for it
+ *
+ * Called by the protocol's recv callback, once per complete reply.
+ *
+ * @param[in] mc	the reply was read from.
+ * @param[in] id	of the reply.
+ * @param[in] reply	talloced reply.  Ownership passes to the request, or it
+ *			is freed if no request is waiting for it.
+ * @return
+ *	- 0 if the reply was delivered.
+ *	- -1 if no request was waiting for the reply.
+ */
+int fr_mux_reply(fr_mux_conn_t *mc, uint64_t id, void *reply)
+{
+	fr_mux_entry_t	*entry, my_entry;
+
+	my_entry.id = id;
+	entry = rbtree_finddata(mc->tree, &my_entry);
+	if (!entry) {
+		fr_mux_t *mux = mc->mux;
+
+		DEBUG3("Discarding reply (%" PRIu64 ") on connection %u, no request is waiting", id, mc->number);
+		talloc_free(reply);
+		return -1;
+	}
+
+	mux_entry_done(entry, reply);
+
+	return 0;
+}
+
+/** Return the total number of requests in flight
+ *
+ * @param[in] mux	to count requests for.
+ * @return the number of requests waiting for replies.
+ */
+uint32_t fr_mux_inflight(fr_mux_t const *mux)
+{
+	uint32_t i, inflight = 0;
+
+	for (i = 0; i < mux->connections; i++) inflight += mux->conns[i].inflight;
+
+	return inflight;
+}
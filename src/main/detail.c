@@ -0,0 +1,314 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file detail.c
+ * @brief Encode and decode records in binary detail files.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/detail.h>
+
+/*
+ *	Attributes are written with an empty secret, and an all-zero
+ *	vector.  That's enough to round-trip "encrypted" attributes,
+ *	without tying the file to any particular client.
+ */
+static void detail_binary_ctx_init(fr_radius_ctx_t *ctx, RADIUS_PACKET *packet)
+{
+	memset(packet, 0, sizeof(*packet));
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->packet = packet;
+	ctx->original = packet;
+	ctx->secret = "";
+}
+
+static void detail_binary_addr_encode(uint8_t out[16], fr_ipaddr_t const *ipaddr)
+{
+	memset(out, 0, 16);
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		memcpy(out, &ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr));
+		break;
+
+	case AF_INET6:
+		memcpy(out, &ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr));
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void detail_binary_addr_decode(fr_ipaddr_t *ipaddr, int af, uint8_t const in[16])
+{
+	memset(ipaddr, 0, sizeof(*ipaddr));
+	ipaddr->af = af;
+
+	switch (af) {
+	case AF_INET:
+		memcpy(&ipaddr->ipaddr.ip4addr, in, sizeof(ipaddr->ipaddr.ip4addr));
+		ipaddr->prefix = 32;
+		break;
+
+	case AF_INET6:
+		memcpy(&ipaddr->ipaddr.ip6addr, in, sizeof(ipaddr->ipaddr.ip6addr));
+		ipaddr->prefix = 128;
+		break;
+
+	default:
+		ipaddr->af = AF_UNSPEC;
+		break;
+	}
+}
+
+/** Write the header of a binary detail record
+ *
+ * @param[out] out	Where to write the header.
+ * @param[in] hdr	to encode.  The source and destination addresses
+ *			must be of the same address family.
+ */
+void detail_binary_header_encode(uint8_t out[DETAIL_BINARY_HDR_LEN], detail_binary_t const *hdr)
+{
+	uint32_t	len = htonl(hdr->length);
+	uint32_t	timestamp = htonl((uint32_t) hdr->timestamp);
+	uint16_t	port;
+
+	memcpy(out, DETAIL_BINARY_MAGIC, 4);
+	out[4] = DETAIL_BINARY_VERSION;
+	out[DETAIL_BINARY_FLAGS_OFFSET] = hdr->flags;
+	out[6] = hdr->code;
+
+	switch (hdr->src_ipaddr.af) {
+	case AF_INET:
+		out[7] = 4;
+		break;
+
+	case AF_INET6:
+		out[7] = 6;
+		break;
+
+	default:
+		out[7] = 0;
+		break;
+	}
+
+	memcpy(out + 8, &len, sizeof(len));
+	memcpy(out + 12, &timestamp, sizeof(timestamp));
+
+	port = htons(hdr->src_port);
+	memcpy(out + 16, &port, sizeof(port));
+	port = htons(hdr->dst_port);
+	memcpy(out + 18, &port, sizeof(port));
+
+	detail_binary_addr_encode(out + 20, &hdr->src_ipaddr);
+	detail_binary_addr_encode(out + 36, &hdr->dst_ipaddr);
+}
+
+/** Read the header of a binary detail record
+ *
+ * @param[out] hdr	The decoded header.
+ * @param[in] in	The start of the record.
+ * @return
+ *	- 0 on success.
+ *	- -1 if this isn't a binary detail record we understand.
+ */
+int detail_binary_header_decode(detail_binary_t *hdr, uint8_t const in[DETAIL_BINARY_HDR_LEN])
+{
+	uint32_t	len, timestamp;
+	uint16_t	port;
+	int		af;
+
+	if (memcmp(in, DETAIL_BINARY_MAGIC, 4) != 0) {
+		fr_strerror_printf("Invalid magic number");
+		return -1;
+	}
+
+	if (in[4] != DETAIL_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported version %u", in[4]);
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->flags = in[DETAIL_BINARY_FLAGS_OFFSET];
+	hdr->code = in[6];
+
+	switch (in[7]) {
+	case 4:
+		af = AF_INET;
+		break;
+
+	case 6:
+		af = AF_INET6;
+		break;
+
+	default:
+		af = AF_UNSPEC;
+		break;
+	}
+
+	memcpy(&len, in + 8, sizeof(len));
+	hdr->length = ntohl(len);
+	if (hdr->length > DETAIL_BINARY_MAX_LEN) {
+		fr_strerror_printf("Record length %u is too large", hdr->length);
+		return -1;
+	}
+
+	memcpy(&timestamp, in + 12, sizeof(timestamp));
+	hdr->timestamp = ntohl(timestamp);
+
+	memcpy(&port, in + 16, sizeof(port));
+	hdr->src_port = ntohs(port);
+	memcpy(&port, in + 18, sizeof(port));
+	hdr->dst_port = ntohs(port);
+
+	detail_binary_addr_decode(&hdr->src_ipaddr, af, in + 20);
+	detail_binary_addr_decode(&hdr->dst_ipaddr, af, in + 36);
+
+	return 0;
+}
+
+/** Encode the attribute at the cursor for a binary detail record
+ *
+ * Internal attributes have no wire format, and are skipped.
+ *
+ * @param[out] out	Where to write the attribute.
+ * @param[in] outlen	Space available in out.
+ * @param[in] cursor	pointing to the attribute to encode.  Is advanced
+ *			past any attributes which were encoded.
+ * @return
+ *	- >= 0 the number of bytes written.
+ *	- -1 on error.
+ */
+ssize_t detail_binary_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor)
+{
+	RADIUS_PACKET	packet;
+	fr_radius_ctx_t	ctx;
+
+	detail_binary_ctx_init(&ctx, &packet);
+
+	return fr_radius_encode_pair(out, outlen, cursor, &ctx);
+}
+
+/** Decode the attributes of a binary detail record
+ *
+ * @param[in] ctx	to allocate the attributes in.
+ * @param[out] out	Where to add the attributes.
+ * @param[in] data	The attributes, after the record header.
+ * @param[in] data_len	Length of the attributes.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int detail_binary_decode_pairs(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const *data, size_t data_len)
+{
+	RADIUS_PACKET	packet;
+	fr_radius_ctx_t	decoder_ctx;
+	VALUE_PAIR	*head = NULL;
+	vp_cursor_t	cursor;
+	uint8_t const	*p = data, *end = data + data_len;
+
+	detail_binary_ctx_init(&decoder_ctx, &packet);
+
+	fr_pair_cursor_init(&cursor, &head);
+
+	while (p < end) {
+		ssize_t slen;
+
+		slen = fr_radius_decode_pair(ctx, &cursor, fr_dict_root(fr_dict_internal),
+					     p, end - p, &decoder_ctx);
+		if (slen < 0) {
+			fr_pair_list_free(&head);
+			return -1;
+		}
+		if (slen == 0) break;
+
+		while (fr_pair_cursor_next(&cursor));
+		p += slen;
+	}
+
+	fr_pair_add(out, head);
+
+	return 0;
+}
+
+/** Print a binary detail record in the text detail format
+ *
+ * @param[in] fp	to write to.
+ * @param[in] hdr	of the record.
+ * @param[in] vps	decoded from the record.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int detail_binary_fprint(FILE *fp, detail_binary_t const *hdr, VALUE_PAIR *vps)
+{
+	char		buffer[64], *nl;
+	char		src[FR_IPADDR_STRLEN], dst[FR_IPADDR_STRLEN];
+	time_t		when = hdr->timestamp;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	CTIME_R(&when, buffer, sizeof(buffer));
+	nl = strchr(buffer, '\n');
+	if (nl) *nl = '\0';
+
+	fprintf(fp, "%s\n", buffer);
+
+	if (is_radius_code(hdr->code)) {
+		fprintf(fp, "\tPacket-Type = %s\n", fr_packet_codes[hdr->code]);
+	} else {
+		fprintf(fp, "\tPacket-Type = %u\n", hdr->code);
+	}
+
+	if (hdr->src_ipaddr.af != AF_UNSPEC) {
+		char const *type = (hdr->src_ipaddr.af == AF_INET6) ? "IPv6" : "IP";
+
+		fr_inet_ntop(src, sizeof(src), &hdr->src_ipaddr);
+		fr_inet_ntop(dst, sizeof(dst), &hdr->dst_ipaddr);
+
+		fprintf(fp, "\tPacket-Src-%s-Address = %s\n", type, src);
+		fprintf(fp, "\tPacket-Dst-%s-Address = %s\n", type, dst);
+		fprintf(fp, "\tPacket-Src-Port = %u\n", hdr->src_port);
+		fprintf(fp, "\tPacket-Dst-Port = %u\n", hdr->dst_port);
+	}
+
+	for (vp = fr_pair_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		FR_TOKEN op;
+
+		op = vp->op;
+		vp->op = T_OP_EQ;
+		fr_pair_fprint(fp, vp);
+		vp->op = op;
+	}
+
+	if (fprintf(fp, "\t%s = %lu\n\n", (hdr->flags & DETAIL_BINARY_FLAG_DONE) ? "Donestamp" : "Timestamp",
+		    (unsigned long) hdr->timestamp) < 0) {
+		fr_strerror_printf("Failed writing entry: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
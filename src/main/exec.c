@@ -494,7 +494,15 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 	return done;
 }
 
-/** Execute a program.
+#ifndef __MINGW32__
+/** Parse the output of a program, and reap it
+ *
+ * This is the second half of #radius_exec_program, split out so that
+ * callers which read the output of the child themselves (i.e. without
+ * blocking) can process it in the same way.
+ *
+ * The caller MUST have closed its end of the pipe before calling this
+ * function, so that the child can't block writing to it.
  *
  * @param[in,out] ctx to allocate new VALUE_PAIR (s) in.
  * @param[out] out buffer to append plaintext (non valuepair) output.
@@ -502,65 +510,23 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
  * @param[out] output_pairs list of value pairs - Data on child's stdout will be parsed and
  *	added into this list of value pairs.
  * @param[in] request Current request (may be NULL).
- * @param[in] cmd Command to execute. This is parsed into argv[] parts, then each individual argv
- *	part is xlat'ed.
- * @param[in] input_pairs list of value pairs - these will be available in the environment of the
- *	child.
- * @param[in] exec_wait set to 1 if you want to read from or write to child.
- * @param[in] shell_escape values before passing them as arguments.
- * @param[in] timeout amount of time to wait, in seconds.
+ * @param[in] cmd which was executed.  Used for error messages.
+ * @param[in] pid of the child.
+ * @param[in] answer the output of the child, with trailing new lines stripped.
+ *	Must be '\0' terminated, and will be modified.
+ * @param[in] len of the output.
  * @return
- *	- 0 if exec_wait==0.
- *	- exit code if exec_wait!=0.
+ *	- exit code of the child.
  *	- -1 on failure.
+ *	- -2 if the child could not be reaped.
  */
-int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
-			REQUEST *request, char const *cmd, VALUE_PAIR *input_pairs,
-			bool exec_wait, bool shell_escape, int timeout)
-
+int radius_exec_program_finish(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
+			       REQUEST *request, char const *cmd, pid_t pid, char *answer, size_t len)
 {
-	pid_t pid;
-	int from_child;
-#ifndef __MINGW32__
 	char *p;
 	pid_t child_pid;
 	int comma = 0;
 	int status, ret = 0;
-	ssize_t len;
-	char answer[4096];
-#endif
-
-	RDEBUG2("Executing: %s", cmd);
-
-	if (out) *out = '\0';
-
-	pid = radius_start_program(cmd, request, exec_wait, NULL, &from_child, input_pairs, shell_escape);
-	if (pid < 0) {
-		return -1;
-	}
-
-	if (!exec_wait) {
-		return 0;
-	}
-
-#ifndef __MINGW32__
-	len = radius_readfrom_program(from_child, pid, timeout, answer, sizeof(answer));
-	if (len < 0) {
-		/*
-		 *	Failure - radius_readfrom_program will
-		 *	have called close(from_child) for us
-		 */
-		RERROR("Failed to read from child output");
-		return -1;
-
-	}
-	answer[len] = '\0';
-
-	/*
-	 *	Make sure that the writer can't block while writing to
-	 *	a pipe that no one is reading from anymore.
-	 */
-	close(from_child);
 
 	if (len == 0) {
 		goto wait;
@@ -598,7 +564,7 @@ int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **
 
 		if (fr_pair_list_afrom_str(ctx, answer, &vps) == T_INVALID) {
 			RERROR("Failed parsing output from: %s: %s", cmd, fr_strerror());
-			strlcpy(out, answer, len);
+			if (out) strlcpy(out, answer, outlen);
 			ret = -1;
 		}
 
@@ -644,7 +610,77 @@ wait:
 	}
 
 	RERROR("Abnormal child exit: %s", fr_syserror(errno));
+
+	return -1;
+}
 #endif	/* __MINGW32__ */
 
+/** Execute a program.
+ *
+ * @param[in,out] ctx to allocate new VALUE_PAIR (s) in.
+ * @param[out] out buffer to append plaintext (non valuepair) output.
+ * @param[in] outlen length of out buffer.
+ * @param[out] output_pairs list of value pairs - Data on child's stdout will be parsed and
+ *	added into this list of value pairs.
+ * @param[in] request Current request (may be NULL).
+ * @param[in] cmd Command to execute. This is parsed into argv[] parts, then each individual argv
+ *	part is xlat'ed.
+ * @param[in] input_pairs list of value pairs - these will be available in the environment of the
+ *	child.
+ * @param[in] exec_wait set to 1 if you want to read from or write to child.
+ * @param[in] shell_escape values before passing them as arguments.
+ * @param[in] timeout amount of time to wait, in seconds.
+ * @return
+ *	- 0 if exec_wait==0.
+ *	- exit code if exec_wait!=0.
+ *	- -1 on failure.
+ */
+int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
+			REQUEST *request, char const *cmd, VALUE_PAIR *input_pairs,
+			bool exec_wait, bool shell_escape, int timeout)
+
+{
+	pid_t pid;
+	int from_child;
+#ifndef __MINGW32__
+	ssize_t len;
+	char answer[4096];
+#endif
+
+	RDEBUG2("Executing: %s", cmd);
+
+	if (out) *out = '\0';
+
+	pid = radius_start_program(cmd, request, exec_wait, NULL, &from_child, input_pairs, shell_escape);
+	if (pid < 0) {
+		return -1;
+	}
+
+	if (!exec_wait) {
+		return 0;
+	}
+
+#ifndef __MINGW32__
+	len = radius_readfrom_program(from_child, pid, timeout, answer, sizeof(answer));
+	if (len < 0) {
+		/*
+		 *	Failure - radius_readfrom_program will
+		 *	have called close(from_child) for us
+		 */
+		RERROR("Failed to read from child output");
+		return -1;
+
+	}
+	answer[len] = '\0';
+
+	/*
+	 *	Make sure that the writer can't block while writing to
+	 *	a pipe that no one is reading from anymore.
+	 */
+	close(from_child);
+
+	return radius_exec_program_finish(ctx, out, outlen, output_pairs, request, cmd, pid, answer, len);
+#else
 	return -1;
+#endif	/* __MINGW32__ */
 }
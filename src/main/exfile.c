@@ -29,6 +29,11 @@
 
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
 
 typedef struct exfile_entry_t {
 	int			fd;			//!< File descriptor associated with an entry.
@@ -38,6 +43,22 @@ typedef struct exfile_entry_t {
 	char			*filename;		//!< Filename.
 } exfile_entry_t;
 
+/** Data waiting to be written to a file by the writer thread
+ *
+ * Each of these is a separate talloc tree, so that the writer can free
+ * them without holding the mutex.
+ */
+typedef struct exfile_pending_t exfile_pending_t;
+struct exfile_pending_t {
+	exfile_pending_t	*next;			//!< Next file with pending data.
+	uint32_t		hash;			//!< Hash for cheap comparison.
+	char			*filename;		//!< File to append to.
+	mode_t			permissions;		//!< To use if the file is created.
+	gid_t			gid;			//!< To set on the file, or -1.
+	struct iovec		*vector;		//!< One entry per call to #exfile_write.
+	int			vector_len;		//!< Number of entries used.
+};
+
 
 struct exfile_t {
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
@@ -49,6 +70,21 @@ struct exfile_t {
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
 	VALUE_PAIR		*trigger_args;		//!< Arguments to pass to trigger.
+
+	struct {
+		bool			enabled;		//!< Writes are buffered, and done by a thread.
+		bool			running;		//!< The writer thread has been started.
+		bool			stop;			//!< Tell the writer to flush and exit.
+		bool			sync;			//!< fsync() files after each batch.
+		uint32_t		interval;		//!< Maximum time data is buffered, in milliseconds.
+		size_t			max_pending;		//!< Block writers when this much data is buffered.
+		size_t			pending;		//!< How much data is buffered.
+		exfile_pending_t	*head;			//!< Files with pending data.
+		pthread_t		thread;			//!< The writer thread.
+		pthread_mutex_t		mutex;			//!< Protects everything in this struct.
+		pthread_cond_t		wakeup;			//!< Signalled to wake up the writer.
+		pthread_cond_t		drained;		//!< Signalled when the writer has taken a batch.
+	} async;
 };
 
 #define MAX_TRY_LOCK 4			//!< How many times we attempt to acquire a lock
@@ -115,6 +151,22 @@ static int _exfile_free(exfile_t *ef)
 {
 	uint32_t i;
 
+	/*
+	 *	Flush anything which is still buffered.
+	 */
+	if (ef->async.enabled) {
+		pthread_mutex_lock(&ef->async.mutex);
+		ef->async.stop = true;
+		pthread_cond_signal(&ef->async.wakeup);
+		pthread_mutex_unlock(&ef->async.mutex);
+
+		if (ef->async.running) pthread_join(ef->async.thread, NULL);
+
+		pthread_cond_destroy(&ef->async.drained);
+		pthread_cond_destroy(&ef->async.wakeup);
+		pthread_mutex_destroy(&ef->async.mutex);
+	}
+
 	pthread_mutex_lock(&ef->mutex);
 
 	for (i = 0; i < ef->max_entries; i++) {
@@ -500,3 +552,304 @@ int exfile_unlock(exfile_t *ef, REQUEST *request, int fd)
 	fr_strerror_printf("Attempt to unlock file which does not exist");
 	return -1;
 }
+
+/** Write all of a vector, dealing with short writes
+ *
+ */
+static int exfile_writev(int fd, struct iovec *vector, int vector_len)
+{
+	while (vector_len > 0) {
+		ssize_t	slen;
+		int	count = vector_len > IOV_MAX ? IOV_MAX : vector_len;
+
+		slen = writev(fd, vector, count);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		/*
+		 *	Skip the entries which were written, and
+		 *	adjust the one which was partially written.
+		 */
+		while ((vector_len > 0) && ((size_t) slen >= vector->iov_len)) {
+			slen -= vector->iov_len;
+			vector++;
+			vector_len--;
+		}
+
+		if (slen > 0) {
+			vector->iov_base = ((uint8_t *) vector->iov_base) + slen;
+			vector->iov_len -= slen;
+		}
+	}
+
+	return 0;
+}
+
+/** Write out the data for one file
+ *
+ */
+static void exfile_flush(exfile_t *ef, exfile_pending_t *p)
+{
+	int fd;
+
+	fd = exfile_open(ef, NULL, p->filename, p->permissions, true);
+	if (fd < 0) {
+		ERROR("Discarding buffered data for %s: %s", p->filename, fr_strerror());
+		return;
+	}
+
+	if ((p->gid != (gid_t) -1) && (fchown(fd, -1, p->gid) < 0)) {
+		WARN("Unable to change system group of %s: %s", p->filename, fr_syserror(errno));
+	}
+
+	if (exfile_writev(fd, p->vector, p->vector_len) < 0) {
+		ERROR("Failed writing to %s: %s", p->filename, fr_syserror(errno));
+	} else if (ef->async.sync && (fsync(fd) < 0)) {
+		ERROR("Failed syncing %s: %s", p->filename, fr_syserror(errno));
+	}
+
+	exfile_close(ef, NULL, fd);
+}
+
+/** Take batches of buffered data, and write them out
+ *
+ */
+static void *exfile_writer(void *arg)
+{
+	exfile_t		*ef = arg;
+	exfile_pending_t	*head, *next;
+	struct timespec		deadline;
+	struct timeval		now;
+	bool			stop;
+
+	pthread_mutex_lock(&ef->async.mutex);
+
+	for (;;) {
+		/*
+		 *	Sleep until there's something to write.
+		 */
+		while (!ef->async.head && !ef->async.stop) pthread_cond_wait(&ef->async.wakeup, &ef->async.mutex);
+
+		/*
+		 *	Give the workers a chance to add more data,
+		 *	unless they've already added lots.
+		 */
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + (ef->async.interval / 1000);
+		deadline.tv_nsec = (now.tv_usec * 1000) + ((ef->async.interval % 1000) * 1000000);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!ef->async.stop && (ef->async.pending < (ef->async.max_pending / 2))) {
+			if (pthread_cond_timedwait(&ef->async.wakeup, &ef->async.mutex, &deadline) == ETIMEDOUT) break;
+		}
+
+		head = ef->async.head;
+		ef->async.head = NULL;
+		ef->async.pending = 0;
+		stop = ef->async.stop;
+
+		pthread_cond_broadcast(&ef->async.drained);
+		pthread_mutex_unlock(&ef->async.mutex);
+
+		for (; head; head = next) {
+			next = head->next;
+			exfile_flush(ef, head);
+			talloc_free(head);
+		}
+
+		if (stop) break;
+
+		pthread_mutex_lock(&ef->async.mutex);
+	}
+
+	return NULL;
+}
+
+/** Buffer writes, and have a separate thread write them out
+ *
+ * After this is called, #exfile_write copies the data it is given, and
+ * returns immediately.  A writer thread appends the data to the files in
+ * batches, opening and locking each file once per batch.
+ *
+ * Errors writing the data can't be returned to the caller, and are
+ * logged instead.
+ *
+ * @param[in] ef		to enable buffering for.
+ * @param[in] interval		maximum time data is buffered for, in milliseconds.
+ * @param[in] max_pending	amount of data to buffer before callers of #exfile_write block.
+ *				The writer is woken up when half of this is buffered.
+ * @param[in] sync		call fsync() on each file after writing a batch to it.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_async_enable(exfile_t *ef, uint32_t interval, size_t max_pending, bool sync)
+{
+	if (ef->async.enabled) return 0;
+
+	if (pthread_mutex_init(&ef->async.mutex, NULL) != 0) {
+		fr_strerror_printf("Failed initialising mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (pthread_cond_init(&ef->async.wakeup, NULL) != 0) {
+		fr_strerror_printf("Failed initialising condition: %s", fr_syserror(errno));
+	error:
+		pthread_mutex_destroy(&ef->async.mutex);
+		return -1;
+	}
+
+	if (pthread_cond_init(&ef->async.drained, NULL) != 0) {
+		fr_strerror_printf("Failed initialising condition: %s", fr_syserror(errno));
+		pthread_cond_destroy(&ef->async.wakeup);
+		goto error;
+	}
+
+	ef->async.interval = interval;
+	ef->async.max_pending = max_pending;
+	ef->async.sync = sync;
+	ef->async.enabled = true;
+
+	return 0;
+}
+
+/** Append data to a file
+ *
+ * If buffering has been enabled with #exfile_async_enable, the data is
+ * copied, and written later by the writer thread.  Otherwise the file
+ * is opened, locked, and written to immediately.
+ *
+ * @param[in] ef		The logfile context returned from #exfile_init.
+ * @param[in] request		The current request.
+ * @param[in] filename		the file to append to.
+ * @param[in] permissions	to use if the file is created.
+ * @param[in] gid		to set on the file, or -1 to leave it alone.
+ * @param[in] vector		of data to write.
+ * @param[in] vector_len	number of entries in vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_write(exfile_t *ef, REQUEST *request, char const *filename, mode_t permissions, gid_t gid,
+		 struct iovec const *vector, int vector_len)
+{
+	exfile_pending_t	*p;
+	uint32_t		hash;
+	size_t			len = 0;
+	uint8_t			*data, *q;
+	int			i;
+
+	for (i = 0; i < vector_len; i++) len += vector[i].iov_len;
+	if (len == 0) return 0;
+
+	if (!ef->async.enabled) {
+		struct iovec	*my_vector;
+		int		fd, ret = 0;
+
+		/*
+		 *	exfile_writev() modifies the vector on short writes.
+		 */
+		my_vector = talloc_memdup(NULL, vector, sizeof(*vector) * vector_len);
+		if (!my_vector) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+
+		fd = exfile_open(ef, request, filename, permissions, true);
+		if (fd < 0) {
+			talloc_free(my_vector);
+			return -1;
+		}
+
+		if ((gid != (gid_t) -1) && (fchown(fd, -1, gid) < 0)) {
+			RWARN("Unable to change system group of %s: %s", filename, fr_syserror(errno));
+		}
+
+		if (exfile_writev(fd, my_vector, vector_len) < 0) {
+			fr_strerror_printf("Failed writing to %s: %s", filename, fr_syserror(errno));
+			ret = -1;
+		}
+
+		exfile_close(ef, request, fd);
+		talloc_free(my_vector);
+
+		return ret;
+	}
+
+	hash = fr_hash_string(filename);
+
+	pthread_mutex_lock(&ef->async.mutex);
+
+	if (!ef->async.running) {
+		if (pthread_create(&ef->async.thread, NULL, exfile_writer, ef) != 0) {
+			pthread_mutex_unlock(&ef->async.mutex);
+			fr_strerror_printf("Failed creating writer thread: %s", fr_syserror(errno));
+			return -1;
+		}
+		ef->async.running = true;
+	}
+
+	/*
+	 *	Too much data is buffered.  Wait for the writer to
+	 *	catch up, rather than using unbounded memory.
+	 */
+	while (!ef->async.stop && ef->async.head && ((ef->async.pending + len) > ef->async.max_pending)) {
+		pthread_cond_signal(&ef->async.wakeup);
+		pthread_cond_wait(&ef->async.drained, &ef->async.mutex);
+	}
+
+	for (p = ef->async.head; p; p = p->next) {
+		if ((p->hash == hash) && (p->permissions == permissions) && (p->gid == gid) &&
+		    (strcmp(p->filename, filename) == 0)) break;
+	}
+
+	if (!p) {
+		p = talloc_zero(NULL, exfile_pending_t);
+		if (!p) {
+		oom:
+			pthread_mutex_unlock(&ef->async.mutex);
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		p->hash = hash;
+		p->filename = talloc_strdup(p, filename);
+		p->permissions = permissions;
+		p->gid = gid;
+
+		if (!ef->async.head) pthread_cond_signal(&ef->async.wakeup);
+		p->next = ef->async.head;
+		ef->async.head = p;
+	}
+
+	if ((p->vector_len % 16) == 0) {
+		struct iovec *vec;
+
+		vec = talloc_realloc(p, p->vector, struct iovec, p->vector_len + 16);
+		if (!vec) goto oom;
+		p->vector = vec;
+	}
+
+	data = q = talloc_array(p, uint8_t, len);
+	if (!data) goto oom;
+
+	for (i = 0; i < vector_len; i++) {
+		memcpy(q, vector[i].iov_base, vector[i].iov_len);
+		q += vector[i].iov_len;
+	}
+
+	p->vector[p->vector_len].iov_base = data;
+	p->vector[p->vector_len].iov_len = len;
+	p->vector_len++;
+
+	ef->async.pending += len;
+	if (ef->async.pending >= (ef->async.max_pending / 2)) pthread_cond_signal(&ef->async.wakeup);
+
+	pthread_mutex_unlock(&ef->async.mutex);
+
+	return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file job_pool.c
+ * @brief Run blocking work in a pool of threads, and resume requests when it completes.
+ *
+ * Modules which have to call blocking libraries (crypt, winbind, kerberos,
+ * expensive EC operations) queue a job to a pool of threads, and yield.
+ * Each worker has a pipe watched by its event list.  When a job has been
+ * run, the pool thread writes a pointer to it to the pipe of the worker
+ * which queued it, and the worker marks the request resumable.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/job_pool.h>
+
+#include <pthread.h>
+
+typedef enum {
+	FR_JOB_QUEUED = 0,			//!< Waiting for a pool thread.
+	FR_JOB_RUNNING,				//!< A pool thread is using the job data.
+	FR_JOB_COMPUTED				//!< The job data is no longer used by the pool thread.
+} fr_job_state_t;
+
+/** A job queued by a worker, and run by a pool thread
+ *
+ */
+struct fr_job {
+	REQUEST			*request;	//!< To resume.  NULL if the job has been cancelled.
+	bool			done;		//!< Worker has received the result, or never will.
+	fr_job_state_t		state;		//!< Protected by the pool's mutex.
+
+	fr_job_pool_t		*pool;		//!< Pool the job was queued on.
+	fr_job_return_t		*r;		//!< Worker the result is sent back to.
+	fr_job_t		*next;		//!< Next job waiting for a pool thread.
+
+	void			*data;		//!< Of the module, parented by the job.
+};
+
+/** A pool thread, and the state it runs jobs with
+ *
+ */
+typedef struct fr_job_thread_t {
+	pthread_t		pthread_id;
+	fr_job_pool_t		*pool;		//!< Pool this thread belongs to.
+	void			*thread;	//!< Created by thread_alloc, or NULL.
+} fr_job_thread_t;
+
+/** Runs jobs for all workers
+ *
+ */
+struct fr_job_pool {
+	char const		*name;		//!< Of the pool, for log messages.
+
+	fr_job_run_t		run;		//!< Run a job.
+	fr_job_fail_t		fail;		//!< Fail a job which won't be run.
+	fr_job_thread_free_t	thread_free;	//!< Free the state of a pool thread.
+	void			*uctx;		//!< Passed to the callbacks.
+
+	pthread_mutex_t		mutex;		//!< Protects the queue, and job states.
+	pthread_cond_t		cond;		//!< Signalled when a job is queued.
+	pthread_cond_t		computed;	//!< Broadcast when a job is computed.
+	fr_job_t		*head;		//!< Oldest job.
+	fr_job_t		**tail;		//!< Where to link the next job.
+	bool			stop;		//!< Pool threads should exit.
+
+	fr_job_thread_t		*threads;
+	uint32_t		num_alloced;	//!< Number of threads which have state.
+	uint32_t		num_threads;	//!< Number of threads which were started.
+};
+
+/** Where completed jobs are sent for a single worker
+ *
+ * The structure outlives the worker if jobs are still outstanding when
+ * it exits, and is freed when the last one completes.
+ */
+struct fr_job_return {
+	char const		*name;		//!< Of the pool, for log messages.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	int			pipe[2];	//!< Read by the worker, written by pool threads.
+	fr_event_list_t		*el;		//!< Worker's event list.
+	fr_job_wake_t		wake;		//!< Resumes requests.
+	uint32_t		outstanding;	//!< Jobs sent, which haven't completed yet.
+	bool			detached;	//!< Worker has exited, discard results.
+};
+
+/** Free a return once the worker and every outstanding job are finished with it
+ *
+ */
+static void job_return_release(fr_job_return_t *r, bool last)
+{
+	if (!last) return;
+
+	pthread_mutex_destroy(&r->mutex);
+	talloc_free(r);
+}
+
+/** Hand a computed job back to the worker which sent it
+ *
+ * The pool's mutex is held until the job has been written, so that
+ * #fr_job_cancel sees whether or not the worker will receive it.  If
+ * the worker has already exited, the job is discarded, and the last
+ * job to complete frees the worker's fr_job_return_t.
+ */
+static void job_complete(fr_job_t *job)
+{
+	fr_job_pool_t	*pool = job->pool;
+	fr_job_return_t	*r = job->r;
+	bool		last;
+
+	pthread_mutex_lock(&pool->mutex);
+	job->state = FR_JOB_COMPUTED;
+	pthread_cond_broadcast(&pool->computed);
+
+	pthread_mutex_lock(&r->mutex);
+	r->outstanding--;
+
+	/*
+	 *	Writes of less than PIPE_BUF are atomic, so many
+	 *	pool threads can write to the same pipe.
+	 */
+	if (!r->detached) {
+		if (write(r->pipe[1], &job, sizeof(job)) == sizeof(job)) {
+			pthread_mutex_unlock(&r->mutex);
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+		ERROR("Failed signalling completion of %s job: %s", pool->name, fr_syserror(errno));
+
+		/*
+		 *	The request won't be resumed.  The job is
+		 *	freed when it's cancelled, if it hasn't
+		 *	been already.
+		 */
+		if (job->request) {
+			job->done = true;
+			pthread_mutex_unlock(&r->mutex);
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+	}
+
+	last = (r->detached && (r->outstanding == 0));
+	pthread_mutex_unlock(&r->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	talloc_free(job);
+
+	job_return_release(r, last);
+}
+
+/** Run queued jobs until told to stop
+ *
+ */
+static void *job_thread(void *arg)
+{
+	fr_job_thread_t	*thread = arg;
+	fr_job_pool_t	*pool = thread->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		fr_job_t *job;
+
+		while (!pool->head && !pool->stop) pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stop) break;
+
+		job = pool->head;
+		pool->head = job->next;
+		if (!pool->head) pool->tail = &pool->head;
+		job->next = NULL;
+		job->state = FR_JOB_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->run(thread->thread, job->data, pool->uctx);
+		job_complete(job);
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Stop the pool threads, and fail any jobs which haven't been run
+ *
+ * @param[in] pool	to free.
+ */
+void fr_job_pool_free(fr_job_pool_t *pool)
+{
+	uint32_t	i;
+	fr_job_t	*job;
+
+	if (!pool) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i].pthread_id, NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	while ((job = pool->head)) {
+		pool->head = job->next;
+		if (!pool->head) pool->tail = &pool->head;
+		job->next = NULL;
+		job->state = FR_JOB_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->fail(job->data, pool->uctx);
+		job_complete(job);
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (pool->thread_free) for (i = 0; i < pool->num_alloced; i++) {
+		pool->thread_free(pool->threads[i].thread, pool->uctx);
+	}
+
+	pthread_cond_destroy(&pool->computed);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	talloc_free(pool);
+}
+
+/** Start threads to run jobs
+ *
+ * The pool isn't parented by the module instance, as instance data is
+ * read only after instantiation.  It must be freed with #fr_job_pool_free.
+ *
+ * @param[in] ctx		to allocate the pool in.  Must not be read only.
+ * @param[in] name		of the pool, for log messages.  Must outlive the pool.
+ * @param[in] num_threads	Number of pool threads to start.
+ * @param[in] run		a job.
+ * @param[in] fail		a job which won't be run, as the pool is being freed.
+ * @param[in] thread_alloc	create the state each pool thread runs jobs with.  May be NULL.
+ * @param[in] thread_free	free that state.  May be NULL.
+ * @param[in] uctx		passed to the callbacks.
+ * @return
+ *	- New pool of threads.
+ *	- NULL on error.
+ */
+fr_job_pool_t *fr_job_pool_alloc(TALLOC_CTX *ctx, char const *name, uint32_t num_threads,
+				 fr_job_run_t run, fr_job_fail_t fail,
+				 fr_job_thread_alloc_t thread_alloc, fr_job_thread_free_t thread_free,
+				 void *uctx)
+{
+	fr_job_pool_t	*pool;
+	uint32_t	i;
+	int		ret;
+
+	pool = talloc_zero(ctx, fr_job_pool_t);
+	if (!pool) return NULL;
+
+	pool->threads = talloc_zero_array(pool, fr_job_thread_t, num_threads);
+	if (!pool->threads) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	pool->name = name;
+	pool->run = run;
+	pool->fail = fail;
+	pool->thread_free = thread_free;
+	pool->uctx = uctx;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->computed, NULL);
+	pool->tail = &pool->head;
+
+	for (i = 0; i < num_threads; i++) {
+		pool->threads[i].pool = pool;
+
+		if (!thread_alloc) continue;
+
+		pool->threads[i].thread = thread_alloc(pool->threads, uctx);
+		if (!pool->threads[i].thread) {
+			ERROR("Failed creating state for %s thread", name);
+			fr_job_pool_free(pool);
+			return NULL;
+		}
+		pool->num_alloced++;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_create(&pool->threads[i].pthread_id, NULL, job_thread, &pool->threads[i]);
+		if (ret != 0) {
+			ERROR("Failed creating %s thread: %s", name, fr_syserror(ret));
+			fr_job_pool_free(pool);
+			return NULL;
+		}
+		pool->num_threads++;
+	}
+
+	return pool;
+}
+
+/** Resume the requests of completed jobs
+ *
+ */
+static void job_return_read(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	fr_job_return_t	*r = ctx;
+	fr_job_t	*jobs[32];
+	ssize_t		slen;
+	size_t		i;
+
+	slen = read(fd, jobs, sizeof(jobs));
+	if (slen < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN)) return;
+
+		ERROR("Failed reading completed %s jobs: %s", r->name, fr_syserror(errno));
+		return;
+	}
+	rad_assert((slen % sizeof(jobs[0])) == 0);
+
+	for (i = 0; i < (slen / sizeof(jobs[0])); i++) {
+		fr_job_t *job = jobs[i];
+
+		/*
+		 *	Request was cancelled while the job was running.
+		 */
+		if (!job->request) {
+			talloc_free(job);
+			continue;
+		}
+
+		job->done = true;
+		r->wake(job->request);
+	}
+}
+
+/** Create the pipe a worker receives completed jobs on
+ *
+ * @param[in] pool	the worker will queue jobs on.
+ * @param[in] el	of the worker.
+ * @param[in] wake	Called to resume requests, usually unlang_resumable().
+ * @return
+ *	- New fr_job_return_t.
+ *	- NULL on error.
+ */
+fr_job_return_t *fr_job_return_alloc(fr_job_pool_t *pool, fr_event_list_t *el, fr_job_wake_t wake)
+{
+	fr_job_return_t *r;
+
+	/*
+	 *	May be freed by a pool thread, so not parented
+	 *	by anything.
+	 */
+	r = talloc_zero(NULL, fr_job_return_t);
+	if (!r) return NULL;
+
+	r->name = pool->name;
+
+	if (pipe(r->pipe) < 0) {
+		ERROR("Failed creating %s completion pipe: %s", r->name, fr_syserror(errno));
+		talloc_free(r);
+		return NULL;
+	}
+
+	if ((fr_nonblock(r->pipe[0]) < 0) ||
+	    (fr_event_fd_insert(el, r->pipe[0], job_return_read, NULL, NULL, r) < 0)) {
+		ERROR("Failed watching %s completion pipe", r->name);
+		close(r->pipe[0]);
+		close(r->pipe[1]);
+		talloc_free(r);
+		return NULL;
+	}
+
+	pthread_mutex_init(&r->mutex, NULL);
+	r->el = el;
+	r->wake = wake;
+
+	return r;
+}
+
+/** Stop receiving completed jobs, when the worker's event list has already been freed
+ *
+ * Jobs which complete after this are discarded.
+ *
+ * @param[in] r		to free.
+ */
+void fr_job_return_detach(fr_job_return_t *r)
+{
+	bool last;
+
+	if (!r) return;
+
+	pthread_mutex_lock(&r->mutex);
+	close(r->pipe[0]);
+	close(r->pipe[1]);
+	r->detached = true;
+	last = (r->outstanding == 0);
+	pthread_mutex_unlock(&r->mutex);
+
+	job_return_release(r, last);
+}
+
+/** Stop receiving completed jobs
+ *
+ * Jobs which complete after this are discarded.
+ *
+ * @param[in] r		to free.
+ */
+void fr_job_return_free(fr_job_return_t *r)
+{
+	if (!r) return;
+
+	(void) fr_event_fd_delete(r->el, r->pipe[0]);
+
+	fr_job_return_detach(r);
+}
+
+/** Allocate a job
+ *
+ * Data for the pool thread should be allocated in the job, and passed
+ * to #fr_job_send.  Everything the job needs must be copied, as the
+ * request can't be used by the pool thread.
+ *
+ * @param[in] r		of the worker processing the request.
+ * @param[in] request	to resume when the job completes.
+ * @return
+ *	- New job.
+ *	- NULL on error.
+ */
+fr_job_t *fr_job_alloc(fr_job_return_t *r, REQUEST *request)
+{
+	fr_job_t *job;
+
+	/*
+	 *	May be freed by the worker or a pool thread,
+	 *	so not parented by the request.
+	 */
+	job = talloc_zero(NULL, fr_job_t);
+	if (!job) return NULL;
+
+	job->request = request;
+	job->r = r;
+
+	return job;
+}
+
+/** Queue a job to be run by a pool thread
+ *
+ * The request is marked resumable when the job completes.  After
+ * reading the result, the job is freed with #fr_job_cancel.
+ *
+ * @param[in] pool	to run the job.
+ * @param[in] job	allocated with #fr_job_alloc.
+ * @param[in] data	passed to the run callback.  Should be parented by the job.
+ */
+void fr_job_send(fr_job_pool_t *pool, fr_job_t *job, void *data)
+{
+	job->pool = pool;
+	job->data = data;
+
+	pthread_mutex_lock(&job->r->mutex);
+	job->r->outstanding++;
+	pthread_mutex_unlock(&job->r->mutex);
+
+	pthread_mutex_lock(&pool->mutex);
+	job->state = FR_JOB_QUEUED;
+	*pool->tail = job;
+	pool->tail = &job->next;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Get the data of a job
+ *
+ * Only valid once the job has been sent with #fr_job_send.
+ *
+ * @param[in] job	to get the data of.
+ * @return the data passed to #fr_job_send.
+ */
+void *fr_job_data(fr_job_t *job)
+{
+	return job->data;
+}
+
+/** Stop waiting for a job, or free a completed one
+ *
+ * Jobs which haven't started are removed from the queue.  If the job
+ * is still running, it's freed when the worker reads the result from
+ * the pipe.
+ *
+ * @param[in] job	to cancel.
+ * @param[in] wait	for a running job to finish with its data.
+ */
+static void job_cancel(fr_job_t *job, bool wait)
+{
+	fr_job_pool_t	*pool = job->pool;
+	fr_job_t	**last;
+
+	/*
+	 *	Never sent.
+	 */
+	if (!pool) {
+		talloc_free(job);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (job->state == FR_JOB_QUEUED) {
+		for (last = &pool->head; *last != job; last = &(*last)->next) rad_assert(*last != NULL);
+
+		*last = job->next;
+		if (pool->tail == &job->next) pool->tail = last;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pthread_mutex_lock(&job->r->mutex);
+		job->r->outstanding--;
+		pthread_mutex_unlock(&job->r->mutex);
+
+		talloc_free(job);
+		return;
+	}
+
+	if (wait) while (job->state != FR_JOB_COMPUTED) pthread_cond_wait(&pool->computed, &pool->mutex);
+
+	if (job->done) {
+		pthread_mutex_unlock(&pool->mutex);
+		talloc_free(job);
+		return;
+	}
+	job->request = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Stop waiting for a job, or free a completed one
+ *
+ * @param[in] job	to cancel.
+ */
+void fr_job_cancel(fr_job_t *job)
+{
+	job_cancel(job, false);
+}
+
+/** Stop waiting for a job, and wait until a running job has finished with its data
+ *
+ * For jobs whose data points into something the caller is about to free.
+ *
+ * @param[in] job	to cancel.
+ */
+void fr_job_cancel_wait(fr_job_t *job)
+{
+	job_cancel(job, true);
+}
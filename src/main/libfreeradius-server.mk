@@ -4,14 +4,19 @@ SOURCES	:=	cond_eval.c \
 		cond_tokenize.c \
 		conffile.c \
 		connection.c \
+		connection_mux.c \
+		detail.c \
 		dl.c \
 		exec.c \
 		exfile.c \
 		log.c \
 		map_proc.c \
 		map.c \
+		job_pool.c \
+		mem_account.c \
 		regex.c \
 		request.c \
+		trace.c \
 		trigger.c \
 		tmpl.c \
 		util.c \
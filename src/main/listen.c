@@ -51,6 +51,10 @@ RCSID("$Id$")
 #  include <sys/stat.h>
 #endif
 
+#ifdef HAVE_LINUX_FILTER_H
+#  include <linux/filter.h>
+#endif
+
 #ifdef DEBUG_PRINT_PACKET
 static void print_packet(RADIUS_PACKET *packet)
 {
@@ -515,6 +519,13 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		if (now == client->last_new_client) goto unknown;
 	}
 
+	/*
+	 *	Don't run the lookup again for addresses which
+	 *	recently failed it, or which are being looked up too
+	 *	often.
+	 */
+	if (!client_dynamic_lookup_allowed(client, ipaddr, now)) goto unknown;
+
 	client->last_new_client = now;
 
 	request = request_alloc(NULL);
@@ -566,8 +577,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 	case RLM_MODULE_FAIL:
 		ERROR("Virtual-Server %s returned %s, creating dynamic client failed", request->server,
 		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
-		talloc_free(request);
-		goto unknown;
+		goto failed;
 
 	/*
 	 *	Probably the result of policy, or the client not existing.
@@ -575,8 +585,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 	default:
 		DEBUG("Virtual-Server %s returned %s, ignoring client", request->server,
 		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
-		talloc_free(request);
-		goto unknown;
+		goto failed;
 	}
 
 	/*
@@ -591,7 +600,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		/*
 		 *	This frees the client if it isn't valid.
 		 */
-		if (!client_add_dynamic(clients, client, created)) goto unknown;
+		if (!client_add_dynamic(clients, client, created)) goto failed;
 	}
 
 	request->server = client->server;
@@ -601,9 +610,17 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	talloc_free(request);
 
-	if (!created) goto unknown;
+	if (!created) {
+		client_dynamic_lookup_failed(client, ipaddr, now);
+		goto unknown;
+	}
 
 	return created;
+
+failed:
+	talloc_free(request);
+	client_dynamic_lookup_failed(client, ipaddr, now);
+	goto unknown;
 #endif
 }
 
@@ -719,6 +736,235 @@ rlm_rcode_t rad_status_server(REQUEST *request)
 	return 0;
 }
 
+/** A reply to Status-Server, which can be sent again without running the virtual server
+ *
+ */
+struct listen_status_reply {
+	RADCLIENT const		*client;	//!< The reply was sent to.
+	time_t			expires;	//!< When the reply has to be built again.
+	unsigned int		code;		//!< Of the reply.
+	ssize_t			offset;		//!< Of the Message-Authenticator, or 0 if there's none.
+	uint8_t			*data;		//!< The encoded reply.
+	size_t			data_len;	//!< Length of the encoded reply.
+};
+
+static pthread_mutex_t	status_reply_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Remember the reply to a Status-Server request
+ *
+ * Later probes from the same client are answered from the cached reply,
+ * by #status_server_fast, until "status_server_cache" seconds have passed.
+ * The next probe is then processed as normal, which builds the cached
+ * reply again.
+ *
+ * Only replies which don't depend on the contents of the probe are kept.
+ * These are replies to probes without Proxy-State or vendor attributes,
+ * which don't contain encrypted attributes.  Anything else, including
+ * not sending a reply, removes the cached reply.
+ *
+ * @param[in] request	the Status-Server request which has been finished.
+ */
+void listen_status_reply_update(REQUEST *request)
+{
+	rad_listen_t		*listener = request->listener;
+	RADIUS_PACKET		*reply = request->reply;
+	listen_socket_t		*sock;
+	listen_status_reply_t	*entry = NULL, *old;
+	VALUE_PAIR		*vp;
+	vp_cursor_t		cursor;
+
+	if (!main_config.status_server_cache || !listener || (request->packet->code != PW_CODE_STATUS_SERVER)) return;
+
+	switch (listener->type) {
+	case RAD_LISTEN_AUTH:
+#ifdef WITH_ACCOUNTING
+	case RAD_LISTEN_ACCT:
+#endif
+		break;
+
+	default:
+		return;
+	}
+
+	sock = listener->data;
+	if (sock->proto != IPPROTO_UDP) return;
+
+	if (!reply->code || !reply->data ||
+	    (reply->data_len < RADIUS_HDR_LEN) || (reply->data_len > MAX_PACKET_LEN)) goto update;
+
+	for (vp = fr_pair_cursor_init(&cursor, &request->packet->vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (vp->da->vendor || (vp->da->attr == PW_PROXY_STATE)) goto update;
+	}
+
+	for (vp = fr_pair_cursor_init(&cursor, &reply->vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (vp->da->flags.encrypt != FLAG_ENCRYPT_NONE) goto update;
+	}
+
+	entry = talloc_zero(sock, listen_status_reply_t);
+	if (!entry) goto update;
+
+	entry->data = talloc_memdup(entry, reply->data, reply->data_len);
+	if (!entry->data) {
+		TALLOC_FREE(entry);
+		goto update;
+	}
+	entry->data_len = reply->data_len;
+	entry->client = request->client;
+	entry->expires = time(NULL) + main_config.status_server_cache;
+	entry->code = reply->code;
+	entry->offset = (reply->offset > 0) ? reply->offset : 0;
+
+update:
+	pthread_mutex_lock(&status_reply_mutex);
+	old = sock->status_reply;
+	sock->status_reply = entry;
+	pthread_mutex_unlock(&status_reply_mutex);
+
+	talloc_free(old);
+}
+
+/** Answer a Status-Server probe from the cached reply
+ *
+ * This is called before the probe is read.  If there's a cached reply
+ * for the client, the probe is read into a buffer on the stack, the
+ * Message-Authenticator is checked, and the cached reply is signed and
+ * sent.  No request is allocated, and the virtual server isn't run.
+ *
+ * Otherwise the probe is left in the receive queue, to be processed as
+ * normal.
+ *
+ * If "status_server_overload" is set, probes are discarded while the
+ * kernel is dropping packets, so that the load balancer sends new
+ * traffic to other servers.
+ *
+ * @param[in] listener	the probe was received on.
+ * @param[in] client	which sent the probe.
+ * @return
+ *	- true if the probe was answered, or discarded.
+ *	- false if the probe should be processed as normal.
+ */
+static bool status_server_fast(rad_listen_t *listener, RADCLIENT *client)
+{
+	listen_socket_t		*sock = listener->data;
+	listen_status_reply_t	*entry;
+	RADIUS_PACKET		packet, reply;
+	uint8_t			packet_data[MAX_PACKET_LEN], reply_data[MAX_PACKET_LEN];
+	uint8_t			*attr, *end;
+	ssize_t			data_len;
+	bool			seen_ma = false;
+	time_t			now = time(NULL);
+
+	if (main_config.status_server_overload) {
+		if (listen_socket_drops(listener, now) > 0) thread_pool_overloaded(now);
+
+		if (thread_pool_is_overloaded(now)) {
+			udp_recv_discard(listener->fd);
+			RATE_LIMIT(WARN("Ignoring Status-Server request, as the server is overloaded"));
+			return true;
+		}
+	}
+
+	if (!main_config.status_server_cache) return false;
+
+	memset(&reply, 0, sizeof(reply));
+
+	/*
+	 *	Copy the cached reply, so that it can be replaced
+	 *	while we're signing it.
+	 */
+	pthread_mutex_lock(&status_reply_mutex);
+	entry = sock->status_reply;
+	if (!entry || (entry->client != client) || (entry->expires <= now)) {
+		pthread_mutex_unlock(&status_reply_mutex);
+		return false;
+	}
+	memcpy(reply_data, entry->data, entry->data_len);
+	reply.data_len = entry->data_len;
+	reply.code = entry->code;
+	reply.offset = entry->offset;
+	pthread_mutex_unlock(&status_reply_mutex);
+
+	memset(&packet, 0, sizeof(packet));
+	data_len = udp_recv(listener->fd, packet_data, sizeof(packet_data), UDP_FLAGS_PEEK,
+			    &packet.src_ipaddr, &packet.src_port,
+			    &packet.dst_ipaddr, &packet.dst_port,
+			    &packet.if_index, NULL);
+	if ((data_len < RADIUS_HDR_LEN) || (((packet_data[2] << 8) | packet_data[3]) != data_len)) return false;
+
+	/*
+	 *	Anything which the normal path might treat
+	 *	differently goes through the normal path, which also
+	 *	complains about malformed packets.
+	 */
+	attr = packet_data + RADIUS_HDR_LEN;
+	end = packet_data + data_len;
+	while (attr < end) {
+		if (((end - attr) < 2) || (attr[1] < 2) || (attr[1] > (end - attr))) return false;
+
+		switch (attr[0]) {
+		case PW_PROXY_STATE:
+		case PW_VENDOR_SPECIFIC:
+			return false;
+
+		case PW_MESSAGE_AUTHENTICATOR:
+			if (seen_ma || (attr[1] != (2 + AUTH_VECTOR_LEN))) return false;
+			seen_ma = true;
+			break;
+
+		default:
+			break;
+		}
+
+		attr += attr[1];
+	}
+	if (!seen_ma) return false;
+
+	packet.sockfd = listener->fd;
+	packet.code = packet_data[0];
+	packet.id = packet_data[1];
+	memcpy(packet.vector, packet_data + 4, AUTH_VECTOR_LEN);
+	packet.data = packet_data;
+	packet.data_len = data_len;
+
+	if (fr_radius_verify(&packet, NULL, client->secret) < 0) return false;
+
+	udp_recv_discard(listener->fd);
+
+	reply.id = packet.id;
+	reply_data[1] = packet.id;
+	reply.data = reply_data;
+
+	if (fr_radius_sign(&reply, &packet, client->secret) < 0) {
+		if (DEBUG_ENABLED) ERROR("Failed signing cached Status-Server reply: %s", fr_strerror());
+		return true;
+	}
+
+	if (udp_send(listener->fd, reply.data, reply.data_len, 0,
+		     &packet.dst_ipaddr, packet.dst_port, packet.if_index,
+		     &packet.src_ipaddr, packet.src_port) < 0) {
+		if (DEBUG_ENABLED) ERROR("Failed sending cached Status-Server reply: %s", fr_syserror(errno));
+		return true;
+	}
+
+#ifdef WITH_ACCOUNTING
+	if (listener->type == RAD_LISTEN_ACCT) {
+		FR_STATS_INC(acct, total_responses);
+	} else
+#endif
+	{
+		FR_STATS_INC(auth, total_responses);
+	}
+
+	DEBUG2("Sent cached %s Id %i to %s port %u, in reply to Status-Server",
+	       fr_packet_codes[reply.code], reply.id, client->shortname, packet.src_port);
+
+	return true;
+}
+
 #ifdef WITH_TCP
 static int dual_tcp_recv(rad_listen_t *listener)
 {
@@ -858,8 +1104,92 @@ static int _common_socket_free(listen_socket_t *sock)
 		sock->home->limit.num_connections--;
 	}
 
+	if (sock->home) pthread_mutex_destroy(&sock->write_mutex);
+
 	return 0;
 }
+
+#define LISTEN_WRITE_QUEUE_MAX	(65536)
+
+/** Write data to a TCP socket, batching it with data from other threads
+ *
+ *  If another thread is already writing to the socket, the data is
+ *  queued, and that thread writes it.  Otherwise, we write all of
+ *  the queued data, until the queue is empty.  When many threads
+ *  proxy to the same home server, one write() then carries many
+ *  packets.
+ *
+ *  If the queue is full, the home server isn't keeping up, and the
+ *  data is discarded.  The proxy code will retransmit, or time out.
+ *
+ * @param[in] listener to write to.
+ * @param[in] data to write.
+ * @param[in] data_len length of data.
+ * @param[in] write_fn which writes the data to the socket.  Must
+ *	write all of the data, or return < 0.
+ * @return
+ *	- 0 if the data was written, or queued.
+ *	- -1 on error.
+ */
+int listen_write_batched(rad_listen_t *listener, uint8_t const *data, size_t data_len, listen_write_t write_fn)
+{
+	listen_socket_t *sock = listener->data;
+	int rcode = 0;
+
+	pthread_mutex_lock(&sock->write_mutex);
+	if ((sock->write_queued + data_len) > LISTEN_WRITE_QUEUE_MAX) {
+		pthread_mutex_unlock(&sock->write_mutex);
+		fr_strerror_printf("Write queue is full");
+		return -1;
+	}
+
+	if (!sock->write_queue) {
+		sock->write_queue = talloc_array(sock, uint8_t, LISTEN_WRITE_QUEUE_MAX);
+		sock->write_spare = talloc_array(sock, uint8_t, LISTEN_WRITE_QUEUE_MAX);
+		if (!sock->write_queue || !sock->write_spare) {
+			TALLOC_FREE(sock->write_queue);
+			TALLOC_FREE(sock->write_spare);
+			pthread_mutex_unlock(&sock->write_mutex);
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+	}
+
+	memcpy(sock->write_queue + sock->write_queued, data, data_len);
+	sock->write_queued += data_len;
+
+	if (sock->writing) {
+		pthread_mutex_unlock(&sock->write_mutex);
+		return 0;
+	}
+	sock->writing = true;
+
+	while (sock->write_queued > 0) {
+		uint8_t	*out = sock->write_queue;
+		size_t	out_len = sock->write_queued;
+
+		/*
+		 *	Other threads can queue more data while we
+		 *	write this.
+		 */
+		sock->write_queue = sock->write_spare;
+		sock->write_spare = out;
+		sock->write_queued = 0;
+		pthread_mutex_unlock(&sock->write_mutex);
+
+		rcode = (write_fn(listener, out, out_len) < 0) ? -1 : 0;
+
+		pthread_mutex_lock(&sock->write_mutex);
+		if (rcode < 0) {
+			sock->write_queued = 0;
+			break;
+		}
+	}
+	sock->writing = false;
+	pthread_mutex_unlock(&sock->write_mutex);
+
+	return rcode;
+}
 #endif
 
 static int dual_tcp_accept(rad_listen_t *listener)
@@ -1253,6 +1583,8 @@ static CONF_PARSER performance_config[] = {
 
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("max_pps", PW_TYPE_INTEGER, listen_socket_t, max_rate) },
+	{ FR_CONF_OFFSET("client_filter", PW_TYPE_BOOLEAN, listen_socket_t, client_filter), .dflt = "no" },
+	{ FR_CONF_OFFSET("recv_buff_max", PW_TYPE_INTEGER, listen_socket_t, recv_buff_max), .dflt = "0" },
 
 #ifdef WITH_TCP
 	{ FR_CONF_OFFSET("max_connections", PW_TYPE_INTEGER, listen_socket_t, limit.max_connections), .dflt = "16" },
@@ -1424,6 +1756,12 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			return -1;
 		}
 
+		if (sock->recv_buff_max) {
+			FR_INTEGER_BOUND_CHECK("recv_buff_max", sock->recv_buff_max, >=, recv_buff);
+			FR_INTEGER_BOUND_CHECK("recv_buff_max", sock->recv_buff_max, >=, 32);
+			FR_INTEGER_BOUND_CHECK("recv_buff_max", sock->recv_buff_max, <=, INT_MAX);
+		}
+
 #ifdef WITH_TCP
 		if ((sock->limit.idle_timeout > 0) && (sock->limit.idle_timeout < 5)) {
 			WARN("Setting idle_timeout to 5");
@@ -1454,6 +1792,37 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 #endif
 	}
 
+	/*
+	 *	Several sockets bound to the same address, each with
+	 *	its own receive queue.  The kernel hashes each client
+	 *	to one socket, so duplicate detection still works.
+	 */
+	rcode = cf_pair_parse(cs, "num_sockets", FR_ITEM_POINTER(PW_TYPE_INTEGER, &this->num_sockets),
+			      "1", T_BARE_WORD);
+	if (rcode < 0) return -1;
+	FR_INTEGER_BOUND_CHECK("num_sockets", this->num_sockets, >=, 1);
+	FR_INTEGER_BOUND_CHECK("num_sockets", this->num_sockets, <=, 64);
+
+	if (this->num_sockets > 1) {
+#ifndef SO_REUSEPORT
+		cf_log_err_cs(cs, "System does not support SO_REUSEPORT.  Delete 'num_sockets' from the "
+			      "configuration file");
+		return -1;
+#else
+		if (sock->proto != IPPROTO_UDP) {
+			cf_log_err_cs(cs, "'num_sockets' can only be used with UDP sockets");
+			return -1;
+		}
+
+#  ifdef WITH_PROXY
+		if (this->type == RAD_LISTEN_PROXY) {
+			cf_log_err_cs(cs, "'num_sockets' cannot be used with proxy sockets");
+			return -1;
+		}
+#  endif
+#endif
+	}
+
 	sock->my_ipaddr = ipaddr;
 	sock->recv_buff = recv_buff;
 
@@ -1725,11 +2094,53 @@ static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
  *
  *	FIXME: have different code for proxy auth & acct!
  */
+#ifdef WITH_TCP
+static ssize_t proxy_socket_tcp_write(rad_listen_t *listener, uint8_t const *data, size_t data_len)
+{
+	size_t done = 0;
+
+	while (done < data_len) {
+		ssize_t rcode;
+
+		rcode = write(listener->fd, data + done, data_len - done);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing to socket: %s", fr_syserror(errno));
+			return -1;
+		}
+		done += rcode;
+	}
+
+	return done;
+}
+#endif
+
 static int proxy_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->proxy->listener == listener);
 	rad_assert(listener->send == proxy_socket_send);
 
+#ifdef WITH_TCP
+	if (((listen_socket_t *) listener->data)->proto == IPPROTO_TCP) {
+		RADIUS_PACKET *packet = request->proxy->packet;
+
+		if (!packet->data &&
+		    ((fr_radius_encode(packet, NULL, request->proxy->home_server->secret) < 0) ||
+		     (fr_radius_sign(packet, NULL, request->proxy->home_server->secret) < 0))) {
+			RERROR("Failed encoding proxied request: %s", fr_strerror());
+			return -1;
+		}
+
+		if (listen_write_batched(listener, packet->data, packet->data_len, proxy_socket_tcp_write) < 0) {
+			RERROR("Failed sending proxied request: %s", fr_strerror());
+			return -1;
+		}
+
+		return 0;
+	}
+#endif
+
 	if (fr_radius_send(request->proxy->packet, NULL,
 			   request->proxy->home_server->secret) < 0) {
 		RERROR("Failed sending proxied request: %s",
@@ -1775,7 +2186,7 @@ static int stats_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(&client->auth, total_requests);
 
 	/*
 	 *	We only understand Status-Server on this socket.
@@ -1845,7 +2256,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(&client->auth, total_requests);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -1862,6 +2273,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 			WARN("Ignoring Status-Server request due to security configuration");
 			return 0;
 		}
+		if (status_server_fast(listener, client)) return 0;
 		fun = rad_status_server;
 		break;
 
@@ -1959,7 +2371,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->acct.total_requests);
+	FR_STATS_TYPE_INC(&client->acct, total_requests);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -1977,6 +2389,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 			WARN("Ignoring Status-Server request due to security configuration");
 			return 0;
 		}
+		if (status_server_fast(listener, client)) return 0;
 		fun = rad_status_server;
 		break;
 
@@ -2343,7 +2756,7 @@ static int proxy_socket_recv(rad_listen_t *listener)
 		      fr_inet_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
 		      packet->src_port, packet->id);
 #  ifdef WITH_STATS
-		listener->stats.total_unknown_types++;
+		FR_STATS_ADD(&listener->stats, total_unknown_types, 1);
 #  endif
 		fr_radius_free(&packet);
 		return 0;
@@ -2356,7 +2769,7 @@ static int proxy_socket_recv(rad_listen_t *listener)
 
 	if (!request_proxy_reply(packet)) {
 #  ifdef WITH_STATS
-		listener->stats.total_packets_dropped++;
+		FR_STATS_ADD(&listener->stats, total_packets_dropped, 1);
 #  endif
 		fr_radius_free(&packet);
 		return 0;
@@ -2499,6 +2912,23 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 #ifdef WITH_PROXY
 static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 {
+	/*
+	 *	Transparent pools forward the request as it was
+	 *	received, if they can.
+	 */
+	if (request->home_pool && request->home_pool->transparent && request->client) {
+		int rcode;
+
+		rcode = fr_radius_encode_proxy(request->proxy->packet, request->packet,
+					       request->client->secret, request->proxy->home_server->secret);
+		if (rcode < 0) {
+			RERROR("Failed encoding proxied packet: %s", fr_strerror());
+
+			return -1;
+		}
+		if (rcode > 0) goto sign;
+	}
+
 	if (fr_radius_encode(request->proxy->packet, NULL, request->proxy->home_server->secret) < 0) {
 		RERROR("Failed encoding proxied packet: %s", fr_strerror());
 
@@ -2510,6 +2940,7 @@ static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 			request->proxy->packet->data_len, MAX_PACKET_LEN);
 	}
 
+sign:
 	if (fr_radius_sign(request->proxy->packet, NULL, request->proxy->home_server->secret) < 0) {
 		RERROR("Failed signing proxied packet: %s", fr_strerror());
 
@@ -2728,6 +3159,339 @@ static int init_pcap(rad_listen_t *this)
 /*
  *	Binds a listener to a socket.
  */
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+/*
+ *	Socket filters see the packet from the transport header, so
+ *	the IP header is at a negative offset.
+ */
+#define CLIENT_FILTER_NET(_off)	(SKF_NET_OFF + (_off))
+#define CLIENT_FILTER_ACCEPT	0xffffffff
+
+typedef struct {
+	struct sock_filter	*v4;		//!< Rules for IPv4 sources.
+	struct sock_filter	*v6;		//!< Rules for IPv6 sources.
+	bool			v4_any;		//!< A client matches every IPv4 address.
+	bool			v6_any;		//!< A client matches every IPv6 address.
+} client_filter_t;
+
+static int client_filter_add(struct sock_filter **rules, struct sock_filter const *insn, size_t num)
+{
+	size_t		used = talloc_array_length(*rules);
+	struct sock_filter *tmp;
+
+	if ((used + num) > BPF_MAXINSNS) return -1;
+
+	tmp = talloc_realloc(NULL, *rules, struct sock_filter, used + num);
+	if (!tmp) return -1;
+
+	memcpy(tmp + used, insn, sizeof(*insn) * num);
+	*rules = tmp;
+
+	return 0;
+}
+
+/** Remove any filter, so every packet is passed up
+ *
+ * Fails harmlessly if there's no filter attached.
+ */
+static void client_filter_detach(int fd)
+{
+	int dummy = 0;
+
+	(void) setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+}
+
+/** Add the rules which accept packets from one client prefix
+ *
+ * Each 32 bit word of the address is masked and compared in turn.  The
+ * first mismatch jumps to the rules for the next prefix.
+ */
+static int _client_filter_prefix(void *uctx, int af, uint8_t const *key, int prefix)
+{
+	client_filter_t		*cf = uctx;
+	struct sock_filter	insn[(4 * 3) + 1];
+	int			offset, words, i, n = 0;
+
+	if (af == AF_INET) {
+		if (cf->v4_any) return 0;
+		if (prefix == 0) {
+			cf->v4_any = true;
+			return 0;
+		}
+		offset = 12;
+	} else {
+		static uint8_t const v4_mapped[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+		if (cf->v6_any) return 0;
+		if (prefix == 0) {
+			cf->v6_any = true;
+			return 0;
+		}
+
+		/*
+		 *	Packets from these clients arrive on dual
+		 *	stack sockets as IPv4.
+		 */
+		if ((prefix >= 96) && (memcmp(key, v4_mapped, sizeof(v4_mapped)) == 0) &&
+		    (_client_filter_prefix(uctx, AF_INET, key + 12, prefix - 96) < 0)) return -1;
+
+		offset = 8;
+	}
+	words = (prefix + 31) / 32;
+
+	for (i = 0; i < words; i++) {
+		int		bits = prefix - (i * 32);
+		uint32_t	mask = (bits >= 32) ? 0xffffffff : ~(0xffffffff >> bits);
+		uint32_t	word;
+
+		memcpy(&word, key + (i * 4), sizeof(word));
+		word = ntohl(word) & mask;
+
+		insn[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, CLIENT_FILTER_NET(offset + (i * 4)));
+		if (mask != 0xffffffff) insn[n++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask);
+
+		/*
+		 *	Fill in the jump to the next prefix below,
+		 *	once we know how long this one is.
+		 */
+		insn[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, word, 0, 0);
+	}
+	insn[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, CLIENT_FILTER_ACCEPT);
+
+	for (i = 0; i < n; i++) {
+		if (BPF_CLASS(insn[i].code) == BPF_JMP) insn[i].jf = n - 1 - i;
+	}
+
+	return client_filter_add((af == AF_INET) ? &cf->v4 : &cf->v6, insn, n);
+}
+
+/** Compile the clients of a listener into a socket filter, and attach it
+ *
+ * Packets from addresses which don't match any client prefix are dropped
+ * by the kernel, before they're copied to us.  Protocols and IPv6 zones
+ * aren't checked, client_listener_find still does that.
+ *
+ * If there are too many clients to fit in a filter, any old filter is
+ * removed, and every packet is passed up to be checked as usual.
+ *
+ * @param[in] this	listener to filter.
+ * @return
+ *	- 0 on success, or if the filter was removed.
+ *	- -1 on error.
+ */
+static int listen_client_filter_attach(rad_listen_t *this)
+{
+	listen_socket_t		*sock = this->data;
+	client_filter_t		cf = { .v4 = NULL };
+	struct sock_filter	*prog = NULL;
+	struct sock_fprog	fprog;
+	size_t			v4_len, v6_len;
+	int			ret = -1;
+
+	if (client_list_walk_prefixes(sock->clients, _client_filter_prefix, &cf) < 0) {
+		char buffer[256];
+
+		this->print(this, buffer, sizeof(buffer));
+		WARN("Too many clients to filter packets to %s in the kernel", buffer);
+
+		talloc_free(cf.v4);
+		talloc_free(cf.v6);
+
+		client_filter_detach(this->fd);
+		return 0;
+	}
+
+	if (cf.v4_any) TALLOC_FREE(cf.v4);
+	if (cf.v6_any) TALLOC_FREE(cf.v6);
+	v4_len = talloc_array_length(cf.v4);
+	v6_len = talloc_array_length(cf.v6);
+
+	/*
+	 *	Dispatch on the IP version, then fall through
+	 *	each block of rules to a final reject.
+	 */
+	{
+		struct sock_filter head[] = {
+			BPF_STMT(BPF_LD | BPF_B | BPF_ABS, CLIENT_FILTER_NET(0)),
+			BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 1),
+			BPF_STMT(BPF_JMP | BPF_JA, 1),
+			BPF_STMT(BPF_JMP | BPF_JA, v4_len + 1),
+		};
+		struct sock_filter v4_tail = BPF_STMT(BPF_RET | BPF_K, cf.v4_any ? CLIENT_FILTER_ACCEPT : 0);
+		struct sock_filter v6_tail = BPF_STMT(BPF_RET | BPF_K, cf.v6_any ? CLIENT_FILTER_ACCEPT : 0);
+
+		if ((client_filter_add(&prog, head, sizeof(head) / sizeof(*head)) < 0) ||
+		    (v4_len && (client_filter_add(&prog, cf.v4, v4_len) < 0)) ||
+		    (client_filter_add(&prog, &v4_tail, 1) < 0) ||
+		    (v6_len && (client_filter_add(&prog, cf.v6, v6_len) < 0)) ||
+		    (client_filter_add(&prog, &v6_tail, 1) < 0)) {
+			char buffer[256];
+
+			this->print(this, buffer, sizeof(buffer));
+			WARN("Too many clients to filter packets to %s in the kernel", buffer);
+
+			client_filter_detach(this->fd);
+			ret = 0;
+			goto done;
+		}
+	}
+
+	fprog.len = talloc_array_length(prog);
+	fprog.filter = prog;
+
+	DEBUG4("[FD %i] Attaching client filter -- setsockopt(%i, SOL_SOCKET, SO_ATTACH_FILTER, <%u insns>)",
+	       this->fd, this->fd, fprog.len);
+	if (setsockopt(this->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+		ERROR("Failed attaching client filter: %s", fr_syserror(errno));
+		goto done;
+	}
+	ret = 0;
+
+done:
+	talloc_free(prog);
+	talloc_free(cf.v4);
+	talloc_free(cf.v6);
+
+	return ret;
+}
+#endif
+
+/** Recompile the client filters of every listener which has one
+ *
+ * Called when clients are added or deleted at run time.  Dynamic clients
+ * don't need this, as they're always inside a network which is already
+ * in the filter.
+ */
+void listen_client_filter_update(void)
+{
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+	rad_listen_t *this;
+
+	for (this = main_config.listen; this != NULL; this = this->next) {
+		listen_socket_t *sock;
+
+		if ((this->type != RAD_LISTEN_AUTH)
+#  ifdef WITH_ACCOUNTING
+		    && (this->type != RAD_LISTEN_ACCT)
+#  endif
+#  ifdef WITH_COA
+		    && (this->type != RAD_LISTEN_COA)
+#  endif
+		    ) continue;
+
+		sock = this->data;
+		if (!sock->client_filter || !sock->clients || (this->fd < 0)) continue;
+
+		(void) listen_client_filter_attach(this);
+	}
+#endif
+}
+
+/** Check whether the kernel has dropped packets on a UDP socket
+ *
+ * The kernel's drop counter is sent with every packet, as SO_RXQ_OVFL
+ * ancillary data.  The packets are read by code which doesn't know
+ * about it, so we peek at the next packet in the receive queue, at
+ * most once a second.  The counter is the one the kernel had when that
+ * packet was queued, so the drops are seen a little late, but they're
+ * never missed.
+ *
+ * If drops are found, the receive buffer is doubled, up to
+ * "recv_buff_max".
+ *
+ * @param[in] this	the listener to check.
+ * @param[in] now	the current time.
+ * @return the number of packets dropped since the last check.
+ */
+uint32_t listen_socket_drops(rad_listen_t *this, time_t now)
+{
+#ifdef SO_RXQ_OVFL
+	listen_socket_t	*sock = this->data;
+	struct msghdr	msgh;
+	struct iovec	iov;
+	struct cmsghdr	*cmsg;
+	char		cbuf[256];
+	uint8_t		dummy;
+	uint32_t	counter, dropped;
+	char		buffer[256];
+
+	if ((this->fd < 0) || (sock->proto != IPPROTO_UDP) || (sock->drops_checked == now)) return 0;
+	sock->drops_checked = now;
+
+	memset(&msgh, 0, sizeof(msgh));
+	iov.iov_base = &dummy;
+	iov.iov_len = 0;
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = cbuf;
+	msgh.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(this->fd, &msgh, MSG_PEEK | MSG_DONTWAIT) < 0) return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) break;
+	}
+	if (!cmsg) return 0;	/* Only sent once there have been drops */
+
+	memcpy(&counter, CMSG_DATA(cmsg), sizeof(counter));
+
+	/*
+	 *	The counter is a uint32_t which wraps.
+	 */
+	dropped = counter - sock->drops_last;
+	sock->drops_last = counter;
+	if (!dropped) return 0;
+
+	__atomic_add_fetch(&sock->drops, dropped, __ATOMIC_RELAXED);
+
+	this->print(this, buffer, sizeof(buffer));
+
+	if (!sock->recv_buff_max || (sock->recv_buff_now >= sock->recv_buff_max)) {
+		RATE_LIMIT(WARN("Kernel dropped %u packets on %s, as the receive buffer was full", dropped, buffer));
+		return dropped;
+	}
+
+	{
+		uint32_t	size;
+		int		actual;
+		socklen_t	actual_len = sizeof(actual);
+
+		size = sock->recv_buff_now * 2;
+		if ((size < sock->recv_buff_now) || (size > sock->recv_buff_max)) size = sock->recv_buff_max;
+
+		if (setsockopt(this->fd, SOL_SOCKET, SO_RCVBUF, (int *) &size, sizeof(int)) < 0) {
+			ERROR("Failed increasing receive buffer size of %s: %s", buffer, fr_syserror(errno));
+			return dropped;
+		}
+
+		/*
+		 *	The kernel silently caps the size (net.core.rmem_max
+		 *	on Linux), so record the size it actually used.
+		 */
+		if (getsockopt(this->fd, SOL_SOCKET, SO_RCVBUF, &actual, &actual_len) == 0) {
+#ifdef __linux__
+			actual /= 2;
+#endif
+			if ((actual > 0) && ((uint32_t) actual <= sock->recv_buff_now)) {
+				RATE_LIMIT(WARN("Kernel dropped %u packets on %s.  The kernel limits the receive "
+						"buffer size to %i, and it can't be increased", dropped, buffer, actual));
+				return dropped;
+			}
+			if ((actual > 0) && ((uint32_t) actual < size)) size = actual;
+		}
+
+		WARN("Kernel dropped %u packets on %s, increasing receive buffer size from %u to %u",
+		     dropped, buffer, sock->recv_buff_now, size);
+		__atomic_store_n(&sock->recv_buff_now, size, __ATOMIC_RELAXED);
+	}
+
+	return dropped;
+#else
+	return 0;
+#endif
+}
+
 static int listen_bind(rad_listen_t *this)
 {
 	int			rcode, port;
@@ -2819,6 +3583,77 @@ static int listen_bind(rad_listen_t *this)
 			return -1;
 		}
 	}
+	sock->recv_buff_now = sock->recv_buff;
+
+	if (sock->proto == IPPROTO_UDP) {
+		/*
+		 *	Remember the size the kernel picked, so that
+		 *	there's something to grow from.
+		 */
+		if (!sock->recv_buff_now) {
+			int		size;
+			socklen_t	size_len = sizeof(size);
+
+			if (getsockopt(this->fd, SOL_SOCKET, SO_RCVBUF, &size, &size_len) == 0) {
+#ifdef __linux__
+				size /= 2;	/* Linux reports double what it was set to */
+#endif
+				if (size > 0) sock->recv_buff_now = size;
+			}
+		}
+
+#ifdef SO_RXQ_OVFL
+		/*
+		 *	Have the kernel tell us how many packets it has
+		 *	dropped, because the receive buffer was full.
+		 */
+		{
+			int on = 1;
+
+			DEBUG4("[FD %i] Enabling drop counter -- setsockopt(%i, SOL_SOCKET, SO_RXQ_OVFL, 1, %zu)",
+			       this->fd, this->fd, sizeof(int));
+			if (setsockopt(this->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+				WARN("Failed enabling SO_RXQ_OVFL, kernel drops will not be counted: %s",
+				     fr_syserror(errno));
+			}
+		}
+#else
+		if (sock->recv_buff_max) WARN("System does not support SO_RXQ_OVFL.  Ignoring 'recv_buff_max'");
+#endif
+	}
+
+	/*
+	 *	Attach the client filter before binding, so no
+	 *	packets from unknown clients are ever queued.
+	 */
+	if (sock->client_filter && sock->clients) {
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+		if (listen_client_filter_attach(this) < 0) {
+			close(this->fd);
+			return -1;
+		}
+#else
+		WARN("System does not support socket filters.  Ignoring 'client_filter'");
+#endif
+	}
+
+#ifdef SO_REUSEPORT
+	/*
+	 *	Every socket in the group has to set SO_REUSEPORT
+	 *	before binding, including the first one.
+	 */
+	if (this->num_sockets > 1) {
+		int on = 1;
+
+		DEBUG4("[FD %i] Setting reuseport -- setsockopt(%i, SOL_SOCKET, SO_REUSEPORT, 1, %zu)", this->fd,
+		       this->fd, sizeof(int));
+		if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			close(this->fd);
+			ERROR("Failed setting SO_REUSEPORT: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
 
 	/*
 	 *	Bind to the interface, IP address, and port.
@@ -2989,6 +3824,9 @@ rad_listen_t *proxy_new_listener(TALLOC_CTX *ctx, home_server_t *home, uint16_t
 	sock->my_ipaddr = home->src_ipaddr;
 	sock->my_port = src_port;
 	sock->proto = home->proto;
+#ifdef WITH_TCP
+	if (home->proto == IPPROTO_TCP) pthread_mutex_init(&sock->write_mutex, NULL);
+#endif
 	talloc_set_destructor(sock, _common_socket_free);
 
 	/*
@@ -3197,6 +4035,37 @@ int listen_init(rad_listen_t **head,
 		this = lc->listener;
 		*last = this;
 		last = &(this->next);
+
+		/*
+		 *	Open the rest of the SO_REUSEPORT group.  Each
+		 *	one is parsed from the same section, and bound
+		 *	to the port the first one ended up with.
+		 */
+		if (this->num_sockets > 1) {
+			listen_socket_t	*sock = this->data;
+			uint32_t	i;
+
+			for (i = 1; i < this->num_sockets; i++) {
+				rad_listen_t	*sibling;
+				listen_socket_t	*sibling_sock;
+
+				sibling = listen_parse(lc);
+				if (!sibling) {
+				error:
+					ERROR("Failed creating SO_REUSEPORT socket %u of %u", i + 1, this->num_sockets);
+					TALLOC_FREE(listen_ctx);
+					return -1;
+				}
+
+				sibling_sock = sibling->data;
+				sibling_sock->my_port = sock->my_port;
+
+				if (lc->proto->open(lc->cs, sibling) < 0) goto error;
+
+				*last = sibling;
+				last = &(sibling->next);
+			}
+		}
 	}
 
 	/*
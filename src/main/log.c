@@ -229,8 +229,8 @@ void vradlog_request(log_type_t type, log_lvl_t lvl, REQUEST *request, char cons
 	uint8_t		unlang_indent, module_indent;
 	va_list		aq;
 
-	char		*msg_prefix = NULL;
-	char		*msg_module = NULL;
+	char		msg_prefix[64];
+	char		msg_module[sizeof(spaces) + 64];
 	char		*msg_exp = NULL;
 
 	rad_assert(request);
@@ -335,10 +335,10 @@ print_msg:
 	 *	(0) <msg>
 	 */
 	if ((request->seq_start == 0) || (request->number == request->seq_start)) {
-		msg_prefix = talloc_asprintf(request, "(%" PRIu64 ")  ", request->number);
+		snprintf(msg_prefix, sizeof(msg_prefix), "(%" PRIu64 ")  ", request->number);
 	} else {
-		msg_prefix = talloc_asprintf(request, "(%" PRIu64 ",%" PRIu64 ")  ",
-					     request->number, request->seq_start);
+		snprintf(msg_prefix, sizeof(msg_prefix), "(%" PRIu64 ",%" PRIu64 ")  ",
+			 request->number, request->seq_start);
 	}
 
 	/*
@@ -357,8 +357,9 @@ print_msg:
 	 *
 	 *	test -     <msg>
 	 */
+	msg_module[0] = '\0';
 	if (request->module) {
-		msg_module = talloc_asprintf(request, "%s - %.*s", request->module, module_indent, spaces);
+		snprintf(msg_module, sizeof(msg_module), "%s - %.*s", request->module, module_indent, spaces);
 	}
 
 	/*
@@ -405,7 +406,7 @@ print_msg:
 			time_buff,
 			fr_int2str(fr_log_levels, type, ""),
 			unlang_indent, spaces,
-			msg_module ? msg_module : "",
+			msg_module,
 			msg_exp);
 		fclose(fp);
 		goto finish;
@@ -432,14 +433,12 @@ print_msg:
 		      type, "%s" "%.*s" "%s" "%s" "%s",
 		      msg_prefix,
 		      unlang_indent, spaces,
-		      msg_module ? msg_module : "",
+		      msg_module,
 		      extra,
 		      msg_exp);
 
 finish:
 	talloc_free(msg_exp);
-	talloc_free(msg_module);
-	talloc_free(msg_prefix);
 }
 
 /** Martial variadic log arguments into a va_list and pass to normal logging functions
@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/map_proc.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trace.h>
 
 #include <sys/stat.h>
 #include <pwd.h>
@@ -151,6 +152,7 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_POINTER("colourise", PW_TYPE_BOOLEAN, &do_colourise) },
 	{ FR_CONF_POINTER("timestamp", PW_TYPE_BOOLEAN, &log_timestamp) },
 	{ FR_CONF_POINTER("use_utc", PW_TYPE_BOOLEAN, &log_dates_utc) },
+	{ FR_CONF_POINTER("async", PW_TYPE_BOOLEAN, &main_config.log_async), .dflt = "no" },
 	{ FR_CONF_POINTER("msg_denied", PW_TYPE_STRING, &main_config.denied_msg), .dflt = "You are already logged in - access denied" },
 #ifdef WITH_CONF_WRITE
 	{ FR_CONF_POINTER("write_dir", PW_TYPE_STRING, &main_config.write_dir), .dflt = NULL },
@@ -166,6 +168,8 @@ static const CONF_PARSER security_config[] = {
 	{ FR_CONF_POINTER("max_attributes", PW_TYPE_INTEGER, &fr_max_attributes), .dflt = STRINGIFY(0) },
 	{ FR_CONF_POINTER("reject_delay", PW_TYPE_TIMEVAL, &main_config.reject_delay), .dflt = STRINGIFY(0) },
 	{ FR_CONF_POINTER("status_server", PW_TYPE_BOOLEAN, &main_config.status_server), .dflt = "no" },
+	{ FR_CONF_POINTER("status_server_cache", PW_TYPE_INTEGER, &main_config.status_server_cache), .dflt = STRINGIFY(0) },
+	{ FR_CONF_POINTER("status_server_overload", PW_TYPE_BOOLEAN, &main_config.status_server_overload), .dflt = "no" },
 
 	/*
 	 *	No default, so it isn't printed in debug mode.
@@ -191,6 +195,12 @@ static const CONF_PARSER resources[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER trace_config[] = {
+	{ FR_CONF_POINTER("sample_rate", PW_TYPE_INTEGER, &main_config.trace_sample_rate), .dflt = "0" },
+	{ FR_CONF_POINTER("buffer_size", PW_TYPE_INTEGER, &main_config.trace_buffer_size), .dflt = "256" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER server_config[] = {
 	/*
 	 *	FIXME: 'prefix' is the ONLY one which should be
@@ -225,6 +235,8 @@ static const CONF_PARSER server_config[] = {
 
 	{ FR_CONF_POINTER("resources", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) resources },
 
+	{ FR_CONF_POINTER("trace", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) trace_config },
+
 	/*
 	 *	People with old configs will have these.  They are listed
 	 *	AFTER the "log" section, so if they exist in radiusd.conf,
@@ -921,6 +933,8 @@ do {\
 
 	FR_INTEGER_BOUND_CHECK("cleanup_delay", main_config.cleanup_delay, <=, 10);
 
+	FR_INTEGER_BOUND_CHECK("status_server_cache", main_config.status_server_cache, <=, 60);
+
 	FR_TIMEVAL_BOUND_CHECK("reject_delay", &main_config.reject_delay, <=, main_config.cleanup_delay, 0);
 
 	FR_SIZE_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, >=, (size_t)(2 * 1024));
@@ -934,6 +948,8 @@ do {\
 				    ((((size_t)1024) * 1024 * 1024) * 16));
 	}
 
+	FR_INTEGER_BOUND_CHECK("trace.buffer_size", main_config.trace_buffer_size, <=, 65536);
+
 	/*
 	 *	Set default initial request processing delay to 1/3 of a second.
 	 *	Will be updated by the lowest response window across all home servers,
@@ -962,6 +978,8 @@ do {\
 		return -1;
 	}
 
+	if (trace_init(main_config.trace_sample_rate, main_config.trace_buffer_size) < 0) return -1;
+
 	/*
 	 *	Register the %{config:section.subsection} xlat function.
 	 */
@@ -1015,6 +1033,7 @@ int main_config_free(void)
 	client_list_free();
 	realms_free();
 	listen_free(&main_config.listen);
+	trace_free();
 
 	/*
 	 *	Frees current config and any previous configs.
@@ -33,6 +33,11 @@ RCSID("$Id$")
 
 #include <ctype.h>
 
+/*
+ *	Maximum number of maps which can be applied in one pass.
+ */
+#define MAP_STATIC_MAX	(64)
+
 #ifdef DEBUG_MAP
 static void map_dump(REQUEST *request, vp_map_t const *map)
 {
@@ -1006,6 +1011,45 @@ do {\
 	}\
 } while (0)
 
+/** Update the cached User-Name and User-Password pointers of a request
+ *
+ * @param[in] context	the request the list belongs to.
+ * @param[in] list	the request list of context.
+ */
+static void map_request_cache_update(REQUEST *context, VALUE_PAIR **list)
+{
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	context->username = NULL;
+	context->password = NULL;
+
+	for (vp = fr_pair_cursor_init(&cursor, list);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+
+		if (!vp->da->parent->flags.is_root) continue;
+		if (vp->da->vendor != 0) continue;
+		if (vp->da->flags.has_tag) continue;
+		if (vp->vp_type != PW_TYPE_STRING) continue;
+
+		if (!context->username && (vp->da->attr == PW_USER_NAME)) {
+			context->username = vp;
+			continue;
+		}
+
+		if (vp->da->attr == PW_STRIPPED_USER_NAME) {
+			context->username = vp;
+			continue;
+		}
+
+		if (vp->da->attr == PW_USER_PASSWORD) {
+			context->password = vp;
+			continue;
+		}
+	}
+}
+
 /** Convert #vp_map_t to #VALUE_PAIR (s) and add them to a #REQUEST.
  *
  * Takes a single #vp_map_t, resolves request and list identifiers
@@ -1443,39 +1487,163 @@ update:
 	 *	TBH, we should probably make each module just do the
 	 *	search themselves.
 	 */
-	if (map->lhs->tmpl_list == PAIR_LIST_REQUEST) {
-		context->username = NULL;
-		context->password = NULL;
+	if (map->lhs->tmpl_list == PAIR_LIST_REQUEST) map_request_cache_update(context, list);
 
-		for (vp = fr_pair_cursor_init(&src_list, list);
-		     vp;
-		     vp = fr_pair_cursor_next(&src_list)) {
+finish:
+	talloc_free(tmp_ctx);
+	return rcode;
+}
 
-			if (!vp->da->parent->flags.is_root) continue;
-			if (vp->da->vendor != 0) continue;
-			if (vp->da->flags.has_tag) continue;
-			if (vp->vp_type != PW_TYPE_STRING) continue;
+/** Check whether a list of maps can be applied with #map_list_static_to_request
+ *
+ * The maps must all write to the same list, have literal values of the
+ * same type as their destination attribute, and use only the "=", ":="
+ * and "+=" operators.  Each destination attribute may only appear once,
+ * so that applying one map can't change what another map sees.
+ *
+ * @param[in] head of the list of maps.
+ * @return true if the maps are static, else false.
+ */
+bool map_list_is_static(vp_map_t const *head)
+{
+	vp_map_t const	*map, *prev;
+	int		count = 0;
 
-			if (!context->username && (vp->da->attr == PW_USER_NAME)) {
-				context->username = vp;
-				continue;
-			}
+	if (!head || (head->lhs->type != TMPL_TYPE_ATTR)) return false;
 
-			if (vp->da->attr == PW_STRIPPED_USER_NAME) {
-				context->username = vp;
-				continue;
-			}
+	if ((head->lhs->tmpl_list == PAIR_LIST_COA) ||
+	    (head->lhs->tmpl_list == PAIR_LIST_DM)) return false;
+
+	for (map = head; map; map = map->next) {
+		if (++count > MAP_STATIC_MAX) return false;
+
+		if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->rhs->type != TMPL_TYPE_DATA)) return false;
+		if (map->lhs->tmpl_num != NUM_ANY) return false;
+		if (map->lhs->tmpl_da->type != map->rhs->tmpl_value_box_type) return false;
+
+		if ((map->lhs->tmpl_request != head->lhs->tmpl_request) ||
+		    (map->lhs->tmpl_list != head->lhs->tmpl_list)) return false;
+
+		switch (map->op) {
+		case T_OP_EQ:
+		case T_OP_SET:
+		case T_OP_ADD:
+			break;
+
+		default:
+			return false;
+		}
 
-			if (vp->da->attr == PW_USER_PASSWORD) {
-				context->password = vp;
-				continue;
+		for (prev = head; prev != map; prev = prev->next) {
+			if (prev->lhs->tmpl_da == map->lhs->tmpl_da) return false;
+		}
+	}
+
+	return true;
+}
+
+/** Apply a list of static maps to a #REQUEST in a single pass over the destination list
+ *
+ * This has the same effect as calling #map_to_request with #map_to_vp for each map,
+ * but the destination list is resolved once, and searched once for all of the maps.
+ *
+ * @param request The current request.
+ * @param head of a list of maps which #map_list_is_static returned true for.
+ * @return
+ *	- -1 if the operation failed.
+ *	- -2 if the destination list isn't valid.
+ *	- 0 on success.
+ */
+int map_list_static_to_request(REQUEST *request, vp_map_t const *head)
+{
+	vp_map_t const	*map;
+	REQUEST		*context = request;
+	VALUE_PAIR	**list, **last, *vp, *new_vp;
+	VALUE_PAIR	*vps[MAP_STATIC_MAX];
+	TALLOC_CTX	*parent;
+	int		i, num = 0, pending = 0;
+
+	VERIFY_MAP(head);
+
+	if (radius_request(&context, head->lhs->tmpl_request) < 0) {
+	invalid:
+		REDEBUG("Mapping to \"%.*s\" invalid in this context", (int)head->lhs->len, head->lhs->name);
+		return -2;
+	}
+
+	list = radius_list(context, head->lhs->tmpl_list);
+	if (!list) goto invalid;
+
+	parent = radius_list_ctx(context, head->lhs->tmpl_list);
+	rad_assert(parent);
+
+	/*
+	 *	Create all of the new attributes first, so that a
+	 *	failure doesn't leave the list half updated.
+	 */
+	for (map = head; map; map = map->next) {
+		new_vp = fr_pair_afrom_da(parent, map->lhs->tmpl_da);
+		if (!new_vp || (value_box_copy(new_vp, &new_vp->data, &map->rhs->tmpl_value_box) < 0)) {
+			talloc_free(new_vp);
+			while (num > 0) talloc_free(vps[--num]);
+			return -1;
+		}
+		new_vp->op = map->op;
+		new_vp->tag = map->lhs->tmpl_tag;
+
+		if (rad_debug_lvl) map_debug_log(request, map, new_vp);
+
+		if (map->op != T_OP_ADD) pending++;
+		vps[num++] = new_vp;
+	}
+
+	/*
+	 *	Walk the list once, replacing the first instance
+	 *	of each ":=" attribute, and skipping "=" attributes
+	 *	which already exist.  We leave with last pointing
+	 *	to the end of the list.
+	 */
+	last = list;
+	while ((vp = *last)) {
+		for (map = head, i = 0; pending && map; map = map->next, i++) {
+			if (!vps[i] || (map->op == T_OP_ADD)) continue;
+			if (vp->da != map->lhs->tmpl_da) continue;
+			if (vp->da->flags.has_tag && !TAG_EQ(map->lhs->tmpl_tag, vp->tag)) continue;
+
+			new_vp = vps[i];
+			vps[i] = NULL;
+			pending--;
+
+			if (map->op == T_OP_EQ) {
+				RDEBUG3("Refusing to overwrite (use :=)");
+				talloc_free(new_vp);
+				break;
 			}
+
+			DEBUG_OVERWRITE(vp, new_vp);
+			*last = new_vp;
+			new_vp->next = vp->next;
+			vp->next = NULL;
+			fr_pair_list_free(&vp);
+			vp = new_vp;
+			break;
 		}
+		last = &vp->next;
 	}
 
-finish:
-	talloc_free(tmp_ctx);
-	return rcode;
+	/*
+	 *	Everything else goes on the end, in order.
+	 */
+	for (i = 0; i < num; i++) {
+		if (!vps[i]) continue;
+
+		*last = vps[i];
+		last = &vps[i]->next;
+	}
+
+	if (head->lhs->tmpl_list == PAIR_LIST_REQUEST) map_request_cache_update(context, list);
+
+	return 0;
 }
 
 /** Check whether the destination of a map is currently valid
@@ -0,0 +1,209 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file mem_account.c
+ * @brief Memory accounting for modules and subsystems.
+ *
+ * Walking a talloc tree to measure it isn't thread safe, and is too slow
+ * to do on every scrape.  Instead, the owner of each tree measures the
+ * memory it adds or removes, at the point it's added or removed, and
+ * records the difference in an account.  Accounts are plain atomic
+ * counters, so they can be read from any thread.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/mem_account.h>
+
+struct mem_account {
+	char const		*type;		//!< Of module or subsystem.
+	char const		*name;		//!< Of the instance.
+
+	int64_t			bytes;		//!< Memory in use, updated atomically.
+	int64_t			objects;	//!< Objects in use, updated atomically.
+	size_t			limit;		//!< Soft limit on bytes, 0 if there's no limit.
+
+	mem_account_t		*prev;		//!< Previous registered account.
+	mem_account_t		*next;		//!< Next registered account.
+};
+
+static pthread_mutex_t	mem_account_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mem_account_t	*mem_account_head;	//!< All registered accounts.
+
+/** Unregister an account
+ *
+ */
+static int _mem_account_free(mem_account_t *acct)
+{
+	pthread_mutex_lock(&mem_account_mutex);
+	if (acct->prev) {
+		acct->prev->next = acct->next;
+	} else {
+		mem_account_head = acct->next;
+	}
+	if (acct->next) acct->next->prev = acct->prev;
+	pthread_mutex_unlock(&mem_account_mutex);
+
+	return 0;
+}
+
+/** Register a new account
+ *
+ * The limit isn't enforced here.  It's reported with the counters, and
+ * owners which can reclaim memory (like caches) check it with
+ * #mem_account_over.
+ *
+ * @param[in] ctx	to allocate the account in.  The account is unregistered when it's freed.
+ * @param[in] type	of module or subsystem, e.g. "module" or "state".
+ * @param[in] name	of the instance.
+ * @param[in] limit	Soft limit on bytes, 0 if there's no limit.
+ * @return
+ *	- A new account.
+ *	- NULL on error.
+ */
+mem_account_t *mem_account_alloc(TALLOC_CTX *ctx, char const *type, char const *name, size_t limit)
+{
+	mem_account_t *acct;
+
+	acct = talloc_zero(ctx, mem_account_t);
+	if (!acct) return NULL;
+
+	acct->type = talloc_strdup(acct, type);
+	acct->name = talloc_strdup(acct, name);
+	if (!acct->type || !acct->name) {
+		talloc_free(acct);
+		return NULL;
+	}
+	acct->limit = limit;
+
+	pthread_mutex_lock(&mem_account_mutex);
+	acct->next = mem_account_head;
+	if (mem_account_head) mem_account_head->prev = acct;
+	mem_account_head = acct;
+	pthread_mutex_unlock(&mem_account_mutex);
+
+	talloc_set_destructor(acct, _mem_account_free);
+
+	return acct;
+}
+
+/** Record memory being allocated or freed
+ *
+ * @param[in] acct	to update.  May be NULL, in which case nothing is recorded.
+ * @param[in] bytes	allocated (positive) or freed (negative).
+ * @param[in] objects	allocated (positive) or freed (negative).
+ */
+void mem_account_add(mem_account_t *acct, int64_t bytes, int64_t objects)
+{
+	if (!acct) return;
+
+	if (bytes) __atomic_add_fetch(&acct->bytes, bytes, __ATOMIC_RELAXED);
+	if (objects) __atomic_add_fetch(&acct->objects, objects, __ATOMIC_RELAXED);
+}
+
+/** Get the memory currently in use
+ *
+ * The counters of different threads may be updated in any order, so
+ * the total can briefly be negative.  It's reported as 0.
+ */
+uint64_t mem_account_bytes(mem_account_t const *acct)
+{
+	int64_t bytes;
+
+	if (!acct) return 0;
+
+	bytes = __atomic_load_n(&acct->bytes, __ATOMIC_RELAXED);
+
+	return (bytes < 0) ? 0 : bytes;
+}
+
+/** Check whether allocating more memory would put an account over its soft limit
+ *
+ * @param[in] acct	to check.
+ * @param[in] bytes	about to be allocated.
+ * @return true if the account has a limit, and it would be exceeded.
+ */
+bool mem_account_over(mem_account_t const *acct, size_t bytes)
+{
+	if (!acct || !acct->limit) return false;
+
+	return (mem_account_bytes(acct) + bytes) > acct->limit;
+}
+
+/** Copy the counters of every registered account
+ *
+ * @param[in] ctx	to allocate the copy in.
+ * @param[out] num	Number of accounts copied.
+ * @return
+ *	- An array of counters, in order of registration.
+ *	- NULL if there are no accounts, or on error.
+ */
+mem_account_stats_t *mem_account_snapshot(TALLOC_CTX *ctx, size_t *num)
+{
+	mem_account_t		*acct, *last = NULL;
+	mem_account_stats_t	*out;
+	size_t			i = 0;
+
+	*num = 0;
+
+	pthread_mutex_lock(&mem_account_mutex);
+	for (acct = mem_account_head; acct; acct = acct->next) {
+		last = acct;
+		i++;
+	}
+
+	if (!i) {
+		pthread_mutex_unlock(&mem_account_mutex);
+		return NULL;
+	}
+
+	out = talloc_zero_array(ctx, mem_account_stats_t, i);
+	if (!out) {
+		pthread_mutex_unlock(&mem_account_mutex);
+		return NULL;
+	}
+
+	/*
+	 *	New accounts are added to the head, walk
+	 *	backwards so the oldest comes first.
+	 */
+	for (acct = last, i = 0; acct; acct = acct->prev, i++) {
+		int64_t objects;
+
+		out[i].type = talloc_strdup(out, acct->type);
+		out[i].name = talloc_strdup(out, acct->name);
+		if (!out[i].type || !out[i].name) {
+			pthread_mutex_unlock(&mem_account_mutex);
+			talloc_free(out);
+			return NULL;
+		}
+		out[i].bytes = mem_account_bytes(acct);
+		objects = __atomic_load_n(&acct->objects, __ATOMIC_RELAXED);
+		out[i].objects = (objects < 0) ? 0 : objects;
+		out[i].limit = acct->limit;
+	}
+	pthread_mutex_unlock(&mem_account_mutex);
+
+	*num = i;
+
+	return out;
+}
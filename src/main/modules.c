@@ -33,6 +33,8 @@ RCSID("$Id$")
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
 
+#include <sys/stat.h>
+
 fr_thread_local_setup(rbtree_t *, module_thread_inst_tree)
 
 static TALLOC_CTX *instance_ctx = NULL;
@@ -58,6 +60,8 @@ const section_type_value_t section_type_value[MOD_COUNT] = {
 
 static int module_instantiate(CONF_SECTION *root, char const *name);
 
+#define MODULE_INSTANTIATE_THREADS	(16)	//!< Maximum number of threads instantiating modules.
+
 static bool is_reserved_word(const char *name)
 {
 	int i;
@@ -371,6 +375,102 @@ int module_instance_read_only(TALLOC_CTX *ctx, char const *name)
 	return rcode;
 }
 
+/** Record that a module call yielded
+ *
+ * @param[in] mi	which was called.
+ * @param[in] method	which was called.
+ */
+void module_stats_yield(module_instance_t *mi, rlm_components_t method)
+{
+	__atomic_add_fetch(&mi->stats[method].yields, 1, __ATOMIC_RELAXED);
+}
+
+/** Record the result of a completed module call
+ *
+ * @param[in] mi	which was called.
+ * @param[in] method	which was called.
+ * @param[in] rcode	the call returned.
+ * @param[in] start	when the call was made.
+ */
+void module_stats_done(module_instance_t *mi, rlm_components_t method, rlm_rcode_t rcode, struct timeval const *start)
+{
+	module_method_stats_t	*stats = &mi->stats[method];
+	struct timeval		now, elapsed;
+	uint64_t		usec;
+	unsigned int		bucket;
+
+	gettimeofday(&now, NULL);
+	if (fr_timeval_cmp(&now, start) > 0) {
+		fr_timeval_subtract(&elapsed, &now, start);
+		usec = ((uint64_t) elapsed.tv_sec * 1000000) + elapsed.tv_usec;
+	} else {
+		usec = 0;
+	}
+
+	for (bucket = 0; (bucket < (MODULE_STATS_BUCKETS - 1)) && (usec >= ((uint64_t) 1 << bucket)); bucket++);
+
+	__atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+	if (rcode < RLM_MODULE_NUMCODES) __atomic_add_fetch(&stats->rcodes[rcode], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->usec, usec, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/** Get a snapshot of the statistics for a module instance
+ *
+ * @param[out] out	Where to write the statistics.
+ * @param[in] mi	to get statistics for.
+ * @param[in] method	to get statistics for, or -1 to add up all methods.
+ */
+void module_stats_get(module_method_stats_t *out, module_instance_t const *mi, int method)
+{
+	int i, j;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i < MOD_COUNT; i++) {
+		module_method_stats_t const *stats = &mi->stats[i];
+
+		if ((method >= 0) && (i != method)) continue;
+
+		out->calls += __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+		out->yields += __atomic_load_n(&stats->yields, __ATOMIC_RELAXED);
+		out->usec += __atomic_load_n(&stats->usec, __ATOMIC_RELAXED);
+
+		for (j = 0; j < RLM_MODULE_NUMCODES; j++) {
+			out->rcodes[j] += __atomic_load_n(&stats->rcodes[j], __ATOMIC_RELAXED);
+		}
+
+		for (j = 0; j < MODULE_STATS_BUCKETS; j++) {
+			out->latency[j] += __atomic_load_n(&stats->latency[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/** Estimate a latency percentile from a module's histogram
+ *
+ * @param[in] stats	from #module_stats_get.
+ * @param[in] percent	to return e.g. 99.
+ * @return the upper bound of the bucket the percentile falls in, in microseconds.
+ *	The last bucket has no upper bound, so its lower bound is returned.
+ */
+uint64_t module_stats_percentile(module_method_stats_t const *stats, unsigned int percent)
+{
+	uint64_t	total = 0, want, seen = 0;
+	int		i;
+
+	for (i = 0; i < MODULE_STATS_BUCKETS; i++) total += stats->latency[i];
+	if (!total) return 0;
+
+	want = ((total * percent) + 99) / 100;
+
+	for (i = 0; i < (MODULE_STATS_BUCKETS - 1); i++) {
+		seen += stats->latency[i];
+		if (seen >= want) return (uint64_t) 1 << i;
+	}
+
+	return (uint64_t) 1 << (MODULE_STATS_BUCKETS - 2);
+}
+
 /** Find an existing module instance
  *
  * @param[in] modules		section in the main config.
@@ -516,6 +616,7 @@ static void _module_thread_instance_free(void *to_free)
 		(void) thread_inst->inst->module->thread_detach(thread_inst->data);
 	}
 
+	mem_account_add(thread_inst->inst->mem, -(int64_t)thread_inst->mem_size, 0);
 	talloc_free(thread_inst);
 }
 
@@ -590,12 +691,21 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 		rbtree_insert(thread_inst_ctx->tree, thread_inst);
 	}
 
-	ret = inst->module->thread_instantiate(inst->cs, inst, thread_inst_ctx->el, thread_inst->data);
+	ret = inst->module->thread_instantiate(inst->cs, inst->data, thread_inst_ctx->el, thread_inst->data);
 	if (ret < 0) {
 		ERROR("Thread instantiation failed for module \"%s\"", inst->name);
 		return -1;
 	}
 
+	/*
+	 *	Connection pools and the like are usually created
+	 *	here, so this is most of what the thread will use.
+	 */
+	if (thread_inst->data) {
+		thread_inst->mem_size = talloc_total_size(thread_inst->data);
+		mem_account_add(inst->mem, thread_inst->mem_size, 0);
+	}
+
 	return 0;
 }
 
@@ -638,20 +748,15 @@ int modules_thread_instantiate(CONF_SECTION *root, fr_event_list_t *el)
 	return 0;
 }
 
-/** Complete module setup by calling its instantiate function
+/** Compile the config items marked as XLAT
  *
- * @param[in] instance	of module to complete instantiation for.
- * @param[in] ctx	modules section, containing instance data.
+ * @param[in] inst	of module to parse.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int _module_instantiate(void *instance, UNUSED void *ctx)
+static int module_instantiate_parse(module_instance_t *inst)
 {
-	module_instance_t *inst = talloc_get_type_abort(instance, module_instance_t);
-
-	if (inst->instantiated) return 0;
-
 	/*
 	 *	Now that ALL modules are instantiated, and ALL xlats
 	 *	are defined, go compile the config items marked as XLAT.
@@ -662,6 +767,18 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 		return -1;
 	}
 
+	return 0;
+}
+
+/** Call a module's instantiate method
+ *
+ * @param[in] inst	of module to instantiate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int module_instantiate_call(module_instance_t *inst)
+{
 	/*
 	 *	Call the instantiate method, if any.
 	 */
@@ -679,6 +796,15 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 		}
 	}
 
+	return 0;
+}
+
+/** Finish instantiating a module
+ *
+ * @param[in] inst	which was instantiated.
+ */
+static void module_instantiate_done(module_instance_t *inst)
+{
 	/*
 	 *	If we're threaded, check if the module is thread-safe.
 	 *
@@ -693,11 +819,161 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 		pthread_mutex_init(inst->mutex, NULL);
 	}
 
+	/*
+	 *	The instance data doesn't change size after
+	 *	instantiation, so it only needs measuring once.
+	 *	One object per instance, threads only add bytes.
+	 */
+	inst->mem = mem_account_alloc(inst, "module", inst->name, 0);
+	mem_account_add(inst->mem, inst->data ? talloc_total_size(inst->data) : 0, 1);
+
 #ifndef NDEBUG
 	if (inst->data) module_instance_read_only(inst->data, inst->name);
 #endif
 
 	inst->instantiated = true;
+}
+
+/** Complete module setup by calling its instantiate function
+ *
+ * @param[in] instance	of module to complete instantiation for.
+ * @param[in] ctx	modules section, containing instance data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int _module_instantiate(void *instance, UNUSED void *ctx)
+{
+	module_instance_t *inst = talloc_get_type_abort(instance, module_instance_t);
+
+	if (inst->instantiated) return 0;
+
+	if (module_instantiate_parse(inst) < 0) return -1;
+	if (module_instantiate_call(inst) < 0) return -1;
+
+	module_instantiate_done(inst);
+
+	return 0;
+}
+
+/** Instantiate modules which don't allow parallel instantiation
+ *
+ */
+static int _module_instantiate_serial(void *instance, void *ctx)
+{
+	module_instance_t *inst = talloc_get_type_abort(instance, module_instance_t);
+
+	if ((inst->module->type & RLM_TYPE_PARALLEL_INSTANTIATE) != 0) return 0;
+
+	return _module_instantiate(instance, ctx);
+}
+
+/** Modules which are being instantiated in parallel
+ *
+ */
+typedef struct {
+	module_instance_t	**inst;		//!< Modules to instantiate.
+	uint32_t		num;		//!< Number of modules.
+	uint32_t		next;		//!< Next module to instantiate.
+	uint32_t		failed;		//!< Number of modules which failed.
+} module_instantiate_parallel_t;
+
+/** Gather the modules which can be instantiated in parallel
+ *
+ */
+static int _module_instantiate_gather(void *instance, void *ctx)
+{
+	module_instance_t		*inst = talloc_get_type_abort(instance, module_instance_t);
+	module_instantiate_parallel_t	*parallel = ctx;
+
+	if (inst->instantiated) return 0;
+
+	if (module_instantiate_parse(inst) < 0) return -1;
+
+	parallel->inst[parallel->num++] = inst;
+
+	return 0;
+}
+
+static int _module_instantiate_count(UNUSED void *instance, void *ctx)
+{
+	(*(uint32_t *)ctx)++;
+
+	return 0;
+}
+
+static void *module_instantiate_thread(void *arg)
+{
+	module_instantiate_parallel_t	*parallel = arg;
+	uint32_t			i;
+
+	while ((i = __atomic_fetch_add(&parallel->next, 1, __ATOMIC_RELAXED)) < parallel->num) {
+		if (module_instantiate_call(parallel->inst[i]) < 0) {
+			__atomic_fetch_add(&parallel->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+/** Instantiate modules marked with RLM_TYPE_PARALLEL_INSTANTIATE
+ *
+ * These are modules which spend their instantiation reading large data
+ * files, or opening connections.  Their instantiate methods only touch
+ * their own instance data, so they can run at the same time.
+ *
+ * @param[in] modules	section.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int modules_instantiate_parallel(CONF_SECTION *modules)
+{
+	module_instantiate_parallel_t	parallel = { .num = 0 };
+	pthread_t			threads[MODULE_INSTANTIATE_THREADS];
+	uint32_t			i, total = 0, num;
+	long				cpus;
+
+	if (cf_data_walk(modules, module_instance_t, _module_instantiate_count, &total) < 0) return -1;
+	if (!total) return 0;
+
+	parallel.inst = talloc_array(NULL, module_instance_t *, total);
+	if (!parallel.inst) return -1;
+
+	if (cf_data_walk(modules, module_instance_t, _module_instantiate_gather, &parallel) < 0) {
+	error:
+		talloc_free(parallel.inst);
+		return -1;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num = (cpus > 0) ? cpus : 1;
+	if (num > MODULE_INSTANTIATE_THREADS) num = MODULE_INSTANTIATE_THREADS;
+	if (num > parallel.num) num = parallel.num;
+
+	/*
+	 *	No point in creating threads for one module.
+	 */
+	if (num <= 1) num = 0;
+
+	for (i = 0; i < num; i++) {
+		if (pthread_create(&threads[i], NULL, module_instantiate_thread, &parallel) != 0) break;
+	}
+	num = i;
+
+	/*
+	 *	Instantiate whatever the threads haven't, which is
+	 *	everything if we couldn't create any threads.
+	 */
+	module_instantiate_thread(&parallel);
+
+	for (i = 0; i < num; i++) pthread_join(threads[i], NULL);
+
+	if (parallel.failed) goto error;
+
+	for (i = 0; i < parallel.num; i++) module_instantiate_done(parallel.inst[i]);
+
+	talloc_free(parallel.inst);
 
 	return 0;
 }
@@ -749,7 +1025,9 @@ int modules_instantiate(CONF_SECTION *root)
 	modules = cf_section_sub_find(root, "modules");
 	if (!modules) return 0;
 
-	if (cf_data_walk(modules, module_instance_t, _module_instantiate, NULL) < 0) return -1;
+	if (cf_data_walk(modules, module_instance_t, _module_instantiate_serial, NULL) < 0) return -1;
+
+	if (modules_instantiate_parallel(modules) < 0) return -1;
 
 #ifndef NDEBUG
 	{
@@ -1117,3 +1395,292 @@ int modules_bootstrap(CONF_SECTION *root)
 
 	return 0;
 }
+
+/** A single loaded version of a module's data
+ *
+ * Allocated in the NULL ctx so that it can be created after the module instance
+ * data has been made read only.
+ */
+typedef struct module_reload_version module_reload_version_t;
+struct module_reload_version {
+	void			*data;		//!< Produced by the load callback.
+	time_t			retired;	//!< When the version was replaced.
+	module_reload_version_t	*next;		//!< Next retired version.
+};
+
+/** A file whose modification time is monitored
+ *
+ */
+typedef struct {
+	char const		*filename;	//!< To stat.
+	time_t			mtime;		//!< When it was last loaded.
+} module_reload_file_t;
+
+struct module_reload {
+	char const		*name;		//!< Of the module instance, for log messages.
+	void const		*instance;	//!< Passed to the load callback.
+	module_reload_load_t	load;		//!< Builds a new version of the data.
+	uint32_t		interval;	//!< How often to check files for changes.
+
+	module_reload_file_t	*files;		//!< Being monitored.
+
+	module_reload_version_t	*current;	//!< Version new requests should use.
+	module_reload_version_t	*retired;	//!< Versions which may still be in use.
+
+	pthread_mutex_t		mutex;		//!< Serialises loads and wakes the reload thread.
+	pthread_cond_t		cond;		//!< Signalled to stop the reload thread.
+	pthread_t		thread;		//!< Checking files for changes.
+	bool			running;	//!< Whether the reload thread was started.
+	bool			stop;		//!< Tell the reload thread to exit.
+};
+
+/** Record the current modification times of all monitored files
+ *
+ * @param[in] mr to update.
+ * @return true if any of the files changed since they were last recorded.
+ */
+static bool module_reload_stat(module_reload_t *mr)
+{
+	size_t		i;
+	bool		changed = false;
+	struct stat	buf;
+
+	for (i = 0; i < talloc_array_length(mr->files); i++) {
+		if (stat(mr->files[i].filename, &buf) < 0) continue;	/* Probably being replaced */
+
+		if (buf.st_mtime != mr->files[i].mtime) {
+			mr->files[i].mtime = buf.st_mtime;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/** Free versions which no request can still be using
+ *
+ * Modules using this API must not yield whilst holding a reference to the
+ * data, so once a version has been retired for longer than max_request_time,
+ * nothing can still be referencing it.
+ *
+ * @param[in] mr to free versions for.
+ * @param[in] now The current time, or 0 to free all retired versions.
+ */
+static void module_reload_reap(module_reload_t *mr, time_t now)
+{
+	module_reload_version_t **last = &mr->retired, *v;
+
+	while ((v = *last)) {
+		if (now && ((v->retired + (time_t)main_config.max_request_time + 1) > now)) {
+			last = &v->next;
+			continue;
+		}
+
+		*last = v->next;
+		talloc_free(v);
+	}
+}
+
+/** Load a new version of the data, and swap it in
+ *
+ * @param[in] mr to load.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The previous version remains in use.
+ */
+static int module_reload_load(module_reload_t *mr)
+{
+	module_reload_version_t *v, *old;
+
+	v = talloc_zero(NULL, module_reload_version_t);
+	if (!v) return -1;
+
+	if (mr->load(v, &v->data, mr->instance) < 0) {
+		talloc_free(v);
+		return -1;
+	}
+
+	old = __atomic_exchange_n(&mr->current, v, __ATOMIC_ACQ_REL);
+	if (old) {
+		old->retired = time(NULL);
+		old->next = mr->retired;
+		mr->retired = old;
+	}
+
+	return 0;
+}
+
+static void *module_reload_thread(void *arg)
+{
+	module_reload_t *mr = arg;
+
+	pthread_mutex_lock(&mr->mutex);
+	while (!mr->stop) {
+		struct timespec	when;
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec += mr->interval;
+
+		pthread_cond_timedwait(&mr->cond, &mr->mutex, &when);
+		if (mr->stop) break;
+
+		module_reload_reap(mr, time(NULL));
+
+		if (!module_reload_stat(mr)) continue;
+
+		INFO("%s - Files changed, reloading", mr->name);
+		if (module_reload_load(mr) < 0) {
+			ERROR("%s - Reload failed, continuing with previous data", mr->name);
+			continue;
+		}
+		INFO("%s - Reload complete", mr->name);
+	}
+	pthread_mutex_unlock(&mr->mutex);
+
+	return NULL;
+}
+
+static int _module_reload_free(module_reload_t *mr)
+{
+	if (mr->running) {
+		pthread_mutex_lock(&mr->mutex);
+		mr->stop = true;
+		pthread_cond_signal(&mr->cond);
+		pthread_mutex_unlock(&mr->mutex);
+
+		pthread_join(mr->thread, NULL);
+	}
+
+	pthread_cond_destroy(&mr->cond);
+	pthread_mutex_destroy(&mr->mutex);
+
+	talloc_free(mr->current);
+	module_reload_reap(mr, 0);
+
+	return 0;
+}
+
+/** Allocate a structure to manage reloading a module's data
+ *
+ * Must be called from the module's instantiate callback.  The module should
+ * then call #module_reload_watch for each file the data is built from, and
+ * #module_reload_start to perform the initial load.
+ *
+ * @param[in] ctx	to allocate in, usually the module instance data.
+ * @param[in] name	of the module instance.
+ * @param[in] instance	passed to the load callback.
+ * @param[in] load	callback to build a new version of the data.
+ * @param[in] interval	How often (in seconds) to check files for changes.
+ *			0 disables reloading.
+ * @return
+ *	- A new reload structure.
+ *	- NULL on error.
+ */
+module_reload_t *module_reload_alloc(TALLOC_CTX *ctx, char const *name, void const *instance,
+				     module_reload_load_t load, uint32_t interval)
+{
+	module_reload_t *mr;
+
+	mr = talloc_zero(ctx, module_reload_t);
+	if (!mr) return NULL;
+
+	mr->name = talloc_typed_strdup(mr, name);
+	mr->instance = instance;
+	mr->load = load;
+	mr->interval = interval;
+	mr->files = talloc_array(mr, module_reload_file_t, 0);
+
+	pthread_mutex_init(&mr->mutex, NULL);
+	pthread_cond_init(&mr->cond, NULL);
+	talloc_set_destructor(mr, _module_reload_free);
+
+	return mr;
+}
+
+/** Add a file to the set checked for changes
+ *
+ * @param[in] mr		to add the file to.
+ * @param[in] filename	to watch.  NULL is ignored.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int module_reload_watch(module_reload_t *mr, char const *filename)
+{
+	module_reload_file_t	*files;
+	size_t			num;
+
+	if (!filename) return 0;
+
+	rad_assert(!mr->running);
+
+	num = talloc_array_length(mr->files);
+	files = talloc_realloc(mr, mr->files, module_reload_file_t, num + 1);
+	if (!files) return -1;
+
+	files[num].filename = talloc_typed_strdup(files, filename);
+	files[num].mtime = 0;
+	mr->files = files;
+
+	return 0;
+}
+
+/** Load the initial version of the data, and start checking for changes
+ *
+ * @param[in] mr to start.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the initial load failed.
+ */
+int module_reload_start(module_reload_t *mr)
+{
+	(void) module_reload_stat(mr);
+
+	if (module_reload_load(mr) < 0) return -1;
+
+	if (!mr->interval || check_config || !talloc_array_length(mr->files)) return 0;
+
+	if (pthread_create(&mr->thread, NULL, module_reload_thread, mr) != 0) {
+		ERROR("%s - Failed creating reload thread: %s", mr->name, fr_syserror(errno));
+		return -1;
+	}
+	mr->running = true;
+
+	return 0;
+}
+
+/** Return the current version of a module's data
+ *
+ * The data must not be referenced after the module method returns, or across a yield.
+ *
+ * @param[in] mr to return data for.
+ * @return the current data.
+ */
+void *module_reload_current(module_reload_t const *mr)
+{
+	module_reload_version_t *v;
+
+	v = __atomic_load_n(&mr->current, __ATOMIC_ACQUIRE);
+
+	return v->data;
+}
+
+/** Reload a module's data immediately, regardless of whether its files changed
+ *
+ * @param[in] mr to reload.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The previous version remains in use.
+ */
+int module_reload_now(module_reload_t *mr)
+{
+	int ret;
+
+	pthread_mutex_lock(&mr->mutex);
+	(void) module_reload_stat(mr);
+	module_reload_reap(mr, time(NULL));
+	ret = module_reload_load(mr);
+	pthread_mutex_unlock(&mr->mutex);
+
+	return ret;
+}
@@ -98,7 +98,7 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 			REDEBUG("Error stringifying operand for regular expression");
 
 		regex_error:
-			talloc_free(preg);
+			regex_cache_release(preg);
 			talloc_free(expr);
 			talloc_free(value);
 			return -2;
@@ -107,7 +107,7 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 		/*
 		 *	Include substring matches.
 		 */
-		slen = regex_compile(request, &preg, expr_p, talloc_array_length(expr_p) - 1, false, false, true, true);
+		slen = regex_compile_cached(&preg, expr_p, talloc_array_length(expr_p) - 1, false, false, true);
 		if (slen <= 0) {
 			REMARKER(expr_p, -slen, fr_strerror());
 
@@ -132,7 +132,7 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 			ret = (slen != 1) ? 0 : -1;
 		}
 
-		talloc_free(preg);
+		regex_cache_release(preg);
 		talloc_free(expr);
 		talloc_free(value);
 		goto finish;
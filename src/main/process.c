@@ -32,6 +32,8 @@ RCSID("$Id$")
 #include <freeradius-devel/state.h>
 
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trace.h>
+#include <freeradius-devel/udp.h>
 
 #ifdef HAVE_STDATOMIC_H
 #  include <stdatomic.h>
@@ -60,7 +62,8 @@ extern uint64_t sd_watchdog_interval;
 static bool spawn_workers = false;
 static bool just_started = true;
 time_t fr_start_time = (time_t)-1;
-static rbtree_t *pl = NULL;
+static request_dup_hash_t *pl = NULL;
+static struct request_reply_cache *rc = NULL;
 static fr_event_list_t *el = NULL;
 
 static void mark_home_server_alive(REQUEST *request, home_server_t *home);
@@ -508,17 +511,670 @@ static void proxy_reply_too_late(REQUEST *request)
 #endif
 
 
+/*
+ *	Duplicate detection.
+ *
+ *	Live requests are kept in a hash table, keyed by a fingerprint
+ *	of the packet tuple (addresses, ports, socket and ID).  The
+ *	fingerprint and the bucket chain are stored in the REQUEST, so
+ *	inserting and removing a request doesn't allocate any memory.
+ */
+#define REQUEST_DUP_HASH_INIT		(256)	//!< Initial number of buckets.  Must be a power of 2.
+#define REQUEST_DUP_HASH_LOAD		(2)	//!< Grow the table past this many entries per bucket.
+
+struct request_dup_hash {
+	uint32_t		num_elements;
+	uint32_t		mask;		//!< Number of buckets - 1.
+	REQUEST			**buckets;
+
+	bool			lock;
+	pthread_mutex_t		mutex;
+};
+
+#define DUP_HASH_LOCK(_dh)	if ((_dh)->lock) pthread_mutex_lock(&(_dh)->mutex)
+#define DUP_HASH_UNLOCK(_dh)	if ((_dh)->lock) pthread_mutex_unlock(&(_dh)->mutex)
+
+/** Hash the fields of a packet which are compared by fr_packet_cmp()
+ *
+ */
+static uint64_t request_dup_fingerprint(RADIUS_PACKET const *packet)
+{
+	uint32_t	hash, seed;
+	int		i;
+
+	hash = fr_hash(&packet->id, sizeof(packet->id));
+	hash = fr_hash_update(&packet->sockfd, sizeof(packet->sockfd), hash);
+	hash = fr_hash_update(&packet->src_port, sizeof(packet->src_port), hash);
+	hash = fr_hash_update(&packet->dst_port, sizeof(packet->dst_port), hash);
+
+	/*
+	 *	Only the parts of the address which
+	 *	fr_ipaddr_cmp() looks at.
+	 */
+	for (i = 0; i < 2; i++) {
+		fr_ipaddr_t const *ipaddr = (i == 0) ? &packet->src_ipaddr : &packet->dst_ipaddr;
+
+		hash = fr_hash_update(&ipaddr->af, sizeof(ipaddr->af), hash);
+		hash = fr_hash_update(&ipaddr->prefix, sizeof(ipaddr->prefix), hash);
+
+		switch (ipaddr->af) {
+		case AF_INET:
+			hash = fr_hash_update(&ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr), hash);
+			break;
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+		case AF_INET6:
+			hash = fr_hash_update(&ipaddr->zone_id, sizeof(ipaddr->zone_id), hash);
+			hash = fr_hash_update(&ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr), hash);
+			break;
+#endif
+
+		default:
+			break;
+		}
+	}
+
+	/*
+	 *	The low bits pick the bucket, the high bits make
+	 *	it unlikely that we have to call fr_packet_cmp()
+	 *	for entries which don't match.
+	 */
+	seed = fr_hash(&hash, sizeof(hash));
+
+	return (((uint64_t) seed) << 32) | hash;
+}
+
+static int _request_dup_hash_free(request_dup_hash_t *dh)
+{
+	if (dh->lock) pthread_mutex_destroy(&dh->mutex);
+
+	return 0;
+}
+
+/** Allocate a hash table for duplicate detection
+ *
+ * @param[in] ctx to allocate the table in.
+ * @param[in] lock whether the table should be protected by a mutex.
+ * @return
+ *	- NULL on error.
+ *	- the new table.
+ */
+request_dup_hash_t *request_dup_hash_alloc(TALLOC_CTX *ctx, bool lock)
+{
+	request_dup_hash_t *dh;
+
+	dh = talloc_zero(ctx, request_dup_hash_t);
+	if (!dh) return NULL;
+
+	dh->buckets = talloc_zero_array(dh, REQUEST *, REQUEST_DUP_HASH_INIT);
+	if (!dh->buckets) {
+		talloc_free(dh);
+		return NULL;
+	}
+	dh->mask = REQUEST_DUP_HASH_INIT - 1;
+
+	dh->lock = lock;
+	if (lock) pthread_mutex_init(&dh->mutex, NULL);
+	talloc_set_destructor(dh, _request_dup_hash_free);
+
+	return dh;
+}
+
+/** Double the number of buckets
+ *
+ *  If we can't allocate memory, the chains just get longer.
+ */
+static void request_dup_hash_grow(request_dup_hash_t *dh)
+{
+	REQUEST		**buckets;
+	uint32_t	i, num = (dh->mask + 1) * 2;
+
+	buckets = talloc_zero_array(dh, REQUEST *, num);
+	if (!buckets) return;
+
+	for (i = 0; i <= dh->mask; i++) {
+		REQUEST *request, *next;
+
+		for (request = dh->buckets[i]; request; request = next) {
+			uint32_t bucket = request->dup_fingerprint & (num - 1);
+
+			next = request->dup_next;
+			request->dup_next = buckets[bucket];
+			buckets[bucket] = request;
+		}
+	}
+
+	talloc_free(dh->buckets);
+	dh->buckets = buckets;
+	dh->mask = num - 1;
+}
+
+/** Find the live request for a packet, with the table locked
+ *
+ */
+static REQUEST *request_dup_hash_find_nl(request_dup_hash_t *dh, RADIUS_PACKET const *packet, uint64_t fingerprint)
+{
+	REQUEST *request;
+
+	for (request = dh->buckets[fingerprint & dh->mask]; request; request = request->dup_next) {
+		if ((request->dup_fingerprint == fingerprint) &&
+		    (fr_packet_cmp(request->packet, packet) == 0)) return request;
+	}
+
+	return NULL;
+}
+
+/** Insert a request into a duplicate detection table
+ *
+ * @param[in] dh to insert the request into.
+ * @param[in] request to insert.
+ * @return
+ *	- true on success.
+ *	- false if there is already a request for the same packet tuple.
+ */
+bool request_dup_hash_insert(request_dup_hash_t *dh, REQUEST *request)
+{
+	uint64_t	fingerprint;
+	uint32_t	bucket;
+
+	fingerprint = request_dup_fingerprint(request->packet);
+
+	DUP_HASH_LOCK(dh);
+	if (request_dup_hash_find_nl(dh, request->packet, fingerprint)) {
+		DUP_HASH_UNLOCK(dh);
+		return false;
+	}
+
+	if (dh->num_elements >= ((dh->mask + 1) * REQUEST_DUP_HASH_LOAD)) request_dup_hash_grow(dh);
+
+	bucket = fingerprint & dh->mask;
+	request->dup_fingerprint = fingerprint;
+	request->dup_next = dh->buckets[bucket];
+	dh->buckets[bucket] = request;
+	dh->num_elements++;
+	DUP_HASH_UNLOCK(dh);
+
+	return true;
+}
+
+/** Remove a request from a duplicate detection table
+ *
+ * @param[in] dh to remove the request from.
+ * @param[in] request to remove.
+ * @return
+ *	- true if the request was removed.
+ *	- false if the request wasn't in the table.
+ */
+bool request_dup_hash_remove(request_dup_hash_t *dh, REQUEST *request)
+{
+	REQUEST **last;
+
+	DUP_HASH_LOCK(dh);
+	for (last = &dh->buckets[request->dup_fingerprint & dh->mask]; *last; last = &(*last)->dup_next) {
+		if (*last != request) continue;
+
+		*last = request->dup_next;
+		request->dup_next = NULL;
+		dh->num_elements--;
+		DUP_HASH_UNLOCK(dh);
+		return true;
+	}
+	DUP_HASH_UNLOCK(dh);
+
+	return false;
+}
+
+/** Find the live request with the same packet tuple as a new packet
+ *
+ * @param[in] dh to search.
+ * @param[in] packet which was just received.
+ * @return
+ *	- NULL if there's no matching request.
+ *	- the matching request.
+ */
+REQUEST *request_dup_hash_find(request_dup_hash_t *dh, RADIUS_PACKET const *packet)
+{
+	REQUEST		*request;
+	uint64_t	fingerprint;
+
+	fingerprint = request_dup_fingerprint(packet);
+
+	DUP_HASH_LOCK(dh);
+	request = request_dup_hash_find_nl(dh, packet, fingerprint);
+	DUP_HASH_UNLOCK(dh);
+
+	return request;
+}
+
+/** Return the number of requests in a duplicate detection table
+ *
+ */
+uint32_t request_dup_hash_num_elements(request_dup_hash_t *dh)
+{
+	uint32_t num;
+
+	DUP_HASH_LOCK(dh);
+	num = dh->num_elements;
+	DUP_HASH_UNLOCK(dh);
+
+	return num;
+}
+
+/** Walk over all requests in a duplicate detection table
+ *
+ *  The walker has the same return codes as an #RBTREE_DELETE_ORDER
+ *  walker.  0 continues the walk, 2 removes the request and continues,
+ *  1 removes the request and stops, and < 0 stops.
+ *
+ *  The table is locked during the walk, so the walker MUST NOT call
+ *  any other request_dup_hash_* functions on it.
+ *
+ * @param[in] dh to walk over.
+ * @param[in] walker to call for each request.
+ * @param[in] ctx to pass to the walker.
+ * @return the last value returned by the walker.
+ */
+int request_dup_hash_walk(request_dup_hash_t *dh, request_dup_walk_t walker, void *ctx)
+{
+	uint32_t	i;
+	int		rcode = 0;
+
+	DUP_HASH_LOCK(dh);
+	for (i = 0; i <= dh->mask; i++) {
+		REQUEST **last, *request;
+
+		last = &dh->buckets[i];
+		while ((request = *last) != NULL) {
+			REQUEST *next = request->dup_next;
+
+			rcode = walker(ctx, request);
+			if (rcode < 0) goto done;
+
+			if (rcode == 0) {
+				last = &request->dup_next;
+				continue;
+			}
+
+			/*
+			 *	The walker may have freed the request,
+			 *	so we don't touch it.
+			 */
+			*last = next;
+			dh->num_elements--;
+			if (rcode != 2) goto done;
+		}
+	}
+
+done:
+	DUP_HASH_UNLOCK(dh);
+
+	return rcode;
+}
+
 static void request_dup_extract(REQUEST *request)
 {
 	if (!request->in_request_hash) return;
 
-	if (!rbtree_deletebydata(pl, &request->packet)) {
+	if (!request_dup_hash_remove(pl, request)) {
 		rad_assert(0 == 1);
 	}
 	request->in_request_hash = false;
 }
 
 
+/*
+ *	Reply cache.
+ *
+ *	After an Access-Request has been answered, all we need to
+ *	answer a retransmit is the key, the authentication vector of
+ *	the request, and the encoded reply.  Those are copied here,
+ *	and the REQUEST is freed immediately, instead of being kept
+ *	for cleanup_delay.
+ *
+ *	Entries are kept in roughly the order they expire, and expired
+ *	entries are removed from the head of the list whenever the
+ *	cache is used.
+ */
+typedef struct request_reply_entry request_reply_entry_t;
+typedef struct request_reply_cache request_reply_cache_t;
+
+struct request_reply_entry {
+	uint64_t		fingerprint;	//!< Of the request, as used by the duplicate hash.
+	request_reply_entry_t	*hash_next;	//!< Next entry in the same bucket.
+	request_reply_entry_t	*prev;		//!< Previous entry in expiry order.
+	request_reply_entry_t	*next;		//!< Next entry in expiry order.
+
+	uint64_t		number;		//!< Of the request, for debug messages.
+	rad_listen_t		*listener;	//!< The request was received on.
+	int			sockfd;
+	int			if_index;
+	int			id;
+	fr_ipaddr_t		src_ipaddr;	//!< Of the request.
+	fr_ipaddr_t		dst_ipaddr;	//!< Of the request.
+	fr_ipaddr_t		reply_src_ipaddr; //!< May be set by the client, instead of dst_ipaddr.
+	uint16_t		src_port;
+	uint16_t		dst_port;
+	size_t			request_len;	//!< Together with the vector, identifies retransmits.
+	uint8_t			vector[AUTH_VECTOR_LEN];
+
+	time_t			timestamp;	//!< When the reply was sent.
+	uint32_t		delay;		//!< How long to keep the entry, doubled on each retransmit.
+	time_t			expires;
+
+	size_t			data_len;	//!< Of the encoded reply, 0 if we didn't reply.
+	uint8_t			data[];
+};
+
+struct request_reply_cache {
+	uint32_t		num_elements;
+	uint32_t		mask;		//!< Number of buckets - 1.
+	request_reply_entry_t	**buckets;
+
+	request_reply_entry_t	*head;		//!< Expires first.
+	request_reply_entry_t	*tail;		//!< Expires last.
+
+	pthread_mutex_t		mutex;
+};
+
+static int _request_reply_cache_free(request_reply_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a reply cache
+ *
+ * @param[in] ctx to allocate the cache in.
+ * @return
+ *	- NULL on error.
+ *	- the new cache.
+ */
+static request_reply_cache_t *request_reply_cache_alloc(TALLOC_CTX *ctx)
+{
+	request_reply_cache_t *cache;
+
+	cache = talloc_zero(ctx, request_reply_cache_t);
+	if (!cache) return NULL;
+
+	cache->buckets = talloc_zero_array(cache, request_reply_entry_t *, REQUEST_DUP_HASH_INIT);
+	if (!cache->buckets) {
+		talloc_free(cache);
+		return NULL;
+	}
+	cache->mask = REQUEST_DUP_HASH_INIT - 1;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _request_reply_cache_free);
+
+	return cache;
+}
+
+/** Double the number of buckets
+ *
+ *  If we can't allocate memory, the chains just get longer.
+ */
+static void request_reply_cache_grow(request_reply_cache_t *cache)
+{
+	request_reply_entry_t	**buckets;
+	uint32_t		i, num = (cache->mask + 1) * 2;
+
+	buckets = talloc_zero_array(cache, request_reply_entry_t *, num);
+	if (!buckets) return;
+
+	for (i = 0; i <= cache->mask; i++) {
+		request_reply_entry_t *entry, *next;
+
+		for (entry = cache->buckets[i]; entry; entry = next) {
+			uint32_t bucket = entry->fingerprint & (num - 1);
+
+			next = entry->hash_next;
+			entry->hash_next = buckets[bucket];
+			buckets[bucket] = entry;
+		}
+	}
+
+	talloc_free(cache->buckets);
+	cache->buckets = buckets;
+	cache->mask = num - 1;
+}
+
+/** Add an entry to the end of the expiry list
+ *
+ */
+static void request_reply_cache_append_nl(request_reply_cache_t *cache, request_reply_entry_t *entry)
+{
+	entry->next = NULL;
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+}
+
+/** Remove an entry from the expiry list
+ *
+ */
+static void request_reply_cache_unlink_nl(request_reply_cache_t *cache, request_reply_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ */
+static void request_reply_cache_delete_nl(request_reply_cache_t *cache, request_reply_entry_t *entry)
+{
+	request_reply_entry_t **last;
+
+	for (last = &cache->buckets[entry->fingerprint & cache->mask]; *last; last = &(*last)->hash_next) {
+		if (*last != entry) continue;
+
+		*last = entry->hash_next;
+		cache->num_elements--;
+		break;
+	}
+
+	request_reply_cache_unlink_nl(cache, entry);
+	talloc_free(entry);
+}
+
+/** Free entries which have expired
+ *
+ */
+static void request_reply_cache_expire_nl(request_reply_cache_t *cache, time_t now)
+{
+	while (cache->head && (cache->head->expires <= now)) {
+		request_reply_cache_delete_nl(cache, cache->head);
+	}
+}
+
+/** Find the entry for the same packet tuple as a new packet
+ *
+ */
+static request_reply_entry_t *request_reply_cache_find_nl(request_reply_cache_t *cache, RADIUS_PACKET const *packet,
+							  uint64_t fingerprint)
+{
+	request_reply_entry_t *entry;
+
+	for (entry = cache->buckets[fingerprint & cache->mask]; entry; entry = entry->hash_next) {
+		if (entry->fingerprint != fingerprint) continue;
+
+		/*
+		 *	The same fields as fr_packet_cmp().
+		 */
+		if ((entry->id == packet->id) &&
+		    (entry->sockfd == packet->sockfd) &&
+		    (entry->src_port == packet->src_port) &&
+		    (entry->dst_port == packet->dst_port) &&
+		    (fr_ipaddr_cmp(&entry->src_ipaddr, &packet->src_ipaddr) == 0) &&
+		    (fr_ipaddr_cmp(&entry->dst_ipaddr, &packet->dst_ipaddr) == 0)) return entry;
+	}
+
+	return NULL;
+}
+
+/** Copy the reply to a request into the reply cache
+ *
+ * @param[in] cache to insert the reply into.
+ * @param[in] request which has been answered.
+ * @return
+ *	- true if the reply was cached, and the request can be freed.
+ *	- false if the request has to be kept for cleanup_delay.
+ */
+static bool request_reply_cache_insert(request_reply_cache_t *cache, REQUEST *request)
+{
+	request_reply_entry_t	*entry, *old;
+	RADIUS_PACKET		*packet = request->packet, *reply = request->reply;
+	size_t			data_len = 0;
+	uint32_t		bucket;
+
+	if (reply->code && reply->data) data_len = reply->data_len;
+
+	entry = talloc_zero_size(cache, sizeof(*entry) + data_len);
+	if (!entry) return false;
+	talloc_set_type(entry, request_reply_entry_t);
+
+	entry->fingerprint = request_dup_fingerprint(packet);
+	entry->number = request->number;
+	entry->listener = request->listener;
+	entry->sockfd = packet->sockfd;
+	entry->if_index = reply->if_index;
+	entry->id = packet->id;
+	entry->src_ipaddr = packet->src_ipaddr;
+	entry->dst_ipaddr = packet->dst_ipaddr;
+	entry->reply_src_ipaddr = reply->src_ipaddr;
+	entry->src_port = packet->src_port;
+	entry->dst_port = packet->dst_port;
+	entry->request_len = packet->data_len;
+	memcpy(entry->vector, packet->vector, sizeof(entry->vector));
+
+	entry->timestamp = reply->timestamp.tv_sec;
+	entry->delay = request->root->cleanup_delay;
+	entry->expires = entry->timestamp + entry->delay;
+
+	entry->data_len = data_len;
+	if (data_len) memcpy(entry->data, reply->data, data_len);
+
+	pthread_mutex_lock(&cache->mutex);
+	request_reply_cache_expire_nl(cache, entry->timestamp);
+
+	/*
+	 *	A previous request with the same ID.  The new
+	 *	reply supersedes it.
+	 */
+	old = request_reply_cache_find_nl(cache, packet, entry->fingerprint);
+	if (old) request_reply_cache_delete_nl(cache, old);
+
+	if (cache->num_elements >= ((cache->mask + 1) * REQUEST_DUP_HASH_LOAD)) request_reply_cache_grow(cache);
+
+	bucket = entry->fingerprint & cache->mask;
+	entry->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+	cache->num_elements++;
+	request_reply_cache_append_nl(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return true;
+}
+
+/** Answer a retransmit from the reply cache
+ *
+ * @param[in] cache to search.
+ * @param[in] listener the packet was received on.
+ * @param[in] client the packet was received from.
+ * @param[in] packet which was just received.
+ * @return
+ *	- true if the packet was a retransmit, and has been dealt with.
+ *	- false if the packet should be processed as a new request.
+ */
+static bool request_reply_cache_received(request_reply_cache_t *cache, rad_listen_t *listener, RADCLIENT *client,
+					 RADIUS_PACKET *packet)
+{
+	request_reply_entry_t	*entry;
+	uint64_t		fingerprint;
+
+	fingerprint = request_dup_fingerprint(packet);
+
+	pthread_mutex_lock(&cache->mutex);
+	request_reply_cache_expire_nl(cache, packet->timestamp.tv_sec);
+
+	entry = request_reply_cache_find_nl(cache, packet, fingerprint);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	/*
+	 *	Same ID, but a different packet.  It's a new request,
+	 *	and the cached reply is no longer useful.
+	 */
+	if ((entry->request_len != packet->data_len) ||
+	    (memcmp(entry->vector, packet->vector, sizeof(entry->vector)) != 0)) {
+		request_reply_cache_delete_nl(cache, entry);
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	FR_STATS_INC(auth, total_dup_requests);
+
+	if (!entry->data_len) {
+		DEBUG("(%" PRIu64 ") No reply.  Ignoring retransmit", entry->number);
+	} else {
+		DEBUG2("(%" PRIu64 ") Sending cached reply to retransmit - ID: %u", entry->number, packet->id);
+
+		if (udp_send(entry->sockfd, entry->data, entry->data_len, 0,
+			     &entry->reply_src_ipaddr, entry->dst_port, entry->if_index,
+			     &entry->src_ipaddr, entry->src_port) < 0) {
+			ERROR("(%" PRIu64 ") Failed sending cached reply: %s", entry->number, fr_syserror(errno));
+		}
+	}
+
+	/*
+	 *	Double the cleanup_delay to catch retransmits.
+	 */
+	entry->delay += entry->delay;
+	entry->expires = entry->timestamp + entry->delay;
+
+	request_reply_cache_unlink_nl(cache, entry);
+	request_reply_cache_append_nl(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return true;
+}
+
+#ifdef WITH_TCP
+/** Remove all cached replies for a listener which is being closed
+ *
+ */
+static void request_reply_cache_listener_free(request_reply_cache_t *cache, rad_listen_t *listener)
+{
+	request_reply_entry_t *entry, *next;
+
+	if (!cache) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	for (entry = cache->head; entry; entry = next) {
+		next = entry->next;
+
+		if (entry->listener == listener) request_reply_cache_delete_nl(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+#endif
+
 /*
  *	If the child is still running, wait for it to be finished.
  */
@@ -758,6 +1414,21 @@ static void request_cleanup_delay_init(REQUEST *request)
 	 *	Set timer for when we need to clean it up.
 	 */
 	if (fr_timeval_cmp(&when, &now) > 0) {
+		/*
+		 *	Replies sent over UDP are copied to the reply
+		 *	cache, which answers retransmits, so we don't
+		 *	need to keep the whole request.
+		 */
+		if (rc && request->in_request_hash &&
+		    (request->listener->type == RAD_LISTEN_AUTH) &&
+#ifdef WITH_TCP
+		    (request->packet->proto != IPPROTO_TCP) &&
+#endif
+		    request_reply_cache_insert(rc, request)) {
+			RDEBUG2("Cached reply for %d seconds", request->delay);
+			goto done;
+		}
+
 #ifdef DEBUG_STATE_MACHINE
 		if (rad_debug_lvl) printf("(%" PRIu64 ") ********\tNEXT-STATE %s -> %s\n", request->number, __FUNCTION__, "request_cleanup_delay");
 #endif
@@ -1354,7 +2025,11 @@ static void request_finish(REQUEST *request, fr_state_action_t action)
 		}
 
 	done:
+		listen_status_reply_update(request);
+
 		RDEBUG2("Finished request");
+		FR_PROBE2(request__done, request->number, request->reply->code);
+		trace_request_done(request);
 		request_cleanup_delay_init(request);
 
 	} else {
@@ -1368,6 +2043,9 @@ static void request_finish(REQUEST *request, fr_state_action_t action)
 		request->listener->encode(request->listener, request);
 		request->process = request_response_delay;
 
+		FR_PROBE2(request__done, request->number, request->reply->code);
+		trace_request_done(request);
+
 		FINAL_STATE(REQUEST_RESPONSE_DELAY);
 	}
 }
@@ -1514,16 +2192,22 @@ static void request_queued(REQUEST *request, fr_state_action_t action)
 /*
  *	See if a new packet is a duplicate of an old one.
  */
-bool request_dup_received(rad_listen_t *listener, rbtree_t *dup_tree, RADCLIENT *client, RADIUS_PACKET *packet)
+bool request_dup_received(rad_listen_t *listener, request_dup_hash_t *dh, RADCLIENT *client, RADIUS_PACKET *packet)
 {
-	RADIUS_PACKET **packet_p;
 	rad_child_state_t child_state;
 	REQUEST *request;
 
-	packet_p = rbtree_finddata(dup_tree, &packet);
-	if (!packet_p) return false;
+	request = request_dup_hash_find(dh, packet);
+	if (!request) {
+		/*
+		 *	The request may have been answered, and freed.
+		 */
+		if ((dh == pl) && rc && (packet->code == PW_CODE_ACCESS_REQUEST)) {
+			return request_reply_cache_received(rc, listener, client, packet);
+		}
+		return false;
+	}
 
-	request = fr_packet2myptr(REQUEST, packet, packet_p);
 	rad_assert(request->in_request_hash);
 
 	child_state = request->child_state;
@@ -1614,7 +2298,7 @@ bool request_limit(rad_listen_t *listener, RADCLIENT *client, RADIUS_PACKET *pac
 	 *	Quench maximum number of outstanding requests.
 	 */
 	if (main_config.max_requests &&
-	    ((count = rbtree_num_elements(pl)) > main_config.max_requests)) {
+	    ((count = request_dup_hash_num_elements(pl)) > main_config.max_requests)) {
 		RATE_LIMIT(ERROR("Dropping request (%d is too many): from client %s port %d - ID: %d", count,
 				 client->shortname,
 				 packet->src_port, packet->id);
@@ -1632,6 +2316,21 @@ bool request_limit(rad_listen_t *listener, RADCLIENT *client, RADIUS_PACKET *pac
 		sock = listener->data;
 	}
 
+	/*
+	 *	The kernel dropping packets means we're overloaded.
+	 *	Shed some accounting load, if we're allowed to.
+	 */
+	if (sock && listen_socket_drops(listener, packet->timestamp.tv_sec)) {
+		thread_pool_overloaded(packet->timestamp.tv_sec);
+	}
+
+#ifdef WITH_ACCOUNTING
+	if ((packet->code == PW_CODE_ACCOUNTING_REQUEST) && thread_pool_limit_acct(packet->timestamp.tv_sec)) {
+		RATE_LIMIT(WARN("Discarding accounting requests, as the server is overloaded"));
+		return true;
+	}
+#endif
+
 	/*
 	 *	Rate-limit the incoming packets
 	 */
@@ -1707,11 +2406,13 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 		return 1;
 	}
 
+	if (listener->affinity) request->affinity = listener->affinity(listener, packet);
+
 	/*
 	 *	Remember the request in the list.
 	 */
 	if (!listener->nodup) {
-		if (!rbtree_insert(pl, &request->packet)) {
+		if (!request_dup_hash_insert(pl, request)) {
 			RERROR("Failed to insert request in the list of live requests: discarding it");
 			request_queued(request, FR_ACTION_DONE);
 			return 1;
@@ -1759,6 +2460,8 @@ REQUEST *request_setup(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *p
 	request->client = client;
 	request->packet = talloc_steal(request, packet);
 	request->number = atomic_fetch_add_explicit(&request_number_counter, 1, memory_order_relaxed);
+	trace_request_start(request);
+	FR_PROBE2(request__start, request->number, packet->code);
 	request->priority = listener->type;
 	if (request->priority >= RAD_LISTEN_MAX) {
 		request->priority = RAD_LISTEN_AUTH;
@@ -1776,14 +2479,14 @@ REQUEST *request_setup(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *p
 	NO_CHILD_THREAD;
 
 #ifdef WITH_STATS
-	request->listener->stats.last_packet = request->packet->timestamp.tv_sec;
+	FR_STATS_LAST_PACKET(&request->listener->stats, request->packet->timestamp.tv_sec);
 	if (packet->code == PW_CODE_ACCESS_REQUEST) {
-		request->client->auth.last_packet = request->packet->timestamp.tv_sec;
-		radius_auth_stats.last_packet = request->packet->timestamp.tv_sec;
+		FR_STATS_LAST_PACKET(&request->client->auth, request->packet->timestamp.tv_sec);
+		FR_STATS_LAST_PACKET(&radius_auth_stats, request->packet->timestamp.tv_sec);
 #ifdef WITH_ACCOUNTING
 	} else if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
-		request->client->acct.last_packet = request->packet->timestamp.tv_sec;
-		radius_acct_stats.last_packet = request->packet->timestamp.tv_sec;
+		FR_STATS_LAST_PACKET(&request->client->acct, request->packet->timestamp.tv_sec);
+		FR_STATS_LAST_PACKET(&radius_acct_stats, request->packet->timestamp.tv_sec);
 #endif
 	}
 #endif	/* WITH_STATS */
@@ -2034,13 +2737,10 @@ static int eol_proxy_listener(void *ctx, void *data)
 }
 #endif	/* WITH_PROXY */
 
-static int eol_listener(void *ctx, void *data)
+static int eol_listener(void *ctx, REQUEST *request)
 {
 	rad_listen_t *this = talloc_get_type_abort(ctx, rad_listen_t);
-	RADIUS_PACKET **packet_p = data;
-	REQUEST *request;
 
-	request = fr_packet2myptr(REQUEST, packet, packet_p);
 	if (request->listener != this) return 0;
 
 	request->master_state = REQUEST_STOP_PROCESSING;
@@ -2314,6 +3014,8 @@ static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply)
 		remove_from_proxy_hash(request);
 	}
 
+	if (request->home_pool && request->home_pool->transparent) return 1;
+
 	if (request->home_pool && request->home_pool->virtual_server) {
 		char const *old_server = request->server;
 
@@ -2434,6 +3136,15 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 
 		proxy->home_server->last_packet_recv = now.tv_sec;
 		sock->last_packet = now.tv_sec;
+
+		/*
+		 *	We can't tell which copy of a retransmitted
+		 *	packet this is a response to, so only the
+		 *	first transmission gives a response time.
+		 */
+		if (proxy->packet->count == 1) {
+			home_server_rtt_update(proxy->home_server, &proxy->packet->timestamp, &now);
+		}
 	}
 
 	/*
@@ -2448,42 +3159,41 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 	if (!proxy->listener) goto global_stats;
 
 	/*
-	 *	Update the proxy listener stats here, because only one
-	 *	thread accesses that at a time.  The home_server and
-	 *	main proxy_*_stats structures are updated once the
+	 *	Update the proxy listener stats here.  The home_server
+	 *	and main proxy_*_stats structures are updated once the
 	 *	request is cleaned up.
 	 */
-	proxy->listener->stats.total_responses++;
+	FR_STATS_ADD(&proxy->listener->stats, total_responses, 1);
 
-	proxy->listener->stats.last_packet = reply->timestamp.tv_sec;
+	FR_STATS_LAST_PACKET(&proxy->listener->stats, reply->timestamp.tv_sec);
 
 	switch (proxy->packet->code) {
 	case PW_CODE_ACCESS_REQUEST:
 		if (proxy->reply->code == PW_CODE_ACCESS_ACCEPT) {
-			proxy->listener->stats.total_access_accepts++;
+			FR_STATS_ADD(&proxy->listener->stats, total_access_accepts, 1);
 
 		} else if (proxy->reply->code == PW_CODE_ACCESS_REJECT) {
-			proxy->listener->stats.total_access_rejects++;
+			FR_STATS_ADD(&proxy->listener->stats, total_access_rejects, 1);
 
 		} else if (proxy->reply->code == PW_CODE_ACCESS_CHALLENGE) {
-			proxy->listener->stats.total_access_challenges++;
+			FR_STATS_ADD(&proxy->listener->stats, total_access_challenges, 1);
 		}
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
-		proxy->listener->stats.total_responses++;
+		FR_STATS_ADD(&proxy->listener->stats, total_responses, 1);
 		break;
 
 #endif
 
 #ifdef WITH_COA
 	case PW_CODE_COA_REQUEST:
-		proxy->listener->stats.total_responses++;
+		FR_STATS_ADD(&proxy->listener->stats, total_responses, 1);
 		break;
 
 	case PW_CODE_DISCONNECT_REQUEST:
-		proxy->listener->stats.total_responses++;
+		FR_STATS_ADD(&proxy->listener->stats, total_responses, 1);
 		break;
 
 #endif
@@ -2492,27 +3202,27 @@ int request_proxy_reply(RADIUS_PACKET *reply)
 	}
 
 global_stats:
-	proxy->home_server->stats.last_packet = reply->timestamp.tv_sec;
+	FR_STATS_LAST_PACKET(&proxy->home_server->stats, reply->timestamp.tv_sec);
 
 	switch (proxy->packet->code) {
 	case PW_CODE_ACCESS_REQUEST:
-		proxy_auth_stats.last_packet = reply->timestamp.tv_sec;
+		FR_STATS_LAST_PACKET(&proxy_auth_stats, reply->timestamp.tv_sec);
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
-		proxy_acct_stats.last_packet = reply->timestamp.tv_sec;
+		FR_STATS_LAST_PACKET(&proxy_acct_stats, reply->timestamp.tv_sec);
 		break;
 
 #endif
 
 #ifdef WITH_COA
 	case PW_CODE_COA_REQUEST:
-		proxy_coa_stats.last_packet = reply->timestamp.tv_sec;
+		FR_STATS_LAST_PACKET(&proxy_coa_stats, reply->timestamp.tv_sec);
 		break;
 
 	case PW_CODE_DISCONNECT_REQUEST:
-		proxy_dsc_stats.last_packet = reply->timestamp.tv_sec;
+		FR_STATS_LAST_PACKET(&proxy_dsc_stats, reply->timestamp.tv_sec);
 		break;
 
 #endif
@@ -3082,6 +3792,15 @@ do_home:
 	 */
 	if (realmname) pair_make_request("Realm", realmname, T_OP_EQ);
 
+	/*
+	 *	The request is forwarded as it was received, so
+	 *	there's no point in editing it.
+	 */
+	if (request->home_pool && request->home_pool->transparent) {
+		RDEBUG2("Home server pool %s is transparent, not running pre-proxy", request->home_pool->name);
+		return 1;
+	}
+
 	/*
 	 *	Strip the name, if told to.
 	 *
@@ -3893,30 +4612,32 @@ static bool proxy_keep_waiting(REQUEST *request, struct timeval *now)
 	if (!home->is_ourself &&
 	    ((home->state == HOME_STATE_ALIVE) ||
 	     (home->state == HOME_STATE_UNKNOWN))) {
+		home_server_rtt_timeout(home);
+
 		home->response_timeouts++;
 		if (home->response_timeouts >= home->max_response_timeouts)
 			mark_home_server_zombie(home, now, &request->proxy->response_delay);
 	}
 
-	FR_STATS_TYPE_INC(home->stats.total_timeouts);
+	FR_STATS_TYPE_INC(&home->stats, total_timeouts);
 	if (home->type == HOME_TYPE_AUTH) {
-		if (request->proxy->listener) FR_STATS_TYPE_INC(request->proxy->listener->stats.total_timeouts);
-		FR_STATS_TYPE_INC(proxy_auth_stats.total_timeouts);
+		if (request->proxy->listener) FR_STATS_TYPE_INC(&request->proxy->listener->stats, total_timeouts);
+		FR_STATS_TYPE_INC(&proxy_auth_stats, total_timeouts);
 	}
 #ifdef WITH_ACCT
 	else if (home->type == HOME_TYPE_ACCT) {
-		if (request->proxy->listener) FR_STATS_TYPE_INC(request->proxy->listener->stats.total_timeouts);
-		FR_STATS_TYPE_INC(proxy_acct_stats.total_timeouts);
+		if (request->proxy->listener) FR_STATS_TYPE_INC(&request->proxy->listener->stats, total_timeouts);
+		FR_STATS_TYPE_INC(&proxy_acct_stats, total_timeouts);
 	}
 #endif
 #ifdef WITH_COA
 	else if (home->type == HOME_TYPE_COA) {
-		if (request->proxy->listener) FR_STATS_TYPE_INC(request->proxy->listener->stats.total_timeouts);
+		if (request->proxy->listener) FR_STATS_TYPE_INC(&request->proxy->listener->stats, total_timeouts);
 
 		if (request->packet->code == PW_CODE_COA_REQUEST) {
-			FR_STATS_TYPE_INC(proxy_coa_stats.total_timeouts);
+			FR_STATS_TYPE_INC(&proxy_coa_stats, total_timeouts);
 		} else {
-			FR_STATS_TYPE_INC(proxy_dsc_stats.total_timeouts);
+			FR_STATS_TYPE_INC(&proxy_dsc_stats, total_timeouts);
 		}
 	}
 #endif
@@ -4010,7 +4731,7 @@ static void proxy_retransmit(REQUEST *request, struct timeval *now)
 	request->proxy->packet->count++;
 
 	rad_assert(request->proxy->listener != NULL);
-	FR_STATS_TYPE_INC(home->stats.total_requests);
+	FR_STATS_TYPE_INC(&home->stats, total_requests);
 	home->last_packet_sent = now->tv_sec;
 	request->proxy->listener->debug(request, request->proxy->packet, false);
 	request->proxy->listener->send(request->proxy->listener, request);
@@ -4473,7 +5194,7 @@ static bool coa_keep_waiting(REQUEST *request)
 
 	request->proxy->packet->count++;
 
-	FR_STATS_TYPE_INC(home->stats.total_requests);
+	FR_STATS_TYPE_INC(&home->stats, total_requests);
 
 	RDEBUG2("Sending duplicate CoA request to home server %s port %d - ID: %d",
 		inet_ntop(request->proxy->packet->dst_ipaddr.af,
@@ -4811,6 +5532,25 @@ static int event_new_fd(rad_listen_t *this)
 
 	if (this->status == RAD_LISTEN_STATUS_KNOWN) return 1;
 
+	/*
+	 *	Another thread is using the socket.  Stop reading
+	 *	from it until it's done.
+	 */
+	if (this->status == RAD_LISTEN_STATUS_PAUSE) {
+		fr_event_fd_delete(el, this->fd);
+		return 1;
+	}
+
+	if (this->status == RAD_LISTEN_STATUS_RESUME) {
+		if (fr_event_fd_insert(el, this->fd, event_socket_handler, NULL, event_socket_error, this)) {
+			ERROR("Failed adding event handler for socket: %s", fr_strerror());
+			fr_exit(1);
+		}
+
+		this->status = RAD_LISTEN_STATUS_KNOWN;
+		return 1;
+	}
+
 	this->print(this, buffer, sizeof(buffer));
 
 	if (this->status == RAD_LISTEN_STATUS_INIT) {
@@ -5007,7 +5747,13 @@ static int event_new_fd(rad_listen_t *this)
 			if (this->type != RAD_LISTEN_COMMAND)
 #endif
 
-			rbtree_walk(pl, RBTREE_DELETE_ORDER, eol_listener, this);
+			request_dup_hash_walk(pl, eol_listener, this);
+
+			/*
+			 *	The socket may be re-used for something
+			 *	else, so we can't send cached replies on it.
+			 */
+			request_reply_cache_listener_free(rc, this);
 		}
 
 
@@ -5201,14 +5947,6 @@ int radius_event_init(TALLOC_CTX *ctx) {
 	return 1;
 }
 
-static int packet_entry_cmp(void const *one, void const *two)
-{
-	RADIUS_PACKET const * const *a = one;
-	RADIUS_PACKET const * const *b = two;
-
-	return fr_packet_cmp(*a, *b);
-}
-
 #ifdef WITH_PROXY
 /*
  *	They haven't defined a proxy listener.  Automatically
@@ -5335,7 +6073,8 @@ int radius_event_start(bool have_children)
 		 */
 		rad_assert(el);
 
-		MEM(pl = rbtree_create(NULL, packet_entry_cmp, NULL, RBTREE_FLAG_LOCK));
+		MEM(pl = request_dup_hash_alloc(NULL, true));
+		MEM(rc = request_reply_cache_alloc(NULL));
 	}
 
 #ifdef WITH_PROXY
@@ -5470,10 +6209,8 @@ static int proxy_delete_cb(UNUSED void *ctx, void *data)
 #endif
 
 
-static int request_delete_cb(UNUSED void *ctx, void *data)
+static int request_delete_cb(UNUSED void *ctx, REQUEST *request)
 {
-	REQUEST *request = fr_packet2myptr(REQUEST, packet, data);
-
 	VERIFY_REQUEST(request);
 
 	request->master_state = REQUEST_STOP_PROCESSING;
@@ -5527,7 +6264,7 @@ void radius_event_free(void)
 	}
 #endif
 
-	rbtree_walk(pl, RBTREE_DELETE_ORDER,  request_delete_cb, NULL);
+	request_dup_hash_walk(pl, request_delete_cb, NULL);
 
 	if (spawn_workers) {
 		/*
@@ -5547,16 +6284,16 @@ void radius_event_free(void)
 			}
 #endif
 
-			rbtree_walk(pl, RBTREE_DELETE_ORDER, request_delete_cb, NULL);
-			num = rbtree_num_elements(pl);
+			request_dup_hash_walk(pl, request_delete_cb, NULL);
+			num = request_dup_hash_num_elements(pl);
 			if (num > 0) {
 				ERROR("Request list has %d requests still in it.", num);
 			}
 		}
 	}
 
-	rbtree_free(pl);
-	pl = NULL;
+	TALLOC_FREE(pl);
+	TALLOC_FREE(rc);
 
 #ifdef WITH_PROXY
 	fr_packet_list_free(proxy_list);
@@ -26,6 +26,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radclient.h>
 #include <freeradius-devel/conf.h>
+#include <freeradius-devel/md5.h>
 #include <ctype.h>
 
 #ifdef HAVE_GETOPT_H
@@ -33,6 +34,12 @@ RCSID("$Id$")
 #endif
 
 #include <assert.h>
+#include <pthread.h>
+
+#ifdef WITH_TLS
+#  include <openssl/ssl.h>
+#  include <openssl/err.h>
+#endif
 
 typedef struct REQUEST REQUEST;	/* to shut up warnings about mschap.h */
 
@@ -69,6 +76,10 @@ static fr_packet_list_t *pl = NULL;
 
 static int sleep_time = -1;
 
+static int window = 0;
+static fr_hash_table_t *dst_table = NULL;
+static FILE *result_fp = NULL;
+
 static rc_request_t *request_head = NULL;
 static rc_request_t *rc_request_tail = NULL;
 
@@ -89,7 +100,17 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -L <rate>[,<opt>=<val>...]\n");
+	fprintf(stderr, "                         Generate load, sending 'rate' packets/s regardless of replies.\n");
+	fprintf(stderr, "                         Options are duration=<seconds> (10), threads=<num> (1),\n");
+	fprintf(stderr, "                         sockets=<num> per thread (4), arrival=constant|poisson.\n");
+	fprintf(stderr, "                         %%{seq} and %%{mac} in string attributes are replaced with a\n");
+	fprintf(stderr, "                         packet counter and a random MAC address.\n");
+	fprintf(stderr, "                         eap=md5|tls|ttls runs an EAP conversation for each packet,\n");
+	fprintf(stderr, "                         with cert=<file>, key=<file>, fragment=<size> (1000) and\n");
+	fprintf(stderr, "                         resume=yes|no for the TLS based methods.\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -o <file>              Write the result of each request to file, or \"-\" for stdout.\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
@@ -97,6 +118,7 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
+	fprintf(stderr, "  -w <num>               Send at most 'num' packets in parallel to each destination.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
 #ifdef WITH_TCP
@@ -139,7 +161,6 @@ static int _rc_request_free(rc_request_t *request)
 static int mschapv1_encode(RADIUS_PACKET *packet, VALUE_PAIR **request,
 			   char const *password)
 {
-	unsigned int		i;
 	uint8_t			*p;
 	VALUE_PAIR		*challenge, *reply;
 	uint8_t			nthash[16];
@@ -155,9 +176,7 @@ static int mschapv1_encode(RADIUS_PACKET *packet, VALUE_PAIR **request,
 	fr_pair_add(request, challenge);
 	challenge->vp_length = 8;
 	challenge->vp_octets = p = talloc_array(challenge, uint8_t, challenge->vp_length);
-	for (i = 0; i < challenge->vp_length; i++) {
-		p[i] = fr_rand();
-	}
+	fr_rand_buffer(p, challenge->vp_length);
 
 	reply = fr_pair_afrom_num(packet, VENDORPEC_MICROSOFT, PW_MSCHAP_RESPONSE);
 	if (!reply) {
@@ -800,6 +819,11 @@ static void deallocate_id(rc_request_t *request)
 		return;
 	}
 
+	if (request->outstanding) {
+		request->dst->outstanding--;
+		request->outstanding = false;
+	}
+
 	/*
 	 *	One more unused RADIUS ID.
 	 */
@@ -814,6 +838,108 @@ static void deallocate_id(rc_request_t *request)
 	if (request->reply) fr_radius_free(&request->reply);
 }
 
+static uint32_t dst_hash(void const *data)
+{
+	uint32_t hash;
+	rc_dst_t const *dst = data;
+
+	hash = fr_hash(&dst->port, sizeof(dst->port));
+
+	if (dst->ipaddr.af == AF_INET) {
+		return fr_hash_update(&dst->ipaddr.ipaddr.ip4addr, sizeof(dst->ipaddr.ipaddr.ip4addr), hash);
+	}
+
+	return fr_hash_update(&dst->ipaddr.ipaddr.ip6addr, sizeof(dst->ipaddr.ipaddr.ip6addr), hash);
+}
+
+static int dst_cmp(void const *one, void const *two)
+{
+	rc_dst_t const *a = one;
+	rc_dst_t const *b = two;
+
+	if (a->port < b->port) return -1;
+	if (a->port > b->port) return +1;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+/*
+ *	Find (or create) the destination for a request.
+ */
+static rc_dst_t *dst_find(RADIUS_PACKET const *packet)
+{
+	rc_dst_t my_dst, *dst;
+
+	memset(&my_dst, 0, sizeof(my_dst));
+	my_dst.ipaddr = packet->dst_ipaddr;
+	my_dst.port = packet->dst_port;
+
+	dst = fr_hash_table_finddata(dst_table, &my_dst);
+	if (dst) return dst;
+
+	dst = talloc_zero(dst_table, rc_dst_t);
+	if (!dst) return NULL;
+
+	dst->ipaddr = my_dst.ipaddr;
+	dst->port = my_dst.port;
+
+	if (!fr_hash_table_insert(dst_table, dst)) {
+		talloc_free(dst);
+		return NULL;
+	}
+
+	return dst;
+}
+
+/*
+ *	Write one line with the result of a request.
+ *
+ *	<file>:<num> <ip> <port> <result> <tries>
+ */
+static void result_print(rc_request_t *request, char const *result)
+{
+	char buffer[INET6_ADDRSTRLEN];
+
+	if (!result_fp) return;
+
+	fprintf(result_fp, "%s:%" PRIu64 " %s %u %s %d\n",
+		request->files->packets, request->num,
+		inet_ntop(request->packet->dst_ipaddr.af, &request->packet->dst_ipaddr.ipaddr,
+			  buffer, sizeof(buffer)),
+		request->packet->dst_port, result, request->tries);
+
+	/*
+	 *	So that other programs can read the results as
+	 *	they arrive.
+	 */
+	fflush(result_fp);
+}
+
+/*
+ *	Fill in User-Password, CHAP-Password or MS-CHAP-Password
+ *	from the Cleartext-Password, using the packet's vector.
+ */
+static void password_update(RADIUS_PACKET *packet, VALUE_PAIR *password)
+{
+	VALUE_PAIR *vp;
+
+	if ((vp = fr_pair_find_by_num(packet->vps, 0, PW_USER_PASSWORD, TAG_ANY)) != NULL) {
+		fr_pair_value_strcpy(vp, password->vp_strvalue);
+
+	} else if ((vp = fr_pair_find_by_num(packet->vps, 0, PW_CHAP_PASSWORD, TAG_ANY)) != NULL) {
+		uint8_t buffer[17];
+
+		fr_radius_encode_chap_password(buffer, packet, fr_rand() & 0xff, password);
+		fr_pair_value_memcpy(vp, buffer, 17);
+
+	} else if (fr_pair_find_by_num(packet->vps, 0, PW_MS_CHAP_PASSWORD, TAG_ANY) != NULL) {
+		mschapv1_encode(packet, &packet->vps, password->vp_strvalue);
+
+	} else {
+		DEBUG("WARNING: No password in the request");
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -870,29 +996,16 @@ static int send_one_packet(rc_request_t *request)
 		assert(request->packet->id != -1);
 		assert(request->packet->data == NULL);
 
+		if (request->dst) {
+			request->dst->outstanding++;
+			request->outstanding = true;
+		}
+
 		/*
 		 *	Update the password, so it can be encrypted with the
 		 *	new authentication vector.
 		 */
-		if (request->password) {
-			VALUE_PAIR *vp;
-
-			if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY)) != NULL) {
-				fr_pair_value_strcpy(vp, request->password->vp_strvalue);
-
-			} else if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_CHAP_PASSWORD, TAG_ANY)) != NULL) {
-				uint8_t buffer[17];
-
-				fr_radius_encode_chap_password(buffer, request->packet, fr_rand() & 0xff, request->password);
-				fr_pair_value_memcpy(vp, buffer, 17);
-
-			} else if (fr_pair_find_by_num(request->packet->vps, 0, PW_MS_CHAP_PASSWORD, TAG_ANY) != NULL) {
-				mschapv1_encode(request->packet, &request->packet->vps, request->password->vp_strvalue);
-
-			} else {
-				DEBUG("WARNING: No password in the request");
-			}
-		}
+		if (request->password) password_update(request->packet, request->password);
 
 		request->timestamp = time(NULL);
 		request->tries = 1;
@@ -938,6 +1051,7 @@ static int send_one_packet(rc_request_t *request)
 
 			REDEBUG("No reply from server for ID %d socket %d",
 				request->packet->id, request->packet->sockfd);
+			result_print(request, "timeout");
 			deallocate_id(request);
 
 			/*
@@ -963,6 +1077,7 @@ static int send_one_packet(rc_request_t *request)
 	 */
 	if (fr_radius_send(request->packet, NULL, secret) < 0) {
 		REDEBUG("Failed to send packet for ID %d", request->packet->id);
+		result_print(request, "error");
 		deallocate_id(request);
 		request->done = true;
 		return -1;
@@ -1057,6 +1172,7 @@ static int recv_one_packet(int wait_time)
 	 */
 	if (fr_radius_verify(reply, request->packet, secret) < 0) {
 		REDEBUG("Reply verification failed");
+		result_print(request, "invalid");
 		stats.lost++;
 		goto packet_done; /* shared secret is incorrect */
 	}
@@ -1081,6 +1197,9 @@ static int recv_one_packet(int wait_time)
 	fr_packet_header_print(fr_log_fp, request->reply, true);
 	if (fr_debug_lvl > 0) fr_pair_list_fprint(fr_log_fp, request->reply->vps);
 
+	result_print(request, is_radius_code(request->reply->code) ?
+		     fr_packet_codes[request->reply->code] : "unknown");
+
 	/*
 	 *	Increment counters...
 	 */
@@ -1142,196 +1261,1637 @@ fr_radius_free(&request->reply);
 	return 0;
 }
 
-int main(int argc, char **argv)
-{
-	int		c;
-	char		const *radius_dir = RADDBDIR;
-	char		const *dict_dir = DICTDIR;
-	char		filesecret[256];
-	FILE		*fp;
-	int		do_summary = false;
-	int		persec = 0;
-	int		parallel = 1;
-	rc_request_t	*this;
-	int		force_af = AF_UNSPEC;
-	fr_dict_t	*dict = NULL;
+/*
+ *	Open-loop load generation.
+ *
+ *	Packets are sent at a fixed rate (or with Poisson arrivals),
+ *	whether or not the server is keeping up.  A closed-loop
+ *	client slows down when the server does, which hides exactly
+ *	the latency we're trying to measure.
+ */
 
-	/*
-	 *	It's easier having two sets of flags to set the
-	 *	verbosity of library calls and the verbosity of
-	 *	radclient.
-	 */
-	fr_debug_lvl = 0;
-	fr_log_fp = stdout;
+/*
+ *	Latencies are recorded in microseconds, in a histogram with
+ *	unit buckets below LOAD_HIST_LINEAR, and LOAD_HIST_HALF buckets
+ *	for each power of two above that.  That keeps the error below
+ *	~6% at any latency, in a fixed amount of memory.
+ */
+#define LOAD_HIST_LINEAR	(32)
+#define LOAD_HIST_HALF		(LOAD_HIST_LINEAR / 2)
+#define LOAD_HIST_BUCKETS	(LOAD_HIST_LINEAR + (32 * LOAD_HIST_HALF))
+
+#define LOAD_MAX_THREADS	(64)
+#define USEC			(1000000)
+#define LOAD_LATE_USEC		(1000)	//!< How far behind schedule a send can be, before it's counted as late.
+
+typedef struct rc_load_hist {
+	uint64_t	count[LOAD_HIST_BUCKETS];
+	uint64_t	total;		//!< Number of values recorded.
+	uint64_t	sum;		//!< Of all values, for the mean.
+	uint64_t	min;
+	uint64_t	max;
+} rc_load_hist_t;
+
+typedef struct rc_load_stats {
+	uint64_t	sent;		//!< Packets sent.
+	uint64_t	accepted;	//!< Access-Accept, Accounting-Response, CoA-ACK, Disconnect-ACK.
+	uint64_t	rejected;	//!< Any other response.
+	uint64_t	challenged;	//!< Access-Challenge.
+	uint64_t	timeouts;	//!< No response within the timeout.
+	uint64_t	invalid;	//!< Responses which couldn't be decoded, verified, or matched.
+	uint64_t	no_id;		//!< Sends skipped because every ID on every socket was in use.
+	uint64_t	errors;		//!< Sends which failed.
+	uint64_t	late;		//!< Sends more than LOAD_LATE_USEC behind schedule.
+
+	uint64_t	conversations;	//!< EAP conversations started.
+	uint64_t	eap_failed;	//!< EAP conversations we couldn't continue.
+	uint64_t	resumed;	//!< TLS sessions which were resumed.
+	uint64_t	rounds;		//!< Round trips in finished conversations.
+
+	rc_load_hist_t	latency;	//!< Of the responses.
+	rc_load_hist_t	conversation;	//!< Of whole EAP conversations, first request to the last response.
+} rc_load_stats_t;
 
-#ifndef NDEBUG
-	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
-		fr_perror("radclient");
-		exit(EXIT_FAILURE);
-	}
-#endif
+/*
+ *	We don't include rlm_eap's headers, they need the server.
+ */
+#define LOAD_EAP_REQUEST	(1)
+#define LOAD_EAP_RESPONSE	(2)
 
-	talloc_set_log_stderr();
+#define LOAD_EAP_IDENTITY	(1)
+#define LOAD_EAP_NAK		(3)
+#define LOAD_EAP_MD5		(4)
+#define LOAD_EAP_TLS		(13)
+#define LOAD_EAP_TTLS		(21)
 
-	filename_tree = rbtree_create(NULL, filename_cmp, NULL, 0);
-	if (!filename_tree) {
-	oom:
-		ERROR("Out of memory");
-		exit(1);
-	}
+#define LOAD_EAP_TLS_LENGTH	(0x80)	//!< Length included.
+#define LOAD_EAP_TLS_MORE	(0x40)	//!< More fragments.
+#define LOAD_EAP_TLS_START	(0x20)
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:p:qr:sS:t:vx"
-#ifdef WITH_TCP
-		"P:"
+/** An EAP conversation, which lives across several round trips
+ *
+ */
+typedef struct rc_load_conv {
+	rc_request_t	*template;	//!< The conversation was started from.
+	VALUE_PAIR	*vps;		//!< Template attributes, expanded, sent in every round.
+	char const	*identity;	//!< User-Name from vps.
+
+	uint8_t		state[FR_MAX_STRING_LEN];	//!< From the last Access-Challenge.
+	size_t		state_len;
+
+	uint64_t	start;		//!< When the first request was sent.
+	uint32_t	rounds;		//!< Requests sent.
+
+#ifdef WITH_TLS
+	SSL		*ssl;
+	BIO		*from_server;	//!< TLS records from the server, for OpenSSL to read.
+	BIO		*to_server;	//!< TLS records written by OpenSSL, to send.
+
+	uint8_t		*out;		//!< TLS data which hasn't been sent yet.
+	size_t		out_len;
+	size_t		out_total;	//!< Length of the TLS message out is part of, for the L flag.
+	bool		tunnel_sent;	//!< TTLS inner attributes have been written.
 #endif
-			   )) != EOF) switch (c) {
-		case '4':
-			force_af = AF_INET;
-			break;
+} rc_load_conv_t;
 
-		case '6':
-			force_af = AF_INET6;
-			break;
+typedef struct rc_load_packet rc_load_packet_t;
 
-		case 'c':
-			if (!isdigit((int) *optarg))
-				usage();
-			resend_count = atoi(optarg);
-			break;
+/** A packet which is waiting for a response
+ *
+ */
+struct rc_load_packet {
+	RADIUS_PACKET		*packet;	//!< Has to be first, for fr_packet2myptr.
+	uint64_t		sent;		//!< When the packet was sent, in microseconds.
+	rc_load_conv_t		*conv;		//!< EAP conversation the packet is part of, or NULL.
 
-		case 'D':
-			dict_dir = optarg;
-			break;
+	rc_load_packet_t	*prev;
+	rc_load_packet_t	*next;
+};
 
-		case 'd':
-			radius_dir = optarg;
-			break;
+typedef struct rc_load_thread {
+	pthread_t		pthread_id;
+	uint32_t		id;		//!< Of this thread, 0..load_threads - 1.
 
-		case 'f':
-		{
-			char const *p;
-			rc_file_pair_t *files;
+	fr_packet_list_t	*pl;		//!< This thread's sockets, and the packets outstanding on them.
+	fr_randctx		rand;		//!< Private pool, so the threads don't share fr_rand().
 
-			files = talloc(talloc_autofree_context(), rc_file_pair_t);
-			if (!files) goto oom;
+	rc_load_packet_t	*head;		//!< Oldest packet outstanding.  As the timeout is the
+	rc_load_packet_t	*tail;		//!< same for all of them, this is also the next to expire.
 
-			p = strchr(optarg, ':');
-			if (p) {
-				files->packets = talloc_strndup(files, optarg, p - optarg);
-				if (!files->packets) goto oom;
-				files->filters = p + 1;
-			} else {
-				files->packets = optarg;
-				files->filters = NULL;
-			}
-			rbtree_insert(filename_tree, (void *) files);
-		}
-			break;
+	rc_request_t		*template;	//!< Next packet to send.
+	uint64_t		seq;		//!< Packets sent by this thread, for %{seq}.
 
-		case 'F':
-			print_filename = true;
-			break;
+#ifdef WITH_TLS
+	SSL_SESSION		*session;	//!< Last session, for resumption.
+#endif
 
-		case 'i':	/* currently broken */
-			if (!isdigit((int) *optarg))
-				usage();
-			last_used_id = atoi(optarg);
-			if ((last_used_id < 0) || (last_used_id > 255)) {
-				usage();
-			}
-			break;
+	rc_load_stats_t		stats;
+} rc_load_thread_t;
+
+static uint32_t load_rate = 0;			//!< Packets per second, 0 if load generation is disabled.
+static uint32_t load_duration = 10;		//!< How long to send for, in seconds.
+static uint32_t load_threads = 1;
+static uint32_t load_sockets = 4;		//!< Per thread.  Each gives another 256 IDs.
+static bool load_poisson = false;		//!< Exponentially distributed gaps between packets.
+
+static int load_eap = 0;			//!< EAP method to use, 0 to send the templates as-is.
+static uint32_t load_fragment = 1000;		//!< Largest TLS fragment we send.
+static bool load_resume = false;		//!< Resume TLS sessions.
+static char const *load_cert = NULL;		//!< Client certificate for EAP-TLS.
+static char const *load_key = NULL;		//!< Private key for load_cert.
+#ifdef WITH_TLS
+static SSL_CTX *load_ssl_ctx = NULL;
+#endif
 
-		case 'n':
-			persec = atoi(optarg);
-			if (persec <= 0) usage();
-			break;
+/*
+ *	fr_rand() and the packet list ID allocator use the same global
+ *	pool, which isn't thread safe.
+ */
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-			/*
-			 *	Note that sending MANY requests in
-			 *	parallel can over-run the kernel
-			 *	queues, and Linux will happily discard
-			 *	packets.  So even if the server responds,
-			 *	the client may not see the reply.
-			 */
-		case 'p':
-			parallel = atoi(optarg);
-			if (parallel <= 0) usage();
-			break;
+/** Parse the argument to -L
+ *
+ * @verbatim <rate>[,duration=<seconds>][,threads=<num>][,sockets=<num>][,arrival=constant|poisson] @endverbatim
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int load_parse(char const *spec)
+{
+	char const	*p = spec;
+	char		*end;
+	unsigned long	num;
 
-#ifdef WITH_TCP
-		case 'P':
-			proto = optarg;
-			if (strcmp(proto, "tcp") != 0) {
-				if (strcmp(proto, "udp") == 0) {
-					proto = NULL;
-				} else {
-					usage();
-				}
+	num = strtoul(p, &end, 10);
+	if ((end == p) || (num == 0) || (num > 10000000)) {
+		ERROR("Invalid rate in \"%s\"", spec);
+		return -1;
+	}
+	load_rate = num;
+	p = end;
+
+	while (*p == ',') {
+		char const	*value;
+		size_t		len;
+
+		p++;
+		value = strchr(p, '=');
+		if (!value) {
+		invalid:
+			ERROR("Invalid option \"%s\" in \"%s\"", p, spec);
+			return -1;
+		}
+		len = value - p;
+		value++;
+
+		if ((len == 3) && (strncmp(p, "eap", len) == 0)) {
+			if (strncmp(value, "md5", 3) == 0) {
+				load_eap = LOAD_EAP_MD5;
+				p = value + 3;
+			} else if (strncmp(value, "tls", 3) == 0) {
+				load_eap = LOAD_EAP_TLS;
+				p = value + 3;
+			} else if (strncmp(value, "ttls", 4) == 0) {
+				load_eap = LOAD_EAP_TTLS;
+				p = value + 4;
 			} else {
-				ipproto = IPPROTO_TCP;
+				goto invalid;
 			}
-			break;
-
-#endif
-
-		case 'q':
-			do_output = false;
-			fr_log_fp = NULL; /* no output from you, either! */
-			break;
 
-		case 'r':
-			if (!isdigit((int) *optarg)) usage();
-			retries = atoi(optarg);
-			if ((retries == 0) || (retries > 1000)) usage();
-			break;
+		} else if (((len == 4) && (strncmp(p, "cert", len) == 0)) ||
+			   ((len == 3) && (strncmp(p, "key", len) == 0))) {
+			char const *q = strchr(value, ',');
 
-		case 's':
-			do_summary = true;
-			break;
+			if (!q) q = value + strlen(value);
+			if (q == value) goto invalid;
 
-		case 'S':
-		{
-			char *p;
-			fp = fopen(optarg, "r");
-			if (!fp) {
-			       ERROR("Error opening %s: %s", optarg, fr_syserror(errno));
-			       exit(1);
+			if (len == 4) {
+				load_cert = talloc_strndup(talloc_autofree_context(), value, q - value);
+			} else {
+				load_key = talloc_strndup(talloc_autofree_context(), value, q - value);
 			}
-			if (fgets(filesecret, sizeof(filesecret), fp) == NULL) {
-			       ERROR("Error reading %s: %s", optarg, fr_syserror(errno));
-			       exit(1);
+			p = q;
+
+		} else if ((len == 6) && (strncmp(p, "resume", len) == 0)) {
+			if (strncmp(value, "yes", 3) == 0) {
+				load_resume = true;
+				p = value + 3;
+			} else if (strncmp(value, "no", 2) == 0) {
+				load_resume = false;
+				p = value + 2;
+			} else {
+				goto invalid;
 			}
-			fclose(fp);
 
-			/* truncate newline */
-			p = filesecret + strlen(filesecret) - 1;
-			while ((p >= filesecret) &&
-			      (*p < ' ')) {
-			       *p = '\0';
-			       --p;
+		} else if ((len == 7) && (strncmp(p, "arrival", len) == 0)) {
+			if (strncmp(value, "constant", 8) == 0) {
+				load_poisson = false;
+				p = value + 8;
+			} else if (strncmp(value, "poisson", 7) == 0) {
+				load_poisson = true;
+				p = value + 7;
+			} else {
+				goto invalid;
 			}
 
-			if (strlen(filesecret) < 2) {
-			       ERROR("Secret in %s is too short", optarg);
-			       exit(1);
+		} else {
+			uint32_t *out, max;
+
+			if ((len == 8) && (strncmp(p, "duration", len) == 0)) {
+				out = &load_duration;
+				max = 86400;
+			} else if ((len == 7) && (strncmp(p, "threads", len) == 0)) {
+				out = &load_threads;
+				max = LOAD_MAX_THREADS;
+			} else if ((len == 7) && (strncmp(p, "sockets", len) == 0)) {
+				out = &load_sockets;
+				max = 255;
+			} else if ((len == 8) && (strncmp(p, "fragment", len) == 0)) {
+				out = &load_fragment;
+				max = 4000;
+			} else {
+				goto invalid;
 			}
-			secret = talloc_strdup(NULL, filesecret);
+
+			num = strtoul(value, &end, 10);
+			if ((end == value) || (num == 0) || (num > max)) {
+				ERROR("Value for \"%.*s\" must be between 1 and %u", (int) len, p, max);
+				return -1;
+			}
+			*out = num;
+			p = end;
 		}
-		       break;
+	}
 
-		case 't':
-			if (!isdigit((int) *optarg))
-				usage();
-			timeout = atof(optarg);
-			break;
+	if (*p) {
+		ERROR("Unexpected text \"%s\" in \"%s\"", p, spec);
+		return -1;
+	}
 
-		case 'v':
-			fr_debug_lvl = 1;
-			DEBUG("%s", radclient_version);
-			exit(0);
+	return 0;
+}
 
-		case 'x':
-			fr_debug_lvl++;
+static uint64_t load_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((uint64_t) now.tv_sec * USEC) + now.tv_usec;
+}
+
+static uint32_t load_rand(rc_load_thread_t *t)
+{
+	uint32_t num;
+
+	num = t->rand.randrsl[t->rand.randcnt++];
+	if (t->rand.randcnt >= 256) {
+		t->rand.randcnt = 0;
+		fr_isaac(&t->rand);
+	}
+
+	return num;
+}
+
+/*
+ *	Gap until the next packet, for Poisson arrivals, as a multiple
+ *	of the mean gap.  This is -ln(u) for u in (0, 1], done by hand
+ *	so we don't need libm.
+ */
+static double load_rand_exp(rc_load_thread_t *t)
+{
+	uint64_t	x = (uint64_t) load_rand(t) + 1;	/* u = x / 2^32 */
+	int		e = 0;
+	double		z, z2, ln;
+
+	while ((x >> e) > 1) e++;
+
+	/*
+	 *	ln(x) = e * ln(2) + ln(m), m = x / 2^e in [1, 2),
+	 *	and ln(m) = 2 * atanh((m - 1) / (m + 1)).
+	 */
+	z = ((double) x - (double) ((uint64_t) 1 << e)) / ((double) x + (double) ((uint64_t) 1 << e));
+	z2 = z * z;
+	ln = 2 * z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 + z2 * (1.0 / 9 + z2 / 11)))));
+	ln += e * 0.69314718055994530942;
+
+	return (32 * 0.69314718055994530942) - ln;
+}
+
+static unsigned int load_hist_bucket(uint64_t value)
+{
+	unsigned int	shift;
+	unsigned int	bucket;
+
+	if (value < LOAD_HIST_LINEAR) return value;
+
+	for (shift = 1; (value >> shift) >= LOAD_HIST_LINEAR; shift++);
+	bucket = LOAD_HIST_LINEAR + ((shift - 1) * LOAD_HIST_HALF) + ((value >> shift) - LOAD_HIST_HALF);
+
+	return (bucket < LOAD_HIST_BUCKETS) ? bucket : LOAD_HIST_BUCKETS - 1;
+}
+
+/*
+ *	Highest value which would be recorded in a bucket.
+ */
+static uint64_t load_hist_value(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < LOAD_HIST_LINEAR) return bucket;
+
+	shift = ((bucket - LOAD_HIST_LINEAR) / LOAD_HIST_HALF) + 1;
+
+	return ((uint64_t) (((bucket - LOAD_HIST_LINEAR) % LOAD_HIST_HALF) + LOAD_HIST_HALF + 1) << shift) - 1;
+}
+
+static void load_hist_add(rc_load_hist_t *hist, uint64_t value)
+{
+	hist->count[load_hist_bucket(value)]++;
+	if (!hist->total || (value < hist->min)) hist->min = value;
+	if (value > hist->max) hist->max = value;
+	hist->total++;
+	hist->sum += value;
+}
+
+static void load_hist_merge(rc_load_hist_t *out, rc_load_hist_t const *in)
+{
+	unsigned int i;
+
+	if (!in->total) return;
+
+	for (i = 0; i < LOAD_HIST_BUCKETS; i++) out->count[i] += in->count[i];
+	if (!out->total || (in->min < out->min)) out->min = in->min;
+	if (in->max > out->max) out->max = in->max;
+	out->total += in->total;
+	out->sum += in->sum;
+}
+
+static uint64_t load_hist_percentile(rc_load_hist_t const *hist, double percentile)
+{
+	uint64_t	want, seen = 0;
+	unsigned int	i;
+
+	want = (uint64_t) ((hist->total * percentile) / 100.0);
+	if (want == 0) want = 1;
+
+	for (i = 0; i < LOAD_HIST_BUCKETS; i++) {
+		seen += hist->count[i];
+		if (seen >= want) {
+			uint64_t value = load_hist_value(i);
+
+			return (value > hist->max) ? hist->max : value;
+		}
+	}
+
+	return hist->max;
+}
+
+/*
+ *	Replace %{seq} and %{mac} in string attributes, so that
+ *	every packet can be for a different user or device.
+ */
+static void load_expand(rc_load_thread_t *t, VALUE_PAIR **vps, uint64_t seq)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		buffer[FR_MAX_STRING_LEN + 1];
+
+	for (vp = fr_pair_cursor_init(&cursor, vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		char const	*p;
+		char		*q, *end;
+		size_t		len;
+
+		if ((vp->vp_type != PW_TYPE_STRING) || !strchr(vp->vp_strvalue, '%')) continue;
+
+		q = buffer;
+		end = buffer + sizeof(buffer) - 1;
+
+		for (p = vp->vp_strvalue; *p && (q < end); p++) {
+			if (strncmp(p, "%{seq}", 6) == 0) {
+				len = snprintf(q, (end - q) + 1, "%" PRIu64, seq);
+				p += 5;
+
+			} else if (strncmp(p, "%{mac}", 6) == 0) {
+				uint32_t a = load_rand(t), b = load_rand(t);
+
+				/*
+				 *	Locally administered, unicast.
+				 */
+				len = snprintf(q, (end - q) + 1, "%02x-%02x-%02x-%02x-%02x-%02x",
+					       ((a >> 24) & 0xfc) | 0x02, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff,
+					       (b >> 8) & 0xff, b & 0xff);
+				p += 5;
+
+			} else {
+				*q++ = *p;
+				continue;
+			}
+
+			q += (len > (size_t) (end - q)) ? (size_t) (end - q) : len;
+		}
+		*q = '\0';
+
+		fr_pair_value_strcpy(vp, buffer);
+	}
+}
+
+static void load_unlink(rc_load_thread_t *t, rc_load_packet_t *lp)
+{
+	if (lp->prev) {
+		lp->prev->next = lp->next;
+	} else {
+		t->head = lp->next;
+	}
+
+	if (lp->next) {
+		lp->next->prev = lp->prev;
+	} else {
+		t->tail = lp->prev;
+	}
+}
+
+/*
+ *	Release the ID, and forget the packet.
+ */
+static void load_done(rc_load_thread_t *t, rc_load_packet_t *lp)
+{
+	fr_packet_list_id_free(t->pl, lp->packet, true);
+	load_unlink(t, lp);
+	talloc_free(lp);
+}
+
+/*
+ *	Allocate a packet for a template, the attributes are added
+ *	by the caller.
+ */
+static rc_load_packet_t *load_packet_alloc(rc_load_thread_t *t, rc_request_t const *template)
+{
+	rc_load_packet_t	*lp;
+	RADIUS_PACKET		*packet;
+	int			i;
+
+	lp = talloc_zero(NULL, rc_load_packet_t);
+	if (!lp) return NULL;
+
+	lp->packet = packet = fr_radius_alloc(lp, false);
+	if (!packet) {
+		talloc_free(lp);
+		return NULL;
+	}
+
+	packet->code = template->packet->code;
+	packet->dst_ipaddr = template->packet->dst_ipaddr;
+	packet->dst_port = template->packet->dst_port;
+	packet->src_ipaddr.af = template->packet->dst_ipaddr.af;
+	packet->id = -1;
+	for (i = 0; i < 4; i++) ((uint32_t *) packet->vector)[i] = load_rand(t);
+
+	return lp;
+}
+
+/*
+ *	Allocate an ID, and send the packet.  lp is freed on error.
+ */
+static int load_packet_send(rc_load_thread_t *t, rc_load_packet_t *lp, VALUE_PAIR *password, uint64_t now)
+{
+	bool rcode;
+
+	pthread_mutex_lock(&load_mutex);
+	rcode = fr_packet_list_id_alloc(t->pl, IPPROTO_UDP, &lp->packet, NULL);
+	if (rcode && password) password_update(lp->packet, password);
+	pthread_mutex_unlock(&load_mutex);
+
+	if (!rcode) {
+		talloc_free(lp);
+		t->stats.no_id++;
+		return -1;
+	}
+
+	if (fr_radius_send(lp->packet, NULL, secret) < 0) {
+		fr_packet_list_id_free(t->pl, lp->packet, true);
+		talloc_free(lp);
+		t->stats.errors++;
+		return -1;
+	}
+
+	lp->sent = now;
+	lp->prev = t->tail;
+	if (t->tail) {
+		t->tail->next = lp;
+	} else {
+		t->head = lp;
+	}
+	t->tail = lp;
+
+	t->stats.sent++;
+
+	return 0;
+}
+
+#ifdef WITH_TLS
+static int _load_conv_free(rc_load_conv_t *conv)
+{
+	/*
+	 *	Frees the BIOs, too.
+	 */
+	if (conv->ssl) SSL_free(conv->ssl);
+
+	return 0;
+}
+#endif
+
+/*
+ *	Send the next round of a conversation, with an EAP response
+ *	of the given type.
+ */
+static int load_eap_send(rc_load_thread_t *t, rc_load_conv_t *conv, uint8_t id, uint8_t type,
+			 uint8_t const *data, size_t data_len, uint64_t now)
+{
+	rc_load_packet_t	*lp;
+	VALUE_PAIR		*vp;
+	uint8_t			*eap;
+	size_t			len = 5 + data_len;
+
+	lp = load_packet_alloc(t, conv->template);
+	if (!lp) {
+	oom:
+		talloc_free(lp);
+		t->stats.errors++;
+		return -1;
+	}
+	lp->conv = conv;
+
+	if (conv->vps) {
+		lp->packet->vps = fr_pair_list_copy(lp->packet, conv->vps);
+		if (!lp->packet->vps) goto oom;
+	}
+
+	vp = fr_pair_afrom_num(lp->packet, 0, PW_EAP_MESSAGE);
+	if (!vp) goto oom;
+
+	eap = talloc_array(vp, uint8_t, len);
+	if (!eap) {
+		talloc_free(vp);
+		goto oom;
+	}
+	eap[0] = LOAD_EAP_RESPONSE;
+	eap[1] = id;
+	eap[2] = (len >> 8) & 0xff;
+	eap[3] = len & 0xff;
+	eap[4] = type;
+	if (data_len) memcpy(eap + 5, data, data_len);
+	fr_pair_value_memsteal(vp, eap);
+	fr_pair_add(&lp->packet->vps, vp);
+
+	if (conv->state_len) {
+		vp = fr_pair_afrom_num(lp->packet, 0, PW_STATE);
+		if (!vp) goto oom;
+		fr_pair_value_memcpy(vp, conv->state, conv->state_len);
+		fr_pair_add(&lp->packet->vps, vp);
+	}
+
+	/*
+	 *	Required with EAP-Message, the value is filled in when
+	 *	the packet is signed.
+	 */
+	vp = fr_pair_afrom_num(lp->packet, 0, PW_MESSAGE_AUTHENTICATOR);
+	if (!vp) goto oom;
+	fr_pair_value_memcpy(vp, (uint8_t const *) "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16);
+	fr_pair_add(&lp->packet->vps, vp);
+
+	conv->rounds++;
+
+	return load_packet_send(t, lp, NULL, now);
+}
+
+#ifdef WITH_TLS
+/*
+ *	Send the next fragment of whatever OpenSSL has written, or an
+ *	ACK if there's nothing left.
+ */
+static int load_tls_send(rc_load_thread_t *t, rc_load_conv_t *conv, uint8_t id, uint64_t now)
+{
+	uint8_t		buffer[5 + 4000];
+	uint8_t		*p = buffer;
+	size_t		len;
+	int		ret;
+
+	/*
+	 *	Pick up anything new, if we've sent everything we had.
+	 */
+	if (!conv->out_len) {
+		size_t pending = BIO_ctrl_pending(conv->to_server);
+
+		if (pending) {
+			talloc_free(conv->out);
+			conv->out = talloc_array(conv, uint8_t, pending);
+			if (!conv->out) return -1;
+
+			conv->out_len = BIO_read(conv->to_server, conv->out, pending);
+			conv->out_total = conv->out_len;
+		}
+	}
+
+	if (!conv->out_len) {
+		*p = 0;
+		return load_eap_send(t, conv, id, load_eap, buffer, 1, now);
+	}
+
+	len = conv->out_len;
+	if (len > load_fragment) len = load_fragment;
+
+	*p = 0;
+	if (len < conv->out_len) *p |= LOAD_EAP_TLS_MORE;
+
+	/*
+	 *	Only the first fragment of a message has the length.
+	 */
+	if ((conv->out_len == conv->out_total) && (conv->out_total > load_fragment)) {
+		*p++ |= LOAD_EAP_TLS_LENGTH;
+		*p++ = (conv->out_total >> 24) & 0xff;
+		*p++ = (conv->out_total >> 16) & 0xff;
+		*p++ = (conv->out_total >> 8) & 0xff;
+		*p++ = conv->out_total & 0xff;
+	} else {
+		p++;
+	}
+
+	memcpy(p, conv->out + (conv->out_total - conv->out_len), len);
+	p += len;
+	conv->out_len -= len;
+
+	ret = load_eap_send(t, conv, id, load_eap, buffer, p - buffer, now);
+	if (!conv->out_len) TALLOC_FREE(conv->out);
+
+	return ret;
+}
+
+/*
+ *	Write the TTLS inner attributes (RFC 5281), User-Name and a
+ *	PAP User-Password, so the server can finish the conversation.
+ */
+static int load_ttls_inner(rc_load_conv_t *conv)
+{
+	uint8_t		buffer[2 * (8 + FR_MAX_STRING_LEN + 16)];
+	uint8_t		*p = buffer;
+	char const	*value[2];
+	size_t		len[2];
+	int		i;
+
+	value[0] = conv->identity;
+	len[0] = strlen(conv->identity);
+	value[1] = conv->template->password->vp_strvalue;
+	len[1] = conv->template->password->vp_length;
+
+	for (i = 0; i < 2; i++) {
+		size_t avp_len = 8 + len[i];
+		size_t padded = len[i];
+
+		/*
+		 *	The password is padded with zeros to a
+		 *	multiple of 16.
+		 */
+		if (i == 1) padded = ((len[i] + 15) / 16) * 16;
+		if (!padded) padded = 16;
+		avp_len = 8 + padded;
+
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = 0;
+		p[3] = i + 1;		/* User-Name, User-Password */
+		p[4] = 0x40;		/* Mandatory */
+		p[5] = (avp_len >> 16) & 0xff;
+		p[6] = (avp_len >> 8) & 0xff;
+		p[7] = avp_len & 0xff;
+		memset(p + 8, 0, padded);
+		memcpy(p + 8, value[i], len[i]);
+		p += avp_len;
+
+		while ((p - buffer) & 0x03) *p++ = 0;
+	}
+
+	if (SSL_write(conv->ssl, buffer, p - buffer) <= 0) return -1;
+
+	conv->tunnel_sent = true;
+
+	return 0;
+}
+
+/*
+ *	Handle one EAP-TLS or EAP-TTLS request.
+ */
+static int load_tls_process(rc_load_thread_t *t, rc_load_conv_t *conv, uint8_t id,
+			    uint8_t const *data, size_t data_len, uint64_t now)
+{
+	uint8_t flags;
+
+	if (data_len < 1) return -1;
+
+	flags = data[0];
+	data++;
+	data_len--;
+
+	if (flags & LOAD_EAP_TLS_LENGTH) {
+		if (data_len < 4) return -1;
+		data += 4;
+		data_len -= 4;
+	}
+
+	if (!conv->ssl) {
+		if (!(flags & LOAD_EAP_TLS_START)) return -1;
+
+		conv->ssl = SSL_new(load_ssl_ctx);
+		if (!conv->ssl) return -1;
+
+		conv->from_server = BIO_new(BIO_s_mem());
+		conv->to_server = BIO_new(BIO_s_mem());
+		if (!conv->from_server || !conv->to_server) {
+			if (conv->from_server) BIO_free(conv->from_server);
+			if (conv->to_server) BIO_free(conv->to_server);
+			conv->from_server = conv->to_server = NULL;
+			return -1;
+		}
+		SSL_set_bio(conv->ssl, conv->from_server, conv->to_server);
+		SSL_set_connect_state(conv->ssl);
+
+		if (load_resume && t->session) SSL_set_session(conv->ssl, t->session);
+	}
+
+	/*
+	 *	An empty request is the server ACKing a fragment.
+	 */
+	if (!data_len && conv->out_len) return load_tls_send(t, conv, id, now);
+
+	if (data_len && (BIO_write(conv->from_server, data, data_len) != (int) data_len)) return -1;
+
+	/*
+	 *	Acknowledge the fragment, and wait for the rest.
+	 */
+	if (flags & LOAD_EAP_TLS_MORE) {
+		uint8_t ack = 0;
+
+		return load_eap_send(t, conv, id, load_eap, &ack, 1, now);
+	}
+
+	if (!SSL_is_init_finished(conv->ssl)) {
+		int ret;
+
+		ret = SSL_connect(conv->ssl);
+		if (ret <= 0) {
+			int err = SSL_get_error(conv->ssl, ret);
+
+			if ((err != SSL_ERROR_WANT_READ) && (err != SSL_ERROR_WANT_WRITE)) {
+				ERR_clear_error();
+				return -1;
+			}
+		}
+
+		if (SSL_is_init_finished(conv->ssl)) {
+			if (SSL_session_reused(conv->ssl)) {
+				t->stats.resumed++;
+
+			} else if (load_resume) {
+				if (t->session) SSL_SESSION_free(t->session);
+				t->session = SSL_get1_session(conv->ssl);
+			}
+		}
+	}
+
+	if ((load_eap == LOAD_EAP_TTLS) && SSL_is_init_finished(conv->ssl) && !conv->tunnel_sent) {
+		if (load_ttls_inner(conv) < 0) return -1;
+	}
+
+	return load_tls_send(t, conv, id, now);
+}
+#endif
+
+/*
+ *	Answer an Access-Challenge, with the next round of the conversation.
+ */
+static int load_eap_continue(rc_load_thread_t *t, rc_load_conv_t *conv, RADIUS_PACKET *reply, uint64_t now)
+{
+	VALUE_PAIR	*vp;
+	uint8_t const	*eap;
+	size_t		len;
+	uint8_t		id;
+
+	vp = fr_pair_find_by_num(reply->vps, 0, PW_STATE, TAG_ANY);
+	if (vp && (vp->vp_length <= sizeof(conv->state))) {
+		memcpy(conv->state, vp->vp_octets, vp->vp_length);
+		conv->state_len = vp->vp_length;
+	} else {
+		conv->state_len = 0;
+	}
+
+	vp = fr_pair_find_by_num(reply->vps, 0, PW_EAP_MESSAGE, TAG_ANY);
+	if (!vp || (vp->vp_length < 5)) return -1;
+
+	eap = vp->vp_octets;
+	len = (eap[2] << 8) | eap[3];
+	if ((eap[0] != LOAD_EAP_REQUEST) || (len < 5) || (len > vp->vp_length)) return -1;
+	id = eap[1];
+
+	if (eap[4] == LOAD_EAP_IDENTITY) {
+		return load_eap_send(t, conv, id, LOAD_EAP_IDENTITY,
+				     (uint8_t const *) conv->identity, strlen(conv->identity), now);
+	}
+
+	/*
+	 *	Ask for the method we want.
+	 */
+	if (eap[4] != load_eap) {
+		uint8_t type = load_eap;
+
+		if (eap[4] == LOAD_EAP_NAK) return -1;
+
+		return load_eap_send(t, conv, id, LOAD_EAP_NAK, &type, 1, now);
+	}
+
+	switch (load_eap) {
+	case LOAD_EAP_MD5:
+	{
+		FR_MD5_CTX	ctx;
+		uint8_t		response[1 + MD5_DIGEST_LENGTH];
+
+		if ((len < 6) || (len < (size_t) (6 + eap[5]))) return -1;
+
+		/*
+		 *	MD5(id + password + challenge)
+		 */
+		fr_md5_init(&ctx);
+		fr_md5_update(&ctx, &id, 1);
+		fr_md5_update(&ctx, (uint8_t const *) conv->template->password->vp_strvalue,
+			      conv->template->password->vp_length);
+		fr_md5_update(&ctx, eap + 6, eap[5]);
+		fr_md5_final(response + 1, &ctx);
+		response[0] = MD5_DIGEST_LENGTH;
+
+		return load_eap_send(t, conv, id, LOAD_EAP_MD5, response, sizeof(response), now);
+	}
+
+#ifdef WITH_TLS
+	case LOAD_EAP_TLS:
+	case LOAD_EAP_TTLS:
+		return load_tls_process(t, conv, id, eap + 5, len - 5, now);
+#endif
+
+	default:
+		return -1;
+	}
+}
+
+/*
+ *	Start a conversation, with an EAP-Response/Identity.
+ */
+static void load_eap_start(rc_load_thread_t *t, rc_request_t *template, uint64_t now)
+{
+	rc_load_conv_t	*conv;
+	VALUE_PAIR	*vp;
+
+	conv = talloc_zero(NULL, rc_load_conv_t);
+	if (!conv) {
+	error:
+		talloc_free(conv);
+		t->stats.errors++;
+		return;
+	}
+#ifdef WITH_TLS
+	talloc_set_destructor(conv, _load_conv_free);
+#endif
+	conv->template = template;
+	conv->start = now;
+
+	conv->vps = fr_pair_list_copy(conv, template->packet->vps);
+	if (!conv->vps) goto error;
+
+	load_expand(t, &conv->vps, (t->seq++ * load_threads) + t->id);
+
+	/*
+	 *	We write our own.
+	 */
+	fr_pair_delete_by_num(&conv->vps, 0, PW_EAP_MESSAGE, TAG_ANY);
+	fr_pair_delete_by_num(&conv->vps, 0, PW_STATE, TAG_ANY);
+	fr_pair_delete_by_num(&conv->vps, 0, PW_MESSAGE_AUTHENTICATOR, TAG_ANY);
+	fr_pair_delete_by_num(&conv->vps, 0, PW_USER_PASSWORD, TAG_ANY);
+
+	vp = fr_pair_find_by_num(conv->vps, 0, PW_USER_NAME, TAG_ANY);
+	if (!vp) goto error;
+	conv->identity = vp->vp_strvalue;
+
+	t->stats.conversations++;
+
+	if (load_eap_send(t, conv, 0, LOAD_EAP_IDENTITY,
+			  (uint8_t const *) conv->identity, strlen(conv->identity), now) < 0) {
+		talloc_free(conv);
+	}
+}
+
+/*
+ *	Send the next packet, or start the next conversation, without
+ *	waiting for anything.
+ */
+static void load_send(rc_load_thread_t *t, uint64_t now)
+{
+	rc_request_t		*template = t->template;
+	rc_load_packet_t	*lp;
+
+	t->template = template->next ? template->next : request_head;
+
+	if (load_eap) {
+		load_eap_start(t, template, now);
+		return;
+	}
+
+	lp = load_packet_alloc(t, template);
+	if (!lp) {
+	oom:
+		talloc_free(lp);
+		t->stats.errors++;
+		return;
+	}
+
+	lp->packet->vps = fr_pair_list_copy(lp->packet, template->packet->vps);
+	if (!lp->packet->vps) goto oom;
+
+	load_expand(t, &lp->packet->vps, (t->seq++ * load_threads) + t->id);
+
+	(void) load_packet_send(t, lp, template->password, now);
+}
+
+/*
+ *	Read one response, and record how long it took.
+ */
+static void load_recv(rc_load_thread_t *t, fd_set *set, uint64_t now)
+{
+	RADIUS_PACKET		*reply, **packet_p;
+	rc_load_packet_t	*lp;
+	rc_load_conv_t		*conv;
+
+	reply = fr_packet_list_recv(t->pl, set);
+	if (!reply) return;
+
+	/*
+	 *	See recv_one_packet().
+	 */
+	reply->dst_ipaddr = client_ipaddr;
+
+	packet_p = fr_packet_list_find_byreply(t->pl, reply);
+	if (!packet_p) {
+		t->stats.invalid++;
+		fr_radius_free(&reply);
+		return;
+	}
+	lp = fr_packet2myptr(rc_load_packet_t, packet, packet_p);
+	conv = lp->conv;
+
+	if ((fr_radius_verify(reply, lp->packet, secret) < 0) ||
+	    (fr_radius_decode(reply, lp->packet, secret) != 0)) {
+		t->stats.invalid++;
+		fr_radius_free(&reply);
+		load_done(t, lp);
+		talloc_free(conv);
+		return;
+	}
+
+	load_hist_add(&t->stats.latency, now - lp->sent);
+	load_done(t, lp);
+
+	switch (reply->code) {
+	case PW_CODE_ACCESS_ACCEPT:
+	case PW_CODE_ACCOUNTING_RESPONSE:
+	case PW_CODE_COA_ACK:
+	case PW_CODE_DISCONNECT_ACK:
+		t->stats.accepted++;
+		break;
+
+	case PW_CODE_ACCESS_CHALLENGE:
+		t->stats.challenged++;
+
+		/*
+		 *	Not finished yet.
+		 */
+		if (conv) {
+			if (load_eap_continue(t, conv, reply, now) < 0) {
+				t->stats.eap_failed++;
+				talloc_free(conv);
+			}
+			fr_radius_free(&reply);
+			return;
+		}
+		break;
+
+	default:
+		t->stats.rejected++;
+		break;
+	}
+
+	if (conv) {
+		load_hist_add(&t->stats.conversation, now - conv->start);
+		t->stats.rounds += conv->rounds;
+		talloc_free(conv);
+	}
+
+	fr_radius_free(&reply);
+}
+
+/*
+ *	Packets aren't retransmitted, as that would change the rate
+ *	we're sending at.  They just time out, along with the
+ *	conversation they're part of.
+ */
+static void load_expire(rc_load_thread_t *t, uint64_t now, uint64_t timeout_usec)
+{
+	while (t->head && ((now - t->head->sent) >= timeout_usec)) {
+		rc_load_conv_t *conv = t->head->conv;
+
+		t->stats.timeouts++;
+		load_done(t, t->head);
+		talloc_free(conv);
+	}
+}
+
+static void *load_thread(void *arg)
+{
+	rc_load_thread_t	*t = arg;
+	double			interval, next;
+	uint64_t		now, stop, wake;
+	uint64_t		timeout_usec = timeout * USEC;
+
+	/*
+	 *	Mean gap between packets sent by this thread.
+	 */
+	interval = ((double) USEC * load_threads) / load_rate;
+
+	now = load_now();
+	stop = now + ((uint64_t) load_duration * USEC);
+
+	/*
+	 *	Stagger the threads, so they don't all send at once.
+	 */
+	next = now + ((interval * t->id) / load_threads);
+
+	for (;;) {
+		fd_set		set;
+		struct timeval	tv;
+		int		max_fd, ready;
+
+		now = load_now();
+
+		while ((next <= now) && (next < stop)) {
+			if ((now - next) > LOAD_LATE_USEC) t->stats.late++;
+
+			load_send(t, now);
+
+			if (load_poisson) {
+				next += load_rand_exp(t) * interval;
+			} else {
+				next += interval;
+			}
+		}
+
+		load_expire(t, now, timeout_usec);
+
+		/*
+		 *	Finished sending, and everything has either
+		 *	been answered, or has timed out.
+		 */
+		if ((next >= stop) && !t->head) break;
+
+		wake = (next < stop) ? (uint64_t) next : UINT64_MAX;
+		if (t->head && ((t->head->sent + timeout_usec) < wake)) wake = t->head->sent + timeout_usec;
+
+		if (wake > now) {
+			tv.tv_sec = (wake - now) / USEC;
+			tv.tv_usec = (wake - now) % USEC;
+		} else {
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+		}
+
+		FD_ZERO(&set);
+		max_fd = fr_packet_list_fd_set(t->pl, &set);
+
+		ready = select(max_fd, &set, NULL, NULL, &tv);
+		if (ready <= 0) continue;
+
+		/*
+		 *	The sockets are non-blocking, so even if a
+		 *	bad packet means we skip to the next socket,
+		 *	we don't wait.
+		 */
+		now = load_now();
+		while (ready-- > 0) load_recv(t, &set, now);
+	}
+
+	return NULL;
+}
+
+static void load_hist_print(char const *name, rc_load_hist_t const *hist)
+{
+	static double const	percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+	size_t			i;
+
+	if (!hist->total) return;
+
+	printf("%s:\n"
+	       "\tMin           : %" PRIu64 "\n"
+	       "\tMean          : %" PRIu64 "\n",
+	       name, hist->min, hist->sum / hist->total);
+
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		printf("\tp%-12g : %" PRIu64 "\n", percentiles[i], load_hist_percentile(hist, percentiles[i]));
+	}
+
+	printf("\tMax           : %" PRIu64 "\n", hist->max);
+}
+
+static void load_print(rc_load_stats_t const *stats, uint64_t elapsed)
+{
+	double			seconds = (double) elapsed / USEC;
+
+	if (!do_output) return;
+
+	printf("Load summary:\n"
+	       "\tDuration      : %.3f s\n"
+	       "\tSent          : %" PRIu64 " (%.1f/s)\n"
+	       "\tAccepted      : %" PRIu64 "\n"
+	       "\tRejected      : %" PRIu64 "\n"
+	       "\tChallenged    : %" PRIu64 "\n"
+	       "\tTimed out     : %" PRIu64 "\n"
+	       "\tInvalid       : %" PRIu64 "\n"
+	       "\tNo free ID    : %" PRIu64 "\n"
+	       "\tSend errors   : %" PRIu64 "\n"
+	       "\tSent late     : %" PRIu64 "\n",
+	       seconds,
+	       stats->sent, seconds > 0 ? stats->sent / seconds : 0,
+	       stats->accepted,
+	       stats->rejected,
+	       stats->challenged,
+	       stats->timeouts,
+	       stats->invalid,
+	       stats->no_id,
+	       stats->errors,
+	       stats->late);
+
+	if (load_eap) {
+		printf("EAP summary:\n"
+		       "\tStarted       : %" PRIu64 "\n"
+		       "\tFinished      : %" PRIu64 "\n"
+		       "\tFailed        : %" PRIu64 "\n"
+		       "\tMean rounds   : %.1f\n"
+		       "\tResumed       : %" PRIu64 "\n",
+		       stats->conversations,
+		       stats->conversation.total,
+		       stats->eap_failed,
+		       stats->conversation.total ? (double) stats->rounds / stats->conversation.total : 0,
+		       stats->resumed);
+	}
+
+	load_hist_print(load_eap ? "Round trip latency (us)" : "Latency (us)", &stats->latency);
+	if (load_eap) load_hist_print("Conversation latency (us)", &stats->conversation);
+}
+
+/** Check the templates can be used for EAP, and set up OpenSSL
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int load_eap_init(void)
+{
+	rc_request_t *this;
+
+	for (this = request_head; this != NULL; this = this->next) {
+		if (this->packet->code != PW_CODE_ACCESS_REQUEST) {
+			ERROR("EAP can only be used with Access-Request packets");
+			return -1;
+		}
+
+		if (!fr_pair_find_by_num(this->packet->vps, 0, PW_USER_NAME, TAG_ANY)) {
+			ERROR("Request %" PRIu64 " in file %s has no User-Name, which is needed for the EAP identity",
+			      this->num, this->files->packets);
+			return -1;
+		}
+
+		if ((load_eap != LOAD_EAP_TLS) && !this->password) {
+			ERROR("Request %" PRIu64 " in file %s has no Cleartext-Password",
+			      this->num, this->files->packets);
+			return -1;
+		}
+	}
+
+	if (load_eap == LOAD_EAP_MD5) return 0;
+
+#ifndef WITH_TLS
+	ERROR("radclient was built without OpenSSL, only eap=md5 is available");
+	return -1;
+#else
+#  if OPENSSL_VERSION_NUMBER < 0x10100000L
+	/*
+	 *	Older versions need locking callbacks to be used from
+	 *	multiple threads, and we don't set them up.
+	 */
+	if (load_threads > 1) {
+		ERROR("OpenSSL is older than 1.1.0, eap=%s needs threads=1",
+		      (load_eap == LOAD_EAP_TLS) ? "tls" : "ttls");
+		return -1;
+	}
+
+	SSL_library_init();
+	SSL_load_error_strings();
+	load_ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+#  else
+	load_ssl_ctx = SSL_CTX_new(TLS_client_method());
+#  endif
+	if (!load_ssl_ctx) {
+		ERROR("Failed creating TLS context");
+		return -1;
+	}
+
+	/*
+	 *	We're measuring the server, not checking it's who it
+	 *	says it is.
+	 */
+	SSL_CTX_set_verify(load_ssl_ctx, SSL_VERIFY_NONE, NULL);
+
+	/*
+	 *	The EAP methods here don't define how TLS 1.3 is used.
+	 */
+#  ifdef SSL_OP_NO_TLSv1_3
+	SSL_CTX_set_options(load_ssl_ctx, SSL_OP_NO_TLSv1_3);
+#  endif
+
+	if (load_cert) {
+		if (SSL_CTX_use_certificate_chain_file(load_ssl_ctx, load_cert) != 1) {
+			ERROR("Failed reading certificate %s", load_cert);
+		error:
+			SSL_CTX_free(load_ssl_ctx);
+			load_ssl_ctx = NULL;
+			return -1;
+		}
+
+		if (SSL_CTX_use_PrivateKey_file(load_ssl_ctx, load_key ? load_key : load_cert, SSL_FILETYPE_PEM) != 1) {
+			ERROR("Failed reading private key %s", load_key ? load_key : load_cert);
+			goto error;
+		}
+
+	} else if (load_eap == LOAD_EAP_TLS) {
+		ERROR("eap=tls needs a client certificate, set with cert=<file>");
+		goto error;
+	}
+
+	return 0;
+#endif
+}
+
+/** Run the load generator, using the packets read from the input files as templates
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int load_run(void)
+{
+	rc_load_thread_t	*threads;
+	rc_load_stats_t		total;
+	rc_request_t		*template;
+	uint64_t		start;
+	uint32_t		i, j, started = 0;
+	int			ret = 0;
+
+#ifdef WITH_TCP
+	if (proto) {
+		ERROR("Load generation only supports UDP");
+		return -1;
+	}
+#endif
+
+	if (load_eap && (load_eap_init() < 0)) return -1;
+
+	threads = talloc_zero_array(NULL, rc_load_thread_t, load_threads);
+	if (!threads) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	/*
+	 *	Set everything up before starting anything, so we
+	 *	either send at the full rate, or not at all.
+	 */
+	template = request_head;
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t *t = &threads[i];
+
+		t->id = i;
+		t->template = template;
+		template = template->next ? template->next : request_head;
+
+		for (j = 0; j < 256; j++) t->rand.randrsl[j] = fr_rand();
+		fr_randinit(&t->rand, 1);
+		t->rand.randcnt = 0;
+
+		t->pl = fr_packet_list_create(1);
+		if (!t->pl) {
+			ERROR("Out of memory");
+			ret = -1;
+			goto done;
+		}
+
+		for (j = 0; j < load_sockets; j++) {
+			int fd;
+
+			fd = fr_socket(&client_ipaddr, 0);
+			if (fd < 0) {
+				ERROR("Error opening socket: %s", fr_strerror());
+				ret = -1;
+				goto done;
+			}
+
+			if ((fd >= FD_SETSIZE) || (fr_nonblock(fd) < 0)) {
+				ERROR("Too many sockets, reduce threads or sockets");
+				close(fd);
+				ret = -1;
+				goto done;
+			}
+
+			if (!fr_packet_list_socket_add(t->pl, fd, IPPROTO_UDP, &server_ipaddr, server_port, NULL)) {
+				ERROR("Can't add new socket");
+				close(fd);
+				ret = -1;
+				goto done;
+			}
+		}
+	}
+
+	start = load_now();
+	for (i = 0; i < load_threads; i++) {
+		if (pthread_create(&threads[i].pthread_id, NULL, load_thread, &threads[i]) != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(errno));
+			ret = -1;
+			break;
+		}
+		started++;
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < started; i++) {
+		rc_load_stats_t const *stats = &threads[i].stats;
+
+		pthread_join(threads[i].pthread_id, NULL);
+
+		total.sent += stats->sent;
+		total.accepted += stats->accepted;
+		total.rejected += stats->rejected;
+		total.challenged += stats->challenged;
+		total.timeouts += stats->timeouts;
+		total.invalid += stats->invalid;
+		total.no_id += stats->no_id;
+		total.errors += stats->errors;
+		total.late += stats->late;
+		total.conversations += stats->conversations;
+		total.eap_failed += stats->eap_failed;
+		total.resumed += stats->resumed;
+		total.rounds += stats->rounds;
+		load_hist_merge(&total.latency, &stats->latency);
+		load_hist_merge(&total.conversation, &stats->conversation);
+	}
+
+	if (started) load_print(&total, load_now() - start);
+
+done:
+	for (i = 0; i < load_threads; i++) {
+		if (threads[i].pl) fr_packet_list_free(threads[i].pl);
+#ifdef WITH_TLS
+		if (threads[i].session) SSL_SESSION_free(threads[i].session);
+#endif
+	}
+	talloc_free(threads);
+#ifdef WITH_TLS
+	if (load_ssl_ctx) {
+		SSL_CTX_free(load_ssl_ctx);
+		load_ssl_ctx = NULL;
+	}
+#endif
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int		c;
+	char		const *radius_dir = RADDBDIR;
+	char		const *dict_dir = DICTDIR;
+	char		filesecret[256];
+	FILE		*fp;
+	int		do_summary = false;
+	int		persec = 0;
+	int		parallel = 1;
+	rc_request_t	*this;
+	int		force_af = AF_UNSPEC;
+	fr_dict_t	*dict = NULL;
+
+	/*
+	 *	It's easier having two sets of flags to set the
+	 *	verbosity of library calls and the verbosity of
+	 *	radclient.
+	 */
+	fr_debug_lvl = 0;
+	fr_log_fp = stdout;
+
+#ifndef NDEBUG
+	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("radclient");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	filename_tree = rbtree_create(NULL, filename_cmp, NULL, 0);
+	if (!filename_tree) {
+	oom:
+		ERROR("Out of memory");
+		exit(1);
+	}
+
+	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:L:n:o:p:qr:sS:t:vw:x"
+#ifdef WITH_TCP
+		"P:"
+#endif
+			   )) != EOF) switch (c) {
+		case '4':
+			force_af = AF_INET;
+			break;
+
+		case '6':
+			force_af = AF_INET6;
+			break;
+
+		case 'c':
+			if (!isdigit((int) *optarg))
+				usage();
+			resend_count = atoi(optarg);
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'd':
+			radius_dir = optarg;
+			break;
+
+		case 'f':
+		{
+			char const *p;
+			rc_file_pair_t *files;
+
+			files = talloc(talloc_autofree_context(), rc_file_pair_t);
+			if (!files) goto oom;
+
+			p = strchr(optarg, ':');
+			if (p) {
+				files->packets = talloc_strndup(files, optarg, p - optarg);
+				if (!files->packets) goto oom;
+				files->filters = p + 1;
+			} else {
+				files->packets = optarg;
+				files->filters = NULL;
+			}
+			rbtree_insert(filename_tree, (void *) files);
+		}
+			break;
+
+		case 'F':
+			print_filename = true;
+			break;
+
+		case 'i':	/* currently broken */
+			if (!isdigit((int) *optarg))
+				usage();
+			last_used_id = atoi(optarg);
+			if ((last_used_id < 0) || (last_used_id > 255)) {
+				usage();
+			}
+			break;
+
+		case 'L':
+			if (load_parse(optarg) < 0) usage();
+			break;
+
+		case 'n':
+			persec = atoi(optarg);
+			if (persec <= 0) usage();
+			break;
+
+			/*
+			 *	Note that sending MANY requests in
+			 *	parallel can over-run the kernel
+			 *	queues, and Linux will happily discard
+			 *	packets.  So even if the server responds,
+			 *	the client may not see the reply.
+			 */
+		case 'o':
+			if (strcmp(optarg, "-") == 0) {
+				result_fp = stdout;
+				break;
+			}
+
+			result_fp = fopen(optarg, "w");
+			if (!result_fp) {
+				ERROR("Error opening %s: %s", optarg, fr_syserror(errno));
+				exit(1);
+			}
+			break;
+
+		case 'p':
+			parallel = atoi(optarg);
+			if (parallel <= 0) usage();
+			break;
+
+#ifdef WITH_TCP
+		case 'P':
+			proto = optarg;
+			if (strcmp(proto, "tcp") != 0) {
+				if (strcmp(proto, "udp") == 0) {
+					proto = NULL;
+				} else {
+					usage();
+				}
+			} else {
+				ipproto = IPPROTO_TCP;
+			}
+			break;
+
+#endif
+
+		case 'q':
+			do_output = false;
+			fr_log_fp = NULL; /* no output from you, either! */
+			break;
+
+		case 'r':
+			if (!isdigit((int) *optarg)) usage();
+			retries = atoi(optarg);
+			if ((retries == 0) || (retries > 1000)) usage();
+			break;
+
+		case 's':
+			do_summary = true;
+			break;
+
+		case 'S':
+		{
+			char *p;
+			fp = fopen(optarg, "r");
+			if (!fp) {
+			       ERROR("Error opening %s: %s", optarg, fr_syserror(errno));
+			       exit(1);
+			}
+			if (fgets(filesecret, sizeof(filesecret), fp) == NULL) {
+			       ERROR("Error reading %s: %s", optarg, fr_syserror(errno));
+			       exit(1);
+			}
+			fclose(fp);
+
+			/* truncate newline */
+			p = filesecret + strlen(filesecret) - 1;
+			while ((p >= filesecret) &&
+			      (*p < ' ')) {
+			       *p = '\0';
+			       --p;
+			}
+
+			if (strlen(filesecret) < 2) {
+			       ERROR("Secret in %s is too short", optarg);
+			       exit(1);
+			}
+			secret = talloc_strdup(NULL, filesecret);
+		}
+		       break;
+
+		case 't':
+			if (!isdigit((int) *optarg))
+				usage();
+			timeout = atof(optarg);
+			break;
+
+		case 'v':
+			fr_debug_lvl = 1;
+			DEBUG("%s", radclient_version);
+			exit(0);
+
+		case 'w':
+			window = atoi(optarg);
+			if (window <= 0) usage();
+			break;
+
+		case 'x':
+			fr_debug_lvl++;
 			break;
 
 		case 'h':
@@ -1463,6 +3023,11 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (window) {
+		dst_table = fr_hash_table_create(NULL, dst_hash, dst_cmp, NULL);
+		if (!dst_table) goto oom;
+	}
+
 	/*
 	 *	Walk over the list of packets, sanity checking
 	 *	everything.
@@ -1473,6 +3038,17 @@ int main(int argc, char **argv)
 		if (radclient_sane(this) != 0) {
 			exit(1);
 		}
+
+		if (dst_table) {
+			this->dst = dst_find(this->packet);
+			if (!this->dst) goto oom;
+		}
+	}
+
+	if (load_rate) {
+		if (load_run() < 0) exit(1);
+		do_summary = false;
+		goto finish;
 	}
 
 	/*
@@ -1529,6 +3105,17 @@ int main(int argc, char **argv)
 			}
 
 			if (n > 0) {
+				/*
+				 *	Too many packets outstanding
+				 *	to this destination.  Send it
+				 *	later.
+				 */
+				if (this->dst && !this->outstanding &&
+				    (this->dst->outstanding >= window)) {
+					done = false;
+					continue;
+				}
+
 				n--;
 
 				/*
@@ -1613,8 +3200,11 @@ int main(int argc, char **argv)
 		}
 	} while (!done);
 
+finish:
 	rbtree_free(filename_tree);
 	fr_packet_list_free(pl);
+	if (dst_table) fr_hash_table_free(dst_table);
+	if (result_fp && (result_fp != stdout)) fclose(result_fp);
 	while (request_head) TALLOC_FREE(request_head);
 	talloc_free(dict);
 	talloc_free(secret);
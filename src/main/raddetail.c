@@ -0,0 +1,209 @@
+/*
+ * raddetail.c	Convert binary detail files to text.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/detail.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static char const *progname = "raddetail";
+
+static void NEVER_RETURNS usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: %s [options] [file ...]\n", progname);
+	fprintf(output, "Print binary detail files in the text detail format.\n");
+	fprintf(output, "If no files are given, or the file is \"-\", read from stdin.\n");
+	fprintf(output, "options:\n");
+	fprintf(output, "  -d <raddb>     Set user dictionary directory (defaults to " RADDBDIR ").\n");
+	fprintf(output, "  -D <dictdir>   Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(output, "  -h             Print this help message.\n");
+	fprintf(output, "  -u             Only print entries which haven't been processed.\n");
+
+	exit(status);
+}
+
+/*
+ *	Print every record in a file.
+ */
+static int raddetail_file(FILE *fp, char const *filename, bool unprocessed)
+{
+	uint8_t		header[DETAIL_BINARY_HDR_LEN];
+	uint8_t		*attrs;
+	detail_binary_t	hdr;
+	TALLOC_CTX	*record_ctx;
+	VALUE_PAIR	*vps;
+	uint64_t	offset = 0;
+	size_t		len;
+
+	attrs = talloc_array(NULL, uint8_t, DETAIL_BINARY_MAX_LEN);
+	if (!attrs) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		return -1;
+	}
+
+	while ((len = fread(header, 1, sizeof(header), fp)) > 0) {
+		if (len < sizeof(header)) {
+		truncated:
+			fprintf(stderr, "%s: Truncated record at offset %" PRIu64 " in %s\n",
+				progname, offset, filename);
+			goto error;
+		}
+
+		if (detail_binary_header_decode(&hdr, header) < 0) {
+			fprintf(stderr, "%s: Invalid record at offset %" PRIu64 " in %s: %s\n",
+				progname, offset, filename, fr_strerror());
+			goto error;
+		}
+
+		if ((hdr.length > 0) && (fread(attrs, hdr.length, 1, fp) != 1)) goto truncated;
+
+		offset += sizeof(header) + hdr.length;
+
+		if (unprocessed && (hdr.flags & DETAIL_BINARY_FLAG_DONE)) continue;
+
+		/*
+		 *	Unknown attributes are allocated in the
+		 *	context, too, so free everything per record.
+		 */
+		record_ctx = talloc_new(NULL);
+		vps = NULL;
+
+		if (detail_binary_decode_pairs(record_ctx, &vps, attrs, hdr.length) < 0) {
+			fprintf(stderr, "%s: Failed decoding record at offset %" PRIu64 " in %s: %s\n",
+				progname, offset - (sizeof(header) + hdr.length), filename, fr_strerror());
+			talloc_free(record_ctx);
+			goto error;
+		}
+
+		if (detail_binary_fprint(stdout, &hdr, vps) < 0) {
+			fr_perror(progname);
+			talloc_free(record_ctx);
+			goto error;
+		}
+		talloc_free(record_ctx);
+	}
+
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: Failed reading %s: %s\n", progname, filename, fr_syserror(errno));
+	error:
+		talloc_free(attrs);
+		return -1;
+	}
+
+	talloc_free(attrs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int		c, i;
+	int		ret = EXIT_SUCCESS;
+	bool		unprocessed = false;
+	char const	*raddb_dir = RADDBDIR;
+	char const	*dict_dir = DICTDIR;
+	fr_dict_t	*dict = NULL;
+
+#ifndef NDEBUG
+	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror(progname);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	while ((c = getopt(argc, argv, "d:D:hu")) != EOF) switch (c) {
+		case 'd':
+			raddb_dir = optarg;
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'u':
+			unprocessed = true;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+
+		default:
+			usage(EXIT_FAILURE);
+	}
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror(progname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror(progname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fr_dict_read(dict, raddb_dir, FR_DICTIONARY_FILE) == -1) {
+		fr_perror(progname);
+		exit(EXIT_FAILURE);
+	}
+	fr_strerror();	/* Clear the error buffer */
+
+	if (argc == 0) {
+		if (raddetail_file(stdin, "stdin", unprocessed) < 0) ret = EXIT_FAILURE;
+		goto done;
+	}
+
+	for (i = 0; i < argc; i++) {
+		FILE *fp;
+
+		if (strcmp(argv[i], "-") == 0) {
+			if (raddetail_file(stdin, "stdin", unprocessed) < 0) ret = EXIT_FAILURE;
+			continue;
+		}
+
+		fp = fopen(argv[i], "r");
+		if (!fp) {
+			fprintf(stderr, "%s: Failed opening %s: %s\n", progname, argv[i], fr_syserror(errno));
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		if (raddetail_file(fp, argv[i], unprocessed) < 0) ret = EXIT_FAILURE;
+		fclose(fp);
+	}
+
+done:
+	talloc_free(dict);
+
+	return ret;
+}
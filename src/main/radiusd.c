@@ -534,6 +534,12 @@ int main(int argc, char *argv[])
 	 */
 	if (modules_bootstrap(main_config.config) < 0) exit(EXIT_FAILURE);
 
+	/*
+	 *	No more attributes will be defined, so build the
+	 *	faster lookup tables.
+	 */
+	if (fr_dict_freeze(main_config.dict) < 0) WARN("Failed freezing dictionary: %s", fr_strerror());
+
 	/*
 	 *	Call the module's initialisation methods.  These create
 	 *	connection pools and open connections to external resources.
@@ -570,6 +576,11 @@ int main(int argc, char *argv[])
 		fr_exit(EXIT_FAILURE);
 	}
 
+	if (main_config.log_async && (default_log.dst != L_DST_SYSLOG) && (fr_log_async_start() < 0)) {
+		ERROR("Failed starting log thread: %s", fr_strerror());
+		fr_exit(EXIT_FAILURE);
+	}
+
 	/*
 	 *	Initialize the threads ONLY if we're spawning, AND
 	 *	we're running normally.
@@ -745,6 +756,8 @@ int main(int argc, char *argv[])
 
 	thread_pool_stop();		/* stop all the threads */
 
+	fr_log_async_stop();		/* write any buffered log messages */
+
 	talloc_free(global_state);	/* Free state entries */
 
 cleanup:
@@ -41,17 +41,34 @@ RCSID("$Id$")
 #  include <collectd/client.h>
 #endif
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #define RS_ASSERT(_x) if (!(_x) && !fr_cond_assert(_x)) exit(1)
 
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
+static _Thread_local char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
-static fr_event_list_t *events;
+/*
+ *	With capture threads, each thread has its own event list,
+ *	and correlates the requests and responses it receives, so
+ *	there's no locking in the packet path.
+ */
+static _Thread_local rbtree_t *request_tree = NULL;
+static _Thread_local rbtree_t *link_tree = NULL;
+static _Thread_local fr_event_list_t *events;
+static _Thread_local TALLOC_CTX *packet_ctx;		//!< What we allocate packets and requests in.
 static bool cleanup;
 
+static atomic_uint_fast64_t captured;			//!< Packets processed by all threads.
+
+static rs_worker_t *workers;				//!< Capture threads, if we have any.
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Protects the global stats.
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 typedef int (*rbcmp)(void const *, void const *);
@@ -75,6 +92,14 @@ static int rs_useful_codes[] = {
 	PW_CODE_COA_NAK,			//!< RFC3575/RFC5176 - CoA-Nak (not willing to perform)
 };
 
+/** Upper bounds of the latency histogram buckets in milliseconds
+ *
+ * The last bucket counts everything else.
+ */
+static double const rs_latency_buckets[RS_LATENCY_BUCKETS - 1] = {
+	1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
 static const FR_NAME_NUMBER rs_events[] = {
 	{ "received",	RS_NORMAL	},
 	{ "norsp",	RS_LOST		},
@@ -86,6 +111,7 @@ static const FR_NAME_NUMBER rs_events[] = {
 };
 
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -577,6 +603,24 @@ static void rs_stats_process_counters(rs_latency_t *stats)
 	}
 }
 
+/** Add the interval counters to the totals
+ *
+ */
+static void rs_stats_process_totals(rs_latency_t *stats)
+{
+	int i;
+
+	stats->total.received += stats->interval.received_total;
+	stats->total.linked += stats->interval.linked_total;
+	stats->total.unlinked += stats->interval.unlinked_total;
+	stats->total.reused += stats->interval.reused_total;
+	stats->total.lost += stats->interval.lost_total;
+	stats->total.latency_total += stats->interval.latency_total;
+
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) stats->total.rt[i] += stats->interval.rt_total[i];
+	for (i = 0; i < RS_LATENCY_BUCKETS; i++) stats->total.latency_buckets[i] += stats->interval.latency_buckets[i];
+}
+
 static void rs_stats_print_code_fancy(rs_latency_t *stats, PW_CODE code)
 {
 	int i;
@@ -783,6 +827,99 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
+/** Write all the counters to a file in OpenMetrics text format
+ *
+ * The file is replaced atomically, so it can be read by a collector (such as node_exporter's
+ * textfile collector) at any time.
+ */
+static void rs_stats_print_openmetrics(UNUSED rs_update_t *this, rs_stats_t *stats, UNUSED struct timeval *now)
+{
+	char		path[PATH_MAX];
+	FILE		*fp;
+	size_t		i;
+	int		j;
+	size_t		rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
+
+	static struct {
+		char const	*name;
+		char const	*help;
+		size_t		offset;
+	} const counters[] = {
+		{ "received", "Packets received.", offsetof(rs_latency_t, total.received) },
+		{ "linked", "Packets linked to a request or response.", offsetof(rs_latency_t, total.linked) },
+		{ "unlinked", "Responses without a request.", offsetof(rs_latency_t, total.unlinked) },
+		{ "reused", "Packets which reused an ID too soon.", offsetof(rs_latency_t, total.reused) },
+		{ "lost", "Requests which never received a response.", offsetof(rs_latency_t, total.lost) },
+		{ NULL, NULL, 0 }
+	};
+
+	snprintf(path, sizeof(path), "%s.tmp", conf->stats.metrics_file);
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		ERROR("Failed opening %s: %s", path, fr_syserror(errno));
+		return;
+	}
+
+	for (j = 0; counters[j].name; j++) {
+		fprintf(fp, "# TYPE radsniff_%s counter\n# HELP radsniff_%s %s\n",
+			counters[j].name, counters[j].name, counters[j].help);
+
+		for (i = 0; i < rs_codes_len; i++) {
+			rs_latency_t const *latency = &stats->exchange[rs_useful_codes[i]];
+
+			fprintf(fp, "radsniff_%s_total{code=\"%s\"} %" PRIu64 "\n", counters[j].name,
+				fr_packet_codes[rs_useful_codes[i]],
+				*(uint64_t const *) (((uint8_t const *) latency) + counters[j].offset));
+		}
+	}
+
+	fprintf(fp, "# TYPE radsniff_retransmits counter\n"
+		"# HELP radsniff_retransmits Requests which completed after this many retransmissions.\n");
+	for (i = 0; i < rs_codes_len; i++) {
+		rs_latency_t const *latency = &stats->exchange[rs_useful_codes[i]];
+
+		for (j = 0; j <= RS_RETRANSMIT_MAX; j++) {
+			fprintf(fp, "radsniff_retransmits_total{code=\"%s\",retransmits=\"%i%s\"} %" PRIu64 "\n",
+				fr_packet_codes[rs_useful_codes[i]], j, (j == RS_RETRANSMIT_MAX) ? "+" : "",
+				latency->total.rt[j]);
+		}
+	}
+
+	fprintf(fp, "# TYPE radsniff_latency_seconds histogram\n"
+		"# HELP radsniff_latency_seconds Time between a request and its response.\n");
+	for (i = 0; i < rs_codes_len; i++) {
+		rs_latency_t const	*latency = &stats->exchange[rs_useful_codes[i]];
+		char const		*name = fr_packet_codes[rs_useful_codes[i]];
+		uint64_t		count = 0;
+
+		for (j = 0; j < (RS_LATENCY_BUCKETS - 1); j++) {
+			count += latency->total.latency_buckets[j];
+			fprintf(fp, "radsniff_latency_seconds_bucket{code=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+				name, rs_latency_buckets[j] / 1000, count);
+		}
+		count += latency->total.latency_buckets[j];
+
+		fprintf(fp, "radsniff_latency_seconds_bucket{code=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", name, count);
+		fprintf(fp, "radsniff_latency_seconds_count{code=\"%s\"} %" PRIu64 "\n", name, count);
+		fprintf(fp, "radsniff_latency_seconds_sum{code=\"%s\"} %.6Lf\n", name,
+			latency->total.latency_total / 1000);
+	}
+
+	fprintf(fp, "# EOF\n");
+
+	if (fclose(fp) != 0) {
+		ERROR("Failed writing %s: %s", path, fr_syserror(errno));
+		unlink(path);
+		return;
+	}
+
+	if (rename(path, conf->stats.metrics_file) < 0) {
+		ERROR("Failed renaming %s to %s: %s", path, conf->stats.metrics_file, fr_syserror(errno));
+		unlink(path);
+	}
+}
+
 /** Process stats for a single interval
  *
  */
@@ -794,6 +931,11 @@ static void rs_stats_process(struct timeval *now, void *ctx)
 	rs_update_t	*this = ctx;
 	rs_stats_t	*stats = this->stats;
 
+	/*
+	 *	Capture threads merge their interval stats into these.
+	 */
+	pthread_mutex_lock(&stats_mutex);
+
 	if (!this->done_header) {
 		if (this->head) this->head(this);
 		this->done_header = true;
@@ -801,6 +943,11 @@ static void rs_stats_process(struct timeval *now, void *ctx)
 
 	stats->intervals++;
 
+	/*
+	 *	Totals are counted even if the interval stats are muted.
+	 */
+	for (i = 0; i < rs_codes_len; i++) rs_stats_process_totals(&stats->exchange[rs_useful_codes[i]]);
+
 	for (in_p = this->in;
 	     in_p;
 	     in_p = in_p->next) {
@@ -844,11 +991,13 @@ clear:
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
 	}
 
+	pthread_mutex_unlock(&stats_mutex);
+
 	{
 		static fr_event_timer_t *event;
 
 		now->tv_sec += conf->stats.interval;
-		now->tv_usec = 0;
+		now->tv_usec = workers ? RS_STATS_MERGE_DELAY : 0;
 
 		if (fr_event_timer_insert(this->list, rs_stats_process, ctx, now, &event) < 0) {
 			ERROR("Failed inserting stats interval event");
@@ -862,7 +1011,8 @@ clear:
  */
 static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency)
 {
-	double lint;
+	double	lint;
+	int	i;
 
 	stats->interval.linked_total++;
 	/* More useful is this in milliseconds */
@@ -875,6 +1025,11 @@ static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency
 	}
 	stats->interval.latency_total += lint;
 
+	for (i = 0; i < (RS_LATENCY_BUCKETS - 1); i++) {
+		if (lint <= rs_latency_buckets[i]) break;
+	}
+	stats->interval.latency_buckets[i]++;
+
 }
 
 static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
@@ -901,6 +1056,11 @@ static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
 		update.body = rs_stats_print_csv;
 		break;
 
+	case RS_STATS_OUT_OPENMETRICS:
+		update.head = NULL;
+		update.body = rs_stats_print_openmetrics;
+		break;
+
 #ifdef HAVE_COLLECTDC_H
 	case RS_STATS_OUT_COLLECTD:
 		update.head = NULL;
@@ -912,7 +1072,7 @@ static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
 	 *	Set the first time we print stats
 	 */
 	now->tv_sec += conf->stats.interval;
-	now->tv_usec = 0;
+	now->tv_usec = workers ? RS_STATS_MERGE_DELAY : 0;
 
 	if (live) {
 		INFO("Muting stats for the next %i milliseconds (warmup)", conf->stats.timeout);
@@ -927,6 +1087,74 @@ static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
 	return 0;
 }
 
+/** Add the interval stats of a capture thread to the global stats
+ *
+ */
+static void rs_stats_merge_latency(rs_latency_t *out, rs_latency_t const *in)
+{
+	int i;
+
+	out->interval.received_total += in->interval.received_total;
+	out->interval.linked_total += in->interval.linked_total;
+	out->interval.unlinked_total += in->interval.unlinked_total;
+	out->interval.reused_total += in->interval.reused_total;
+	out->interval.lost_total += in->interval.lost_total;
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) out->interval.rt_total[i] += in->interval.rt_total[i];
+	for (i = 0; i < RS_LATENCY_BUCKETS; i++) out->interval.latency_buckets[i] += in->interval.latency_buckets[i];
+
+	out->interval.latency_total += in->interval.latency_total;
+	if (in->interval.latency_high > out->interval.latency_high) {
+		out->interval.latency_high = in->interval.latency_high;
+	}
+	if (in->interval.latency_low &&
+	    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+		out->interval.latency_low = in->interval.latency_low;
+	}
+}
+
+/** Merge the stats of a capture thread into the global stats at the end of each interval
+ *
+ * The main thread processes and prints the global stats #RS_STATS_MERGE_DELAY microseconds later.
+ */
+static void rs_worker_stats_merge(struct timeval *now, void *ctx)
+{
+	size_t		i;
+	size_t		rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
+	fr_pcap_t	*in_p;
+	rs_worker_t	*worker = ctx;
+	rs_stats_t	*stats = worker->stats;
+	struct timeval	quiet = stats->quiet;
+
+	for (in_p = worker->in;
+	     in_p;
+	     in_p = in_p->next) {
+		if (rs_check_pcap_drop(in_p) < 0) {
+			ERROR("Thread %i muting stats for the next %i milliseconds", worker->id, conf->stats.timeout);
+			rs_tv_add_ms(now, conf->stats.timeout, &quiet);
+		}
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	for (i = 0; i < rs_codes_len; i++) {
+		rs_stats_merge_latency(&worker->total->exchange[rs_useful_codes[i]],
+				       &stats->exchange[rs_useful_codes[i]]);
+	}
+	if (timercmp(&quiet, &worker->total->quiet, >)) worker->total->quiet = quiet;
+	pthread_mutex_unlock(&stats_mutex);
+
+	for (i = 0; i < rs_codes_len; i++) {
+		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
+		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
+	}
+
+	now->tv_sec += conf->stats.interval;
+	now->tv_usec = 0;
+
+	if (fr_event_timer_insert(worker->list, rs_worker_stats_merge, worker, now, &worker->merge_ev) < 0) {
+		ERROR("Thread %i failed inserting stats merge event", worker->id);
+	}
+}
+
 /** Copy a subset of attributes from one list into the other
  *
  * Should be O(n) if all the attributes exist.  List must be pre-sorted.
@@ -1192,7 +1420,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
+	uint64_t		total;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*current;		/* Current packet were processing */
@@ -1297,7 +1525,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	current = fr_radius_alloc(conf, false);
+	current = fr_radius_alloc(packet_ctx, false);
 	if (!current) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1613,7 +1841,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(packet_ctx, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
@@ -1749,19 +1977,31 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_radius_free(&current);
 	}
 
-	captured++;
+	total = atomic_fetch_add_explicit(&captured, 1, memory_order_relaxed) + 1;
 	/*
 	 *	We've hit our capture limit, break out of the event loop
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
+	if ((conf->limit > 0) && (total >= conf->limit)) {
+		/*
+		 *	Only the main thread handles signals, it'll
+		 *	stop the other capture threads too.
+		 */
+		if (workers) {
+			if (total == conf->limit) {
+				INFO("Captured %" PRIu64 " packets, exiting...", total);
+				rs_signal_self(SIGTERM);
+			}
+			return;
+		}
+
+		INFO("Captured %" PRIu64 " packets, exiting...", total);
 		fr_event_loop_exit(events, 1);
 	}
 }
 
 static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 {
-	static uint64_t	count = 0;	/* Packets seen */
+	static _Thread_local uint64_t count = 0;	/* Packets seen */
 	rs_event_t	*event = ctx;
 	pcap_t		*handle = event->in->handle;
 
@@ -2084,6 +2324,241 @@ fr_event_list_t *list, int fd, UNUSED void *ctx)
 	}
 }
 
+/** Tell a capture thread's event loop to exit
+ *
+ */
+static void rs_worker_exit(fr_event_list_t *el, int fd, UNUSED void *ctx)
+{
+	char c;
+
+	if (read(fd, &c, sizeof(c)) < 0) {
+		ERROR("Failed reading from thread pipe: %s", fr_syserror(errno));
+	}
+
+	fr_event_loop_exit(el, 1);
+}
+
+/** Capture thread
+ *
+ */
+static void *rs_worker_thread(void *arg)
+{
+	rs_worker_t *worker = arg;
+
+	events = worker->list;
+	request_tree = worker->request_tree;
+	link_tree = worker->link_tree;
+	packet_ctx = worker->ctx;
+
+	DEBUG2("Thread %i entering event loop", worker->id);
+
+	fr_event_loop(events);
+
+	DEBUG2("Thread %i done sniffing", worker->id);
+
+	/*
+	 *	Requests remove themselves from the trees and the
+	 *	event list as they're freed, so this has to be done
+	 *	with our thread local variables.
+	 */
+	talloc_free(worker->ctx);
+	worker->ctx = NULL;
+
+	return NULL;
+}
+
+/** Stop all the capture threads
+ *
+ */
+static void rs_workers_stop(void)
+{
+	int i;
+
+	if (!workers) return;
+
+	cleanup = true;
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		if (!worker->running) continue;
+
+		if (write(worker->pipe[1], "x", 1) < 0) {
+			ERROR("Failed signalling thread %i: %s", worker->id, fr_syserror(errno));
+			continue;
+		}
+		pthread_join(worker->pthread_id, NULL);
+		worker->running = false;
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		if (worker->pipe[0] >= 0) close(worker->pipe[0]);
+		if (worker->pipe[1] >= 0) close(worker->pipe[1]);
+		talloc_free(worker->ctx);
+	}
+}
+
+/** Start the capture threads
+ *
+ * The first thread takes over the capture handles we already opened.  The other threads open
+ * their own handles on the same interfaces, which join the same fanout groups, so the kernel
+ * spreads the packets over all the threads by flow hash.
+ *
+ * @param[in] stats	The global stats, which the threads merge their interval stats into.
+ * @param[in] in	Capture handles opened by the main thread.
+ * @param[in] now	The current time.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rs_workers_start(rs_stats_t *stats, fr_pcap_t *in, struct timeval const *now)
+{
+	int		i;
+	fr_pcap_t	*in_p;
+
+	workers = talloc_zero_array(conf, rs_worker_t, conf->threads);
+	if (!workers) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		workers[i].pipe[0] = workers[i].pipe[1] = -1;
+	}
+
+	/*
+	 *	Setup everything first, so that we don't have to
+	 *	stop threads if something goes wrong.
+	 */
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_t	*worker = &workers[i];
+		fr_pcap_t	**last = &worker->in;
+
+		worker->id = i;
+		worker->total = stats;
+
+		/*
+		 *	Not parented by conf, as the main thread
+		 *	carries on allocating from it.
+		 */
+		worker->ctx = talloc_new(NULL);
+		if (!worker->ctx) {
+			ERROR("Out of memory");
+			return -1;
+		}
+
+		worker->stats = talloc_zero(worker->ctx, rs_stats_t);
+		if (!worker->stats) {
+			ERROR("Out of memory");
+			return -1;
+		}
+
+		worker->list = fr_event_list_create(worker->ctx, _rs_event_status, NULL);
+		if (!worker->list) {
+			ERROR("Failed creating event list for thread %i", i);
+			return -1;
+		}
+
+		worker->request_tree = rbtree_create(worker->ctx, (rbcmp) rs_packet_cmp, _unmark_request, 0);
+		if (!worker->request_tree) {
+			ERROR("Failed creating request tree for thread %i", i);
+			return -1;
+		}
+
+		if (conf->link_da_num) {
+			worker->link_tree = rbtree_create(worker->ctx, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
+			if (!worker->link_tree) {
+				ERROR("Failed creating RTX tree for thread %i", i);
+				return -1;
+			}
+		}
+
+		if (pipe(worker->pipe) < 0) {
+			ERROR("Couldn't open pipe for thread %i: %s", i, fr_syserror(errno));
+			return -1;
+		}
+
+		if (fr_event_fd_insert(worker->list, worker->pipe[0], rs_worker_exit, NULL, NULL, worker) < 0) {
+			ERROR("Failed inserting thread pipe descriptor: %s", fr_strerror());
+			return -1;
+		}
+
+		for (in_p = in;
+		     in_p;
+		     in_p = in_p->next) {
+			fr_pcap_t	*handle = in_p;
+			rs_event_t	*event;
+
+			if (i > 0) {
+				handle = fr_pcap_init(conf, in_p->name, PCAP_INTERFACE_IN);
+				if (!handle) {
+					ERROR("Failed allocating pcap handle (%s): %s", in_p->name, fr_strerror());
+					return -1;
+				}
+				handle->promiscuous = in_p->promiscuous;
+				handle->buffer_pkts = in_p->buffer_pkts;
+				handle->fanout = in_p->fanout;
+				handle->fanout_id = in_p->fanout_id;
+
+				if (fr_pcap_open(handle) < 0) {
+					ERROR("Failed opening pcap handle (%s): %s", handle->name, fr_strerror());
+					return -1;
+				}
+
+				if (conf->pcap_filter && (fr_pcap_apply_filter(handle, conf->pcap_filter) < 0)) {
+					ERROR("Failed applying filter");
+					return -1;
+				}
+			}
+
+			*last = handle;
+			last = &handle->next;
+
+			event = talloc_zero(worker->ctx, rs_event_t);
+			if (!event) {
+				ERROR("Out of memory");
+				return -1;
+			}
+			event->list = worker->list;
+			event->in = handle;
+			event->stats = worker->stats;
+
+			if (fr_event_fd_insert(worker->list, handle->fd, rs_got_packet, NULL, NULL, event) < 0) {
+				ERROR("Failed inserting file descriptor");
+				return -1;
+			}
+		}
+		*last = NULL;
+
+		if (conf->stats.interval) {
+			struct timeval when = *now;
+
+			when.tv_sec += conf->stats.interval;
+			when.tv_usec = 0;
+
+			if (fr_event_timer_insert(worker->list, rs_worker_stats_merge, worker, &when,
+						  &worker->merge_ev) < 0) {
+				ERROR("Failed inserting stats merge event for thread %i", i);
+				return -1;
+			}
+		}
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		if (pthread_create(&worker->pthread_id, NULL, rs_worker_thread, worker) != 0) {
+			ERROR("Failed creating thread %i: %s", i, fr_syserror(errno));
+			return -1;
+		}
+		worker->running = true;
+	}
+
+	return 0;
+}
+
 static void NEVER_RETURNS usage(int status)
 {
 	FILE *output = status ? stderr : stdout;
@@ -2106,6 +2581,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from <file>\n");
+	fprintf(output, "  -j <threads>          Capture using this many threads (Linux only).\n");
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
@@ -2122,6 +2598,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "stats options:\n");
 	fprintf(output, "  -W <interval>         Periodically write out statistics every <interval> seconds.\n");
 	fprintf(output, "  -E                    Print stats in CSV format.\n");
+	fprintf(output, "  -M <file>             Write stats to <file> in OpenMetrics format.\n");
 	fprintf(output, "  -T <timeout>          How many milliseconds before the request is counted as lost "
 		"(defaults to %i).\n", RS_DEFAULT_TIMEOUT);
 #ifdef HAVE_COLLECTDC_H
@@ -2170,6 +2647,7 @@ int main(int argc, char *argv[])
 	RS_ASSERT(conf);
 
 	stats = talloc_zero(conf, rs_stats_t);
+	packet_ctx = conf;
 
 	/*
 	 *  We don't really want probes taking down machines
@@ -2200,7 +2678,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((opt = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
+	while ((opt = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:j:l:L:mM:p:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
 		switch (opt) {
 		case 'a':
 		{
@@ -2292,6 +2770,15 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->threads = atoi(optarg);
+			if ((conf->threads < 1) || (conf->threads > RS_MAX_THREADS)) {
+				ERROR("Invalid number of threads \"%s\", must be between 1 and %i",
+				      optarg, RS_MAX_THREADS);
+				usage(1);
+			}
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2304,6 +2791,11 @@ int main(int argc, char *argv[])
 			conf->promiscuous = false;
 			break;
 
+		case 'M':
+			conf->stats.out = RS_STATS_OUT_OPENMETRICS;
+			conf->stats.metrics_file = optarg;
+			break;
+
 		case 'p':
 			port = atoi(optarg);
 			break;
@@ -2426,7 +2918,8 @@ int main(int argc, char *argv[])
 	}
 
 	/* Can't set stats export mode if we're not writing stats */
-	if ((conf->stats.out == RS_STATS_OUT_STDIO_CSV) && !conf->stats.interval) {
+	if (((conf->stats.out == RS_STATS_OUT_STDIO_CSV) || (conf->stats.out == RS_STATS_OUT_OPENMETRICS)) &&
+	    !conf->stats.interval) {
 		usage(64);
 	}
 
@@ -2578,7 +3071,7 @@ int main(int argc, char *argv[])
 	 *	attributes.
 	 */
 	if (conf->list_da_num || conf->link_da_num || conf->filter_response_vps || conf->filter_request_vps ||
-	    conf->print_packet) {
+	    RDEBUG_ENABLED()) {
 		conf->decode_attrs = true;
 	}
 
@@ -2702,18 +3195,42 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	/*
+	 *	Capture threads each correlate their own packets, and
+	 *	there's no way of sharing a pcap output file between
+	 *	them.
+	 */
+	if (conf->threads > 1) {
+		if (!conf->from_dev) {
+			ERROR("Capture threads (-j) can only be used with live capture");
+			ret = 64;
+			goto finish;
+		}
+
+		if (out) {
+			ERROR("Capture threads (-j) can't be used when writing PCAP data");
+			ret = 64;
+			goto finish;
+		}
+	}
+
 	/*
 	 *	This actually opens the capture interfaces/files (we just allocated the memory earlier)
 	 */
 	{
 		fr_pcap_t *tmp;
 		fr_pcap_t **tmp_p = &tmp;
+		uint16_t fanout_id = getpid() & 0xffff;
 
 		for (in_p = in;
 		     in_p;
 		     in_p = in_p->next) {
 			in_p->promiscuous = conf->promiscuous;
 			in_p->buffer_pkts = conf->buffer_pkts;
+			if (conf->threads > 1) {
+				in_p->fanout = true;
+				in_p->fanout_id = fanout_id++;
+			}
 			if (fr_pcap_open(in_p) < 0) {
 				ERROR("Failed opening pcap handle (%s): %s", in_p->name, fr_strerror());
 				if (conf->from_auto || (in_p->type == PCAP_FILE_IN)) {
@@ -2808,10 +3325,11 @@ int main(int argc, char *argv[])
 		}
 
 		/*
-		 *  Now add fd's for each of the pcap sessions we opened
+		 *  Now add fd's for each of the pcap sessions we opened,
+		 *  unless the capture threads are reading from them.
 		 */
 		for (in_p = in;
-		     in_p;
+		     in_p && (conf->threads <= 1);
 		     in_p = in_p->next) {
 			rs_event_t *event;
 
@@ -2835,7 +3353,7 @@ int main(int argc, char *argv[])
 		 */
 		if (conf->stats.interval && conf->from_dev) {
 			gettimeofday(&now, NULL);
-			rs_install_stats_processor(stats, events, in, &now, false);
+			rs_install_stats_processor(stats, events, (conf->threads > 1) ? NULL : in, &now, false);
 		}
 	}
 
@@ -2847,6 +3365,19 @@ int main(int argc, char *argv[])
 		rs_daemonize(conf->pidfile);
 	}
 
+	/*
+	 *	Threads have to be started after we fork.
+	 */
+	if (conf->threads > 1) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		start_pcap = now;
+
+		if (rs_workers_start(stats, in, &now) < 0) goto finish;
+		DEBUG("Started %i capture threads", conf->threads);
+	}
+
 	/*
 	 *	Setup signal handlers so we always exit gracefully, ensuring output buffers are always
 	 *	flushed.
@@ -2864,6 +3395,7 @@ int main(int argc, char *argv[])
 	DEBUG2("Done sniffing");
 
 finish:
+	rs_workers_stop();
 	cleanup = true;
 
 	/*
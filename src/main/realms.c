@@ -1206,6 +1206,23 @@ static int server_pool_add(realm_config_t *rc,
 	/*
 	 *	Count the home servers and initalize them.
 	 */
+	cp = cf_pair_find(cs, "transparent");
+	if (cp) {
+		value = cf_pair_value(cp);
+		if (!value || ((strcmp(value, "yes") != 0) && (strcmp(value, "no") != 0))) {
+			cf_log_err_cp(cp, "'transparent' must be 'yes' or 'no'");
+			goto error;
+		}
+		pool->transparent = (strcmp(value, "yes") == 0);
+
+		if (pool->transparent && pool->virtual_server) {
+			cf_log_err_cp(cp, "'transparent' pools cannot have a 'virtual_server'");
+			goto error;
+		}
+
+		if (do_print) cf_log_info(cs, "\ttransparent = %s", value);
+	}
+
 	num_home_servers = 0;
 	for (cp = cf_pair_find(cs, "home_server");
 	     cp != NULL;
@@ -1270,6 +1287,7 @@ static int server_pool_add(realm_config_t *rc,
 			{ "client-balance", HOME_POOL_CLIENT_BALANCE },
 			{ "client-port-balance", HOME_POOL_CLIENT_PORT_BALANCE },
 			{ "keyed-balance", HOME_POOL_KEYED_BALANCE },
+			{ "latency-balance", HOME_POOL_LATENCY_BALANCE },
 			{ NULL, 0 }
 		};
 
@@ -2418,6 +2436,89 @@ void home_server_update_request(home_server_t *home, REQUEST *request)
 	request->proxy->home_server = home;
 }
 
+/** Update the response time and concurrency limit of a home server
+ *
+ *  The response time is smoothed in the same way as TCP's SRTT
+ *  (RFC 6298).  A response which arrives within twice the smoothed
+ *  response time raises the concurrency limit by one, a slower one
+ *  cuts it by a quarter.
+ *
+ * @param[in] home which responded.
+ * @param[in] sent when the request was sent.  Callers should not
+ *	pass retransmitted requests, as we can't tell which copy
+ *	the response is for.
+ * @param[in] received when the response was received.
+ */
+void home_server_rtt_update(home_server_t *home, struct timeval const *sent, struct timeval const *received)
+{
+	struct timeval	diff;
+	int64_t		sample;
+
+	fr_timeval_subtract(&diff, received, sent);
+	if (diff.tv_sec < 0) return;
+
+	sample = ((int64_t) diff.tv_sec * 1000000) + diff.tv_usec;
+	if (sample > (UINT32_MAX >> HOME_RTT_SHIFT)) sample = UINT32_MAX >> HOME_RTT_SHIFT;
+
+	if (!home->concurrency) home->concurrency = HOME_CONCURRENCY_MIN;
+
+	if (!home->rtt) {
+		home->rtt = sample << HOME_RTT_SHIFT;
+		return;
+	}
+
+	if (sample > ((home->rtt >> HOME_RTT_SHIFT) * 2)) {
+		home_server_rtt_timeout(home);
+	} else if (home->concurrency < home->max_outstanding) {
+		home->concurrency++;
+	}
+
+	home->rtt += sample - (home->rtt >> HOME_RTT_SHIFT);
+}
+
+/** Cut the concurrency limit of a home server which didn't respond
+ *
+ * @param[in] home which timed out.
+ */
+void home_server_rtt_timeout(home_server_t *home)
+{
+	home->concurrency -= home->concurrency / 4;
+	if (home->concurrency < HOME_CONCURRENCY_MIN) home->concurrency = HOME_CONCURRENCY_MIN;
+}
+
+/** Compare two home servers for latency-balance pools
+ *
+ *  Servers which are under their concurrency limit are preferred.
+ *  After that, we prefer the lowest expected wait, which is the
+ *  response time multiplied by the number of outstanding requests.
+ *  If we don't know the response time of a server, we only compare
+ *  the number of outstanding requests.
+ *
+ * @return
+ *	- < 0 if a is better.
+ *	- 0 if they're equivalent.
+ *	- > 0 if b is better.
+ */
+static int home_server_latency_cmp(home_server_t const *a, home_server_t const *b)
+{
+	bool		a_over, b_over;
+	uint64_t	a_cost, b_cost;
+
+	a_over = a->concurrency && (a->currently_outstanding >= a->concurrency);
+	b_over = b->concurrency && (b->currently_outstanding >= b->concurrency);
+	if (a_over != b_over) return a_over - b_over;
+
+	a_cost = a->currently_outstanding + 1;
+	b_cost = b->currently_outstanding + 1;
+
+	if (a->rtt && b->rtt) {
+		a_cost *= a->rtt;
+		b_cost *= b->rtt;
+	}
+
+	return (a_cost > b_cost) - (a_cost < b_cost);
+}
+
 home_server_t *home_server_ldb(char const *realmname,
 			     home_pool_t *pool, REQUEST *request)
 {
@@ -2425,6 +2526,8 @@ home_server_t *home_server_ldb(char const *realmname,
 	int		count;
 	home_server_t	*found = NULL;
 	home_server_t	*zombie = NULL;
+	home_server_t	*other = NULL;
+	int		num_live = 0;
 	VALUE_PAIR	*vp;
 	uint32_t	hash;
 
@@ -2491,6 +2594,7 @@ home_server_t *home_server_ldb(char const *realmname,
 		/* FALL-THROUGH */
 
 	case HOME_POOL_LOAD_BALANCE:
+	case HOME_POOL_LATENCY_BALANCE:
 	case HOME_POOL_FAIL_OVER:
 		start = 0;
 		break;
@@ -2577,6 +2681,29 @@ home_server_t *home_server_ldb(char const *realmname,
 			continue;
 		}
 
+		/*
+		 *	Pick two live servers at random, and choose
+		 *	between them once we've looked at them all.
+		 */
+		if (pool->type == HOME_POOL_LATENCY_BALANCE) {
+			uint32_t r;
+
+			num_live++;
+			if (num_live == 1) {
+				found = home;
+			} else if (num_live == 2) {
+				other = home;
+			} else {
+				r = fr_rand() % num_live;
+				if (r == 0) {
+					found = home;
+				} else if (r == 1) {
+					other = home;
+				}
+			}
+			continue;
+		}
+
 		/*
 		 *	We've found the first "live" one.  Use that.
 		 */
@@ -2628,6 +2755,16 @@ home_server_t *home_server_ldb(char const *realmname,
 		}
 	} /* loop over the home servers */
 
+	if (found && other) {
+		RDEBUG3("PROXY %s %d/%d %uus\t%s %d/%d %uus",
+			found->log_name, found->currently_outstanding, found->concurrency,
+			found->rtt >> HOME_RTT_SHIFT,
+			other->log_name, other->currently_outstanding, other->concurrency,
+			other->rtt >> HOME_RTT_SHIFT);
+
+		if (home_server_latency_cmp(other, found) < 0) found = other;
+	}
+
 	/*
 	 *	We have no live servers, BUT we have a zombie.  Use
 	 *	the zombie as a last resort.
@@ -31,6 +31,12 @@ RCSID("$Id$")
 #ifdef HAVE_REGEX
 
 #define REQUEST_DATA_REGEX (0xadbeef00)
+#define REQUEST_DATA_REGEX_CACHE (0xadbeef01)
+
+/*
+ *	Number of (pattern, subject) results remembered per request.
+ */
+#define REGEX_CACHE_SIZE (32)
 
 typedef struct regcapture {
 	regex_t		*preg;		//!< Compiled pattern.
@@ -39,6 +45,32 @@ typedef struct regcapture {
 	size_t		nmatch;		//!< Number of match vectors.
 } regcapture_t;
 
+typedef struct regex_cache_entry {
+	regex_t const	*preg;		//!< Pre-compiled pattern, NULL if the entry is unused.
+	uint32_t	hash;		//!< Of the pattern and the subject.
+	char		*subject;	//!< Copy of the subject.
+	size_t		len;		//!< Length of the subject.
+	int		ret;		//!< What regex_exec returned.
+	regmatch_t	*rxmatch;	//!< Match vectors.
+	size_t		nmatch;		//!< Number of match vectors.
+} regex_cache_entry_t;
+
+typedef struct regex_cache {
+	regex_cache_entry_t	entry[REGEX_CACHE_SIZE];
+} regex_cache_t;
+
+#ifdef HAVE_PCRE
+/** Release the reference a capture holds on a cached expression
+ *
+ */
+static int _regcapture_free(regcapture_t *sc)
+{
+	regex_cache_release(sc->preg);
+
+	return 0;
+}
+#endif
+
 /** Adds subcapture values to request data
  *
  * Allows use of %{n} expansions.
@@ -91,7 +123,15 @@ void regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value, s
 	new_sc->nmatch = nmatch;
 
 #ifdef HAVE_PCRE
-	if (!(*preg)->precompiled) {
+	if ((*preg)->cached) {
+		/*
+		 *	May be evicted from the compile cache while
+		 *	the request still needs it for named captures.
+		 */
+		regex_cache_reference(*preg);
+		new_sc->preg = *preg;
+		talloc_set_destructor(new_sc, _regcapture_free);
+	} else if (!(*preg)->precompiled) {
 		new_sc->preg = talloc_steal(new_sc, *preg);
 		*preg = NULL;
 	} else
@@ -103,6 +143,91 @@ void regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value, s
 	request_data_add(request, request, REQUEST_DATA_REGEX, new_sc, true, false, false);
 }
 
+/** Match a pre-compiled pattern against a subject, remembering the result for the request
+ *
+ * Policies often test the same attribute against the same patterns in
+ * several places.  The result of each (pattern, subject) pair is kept
+ * in a small per-request cache, so that repeat tests don't run the
+ * regex engine again.
+ *
+ * @note preg must remain valid for the lifetime of the request, i.e.
+ *	it must be a pattern compiled when the server was started.
+ *
+ * @param[in] request	Current request.
+ * @param[in] preg	Pre-compiled pattern.
+ * @param[in] subject	to match.
+ * @param[in] len	Length of subject.
+ * @param[out] pmatch	Array of match pointers.
+ * @param[in,out] nmatch How big the match array is. Updated to number of matches.
+ * @return
+ *	- -1 on failure.
+ *	- 0 on no match.
+ *	- 1 on match.
+ */
+int regex_exec_request(REQUEST *request, regex_t *preg, char const *subject, size_t len,
+		       regmatch_t pmatch[], size_t *nmatch)
+{
+	regex_cache_t		*cache;
+	regex_cache_entry_t	*entry;
+	uint32_t		hash;
+	size_t			max = *nmatch;
+	int			ret;
+
+	hash = fr_hash_update(&preg, sizeof(preg), fr_hash(subject, len));
+
+	cache = request_data_reference(request, request, REQUEST_DATA_REGEX_CACHE);
+	if (!cache) {
+		cache = talloc_zero(request, regex_cache_t);
+		if (!cache || (request_data_add(request, request, REQUEST_DATA_REGEX_CACHE,
+						cache, true, false, false) < 0)) {
+			talloc_free(cache);
+			return regex_exec(preg, subject, len, pmatch, nmatch);
+		}
+	}
+
+	entry = &cache->entry[hash % REGEX_CACHE_SIZE];
+	if ((entry->preg == preg) && (entry->hash == hash) && (entry->len == len) &&
+	    (memcmp(entry->subject, subject, len) == 0) && (entry->nmatch <= max)) {
+		RDEBUG4("Using cached regex result");
+
+		if (entry->nmatch) memcpy(pmatch, entry->rxmatch, sizeof(pmatch[0]) * entry->nmatch);
+		*nmatch = entry->nmatch;
+
+		return entry->ret;
+	}
+
+	ret = regex_exec(preg, subject, len, pmatch, nmatch);
+	if (ret < 0) return ret;
+
+	/*
+	 *	Replace whatever was in this slot.
+	 */
+	talloc_free(entry->subject);
+	talloc_free(entry->rxmatch);
+	memset(entry, 0, sizeof(*entry));
+
+	entry->subject = talloc_array(cache, char, len + 1);
+	if (!entry->subject) return ret;
+	memcpy(entry->subject, subject, len);
+	entry->subject[len] = '\0';
+
+	if ((ret == 1) && *nmatch) {
+		entry->rxmatch = talloc_memdup(cache, pmatch, sizeof(pmatch[0]) * *nmatch);
+		if (!entry->rxmatch) {
+			TALLOC_FREE(entry->subject);
+			return ret;
+		}
+		entry->nmatch = *nmatch;
+	}
+
+	entry->preg = preg;
+	entry->hash = hash;
+	entry->len = len;
+	entry->ret = ret;
+
+	return ret;
+}
+
 #  ifdef HAVE_PCRE
 /** Extract a subcapture value from the request
  *
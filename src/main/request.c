@@ -44,6 +44,38 @@ struct request_data_t {
 						//!< after we're done processing this request.
 };
 
+#define REQUEST_DATA_BUCKETS	16		//!< Must be a power of 2.
+
+/** Find the bucket a unique_ptr and unique_int pair is stored in
+ *
+ * Modules commonly add many entries under their instance pointer,
+ * with different unique_ints, so both are mixed into the hash.
+ */
+static inline request_data_t **request_data_bucket(REQUEST const *request, void const *unique_ptr, int unique_int)
+{
+	uint32_t hash;
+
+	hash = (uint32_t)((uintptr_t)unique_ptr >> 3) ^ ((uint32_t)unique_int * 0x9e3779b1);
+	hash ^= hash >> 16;
+
+	return &request->data[hash & (REQUEST_DATA_BUCKETS - 1)];
+}
+
+/** Allocate the request data buckets on first use
+ *
+ * Most requests never have request data added, so the buckets
+ * aren't part of the REQUEST.
+ */
+static int request_data_init(REQUEST *request)
+{
+	if (request->data) return 0;
+
+	request->data = talloc_zero_array(request, request_data_t *, REQUEST_DATA_BUCKETS);
+	if (!request->data) return -1;
+
+	return 0;
+}
+
 /** Callback for freeing a request struct
  *
  */
@@ -126,10 +158,26 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
  *	into the server, for tunneled protocols like TTLS & PEAP.
  */
 REQUEST *request_alloc_fake(REQUEST *request)
+{
+	return request_alloc_fake_ctx(request, request);
+}
+
+/** Create a new fake REQUEST, in a ctx other than the parent
+ *
+ * Lets tunneled methods allocate inner requests out of a pool which
+ * is kept for the life of their session.
+ *
+ * @param[in] ctx	to allocate the fake request in.
+ * @param[in] request	the fake request is based on.
+ * @return
+ *	- The new fake request.
+ *	- NULL on error.
+ */
+REQUEST *request_alloc_fake_ctx(TALLOC_CTX *ctx, REQUEST *request)
 {
 	REQUEST *fake;
 
-	fake = request_alloc(request);
+	fake = request_alloc(ctx);
 	if (!fake) return NULL;
 
 	fake->number = request->number;
@@ -313,8 +361,10 @@ int request_data_add(REQUEST *request, void const *unique_ptr, int unique_int, v
 		   (talloc_parent(opaque) == talloc_null_ctx()));
 	rad_assert(!free_on_parent || (talloc_parent(opaque) != request));
 
+	if (request_data_init(request) < 0) return -1;
+
 	this = next = NULL;
-	for (last = &(request->data); *last != NULL; last = &((*last)->next)) {
+	for (last = request_data_bucket(request, unique_ptr, unique_int); *last != NULL; last = &((*last)->next)) {
 #ifdef WITH_VERIFY_PTR
 		*last = talloc_get_type_abort(*last, request_data_t);
 #endif
@@ -394,9 +444,9 @@ void *request_data_get(REQUEST *request, void const *unique_ptr, int unique_int)
 {
 	request_data_t **last;
 
-	if (!request) return NULL;
+	if (!request || !request->data) return NULL;
 
-	for (last = &(request->data); *last != NULL; last = &((*last)->next)) {
+	for (last = request_data_bucket(request, unique_ptr, unique_int); *last != NULL; last = &((*last)->next)) {
 #ifdef WITH_VERIFY_PTR
 		*last = talloc_get_type_abort(*last, request_data_t);
 #endif
@@ -431,20 +481,28 @@ void *request_data_get(REQUEST *request, void const *unique_ptr, int unique_int)
 int request_data_by_persistance(request_data_t **out, REQUEST *request, bool persist)
 {
 	int count = 0;
+	int i;
 
 	request_data_t **last, *head = NULL, **next;
 
 	next = &head;
 
-	for (last = &(request->data); *last != NULL; last = &((*last)->next)) {
-#ifdef WITH_VERIFY_PTR
-		*last = talloc_get_type_abort(*last, request_data_t);
-#endif
-		if ((*last)->persist == persist) {
+	if (request->data) for (i = 0; i < REQUEST_DATA_BUCKETS; i++) {
+		last = &request->data[i];
+
+		while (*last) {
 			request_data_t	*this;
 
-			/* Unlink it from the list */
+#ifdef WITH_VERIFY_PTR
+			*last = talloc_get_type_abort(*last, request_data_t);
+#endif
 			this = *last;
+			if (this->persist != persist) {
+				last = &this->next;
+				continue;
+			}
+
+			/* Unlink it from the bucket */
 			*last = this->next;
 
 			/* Add it to our list of data to return */
@@ -453,7 +511,6 @@ int request_data_by_persistance(request_data_t **out, REQUEST *request, bool per
 			next = &this->next;
 			count++;
 		}
-		if (!*last) break;
 	}
 	*out = head;
 
@@ -470,19 +527,36 @@ int request_data_by_persistance(request_data_t **out, REQUEST *request, bool per
  */
 void request_data_restore(REQUEST *request, request_data_t *entry)
 {
-	request_data_t **last;
+	request_data_t **last, *next;
+
+	if (!entry) return;
+
+	MEM(request_data_init(request) == 0);
 
 	/*
-	 *	Wind to the end of the current request data
+	 *	Append each entry to the end of its bucket, so
+	 *	existing entries are still found first.
 	 */
-	for (last = &(request->data); *last != NULL; last = &((*last)->next)) if (!(*last)->next) break;
-	*last = entry;
+	for (; entry; entry = next) {
+		next = entry->next;
+		entry->next = NULL;
+
+		for (last = request_data_bucket(request, entry->unique_ptr, entry->unique_int);
+		     *last != NULL;
+		     last = &((*last)->next));
+		*last = entry;
+	}
 
 #ifdef WITH_VERIFY_PTR
 	{
-		request_data_t *this;
+		request_data_t	*this;
+		int		i;
 
-		for (this = request->data; this; this = this->next) this = talloc_get_type_abort(this, request_data_t);
+		for (i = 0; i < REQUEST_DATA_BUCKETS; i++) {
+			for (this = request->data[i]; this; this = this->next) {
+				this = talloc_get_type_abort(this, request_data_t);
+			}
+		}
 	}
 #endif
 }
@@ -503,7 +577,9 @@ void *request_data_reference(REQUEST *request, void const *unique_ptr, int uniqu
 {
 	request_data_t **last;
 
-	for (last = &(request->data); *last != NULL; last = &((*last)->next)) {
+	if (!request->data) return NULL;
+
+	for (last = request_data_bucket(request, unique_ptr, unique_int); *last != NULL; last = &((*last)->next)) {
 		if (((*last)->unique_ptr == unique_ptr) &&
 		    ((*last)->unique_int == unique_int)) return (*last)->opaque;
 	}
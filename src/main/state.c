@@ -48,8 +48,15 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/state.h>
+#include <freeradius-devel/mem_account.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
  */
@@ -94,8 +101,8 @@ typedef struct state_entry {
 
 	uint64_t		seq_start;			//!< Number of first request in this sequence.
 	time_t			cleanup;			//!< When this entry should be cleaned up.
-	struct state_entry	*prev;				//!< Previous entry in the cleanup list.
-	struct state_entry	*next;				//!< Next entry in the cleanup list.
+	struct state_entry	*prev;				//!< Previous entry in the shard's cleanup list.
+	struct state_entry	*next;				//!< Next entry in the shard's cleanup list.
 
 	int			tries;
 
@@ -104,26 +111,49 @@ typedef struct state_entry {
 	VALUE_PAIR		*vps;				//!< session-state VALUE_PAIRs, parented by ctx.
 
 	request_data_t		*data;				//!< Persistable request data, also parented ctx.
+
+	mem_account_t		*mem;				//!< Account of the tree, if we've been added to it.
+	size_t			ctx_size;			//!< Size of ctx when it was given to us.
 } fr_state_entry_t;
 
+/*
+ *	Entries are spread over shards by the hash of their state
+ *	value, so that threads working on different sessions rarely
+ *	contend for the same mutex.
+ */
+#define STATE_SHARDS	(16)
+
+/** One part of the state tree, with its own lock
+ *
+ */
+typedef struct state_shard_t {
+	rbtree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} state_shard_t;
+
 struct fr_state_tree_t {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast64_t	timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
-
-	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
+	uint32_t		shard_max_sessions;		//!< Maximum number of sessions in each shard.
 	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	mem_account_t		*mem;				//!< Memory used by entries, including the
+								//!< session-state and request data they hold.
+
+	state_shard_t		shard[STATE_SHARDS];		//!< Entries, by hash of their state value.
 };
 
 fr_state_tree_t *global_state = NULL;
 
+static fr_state_backend_t const	*state_backend = NULL;		//!< Where to share state with other servers.
+static void			*state_backend_uctx = NULL;	//!< Passed to the backend's callbacks.
+
 #define PTHREAD_MUTEX_LOCK if (main_config.spawn_workers) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (main_config.spawn_workers) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(state_shard_t *shard, fr_state_entry_t *entry);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -136,34 +166,48 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Return the shard which holds a state value
+ *
+ */
+static inline state_shard_t *state_shard(fr_state_tree_t *state, uint8_t const *value)
+{
+	return &state->shard[fr_hash(value, sizeof(((fr_state_entry_t *)NULL)->state)) % STATE_SHARDS];
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
 	fr_state_entry_t *this;
-
-	if (main_config.spawn_workers) pthread_mutex_destroy(&state->mutex);
+	int i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while (state->head) {
-		this = state->head;
-		state_entry_unlink(state, this);
-		talloc_free(this);
-	}
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
 
-	for (this = state->head; this; this = this->next) DEBUG4("State %" PRIu64 " needs freeing prev was %" PRIu64 "", this->id, this->prev ? this->prev->id : 100000);
+		if (!shard->tree) continue;
 
-	/*
-	 *	Ensure we got *all* the entries
-	 */
-	rad_assert(!state->head);
+		if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
 
-	/*
-	 *	Free the rbtree
-	 */
-	rbtree_free(state->tree);
+		while (shard->head) {
+			this = shard->head;
+			state_entry_unlink(shard, this);
+			talloc_free(this);
+		}
+
+		/*
+		 *	Ensure we got *all* the entries
+		 */
+		rad_assert(!shard->head);
+
+		/*
+		 *	Free the rbtree
+		 */
+		rbtree_free(shard->tree);
+		shard->tree = NULL;
+	}
 
 	if (state == global_state) global_state = NULL;
 
@@ -180,13 +224,21 @@ static int _state_tree_free(fr_state_tree_t *state)
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout)
 {
 	fr_state_tree_t *state;
+	int i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
 	state->max_sessions = max_sessions;
+	state->shard_max_sessions = (max_sessions + STATE_SHARDS - 1) / STATE_SHARDS;
 	state->timeout = timeout;
 
+	state->mem = mem_account_alloc(state, "state", "session-state", 0);
+	if (!state->mem) {
+		talloc_free(state);
+		return NULL;
+	}
+
 	/*
 	 *	Create a break in the contexts.
 	 *	We still want this to be freed at the same time
@@ -196,23 +248,30 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	 */
 	fr_talloc_link_ctx(ctx, state);
 
-	if (main_config.spawn_workers && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	talloc_set_destructor(state, _state_tree_free);
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
+		if (!shard->tree) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (main_config.spawn_workers && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			rbtree_free(shard->tree);
+			shard->tree = NULL;
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	return state;
 }
@@ -220,7 +279,7 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 /** Unlink an entry and remove if from the tree
  *
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(state_shard_t *shard, fr_state_entry_t *entry)
 {
 	fr_state_entry_t *prev, *next;
 
@@ -228,24 +287,24 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	next = entry->next;
 
 	if (prev) {
-		rad_assert(state->head != entry);
+		rad_assert(shard->head != entry);
 		prev->next = next;
-	} else if (state->head) {
-		rad_assert(state->head == entry);
-		state->head = next;
+	} else if (shard->head) {
+		rad_assert(shard->head == entry);
+		shard->head = next;
 	}
 
 	if (next) {
-		rad_assert(state->tail != entry);
+		rad_assert(shard->tail != entry);
 		next->prev = prev;
-	} else if (state->tail) {
-		rad_assert(state->tail == entry);
-		state->tail = prev;
+	} else if (shard->tail) {
+		rad_assert(shard->tail == entry);
+		shard->tail = prev;
 	}
 	entry->next = NULL;
 	entry->prev = NULL;
 
-	rbtree_deletebydata(state->tree, entry);
+	rbtree_deletebydata(shard->tree, entry);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -283,51 +342,102 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	 */
 	if (entry->ctx) TALLOC_FREE(entry->ctx);
 
+	mem_account_add(entry->mem, -(int64_t)(sizeof(*entry) + entry->ctx_size), entry->mem ? -1 : 0);
+
 	DEBUG4("State ID %" PRIu64 " freed", entry->id);
 
 	return 0;
 }
 
-/** Create a new state entry
+/** Unlink the entries in a shard which have timed out
+ *
+ * @note Called with the shard's mutex held.
  *
- * @note Called with the mutex held.
+ * @param[in] state tree the shard belongs to.
+ * @param[in] shard to clean up.
+ * @param[in] keep an entry which must not be unlinked, may be NULL.
+ * @param[in] now the current time.
+ * @param[in,out] free_next where to add the unlinked entries.
+ * @return where to add further entries.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static fr_state_entry_t **state_shard_expire(fr_state_tree_t *state, state_shard_t *shard,
+					     fr_state_entry_t *keep, time_t now, fr_state_entry_t **free_next)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	VALUE_PAIR		*vp;
-	fr_state_entry_t	*entry, *next;
-	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
+	fr_state_entry_t *entry, *next;
 
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
-
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = state->head; entry != NULL; entry = next) {
+	for (entry = shard->head; entry != NULL; entry = next) {
 		next = entry->next;
 
-		if (entry == old) continue;
+		if (entry == keep) continue;
 
 		/*
 		 *	Too old, we can delete it.
 		 */
 		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
+			state_entry_unlink(shard, entry);
 			*free_next = entry;
 			free_next = &(entry->next);
-			state->timed_out++;
+			atomic_fetch_add_explicit(&state->timed_out, 1, memory_order_relaxed);
 			continue;
 		}
 
 		break;
 	}
 
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) return NULL;
+	return free_next;
+}
+
+/** Free entries which have been unlinked
+ *
+ *  We do it outside of the mutex as freeing may involve significantly
+ *  more work than just freeing the data.
+ *
+ *  If there's request data that was persisted it will now be freed
+ *  also, and it may have complex destructors associated with it.
+ */
+static void state_entry_free_list(fr_state_entry_t *head)
+{
+	fr_state_entry_t *entry, *next;
+
+	for (next = head; next;) {
+		entry = next;
+		next = entry->next;
+		talloc_free(entry);
+	}
+}
+
+/** Create a new state entry, and give it the state from the request
+ *
+ * @note Called with the mutex of old_shard held, if there's an old entry.
+ *	Returns with no mutexes held.
+ *
+ * @param[in] state tree to add the entry to.
+ * @param[in] request to take session-state and persistable data from.
+ * @param[in] packet to add the State attribute to.
+ * @param[in] old_shard containing old.
+ * @param[in] old entry this one continues from, may be NULL.
+ * @param[in] data persistable request data.
+ * @param[out] key_out where to copy the state value of the new entry, as
+ *	the entry may be freed by another thread as soon as it's inserted.
+ * @return
+ *	- The new entry.
+ *	- NULL on error, in which case the request is unchanged.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet,
+					    state_shard_t *old_shard, fr_state_entry_t *old, request_data_t *data,
+					    uint8_t *key_out)
+{
+	size_t			i;
+	uint32_t		x;
+	time_t			now = time(NULL);
+	VALUE_PAIR		*vp;
+	fr_state_entry_t	*entry;
+	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
+	state_shard_t		*shard;
+
+	uint8_t			old_state[sizeof(old->state)];
+	int			old_tries = 0;
+	size_t			ctx_size;
 
 	/*
 	 *	Record the information from the old state, we may base the
@@ -337,6 +447,8 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	so we have to grab the values now.
 	 */
 	if (old) {
+		free_next = state_shard_expire(state, old_shard, old, now, free_next);
+
 		old_tries = old->tries;
 
 		memcpy(old_state, old->state, sizeof(old_state));
@@ -345,26 +457,14 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		 *	The old one isn't used any more, so we can free it.
 		 */
 		if (!old->data) {
-			state_entry_unlink(state, old);
+			state_entry_unlink(old_shard, old);
 			*free_next = old;
 		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&old_shard->mutex);
 
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	for (next = free_head; next;) {
-		entry = next;
-		next = entry->next;
-		talloc_free(entry);
+		state_entry_free_list(free_head);
+		free_head = NULL;
+		free_next = &free_head;
 	}
 
 	/*
@@ -375,12 +475,17 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	we can't do it now due to thread safety issues with talloc.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
+
+	/*
+	 *	The ctx holds the session-state attributes, and any
+	 *	persistable request data (like EAP sessions).  It's
+	 *	still ours, so can be safely measured now.
+	 */
+	ctx_size = request->state_ctx ? talloc_total_size(request->state_ctx) : 0;
+
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -452,21 +557,35 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		       entry->id, hex, (uint64_t)entry->cleanup - now);
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (rbtree_num_elements(state->tree) >= (uint32_t)state->max_sessions) {
-		talloc_free(entry);
-		return NULL;
-	}
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
 	 *	only succeed in the virtual server that created the state
 	 *	value.
+	 *
+	 *	The hash is part of the State value we send, and of
+	 *	state shared with other servers, so it must be the
+	 *	same on every host, and in every release.
+	 */
+	*((uint32_t *)(&entry->state_comp.server_hash)) ^= htonl(fr_hash_fnv_string(request->server));
+
+	/*
+	 *	The new state value may well hash to a different
+	 *	shard than the old one.
 	 */
-	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(request->server);
+	shard = state_shard(state, entry->state);
 
-	if (!rbtree_insert(state->tree, entry)) {
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	free_next = state_shard_expire(state, shard, NULL, now, free_next);
+
+	if ((rbtree_num_elements(shard->tree) >= state->shard_max_sessions) ||
+	    !rbtree_insert(shard->tree, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		state_entry_free_list(free_head);
 		talloc_free(entry);
 		return NULL;
 	}
@@ -475,43 +594,339 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	if (!state->head) {
+	if (!shard->head) {
 		entry->prev = entry->next = NULL;
-		state->head = state->tail = entry;
+		shard->head = shard->tail = entry;
 	} else {
-		rad_assert(state->tail != NULL);
+		rad_assert(shard->tail != NULL);
 
-		entry->prev = state->tail;
-		state->tail->next = entry;
+		entry->prev = shard->tail;
+		shard->tail->next = entry;
 
 		entry->next = NULL;
-		state->tail = entry;
+		shard->tail = entry;
 	}
 
+	rad_assert(request->state_ctx);
+
+	entry->seq_start = request->seq_start;
+	entry->ctx = request->state_ctx;
+	entry->vps = request->state;
+	entry->data = data;
+
+	/*
+	 *	Accounted while we hold the mutex, so another
+	 *	thread can't free the entry first.
+	 */
+	entry->mem = state->mem;
+	entry->ctx_size = ctx_size;
+	mem_account_add(entry->mem, sizeof(*entry) + ctx_size, 1);
+
+	request->state_ctx = NULL;
+	request->state = NULL;
+
+	memcpy(key_out, entry->state, sizeof(entry->state));
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	state_entry_free_list(free_head);
+
 	return entry;
 }
 
-/** Find the entry, based on the State attribute
+/** Register a backend to share state entries with other servers
+ *
+ *  Entries are still kept in the local state tree, which acts as a
+ *  cache in front of the backend.  If an entry isn't found locally,
+ *  the backend is asked for it.
  *
+ *  Only session-state VALUE_PAIRs are shared.  Persistable request
+ *  data is made of pointers into this process, so sessions which
+ *  have any are kept local.
+ *
+ * @param[in] backend to use, or NULL to stop using one.
+ * @param[in] uctx passed to the backend's callbacks.
+ */
+void fr_state_backend_register(fr_state_backend_t const *backend, void *uctx)
+{
+	state_backend = backend;
+	state_backend_uctx = uctx;
+}
+
+/*
+ *	Serialised state is a version octet, then the number of the
+ *	first request in the sequence (8 octets), then for each
+ *	VALUE_PAIR:
+ *
+ *	name length (2), name, tag (1), operator (1), value length (4), value
+ *
+ *	All numbers are in network order.  string and octets values
+ *	are copied as-is, everything else is printed, and parsed again
+ *	when the state is restored.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
+#define STATE_SERIALISE_VERSION	(1)
+
+/** Serialise session-state so it can be stored in a backend
+ *
+ * @param[in] ctx to allocate the buffer in.
+ * @param[out] out where to write the buffer.
+ * @param[in] seq_start number of the first request in the sequence.
+ * @param[in] vps to serialise.
+ * @return
+ *	- Length of the data written to out.
+ *	- -1 on error.
+ */
+static ssize_t state_serialise(TALLOC_CTX *ctx, uint8_t **out, uint64_t seq_start, VALUE_PAIR *vps)
+{
+	uint8_t		*buff, *p;
+	size_t		len, needed;
+	int		i;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	len = 9;
+	buff = talloc_array(ctx, uint8_t, 256);
+	if (!buff) return -1;
+
+	buff[0] = STATE_SERIALISE_VERSION;
+	for (i = 0; i < 8; i++) buff[1 + i] = (seq_start >> (56 - (i * 8))) & 0xff;
+
+	for (vp = fr_pair_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		size_t		name_len, value_len;
+		uint8_t const	*value;
+		char		*str = NULL;
+
+		/*
+		 *	Don't bother with attributes we couldn't find
+		 *	by name again.
+		 */
+		if (vp->da->flags.is_unknown) continue;
+
+		switch (vp->vp_type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+			value = vp->vp_octets;
+			value_len = vp->vp_length;
+			break;
+
+		default:
+			str = value_box_asprint(ctx, &vp->data, '\0');
+			if (!str) goto error;
+			value = (uint8_t const *)str;
+			value_len = strlen(str);
+			break;
+		}
+
+		name_len = strlen(vp->da->name);
+		needed = len + 2 + name_len + 2 + 4 + value_len;
+		if (needed > talloc_array_length(buff)) {
+			uint8_t *tmp;
+
+			tmp = talloc_realloc(ctx, buff, uint8_t, needed * 2);
+			if (!tmp) {
+				talloc_free(str);
+				goto error;
+			}
+			buff = tmp;
+		}
+
+		p = buff + len;
+		*p++ = (name_len >> 8) & 0xff;
+		*p++ = name_len & 0xff;
+		memcpy(p, vp->da->name, name_len);
+		p += name_len;
+		*p++ = vp->tag;
+		*p++ = vp->op;
+		for (i = 0; i < 4; i++) *p++ = (value_len >> (24 - (i * 8))) & 0xff;
+		memcpy(p, value, value_len);
+		p += value_len;
+
+		len = p - buff;
+		talloc_free(str);
+	}
+
+	*out = buff;
+	return len;
+
+error:
+	talloc_free(buff);
+	return -1;
+}
+
+/** Turn serialised state back into session-state
+ *
+ * @param[in] ctx to allocate the VALUE_PAIRs in.
+ * @param[out] out where to write the VALUE_PAIRs.
+ * @param[out] seq_start number of the first request in the sequence.
+ * @param[in] data to parse.
+ * @param[in] data_len length of the data.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the data is malformed, or references unknown attributes.
+ */
+static int state_unserialise(TALLOC_CTX *ctx, VALUE_PAIR **out, uint64_t *seq_start,
+			     uint8_t const *data, size_t data_len)
+{
+	uint8_t const	*p = data, *end = data + data_len;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*head = NULL, *vp;
+	int		i;
+
+	if ((data_len < 9) || (data[0] != STATE_SERIALISE_VERSION)) {
+		fr_strerror_printf("Invalid serialised state");
+		return -1;
+	}
+
+	*seq_start = 0;
+	for (i = 0; i < 8; i++) *seq_start = (*seq_start << 8) | data[1 + i];
+	p += 9;
+
+	fr_pair_cursor_init(&cursor, &head);
+
+	while (p < end) {
+		char			name[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+		size_t			name_len, value_len;
+		fr_dict_attr_t const	*da;
+
+		if ((end - p) < 2) goto malformed;
+		name_len = (p[0] << 8) | p[1];
+		p += 2;
+
+		if ((name_len >= sizeof(name)) || ((size_t)(end - p) < (name_len + 6))) goto malformed;
+		memcpy(name, p, name_len);
+		name[name_len] = '\0';
+		p += name_len;
+
+		da = fr_dict_attr_by_name(NULL, name);
+		if (!da) {
+			fr_strerror_printf("Unknown attribute \"%s\" in serialised state", name);
+			goto error;
+		}
+
+		vp = fr_pair_afrom_da(ctx, da);
+		if (!vp) goto error;
+
+		vp->tag = *p++;
+		vp->op = *p++;
+
+		value_len = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		p += 4;
+		if ((size_t)(end - p) < value_len) {
+			talloc_free(vp);
+			goto malformed;
+		}
+
+		switch (da->type) {
+		case PW_TYPE_STRING:
+			fr_pair_value_bstrncpy(vp, p, value_len);
+			break;
+
+		case PW_TYPE_OCTETS:
+			fr_pair_value_memcpy(vp, p, value_len);
+			break;
+
+		default:
+			if (fr_pair_value_from_str(vp, (char const *)p, value_len) < 0) {
+				talloc_free(vp);
+				goto error;
+			}
+			break;
+		}
+		p += value_len;
+
+		fr_pair_cursor_append(&cursor, vp);
+	}
+
+	*out = head;
+	return 0;
+
+malformed:
+	fr_strerror_printf("Serialised state is truncated");
+error:
+	fr_pair_list_free(&head);
+	return -1;
+}
+
+/** Restore session-state from the backend
+ *
+ * @return
+ *	- true if the state was found.
+ *	- false otherwise.
+ */
+static bool state_backend_fetch(REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	uint8_t		*data = NULL;
+	ssize_t		data_len;
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	*vps;
+	uint64_t	seq_start;
+
+	data_len = state_backend->fetch(request, &data, state_backend_uctx, request, key, key_len);
+	if (data_len <= 0) return false;
+
+	ctx = talloc_init("session-state");
+	if (!ctx) {
+		talloc_free(data);
+		return false;
+	}
+
+	if (state_unserialise(ctx, &vps, &seq_start, data, data_len) < 0) {
+		RWDEBUG("Failed restoring &session-state from %s: %s", state_backend->name, fr_strerror());
+		talloc_free(data);
+		talloc_free(ctx);
+		return false;
+	}
+	talloc_free(data);
+
+	if (request->state_ctx) talloc_free(request->state_ctx);
+	request->seq_start = seq_start;
+	request->state_ctx = ctx;
+	request->state = vps;
+
+	RDEBUG2("Restored &session-state from %s", state_backend->name);
+
+	return true;
+}
+
+/** Get the lookup key from the State attribute
+ *
+ * @param[out] my_entry to write the key to.
+ * @param[in] request the packet is for.
+ * @param[in] packet containing the State attribute.
+ * @return
+ *	- true if there's a usable State attribute.
+ *	- false otherwise.
+ */
+static bool state_entry_key(fr_state_entry_t *my_entry, REQUEST *request, RADIUS_PACKET *packet)
 {
 	VALUE_PAIR *vp;
-	fr_state_entry_t *entry, my_entry;
 
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_STATE, TAG_ANY);
-	if (!vp) return NULL;
+	if (!vp) return false;
 
-	if (vp->vp_length != sizeof(my_entry.state)) return NULL;
+	if (vp->vp_length != sizeof(my_entry->state)) return false;
 
-	memcpy(my_entry.state, vp->vp_octets, sizeof(my_entry.state));
+	memcpy(my_entry->state, vp->vp_octets, sizeof(my_entry->state));
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(request->server);
+	my_entry->state_comp.server_hash ^= htonl(fr_hash_fnv_string(request->server));
+
+	return true;
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the shard's mutex held.
+ */
+static fr_state_entry_t *state_entry_find(state_shard_t *shard, fr_state_entry_t *my_entry)
+{
+	fr_state_entry_t *entry;
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	entry = rbtree_finddata(shard->tree, my_entry);
 
 #ifdef WITH_VERIFY_PTR
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
@@ -525,16 +940,22 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original)
 {
-	fr_state_entry_t *entry;
+	fr_state_entry_t	*entry, my_entry;
+	state_shard_t		*shard;
+
+	if (!state_entry_key(&my_entry, request, original)) return;
+	shard = state_shard(state, my_entry.state);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, original);
+	if (state_backend) state_backend->remove(state_backend_uctx, request, my_entry.state, sizeof(my_entry.state));
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	The state and request must be in the same state
@@ -561,8 +982,9 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry;
-	TALLOC_CTX *old_ctx = NULL;
+	fr_state_entry_t	*entry, my_entry;
+	state_shard_t		*shard;
+	TALLOC_CTX		*old_ctx = NULL;
 
 	rad_assert(request->state == NULL);
 
@@ -575,9 +997,12 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	if (!state_entry_key(&my_entry, request, packet)) goto done;
+	shard = state_shard(state, my_entry.state);
 
-	entry = state_entry_find(state, request, packet);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	entry = state_entry_find(shard, &my_entry);
 	if (entry) {
 		if (request->state_ctx) old_ctx = request->state_ctx;
 
@@ -589,10 +1014,19 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		entry->ctx = NULL;
 		entry->vps = NULL;
 		entry->data = NULL;
+
+		mem_account_add(entry->mem, -(int64_t)entry->ctx_size, 0);
+		entry->ctx_size = 0;
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	/*
+	 *	Not one of ours, another server may have it.
+	 */
+	if (!entry && state_backend) (void) state_backend_fetch(request, my_entry.state, sizeof(my_entry.state));
 
+done:
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
@@ -619,8 +1053,13 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry, *old;
-	request_data_t *data;
+	fr_state_entry_t	*entry, *old = NULL, my_entry;
+	state_shard_t		*old_shard = NULL;
+	request_data_t		*data;
+	uint8_t			*data_buff = NULL;
+	ssize_t			data_len = 0;
+	uint64_t		seq_start = request->seq_start;
+	uint8_t			key[sizeof(my_entry.state)];
 
 	request_data_by_persistance(&data, request, true);
 
@@ -631,29 +1070,38 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	/*
+	 *	The VALUE_PAIRs belong to the entry as soon as it's
+	 *	inserted, so serialise them while they're still ours.
+	 */
+	if (state_backend && !data) {
+		data_len = state_serialise(NULL, &data_buff, seq_start, request->state);
+		if (data_len < 0) {
+			RWDEBUG("Failed serialising &session-state for %s: %s", state_backend->name, fr_strerror());
+		}
+	}
+
+	if (original && state_entry_key(&my_entry, request, original)) {
+		old_shard = state_shard(state, my_entry.state);
 
-	old = original ? state_entry_find(state, request, original) :
-			 NULL;
+		PTHREAD_MUTEX_LOCK(&old_shard->mutex);
+		old = state_entry_find(old_shard, &my_entry);
+		if (!old) PTHREAD_MUTEX_UNLOCK(&old_shard->mutex);
+	}
 
-	entry = state_entry_create(state, request, packet, old);
+	entry = state_entry_create(state, request, packet, old_shard, old, data, key);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		talloc_free(data_buff);
 		return false;
 	}
 
-	rad_assert(entry->ctx == NULL);
-	rad_assert(request->state_ctx);
-
-	entry->seq_start = request->seq_start;
-	entry->ctx = request->state_ctx;
-	entry->vps = request->state;
-	entry->data = data;
-
-	request->state_ctx = NULL;
-	request->state = NULL;
-
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	if (data_len > 0) {
+		if (state_backend->store(state_backend_uctx, request, key, sizeof(key),
+					 data_buff, data_len, state->timeout) < 0) {
+			RWDEBUG("Failed saving &session-state to %s", state_backend->name);
+		}
+	}
+	talloc_free(data_buff);
 
 	rad_assert(request->state == NULL);
 	VERIFY_REQUEST(request);
@@ -665,7 +1113,7 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -673,7 +1121,7 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	return atomic_load_explicit(&state->timed_out, memory_order_relaxed);
 }
 
 /** Return number of entries we're currently tracking
@@ -681,5 +1129,16 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	uint32_t	num = 0;
+	int		i;
+
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		num += rbtree_num_elements(shard->tree);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return num;
 }
@@ -25,6 +25,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/modpriv.h>
+#include <freeradius-devel/mem_account.h>
+#include <freeradius-devel/interpreter.h>
 
 #ifdef WITH_STATS
 
@@ -35,29 +38,82 @@ RCSID("$Id$")
 static struct timeval	start_time;
 static struct timeval	hup_time;
 
-#define FR_STATS_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 	\
-				 { 0, 0, 0, 0, 0, 0, 0, 0 }}
-
-fr_stats_t radius_auth_stats = FR_STATS_INIT;
+fr_stats_block_t radius_auth_stats;
 #ifdef WITH_ACCOUNTING
-fr_stats_t radius_acct_stats = FR_STATS_INIT;
+fr_stats_block_t radius_acct_stats;
 #endif
 #ifdef WITH_COA
-fr_stats_t radius_coa_stats = FR_STATS_INIT;
-fr_stats_t radius_dsc_stats = FR_STATS_INIT;
+fr_stats_block_t radius_coa_stats;
+fr_stats_block_t radius_dsc_stats;
 #endif
 
 #ifdef WITH_PROXY
-fr_stats_t proxy_auth_stats = FR_STATS_INIT;
+fr_stats_block_t proxy_auth_stats;
 #ifdef WITH_ACCOUNTING
-fr_stats_t proxy_acct_stats = FR_STATS_INIT;
+fr_stats_block_t proxy_acct_stats;
 #endif
 #ifdef WITH_COA
-fr_stats_t proxy_coa_stats = FR_STATS_INIT;
-fr_stats_t proxy_dsc_stats = FR_STATS_INIT;
+fr_stats_block_t proxy_coa_stats;
+fr_stats_block_t proxy_dsc_stats;
 #endif
 #endif
 
+static uint32_t			stats_shard_next;	//!< Next shard to give to a thread.
+static _Thread_local int	stats_shard_id = -1;	//!< This thread's shard.
+
+/** Get the shard the calling thread counts into
+ *
+ */
+unsigned int fr_stats_shard(void)
+{
+	if (stats_shard_id < 0) {
+		stats_shard_id = __atomic_fetch_add(&stats_shard_next, 1, __ATOMIC_RELAXED) % FR_STATS_SHARDS;
+	}
+
+	return stats_shard_id;
+}
+
+/** Add up the shards of a block
+ *
+ * Shards are still being written while they're read, so the result
+ * may be a little behind, but every counter is read atomically, and
+ * never goes backwards.
+ *
+ * @param[out] out	Where to write the totals.
+ * @param[in] block	to add up.
+ */
+void fr_stats_merge(fr_stats_t *out, fr_stats_block_t const *block)
+{
+	int i, j;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i < FR_STATS_SHARDS; i++) {
+		fr_stats_t const	*in = &block->shard[i].stats;
+		time_t			last_packet;
+
+#define MERGE(_x) out->_x += __atomic_load_n(&in->_x, __ATOMIC_RELAXED)
+		MERGE(total_requests);
+		MERGE(total_invalid_requests);
+		MERGE(total_dup_requests);
+		MERGE(total_responses);
+		MERGE(total_access_accepts);
+		MERGE(total_access_rejects);
+		MERGE(total_access_challenges);
+		MERGE(total_malformed_requests);
+		MERGE(total_bad_authenticators);
+		MERGE(total_packets_dropped);
+		MERGE(total_no_records);
+		MERGE(total_unknown_types);
+		MERGE(total_timeouts);
+		for (j = 0; j < 8; j++) MERGE(elapsed[j]);
+#undef MERGE
+
+		last_packet = __atomic_load_n(&in->last_packet, __ATOMIC_RELAXED);
+		if (last_packet > out->last_packet) out->last_packet = last_packet;
+	}
+}
+
 void request_stats_final(REQUEST *request)
 {
 	if (request->master_state == REQUEST_COUNTED) return;
@@ -79,25 +135,25 @@ void request_stats_final(REQUEST *request)
 		return;
 
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;request->client->auth._x++;
+#define INC_AUTH(_x) FR_STATS_ADD(&radius_auth_stats, _x, 1);FR_STATS_ADD(&request->listener->stats, _x, 1);FR_STATS_ADD(&request->client->auth, _x, 1);
 
 #undef INC_ACCT
 #ifdef WITH_ACCOUNTING
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;request->client->acct._x++
+#define INC_ACCT(_x) FR_STATS_ADD(&radius_acct_stats, _x, 1);FR_STATS_ADD(&request->listener->stats, _x, 1);FR_STATS_ADD(&request->client->acct, _x, 1)
 #else
 #define INC_ACCT(_x)
 #endif
 
 #undef INC_COA
 #ifdef WITH_COA
-#define INC_COA(_x) radius_coa_stats._x++;request->listener->stats._x++;request->client->coa._x++
+#define INC_COA(_x) FR_STATS_ADD(&radius_coa_stats, _x, 1);FR_STATS_ADD(&request->listener->stats, _x, 1);FR_STATS_ADD(&request->client->coa, _x, 1)
 #else
 #define INC_COA(_x)
 #endif
 
 #undef INC_DSC
 #ifdef WITH_DSC
-#define INC_DSC(_x) radius_dsc_stats._x++;request->listener->stats._x++;request->client->dsc._x++
+#define INC_DSC(_x) FR_STATS_ADD(&radius_dsc_stats, _x, 1);FR_STATS_ADD(&request->listener->stats, _x, 1);FR_STATS_ADD(&request->client->dsc, _x, 1)
 #else
 #define INC_DSC(_x)
 #endif
@@ -105,10 +161,8 @@ void request_stats_final(REQUEST *request)
 	/*
 	 *	Update the statistics.
 	 *
-	 *	Note that we do NOT do this in a child thread.
-	 *	Instead, we update the stats when a request is
-	 *	deleted, because only the main server thread calls
-	 *	this function, which makes it thread-safe.
+	 *	This is called from whichever thread finishes the
+	 *	request, so everything goes into that thread's shard.
 	 */
 	if (request->reply && request->packet && (request->packet->code != PW_CODE_STATUS_SERVER)) switch (request->reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
@@ -120,13 +174,13 @@ void request_stats_final(REQUEST *request)
 		/*
 		 *	FIXME: Do the time calculations once...
 		 */
-		fr_stats_bins(&radius_auth_stats,
+		fr_stats_bins(FR_STATS_LOCAL(&radius_auth_stats),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
-		fr_stats_bins(&request->client->auth,
+		fr_stats_bins(FR_STATS_LOCAL(&request->client->auth),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
-		fr_stats_bins(&request->listener->stats,
+		fr_stats_bins(FR_STATS_LOCAL(&request->listener->stats),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -142,10 +196,10 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_RESPONSE:
 		INC_ACCT(total_responses);
-		fr_stats_bins(&radius_acct_stats,
+		fr_stats_bins(FR_STATS_LOCAL(&radius_acct_stats),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
-		fr_stats_bins(&request->client->acct,
+		fr_stats_bins(FR_STATS_LOCAL(&request->client->acct),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -156,7 +210,7 @@ void request_stats_final(REQUEST *request)
 		INC_COA(total_access_accepts);
 	  coa_stats:
 		INC_COA(total_responses);
-		fr_stats_bins(&request->client->coa,
+		fr_stats_bins(FR_STATS_LOCAL(&request->client->coa),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -169,7 +223,7 @@ void request_stats_final(REQUEST *request)
 		INC_DSC(total_access_accepts);
 	  dsc_stats:
 		INC_DSC(total_responses);
-		fr_stats_bins(&request->client->dsc,
+		fr_stats_bins(FR_STATS_LOCAL(&request->client->dsc),
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -208,26 +262,26 @@ void request_stats_final(REQUEST *request)
 
 	switch (request->proxy->packet->code) {
 	case PW_CODE_ACCESS_REQUEST:
-		proxy_auth_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		FR_STATS_ADD(&proxy_auth_stats, total_requests, request->proxy->packet->count);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_requests, request->proxy->packet->count);
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
-		proxy_acct_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		FR_STATS_ADD(&proxy_acct_stats, total_requests, request->proxy->packet->count);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_requests, request->proxy->packet->count);
 		break;
 #endif
 
 #ifdef WITH_COA
 	case PW_CODE_COA_REQUEST:
-		proxy_coa_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		FR_STATS_ADD(&proxy_coa_stats, total_requests, request->proxy->packet->count);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_requests, request->proxy->packet->count);
 		break;
 
 	case PW_CODE_DISCONNECT_REQUEST:
-		proxy_dsc_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		FR_STATS_ADD(&proxy_dsc_stats, total_requests, request->proxy->packet->count);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_requests, request->proxy->packet->count);
 		break;
 #endif
 
@@ -238,17 +292,18 @@ void request_stats_final(REQUEST *request)
 	if (!request->proxy->reply) goto done;	/* simplifies formatting */
 
 #undef INC
-#define INC(_x) proxy_auth_stats._x += request->proxy->reply->count; request->proxy->home_server->stats._x += request->proxy->reply->count;
+#define INC(_x) FR_STATS_ADD(&proxy_auth_stats, _x, request->proxy->reply->count); \
+	FR_STATS_ADD(&request->proxy->home_server->stats, _x, request->proxy->reply->count);
 
 	switch (request->proxy->reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
 		INC(total_access_accepts);
 	proxy_stats:
 		INC(total_responses);
-		fr_stats_bins(&proxy_auth_stats,
+		fr_stats_bins(FR_STATS_LOCAL(&proxy_auth_stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
+		fr_stats_bins(FR_STATS_LOCAL(&request->proxy->home_server->stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
 		break;
@@ -263,12 +318,12 @@ void request_stats_final(REQUEST *request)
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_RESPONSE:
-		proxy_acct_stats.total_responses++;
-		request->proxy->home_server->stats.total_responses++;
-		fr_stats_bins(&proxy_acct_stats,
+		FR_STATS_ADD(&proxy_acct_stats, total_responses, 1);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_responses, 1);
+		fr_stats_bins(FR_STATS_LOCAL(&proxy_acct_stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
+		fr_stats_bins(FR_STATS_LOCAL(&request->proxy->home_server->stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
 		break;
@@ -277,32 +332,32 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_COA
 	case PW_CODE_COA_ACK:
 	case PW_CODE_COA_NAK:
-		proxy_coa_stats.total_responses++;
-		request->proxy->home_server->stats.total_responses++;
-		fr_stats_bins(&proxy_coa_stats,
+		FR_STATS_ADD(&proxy_coa_stats, total_responses, 1);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_responses, 1);
+		fr_stats_bins(FR_STATS_LOCAL(&proxy_coa_stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
+		fr_stats_bins(FR_STATS_LOCAL(&request->proxy->home_server->stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
 		break;
 
 	case PW_CODE_DISCONNECT_ACK:
 	case PW_CODE_DISCONNECT_NAK:
-		proxy_dsc_stats.total_responses++;
-		request->proxy->home_server->stats.total_responses++;
-		fr_stats_bins(&proxy_dsc_stats,
+		FR_STATS_ADD(&proxy_dsc_stats, total_responses, 1);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_responses, 1);
+		fr_stats_bins(FR_STATS_LOCAL(&proxy_dsc_stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
+		fr_stats_bins(FR_STATS_LOCAL(&request->proxy->home_server->stats),
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
 		break;
 #endif
 
 	default:
-		proxy_auth_stats.total_unknown_types++;
-		request->proxy->home_server->stats.total_unknown_types++;
+		FR_STATS_ADD(&proxy_auth_stats, total_unknown_types, 1);
+		FR_STATS_ADD(&request->proxy->home_server->stats, total_unknown_types, 1);
 		break;
 	}
 
@@ -412,18 +467,21 @@ static fr_stats2vp client_acctvp[] = {
 #endif
 
 static void request_stats_addvp(REQUEST *request,
-				fr_stats2vp *table, fr_stats_t *stats)
+				fr_stats2vp *table, fr_stats_block_t const *block)
 {
 	int i;
 	fr_uint_t counter;
+	fr_stats_t stats;
 	VALUE_PAIR *vp;
 
+	fr_stats_merge(&stats, block);
+
 	for (i = 0; table[i].attribute != 0; i++) {
 		vp = radius_pair_create(request->reply, &request->reply->vps,
 				       table[i].attribute, VENDORPEC_FREERADIUS);
 		if (!vp) continue;
 
-		counter = *(fr_uint_t *) (((uint8_t *) stats) + table[i].offset);
+		counter = *(fr_uint_t *) (((uint8_t *) &stats) + table[i].offset);
 		vp->vp_integer = counter;
 	}
 }
@@ -755,7 +813,462 @@ void request_stats_reply(REQUEST *request)
 #endif
 	}
 #endif	/* WITH_PROXY */
+
+	/*
+	 *	For a particular module instance, and optionally a
+	 *	particular method.
+	 */
+	if ((flag->vp_integer & 0x100) != 0) {
+		module_instance_t	*mi;
+		module_method_stats_t	stats;
+		VALUE_PAIR		*name, *method;
+		CONF_SECTION		*modules;
+		int			i = -1;
+
+		name = fr_pair_find_by_num(request->packet->vps, VENDORPEC_FREERADIUS,
+					   PW_FREERADIUS_STATS_MODULE_NAME, TAG_ANY);
+		if (!name) return;
+
+		modules = cf_section_sub_find(main_config.config, "modules");
+		if (!modules) return;
+
+		mi = module_find(modules, name->vp_strvalue);
+		if (!mi) return;
+
+		method = fr_pair_find_by_num(request->packet->vps, VENDORPEC_FREERADIUS,
+					     PW_FREERADIUS_STATS_MODULE_METHOD, TAG_ANY);
+		if (method) {
+			for (i = 0; i < MOD_COUNT; i++) {
+				if (strcmp(comp2str[i], method->vp_strvalue) == 0) break;
+			}
+			if (i == MOD_COUNT) return;
+		}
+
+		module_stats_get(&stats, mi, i);
+
+		fr_pair_add(&request->reply->vps, fr_pair_copy(request->reply, name));
+		if (method) fr_pair_add(&request->reply->vps, fr_pair_copy(request->reply, method));
+
+		vp = radius_pair_create(request->reply, &request->reply->vps,
+				       PW_FREERADIUS_STATS_MODULE_CALLS, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer64 = stats.calls;
+
+		vp = radius_pair_create(request->reply, &request->reply->vps,
+				       PW_FREERADIUS_STATS_MODULE_YIELDS, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer64 = stats.yields;
+
+		vp = radius_pair_create(request->reply, &request->reply->vps,
+				       PW_FREERADIUS_STATS_MODULE_ERRORS, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer64 = stats.rcodes[RLM_MODULE_FAIL] + stats.rcodes[RLM_MODULE_INVALID];
+
+		vp = radius_pair_create(request->reply, &request->reply->vps,
+				       PW_FREERADIUS_STATS_MODULE_LATENCY_AVERAGE, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = stats.calls ? (stats.usec / stats.calls) : 0;
+
+		vp = radius_pair_create(request->reply, &request->reply->vps,
+				       PW_FREERADIUS_STATS_MODULE_LATENCY_P50, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = module_stats_percentile(&stats, 50);
+
+		vp = radius_pair_create(request->reply, &request->reply->vps,
+				       PW_FREERADIUS_STATS_MODULE_LATENCY_P99, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = module_stats_percentile(&stats, 99);
+	}
+}
+
+/*
+ *	OpenMetrics export.
+ */
+typedef struct fr_stats2metric {
+	char const	*name;		//!< Metric family, without the "freeradius_" prefix.
+	char const	*help;
+	size_t		offset;		//!< Of the counter in fr_stats_t.
+} fr_stats2metric_t;
+
+static const fr_stats2metric_t stats_metrics[] = {
+	{ "requests", "Requests received.", offsetof(fr_stats_t, total_requests) },
+	{ "responses", "Responses sent.", offsetof(fr_stats_t, total_responses) },
+	{ "access_accepts", "Access-Accepts sent.", offsetof(fr_stats_t, total_access_accepts) },
+	{ "access_rejects", "Access-Rejects sent.", offsetof(fr_stats_t, total_access_rejects) },
+	{ "access_challenges", "Access-Challenges sent.", offsetof(fr_stats_t, total_access_challenges) },
+	{ "duplicate_requests", "Duplicate requests received.", offsetof(fr_stats_t, total_dup_requests) },
+	{ "invalid_requests", "Requests from unknown clients.", offsetof(fr_stats_t, total_invalid_requests) },
+	{ "malformed_requests", "Malformed requests received.", offsetof(fr_stats_t, total_malformed_requests) },
+	{ "bad_authenticators", "Requests with an invalid authenticator.",
+	  offsetof(fr_stats_t, total_bad_authenticators) },
+	{ "dropped_requests", "Requests which were dropped.", offsetof(fr_stats_t, total_packets_dropped) },
+	{ "no_records", "Accounting requests which weren't recorded.", offsetof(fr_stats_t, total_no_records) },
+	{ "unknown_types", "Packets with an unknown code.", offsetof(fr_stats_t, total_unknown_types) },
+	{ "timeouts", "Requests which timed out.", offsetof(fr_stats_t, total_timeouts) },
+	{ NULL, NULL, 0 }
+};
+
+/*
+ *	fr_stats_bins() bin N counts requests which took less than
+ *	10^(N + 1) microseconds.
+ */
+static char const *stats_bin_le[8] = {
+	"1e-05", "0.0001", "0.001", "0.01", "0.1", "1.0", "10.0", "+Inf"
+};
+
+typedef struct {
+	char const	*role;		//!< "server" or "proxy".
+	char const	*type;		//!< Type of packets.
+	fr_stats_t	stats;		//!< Copy of the counters.
+} fr_stats_snapshot_t;
+
+#define STATS_SNAPSHOT_MAX	(8)
+
+#define METRIC(_fmt, ...) do { \
+		out = talloc_asprintf_append_buffer(out, _fmt, ## __VA_ARGS__); \
+		if (!out) return NULL; \
+	} while (0)
+
+/** Add up the global counters
+ *
+ */
+static int stats_snapshot(fr_stats_snapshot_t *out)
+{
+	int num = 0;
+
+#define SNAPSHOT(_role, _type, _stats) do { \
+		out[num].role = _role; \
+		out[num].type = _type; \
+		fr_stats_merge(&out[num].stats, &_stats); \
+		num++; \
+	} while (0)
+
+	SNAPSHOT("server", "auth", radius_auth_stats);
+#ifdef WITH_ACCOUNTING
+	SNAPSHOT("server", "acct", radius_acct_stats);
+#endif
+#ifdef WITH_COA
+	SNAPSHOT("server", "coa", radius_coa_stats);
+	SNAPSHOT("server", "disconnect", radius_dsc_stats);
+#endif
+#ifdef WITH_PROXY
+	SNAPSHOT("proxy", "auth", proxy_auth_stats);
+#  ifdef WITH_ACCOUNTING
+	SNAPSHOT("proxy", "acct", proxy_acct_stats);
+#  endif
+#  ifdef WITH_COA
+	SNAPSHOT("proxy", "coa", proxy_coa_stats);
+	SNAPSHOT("proxy", "disconnect", proxy_dsc_stats);
+#  endif
+#endif
+#undef SNAPSHOT
+
+	return num;
+}
+
+/** Print module call counters and latency histograms
+ *
+ */
+static char *stats_openmetrics_modules(char *out)
+{
+	CONF_SECTION	*cs, *subcs;
+	int		i, j;
+
+	cs = cf_section_sub_find(main_config.config, "modules");
+	if (!cs) return out;
+
+	METRIC("# TYPE freeradius_module_calls counter\n"
+	       "# HELP freeradius_module_calls Completed calls to a module method.\n");
+	for (subcs = cf_subsection_find_next(cs, NULL, NULL);
+	     subcs;
+	     subcs = cf_subsection_find_next(cs, subcs, NULL)) {
+		module_instance_t const *mi;
+		char const *name = cf_section_name2(subcs) ? cf_section_name2(subcs) : cf_section_name1(subcs);
+
+		mi = module_find(cs, name);
+		if (!mi) continue;
+
+		for (i = 0; i < MOD_COUNT; i++) {
+			module_method_stats_t stats;
+
+			if (!mi->module->methods[i]) continue;
+
+			module_stats_get(&stats, mi, i);
+
+			METRIC("freeradius_module_calls_total{module=\"%s\",method=\"%s\"} %" PRIu64 "\n",
+			       name, comp2str[i], stats.calls);
+		}
+	}
+
+	METRIC("# TYPE freeradius_module_yields counter\n"
+	       "# HELP freeradius_module_yields Calls to a module method which yielded.\n");
+	for (subcs = cf_subsection_find_next(cs, NULL, NULL);
+	     subcs;
+	     subcs = cf_subsection_find_next(cs, subcs, NULL)) {
+		module_instance_t const *mi;
+		char const *name = cf_section_name2(subcs) ? cf_section_name2(subcs) : cf_section_name1(subcs);
+
+		mi = module_find(cs, name);
+		if (!mi) continue;
+
+		for (i = 0; i < MOD_COUNT; i++) {
+			module_method_stats_t stats;
+
+			if (!mi->module->methods[i]) continue;
+
+			module_stats_get(&stats, mi, i);
+
+			METRIC("freeradius_module_yields_total{module=\"%s\",method=\"%s\"} %" PRIu64 "\n",
+			       name, comp2str[i], stats.yields);
+		}
+	}
+
+	METRIC("# TYPE freeradius_module_results counter\n"
+	       "# HELP freeradius_module_results Results returned by a module method.\n");
+	for (subcs = cf_subsection_find_next(cs, NULL, NULL);
+	     subcs;
+	     subcs = cf_subsection_find_next(cs, subcs, NULL)) {
+		module_instance_t const *mi;
+		char const *name = cf_section_name2(subcs) ? cf_section_name2(subcs) : cf_section_name1(subcs);
+
+		mi = module_find(cs, name);
+		if (!mi) continue;
+
+		for (i = 0; i < MOD_COUNT; i++) {
+			module_method_stats_t stats;
+
+			if (!mi->module->methods[i]) continue;
+
+			module_stats_get(&stats, mi, i);
+
+			for (j = 0; j < RLM_MODULE_NUMCODES; j++) {
+				if (!stats.rcodes[j]) continue;
+
+				METRIC("freeradius_module_results_total{module=\"%s\",method=\"%s\",rcode=\"%s\"} "
+				       "%" PRIu64 "\n",
+				       name, comp2str[i], fr_int2str(mod_rcode_table, j, "invalid"), stats.rcodes[j]);
+			}
+		}
+	}
+
+	METRIC("# TYPE freeradius_module_latency_seconds histogram\n"
+	       "# HELP freeradius_module_latency_seconds How long calls to a module method took.\n");
+	for (subcs = cf_subsection_find_next(cs, NULL, NULL);
+	     subcs;
+	     subcs = cf_subsection_find_next(cs, subcs, NULL)) {
+		module_instance_t const *mi;
+		char const *name = cf_section_name2(subcs) ? cf_section_name2(subcs) : cf_section_name1(subcs);
+
+		mi = module_find(cs, name);
+		if (!mi) continue;
+
+		for (i = 0; i < MOD_COUNT; i++) {
+			module_method_stats_t	stats;
+			uint64_t		count = 0;
+
+			if (!mi->module->methods[i]) continue;
+
+			module_stats_get(&stats, mi, i);
+
+			/*
+			 *	Bucket N counts calls which took less
+			 *	than 2^N microseconds.
+			 */
+			for (j = 0; j < (MODULE_STATS_BUCKETS - 1); j++) {
+				count += stats.latency[j];
+				METRIC("freeradius_module_latency_seconds_bucket{module=\"%s\",method=\"%s\","
+				       "le=\"%g\"} %" PRIu64 "\n",
+				       name, comp2str[i], (double) ((uint64_t) 1 << j) / USEC, count);
+			}
+			count += stats.latency[j];
+
+			METRIC("freeradius_module_latency_seconds_bucket{module=\"%s\",method=\"%s\",le=\"+Inf\"} "
+			       "%" PRIu64 "\n", name, comp2str[i], count);
+			METRIC("freeradius_module_latency_seconds_count{module=\"%s\",method=\"%s\"} %" PRIu64 "\n",
+			       name, comp2str[i], count);
+			METRIC("freeradius_module_latency_seconds_sum{module=\"%s\",method=\"%s\"} %.6f\n",
+			       name, comp2str[i], (double) stats.usec / USEC);
+		}
+	}
+
+	return out;
+}
+
+/** Print the memory used by modules and subsystems
+ *
+ */
+static char *stats_openmetrics_memory(char *out)
+{
+	mem_account_stats_t	*acct;
+	size_t			num, i;
+
+	/*
+	 *	Parented by the output, so it's freed if
+	 *	we run out of memory part way through.
+	 */
+	acct = mem_account_snapshot(out, &num);
+	if (!acct) return out;
+
+	METRIC("# TYPE freeradius_memory_bytes gauge\n"
+	       "# HELP freeradius_memory_bytes Memory used by a module or subsystem.\n");
+	for (i = 0; i < num; i++) {
+		METRIC("freeradius_memory_bytes{type=\"%s\",name=\"%s\"} %" PRIu64 "\n",
+		       acct[i].type, acct[i].name, acct[i].bytes);
+	}
+
+	METRIC("# TYPE freeradius_memory_objects gauge\n"
+	       "# HELP freeradius_memory_objects Objects allocated by a module or subsystem.\n");
+	for (i = 0; i < num; i++) {
+		METRIC("freeradius_memory_objects{type=\"%s\",name=\"%s\"} %" PRIu64 "\n",
+		       acct[i].type, acct[i].name, acct[i].objects);
+	}
+
+	METRIC("# TYPE freeradius_memory_limit_bytes gauge\n"
+	       "# HELP freeradius_memory_limit_bytes Soft limit on the memory used by a module or subsystem.\n");
+	for (i = 0; i < num; i++) {
+		if (!acct[i].limit) continue;
+
+		METRIC("freeradius_memory_limit_bytes{type=\"%s\",name=\"%s\"} %" PRIu64 "\n",
+		       acct[i].type, acct[i].name, acct[i].limit);
+	}
+
+	talloc_free(acct);
+
+	return out;
+}
+
+/** Print the kernel drop counters of the UDP sockets
+ *
+ */
+static char *stats_openmetrics_sockets(char *out)
+{
+	rad_listen_t	*this;
+	bool		header = false;
+
+	for (this = main_config.listen; this != NULL; this = this->next) {
+		listen_socket_t	*sock;
+		char		name[256];
+
+		if ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		    && (this->type != RAD_LISTEN_ACCT)
+#endif
+#ifdef WITH_COA
+		    && (this->type != RAD_LISTEN_COA)
+#endif
+		    ) continue;
+
+		sock = this->data;
+		if (sock->proto != IPPROTO_UDP) continue;
+
+		if (!header) {
+			METRIC("# TYPE freeradius_socket_kernel_drops counter\n"
+			       "# HELP freeradius_socket_kernel_drops Packets the kernel dropped, "
+			       "as the receive buffer of the socket was full.\n");
+			header = true;
+		}
+
+		this->print(this, name, sizeof(name));
+
+		METRIC("freeradius_socket_kernel_drops_total{socket=\"%s\"} %" PRIu64 "\n",
+		       name, __atomic_load_n(&sock->drops, __ATOMIC_RELAXED));
+	}
+
+	if (!header) return out;
+
+	METRIC("# TYPE freeradius_socket_recv_buff_bytes gauge\n"
+	       "# HELP freeradius_socket_recv_buff_bytes Size of the receive buffer of the socket.\n");
+	for (this = main_config.listen; this != NULL; this = this->next) {
+		listen_socket_t	*sock;
+		char		name[256];
+
+		if ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		    && (this->type != RAD_LISTEN_ACCT)
+#endif
+#ifdef WITH_COA
+		    && (this->type != RAD_LISTEN_COA)
+#endif
+		    ) continue;
+
+		sock = this->data;
+		if (sock->proto != IPPROTO_UDP) continue;
+
+		this->print(this, name, sizeof(name));
+
+		METRIC("freeradius_socket_recv_buff_bytes{socket=\"%s\"} %u\n",
+		       name, __atomic_load_n(&sock->recv_buff_now, __ATOMIC_RELAXED));
+	}
+
+	return out;
+}
+
+/** Print the server statistics in OpenMetrics text format
+ *
+ * Produces the global request counters and latency histograms for the server (and the proxy,
+ * if it's enabled), the call counters and latency histograms of every module, the memory
+ * used by modules and subsystems, and the kernel drop counters of the UDP sockets.
+ *
+ * @param[in] ctx	to allocate the output in.
+ * @return
+ *	- The metrics, terminated with "# EOF".
+ *	- NULL if we ran out of memory.
+ */
+char *radius_stats_openmetrics(TALLOC_CTX *ctx)
+{
+	fr_stats_snapshot_t	snapshot[STATS_SNAPSHOT_MAX];
+	int			num, i, j;
+	char			*out;
+
+	num = stats_snapshot(snapshot);
+
+	out = talloc_typed_asprintf(ctx, "# TYPE freeradius_start_time_seconds gauge\n"
+				    "# HELP freeradius_start_time_seconds When the server was started.\n"
+				    "freeradius_start_time_seconds %ld.%06ld\n"
+				    "# TYPE freeradius_hup_time_seconds gauge\n"
+				    "# HELP freeradius_hup_time_seconds When the server last reloaded its "
+				    "configuration.\n"
+				    "freeradius_hup_time_seconds %ld.%06ld\n",
+				    (long) start_time.tv_sec, (long) start_time.tv_usec,
+				    (long) hup_time.tv_sec, (long) hup_time.tv_usec);
+	if (!out) return NULL;
+
+	for (i = 0; stats_metrics[i].name; i++) {
+		METRIC("# TYPE freeradius_%s counter\n# HELP freeradius_%s %s\n",
+		       stats_metrics[i].name, stats_metrics[i].name, stats_metrics[i].help);
+
+		for (j = 0; j < num; j++) {
+			fr_uint_t counter;
+
+			counter = *(fr_uint_t const *) (((uint8_t const *) &snapshot[j].stats) + stats_metrics[i].offset);
+
+			METRIC("freeradius_%s_total{role=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+			       stats_metrics[i].name, snapshot[j].role, snapshot[j].type, (uint64_t) counter);
+		}
+	}
+
+	METRIC("# TYPE freeradius_request_latency_seconds histogram\n"
+	       "# HELP freeradius_request_latency_seconds How long requests took to process.\n");
+	for (j = 0; j < num; j++) {
+		uint64_t count = 0;
+
+		for (i = 0; i < 8; i++) {
+			count += snapshot[j].stats.elapsed[i];
+			METRIC("freeradius_request_latency_seconds_bucket{role=\"%s\",type=\"%s\",le=\"%s\"} "
+			       "%" PRIu64 "\n", snapshot[j].role, snapshot[j].type, stats_bin_le[i], count);
+		}
+		METRIC("freeradius_request_latency_seconds_count{role=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+		       snapshot[j].role, snapshot[j].type, count);
+	}
+
+	out = stats_openmetrics_modules(out);
+	if (!out) return NULL;
+
+	out = stats_openmetrics_memory(out);
+	if (!out) return NULL;
+
+	out = stats_openmetrics_sockets(out);
+	if (!out) return NULL;
+
+	METRIC("# EOF\n");
+
+	return out;
 }
+#undef METRIC
 
 void radius_stats_init(int flag)
 {
@@ -29,6 +29,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/trace.h>
 
 #ifdef HAVE_SYS_WAIT_H
 #  include <sys/wait.h>
@@ -128,6 +129,7 @@ typedef struct THREAD_POOL {
 	fr_pps_t	pps_in, pps_out;
 #ifdef WITH_ACCOUNTING
 	bool		auto_limit_acct;
+	time_t		overload_time;	//!< When the kernel last dropped packets.
 #endif
 #endif
 
@@ -266,6 +268,7 @@ void request_enqueue(REQUEST *request)
 	THREAD_HANDLE *thread;
 	THREAD_HANDLE *found = NULL;
 	char data = 0;
+	bool wake;
 
 	request->component = "<core>";
 
@@ -292,13 +295,31 @@ void request_enqueue(REQUEST *request)
 	request->child_state = REQUEST_QUEUED;
 	request->module = "<queue>";
 
+	trace_request_queued(request);
+	FR_PROBE1(request__enqueue, request->number);
+
 	found = thread_pool.thread_head;
 
-	for (thread = thread_pool.thread_head;
-	     thread != NULL;
-	     thread = thread->next) {
-		if (fr_heap_num_elements(found->backlog) > fr_heap_num_elements(thread->backlog)) {
-			found = thread;
+	/*
+	 *	Requests with an affinity always go to the same
+	 *	thread, so long as the number of threads doesn't
+	 *	change.  Otherwise pick the least busy thread.
+	 */
+	if (request->affinity && (thread_pool.total_threads > 0)) {
+		uint32_t i = request->affinity % thread_pool.total_threads;
+
+		for (thread = thread_pool.thread_head;
+		     (thread != NULL) && (i > 0);
+		     thread = thread->next, i--);
+
+		if (thread) found = thread;
+	} else {
+		for (thread = thread_pool.thread_head;
+		     thread != NULL;
+		     thread = thread->next) {
+			if (fr_heap_num_elements(found->backlog) > fr_heap_num_elements(thread->backlog)) {
+				found = thread;
+			}
 		}
 	}
 
@@ -308,6 +329,7 @@ void request_enqueue(REQUEST *request)
 	DEBUG3("Thread %d being signalled", thread->thread_num);
 
 	pthread_mutex_lock(&thread->backlog_mutex);
+	wake = (fr_heap_num_elements(thread->backlog) == 0);
 	fr_heap_insert(thread->backlog, request);
 	request->backlog = thread->backlog;
 	request->thread_ctx = thread;
@@ -316,8 +338,14 @@ void request_enqueue(REQUEST *request)
 	/*
 	 *	Tell the thread that there's a request available for
 	 *	it, once we're done all of the above work.
+	 *
+	 *	The thread drains the whole backlog every time it's
+	 *	woken up, and always before it waits.  So it only
+	 *	needs waking when the backlog was empty.  Requests
+	 *	added to a non-empty backlog are picked up with the
+	 *	ones already there.
 	 */
-	(void) write(thread->pipe_fd[1], &data, 1);
+	if (wake) (void) write(thread->pipe_fd[1], &data, 1);
 }
 
 /*
@@ -415,6 +443,9 @@ static void thread_process_request(THREAD_HANDLE *thread, REQUEST *request)
 		thread->thread_num, request->number,
 		thread->request_count);
 
+	trace_request_dequeued(request);
+	FR_PROBE2(request__dequeue, request->number, thread->thread_num);
+
 	request->child_pid = thread->pthread_id;
 	request->component = "<core>";
 	request->module = NULL;
@@ -955,6 +986,57 @@ void thread_pool_stop(void)
 #endif
 }
 
+/** Tell the thread pool that the kernel is dropping packets
+ *
+ * The kernel only drops packets when the receive buffer of a socket is
+ * full, which means the workers aren't keeping up with the offered load.
+ *
+ * @param[in] now	the current time.
+ */
+void thread_pool_overloaded(UNUSED time_t now)
+{
+#if !defined(WITH_GCD) && defined(WITH_STATS) && defined(WITH_ACCOUNTING)
+	thread_pool.overload_time = now;
+#endif
+}
+
+/** Decide whether to discard a new accounting request
+ *
+ * If "auto_limit_acct" is set, half of the accounting requests received
+ * within a second of the kernel dropping packets are discarded.  The NAS
+ * will retransmit them, and the server gets a chance to catch up.
+ *
+ * @param[in] now	the current time.
+ * @return true if the request should be discarded.
+ */
+bool thread_pool_limit_acct(UNUSED time_t now)
+{
+#if !defined(WITH_GCD) && defined(WITH_STATS) && defined(WITH_ACCOUNTING)
+	if (!thread_pool.auto_limit_acct || !thread_pool.overload_time) return false;
+
+	if ((now - thread_pool.overload_time) > 1) return false;
+
+	return ((fr_rand() & 0x01) == 0);
+#else
+	return false;
+#endif
+}
+
+/** Check whether the kernel has dropped packets recently
+ *
+ * @param[in] now	the current time.
+ * @return true if packets were dropped within the last second.
+ */
+bool thread_pool_is_overloaded(UNUSED time_t now)
+{
+#if !defined(WITH_GCD) && defined(WITH_STATS) && defined(WITH_ACCOUNTING)
+	if (!thread_pool.overload_time) return false;
+
+	return ((now - thread_pool.overload_time) <= 1);
+#else
+	return false;
+#endif
+}
 
 #ifdef WITH_GCD
 void request_enqueue(REQUEST *request)
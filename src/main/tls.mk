@@ -1,9 +1,11 @@
 SOURCES	+= ${top_srcdir}/src/main/tls/cache.c \
+    ${top_srcdir}/src/main/tls/cache_local.c \
     ${top_srcdir}/src/main/tls/conf.c \
     ${top_srcdir}/src/main/tls/ctx.c \
     ${top_srcdir}/src/main/tls/global.c \
     ${top_srcdir}/src/main/tls/log.c \
     ${top_srcdir}/src/main/tls/ocsp.c \
     ${top_srcdir}/src/main/tls/session.c \
+    ${top_srcdir}/src/main/tls/ticket.c \
     ${top_srcdir}/src/main/tls/utils.c \
     ${top_srcdir}/src/main/tls/validate.c
@@ -266,6 +266,23 @@ int tls_cache_write(REQUEST *request, tls_session_t *tls_session)
 		return 1;
 	}
 
+	if (conf->session_cache_local) {
+		if (tls_cache_local_store(conf->session_cache_local,
+					  tls_session->session_id, talloc_array_length(tls_session->session_id),
+					  tls_session->session_blob, talloc_array_length(tls_session->session_blob),
+					  conf->session_cache_lifetime) < 0) {
+			RWDEBUG("Failed storing session data in local cache: %s", fr_strerror());
+			if (!conf->session_cache_server) return -1;
+		} else {
+			RDEBUG2("Stored session data in local cache");
+		}
+	}
+
+	/*
+	 *	Sessions may only be resumable using tickets.
+	 */
+	if (!conf->session_cache_server) return conf->session_cache_local ? 0 : 1;
+
 	if (tls_cache_attrs(request, tls_session->session_id, talloc_array_length(tls_session->session_id),
 			    CACHE_ACTION_SESSION_WRITE) < 0) {
 		RWDEBUG("Failed adding session key to the request");
@@ -309,7 +326,67 @@ int tls_cache_write(REQUEST *request, tls_session_t *tls_session)
 	return ret;
 }
 
+/** Deserialise session data, and validate the session
+ *
+ * @param[in] request	The current request.
+ * @param[in] ssl	session state.
+ * @param[in] data	Serialised session.
+ * @param[in] len	Length of the serialised session.
+ * @return
+ *	- Deserialised session data on success.
+ *	- NULL on error.
+ */
+static SSL_SESSION *tls_cache_session_load(REQUEST *request, SSL *ssl, uint8_t const *data, size_t len)
+{
+	unsigned char const	**p;
+	uint8_t const		*q;
+	SSL_SESSION		*sess;
+
+	q = data;	/* openssl will mutate q, so we can't use data directly */
+	p = (unsigned char const **)&q;
+
+	sess = d2i_SSL_SESSION(NULL, p, len);
+	if (!sess) {
+		RWDEBUG("Failed loading persisted session: %s", ERR_error_string(ERR_get_error(), NULL));
+		return NULL;
+	}
+	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", len);
+
+	/*
+	 *	OpenSSL's API is very inconsistent.
+	 *
+	 *	We need to set external data here, so it can be
+	 *	retrieved in tls_cache_delete.
+	 *
+	 *	ex_data is not serialised in i2d_SSL_SESSION
+	 *	so we don't have to bother unsetting it.
+	 */
+	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION));
+
+	/*
+	 *	SSL_set_session increases the reference could
+	 *	on the session, so when OpenSSL attempts to
+	 *	free it, when setting our returned session
+	 *	it becomes a noop.
+	 *
+	 *	Spent many hours trying to find a better place
+	 *	to do validation than this, but it seems
+	 *	like this is the only way.
+	 */
+	SSL_set_session(ssl, sess);
+	if (tls_validate_client_cert_chain(ssl) != 1) {
+		RWDEBUG("Validation failed, forcefully expiring resumed session");
+		SSL_SESSION_set_timeout(sess, 0);
+	}
+
+	return sess;
+}
+
 /** Read session data from the cache
+ *
+ * The local cache (if configured) is checked first.  If the session isn't
+ * found there, the virtual server (if configured) is called, and any session
+ * it returns is added to the local cache.
  *
  * @param[in] ssl session state.
  * @param[in] key to retrieve session data for.
@@ -331,21 +408,37 @@ static SSL_SESSION *tls_cache_read(SSL *ssl,
 {
 	fr_tls_conf_t		*conf;
 	REQUEST			*request;
-	unsigned char const	**p;
-	uint8_t const		*q;
 	VALUE_PAIR		*vp;
 	SSL_SESSION		*sess;
 
 	request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
 	conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 
+	*copy = 0;
+
+	if (conf->session_cache_local) {
+		uint8_t	*data;
+		ssize_t	len;
+
+		len = tls_cache_local_fetch(request, &data, conf->session_cache_local, key, key_len);
+		if (len > 0) {
+			RDEBUG2("Found session in local cache");
+			sess = tls_cache_session_load(request, ssl, data, len);
+			talloc_free(data);
+			if (sess) return sess;
+		}
+	}
+
+	if (!conf->session_cache_server) {
+		RWDEBUG("No cached session found");
+		return NULL;
+	}
+
 	if (tls_cache_attrs(request, key, key_len, CACHE_ACTION_SESSION_READ) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		return NULL;
 	}
 
-	*copy = 0;
-
 	/*
 	 *	Call the virtual server to read the session
 	 */
@@ -365,41 +458,16 @@ static SSL_SESSION *tls_cache_read(SSL *ssl,
 		return NULL;
 	}
 
-	q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
-	p = (unsigned char const **)&q;
-
-	sess = d2i_SSL_SESSION(NULL, p, vp->vp_length);
-	if (!sess) {
-		RWDEBUG("Failed loading persisted session: %s", ERR_error_string(ERR_get_error(), NULL));
-		return NULL;
-	}
-	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", vp->vp_length);
+	sess = tls_cache_session_load(request, ssl, vp->vp_octets, vp->vp_length);
 
 	/*
-	 *	OpenSSL's API is very inconsistent.
-	 *
-	 *	We need to set external data here, so it can be
-	 *	retrieved in tls_cache_delete.
-	 *
-	 *	ex_data is not serialised in i2d_SSL_SESSION
-	 *	so we don't have to bother unsetting it.
-	 */
-	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION));
-
-	/*
-	 *	SSL_set_session increases the reference could
-	 *	on the session, so when OpenSSL attempts to
-	 *	free it, when setting our returned session
-	 *	it becomes a noop.
-	 *
-	 *	Spent many hours trying to find a better place
-	 *	to do validation than this, but it seems
-	 *	like this is the only way.
+	 *	Populate the local cache, so the next
+	 *	resumption doesn't need the virtual server.
 	 */
-	SSL_set_session(ssl, sess);
-	if (tls_validate_client_cert_chain(ssl) != 1) {
-		RWDEBUG("Validation failed, forcefully expiring resumed session");
-		SSL_SESSION_set_timeout(sess, 0);
+	if (sess && conf->session_cache_local &&
+	    (tls_cache_local_store(conf->session_cache_local, key, key_len, vp->vp_octets, vp->vp_length,
+				   conf->session_cache_lifetime) < 0)) {
+		RDEBUG2("Not adding session to local cache: %s", fr_strerror());
 	}
 
 	/*
@@ -441,6 +509,10 @@ static void tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
 		return;
 	}
 
+	if (conf->session_cache_local) tls_cache_local_delete(conf->session_cache_local, key, (size_t)key_len);
+
+	if (!conf->session_cache_server) return;
+
 	if (tls_cache_attrs(request, key, (size_t)key_len, CACHE_ACTION_SESSION_DELETE) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		goto error;
@@ -0,0 +1,443 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/cache_local.c
+ * @brief Native cache of serialised TLS sessions, optionally in shared memory.
+ *
+ * The cache is set associative.  An entry's session ID selects a set, and
+ * within the set the least recently used entry is evicted.  Each set has its
+ * own lock, so threads (and processes) only contend when they touch sessions
+ * which hash to the same set.
+ *
+ * All entries are stored in a single contiguous region, so the same layout
+ * works whether the region is heap memory private to this process, or a POSIX
+ * shared memory segment shared by multiple servers on the same host.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define TLS_CACHE_LOCAL_WAYS	8		//!< Entries per set.
+#define TLS_CACHE_LOCAL_MAGIC	0x544c5343	//!< "TLSC", marks an initialised segment.
+
+/** Metadata for a single cached session
+ *
+ */
+typedef struct {
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];	//!< Session ID.
+	uint8_t		id_len;			//!< Length of the session ID.  0 if the entry is free.
+	uint32_t	len;			//!< Length of the serialised session.
+	time_t		expires;		//!< When the entry can no longer be used.
+	uint64_t	used;			//!< Value of the set's clock when the entry was last used.
+} tls_cache_local_entry_t;
+
+/** A set of entries sharing a lock
+ *
+ * Followed in memory by #TLS_CACHE_LOCAL_WAYS buffers of max_size bytes.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;
+	uint64_t		clock;		//!< Incremented on every access, for LRU.
+	tls_cache_local_entry_t	entry[TLS_CACHE_LOCAL_WAYS];
+} tls_cache_local_set_t;
+
+/** Start of the region, used to check shared segments are compatible
+ *
+ */
+typedef struct {
+	uint32_t	magic;			//!< #TLS_CACHE_LOCAL_MAGIC once initialised.
+	uint32_t	num_sets;
+	uint32_t	max_size;
+	uint32_t	set_size;
+} tls_cache_local_hdr_t;
+
+struct tls_cache_local {
+	char const		*shm_name;	//!< Name of the shared memory segment, or NULL.
+	uint8_t			*region;	//!< Containing the header and all sets.
+	size_t			region_size;	//!< Length of the region.
+	bool			mapped;		//!< Whether the region was mmapped.
+
+	uint32_t		num_sets;	//!< Number of sets in the region.
+	uint32_t		max_size;	//!< Largest session we can store.
+	size_t			set_size;	//!< Size of one set and its data buffers.
+};
+
+#define SET_OFFSET(_lc) (((sizeof(tls_cache_local_hdr_t) + 63) / 64) * 64)
+
+static inline tls_cache_local_set_t *tls_cache_local_set(tls_cache_local_t *lc, uint8_t const *id, size_t id_len)
+{
+	return (tls_cache_local_set_t *)(lc->region + SET_OFFSET(lc) +
+					 ((fr_hash(id, id_len) % lc->num_sets) * lc->set_size));
+}
+
+static inline uint8_t *tls_cache_local_data(tls_cache_local_t *lc, tls_cache_local_set_t *set, int way)
+{
+	return ((uint8_t *)(set + 1)) + (way * lc->max_size);
+}
+
+/** Lock a set, recovering it if another process died whilst holding the lock
+ *
+ */
+static void tls_cache_local_lock(tls_cache_local_set_t *set)
+{
+#ifdef PTHREAD_MUTEX_ROBUST
+	if (pthread_mutex_lock(&set->mutex) == EOWNERDEAD) {
+		/*
+		 *	The entries may be half written, discard them.
+		 */
+		memset(set->entry, 0, sizeof(set->entry));
+		pthread_mutex_consistent(&set->mutex);
+	}
+#else
+	pthread_mutex_lock(&set->mutex);
+#endif
+}
+
+static inline int tls_cache_local_find(tls_cache_local_set_t *set, uint8_t const *id, size_t id_len)
+{
+	int i;
+
+	for (i = 0; i < TLS_CACHE_LOCAL_WAYS; i++) {
+		if ((set->entry[i].id_len == id_len) && (memcmp(set->entry[i].id, id, id_len) == 0)) return i;
+	}
+
+	return -1;
+}
+
+/** Initialise all sets in a new region
+ *
+ */
+static int tls_cache_local_format(tls_cache_local_t *lc)
+{
+	pthread_mutexattr_t	attr;
+	uint32_t		i;
+	tls_cache_local_hdr_t	*hdr = (tls_cache_local_hdr_t *)lc->region;
+
+	pthread_mutexattr_init(&attr);
+	if (lc->shm_name) {
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_MUTEX_ROBUST
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	}
+
+	for (i = 0; i < lc->num_sets; i++) {
+		tls_cache_local_set_t *set;
+
+		set = (tls_cache_local_set_t *)(lc->region + SET_OFFSET(lc) + (i * lc->set_size));
+		if (pthread_mutex_init(&set->mutex, &attr) != 0) {
+			pthread_mutexattr_destroy(&attr);
+			fr_strerror_printf("Failed initialising mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	hdr->num_sets = lc->num_sets;
+	hdr->max_size = lc->max_size;
+	hdr->set_size = lc->set_size;
+	__atomic_store_n(&hdr->magic, TLS_CACHE_LOCAL_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/** Create or attach to a shared memory segment
+ *
+ */
+static int tls_cache_local_shm_open(tls_cache_local_t *lc)
+{
+	int			fd, i;
+	bool			created = true;
+	tls_cache_local_hdr_t	*hdr;
+
+	fd = shm_open(lc->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if ((fd < 0) && (errno == EEXIST)) {
+		created = false;
+		fd = shm_open(lc->shm_name, O_RDWR, 0600);
+	}
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening shared memory segment \"%s\": %s",
+				   lc->shm_name, fr_syserror(errno));
+		return -1;
+	}
+
+	if (created && (ftruncate(fd, lc->region_size) < 0)) {
+		fr_strerror_printf("Failed sizing shared memory segment \"%s\": %s",
+				   lc->shm_name, fr_syserror(errno));
+	error:
+		close(fd);
+		if (created) shm_unlink(lc->shm_name);
+		return -1;
+	}
+
+	lc->region = mmap(NULL, lc->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (lc->region == MAP_FAILED) {
+		lc->region = NULL;
+		fr_strerror_printf("Failed mapping shared memory segment \"%s\": %s",
+				   lc->shm_name, fr_syserror(errno));
+		goto error;
+	}
+	lc->mapped = true;
+	close(fd);
+
+	if (created) return tls_cache_local_format(lc);
+
+	/*
+	 *	Wait (briefly) for the creator to finish
+	 *	initialising the segment.
+	 */
+	hdr = (tls_cache_local_hdr_t *)lc->region;
+	for (i = 0; i < 100; i++) {
+		if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == TLS_CACHE_LOCAL_MAGIC) break;
+		usleep(10000);
+	}
+
+	if ((hdr->magic != TLS_CACHE_LOCAL_MAGIC) ||
+	    (hdr->num_sets != lc->num_sets) || (hdr->max_size != lc->max_size) || (hdr->set_size != lc->set_size)) {
+		fr_strerror_printf("Shared memory segment \"%s\" was created with a different max_entries "
+				   "or max_session_size", lc->shm_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _tls_cache_local_free(tls_cache_local_t *lc)
+{
+	uint32_t i;
+
+	if (!lc->region) return 0;
+
+	if (!lc->shm_name) {
+		for (i = 0; i < lc->num_sets; i++) {
+			pthread_mutex_destroy(&((tls_cache_local_set_t *)(lc->region + SET_OFFSET(lc) +
+									   (i * lc->set_size)))->mutex);
+		}
+	}
+
+	/*
+	 *	Shared segments are left for other servers
+	 *	still using them.
+	 */
+	if (lc->mapped) munmap(lc->region, lc->region_size);
+
+	return 0;
+}
+
+/** Allocate a new session cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Number of sessions to store.  Rounded up to a
+ *				multiple of the set size.
+ * @param[in] max_size		Largest serialised session we will store.
+ * @param[in] shm_name		If not NULL, the name of a POSIX shared memory
+ *				segment to store the sessions in.
+ * @return
+ *	- A new cache on success.
+ *	- NULL on error.
+ */
+tls_cache_local_t *tls_cache_local_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_size,
+					 char const *shm_name)
+{
+	tls_cache_local_t *lc;
+
+	rad_assert(max_entries > 0);
+
+	lc = talloc_zero(ctx, tls_cache_local_t);
+	if (!lc) return NULL;
+	talloc_set_destructor(lc, _tls_cache_local_free);
+
+	lc->num_sets = (max_entries + TLS_CACHE_LOCAL_WAYS - 1) / TLS_CACHE_LOCAL_WAYS;
+	lc->max_size = ((max_size + 7) / 8) * 8;
+	lc->set_size = (((sizeof(tls_cache_local_set_t) + (TLS_CACHE_LOCAL_WAYS * lc->max_size)) + 63) / 64) * 64;
+	lc->region_size = SET_OFFSET(lc) + (lc->num_sets * lc->set_size);
+
+	if (shm_name) {
+		lc->shm_name = talloc_typed_strdup(lc, shm_name);
+		if (tls_cache_local_shm_open(lc) < 0) {
+		error:
+			talloc_free(lc);
+			return NULL;
+		}
+		return lc;
+	}
+
+	lc->region = mmap(NULL, lc->region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (lc->region == MAP_FAILED) {
+		lc->region = NULL;
+		fr_strerror_printf("Failed allocating %zu bytes for session cache: %s",
+				   lc->region_size, fr_syserror(errno));
+		goto error;
+	}
+	lc->mapped = true;
+
+	if (tls_cache_local_format(lc) < 0) goto error;
+
+	return lc;
+}
+
+/** Store a serialised session
+ *
+ * @param[in] lc	to store the session in.
+ * @param[in] id	Session ID.
+ * @param[in] id_len	Length of the session ID.
+ * @param[in] data	Serialised session.
+ * @param[in] len	Length of the serialised session.
+ * @param[in] lifetime	How long the session may be resumed for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the session was too large.
+ */
+int tls_cache_local_store(tls_cache_local_t *lc, uint8_t const *id, size_t id_len,
+			  uint8_t const *data, size_t len, uint32_t lifetime)
+{
+	tls_cache_local_set_t	*set;
+	time_t			now;
+	int			i, way;
+
+	if ((id_len == 0) || (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)) {
+		fr_strerror_printf("Invalid session ID length %zu", id_len);
+		return -1;
+	}
+
+	if (len > lc->max_size) {
+		fr_strerror_printf("Session too large (%zu bytes, max_session_size is %u)", len, lc->max_size);
+		return -1;
+	}
+
+	now = time(NULL);
+	set = tls_cache_local_set(lc, id, id_len);
+
+	tls_cache_local_lock(set);
+
+	/*
+	 *	Replace an existing entry for this session, or a
+	 *	free or expired entry, or the least recently used.
+	 */
+	way = tls_cache_local_find(set, id, id_len);
+	if (way < 0) {
+		way = 0;
+		for (i = 0; i < TLS_CACHE_LOCAL_WAYS; i++) {
+			if (!set->entry[i].id_len || (set->entry[i].expires <= now)) {
+				way = i;
+				break;
+			}
+			if (set->entry[i].used < set->entry[way].used) way = i;
+		}
+	}
+
+	memcpy(set->entry[way].id, id, id_len);
+	set->entry[way].id_len = id_len;
+	set->entry[way].len = len;
+	set->entry[way].expires = now + lifetime;
+	set->entry[way].used = ++set->clock;
+	memcpy(tls_cache_local_data(lc, set, way), data, len);
+
+	pthread_mutex_unlock(&set->mutex);
+
+	return 0;
+}
+
+/** Retrieve a copy of a serialised session
+ *
+ * @param[in] ctx	to allocate the copy in.
+ * @param[out] out	Where to write the copy.
+ * @param[in] lc	to retrieve the session from.
+ * @param[in] id	Session ID.
+ * @param[in] id_len	Length of the session ID.
+ * @return
+ *	- The length of the serialised session.
+ *	- 0 if no session was found.
+ *	- -1 on error.
+ */
+ssize_t tls_cache_local_fetch(TALLOC_CTX *ctx, uint8_t **out, tls_cache_local_t *lc,
+			      uint8_t const *id, size_t id_len)
+{
+	tls_cache_local_set_t	*set;
+	int			way;
+	ssize_t			len;
+
+	*out = NULL;
+
+	if ((id_len == 0) || (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)) return 0;
+
+	set = tls_cache_local_set(lc, id, id_len);
+
+	tls_cache_local_lock(set);
+	way = tls_cache_local_find(set, id, id_len);
+	if (way < 0) {
+	miss:
+		pthread_mutex_unlock(&set->mutex);
+		return 0;
+	}
+
+	if (set->entry[way].expires <= time(NULL)) {
+		set->entry[way].id_len = 0;
+		goto miss;
+	}
+
+	len = set->entry[way].len;
+	*out = talloc_memdup(ctx, tls_cache_local_data(lc, set, way), len);
+	if (!*out) {
+		pthread_mutex_unlock(&set->mutex);
+		return -1;
+	}
+	set->entry[way].used = ++set->clock;
+
+	pthread_mutex_unlock(&set->mutex);
+
+	return len;
+}
+
+/** Remove a session
+ *
+ * @param[in] lc	to remove the session from.
+ * @param[in] id	Session ID.
+ * @param[in] id_len	Length of the session ID.
+ */
+void tls_cache_local_delete(tls_cache_local_t *lc, uint8_t const *id, size_t id_len)
+{
+	tls_cache_local_set_t	*set;
+	int			way;
+
+	if ((id_len == 0) || (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)) return;
+
+	set = tls_cache_local_set(lc, id, id_len);
+
+	tls_cache_local_lock(set);
+	way = tls_cache_local_find(set, id, id_len);
+	if (way >= 0) set->entry[way].id_len = 0;
+	pthread_mutex_unlock(&set->mutex);
+}
+#endif /* WITH_TLS */
@@ -44,6 +44,12 @@ static CONF_PARSER cache_config[] = {
 	{ FR_CONF_OFFSET("name", PW_TYPE_STRING, fr_tls_conf_t, session_id_name) },
 	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, fr_tls_conf_t, session_cache_lifetime), .dflt = "86400" },
 	{ FR_CONF_OFFSET("verify", PW_TYPE_BOOLEAN, fr_tls_conf_t, session_cache_verify), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, fr_tls_conf_t, session_cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_session_size", PW_TYPE_INTEGER, fr_tls_conf_t, session_cache_max_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("shared_memory", PW_TYPE_STRING, fr_tls_conf_t, session_cache_shm) },
+	{ FR_CONF_OFFSET("session_tickets", PW_TYPE_BOOLEAN, fr_tls_conf_t, session_tickets), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_rotation_interval", PW_TYPE_INTEGER, fr_tls_conf_t, session_ticket_rotate), .dflt = "3600" },
+	{ FR_CONF_OFFSET("ticket_key_file", PW_TYPE_FILE_INPUT, fr_tls_conf_t, session_ticket_key_file) },
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", PW_TYPE_BOOLEAN, fr_tls_conf_t, session_cache_require_extms), .dflt = "yes" },
@@ -51,7 +57,6 @@ static CONF_PARSER cache_config[] = {
 #endif
 
 	{ FR_CONF_DEPRECATED("enable", PW_TYPE_BOOLEAN, fr_tls_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("max_entries", PW_TYPE_INTEGER, fr_tls_conf_t, NULL) },
 	{ FR_CONF_DEPRECATED("persist_dir", PW_TYPE_STRING, fr_tls_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
@@ -60,6 +65,8 @@ static CONF_PARSER cache_config[] = {
 static CONF_PARSER verify_config[] = {
 	{ FR_CONF_OFFSET("tmpdir", PW_TYPE_STRING, fr_tls_conf_t, verify_tmp_dir) },
 	{ FR_CONF_OFFSET("client", PW_TYPE_STRING, fr_tls_conf_t, verify_client_cert_cmd) },
+	{ FR_CONF_OFFSET("cache_max_entries", PW_TYPE_INTEGER, fr_tls_conf_t, verify_cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_lifetime", PW_TYPE_INTEGER, fr_tls_conf_t, verify_cache_lifetime), .dflt = "3600" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -75,6 +82,10 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("timeout", PW_TYPE_INTEGER, fr_tls_ocsp_conf_t, timeout), .dflt = "yes" },
 	{ FR_CONF_OFFSET("softfail", PW_TYPE_BOOLEAN, fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
 
+	{ FR_CONF_OFFSET("cache_max_entries", PW_TYPE_INTEGER, fr_tls_ocsp_conf_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_max_ttl", PW_TYPE_INTEGER, fr_tls_ocsp_conf_t, cache_max_ttl), .dflt = "3600" },
+	{ FR_CONF_OFFSET("cache_refresh", PW_TYPE_INTEGER, fr_tls_ocsp_conf_t, cache_refresh), .dflt = "0" },
+
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -105,6 +116,9 @@ static CONF_PARSER tls_server_config[] = {
 	{ FR_CONF_OFFSET("check_cert_cn", PW_TYPE_STRING, fr_tls_conf_t, check_cert_cn) },
 	{ FR_CONF_OFFSET("cipher_list", PW_TYPE_STRING, fr_tls_conf_t, cipher_list) },
 	{ FR_CONF_OFFSET("cipher_server_preference", PW_TYPE_BOOLEAN, fr_tls_conf_t, cipher_server_preference), .dflt = "yes" },
+#ifdef SSL_MODE_ASYNC
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, fr_tls_conf_t, async), .dflt = "no" },
+#endif
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
 	{ FR_CONF_OFFSET("allow_renegotiation", PW_TYPE_BOOLEAN, fr_tls_conf_t, allow_renegotiation), .dflt = "no" },
 #endif
@@ -274,6 +288,12 @@ static int _conf_server_free(fr_tls_conf_t *conf)
 	for (i = 0; i < conf->ctx_count; i++) SSL_CTX_free(conf->ctx[i]);
 
 #ifdef HAVE_OPENSSL_OCSP_H
+	/*
+	 *	The refresh threads use the stores, so they
+	 *	must be stopped first.
+	 */
+	TALLOC_FREE(conf->ocsp.cache);
+	TALLOC_FREE(conf->staple.cache);
 	if (conf->ocsp.store) X509_STORE_free(conf->ocsp.store);
 	conf->ocsp.store = NULL;
 	if (conf->staple.store) X509_STORE_free(conf->staple.store);
@@ -332,7 +352,58 @@ fr_tls_conf_t *tls_conf_parse_server(CONF_SECTION *cs)
 	/*
 	 *	Setup session caching
 	 */
-	if (conf->session_cache_server) {
+	if (conf->session_cache_max_entries) {
+		if (conf->session_cache_shm && (conf->session_cache_shm[0] != '/')) {
+			ERROR("cache { shared_memory } must begin with '/'");
+			goto error;
+		}
+
+		conf->session_cache_local = tls_cache_local_alloc(conf, conf->session_cache_max_entries,
+								  conf->session_cache_max_size,
+								  conf->session_cache_shm);
+		if (!conf->session_cache_local) {
+			ERROR("Failed creating session cache: %s", fr_strerror());
+			goto error;
+		}
+	} else if (conf->session_cache_shm) {
+		ERROR("cache { shared_memory } requires cache { max_entries } to be set");
+		goto error;
+	}
+
+	/*
+	 *	Setup caching of verified certificate chains
+	 */
+	if (conf->verify_cache_max_entries) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		conf->verify_cache = tls_verify_cache_alloc(conf, conf);
+		if (!conf->verify_cache) {
+			ERROR("Failed creating verified chain cache: %s", fr_strerror());
+			goto error;
+		}
+#else
+		WARN("verify { cache_max_entries } requires OpenSSL >= 1.1.0, ignoring");
+#endif
+	}
+
+	if (conf->session_tickets) {
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+		/*
+		 *	Without the decrypt callback we can't tell whether
+		 *	the session completed authentication.
+		 */
+		ERROR("session_tickets requires OpenSSL >= 1.1.1");
+		goto error;
+#endif
+		conf->session_ticket_ring = tls_ticket_ring_alloc(conf, conf->session_ticket_key_file,
+								  conf->session_ticket_rotate,
+								  conf->session_cache_lifetime);
+		if (!conf->session_ticket_ring) {
+			ERROR("Failed loading session ticket keys: %s", fr_strerror());
+			goto error;
+		}
+	}
+
+	if (conf->session_cache_server || conf->session_cache_local || conf->session_tickets) {
 		/*
 		 *	Create a unique context Id per EAP-TLS configuration.
 		 */
@@ -379,11 +450,27 @@ fr_tls_conf_t *tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf->ocsp.enable) {
 		conf->ocsp.store = conf_ocsp_revocation_store(conf);
 		if (conf->ocsp.store == NULL) goto error;
+
+		if (conf->ocsp.cache_max_entries) {
+			conf->ocsp.cache = tls_ocsp_cache_alloc(conf, &conf->ocsp);
+			if (!conf->ocsp.cache) {
+				ERROR("Failed creating OCSP cache: %s", fr_strerror());
+				goto error;
+			}
+		}
 	}
 
 	if (conf->staple.enable) {
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
+
+		if (conf->staple.cache_max_entries) {
+			conf->staple.cache = tls_ocsp_cache_alloc(conf, &conf->staple);
+			if (!conf->staple.cache) {
+				ERROR("Failed creating OCSP staple cache: %s", fr_strerror());
+				goto error;
+			}
+		}
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
@@ -319,7 +319,7 @@ post_ca:
 	}
 
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET;
+	if (!conf->session_ticket_ring) ctx_options |= SSL_OP_NO_TICKET;
 #endif
 
 	if (!conf->disable_single_dh_use) {
@@ -361,6 +361,15 @@ post_ca:
 
 	SSL_CTX_set_options(ctx, ctx_options);
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	Crypto operations performed by an asynchronous
+	 *	engine (e.g. QAT) pause the handshake, instead
+	 *	of blocking the thread.
+	 */
+	if (conf->async) SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#endif
+
 	/*
 	 *	TODO: Set the RSA & DH
 	 *	SSL_CTX_set_tmp_rsa_callback(ctx, cbtls_rsa);
@@ -421,6 +430,7 @@ post_ca:
 	verify_mode |= SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
 	verify_mode |= SSL_VERIFY_CLIENT_ONCE;
 	SSL_CTX_set_verify(ctx, verify_mode, tls_validate_cert_cb);
+	if (conf->verify_cache) SSL_CTX_set_cert_verify_callback(ctx, tls_validate_chain_cb, app_data_index);
 
 	if (conf->verify_depth) {
 		SSL_CTX_set_verify_depth(ctx, conf->verify_depth);
@@ -465,7 +475,9 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	tls_cache_init(ctx, (bool)conf->session_cache_server, conf->session_context_id, conf->session_cache_lifetime);
+	tls_cache_init(ctx, conf->session_cache_server || conf->session_cache_local || conf->session_tickets,
+		       conf->session_context_id, conf->session_cache_lifetime);
+	if (conf->session_ticket_ring) tls_ticket_init(ctx);
 
 	/*
 	 *	Load dh params
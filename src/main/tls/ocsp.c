@@ -48,6 +48,10 @@ typedef enum {
  */
 #define OCSP_MAX_VALIDITY_PERIOD (5 * 60)
 
+/** How long to wait before retrying a failed refresh of a cached response
+ */
+#define OCSP_CACHE_RETRY_DELAY 10
+
 /** Convert OpenSSL's ASN1_TIME to an epoch time
  *
  * @param[out] out	Where to write the time_t.
@@ -300,12 +304,292 @@ int tls_ocsp_staple_cb(SSL *ssl, void *data)
 	return ret;
 }
 
-/** Sends a OCSP request to a defined OCSP responder
+/** An OCSP response held in the in-memory cache
  *
+ * Entries are keyed by the DER encoding of the OCSP_CERTID, which is
+ * the hash of the issuer's name and key, and the certificate's serial.
  */
-int tls_ocsp_check(REQUEST *request, SSL *ssl,
-		   X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
-		   fr_tls_ocsp_conf_t *conf, bool staple_response)
+typedef struct {
+	uint8_t		*key;			//!< DER encoded OCSP_CERTID.
+	size_t		key_len;		//!< Length of key.
+
+	uint8_t		*resp;			//!< DER encoded OCSP response.
+	size_t		resp_len;		//!< Length of resp.
+
+	ocsp_status_t	status;			//!< OCSP_STATUS_OK for good, OCSP_STATUS_FAILED
+						//!< for revoked or unknown.
+	time_t		next_update;		//!< nextUpdate from the response, 0 if absent.
+	time_t		expires;		//!< When we stop using this response.
+	time_t		retry;			//!< Don't attempt another refresh before this time.
+
+	X509_STORE	*store;			//!< To verify refreshed responses against.
+	X509		*client_cert;		//!< Copy of the certificate, so we can refresh.
+	X509		*issuer_cert;		//!< Copy of the issuer, so we can refresh.
+
+	bool		used;			//!< Looked up since it was last refreshed.
+	bool		refreshing;		//!< The refresh thread is querying the responder.
+} ocsp_cache_entry_t;
+
+/** In-memory OCSP response cache, shared by all threads
+ *
+ */
+struct tls_ocsp_cache {
+	pthread_mutex_t		mutex;		//!< Protects the tree and all entries.
+	pthread_cond_t		cond;		//!< Used to wake the refresh thread on exit.
+	rbtree_t		*tree;		//!< Entries, ordered by key.
+	fr_tls_ocsp_conf_t	*conf;		//!< OCSP configuration the cache belongs to.
+
+	bool			running;	//!< Whether the refresh thread was started.
+	bool			stop;		//!< Tell the refresh thread to exit.
+	pthread_t		thread;		//!< Refresh thread.
+};
+
+/** Walker context for evicting and selecting cache entries
+ *
+ */
+typedef struct {
+	time_t			now;
+	uint32_t		refresh;	//!< How long before expiry entries are refreshed.
+	ocsp_cache_entry_t	*oldest;	//!< Entry which expires soonest.
+	ocsp_cache_entry_t	*due;		//!< Entry which should be refreshed.
+} ocsp_cache_walk_t;
+
+static int ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one, *b = two;
+
+	if (a->key_len != b->key_len) return (a->key_len < b->key_len) - (a->key_len > b->key_len);
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _ocsp_cache_entry_free(ocsp_cache_entry_t *entry)
+{
+	if (entry->client_cert) X509_free(entry->client_cert);
+	if (entry->issuer_cert) X509_free(entry->issuer_cert);
+
+	return 0;
+}
+
+static void ocsp_cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+/** Remove expired entries, and find the entry which expires soonest
+ *
+ */
+static int _ocsp_cache_evict(void *ctx, void *data)
+{
+	ocsp_cache_walk_t	*walk = ctx;
+	ocsp_cache_entry_t	*entry = data;
+
+	if (entry->expires <= walk->now) return 2;
+
+	if (!walk->oldest || (entry->expires < walk->oldest->expires)) walk->oldest = entry;
+
+	return 0;
+}
+
+/** Remove expired entries, and find an entry which is due to be refreshed
+ *
+ * Only entries which have been looked up since they were last refreshed
+ * are refreshed, anything else is left to expire.
+ */
+static int _ocsp_cache_select(void *ctx, void *data)
+{
+	ocsp_cache_walk_t	*walk = ctx;
+	ocsp_cache_entry_t	*entry = data;
+
+	if (entry->expires <= walk->now) return 2;
+
+	if (walk->due || !entry->used || entry->refreshing || (entry->retry > walk->now)) return 0;
+
+	if ((entry->expires - walk->now) <= (time_t)walk->refresh) walk->due = entry;
+
+	return 0;
+}
+
+/** Generate the cache key for a certificate
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[out] key_len	Length of the key.
+ * @param[in] certid	to encode.
+ * @return
+ *	- The key on success.
+ *	- NULL on failure.
+ */
+static uint8_t *ocsp_cache_key(TALLOC_CTX *ctx, size_t *key_len, OCSP_CERTID *certid)
+{
+	uint8_t		*key, *p;
+	int		len;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if (len <= 0) return NULL;
+
+	key = p = talloc_array(ctx, uint8_t, len);
+	if (!key) return NULL;
+
+	if (i2d_OCSP_CERTID(certid, &p) != len) {
+		talloc_free(key);
+		return NULL;
+	}
+	*key_len = len;
+
+	return key;
+}
+
+/** Retrieve a cached OCSP response
+ *
+ * @param[out] resp		The decoded OCSP response.  May be NULL if the
+ *				caller doesn't need it.
+ * @param[out] next_update	nextUpdate from the response, 0 if absent.
+ * @param[in] cache		to search.
+ * @param[in] key		from #ocsp_cache_key.
+ * @param[in] key_len		Length of key.
+ * @return
+ *	- OCSP_STATUS_OK if the certificate is good.
+ *	- OCSP_STATUS_FAILED if the certificate is revoked or unknown.
+ *	- OCSP_STATUS_SKIPPED if no valid response was found.
+ */
+static ocsp_status_t ocsp_cache_find(OCSP_RESPONSE **resp, time_t *next_update,
+				     tls_ocsp_cache_t *cache, uint8_t *key, size_t key_len)
+{
+	ocsp_cache_entry_t	find, *entry;
+	ocsp_status_t		status = OCSP_STATUS_SKIPPED;
+
+	find.key = key;
+	find.key_len = key_len;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) goto done;
+
+	if (entry->expires <= time(NULL)) {
+		rbtree_deletebydata(cache->tree, entry);
+		goto done;
+	}
+
+	if (resp) {
+		unsigned char const *p = entry->resp;
+
+		*resp = d2i_OCSP_RESPONSE(NULL, &p, entry->resp_len);
+		if (!*resp) goto done;
+	}
+
+	entry->used = true;
+	*next_update = entry->next_update;
+	status = entry->status;
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return status;
+}
+
+/** Add or replace a response in the OCSP cache
+ *
+ * @param[in] cache		to add the response to.
+ * @param[in] store		the response was verified against.
+ * @param[in] key		from #ocsp_cache_key.
+ * @param[in] key_len		Length of key.
+ * @param[in] resp		A verified OCSP response.
+ * @param[in] status		OCSP_STATUS_OK or OCSP_STATUS_FAILED.
+ * @param[in] next_update	nextUpdate from the response, 0 if absent.
+ * @param[in] client_cert	the response is for.
+ * @param[in] issuer_cert	of client_cert.
+ */
+static void ocsp_cache_store(tls_ocsp_cache_t *cache, X509_STORE *store, uint8_t const *key, size_t key_len,
+			     OCSP_RESPONSE *resp, ocsp_status_t status, time_t next_update,
+			     X509 *client_cert, X509 *issuer_cert)
+{
+	ocsp_cache_entry_t	find, *entry;
+	ocsp_cache_walk_t	walk = { .now = time(NULL) };
+	uint8_t			*buff, *p;
+	time_t			expires;
+	int			len;
+
+	expires = walk.now + cache->conf->cache_max_ttl;
+	if (next_update) {
+		if (next_update <= walk.now) return;
+		if (next_update < expires) expires = next_update;
+	}
+
+	len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0) return;
+
+	buff = p = talloc_array(NULL, uint8_t, len);
+	if (!buff) return;
+	if (i2d_OCSP_RESPONSE(resp, &p) != len) {
+		talloc_free(buff);
+		return;
+	}
+
+	memcpy(&find.key, &key, sizeof(find.key));
+	find.key_len = key_len;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) {
+		if (rbtree_num_elements(cache->tree) >= cache->conf->cache_max_entries) {
+			rbtree_walk(cache->tree, RBTREE_DELETE_ORDER, _ocsp_cache_evict, &walk);
+			if (walk.oldest && (rbtree_num_elements(cache->tree) >= cache->conf->cache_max_entries)) {
+				rbtree_deletebydata(cache->tree, walk.oldest);
+			}
+		}
+
+		entry = talloc_zero(NULL, ocsp_cache_entry_t);
+		if (!entry) goto error;
+		talloc_set_destructor(entry, _ocsp_cache_entry_free);
+
+		entry->key = talloc_memdup(entry, key, key_len);
+		entry->key_len = key_len;
+		entry->client_cert = X509_dup(client_cert);
+		entry->issuer_cert = X509_dup(issuer_cert);
+		if (!entry->key || !entry->client_cert || !entry->issuer_cert ||
+		    !rbtree_insert(cache->tree, entry)) {
+			talloc_free(entry);
+			goto error;
+		}
+	} else {
+		talloc_free(entry->resp);
+	}
+
+	entry->store = store;
+	entry->resp = talloc_steal(entry, buff);
+	entry->resp_len = len;
+	entry->status = status;
+	entry->next_update = next_update;
+	entry->expires = expires;
+	entry->retry = 0;
+	entry->refreshing = false;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return;
+
+error:
+	pthread_mutex_unlock(&cache->mutex);
+	talloc_free(buff);
+}
+
+/** Query an OCSP responder about a certificate
+ *
+ * @param[out] out		The verified OCSP response, if one containing the
+ *				status of client_cert was received.
+ * @param[out] next_update	nextUpdate from the response, 0 if absent.
+ * @param[in] request		The current request.
+ * @param[in] ssl_log		BIO to accumulate OpenSSL messages in.
+ * @param[in] store		to validate the OCSP response against.
+ * @param[in] issuer_cert	of client_cert.
+ * @param[in] client_cert	to check.
+ * @param[in] conf		OCSP configuration.
+ * @return
+ *	- OCSP_STATUS_OK if the certificate is good.
+ *	- OCSP_STATUS_FAILED if the certificate was revoked, or the response was invalid.
+ *	- OCSP_STATUS_SKIPPED if the responder couldn't be queried.
+ */
+static ocsp_status_t ocsp_fetch(OCSP_RESPONSE **out, time_t *next_update_out, REQUEST *request, BIO *ssl_log,
+				X509_STORE *store, X509 *issuer_cert, X509 *client_cert, fr_tls_ocsp_conf_t *conf)
 {
 	OCSP_CERTID	*certid;
 	OCSP_REQUEST	*req = NULL;
@@ -317,7 +601,7 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	char		host_header[1024];
 	int		use_ssl = -1;
 	long		this_fudge = OCSP_MAX_VALIDITY_PERIOD, this_max_age = -1;
-	BIO		*conn = NULL, *ssl_log = NULL;
+	BIO		*conn = NULL;
 	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
 	ocsp_status_t	status;
 	ASN1_GENERALIZEDTIME *rev, *this_update, *next_update;
@@ -326,80 +610,11 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	OCSP_REQ_CTX	*ctx;
 	int		rc;
 	struct timeval	when;
-#endif
 	struct timeval	now = { 0, 0 };
-	time_t		next;
-	VALUE_PAIR	*vp;
-
-	if (conf->cache_server) switch (tls_cache_process(request, conf->cache_server,
-							       CACHE_ACTION_OCSP_READ)) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Told to force OCSP validation failure from cached response");
-		return OCSP_STATUS_FAILED;
-
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-	/*
-	 *	These are fine for OCSP too, we don't *expect* to always
-	 *	have a cached OCSP status.
-	 */
-	case RLM_MODULE_NOTFOUND:
-	case RLM_MODULE_NOOP:
-		break;
-
-	default:
-		RWDEBUG("Failed retrieving cached OCSP status");
-		break;
-	}
-
-	/*
-	 *	Allow us to cache the OCSP verified state externally
-	 */
-	vp = fr_pair_find_by_num(request->control, 0, PW_TLS_OCSP_CERT_VALID, TAG_ANY);
-	if (vp) switch (vp->vp_integer) {
-	case 0:	/* no */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = no, forcing OCSP failure");
-		return OCSP_STATUS_FAILED;
-
-	case 1: /* yes */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = yes, forcing OCSP success");
-
-		/*
-		 *	If this fails, and an OCSP stapled response is required,
-		 *	we need to run the full OCSP check.
-		 */
-		if (staple_response) {
-			vp = fr_pair_find_by_num(request->control, 0, PW_TLS_OCSP_RESPONSE, TAG_ANY);
-			if (!vp) {
-				RDEBUG2("No &control:TLS-OCSP-Response attribute found, performing full OCSP check");
-				break;
-			}
-			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
-				RWDEBUG("Failed setting OCSP staple response in SSL session");
-				return OCSP_STATUS_FAILED;
-			}
-		}
-
-		return OCSP_STATUS_OK;
-
-	case 2: /* skipped */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = skipped, skipping OCSP check");
-		return conf->softfail ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
-
-	case 3: /* unknown */
-	default:
-		break;
-	}
+#endif
 
-	/*
-	 *	Setup logging for this OCSP operation
-	 */
-	ssl_log = BIO_new(BIO_s_mem());
-	if (!ssl_log) {
-		REDEBUG("Failed creating log queue");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
-	}
+	*out = NULL;
+	*next_update_out = 0;
 
 	/*
 	 *	Create OCSP Request
@@ -468,8 +683,7 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	resp = OCSP_sendreq_bio(conn, path, req);
 	if (!resp) {
 		REDEBUG("Couldn't get OCSP response");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 #else
 	if (conf->timeout) BIO_set_nbio(conn, 1);
@@ -477,27 +691,23 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	rc = BIO_do_connect(conn);
 	if ((rc <= 0) && ((!conf->timeout) || !BIO_should_retry(conn))) {
 		REDEBUG("Couldn't connect to OCSP responder");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 
 	ctx = OCSP_sendreq_new(conn, path, NULL, -1);
 	if (!ctx) {
 		REDEBUG("Couldn't create OCSP request");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 
 	if (!OCSP_REQ_CTX_add1_header(ctx, "Host", host_header)) {
 		REDEBUG("Couldn't set Host header");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 
 	if (!OCSP_REQ_CTX_set1_req(ctx, req)) {
 		REDEBUG("Couldn't add data to OCSP request");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 
 	gettimeofday(&when, NULL);
@@ -513,8 +723,7 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 
 	if (conf->timeout && (rc == -1) && BIO_should_retry(conn)) {
 		REDEBUG("Response timed out");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 
 	OCSP_REQ_CTX_free(ctx);
@@ -522,8 +731,7 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	if (rc == 0) {
 		REDEBUG("Couldn't get OCSP response");
 		SSL_DRAIN_ERROR_QUEUE(REDEBUG, "", ssl_log);
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		goto skipped;
 	}
 #endif /* OPENSSL_VERSION_NUMBER < 0x1000003f */
 
@@ -594,29 +802,9 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	 *	When an OCSP validation command is used with OpenSSL
 	 *	next_update is NULL.
 	 */
-	if (next_update) {
-		/*
-		 *	Sometimes we already know what 'now' is depending
-		 *	on the code path, other times we don't.
-		 */
-		if (now.tv_sec == 0) gettimeofday(&now, NULL);
-		if (ocsp_asn1time_to_epoch(&next, next_update) < 0) {
-			REDEBUG("Failed parsing next_update time: %s", fr_strerror());
-			ocsp_status = OCSP_STATUS_SKIPPED;
-			goto finish;
-		}
-		if (now.tv_sec < next){
-			RDEBUG2("Adding OCSP TTL attribute");
-			RINDENT();
-			vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
-			vp->vp_integer = next - now.tv_sec;
-			rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
-			REXDENT();
-		} else {
-			RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
-		}
-	} else {
-		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
+	if (next_update && (ocsp_asn1time_to_epoch(next_update_out, next_update) < 0)) {
+		REDEBUG("Failed parsing next_update time: %s", fr_strerror());
+		goto skipped;
 	}
 
 	switch (status) {
@@ -644,6 +832,334 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 		break;
 	}
 
+	/*
+	 *	The response contains a verified status for
+	 *	the certificate, give it to the caller.
+	 */
+	*out = resp;
+	resp = NULL;
+	goto finish;
+
+skipped:
+	ocsp_status = OCSP_STATUS_SKIPPED;
+
+finish:
+	/* Free OCSP Stuff */
+	OCSP_REQUEST_free(req);
+	OCSP_BASICRESP_free(bresp);
+	OCSP_RESPONSE_free(resp);
+	OPENSSL_free(host);
+	OPENSSL_free(port);
+	OPENSSL_free(path);
+	BIO_free_all(conn);
+
+	return ocsp_status;
+}
+
+/** Query the responder for an entry which is close to expiring
+ *
+ * Called by the refresh thread without the cache mutex held.
+ */
+static void ocsp_cache_refresh(tls_ocsp_cache_t *cache, X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+			       uint8_t const *key, size_t key_len)
+{
+	REQUEST			*request;
+	BIO			*ssl_log;
+	OCSP_RESPONSE		*resp = NULL;
+	ocsp_status_t		status;
+	time_t			next_update;
+	ocsp_cache_entry_t	find, *entry;
+
+	/*
+	 *	ocsp_fetch() logs against a request, so give it
+	 *	one which writes to the main server log.
+	 */
+	request = request_alloc(NULL);
+	ssl_log = BIO_new(BIO_s_mem());
+	if (!request || !ssl_log) goto done;
+	request->module = "tls - ocsp - refresh";
+
+	status = ocsp_fetch(&resp, &next_update, request, ssl_log, store, issuer_cert, client_cert, cache->conf);
+	if (resp) {
+		ocsp_cache_store(cache, store, key, key_len, resp, status, next_update, client_cert, issuer_cert);
+		OCSP_RESPONSE_free(resp);
+		goto done;
+	}
+
+	while (ERR_get_error());
+
+	/*
+	 *	Keep using the old response until it expires,
+	 *	and try again a little later.
+	 */
+	memcpy(&find.key, &key, sizeof(find.key));
+	find.key_len = key_len;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) {
+		entry->refreshing = false;
+		entry->used = true;
+		entry->retry = time(NULL) + OCSP_CACHE_RETRY_DELAY;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+done:
+	if (ssl_log) BIO_free(ssl_log);
+	talloc_free(request);
+}
+
+/** Refresh cached responses before they expire
+ *
+ * This means clients presenting certificates we've seen before
+ * don't have to wait for the OCSP responder.
+ */
+static void *ocsp_cache_refresh_thread(void *arg)
+{
+	tls_ocsp_cache_t	*cache = arg;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		ocsp_cache_walk_t	walk = { .now = time(NULL), .refresh = cache->conf->cache_refresh };
+		ocsp_cache_entry_t	*entry;
+		X509			*client_cert, *issuer_cert;
+		X509_STORE		*store;
+		uint8_t			*key;
+		size_t			key_len;
+		struct timespec		ts;
+
+		rbtree_walk(cache->tree, RBTREE_DELETE_ORDER, _ocsp_cache_select, &walk);
+		entry = walk.due;
+		if (!entry) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&cache->cond, &cache->mutex, &ts);
+			continue;
+		}
+
+		/*
+		 *	Copy everything we need, as the entry may be
+		 *	evicted while we're talking to the responder.
+		 */
+		client_cert = X509_dup(entry->client_cert);
+		issuer_cert = X509_dup(entry->issuer_cert);
+		key = talloc_memdup(NULL, entry->key, entry->key_len);
+		key_len = entry->key_len;
+		store = entry->store;
+		entry->refreshing = true;
+		entry->used = false;
+		pthread_mutex_unlock(&cache->mutex);
+
+		if (client_cert && issuer_cert && key) {
+			ocsp_cache_refresh(cache, store, issuer_cert, client_cert, key, key_len);
+		}
+		if (client_cert) X509_free(client_cert);
+		if (issuer_cert) X509_free(issuer_cert);
+		talloc_free(key);
+
+		pthread_mutex_lock(&cache->mutex);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+static int _tls_ocsp_cache_free(tls_ocsp_cache_t *cache)
+{
+	if (cache->running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_signal(&cache->cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->thread, NULL);
+	}
+
+	talloc_free(cache->tree);
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate an in-memory OCSP response cache
+ *
+ * If conf->cache_refresh is set, a thread is started to refresh
+ * responses which are in use before they expire.
+ *
+ * @param[in] ctx	to allocate the cache in.  The cache must be freed before
+ *			any X509_STORE it's used with.
+ * @param[in] conf	OCSP configuration.
+ * @return
+ *	- A new cache on success.
+ *	- NULL on failure.
+ */
+tls_ocsp_cache_t *tls_ocsp_cache_alloc(TALLOC_CTX *ctx, fr_tls_ocsp_conf_t *conf)
+{
+	tls_ocsp_cache_t	*cache;
+	int			ret;
+
+	cache = talloc_zero(ctx, tls_ocsp_cache_t);
+	if (!cache) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	cache->conf = conf;
+
+	cache->tree = rbtree_create(NULL, ocsp_cache_entry_cmp, ocsp_cache_entry_free, 0);
+	if (!cache->tree) {
+		fr_strerror_printf("Failed creating OCSP cache tree");
+		talloc_free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->cond, NULL);
+	talloc_set_destructor(cache, _tls_ocsp_cache_free);
+
+	if (!conf->cache_refresh || check_config) return cache;
+
+	ret = pthread_create(&cache->thread, NULL, ocsp_cache_refresh_thread, cache);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating OCSP refresh thread: %s", fr_syserror(ret));
+		talloc_free(cache);
+		return NULL;
+	}
+	cache->running = true;
+
+	return cache;
+}
+
+/** Sends a OCSP request to a defined OCSP responder
+ *
+ */
+int tls_ocsp_check(REQUEST *request, SSL *ssl,
+		   X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+		   fr_tls_ocsp_conf_t *conf, bool staple_response)
+{
+	OCSP_CERTID	*certid;
+	OCSP_RESPONSE	*resp = NULL;
+	BIO		*ssl_log = NULL;
+	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
+	uint8_t		*key = NULL;
+	size_t		key_len = 0;
+	time_t		next = 0;
+	VALUE_PAIR	*vp;
+
+	if (conf->cache_server) switch (tls_cache_process(request, conf->cache_server,
+							       CACHE_ACTION_OCSP_READ)) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Told to force OCSP validation failure from cached response");
+		return OCSP_STATUS_FAILED;
+
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+	/*
+	 *	These are fine for OCSP too, we don't *expect* to always
+	 *	have a cached OCSP status.
+	 */
+	case RLM_MODULE_NOTFOUND:
+	case RLM_MODULE_NOOP:
+		break;
+
+	default:
+		RWDEBUG("Failed retrieving cached OCSP status");
+		break;
+	}
+
+	/*
+	 *	Allow us to cache the OCSP verified state externally
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, PW_TLS_OCSP_CERT_VALID, TAG_ANY);
+	if (vp) switch (vp->vp_integer) {
+	case 0:	/* no */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = no, forcing OCSP failure");
+		return OCSP_STATUS_FAILED;
+
+	case 1: /* yes */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = yes, forcing OCSP success");
+
+		/*
+		 *	If this fails, and an OCSP stapled response is required,
+		 *	we need to run the full OCSP check.
+		 */
+		if (staple_response) {
+			vp = fr_pair_find_by_num(request->control, 0, PW_TLS_OCSP_RESPONSE, TAG_ANY);
+			if (!vp) {
+				RDEBUG2("No &control:TLS-OCSP-Response attribute found, performing full OCSP check");
+				break;
+			}
+			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
+				RWDEBUG("Failed setting OCSP staple response in SSL session");
+				return OCSP_STATUS_FAILED;
+			}
+		}
+
+		return OCSP_STATUS_OK;
+
+	case 2: /* skipped */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = skipped, skipping OCSP check");
+		return conf->softfail ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
+
+	case 3: /* unknown */
+	default:
+		break;
+	}
+
+	/*
+	 *	Setup logging for this OCSP operation
+	 */
+	ssl_log = BIO_new(BIO_s_mem());
+	if (!ssl_log) {
+		REDEBUG("Failed creating log queue");
+		ocsp_status = OCSP_STATUS_SKIPPED;
+		goto finish;
+	}
+
+	/*
+	 *	Look for a response we've already retrieved for
+	 *	this certificate.  The CERTID identifies it by
+	 *	issuer and serial number.
+	 */
+	if (conf->cache) {
+		certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
+		if (certid) {
+			key = ocsp_cache_key(request, &key_len, certid);
+			OCSP_CERTID_free(certid);
+		}
+	}
+
+	if (key) {
+		ocsp_status = ocsp_cache_find(staple_response ? &resp : NULL, &next, conf->cache, key, key_len);
+		if (ocsp_status != OCSP_STATUS_SKIPPED) {
+			RDEBUG2("Using cached OCSP response");
+			goto next_update;
+		}
+	}
+
+	ocsp_status = ocsp_fetch(&resp, &next, request, ssl_log, store, issuer_cert, client_cert, conf);
+	if (key && resp) ocsp_cache_store(conf->cache, store, key, key_len, resp, ocsp_status, next,
+					  client_cert, issuer_cert);
+	if (ocsp_status == OCSP_STATUS_SKIPPED) goto finish;
+
+next_update:
+	if (next) {
+		time_t now = time(NULL);
+
+		if (now < next) {
+			RDEBUG2("Adding OCSP TTL attribute");
+			RINDENT();
+			vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
+			vp->vp_integer = next - now;
+			rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
+			REXDENT();
+		} else {
+			RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
+		}
+	} else {
+		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
+	}
+
 finish:
 	switch (ocsp_status) {
 	case OCSP_STATUS_OK:
@@ -710,14 +1226,8 @@ finish:
 		break;
 	}
 
-	/* Free OCSP Stuff */
-	OCSP_REQUEST_free(req);
-	OCSP_BASICRESP_free(bresp);
+	talloc_free(key);
 	OCSP_RESPONSE_free(resp);
-	OPENSSL_free(host);
-	OPENSSL_free(port);
-	OPENSSL_free(path);
-	BIO_free_all(conn);
 	BIO_free(ssl_log);
 
 	return ocsp_status;
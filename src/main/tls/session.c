@@ -29,6 +29,7 @@
 #define LOG_PREFIX "tls - "
 
 #include <ctype.h>
+#include <poll.h>
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 #include <openssl/x509v3.h>
@@ -57,12 +58,18 @@ static char const *cert_attr_names[8][2] = {
 #define FR_TLS_SAN_UPN          (7)
 
 /** Clear a record buffer
+ *
+ * Frees any memory held by the record.
  *
  * @param record buffer to clear.
  */
 inline static void record_init(tls_record_t *record)
 {
+	talloc_free(record->buff);
+	record->data = NULL;
 	record->used = 0;
+	record->buff = NULL;
+	record->size = 0;
 }
 
 /** Destroy a record buffer
@@ -71,7 +78,106 @@ inline static void record_init(tls_record_t *record)
  */
 inline static void record_close(tls_record_t *record)
 {
-	record->used = 0;
+	record_init(record);
+}
+
+/** Ensure there's room in a record buffer for more data
+ *
+ * The caller writes up to the returned amount of data to the returned
+ * pointer, then adds the amount written to record->used.
+ *
+ * @param[in] record	buffer to expand.
+ * @param[in] want	How much room to make.  Limited by #FR_TLS_MAX_RECORD_SIZE.
+ * @param[out] room	How much room there is at the returned pointer.
+ * @return
+ *	- Where to write new data.
+ *	- NULL if the record is full, or we failed allocating memory.
+ */
+static uint8_t *record_grow(tls_record_t *record, size_t want, size_t *room)
+{
+	size_t	size;
+
+	*room = 0;
+
+	if (want > (FR_TLS_MAX_RECORD_SIZE - record->used)) want = FR_TLS_MAX_RECORD_SIZE - record->used;
+	if (want == 0) return NULL;
+
+	if (!record->buff) {
+		record->data = record->buff = talloc_array(NULL, uint8_t, want);
+		if (!record->buff) return NULL;
+		record->size = want;
+
+	} else if (((record->data - record->buff) + record->used + want) > record->size) {
+		uint8_t *buff;
+
+		/*
+		 *	Reclaim the space taken up by data
+		 *	which has already been read.
+		 */
+		if (record->data != record->buff) {
+			memmove(record->buff, record->data, record->used);
+			record->data = record->buff;
+		}
+
+		size = record->used + want;
+		if (size > record->size) {
+			buff = talloc_realloc(NULL, record->buff, uint8_t, size);
+			if (!buff) return NULL;
+
+			record->data = record->buff = buff;
+			record->size = size;
+		}
+	}
+
+	*room = record->size - (record->data - record->buff) - record->used;
+
+	return record->data + record->used;
+}
+
+/** Return a pointer to at least size bytes of free space in a record buffer
+ *
+ * @param[in] record	buffer to expand.
+ * @param[in] size	of space required.
+ * @return
+ *	- Where to write new data.
+ *	- NULL if there's insufficient space in the record buffer.
+ */
+static uint8_t *record_reserve(tls_record_t *record, size_t size)
+{
+	size_t	room;
+	uint8_t	*p;
+
+	p = record_grow(record, size, &room);
+	if (!p || (room < size)) return NULL;
+
+	return p;
+}
+
+/** Release memory we didn't end up using
+ *
+ * @param[in] record	buffer to shrink.
+ */
+static void record_shrink(tls_record_t *record)
+{
+	uint8_t	*buff;
+
+	if (!record->buff || (record->used == record->size)) return;
+
+	if (!record->used) {
+		record_init(record);
+		return;
+	}
+
+	if (record->data != record->buff) memmove(record->buff, record->data, record->used);
+
+	buff = talloc_realloc(NULL, record->buff, uint8_t, record->used);
+	if (!buff) {
+		record->data = record->buff;	/* Old buffer is still valid */
+		return;
+	}
+
+	record->data = record->buff = buff;
+	record->size = record->used;
 }
 
 /** Copy data to the intermediate buffer, before we send it somewhere
@@ -83,18 +189,23 @@ inline static void record_close(tls_record_t *record)
  */
 inline static unsigned int record_from_buff(tls_record_t *record, void const *in, unsigned int inlen)
 {
-	unsigned int added = FR_TLS_MAX_RECORD_SIZE - record->used;
+	size_t	added;
+	uint8_t	*p;
+
+	p = record_grow(record, inlen, &added);
+	if (!p) return 0;
 
 	if (added > inlen) added = inlen;
-	if (added == 0) return 0;
 
-	memcpy(record->data + record->used, in, added);
+	memcpy(p, in, added);
 	record->used += added;
 
 	return added;
 }
 
 /** Take data from the buffer, and give it to the caller
+ *
+ * The record's memory is freed once all the data has been taken.
  *
  * @param[in] record	buffer to read from.
  * @param[out] out	where to write data from record buffer.
@@ -111,14 +222,228 @@ inline static unsigned int record_to_buff(tls_record_t *record, void *out, unsig
 
 	record->used -= taken;
 
+	if (record->used == 0) {
+		record_init(record);
+		return taken;
+	}
+
 	/*
-	 *	This is pretty bad...
+	 *	Large records are sent in many small
+	 *	fragments, so don't move the rest of the
+	 *	data each time.
 	 */
-	if (record->used > 0) memmove(record->data, record->data + taken, record->used);
+	record->data += taken;
 
 	return taken;
 }
 
+/** Add a buffer to the end of the chain OpenSSL reads encrypted data from
+ *
+ */
+static void dirty_in_append(tls_session_t *session, tls_record_ref_t *ref)
+{
+	tls_record_ref_t **last;
+
+	for (last = &session->dirty_in_chain; *last; last = &(*last)->next);
+	*last = ref;
+
+	session->dirty_in_pending += ref->used;
+}
+
+/** Give the contents of dirty_in to OpenSSL, without copying it
+ *
+ * The record's buffer is moved to the chain that into_ssl reads from,
+ * and the record is left empty.
+ *
+ * @param[in] session	The current TLS session.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int dirty_in_flush(tls_session_t *session)
+{
+	tls_record_ref_t *ref;
+
+	if (!session->dirty_in.used) {
+		record_init(&session->dirty_in);
+		return 0;
+	}
+
+	ref = talloc_zero(session, tls_record_ref_t);
+	if (!ref) {
+		record_init(&session->dirty_in);
+		return -1;
+	}
+
+	ref->data = session->dirty_in.data;
+	ref->used = session->dirty_in.used;
+	(void) talloc_steal(ref, session->dirty_in.buff);
+
+	session->dirty_in.buff = NULL;
+	record_init(&session->dirty_in);
+
+	dirty_in_append(session, ref);
+
+	return 0;
+}
+
+/** Queue encrypted data for OpenSSL, leaving it in the buffer it arrived in
+ *
+ * This is used to reassemble TLS records which arrived in fragments (in
+ * EAP-TLS and friends).  The fragments aren't copied into dirty_in, and
+ * OpenSSL reads them directly when the handshake is next continued, or
+ * data is next decrypted.
+ *
+ * @param[in] session	The current TLS session.
+ * @param[in] data	to queue.  Must be inside buffer.
+ * @param[in] data_len	Length of data.
+ * @param[in] buffer	talloced buffer which contains data.  A reference
+ *			is held to it until OpenSSL has read all the data.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the data would exceed #FR_TLS_MAX_RECORD_SIZE, or on error.
+ */
+int tls_session_recv_borrow(tls_session_t *session, uint8_t const *data, size_t data_len, void const *buffer)
+{
+	tls_record_ref_t *ref;
+
+	if (data_len == 0) return 0;
+
+	if ((session->dirty_in_pending + session->dirty_in.used + data_len) > FR_TLS_MAX_RECORD_SIZE) {
+		fr_strerror_printf("Exceeded maximum record size");
+		return -1;
+	}
+
+	ref = talloc_zero(session, tls_record_ref_t);
+	if (!ref || !talloc_reference(ref, buffer)) {
+		talloc_free(ref);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	ref->data = data;
+	ref->used = data_len;
+
+	dirty_in_append(session, ref);
+
+	return 0;
+}
+
+/*
+ *	OpenSSL < 1.1.0 doesn't have accessors for BIOs.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#  define BIO_get_data(_bio)		((_bio)->ptr)
+#  define BIO_set_data(_bio, _ptr)	((_bio)->ptr = (_ptr))
+#  define BIO_set_init(_bio, _init)	((_bio)->init = (_init))
+#endif
+
+/** Give OpenSSL encrypted data from the dirty_in chain
+ *
+ * This is the only place the encrypted data is copied, directly from
+ * the packets it arrived in.
+ */
+static int dirty_in_bio_read(BIO *bio, char *out, int outlen)
+{
+	tls_session_t	*session = BIO_get_data(bio);
+	int		done = 0;
+
+	BIO_clear_retry_flags(bio);
+
+	while ((done < outlen) && session->dirty_in_chain) {
+		tls_record_ref_t	*ref = session->dirty_in_chain;
+		size_t			len = outlen - done;
+
+		if (len > ref->used) len = ref->used;
+
+		memcpy(out + done, ref->data, len);
+		done += len;
+
+		ref->data += len;
+		ref->used -= len;
+		session->dirty_in_pending -= len;
+
+		if (ref->used) break;
+
+		session->dirty_in_chain = ref->next;
+		talloc_free(ref);
+	}
+
+	/*
+	 *	Same as an empty memory BIO.
+	 */
+	if (!done) {
+		BIO_set_retry_read(bio);
+		return -1;
+	}
+
+	return done;
+}
+
+static long dirty_in_bio_ctrl(BIO *bio, int cmd, UNUSED long num, UNUSED void *ptr)
+{
+	tls_session_t *session = BIO_get_data(bio);
+
+	switch (cmd) {
+	case BIO_CTRL_PENDING:
+		return session->dirty_in_pending;
+
+	case BIO_CTRL_FLUSH:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static BIO_METHOD	*dirty_in_bio_method;
+static pthread_once_t	dirty_in_bio_once = PTHREAD_ONCE_INIT;
+
+static void _dirty_in_bio_method_init(void)
+{
+	dirty_in_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "dirty_in");
+	if (!dirty_in_bio_method) return;
+
+	BIO_meth_set_read(dirty_in_bio_method, dirty_in_bio_read);
+	BIO_meth_set_ctrl(dirty_in_bio_method, dirty_in_bio_ctrl);
+}
+#else
+static BIO_METHOD dirty_in_bio_method_s = {
+	.type		= BIO_TYPE_SOURCE_SINK,
+	.name		= "dirty_in",
+	.bread		= dirty_in_bio_read,
+	.ctrl		= dirty_in_bio_ctrl
+};
+#endif
+
+/** Create the BIO OpenSSL reads encrypted data from
+ *
+ * @param[in] session	The current TLS session.
+ * @return
+ *	- A new BIO, which reads from session->dirty_in_chain.
+ *	- NULL on error.
+ */
+static BIO *dirty_in_bio_alloc(tls_session_t *session)
+{
+	BIO *bio;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	pthread_once(&dirty_in_bio_once, _dirty_in_bio_method_init);
+	if (!dirty_in_bio_method) return NULL;
+
+	bio = BIO_new(dirty_in_bio_method);
+#else
+	bio = BIO_new(&dirty_in_bio_method_s);
+#endif
+	if (!bio) return NULL;
+
+	BIO_set_data(bio, session);
+	BIO_set_init(bio, 1);
+
+	return bio;
+}
+
 /** Return the static private key password we have configured
  *
  * @param[out] buf	Where to write the password to.
@@ -1063,6 +1388,21 @@ do { \
 	return 0;
 }
 
+/** Return how much space dirty_out needs to hold the data OpenSSL has ready to send
+ *
+ * @param[in] session	The current TLS session.
+ * @return the number of bytes to reserve, between 1 and #FR_TLS_MAX_RECORD_SIZE.
+ */
+static size_t tls_session_pending(tls_session_t *session)
+{
+	size_t pending = BIO_ctrl_pending(session->from_ssl);
+
+	if (pending == 0) return 1;
+	if (pending > FR_TLS_MAX_RECORD_SIZE) return FR_TLS_MAX_RECORD_SIZE;
+
+	return pending;
+}
+
 /** Decrypt application data
  *
  * @note Handshake must have completed before this function may be called.
@@ -1079,6 +1419,7 @@ do { \
 int tls_session_recv(REQUEST *request, tls_session_t *session)
 {
 	int ret;
+	uint8_t *p;
 
 	if (!SSL_is_init_finished(session->ssl)) {
 		REDEBUG("Attempted to read application data before handshake completed");
@@ -1086,20 +1427,17 @@ int tls_session_recv(REQUEST *request, tls_session_t *session)
 	}
 
 	/*
-	 *	Decrypt the complete record.
+	 *	Decrypt the complete record.  This empties
+	 *	the dirty buffer.
 	 */
-	ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
-	if (ret != (int) session->dirty_in.used) {
-		record_init(&session->dirty_in);
-		REDEBUG("Failed writing %zd bytes to SSL BIO: %d", session->dirty_in.used, ret);
+	if (dirty_in_flush(session) < 0) {
+		REDEBUG("Failed passing %zu bytes to SSL BIO", session->dirty_in.used);
 		return -1;
 	}
 
 	/*
-	 *      Clear the dirty buffer now that we are done with it
-	 *      and init the clean_out buffer to store decrypted data
+	 *      Init the clean_out buffer to store decrypted data
 	 */
-	record_init(&session->dirty_in);
 	record_init(&session->clean_out);
 
 	/*
@@ -1107,7 +1445,13 @@ int tls_session_recv(REQUEST *request, tls_session_t *session)
 	 *      SSL session, and put it into the decrypted
 	 *      data buffer.
 	 */
-	ret = SSL_read(session->ssl, session->clean_out.data, sizeof(session->clean_out.data));
+	p = record_reserve(&session->clean_out, FR_TLS_MAX_RECORD_SIZE);
+	if (!p) {
+		REDEBUG("Failed allocating buffer for decrypted data");
+		return -1;
+	}
+
+	ret = SSL_read(session->ssl, p, FR_TLS_MAX_RECORD_SIZE);
 	if (ret < 0) {
 		int code;
 
@@ -1136,6 +1480,7 @@ int tls_session_recv(REQUEST *request, tls_session_t *session)
 	 *	Passed all checks, successfully decrypted data
 	 */
 	session->clean_out.used = ret;
+	record_shrink(&session->clean_out);
 
 	RDEBUG2("Decrypted TLS application data (%zu bytes)", session->clean_out.used);
 	radlog_request_hex(L_DBG, L_DBG_LVL_3, request, session->clean_out.data, session->clean_out.used);
@@ -1174,6 +1519,7 @@ int tls_session_send(REQUEST *request, tls_session_t *session)
 	 */
 	if (session->clean_in.used > 0) {
 		int ret;
+		uint8_t *p;
 
 		RDEBUG2("TLS application data to encrypt (%zu bytes)", session->clean_in.used);
 		radlog_request_hex(L_DBG, L_DBG_LVL_3, request, session->clean_in.data, session->clean_in.used);
@@ -1182,11 +1528,19 @@ int tls_session_send(REQUEST *request, tls_session_t *session)
 		record_to_buff(&session->clean_in, NULL, ret);
 
 		/* Get the dirty data from Bio to send it */
-		ret = BIO_read(session->from_ssl, session->dirty_out.data,
-			       sizeof(session->dirty_out.data));
+		record_init(&session->dirty_out);
+		p = record_reserve(&session->dirty_out, tls_session_pending(session));
+		if (!p) {
+			REDEBUG("Failed allocating buffer for encrypted data");
+			return 0;
+		}
+
+		ret = BIO_read(session->from_ssl, p, session->dirty_out.size);
 		if (ret > 0) {
 			session->dirty_out.used = ret;
+			record_shrink(&session->dirty_out);
 		} else {
+			record_init(&session->dirty_out);
 			if (!tls_log_io_error(request, session, ret, "Failed in SSL_write")) return 0;
 		}
 	}
@@ -1218,10 +1572,14 @@ int tls_session_handshake_alert(UNUSED REQUEST *request, tls_session_t *session,
  * @return
  *	- 0 on error.
  *	- 1 on success.
+ *	- 2 if the handshake is waiting for an asynchronous crypto operation.
+ *	  Call again (without adding data to dirty_in) once #tls_session_async_fd
+ *	  is readable.
  */
 int tls_session_handshake(REQUEST *request, tls_session_t *session)
 {
 	int ret;
+	uint8_t *p;
 
 	/*
 	 *	This is a logic error.  tls_session_handshake
@@ -1243,14 +1601,15 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 *	Feed dirty data into OpenSSL, so that is can either
 	 *	process it as Application data (decrypting it)
 	 *	or continue the TLS handshake.
+	 *
+	 *	If we're resuming a paused handshake, the data
+	 *	was already written.
 	 */
-	ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
-	if (ret != (int)session->dirty_in.used) {
-		REDEBUG("Failed writing %zd bytes to TLS BIO: %d", session->dirty_in.used, ret);
-		record_init(&session->dirty_in);
+	if (!session->async_pending && (dirty_in_flush(session) < 0)) {
+		REDEBUG("Failed passing %zu bytes to TLS BIO", session->dirty_in.used);
 		return 0;
 	}
-	record_init(&session->dirty_in);
+	session->async_pending = false;
 
 	/*
 	 *	Magic/More magic? Although SSL_read is normally
@@ -1272,12 +1631,28 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 *	If acting as a server SSL_set_accept_state must have
 	 *	been called before this function.
 	 */
-	ret = SSL_read(session->ssl, session->clean_out.data + session->clean_out.used,
-		       sizeof(session->clean_out.data) - session->clean_out.used);
+	p = record_reserve(&session->clean_out, FR_TLS_MAX_RECORD_SIZE - session->clean_out.used);
+	if (!p) {
+		REDEBUG("Failed allocating buffer for TLS data");
+		return 0;
+	}
+
+	ret = SSL_read(session->ssl, p, FR_TLS_MAX_RECORD_SIZE - session->clean_out.used);
 	if (ret > 0) {
 		session->clean_out.used += ret;
+		record_shrink(&session->clean_out);
 		return 1;
 	}
+	record_shrink(&session->clean_out);
+
+#ifdef SSL_MODE_ASYNC
+	if (SSL_get_error(session->ssl, ret) == SSL_ERROR_WANT_ASYNC) {
+		RDEBUG3("Handshake paused, waiting for asynchronous crypto operation");
+		session->async_pending = true;
+		return 2;
+	}
+#endif
+
 	if (!tls_log_io_error(request, session, ret, "Failed in SSL_read")) return 0;
 
 	/*
@@ -1357,10 +1732,18 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 */
 	ret = BIO_ctrl_pending(session->from_ssl);
 	if (ret > 0) {
-		ret = BIO_read(session->from_ssl, session->dirty_out.data,
-			       sizeof(session->dirty_out.data));
+		record_init(&session->dirty_out);
+		p = record_reserve(&session->dirty_out, tls_session_pending(session));
+		if (!p) {
+			REDEBUG("Failed allocating buffer for encrypted data");
+			record_init(&session->dirty_in);
+			return 0;
+		}
+
+		ret = BIO_read(session->from_ssl, p, session->dirty_out.size);
 		if (ret > 0) {
 			session->dirty_out.used = ret;
+			record_shrink(&session->dirty_out);
 		} else if (BIO_should_retry(session->from_ssl)) {
 			record_init(&session->dirty_in);
 			RDEBUG2("Asking for more data in tunnel");
@@ -1388,13 +1771,21 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 		 */
 		session->info.content_type = SSL3_RT_ALERT;
 
-		session->dirty_out.data[0] = session->info.content_type;
-		session->dirty_out.data[1] = 3;
-		session->dirty_out.data[2] = 1;
-		session->dirty_out.data[3] = 0;
-		session->dirty_out.data[4] = 2;
-		session->dirty_out.data[5] = session->handshake_alert.level;
-		session->dirty_out.data[6] = session->handshake_alert.description;
+		record_init(&session->dirty_out);
+		p = record_reserve(&session->dirty_out, 7);
+		if (!p) {
+			REDEBUG("Failed allocating buffer for TLS alert");
+			record_init(&session->dirty_in);
+			return 0;
+		}
+
+		p[0] = session->info.content_type;
+		p[1] = 3;
+		p[2] = 1;
+		p[3] = 0;
+		p[4] = 2;
+		p[5] = session->handshake_alert.level;
+		p[6] = session->handshake_alert.description;
 
 		session->dirty_out.used = 7;
 
@@ -1406,6 +1797,77 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	return 1;
 }
 
+/** Return the file descriptor which becomes readable when a paused handshake can continue
+ *
+ * @param session The current TLS session.
+ * @return
+ *	- The fd to wait on.
+ *	- -1 if the handshake isn't paused, or the engine didn't provide an fd.
+ */
+int tls_session_async_fd(tls_session_t *session)
+{
+#ifdef SSL_MODE_ASYNC
+	OSSL_ASYNC_FD	*fds;
+	size_t		num = 0;
+	int		fd;
+
+	if (!session->async_pending) return -1;
+
+	if ((SSL_get_all_async_fds(session->ssl, NULL, &num) != 1) || (num == 0)) return -1;
+
+	/*
+	 *	Only one engine can be pending for a given
+	 *	SSL, so there should only be one fd.
+	 */
+	fds = talloc_array(session, OSSL_ASYNC_FD, num);
+	if (!fds) return -1;
+
+	if (SSL_get_all_async_fds(session->ssl, fds, &num) != 1) {
+		talloc_free(fds);
+		return -1;
+	}
+	fd = fds[0];
+	talloc_free(fds);
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/** Block until a paused handshake can continue
+ *
+ * For callers which can't yield, such as the TLS listener.
+ *
+ * @param request The current request.
+ * @param session The current TLS session.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int tls_session_async_wait(REQUEST *request, tls_session_t *session)
+{
+	struct pollfd	pfd;
+	int		ret;
+
+	pfd.fd = tls_session_async_fd(session);
+	if (pfd.fd < 0) {
+		REDEBUG("Handshake paused, but the engine did not provide a file descriptor to wait on");
+		return -1;
+	}
+	pfd.events = POLLIN;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0) {
+		REDEBUG("Failed waiting for asynchronous crypto operation: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Free a TLS session and any associated OpenSSL data
  *
  * @param session to free.
@@ -1421,6 +1883,11 @@ static int _tls_session_free(tls_session_t *session)
 		session->ssl = NULL;
 	}
 
+	record_close(&session->clean_in);
+	record_close(&session->clean_out);
+	record_close(&session->dirty_in);
+	record_close(&session->dirty_out);
+
 	return 0;
 }
 
@@ -1566,6 +2033,7 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *conf, REQ
 	session->record_close = record_close;
 	session->record_from_buff = record_from_buff;
 	session->record_to_buff = record_to_buff;
+	session->record_reserve = record_reserve;
 
 	/*
 	 *	Create & hook the BIOs to handle the dirty side of the
@@ -1575,10 +2043,20 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *conf, REQ
 	 *
 	 *	This means that all SSL IO is done to/from memory,
 	 *	and we can update those BIOs from the packets we've
-	 *	received.
+	 *	received.  into_ssl reads straight from the packets,
+	 *	so fragmented records don't have to be reassembled
+	 *	first.
 	 */
-	session->into_ssl = BIO_new(BIO_s_mem());
+	session->into_ssl = dirty_in_bio_alloc(session);
 	session->from_ssl = BIO_new(BIO_s_mem());
+	if (!session->into_ssl || !session->from_ssl) {
+		RERROR("Error allocating BIOs for TLS session");
+		if (session->into_ssl) BIO_free(session->into_ssl);
+		if (session->from_ssl) BIO_free(session->from_ssl);
+		session->into_ssl = session->from_ssl = NULL;
+		talloc_free(session);
+		return NULL;
+	}
 	SSL_set_bio(session->ssl, session->into_ssl, session->from_ssl);
 
 	/*
@@ -1675,7 +2153,9 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *conf, REQ
 		session->mtu = vp->vp_integer;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	if (conf->session_cache_server || conf->session_cache_local || conf->session_tickets) {
+		session->allow_session_resumption = true; /* otherwise it's false */
+	}
 
 	return session;
 }
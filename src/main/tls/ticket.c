@@ -0,0 +1,493 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/ticket.c
+ * @brief Stateless session resumption using RFC 5077 session tickets.
+ *
+ * Tickets are encrypted with AES-256-CBC and authenticated with HMAC-SHA256,
+ * using keys from a key ring.  The first key in the ring is used to issue new
+ * tickets, the others are only used to decrypt tickets issued before the last
+ * rotation.  Clients presenting a ticket encrypted with an older key are issued
+ * a new one.
+ *
+ * Keys are either generated randomly and rotated every rotation_interval
+ * seconds, which is only useful for a single server, or read from a key file
+ * which is distributed to every server in a cluster.  The key file is re-read
+ * when it changes.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <ctype.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#else
+#  include <openssl/hmac.h>
+#endif
+
+#define TLS_TICKET_MAX_KEYS	64
+
+/*
+ *	Stored in the ticket of sessions which completed every phase
+ *	of authentication.  Tickets without it are never resumed.
+ */
+static uint8_t const tls_ticket_marker[] = "FreeRADIUS authenticated";
+
+/** A single ticket key
+ *
+ */
+typedef struct {
+	uint8_t		name[16];			//!< Sent in the clear, to identify the key.
+	uint8_t		aes_key[32];			//!< Encrypts the ticket.
+	uint8_t		hmac_key[32];			//!< Authenticates the ticket.
+} tls_ticket_key_t;
+
+struct tls_ticket_ring {
+	pthread_rwlock_t	lock;			//!< Protects the keys.
+
+	tls_ticket_key_t	key[TLS_TICKET_MAX_KEYS];	//!< key[0] issues new tickets.
+	uint32_t		num_keys;		//!< In the ring.
+	uint32_t		max_keys;		//!< Oldest keys are discarded when we rotate.
+
+	uint32_t		interval;		//!< How often to rotate generated keys.
+	time_t			rotated;		//!< When key[0] was created.
+
+	char const		*key_file;		//!< Keys shared between servers.
+	time_t			key_file_mtime;		//!< When the key file was last read.
+	time_t			key_file_checked;	//!< When we last called stat() on the key file.
+};
+
+/** Read keys from a key file
+ *
+ * Each non-blank line which doesn't start with '#' contains 80 bytes of
+ * hex encoded data.  16 bytes of key name, 32 bytes of AES key, and 32 bytes
+ * of HMAC key.  The first key is used to issue tickets.
+ *
+ * @param[in] ring to populate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The existing keys are unchanged.
+ */
+static int tls_ticket_key_file_read(tls_ticket_ring_t *ring)
+{
+	FILE			*fp;
+	char			buffer[256];
+	int			lineno = 0;
+	uint32_t		num = 0;
+	tls_ticket_key_t	keys[TLS_TICKET_MAX_KEYS];
+
+	fp = fopen(ring->key_file, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", ring->key_file, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		char	*p = buffer;
+		size_t	len;
+		uint8_t	bin[sizeof(tls_ticket_key_t)];
+
+		lineno++;
+
+		while (isspace((int)*p)) p++;
+		if (!*p || (*p == '#')) continue;
+
+		len = strlen(p);
+		while ((len > 0) && isspace((int)p[len - 1])) p[--len] = '\0';
+
+		if ((len != (sizeof(bin) * 2)) || (fr_hex2bin(bin, sizeof(bin), p, len) != sizeof(bin))) {
+			fr_strerror_printf("%s[%d]: Expected %zu hex digits", ring->key_file, lineno, sizeof(bin) * 2);
+		error:
+			fclose(fp);
+			return -1;
+		}
+
+		if (num >= TLS_TICKET_MAX_KEYS) {
+			fr_strerror_printf("%s[%d]: Too many keys, maximum is %i", ring->key_file, lineno,
+					   TLS_TICKET_MAX_KEYS);
+			goto error;
+		}
+
+		memcpy(keys[num].name, bin, sizeof(keys[num].name));
+		memcpy(keys[num].aes_key, bin + sizeof(keys[num].name), sizeof(keys[num].aes_key));
+		memcpy(keys[num].hmac_key, bin + sizeof(keys[num].name) + sizeof(keys[num].aes_key),
+		       sizeof(keys[num].hmac_key));
+		num++;
+	}
+	fclose(fp);
+
+	if (!num) {
+		fr_strerror_printf("%s: No keys found", ring->key_file);
+		return -1;
+	}
+
+	memcpy(ring->key, keys, sizeof(keys[0]) * num);
+	ring->num_keys = num;
+	memset(keys, 0, sizeof(keys));
+
+	return 0;
+}
+
+/** Generate a new key, making the previous keys decrypt only
+ *
+ */
+static int tls_ticket_key_rotate(tls_ticket_ring_t *ring, time_t now)
+{
+	tls_ticket_key_t key;
+
+	if (RAND_bytes((uint8_t *)&key, sizeof(key)) != 1) {
+		fr_strerror_printf("Failed generating ticket key");
+		return -1;
+	}
+
+	if (ring->num_keys == ring->max_keys) ring->num_keys--;
+	memmove(&ring->key[1], &ring->key[0], sizeof(ring->key[0]) * ring->num_keys);
+	memcpy(&ring->key[0], &key, sizeof(key));
+	memset(&key, 0, sizeof(key));
+	ring->num_keys++;
+	ring->rotated = now;
+
+	return 0;
+}
+
+/** Rotate or reload the keys if required
+ *
+ * Called with the write lock held.
+ */
+static void tls_ticket_keys_update(tls_ticket_ring_t *ring, time_t now)
+{
+	struct stat buf;
+
+	if (!ring->key_file) {
+		if ((ring->rotated + (time_t)ring->interval) > now) return;
+
+		if (tls_ticket_key_rotate(ring, now) < 0) {
+			ERROR("%s", fr_strerror());
+			return;
+		}
+		DEBUG2("Rotated session ticket key");
+		return;
+	}
+
+	if (ring->key_file_checked == now) return;
+	ring->key_file_checked = now;
+
+	if ((stat(ring->key_file, &buf) < 0) || (buf.st_mtime == ring->key_file_mtime)) return;
+
+	if (tls_ticket_key_file_read(ring) < 0) {
+		ERROR("Failed reloading session ticket keys, continuing with previous keys: %s", fr_strerror());
+	} else {
+		DEBUG2("Reloaded session ticket keys from %s", ring->key_file);
+	}
+	ring->key_file_mtime = buf.st_mtime;
+}
+
+static inline bool tls_ticket_keys_stale(tls_ticket_ring_t const *ring, time_t now)
+{
+	if (ring->key_file) return ring->key_file_checked != now;
+
+	return (ring->rotated + (time_t)ring->interval) <= now;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  define TICKET_HMAC_CTX EVP_MAC_CTX
+
+static int tls_ticket_hmac_init(EVP_MAC_CTX *hctx, uint8_t const *key, size_t key_len)
+{
+	OSSL_PARAM	params[3];
+	uint8_t		*key_p;
+	char		digest[] = "sha256";
+
+	memcpy(&key_p, &key, sizeof(key_p));	/* const */
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key_p, key_len);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+#  define TICKET_HMAC_CTX HMAC_CTX
+
+static int tls_ticket_hmac_init(HMAC_CTX *hctx, uint8_t const *key, size_t key_len)
+{
+	return HMAC_Init_ex(hctx, key, key_len, EVP_sha256(), NULL);
+}
+#endif
+
+/** Encrypt or decrypt a session ticket
+ *
+ * @param[in] ssl	The current OpenSSL session.
+ * @param[in,out] name	of the key, written when encrypting, read when decrypting.
+ * @param[in,out] iv	Initialisation vector, written when encrypting, read when decrypting.
+ * @param[in] ctx	Cipher context to initialise.
+ * @param[in] hctx	HMAC context to initialise.
+ * @param[in] enc	1 if we're issuing a ticket, 0 if we're decrypting one.
+ * @return
+ *	- 1 on success.
+ *	- 2 if the ticket was decrypted with an old key, and a new one should be issued.
+ *	- 0 if no key matched, and a full handshake should be performed.
+ *	- -1 on error.
+ */
+static int tls_ticket_key_cb(SSL *ssl, unsigned char name[16], unsigned char *iv,
+			     EVP_CIPHER_CTX *ctx, TICKET_HMAC_CTX *hctx, int enc)
+{
+	fr_tls_conf_t		*conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	tls_ticket_ring_t	*ring = conf->session_ticket_ring;
+	time_t			now = time(NULL);
+	uint32_t		i;
+	int			ret = -1;
+
+	if (tls_ticket_keys_stale(ring, now)) {
+		pthread_rwlock_wrlock(&ring->lock);
+		tls_ticket_keys_update(ring, now);
+		pthread_rwlock_unlock(&ring->lock);
+	}
+
+	pthread_rwlock_rdlock(&ring->lock);
+	if (enc) {
+		tls_ticket_key_t const *key = &ring->key[0];
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) goto finish;
+
+		memcpy(name, key->name, sizeof(key->name));
+		if ((EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1) ||
+		    (tls_ticket_hmac_init(hctx, key->hmac_key, sizeof(key->hmac_key)) != 1)) goto finish;
+
+		ret = 1;
+		goto finish;
+	}
+
+	for (i = 0; i < ring->num_keys; i++) {
+		if (memcmp(name, ring->key[i].name, sizeof(ring->key[i].name)) == 0) break;
+	}
+	if (i == ring->num_keys) {
+		ret = 0;
+		goto finish;
+	}
+
+	if ((tls_ticket_hmac_init(hctx, ring->key[i].hmac_key, sizeof(ring->key[i].hmac_key)) != 1) ||
+	    (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, ring->key[i].aes_key, iv) != 1)) goto finish;
+
+	ret = (i == 0) ? 1 : 2;
+
+finish:
+	pthread_rwlock_unlock(&ring->lock);
+
+	return ret;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/** Check a session ticket is allowed to be used, and re-validate the client's certificate
+ *
+ * Sessions resumed from tickets don't go through tls_cache_read, so this
+ * performs the equivalent checks.
+ */
+static SSL_TICKET_RETURN tls_ticket_decrypt_cb(SSL *ssl, SSL_SESSION *sess,
+					       UNUSED unsigned char const *keyname, UNUSED size_t keyname_len,
+					       SSL_TICKET_STATUS status, UNUSED void *arg)
+{
+	REQUEST		*request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	X509		*cert;
+	X509_STORE_CTX	*store_ctx;
+	int		verify;
+	void		*appdata;
+	size_t		appdata_len;
+
+	switch (status) {
+	case SSL_TICKET_SUCCESS:
+	case SSL_TICKET_SUCCESS_RENEW:
+		break;
+
+	case SSL_TICKET_EMPTY:
+	case SSL_TICKET_NO_DECRYPT:
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+
+	default:
+		return SSL_TICKET_RETURN_IGNORE;
+	}
+
+	/*
+	 *	Tickets are issued when the handshake completes, which
+	 *	for tunnelled methods is before the inner authentication
+	 *	has run.  Only resume sessions which tls_ticket_allow()
+	 *	marked as successful.
+	 */
+	if ((SSL_SESSION_get0_ticket_appdata(sess, &appdata, &appdata_len) != 1) ||
+	    (appdata_len != sizeof(tls_ticket_marker)) ||
+	    (memcmp(appdata, tls_ticket_marker, sizeof(tls_ticket_marker)) != 0)) {
+		if (request) RDEBUG2("Session ticket was issued before authentication completed, ignoring it");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION));
+
+	/*
+	 *	The peer's chain isn't stored in the ticket, so the
+	 *	certificate must validate against our trust store alone.
+	 */
+	cert = SSL_SESSION_get0_peer(sess);
+	if (cert) {
+		store_ctx = X509_STORE_CTX_new();
+		if (!store_ctx) return SSL_TICKET_RETURN_IGNORE_RENEW;
+
+		X509_STORE_CTX_init(store_ctx, SSL_CTX_get_cert_store(SSL_get_SSL_CTX(ssl)), cert, NULL);
+		verify = X509_verify_cert(store_ctx);
+		if (verify != 1) {
+			if (request) RWDEBUG("Failed re-validating session ticket: %s",
+					     X509_verify_cert_error_string(X509_STORE_CTX_get_error(store_ctx)));
+			X509_STORE_CTX_free(store_ctx);
+			return SSL_TICKET_RETURN_IGNORE_RENEW;
+		}
+		X509_STORE_CTX_free(store_ctx);
+	}
+
+	if (request) RDEBUG2("Resuming session from ticket");
+
+	return (status == SSL_TICKET_SUCCESS_RENEW) ? SSL_TICKET_RETURN_USE_RENEW : SSL_TICKET_RETURN_USE;
+}
+
+/** Mark a session as resumable from a ticket
+ *
+ * Must only be called once every phase of authentication has succeeded.
+ * Tickets issued before this (i.e. all TLS 1.2 tickets for tunnelled
+ * methods) don't contain the marker, and are ignored by #tls_ticket_decrypt_cb.
+ *
+ * TLS 1.3 tickets are sent after the handshake.  #tls_ticket_init stops
+ * OpenSSL issuing them automatically, so we queue one here, after the marker
+ * has been added.  It's sent with the next record written to the client.
+ *
+ * @param[in] request	The current request.
+ * @param[in] session	which completed successfully.
+ */
+void tls_ticket_allow(REQUEST *request, tls_session_t *session)
+{
+	fr_tls_conf_t	*conf = SSL_get_ex_data(session->ssl, FR_TLS_EX_INDEX_CONF);
+	SSL_SESSION	*sess;
+	VALUE_PAIR	*vp;
+
+	if (!conf->session_ticket_ring || !session->allow_session_resumption) return;
+
+	vp = fr_pair_find_by_num(request->control, 0, PW_ALLOW_SESSION_RESUMPTION, TAG_ANY);
+	if (vp && (vp->vp_integer == 0)) return;
+
+	sess = SSL_get_session(session->ssl);
+	if (!sess || (SSL_SESSION_set1_ticket_appdata(sess, tls_ticket_marker, sizeof(tls_ticket_marker)) != 1)) {
+		RWDEBUG("Failed marking session as resumable, session tickets will be ignored");
+		return;
+	}
+
+	if ((SSL_version(session->ssl) >= TLS1_3_VERSION) && (SSL_new_session_ticket(session->ssl) != 1)) {
+		RWDEBUG("Failed issuing session ticket");
+		return;
+	}
+
+	RDEBUG2("Session may be resumed from a ticket");
+}
+#else
+void tls_ticket_allow(UNUSED REQUEST *request, UNUSED tls_session_t *session)
+{
+}
+#endif
+
+static int _tls_ticket_ring_free(tls_ticket_ring_t *ring)
+{
+	memset(ring->key, 0, sizeof(ring->key));
+	pthread_rwlock_destroy(&ring->lock);
+
+	return 0;
+}
+
+/** Allocate a session ticket key ring
+ *
+ * @param[in] ctx		to allocate the ring in.
+ * @param[in] key_file		to read keys from.  If NULL keys are generated.
+ * @param[in] interval		How often to rotate generated keys.
+ * @param[in] lifetime		Maximum age of a session.  Determines how many
+ *				generated keys are kept for decryption.
+ * @return
+ *	- A new key ring on success.
+ *	- NULL on error.
+ */
+tls_ticket_ring_t *tls_ticket_ring_alloc(TALLOC_CTX *ctx, char const *key_file, uint32_t interval, uint32_t lifetime)
+{
+	tls_ticket_ring_t	*ring;
+	struct stat		buf;
+
+	ring = talloc_zero(ctx, tls_ticket_ring_t);
+	if (!ring) return NULL;
+
+	pthread_rwlock_init(&ring->lock, NULL);
+	talloc_set_destructor(ring, _tls_ticket_ring_free);
+
+	if (key_file) {
+		ring->key_file = talloc_typed_strdup(ring, key_file);
+		if (stat(key_file, &buf) == 0) ring->key_file_mtime = buf.st_mtime;
+		if (tls_ticket_key_file_read(ring) < 0) {
+		error:
+			talloc_free(ring);
+			return NULL;
+		}
+		return ring;
+	}
+
+	if (interval == 0) interval = lifetime;
+	rad_assert(interval > 0);
+
+	ring->interval = interval;
+	ring->max_keys = (lifetime / interval) + 2;
+	if (ring->max_keys > TLS_TICKET_MAX_KEYS) ring->max_keys = TLS_TICKET_MAX_KEYS;
+
+	if (tls_ticket_key_rotate(ring, time(NULL)) < 0) goto error;
+
+	return ring;
+}
+
+/** Enable session tickets on an SSL_CTX
+ *
+ * @param[in] ctx	to enable tickets for.
+ */
+void tls_ticket_init(SSL_CTX *ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb);
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	SSL_CTX_set_session_ticket_cb(ctx, NULL, tls_ticket_decrypt_cb, NULL);
+
+	/*
+	 *	TLS 1.3 tickets are issued by tls_ticket_allow().
+	 */
+	SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+}
+#endif /* WITH_TLS */
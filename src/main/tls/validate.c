@@ -31,6 +31,9 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
 /** Validates a certificate using custom logic
  *
  * Before trusting a certificate, we make sure that the certificate is
@@ -322,6 +325,331 @@ int tls_validate_cert_cb(int ok, X509_STORE_CTX *x509_ctx)
 	return my_ok;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/** A certificate chain which has already been verified
+ *
+ */
+typedef struct {
+	uint8_t		fingerprint[SHA256_DIGEST_LENGTH];	//!< SHA256 of the leaf certificate.
+	STACK_OF(X509)	*chain;			//!< The verified chain, leaf first.
+	uint64_t	generation;		//!< Of the CA store when the chain was verified.
+	time_t		expires;		//!< When the chain must be verified again.
+} tls_verify_cache_entry_t;
+
+/** Cache of verified certificate chains, shared by all threads
+ *
+ */
+struct tls_verify_cache {
+	pthread_mutex_t	mutex;			//!< Protects the tree and generation.
+	rbtree_t	*tree;			//!< Entries, ordered by fingerprint.
+	uint32_t	max_entries;		//!< Maximum number of chains to keep.
+	uint32_t	lifetime;		//!< Maximum time a chain is trusted for.
+
+	char const	*ca_file;		//!< Watched for changes to CAs and CRLs.
+	char const	*ca_path;		//!< Watched for CAs and CRLs being added.
+	time_t		ca_file_mtime;		//!< Last modification time of ca_file.
+	time_t		ca_path_mtime;		//!< Last modification time of ca_path.
+	time_t		last_check;		//!< When we last checked ca_file and ca_path.
+	uint64_t	generation;		//!< Incremented whenever the CA store may have changed.
+};
+
+/** Walker context for evicting cache entries
+ *
+ */
+typedef struct {
+	tls_verify_cache_t		*cache;
+	tls_verify_cache_entry_t	*oldest;	//!< Entry which expires soonest.
+} verify_cache_walk_t;
+
+static int verify_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_verify_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->fingerprint, b->fingerprint, sizeof(a->fingerprint));
+}
+
+static int _verify_cache_entry_free(tls_verify_cache_entry_t *entry)
+{
+	if (entry->chain) sk_X509_pop_free(entry->chain, X509_free);
+
+	return 0;
+}
+
+static void verify_cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+/** Remove stale entries, and find the entry which expires soonest
+ *
+ */
+static int _verify_cache_evict(void *ctx, void *data)
+{
+	verify_cache_walk_t		*walk = ctx;
+	tls_verify_cache_entry_t	*entry = data;
+
+	if ((entry->generation != walk->cache->generation) || (entry->expires <= walk->cache->last_check)) return 2;
+
+	if (!walk->oldest || (entry->expires < walk->oldest->expires)) walk->oldest = entry;
+
+	return 0;
+}
+
+static time_t verify_cache_mtime(char const *filename)
+{
+	struct stat buf;
+
+	if (!filename || (stat(filename, &buf) < 0)) return 0;
+
+	return buf.st_mtime;
+}
+
+/** Invalidate all entries if the CAs or CRLs may have changed
+ *
+ * ca_file and ca_path are checked at most once a second.  New CRLs
+ * and CAs added to ca_path are picked up by OpenSSL without reloading
+ * the store, so cached chains must not be trusted past that point.
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void verify_cache_generation_check(tls_verify_cache_t *cache, time_t now)
+{
+	time_t ca_file_mtime, ca_path_mtime;
+
+	if (cache->last_check == now) return;
+	cache->last_check = now;
+
+	ca_file_mtime = verify_cache_mtime(cache->ca_file);
+	ca_path_mtime = verify_cache_mtime(cache->ca_path);
+	if ((ca_file_mtime == cache->ca_file_mtime) && (ca_path_mtime == cache->ca_path_mtime)) return;
+
+	cache->ca_file_mtime = ca_file_mtime;
+	cache->ca_path_mtime = ca_path_mtime;
+	cache->generation++;
+}
+
+/** Find a previously verified chain for a certificate
+ *
+ * @param[in] cache		to search.
+ * @param[in] fingerprint	of the leaf certificate.
+ * @return
+ *	- A copy of the verified chain which must be freed with sk_X509_pop_free().
+ *	- NULL if the chain hasn't been verified, or must be verified again.
+ */
+static STACK_OF(X509) *verify_cache_find(tls_verify_cache_t *cache, uint8_t const *fingerprint)
+{
+	tls_verify_cache_entry_t	find, *entry;
+	STACK_OF(X509)			*chain = NULL;
+
+	memcpy(find.fingerprint, fingerprint, sizeof(find.fingerprint));
+
+	pthread_mutex_lock(&cache->mutex);
+	verify_cache_generation_check(cache, time(NULL));
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) goto done;
+
+	if ((entry->generation != cache->generation) || (entry->expires <= cache->last_check)) {
+		rbtree_deletebydata(cache->tree, entry);
+		goto done;
+	}
+
+	chain = X509_chain_up_ref(entry->chain);
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return chain;
+}
+
+/** Record that a chain was verified successfully
+ *
+ * @param[in] cache		to add the chain to.
+ * @param[in] fingerprint	of the leaf certificate.
+ * @param[in] x509_ctx		which verified the chain.
+ */
+static void verify_cache_store(tls_verify_cache_t *cache, uint8_t const *fingerprint, X509_STORE_CTX *x509_ctx)
+{
+	tls_verify_cache_entry_t	find, *entry;
+	verify_cache_walk_t		walk = { .cache = cache };
+	STACK_OF(X509)			*chain;
+	time_t				now = time(NULL), expires;
+	int				i;
+
+	chain = X509_STORE_CTX_get1_chain(x509_ctx);
+	if (!chain) return;
+
+	/*
+	 *	Don't trust the chain past the expiry
+	 *	of any certificate in it.
+	 */
+	expires = now + cache->lifetime;
+	for (i = 0; i < sk_X509_num(chain); i++) {
+		int	days, secs;
+		time_t	not_after;
+
+		if (!ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(sk_X509_value(chain, i)))) goto error;
+
+		not_after = now + ((time_t)days * 86400) + secs;
+		if (not_after <= now) goto error;
+		if (not_after < expires) expires = not_after;
+	}
+
+	memcpy(find.fingerprint, fingerprint, sizeof(find.fingerprint));
+
+	pthread_mutex_lock(&cache->mutex);
+	verify_cache_generation_check(cache, now);
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) rbtree_deletebydata(cache->tree, entry);
+
+	if (rbtree_num_elements(cache->tree) >= cache->max_entries) {
+		rbtree_walk(cache->tree, RBTREE_DELETE_ORDER, _verify_cache_evict, &walk);
+		if (walk.oldest && (rbtree_num_elements(cache->tree) >= cache->max_entries)) {
+			rbtree_deletebydata(cache->tree, walk.oldest);
+		}
+	}
+
+	entry = talloc_zero(NULL, tls_verify_cache_entry_t);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		goto error;
+	}
+	talloc_set_destructor(entry, _verify_cache_entry_free);
+
+	memcpy(entry->fingerprint, fingerprint, sizeof(entry->fingerprint));
+	entry->chain = chain;
+	entry->generation = cache->generation;
+	entry->expires = expires;
+
+	if (!rbtree_insert(cache->tree, entry)) talloc_free(entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return;
+
+error:
+	sk_X509_pop_free(chain, X509_free);
+}
+
+static int _tls_verify_cache_free(tls_verify_cache_t *cache)
+{
+	talloc_free(cache->tree);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache of verified certificate chains
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] conf	TLS configuration.  Must outlive the cache.
+ * @return
+ *	- A new cache on success.
+ *	- NULL on failure.
+ */
+tls_verify_cache_t *tls_verify_cache_alloc(TALLOC_CTX *ctx, fr_tls_conf_t const *conf)
+{
+	tls_verify_cache_t *cache;
+
+	cache = talloc_zero(ctx, tls_verify_cache_t);
+	if (!cache) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	cache->tree = rbtree_create(NULL, verify_cache_entry_cmp, verify_cache_entry_free, 0);
+	if (!cache->tree) {
+		fr_strerror_printf("Failed creating verified chain tree");
+		talloc_free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _tls_verify_cache_free);
+
+	cache->max_entries = conf->verify_cache_max_entries;
+	cache->lifetime = conf->verify_cache_lifetime;
+	cache->ca_file = conf->ca_file;
+	cache->ca_path = conf->ca_path;
+	cache->ca_file_mtime = verify_cache_mtime(cache->ca_file);
+	cache->ca_path_mtime = verify_cache_mtime(cache->ca_path);
+
+	return cache;
+}
+#endif
+
+/** Verify a certificate chain, skipping the expensive checks if we've verified it before
+ *
+ * Replaces X509_verify_cert().  If the leaf certificate was part of a
+ * chain that was verified recently against the same CAs and CRLs, that
+ * chain is reused without building the path or checking signatures
+ * again.  tls_validate_cert_cb() is still called for every certificate
+ * in the chain, so attributes are added, and the per-request checks
+ * (issuer, CN, external command, OCSP) are run as usual.
+ *
+ * @param[in] x509_ctx	containing the certificate to verify.
+ * @param[in] arg	The fr_tls_conf_t the SSL_CTX was created with.
+ * @return
+ *	- 1 if the chain is valid.
+ *	- 0 if the chain is invalid.
+ */
+int tls_validate_chain_cb(X509_STORE_CTX *x509_ctx, void *arg)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	fr_tls_conf_t	*conf = talloc_get_type_abort(arg, fr_tls_conf_t);
+	X509		*cert;
+	STACK_OF(X509)	*chain;
+	uint8_t		fingerprint[SHA256_DIGEST_LENGTH];
+	unsigned int	fingerprint_len = sizeof(fingerprint);
+	SSL		*ssl;
+	REQUEST		*request;
+	int		i, ret;
+
+	if (!conf->verify_cache) return X509_verify_cert(x509_ctx);
+
+	cert = X509_STORE_CTX_get0_cert(x509_ctx);
+	if (!cert || !X509_digest(cert, EVP_sha256(), fingerprint, &fingerprint_len)) {
+		return X509_verify_cert(x509_ctx);
+	}
+
+	chain = verify_cache_find(conf->verify_cache, fingerprint);
+	if (!chain) {
+		ret = X509_verify_cert(x509_ctx);
+		if (ret == 1) verify_cache_store(conf->verify_cache, fingerprint, x509_ctx);
+
+		return ret;
+	}
+
+	ssl = X509_STORE_CTX_get_ex_data(x509_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+	request = (REQUEST *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	rad_assert(request != NULL);
+
+	RDEBUG2("Certificate chain was verified previously, skipping signature checks");
+
+	/*
+	 *	Make the chain available to OpenSSL and to the
+	 *	verify callback, as if X509_verify_cert() built it.
+	 */
+	X509_STORE_CTX_set0_verified_chain(x509_ctx, chain);
+	X509_STORE_CTX_set_error(x509_ctx, X509_V_OK);
+
+	for (i = sk_X509_num(chain) - 1; i >= 0; i--) {
+		X509_STORE_CTX_set_current_cert(x509_ctx, sk_X509_value(chain, i));
+		X509_STORE_CTX_set_error_depth(x509_ctx, i);
+
+		if (!tls_validate_cert_cb(1, x509_ctx)) {
+			if (X509_STORE_CTX_get_error(x509_ctx) == X509_V_OK) {
+				X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_APPLICATION_VERIFICATION);
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+#else
+	return X509_verify_cert(x509_ctx);
+#endif
+}
+
 /** Revalidates the client's certificate chain
  *
  * Wraps the tls_validate_cert_cb callback, allowing us to use the same
@@ -358,7 +686,7 @@ int tls_validate_client_cert_chain(SSL *ssl)
 	X509_STORE_CTX_set_ex_data(store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx(), ssl);
 	X509_STORE_CTX_set_verify_cb(store_ctx, tls_validate_cert_cb);
 
-	verify = X509_verify_cert(store_ctx);
+	verify = tls_validate_chain_cb(store_ctx, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF));
 	if (verify != 1) {
 		err = X509_STORE_CTX_get_error(store_ctx);
 
@@ -79,7 +79,7 @@ static int CC_HINT(nonnull) tls_socket_write(rad_listen_t *listener, REQUEST *re
 		p += rcode;
 	}
 
-	sock->tls_session->dirty_out.used = 0;
+	sock->tls_session->record_init(&sock->tls_session->dirty_out);
 
 	return 1;
 }
@@ -92,6 +92,7 @@ static int tls_socket_recv(rad_listen_t *listener)
 	REQUEST *request;
 	listen_socket_t *sock = listener->data;
 	int ret;
+	uint8_t *p;
 	RADCLIENT *client = sock->client;
 
 	if (!sock->packet) {
@@ -150,9 +151,14 @@ static int tls_socket_recv(rad_listen_t *listener)
 
 	RDEBUG3("Reading from socket %d", request->packet->sockfd);
 	pthread_mutex_lock(&sock->mutex);
-	rcode = read(request->packet->sockfd,
-		     sock->tls_session->dirty_in.data,
-		     sizeof(sock->tls_session->dirty_in.data));
+	sock->tls_session->record_init(&sock->tls_session->dirty_in);
+	p = sock->tls_session->record_reserve(&sock->tls_session->dirty_in, FR_TLS_MAX_RECORD_SIZE);
+	if (!p) {
+		RDEBUG("Failed allocating buffer for TLS data");
+		goto do_close;
+	}
+
+	rcode = read(request->packet->sockfd, p, FR_TLS_MAX_RECORD_SIZE);
 	if ((rcode < 0) && (errno == ECONNRESET)) {
 	do_close:
 		pthread_mutex_unlock(&sock->mutex);
@@ -190,7 +196,19 @@ static int tls_socket_recv(rad_listen_t *listener)
 	 *	If we need to do more initialization, do that here.
 	 */
 	if (!SSL_is_init_finished(sock->tls_session->ssl)) {
-		if (!tls_session_handshake(request, sock->tls_session)) {
+		int ret;
+
+		/*
+		 *	Listener threads can't yield, so wait here for
+		 *	any asynchronous crypto operations to complete.
+		 */
+		while ((ret = tls_session_handshake(request, sock->tls_session)) == 2) {
+			if (tls_session_async_wait(request, sock->tls_session) < 0) {
+				ret = 0;
+				break;
+			}
+		}
+		if (!ret) {
 			RDEBUG("FAILED in TLS handshake receive");
 			goto do_close;
 		}
@@ -633,31 +651,14 @@ int proxy_tls_recv(rad_listen_t *listener)
 	return 1;
 }
 
-int proxy_tls_send(rad_listen_t *listener, REQUEST *request)
+static ssize_t proxy_tls_write(rad_listen_t *listener, uint8_t const *data, size_t data_len)
 {
 	int rcode;
 	listen_socket_t *sock = listener->data;
 
-	VERIFY_REQUEST(request);
-
-	if ((listener->status != RAD_LISTEN_STATUS_INIT) &&
-	    (listener->status != RAD_LISTEN_STATUS_KNOWN)) return 0;
-
-	/*
-	 *	Normal proxying calls us with the data already
-	 *	encoded.  The "ping home server" code does not.  So,
-	 *	if there's no packet, encode it here.
-	 */
-	if (!request->proxy->packet->data) {
-		request->proxy->listener->encode(request->proxy->listener,
-						 request);
-	}
-
-	DEBUG3("Proxy is writing %u bytes to SSL",
-	       (unsigned int) request->proxy->packet->data_len);
+	DEBUG3("Proxy is writing %zu bytes to SSL", data_len);
 	pthread_mutex_lock(&sock->mutex);
-	rcode = SSL_write(sock->tls_session->ssl, request->proxy->packet->data,
-			  request->proxy->packet->data_len);
+	rcode = SSL_write(sock->tls_session->ssl, data, data_len);
 	if (rcode < 0) {
 		int err;
 
@@ -673,11 +674,39 @@ int proxy_tls_send(rad_listen_t *listener, REQUEST *request)
 			DEBUG("Closing TLS socket to home server");
 			tls_socket_close(listener);
 			pthread_mutex_unlock(&sock->mutex);
-			return 0;
+			fr_strerror_printf("TLS socket closed");
+			return -1;
 		}
 	}
 	pthread_mutex_unlock(&sock->mutex);
 
+	return data_len;
+}
+
+int proxy_tls_send(rad_listen_t *listener, REQUEST *request)
+{
+	VERIFY_REQUEST(request);
+
+	if ((listener->status != RAD_LISTEN_STATUS_INIT) &&
+	    (listener->status != RAD_LISTEN_STATUS_KNOWN)) return 0;
+
+	/*
+	 *	Normal proxying calls us with the data already
+	 *	encoded.  The "ping home server" code does not.  So,
+	 *	if there's no packet, encode it here.
+	 */
+	if (!request->proxy->packet->data) {
+		request->proxy->listener->encode(request->proxy->listener,
+						 request);
+	}
+
+	/*
+	 *	Packets from other threads may be written along
+	 *	with this one, in one SSL_write().
+	 */
+	if (listen_write_batched(listener, request->proxy->packet->data,
+				 request->proxy->packet->data_len, proxy_tls_write) < 0) return 0;
+
 	return 1;
 }
 #endif	/* WITH_PROXY */
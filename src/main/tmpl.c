@@ -2301,6 +2301,94 @@ int tmpl_copy_vps(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, vp_tmpl_t
 	return err;
 }
 
+/*
+ *	Number of attribute references remembered per request.
+ */
+#define TMPL_FIND_CACHE_SIZE	(16)
+
+typedef struct tmpl_find_cache_entry {
+	VALUE_PAIR		**list;		//!< The list which was searched, NULL if the entry is unused.
+	VALUE_PAIR		*head;		//!< The head of the list when it was searched.
+	fr_dict_attr_t const	*da;		//!< The attribute which was searched for.
+	int8_t			tag;		//!< The tag which was searched for.
+	VALUE_PAIR		*vp;		//!< The first match.
+	uint64_t		generation;	//!< Of the pair lists when the entry was added.
+} tmpl_find_cache_entry_t;
+
+struct tmpl_find_cache {
+	tmpl_find_cache_entry_t	entry[TMPL_FIND_CACHE_SIZE];
+};
+
+/** Find the first instance of an attribute, using the request's lookup cache
+ *
+ * Only successful lookups are cached.  An entry stays valid until
+ * the generation of the pair lists changes (see #fr_pair_list_changed),
+ * or the head of the list changes.  Appending to the list doesn't
+ * change the first match, so it doesn't invalidate anything.
+ *
+ * @param[out] out where to write the retrieved vp.  May be NULL.
+ * @param[in] request The current #REQUEST.
+ * @param[in] vpt specifying the #VALUE_PAIR type/tag to find.  Must be a
+ *	#TMPL_TYPE_ATTR for the first instance of the attribute.
+ * @return the same values as #tmpl_find_vp.
+ */
+static int tmpl_find_vp_cached(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt)
+{
+	REQUEST			*context = request;
+	VALUE_PAIR		**list, *vp;
+	vp_cursor_t		cursor;
+	tmpl_find_cache_entry_t	*entry;
+	uint64_t		generation;
+	unsigned int		slot;
+
+	if (out) *out = NULL;
+
+	if (radius_request(&context, vpt->tmpl_request) < 0) return -3;
+
+	list = radius_list(context, vpt->tmpl_list);
+	if (!list) return -2;
+
+	generation = fr_pair_list_generation();
+	slot = (((uintptr_t)list >> 4) ^ ((uintptr_t)vpt->tmpl_da >> 4) ^ (uint8_t)vpt->tmpl_tag) % TMPL_FIND_CACHE_SIZE;
+	entry = NULL;
+
+	if (request->tmpl_cache) {
+		entry = &request->tmpl_cache->entry[slot];
+
+		if ((entry->list == list) && (entry->da == vpt->tmpl_da) && (entry->tag == vpt->tmpl_tag) &&
+		    (entry->generation == generation) && (entry->head == *list)) {
+			VERIFY_VP(entry->vp);
+			if (out) *out = entry->vp;
+			return 0;
+		}
+	}
+
+	(void) fr_pair_cursor_init(&cursor, list);
+	vp = fr_pair_cursor_next_by_da(&cursor, vpt->tmpl_da, vpt->tmpl_tag);
+	if (!vp) return -1;
+
+	VERIFY_VP(vp);
+	if (out) *out = vp;
+
+	if (!entry) {
+		request->tmpl_cache = talloc_zero(request, struct tmpl_find_cache);
+		if (!request->tmpl_cache) return 0;
+
+		entry = &request->tmpl_cache->entry[slot];
+	}
+
+	vp->cached = true;
+
+	entry->list = list;
+	entry->head = *list;
+	entry->da = vpt->tmpl_da;
+	entry->tag = vpt->tmpl_tag;
+	entry->vp = vp;
+	entry->generation = generation;
+
+	return 0;
+}
+
 /** Returns the first VP matching a #vp_tmpl_t
  *
  * @param[out] out where to write the retrieved vp.
@@ -2324,6 +2412,14 @@ int tmpl_find_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt)
 
 	int err;
 
+	/*
+	 *	The first instance of an attribute is by far the most
+	 *	common lookup, and is often repeated.
+	 */
+	if ((vpt->type == TMPL_TYPE_ATTR) && ((vpt->tmpl_num == NUM_ANY) || (vpt->tmpl_num == 0))) {
+		return tmpl_find_vp_cached(out, request, vpt);
+	}
+
 	vp = tmpl_cursor_init(&err, &cursor, request, vpt);
 	if (out) *out = vp;
 
@@ -0,0 +1,305 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file trace.c
+ * @brief Sampled per-request tracing.
+ *
+ * One in every sample_rate requests records a span for each section, module
+ * call, xlat function and connection reservation.  When the request is finished, the spans
+ * are copied to a ring buffer, so the slowest requests can be examined
+ * with radmin, without having to run the server in debug mode.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trace.h>
+
+static uint32_t		trace_rate;		//!< Trace one in this many requests.
+static uint32_t		trace_counter;		//!< For sampling.
+
+static pthread_mutex_t	trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_t		*trace_buffer;		//!< Ring buffer of finished traces.
+static uint32_t		trace_buffer_size;
+static uint64_t		trace_buffer_next;	//!< Total number of traces written to the buffer.
+
+/** Microseconds between two times, clamped to fit in a span
+ *
+ */
+static uint32_t trace_usec(struct timeval const *start, struct timeval const *now)
+{
+	struct timeval	elapsed;
+	uint64_t	usec;
+
+	if (fr_timeval_cmp(now, start) <= 0) return 0;
+
+	fr_timeval_subtract(&elapsed, now, start);
+	usec = ((uint64_t) elapsed.tv_sec * 1000000) + elapsed.tv_usec;
+
+	return (usec > UINT32_MAX) ? UINT32_MAX : usec;
+}
+
+/** Allocate the ring buffer and set the sample rate
+ *
+ * @param[in] sample_rate	Trace one in this many requests, 0 to disable tracing.
+ * @param[in] buffer_size	How many finished traces to keep.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int trace_init(uint32_t sample_rate, uint32_t buffer_size)
+{
+	trace_t *buffer = NULL;
+
+	if (buffer_size) {
+		buffer = talloc_zero_array(talloc_null_ctx(), trace_t, buffer_size);
+		if (!buffer) {
+			ERROR("Out of memory allocating trace buffer");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&trace_mutex);
+	talloc_free(trace_buffer);
+	trace_buffer = buffer;
+	trace_buffer_size = buffer_size;
+	trace_buffer_next = 0;
+	pthread_mutex_unlock(&trace_mutex);
+
+	trace_sample_rate_set(sample_rate);
+
+	return 0;
+}
+
+/** Free the ring buffer, and stop tracing
+ *
+ */
+void trace_free(void)
+{
+	trace_sample_rate_set(0);
+
+	pthread_mutex_lock(&trace_mutex);
+	TALLOC_FREE(trace_buffer);
+	trace_buffer_size = 0;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+/** Change the sample rate at run time
+ *
+ * @param[in] sample_rate	Trace one in this many requests, 0 to disable tracing.
+ */
+void trace_sample_rate_set(uint32_t sample_rate)
+{
+	__atomic_store_n(&trace_rate, sample_rate, __ATOMIC_RELAXED);
+}
+
+/** Get the current sample rate
+ *
+ */
+uint32_t trace_sample_rate(void)
+{
+	return __atomic_load_n(&trace_rate, __ATOMIC_RELAXED);
+}
+
+/** Decide whether a new request should be traced
+ *
+ * @param[in] request	which has just been received.
+ */
+void trace_request_start(REQUEST *request)
+{
+	uint32_t	rate = trace_sample_rate();
+	trace_t		*trace;
+
+	if (!rate || !trace_buffer_size) return;
+
+	if ((__atomic_fetch_add(&trace_counter, 1, __ATOMIC_RELAXED) % rate) != 0) return;
+
+	/*
+	 *	Don't fail the request if we can't trace it.
+	 */
+	trace = talloc_zero(request, trace_t);
+	if (!trace) return;
+
+	trace->number = request->number;
+	if (request->packet) trace->code = request->packet->code;
+	gettimeofday(&trace->start, NULL);
+
+	request->trace = trace;
+}
+
+/** Record that the request is waiting for a thread
+ *
+ */
+void trace_request_queued(REQUEST *request)
+{
+	if (!request->trace) return;
+
+	gettimeofday(&request->trace->queued, NULL);
+}
+
+/** Record that a thread has picked up the request
+ *
+ */
+void trace_request_dequeued(REQUEST *request)
+{
+	struct timeval now;
+
+	if (!request->trace || !request->trace->queued.tv_sec) return;
+
+	gettimeofday(&now, NULL);
+	request->trace->queue_usec += trace_usec(&request->trace->queued, &now);
+	timerclear(&request->trace->queued);
+}
+
+/** Start a new span
+ *
+ * Spans started before this one is done are nested inside it.
+ *
+ * @param[in] request	being traced.
+ * @param[in] type	of the span.
+ * @param[in] name	of the section, module, xlat, or pool.
+ * @return
+ *	- The span, to pass to #trace_span_done.
+ *	- -1 if the request isn't being traced, or has too many spans.
+ */
+int trace_span_start(REQUEST *request, trace_span_type_t type, char const *name)
+{
+	trace_t		*trace;
+	trace_span_t	*span;
+	struct timeval	now;
+
+	if (!request || !request->trace) return -1;
+	trace = request->trace;
+
+	if (trace->num_spans >= TRACE_SPANS_MAX) {
+		trace->truncated = true;
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	span = &trace->span[trace->num_spans];
+	strlcpy(span->name, name ? name : "", sizeof(span->name));
+	span->type = type;
+	span->depth = trace->depth++;
+	span->start = trace_usec(&trace->start, &now);
+
+	return trace->num_spans++;
+}
+
+/** Finish a span
+ *
+ * @param[in] request	being traced.
+ * @param[in] span	as returned by #trace_span_start.
+ * @param[in] rcode	returned by the section or module.
+ */
+void trace_span_done(REQUEST *request, int span, rlm_rcode_t rcode)
+{
+	trace_t		*trace;
+	trace_span_t	*this;
+	struct timeval	now;
+
+	if (!request || !request->trace || (span < 0)) return;
+	trace = request->trace;
+
+	rad_assert(span < trace->num_spans);
+	this = &trace->span[span];
+
+	gettimeofday(&now, NULL);
+
+	this->usec = trace_usec(&trace->start, &now) - this->start;
+	this->rcode = rcode;
+	this->done = true;
+
+	/*
+	 *	Anything started after this span is no longer
+	 *	nested inside it.
+	 */
+	trace->depth = this->depth;
+}
+
+/** Copy the trace of a finished request to the ring buffer
+ *
+ * Spans which haven't finished (modules which yielded and were never
+ * resumed) are left marked as not done.
+ *
+ * @param[in] request	which has been finished.
+ */
+void trace_request_done(REQUEST *request)
+{
+	trace_t		*trace = request->trace;
+	struct timeval	now;
+
+	if (!trace) return;
+
+	gettimeofday(&now, NULL);
+	trace->usec = trace_usec(&trace->start, &now);
+	if (request->server) strlcpy(trace->server, request->server, sizeof(trace->server));
+	if (request->reply) trace->reply_code = request->reply->code;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_buffer_size) {
+		trace_buffer[trace_buffer_next % trace_buffer_size] = *trace;
+		trace_buffer_next++;
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	TALLOC_FREE(request->trace);
+}
+
+/** Copy the contents of the ring buffer
+ *
+ * @param[in] ctx	to allocate the copy in.
+ * @param[in,out] count	Maximum number of traces to copy, or 0 for all of them.
+ *			Is set to the number of traces copied.
+ * @return
+ *	- An array of traces, newest first.
+ *	- NULL if there are no traces, or on error.
+ */
+trace_t *trace_buffer_copy(TALLOC_CTX *ctx, uint32_t *count)
+{
+	trace_t		*out;
+	uint32_t	available, i;
+
+	pthread_mutex_lock(&trace_mutex);
+	available = (trace_buffer_next < trace_buffer_size) ? trace_buffer_next : trace_buffer_size;
+	if (!*count || (*count > available)) *count = available;
+
+	if (!*count) {
+		pthread_mutex_unlock(&trace_mutex);
+		return NULL;
+	}
+
+	out = talloc_array(ctx, trace_t, *count);
+	if (!out) {
+		pthread_mutex_unlock(&trace_mutex);
+		*count = 0;
+		return NULL;
+	}
+
+	for (i = 0; i < *count; i++) {
+		out[i] = trace_buffer[(trace_buffer_next - 1 - i) % trace_buffer_size];
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	return out;
+}
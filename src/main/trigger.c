@@ -35,14 +35,69 @@ static pthread_mutex_t		*trigger_mutex;
 #define REQUEST_INDEX_TRIGGER_NAME	1
 #define REQUEST_INDEX_TRIGGER_ARGS	2
 
+#define TRIGGER_MAX_THREADS	32
+
+typedef enum {
+	TRIGGER_SINK_EXEC = 0,		//!< Run the trigger command.
+	TRIGGER_SINK_LOG		//!< Log the expanded trigger command, without forking.
+} trigger_sink_t;
+
+static const FR_NAME_NUMBER trigger_sink_table[] = {
+	{ "exec",	TRIGGER_SINK_EXEC },
+	{ "log",	TRIGGER_SINK_LOG },
+	{ NULL,		-1 }
+};
+
 /** Describes a rate limiting entry for a trigger
  *
+ * When aggregation is enabled, there's one entry for each trigger and
+ * set of arguments.  Otherwise it's one per trigger.
  */
+typedef struct trigger_job_t trigger_job_t;
+
 typedef struct {
 	CONF_ITEM	*ci;		//!< Config item this rate limit counter is associated with.
+	uint32_t	args_hash;	//!< Of the trigger arguments, so different pools are counted separately.
 	time_t		last_fired;	//!< When this trigger last fired.
+
+	uint32_t	suppressed;	//!< Events collapsed since the trigger last fired.
+	trigger_job_t	*last;		//!< Copy of the most recent suppressed event, so the
+					//!< dispatcher can fire it when the window closes.
 } trigger_last_fired_t;
 
+/** A trigger waiting for a dispatcher thread
+ *
+ */
+struct trigger_job_t {
+	trigger_job_t	*next;
+	char		*name;		//!< Of the trigger.
+	char		*value;		//!< Command to execute.
+	REQUEST		*request;	//!< Holding copies of the request attributes and the trigger args.
+	VALUE_PAIR	*args;
+};
+
+static uint32_t			trigger_window;		//!< Collapse identical events over this many seconds.
+static uint32_t			trigger_num_threads;	//!< 0 means run triggers in the caller.
+static uint32_t			trigger_max_queued;	//!< Queued triggers above this are dropped.
+static char const		*trigger_sink_name;
+static trigger_sink_t		trigger_sink;
+
+static const CONF_PARSER trigger_dispatch_config[] = {
+	{ FR_CONF_POINTER("aggregate_window", PW_TYPE_INTEGER, &trigger_window), .dflt = "0" },
+	{ FR_CONF_POINTER("threads", PW_TYPE_INTEGER, &trigger_num_threads), .dflt = "0" },
+	{ FR_CONF_POINTER("max_queued", PW_TYPE_INTEGER, &trigger_max_queued), .dflt = "1024" },
+	{ FR_CONF_POINTER("sink", PW_TYPE_STRING, &trigger_sink_name), .dflt = "exec" },
+	CONF_PARSER_TERMINATOR
+};
+
+static pthread_t		trigger_threads[TRIGGER_MAX_THREADS];
+static uint32_t			trigger_threads_running;
+static pthread_cond_t		trigger_cond = PTHREAD_COND_INITIALIZER;
+static trigger_job_t		*trigger_queue_head, **trigger_queue_tail = &trigger_queue_head;
+static uint32_t			trigger_queue_len;
+static uint64_t			trigger_dropped;
+static bool			trigger_stopping;
+
 /** Retrieve attributes from a special trigger list
  *
  */
@@ -89,7 +144,10 @@ static int _mutex_free(pthread_mutex_t *mutex)
 
 static void _trigger_last_fired_free(void *data)
 {
-	talloc_free(data);
+	trigger_last_fired_t *found = data;
+
+	talloc_free(found->last);
+	talloc_free(found);
 }
 
 /** Compares two last fired structures
@@ -106,9 +164,296 @@ static int _trigger_last_fired_cmp(void const *a, void const *b)
 	trigger_last_fired_t const *lf_a = a, *lf_b = b;
 
 	if (lf_a->ci < lf_b->ci) return -1;
-	if (lf_a->ci == lf_b->ci) return 0;
+	if (lf_a->ci > lf_b->ci) return 1;
+
+	if (lf_a->args_hash < lf_b->args_hash) return -1;
+	if (lf_a->args_hash > lf_b->args_hash) return 1;
+
+	return 0;
+}
+
+/** Hash the trigger arguments
+ *
+ * Events from different connection pools use the same trigger, but
+ * different arguments.  They shouldn't be collapsed into one.
+ */
+static uint32_t trigger_args_hash(VALUE_PAIR *args)
+{
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	uint32_t	hash;
+	char		buffer[256];
+
+	hash = fr_hash("trigger", 7);
+
+	for (vp = fr_pair_cursor_init(&cursor, &args);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		size_t len;
+
+		hash = fr_hash_update(&vp->da, sizeof(vp->da), hash);
+
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+		if (len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+		hash = fr_hash_update(buffer, len, hash);
+	}
+
+	return hash;
+}
+
+/** Append the number of events a trigger stands for to its arguments
+ *
+ */
+static VALUE_PAIR *trigger_args_count(TALLOC_CTX *ctx, VALUE_PAIR *args, uint32_t count)
+{
+	VALUE_PAIR	*out, *vp;
+
+	out = fr_pair_list_copy(ctx, args);
+
+	vp = fr_pair_afrom_num(ctx, 0, PW_TRIGGER_COUNT);
+	if (!vp) return out;
+
+	vp->vp_integer = count;
+	fr_pair_add(&out, vp);
+
+	return out;
+}
+
+/** Run a trigger, either by executing the command, or by logging it
+ *
+ * @param request	to expand the command with.
+ * @param name		of the trigger.
+ * @param value		the command.
+ * @param args		to make available via the @verbatim %{trigger:<arg>} @endverbatim xlat.
+ * @param exec_wait	wait for the command to finish.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int trigger_run(REQUEST *request, char const *name, char const *value, VALUE_PAIR *args, bool exec_wait)
+{
+	VALUE_PAIR	*vp = NULL;
+	int		ret = 0;
+
+	/*
+	 *	May be called for Status-Server packets.
+	 */
+	if (request->packet) vp = request->packet->vps;
+
+	RDEBUG2("Trigger \"%s\": %s", name, value);
+
+	/*
+	 *	Add the args to the request data, so they can be picked up by the
+	 *	xlat_trigger function.
+	 */
+	if (args && (request_data_add(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS, args,
+				      false, false, false) < 0)) {
+		RERROR("Failed adding trigger request data");
+		return -1;
+	}
+
+	{
+		void *name_tmp;
+
+		memcpy(&name_tmp, &name, sizeof(name_tmp));
+
+		if (request_data_add(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_NAME,
+				     name_tmp, false, false, false) < 0) {
+			RERROR("Failed marking request as inside trigger");
+			return -1;
+		}
+	}
+
+	/*
+	 *	Don't fire triggers if we're just testing
+	 */
+	if (!check_config) switch (trigger_sink) {
+	case TRIGGER_SINK_EXEC:
+		ret = radius_exec_program(request, NULL, 0, NULL, request, value, vp,
+					  exec_wait, true, EXEC_TIMEOUT);
+		break;
+
+	case TRIGGER_SINK_LOG:
+	{
+		char *expanded = NULL;
+
+		if (xlat_aeval(request, &expanded, request, value, NULL, NULL) < 0) {
+			ret = -1;
+			break;
+		}
+		INFO("Trigger \"%s\": %s", name, expanded);
+		talloc_free(expanded);
+	}
+		break;
+	}
+
+	request_data_reference(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_NAME);
+	request_data_reference(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS);
+
+	return ret;
+}
+
+/** Copy everything a trigger needs, so it can be run after the caller has returned
+ *
+ * Only the request attributes and the trigger arguments are copied.
+ * Commands run by a dispatcher thread can't refer to the control or
+ * reply lists.
+ */
+static trigger_job_t *trigger_job_alloc(REQUEST *request, char const *name, char const *value,
+					VALUE_PAIR *args, uint32_t count)
+{
+	trigger_job_t *job;
+
+	job = talloc_zero(NULL, trigger_job_t);
+	if (!job) return NULL;
+
+	job->name = talloc_typed_strdup(job, name);
+	job->value = talloc_typed_strdup(job, value);
+
+	job->request = request_alloc(job);
+	if (!job->request) {
+	error:
+		talloc_free(job);
+		return NULL;
+	}
+
+	if (request && request->packet) {
+		job->request->packet = fr_radius_alloc(job->request, false);
+		if (!job->request->packet) goto error;
+
+		job->request->packet->code = request->packet->code;
+		job->request->packet->vps = fr_pair_list_copy(job->request->packet, request->packet->vps);
+	}
+
+	if (trigger_window) {
+		job->args = trigger_args_count(job, args, count);
+	} else {
+		job->args = fr_pair_list_copy(job, args);
+	}
+
+	return job;
+}
+
+/** Add a job to the dispatch queue
+ *
+ * @note Must be called with the trigger mutex held.
+ */
+static void trigger_job_enqueue(trigger_job_t *job)
+{
+	if (trigger_queue_len >= trigger_max_queued) {
+		trigger_dropped++;
+		RATE_LIMIT(WARN("Trigger queue is full, dropping \"%s\" (%" PRIu64 " dropped so far)",
+				job->name, trigger_dropped));
+		talloc_free(job);
+		return;
+	}
+
+	job->next = NULL;
+	*trigger_queue_tail = job;
+	trigger_queue_tail = &job->next;
+	trigger_queue_len++;
 
-	return 1;
+	pthread_cond_signal(&trigger_cond);
+}
+
+typedef struct {
+	time_t		now;
+	bool		all;		//!< Flush everything, we're exiting.
+	time_t		next;		//!< When the next window closes.
+} trigger_flush_ctx_t;
+
+/** Fire the collapsed events of triggers whose window has closed
+ *
+ */
+static int _trigger_flush(void *uctx, void *data)
+{
+	trigger_last_fired_t	*found = data;
+	trigger_flush_ctx_t	*ctx = uctx;
+	trigger_job_t		*job;
+
+	if (!found->suppressed) return 0;
+
+	if (!ctx->all && (ctx->now < (found->last_fired + (time_t) trigger_window))) {
+		time_t closes = found->last_fired + trigger_window;
+
+		if (!ctx->next || (closes < ctx->next)) ctx->next = closes;
+		return 0;
+	}
+
+	job = found->last;
+	found->last = NULL;
+
+	/*
+	 *	The count was set when the event was copied, fix it up
+	 *	to be the number of events collapsed into this one.
+	 */
+	if (job) {
+		VALUE_PAIR *vp;
+
+		vp = fr_pair_find_by_num(job->args, 0, PW_TRIGGER_COUNT, TAG_ANY);
+		if (vp) vp->vp_integer = found->suppressed;
+
+		trigger_job_enqueue(job);
+	}
+
+	found->suppressed = 0;
+	found->last_fired = ctx->now;
+
+	return 0;
+}
+
+/** Take jobs off the queue, and run them
+ *
+ * The number of dispatcher threads limits the number of trigger
+ * commands which can be running at the same time.
+ */
+static void *trigger_dispatch(UNUSED void *arg)
+{
+	pthread_mutex_lock(trigger_mutex);
+	for (;;) {
+		trigger_job_t		*job;
+		trigger_flush_ctx_t	ctx;
+
+		ctx.now = time(NULL);
+		ctx.all = trigger_stopping;
+		ctx.next = 0;
+
+		if (trigger_window) rbtree_walk(trigger_last_fired_tree, RBTREE_IN_ORDER, _trigger_flush, &ctx);
+
+		job = trigger_queue_head;
+		if (!job) {
+			struct timespec when;
+
+			if (trigger_stopping) break;
+
+			if (!ctx.next) {
+				pthread_cond_wait(&trigger_cond, trigger_mutex);
+				continue;
+			}
+
+			when.tv_sec = ctx.next;
+			when.tv_nsec = 0;
+			pthread_cond_timedwait(&trigger_cond, trigger_mutex, &when);
+			continue;
+		}
+
+		trigger_queue_head = job->next;
+		if (!trigger_queue_head) trigger_queue_tail = &trigger_queue_head;
+		trigger_queue_len--;
+		pthread_mutex_unlock(trigger_mutex);
+
+		/*
+		 *	Wait for the command, so that there are never
+		 *	more children than dispatcher threads.
+		 */
+		(void) trigger_run(job->request, job->name, job->value, job->args, true);
+		talloc_free(job);
+
+		pthread_mutex_lock(trigger_mutex);
+	}
+	pthread_mutex_unlock(trigger_mutex);
+
+	return NULL;
 }
 
 /** Set the global trigger section trigger_exec will search in, and register xlats
@@ -121,6 +466,9 @@ static int _trigger_last_fired_cmp(void const *a, void const *b)
  */
 void trigger_exec_init(CONF_SECTION const *cs)
 {
+	CONF_SECTION	*dispatch_cs;
+	uint32_t	i;
+
 	trigger_exec_main = cs;
 	trigger_exec_subcs = cf_section_sub_find(cs, "trigger");
 
@@ -132,13 +480,69 @@ void trigger_exec_init(CONF_SECTION const *cs)
 	talloc_set_destructor(trigger_mutex, _mutex_free);
 
 	xlat_register(NULL, "trigger", xlat_trigger, NULL, NULL, 0, 0);
+
+	/*
+	 *	Defaults are to run triggers in the caller, one
+	 *	execution per event, as we always have.
+	 */
+	trigger_window = 0;
+	trigger_num_threads = 0;
+	trigger_max_queued = 1024;
+	trigger_sink = TRIGGER_SINK_EXEC;
+	trigger_stopping = false;
+	trigger_dropped = 0;
+
+	dispatch_cs = cf_section_sub_find(cs, "trigger_dispatch");
+	if (!dispatch_cs) return;
+
+	if (cf_section_parse(dispatch_cs, NULL, trigger_dispatch_config) < 0) {
+		ERROR("Failed parsing \"trigger_dispatch\", using defaults");
+		return;
+	}
+
+	if (trigger_num_threads > TRIGGER_MAX_THREADS) {
+		WARN("trigger_dispatch.threads %u is too large, setting it to %u",
+		     trigger_num_threads, TRIGGER_MAX_THREADS);
+		trigger_num_threads = TRIGGER_MAX_THREADS;
+	}
+
+	trigger_sink = fr_str2int(trigger_sink_table, trigger_sink_name, -1);
+	if ((int) trigger_sink < 0) {
+		WARN("Unknown trigger_dispatch.sink \"%s\", using \"exec\"", trigger_sink_name);
+		trigger_sink = TRIGGER_SINK_EXEC;
+	}
+
+	for (i = 0; i < trigger_num_threads; i++) {
+		int ret;
+
+		ret = pthread_create(&trigger_threads[i], NULL, trigger_dispatch, NULL);
+		if (ret != 0) {
+			ERROR("Failed creating trigger dispatcher thread: %s", fr_syserror(ret));
+			break;
+		}
+	}
+	trigger_threads_running = i;
 }
 
 /** Free trigger resources
  *
+ * Waits for the dispatcher threads to run any queued triggers, and any
+ * events which are still being collapsed.
  */
 void trigger_exec_free(void)
 {
+	uint32_t i;
+
+	if (trigger_threads_running) {
+		pthread_mutex_lock(trigger_mutex);
+		trigger_stopping = true;
+		pthread_cond_broadcast(&trigger_cond);
+		pthread_mutex_unlock(trigger_mutex);
+
+		for (i = 0; i < trigger_threads_running; i++) pthread_join(trigger_threads[i], NULL);
+		trigger_threads_running = 0;
+	}
+
 	TALLOC_FREE(trigger_last_fired_tree);
 	TALLOC_FREE(trigger_mutex);
 }
@@ -167,9 +571,9 @@ int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, boo
 	char const		*attr;
 	char const		*value;
 
-	VALUE_PAIR		*vp;
-
 	REQUEST			*fake = NULL;
+	VALUE_PAIR		*count_args = NULL;
+	uint32_t		count = 1;
 	int			ret = 0;
 
 	/*
@@ -223,77 +627,103 @@ int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, boo
 	}
 
 	/*
-	 *	May be called for Status-Server packets.
-	 */
-	vp = NULL;
-	if (request && request->packet) vp = request->packet->vps;
-
-	/*
-	 *	Perform periodic rate_limiting.
+	 *	Perform periodic rate_limiting, or collapse identical
+	 *	events into one.
 	 */
-	if (rate_limit) {
+	if (rate_limit || trigger_window) {
 		trigger_last_fired_t	find, *found;
 		time_t			now = time(NULL);
 
 		find.ci = ci;
+		find.args_hash = trigger_window ? trigger_args_hash(args) : 0;
 
 		pthread_mutex_lock(trigger_mutex);
 
 		found = rbtree_finddata(trigger_last_fired_tree, &find);
 		if (!found) {
-			MEM(found = talloc(NULL, trigger_last_fired_t));
+			MEM(found = talloc_zero(NULL, trigger_last_fired_t));
 			found->ci = ci;
+			found->args_hash = find.args_hash;
 			found->last_fired = 0;
 
 			rbtree_insert(trigger_last_fired_tree, found);
 		}
 
-		pthread_mutex_unlock(trigger_mutex);
+		if (!trigger_window) {
+			pthread_mutex_unlock(trigger_mutex);
+
+			/*
+			 *	Send the rate_limited traps at most once per second.
+			 */
+			if (found->last_fired == now) return -1;
+			found->last_fired = now;
+
+		} else if (now < (found->last_fired + (time_t) trigger_window)) {
+			/*
+			 *	Inside the window.  Count it, and keep a copy
+			 *	so a dispatcher thread can fire it when the
+			 *	window closes.  Without dispatcher threads, the
+			 *	count is passed on with the next event after
+			 *	the window.
+			 */
+			found->suppressed++;
+			if (trigger_threads_running) {
+				trigger_job_t *job;
+
+				job = trigger_job_alloc(request, name, value, args, found->suppressed);
+				if (job) {
+					talloc_free(found->last);
+					found->last = job;
+				}
+				pthread_cond_signal(&trigger_cond);
+			}
+			pthread_mutex_unlock(trigger_mutex);
+
+			ROPTIONAL(RDEBUG3, DEBUG3, "Trigger \"%s\" collapsed (%u events in window)",
+				  name, found->suppressed);
+			return 0;
 
-		/*
-		 *	Send the rate_limited traps at most once per second.
-		 */
-		if (found->last_fired == now) return -1;
-		found->last_fired = now;
+		} else {
+			count += found->suppressed;
+			found->suppressed = 0;
+			TALLOC_FREE(found->last);
+			found->last_fired = now;
+			pthread_mutex_unlock(trigger_mutex);
+		}
 	}
 
 	/*
-	 *	radius_exec_program always needs a request.
+	 *	Hand it to a dispatcher thread.  The caller never forks.
 	 */
-	if (!request) request = fake = request_alloc(NULL);
+	if (trigger_threads_running) {
+		trigger_job_t *job;
 
-	RDEBUG2("Trigger \"%s\": %s", name, value);
-
-	/*
-	 *	Add the args to the request data, so they can be picked up by the
-	 *	xlat_trigger function.
-	 */
-	if (args && (request_data_add(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS, args,
-				      false, false, false) < 0)) {
-		RERROR("Failed adding trigger request data");
-		return -1;
-	}
-
-	{
-		void *name_tmp;
-
-		memcpy(&name_tmp, &name, sizeof(name_tmp));
-
-		if (request_data_add(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_NAME,
-				     name_tmp, false, false, false) < 0) {
-			RERROR("Failed marking request as inside trigger");
+		job = trigger_job_alloc(request, name, value, args, count);
+		if (!job) {
+			ROPTIONAL(RERROR, ERROR, "Failed queueing trigger \"%s\"", name);
 			return -1;
 		}
+
+		pthread_mutex_lock(trigger_mutex);
+		trigger_job_enqueue(job);
+		pthread_mutex_unlock(trigger_mutex);
+
+		return 0;
 	}
 
 	/*
-	 *	Don't fire triggers if we're just testing
+	 *	radius_exec_program always needs a request.
 	 */
-	if (!check_config) ret = radius_exec_program(request, NULL, 0, NULL,
-						     request, value, vp, false, true, EXEC_TIMEOUT);
-	request_data_reference(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_NAME);
-	request_data_reference(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS);
+	if (!request) request = fake = request_alloc(NULL);
+
+	if (trigger_window) {
+		count_args = trigger_args_count(request, args, count);
+		args = count_args;
+	}
+
+	ret = trigger_run(request, name, value, args, false);
 
+	fr_pair_list_free(&count_args);
 	if (fake) talloc_free(fake);
 
 	return ret;
@@ -34,6 +34,7 @@ typedef struct REQUEST REQUEST;
 #include <freeradius-devel/conf.h>
 #include <freeradius-devel/radpaths.h>
 #include <freeradius-devel/dhcp.h>
+#include <freeradius-devel/net.h>
 
 #ifdef WITH_TACACS
 #include "../modules/proto_tacacs/tacacs.h"
@@ -89,6 +90,8 @@ static RADIUS_PACKET my_packet = {
 
 static char *my_secret = NULL;
 
+static fr_radius_encode_plan_t *my_plan = NULL;
+
 /*
  *	End of hacks for xlat
  *
@@ -578,6 +581,53 @@ static void parse_xlat(char const *input, char *output, size_t outlen)
 	talloc_free(fmt);
 }
 
+/** Encode a list of VALUE_PAIRs as RADIUS attributes
+ *
+ * Exits on error, as there's no output we could check.
+ */
+static size_t encode_pairs(uint8_t *out, size_t outlen, VALUE_PAIR **head, fr_radius_ctx_t *encoder_ctx)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	uint8_t		*attr = out;
+	ssize_t		len;
+
+	fr_pair_cursor_init(&cursor, head);
+	while ((vp = fr_pair_cursor_current(&cursor))) {
+		len = fr_radius_encode_pair(attr, out + outlen - attr, &cursor, encoder_ctx);
+		if (len < 0) {
+			fprintf(stderr, "Failed encoding %s: %s\n",
+				vp->da->name, fr_strerror());
+			exit(1);
+		}
+
+		attr += len;
+		if (len == 0) break;
+	}
+
+	return attr - out;
+}
+
+/** Print a list of VALUE_PAIRs, separated by commas
+ *
+ */
+static void print_pairs(char *out, size_t outlen, VALUE_PAIR *head)
+{
+	VALUE_PAIR	*vp;
+	char		*p = out;
+
+	*out = '\0';
+	for (vp = head; vp; vp = vp->next) {
+		fr_pair_snprint(p, outlen - (p - out), vp);
+		p += strlen(p);
+
+		if (vp->next) {
+			strcpy(p, ", ");
+			p += 2;
+		}
+	}
+}
+
 static void process_file(fr_dict_t *dict, const char *root_dir, char const *filename)
 {
 	int		lineno;
@@ -686,7 +736,6 @@ static void process_file(fr_dict_t *dict, const char *root_dir, char const *file
 		}
 
 		if (strncmp(p, "encode ", 7) == 0) {
-			vp_cursor_t cursor;
 			fr_radius_ctx_t encoder_ctx = { .packet = &my_packet,
 								.original = &my_original,
 								.secret = my_secret };
@@ -705,22 +754,36 @@ static void process_file(fr_dict_t *dict, const char *root_dir, char const *file
 				continue;
 			}
 
-			attr = data;
-			fr_pair_cursor_init(&cursor, &head);
-			while ((vp = fr_pair_cursor_current(&cursor))) {
-				len = fr_radius_encode_pair(attr, data + sizeof(data) - attr, &cursor, &encoder_ctx);
-				if (len < 0) {
-					fprintf(stderr, "Failed encoding %s: %s\n",
-						vp->da->name, fr_strerror());
-					exit(1);
-				}
+			outlen = encode_pairs(data, sizeof(data), &head, &encoder_ctx);
+			fr_pair_list_free(&head);
+			goto print_hex;
+		}
 
-				attr += len;
-				if (len == 0) break;
+		/*
+		 *	The same as "encode", but using the cache of
+		 *	pre-computed attribute headers.  The cache lasts
+		 *	for the whole file, so repeating a line checks
+		 *	the cached headers, too.
+		 */
+		if (strncmp(p, "encode-plan ", 12) == 0) {
+			fr_radius_ctx_t encoder_ctx = { .packet = &my_packet,
+								.original = &my_original,
+								.secret = my_secret,
+								.plan = my_plan };
+
+			if (strcmp(p + 12, "-") == 0) {
+				p = output;
+			} else {
+				p += 12;
+			}
+
+			if (fr_pair_list_afrom_str(NULL, p, &head) != T_EOL) {
+				strlcpy(output, fr_strerror(), sizeof(output));
+				continue;
 			}
 
+			outlen = encode_pairs(data, sizeof(data), &head, &encoder_ctx);
 			fr_pair_list_free(&head);
-			outlen = attr - data;
 			goto print_hex;
 		}
 
@@ -766,18 +829,7 @@ static void process_file(fr_dict_t *dict, const char *root_dir, char const *file
 			 *	it if so.
 			 */
 			if (head) {
-				p = output;
-				for (vp = fr_pair_cursor_first(&cursor);
-				     vp;
-				     vp = fr_pair_cursor_next(&cursor)) {
-					fr_pair_snprint(p, sizeof(output) - (p - output), vp);
-					p += strlen(p);
-
-					if (vp->next) {strcpy(p, ", ");
-						p += 2;
-					}
-				}
-
+				print_pairs(output, sizeof(output), head);
 				fr_pair_list_free(&head);
 			} else if (my_len < 0) {
 				strlcpy(output, fr_strerror(), sizeof(output));
@@ -788,6 +840,73 @@ static void process_file(fr_dict_t *dict, const char *root_dir, char const *file
 			continue;
 		}
 
+		/*
+		 *	Wrap the attributes in a packet, and decode it
+		 *	the way the server does.  fr_radius_ok() indexes
+		 *	the attributes, and large "octets" values point
+		 *	into the packet instead of being copied.
+		 */
+		if (strncmp(p, "decode-lazy ", 12) == 0) {
+			RADIUS_PACKET	*packet;
+			size_t		packet_len;
+			decode_fail_t	reason;
+
+			if (strcmp(p + 12, "-") == 0) {
+				len = data_len;
+			} else {
+				len = encode_hex(p + 12, data, sizeof(data));
+				if (len == 0) {
+					fprintf(stderr, "Failed decoding hex string at line %d of %s\n", lineno, directory);
+					exit(1);
+				}
+			}
+
+			packet = fr_radius_alloc(NULL, false);
+			if (!packet) {
+				fprintf(stderr, "Failed allocating packet\n");
+				exit(1);
+			}
+
+			packet_len = RADIUS_HDR_LEN + len;
+			packet->data = talloc_array(packet, uint8_t, packet_len);
+			if (!packet->data) {
+				fprintf(stderr, "Failed allocating packet data\n");
+				exit(1);
+			}
+			packet->data_len = packet_len;
+
+			packet->data[0] = my_packet.code;
+			packet->data[1] = my_packet.id;
+			packet->data[2] = (packet_len >> 8) & 0xff;
+			packet->data[3] = packet_len & 0xff;
+			memcpy(packet->data + 4, my_packet.vector, AUTH_VECTOR_LEN);
+			memcpy(packet->data + RADIUS_HDR_LEN, data, len);
+
+			fr_radius_ok_index = true;
+			fr_radius_borrow_octets = true;
+
+			/*
+			 *	fr_radius_ok() only sets an error message
+			 *	when debugging, so print the reason instead.
+			 */
+			if (!fr_radius_ok(packet, false, &reason)) {
+				snprintf(output, sizeof(output), "Malformed packet (reason %d)", reason);
+
+			} else if ((fr_radius_decode_lazy(packet, &my_original, my_secret) < 0) ||
+				   (fr_radius_decode_pending(packet) < 0)) {
+				strlcpy(output, fr_strerror(), sizeof(output));
+
+			} else {
+				print_pairs(output, sizeof(output), packet->vps);
+			}
+
+			fr_radius_ok_index = false;
+			fr_radius_borrow_octets = false;
+
+			talloc_free(packet);
+			continue;
+		}
+
 		/*
 		 *	And some DHCP tests
 		 */
@@ -1105,6 +1224,12 @@ int main(int argc, char *argv[])
 
 	my_secret = talloc_strdup(NULL, "testing123");
 
+	my_plan = fr_radius_encode_plan_alloc(NULL);
+	if (!my_plan) {
+		fprintf(stderr, "Failed allocating encode plan\n");
+		return 1;
+	}
+
 	if (argc < 2) {
 		process_file(dict, NULL, "-");
 
@@ -1112,6 +1237,11 @@ int main(int argc, char *argv[])
 		process_file(dict, NULL, argv[1]);
 	}
 
+	/*
+	 *	The plan points to attributes in the dictionary.
+	 */
+	TALLOC_FREE(my_plan);
+
 	if (report) {
 		talloc_free(dict);
 		talloc_free(my_secret);
@@ -25,9 +25,11 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/map_proc.h>
 #include <freeradius-devel/state.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trace.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -682,6 +684,454 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, UNUSED void *proc_inst, U
 	return RLM_MODULE_FAIL;
 }
 
+/** Create a new request with a copy of the packet in a template request
+ *
+ * Each benchmark iteration gets its own request, so the policy sees
+ * exactly the same input every time.
+ */
+static REQUEST *request_clone(REQUEST const *template, uint64_t number)
+{
+	REQUEST		*request;
+
+	request = request_alloc(NULL);
+
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+	if (!request->packet || !request->reply) {
+		ERROR("No memory");
+		talloc_free(request);
+		return NULL;
+	}
+	gettimeofday(&request->packet->timestamp, NULL);
+
+	request->packet->code = template->packet->code;
+	request->packet->id = template->packet->id;
+	request->packet->src_ipaddr = template->packet->src_ipaddr;
+	request->packet->src_port = template->packet->src_port;
+	request->packet->dst_ipaddr = template->packet->dst_ipaddr;
+	request->packet->dst_port = template->packet->dst_port;
+	memcpy(request->packet->vector, template->packet->vector, sizeof(request->packet->vector));
+	request->packet->vps = fr_pair_list_copy(request->packet, template->packet->vps);
+
+	request->reply->dst_ipaddr = request->packet->src_ipaddr;
+	request->reply->src_ipaddr = request->packet->dst_ipaddr;
+	request->reply->dst_port = request->packet->src_port;
+	request->reply->src_port = request->packet->dst_port;
+	request->reply->id = request->packet->id;
+	memcpy(request->reply->vector, request->packet->vector, sizeof(request->reply->vector));
+
+	request->listener = listen_alloc(request);
+	request->client = template->client;
+	request->number = number;
+
+	request->master_state = REQUEST_ACTIVE;
+	request->child_state = REQUEST_RUNNING;
+	request->handle = NULL;
+	request->server = talloc_typed_strdup(request, template->server);
+
+	request->root = &main_config;
+
+	request->log.lvl = rad_debug_lvl;
+	request->log.func = vradlog_request;
+
+	request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+	request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
+
+	return request;
+}
+
+/** Stub out modules, so that policies can be run without their backends
+ *
+ * The stub file contains one section per module instance, e.g.
+ *
+ @verbatim
+ldap {
+	rcode = ok
+	update {
+		&control:Password-With-Header := "{clear}hello"
+	}
+}
+ @endverbatim
+ *
+ * The module is never called.  Instead, the updates are applied to
+ * the request, and "rcode" (default "ok") is returned.
+ *
+ * @param[in] filename	of the stub file.
+ * @return
+ *	- The parsed stub file, which must be kept until the modules are freed.
+ *	- NULL on error.
+ */
+static CONF_SECTION *stubs_load(char const *filename)
+{
+	CONF_SECTION	*stubs, *cs, *modules;
+
+	modules = cf_section_sub_find(main_config.config, "modules");
+	if (!modules) {
+		ERROR("Can't stub modules, there is no \"modules\" section");
+		return NULL;
+	}
+
+	stubs = cf_section_alloc(NULL, "stubs", NULL);
+	if (cf_file_read(stubs, filename) < 0) {
+		ERROR("Failed parsing stub file %s", filename);
+	error:
+		talloc_free(stubs);
+		return NULL;
+	}
+
+	for (cs = cf_subsection_find_next(stubs, NULL, NULL);
+	     cs != NULL;
+	     cs = cf_subsection_find_next(stubs, cs, NULL)) {
+		module_instance_t	*instance;
+		CONF_PAIR		*cp;
+		CONF_SECTION		*update;
+		int			code = RLM_MODULE_OK;
+
+		instance = module_find(modules, cf_section_name1(cs));
+		if (!instance) {
+			cf_log_err_cs(cs, "No such module \"%s\"", cf_section_name1(cs));
+			goto error;
+		}
+
+		cp = cf_pair_find(cs, "rcode");
+		if (cp) {
+			code = fr_str2int(mod_rcode_table, cf_pair_value(cp), -1);
+			if (code < 0) {
+				cf_log_err_cp(cp, "Unknown rcode \"%s\"", cf_pair_value(cp));
+				goto error;
+			}
+		}
+
+		update = cf_section_sub_find(cs, "update");
+		if (update && (map_afrom_cs(&instance->force_maps, update, PAIR_LIST_REQUEST, PAIR_LIST_REQUEST,
+					    unlang_fixup_update, NULL, 128) < 0)) goto error;
+
+		instance->code = code;
+		instance->force = true;
+	}
+
+	return stubs;
+}
+
+/** Time spent in one section, module, xlat or pool
+ *
+ */
+typedef struct {
+	trace_span_type_t	type;
+	char			name[TRACE_NAME_LEN];
+	uint64_t		calls;
+	uint64_t		usec;				//!< Including any nested spans.
+	uint32_t		max_usec;
+} bench_stat_t;
+
+/** State for one benchmark thread
+ *
+ */
+typedef struct {
+	pthread_t		thread;
+	int			id;
+
+	REQUEST			**corpus;			//!< Template requests, shared by all threads.
+	int			corpus_len;
+	uint32_t		iterations;			//!< Number of times to replay the corpus.
+
+	bench_stat_t		*stats;				//!< talloc array of per-span statistics.
+	int			num_stats;
+
+	uint64_t		requests;
+	uint64_t		usec;				//!< Total time spent in rad_virtual_server().
+	uint64_t		truncated;			//!< Requests which had spans left out.
+	int			ret;
+} bench_thread_t;
+
+static char const *bench_span_type[TRACE_SPAN_MAX] = {
+	[TRACE_SPAN_SECTION]	= "section",
+	[TRACE_SPAN_MODULE]	= "module",
+	[TRACE_SPAN_XLAT]	= "xlat",
+	[TRACE_SPAN_POOL]	= "pool"
+};
+
+static uint64_t bench_usec(struct timeval const *start, struct timeval const *end)
+{
+	struct timeval elapsed;
+
+	fr_timeval_subtract(&elapsed, end, start);
+
+	return ((uint64_t) elapsed.tv_sec * 1000000) + elapsed.tv_usec;
+}
+
+static bench_stat_t *bench_stat_find(bench_thread_t *thread, trace_span_type_t type, char const *name)
+{
+	bench_stat_t	*stat;
+	int		i;
+
+	for (i = 0; i < thread->num_stats; i++) {
+		stat = &thread->stats[i];
+
+		if ((stat->type == type) && (strcmp(stat->name, name) == 0)) return stat;
+	}
+
+	if (thread->num_stats == (int) talloc_array_length(thread->stats)) {
+		bench_stat_t *stats;
+
+		stats = talloc_realloc(NULL, thread->stats, bench_stat_t, (thread->num_stats * 2) + 16);
+		if (!stats) return NULL;
+		thread->stats = stats;
+	}
+
+	stat = &thread->stats[thread->num_stats++];
+	memset(stat, 0, sizeof(*stat));
+	stat->type = type;
+	strlcpy(stat->name, name, sizeof(stat->name));
+
+	return stat;
+}
+
+/** Add the spans of a request to the thread's statistics
+ *
+ */
+static void bench_stats_add(bench_thread_t *thread, trace_t const *trace)
+{
+	int i;
+
+	if (trace->truncated) thread->truncated++;
+
+	for (i = 0; i < trace->num_spans; i++) {
+		trace_span_t const	*span = &trace->span[i];
+		bench_stat_t		*stat;
+
+		if (!span->done) continue;
+
+		stat = bench_stat_find(thread, span->type, span->name);
+		if (!stat) continue;
+
+		stat->calls++;
+		stat->usec += span->usec;
+		if (span->usec > stat->max_usec) stat->max_usec = span->usec;
+	}
+}
+
+/** Order by type, and then by the most time spent
+ *
+ */
+static int bench_stat_cmp(void const *one, void const *two)
+{
+	bench_stat_t const *a = one, *b = two;
+
+	if (a->type != b->type) return (a->type < b->type) ? -1 : +1;
+	if (a->usec != b->usec) return (a->usec > b->usec) ? -1 : +1;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Replay the corpus through the virtual server
+ *
+ */
+static void *bench_thread(void *arg)
+{
+	bench_thread_t	*thread = arg;
+	fr_event_list_t	*el;
+	uint32_t	i;
+	int		j;
+
+	el = fr_event_list_create(NULL, NULL, NULL);
+	if (!el) {
+		ERROR("Thread %i - Failed creating event list", thread->id);
+		thread->ret = -1;
+		return NULL;
+	}
+
+	if (modules_thread_instantiate(main_config.config, el) < 0) {
+		ERROR("Thread %i - Failed instantiating modules", thread->id);
+		talloc_free(el);
+		thread->ret = -1;
+		return NULL;
+	}
+
+	for (i = 0; i < thread->iterations; i++) {
+		for (j = 0; j < thread->corpus_len; j++) {
+			REQUEST		*request;
+			struct timeval	start, end;
+
+			request = request_clone(thread->corpus[j],
+						((uint64_t) thread->id << 40) | thread->requests);
+			if (!request) {
+				thread->ret = -1;
+				goto done;
+			}
+
+			trace_request_start(request);
+
+			gettimeofday(&start, NULL);
+			rad_virtual_server(request);
+			gettimeofday(&end, NULL);
+
+			thread->usec += bench_usec(&start, &end);
+			thread->requests++;
+
+			/*
+			 *	The trace is freed with the request.  We don't
+			 *	need to copy it to the ring buffer.
+			 */
+			if (request->trace) bench_stats_add(thread, request->trace);
+
+			talloc_free(request);
+		}
+	}
+
+done:
+	talloc_free(el);
+
+	return NULL;
+}
+
+/** Run the policy benchmark
+ *
+ * Reads every request in the input file, then replays them through
+ * the virtual server in one or more threads.  When done, the time
+ * spent in each section, module, and xlat function is printed as one
+ * JSON object per line.  Times include any nested spans, e.g. the
+ * modules called from a section.
+ *
+ * @param[in] fp		to read the requests from.
+ * @param[in] client		to associate with the requests.
+ * @param[in] iterations	how many times each thread replays the corpus.
+ * @param[in] num_threads	to replay the corpus in.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int bench_run(FILE *fp, RADCLIENT *client, uint32_t iterations, int num_threads)
+{
+	TALLOC_CTX	*ctx;
+	REQUEST		**corpus = NULL;
+	int		corpus_len = 0;
+	bench_thread_t	*threads;
+	bench_thread_t	*total;
+	struct timeval	start, end;
+	uint64_t	wall_usec;
+	int		i, j, ret = -1;
+
+	ctx = talloc_init("bench");
+
+	while (!filedone) {
+		REQUEST *request;
+
+		request = request_from_file(fp, client);
+		if (!request) goto finish;
+
+		/*
+		 *	Blank lines at the end of the file.
+		 */
+		if (!request->packet->vps) {
+			talloc_free(request);
+			continue;
+		}
+
+		corpus = talloc_realloc(ctx, corpus, REQUEST *, corpus_len + 1);
+		if (!corpus) {
+			ERROR("Out of memory");
+			goto finish;
+		}
+		corpus[corpus_len++] = talloc_steal(corpus, request);
+	}
+
+	if (!corpus_len) {
+		ERROR("No requests in input");
+		goto finish;
+	}
+
+	/*
+	 *	Record a span for every section, module call and xlat
+	 *	of every request.
+	 */
+	if (trace_init(1, 1) < 0) goto finish;
+
+	threads = talloc_zero_array(ctx, bench_thread_t, num_threads);
+	if (!threads) {
+		ERROR("Out of memory");
+		goto finish;
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].corpus = corpus;
+		threads[i].corpus_len = corpus_len;
+		threads[i].iterations = iterations;
+
+		ret = pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+		if (ret != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(ret));
+			threads[0].ret = -1;
+			num_threads = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) pthread_join(threads[i].thread, NULL);
+
+	gettimeofday(&end, NULL);
+	wall_usec = bench_usec(&start, &end);
+
+	/*
+	 *	Merge the statistics of all threads into the first one.
+	 */
+	total = &threads[0];
+	for (i = 1; i < num_threads; i++) {
+		total->requests += threads[i].requests;
+		total->usec += threads[i].usec;
+		total->truncated += threads[i].truncated;
+		if (threads[i].ret < 0) total->ret = -1;
+
+		for (j = 0; j < threads[i].num_stats; j++) {
+			bench_stat_t const	*stat = &threads[i].stats[j];
+			bench_stat_t		*out;
+
+			out = bench_stat_find(total, stat->type, stat->name);
+			if (!out) continue;
+
+			out->calls += stat->calls;
+			out->usec += stat->usec;
+			if (stat->max_usec > out->max_usec) out->max_usec = stat->max_usec;
+		}
+	}
+
+	if (total->num_stats) qsort(total->stats, total->num_stats, sizeof(total->stats[0]), bench_stat_cmp);
+
+	printf("{\"requests\":%" PRIu64 ",\"corpus\":%i,\"threads\":%i,\"wall_usec\":%" PRIu64
+	       ",\"requests_per_sec\":%.1f,\"mean_usec\":%.2f,\"truncated\":%" PRIu64 "}\n",
+	       total->requests, corpus_len, num_threads, wall_usec,
+	       wall_usec ? ((double) total->requests * 1000000) / wall_usec : 0.0,
+	       total->requests ? (double) total->usec / total->requests : 0.0,
+	       total->truncated);
+
+	for (i = 0; i < total->num_stats; i++) {
+		bench_stat_t const *stat = &total->stats[i];
+
+		printf("{\"type\":\"%s\",\"name\":\"%s\",\"calls\":%" PRIu64 ",\"total_usec\":%" PRIu64
+		       ",\"mean_usec\":%.2f,\"max_usec\":%u,\"per_request_usec\":%.2f}\n",
+		       bench_span_type[stat->type], stat->name, stat->calls, stat->usec,
+		       (double) stat->usec / stat->calls, stat->max_usec,
+		       total->requests ? (double) stat->usec / total->requests : 0.0);
+	}
+
+	if (total->truncated) {
+		WARN("%" PRIu64 " requests had more than %i spans, the remaining spans were not counted",
+		     total->truncated, TRACE_SPANS_MAX);
+	}
+
+	ret = total->ret;
+	for (i = 0; i < num_threads; i++) talloc_free(threads[i].stats);
+
+finish:
+	trace_free();
+	talloc_free(ctx);
+
+	return ret;
+}
+
 /*
  *	The main guy.
  */
@@ -700,6 +1150,10 @@ int main(int argc, char *argv[])
 	fr_state_tree_t		*state = NULL;
 	fr_event_list_t		*el = NULL;
 	RADCLIENT		*client = NULL;
+	char const		*stub_file = NULL;
+	CONF_SECTION		*stubs = NULL;
+	uint32_t		bench_iterations = 0;
+	int			bench_threads = 1;
 
 	fr_talloc_fault_setup();
 
@@ -736,9 +1190,17 @@ int main(int argc, char *argv[])
 	default_log.fd = STDOUT_FILENO;
 
 	/*  Process the options.  */
-	while ((argval = getopt(argc, argv, "d:D:f:hi:mMn:o:O:xX")) != EOF) {
+	while ((argval = getopt(argc, argv, "b:d:D:f:hi:mMn:o:O:S:t:xX")) != EOF) {
 
 		switch (argval) {
+			case 'b':
+				bench_iterations = strtoul(optarg, NULL, 10);
+				if (!bench_iterations) {
+					fprintf(stderr, "Invalid iteration count '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
 			case 'd':
 				set_radius_dir(NULL, optarg);
 				break;
@@ -780,6 +1242,18 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Unknown option '%s'\n", optarg);
 				exit(EXIT_FAILURE);
 
+			case 'S':
+				stub_file = optarg;
+				break;
+
+			case 't':
+				bench_threads = atoi(optarg);
+				if ((bench_threads < 1) || (bench_threads > 256)) {
+					fprintf(stderr, "Invalid thread count '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
 			case 'X':
 				rad_debug_lvl += 2;
 				main_config.log_auth = true;
@@ -879,6 +1353,14 @@ int main(int argc, char *argv[])
 	 */
 	if (modules_instantiate(main_config.config) < 0) goto exit_failure;
 
+	/*
+	 *	Replace modules with recorded responses
+	 */
+	if (stub_file) {
+		stubs = stubs_load(stub_file);
+		if (!stubs) goto exit_failure;
+	}
+
 	/*
 	 *	Create a dummy event list
 	 */
@@ -935,6 +1417,15 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Replay all of the requests, many times.
+	 */
+	if (bench_iterations) {
+		if (bench_run(fp, client, bench_iterations, bench_threads) < 0) rcode = EXIT_FAILURE;
+		if (input_file) fclose(fp);
+		goto finish;
+	}
+
 	/*
 	 *	Grab the VPs from stdin, or from the file.
 	 */
@@ -1039,6 +1530,7 @@ finish:
 	 *	Detach modules, connection pools, registered xlats / paircompares / maps.
 	 */
 	modules_free();
+	talloc_free(stubs);
 
 	/*
 	 *	The only xlats remaining are the ones registered by the server core.
@@ -1074,6 +1566,7 @@ static void NEVER_RETURNS usage(int status)
 
 	fprintf(output, "Usage: %s [options]\n", main_config.name);
 	fprintf(output, "Options:\n");
+	fprintf(output, "  -b count      Benchmark, replaying every request in the input file count times.\n");
 	fprintf(output, "  -d raddb_dir  Configuration files are in \"raddb_dir/*\".\n");
 	fprintf(output, "  -D dict_dir   Dictionary files are in \"dict_dir/*\".\n");
 	fprintf(output, "  -f file       Filter reply against attributes in 'file'.\n");
@@ -1081,6 +1574,8 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -i file       File containing request attributes.\n");
 	fprintf(output, "  -m            On SIGINT or SIGQUIT exit cleanly instead of immediately.\n");
 	fprintf(output, "  -n name       Read raddb/name.conf instead of raddb/radiusd.conf.\n");
+	fprintf(output, "  -S file       Replace modules with the responses in 'file'.\n");
+	fprintf(output, "  -t threads    Number of threads to benchmark with (default 1).\n");
 	fprintf(output, "  -X            Turn on full debugging.\n");
 	fprintf(output, "  -x            Turn on additional debugging. (-xx gives more debugging).\n");
 	exit(status);
@@ -1585,6 +1585,7 @@ static unlang_t *compile_update(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
+	g->static_update = map_list_is_static(g->map);
 	g->done_pass2 = true;
 
 	return c;
@@ -1906,6 +1907,117 @@ static unlang_t *compile_group(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	return compile_children(g, parent, unlang_ctx, group_type, parentgroup_type);
 }
 
+/*
+ *	Don't bother with a hash table for a few case statements.
+ */
+#define UNLANG_SWITCH_HASH_MIN	(4)
+
+static uint32_t switch_case_hash(void const *data)
+{
+	value_box_t const *value = ((unlang_switch_case_t const *)data)->value;
+
+	switch (value->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		return fr_hash(value->datum.ptr, value->length);
+
+	default:
+		return fr_hash(((uint8_t const *)value) + value_box_offsets[value->type],
+			       value_box_field_sizes[value->type]);
+	}
+}
+
+static int switch_case_cmp(void const *one, void const *two)
+{
+	unlang_switch_case_t const *a = one, *b = two;
+
+	return value_box_cmp(a->value, b->value);
+}
+
+/** Build a hash table mapping case values to case statements
+ *
+ *  This is only possible when we're switching over an attribute, and
+ *  all of the case statements have values which were converted to the
+ *  type of the attribute when they were compiled.  Otherwise the
+ *  interpreter checks each case statement in turn.
+ *
+ * @param[in] g	the switch statement.
+ * @return
+ *	- 0 on success, or if a hash table can't be used.
+ *	- -1 on error.
+ */
+static int compile_switch_cases(unlang_group_t *g)
+{
+	unlang_t		*this;
+	unlang_group_t		*h;
+	int			i, num_cases = 0;
+
+	if (g->vpt->type != TMPL_TYPE_ATTR) return 0;
+
+	switch (g->vpt->tmpl_da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IFID:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_BOOLEAN:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_SIZE:
+	case PW_TYPE_SIGNED:
+	case PW_TYPE_DATE:
+		break;
+
+	default:
+		return 0;
+	}
+
+	for (this = g->children; this; this = this->next) {
+		h = unlang_group_to_module_call(this);
+		if (!h->vpt) continue;
+
+		if ((h->vpt->type != TMPL_TYPE_DATA) ||
+		    (h->vpt->tmpl_value_box_type != g->vpt->tmpl_da->type)) return 0;
+
+		num_cases++;
+	}
+
+	if (num_cases < UNLANG_SWITCH_HASH_MIN) return 0;
+
+	g->cases = fr_hash_table_create(g, switch_case_hash, switch_case_cmp, NULL);
+	if (!g->cases) return -1;
+
+	for (this = g->children, i = 0; this; this = this->next, i++) {
+		unlang_switch_case_t *sc;
+
+		h = unlang_group_to_module_call(this);
+		if (!h->vpt) continue;
+
+		sc = talloc_zero(g->cases, unlang_switch_case_t);
+		if (!sc) return -1;
+
+		sc->value = &h->vpt->tmpl_value_box;
+		sc->instruction = this;
+		sc->index = i;
+
+		/*
+		 *	Duplicate values can never match the
+		 *	second case statement, so keep the first.
+		 */
+		if (fr_hash_table_finddata(g->cases, sc)) {
+			talloc_free(sc);
+			continue;
+		}
+
+		if (!fr_hash_table_insert(g->cases, sc)) return -1;
+	}
+
+	return 0;
+}
+
 static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs,
 				   unlang_group_type_t group_type, unlang_group_type_t parentgroup_type, unlang_type_t mod_type)
 {
@@ -2002,7 +2114,16 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
-	return compile_children(g, parent, unlang_ctx, group_type, parentgroup_type);
+	c = compile_children(g, parent, unlang_ctx, group_type, parentgroup_type);
+	if (!c) return NULL;
+
+	if (compile_switch_cases(g) < 0) {
+		cf_log_err_cs(cs, "Failed building table of case statements");
+		talloc_free(c);
+		return NULL;
+	}
+
+	return c;
 }
 
 static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs,
@@ -2536,6 +2657,8 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 	unlang_t *c;
 	unlang_t *child;
 	unlang_group_t *g;
+	char const *name2;
+	bool any = false;
 
 	/*
 	 *	No children?  Die!
@@ -2545,20 +2668,36 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 		return NULL;
 	}
 
-	if (cf_section_name2(cs) != NULL) {
-		cf_log_err_cs(cs, "%s sections cannot have an argument", unlang_ops[mod_type].name);
-		return NULL;
+	/*
+	 *	"parallel any" resumes when the first child is done,
+	 *	"parallel" and "parallel all" when all of them are.
+	 */
+	name2 = cf_section_name2(cs);
+	if (name2) {
+		if (strcmp(name2, "any") == 0) {
+			any = true;
+
+		} else if (strcmp(name2, "all") != 0) {
+			cf_log_err_cs(cs, "%s sections take 'any' or 'all', not '%s'", unlang_ops[mod_type].name, name2);
+			return NULL;
+		}
 	}
 
 	c = compile_group(parent, unlang_ctx, cs, group_type, parentgroup_type, mod_type);
 	if (!c) return NULL;
 
-	c->name = c->debug_name = unlang_ops[c->type].name;
+	c->name = unlang_ops[c->type].name;
+	if (name2) {
+		c->debug_name = talloc_asprintf(c, "%s %s", c->name, name2);
+	} else {
+		c->debug_name = c->name;
+	}
 
 	/*
 	 *	Check that all children are of the new type.
 	 */
 	g = unlang_group_to_module_call(c);
+	g->parallel_any = any;
 
 	for (child = g->children; child != NULL; child = child->next) {
 		unlang_module_call_t *single;
@@ -2693,6 +2832,7 @@ static unlang_t *compile_module(unlang_t *parent, unlang_compile_t *unlang_ctx,
 	single = talloc_zero(parent, unlang_module_call_t);
 	single->module_instance = this;
 	single->method = this->module->methods[unlang_ctx->component];
+	single->component = unlang_ctx->component;
 
 	c = unlang_module_call_to_generic(single);
 	c->parent = parent;
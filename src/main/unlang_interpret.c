@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/trace.h>
 
 static FR_NAME_NUMBER unlang_action_table[] = {
 	{ "calculate-result",	UNLANG_ACTION_CALCULATE_RESULT },
@@ -56,6 +57,8 @@ static void safe_unlock(module_instance_t *instance)
 		pthread_mutex_unlock(instance->mutex);
 }
 
+static rlm_rcode_t unlang_run(REQUEST *request, unlang_stack_t *stack);
+
 static void unlang_push(unlang_stack_t *stack, unlang_t *program, rlm_rcode_t result, bool do_next_sibling)
 {
 	unlang_stack_frame_t *next;
@@ -269,34 +272,366 @@ static unlang_action_t unlang_group(REQUEST *request, unlang_stack_t *stack,
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
-typedef struct unlang_parallel_t {
-	rlm_rcode_t	rcode;
-	int		priority;
+/** Progress of one child of a parallel section
+ *
+ */
+typedef enum {
+	UNLANG_PARALLEL_CHILD_INIT = 0,			//!< Not run yet.
+	UNLANG_PARALLEL_CHILD_YIELDED,			//!< Waiting for I/O.
+	UNLANG_PARALLEL_CHILD_DONE,			//!< Finished, result is valid.
+	UNLANG_PARALLEL_CHILD_CANCELLED			//!< Section finished without it.
+} unlang_parallel_child_state_t;
+
+/** One child of a parallel section
+ *
+ * The child request shares the parent's packet, reply, control and
+ * state lists, so modules called in parallel behave the same as they
+ * would in a group.  It has its own interpreter stack, and its own
+ * entry in the backlog, which is what lets modules yield and resume
+ * it independently of its siblings.
+ *
+ * Child requests are parented by the parent request, and not by the
+ * section, because attributes they allocated may still be in the
+ * parent's lists after the section is done.
+ */
+typedef struct {
+	REQUEST				*request;	//!< Child request.
+	unlang_parallel_t		*parallel;	//!< Section we belong to.  NULL once it's done.
+	int				index;		//!< In the section's list of children.
+	unlang_t			*instruction;	//!< Module call the child runs.
+	unlang_parallel_child_state_t	state;
+} unlang_parallel_child_t;
+
+struct unlang_parallel_t {
+	REQUEST			*request;	//!< Parent request.
+	bool			any;		//!< Done when the first child finishes.
+	int			num_children;
+	int			num_done;	//!< Children which finished.
+
+	rlm_rcode_t		rcode;		//!< Highest priority result so far.
+	int			priority;
+
+	unlang_parallel_child_t	**children;
+};
+
+static void unlang_parallel_child_process(REQUEST *child, fr_state_action_t action);
+
+/** Copy the parent's lists into a child, before running it
+ *
+ */
+static void parallel_child_enter(REQUEST *child)
+{
+	REQUEST *request = child->parent;
+
+	child->control = request->control;
+	child->state = request->state;
+	child->username = request->username;
+	child->password = request->password;
+
+	child->el = request->el;
+	child->backlog = request->backlog;
+	child->log.unlang_indent = request->log.unlang_indent;
+}
+
+/** Copy the lists back to the parent, after running a child
+ *
+ * Modules may have added the first attribute to an empty list, which
+ * changes the head of the list.
+ */
+static void parallel_child_leave(REQUEST *child)
+{
+	REQUEST *request = child->parent;
+
+	request->control = child->control;
+	request->state = child->state;
+	request->username = child->username;
+	request->password = child->password;
+}
+
+/** Stop a child which is still waiting for I/O
+ *
+ */
+static void parallel_child_cancel(unlang_parallel_child_t *pc)
+{
+	REQUEST *request = pc->request;
+
+	if (request->heap_id >= 0) (void) fr_heap_extract(request->backlog, request);
+
+	if (pc->state == UNLANG_PARALLEL_CHILD_YIELDED) {
+		RDEBUG2("Cancelling %s", pc->instruction->debug_name);
+		unlang_action(request, FR_ACTION_DONE);
+	}
+
+	if (pc->state != UNLANG_PARALLEL_CHILD_DONE) pc->state = UNLANG_PARALLEL_CHILD_CANCELLED;
+	pc->parallel = NULL;
+}
+
+static int _parallel_child_free(unlang_parallel_child_t *pc)
+{
+	if (pc->parallel) pc->parallel->children[pc->index] = NULL;
+
+	parallel_child_cancel(pc);
+
+	/*
+	 *	Borrowed from the parent.
+	 */
+	pc->request->state_ctx = NULL;
+
+	return 0;
+}
+
+static int _unlang_parallel_free(unlang_parallel_t *p)
+{
+	int i;
+
+	for (i = 0; i < p->num_children; i++) {
+		if (p->children[i]) parallel_child_cancel(p->children[i]);
+	}
+
+	return 0;
+}
+
+/** Allocate a child request for a parallel section
+ *
+ * @param[in] p		the parallel section.
+ * @param[in] index	of the child.
+ * @param[in] instruction	the child will run.
+ * @return
+ *	- NULL on error.
+ *	- the new child.
+ */
+static unlang_parallel_child_t *parallel_child_alloc(unlang_parallel_t *p, int index, unlang_t *instruction)
+{
+	REQUEST			*request = p->request;
+	REQUEST			*child;
+	unlang_parallel_child_t	*pc;
+	unlang_stack_t		*stack;
+
+	pc = talloc_zero(request, unlang_parallel_child_t);
+	if (!pc) return NULL;
+
+	child = request_alloc(pc);
+	if (!child) {
+	error:
+		talloc_free(pc);
+		return NULL;
+	}
+	pc->request = child;
+	pc->instruction = instruction;
+	pc->index = index;
+
+	talloc_free(child->state_ctx);
+	child->state_ctx = request->state_ctx;
+	talloc_set_destructor(pc, _parallel_child_free);
+
+	child->number = request->number;
+	child->seq_start = request->seq_start;
+	child->parent = request;
+	child->root = request->root;
+	child->client = request->client;
+	child->listener = request->listener;
+	child->server = request->server;
+	child->server_cs = request->server_cs;
+	child->packet = request->packet;
+	child->reply = request->reply;
+	child->request_state = request->request_state;
+	child->component = request->component;
+	child->master_state = REQUEST_ACTIVE;
+	child->child_state = REQUEST_RUNNING;
+	child->process = unlang_parallel_child_process;
+	memcpy(&child->log, &request->log, sizeof(child->log));
+
+	if (request_data_add(child, (void *)unlang_parallel_child_process, 0, pc, false, false, false) < 0) goto error;
+
+	/*
+	 *	The child runs exactly one instruction.
+	 */
+	stack = child->stack;
+	unlang_push(stack, instruction, RLM_MODULE_NOOP, false);
+	stack->frame[stack->depth].top_frame = true;
+
+	pc->parallel = p;
+
+	return pc;
+}
+
+/** Whether a parallel section can be resumed
+ *
+ */
+static inline bool parallel_done(unlang_parallel_t const *p)
+{
+	if (p->any) return (p->num_done > 0);
+
+	return (p->num_done == p->num_children);
+}
+
+/** Run a child until it yields or finishes
+ *
+ * @param[in] pc	to run.
+ * @return true if this child finishing completed the section.
+ */
+static bool parallel_child_run(unlang_parallel_child_t *pc)
+{
+	unlang_parallel_t	*p = pc->parallel;
+	REQUEST			*child = pc->request;
+	rlm_rcode_t		rcode;
+	int			priority;
+
+	parallel_child_enter(child);
+	rcode = unlang_run(child, child->stack);
+	parallel_child_leave(child);
+
+	if (rcode == RLM_MODULE_YIELD) {
+		pc->state = UNLANG_PARALLEL_CHILD_YIELDED;
+		return false;
+	}
+
+	pc->state = UNLANG_PARALLEL_CHILD_DONE;
+	p->num_done++;
+
+	/*
+	 *	Keep the highest priority result, as a group would.
+	 *	"return" and "reject" always win.
+	 */
+	priority = pc->instruction->actions[rcode];
+	if (priority == MOD_ACTION_REJECT) {
+		rcode = RLM_MODULE_REJECT;
+		priority = MOD_PRIORITY_MAX + 1;
+	} else if (priority == MOD_ACTION_RETURN) {
+		priority = MOD_PRIORITY_MAX + 1;
+	}
+
+	if (priority > p->priority) {
+		p->rcode = rcode;
+		p->priority = priority;
+	}
+
+	/*
+	 *	Only the child which completes the section wakes the
+	 *	parent, so that it's never in the backlog twice.
+	 */
+	return (p->num_done == (p->any ? 1 : p->num_children));
+}
+
+/** Resume a child of a parallel section
+ *
+ * Children are inserted into the backlog by unlang_resumable(), and
+ * run by the worker in the same way as any other request.
+ */
+static void unlang_parallel_child_process(REQUEST *child, fr_state_action_t action)
+{
+	unlang_parallel_child_t	*pc;
+	REQUEST			*request;
+
+	pc = request_data_reference(child, (void *)unlang_parallel_child_process, 0);
+	if (!pc || !pc->parallel || (pc->state != UNLANG_PARALLEL_CHILD_YIELDED)) return;
 
-	unlang_stack_t	*stacks;
-} unlang_parallel_t;
+	request = pc->parallel->request;
+
+	switch (action) {
+	case FR_ACTION_RUN:
+		if (parallel_child_run(pc)) unlang_resumable(request);
+		break;
+
+	default:
+		unlang_action(child, action);
+		break;
+	}
+}
 
-static unlang_action_t unlang_parallel(UNUSED REQUEST *request, unlang_stack_t *stack,
-				       UNUSED rlm_rcode_t *result, UNUSED int *priority)
+/** Pass an action on to the children of a parallel section
+ *
+ */
+static void unlang_parallel_action(unlang_parallel_t *p, fr_state_action_t action)
+{
+	int i;
+
+	for (i = 0; i < p->num_children; i++) {
+		unlang_parallel_child_t *pc = p->children[i];
+
+		if (!pc || (pc->state != UNLANG_PARALLEL_CHILD_YIELDED)) continue;
+
+		if (action == FR_ACTION_DONE) {
+			parallel_child_cancel(pc);
+			continue;
+		}
+
+		unlang_action(pc->request, action);
+	}
+}
+
+static unlang_action_t unlang_parallel(REQUEST *request, unlang_stack_t *stack,
+				       rlm_rcode_t *presult, int *priority)
 {
 	unlang_stack_frame_t	*frame = &stack->frame[stack->depth];
 	unlang_t		*instruction = frame->instruction;
-	unlang_group_t	*g;
+	unlang_group_t		*g;
+	unlang_parallel_t	*p;
 
 	g = unlang_group_to_module_call(instruction);
 
 	if (!frame->resume) {
+		unlang_t	*child;
+		int		i;
+
+		p = talloc_zero(request, unlang_parallel_t);
+		if (!p) {
+		fail:
+			*presult = RLM_MODULE_FAIL;
+			*priority = instruction->actions[*presult];
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+		talloc_set_destructor(p, _unlang_parallel_free);
+
+		p->request = request;
+		p->any = g->parallel_any;
+		p->num_children = g->num_children;
+		p->rcode = RLM_MODULE_NOOP;
+		p->priority = -1;
+		p->children = talloc_zero_array(p, unlang_parallel_child_t *, p->num_children);
+		if (!p->children) {
+			talloc_free(p);
+			goto fail;
+		}
+
+		for (child = g->children, i = 0; child != NULL; child = child->next, i++) {
+			p->children[i] = parallel_child_alloc(p, i, child);
+			if (!p->children[i]) {
+				REDEBUG("Failed allocating child for %s", child->debug_name);
+				talloc_free(p);
+				goto fail;
+			}
+		}
+
 		/*
-		 *	Set up some stacks and a return code.
+		 *	Start all of the children.  Each one runs until
+		 *	it yields, which means all of their I/O is
+		 *	outstanding at the same time.
 		 */
+		for (i = 0; i < p->num_children; i++) {
+			if (parallel_child_run(p->children[i])) break;
+		}
+
+		frame->parallel.state = p;
 	} else {
-		/*
-		 *	Find a resumption child and run it.
-		 */
+		p = frame->parallel.state;
 	}
 
-	unlang_push(stack, g->children, frame->result, true);
-	return UNLANG_ACTION_PUSHED_CHILD;
+	if (!parallel_done(p)) {
+		RDEBUG3("parallel - %d of %d children done, yielding", p->num_done, p->num_children);
+		*presult = RLM_MODULE_YIELD;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	*presult = p->rcode;
+	*priority = instruction->actions[*presult];
+
+	/*
+	 *	Cancels any children which are still running.
+	 */
+	TALLOC_FREE(frame->parallel.state);
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
 static unlang_action_t unlang_case(REQUEST *request, unlang_stack_t *stack,
@@ -536,6 +871,33 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 		goto do_null_case;
 	}
 
+	/*
+	 *	The values of all of the case statements are in a
+	 *	hash table.  Look up the value of each instance of the
+	 *	attribute, and pick the case statement which appears
+	 *	first, which is the one a linear search would find.
+	 */
+	if (g->cases) {
+		VALUE_PAIR		*vp;
+		vp_cursor_t		cursor;
+		unlang_switch_case_t	my_case, *sc, *best = NULL;
+		int			err;
+
+		for (vp = tmpl_cursor_init(&err, &cursor, request, g->vpt);
+		     vp;
+		     vp = tmpl_cursor_next(&cursor, g->vpt)) {
+			my_case.value = &vp->data;
+
+			sc = fr_hash_table_finddata(g->cases, &my_case);
+			if (sc && (!best || (sc->index < best->index))) best = sc;
+		}
+
+		if (!best) goto find_null_case;
+
+		found = best->instruction;
+		goto do_null_case;
+	}
+
 	/*
 	 *	Expand the template if necessary, so that it
 	 *	is evaluated once instead of for each 'case'
@@ -642,6 +1004,16 @@ static unlang_action_t unlang_update(REQUEST *request, unlang_stack_t *stack,
 	vp_map_t *map;
 
 	RINDENT();
+	if (g->static_update) {
+		rcode = map_list_static_to_request(request, g->map);
+		if (rcode < 0) {
+			*presult = (rcode == -2) ? RLM_MODULE_INVALID : RLM_MODULE_FAIL;
+			REXDENT();
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+		goto done;
+	}
+
 	for (map = g->map; map != NULL; map = map->next) {
 		rcode = map_to_request(request, map, map_to_vp, NULL);
 		if (rcode < 0) {
@@ -650,6 +1022,8 @@ static unlang_action_t unlang_update(REQUEST *request, unlang_stack_t *stack,
 			return UNLANG_ACTION_CALCULATE_RESULT;
 		}
 	}
+
+done:
 	REXDENT();
 
 	*presult = RLM_MODULE_NOOP;
@@ -682,6 +1056,8 @@ static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stac
 	unlang_module_call_t		*sp;
 	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
 	unlang_t			*instruction = frame->instruction;
+	struct timeval			start;
+	int				span;
 
 	/*
 	 *	Process a stand-alone child, and fall through
@@ -698,7 +1074,20 @@ static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stac
 	RDEBUG4("[%i] %s - %s (%s)", stack->depth, __FUNCTION__, sp->module_instance->name, sp->module_instance->module->name);
 
 	if (sp->module_instance->force) {
+		vp_map_t *map;
+
+		span = trace_span_start(request, TRACE_SPAN_MODULE, sp->module_instance->name);
+
+		for (map = sp->module_instance->force_maps; map != NULL; map = map->next) {
+			if (map_to_request(request, map, map_to_vp, NULL) < 0) {
+				request->rcode = RLM_MODULE_FAIL;
+				trace_span_done(request, span, request->rcode);
+				goto fail;
+			}
+		}
+
 		request->rcode = sp->module_instance->code;
+		trace_span_done(request, span, request->rcode);
 		goto fail;
 	}
 
@@ -712,12 +1101,34 @@ static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stac
 	 */
 	request->module = sp->module_instance->name;
 
+	span = trace_span_start(request, TRACE_SPAN_MODULE, sp->module_instance->name);
+	FR_PROBE2(module__start, request->number, sp->module_instance->name);
+
+	gettimeofday(&start, NULL);
+
 	safe_lock(sp->module_instance);
 	request->rcode = sp->method(sp->module_instance->data, frame->modcall.thread, request);
 	safe_unlock(sp->module_instance);
 
 	request->module = NULL;
 
+	/*
+	 *	If the module yielded, the latency is recorded when
+	 *	it's finally done.
+	 */
+	if ((request->rcode == RLM_MODULE_YIELD) && (frame->instruction->type == UNLANG_TYPE_RESUME)) {
+		unlang_resumption_t *mr = unlang_generic_to_resumption(frame->instruction);
+
+		mr->start = start;
+		mr->trace_span = span;
+		module_stats_yield(sp->module_instance, sp->component);
+		FR_PROBE2(module__yield, request->number, sp->module_instance->name);
+	} else {
+		module_stats_done(sp->module_instance, sp->component, request->rcode, &start);
+		trace_span_done(request, span, request->rcode);
+		FR_PROBE3(module__done, request->number, sp->module_instance->name, request->rcode);
+	}
+
 	/*
 	 *	Is now marked as "stop" when it wasn't before, we must have been blocked.
 	 */
@@ -863,10 +1274,18 @@ static unlang_action_t unlang_resumption(REQUEST *request, unlang_stack_t *stack
 
 	memcpy(&mutable, &mr->ctx, sizeof(mutable));
 
+	FR_PROBE2(module__resume, request->number, sp->module_instance->name);
+
 	safe_lock(sp->module_instance);
 	*presult = mr->callback(request, mr->module.module_instance->data, mr->thread, mutable);
 	safe_unlock(sp->module_instance);
 
+	if (*presult != RLM_MODULE_YIELD) {
+		module_stats_done(sp->module_instance, sp->component, *presult, &mr->start);
+		trace_span_done(request, mr->trace_span, *presult);
+		FR_PROBE3(module__done, request->number, sp->module_instance->name, *presult);
+	}
+
 	RDEBUG2("%s (%s)", instruction->name ? instruction->name : "",
 		fr_int2str(mod_rcode_table, *presult, "<invalid>"));
 
@@ -1101,7 +1520,8 @@ redo:
 
 		case UNLANG_ACTION_CALCULATE_RESULT:
 			if (result == RLM_MODULE_YIELD) {
-				rad_assert(frame->instruction->type == UNLANG_TYPE_RESUME);
+				rad_assert((frame->instruction->type == UNLANG_TYPE_RESUME) ||
+					   (frame->instruction->type == UNLANG_TYPE_PARALLEL));
 				frame->resume = true;
 				RDEBUG4("** [%i] %s - exited (yield)", stack->depth, __FUNCTION__);
 				return RLM_MODULE_YIELD;
@@ -1531,6 +1951,15 @@ void unlang_action(REQUEST *request, fr_state_action_t action)
 
 	frame = &stack->frame[stack->depth];
 
+	/*
+	 *	The children of a parallel section are the ones
+	 *	which yielded.
+	 */
+	if (frame->instruction->type == UNLANG_TYPE_PARALLEL) {
+		unlang_parallel_action(frame->parallel.state, action);
+		return;
+	}
+
 	rad_assert(frame->instruction->type == UNLANG_TYPE_RESUME);
 
 	mr = unlang_generic_to_resumption(frame->instruction);
@@ -1542,6 +1971,9 @@ void unlang_action(REQUEST *request, fr_state_action_t action)
 }
 
 /** Yield a request
+ *
+ * May also be called from a #fr_unlang_resume_t callback, in which case
+ * the request yields again, and the new callbacks replace the old ones.
  *
  * @param[in] request		The current request.
  * @param[in] callback		to call on unlang_resumable().
@@ -1561,6 +1993,18 @@ rlm_rcode_t unlang_yield(REQUEST *request, fr_unlang_resume_t callback,
 
 	frame = &stack->frame[stack->depth];
 
+	/*
+	 *	Yielding again from a resume callback.
+	 */
+	if (frame->instruction->type == UNLANG_TYPE_RESUME) {
+		mr = unlang_generic_to_resumption(frame->instruction);
+		mr->callback = callback;
+		mr->action_callback = action_callback;
+		mr->ctx = ctx;
+
+		return RLM_MODULE_YIELD;
+	}
+
 	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
 	sp = unlang_generic_to_module_call(frame->instruction);
 
@@ -1574,6 +2018,7 @@ rlm_rcode_t unlang_yield(REQUEST *request, fr_unlang_resume_t callback,
 	mr->action_callback = action_callback;
 	mr->thread = module_thread_instance_find(sp->module_instance);
 	mr->ctx = ctx;
+	mr->trace_span = -1;
 
 	frame->instruction = unlang_resumption_to_generic(mr);
 
@@ -1513,6 +1513,9 @@ int rad_segid(gid_t gid)
  * This solves the problem of attempting to keep min/max/avg latencies, whilst
  * not knowing what the polling frequency will be.
  *
+ * The bins are updated atomically, as a shard of a #fr_stats_block_t may
+ * be shared by more than one thread.
+ *
  * @param[out] stats Holding monotonically increasing stats bins.
  * @param[in] start of the request.
  * @param[in] end of the request.
@@ -1527,7 +1530,7 @@ void fr_stats_bins(fr_stats_t *stats, struct timeval *start, struct timeval *end
 	fr_timeval_subtract(&diff, end, start);
 
 	if (diff.tv_sec >= 10) {
-		stats->elapsed[7]++;
+		__atomic_add_fetch(&stats->elapsed[7], 1, __ATOMIC_RELAXED);
 	} else {
 		int i;
 		uint32_t cmp;
@@ -1537,7 +1540,7 @@ void fr_stats_bins(fr_stats_t *stats, struct timeval *start, struct timeval *end
 		cmp = 10;
 		for (i = 0; i < 7; i++) {
 			if (delay < cmp) {
-				stats->elapsed[i]++;
+				__atomic_add_fetch(&stats->elapsed[i], 1, __ATOMIC_RELAXED);
 				break;
 			}
 			cmp *= 10;
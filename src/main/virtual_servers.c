@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/trace.h>
 
 static int default_component_results[MOD_COUNT] = {
 	RLM_MODULE_REJECT,	/* AUTH */
@@ -56,6 +57,7 @@ static rlm_rcode_t module_method_call(rlm_components_t comp, int idx, REQUEST *r
 	CONF_SECTION	*cs, *server_cs;
 	char const	*module;
 	char const	*component;
+	int		span;
 
 	rad_assert(request->server != NULL);
 
@@ -121,8 +123,17 @@ static rlm_rcode_t module_method_call(rlm_components_t comp, int idx, REQUEST *r
 	request->module = NULL;
 	request->component = section_type_value[comp].section;
 
+	span = trace_span_start(request, TRACE_SPAN_SECTION, section_type_value[comp].section);
+	FR_PROBE2(section__start, request->number, section_type_value[comp].section);
+
 	rcode = unlang_interpret(request, cs, default_component_results[comp]);
 
+	/*
+	 *	Sections which yield are finished when the request is.
+	 */
+	if (rcode != RLM_MODULE_YIELD) trace_span_done(request, span, rcode);
+	FR_PROBE3(section__done, request->number, section_type_value[comp].section, rcode);
+
 	request->component = component;
 	request->module = module;
 	request->server_cs = server_cs;
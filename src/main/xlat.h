@@ -73,6 +73,8 @@ struct xlat_exp {
 		int		regex_index;	//!< for %{1} and friends.
 	};
 	xlat_t const	*xlat;		//!< The xlat expansion to expand format with.
+	void		*inst;		//!< Instance data created by the xlat's instantiate function.
+					//!< Only set if the argument of the expansion is a literal.
 };
 
 typedef struct xlat_out {
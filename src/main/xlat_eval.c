@@ -29,10 +29,16 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/parser.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/trace.h>
 
 #include <ctype.h>
 #include "xlat.h"
 
+/*
+ *	Longest one-character expansion, e.g. %t
+ */
+#define XLAT_PERCENT_MAX	(256)
+
 static size_t xlat_process(TALLOC_CTX *ctx, char **out, REQUEST *request, xlat_exp_t const * const head,
 			   xlat_escape_t escape, void  const *escape_ctx);
 
@@ -282,20 +288,25 @@ do_print:
 	 */
 	case NUM_ALL:
 	{
-		char *p, *q;
+		fr_sbuff_t *sb;
 
 		if (!fr_pair_cursor_current(&cursor)) return NULL;
-		p = fr_pair_value_asprint(ctx, vp, quote);
-		if (!p) return NULL;
+
+		/*
+		 *	Build the list in the thread local buffer,
+		 *	so there's only one allocation.
+		 */
+		sb = fr_sbuff_thread_local();
+		if (!sb) return NULL;
+
+		if (fr_sbuff_in_pair_value(sb, vp, quote) < 0) return NULL;
 
 		while ((vp = tmpl_cursor_next(&cursor, vpt)) != NULL) {
-			q = fr_pair_value_asprint(ctx, vp, quote);
-			if (!q) return NULL;
-			p = talloc_strdup_append(p, ",");
-			p = talloc_strdup_append(p, q);
+			if ((fr_sbuff_in_char(sb, ',') < 0) ||
+			    (fr_sbuff_in_pair_value(sb, vp, quote) < 0)) return NULL;
 		}
 
-		return p;
+		return talloc_bstrndup(ctx, fr_sbuff_start(sb), fr_sbuff_used(sb));
 	}
 
 	default:
@@ -320,140 +331,187 @@ finish:
 	return ret;
 }
 
+/** Print a real attribute into the thread local buffer
+ *
+ * Avoids allocating a copy of the value, when we're going to copy
+ * it into the output buffer anyway.  Anything which needs special
+ * handling (virtual attributes, counts, lists, missing attributes)
+ * is left to #xlat_getvp.
+ *
+ * @return
+ *	- The buffer holding the printed value.
+ *	- NULL if #xlat_getvp should be used instead.
+ */
+static fr_sbuff_t *xlat_getvp_sbuff(REQUEST *request, vp_tmpl_t const *vpt, bool escape)
+{
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	fr_sbuff_t	*sb;
+
+	if ((vpt->type != TMPL_TYPE_ATTR) ||
+	    (vpt->tmpl_num == NUM_COUNT) || (vpt->tmpl_num == NUM_ALL)) return NULL;
+
+	vp = tmpl_cursor_init(NULL, &cursor, request, vpt);
+	if (!vp) return NULL;
+
+	sb = fr_sbuff_thread_local();
+	if (!sb) return NULL;
+
+	if (fr_sbuff_in_pair_value(sb, vp, escape ? '"' : '\0') < 0) return NULL;
+
+	return sb;
+}
+
 #ifdef DEBUG_XLAT
 static const char xlat_spaces[] = "                                                                                                                                                                                                                                                                ";
 #endif
 
-static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * const node,
-			 xlat_escape_t escape, void const *escape_ctx, int lvl)
+/** Expand a one-character expansion, e.g. %t
+ *
+ * @param[out] out	Where to write the expansion.
+ * @param[in] outlen	Size of out.  Should be at least #XLAT_PERCENT_MAX.
+ * @param[in] request	current request.
+ * @param[in] c		the character after the '%'.
+ * @return
+ *	- The length of the expansion.
+ *	- -1 on error.
+ */
+static ssize_t xlat_percent(char *out, size_t outlen, REQUEST *request, char c)
 {
-	ssize_t rcode;
-	char *str = NULL, *child;
-	char const *p;
-
-	XLAT_DEBUG("%.*sxlat aprint %d %s", lvl, xlat_spaces, node->type, node->fmt);
+	char *nl;
+	struct tm ts;
+	time_t when;
+	long int microseconds;
+
+	when = request->packet->timestamp.tv_sec;
+	microseconds = request->packet->timestamp.tv_usec;
+
+	switch (c) {
+	case '%':
+		out[0] = '%';
+		out[1] = '\0';
+		break;
 
-	switch (node->type) {
-		/*
-		 *	Don't escape this.
-		 */
-	case XLAT_LITERAL:
-		XLAT_DEBUG("%.*sxlat_aprint LITERAL", lvl, xlat_spaces);
-		return talloc_typed_strdup(ctx, node->fmt);
+	case 'd': /* request day */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%d", &ts);
+		break;
 
-		/*
-		 *	Do a one-character expansion.
-		 */
-	case XLAT_PERCENT:
-	{
-		char *nl;
-		size_t freespace = 256;
-		struct tm ts;
-		time_t when;
-		long int microseconds;
+	case 'l': /* request timestamp */
+		snprintf(out, outlen, "%lu",
+			 (unsigned long) when);
+		break;
 
-		XLAT_DEBUG("%.*sxlat_aprint PERCENT", lvl, xlat_spaces);
+	case 'm': /* request month */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%m", &ts);
+		break;
 
-		str = talloc_array(ctx, char, freespace); /* @todo do better allocation */
-		p = node->fmt;
+	case 'n': /* Request Number*/
+		snprintf(out, outlen, "%" PRIu64 , request->number);
+		break;
 
-		when = request->packet->timestamp.tv_sec;
-		microseconds = request->packet->timestamp.tv_usec;
+	case 's': /* First request in this sequence */
+		snprintf(out, outlen, "%" PRIu64 , request->seq_start);
+		break;
 
-		switch (*p) {
-		case '%':
-			str[0] = '%';
-			str[1] = '\0';
-			break;
+	case 'e': /* Request second */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%S", &ts);
+		break;
 
-		case 'd': /* request day */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%d", &ts);
-			break;
+	case 't': /* request timestamp */
+		CTIME_R(&when, out, outlen);
+		nl = strchr(out, '\n');
+		if (nl) *nl = '\0';
+		break;
 
-		case 'l': /* request timestamp */
-			snprintf(str, freespace, "%lu",
-				 (unsigned long) when);
-			break;
+	case 'D': /* request date */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%Y%m%d", &ts);
+		break;
 
-		case 'm': /* request month */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%m", &ts);
-			break;
+	case 'G': /* request minute */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%M", &ts);
+		break;
 
-		case 'n': /* Request Number*/
-			snprintf(str, freespace, "%" PRIu64 , request->number);
-			break;
+	case 'H': /* request hour */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%H", &ts);
+		break;
 
-		case 's': /* First request in this sequence */
-			snprintf(str, freespace, "%" PRIu64 , request->seq_start);
-			break;
+	case 'I': /* Request ID */
+		rad_assert(request != NULL);
+		snprintf(out, outlen, "%i", request->packet->id);
+		break;
 
-		case 'e': /* Request second */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%S", &ts);
-			break;
+	case 'M': /* Request microsecond */
+		snprintf(out, outlen, "%06ld", microseconds);
+		break;
 
-		case 't': /* request timestamp */
-			CTIME_R(&when, str, freespace);
-			nl = strchr(str, '\n');
-			if (nl) *nl = '\0';
-			break;
+	case 'S': /* request timestamp in SQL format*/
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%Y-%m-%d %H:%M:%S", &ts);
+		break;
 
-		case 'D': /* request date */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%Y%m%d", &ts);
-			break;
+	case 'T': /* request timestamp */
+		if (!localtime_r(&when, &ts)) goto error;
+		strftime(out, outlen, "%Y-%m-%d-%H.%M.%S.000000", &ts);
+		break;
 
-		case 'G': /* request minute */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%M", &ts);
-			break;
+	case 'Y': /* request year */
+		if (!localtime_r(&when, &ts)) {
+			error:
+			REDEBUG("Failed converting packet timestamp to localtime: %s", fr_syserror(errno));
+			return -1;
+		}
+		strftime(out, outlen, "%Y", &ts);
+		break;
 
-		case 'H': /* request hour */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%H", &ts);
-			break;
+	case 'v': /* Version of code */
+		RWDEBUG("%%v is deprecated and will be removed.  Use ${version.freeradius-server}");
+		snprintf(out, outlen, "%s", radiusd_version_short);
+		break;
 
-		case 'I': /* Request ID */
-			rad_assert(request != NULL);
-			snprintf(str, freespace, "%i", request->packet->id);
-			break;
+	default:
+		rad_assert(0 == 1);
+		out[0] = '\0';
+		break;
+	}
 
-		case 'M': /* Request microsecond */
-			snprintf(str, freespace, "%06ld", microseconds);
-			break;
+	return strlen(out);
+}
 
-		case 'S': /* request timestamp in SQL format*/
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%Y-%m-%d %H:%M:%S", &ts);
-			break;
+static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * const node,
+			 xlat_escape_t escape, void const *escape_ctx, int lvl)
+{
+	ssize_t rcode;
+	char *str = NULL, *child;
+	char const *p;
+	int span;
 
-		case 'T': /* request timestamp */
-			if (!localtime_r(&when, &ts)) goto error;
-			strftime(str, freespace, "%Y-%m-%d-%H.%M.%S.000000", &ts);
-			break;
+	XLAT_DEBUG("%.*sxlat aprint %d %s", lvl, xlat_spaces, node->type, node->fmt);
 
-		case 'Y': /* request year */
-			if (!localtime_r(&when, &ts)) {
-				error:
-				REDEBUG("Failed converting packet timestamp to localtime: %s", fr_syserror(errno));
-				talloc_free(str);
-				return NULL;
-			}
-			strftime(str, freespace, "%Y", &ts);
-			break;
+	switch (node->type) {
+		/*
+		 *	Don't escape this.
+		 */
+	case XLAT_LITERAL:
+		XLAT_DEBUG("%.*sxlat_aprint LITERAL", lvl, xlat_spaces);
+		return talloc_typed_strdup(ctx, node->fmt);
 
-		case 'v': /* Version of code */
-			RWDEBUG("%%v is deprecated and will be removed.  Use ${version.freeradius-server}");
-			snprintf(str, freespace, "%s", radiusd_version_short);
-			break;
+		/*
+		 *	Do a one-character expansion.
+		 */
+	case XLAT_PERCENT:
+		XLAT_DEBUG("%.*sxlat_aprint PERCENT", lvl, xlat_spaces);
 
-		default:
-			rad_assert(0 == 1);
-			break;
+		str = talloc_array(ctx, char, XLAT_PERCENT_MAX);
+		if (xlat_percent(str, talloc_array_length(str), request, node->fmt[0]) < 0) {
+			talloc_free(str);
+			return NULL;
 		}
-	}
 		break;
 
 	case XLAT_ATTRIBUTE:
@@ -476,7 +534,9 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 			str = talloc_array(ctx, char, node->xlat->buf_len);
 			str[0] = '\0';	/* Be sure the string is \0 terminated */
 		}
+		span = trace_span_start(request, TRACE_SPAN_XLAT, node->xlat->name);
 		rcode = node->xlat->func(ctx, &str, node->xlat->buf_len, node->xlat->mod_inst, NULL, request, NULL);
+		trace_span_done(request, span, (rcode < 0) ? RLM_MODULE_FAIL : RLM_MODULE_OK);
 		if (rcode < 0) {
 			talloc_free(str);
 			return NULL;
@@ -554,7 +614,10 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 			str = talloc_array(ctx, char, node->xlat->buf_len);
 			str[0] = '\0';	/* Be sure the string is \0 terminated */
 		}
-		rcode = node->xlat->func(ctx, &str, node->xlat->buf_len, node->xlat->mod_inst, NULL, request, child);
+		span = trace_span_start(request, TRACE_SPAN_XLAT, node->xlat->name);
+		rcode = node->xlat->func(ctx, &str, node->xlat->buf_len, node->xlat->mod_inst, node->inst,
+					 request, child);
+		trace_span_done(request, span, (rcode < 0) ? RLM_MODULE_FAIL : RLM_MODULE_OK);
 		talloc_free(child);
 		if (rcode < 0) {
 			talloc_free(str);
@@ -632,13 +695,43 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 }
 
 
+/** Ensure an expansion buffer has room for len more bytes, and a trailing '\0'
+ *
+ * @param[in] ctx	the buffer is allocated in.
+ * @param[in,out] buff	to grow.
+ * @param[in,out] size	of buff.
+ * @param[in] used	bytes of buff.
+ * @param[in] len	bytes we're about to add.
+ * @return
+ *	- 0 on success.
+ *	- -1 on out of memory.
+ */
+static int xlat_buff_reserve(TALLOC_CTX *ctx, char **buff, size_t *size, size_t used, size_t len)
+{
+	size_t	needed = used + len + 1;
+	char	*p;
+
+	if (needed <= *size) return 0;
+
+	if (needed < (*size * 2)) needed = *size * 2;
+
+	p = talloc_realloc(ctx, *buff, char, needed);
+	if (!p) return -1;
+
+	*buff = p;
+	*size = needed;
+
+	return 0;
+}
+
 static size_t xlat_process(TALLOC_CTX *ctx, char **out, REQUEST *request, xlat_exp_t const * const head,
 			   xlat_escape_t escape, void const *escape_ctx)
 {
-	int i, list;
-	size_t total;
-	char **array, *answer;
-	xlat_exp_t const *node;
+	char			*answer, *str;
+	char			percent[XLAT_PERCENT_MAX];
+	size_t			size, used, len;
+	void			*mutable;
+	xlat_exp_t const	*node;
 
 	*out = NULL;
 
@@ -671,46 +764,117 @@ static size_t xlat_process(TALLOC_CTX *ctx, char **out, REQUEST *request, xlat_e
 		return strlen(answer);
 	}
 
-	list = 0;		/* FIXME: calculate this once */
+	/*
+	 *	Everything is written to one buffer, which is sized
+	 *	for the literals, plus a guess at the expansions.
+	 *	Literals and attributes are copied (or escaped)
+	 *	directly into it, without intermediate strings.
+	 */
+	len = 0;
 	for (node = head; node != NULL; node = node->next) {
-		list++;
+		len += (node->type == XLAT_LITERAL) ? node->len : 32;
 	}
 
-	array = talloc_array(ctx, char *, list);
-	if (!array) return -1;
+	answer = NULL;
+	size = used = 0;
+	if (xlat_buff_reserve(ctx, &answer, &size, used, len) < 0) return -1;
 
-	for (node = head, i = 0; node != NULL; node = node->next, i++) {
-		array[i] = xlat_aprint(array, request, node, escape, escape_ctx, 0); /* may be NULL */
-	}
+	memcpy(&mutable, &escape_ctx, sizeof(mutable));
 
-	total = 0;
-	for (i = 0; i < list; i++) {
-		if (array[i]) total += strlen(array[i]); /* FIXME: calculate strlen once */
-	}
+	for (node = head; node != NULL; node = node->next) {
+		bool	allocated = true;
 
-	if (!total) {
-		talloc_free(array);
-		*out = talloc_zero_array(ctx, char, 1);
-		return 0;
-	}
+		switch (node->type) {
+		case XLAT_LITERAL:
+			if (!node->fmt) continue;
 
-	answer = talloc_array(ctx, char, total + 1);
+			len = strlen(node->fmt);
+			if (xlat_buff_reserve(ctx, &answer, &size, used, len) < 0) goto oom;
 
-	total = 0;
-	for (i = 0; i < list; i++) {
-		size_t len;
+			memcpy(answer + used, node->fmt, len);
+			used += len;
+			continue;
+
+		case XLAT_PERCENT:
+			if (xlat_percent(percent, sizeof(percent), request, node->fmt[0]) < 0) continue;
+			str = percent;
+			allocated = false;
+			break;
+
+		case XLAT_ATTRIBUTE:
+		{
+			fr_sbuff_t *sb;
+
+			/*
+			 *	The buffer is only used until the value
+			 *	has been copied, or escaped, below.
+			 */
+			sb = xlat_getvp_sbuff(request, node->attr, escape ? false : true);
+			if (sb) {
+				str = fr_sbuff_start(sb);
+				allocated = false;
+				break;
+			}
+
+			str = xlat_getvp(ctx, request, node->attr, escape ? false : true, true);
+		}
+			break;
 
-		if (array[i]) {
-			len = strlen(array[i]);
-			memcpy(answer + total, array[i], len);
-			total += len;
+			/*
+			 *	These do their own escaping.
+			 */
+		default:
+			str = xlat_aprint(ctx, request, node, escape, escape_ctx, 0);
+			if (!str) continue;
+
+			len = strlen(str);
+			if (xlat_buff_reserve(ctx, &answer, &size, used, len) < 0) {
+				talloc_free(str);
+				goto oom;
+			}
+
+			memcpy(answer + used, str, len);
+			used += len;
+			talloc_free(str);
+			continue;
 		}
+
+		if (!str) continue;
+
+		len = strlen(str);
+		if (len > 0) {
+			if (escape) {
+				if (xlat_buff_reserve(ctx, &answer, &size, used, (len + 1) * 3) < 0) goto fail;
+
+				used += escape(request, answer + used, (len + 1) * 3, str, mutable);
+			} else {
+				if (xlat_buff_reserve(ctx, &answer, &size, used, len) < 0) goto fail;
+
+				memcpy(answer + used, str, len);
+				used += len;
+			}
+		}
+
+		if (allocated) talloc_free(str);
+		continue;
+
+	fail:
+		if (allocated) talloc_free(str);
+	oom:
+		talloc_free(answer);
+		return -1;
 	}
-	answer[total] = '\0';
-	talloc_free(array);	/* and child entries */
+
+	/*
+	 *	Callers use talloc_array_length() of the result, so
+	 *	trim the buffer to size.
+	 */
+	answer[used] = '\0';
+	str = talloc_realloc(ctx, answer, char, used + 1);
+	if (str) answer = str;
 
 	*out = answer;
-	return total;
+	return used;
 }
 
 /** Replace %whatever in a string.
@@ -511,6 +511,118 @@ static ssize_t xlat_tokenize_literal(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **he
 	return p - fmt;
 }
 
+/** Fold constant parts of an xlat tree
+ *
+ * The tokenizer splits literals at every escaped character, so
+ * "foo%%bar" is three nodes.  Merge adjacent literals into one node
+ * so that the evaluator copies them with a single memcpy().
+ *
+ * @param[in] head	of the list to fold.  Nested lists are also folded.
+ */
+static void xlat_fold(xlat_exp_t *head)
+{
+	xlat_exp_t *node;
+
+	for (node = head; node != NULL; node = node->next) {
+		switch (node->type) {
+		case XLAT_MODULE:
+			if (node->child) xlat_fold(node->child);
+			break;
+
+		case XLAT_ALTERNATE:
+			xlat_fold(node->child);
+			xlat_fold(node->alternate);
+			break;
+
+		default:
+			break;
+		}
+
+		while ((node->type == XLAT_LITERAL) && node->fmt &&
+		       node->next && (node->next->type == XLAT_LITERAL) && node->next->fmt) {
+			xlat_exp_t	*next = node->next;
+			char		*fmt;
+
+			fmt = talloc_asprintf(node, "%s%s", node->fmt, next->fmt);
+			if (!fmt) return;
+
+			node->fmt = fmt;
+			node->len = talloc_array_length(fmt) - 1;
+
+			/*
+			 *	Each node is parented by the one before
+			 *	it, so keep the rest of the list.
+			 */
+			node->next = next->next;
+			if (next->next) (void) talloc_steal(node, next->next);
+			next->next = NULL;
+			talloc_free(next);
+		}
+	}
+}
+
+/** Call the instantiate functions of module expansions
+ *
+ * Only expansions whose argument is a single literal (after folding)
+ * are instantiated, as the argument is then known before any request
+ * is processed.  The xlat function is passed the instance data, along
+ * with the argument as usual.
+ *
+ * @param[in] head	of the list to instantiate.  Nested lists are also instantiated.
+ * @param[out] error	where to write a pointer to an error message.
+ * @return
+ *	- 0 on success.
+ *	- -1 if an instantiate function failed.
+ */
+static int xlat_instantiate(xlat_exp_t *head, char const **error)
+{
+	xlat_exp_t *node;
+
+	for (node = head; node != NULL; node = node->next) {
+		switch (node->type) {
+		case XLAT_MODULE:
+		{
+			xlat_exp_t *child = node->child;
+
+			if (child && (xlat_instantiate(child, error) < 0)) return -1;
+
+			if (!node->xlat->instantiate) break;
+
+			/*
+			 *	Literals containing escapes are
+			 *	unescaped at run-time, leave those
+			 *	to the xlat function.
+			 */
+			if (child && ((child->type != XLAT_LITERAL) || child->next ||
+				      strchr(child->fmt, '\\'))) break;
+
+			node->inst = talloc_zero_array(node, uint8_t, node->xlat->inst_size);
+			if (!node->inst) {
+				*error = "Out of memory";
+				return -1;
+			}
+
+			if (node->xlat->instantiate(node->inst, node->xlat->mod_inst,
+						    child ? child->fmt : "") < 0) {
+				*error = fr_strerror();
+				return -1;
+			}
+		}
+			break;
+
+		case XLAT_ALTERNATE:
+			if (xlat_instantiate(node->child, error) < 0) return -1;
+			if (xlat_instantiate(node->alternate, error) < 0) return -1;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
 static void xlat_tokenize_debug(REQUEST *request, xlat_exp_t const *node)
 {
 	rad_assert(node != NULL);
@@ -761,6 +873,8 @@ ssize_t xlat_tokenize_request(TALLOC_CTX *ctx, REQUEST *request, char const *fmt
 		return slen;
 	}
 
+	if (slen > 0) xlat_fold(*head);
+
 	if (*head && RDEBUG_ENABLED3) {
 		RDEBUG3("%s", fmt);
 		RDEBUG3("Parsed xlat tree:");
@@ -786,6 +900,18 @@ ssize_t xlat_tokenize_request(TALLOC_CTX *ctx, REQUEST *request, char const *fmt
  */
 ssize_t xlat_tokenize(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head, char const **error)
 {
-	return xlat_tokenize_literal(ctx, fmt, head, false, error);
+	ssize_t slen;
+
+	slen = xlat_tokenize_literal(ctx, fmt, head, false, error);
+	if (slen > 0) {
+		xlat_fold(*head);
+
+		if (xlat_instantiate(*head, error) < 0) {
+			TALLOC_FREE(*head);
+			return -1;
+		}
+	}
+
+	return slen;
 }
 
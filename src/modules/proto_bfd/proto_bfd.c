@@ -61,6 +61,8 @@ typedef enum bfd_auth_type_t {
 
 #define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
 
+typedef struct bfd_engine_t bfd_engine_t;
+
 typedef struct bfd_state_t {
 	int		number;
 	int		sockfd;
@@ -69,9 +71,7 @@ typedef struct bfd_state_t {
 	const char	*server;
 	CONF_SECTION	*unlang;
 
-	bool		blocked;
-	int		pipefd[2];
-	pthread_t	pthread_id;
+	bfd_engine_t	*engine;	//!< Thread which runs this session, or NULL.
 
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
@@ -225,8 +225,33 @@ typedef struct bfd_socket_t {
 	size_t		secret_len;
 
 	rbtree_t	*session_tree;
+
+	uint32_t	num_engines;	//!< How many threads to run the sessions in.
+	bfd_engine_t	*engines;
 } bfd_socket_t;
 
+/** A thread which runs the timers and processes the packets for many sessions
+ *
+ */
+struct bfd_engine_t {
+	int		number;
+	fr_event_list_t	*el;
+	int		pipefd[2];	//!< Packets from the listener, as bfd_engine_msg_t.
+	pthread_t	pthread_id;
+
+	bfd_state_t	**sessions;	//!< Sessions run by this engine.
+	uint32_t	num_sessions;
+};
+
+/** A packet passed from the listener to an engine
+ *
+ * Is small enough that writes to the pipe are atomic.
+ */
+typedef struct bfd_engine_msg_t {
+	bfd_state_t	*session;
+	bfd_packet_t	bfd;
+} bfd_engine_msg_t;
+
 static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
@@ -242,127 +267,148 @@ void bfd_init(fr_event_list_t *xel)
 	el = xel;
 }
 
-static void bfd_pthread_free(bfd_state_t *session)
-{
-	session->blocked = true;
-
-	close(session->pipefd[0]);
-	close(session->pipefd[1]);
-
-	talloc_free(session->el);
-
-	session->el = NULL;
-	session->pipefd[0] = session->pipefd[1] = -1;
-
-	session->blocked = false;
-}
-
 /*
- *	A child thread reads the packet from a pipe, and processes it.
+ *	An engine reads packets from a pipe, and processes them.
+ *
+ *	The pipe is drained each time, so a busy engine handles many
+ *	packets per wakeup.
  */
 static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, void *ctx)
 {
 	ssize_t num;
-	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
+	bfd_engine_t *engine = ctx;
+	bfd_engine_msg_t msg;
 
-	if (session->blocked) return;
+	while (true) {
+		num = read(fd, &msg, sizeof(msg));
+		if (num < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
 
-	/*
-	 *	Read the header
-	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
-	fail:
-		ERROR("BFD Failed reading from pipe!");
-		session->blocked = true;
-		return;
-	}
+			ERROR("BFD engine %d failed reading from pipe: %s", engine->number, fr_syserror(errno));
+			return;
+		}
 
-	/*
-	 *	This is already checked in the caller, but what the heck...
-	 */
-	if (bfd.length > sizeof(bfd)) goto fail;
+		if (num == 0) return;
 
-	/*
-	 *	Read the rest of the packet.
-	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
+		/*
+		 *	Writes are atomic, so this should never happen.
+		 */
+		if ((num != sizeof(msg)) || (msg.bfd.length > sizeof(msg.bfd)) || !msg.session) {
+			ERROR("BFD engine %d read invalid message from pipe", engine->number);
+			continue;
+		}
+
+		rad_assert(msg.session->engine == engine);
 
-	bfd_process(session, &bfd);
+		bfd_process(msg.session, &msg.bfd);
+	}
 }
 
 /*
- *	Do nothing more than read from the sockets and process the
- *	timers.
+ *	Start the sessions, and then do nothing more than read from
+ *	the pipe and process the timers.
  */
-static void *bfd_child_thread(void *ctx)
+static void *bfd_engine_thread(void *ctx)
 {
-	bfd_state_t *session = ctx;
+	bfd_engine_t *engine = ctx;
+	uint32_t i;
 
-	DEBUG("BFD %d starting child thread", session->number);
-	bfd_start_control(session);
+	DEBUG("BFD engine %d starting with %u session(s)", engine->number, engine->num_sessions);
 
-	fr_event_loop(session->el);
+	for (i = 0; i < engine->num_sessions; i++) bfd_start_control(engine->sessions[i]);
 
-	bfd_pthread_free(session);
+	fr_event_loop(engine->el);
 
 	return NULL;
 }
 
+static int bfd_engine_add(void *ctx, void *data)
+{
+	bfd_socket_t *sock = ctx;
+	bfd_state_t *session = data;
+	bfd_engine_t *engine;
+
+	engine = &sock->engines[session->number % sock->num_engines];
+
+	engine->sessions = talloc_realloc(sock->engines, engine->sessions, bfd_state_t *, engine->num_sessions + 1);
+	if (!engine->sessions) return -1;
+	engine->sessions[engine->num_sessions++] = session;
+
+	session->engine = engine;
+	session->el = engine->el;
 
-static int bfd_pthread_create(bfd_state_t *session)
+	return 0;
+}
+
+/*
+ *	Spread the sessions over a few threads, each of which runs
+ *	its sessions from one event list.
+ */
+static int bfd_engines_start(bfd_socket_t *sock)
 {
+	uint32_t i;
 	int rcode;
 	pthread_attr_t attr;
 
-	if (pipe(session->pipefd) < 0) {
-		ERROR("Failed opening pipe: %s", fr_syserror(errno));
-		return 0;
-	}
+	sock->engines = talloc_zero_array(sock, bfd_engine_t, sock->num_engines);
+	if (!sock->engines) return -1;
 
-	session->el = fr_event_list_create(session, NULL, NULL);
-	if (!session->el) {
-		ERROR("Failed creating event list");
-	close_pipes:
-		close(session->pipefd[0]);
-		close(session->pipefd[1]);
-		session->pipefd[0] = session->pipefd[1] = -1;
-		return 0;
-	}
+	for (i = 0; i < sock->num_engines; i++) {
+		bfd_engine_t *engine = &sock->engines[i];
+
+		engine->number = i;
+		engine->pipefd[0] = engine->pipefd[1] = -1;
+
+		if (pipe(engine->pipefd) < 0) {
+			ERROR("Failed opening pipe: %s", fr_syserror(errno));
+			return -1;
+		}
 
 #ifdef O_NONBLOCK
-	fcntl(session->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	fcntl(session->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+		fcntl(engine->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+		fcntl(engine->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
 #endif
 
-	if (fr_event_fd_insert(session->el, session->pipefd[0], bfd_pipe_recv, NULL, NULL, session) < 0) {
-		ERROR("Failed inserting file descriptor into event list: %s", fr_strerror());
-		goto close_pipes;
+		engine->el = fr_event_list_create(sock->engines, NULL, NULL);
+		if (!engine->el) {
+			ERROR("Failed creating event list");
+			return -1;
+		}
+
+		if (fr_event_fd_insert(engine->el, engine->pipefd[0], bfd_pipe_recv, NULL, NULL, engine) < 0) {
+			ERROR("Failed inserting file descriptor into event list: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	if (rbtree_walk(sock->session_tree, RBTREE_IN_ORDER, bfd_engine_add, sock) != 0) {
+		ERROR("Failed assigning sessions to threads");
+		return -1;
 	}
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-	/*
-	 *	Create the thread detached, so that it cleans up it's
-	 *	own memory when it exits.
-	 *
-	 *	Note that the function returns non-zero on error, NOT
-	 *	-1.  The return code is the error, and errno isn't set.
-	 */
-	rcode = pthread_create(&session->pthread_id, &attr,
-			       bfd_child_thread, session);
-	if (rcode != 0) {
-		talloc_free(session->el);
-		session->el = NULL;
-		ERROR("Thread create failed: %s", fr_syserror(rcode));
-		goto close_pipes;
+	for (i = 0; i < sock->num_engines; i++) {
+		bfd_engine_t *engine = &sock->engines[i];
+
+		if (!engine->num_sessions) continue;
+
+		/*
+		 *	Note that the function returns non-zero on error, NOT
+		 *	-1.  The return code is the error, and errno isn't set.
+		 */
+		rcode = pthread_create(&engine->pthread_id, &attr, bfd_engine_thread, engine);
+		if (rcode != 0) {
+			ERROR("Thread create failed: %s", fr_syserror(rcode));
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
 	}
 	pthread_attr_destroy(&attr);
 
-	return 1;
+	return 0;
 }
 
 static const char *bfd_state[] = {
@@ -408,13 +454,6 @@ static void bfd_session_free(void *ctx)
 {
 	bfd_state_t *session = ctx;
 
-	if (el != session->el) {
-		/*
-		 *	FIXME: this isn't particularly safe.
-		 */
-		bfd_pthread_free(session);
-	}
-
 	talloc_free(session);
 }
 
@@ -571,21 +610,13 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	bfd_trigger(session);
 
 	/*
-	 *	Check for threaded / non-threaded operation.
+	 *	Check for threaded / non-threaded operation.  In
+	 *	threaded mode, the session is started by its engine.
 	 */
 	if (el) {
 		session->el = el;
 
 		bfd_start_control(session);
-
-		session->pipefd[0] = session->pipefd[1] = -1;
-		session->pthread_id = pthread_self();
-	} else {
-		if (!bfd_pthread_create(session)) {
-			rbtree_deletebydata(sock->session_tree, session);
-			talloc_free(session);
-			return NULL;
-		}
 	}
 
 	return session;
@@ -1500,35 +1531,29 @@ static int bfd_socket_recv(rad_listen_t *listener)
 	}
 
 	if (!el) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
-
-		/*
-		 *	A child has had a problem.  Do some cleanups.
-		 */
-		if (session->blocked) bfd_pthread_free(session);
+		bfd_engine_msg_t msg;
 
-		/*
-		 *	No event list, try to create a new one.
-		 */
-		if (!session->el && !bfd_pthread_create(session)) {
-			DEBUG("BFD %d - error trying to create child thread",
-			      session->number);
+		if (!session->engine) {
+			DEBUG("BFD %d - session has no thread", session->number);
 			return 0;
 		}
 
-		do {
-			rcode = write(session->pipefd[1], p, total);
-			if ((rcode < 0) && (errno == EINTR)) continue;
+		msg.session = session;
+		memcpy(&msg.bfd, &bfd, sizeof(msg.bfd));
 
-			if (rcode < 0) {
-				session->blocked = true;
-				return 0;
-			}
+		/*
+		 *	If the engine is so far behind that the pipe
+		 *	is full, drop the packet.  BFD copes with
+		 *	lost packets.
+		 */
+		do {
+			rcode = write(session->engine->pipefd[1], &msg, sizeof(msg));
+		} while ((rcode < 0) && (errno == EINTR));
 
-			total -= rcode;
-			p += rcode;
-		} while (total > 0);
+		if (rcode < 0) {
+			DEBUG("BFD %d - failed passing packet to thread: %s",
+			      session->number, fr_syserror(errno));
+		}
 		return 0;
 	}
 
@@ -1673,6 +1698,7 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	cf_pair_parse(cs, "max_timeouts", FR_ITEM_POINTER(PW_TYPE_INTEGER, &sock->max_timeouts), "3", T_BARE_WORD);
 	cf_pair_parse(cs, "demand", FR_ITEM_POINTER(PW_TYPE_BOOLEAN, &sock->demand), "no", T_DOUBLE_QUOTED_STRING);
 	cf_pair_parse(cs, "auth_type", FR_ITEM_POINTER(PW_TYPE_STRING, &auth_type_str), NULL, T_INVALID);
+	cf_pair_parse(cs, "threads", FR_ITEM_POINTER(PW_TYPE_INTEGER, &sock->num_engines), "1", T_BARE_WORD);
 
 	if (!this->server) {
 		cf_pair_parse(cs, "server", FR_ITEM_POINTER(PW_TYPE_STRING, &sock->server), NULL, T_INVALID);
@@ -1689,6 +1715,9 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	if (sock->max_timeouts == 0) sock->max_timeouts = 1;
 	if (sock->max_timeouts > 10) sock->max_timeouts = 10;
 
+	if (sock->num_engines == 0) sock->num_engines = 1;
+	if (sock->num_engines > 64) sock->num_engines = 64;
+
 	sock->auth_type = fr_str2int(auth_types, auth_type_str, BFD_AUTH_INVALID);
 	if (sock->auth_type == BFD_AUTH_INVALID) {
 		ERROR("Unknown auth_type '%s'", auth_type_str);
@@ -1770,6 +1799,10 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		exit(1);
 	}
 
+	if (!el && (bfd_engines_start(sock) < 0)) {
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -44,6 +44,8 @@ RCSID("$Id$")
 
 #define USEC (1000000)
 
+#define DETAIL_READ_BUFFER (64 * 1024)
+
 static FR_NAME_NUMBER state_names[] = {
 	{ "unopened", STATE_UNOPENED },
 	{ "unlocked", STATE_UNLOCKED },
@@ -52,121 +54,157 @@ static FR_NAME_NUMBER state_names[] = {
 	{ "header", STATE_HEADER },
 	{ "vps", STATE_VPS },
 	{ "queued", STATE_QUEUED },
-	{ "running", STATE_RUNNING },
-	{ "no-reply", STATE_NO_REPLY },
-	{ "replied", STATE_REPLIED },
 
 	{ NULL, 0 }
 };
 
 
 /*
- *	If we're limiting outstanding packets, then mark the response
- *	as being sent.
+ *	Update the load factor delay, based on how long the server took
+ *	to process a packet.
+ *
+ *	This is only called from the reader thread, so it's safe to
+ *	update the detail structure.
  */
-static int detail_send(rad_listen_t *listener, REQUEST *request)
+static void detail_rtt_update(listen_detail_t *data, int rtt)
 {
-	char c = 0;
-	listen_detail_t *data = listener->data;
+	struct timeval now;
 
-	rad_assert(request->listener == listener);
-	rad_assert(listener->send == detail_send);
+	/*
+	 *	We call gettimeofday a lot.  But it should be OK,
+	 *	because there's nothing else to do.
+	 */
+	gettimeofday(&now, NULL);
 
 	/*
-	 *	This request timed out.  Remember that, and tell the
-	 *	caller it's OK to read more "detail" file stuff.
+	 *	If we haven't sent a packet in the last second, reset
+	 *	the RTT.
 	 */
-	if (request->reply->code == 0) {
-		data->delay_time = data->retry_interval * USEC;
-		data->signal = 1;
-		data->entry_state = STATE_NO_REPLY;
+	now.tv_sec -= 1;
+	if (fr_timeval_cmp(&data->last_packet, &now) < 0) {
+		data->has_rtt = false;
+	}
+	now.tv_sec += 1;
+
+	/*
+	 *	We keep smoothed round trip time (SRTT), but not round
+	 *	trip timeout (RTO).  We use SRTT to calculate a rough
+	 *	load factor.
+	 *
+	 *	If we're proxying, the RTT is our processing time,
+	 *	plus the network delay there and back, plus the time
+	 *	on the other end to process the packet.  Ideally, we
+	 *	should remove the network delays from the RTT, but we
+	 *	don't know what they are.
+	 *
+	 *	So, to be safe, we over-estimate the total cost of
+	 *	processing the packet.
+	 */
+	if (!data->has_rtt) {
+		data->has_rtt = true;
+		data->srtt = rtt;
+		data->rttvar = rtt / 2;
 
-		RDEBUG("detail (%s): No response to request.  Will retry in %d seconds",
-		       data->name, data->retry_interval);
 	} else {
-		int rtt;
-		struct timeval now;
-		/*
-		 *	We call gettimeofday a lot.  But it should be OK,
-		 *	because there's nothing else to do.
-		 */
-		gettimeofday(&now, NULL);
+		data->rttvar -= data->rttvar >> 2;
+		data->rttvar += (data->srtt - rtt);
+		data->srtt -= data->srtt >> 3;
+		data->srtt += rtt >> 3;
+	}
 
-		/*
-		 *	If we haven't sent a packet in the last second, reset
-		 *	the RTT.
-		 */
-		now.tv_sec -= 1;
-		if (fr_timeval_cmp(&data->last_packet, &now) < 0) {
-			data->has_rtt = false;
-		}
-		now.tv_sec += 1;
+	/*
+	 *	Calculate the time we wait before sending the next
+	 *	packet.
+	 *
+	 *	rtt / (rtt + delay) = load_factor / 100
+	 */
+	data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
 
-		/*
-		 *	Only one detail packet may be outstanding at a time,
-		 *	so it's safe to update some entries in the detail
-		 *	structure.
-		 *
-		 *	We keep smoothed round trip time (SRTT), but not round
-		 *	trip timeout (RTO).  We use SRTT to calculate a rough
-		 *	load factor.
-		 */
-		rtt = now.tv_sec - request->packet->timestamp.tv_sec;
-		rtt *= USEC;
-		rtt += now.tv_usec;
-		rtt -= request->packet->timestamp.tv_usec;
+	/*
+	 *	Cap delay at no less than 4 packets/s.  If the
+	 *	end system can't handle this, then it's very
+	 *	broken.
+	 */
+	if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
 
-		/*
-		 *	If we're proxying, the RTT is our processing time,
-		 *	plus the network delay there and back, plus the time
-		 *	on the other end to process the packet.  Ideally, we
-		 *	should remove the network delays from the RTT, but we
-		 *	don't know what they are.
-		 *
-		 *	So, to be safe, we over-estimate the total cost of
-		 *	processing the packet.
-		 */
-		if (!data->has_rtt) {
-			data->has_rtt = true;
-			data->srtt = rtt;
-			data->rttvar = rtt / 2;
+	data->last_packet = now;
+}
 
-		} else {
-			data->rttvar -= data->rttvar >> 2;
-			data->rttvar += (data->srtt - rtt);
-			data->srtt -= data->srtt >> 3;
-			data->srtt += rtt >> 3;
-		}
+/*
+ *	Tell the reader thread that we're done with a packet.
+ */
+static void detail_ack(listen_detail_t *data, RADIUS_PACKET const *packet, bool replied, int rtt)
+{
+	detail_ack_t ack;
 
-		/*
-		 *	Calculate the time we wait before sending the next
-		 *	packet.
-		 *
-		 *	rtt / (rtt + delay) = load_factor / 100
-		 */
-		data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
+	ack.packet = packet;
+	ack.replied = replied;
+	ack.rtt = rtt;
 
-		/*
-		 *	Cap delay at no less than 4 packets/s.  If the
-		 *	end system can't handle this, then it's very
-		 *	broken.
-		 */
-		if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
+	/*
+	 *	Writes smaller than PIPE_BUF are atomic, so acks from
+	 *	different workers don't get mixed up.
+	 */
+	if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
+		ERROR("detail (%s): Failed writing ack to reader thread: %s", data->name, fr_syserror(errno));
+	}
+}
 
-		RDEBUG3("detail (%s): Received response for request %" PRIu64 ".  "
-			"Will read the next packet in %d seconds",
-			data->name, request->number, data->delay_time / USEC);
+/*
+ *	Find the reader which sent a packet.  The reader number is
+ *	encoded in the fake destination port.
+ */
+static listen_detail_t *detail_reader(listen_detail_t *data, RADIUS_PACKET const *packet)
+{
+	unsigned int reader = packet->dst_port - 1024;
 
-		data->last_packet = now;
-		data->signal = 1;
-		data->entry_state = STATE_REPLIED;
-		data->counter++;
+	if (reader >= data->num_readers) {
+		ERROR("detail (%s): Can't find the reader for packet with destination port %u",
+		      data->name, packet->dst_port);
+		return data;
 	}
 
-	if (write(data->child_pipe[1], &c, 1) < 0) {
-		RERROR("detail (%s): Failed writing ack to reader thread: %s", data->name, fr_syserror(errno));
+	return data->readers[reader];
+}
+
+/*
+ *	Mark the response as being sent, so the reader thread can
+ *	either retransmit the packet, or forget about it.
+ *
+ *	This is called from whichever worker processed the request,
+ *	so all it does is pass the result back to the reader thread.
+ */
+static int detail_send(rad_listen_t *listener, REQUEST *request)
+{
+	int rtt;
+	struct timeval now;
+	listen_detail_t *data = listener->data;
+
+	rad_assert(request->listener == listener);
+	rad_assert(listener->send == detail_send);
+
+	/*
+	 *	This request timed out.  Tell the reader thread to
+	 *	send it again.
+	 */
+	if (request->reply->code == 0) {
+		RDEBUG("detail (%s): No response to request.  Will retry in %d seconds",
+		       data->name, data->retry_interval);
+		detail_ack(detail_reader(data, request->packet), request->packet, false, -1);
+		return 0;
 	}
 
+	gettimeofday(&now, NULL);
+
+	rtt = now.tv_sec - request->packet->timestamp.tv_sec;
+	rtt *= USEC;
+	rtt += now.tv_usec;
+	rtt -= request->packet->timestamp.tv_usec;
+
+	RDEBUG3("detail (%s): Received response for request %" PRIu64, data->name, request->number);
+
+	detail_ack(detail_reader(data, request->packet), request->packet, true, rtt);
+
 	return 0;
 }
 
@@ -177,10 +215,9 @@ static int detail_send(rad_listen_t *listener, REQUEST *request)
  *	FIXME: create it, if it's not already there, so that the main
  *	server select() will wake us up if there's anything to read.
  */
-static int detail_open(rad_listen_t *this)
+static int detail_open(listen_detail_t *data)
 {
 	struct stat st;
-	listen_detail_t *data = this->data;
 
 	rad_assert(data->file_state == STATE_UNOPENED);
 	data->delay_time = USEC;
@@ -241,6 +278,16 @@ static int detail_open(rad_listen_t *this)
 		chtime = 0;
 		found = -1;
 		for (i = 0; i < files.gl_pathc; i++) {
+			char const *p;
+
+			/*
+			 *	Don't steal a work file from another
+			 *	reader.
+			 */
+			p = strrchr(files.gl_pathv[i], FR_DIR_SEP);
+			p = p ? p + 1 : files.gl_pathv[i];
+			if (strncmp(p, "detail.work", 11) == 0) continue;
+
 			if (stat(files.gl_pathv[i], &st) < 0) continue;
 
 			if ((i == 0) || (st.st_ctime < chtime)) {
@@ -310,11 +357,11 @@ static int detail_open(rad_listen_t *this)
  */
 static int detail_recv(rad_listen_t *listener)
 {
-	char c = 0;
 	ssize_t rcode;
 	RADIUS_PACKET *packet;
 	listen_detail_t *data = listener->data;
 	RAD_REQUEST_FUNP fun = NULL;
+	bool replied = false;
 
 	/*
 	 *	Block until there's a packet ready.
@@ -335,19 +382,17 @@ static int detail_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		data->entry_state = STATE_REPLIED;
+		replied = true;		/* nothing to do, skip it */
 		goto signal_thread;
 	}
 
 	if (!request_receive(NULL, listener, packet, &data->detail_client, fun)) {
-		data->entry_state = STATE_NO_REPLY;	/* try again later */
-
 	signal_thread:
+		/*
+		 *	If we didn't process it, try again later.
+		 */
+		detail_ack(detail_reader(data, packet), packet, replied, -1);
 		fr_radius_free(&packet);
-		if (write(data->child_pipe[1], &c, 1) < 0) {
-			ERROR("detail (%s): Failed writing ack to reader thread: %s", data->name,
-			      fr_syserror(errno));
-		}
 	}
 
 	/*
@@ -356,21 +401,101 @@ static int detail_recv(rad_listen_t *listener)
 	return 0;
 }
 
-static RADIUS_PACKET *detail_poll(rad_listen_t *listener)
+/*
+ *	Read one record from a binary detail file.
+ *
+ *	There's nothing to parse, the attributes are decoded directly
+ *	from the RADIUS wire format.
+ */
+static int detail_read_binary(listen_detail_t *data)
+{
+	uint8_t		header[DETAIL_BINARY_HDR_LEN];
+	uint8_t		*attrs = NULL;
+	detail_binary_t	hdr;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	if (fread(header, sizeof(header), 1, data->fp) != 1) {
+	truncated:
+		ERROR("detail (%s): Truncated record: treating it as EOF for detail file %s",
+		      data->name, data->filename_work);
+		talloc_free(attrs);
+		return -1;
+	}
+
+	if (detail_binary_header_decode(&hdr, header) < 0) {
+		ERROR("detail (%s): Invalid record at offset %" PRIu64 " of detail file %s: %s",
+		      data->name, (uint64_t) data->offset, data->filename_work, fr_strerror());
+		return -1;
+	}
+
+	if (hdr.length > 0) {
+		attrs = talloc_array(data, uint8_t, hdr.length);
+		if (!attrs || (fread(attrs, hdr.length, 1, data->fp) != 1)) goto truncated;
+	}
+
+	data->last_offset = data->offset;
+	data->offset += sizeof(header) + hdr.length;
+
+	if (attrs && (detail_binary_decode_pairs(data, &data->vps, attrs, hdr.length) < 0)) {
+		WARN("detail (%s): Failed decoding attributes at offset %" PRIu64 ": %s",
+		     data->name, (uint64_t) data->last_offset, fr_strerror());
+	}
+	talloc_free(attrs);
+
+	data->timestamp = hdr.timestamp;
+	data->timestamp_offset = data->last_offset + DETAIL_BINARY_FLAGS_OFFSET;
+	data->done_entry = ((hdr.flags & DETAIL_BINARY_FLAG_DONE) != 0);
+	if (hdr.src_ipaddr.af != AF_UNSPEC) data->client_ip = hdr.src_ipaddr;
+
+	/*
+	 *	Add the same internal attributes we'd get from a
+	 *	text entry.
+	 */
+	fr_pair_cursor_init(&cursor, &data->vps);
+
+	vp = fr_pair_afrom_num(data, 0, PW_PACKET_TYPE);
+	if (vp) {
+		vp->vp_integer = hdr.code;
+		vp->type = VT_DATA;
+		fr_pair_cursor_append(&cursor, vp);
+	}
+
+	vp = fr_pair_afrom_num(data, 0, PW_PACKET_ORIGINAL_TIMESTAMP);
+	if (vp) {
+		vp->vp_date = (uint32_t) hdr.timestamp;
+		vp->type = VT_DATA;
+		fr_pair_cursor_append(&cursor, vp);
+	}
+
+	data->entry_state = STATE_QUEUED;
+
+	return 0;
+}
+
+/** Read the next entry from the detail file
+ *
+ * @param[in] data	the reader.
+ * @param[out] entry	to fill with the attributes, and the information
+ *			we need to mark the entry as done.
+ * @return
+ *	- 1 if an entry was read.
+ *	- 0 if there's nothing to read right now.
+ */
+static int detail_poll(listen_detail_t *data, detail_entry_t *entry)
 {
 	char		key[256], op[8], value[1024];
 	vp_cursor_t	cursor;
 	VALUE_PAIR	*vp;
-	RADIUS_PACKET	*packet;
 	char		buffer[2048];
-	listen_detail_t *data = listener->data;
+	size_t		len;
 
 	switch (data->file_state) {
 	case STATE_UNOPENED:
 open_file:
 		rad_assert(data->work_fd < 0);
 
-		if (!detail_open(listener)) return NULL;
+		if (!detail_open(data)) return 0;
 
 		rad_assert(data->file_state == STATE_UNLOCKED);
 		rad_assert(data->work_fd >= 0);
@@ -405,7 +530,7 @@ open_file:
 			data->fp = NULL;
 			data->work_fd = -1;
 			data->file_state = STATE_UNOPENED;
-			return NULL;
+			return 0;
 		}
 
 		/*
@@ -419,6 +544,26 @@ open_file:
 			fr_exit(1);
 		}
 
+		/*
+		 *	Read the file in large chunks.  Backlogs can be
+		 *	many gigabytes, and the default buffer is
+		 *	usually only a few KB.
+		 */
+		if (setvbuf(data->fp, NULL, _IOFBF, DETAIL_READ_BUFFER) != 0) {
+			WARN("detail (%s): Failed setting read buffer size", data->name);
+		}
+
+		/*
+		 *	Binary files start with the record magic.
+		 *	Anything else is read as text.
+		 */
+		{
+			uint8_t magic[sizeof(DETAIL_BINARY_MAGIC) - 1];
+
+			data->binary = ((pread(data->work_fd, magic, sizeof(magic), 0) == sizeof(magic)) &&
+					(memcmp(magic, DETAIL_BINARY_MAGIC, sizeof(magic)) == 0));
+		}
+
 		/*
 		 *	Look for the header
 		 */
@@ -442,7 +587,8 @@ open_file:
 		data->done_entry = false;
 		data->timestamp_offset = 0;
 
-		data->tries = 0;
+		if (data->draining) goto cleanup;
+
 		if (!data->fp) {
 			data->file_state = STATE_UNOPENED;
 			goto open_file;
@@ -457,7 +603,7 @@ open_file:
 
 				goto cleanup;
 			}
-			if (((off_t) ftell(data->fp)) == buf.st_size) {
+			if (data->offset == buf.st_size) {
 				goto cleanup;
 			}
 		}
@@ -468,6 +614,18 @@ open_file:
 		 */
 		if (feof(data->fp)) {
 		cleanup:
+			/*
+			 *	Packets from this file are still in
+			 *	flight.  Don't read any more of it, and
+			 *	don't delete it until they've all been
+			 *	answered.
+			 */
+			if (data->outstanding > 0) {
+				data->draining = true;
+				return 0;
+			}
+			data->draining = false;
+
 			DEBUG("detail (%s): Unlinking %s", data->name, data->filename_work);
 			unlink(data->filename_work);
 			if (data->fp) fclose(data->fp);
@@ -481,7 +639,7 @@ open_file:
 				radius_signal_self(RADIUS_SIGNAL_SELF_EXIT);
 			}
 
-			return NULL;
+			return 0;
 		}
 
 		/*
@@ -501,58 +659,17 @@ open_file:
 		/* FALL-THROUGH */
 
 	case STATE_QUEUED:
-		goto alloc_packet;
-
-	/*
-	 *	Periodically check what's going on.
-	 *	If the request is taking too long,
-	 *	retry it.
-	 */
-	case STATE_RUNNING:
-		if (time(NULL) < (data->running + (int)data->retry_interval)) {
-			return NULL;
-		}
-
-		DEBUG("detail (%s): No response to detail request.  Retrying", data->name);
-		/* FALL-THROUGH */
-
-	/*
-	 *	If there's no reply, keep
-	 *	retransmitting the current packet
-	 *	forever.
-	 */
-	case STATE_NO_REPLY:
-		data->entry_state = STATE_QUEUED;
-		goto alloc_packet;
-
-	/*
-	 *	We have a reply.  Clean up the old
-	 *	request, and go read another one.
-	 */
-	case STATE_REPLIED:
-		if (data->track) {
-			rad_assert(data->fp != NULL);
-
-			if (fseek(data->fp, data->timestamp_offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to timestamp offset: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fwrite("\tDone", 1, 5, data->fp) < 5) {
-				WARN("detail (%s): Failed marking request as done: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fflush(data->fp) != 0) {
-				WARN("detail (%s): Failed flushing marked detail file to disk: %s",
-				     data->name, fr_syserror(errno));
-			}
+		goto queue_entry;
+	}
 
-			if (fseek(data->fp, data->offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to next detail request: %s",
-				     data->name, fr_syserror(errno));
-			}
+	if (data->binary) {
+		if (detail_read_binary(data) < 0) {
+			fr_pair_list_free(&data->vps);
+			goto cleanup;
 		}
 
-		fr_pair_list_free(&data->vps);
-		data->entry_state = STATE_HEADER;
-		goto do_header;
+		data->packets++;
+		goto queue_entry;
 	}
 
 	fr_pair_cursor_init(&cursor, &data->vps);
@@ -561,15 +678,20 @@ open_file:
 	 *	Read a header, OR a value-pair.
 	 */
 	while (fgets(buffer, sizeof(buffer), data->fp)) {
+		/*
+		 *	Track the offset ourselves.  ftell() may
+		 *	make a system call every time.
+		 */
+		len = strlen(buffer);
 		data->last_offset = data->offset;
-		data->offset = ftell(data->fp); /* for statistics */
+		data->offset += len;
 
 		/*
 		 *	Badly formatted file: delete it.
 		 *
 		 *	FIXME: Maybe flag an error?
 		 */
-		if (!strchr(buffer, '\n')) {
+		if ((len == 0) || (buffer[len - 1] != '\n')) {
 			fr_pair_list_free(&data->vps);
 			goto cleanup;
 		}
@@ -689,13 +811,9 @@ open_file:
 	 */
 	if (ferror(data->fp)) goto cleanup;
 
-	data->tries = 0;
 	data->packets++;
 
-	/*
-	 *	Process the packet.
-	 */
- alloc_packet:
+ queue_entry:
 	if (data->done_entry) {
 		DEBUG2("detail (%s): Skipping record for timestamp %lu", data->name, data->timestamp);
 		fr_pair_list_free(&data->vps);
@@ -703,8 +821,6 @@ open_file:
 		goto do_header;
 	}
 
-	data->tries++;
-
 	/*
 	 *	The writer doesn't check that the record was
 	 *	completely written.  If the disk is full, this can
@@ -727,9 +843,43 @@ open_file:
 		     data->name, data->filename_work);
 		data->entry_state = STATE_HEADER;
 		if (!data->fp || feof(data->fp)) goto cleanup;
-		return NULL;
+		return 0;
 	}
 
+	/*
+	 *	Hand the entry over to the caller, and look for
+	 *	the next one.
+	 */
+	entry->vps = data->vps;
+	entry->timestamp = data->timestamp;
+	entry->timestamp_offset = data->timestamp_offset;
+	entry->client_ip = data->client_ip;
+	entry->tries = 0;
+	entry->session_hash = 0;
+
+	vp = fr_pair_find_by_num(data->vps, 0, PW_ACCT_SESSION_ID, TAG_ANY);
+	if (vp && (vp->vp_length > 0)) {
+		entry->session_hash = fr_hash(vp->vp_strvalue, vp->vp_length);
+		if (!entry->session_hash) entry->session_hash = 1;
+	}
+
+	data->vps = NULL;
+	data->entry_state = STATE_HEADER;
+
+	return 1;
+}
+
+/*
+ *	Create a packet from an entry.  This is done every time we
+ *	(re)send the entry, so that the server always gets the original
+ *	attributes, unmolested.
+ */
+static RADIUS_PACKET *detail_packet_alloc(listen_detail_t *data, detail_entry_t *entry)
+{
+	VALUE_PAIR	*vp;
+	RADIUS_PACKET	*packet;
+	time_t		timestamp = entry->timestamp;
+
 	/*
 	 *	Allocate the packet.  If we fail, it's a serious
 	 *	problem.
@@ -745,12 +895,7 @@ open_file:
 	packet->src_ipaddr.af = AF_INET;
 	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
 
-	/*
-	 *	If everything's OK, this is a waste of memory.
-	 *	Otherwise, it lets us re-send the original packet
-	 *	contents, unmolested.
-	 */
-	packet->vps = fr_pair_list_copy(packet, data->vps);
+	packet->vps = fr_pair_list_copy(packet, entry->vps);
 
 	packet->code = PW_CODE_ACCOUNTING_REQUEST;
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TYPE, TAG_ANY);
@@ -762,8 +907,8 @@ open_file:
 	 *	Remember where it came from, so that we don't
 	 *	proxy it to the place it came from...
 	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
+	if (entry->client_ip.af != AF_UNSPEC) {
+		packet->src_ipaddr = entry->client_ip;
 	}
 
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IP_ADDRESS, TAG_ANY);
@@ -797,14 +942,19 @@ open_file:
 	}
 
 	/*
-	 *	Generate packet ID, ports, IP via a counter.
+	 *	Generate packet ID, ports, IP via a counter.  Every
+	 *	packet in flight gets a different one.
+	 *
+	 *	The destination port is the reader number, so that
+	 *	the ack can be sent to the right reader.
 	 */
+	data->counter++;
 	packet->id = data->counter & 0xff;
 	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
-	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
+	packet->dst_port = 1024 + data->reader;
 
 	packet->dst_ipaddr.af = AF_INET;
-	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
+	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 16) & 0xffff));
 
 	/*
 	 *	Create / update accounting attributes.
@@ -818,7 +968,7 @@ open_file:
 		 */
 		vp = fr_pair_find_by_num(packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY);
 		if (vp) {
-			data->timestamp = vp->vp_integer;
+			timestamp = vp->vp_integer;
 		}
 
 		/*
@@ -831,8 +981,8 @@ open_file:
 			rad_assert(vp != NULL);
 			fr_pair_add(&packet->vps, vp);
 		}
-		if (data->timestamp != 0) {
-			vp->vp_integer += time(NULL) - data->timestamp;
+		if (timestamp != 0) {
+			vp->vp_integer += time(NULL) - timestamp;
 		}
 	}
 
@@ -845,10 +995,7 @@ open_file:
 		rad_assert(vp != NULL);
 		fr_pair_add(&packet->vps, vp);
 	}
-	vp->vp_integer = data->tries;
-
-	data->entry_state = STATE_RUNNING;
-	data->running = packet->timestamp.tv_sec;
+	vp->vp_integer = entry->tries;
 
 	return packet;
 }
@@ -858,26 +1005,45 @@ open_file:
  */
 static int _detail_free(listen_detail_t *data)
 {
+	uint32_t i;
+
 	if (!check_config) {
-		ssize_t ret;
+		ssize_t ret = 0;
 		void *arg = NULL;
+		uint32_t running = data->num_readers;
 
-		/*
-		 *	Mark the child pipes as unusable
-		 */
-		close(data->child_pipe[0]);
-		close(data->child_pipe[1]);
-		data->child_pipe[0] = -1;
+		for (i = 0; i < data->num_readers; i++) {
+			listen_detail_t *reader = data->readers[i];
 
-		/*
-		 *	Tell it to stop (interrupting its sleep)
-		 */
-		pthread_kill(data->pthread_id, SIGTERM);
+			/*
+			 *	Mark the child pipes as unusable
+			 */
+			close(reader->child_pipe[0]);
+			close(reader->child_pipe[1]);
+			reader->child_pipe[0] = -1;
+
+			/*
+			 *	Tell it to stop (interrupting its sleep)
+			 */
+			pthread_kill(reader->pthread_id, SIGTERM);
+		}
 
 		/*
-		 *	Wait for it to acknowledge that it's stopped.
+		 *	Wait for them all to acknowledge that they've
+		 *	stopped, throwing away any packets they queued
+		 *	for us in the meantime.
 		 */
-		ret = read(data->master_pipe[0], &arg, sizeof(arg));
+		while ((running > 0) &&
+		       ((ret = read(data->master_pipe[0], &arg, sizeof(arg))) == sizeof(arg))) {
+			RADIUS_PACKET *packet = arg;
+
+			if (!packet) {
+				running--;
+				continue;
+			}
+			fr_radius_free(&packet);
+			arg = NULL;
+		}
 		if (ret < 0) {
 			ERROR("detail (%s): Reader thread exited without informing the master: %s",
 			      data->name, fr_syserror(errno));
@@ -889,13 +1055,15 @@ static int _detail_free(listen_detail_t *data)
 
 		close(data->master_pipe[0]);
 		close(data->master_pipe[1]);
-
-		if (arg) pthread_join(data->pthread_id, &arg);
 	}
 
-	if (data->fp != NULL) {
-		fclose(data->fp);
-		data->fp = NULL;
+	for (i = 0; i < data->num_readers; i++) {
+		listen_detail_t *reader = data->readers[i];
+
+		if (reader->fp != NULL) {
+			fclose(reader->fp);
+			reader->fp = NULL;
+		}
 	}
 
 	return 0;
@@ -960,54 +1128,217 @@ static int detail_decode(rad_listen_t *this, REQUEST *request)
 }
 
 
+/*
+ *	Send an entry to the server, or re-send it.
+ */
+static void detail_entry_send(listen_detail_t *data, detail_entry_t *entry)
+{
+	RADIUS_PACKET *packet;
+
+	entry->tries++;
+	data->tries = entry->tries;	/* for statistics */
+
+	packet = detail_packet_alloc(data, entry);
+	entry->packet = packet;
+
+	if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+		ERROR("detail (%s): Failed passing detail packet pointer to master: %s",
+		      data->name, fr_syserror(errno));
+	}
+}
+
+/*
+ *	The entry has been processed.  Mark it as done in the file, if
+ *	we're tracking progress, and forget about it.
+ *
+ *	Entries may be answered in any order, so each one is marked
+ *	individually.  This means that if the server is restarted, it
+ *	skips exactly the entries which were processed.
+ */
+static void detail_entry_done(listen_detail_t *data, detail_entry_t *entry)
+{
+	if (data->track) {
+		bool ok;
+
+		rad_assert(data->work_fd >= 0);
+
+		/*
+		 *	Don't go through stdio.  That would mean
+		 *	seeking, and throwing away the read buffer.
+		 *
+		 *	Text entries have "Timestamp" changed to
+		 *	"Donestamp".  Binary ones have a flag set.
+		 */
+		if (data->binary) {
+			uint8_t flags = DETAIL_BINARY_FLAG_DONE;
+
+			ok = (pwrite(data->work_fd, &flags, sizeof(flags), entry->timestamp_offset) == sizeof(flags));
+		} else {
+			ok = (pwrite(data->work_fd, "\tDone", 5, entry->timestamp_offset) == 5);
+		}
+		if (!ok) {
+			WARN("detail (%s): Failed marking request as done: %s",
+			     data->name, fr_syserror(errno));
+		}
+	}
+
+	fr_pair_list_free(&entry->vps);
+	entry->packet = NULL;
+	entry->session_hash = 0;
+
+	data->outstanding--;
+	rad_assert(data->outstanding >= 0);
+}
+
+/*
+ *	Tell the master thread that we've exited.
+ */
+static void *detail_handler_exit(listen_detail_t *data)
+{
+	RADIUS_PACKET *packet = NULL;
+
+	if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+		ERROR("detail (%s): Failed writing exit status to master: %s",
+		      data->name, fr_syserror(errno));
+	}
+
+	return NULL;
+}
+
+/*
+ *	Check if there's another entry in flight for the same session.
+ *
+ *	Entries for one session (e.g. Start, Interim-Update, Stop) must
+ *	be processed in the order they were written, so only one of them
+ *	may be in flight at a time.
+ */
+static bool detail_entry_blocked(listen_detail_t *data, detail_entry_t *entry)
+{
+	uint32_t i;
+
+	if (!entry->session_hash) return false;
+
+	for (i = 0; i < data->max_outstanding; i++) {
+		if (&data->entries[i] == entry) continue;
+		if (!data->entries[i].packet) continue;
+
+		if (data->entries[i].session_hash == entry->session_hash) return true;
+	}
+
+	return false;
+}
+
 static void *detail_handler_thread(void *arg)
 {
-	char c;
-	rad_listen_t *this = arg;
-	listen_detail_t *data = this->data;
+	listen_detail_t *data = arg;
 
 	while (true) {
-		RADIUS_PACKET *packet;
+		detail_ack_t	ack;
+		detail_entry_t	*entry = NULL;
+		ssize_t		rcode;
+		uint32_t	i;
+
+		/*
+		 *	Keep up to max_outstanding entries in flight.
+		 */
+		while (data->outstanding < (int) data->max_outstanding) {
+			/*
+			 *	Send the entry we couldn't send before,
+			 *	if that's now OK.
+			 */
+			if (data->blocked) {
+				if (detail_entry_blocked(data, data->blocked)) break;
+
+				entry = data->blocked;
+				data->blocked = NULL;
+				detail_entry_send(data, entry);
+				continue;
+			}
+
+			for (i = 0; i < data->max_outstanding; i++) {
+				if (!data->entries[i].vps) break;
+			}
+			rad_assert(i < data->max_outstanding);
+			entry = &data->entries[i];
+
+			if (!detail_poll(data, entry)) break;
 
-		while ((packet = detail_poll(this)) == NULL) {
+			data->outstanding++;
+
+			/*
+			 *	Don't read any more entries until
+			 *	this one can be sent.
+			 */
+			if (detail_entry_blocked(data, entry)) {
+				data->blocked = entry;
+				break;
+			}
+
+			detail_entry_send(data, entry);
+		}
+
+		/*
+		 *	Nothing to do, wait for the file to appear.
+		 */
+		if (data->outstanding == 0) {
 			usleep(detail_delay(data));
 
 			/*
 			 *	If we're supposed to exit then tell
 			 *	the master thread we've exited.
 			 */
-			if (data->child_pipe[0] < 0) {
-				packet = NULL;
-				if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-					ERROR("detail (%s): Failed writing exit status to master: %s",
-					      data->name, fr_syserror(errno));
-				}
-				return NULL;
-			}
+			if (data->child_pipe[0] < 0) return detail_handler_exit(data);
+			continue;
 		}
 
 		/*
-		 *	Keep retrying forever.
-		 *
-		 *	FIXME: cap the retries.
+		 *	Wait for one of the packets to be answered.
 		 */
-		do {
-			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-				ERROR("detail (%s): Failed passing detail packet pointer to master: %s",
-				      data->name, fr_syserror(errno));
-			}
+		rcode = read(data->child_pipe[0], &ack, sizeof(ack));
+		if (rcode != sizeof(ack)) {
+			if (data->child_pipe[0] < 0) return detail_handler_exit(data);
 
-			if (read(data->child_pipe[0], &c, 1) < 0) {
+			if ((rcode < 0) && (errno != EINTR)) {
 				ERROR("detail (%s): Failed getting detail packet ack from master: %s",
 				      data->name, fr_syserror(errno));
+				usleep(detail_delay(data));
+			}
+			continue;
+		}
+
+		entry = NULL;
+		for (i = 0; i < data->max_outstanding; i++) {
+			if (data->entries[i].packet == ack.packet) {
+				entry = &data->entries[i];
 				break;
 			}
+		}
+		if (!ack.packet || !entry) {
+			ERROR("detail (%s): Received ack for unknown packet", data->name);
+			continue;
+		}
+
+		/*
+		 *	Keep retrying forever.
+		 *
+		 *	FIXME: cap the retries.
+		 */
+		if (!ack.replied) {
+			data->delay_time = data->retry_interval * USEC;
+			usleep(data->delay_time);
 
-			if (data->delay_time > 0) usleep(data->delay_time);
+			detail_entry_send(data, entry);
+			continue;
+		}
+
+		if (ack.rtt >= 0) detail_rtt_update(data, ack.rtt);
+		detail_entry_done(data, entry);
 
-			packet = detail_poll(this);
-			if (!packet) break;
-		} while (data->entry_state != STATE_REPLIED);
+		/*
+		 *	Enforce the load factor before reading the
+		 *	next entry.
+		 */
+		if (data->delay_time > 0) usleep(data->delay_time);
 	}
 
 	return NULL;
@@ -1020,6 +1351,8 @@ static const CONF_PARSER detail_config[] = {
 	{ FR_CONF_OFFSET("load_factor", PW_TYPE_INTEGER, listen_detail_t, load_factor), .dflt = STRINGIFY(10) },
 	{ FR_CONF_OFFSET("poll_interval", PW_TYPE_INTEGER, listen_detail_t, poll_interval), .dflt = STRINGIFY(1) },
 	{ FR_CONF_OFFSET("retry_interval", PW_TYPE_INTEGER, listen_detail_t, retry_interval), .dflt = STRINGIFY(30) },
+	{ FR_CONF_OFFSET("max_outstanding", PW_TYPE_INTEGER, listen_detail_t, max_outstanding), .dflt = STRINGIFY(1) },
+	{ FR_CONF_OFFSET("readers", PW_TYPE_INTEGER, listen_detail_t, num_readers), .dflt = STRINGIFY(1) },
 	{ FR_CONF_OFFSET("one_shot", PW_TYPE_BOOLEAN, listen_detail_t, one_shot), .dflt = "no" },
 	{ FR_CONF_OFFSET("track", PW_TYPE_BOOLEAN, listen_detail_t, track), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
@@ -1031,6 +1364,7 @@ static const CONF_PARSER detail_config[] = {
 static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 {
 	int		rcode;
+	uint32_t	i;
 	listen_detail_t *data;
 	RADCLIENT	*client;
 	char		buffer[2048];
@@ -1065,6 +1399,17 @@ static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, >=, 4);
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, <=, 3600);
 
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("readers", data->num_readers, >=, 1);
+	FR_INTEGER_BOUND_CHECK("readers", data->num_readers, <=, 32);
+
+	if ((data->num_readers > 1) && data->one_shot) {
+		cf_log_err_cs(cs, "'one_shot' can't be used with more than one reader");
+		return -1;
+	}
+
 	/*
 	 *	Only checking the config.  Don't start threads or anything else.
 	 */
@@ -1115,6 +1460,9 @@ static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	data->entry_state = STATE_HEADER;
 	data->delay_time = data->poll_interval * USEC;
 	data->signal = 1;
+	data->entries = talloc_zero_array(data, detail_entry_t, data->max_outstanding);
+	data->outstanding = 0;
+	data->draining = false;
 
 	/*
 	 *	Initialize the fake client.
@@ -1131,6 +1479,33 @@ static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	this->server_cs = cf_item_parent(cf_section_to_item(this->cs));
 	client->server_cs = this->server_cs;
 
+	/*
+	 *	Each additional reader gets a copy of the
+	 *	configuration, and its own work file.  They all
+	 *	take files from the same glob, so each one
+	 *	processes a different file.
+	 */
+	data->reader = 0;
+	data->readers = talloc_zero_array(data, listen_detail_t *, data->num_readers);
+	data->readers[0] = data;
+
+	for (i = 1; i < data->num_readers; i++) {
+		listen_detail_t *reader;
+
+		reader = talloc_memdup(data, data, sizeof(*data));
+		if (!reader) {
+			cf_log_err_cs(cs, "Out of memory");
+			return -1;
+		}
+		talloc_set_type(reader, listen_detail_t);
+
+		reader->reader = i;
+		reader->filename_work = talloc_asprintf(reader, "%s.%u", data->filename_work, i);
+		reader->entries = talloc_zero_array(reader, detail_entry_t, data->max_outstanding);
+
+		data->readers[i] = reader;
+	}
+
 	return 0;
 }
 
@@ -1140,6 +1515,7 @@ static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 static int detail_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *this)
 {
 	listen_detail_t *data;
+	uint32_t	i;
 
 	data = this->data;
 	talloc_set_destructor(data, _detail_free);
@@ -1152,14 +1528,21 @@ static int detail_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *this)
 		fr_exit(1);
 	}
 
-	if (pipe(data->child_pipe) < 0) {
-		ERROR("detail (%s): Error opening internal pipe: %s", data->name, fr_syserror(errno));
-		fr_exit(1);
-	}
+	for (i = 0; i < data->num_readers; i++) {
+		listen_detail_t *reader = data->readers[i];
 
-	if (pthread_create(&data->pthread_id, NULL, detail_handler_thread, this) != 0) {
-		ERROR("detail (%s): Error creating detail reader thread: %s", data->name, fr_syserror(errno));
-		fr_exit(1);
+		reader->master_pipe[0] = data->master_pipe[0];
+		reader->master_pipe[1] = data->master_pipe[1];
+
+		if (pipe(reader->child_pipe) < 0) {
+			ERROR("detail (%s): Error opening internal pipe: %s", data->name, fr_syserror(errno));
+			fr_exit(1);
+		}
+
+		if (pthread_create(&reader->pthread_id, NULL, detail_handler_thread, reader) != 0) {
+			ERROR("detail (%s): Error creating detail reader thread: %s", data->name, fr_syserror(errno));
+			fr_exit(1);
+		}
 	}
 
 	this->fd = data->master_pipe[0];
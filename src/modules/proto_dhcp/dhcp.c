@@ -41,6 +41,7 @@ RCSID("$Id$")
 #endif
 
 #ifdef HAVE_LINUX_IF_PACKET_H
+#  include <net/if.h>
 #  include <linux/if_packet.h>
 #  include <linux/if_ether.h>
 #endif
@@ -60,6 +61,7 @@ RCSID("$Id$")
 #endif
 
 static fr_dict_attr_t const *dhcp_option_82;
+static fr_dict_attr_t const *dhcp_vendor_root;	//!< Parent of all DHCP options.
 
 /* @todo: this is a hack */
 #  define DEBUG			if (fr_debug_lvl && fr_log_fp) fr_printf_log
@@ -87,9 +89,6 @@ static uint8_t eth_bcast[ETH_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 }
 #endif
 
-static RADIUS_PACKET *fr_dhcp_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipaddr_t src_ipaddr,
-					uint16_t src_port, fr_ipaddr_t dst_ipaddr, uint16_t dst_port);
-
 typedef struct dhcp_packet_t {
 	uint8_t		opcode;
 	uint8_t		htype;
@@ -169,6 +168,14 @@ static int dhcp_header_sizes[] = {
 	DHCP_FILE_LEN
 };
 
+#define DHCP_NUM_HEADERS	(sizeof(dhcp_header_sizes) / sizeof(dhcp_header_sizes[0]))
+
+/*
+ *	Resolved versions of dhcp_header_names, in the same order.
+ *	The header attributes are numbered from 256.
+ */
+static fr_dict_attr_t const *dhcp_header_attrs[DHCP_NUM_HEADERS];
+
 
 /*
  *	Some clients silently ignore responses less than 300 bytes.
@@ -1049,17 +1056,24 @@ ssize_t fr_dhcp_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 
 	/*
 	 *	Stupid hacks until we have protocol specific dictionaries
+	 *
+	 *	This is called for every option, so use the parent
+	 *	dhcp_init() found if we can.
 	 */
-	parent = fr_dict_attr_child_by_num(parent, PW_VENDOR_SPECIFIC);
-	if (!parent) {
-		fr_strerror_printf("Can't find Vendor-Specific (26)");
-		return -1;
-	}
+	if (dhcp_vendor_root && (parent == fr_dict_root(fr_dict_internal))) {
+		parent = dhcp_vendor_root;
+	} else {
+		parent = fr_dict_attr_child_by_num(parent, PW_VENDOR_SPECIFIC);
+		if (!parent) {
+			fr_strerror_printf("Can't find Vendor-Specific (26)");
+			return -1;
+		}
 
-	parent = fr_dict_attr_child_by_num(parent, DHCP_MAGIC_VENDOR);
-	if (!parent) {
-		fr_strerror_printf("Can't find DHCP vendor");
-		return -1;
+		parent = fr_dict_attr_child_by_num(parent, DHCP_MAGIC_VENDOR);
+		if (!parent) {
+			fr_strerror_printf("Can't find DHCP vendor");
+			return -1;
+		}
 	}
 
 	/*
@@ -1130,9 +1144,13 @@ int fr_dhcp_decode(RADIUS_PACKET *packet)
 	/*
 	 *	Decode the header.
 	 */
-	for (i = 0; i < 14; i++) {
-
-		vp = fr_pair_make(packet, NULL, dhcp_header_names[i], NULL, T_OP_EQ);
+	for (i = 0; i < DHCP_NUM_HEADERS; i++) {
+		if (dhcp_header_attrs[i]) {
+			vp = fr_pair_afrom_da(packet, dhcp_header_attrs[i]);
+			if (vp) vp->op = T_OP_EQ;
+		} else {
+			vp = fr_pair_make(packet, NULL, dhcp_header_names[i], NULL, T_OP_EQ);
+		}
 		if (!vp) {
 			char buffer[256];
 			strlcpy(buffer, fr_strerror(), sizeof(buffer));
@@ -1651,6 +1669,50 @@ ssize_t fr_dhcp_encode_option(uint8_t *out, size_t outlen, vp_cursor_t *cursor,
 	return len;
 }
 
+/** Find the attributes for the fixed header fields, in one pass over the list
+ *
+ * Equivalent to calling fr_pair_find_by_num() for each header field.
+ *
+ * @param[out] out	The first attribute for each field, or NULL.
+ * @param[in] vps	to search.
+ */
+static void dhcp_header_pairs(VALUE_PAIR *out[DHCP_NUM_HEADERS], VALUE_PAIR *vps)
+{
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	memset(out, 0, sizeof(out[0]) * DHCP_NUM_HEADERS);
+
+	for (vp = fr_pair_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		unsigned int i;
+
+		if ((vp->da->vendor != DHCP_MAGIC_VENDOR) || (vp->da->attr < 256)) continue;
+
+		i = vp->da->attr - 256;
+		if ((i < DHCP_NUM_HEADERS) && !out[i]) out[i] = vp;
+	}
+}
+
+/** Check whether the attributes are already in the order fr_dhcp_encode_option() needs
+ *
+ * Replies are usually built the same way every time, so they're
+ * often already sorted.  Checking is O(n), sorting is not.
+ */
+static bool dhcp_pairs_sorted(VALUE_PAIR const *vps)
+{
+	VALUE_PAIR const *vp;
+
+	if (!vps) return true;
+
+	for (vp = vps; vp->next; vp = vp->next) {
+		if (fr_dhcp_attr_cmp(vp, vp->next) > 0) return false;
+	}
+
+	return true;
+}
+
 int fr_dhcp_encode(RADIUS_PACKET *packet)
 {
 	uint8_t		*p;
@@ -1660,6 +1722,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	uint16_t	svalue;
 	size_t		dhcp_size;
 	ssize_t		len;
+	VALUE_PAIR	*header[DHCP_NUM_HEADERS];
 
 	if (packet->data) return 0;
 
@@ -1669,8 +1732,10 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	/* XXX Ugly ... should be set by the caller */
 	if (packet->code == 0) packet->code = PW_DHCP_NAK;
 
+	dhcp_header_pairs(header, packet->vps);
+
 	/* store xid */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 260, TAG_ANY))) {
+	if ((vp = header[4])) {
 		packet->id = vp->vp_integer;
 	} else {
 		packet->id = fr_rand();
@@ -1699,7 +1764,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	}
 #endif
 
-	vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 256, TAG_ANY);
+	vp = header[0];
 	if (vp) {
 		*p++ = vp->vp_integer & 0xff;
 	} else {
@@ -1707,21 +1772,21 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	}
 
 	/* DHCP-Hardware-Type */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 257, TAG_ANY))) {
+	if ((vp = header[1])) {
 		*p++ = vp->vp_byte;
 	} else {
 		*p++ = 1;		/* hardware type = ethernet */
 	}
 
 	/* DHCP-Hardware-Address-len */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 258, TAG_ANY))) {
+	if ((vp = header[2])) {
 		*p++ = vp->vp_byte;
 	} else {
 		*p++ = 6;		/* 6 bytes of ethernet */
 	}
 
 	/* DHCP-Hop-Count */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 259, TAG_ANY))) {
+	if ((vp = header[3])) {
 		*p = vp->vp_byte;
 	}
 	p++;
@@ -1732,27 +1797,27 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += 4;
 
 	/* DHCP-Number-of-Seconds */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 261, TAG_ANY))) {
+	if ((vp = header[5])) {
 		svalue = htons(vp->vp_short);
 		memcpy(p, &svalue, 2);
 	}
 	p += 2;
 
 	/* DHCP-Flags */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 262, TAG_ANY))) {
+	if ((vp = header[6])) {
 		svalue = htons(vp->vp_short);
 		memcpy(p, &svalue, 2);
 	}
 	p += 2;
 
 	/* DHCP-Client-IP-Address */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY))) {
+	if ((vp = header[7])) {
 		memcpy(p, &vp->vp_ipaddr, 4);
 	}
 	p += 4;
 
 	/* DHCP-Your-IP-address */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 264, TAG_ANY))) {
+	if ((vp = header[8])) {
 		lvalue = vp->vp_ipaddr;
 	} else {
 		lvalue = htonl(INADDR_ANY);
@@ -1761,7 +1826,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += 4;
 
 	/* DHCP-Server-IP-Address */
-	vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 265, TAG_ANY);
+	vp = header[9];
 	if (vp) {
 		lvalue = vp->vp_ipaddr;
 	} else {
@@ -1773,7 +1838,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	/*
 	 *	DHCP-Gateway-IP-Address
 	 */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY))) {
+	if ((vp = header[10])) {
 		lvalue = vp->vp_ipaddr;
 	} else {
 		lvalue = htonl(INADDR_ANY);
@@ -1782,7 +1847,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += 4;
 
 	/* DHCP-Client-Hardware-Address */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 267, TAG_ANY))) {
+	if ((vp = header[11])) {
 		if (vp->vp_length == sizeof(vp->vp_ether)) {
 			/*
 			 *	Ensure that we mark the packet as being Ethernet.
@@ -1797,7 +1862,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	p += DHCP_CHADDR_LEN;
 
 	/* DHCP-Server-Host-Name */
-	if ((vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 268, TAG_ANY))) {
+	if ((vp = header[12])) {
 		if (vp->vp_length > DHCP_SNAME_LEN) {
 			memcpy(p, vp->vp_strvalue, DHCP_SNAME_LEN);
 		} else {
@@ -1817,7 +1882,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	 */
 
 	/* DHCP-Boot-Filename */
-	vp = fr_pair_find_by_num(packet->vps, DHCP_MAGIC_VENDOR, 269, TAG_ANY);
+	vp = header[13];
 	if (vp) {
 		if (vp->vp_length > DHCP_FILE_LEN) {
 			memcpy(p, vp->vp_strvalue, DHCP_FILE_LEN);
@@ -1841,7 +1906,7 @@ int fr_dhcp_encode(RADIUS_PACKET *packet)
 	 *  Pre-sort attributes into contiguous blocks so that fr_dhcp_encode_option
 	 *  operates correctly. This changes the order of the list, but never mind...
 	 */
-	fr_pair_list_sort(&packet->vps, fr_dhcp_attr_cmp);
+	if (!dhcp_pairs_sorted(packet->vps)) fr_pair_list_sort(&packet->vps, fr_dhcp_attr_cmp);
 	fr_pair_cursor_init(&cursor, &packet->vps);
 
 	/*
@@ -1985,28 +2050,22 @@ int fr_socket_packet(int if_index, struct sockaddr_ll *link_layer)
 }
 
 /*
- *	Encode and send a DHCP packet on a raw packet socket.
+ *	Build an Ethernet frame containing an encoded DHCP packet.
+ *	Returns the length of the frame.
  */
-int fr_dhcp_send_raw_packet(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *packet)
+static size_t dhcp_raw_frame_build(uint8_t frame[1518], uint8_t const *dst_ether_addr,
+				   uint8_t const *src_ether_addr, RADIUS_PACKET *packet)
 {
-	uint8_t			dhcp_packet[1518] = { 0 };
-	ethernet_header_t	*eth_hdr = (ethernet_header_t *)dhcp_packet;
-	ip_header_t		*ip_hdr = (ip_header_t *)(dhcp_packet + ETH_HDR_SIZE);
-	udp_header_t		*udp_hdr = (udp_header_t *) (dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE);
-	dhcp_packet_t		*dhcp = (dhcp_packet_t *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+	ethernet_header_t	*eth_hdr = (ethernet_header_t *)frame;
+	ip_header_t		*ip_hdr = (ip_header_t *)(frame + ETH_HDR_SIZE);
+	udp_header_t		*udp_hdr = (udp_header_t *) (frame + ETH_HDR_SIZE + IP_HDR_SIZE);
+	dhcp_packet_t		*dhcp = (dhcp_packet_t *)(frame + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
 
 	uint16_t		l4_len = (UDP_HDR_SIZE + packet->data_len);
-	VALUE_PAIR		*vp;
-
-	/* set ethernet source address to our MAC address (DHCP-Client-Hardware-Address). */
-	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
-	if ((vp = fr_pair_find_by_num(packet->vps, 267, DHCP_MAGIC_VENDOR, TAG_ANY))) {
-		if (vp->vp_length == sizeof(vp->vp_ether)) memcpy(dhmac, vp->vp_ether, vp->vp_length);
-	}
 
 	/* fill in Ethernet layer (L2) */
-	memcpy(eth_hdr->ether_dst, eth_bcast, ETH_ADDR_LEN);
-	memcpy(eth_hdr->ether_src, dhmac, ETH_ADDR_LEN);
+	memcpy(eth_hdr->ether_dst, dst_ether_addr, ETH_ADDR_LEN);
+	memcpy(eth_hdr->ether_src, src_ether_addr, ETH_ADDR_LEN);
 	eth_hdr->ether_type = htons(ETH_TYPE_IP);
 
 	/* fill in IP layer (L3) */
@@ -2040,12 +2099,121 @@ int fr_dhcp_send_raw_packet(int sockfd, struct sockaddr_ll *link_layer, RADIUS_P
 	memcpy(dhcp, packet->data, packet->data_len);
 
 	/* UDP checksum is done here */
-	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE),
+	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)(frame + ETH_HDR_SIZE + IP_HDR_SIZE),
 					    ntohs(udp_hdr->len), udp_hdr->checksum,
 					    packet->src_ipaddr.ipaddr.ip4addr, packet->dst_ipaddr.ipaddr.ip4addr);
 
-	return sendto(sockfd, dhcp_packet, (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len),
-		      0, (struct sockaddr *) link_layer, sizeof(struct sockaddr_ll));
+	return ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len;
+}
+
+/*
+ *	Encode and send a DHCP packet on a raw packet socket.
+ */
+int fr_dhcp_send_raw_packet(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *packet)
+{
+	uint8_t			dhcp_packet[1518] = { 0 };
+	size_t			len;
+	VALUE_PAIR		*vp;
+
+	/* set ethernet source address to our MAC address (DHCP-Client-Hardware-Address). */
+	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
+	if ((vp = fr_pair_find_by_num(packet->vps, 267, DHCP_MAGIC_VENDOR, TAG_ANY))) {
+		if (vp->vp_length == sizeof(vp->vp_ether)) memcpy(dhmac, vp->vp_ether, vp->vp_length);
+	}
+
+	len = dhcp_raw_frame_build(dhcp_packet, eth_bcast, dhmac, packet);
+
+	return sendto(sockfd, dhcp_packet, len, 0, (struct sockaddr *) link_layer, sizeof(struct sockaddr_ll));
+}
+
+/** Open a raw packet socket which is only used to send DHCP replies
+ *
+ * The socket is bound to no protocol, so the kernel doesn't queue
+ * received frames on it.
+ *
+ * @param[in] interface		to send replies on.
+ * @param[out] link_layer	address to pass to fr_dhcp_send_raw_reply().
+ * @param[out] ether_addr	MAC address of the interface.
+ * @return
+ *	- >= 0 the socket.
+ *	- -1 on failure.
+ */
+int fr_dhcp_raw_reply_socket(char const *interface, struct sockaddr_ll *link_layer, uint8_t ether_addr[6])
+{
+	int		sockfd;
+	unsigned int	if_index;
+	struct ifreq	ifr;
+
+	if_index = if_nametoindex(interface);
+	if (!if_index) {
+		fr_strerror_printf("Unknown interface %s: %s", interface, fr_syserror(errno));
+		return -1;
+	}
+
+	sockfd = socket(PF_PACKET, SOCK_RAW, 0);
+	if (sockfd < 0) {
+		fr_strerror_printf("Cannot open raw socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
+	if (ioctl(sockfd, SIOCGIFHWADDR, &ifr) < 0) {
+		fr_strerror_printf("Cannot get MAC address of interface %s: %s", interface, fr_syserror(errno));
+		close(sockfd);
+		return -1;
+	}
+	memcpy(ether_addr, ifr.ifr_hwaddr.sa_data, ETH_ADDR_LEN);
+
+	memset(link_layer, 0, sizeof(*link_layer));
+	link_layer->sll_family = AF_PACKET;
+	link_layer->sll_protocol = htons(ETH_P_IP);
+	link_layer->sll_ifindex = if_index;
+	link_layer->sll_halen = ETH_ADDR_LEN;
+
+	return sockfd;
+}
+
+/** Send a DHCP reply directly to a client's MAC address
+ *
+ * This lets replies be sent to clients which don't yet have an IP
+ * address, without adding an entry to the ARP table first, so each
+ * reply costs one system call.
+ *
+ * @param[in] sockfd		from fr_dhcp_raw_reply_socket().
+ * @param[in] link_layer	from fr_dhcp_raw_reply_socket().
+ * @param[in] src_ether_addr	MAC address of the interface.
+ * @param[in] dst_ether_addr	MAC address of the client.
+ * @param[in] packet		encoded reply to send.
+ * @return
+ *	- >= 0 on success.
+ *	- < 0 on failure.
+ */
+int fr_dhcp_send_raw_reply(int sockfd, struct sockaddr_ll const *link_layer, uint8_t const *src_ether_addr,
+			   uint8_t const *dst_ether_addr, RADIUS_PACKET *packet)
+{
+	uint8_t			frame[1518] = { 0 };
+	size_t			len;
+	struct sockaddr_ll	ll;
+	ssize_t			ret;
+
+	if (packet->data_len > (sizeof(frame) - (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE))) {
+		fr_strerror_printf("Packet is too large for a raw frame");
+		return -1;
+	}
+
+	len = dhcp_raw_frame_build(frame, dst_ether_addr, src_ether_addr, packet);
+
+	ll = *link_layer;
+	memcpy(ll.sll_addr, dst_ether_addr, ETH_ADDR_LEN);
+
+	ret = sendto(sockfd, frame, len, 0, (struct sockaddr *) &ll, sizeof(ll));
+	if (ret < 0) {
+		fr_strerror_printf("dhcp_send_raw_reply: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return ret;
 }
 
 /*
@@ -2239,11 +2407,28 @@ RADIUS_PACKET *fr_dhcp_recv_raw_packet(int sockfd, struct sockaddr_ll *link_laye
  */
 int dhcp_init(void)
 {
+	size_t i;
+
 	dhcp_option_82 = fr_dict_attr_by_num(NULL, DHCP_MAGIC_VENDOR, PW_DHCP_OPTION_82);
 	if (!dhcp_option_82) {
 		fr_strerror_printf("Missing dictionary attribute for DHCP-Option-82");
 		return -1;
 	}
 
+	dhcp_vendor_root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), PW_VENDOR_SPECIFIC);
+	if (dhcp_vendor_root) dhcp_vendor_root = fr_dict_attr_child_by_num(dhcp_vendor_root, DHCP_MAGIC_VENDOR);
+	if (!dhcp_vendor_root) {
+		fr_strerror_printf("Missing dictionary vendor for DHCP");
+		return -1;
+	}
+
+	for (i = 0; i < DHCP_NUM_HEADERS; i++) {
+		dhcp_header_attrs[i] = fr_dict_attr_by_name(NULL, dhcp_header_names[i]);
+		if (!dhcp_header_attrs[i]) {
+			fr_strerror_printf("Missing dictionary attribute for %s", dhcp_header_names[i]);
+			return -1;
+		}
+	}
+
 	return 0;
 }
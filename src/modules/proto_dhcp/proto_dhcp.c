@@ -66,9 +66,17 @@ typedef struct dhcp_socket_t {
 	 *	DHCP-specific additions.
 	 */
 	bool		suppress_responses;
+	bool		shard_by_subnet;	//!< Send packets from the same relay to the same thread.
 	RADCLIENT	dhcp_client;
 	char const	*src_interface;
 	fr_ipaddr_t	src_ipaddr;
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	bool		raw_replies;		//!< Send replies to unconfigured clients on a raw socket.
+	int		raw_fd;			//!< Raw socket for unicast replies, or -1.
+	struct sockaddr_ll raw_ll;		//!< Link layer address for the raw socket.
+	uint8_t		raw_ether_addr[6];	//!< MAC address of src_interface.
+#endif
 } dhcp_socket_t;
 
 static void dhcp_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received);
@@ -626,6 +634,14 @@ static rlm_rcode_t dhcp_process(REQUEST *request)
 	RDEBUG2("Reply will be unicast to &DHCP-Your-IP-Address");
 	request->reply->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+	/*
+	 *	The reply will be sent directly to the client's MAC
+	 *	address, so there's no need for an ARP entry.
+	 */
+	if (sock->raw_fd >= 0) return RLM_MODULE_OK;
+#endif
+
 	/*
 	 *	When sending a DHCP_OFFER, make sure our ARP table
 	 *	contains an entry for the client IP address.
@@ -705,6 +721,33 @@ static const char *dhcp_pcap_filter_build(rad_listen_t *this)
 }
 #endif
 
+/*
+ *	Pick the worker thread for a packet.
+ *
+ *	Relayed packets are sharded by the relay address, so all of
+ *	the requests for one subnet are handled by one thread.  That
+ *	keeps the per-thread state of the ippool modules (reserved
+ *	addresses, and allocations waiting to be written) for a pool
+ *	in one place.  Packets from directly connected clients are
+ *	sharded by client hardware address instead.
+ */
+static uint32_t dhcp_affinity(UNUSED rad_listen_t const *listener, RADIUS_PACKET const *packet)
+{
+	uint32_t hash;
+	uint32_t giaddr;
+
+	if (!packet->data || (packet->data_len < 44)) return 0;
+
+	memcpy(&giaddr, packet->data + 24, sizeof(giaddr));
+	if (giaddr != htonl(INADDR_ANY)) {
+		hash = fr_hash(&giaddr, sizeof(giaddr));
+	} else {
+		hash = fr_hash(packet->data + 28, 16);	/* chaddr */
+	}
+
+	return hash ? hash : 1;
+}
+
 static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 {
 	int rcode;
@@ -739,6 +782,24 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		if (rcode < 0) return -1;
 	}
 
+	sock->shard_by_subnet = false;
+	cp = cf_pair_find(cs, "shard_by_subnet");
+	if (cp) {
+		rcode = cf_pair_parse(cs, "shard_by_subnet", FR_ITEM_POINTER(PW_TYPE_BOOLEAN, &sock->shard_by_subnet), NULL, T_INVALID);
+		if (rcode < 0) return -1;
+	}
+	if (sock->shard_by_subnet) this->affinity = dhcp_affinity;
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	sock->raw_fd = -1;
+	sock->raw_replies = false;
+	cp = cf_pair_find(cs, "raw_replies");
+	if (cp) {
+		rcode = cf_pair_parse(cs, "raw_replies", FR_ITEM_POINTER(PW_TYPE_BOOLEAN, &sock->raw_replies), NULL, T_INVALID);
+		if (rcode < 0) return -1;
+	}
+#endif
+
 	cp = cf_pair_find(cs, "src_interface");
 	if (cp) {
 		rcode = cf_pair_parse(cs, "src_interface", FR_ITEM_POINTER(PW_TYPE_STRING, &sock->src_interface), NULL, T_INVALID);
@@ -813,6 +874,46 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	client->secret = client->shortname;
 	client->nas_type = talloc_typed_strdup(sock, "none");
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+	if (sock->raw_replies && !sock->src_interface) {
+		cf_log_err_cs(cs, "\"raw_replies\" requires \"interface\" or \"src_interface\" to be set");
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+static int _dhcp_socket_free(dhcp_socket_t *sock)
+{
+	if (sock->raw_fd >= 0) close(sock->raw_fd);
+
+	return 0;
+}
+#endif
+
+static int dhcp_socket_open(CONF_SECTION *cs, rad_listen_t *this)
+{
+	int		rcode;
+#ifdef HAVE_LINUX_IF_PACKET_H
+	dhcp_socket_t	*sock = this->data;
+#endif
+
+	rcode = common_socket_open(cs, this);
+	if (rcode != 0) return rcode;
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	if (sock->raw_replies) {
+		sock->raw_fd = fr_dhcp_raw_reply_socket(sock->src_interface, &sock->raw_ll, sock->raw_ether_addr);
+		if (sock->raw_fd < 0) {
+			cf_log_err_cs(cs, "Failed opening raw socket for replies: %s", fr_strerror());
+			return -1;
+		}
+		talloc_set_destructor(sock, _dhcp_socket_free);
+	}
+#endif
+
 	return 0;
 }
 
@@ -832,7 +933,7 @@ static int dhcp_socket_recv(rad_listen_t *listener)
 	if (!rad_cond_assert(client != NULL)) return 1;
 
 	FR_STATS_INC(auth, total_requests);
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(&client->auth, total_requests);
 
 #ifdef PCAP_RAW_SOCKETS
 	if (sock->lsock.pcap) {
@@ -898,6 +999,28 @@ static int dhcp_socket_send(rad_listen_t *listener, REQUEST *request)
 
 		return fr_dhcp_send_pcap(sock->lsock.pcap, dhmac, request->reply);
 	} else
+#endif
+#ifdef HAVE_LINUX_IF_PACKET_H
+	/*
+	 *	Replies to clients which don't have an address yet
+	 *	go straight to their MAC address.
+	 */
+	if ((sock->raw_fd >= 0) && !fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 272, TAG_ANY)) {
+		VALUE_PAIR *yiaddr, *hwvp;
+
+		yiaddr = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 264, TAG_ANY); /* DHCP-Your-IP-Address */
+		hwvp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 267, TAG_ANY); /* DHCP-Client-Hardware-Address */
+
+		if (yiaddr && hwvp && (hwvp->vp_length == sizeof(hwvp->vp_ether)) &&
+		    (request->reply->dst_ipaddr.ipaddr.ip4addr.s_addr == yiaddr->vp_ipaddr)) {
+			if (fr_dhcp_send_raw_reply(sock->raw_fd, &sock->raw_ll, sock->raw_ether_addr,
+						   hwvp->vp_ether, request->reply) < 0) {
+				REDEBUG("Failed sending raw reply: %s", fr_strerror());
+				return -1;
+			}
+			return 0;
+		}
+	}
 #endif
 	{
 		return fr_dhcp_send_socket(request->reply);
@@ -1068,7 +1191,7 @@ rad_protocol_t proto_dhcp = {
 	.load		= dhcp_load,
 	.compile	= dhcp_listen_compile,
 	.parse		= dhcp_socket_parse,
-	.open		= common_socket_open,
+	.open		= dhcp_socket_open,
 	.recv		= dhcp_socket_recv,
 	.send		= dhcp_socket_send,
 	.print		= common_socket_print,
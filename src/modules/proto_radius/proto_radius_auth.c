@@ -35,6 +35,32 @@
 #define USEC (1000000)
 #endif
 
+/*
+ *	Replies are mostly the same attributes, so each thread
+ *	remembers how to encode them.
+ */
+fr_thread_local_setup(fr_radius_encode_plan_t *, auth_encode_plan)	/* macro */
+
+static void _auth_encode_plan_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+static fr_radius_encode_plan_t *auth_encode_plan_get(void)
+{
+	fr_radius_encode_plan_t *plan;
+
+	plan = auth_encode_plan;
+	if (!plan) {
+		plan = fr_radius_encode_plan_alloc(NULL);
+		if (!plan) return NULL;
+
+		fr_thread_local_set_destructor(auth_encode_plan, _auth_encode_plan_free, plan);
+	}
+
+	return plan;
+}
+
 /*
  *	Make sure user/pass are clean and then create an attribute
  *	which contains the log message.
@@ -125,7 +151,7 @@ static void auth_dup_extract(REQUEST *request)
 
 	if (!request->in_request_hash) return;
 
-	if (!rbtree_deletebydata(sock->dup_tree, &request->packet)) {
+	if (!request_dup_hash_remove(sock->dup_hash, request)) {
 		rad_assert(0 == 1);
 	}
 	request->in_request_hash = false;
@@ -766,7 +792,8 @@ static void auth_running(REQUEST *request, fr_state_action_t action)
 		}
 #endif
 
-		if (fr_radius_encode(request->reply, request->packet, request->client->secret) < 0) {
+		if (fr_radius_encode_plan(request->reply, request->packet, request->client->secret,
+					  auth_encode_plan_get()) < 0) {
 			RDEBUG("Failed encoding RADIUS reply: %s", fr_strerror());
 			goto stop_processing;
 		}
@@ -952,7 +979,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	if (request_dup_received(listener, sock->dup_tree, client, packet)) {
+	if (request_dup_received(listener, sock->dup_hash, client, packet)) {
 		talloc_free(ctx);
 		return 0;
 	}
@@ -968,7 +995,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	if (!rbtree_insert(sock->dup_tree, &request->packet)) {
+	if (!request_dup_hash_insert(sock->dup_hash, request)) {
 		RERROR("Failed to insert request in the list of live requests: discarding it");
 		request_free(request);
 		return 1;
@@ -1128,14 +1155,6 @@ static int auth_listen_bootstrap(CONF_SECTION *server_cs, UNUSED CONF_SECTION *l
 	return 0;
 }
 
-static int packet_entry_cmp(void const *one, void const *two)
-{
-	RADIUS_PACKET const * const *a = one;
-	RADIUS_PACKET const * const *b = two;
-
-	return fr_packet_cmp(*a, *b);
-}
-
 static int auth_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 {
 	listen_socket_t *sock = this->data;
@@ -1144,7 +1163,7 @@ static int auth_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	if (!sock->my_port) sock->my_port = PW_AUTH_UDP_PORT;
 
-	sock->dup_tree = rbtree_create(NULL, packet_entry_cmp, NULL, 0);
+	sock->dup_hash = request_dup_hash_alloc(NULL, false);
 
 	return 0;
 }
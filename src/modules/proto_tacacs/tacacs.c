@@ -31,8 +31,27 @@
 
 #include "tacacs.h"
 
+#include <poll.h>
+
 fr_dict_attr_t const *dict_tacacs_root = NULL;
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Replies for different sessions on a single-connect socket
+ *	may be sent by different workers.  Lock the socket while
+ *	writing, so that the packets aren't interleaved.
+ */
+#define TACACS_WRITE_LOCKS	(16)
+static pthread_mutex_t tacacs_write_mutex[TACACS_WRITE_LOCKS] = {
+	[0 ... TACACS_WRITE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+#  define WRITE_LOCK(_fd)	pthread_mutex_lock(&tacacs_write_mutex[(_fd) % TACACS_WRITE_LOCKS])
+#  define WRITE_UNLOCK(_fd)	pthread_mutex_unlock(&tacacs_write_mutex[(_fd) % TACACS_WRITE_LOCKS])
+#else
+#  define WRITE_LOCK(_fd)
+#  define WRITE_UNLOCK(_fd)
+#endif
+
 tacacs_type_t tacacs_type(RADIUS_PACKET const * const packet)
 {
 	VALUE_PAIR const *vp;
@@ -185,9 +204,8 @@ static int tacacs_xor(RADIUS_PACKET * const packet, char const *secret)
 {
 	tacacs_packet_t *pkt = (tacacs_packet_t *)packet->data;
 	uint8_t pad[MD5_DIGEST_LENGTH];
-	uint8_t *buf;
-	int secret_len;
-	int pad_offset;
+	FR_MD5_CTX prefix, ctx;
+	size_t pos, i;
 
 	if (!secret) {
 		if (pkt->hdr.flags & TAC_PLUS_UNENCRYPTED_FLAG)
@@ -203,33 +221,35 @@ static int tacacs_xor(RADIUS_PACKET * const packet, char const *secret)
 		return -1;
 	}
 
-	secret_len = strlen(secret);
-	pad_offset = sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version) + sizeof(pkt->hdr.seq_no);
-
 	/* MD5_1 = MD5{session_id, key, version, seq_no} */
 	/* MD5_n = MD5{session_id, key, version, seq_no, MD5_n-1} */
-	buf = talloc_array(NULL, uint8_t, pad_offset + MD5_DIGEST_LENGTH);
 
-	memcpy(&buf[0], &pkt->hdr.session_id, sizeof(pkt->hdr.session_id));
-	memcpy(&buf[sizeof(pkt->hdr.session_id)], secret, secret_len);
-	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len], &pkt->hdr.version, sizeof(pkt->hdr.version));
-	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version)], &pkt->hdr.seq_no, sizeof(pkt->hdr.seq_no));
-	fr_md5_calc(pad, buf, pad_offset);
+	/*
+	 *	Every pad starts with the same data, so hash it once,
+	 *	and copy the state for each block of the body.
+	 */
+	fr_md5_init(&prefix);
+	fr_md5_update(&prefix, (uint8_t const *)&pkt->hdr.session_id, sizeof(pkt->hdr.session_id));
+	fr_md5_update(&prefix, (uint8_t const *)secret, strlen(secret));
+	fr_md5_update(&prefix, &pkt->hdr.version, sizeof(pkt->hdr.version));
+	fr_md5_update(&prefix, &pkt->hdr.seq_no, sizeof(pkt->hdr.seq_no));
+
+	fr_md5_copy(&ctx, &prefix);
+	fr_md5_final(pad, &ctx);
 
-	size_t pos = sizeof(tacacs_packet_hdr_t);
+	pos = sizeof(tacacs_packet_hdr_t);
 	do {
-		for (size_t i = 0; i < MD5_DIGEST_LENGTH && pos < packet->data_len; i++, pos++)
+		for (i = 0; i < MD5_DIGEST_LENGTH && pos < packet->data_len; i++, pos++)
 			packet->data[pos] ^= pad[i];
 
 		if (pos == packet->data_len)
 			break;
 
-		memcpy(&buf[pad_offset], pad, MD5_DIGEST_LENGTH);
-		fr_md5_calc(pad, buf, pad_offset + MD5_DIGEST_LENGTH);
+		fr_md5_copy(&ctx, &prefix);
+		fr_md5_update(&ctx, pad, MD5_DIGEST_LENGTH);
+		fr_md5_final(pad, &ctx);
 	} while (1);
 
-	talloc_free(buf);
-
 	return 0;
 }
 
@@ -791,6 +811,57 @@ int tacacs_read_packet(RADIUS_PACKET * const packet, char const * const secret)
 	return 1;	/* done reading the packet */
 }
 
+/** Write a whole packet to a (non-blocking) socket
+ *
+ * @param[in] sockfd	to write to.
+ * @param[in] data	to write.
+ * @param[in] data_len	of the data.
+ * @return
+ *	- The number of bytes written.
+ *	- -1 on error.
+ */
+static ssize_t tacacs_write(int sockfd, uint8_t const *data, size_t data_len)
+{
+	size_t	done = 0;
+	ssize_t	len;
+
+	WRITE_LOCK(sockfd);
+	while (done < data_len) {
+		len = write(sockfd, data + done, data_len - done);
+		if (len < 0) {
+			struct pollfd pfd;
+
+			if (errno == EINTR) continue;
+
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			error:
+				fr_strerror_printf("Failed writing TACACS reply: %s", fr_syserror(errno));
+				WRITE_UNLOCK(sockfd);
+				return -1;
+			}
+
+			/*
+			 *	The socket is full.  Wait a little for
+			 *	the client to read, rather than sending
+			 *	half a packet.
+			 */
+			pfd.fd = sockfd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+
+			len = poll(&pfd, 1, 1000);
+			if (len == 0) errno = ETIMEDOUT;
+			if ((len <= 0) && (errno != EINTR)) goto error;
+			continue;
+		}
+
+		done += len;
+	}
+	WRITE_UNLOCK(sockfd);
+
+	return done;
+}
+
 int tacacs_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * const original, char const * const secret)
 {
 	uint8_t			vminor;
@@ -838,13 +909,20 @@ int tacacs_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * const origin
 
 	rad_assert(tacacs_ok(packet, false) == true);
 
+	/*
+	 *	If the client asked for single-connect mode, say that
+	 *	we'll do it, too.  The client can then send many
+	 *	sessions over this connection, which are processed
+	 *	by the workers at the same time.
+	 */
+	if (((tacacs_packet_t const *)original->data)->hdr.flags & TAC_PLUS_SINGLE_CONNECT_FLAG) {
+		((tacacs_packet_t *)packet->data)->hdr.flags |= TAC_PLUS_SINGLE_CONNECT_FLAG;
+	}
+
 	if (tacacs_xor(packet, secret) < 0) {
 		fr_strerror_printf("Failed encryption of TACACS reply: %s", fr_syserror(errno));
 		return -1;
 	}
 
-	/*
-	 *	@fixme: EINTR and retry
-	 */
-	return write(packet->sockfd, packet->data, packet->data_len);
+	return tacacs_write(packet->sockfd, packet->data, packet->data_len);
 }
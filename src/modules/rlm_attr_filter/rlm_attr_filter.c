@@ -41,13 +41,54 @@ typedef struct rlm_attr_filter {
 	char const	*filename;
 	vp_tmpl_t	*key;
 	bool		relaxed;
-	PAIR_LIST	*attrs;
+	uint32_t	reload_interval;
+	module_reload_t	*reload;	//!< Manages the parsed "attrs" file.
 } rlm_attr_filter_t;
 
+/** The rules in one entry for one attribute
+ *
+ */
+typedef struct attr_filter_attr {
+	fr_dict_attr_t const	*da;		//!< The attribute the rules are for.
+	VALUE_PAIR		**rules;	//!< Check items for this attribute, in file order.
+	int			num_rules;
+} attr_filter_attr_t;
+
+/** One entry of the "attrs" file, compiled
+ *
+ */
+typedef struct attr_filter_entry {
+	PAIR_LIST		*pl;		//!< The entry as read from the file.
+	bool			fall_through;	//!< Continue to the next matching entry.
+	int			relax_filter;	//!< Value of Relax-Filter, or -1 if not set.
+	int			vsa_any;	//!< Number of "Vendor-Specific =* ANY" rules.
+	VALUE_PAIR		**set;		//!< Items to add to the output, in file order.
+	int			num_set;
+	fr_hash_table_t		*attrs;		//!< attr_filter_attr_t, indexed by attribute.
+} attr_filter_entry_t;
+
+/** The entries which are used for one key
+ *
+ */
+typedef struct attr_filter_name {
+	char const		*name;		//!< Key to match.
+	attr_filter_entry_t	**entries;	//!< Entries with this name, and DEFAULT entries, in file order.
+	int			num_entries;
+} attr_filter_name_t;
+
+/** The compiled "attrs" file
+ *
+ */
+typedef struct attr_filter_table {
+	fr_hash_table_t		*names;		//!< attr_filter_name_t, indexed by name.
+	attr_filter_name_t	defaults;	//!< Entries used when no name matches.
+} attr_filter_table_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_INPUT | PW_TYPE_REQUIRED, rlm_attr_filter_t, filename) },
 	{ FR_CONF_OFFSET("key", PW_TYPE_TMPL, rlm_attr_filter_t, key), .dflt = "&Realm", .quote = T_BARE_WORD },
 	{ FR_CONF_OFFSET("relaxed", PW_TYPE_BOOLEAN, rlm_attr_filter_t, relaxed), .dflt = "no" },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_attr_filter_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -125,24 +166,199 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, char const *filename, PAIR_LIST
 }
 
 
+static uint32_t attr_filter_attr_hash(void const *data)
+{
+	attr_filter_attr_t const *a = data;
+
+	return fr_hash(&a->da, sizeof(a->da));
+}
+
+static int attr_filter_attr_cmp(void const *one, void const *two)
+{
+	attr_filter_attr_t const *a = one;
+	attr_filter_attr_t const *b = two;
+
+	return (a->da > b->da) - (a->da < b->da);
+}
+
+static uint32_t attr_filter_name_hash(void const *data)
+{
+	attr_filter_name_t const *a = data;
+
+	return fr_hash_string(a->name);
+}
+
+static int attr_filter_name_cmp(void const *one, void const *two)
+{
+	attr_filter_name_t const *a = one;
+	attr_filter_name_t const *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Compile one entry, so that the rules for an attribute can be found by looking up the attribute
+ *
+ */
+static attr_filter_entry_t *attr_filter_entry_compile(TALLOC_CTX *ctx, PAIR_LIST *pl)
+{
+	attr_filter_entry_t	*entry;
+	attr_filter_attr_t	my_attr, *attr;
+	vp_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+
+	entry = talloc_zero(ctx, attr_filter_entry_t);
+	if (!entry) return NULL;
+
+	entry->pl = pl;
+	entry->relax_filter = -1;
+
+	entry->attrs = fr_hash_table_create(entry, attr_filter_attr_hash, attr_filter_attr_cmp, NULL);
+	if (!entry->attrs) {
+	error:
+		talloc_free(entry);
+		return NULL;
+	}
+
+	for (vp = fr_pair_cursor_init(&cursor, &pl->check);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (!vp->da->vendor && (vp->da->attr == PW_FALL_THROUGH) && (vp->vp_integer == 1)) {
+			entry->fall_through = true;
+
+		} else if (!vp->da->vendor && (vp->da->attr == PW_RELAX_FILTER)) {
+			entry->relax_filter = vp->vp_integer;
+
+		} else if (vp->op == T_OP_SET) {
+			entry->set = talloc_realloc(entry, entry->set, VALUE_PAIR *, entry->num_set + 1);
+			if (!entry->set) goto error;
+			entry->set[entry->num_set++] = vp;
+			continue;
+		}
+
+		/*
+		 *	Vendor-Specific is special, and matches any VSA if the
+		 *	comparison is always true.
+		 */
+		if ((vp->da->attr == PW_VENDOR_SPECIFIC) && (vp->op == T_OP_CMP_TRUE)) entry->vsa_any++;
+
+		my_attr.da = vp->da;
+		attr = fr_hash_table_finddata(entry->attrs, &my_attr);
+		if (!attr) {
+			attr = talloc_zero(entry, attr_filter_attr_t);
+			if (!attr) goto error;
+
+			attr->da = vp->da;
+			if (!fr_hash_table_insert(entry->attrs, attr)) goto error;
+		}
+
+		attr->rules = talloc_realloc(attr, attr->rules, VALUE_PAIR *, attr->num_rules + 1);
+		if (!attr->rules) goto error;
+		attr->rules[attr->num_rules++] = vp;
+	}
+
+	return entry;
+}
+
+/** Add an entry to the list of entries used for a name
+ *
+ */
+static int attr_filter_name_add(TALLOC_CTX *ctx, attr_filter_name_t *name, attr_filter_entry_t *entry)
+{
+	name->entries = talloc_realloc(ctx, name->entries, attr_filter_entry_t *, name->num_entries + 1);
+	if (!name->entries) return -1;
+
+	name->entries[name->num_entries++] = entry;
+
+	return 0;
+}
+
 /*
- *	(Re-)read the "attrs" file into memory.
+ *	(Re-)read the "attrs" file into memory, and compile it.
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+static int attr_filter_load(TALLOC_CTX *ctx, void **out, void const *instance)
 {
-	rlm_attr_filter_t *inst = instance;
-	int rcode;
+	rlm_attr_filter_t const *inst = instance;
+	attr_filter_table_t	*table;
+	attr_filter_entry_t	**entries;
+	attr_filter_name_t	my_name, *name;
+	PAIR_LIST		*attrs, *pl;
+	int			i, j, num = 0;
 
-	rcode = attr_filter_getfile(inst, inst->filename, &inst->attrs);
-	if (rcode != 0) {
+	if (attr_filter_getfile(ctx, inst->filename, &attrs) != 0) {
 		ERROR("Errors reading %s", inst->filename);
 
 		return -1;
 	}
 
+	table = talloc_zero(ctx, attr_filter_table_t);
+	if (!table) {
+	oom:
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	table->names = fr_hash_table_create(table, attr_filter_name_hash, attr_filter_name_cmp, NULL);
+	if (!table->names) goto oom;
+
+	for (pl = attrs; pl; pl = pl->next) num++;
+
+	entries = talloc_array(table, attr_filter_entry_t *, num);
+	if (!entries) goto oom;
+
+	for (pl = attrs, i = 0; pl; pl = pl->next, i++) {
+		entries[i] = attr_filter_entry_compile(table, pl);
+		if (!entries[i]) goto oom;
+	}
+
+	/*
+	 *	Each name gets the list of entries which would be
+	 *	matched by walking the file in order, i.e. the entries
+	 *	with that name, and all of the DEFAULT entries.
+	 */
+	for (i = 0; i < num; i++) {
+		if (strcmp(entries[i]->pl->name, "DEFAULT") == 0) {
+			if (attr_filter_name_add(table, &table->defaults, entries[i]) < 0) goto oom;
+			continue;
+		}
+
+		my_name.name = entries[i]->pl->name;
+		if (fr_hash_table_finddata(table->names, &my_name)) continue;
+
+		name = talloc_zero(table, attr_filter_name_t);
+		if (!name) goto oom;
+		name->name = entries[i]->pl->name;
+
+		for (j = 0; j < num; j++) {
+			if ((strcmp(entries[j]->pl->name, "DEFAULT") != 0) &&
+			    (strcmp(entries[j]->pl->name, name->name) != 0)) continue;
+
+			if (attr_filter_name_add(name, name, entries[j]) < 0) goto oom;
+		}
+
+		if (!fr_hash_table_insert(table->names, name)) goto oom;
+	}
+
+	*out = table;
+
 	return 0;
 }
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_attr_filter_t *inst = instance;
+	char const *name;
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
+
+	inst->reload = module_reload_alloc(inst, name, inst, attr_filter_load, inst->reload_interval);
+	if (!inst->reload) return -1;
+
+	if (module_reload_watch(inst->reload, inst->filename) < 0) return -1;
+
+	return module_reload_start(inst->reload);
+}
+
 
 /*
  *	Common attr_filter checks
@@ -152,9 +368,11 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 {
 	rlm_attr_filter_t const *inst = instance;
 	VALUE_PAIR	*vp;
-	vp_cursor_t	input, check, out;
-	VALUE_PAIR	*input_item, *check_item, *output;
-	PAIR_LIST	*pl;
+	vp_cursor_t	input, out;
+	VALUE_PAIR	*input_item, *output;
+	attr_filter_table_t *table;
+	attr_filter_name_t my_name, *name;
+	int		i, j;
 	int		found = 0;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
@@ -177,85 +395,59 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 	fr_pair_cursor_init(&out, &output);
 
 	/*
-	 *      Find the attr_filter profile entry for the entry.
+	 *      Find the attr_filter profile entries for the key.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
+	table = module_reload_current(inst->reload);
+	my_name.name = keyname;
+	name = fr_hash_table_finddata(table->names, &my_name);
+	if (!name) name = &table->defaults;
 
-		/*
-		 *  If the current entry is NOT a default,
-		 *  AND the realm does NOT match the current entry,
-		 *  then skip to the next entry.
-		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
-		    continue;
-		}
+	for (i = 0; i < name->num_entries; i++) {
+		attr_filter_entry_t	*entry = name->entries[i];
+		int			relax_filter;
 
-		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
-		found = 1;
+		relax_filter = (entry->relax_filter >= 0) ? entry->relax_filter : inst->relaxed;
 
-		for (check_item = fr_pair_cursor_init(&check, &pl->check);
-		     check_item;
-		     check_item = fr_pair_cursor_next(&check)) {
-			if (!check_item->da->vendor &&
-			    (check_item->da->attr == PW_FALL_THROUGH) &&
-				(check_item->vp_integer == 1)) {
-				fall_through = 1;
-				continue;
-			}
-			else if (!check_item->da->vendor && check_item->da->attr == PW_RELAX_FILTER) {
-				relax_filter = check_item->vp_integer;
-				continue;
-			}
+		RDEBUG2("Matched entry %s at line %d", entry->pl->name, entry->pl->lineno);
+		found = 1;
 
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
-				vp = fr_pair_copy(packet, check_item);
-				if (!vp) {
-					goto error;
-				}
-				xlat_eval_do(request, vp);
-				fr_pair_cursor_append(&out, vp);
+		/*
+		 *    If it is a SET operator, add the attribute to
+		 *    the output list without checking it.
+		 */
+		for (j = 0; j < entry->num_set; j++) {
+			vp = fr_pair_copy(packet, entry->set[j]);
+			if (!vp) {
+				goto error;
 			}
+			xlat_eval_do(request, vp);
+			fr_pair_cursor_append(&out, vp);
 		}
 
 		/*
 		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
-		 *	only if it matches all rules that describe an
+		 *	each item to the rules for that attribute, then
+		 *	moving it to the output list only if it matches
+		 *	all of them.  IE, Idle-Timeout is moved only if
+		 *	it matches all rules that describe an
 		 *	Idle-Timeout.
 		 */
 		for (input_item = fr_pair_cursor_init(&input, &packet->vps);
 		     input_item;
 		     input_item = fr_pair_cursor_next(&input)) {
-			pass = fail = 0; /* reset the pass,fail vars for each reply item */
+			attr_filter_attr_t my_attr, *attr;
 
 			/*
-			 *  Reset the check_item pointer to beginning of the list
+			 *  Vendor-Specific is special, and matches any VSA if the
+			 *  comparison is always true.
 			 */
-			for (check_item = fr_pair_cursor_first(&check);
-			     check_item;
-			     check_item = fr_pair_cursor_next(&check)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da->attr == PW_VENDOR_SPECIFIC) && (input_item->da->vendor != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			pass = (input_item->da->vendor != 0) ? entry->vsa_any : 0;
+			fail = 0;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
-				}
+			my_attr.da = input_item->da;
+			attr = fr_hash_table_finddata(entry->attrs, &my_attr);
+			if (attr) for (j = 0; j < attr->num_rules; j++) {
+				check_pair(request, attr->rules[j], input_item, &pass, &fail);
 			}
 
 			RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules",
@@ -277,7 +469,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
+		if (!entry->fall_through) {
 			break;
 		}
 	}
@@ -337,6 +529,7 @@ extern rad_module_t rlm_attr_filter;
 rad_module_t rlm_attr_filter = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "attr_filter",
+	.type		= RLM_TYPE_PARALLEL_INSTANTIATE,
 	.inst_size	= sizeof(rlm_attr_filter_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
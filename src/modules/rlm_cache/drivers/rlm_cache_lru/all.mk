@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_lru.a
+SOURCES		:= rlm_cache_lru.c ../../serialize.c
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,675 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_lru.c
+ * @brief Sharded in memory cache with CLOCK eviction.
+ *
+ * Entries are spread over a fixed number of shards by key hash.  Each shard
+ * has its own hash table, CLOCK ring and mutex, so requests looking up
+ * different keys rarely contend with each other.
+ *
+ * A cache hit only sets the entry's reference bit, so lookups never relink
+ * lists.  When a shard is over its entry or memory limit, the CLOCK hand
+ * sweeps the ring, clearing reference bits and evicting the first entry which
+ * was not referenced (or which has expired).
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/mem_account.h>
+#include "../../rlm_cache.h"
+#include "../../serialize.h"
+
+typedef struct rlm_cache_lru_entry rlm_cache_lru_entry_t;
+
+struct rlm_cache_lru_entry {
+	rlm_cache_entry_t	fields;		//!< Entry data.  Must come first.
+
+	uint32_t		hash;		//!< Hash of the entry's key.
+	size_t			size;		//!< Serialized size of the entry, used for memory limits.
+	size_t			mem_size;	//!< Memory used by the entry, used for max_memory.
+	bool			referenced;	//!< Set on every hit, cleared by the CLOCK hand.
+
+	rlm_cache_lru_entry_t	*next;		//!< Next entry in the same hash bucket.
+
+	rlm_cache_lru_entry_t	*clock_prev;	//!< Previous entry in the CLOCK ring.
+	rlm_cache_lru_entry_t	*clock_next;	//!< Next entry in the CLOCK ring.
+};
+
+typedef struct rlm_cache_lru_shard {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+
+	rlm_cache_lru_entry_t	**buckets;	//!< Hash table of entries.
+	uint32_t		num_buckets;	//!< Always a power of 2.
+
+	rlm_cache_lru_entry_t	*hand;		//!< CLOCK hand, the next eviction candidate.
+
+	uint32_t		num_entries;	//!< Entries currently in the shard.
+	size_t			size;		//!< Sum of the serialized sizes of entries in the shard.
+	size_t			mem_size;	//!< Sum of the memory used by entries in the shard.
+
+	TALLOC_CTX		*buckets_ctx;	//!< Driver's ctx for bucket arrays.
+	mem_account_t		*mem;		//!< Driver's memory account.
+} rlm_cache_lru_shard_t;
+
+typedef struct rlm_cache_lru {
+	uint32_t		num_shards;	//!< How many shards to split the cache into.
+	size_t			max_size;	//!< Maximum serialized size of all entries.
+
+	uint32_t		shard_max_entries;	//!< Per-shard entry limit, derived from max_entries.
+	size_t			shard_max_size;		//!< Per-shard size limit, derived from max_size.
+	size_t			shard_max_memory;	//!< Per-shard memory limit, derived from max_memory.
+
+	mem_account_t		*mem;		//!< Memory used by all entries.
+
+	char const		*snapshot;	//!< File to save entries to on detach, and load them from
+						//!< on instantiation.
+	bool			snapshot_loaded;	//!< So a failed instantiation doesn't overwrite
+							//!< the snapshot with an empty cache.
+
+	TALLOC_CTX		*buckets_ctx;	//!< Owns the shards' bucket arrays.  Not a child of
+						//!< the instance, which has a memory limit once it's
+						//!< been instantiated.
+	rlm_cache_lru_shard_t	*shards;	//!< Array of shards.
+} rlm_cache_lru_t;
+
+/** Records which shard (if any) a request currently has locked
+ *
+ * Entries returned by #cache_entry_find are used in place by rlm_cache, so the
+ * shard they live in must stay locked until the handle is released.
+ */
+typedef struct rlm_cache_lru_handle {
+	REQUEST			*request;	//!< Request the handle was acquired for.
+	rlm_cache_lru_shard_t	*shard;		//!< Shard we hold the mutex for.
+} rlm_cache_lru_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_cache_lru_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("max_size", PW_TYPE_SIZE, rlm_cache_lru_t, max_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("snapshot", PW_TYPE_FILE_OUTPUT, rlm_cache_lru_t, snapshot) },
+	CONF_PARSER_TERMINATOR
+};
+
+#define LRU_MIN_BUCKETS	64
+
+/** Lock the shard responsible for a key hash
+ *
+ * If the handle already holds a different shard, that shard is released first.
+ * rlm_cache only ever operates on one key per handle, so in practice this
+ * only takes a lock once.
+ */
+static rlm_cache_lru_shard_t *shard_lock(rlm_cache_lru_t *driver, rlm_cache_lru_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_lru_shard_t *shard;
+
+	/*
+	 *	Buckets are selected with the low bits of the
+	 *	hash, so use the high bits to pick the shard.
+	 */
+	shard = &driver->shards[(hash >> 16) % driver->num_shards];
+
+	if (handle->shard == shard) return shard;
+	if (handle->shard) pthread_mutex_unlock(&handle->shard->mutex);
+
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	return shard;
+}
+
+/** Find an entry in a shard's hash table
+ *
+ */
+static rlm_cache_lru_entry_t *shard_find(rlm_cache_lru_shard_t *shard, uint32_t hash,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lru_entry_t *c;
+
+	for (c = shard->buckets[hash & (shard->num_buckets - 1)]; c; c = c->next) {
+		if ((c->hash == hash) && (c->fields.key_len == key_len) &&
+		    (memcmp(c->fields.key, key, key_len) == 0)) return c;
+	}
+
+	return NULL;
+}
+
+/** Double the size of a shard's hash table
+ *
+ * Failure isn't fatal, we just end up with longer chains.
+ */
+static void shard_grow(rlm_cache_lru_shard_t *shard)
+{
+	rlm_cache_lru_entry_t	**buckets, *c, *next;
+	uint32_t		num_buckets = shard->num_buckets * 2;
+	uint32_t		i;
+
+	buckets = talloc_zero_array(shard->buckets_ctx, rlm_cache_lru_entry_t *, num_buckets);
+	if (!buckets) return;
+
+	for (i = 0; i < shard->num_buckets; i++) {
+		for (c = shard->buckets[i]; c; c = next) {
+			rlm_cache_lru_entry_t **bucket = &buckets[c->hash & (num_buckets - 1)];
+
+			next = c->next;
+			c->next = *bucket;
+			*bucket = c;
+		}
+	}
+
+	talloc_free(shard->buckets);
+	shard->buckets = buckets;
+	shard->num_buckets = num_buckets;
+}
+
+/** Add an entry to a shard's hash table and CLOCK ring
+ *
+ * New entries are inserted just behind the hand, so they get a full sweep
+ * before they're considered for eviction.
+ */
+static void shard_link(rlm_cache_lru_shard_t *shard, rlm_cache_lru_entry_t *c)
+{
+	rlm_cache_lru_entry_t **bucket;
+
+	if (shard->num_entries >= (shard->num_buckets * 2)) shard_grow(shard);
+
+	bucket = &shard->buckets[c->hash & (shard->num_buckets - 1)];
+	c->next = *bucket;
+	*bucket = c;
+
+	if (!shard->hand) {
+		c->clock_prev = c->clock_next = c;
+		shard->hand = c;
+	} else {
+		c->clock_next = shard->hand;
+		c->clock_prev = shard->hand->clock_prev;
+		c->clock_prev->clock_next = c;
+		shard->hand->clock_prev = c;
+	}
+	c->referenced = false;
+
+	shard->num_entries++;
+	shard->size += c->size;
+	shard->mem_size += c->mem_size;
+	mem_account_add(shard->mem, c->mem_size, 1);
+}
+
+/** Remove an entry from a shard's hash table and CLOCK ring
+ *
+ * The entry is not freed.
+ */
+static void shard_unlink(rlm_cache_lru_shard_t *shard, rlm_cache_lru_entry_t *c)
+{
+	rlm_cache_lru_entry_t **p;
+
+	for (p = &shard->buckets[c->hash & (shard->num_buckets - 1)]; *p; p = &(*p)->next) {
+		if (*p != c) continue;
+		*p = c->next;
+		break;
+	}
+
+	if (c->clock_next == c) {
+		shard->hand = NULL;
+	} else {
+		c->clock_prev->clock_next = c->clock_next;
+		c->clock_next->clock_prev = c->clock_prev;
+		if (shard->hand == c) shard->hand = c->clock_next;
+	}
+	c->next = c->clock_next = c->clock_prev = NULL;
+
+	shard->num_entries--;
+	shard->size -= c->size;
+	shard->mem_size -= c->mem_size;
+	mem_account_add(shard->mem, -(int64_t)c->mem_size, -1);
+}
+
+/** Evict entries from a shard until there's room for an entry of the given size and memory use
+ *
+ * The hand gives every referenced entry a second chance, so the sweep visits
+ * each entry at most twice per eviction.
+ */
+static void shard_evict(rlm_cache_lru_t *driver, rlm_cache_lru_shard_t *shard, size_t size, size_t mem_size,
+			time_t now)
+{
+	for (;;) {
+		rlm_cache_lru_entry_t *c;
+
+		if (!shard->hand) return;
+
+		if ((!driver->shard_max_entries || (shard->num_entries < driver->shard_max_entries)) &&
+		    (!driver->shard_max_size || ((shard->size + size) <= driver->shard_max_size)) &&
+		    (!driver->shard_max_memory || ((shard->mem_size + mem_size) <= driver->shard_max_memory))) return;
+
+		c = shard->hand;
+		if (c->referenced && (c->fields.expires >= now)) {
+			c->referenced = false;
+			shard->hand = c->clock_next;
+			continue;
+		}
+
+		shard_unlink(shard, c);
+		talloc_free(c);
+	}
+}
+
+/** Save the contents of the cache
+ *
+ * Entries are saved in CLOCK order, starting from the hand, so they're
+ * loaded back in roughly the same order.
+ */
+static void cache_snapshot_save(rlm_cache_lru_t *driver)
+{
+	cache_snapshot_t	*snap;
+	time_t			now = time(NULL);
+	uint32_t		i;
+	int			ret;
+
+	snap = cache_snapshot_alloc(NULL, driver->snapshot);
+	if (!snap) {
+	error:
+		ERROR("Failed saving cache snapshot: %s", fr_strerror());
+		return;
+	}
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_lru_shard_t	*shard = &driver->shards[i];
+		rlm_cache_lru_entry_t	*c;
+
+		if (!shard->hand) continue;
+
+		c = shard->hand;
+		do {
+			if ((c->fields.expires >= now) && (cache_snapshot_add(snap, &c->fields) < 0)) {
+				talloc_free(snap);
+				goto error;
+			}
+			c = c->clock_next;
+		} while (c != shard->hand);
+	}
+
+	ret = cache_snapshot_commit(snap);
+	if (ret < 0) goto error;
+
+	INFO("Saved %i cache entries to \"%s\"", ret, driver->snapshot);
+}
+
+/** Allocate an entry loaded from a snapshot
+ *
+ */
+static rlm_cache_entry_t *_cache_snapshot_alloc(UNUSED void *uctx)
+{
+	return (rlm_cache_entry_t *)talloc_zero(NULL, rlm_cache_lru_entry_t);
+}
+
+/** Insert an entry loaded from a snapshot
+ *
+ * The shards aren't shared yet, so they don't need to be locked.  Limits
+ * are enforced in the same way as they are for new entries.
+ */
+static int _cache_snapshot_insert(void *uctx, rlm_cache_entry_t *c)
+{
+	rlm_cache_lru_t		*driver = uctx;
+	rlm_cache_lru_entry_t	*my_c = (rlm_cache_lru_entry_t *)c;
+	rlm_cache_lru_shard_t	*shard;
+
+	my_c->hash = fr_hash(c->key, c->key_len);
+
+	if (driver->shard_max_size) {
+		uint8_t *serialized;
+
+		if (cache_serialize_binary(NULL, &serialized, c) < 0) return -1;
+		my_c->size = c->key_len + talloc_array_length(serialized);
+		talloc_free(serialized);
+
+		if (my_c->size > driver->shard_max_size) return -1;
+	}
+	my_c->mem_size = talloc_total_size(my_c);
+
+	shard = &driver->shards[(my_c->hash >> 16) % driver->num_shards];
+	if (shard_find(shard, my_c->hash, c->key, c->key_len)) return -1;
+
+	shard_evict(driver, shard, my_c->size, my_c->mem_size, time(NULL));
+	shard_link(shard, my_c);
+
+	return 0;
+}
+
+/** Cleanup a cache_lru instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_lru_t	*driver = instance;
+	uint32_t	i;
+
+	if (!driver->shards) goto finish;
+
+	if (driver->snapshot_loaded) cache_snapshot_save(driver);
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_lru_shard_t *shard = &driver->shards[i];
+
+		while (shard->hand) {
+			rlm_cache_lru_entry_t *c = shard->hand;
+
+			shard_unlink(shard, c);
+			talloc_free(c);
+		}
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+finish:
+	TALLOC_FREE(driver->buckets_ctx);
+
+	return 0;
+}
+
+/** Create a new cache_lru instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_lru_t	*driver = instance;
+	uint32_t	i;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	if (driver->max_size && (driver->max_size < driver->num_shards)) {
+		cf_log_err_cs(conf, "'max_size' must be at least the number of shards (%u)", driver->num_shards);
+		return -1;
+	}
+
+	driver->shard_max_size = driver->max_size / driver->num_shards;
+	driver->shard_max_memory = config->max_memory / driver->num_shards;
+
+	driver->mem = mem_account_alloc(driver, "rlm_cache_lru", config->name, config->max_memory);
+	if (!driver->mem) {
+		ERROR("Failed allocating memory account");
+		return -1;
+	}
+
+	/*
+	 *	Round up, so small limits still allow at least one
+	 *	entry per shard.
+	 */
+	if (config->max_entries > 0) {
+		driver->shard_max_entries = (config->max_entries + driver->num_shards - 1) / driver->num_shards;
+	}
+
+	/*
+	 *	The bucket arrays are resized at runtime, so they
+	 *	can't come out of the instance ctx.  They get their
+	 *	own ctx instead, which is freed on detach.
+	 */
+	driver->buckets_ctx = talloc_new(NULL);
+	if (!driver->buckets_ctx) {
+		ERROR("Failed allocating cache hash table ctx");
+		return -1;
+	}
+
+	driver->shards = talloc_zero_array(driver, rlm_cache_lru_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
+		return -1;
+	}
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_lru_shard_t *shard = &driver->shards[i];
+
+		shard->buckets_ctx = driver->buckets_ctx;
+		shard->buckets = talloc_zero_array(shard->buckets_ctx, rlm_cache_lru_entry_t *, LRU_MIN_BUCKETS);
+		if (!shard->buckets) {
+			ERROR("Failed allocating cache hash table");
+			return -1;
+		}
+		shard->num_buckets = LRU_MIN_BUCKETS;
+		shard->mem = driver->mem;
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	if (driver->snapshot) {
+		int loaded;
+
+		loaded = cache_snapshot_load(driver->snapshot, time(NULL),
+					     _cache_snapshot_alloc, _cache_snapshot_insert, driver);
+		if (loaded < 0) {
+			/*
+			 *	A bad snapshot only costs us a cold
+			 *	cache, don't refuse to start.
+			 */
+			WARN("Failed loading cache snapshot: %s", fr_strerror());
+		} else if (loaded > 0) {
+			INFO("Loaded %i cache entries from \"%s\"", loaded, driver->snapshot);
+		}
+		driver->snapshot_loaded = true;
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_lru_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_lru_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * The entry's shard remains locked until the handle is released.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       UNUSED REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	*shard;
+	rlm_cache_lru_entry_t	*c;
+	uint32_t		hash = fr_hash(key, key_len);
+
+	shard = shard_lock(driver, handle, hash);
+
+	c = shard_find(shard, hash, key, key_len);
+	if (!c) {
+		*out = NULL;
+		return CACHE_MISS;
+	}
+	c->referenced = true;
+	*out = &c->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	*shard;
+	rlm_cache_lru_entry_t	*c;
+	uint32_t		hash = fr_hash(key, key_len);
+
+	if (!request) return CACHE_ERROR;
+
+	shard = shard_lock(driver, handle, hash);
+
+	c = shard_find(shard, hash, key, key_len);
+	if (!c) return CACHE_MISS;
+
+	shard_unlink(shard, c);
+	talloc_free(c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Existing entries with the same key are replaced.  If the shard is full
+ * entries are evicted to make room.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_lru_t		*driver = instance;
+	rlm_cache_lru_shard_t	*shard;
+	rlm_cache_lru_entry_t	*my_c, *old;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+
+	my_c->hash = fr_hash(c->key, c->key_len);
+
+	/*
+	 *	Only pay for serialization if we're enforcing
+	 *	a memory limit.
+	 */
+	if (driver->shard_max_size) {
+		uint8_t *serialized;
+
+		if (cache_serialize_binary(NULL, &serialized, c) < 0) {
+			RERROR("Failed serializing entry: %s", fr_strerror());
+			return CACHE_ERROR;
+		}
+		my_c->size = c->key_len + talloc_array_length(serialized);
+		talloc_free(serialized);
+
+		if (my_c->size > driver->shard_max_size) {
+			RWDEBUG("Entry size (%zu bytes) exceeds maximum per shard size (%zu bytes)",
+				my_c->size, driver->shard_max_size);
+			return CACHE_ERROR;
+		}
+	}
+
+	my_c->mem_size = talloc_total_size(my_c);
+
+	shard = shard_lock(driver, handle, my_c->hash);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = shard_find(shard, my_c->hash, c->key, c->key_len);
+	if (old) {
+		shard_unlink(shard, old);
+		talloc_free(old);
+	}
+
+	shard_evict(driver, shard, my_c->size, my_c->mem_size, request->packet->timestamp.tv_sec);
+	shard_link(shard, my_c);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Expiry is checked lazily on lookup, and by the CLOCK hand, so there's
+ * nothing to reorder.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  UNUSED REQUEST *request, UNUSED void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	return CACHE_OK;
+}
+
+/** Allocate a handle to record which shard we lock
+ *
+ * No locks are taken here, the shard is locked on the first operation
+ * which provides a key.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_lru_handle_t *h;
+
+	h = talloc_zero(request, rlm_cache_lru_handle_t);
+	if (!h) return -1;
+	h->request = request;
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Release the handle, unlocking any shard we locked
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_lru_handle_t *h = handle;
+
+	if (h->shard) {
+		pthread_mutex_unlock(&h->shard->mutex);
+		RDEBUG3("Shard mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern cache_driver_t rlm_cache_lru;
+cache_driver_t rlm_cache_lru = {
+	.name		= "rlm_cache_lru",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_lru_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
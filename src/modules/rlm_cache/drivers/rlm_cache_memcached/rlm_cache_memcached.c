@@ -39,11 +39,17 @@ typedef struct rlm_cache_memcached_handle {
 
 typedef struct rlm_cache_memcached {
 	char const 		*options;	//!< Connection options
+	bool			binary_protocol;	//!< Use the binary protocol instead of the text one.
+	bool			tcp_nodelay;	//!< Disable Nagle's algorithm.
+	bool			noreply;	//!< Don't wait for replies to sets and deletes.
 	fr_connection_pool_t	*pool;
 } rlm_cache_memcached_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET("binary_protocol", PW_TYPE_BOOLEAN, rlm_cache_memcached_t, binary_protocol), .dflt = "no" },
+	{ FR_CONF_OFFSET("tcp_nodelay", PW_TYPE_BOOLEAN, rlm_cache_memcached_t, tcp_nodelay), .dflt = "yes" },
+	{ FR_CONF_OFFSET("noreply", PW_TYPE_BOOLEAN, rlm_cache_memcached_t, noreply), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -78,12 +84,26 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval con
 
 	ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, (uint64_t)FR_TIMEVAL_TO_MS(timeout));
 	if (ret != MEMCACHED_SUCCESS) {
+	behavior_error:
 		ERROR("%s: %s", memcached_strerror(sandle, ret), memcached_last_error_message(sandle));
 	error:
 		memcached_free(sandle);
 		return NULL;
 	}
 
+	/*
+	 *	Must be set before the first request is sent, the
+	 *	protocol can't be changed once we're connected.
+	 */
+	ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, driver->binary_protocol);
+	if (ret != MEMCACHED_SUCCESS) goto behavior_error;
+
+	ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_TCP_NODELAY, driver->tcp_nodelay);
+	if (ret != MEMCACHED_SUCCESS) goto behavior_error;
+
+	ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_NOREPLY, driver->noreply);
+	if (ret != MEMCACHED_SUCCESS) goto behavior_error;
+
 	ret = memcached_version(sandle);
 	if (ret != MEMCACHED_SUCCESS) {
 		ERROR("%s: %s", memcached_strerror(sandle, ret), memcached_last_error_message(sandle));
@@ -127,6 +147,11 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 		ERROR("max_entries is not supported by this driver");
 		return -1;
 	}
+
+	if (config->max_memory > 0) {
+		ERROR("max_memory is not supported by this driver");
+		return -1;
+	}
 	return 0;
 }
 
@@ -145,6 +170,41 @@ static void cache_entry_free(rlm_cache_entry_t *c)
 	talloc_free(c);
 }
 
+/** Turn a value retrieved from memcached into a cache entry
+ *
+ * @param[out] out Where to write the new entry.
+ * @param[in] request The current request.
+ * @param[in] key the entry was stored under.
+ * @param[in] key_len the length of the key.
+ * @param[in] data retrieved from memcached, must be \0 terminated.
+ * @param[in] len of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_entry_deserialize(rlm_cache_entry_t **out, REQUEST *request,
+				   uint8_t const *key, size_t key_len, char *data, size_t len)
+{
+	rlm_cache_entry_t *c;
+
+	RDEBUG2("Retrieved %zu bytes from memcached", len);
+	if (len && (data[0] != '\0')) RDEBUG2("%s", data);	/* Binary entries start with NUL */
+
+	c = talloc_zero(NULL,  rlm_cache_entry_t);
+	if (!c) return -1;
+
+	if (cache_deserialize(c, data, len) < 0) {
+		RERROR("%s", fr_strerror());
+		talloc_free(c);
+		return -1;
+	}
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+	*out = c;
+
+	return 0;
+}
+
 /** Locate a cache entry in memcached
  *
  * @copydetails cache_entry_find_t
@@ -162,8 +222,6 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 
 	char			*from_store;
 
-	rlm_cache_entry_t	*c;
-
 	from_store = memcached_get(mandle->handle, (char const *)key, key_len, &len, &flags, &mret);
 	if (!from_store) {
 		if (mret == MEMCACHED_NOTFOUND) return CACHE_MISS;
@@ -173,19 +231,86 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 
 		return CACHE_ERROR;
 	}
-	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
-
-	c = talloc_zero(NULL,  rlm_cache_entry_t);
-	ret = cache_deserialize(c, from_store, len);
+	ret = cache_entry_deserialize(out, request, key, key_len, from_store, len);
 	free(from_store);
-	if (ret < 0) {
-		RERROR("%s", fr_strerror());
-		talloc_free(c);
+	if (ret < 0) return CACHE_ERROR;
+
+	return CACHE_OK;
+}
+
+/** Locate several cache entries in memcached with a single multi-get
+ *
+ * @copydetails cache_entry_find_multi_t
+ */
+static cache_status_t cache_entry_find_multi(rlm_cache_entry_t **out,
+					     UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					     REQUEST *request, void *handle,
+					     uint8_t const **keys, size_t const *key_lens, size_t num)
+{
+	rlm_cache_memcached_handle_t *mandle = handle;
+
+	memcached_return_t	mret;
+	memcached_result_st	result, *r;
+	size_t			i, found = 0;
+	bool			failed = false;
+
+	memset(out, 0, sizeof(*out) * num);
+
+	mret = memcached_mget(mandle->handle, (char const * const *)keys, key_lens, num);
+	if (mret != MEMCACHED_SUCCESS) {
+		RERROR("Failed retrieving entries: %s: %s", memcached_strerror(mandle->handle, mret),
+		       memcached_last_error_message(mandle->handle));
+
+		return CACHE_ERROR;
+	}
+
+	if (!memcached_result_create(mandle->handle, &result)) {
+		RERROR("Failed allocating result");
 		return CACHE_ERROR;
 	}
-	c->key = talloc_memdup(c, key, key_len);
-	*out = c;
+
+	/*
+	 *	Results arrive in whatever order the servers answer,
+	 *	match them back to the keys we asked for.  All the
+	 *	results must be read, even after an error, or the
+	 *	handle is left in an unusable state.
+	 */
+	while ((r = memcached_fetch_result(mandle->handle, &result, &mret))) {
+		char const	*rkey = memcached_result_key_value(r);
+		size_t		rkey_len = memcached_result_key_length(r);
+		char		*value;
+
+		if (failed) continue;
+
+		for (i = 0; i < num; i++) {
+			if (out[i] || (key_lens[i] != rkey_len) || (memcmp(keys[i], rkey, rkey_len) != 0)) continue;
+
+			/*
+			 *	The result buffer is reused, and isn't
+			 *	necessarily \0 terminated.
+			 */
+			value = talloc_bstrndup(NULL, memcached_result_value(r), memcached_result_length(r));
+			if (!value || (cache_entry_deserialize(&out[i], request, keys[i], key_lens[i],
+							       value, memcached_result_length(r)) < 0)) failed = true;
+			talloc_free(value);
+			found++;
+			break;
+		}
+	}
+	memcached_result_free(&result);
+
+	if (!failed && (mret != MEMCACHED_END) && (mret != MEMCACHED_SUCCESS) && (mret != MEMCACHED_NOTFOUND)) {
+		RERROR("Failed retrieving entries: %s: %s", memcached_strerror(mandle->handle, mret),
+		       memcached_last_error_message(mandle->handle));
+		failed = true;
+	}
+
+	if (failed) {
+		for (i = 0; i < num; i++) TALLOC_FREE(out[i]);
+		return CACHE_ERROR;
+	}
+
+	RDEBUG2("Retrieved %zu of %zu entries from memcached", found, num);
 
 	return CACHE_OK;
 }
@@ -202,22 +327,22 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
-	char *to_store;
+	uint8_t *to_store;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
+	if (cache_serialize_binary(pool, &to_store, c) < 0) {
+		RERROR("%s", fr_strerror());
 		talloc_free(pool);
 
 		return CACHE_ERROR;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            (char const *)to_store, talloc_array_length(to_store), c->expires, 0);
 	talloc_free(pool);
-	if (ret != MEMCACHED_SUCCESS) {
+	if ((ret != MEMCACHED_SUCCESS) && (ret != MEMCACHED_BUFFERED)) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
 		       memcached_last_error_message(mandle->handle));
 
@@ -241,6 +366,7 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	ret = memcached_delete(mandle->handle, (char const *)key, key_len, 0);
 	switch (ret) {
 	case MEMCACHED_SUCCESS:
+	case MEMCACHED_BUFFERED:	/* noreply, we don't know whether it existed */
 		return CACHE_OK;
 
 	case MEMCACHED_DATA_DOES_NOT_EXIST:
@@ -319,6 +445,7 @@ cache_driver_t rlm_cache_memcached = {
 	.free		= cache_entry_free,
 
 	.find		= cache_entry_find,
+	.find_multi	= cache_entry_find_multi,
 	.insert		= cache_entry_insert,
 	.expire		= cache_entry_expire,
 
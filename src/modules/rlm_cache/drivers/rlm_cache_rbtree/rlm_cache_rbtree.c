@@ -24,20 +24,36 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/mem_account.h>
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 
 typedef struct rlm_cache_rbtree {
 	rbtree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
 
+	mem_account_t		*mem;		//!< Memory used by entries, and the max_memory limit.
+
+	char const		*snapshot;	//!< File to save entries to on detach, and load them from
+						//!< on instantiation.
+	bool			snapshot_loaded;	//!< So a failed instantiation doesn't overwrite
+							//!< the snapshot with an empty cache.
+	uint32_t		max_entries;	//!< Copied from the module config, for loading snapshots.
+
 	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
 } rlm_cache_rbtree_t;
 
 typedef struct rlm_cache_rbtree_entry {
 	rlm_cache_entry_t	fields;		//!< Entry data.
 	size_t			offset;		//!< Offset used for heap.
+	size_t			size;		//!< Memory recorded against the driver's account.
 } rlm_cache_rbtree_entry_t;
 
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("snapshot", PW_TYPE_FILE_OUTPUT, rlm_cache_rbtree_t, snapshot) },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Compare two entries by key
  *
  * There may only be one entry with the same key.
@@ -68,6 +84,19 @@ static int cache_heap_cmp(void const *one, void const *two)
 	return 0;
 }
 
+/** Remove an entry from the tree and heap, and free it
+ *
+ */
+static void cache_entry_remove(rlm_cache_rbtree_t *driver, rlm_cache_entry_t *c)
+{
+	rlm_cache_rbtree_entry_t *entry = (rlm_cache_rbtree_entry_t *)c;
+
+	fr_heap_extract(driver->heap, c);
+	rbtree_deletebydata(driver->cache, c);
+	mem_account_add(driver->mem, -(int64_t)entry->size, -1);
+	talloc_free(c);
+}
+
 /** Walk over the cache rbtree
  *
  * Used to free any entries left in the tree on detach.
@@ -83,6 +112,81 @@ static int _cache_entry_free(UNUSED void *ctx, void *data)
 	return 2;
 }
 
+/** Walk over the cache rbtree, adding entries to a snapshot
+ *
+ * @param ctx snapshot to add entries to.
+ * @param data to add.
+ * @return
+ *	- 0 to continue.
+ *	- 1 to stop walking, after an error.
+ */
+static int _cache_entry_snapshot(void *ctx, void *data)
+{
+	rlm_cache_entry_t *c = data;
+
+	if (c->expires < time(NULL)) return 0;
+
+	return (cache_snapshot_add(ctx, c) < 0) ? 1 : 0;
+}
+
+/** Save the contents of the cache
+ *
+ */
+static void cache_snapshot_save(rlm_cache_rbtree_t *driver)
+{
+	cache_snapshot_t	*snap;
+	int			ret;
+
+	snap = cache_snapshot_alloc(NULL, driver->snapshot);
+	if (!snap) {
+	error:
+		ERROR("Failed saving cache snapshot: %s", fr_strerror());
+		return;
+	}
+
+	if (rbtree_walk(driver->cache, RBTREE_IN_ORDER, _cache_entry_snapshot, snap) != 0) {
+		talloc_free(snap);
+		goto error;
+	}
+
+	ret = cache_snapshot_commit(snap);
+	if (ret < 0) goto error;
+
+	INFO("Saved %i cache entries to \"%s\"", ret, driver->snapshot);
+}
+
+/** Allocate an entry loaded from a snapshot
+ *
+ */
+static rlm_cache_entry_t *_cache_snapshot_alloc(UNUSED void *uctx)
+{
+	return (rlm_cache_entry_t *)talloc_zero(NULL, rlm_cache_rbtree_entry_t);
+}
+
+/** Insert an entry loaded from a snapshot
+ *
+ * Entries which would take the cache over its limits are discarded.
+ */
+static int _cache_snapshot_insert(void *uctx, rlm_cache_entry_t *c)
+{
+	rlm_cache_rbtree_t		*driver = uctx;
+	rlm_cache_rbtree_entry_t	*entry = (rlm_cache_rbtree_entry_t *)c;
+
+	if (driver->max_entries && (rbtree_num_elements(driver->cache) >= driver->max_entries)) return -1;
+
+	entry->size = talloc_total_size(c);
+	if (mem_account_over(driver->mem, entry->size)) return -1;
+
+	if (!rbtree_insert(driver->cache, c)) return -1;
+	if (!fr_heap_insert(driver->heap, c)) {
+		rbtree_deletebydata(driver->cache, c);
+		return -1;
+	}
+	mem_account_add(driver->mem, entry->size, 1);
+
+	return 0;
+}
+
 /** Cleanup a cache_rbtree instance
  *
  */
@@ -90,6 +194,8 @@ static int mod_detach(void *instance)
 {
 	rlm_cache_rbtree_t *driver = instance;
 
+	if (driver->snapshot_loaded) cache_snapshot_save(driver);
+
 	if (driver->heap) fr_heap_delete(driver->heap);
 	if (driver->cache) {
 		rbtree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
@@ -105,7 +211,7 @@ static int mod_detach(void *instance)
  *
  * @copydetails cache_instantiate_t
  */
-static int mod_instantiate(UNUSED rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
 {
 	rlm_cache_rbtree_t *driver = instance;
 
@@ -128,11 +234,36 @@ static int mod_instantiate(UNUSED rlm_cache_config_t const *config, void *instan
 		return -1;
 	}
 
+	driver->mem = mem_account_alloc(driver, "rlm_cache_rbtree", config->name, config->max_memory);
+	if (!driver->mem) {
+		ERROR("Failed allocating memory account");
+		return -1;
+	}
+
 	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
 		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
 		return -1;
 	}
 
+	if (driver->snapshot) {
+		int loaded;
+
+		driver->max_entries = config->max_entries;
+
+		loaded = cache_snapshot_load(driver->snapshot, time(NULL),
+					     _cache_snapshot_alloc, _cache_snapshot_insert, driver);
+		if (loaded < 0) {
+			/*
+			 *	A bad snapshot only costs us a cold
+			 *	cache, don't refuse to start.
+			 */
+			WARN("Failed loading cache snapshot: %s", fr_strerror());
+		} else if (loaded > 0) {
+			INFO("Loaded %i cache entries from \"%s\"", loaded, driver->snapshot);
+		}
+		driver->snapshot_loaded = true;
+	}
+
 	return 0;
 }
 
@@ -176,11 +307,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	 *	Clear out old entries
 	 */
 	c = fr_heap_peek(driver->heap);
-	if (c && (c->expires < request->packet->timestamp.tv_sec)) {
-		fr_heap_extract(driver->heap, c);
-		rbtree_deletebydata(driver->cache, c);
-		talloc_free(c);
-	}
+	if (c && (c->expires < request->packet->timestamp.tv_sec)) cache_entry_remove(driver, c);
 
 	/*
 	 *	Is there an entry for this key?
@@ -217,9 +344,7 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	c = rbtree_finddata(driver->cache, &my_c);
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(driver->heap, c);
-	rbtree_deletebydata(driver->cache, c);
-	talloc_free(c);
+	cache_entry_remove(driver, c);
 
 	return CACHE_OK;
 }
@@ -237,13 +362,16 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 	cache_status_t status;
 
 	rlm_cache_rbtree_t *driver = instance;
-	rlm_cache_entry_t *my_c;
+	rlm_cache_entry_t *my_c, *oldest;
+	rlm_cache_rbtree_entry_t *entry;
 
 	rad_assert(handle == request);
 
 	if (!request) return CACHE_ERROR;
 
 	memcpy(&my_c, &c, sizeof(my_c));
+	entry = (rlm_cache_rbtree_entry_t *)my_c;
+	entry->size = talloc_total_size(my_c);
 
 	/*
 	 *	Allow overwriting
@@ -266,6 +394,17 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 		return CACHE_ERROR;
 	}
 
+	/*
+	 *	Make room by evicting the entries closest
+	 *	to expiry, but never the new entry.
+	 */
+	while (mem_account_over(driver->mem, entry->size) &&
+	       ((oldest = fr_heap_peek(driver->heap)) != NULL) && (oldest != my_c)) {
+		RDEBUG3("Cache is over max_memory, evicting entry");
+		cache_entry_remove(driver, oldest);
+	}
+	mem_account_add(driver->mem, entry->size, 1);
+
 	return CACHE_OK;
 }
 
@@ -295,6 +434,7 @@ static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *confi
 
 	if (!fr_heap_insert(driver->heap, c)) {
 		rbtree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
+		mem_account_add(driver->mem, -(int64_t)((rlm_cache_rbtree_entry_t *)c)->size, -1);
 		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
 		return CACHE_ERROR;
 	}
@@ -360,6 +500,7 @@ cache_driver_t rlm_cache_rbtree = {
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
 	.inst_size	= sizeof(rlm_cache_rbtree_t),
+	.config		= driver_config,
 	.alloc		= cache_entry_alloc,
 
 	.find		= cache_entry_find,
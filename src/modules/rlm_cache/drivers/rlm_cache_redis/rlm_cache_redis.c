@@ -27,24 +27,29 @@
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 #include "../../../rlm_redis/redis.h"
 #include "../../../rlm_redis/cluster.h"
 
-static CONF_PARSER driver_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
-
 typedef struct rlm_cache_redis {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
 						//!< Must be first field in this struct.
 
+	bool			binary;		//!< Store entries as a single string in the compact
+						//!< binary format, instead of as a list.
+
 	vp_tmpl_t		*created_attr;	//!< LHS of the Cache-Created map.
 	vp_tmpl_t		*expires_attr;	//!< LHS of the Cache-Expires map.
 
 	fr_redis_cluster_t	*cluster;
 } rlm_cache_redis_t;
 
+static CONF_PARSER driver_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("binary", PW_TYPE_BOOLEAN, rlm_cache_redis_t, binary), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Create a new rlm_cache_redis instance
  *
  * @copydetails cache_instantiate_t
@@ -56,6 +61,11 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 
 	buffer[0] = '\0';
 
+	if (config->max_memory > 0) {
+		ERROR("max_memory is not supported by this driver");
+		return -1;
+	}
+
 	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
 
 	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", config->name);
@@ -96,6 +106,72 @@ static void cache_entry_free(rlm_cache_entry_t *c)
 	talloc_free(c);
 }
 
+/** Retrieve an entry stored in the compact binary format
+ *
+ */
+static cache_status_t cache_entry_find_binary(rlm_cache_entry_t **out, rlm_cache_redis_t *driver,
+					      REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+	rlm_cache_entry_t		*c;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "GET %b", key, key_len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		char *p;
+
+		p = fr_asprint(NULL, (char const *)key, key_len, '"');
+		RERROR("Failed retrieving entry for key \"%s\"", p);
+		talloc_free(p);
+
+	error:
+		fr_redis_reply_free(reply);
+		return CACHE_ERROR;
+	}
+
+	if (!rad_cond_assert(reply)) goto error;
+
+	switch (reply->type) {
+	case REDIS_REPLY_NIL:
+		fr_redis_reply_free(reply);
+		return CACHE_MISS;
+
+	case REDIS_REPLY_STRING:
+		break;
+
+	default:
+		REDEBUG("Bad result type, expected string, got %s",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		goto error;
+	}
+
+	RDEBUG3("Retrieved %zu bytes", (size_t)reply->len);
+
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	if (!c) goto error;
+
+	if (cache_deserialize_binary(c, (uint8_t const *)reply->str, reply->len) < 0) {
+		RERROR("%s", fr_strerror());
+		talloc_free(c);
+		goto error;
+	}
+	fr_redis_reply_free(reply);
+
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+	*out = c;
+
+	return CACHE_OK;
+}
+
 /** Locate a cache entry in redis
  *
  * @copydetails cache_entry_find_t
@@ -119,6 +195,8 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 #endif
 	rlm_cache_entry_t		*c;
 
+	if (driver->binary) return cache_entry_find_binary(out, driver, request, key, key_len);
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
@@ -257,6 +335,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	int			s_ret;
 
 	static char const	command[] = "RPUSH";
+	static char const	binary_command[] = "SET";
 	char const		**argv;
 	size_t			*argv_len;
 	char const		**argv_p;
@@ -314,6 +393,32 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	pool = talloc_pool(request, 1024);
 	if (!pool) return CACHE_ERROR;
 
+	/*
+	 *	The whole entry is a single string, with
+	 *	maps encoded in the compact binary format.
+	 */
+	if (driver->binary) {
+		uint8_t *blob;
+
+		if (cache_serialize_binary(pool, &blob, c) < 0) {
+			REDEBUG("Failed encoding entry: %s", fr_strerror());
+			talloc_free(pool);
+			return CACHE_ERROR;
+		}
+
+		argv = talloc_array(pool, char const *, 3);
+		argv_len = talloc_array(pool, size_t, 3);
+
+		argv[0] = binary_command;
+		argv_len[0] = sizeof(binary_command) - 1;
+		argv[1] = (char const *)c->key;
+		argv_len[1] = c->key_len;
+		argv[2] = (char const *)blob;
+		argv_len[2] = talloc_array_length(blob);
+
+		goto pipeline;
+	}
+
 	argv_p = argv = talloc_array(pool, char const *, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 	argv_len_p = argv_len = talloc_array(pool, size_t, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 
@@ -336,6 +441,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 		argv_len_p += 3;
 	}
 
+pipeline:
 	RDEBUG3("Pipelining commands");
 
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, c->key, c->key_len, false);
@@ -34,15 +34,87 @@ RCSID("$Id$")
 
 #include "rlm_cache.h"
 
+typedef struct cache_flight cache_flight_t;
+typedef struct cache_waiter cache_waiter_t;
+
+typedef struct rlm_cache_thread {
+	rlm_cache_t const	*inst;		//!< Instance of rlm_cache.
+	fr_event_list_t		*el;		//!< This thread's event list.
+	rbtree_t		*flights;	//!< Missing keys currently being loaded by a request.
+} rlm_cache_thread_t;
+
+/** A request waiting for another request to load a missing entry
+ *
+ */
+struct cache_waiter {
+	REQUEST			*request;	//!< Waiting request, or NULL if it was cancelled.
+	bool			done;		//!< The flight has finished.
+	bool			retry;		//!< Try coalescing again when resumed.
+	cache_waiter_t		*next;		//!< Next waiter for the same key.
+};
+
+/** A missing key, and the request expected to load it
+ *
+ * Parented by the loading request, so it's freed (waking any waiters)
+ * if that request finishes without inserting an entry.
+ */
+struct cache_flight {
+	uint8_t const		*key;		//!< Key being loaded.
+	size_t			key_len;	//!< Length of the key.
+
+	REQUEST			*loader;	//!< Request expected to insert the entry.
+	rlm_cache_thread_t	*t;		//!< Thread the flight belongs to, NULL after thread detach.
+	fr_event_timer_t	*ev;		//!< When to stop waiting for the loader.
+	bool			timed_out;	//!< Waiters shouldn't wait again.
+
+	cache_waiter_t		*head;		//!< Requests waiting for the entry.
+	cache_waiter_t		**tail;		//!< Where to add the next waiter.
+};
+
+/** An entry retrieved before it was looked up
+ *
+ */
+typedef struct cache_prefetch_entry {
+	uint8_t const		*key;		//!< Key that was retrieved.
+	size_t			key_len;	//!< Length of the key.
+	rlm_cache_entry_t	*c;		//!< Retrieved entry, or NULL if there was no entry.
+	bool			used;		//!< Entry has been looked up, or is out of date.
+} cache_prefetch_entry_t;
+
+/** The entries retrieved by the first lookup in a request
+ *
+ * Stored as request data, so it's freed (along with any entries which
+ * were never looked up) when the request is.
+ */
+typedef struct cache_prefetch {
+	rlm_cache_t const	*inst;		//!< Instance the entries belong to.
+	cache_prefetch_entry_t	*entry;		//!< Array of entries.
+	size_t			num;		//!< Number of entries.
+} cache_prefetch_t;
+
+static const CONF_PARSER l1_config[] = {
+	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_cache_t, l1_driver_name) },
+	{ FR_CONF_OFFSET("ttl", PW_TYPE_INTEGER, rlm_cache_t, l1_ttl), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_cache_t, l1_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_memory", PW_TYPE_SIZE, rlm_cache_t, l1_max_memory), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_cache_config_t, key) },
 	{ FR_CONF_OFFSET("ttl", PW_TYPE_INTEGER, rlm_cache_config_t, ttl), .dflt = "500" },
 	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_cache_config_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_memory", PW_TYPE_SIZE, rlm_cache_config_t, max_memory), .dflt = "0" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", PW_TYPE_SIGNED, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", PW_TYPE_BOOLEAN, rlm_cache_config_t, stats), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("coalesce_timeout", PW_TYPE_TIMEVAL, rlm_cache_t, coalesce_timeout), .dflt = "0" },
+	{ FR_CONF_OFFSET("prefetch", PW_TYPE_TMPL | PW_TYPE_MULTI, rlm_cache_t, prefetch), .quote = T_DOUBLE_QUOTED_STRING },
+
+	{ FR_CONF_POINTER("l1", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) l1_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -118,6 +190,366 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 	*c = NULL;
 }
 
+/** Copy the key, timestamps and maps of one cache entry into another
+ *
+ * Used to move entries between the local and remote tiers, where the two
+ * drivers have different ideas about who owns the entry's memory.
+ *
+ * @param[in,out] dst Entry to populate, allocated by the driver it'll be stored in.
+ * @param[in] src Entry to copy.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_entry_copy(rlm_cache_entry_t *dst, rlm_cache_entry_t const *src)
+{
+	vp_map_t	*map;
+	vp_map_t	**last = &dst->maps, *c_map;
+
+	dst->key = talloc_memdup(dst, src->key, src->key_len);
+	if (!dst->key) return -1;
+
+	dst->key_len = src->key_len;
+	dst->hits = src->hits;
+	dst->created = src->created;
+	dst->expires = src->expires;
+
+	for (map = src->maps; map; map = map->next) {
+		c_map = talloc_zero(dst, vp_map_t);
+		if (!c_map) return -1;
+		c_map->op = map->op;
+
+		c_map->lhs = tmpl_init(talloc(c_map, vp_tmpl_t), TMPL_TYPE_ATTR,
+				       talloc_strndup(c_map, map->lhs->name, map->lhs->len),
+				       map->lhs->len, T_BARE_WORD);
+		if (!c_map->lhs) return -1;
+		c_map->lhs->tmpl_da = map->lhs->tmpl_da;
+		c_map->lhs->tmpl_tag = map->lhs->tmpl_tag;
+		c_map->lhs->tmpl_list = map->lhs->tmpl_list;
+		c_map->lhs->tmpl_num = map->lhs->tmpl_num;
+		c_map->lhs->tmpl_request = map->lhs->tmpl_request;
+
+		c_map->rhs = tmpl_init(talloc(c_map, vp_tmpl_t), TMPL_TYPE_DATA,
+				       talloc_strndup(c_map, map->rhs->name, map->rhs->len),
+				       map->rhs->len, map->rhs->quote);
+		if (!c_map->rhs ||
+		    (value_box_copy(c_map->rhs, &c_map->rhs->tmpl_value_box, &map->rhs->tmpl_value_box) < 0)) {
+			return -1;
+		}
+
+		*last = c_map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+}
+
+/** Get exclusive use of a handle to access the local tier
+ *
+ */
+static int cache_l1_acquire(rlm_cache_handle_t **out, rlm_cache_t const *inst, REQUEST *request)
+{
+	if (!inst->l1_driver->acquire) {
+		*out = NULL;
+		return 0;
+	}
+
+	return inst->l1_driver->acquire(out, &inst->l1_config, inst->l1_driver_inst, request);
+}
+
+/** Release a handle to the local tier
+ *
+ */
+static void cache_l1_release(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t *handle)
+{
+	if (!inst->l1_driver->release || !handle) return;
+
+	inst->l1_driver->release(&inst->l1_config, inst->l1_driver_inst, request, handle);
+}
+
+/** Retrieve a copy of an entry from the local tier
+ *
+ * The remote tier's driver always provides a free callback, so the caller
+ * frees the copy exactly as it would an entry retrieved from the remote tier.
+ *
+ * @return
+ *	- A copy of the local entry.
+ *	- NULL if there was no valid local entry.
+ */
+static rlm_cache_entry_t *cache_l1_find(rlm_cache_t const *inst, REQUEST *request,
+					uint8_t const *key, size_t key_len)
+{
+	rlm_cache_handle_t	*handle;
+	rlm_cache_entry_t	*l1_c, *c = NULL;
+
+	if (cache_l1_acquire(&handle, inst, request) < 0) return NULL;
+
+	if (inst->l1_driver->find(&l1_c, &inst->l1_config, inst->l1_driver_inst, request,
+				  handle, key, key_len) != CACHE_OK) goto finish;
+
+	if ((l1_c->expires < request->packet->timestamp.tv_sec) || (l1_c->created < inst->config.epoch)) {
+		inst->l1_driver->expire(&inst->l1_config, inst->l1_driver_inst, request, handle, key, key_len);
+		goto finish;
+	}
+
+	c = cache_alloc(inst, request);
+	if (!c) goto finish;
+
+	if (cache_entry_copy(c, l1_c) < 0) {
+		RWDEBUG("Failed copying local cache entry");
+		talloc_free(c);
+		c = NULL;
+		goto finish;
+	}
+	l1_c->hits++;
+
+finish:
+	cache_l1_release(inst, request, handle);
+
+	return c;
+}
+
+/** Store a copy of an entry retrieved from, or written to, the remote tier
+ *
+ * The local copy never outlives the remote entry, and is kept for at most
+ * l1.ttl seconds, which bounds how stale the local tier can be when the
+ * remote entry is changed by another server.
+ *
+ * Failures are not fatal, the next lookup will just go to the remote tier.
+ */
+static void cache_l1_insert(rlm_cache_t const *inst, REQUEST *request, rlm_cache_entry_t const *c)
+{
+	rlm_cache_handle_t	*handle;
+	rlm_cache_entry_t	*l1_c;
+	time_t			expires = request->packet->timestamp.tv_sec + inst->l1_ttl;
+
+	l1_c = inst->l1_driver->alloc ? inst->l1_driver->alloc(&inst->l1_config, inst->l1_driver_inst, request) :
+					talloc_zero(NULL, rlm_cache_entry_t);
+	if (!l1_c) return;
+
+	if (cache_entry_copy(l1_c, c) < 0) {
+		RWDEBUG("Failed copying entry to local cache");
+		talloc_free(l1_c);
+		return;
+	}
+	if (l1_c->expires > expires) l1_c->expires = expires;
+
+	if (cache_l1_acquire(&handle, inst, request) < 0) {
+		talloc_free(l1_c);
+		return;
+	}
+
+	if ((inst->l1_max_entries > 0) && inst->l1_driver->count &&
+	    (inst->l1_driver->count(&inst->l1_config, inst->l1_driver_inst, request, handle) >= inst->l1_max_entries)) {
+		RDEBUG3("Local cache is full");
+		talloc_free(l1_c);
+		goto finish;
+	}
+
+	if (inst->l1_driver->insert(&inst->l1_config, inst->l1_driver_inst, request, handle, l1_c) != CACHE_OK) {
+		RWDEBUG("Failed adding entry to local cache");
+		talloc_free(l1_c);
+	}
+
+finish:
+	cache_l1_release(inst, request, handle);
+}
+
+/** Remove an entry from the local tier
+ *
+ */
+static void cache_l1_expire(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_handle_t *handle;
+
+	if (cache_l1_acquire(&handle, inst, request) < 0) return;
+	inst->l1_driver->expire(&inst->l1_config, inst->l1_driver_inst, request, handle, key, key_len);
+	cache_l1_release(inst, request, handle);
+}
+
+/** Free any prefetched entries which were never looked up
+ *
+ */
+static int _cache_prefetch_free(cache_prefetch_t *pf)
+{
+	size_t i;
+
+	for (i = 0; i < pf->num; i++) cache_free(pf->inst, &pf->entry[i].c);
+
+	return 0;
+}
+
+/** Find a key in the prefetched entries
+ *
+ * @return
+ *	- The prefetched entry for the key.
+ *	- NULL if the key wasn't prefetched, or has already been looked up.
+ */
+static cache_prefetch_entry_t *cache_prefetch_entry(cache_prefetch_t *pf, uint8_t const *key, size_t key_len)
+{
+	size_t i;
+
+	for (i = 0; i < pf->num; i++) {
+		if (pf->entry[i].used || (pf->entry[i].key_len != key_len) ||
+		    (memcmp(pf->entry[i].key, key, key_len) != 0)) continue;
+
+		return &pf->entry[i];
+	}
+
+	return NULL;
+}
+
+/** Retrieve the key, and all the prefetch keys, with one driver call
+ *
+ * The first lookup in a request retrieves its own key, and the expansions
+ * of the "prefetch" templates.  The other entries are held until the
+ * request looks them up, so several lookups cost a single round trip
+ * to the datastore.
+ *
+ * @return
+ *	- #CACHE_OK if an entry was found.
+ *	- #CACHE_MISS if no entry was found.
+ *	- #CACHE_RECONNECT if the handle needs to be reconnected.
+ *	- #CACHE_ERROR on failure.
+ */
+static cache_status_t cache_prefetch_find(rlm_cache_entry_t **out, rlm_cache_t const *inst, REQUEST *request,
+					  rlm_cache_handle_t *handle, uint8_t const *key, size_t key_len)
+{
+	cache_prefetch_t	*pf;
+	cache_prefetch_entry_t	*entry;
+	uint8_t const		**keys;
+	size_t			*key_lens;
+	rlm_cache_entry_t	**found;
+	size_t			i, max;
+	cache_status_t		ret;
+
+	*out = NULL;
+
+	/*
+	 *	Prefetching only happens once per request, after
+	 *	that, keys which weren't prefetched are retrieved
+	 *	individually.
+	 */
+	pf = request_data_reference(request, inst, 0);
+	if (pf) {
+		entry = cache_prefetch_entry(pf, key, key_len);
+		if (!entry) return inst->driver->find(out, &inst->config, inst->driver_inst, request, handle,
+						      key, key_len);
+
+		RDEBUG3("Using prefetched result");
+		entry->used = true;
+		*out = entry->c;
+		entry->c = NULL;
+
+		return *out ? CACHE_OK : CACHE_MISS;
+	}
+
+	max = talloc_array_length(inst->prefetch) + 1;
+
+	MEM(pf = talloc_zero(NULL, cache_prefetch_t));
+	pf->inst = inst;
+	MEM(pf->entry = talloc_zero_array(pf, cache_prefetch_entry_t, max));
+
+	pf->entry[0].key = key;
+	pf->entry[0].key_len = key_len;
+	pf->num = 1;
+
+	for (i = 0; i < (max - 1); i++) {
+		char	*expanded;
+		ssize_t	slen;
+
+		slen = tmpl_aexpand(pf, &expanded, request, inst->prefetch[i], NULL, NULL);
+		if (slen < 0) {
+			RWDEBUG("Failed expanding prefetch key \"%s\", skipping it", inst->prefetch[i]->name);
+			continue;
+		}
+
+		if ((slen == 0) || cache_prefetch_entry(pf, (uint8_t const *)expanded, slen)) {
+			talloc_free(expanded);
+			continue;
+		}
+
+		pf->entry[pf->num].key = (uint8_t const *)expanded;
+		pf->entry[pf->num].key_len = slen;
+		pf->num++;
+	}
+
+	MEM(keys = talloc_array(pf, uint8_t const *, pf->num));
+	MEM(key_lens = talloc_array(pf, size_t, pf->num));
+	MEM(found = talloc_zero_array(pf, rlm_cache_entry_t *, pf->num));
+
+	for (i = 0; i < pf->num; i++) {
+		keys[i] = pf->entry[i].key;
+		key_lens[i] = pf->entry[i].key_len;
+	}
+
+	RDEBUG2("Retrieving %zu key(s)", pf->num);
+
+	ret = inst->driver->find_multi(found, &inst->config, inst->driver_inst, request, handle,
+				       keys, key_lens, pf->num);
+	if (ret != CACHE_OK) {
+		talloc_free(pf);
+		return ret;
+	}
+
+	for (i = 0; i < pf->num; i++) pf->entry[i].c = found[i];
+	talloc_free(found);
+	talloc_free(key_lens);
+	talloc_free(keys);
+
+	/*
+	 *	The first entry is returned now, its key
+	 *	belongs to the caller.
+	 */
+	*out = pf->entry[0].c;
+	pf->entry[0].c = NULL;
+	pf->entry[0].used = true;
+	pf->entry[0].key = NULL;
+	pf->entry[0].key_len = 0;
+
+	talloc_set_destructor(pf, _cache_prefetch_free);
+
+	if (request_data_add(request, inst, 0, pf, true, true, false) < 0) {
+		RWDEBUG("Failed storing prefetched entries");
+		talloc_free(pf);
+	}
+
+	return *out ? CACHE_OK : CACHE_MISS;
+}
+
+/** Retrieve an entry from the driver, using the prefetched entries if there are any
+ *
+ */
+static cache_status_t cache_driver_find(rlm_cache_entry_t **out, rlm_cache_t const *inst, REQUEST *request,
+					rlm_cache_handle_t *handle, uint8_t const *key, size_t key_len)
+{
+	if (inst->prefetch && inst->driver->find_multi) {
+		return cache_prefetch_find(out, inst, request, handle, key, key_len);
+	}
+
+	return inst->driver->find(out, &inst->config, inst->driver_inst, request, handle, key, key_len);
+}
+
+/** Discard a prefetched entry which is about to be out of date
+ *
+ */
+static void cache_prefetch_expire(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	cache_prefetch_t	*pf;
+	cache_prefetch_entry_t	*entry;
+
+	if (!inst->prefetch || !inst->driver->find_multi) return;
+
+	pf = request_data_reference(request, inst, 0);
+	if (!pf) return;
+
+	entry = cache_prefetch_entry(pf, key, key_len);
+	if (!entry) return;
+
+	cache_free(inst, &entry->c);
+	entry->used = true;
+}
+
 /** Merge a cached entry into a #REQUEST
  *
  * @return
@@ -185,8 +617,20 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 
 	*out = NULL;
 
+	/*
+	 *	Try the local tier first, this avoids a round trip
+	 *	to the remote datastore for hot keys.
+	 */
+	if (inst->l1_driver) {
+		c = cache_l1_find(inst, request, key, key_len);
+		if (c) {
+			RDEBUG2("Found entry in local cache");
+			goto found;
+		}
+	}
+
 	for (;;) {
-		ret = inst->driver->find(&c, &inst->config, inst->driver_inst, request, *handle, key, key_len);
+		ret = cache_driver_find(&c, inst, request, *handle, key, key_len);
 		switch (ret) {
 		case CACHE_RECONNECT:
 			RDEBUG("Reconnecting...");
@@ -229,7 +673,7 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			talloc_free(p);
 		}
 
-		inst->driver->expire(&inst->config, inst->driver_inst, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -242,6 +686,9 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 		talloc_free(p);
 	}
 
+	if (inst->l1_driver) cache_l1_insert(inst, request, c);
+
+found:
 	c->hits++;
 	*out = c;
 
@@ -259,6 +706,10 @@ static rlm_rcode_t cache_expire(rlm_cache_t const *inst, REQUEST *request,
 				rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
 	RDEBUG("Expiring cache entry");
+
+	if (inst->l1_driver) cache_l1_expire(inst, request, key, key_len);
+	cache_prefetch_expire(inst, request, key, key_len);
+
 	for (;;) switch (inst->driver->expire(&inst->config, inst->driver_inst, request,
 					      *handle, key, key_len)) {
 	case CACHE_RECONNECT:
@@ -297,11 +748,13 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		return RLM_MODULE_FAIL;
 	}
 
+	cache_prefetch_expire(inst, request, key, key_len);
+
 	c = cache_alloc(inst, request);
 	if (!c) return RLM_MODULE_FAIL;
 
@@ -447,6 +900,10 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 
 		case CACHE_OK:
 			RDEBUG("Committed entry, TTL %d seconds", ttl);
+			if (inst->l1_driver) {
+				cache_l1_expire(inst, request, key, key_len);
+				cache_l1_insert(inst, request, c);
+			}
 			cache_free(inst, &c);
 			return merge ? RLM_MODULE_UPDATED :
 				       RLM_MODULE_OK;
@@ -467,6 +924,14 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 static rlm_rcode_t cache_set_ttl(rlm_cache_t const *inst, REQUEST *request,
 				 rlm_cache_handle_t **handle, rlm_cache_entry_t *c)
 {
+	/*
+	 *	The local copy's expiry may now be later than
+	 *	the remote entry's, drop it, and let the next
+	 *	lookup fetch the entry again.
+	 */
+	if (inst->l1_driver) cache_l1_expire(inst, request, c->key, c->key_len);
+	cache_prefetch_expire(inst, request, c->key, c->key_len);
+
 	/*
 	 *	Call the driver's insert method to overwrite the old entry
 	 */
@@ -527,6 +992,171 @@ static int cache_verify(vp_map_t *map, void *ctx)
 	return 0;
 }
 
+/** Compare two flights by key
+ *
+ */
+static int cache_flight_cmp(void const *one, void const *two)
+{
+	cache_flight_t const *a = one;
+	cache_flight_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Remove a flight, resuming any requests waiting on it
+ *
+ */
+static int _cache_flight_free(cache_flight_t *flight)
+{
+	cache_waiter_t *waiter, *next;
+
+	if (flight->t) {
+		rbtree_deletebydata(flight->t->flights, flight);
+		if (flight->ev) fr_event_timer_delete(flight->t->el, &flight->ev);
+	}
+
+	for (waiter = flight->head; waiter; waiter = next) {
+		next = waiter->next;
+		waiter->next = NULL;
+		waiter->done = true;
+		waiter->retry = !flight->timed_out;
+
+		if (waiter->request) {
+			unlang_resumable(waiter->request);
+			continue;
+		}
+		talloc_free(waiter);
+	}
+
+	return 0;
+}
+
+/** Stop waiting for the loader
+ *
+ * Waiters go to the datastore themselves, and won't wait again.
+ */
+static void cache_flight_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	cache_flight_t *flight = talloc_get_type_abort(ctx, cache_flight_t);
+
+	flight->timed_out = true;
+	talloc_free(flight);
+}
+
+/** Wait for another request to load a missing key, or become the loader for it
+ *
+ * Requests can only be resumed by the thread they're running in, so lookups
+ * are only coalesced with other requests on the same thread.
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] key	which was missing.
+ * @param[in] key_len	Length of key.
+ * @return
+ *	- A waiter to yield with, if another request is already loading the key.
+ *	- NULL if the request should load the key itself.
+ */
+static cache_waiter_t *cache_flight_join(rlm_cache_thread_t *t, REQUEST *request,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_t const	*inst = t->inst;
+	cache_flight_t		*flight, my_flight;
+	cache_waiter_t		*waiter;
+	struct timeval		now, when;
+
+	my_flight.key = key;
+	my_flight.key_len = key_len;
+
+	flight = rbtree_finddata(t->flights, &my_flight);
+	if (flight) {
+		if (flight->loader == request) return NULL;
+
+		MEM(waiter = talloc_zero(NULL, cache_waiter_t));
+		waiter->request = request;
+
+		*flight->tail = waiter;
+		flight->tail = &waiter->next;
+
+		RDEBUG2("Entry is being loaded by another request, waiting for it");
+		return waiter;
+	}
+
+	MEM(flight = talloc_zero(request, cache_flight_t));
+	talloc_set_type(flight, cache_flight_t);
+	MEM(flight->key = talloc_memdup(flight, key, key_len));
+	flight->key_len = key_len;
+	flight->loader = request;
+	flight->t = t;
+	flight->tail = &flight->head;
+
+	if (!rbtree_insert(t->flights, flight)) {
+		talloc_free(flight);
+		return NULL;
+	}
+	talloc_set_destructor(flight, _cache_flight_free);
+
+	gettimeofday(&now, NULL);
+	fr_timeval_add(&when, &now, &inst->coalesce_timeout);
+	if (fr_event_timer_insert(t->el, cache_flight_timeout, flight, &when, &flight->ev) < 0) {
+		RWDEBUG("Failed inserting coalescing timer");
+	}
+
+	RDEBUG3("Now loading entry, other requests for this key will wait");
+
+	return NULL;
+}
+
+/** An entry was added to the cache, wake anything waiting for it
+ *
+ */
+static void cache_flight_land(rlm_cache_thread_t *t, uint8_t const *key, size_t key_len)
+{
+	cache_flight_t *flight, my_flight;
+
+	if (!t->flights) return;
+
+	my_flight.key = key;
+	my_flight.key_len = key_len;
+
+	flight = rbtree_finddata(t->flights, &my_flight);
+	if (flight) talloc_free(flight);
+}
+
+static rlm_rcode_t cache_it(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request, bool coalesce);
+
+/** Repeat the cache operation now the loader has finished
+ *
+ */
+static rlm_rcode_t cache_flight_resume(REQUEST *request, void *instance, void *thread, void *ctx)
+{
+	cache_waiter_t	*waiter = talloc_get_type_abort(ctx, cache_waiter_t);
+	bool		retry = waiter->retry;
+
+	talloc_free(waiter);
+
+	return cache_it(instance, thread, request, retry);
+}
+
+/** Stop waiting if the request is cancelled
+ *
+ */
+static void cache_flight_action(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				fr_state_action_t action)
+{
+	cache_waiter_t *waiter = talloc_get_type_abort(ctx, cache_waiter_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (waiter->done) {
+		talloc_free(waiter);
+		return;
+	}
+	waiter->request = NULL;
+}
+
 /** Do caching checks
  *
  * Since we can update ANY VP list, we do exactly the same thing for all sections
@@ -535,13 +1165,27 @@ static int cache_verify(vp_map_t *map, void *ctx)
  * If you want to cache something different in different sections, configure
  * another cache module.
  */
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_cache_it(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_cache_it(void *instance, void *thread, REQUEST *request)
+{
+	return cache_it(instance, thread, request, fr_timeval_isset(&((rlm_cache_t const *)instance)->coalesce_timeout));
+}
+
+/** Perform the cache operation requested by the control attributes
+ *
+ * @param[in] inst	of rlm_cache.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] coalesce	If true, and a lookup misses while another request
+ *			is loading the same key, wait for that request to
+ *			insert the entry instead of returning notfound.
+ */
+static rlm_rcode_t cache_it(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request, bool coalesce)
 {
 	rlm_cache_entry_t	*c = NULL;
-	rlm_cache_t const	*inst = instance;
 
 	rlm_cache_handle_t	*handle;
+	cache_waiter_t		*waiter = NULL;
 
 	vp_cursor_t		cursor;
 	VALUE_PAIR		*vp;
@@ -583,6 +1227,11 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 
 		rcode = c ? RLM_MODULE_OK:
 			    RLM_MODULE_NOTFOUND;
+
+		if (!c && coalesce) {
+			waiter = cache_flight_join(t, request, key, key_len);
+			if (waiter) goto yield;
+		}
 		goto finish;
 	}
 
@@ -635,6 +1284,16 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 		case RLM_MODULE_NOTFOUND:
 			rcode = RLM_MODULE_NOTFOUND;
 			exists = 0;
+
+			/*
+			 *	If we're not going to insert the
+			 *	entry ourselves, someone else might
+			 *	be about to.
+			 */
+			if (coalesce && !insert && !expire && !set_ttl) {
+				waiter = cache_flight_join(t, request, key, key_len);
+				if (waiter) goto yield;
+			}
 			break;
 
 		default:
@@ -749,9 +1408,20 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 			rad_assert(0);
 		}
 		rad_assert(!inst->driver->acquire || handle);
-		goto finish;
+
+		cache_flight_land(t, key, key_len);
 	}
+	goto finish;
 
+yield:
+	cache_free(inst, &c);
+	cache_release(inst, request, &handle);
+
+	/*
+	 *	Control attributes are left alone, we need
+	 *	them to repeat the operation when we're resumed.
+	 */
+	return unlang_yield(request, cache_flight_resume, cache_flight_action, waiter);
 
 finish:
 	cache_free(inst, &c);
@@ -818,16 +1488,16 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	switch (cache_find(&c, mod_inst, request, handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
-		return 0;
+		goto finish;
 
 	default:
-		talloc_free(target);
-		return -1;
+		ret = -1;
+		goto finish;
 	}
 
 	for (map = c->maps; map; map = map->next) {
@@ -840,13 +1510,8 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		break;
 	}
 
+finish:
 	talloc_free(target);
-
-	/*
-	 *	Check if we found a matching map
-	 */
-	if (!map) return 0;
-
 	cache_free(mod_inst, &c);
 	cache_release(mod_inst, request, &handle);
 
@@ -877,6 +1542,7 @@ static int mod_detach(void *instance)
 	 *	until all instances of rlm_cache that use it have been destroyed.
 	 */
 	talloc_decrease_ref_count(inst->driver_handle);
+	if (inst->l1_driver_handle) talloc_decrease_ref_count(inst->l1_driver_handle);
 
 	return 0;
 }
@@ -901,66 +1567,182 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
-/** Create a new rlm_cache_instance
+/** Create the tree of in flight keys
  *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_cache_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int mod_instantiate(CONF_SECTION *conf, void *instance)
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
 {
-	rlm_cache_t	*inst = instance;
-	CONF_SECTION	*update;
-	CONF_SECTION	*driver_cs;
-	char const 	*name;
+	rlm_cache_thread_t	*t = thread;
 
-	inst->cs = conf;
+	t->inst = instance;
+	t->el = el;
 
-	rad_assert(inst->config.key);
+	if (!fr_timeval_isset(&t->inst->coalesce_timeout)) return 0;
+
+	t->flights = rbtree_create(NULL, cache_flight_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!t->flights) return -1;
+
+	return 0;
+}
+
+/** Detach a flight from the thread
+ *
+ * The flight itself is freed with the request that's loading it.
+ */
+static int _cache_flight_detach(void *ctx, void *data)
+{
+	rlm_cache_thread_t	*t = ctx;
+	cache_flight_t		*flight = data;
+
+	if (flight->ev) fr_event_timer_delete(t->el, &flight->ev);
+	flight->t = NULL;
+
+	return 2;
+}
+
+/** Free the tree of in flight keys
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_cache_thread_t	*t = thread;
+
+	if (!t->flights) return 0;
+
+	rbtree_walk(t->flights, RBTREE_DELETE_ORDER, _cache_flight_detach, t);
+	rbtree_free(t->flights);
+
+	return 0;
+}
+
+/** Load and instantiate a cache driver
+ *
+ * @param[out] handle	Where to write the driver's dl_handle.
+ * @param[out] driver	Where to write the driver's exported interface.
+ * @param[out] driver_inst Where to write the driver's instance data.
+ * @param[in] inst	of rlm_cache.
+ * @param[in] cs	containing the driver's (optional) configuration section.
+ * @param[in] driver_name to load.
+ * @param[in] config	to pass to the driver.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_driver_load(dl_module_t const **handle, cache_driver_t const **driver, void **driver_inst,
+			     rlm_cache_t *inst, CONF_SECTION *cs, char const *driver_name,
+			     rlm_cache_config_t const *config)
+{
+	CONF_SECTION	*driver_cs;
+	char const 	*name;
 
 	/*
 	 *	Sanity check for crazy people.
 	 */
-	if (strncmp(inst->config.driver_name, "rlm_cache_", 8) != 0) {
-		cf_log_err_cs(conf, "\"%s\" is NOT an Cache driver!", inst->config.driver_name);
+	if (strncmp(driver_name, "rlm_cache_", 8) != 0) {
+		cf_log_err_cs(cs, "\"%s\" is NOT an Cache driver!", driver_name);
 		return -1;
 	}
 
-	name = strrchr(inst->config.driver_name, '_');
+	name = strrchr(driver_name, '_');
 	if (!name) {
-		name = inst->config.driver_name;
+		name = driver_name;
 	} else {
 		name++;
 	}
 
-	driver_cs = cf_section_sub_find(conf, name);
+	driver_cs = cf_section_sub_find(cs, name);
 	if (!driver_cs) {
-		driver_cs = cf_section_alloc(conf, name, NULL);
+		driver_cs = cf_section_alloc(cs, name, NULL);
 		if (!driver_cs) return -1;
 	}
 
 	/*
 	 *	Load the appropriate driver for our backend
 	 */
-	inst->driver_handle = dl_module(driver_cs, name, "rlm_cache_");
-	if (!inst->driver_handle) return -1;
+	*handle = dl_module(driver_cs, name, "rlm_cache_");
+	if (!*handle) return -1;
 
-	inst->driver = (cache_driver_t const *)inst->driver_handle->common;
+	*driver = (cache_driver_t const *)(*handle)->common;
 
 	/*
 	 *	Non optional fields and callbacks
 	 */
-	rad_assert(inst->driver->name);
-	rad_assert(inst->driver->find);
-	rad_assert(inst->driver->insert);
-	rad_assert(inst->driver->expire);
+	rad_assert((*driver)->name);
+	rad_assert((*driver)->find);
+	rad_assert((*driver)->insert);
+	rad_assert((*driver)->expire);
 
-	if (dl_module_instance_data_alloc(&inst->driver_inst, inst, inst->driver_handle, driver_cs) < 0) return -1;
+	if (dl_module_instance_data_alloc(driver_inst, inst, *handle, driver_cs) < 0) return -1;
 
-	if (inst->driver->instantiate &&
-	    (inst->driver->instantiate(&inst->config, inst->driver_inst, driver_cs) < 0)) return -1;
+	if ((*driver)->instantiate &&
+	    ((*driver)->instantiate(config, *driver_inst, driver_cs) < 0)) return -1;
 
 #ifndef NDEBUG
-	if (inst->driver_inst) module_instance_read_only(inst->driver_inst, inst->driver->name);
+	if (*driver_inst) module_instance_read_only(*driver_inst, (*driver)->name);
 #endif
 
+	return 0;
+}
+
+/** Create a new rlm_cache_instance
+ *
+ */
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_cache_t	*inst = instance;
+	CONF_SECTION	*update;
+
+	inst->cs = conf;
+
+	rad_assert(inst->config.key);
+
+	if (cache_driver_load(&inst->driver_handle, &inst->driver, &inst->driver_inst,
+			      inst, conf, inst->config.driver_name, &inst->config) < 0) return -1;
+
+	/*
+	 *	Optional local tier in front of the main driver
+	 */
+	if (inst->l1_driver_name) {
+		CONF_SECTION *l1_cs = cf_section_sub_find(conf, "l1");
+
+		rad_assert(l1_cs);
+
+		if (!inst->driver->free) {
+			cf_log_err_cs(l1_cs, "Driver \"%s\" already stores entries locally, a local tier "
+				      "would not avoid any lookups", inst->driver->name);
+			return -1;
+		}
+
+		if (inst->l1_ttl == 0) {
+			cf_log_err_cs(l1_cs, "Must set 'ttl' to non-zero");
+			return -1;
+		}
+
+		inst->l1_config = inst->config;
+		inst->l1_config.driver_name = inst->l1_driver_name;
+		inst->l1_config.ttl = inst->l1_ttl;
+		inst->l1_config.max_entries = inst->l1_max_entries;
+		inst->l1_config.max_memory = inst->l1_max_memory;
+
+		if (cache_driver_load(&inst->l1_driver_handle, &inst->l1_driver, &inst->l1_driver_inst,
+				      inst, l1_cs, inst->l1_driver_name, &inst->l1_config) < 0) return -1;
+
+		if (inst->l1_driver->free) {
+			cf_log_err_cs(l1_cs, "Driver \"%s\" does not store entries locally, and cannot be "
+				      "used as a local tier", inst->l1_driver->name);
+			return -1;
+		}
+	}
+
 	if (inst->config.ttl == 0) {
 		cf_log_err_cs(conf, "Must set 'ttl' to non-zero");
 		return -1;
@@ -971,6 +1753,12 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->prefetch && !inst->driver->find_multi) {
+		cf_log_err_cs(conf, "Driver \"%s\" cannot retrieve multiple entries at once, 'prefetch' "
+			      "is not supported", inst->driver->name);
+		return -1;
+	}
+
 	update = cf_section_sub_find(inst->cs, "update");
 	if (!update) {
 		cf_log_err_cs(conf, "Must have an 'update' section in order to cache anything");
@@ -1008,9 +1796,12 @@ rad_module_t rlm_cache = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "cache",
 	.inst_size	= sizeof(rlm_cache_t),
+	.thread_inst_size	= sizeof(rlm_cache_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_cache_it,
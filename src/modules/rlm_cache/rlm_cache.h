@@ -51,6 +51,7 @@ typedef struct rlm_cache_config_t {
 	vp_tmpl_t		*key;			//!< What to expand to get the value of the key.
 	uint32_t		ttl;			//!< How long an entry is valid for.
 	uint32_t		max_entries;		//!< Maximum entries allowed.
+	size_t			max_memory;		//!< Soft limit on memory used by entries.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
 } rlm_cache_config_t;
@@ -69,6 +70,24 @@ typedef struct rlm_cache_t {
 	void			*driver_inst;		//!< Driver's instance data.
 	cache_driver_t const	*driver;		//!< Driver's exported interface.
 
+	char const		*l1_driver_name;	//!< Driver used for the local tier, or NULL if there's
+							//!< only one tier.
+	uint32_t		l1_ttl;			//!< Maximum time entries are kept in the local tier.
+	uint32_t		l1_max_entries;		//!< Maximum entries in the local tier.
+	size_t			l1_max_memory;		//!< Soft limit on memory used by the local tier.
+	rlm_cache_config_t	l1_config;		//!< Configuration passed to the local tier's driver.
+
+	dl_module_t const	*l1_driver_handle;	//!< Local tier driver's dl_handle.
+	void			*l1_driver_inst;	//!< Local tier driver's instance data.
+	cache_driver_t const	*l1_driver;		//!< Local tier driver's exported interface.
+
+	struct timeval		coalesce_timeout;	//!< How long to wait for another request to load a
+							//!< missing entry.  Zero disables coalescing.
+
+	vp_tmpl_t		**prefetch;		//!< Other keys to retrieve along with the first lookup
+							//!< in a request, if the driver can retrieve several
+							//!< keys at once.
+
 	vp_map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
@@ -144,6 +163,32 @@ typedef cache_status_t	(*cache_entry_find_t)(rlm_cache_entry_t **out, rlm_cache_
 					      void *instance, REQUEST *request, void *handle,
 					      uint8_t const *key, size_t key_len);
 
+/** Retrieve several entries from the cache in one operation
+ *
+ * Behaves as if #cache_entry_find_t was called once for each key, but lets the driver
+ * combine the lookups into a single round trip to the datastore.
+ *
+ * @note This callback is optional.  If it's not provided, prefetching is disabled.
+ *
+ * @param[out] out Array of num elements.  Each is set to the entry for the corresponding key,
+ *	or NULL if there was no entry for that key.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] request The current request.
+ * @param[in] handle the driver gave us when we called #cache_acquire_t, or NULL if no
+ *	#cache_acquire_t callback was provided.
+ * @param[in] keys to use to lookup cache entries.
+ * @param[in] key_lens the length of each key.
+ * @param[in] num number of keys.
+ * @return
+ *	- #CACHE_RECONNECT - If handle needs to be reinitialised/reconnected.
+ *	- #CACHE_ERROR - If the lookup couldn't be completed.  No entries are returned.
+ *	- #CACHE_OK - Lookup was successful, even if no entries were found.
+ */
+typedef cache_status_t	(*cache_entry_find_multi_t)(rlm_cache_entry_t **out, rlm_cache_config_t const *config,
+						    void *instance, REQUEST *request, void *handle,
+						    uint8_t const **keys, size_t const *key_lens, size_t num);
+
 /** Insert an entry into the cache
  *
  * Serialize (if necessary) the entry passed to us, and write it to the cache with
@@ -285,6 +330,8 @@ struct cache_driver {
 	cache_entry_free_t		free;			//!< (optional) Free memory used by an entry.
 
 	cache_entry_find_t		find;			//!< Retrieve an existing cache entry.
+	cache_entry_find_multi_t	find_multi;		//!< (optional) Retrieve several existing entries
+								//!< at once.
 	cache_entry_insert_t		insert;			//!< Add a new entry.
 	cache_entry_expire_t		expire;			//!< Remove an old entry.
 	cache_entry_set_ttl_t		set_ttl;		//!< (Optional) Update the TTL of an entry.
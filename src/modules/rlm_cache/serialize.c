@@ -25,9 +25,14 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/rad_assert.h>
 #include "rlm_cache.h"
 #include "serialize.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -89,6 +94,470 @@ finish:
 	return 0;
 }
 
+/*
+ *	Binary format
+ *
+ *	All integers are in network byte order.
+ *
+ *	Header
+ *	  4 bytes	magic, "\0FRC"
+ *	  1 byte	version
+ *	  8 bytes	created
+ *	  8 bytes	expires
+ *
+ *	Followed by zero or more maps.
+ *	  1 byte	operator
+ *	  1 byte	request reference
+ *	  1 byte	list
+ *	  1 byte	tag
+ *	  1 byte	attribute reference type (CACHE_BINARY_REF_*)
+ *	  ...		vendor and attribute numbers (4 bytes each),
+ *			or the attribute name (2 byte length, then the name)
+ *	  1 byte	value type, or PW_TYPE_INVALID if the value is
+ *			in its printed form
+ *	  4 bytes	value length
+ *	  ...		value
+ */
+static uint8_t const cache_binary_magic[] = { 0x00, 'F', 'R', 'C' };
+
+#define CACHE_BINARY_VERSION	1
+#define CACHE_BINARY_HDR_LEN	(sizeof(cache_binary_magic) + 1 + 8 + 8)
+
+#define CACHE_BINARY_REF_NUM	0	//!< Attribute is referenced by vendor and attribute number.
+#define CACHE_BINARY_REF_NAME	1	//!< Attribute is referenced by name.
+
+static uint8_t *cache_binary_put(uint8_t *p, uint64_t num, size_t len)
+{
+	size_t i;
+
+	for (i = len; i > 0; i--) {
+		p[i - 1] = num & 0xff;
+		num >>= 8;
+	}
+
+	return p + len;
+}
+
+static uint64_t cache_binary_get(uint8_t const *p, size_t len)
+{
+	uint64_t	num = 0;
+	size_t		i;
+
+	for (i = 0; i < len; i++) num = (num << 8) | p[i];
+
+	return num;
+}
+
+/** Return the width of the binary encoding of a fixed width type
+ *
+ * @return
+ *	- Width of the encoded value.
+ *	- 0 if the type has no fixed width binary encoding.
+ */
+static size_t cache_binary_fixed_width(PW_TYPE type)
+{
+	switch (type) {
+	case PW_TYPE_BOOLEAN:
+	case PW_TYPE_BYTE:
+		return 1;
+
+	case PW_TYPE_SHORT:
+		return 2;
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_SIGNED:
+	case PW_TYPE_DATE:
+	case PW_TYPE_IPV4_ADDR:
+		return 4;
+
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_IFID:
+		return 8;
+
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_IPV4_PREFIX:
+		return 6;
+
+	case PW_TYPE_IPV6_ADDR:
+		return 16;
+
+	case PW_TYPE_IPV6_PREFIX:
+		return 18;
+
+	default:
+		return 0;
+	}
+}
+
+/** Serialize a cache entry in the compact binary format
+ *
+ * Attributes are referenced by number, and values are written in their
+ * binary form, so decoding doesn't need to tokenise or parse anything.
+ *
+ * @param ctx to alloc the buffer in.
+ * @param out Where to write a pointer to the serialized entry.  Length is
+ *	given by talloc_array_length.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c)
+{
+	vp_map_t	*map;
+	uint8_t		*buff, *p;
+	size_t		len = CACHE_BINARY_HDR_LEN;
+	TALLOC_CTX	*value_pool = NULL;
+
+	/*
+	 *	Work out how much space we need
+	 */
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da = map->lhs->tmpl_da;
+		value_box_t const	*vb = &map->rhs->tmpl_value_box;
+
+		len += 5 + 1 + 4;
+		if (fr_dict_attr_by_num(NULL, da->vendor, da->attr) == da) {
+			len += 8;
+		} else {
+			len += 2 + strlen(da->name);
+		}
+
+		switch (vb->type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+		case PW_TYPE_ABINARY:
+			len += vb->length;
+			break;
+
+		default:
+			len += cache_binary_fixed_width(vb->type);
+			break;
+		}
+	}
+
+	buff = p = talloc_array(ctx, uint8_t, len);
+	if (!buff) return -1;
+
+	memcpy(p, cache_binary_magic, sizeof(cache_binary_magic));
+	p += sizeof(cache_binary_magic);
+	*p++ = CACHE_BINARY_VERSION;
+	p = cache_binary_put(p, (uint64_t)c->created, 8);
+	p = cache_binary_put(p, (uint64_t)c->expires, 8);
+
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da = map->lhs->tmpl_da;
+		value_box_t const	*vb = &map->rhs->tmpl_value_box;
+		value_box_t		tmp;
+		uint8_t const		*value;
+		size_t			value_len;
+		size_t			name_len;
+		char			*printed;
+
+		if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->rhs->type != TMPL_TYPE_DATA)) {
+			fr_strerror_printf("Only maps of attributes to values can be serialized");
+		error:
+			talloc_free(value_pool);
+			talloc_free(buff);
+			return -1;
+		}
+
+		*p++ = map->op;
+		*p++ = map->lhs->tmpl_request;
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t)map->lhs->tmpl_tag;
+
+		if (fr_dict_attr_by_num(NULL, da->vendor, da->attr) == da) {
+			*p++ = CACHE_BINARY_REF_NUM;
+			p = cache_binary_put(p, da->vendor, 4);
+			p = cache_binary_put(p, da->attr, 4);
+		} else {
+			name_len = strlen(da->name);
+
+			*p++ = CACHE_BINARY_REF_NAME;
+			p = cache_binary_put(p, name_len, 2);
+			memcpy(p, da->name, name_len);
+			p += name_len;
+		}
+
+		switch (vb->type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+		case PW_TYPE_ABINARY:
+			value = vb->type == PW_TYPE_ABINARY ? vb->datum.filter : vb->datum.octets;
+			value_len = vb->length;
+			break;
+
+		case PW_TYPE_BOOLEAN:
+			tmp.datum.byte = vb->datum.boolean ? 1 : 0;
+			value = &tmp.datum.byte;
+			value_len = 1;
+			break;
+
+		case PW_TYPE_SHORT:
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_SIGNED:
+		case PW_TYPE_DATE:
+		case PW_TYPE_INTEGER64:
+			if (value_box_hton(&tmp, vb) < 0) goto error;
+			value = (uint8_t const *)&tmp.datum;
+			value_len = cache_binary_fixed_width(vb->type);
+			break;
+
+		default:
+			value_len = cache_binary_fixed_width(vb->type);
+			if (value_len) {
+				value = (uint8_t const *)&vb->datum;
+				break;
+			}
+
+			/*
+			 *	No binary form, fall back to the printed
+			 *	representation.  This needs more space.
+			 */
+			if (!value_pool) {
+				value_pool = talloc_pool(NULL, 256);
+				if (!value_pool) goto error;
+			}
+
+			printed = value_box_asprint(value_pool, vb, '\0');
+			if (!printed) goto error;
+			value = (uint8_t const *)printed;
+			value_len = talloc_array_length(printed) - 1;
+
+			len += value_len;
+			{
+				size_t	offset = p - buff;
+				uint8_t	*tmp_buff;
+
+				tmp_buff = talloc_realloc(ctx, buff, uint8_t, len);
+				if (!tmp_buff) goto error;
+				buff = tmp_buff;
+				p = buff + offset;
+			}
+
+			*p++ = PW_TYPE_INVALID;
+			p = cache_binary_put(p, value_len, 4);
+			memcpy(p, value, value_len);
+			p += value_len;
+			continue;
+		}
+
+		*p++ = vb->type;
+		p = cache_binary_put(p, value_len, 4);
+		if (value_len) memcpy(p, value, value_len);
+		p += value_len;
+	}
+	talloc_free(value_pool);
+
+	rad_assert((size_t)(p - buff) == len);
+	*out = buff;
+
+	return 0;
+}
+
+/** Converts an entry in the compact binary format back into a structure
+ *
+ * @param c Cache entry to populate (should already be allocated)
+ * @param in Binary representation of the cache entry.
+ * @param inlen Length of the data in in.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	uint8_t const	*p = in, *end = in + inlen;
+	vp_map_t	**last = &c->maps;
+
+	if ((inlen < CACHE_BINARY_HDR_LEN) || (memcmp(p, cache_binary_magic, sizeof(cache_binary_magic)) != 0)) {
+		fr_strerror_printf("Not a binary cache entry");
+		return -1;
+	}
+	p += sizeof(cache_binary_magic);
+
+	if (*p != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported binary cache entry version %u", *p);
+		return -1;
+	}
+	p++;
+
+	c->created = (time_t)cache_binary_get(p, 8);
+	p += 8;
+	c->expires = (time_t)cache_binary_get(p, 8);
+	p += 8;
+
+	while (p < end) {
+		vp_map_t		*map;
+		fr_dict_attr_t const	*da;
+		FR_TOKEN		op;
+		request_refs_t		request_ref;
+		pair_lists_t		list;
+		int8_t			tag;
+		PW_TYPE			type;
+		size_t			len;
+		value_box_t		*vb;
+
+		if ((end - p) < 5) {
+		truncated:
+			fr_strerror_printf("Binary cache entry truncated");
+			return -1;
+		}
+		op = p[0];
+		request_ref = p[1];
+		list = p[2];
+		tag = (int8_t)p[3];
+
+		switch (p[4]) {
+		case CACHE_BINARY_REF_NUM:
+			p += 5;
+			if ((end - p) < 8) goto truncated;
+			da = fr_dict_attr_by_num(NULL, cache_binary_get(p, 4), cache_binary_get(p + 4, 4));
+			if (!da) {
+				fr_strerror_printf("Unknown attribute %u (vendor %u) in binary cache entry.  "
+						   "Check local dictionaries",
+						   (unsigned int)cache_binary_get(p + 4, 4),
+						   (unsigned int)cache_binary_get(p, 4));
+				return -1;
+			}
+			p += 8;
+			break;
+
+		case CACHE_BINARY_REF_NAME:
+		{
+			char name[FR_DICT_ATTR_MAX_NAME_LEN + 1];
+
+			p += 5;
+			if ((end - p) < 2) goto truncated;
+			len = cache_binary_get(p, 2);
+			p += 2;
+			if ((size_t)(end - p) < len) goto truncated;
+			if (len >= sizeof(name)) {
+				fr_strerror_printf("Attribute name too long in binary cache entry");
+				return -1;
+			}
+			memcpy(name, p, len);
+			name[len] = '\0';
+			p += len;
+
+			da = fr_dict_attr_by_name(NULL, name);
+			if (!da) {
+				fr_strerror_printf("Unknown attribute \"%s\" in binary cache entry.  "
+						   "Check local dictionaries", name);
+				return -1;
+			}
+		}
+			break;
+
+		default:
+			fr_strerror_printf("Invalid attribute reference type %u in binary cache entry", p[4]);
+			return -1;
+		}
+
+		if ((end - p) < 5) goto truncated;
+		type = p[0];
+		len = cache_binary_get(p + 1, 4);
+		p += 5;
+		if ((size_t)(end - p) < len) goto truncated;
+
+		if ((type != PW_TYPE_INVALID) && (type != da->type)) {
+			fr_strerror_printf("Attribute \"%s\" has type %s in binary cache entry, but %s in "
+					   "the dictionary", da->name,
+					   fr_int2str(dict_attr_types, type, "<INVALID>"),
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"));
+			return -1;
+		}
+
+		map = talloc_zero(c, vp_map_t);
+		if (!map) return -1;
+		map->op = op;
+
+		map->lhs = talloc(map, vp_tmpl_t);
+		map->rhs = talloc(map, vp_tmpl_t);
+		if (!map->lhs || !map->rhs) {
+		error:
+			talloc_free(map);
+			return -1;
+		}
+		tmpl_from_da(map->lhs, da, tag, NUM_ANY, request_ref, list);
+		tmpl_init(map->rhs, TMPL_TYPE_DATA, NULL, 0, T_BARE_WORD);
+
+		vb = &map->rhs->tmpl_value_box;
+
+		switch (type) {
+		case PW_TYPE_INVALID:
+			type = da->type;
+			if (value_box_from_str(map->rhs, vb, &type, da, (char const *)p, len, '\0') < 0) goto error;
+			break;
+
+		case PW_TYPE_STRING:
+		{
+			char *str;
+
+			str = talloc_array(map->rhs, char, len + 1);
+			if (!str) goto error;
+			memcpy(str, p, len);
+			str[len] = '\0';
+
+			vb->datum.strvalue = str;
+			vb->length = len;
+		}
+			break;
+
+		case PW_TYPE_OCTETS:
+			vb->datum.octets = talloc_memdup(map->rhs, p, len);
+			if (!vb->datum.octets) goto error;
+			vb->length = len;
+			break;
+
+		case PW_TYPE_ABINARY:
+			if (len > sizeof(vb->datum.filter)) goto bad_length;
+			memcpy(vb->datum.filter, p, len);
+			vb->length = len;
+			break;
+
+		case PW_TYPE_BOOLEAN:
+			if (len != 1) goto bad_length;
+			vb->datum.boolean = (p[0] != 0);
+			vb->length = 1;
+			break;
+
+		default:
+			if (!len || (len != cache_binary_fixed_width(type))) {
+			bad_length:
+				fr_strerror_printf("Invalid value length %zu for attribute \"%s\" in binary cache entry",
+						   len, da->name);
+				goto error;
+			}
+			memcpy(&vb->datum, p, len);
+			vb->length = len;
+			vb->type = type;
+
+			switch (type) {
+			case PW_TYPE_SHORT:
+			case PW_TYPE_INTEGER:
+			case PW_TYPE_SIGNED:
+			case PW_TYPE_DATE:
+			case PW_TYPE_INTEGER64:
+				/* hton and ntoh are the same operation */
+				if (value_box_hton(vb, vb) < 0) goto error;
+				break;
+
+			default:
+				break;
+			}
+			break;
+		}
+		vb->type = type;
+		p += len;
+
+		*last = map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+}
+
 /** Converts a serialized cache entry back into a structure
  *
  * @param c Cache entry to populate (should already be allocated)
@@ -104,6 +573,14 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 	vp_map_t	**last = &c->maps;
 	char		*p, *q;
 
+	/*
+	 *	Binary entries start with a NUL, which can't appear
+	 *	in the text format.
+	 */
+	if ((inlen >= (ssize_t)CACHE_BINARY_HDR_LEN) && (memcmp(in, cache_binary_magic, sizeof(cache_binary_magic)) == 0)) {
+		return cache_deserialize_binary(c, (uint8_t const *)in, (size_t)inlen);
+	}
+
 	if (inlen < 0) inlen = strlen(in);
 
 	p = in;
@@ -172,3 +649,282 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	return 0;
 }
+
+/*
+ *	Snapshot file format
+ *
+ *	All integers are in network byte order.
+ *
+ *	Header
+ *	  4 bytes	magic, "\0FRS"
+ *	  1 byte	version
+ *
+ *	Followed by zero or more entries.
+ *	  4 bytes	key length
+ *	  4 bytes	entry length
+ *	  ...		key
+ *	  ...		entry, in the binary format produced by cache_serialize_binary
+ */
+static uint8_t const cache_snapshot_magic[] = { 0x00, 'F', 'R', 'S' };
+
+#define CACHE_SNAPSHOT_VERSION	1
+#define CACHE_SNAPSHOT_HDR_LEN	(sizeof(cache_snapshot_magic) + 1)
+
+struct cache_snapshot {
+	char const	*file;		//!< The snapshot will be renamed to, when it's complete.
+	char const	*tmp;		//!< File we're writing to.
+	FILE		*fp;
+	uint32_t	num;		//!< Entries written.
+};
+
+/** Close the temporary file if the snapshot was abandoned
+ *
+ */
+static int _cache_snapshot_free(cache_snapshot_t *snap)
+{
+	if (snap->fp) {
+		fclose(snap->fp);
+		unlink(snap->tmp);
+	}
+
+	return 0;
+}
+
+/** Start writing a snapshot of a cache
+ *
+ * Entries are written to a temporary file, which replaces the snapshot
+ * when #cache_snapshot_commit is called.  If the snapshot is freed before
+ * then, the temporary file is removed, and any old snapshot is left alone.
+ *
+ * @param ctx to allocate the snapshot in.
+ * @param file to write the snapshot to.
+ * @return
+ *	- A new snapshot.
+ *	- NULL on error.
+ */
+cache_snapshot_t *cache_snapshot_alloc(TALLOC_CTX *ctx, char const *file)
+{
+	cache_snapshot_t	*snap;
+	int			fd;
+
+	snap = talloc_zero(ctx, cache_snapshot_t);
+	if (!snap) return NULL;
+
+	snap->file = talloc_strdup(snap, file);
+	snap->tmp = talloc_asprintf(snap, "%s.tmp", file);
+	if (!snap->file || !snap->tmp) {
+		talloc_free(snap);
+		return NULL;
+	}
+
+	/*
+	 *	Entries may contain credentials, so don't let
+	 *	anyone else read them.
+	 */
+	fd = open(snap->tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", snap->tmp, fr_syserror(errno));
+		talloc_free(snap);
+		return NULL;
+	}
+
+	snap->fp = fdopen(fd, "w");
+	if (!snap->fp) {
+		fr_strerror_printf("Failed opening \"%s\": %s", snap->tmp, fr_syserror(errno));
+		close(fd);
+		unlink(snap->tmp);
+		talloc_free(snap);
+		return NULL;
+	}
+	talloc_set_destructor(snap, _cache_snapshot_free);
+
+	if ((fwrite(cache_snapshot_magic, sizeof(cache_snapshot_magic), 1, snap->fp) != 1) ||
+	    (fputc(CACHE_SNAPSHOT_VERSION, snap->fp) == EOF)) {
+		fr_strerror_printf("Failed writing \"%s\": %s", snap->tmp, fr_syserror(errno));
+		talloc_free(snap);
+		return NULL;
+	}
+
+	return snap;
+}
+
+/** Add an entry to a snapshot
+ *
+ * @param snap to add the entry to.
+ * @param c to add.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The snapshot should be abandoned.
+ */
+int cache_snapshot_add(cache_snapshot_t *snap, rlm_cache_entry_t const *c)
+{
+	uint8_t		*data;
+	uint8_t		hdr[8];
+	size_t		len;
+
+	if (cache_serialize_binary(NULL, &data, c) < 0) return -1;
+	len = talloc_array_length(data);
+
+	cache_binary_put(hdr, c->key_len, 4);
+	cache_binary_put(hdr + 4, len, 4);
+
+	if ((fwrite(hdr, sizeof(hdr), 1, snap->fp) != 1) ||
+	    (c->key_len && (fwrite(c->key, c->key_len, 1, snap->fp) != 1)) ||
+	    (fwrite(data, len, 1, snap->fp) != 1)) {
+		fr_strerror_printf("Failed writing \"%s\": %s", snap->tmp, fr_syserror(errno));
+		talloc_free(data);
+		return -1;
+	}
+	talloc_free(data);
+	snap->num++;
+
+	return 0;
+}
+
+/** Finish a snapshot, replacing any old snapshot
+ *
+ * The snapshot is freed whether or not this succeeds.
+ *
+ * @param snap to finish.
+ * @return
+ *	- The number of entries written.
+ *	- -1 on failure.
+ */
+int cache_snapshot_commit(cache_snapshot_t *snap)
+{
+	int ret;
+
+	ret = fclose(snap->fp);
+	snap->fp = NULL;
+	if (ret != 0) {
+		fr_strerror_printf("Failed writing \"%s\": %s", snap->tmp, fr_syserror(errno));
+	error:
+		unlink(snap->tmp);
+		talloc_free(snap);
+		return -1;
+	}
+
+	if (rename(snap->tmp, snap->file) < 0) {
+		fr_strerror_printf("Failed renaming \"%s\" to \"%s\": %s",
+				   snap->tmp, snap->file, fr_syserror(errno));
+		goto error;
+	}
+
+	ret = snap->num;
+	talloc_free(snap);
+
+	return ret;
+}
+
+/** Load the entries in a snapshot
+ *
+ * The file is mapped, and each entry is decoded as it's passed to the
+ * driver, so the whole snapshot is never copied into the heap.  Entries
+ * which have expired are skipped.
+ *
+ * The snapshot is removed once it's loaded.  Entries which change after
+ * the server starts would otherwise be resurrected if the server were to
+ * stop without writing a new snapshot.
+ *
+ * @param file to load.
+ * @param now Entries which expired before this are skipped.
+ * @param alloc Called to allocate each entry.
+ * @param insert Called to insert each entry.  If it fails, the entry is freed.
+ * @param uctx passed to alloc and insert.
+ * @return
+ *	- The number of entries loaded.  0 if there is no snapshot.
+ *	- -1 on failure.
+ */
+int cache_snapshot_load(char const *file, time_t now,
+			cache_snapshot_alloc_t alloc, cache_snapshot_insert_t insert, void *uctx)
+{
+	int		fd, loaded = 0;
+	struct stat	st;
+	uint8_t		*map;
+	uint8_t const	*p, *end;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+
+		fr_strerror_printf("Failed opening \"%s\": %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed reading \"%s\": %s", file, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size < CACHE_SNAPSHOT_HDR_LEN) {
+		fr_strerror_printf("\"%s\" is not a cache snapshot", file);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping \"%s\": %s", file, fr_syserror(errno));
+		return -1;
+	}
+	p = map;
+	end = map + st.st_size;
+
+	if ((memcmp(p, cache_snapshot_magic, sizeof(cache_snapshot_magic)) != 0) ||
+	    (p[sizeof(cache_snapshot_magic)] != CACHE_SNAPSHOT_VERSION)) {
+		fr_strerror_printf("\"%s\" is not a cache snapshot", file);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	p += CACHE_SNAPSHOT_HDR_LEN;
+
+	(void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	while (p < end) {
+		rlm_cache_entry_t	*c;
+		size_t			key_len, len;
+
+		if ((end - p) < 8) {
+		truncated:
+			fr_strerror_printf("\"%s\" is truncated", file);
+			munmap(map, st.st_size);
+			return -1;
+		}
+		key_len = cache_binary_get(p, 4);
+		len = cache_binary_get(p + 4, 4);
+		p += 8;
+
+		if ((size_t)(end - p) < (key_len + len)) goto truncated;
+
+		c = alloc(uctx);
+		if (!c) {
+			munmap(map, st.st_size);
+			return -1;
+		}
+
+		c->key = talloc_memdup(c, p, key_len);
+		c->key_len = key_len;
+		if (!c->key || (cache_deserialize_binary(c, p + key_len, len) < 0)) {
+			talloc_free(c);
+			munmap(map, st.st_size);
+			return -1;
+		}
+		p += key_len + len;
+
+		if ((c->expires < now) || (insert(uctx, c) < 0)) {
+			talloc_free(c);
+			continue;
+		}
+		loaded++;
+	}
+	munmap(map, st.st_size);
+
+	if (unlink(file) < 0) {
+		fr_strerror_printf("Failed removing \"%s\": %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	return loaded;
+}
@@ -27,3 +27,28 @@ RCSIDH(serialize_h, "$Id$")
 
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen);
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c);
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
+
+typedef struct cache_snapshot cache_snapshot_t;
+
+/** Allocate an entry to load from a snapshot
+ *
+ * @param uctx passed to #cache_snapshot_load.
+ * @return a new entry, or NULL on error.
+ */
+typedef rlm_cache_entry_t *(*cache_snapshot_alloc_t)(void *uctx);
+
+/** Insert an entry loaded from a snapshot
+ *
+ * @param uctx passed to #cache_snapshot_load.
+ * @param c entry to insert.
+ * @return 0 on success, -1 if the entry wasn't inserted.
+ */
+typedef int (*cache_snapshot_insert_t)(void *uctx, rlm_cache_entry_t *c);
+
+cache_snapshot_t *cache_snapshot_alloc(TALLOC_CTX *ctx, char const *file);
+int cache_snapshot_add(cache_snapshot_t *snap, rlm_cache_entry_t const *c);
+int cache_snapshot_commit(cache_snapshot_t *snap);
+int cache_snapshot_load(char const *file, time_t now,
+			cache_snapshot_alloc_t alloc, cache_snapshot_insert_t insert, void *uctx);
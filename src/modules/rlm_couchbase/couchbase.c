@@ -28,12 +28,51 @@ RCSID("$Id$")
 #define LOG_PREFIX "rlm_couchbase - "
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 
 #include <libcouchbase/couchbase.h>
 #include "../rlm_json/json.h"
 
 #include "couchbase.h"
 
+/** Finish an operation scheduled with one of the async functions
+ *
+ * Resumes the request waiting on the operation, or if that request has
+ * been cancelled, frees the cookie.
+ *
+ * @param c Cookie the operation was scheduled with.
+ */
+static void couchbase_cookie_done(cookie_t *c)
+{
+	if (!c || !c->async) return;
+
+	if (!c->request) {
+		talloc_free(c);
+		return;
+	}
+
+	unlang_resumable(c->request);
+}
+
+/** Couchbase callback for the end of bootstrapping
+ *
+ * Only used for instances which aren't waited on.  If bootstrapping fails,
+ * operations scheduled on the instance fail in their callbacks.
+ *
+ * @param instance Couchbase connection instance.
+ * @param error    Couchbase error object.
+ */
+static void couchbase_bootstrap_callback(lcb_t instance, lcb_error_t error)
+{
+	if (error != LCB_SUCCESS) {
+		/* log error */
+		ERROR("(bootstrap_callback) %s (0x%x)", lcb_strerror(instance, error), error);
+		return;
+	}
+
+	DEBUG2("(bootstrap_callback) connected to cluster");
+}
+
 /** Couchbase callback for cluster statistics requests
  *
  * @param instance Couchbase connection instance.
@@ -63,12 +102,21 @@ void couchbase_stat_callback(lcb_t instance, const void *cookie, lcb_error_t err
 void couchbase_store_callback(lcb_t instance, const void *cookie, lcb_storage_t operation,
 			      lcb_error_t error, const lcb_store_resp_t *resp)
 {
+	cookie_u cu;                            /* union of const and non const pointers */
+	cu.cdata = cookie;                      /* set const union member to cookie passed from couchbase */
+	cookie_t *c = (cookie_t *) cu.data;     /* set our cookie struct using non-const member */
+
 	if (error != LCB_SUCCESS) {
 		/* log error */
 		ERROR("(store_callback) %s (0x%x)", lcb_strerror(instance, error), error);
 	}
+
+	/* record result and resume request */
+	if (c) {
+		c->error = error;
+		couchbase_cookie_done(c);
+	}
 	/* silent compiler */
-	(void)cookie;
 	(void)operation;
 	(void)resp;
 }
@@ -127,6 +175,10 @@ void couchbase_get_callback(lcb_t instance, const void *cookie, lcb_error_t erro
 		ERROR("(get_callback) %s (0x%x)", lcb_strerror(instance, error), error);
 		break;
 	}
+
+	/* record result and resume request */
+	c->error = error;
+	couchbase_cookie_done(c);
 }
 
 /** Couchbase callback for http (view) operations
@@ -184,17 +236,20 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
 /** Initialize a Couchbase connection instance
  *
  * Initialize all information relating to a Couchbase instance and configure available method callbacks.
- * This function forces synchronous operation and will wait for a connection or timeout.
+ * When no IO plugin is passed, this function forces synchronous operation and will wait for a
+ * connection or timeout.  Otherwise the connection is established as the plugin's event loop
+ * is serviced, and operations scheduled in the meantime are queued until it's ready.
  *
  * @param instance Empty (un-allocated) Couchbase instance object.
+ * @param io         IO plugin to use (NULL for the libcouchbase default, and wait for the connection).
  * @param host       The Couchbase server or list of servers.
  * @param bucket     The Couchbase bucket to associate with the instance.
  * @param pass       The Couchbase bucket password (NULL if none).
- * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @param timeout    Maximum time to wait for obtaining the initial configuration (0 for the default).
  * @return           Couchbase error object.
  */
-lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *pass,
-				      lcb_uint32_t timeout)
+lcb_error_t couchbase_init_connection(lcb_t *instance, lcb_io_opt_t io, const char *host, const char *bucket,
+				      const char *pass, lcb_uint32_t timeout)
 {
 	lcb_error_t error;                      /* couchbase command return */
 	struct lcb_create_st options;           /* init create struct */
@@ -205,6 +260,7 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	/* assign couchbase create options */
 	options.v.v0.host = host;
 	options.v.v0.bucket = bucket;
+	options.v.v0.io = io;
 
 	/* assign user and password if they were both passed */
 	if (bucket != NULL && pass != NULL) {
@@ -216,8 +272,10 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	error = lcb_create(instance, &options);
 	if (error != LCB_SUCCESS) return error;
 
-	error = lcb_cntl(*instance, LCB_CNTL_SET, LCB_CNTL_CONFIGURATION_TIMEOUT, &timeout);
-	if (error != LCB_SUCCESS) return error;
+	if (timeout) {
+		error = lcb_cntl(*instance, LCB_CNTL_SET, LCB_CNTL_CONFIGURATION_TIMEOUT, &timeout);
+		if (error != LCB_SUCCESS) return error;
+	}
 
 	/* initiate connection */
 	error = lcb_connect(*instance);
@@ -228,6 +286,13 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	lcb_set_store_callback(*instance, couchbase_store_callback);
 	lcb_set_get_callback(*instance, couchbase_get_callback);
 	lcb_set_http_data_callback(*instance, couchbase_http_data_callback);
+
+	/* connection completes in the event loop */
+	if (io) {
+		lcb_set_bootstrap_callback(*instance, couchbase_bootstrap_callback);
+		return LCB_SUCCESS;
+	}
+
 	/* wait on connection */
 	lcb_wait(*instance);
 
@@ -266,19 +331,18 @@ lcb_error_t couchbase_server_stats(lcb_t instance, const void *cookie)
 	return error;
 }
 
-/** Store a document by key in Couchbase
- *
- * Setup and execute a Couchbase set operation and wait for the result.
+/** Schedule a Couchbase set operation
  *
  * @param  instance Couchbase connection instance.
+ * @param  cookie   Couchbase cookie for returning information from callbacks (may be NULL).
  * @param  key      Document key to store in the database.
  * @param  document Document body to store in the database.
  * @param  expire   Expiration time for the document (0 = never)
  * @return          Couchbase error object.
  */
-lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *document, int expire)
+static lcb_error_t couchbase_set_key_schedule(lcb_t instance, cookie_t *cookie, const char *key,
+					      const char *document, int expire)
 {
-	lcb_error_t error;                  /* couchbase command return */
 	lcb_store_cmd_t cmd;                /* store command stuct */
 	const lcb_store_cmd_t *commands[1]; /* store commands array */
 
@@ -295,7 +359,24 @@ lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *docum
 	cmd.v.v0.operation = LCB_SET;
 
 	/* store key/document in couchbase */
-	if ((error = lcb_store(instance, NULL, 1, commands)) == LCB_SUCCESS) {
+	return lcb_store(instance, cookie, 1, commands);
+}
+
+/** Store a document by key in Couchbase
+ *
+ * Setup and execute a Couchbase set operation and wait for the result.
+ *
+ * @param  instance Couchbase connection instance.
+ * @param  key      Document key to store in the database.
+ * @param  document Document body to store in the database.
+ * @param  expire   Expiration time for the document (0 = never)
+ * @return          Couchbase error object.
+ */
+lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *document, int expire)
+{
+	lcb_error_t error;                  /* couchbase command return */
+
+	if ((error = couchbase_set_key_schedule(instance, NULL, key, document, expire)) == LCB_SUCCESS) {
 		/* enter event loop on success */
 		lcb_wait(instance);
 	}
@@ -304,6 +385,27 @@ lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *docum
 	return error;
 }
 
+/** Store a document by key in Couchbase without waiting for the result
+ *
+ * The document is copied before this function returns.  When the operation
+ * completes, the result is written to the cookie and the cookie's request
+ * is marked resumable.
+ *
+ * @param  instance Couchbase connection instance (using an event loop IO plugin).
+ * @param  cookie   Allocated with #couchbase_cookie_alloc.
+ * @param  key      Document key to store in the database.
+ * @param  document Document body to store in the database.
+ * @param  expire   Expiration time for the document (0 = never)
+ * @return          Couchbase error object.
+ */
+lcb_error_t couchbase_set_key_async(lcb_t instance, cookie_t *cookie, const char *key, const char *document,
+				    int expire)
+{
+	cookie->error = LCB_SUCCESS;
+
+	return couchbase_set_key_schedule(instance, cookie, key, document, expire);
+}
+
 /** Retrieve a document by key from Couchbase
  *
  * Setup and execute a Couchbase get request and wait for the result.
@@ -350,11 +452,94 @@ lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *ke
 
 	/* free token */
 	json_tokener_free(c->jtok);
+	c->jtok = NULL;
 
 	/* return error */
 	return error;
 }
 
+/** Free any json-c objects still held by an async cookie
+ *
+ */
+static int _couchbase_cookie_free(cookie_t *c)
+{
+	if (c->jobj) json_object_put(c->jobj);
+	if (c->jtok) json_tokener_free(c->jtok);
+
+	return 0;
+}
+
+/** Allocate a cookie for operations scheduled without waiting for the result
+ *
+ * The cookie should be allocated in a context which outlives the request,
+ * as if the request is cancelled before the operation completes, the
+ * request should be set to NULL, and the cookie is freed by the callback.
+ *
+ * @param  ctx     to allocate the cookie in.
+ * @param  request to resume when operations complete.
+ * @return
+ *	- New cookie.
+ *	- NULL on error.
+ */
+cookie_t *couchbase_cookie_alloc(TALLOC_CTX *ctx, REQUEST *request)
+{
+	cookie_t *c;
+
+	c = talloc_zero(ctx, cookie_t);
+	if (!c) return NULL;
+	talloc_set_destructor(c, _couchbase_cookie_free);
+
+	c->jerr = json_tokener_success;
+	c->async = true;
+	c->request = request;
+
+	return c;
+}
+
+/** Retrieve a document by key from Couchbase without waiting for the result
+ *
+ * When the operation completes, the parsed document (if any) and the result
+ * are written to the cookie, and the cookie's request is marked resumable.
+ *
+ * @param  instance Couchbase connection instance (using an event loop IO plugin).
+ * @param  cookie   Allocated with #couchbase_cookie_alloc.
+ * @param  key      Document key to fetch.
+ * @return          Couchbase error object.
+ */
+lcb_error_t couchbase_get_key_async(lcb_t instance, cookie_t *cookie, const char *key)
+{
+	lcb_get_cmd_t cmd;                   /* get command struct */
+	const lcb_get_cmd_t *commands[1];    /* get commands array */
+
+	/* init commands */
+	commands[0] = &cmd;
+	memset(&cmd, 0, sizeof(cmd));
+
+	/* populate command struct */
+	cmd.v.v0.key = key;
+	cmd.v.v0.nkey = strlen(cmd.v.v0.key);
+
+	/* reset any previous result */
+	if (cookie->jobj) {
+		json_object_put(cookie->jobj);
+		cookie->jobj = NULL;
+	}
+	cookie->jerr = json_tokener_success;
+	cookie->error = LCB_SUCCESS;
+
+	/* create token */
+	if (!cookie->jtok) {
+		cookie->jtok = json_tokener_new();
+	} else {
+		json_tokener_reset(cookie->jtok);
+	}
+
+	/* debugging */
+	DEBUG3("fetching document %s", key);
+
+	return lcb_get(instance, cookie, 1, commands);
+}
+
 /** Query a Couchbase design document view
  *
  * Setup and execute a Couchbase view request and wait for the result.
@@ -29,9 +29,18 @@
 
 RCSIDH(couchbase_h, "$Id$")
 
+#include <freeradius-devel/event.h>
 #include <libcouchbase/couchbase.h>
 #include "../rlm_json/json.h"
 
+/*
+ *	Driving libcouchbase from the worker's event list needs
+ *	the version 2 IO plugin API.
+ */
+#if defined(LCB_VERSION) && (LCB_VERSION >= 0x020500)
+#  define HAVE_COUCHBASE_ASYNC 1
+#endif
+
 /** Information relating to the parsing of Couchbase document payloads
  *
  * This structure holds various references to json-c objects used when parsing
@@ -41,6 +50,11 @@ typedef struct cookie_t {
 	json_object *jobj;              //!< JSON objects handled by the json-c library.
 	json_tokener *jtok;             //!< JSON tokener objects handled by the json-c library.
 	enum json_tokener_error jerr;   //!< Error values produced by the json-c library.
+
+	bool async;                     //!< Operation was scheduled without waiting for the result.
+	REQUEST *request;               //!< Request to resume when the operation completes
+	                                //!< (NULL if the request was cancelled).
+	lcb_error_t error;              //!< Result of the operation.
 } cookie_t;
 
 /** Union of constant and non-constant pointers
@@ -70,8 +84,8 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance,
 	const void *cookie, lcb_error_t error, const lcb_http_resp_t *resp);
 
 /* create a couchbase instance and connect to the cluster */
-lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *pass,
-				      lcb_uint32_t timeout);
+lcb_error_t couchbase_init_connection(lcb_t *instance, lcb_io_opt_t io, const char *host, const char *bucket,
+				      const char *pass, lcb_uint32_t timeout);
 
 /* get server statistics */
 lcb_error_t couchbase_server_stats(lcb_t instance, const void *cookie);
@@ -82,6 +96,21 @@ lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *docum
 /* pull document from couchbase by key */
 lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *key);
 
+/* allocate a cookie for an operation which resumes a request */
+cookie_t *couchbase_cookie_alloc(TALLOC_CTX *ctx, REQUEST *request);
+
+/* schedule a store without waiting for the result */
+lcb_error_t couchbase_set_key_async(lcb_t instance, cookie_t *cookie, const char *key, const char *document,
+				    int expire);
+
+/* schedule a fetch without waiting for the result */
+lcb_error_t couchbase_get_key_async(lcb_t instance, cookie_t *cookie, const char *key);
+
+#ifdef HAVE_COUCHBASE_ASYNC
+/* allocate an io plugin which uses the event list of the calling thread */
+lcb_io_opt_t couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el);
+#endif
+
 /* query a couchbase view via http */
 lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char *path, const char *post);
 
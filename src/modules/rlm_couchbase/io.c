@@ -0,0 +1,288 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief libcouchbase IO plugin driven by a worker's event list.
+ * @file rlm_couchbase/io.c
+ *
+ * libcouchbase hands us the sockets and timers it's interested in, and we
+ * register them with the event list of the thread that owns the lcb_t.
+ * Operations scheduled on that lcb_t complete in their callbacks, without
+ * lcb_wait() ever being called.
+ *
+ * @copyright 2017 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_couchbase - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "couchbase.h"
+
+#ifdef HAVE_COUCHBASE_ASYNC
+/** IO plugin state
+ *
+ */
+typedef struct couchbase_io_t {
+	struct lcb_io_opt_st	iops;		//!< Passed to libcouchbase, must be first.
+	fr_event_list_t		*el;		//!< Event list sockets and timers are inserted into.
+} couchbase_io_t;
+
+/** A socket libcouchbase wants to be notified about
+ *
+ */
+typedef struct couchbase_io_event_t {
+	couchbase_io_t		*io;		//!< Plugin this event belongs to.
+	lcb_socket_t		sock;		//!< Socket currently registered (-1 if none).
+	short			flags;		//!< LCB_READ_EVENT and/or LCB_WRITE_EVENT.
+	void			*uarg;		//!< Passed to handler.
+	lcb_ioE_callback	handler;	//!< libcouchbase's callback.
+} couchbase_io_event_t;
+
+/** A timer libcouchbase wants to be notified about
+ *
+ */
+typedef struct couchbase_io_timer_t {
+	couchbase_io_t		*io;		//!< Plugin this timer belongs to.
+	fr_event_timer_t	*ev;		//!< Event list timer (NULL if not armed).
+	void			*uarg;		//!< Passed to handler.
+	lcb_ioE_callback	handler;	//!< libcouchbase's callback.
+} couchbase_io_timer_t;
+
+static inline couchbase_io_t *couchbase_io(lcb_io_opt_t iops)
+{
+	return talloc_get_type_abort(iops->v.v2.cookie, couchbase_io_t);
+}
+
+/** Call libcouchbase's handler for a socket event
+ *
+ * The handler may modify or destroy the event, so nothing in it is
+ * accessed after the handler returns.
+ */
+static inline void _couchbase_io_service(int fd, void *ctx, short which)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(ctx, couchbase_io_event_t);
+
+	DEBUG4("libcouchbase fd %i signalled (events 0x%x)", fd, which);
+
+	ev->handler(fd, which, ev->uarg);
+}
+
+static void _couchbase_io_readable(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	_couchbase_io_service(fd, ctx, LCB_READ_EVENT);
+}
+
+static void _couchbase_io_writable(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	_couchbase_io_service(fd, ctx, LCB_WRITE_EVENT);
+}
+
+static void _couchbase_io_errored(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	_couchbase_io_service(fd, ctx, LCB_ERROR_EVENT);
+}
+
+static void *_couchbase_io_event_create(lcb_io_opt_t iops)
+{
+	couchbase_io_t		*io = couchbase_io(iops);
+	couchbase_io_event_t	*ev;
+
+	ev = talloc_zero(io, couchbase_io_event_t);
+	if (!ev) return NULL;
+
+	ev->io = io;
+	ev->sock = -1;
+
+	return ev;
+}
+
+static void _couchbase_io_event_cancel(UNUSED lcb_io_opt_t iops, UNUSED lcb_socket_t sock, void *event)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(event, couchbase_io_event_t);
+
+	if (ev->sock < 0) return;
+
+	if (fr_event_fd_delete(ev->io->el, ev->sock) < 0) {
+		ERROR("Failed removing libcouchbase fd %i from event list: %s", ev->sock, fr_strerror());
+	}
+	ev->sock = -1;
+	ev->flags = 0;
+}
+
+/** Register interest in a socket, or remove it if flags is 0
+ *
+ */
+static int _couchbase_io_event_watch(lcb_io_opt_t iops, lcb_socket_t sock, void *event, short flags,
+				     void *uarg, lcb_ioE_callback handler)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(event, couchbase_io_event_t);
+
+	if ((ev->sock >= 0) && ((ev->sock != sock) || !(flags & (LCB_READ_EVENT | LCB_WRITE_EVENT)))) {
+		_couchbase_io_event_cancel(iops, ev->sock, ev);
+	}
+	if (!(flags & (LCB_READ_EVENT | LCB_WRITE_EVENT))) return 0;
+
+	ev->uarg = uarg;
+	ev->handler = handler;
+
+	if (fr_event_fd_insert(ev->io->el, sock,
+			       (flags & LCB_READ_EVENT) ? _couchbase_io_readable : NULL,
+			       (flags & LCB_WRITE_EVENT) ? _couchbase_io_writable : NULL,
+			       _couchbase_io_errored, ev) < 0) {
+		ERROR("Failed registering libcouchbase fd %i with event list: %s", sock, fr_strerror());
+		iops->v.v2.error = EINVAL;
+		return -1;
+	}
+	ev->sock = sock;
+	ev->flags = flags;
+
+	return 0;
+}
+
+static void _couchbase_io_event_destroy(lcb_io_opt_t iops, void *event)
+{
+	couchbase_io_event_t	*ev = talloc_get_type_abort(event, couchbase_io_event_t);
+
+	_couchbase_io_event_cancel(iops, ev->sock, ev);
+	talloc_free(ev);
+}
+
+static void _couchbase_io_timer_expired(UNUSED struct timeval *now, void *ctx)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(ctx, couchbase_io_timer_t);
+
+	DEBUG4("libcouchbase timer expired");
+
+	timer->handler(-1, 0, timer->uarg);
+}
+
+static void *_couchbase_io_timer_create(lcb_io_opt_t iops)
+{
+	couchbase_io_t		*io = couchbase_io(iops);
+	couchbase_io_timer_t	*timer;
+
+	timer = talloc_zero(io, couchbase_io_timer_t);
+	if (!timer) return NULL;
+
+	timer->io = io;
+
+	return timer;
+}
+
+static void _couchbase_io_timer_cancel(UNUSED lcb_io_opt_t iops, void *ctx)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(ctx, couchbase_io_timer_t);
+
+	if (timer->ev && (fr_event_timer_delete(timer->io->el, &timer->ev) < 0)) {
+		ERROR("Failed removing libcouchbase timer: %s", fr_strerror());
+	}
+	timer->ev = NULL;
+}
+
+static int _couchbase_io_timer_schedule(lcb_io_opt_t iops, void *ctx, lcb_U32 usec,
+					void *uarg, lcb_ioE_callback handler)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(ctx, couchbase_io_timer_t);
+	struct timeval		now, to_add, when;
+
+	timer->uarg = uarg;
+	timer->handler = handler;
+
+	gettimeofday(&now, NULL);
+	to_add.tv_sec = usec / 1000000;
+	to_add.tv_usec = usec % 1000000;
+	fr_timeval_add(&when, &now, &to_add);
+
+	if (fr_event_timer_insert(timer->io->el, _couchbase_io_timer_expired, timer, &when, &timer->ev) < 0) {
+		ERROR("Failed inserting libcouchbase timer: %s", fr_strerror());
+		iops->v.v2.error = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _couchbase_io_timer_destroy(lcb_io_opt_t iops, void *ctx)
+{
+	_couchbase_io_timer_cancel(iops, ctx);
+	talloc_free(ctx);
+}
+
+/** libcouchbase only starts the loop from lcb_wait(), which is never called on these instances
+ *
+ */
+static void _couchbase_io_loop_start(UNUSED lcb_io_opt_t iops)
+{
+	rad_assert(0);
+}
+
+static void _couchbase_io_loop_stop(UNUSED lcb_io_opt_t iops)
+{
+}
+
+static void _couchbase_io_get_procs(int version, lcb_loop_procs *loop, lcb_timer_procs *timer,
+				    lcb_bsd_procs *bsd, lcb_ev_procs *ev,
+				    UNUSED lcb_completion_procs *completion, lcb_iomodel_t *model)
+{
+	loop->start = _couchbase_io_loop_start;
+	loop->stop = _couchbase_io_loop_stop;
+
+	timer->create = _couchbase_io_timer_create;
+	timer->destroy = _couchbase_io_timer_destroy;
+	timer->cancel = _couchbase_io_timer_cancel;
+	timer->schedule = _couchbase_io_timer_schedule;
+
+	ev->create = _couchbase_io_event_create;
+	ev->destroy = _couchbase_io_event_destroy;
+	ev->cancel = _couchbase_io_event_cancel;
+	ev->watch = _couchbase_io_event_watch;
+
+	lcb_iops_wire_bsd_impl2(bsd, version);
+
+	*model = LCB_IOMODEL_EVENT;
+}
+
+/** Allocate an IO plugin which registers sockets and timers with an event list
+ *
+ * The plugin must outlive any lcb_t created with it, and the lcb_t must
+ * only be used from the thread servicing the event list.
+ *
+ * @param[in] ctx	to allocate the plugin in.
+ * @param[in] el	to insert sockets and timers into.
+ * @return
+ *	- New IO plugin.
+ *	- NULL on error.
+ */
+lcb_io_opt_t couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	couchbase_io_t	*io;
+
+	io = talloc_zero(ctx, couchbase_io_t);
+	if (!io) return NULL;
+
+	io->el = el;
+	io->iops.version = 2;
+	io->iops.v.v2.cookie = io;
+	io->iops.v.v2.get_procs = _couchbase_io_get_procs;
+
+	return &io->iops;
+}
+#endif
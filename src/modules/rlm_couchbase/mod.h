@@ -66,10 +66,26 @@ typedef struct rlm_couchbase_t {
 	vp_tmpl_t		*simul_vkey;		//!< The query key to be used with simul_view.
 	bool			delete_stale_sessions;	//!< Toggle to trigger zapping of stale sessions.
 
+	bool			async;			//!< Yield requests while waiting for get and set
+							//!< operations, instead of blocking the worker.
+
 	json_object		*map;           	//!< Json object to hold user defined attribute map.
 	fr_connection_pool_t	*pool;			//!< Connection pool.
 } rlm_couchbase_t;
 
+/** Thread specific module instance
+ *
+ * When async is enabled, each worker has its own Couchbase instance driven
+ * by the worker's event list, shared by all the operations the worker's
+ * requests have outstanding.
+ */
+typedef struct rlm_couchbase_thread_t {
+	rlm_couchbase_t const	*inst;			//!< Module instance.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	lcb_io_opt_t		io;			//!< IO plugin using el.
+	lcb_t			cb_inst;		//!< Couchbase instance (NULL if async is disabled).
+} rlm_couchbase_thread_t;
+
 /** Couchbase instance specific information
  *
  * This struct contains the Couchbase connection handle as well as a
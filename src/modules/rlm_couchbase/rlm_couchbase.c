@@ -54,6 +54,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("server", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_couchbase_t, server_raw) },
 	{ FR_CONF_OFFSET("bucket", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_couchbase_t, bucket) },
 	{ FR_CONF_OFFSET("password", PW_TYPE_STRING, rlm_couchbase_t, password) },
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, rlm_couchbase_t, async), .dflt = "no" },
 #ifdef WITH_ACCOUNTING
 	{ FR_CONF_OFFSET("acct_key", PW_TYPE_TMPL, rlm_couchbase_t, acct_key), .dflt = "radacct_%{%{Acct-Unique-Session-Id}:-%{Acct-Session-Id}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("doctype", PW_TYPE_STRING, rlm_couchbase_t, doctype), .dflt = "radacct" },
@@ -71,6 +72,79 @@ static const CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+#ifdef HAVE_COUCHBASE_ASYNC
+/** Stop waiting for a fetch if the request is cancelled
+ *
+ * The cookie is freed by the callback when the operation completes.
+ */
+static void mod_authorize_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				 fr_state_action_t action)
+{
+	cookie_t *cookie = talloc_get_type_abort(ctx, cookie_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending Couchbase fetch");
+
+	cookie->request = NULL;
+}
+
+/** Inject the value pairs from a user document fetched asynchronously
+ *
+ */
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	cookie_t *cookie = talloc_get_type_abort(ctx, cookie_t);
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+
+	/* check error */
+	if (!cookie->jobj) {
+		/* log error */
+		RERROR("failed to fetch document or parse return");
+		/* set return */
+		rcode = RLM_MODULE_FAIL;
+		/* return */
+		goto finish;
+	}
+
+	/* debugging */
+	RDEBUG3("parsed user document == %s", json_object_to_json_string(cookie->jobj));
+
+	/* inject config value pairs defined in this json oblect */
+	mod_json_object_to_value_pairs(cookie->jobj, "config", request);
+
+	/* inject reply value pairs defined in this json oblect */
+	mod_json_object_to_value_pairs(cookie->jobj, "reply", request);
+
+finish:
+	talloc_free(cookie);
+
+	return rcode;
+}
+
+/** Fetch a user document and yield until it arrives
+ *
+ */
+static rlm_rcode_t mod_authorize_async(rlm_couchbase_thread_t *t, REQUEST *request, char const *dockey)
+{
+	cookie_t *cookie;                       /* cookie for this fetch */
+	lcb_error_t cb_error;                   /* couchbase error holder */
+
+	/* allocated off the thread, in case the request goes away first */
+	cookie = couchbase_cookie_alloc(t, request);
+	if (!cookie) return RLM_MODULE_FAIL;
+
+	cb_error = couchbase_get_key_async(t->cb_inst, cookie, dockey);
+	if (cb_error != LCB_SUCCESS) {
+		RERROR("failed to fetch document: %s (0x%x)", lcb_strerror(NULL, cb_error), cb_error);
+		talloc_free(cookie);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_yield(request, mod_authorize_resume, mod_authorize_action, cookie);
+}
+#endif
+
 /** Handle authorization requests using Couchbase document data
  *
  * Attempt to fetch the document assocaited with the requested user by
@@ -78,6 +152,8 @@ static const CONF_PARSER module_config[] = {
  * document is found it will be parsed and the containing value pairs will be
  * injected into the request.
  *
+ * If async is enabled, the request yields until the document arrives.
+ *
  * @param instance	The module instance.
  * @param thread	specific data.
  * @param request	The authorization request.
@@ -104,6 +180,10 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		return RLM_MODULE_FAIL;
 	}
 
+#ifdef HAVE_COUCHBASE_ASYNC
+	if (inst->async) return mod_authorize_async(thread, request, dockey);
+#endif
+
 	/* get handle */
 	handle = fr_connection_get(inst->pool, request);
 
@@ -156,6 +236,212 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 }
 
 #ifdef WITH_ACCOUNTING
+/** Merge the attributes of an accounting request into its document
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] request	The accounting request object.
+ * @param[in] status	Acct-Status-Type of the request.
+ * @param[in,out] json	The existing document (NULL if none was found), updated in place,
+ *			or set to a new document.
+ * @param[out] document	Where to write the serialised document.
+ * @param[in] outlen	Length of the document buffer.
+ * @return
+ *	- RLM_MODULE_OK if the document should be stored.
+ *	- RLM_MODULE_NOOP if the status type isn't handled.
+ *	- RLM_MODULE_FAIL if the document didn't fit in the buffer.
+ */
+static rlm_rcode_t mod_accounting_document(rlm_couchbase_t const *inst, REQUEST *request, int status,
+					   json_object **json, char *document, size_t outlen)
+{
+	VALUE_PAIR *vp;                         /* radius value pair linked list */
+	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
+
+	/* start json document if needed */
+	if (!*json) {
+		/* debugging */
+		RDEBUG("no existing document found - creating new json document");
+		/* create new json object */
+		*json = json_object_new_object();
+		/* set 'docType' element for new document */
+		json_object_object_add(*json, "docType", json_object_new_string(inst->doctype));
+		/* default startTimestamp and stopTimestamp to null values */
+		json_object_object_add(*json, "startTimestamp", NULL);
+		json_object_object_add(*json, "stopTimestamp", NULL);
+	}
+
+	/* status specific replacements for start/stop time */
+	switch (status) {
+	case PW_STATUS_START:
+		/* add start time */
+		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
+			/* add to json object */
+			json_object_object_add(*json, "startTimestamp",
+					       mod_value_pair_to_json_object(request, vp));
+		}
+		break;
+
+	case PW_STATUS_STOP:
+		/* add stop time */
+		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
+			/* add to json object */
+			json_object_object_add(*json, "stopTimestamp",
+					       mod_value_pair_to_json_object(request, vp));
+		}
+		/* check start timestamp and adjust if needed */
+		mod_ensure_start_timestamp(*json, request->packet->vps);
+		break;
+
+	case PW_STATUS_ALIVE:
+		/* check start timestamp and adjust if needed */
+		mod_ensure_start_timestamp(*json, request->packet->vps);
+		break;
+
+	default:
+		/* don't doing anything */
+		return RLM_MODULE_NOOP;
+	}
+
+	/* loop through pairs and add to json document */
+	for (vp = request->packet->vps; vp; vp = vp->next) {
+		/* map attribute to element */
+		if (mod_attribute_to_element(vp->da->name, inst->map, &element) == 0) {
+			/* debug */
+			RDEBUG3("mapped attribute %s => %s", vp->da->name, element);
+			/* add to json object with mapped name */
+			json_object_object_add(*json, element, mod_value_pair_to_json_object(request, vp));
+		}
+	}
+
+	/* copy json string to document and check size */
+	if (strlcpy(document, json_object_to_json_string(*json), outlen) >= outlen) {
+		/* this isn't good */
+		RERROR("could not write json document - insufficient buffer space");
+		/* return */
+		return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+#ifdef HAVE_COUCHBASE_ASYNC
+/** State of an accounting request waiting on Couchbase
+ *
+ * Allocated off the cookie, so it's freed along with it.
+ */
+typedef struct rlm_couchbase_acct_t {
+	cookie_t		*cookie;	//!< Cookie of the outstanding operation.
+	char const		*dockey;	//!< Accounting document key.
+	int			status;		//!< Acct-Status-Type of the request.
+	bool			stored;		//!< The document has been sent to be stored.
+} rlm_couchbase_acct_t;
+
+/** Stop waiting for a fetch or store if the request is cancelled
+ *
+ * The cookie is freed by the callback when the operation completes.
+ */
+static void mod_accounting_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				  fr_state_action_t action)
+{
+	rlm_couchbase_acct_t *actx = talloc_get_type_abort(ctx, rlm_couchbase_acct_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending Couchbase %s", actx->stored ? "store" : "fetch");
+
+	actx->cookie->request = NULL;
+}
+
+/** Merge the request into the fetched document and store it, or check the result of the store
+ *
+ */
+static rlm_rcode_t mod_accounting_resume(REQUEST *request, void *instance, void *thread, void *ctx)
+{
+	rlm_couchbase_t const *inst = instance;       /* our module instance */
+	rlm_couchbase_thread_t *t = thread;     /* our thread instance */
+	rlm_couchbase_acct_t *actx = talloc_get_type_abort(ctx, rlm_couchbase_acct_t);
+	cookie_t *cookie = actx->cookie;        /* cookie for the fetch and store */
+	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
+	char document[MAX_VALUE_SIZE];          /* our document body */
+	lcb_error_t cb_error;                   /* couchbase error holder */
+
+	/* check result of the store */
+	if (actx->stored) {
+		if (cookie->error != LCB_SUCCESS) {
+			RERROR("failed to store document (%s): %s (0x%x)", actx->dockey,
+			       lcb_strerror(NULL, cookie->error), cookie->error);
+		}
+		goto finish;
+	}
+
+	/* check error and object */
+	if (cookie->jerr != json_tokener_success || !cookie->jobj) {
+		/* log error */
+		RERROR("failed to execute get request or parse returned json object");
+		/* free and reset json object */
+		if (cookie->jobj) {
+			json_object_put(cookie->jobj);
+			cookie->jobj = NULL;
+		}
+	} else {
+		/* debugging */
+		RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
+	}
+
+	rcode = mod_accounting_document(inst, request, actx->status, &cookie->jobj, document, sizeof(document));
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	/* debugging */
+	RDEBUG3("setting '%s' => '%s'", actx->dockey, document);
+
+	/* store document/key in couchbase */
+	cb_error = couchbase_set_key_async(t->cb_inst, cookie, actx->dockey, document, inst->expire);
+	if (cb_error != LCB_SUCCESS) {
+		RERROR("failed to store document (%s): %s (0x%x)", actx->dockey, lcb_strerror(NULL, cb_error), cb_error);
+		goto finish;
+	}
+	actx->stored = true;
+
+	return unlang_yield(request, mod_accounting_resume, mod_accounting_action, actx);
+
+finish:
+	talloc_free(cookie);
+
+	return rcode;
+}
+
+/** Fetch an accounting document and yield until it arrives
+ *
+ */
+static rlm_rcode_t mod_accounting_async(rlm_couchbase_thread_t *t, REQUEST *request, char const *dockey, int status)
+{
+	rlm_couchbase_acct_t *actx;             /* accounting state */
+	cookie_t *cookie;                       /* cookie for the fetch and store */
+	lcb_error_t cb_error;                   /* couchbase error holder */
+
+	/* allocated off the thread, in case the request goes away first */
+	cookie = couchbase_cookie_alloc(t, request);
+	if (!cookie) return RLM_MODULE_FAIL;
+
+	actx = talloc_zero(cookie, rlm_couchbase_acct_t);
+	if (!actx) {
+	error:
+		talloc_free(cookie);
+		return RLM_MODULE_FAIL;
+	}
+	actx->cookie = cookie;
+	actx->dockey = talloc_strdup(actx, dockey);
+	actx->status = status;
+
+	cb_error = couchbase_get_key_async(t->cb_inst, cookie, dockey);
+	if (cb_error != LCB_SUCCESS) {
+		RERROR("failed to execute get request: %s (0x%x)", lcb_strerror(NULL, cb_error), cb_error);
+		goto error;
+	}
+
+	return unlang_yield(request, mod_accounting_resume, mod_accounting_action, actx);
+}
+#endif
+
 /** Write accounting data to Couchbase documents
  *
  * Handle accounting requests and store the associated data into JSON documents
@@ -165,6 +451,9 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
  * will be merged with the currently existing data.  When conflicts arrise the new attribute
  * value will replace or be added to the existing value.
  *
+ * If async is enabled, the request yields while the document is fetched, and again while
+ * it's stored.
+ *
  * @param instance	The module instance.
  * @param thread	specific data.
  * @param request	The accounting request object.
@@ -179,9 +468,7 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	char buffer[MAX_KEY_SIZE];
 	char const *dockey;			/* our document key */
 	char document[MAX_VALUE_SIZE];          /* our document body */
-	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
 	int status = 0;                         /* account status type */
-	int docfound = 0;                       /* document found toggle */
 	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
 	ssize_t slen;
 
@@ -207,6 +494,18 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 		return RLM_MODULE_OK;
 	}
 
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
+	if (slen < 0) return RLM_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		return RLM_MODULE_FAIL;
+	}
+
+#ifdef HAVE_COUCHBASE_ASYNC
+	if (inst->async) return mod_accounting_async(thread, request, dockey, status);
+#endif
+
 	/* get handle */
 	handle = fr_connection_get(inst->pool, request);
 
@@ -219,19 +518,6 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	/* set cookie */
 	cookie_t *cookie = handle->cookie;
 
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
-	if (slen < 0) {
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
-
 	/* attempt to fetch document */
 	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
 
@@ -246,79 +532,13 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 		}
 	/* check cookie json object */
 	} else if (cookie->jobj) {
-		/* set doc found */
-		docfound = 1;
 		/* debugging */
 		RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
 	}
 
-	/* start json document if needed */
-	if (docfound != 1) {
-		/* debugging */
-		RDEBUG("no existing document found - creating new json document");
-		/* create new json object */
-		cookie->jobj = json_object_new_object();
-		/* set 'docType' element for new document */
-		json_object_object_add(cookie->jobj, "docType", json_object_new_string(inst->doctype));
-		/* default startTimestamp and stopTimestamp to null values */
-		json_object_object_add(cookie->jobj, "startTimestamp", NULL);
-		json_object_object_add(cookie->jobj, "stopTimestamp", NULL);
-	}
-
-	/* status specific replacements for start/stop time */
-	switch (status) {
-	case PW_STATUS_START:
-		/* add start time */
-		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
-			/* add to json object */
-			json_object_object_add(cookie->jobj, "startTimestamp",
-					       mod_value_pair_to_json_object(request, vp));
-		}
-		break;
-
-	case PW_STATUS_STOP:
-		/* add stop time */
-		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
-			/* add to json object */
-			json_object_object_add(cookie->jobj, "stopTimestamp",
-					       mod_value_pair_to_json_object(request, vp));
-		}
-		/* check start timestamp and adjust if needed */
-		mod_ensure_start_timestamp(cookie->jobj, request->packet->vps);
-		break;
-
-	case PW_STATUS_ALIVE:
-		/* check start timestamp and adjust if needed */
-		mod_ensure_start_timestamp(cookie->jobj, request->packet->vps);
-		break;
-
-	default:
-		/* don't doing anything */
-		rcode = RLM_MODULE_NOOP;
-		/* return */
-		goto finish;
-	}
-
-	/* loop through pairs and add to json document */
-	for (vp = request->packet->vps; vp; vp = vp->next) {
-		/* map attribute to element */
-		if (mod_attribute_to_element(vp->da->name, inst->map, &element) == 0) {
-			/* debug */
-			RDEBUG3("mapped attribute %s => %s", vp->da->name, element);
-			/* add to json object with mapped name */
-			json_object_object_add(cookie->jobj, element, mod_value_pair_to_json_object(request, vp));
-		}
-	}
-
-	/* copy json string to document and check size */
-	if (strlcpy(document, json_object_to_json_string(cookie->jobj), sizeof(document)) >= sizeof(document)) {
-		/* this isn't good */
-		RERROR("could not write json document - insufficient buffer space");
-		/* set return */
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
+	/* merge the request into the document */
+	rcode = mod_accounting_document(inst, request, status, &cookie->jobj, document, sizeof(document));
+	if (rcode != RLM_MODULE_OK) goto finish;
 
 	/* debugging */
 	RDEBUG3("setting '%s' => '%s'", dockey, document);
@@ -772,6 +992,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_couchbase_t *inst = instance;   /* our module instance */
 
+#ifndef HAVE_COUCHBASE_ASYNC
+	if (inst->async) {
+		cf_log_err_cs(conf, "async requires libcouchbase >= 2.5.0, linked with %s", lcb_get_version(NULL));
+		return -1;
+	}
+#endif
+
 	{
 		char *server, *p;
 		size_t len, i;
@@ -854,6 +1081,71 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/** Create the thread's Couchbase instance if async is enabled
+ *
+ * The connection is established as the thread's event list is serviced.
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_couchbase_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el,
+				  void *thread)
+{
+	rlm_couchbase_t const	*inst = instance;
+	rlm_couchbase_thread_t	*t = thread;
+
+	t->inst = inst;
+	t->el = el;
+
+	if (!inst->async) return 0;
+
+#ifdef HAVE_COUCHBASE_ASYNC
+	{
+		lcb_error_t cb_error;
+
+		t->io = couchbase_io_alloc(t, el);
+		if (!t->io) {
+			ERROR("failed to allocate couchbase io plugin");
+			return -1;
+		}
+
+		cb_error = couchbase_init_connection(&t->cb_inst, t->io, inst->server, inst->bucket,
+						     inst->password, 0);
+		if (cb_error != LCB_SUCCESS) {
+			ERROR("failed to initiate couchbase connection: %s (0x%x)",
+			      lcb_strerror(NULL, cb_error), cb_error);
+			if (t->cb_inst) lcb_destroy(t->cb_inst);
+			t->cb_inst = NULL;
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/** Destroy the thread's Couchbase instance
+ *
+ * Any outstanding operations complete with an error, and free their cookies.
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_couchbase_thread_t	*t = thread;
+
+	if (t->cb_inst) lcb_destroy(t->cb_inst);
+	t->cb_inst = NULL;
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	INFO("libcouchbase version: %s", lcb_get_version(NULL));
@@ -866,14 +1158,17 @@ static int mod_load(void)
  */
 extern rad_module_t rlm_couchbase;
 rad_module_t rlm_couchbase = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "couchbase",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_couchbase_t),
-	.config		= module_config,
-	.load		= mod_load,
-	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "couchbase",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_couchbase_t),
+	.thread_inst_size	= sizeof(rlm_couchbase_thread_t),
+	.config			= module_config,
+	.load			= mod_load,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
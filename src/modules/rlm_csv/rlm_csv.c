@@ -30,6 +30,10 @@ RCSID("$Id$")
 
 #include <freeradius-devel/map_proc.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST *request,
 				vp_tmpl_t const *key, vp_map_t const *maps);
 
@@ -53,7 +57,12 @@ typedef struct rlm_csv_t {
 
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
-	rbtree_t	*tree;
+
+	bool		mmap;		//!< Look entries up in the file, instead of loading them.
+	char const	*index_filename;	//!< Where to keep the index of the file, when using mmap.
+
+	uint32_t	reload_interval;
+	module_reload_t	*reload;	//!< Manages the tree of entries read from the file.
 } rlm_csv_t;
 
 typedef struct rlm_csv_entry_t {
@@ -62,6 +71,52 @@ typedef struct rlm_csv_entry_t {
 	char *data[];
 } rlm_csv_entry_t;
 
+/** Where to find an entry in a memory mapped file
+ *
+ * The index is sorted by hash, then by position in the file.
+ */
+typedef struct csv_index_entry_t {
+	uint32_t	hash;		//!< Of the key.
+	uint32_t	lineno;		//!< For error messages.
+	uint64_t	offset;		//!< Of the start of the line.
+} csv_index_entry_t;
+
+#define CSV_INDEX_MAGIC		"FRCSVIDX"
+#define CSV_INDEX_VERSION	1
+
+/** Start of an index file
+ *
+ * The index is only used if it was built from the current version of
+ * the file, with the same key field.
+ */
+typedef struct csv_index_header_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	delimiter;
+	uint32_t	num_fields;
+	uint32_t	key_field;
+	uint64_t	data_size;	//!< Of the file the index was built from.
+	uint64_t	data_inode;
+	int64_t		data_mtime;
+	uint64_t	num_entries;	//!< Number of csv_index_entry_t which follow.
+} csv_index_header_t;
+
+/** A CSV file which is looked up in place
+ *
+ */
+typedef struct csv_mmap_t {
+	rlm_csv_t const		*inst;
+
+	uint8_t const		*data;		//!< Mapping of the CSV file.
+	size_t			data_len;
+
+	void			*index_map;	//!< Mapping of the index file, if the index was read from one.
+	size_t			index_map_len;
+
+	csv_index_entry_t const	*index;
+	uint64_t		num_entries;
+} csv_mmap_t;
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -70,6 +125,9 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("delimiter", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, delimiter), .dflt = "," },
 	{ FR_CONF_OFFSET("header", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, header) },
 	{ FR_CONF_OFFSET("key_field", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("mmap", PW_TYPE_BOOLEAN, rlm_csv_t, mmap), .dflt = "no" },
+	{ FR_CONF_OFFSET("index_filename", PW_TYPE_STRING, rlm_csv_t, index_filename) },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_csv_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -84,7 +142,7 @@ static int csv_entry_cmp(void const *one, void const *two)
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -152,36 +210,63 @@ static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
 	return false;
 }
 
-/*
- *	Convert a buffer to a CSV entry
+/** Split a line into fields
+ *
+ * @param[in] inst	of rlm_csv.
+ * @param[in] lineno	for error messages.
+ * @param[in] buffer	containing the line.  Modified in place.
+ * @param[out] fields	array of inst->num_fields pointers into buffer.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the line is malformed.
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static int csv_split(rlm_csv_t const *inst, int lineno, char *buffer, char **fields)
 {
-	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst->tree, uint8_t,
-						     sizeof(*e) + inst->used_fields + sizeof(e->data[0])));
-
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
 		if (!buf2entry(inst, p, &q)) {
-			cf_log_err_cs(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
-			return NULL;
+			ERROR("%s - Malformed entry in file %s line %d", inst->name, inst->filename, lineno);
+			return -1;
 		}
 
 		if (q) *(q++) = '\0';
 
 		if (i >= inst->num_fields) {
-			cf_log_err_cs(conf, "Too many fields at file %s line %d", inst->filename, lineno);
-			return NULL;
+			ERROR("%s - Too many fields at file %s line %d", inst->name, inst->filename, lineno);
+			return -1;
 		}
 
+		fields[i] = p;
+	}
+
+	if (i < inst->num_fields) {
+		ERROR("%s - Too few fields at file %s line %d (%d < %d)", inst->name, inst->filename, lineno,
+		      i, inst->num_fields);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Convert split fields to a CSV entry
+ */
+static rlm_csv_entry_t *fields2csv(TALLOC_CTX *ctx, rlm_csv_t const *inst, char **fields)
+{
+	rlm_csv_entry_t *e;
+	int i;
+
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
+						     sizeof(*e) + inst->used_fields * sizeof(e->data[0])));
+
+	for (i = 0; i < inst->num_fields; i++) {
 		/*
 		 *	This is the key field.
 		 */
 		if (i == inst->key_field) {
-			e->key = talloc_strdup(e, p);
+			MEM(e->key = talloc_strdup(e, fields[i]));
 			continue;
 		}
 
@@ -190,26 +275,393 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 		 */
 		if (inst->field_offsets[i] < 0) continue;
 
-		MEM(e->data[inst->field_offsets[i]] = talloc_strdup(e, p));
+		MEM(e->data[inst->field_offsets[i]] = talloc_strdup(e, fields[i]));
 	}
 
-	if (i < inst->num_fields) {
-		cf_log_err_cs(conf, "Too few fields at file %s line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
-		return NULL;
-	}
+	return e;
+}
+
+/*
+ *	Convert a buffer to a CSV entry
+ */
+static rlm_csv_entry_t *file2csv(rbtree_t *tree, rlm_csv_t const *inst, int lineno, char *buffer, char **fields)
+{
+	rlm_csv_entry_t *e;
+
+	if (csv_split(inst, lineno, buffer, fields) < 0) return NULL;
+
+	e = fields2csv(tree, inst, fields);
 
 	/*
 	 *	FIXME: Allow duplicate keys later.
 	 */
-	if (!rbtree_insert(inst->tree, e)) {
-		cf_log_err_cs(conf, "Failed inserting entry for filename %s line %d: duplicate entry",
-			      inst->filename, lineno);
+	if (!rbtree_insert(tree, e)) {
+		ERROR("%s - Failed inserting entry for filename %s line %d: duplicate entry",
+		      inst->name, inst->filename, lineno);
 		return NULL;
 	}
 
 	return e;
 }
 
+/** Copy a line of a memory mapped file, and split it into fields
+ *
+ * @param[in] cm	memory mapped file.
+ * @param[in] entry	index entry of the line.
+ * @param[out] buffer	to copy the line into.
+ * @param[in] bufsize	of buffer.
+ * @param[out] fields	array of inst->num_fields pointers into buffer.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the line is too long, or malformed.
+ */
+static int csv_mmap_line(csv_mmap_t const *cm, csv_index_entry_t const *entry,
+			 char *buffer, size_t bufsize, char **fields)
+{
+	uint8_t const	*p, *q;
+	size_t		len;
+
+	if (entry->offset >= cm->data_len) {
+	changed:
+		ERROR("%s - File %s changed while in use", cm->inst->name, cm->inst->filename);
+		return -1;
+	}
+
+	/*
+	 *	Keep the newline, so that lines are
+	 *	parsed exactly the same as by fgets().
+	 */
+	p = cm->data + entry->offset;
+	q = memchr(p, '\n', cm->data_len - entry->offset);
+	len = q ? (size_t)(q - p) + 1 : cm->data_len - entry->offset;
+
+	if (len >= bufsize) {
+		ERROR("%s - Line too long at file %s line %u", cm->inst->name, cm->inst->filename, entry->lineno);
+		return -1;
+	}
+	memcpy(buffer, p, len);
+	buffer[len] = '\0';
+
+	if (csv_split(cm->inst, entry->lineno, buffer, fields) < 0) goto changed;
+
+	return 0;
+}
+
+static int csv_index_entry_cmp(void const *one, void const *two)
+{
+	csv_index_entry_t const *a = one, *b = two;
+
+	if (a->hash != b->hash) return (a->hash < b->hash) ? -1 : 1;
+
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+/** Build the index of a memory mapped file
+ *
+ * Every line is parsed, so errors are found when the file is loaded,
+ * not when the entry is used.  Only the key and the position of the
+ * line is kept.
+ */
+static int csv_mmap_index(csv_mmap_t *cm, char **fields)
+{
+	rlm_csv_t const		*inst = cm->inst;
+	csv_index_entry_t	*index = NULL;
+	size_t			num = 0, alloced = 0, i, j;
+	uint8_t const		*p, *q, *end;
+	uint32_t		lineno = 1;
+	char			buffer[8192], other[8192];
+	char			**other_fields;
+
+	p = cm->data;
+	end = cm->data + cm->data_len;
+
+	while (p < end) {
+		size_t len;
+
+		q = memchr(p, '\n', end - p);
+		len = q ? (size_t)(q - p) + 1 : (size_t)(end - p);
+
+		if (len >= sizeof(buffer)) {
+			ERROR("%s - Line too long at file %s line %u", inst->name, inst->filename, lineno);
+			return -1;
+		}
+		memcpy(buffer, p, len);
+		buffer[len] = '\0';
+
+		if (csv_split(inst, lineno, buffer, fields) < 0) return -1;
+
+		if (num == alloced) {
+			alloced = alloced ? alloced * 2 : 1024;
+			index = talloc_realloc(cm, index, csv_index_entry_t, alloced);
+			if (!index) {
+				ERROR("%s - Out of memory", inst->name);
+				return -1;
+			}
+		}
+
+		index[num].hash = fr_hash_string(fields[inst->key_field]);
+		index[num].lineno = lineno;
+		index[num].offset = p - cm->data;
+		num++;
+
+		p += len;
+		lineno++;
+	}
+
+	if (num) qsort(index, num, sizeof(index[0]), csv_index_entry_cmp);
+
+	cm->index = index;
+	cm->num_entries = num;
+
+	/*
+	 *	Entries with the same hash may have the same key.
+	 *
+	 *	FIXME: Allow duplicate keys later.
+	 */
+	other_fields = talloc_array(cm, char *, inst->num_fields);
+	if (!other_fields) return -1;
+
+	for (i = 0; i < num; i++) {
+		for (j = i + 1; (j < num) && (index[j].hash == index[i].hash); j++) {
+			if ((csv_mmap_line(cm, &index[i], buffer, sizeof(buffer), fields) < 0) ||
+			    (csv_mmap_line(cm, &index[j], other, sizeof(other), other_fields) < 0)) return -1;
+
+			if (strcmp(fields[inst->key_field], other_fields[inst->key_field]) == 0) {
+				ERROR("%s - Failed inserting entry for filename %s line %u: duplicate entry",
+				      inst->name, inst->filename, index[j].lineno);
+				return -1;
+			}
+		}
+	}
+	talloc_free(other_fields);
+
+	return 0;
+}
+
+/** Map an index file, if it was built from the current version of the CSV file
+ *
+ * @return
+ *	- 0 if the index was read.
+ *	- -1 if it doesn't exist, is out of date, or invalid.
+ */
+static int csv_mmap_index_read(csv_mmap_t *cm, struct stat const *data_st)
+{
+	rlm_csv_t const			*inst = cm->inst;
+	int				fd;
+	struct stat			st;
+	void				*map;
+	csv_index_header_t const	*hdr;
+
+	fd = open(inst->index_filename, O_RDONLY);
+	if (fd < 0) return -1;
+
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(*hdr))) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	hdr = map;
+	if ((memcmp(hdr->magic, CSV_INDEX_MAGIC, sizeof(hdr->magic)) != 0) ||
+	    (hdr->version != CSV_INDEX_VERSION) ||
+	    (hdr->delimiter != (uint8_t) *inst->delimiter) ||
+	    (hdr->num_fields != (uint32_t) inst->num_fields) ||
+	    (hdr->key_field != (uint32_t) inst->key_field) ||
+	    (hdr->data_size != (uint64_t) data_st->st_size) ||
+	    (hdr->data_inode != (uint64_t) data_st->st_ino) ||
+	    (hdr->data_mtime != (int64_t) data_st->st_mtime) ||
+	    (hdr->num_entries != ((st.st_size - sizeof(*hdr)) / sizeof(csv_index_entry_t))) ||
+	    (((st.st_size - sizeof(*hdr)) % sizeof(csv_index_entry_t)) != 0)) {
+		DEBUG2("%s - Index file %s is out of date", inst->name, inst->index_filename);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	cm->index_map = map;
+	cm->index_map_len = st.st_size;
+	cm->index = (csv_index_entry_t const *)(hdr + 1);
+	cm->num_entries = hdr->num_entries;
+
+	return 0;
+}
+
+/** Write the index, so that it doesn't need to be built the next time the file is loaded
+ *
+ * The index is written to a temporary file, which is renamed once
+ * complete, so that other servers never see a partial index.
+ */
+static void csv_mmap_index_write(csv_mmap_t const *cm, struct stat const *data_st)
+{
+	rlm_csv_t const		*inst = cm->inst;
+	csv_index_header_t	hdr;
+	char			*tmp;
+	FILE			*fp;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CSV_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = CSV_INDEX_VERSION;
+	hdr.delimiter = (uint8_t) *inst->delimiter;
+	hdr.num_fields = inst->num_fields;
+	hdr.key_field = inst->key_field;
+	hdr.data_size = data_st->st_size;
+	hdr.data_inode = data_st->st_ino;
+	hdr.data_mtime = data_st->st_mtime;
+	hdr.num_entries = cm->num_entries;
+
+	tmp = talloc_asprintf(NULL, "%s.%u", inst->index_filename, (unsigned int) getpid());
+	if (!tmp) return;
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		WARN("%s - Failed creating index file %s: %s", inst->name, tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return;
+	}
+
+	if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+	    (cm->num_entries && (fwrite(cm->index, sizeof(cm->index[0]), cm->num_entries, fp) != cm->num_entries)) ||
+	    (fclose(fp) != 0)) {
+		WARN("%s - Failed writing index file %s: %s", inst->name, tmp, fr_syserror(errno));
+		unlink(tmp);
+		talloc_free(tmp);
+		return;
+	}
+
+	if (rename(tmp, inst->index_filename) < 0) {
+		WARN("%s - Failed renaming %s to %s: %s", inst->name, tmp, inst->index_filename, fr_syserror(errno));
+		unlink(tmp);
+	}
+	talloc_free(tmp);
+}
+
+static int _csv_mmap_free(csv_mmap_t *cm)
+{
+	void *map;
+
+	if (cm->data) {
+		memcpy(&map, &cm->data, sizeof(map)); /* const */
+		munmap(map, cm->data_len);
+	}
+	if (cm->index_map) munmap(cm->index_map, cm->index_map_len);
+
+	return 0;
+}
+
+/** Map the CSV file, and read or build its index
+ *
+ */
+static int csv_mmap_load(TALLOC_CTX *ctx, void **out, rlm_csv_t const *inst)
+{
+	csv_mmap_t	*cm;
+	struct stat	st;
+	int		fd;
+	char		**fields;
+
+	cm = talloc_zero(ctx, csv_mmap_t);
+	if (!cm) {
+		ERROR("%s - Out of memory", inst->name);
+		return -1;
+	}
+	cm->inst = inst;
+	talloc_set_destructor(cm, _csv_mmap_free);
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		ERROR("%s - Error opening filename %s: %s", inst->name, inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("%s - Error reading filename %s: %s", inst->name, inst->filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 *	Can't map an empty file.
+	 */
+	if (st.st_size > 0) {
+		void *map;
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			ERROR("%s - Error mapping filename %s: %s", inst->name, inst->filename, fr_syserror(errno));
+			close(fd);
+			return -1;
+		}
+		cm->data = map;
+		cm->data_len = st.st_size;
+	}
+	close(fd);
+
+	if (inst->index_filename && (csv_mmap_index_read(cm, &st) == 0)) {
+		DEBUG2("%s - Using index file %s", inst->name, inst->index_filename);
+		*out = cm;
+		return 0;
+	}
+
+	fields = talloc_array(cm, char *, inst->num_fields);
+	if (!fields) return -1;
+
+	if (csv_mmap_index(cm, fields) < 0) return -1;
+	talloc_free(fields);
+
+	if (inst->index_filename) csv_mmap_index_write(cm, &st);
+
+	*out = cm;
+
+	return 0;
+}
+
+/** Find an entry in a memory mapped file
+ *
+ * @param[in] ctx	to allocate the entry in.
+ * @param[in] cm	memory mapped file.
+ * @param[in] key	to look for.
+ * @return
+ *	- The entry.
+ *	- NULL if not found.
+ */
+static rlm_csv_entry_t *csv_mmap_find(TALLOC_CTX *ctx, csv_mmap_t const *cm, char const *key)
+{
+	rlm_csv_t const		*inst = cm->inst;
+	uint32_t		hash = fr_hash_string(key);
+	uint64_t		lo = 0, hi = cm->num_entries, i;
+	char			buffer[8192];
+	char			**fields;
+	rlm_csv_entry_t		*e = NULL;
+
+	/*
+	 *	Find the first entry with the same hash.
+	 */
+	while (lo < hi) {
+		uint64_t mid = lo + ((hi - lo) / 2);
+
+		if (cm->index[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo == cm->num_entries) || (cm->index[lo].hash != hash)) return NULL;
+
+	MEM(fields = talloc_array(ctx, char *, inst->num_fields));
+
+	for (i = lo; (i < cm->num_entries) && (cm->index[i].hash == hash); i++) {
+		if (csv_mmap_line(cm, &cm->index[i], buffer, sizeof(buffer), fields) < 0) break;
+
+		if (strcmp(fields[inst->key_field], key) != 0) continue;
+
+		e = fields2csv(ctx, inst, fields);
+		break;
+	}
+	talloc_free(fields);
+
+	return e;
+}
 
 static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
 {
@@ -276,9 +728,6 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	char const *p;
 	char *q;
 	char *header;
-	FILE *fp;
-	int lineno;
-	char buffer[8192];
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -288,6 +737,11 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->index_filename && !inst->mmap) {
+		cf_log_err_cs(conf, "'index_filename' can only be used with 'mmap = yes'");
+		return -1;
+	}
+
 	for (p = inst->header; p != NULL; p = strchr(p + 1, *inst->delimiter)) {
 		inst->num_fields++;
 	}
@@ -365,15 +819,41 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
-	inst->tree = rbtree_create(inst, csv_entry_cmp, NULL, 0);
-	if (!inst->tree) goto oom;
+	/*
+	 *	And register the map function.
+	 */
+	map_proc_register(inst, inst->name, mod_map_proc, csv_map_verify, 0);
+
+	return 0;
+}
+
+/*
+ *	Read the CSV file into a new tree.
+ */
+static int csv_load(TALLOC_CTX *ctx, void **out, void const *instance)
+{
+	rlm_csv_t const *inst = instance;
+	rbtree_t *tree;
+	FILE *fp;
+	int lineno;
+	char buffer[8192];
+	char **fields;
+
+	if (inst->mmap) return csv_mmap_load(ctx, out, inst);
+
+	tree = rbtree_create(ctx, csv_entry_cmp, NULL, 0);
+	fields = talloc_array(tree, char *, inst->num_fields);
+	if (!tree || !fields) {
+		ERROR("%s - Out of memory", inst->name);
+		return -1;
+	}
 
 	/*
 	 *	Read the file line by line.
 	 */
 	fp = fopen(inst->filename, "r");
 	if (!fp) {
-		cf_log_err_cs(conf, "Error opening filename %s: %s", inst->filename, strerror(errno));
+		ERROR("%s - Error opening filename %s: %s", inst->name, inst->filename, fr_syserror(errno));
 		return -1;
 	}
 
@@ -381,7 +861,7 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	while (fgets(buffer, sizeof(buffer), fp)) {
 		rlm_csv_entry_t *e;
 
-		e = file2csv(conf, inst, lineno, buffer);
+		e = file2csv(tree, inst, lineno, buffer, fields);
 		if (!e) {
 			fclose(fp);
 			return -1;
@@ -391,15 +871,25 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	}
 
 	fclose(fp);
+	talloc_free(fields);
 
-	/*
-	 *	And register the map function.
-	 */
-	map_proc_register(inst, inst->name, mod_map_proc, csv_map_verify, 0);
+	*out = tree;
 
 	return 0;
 }
 
+static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+{
+	rlm_csv_t *inst = instance;
+
+	inst->reload = module_reload_alloc(inst, inst->name, inst, csv_load, inst->reload_interval);
+	if (!inst->reload) return -1;
+
+	if (module_reload_watch(inst->reload, inst->filename) < 0) return -1;
+
+	return module_reload_start(inst->reload);
+}
+
 /*
  *	Convert field X to a VP.
  */
@@ -480,9 +970,12 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 	if (tmpl_aexpand(request, &key_str, request, key, NULL, NULL) < 0) return RLM_MODULE_FAIL;
 
-	my_entry.key = key_str;
-
-	e = rbtree_finddata(inst->tree, &my_entry);
+	if (inst->mmap) {
+		e = csv_mmap_find(request, module_reload_current(inst->reload), key_str);
+	} else {
+		my_entry.key = key_str;
+		e = rbtree_finddata(module_reload_current(inst->reload), &my_entry);
+	}
 	if (!e) {
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
@@ -529,6 +1022,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	}
 
 finish:
+	if (inst->mmap) talloc_free(e);
 	talloc_free(key_str);
 	return rcode;
 }
@@ -541,4 +1035,5 @@ rad_module_t rlm_csv = {
 	.inst_size	= sizeof(rlm_csv_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
 };
@@ -17,7 +17,7 @@
 /**
  * $Id$
  * @file rlm_detail.c
- * @brief Write plaintext versions of packets to flatfiles.
+ * @brief Write plaintext or binary versions of packets to flatfiles.
  *
  * @copyright 2000,2006  The FreeRADIUS server project
  */
@@ -62,6 +62,9 @@ typedef struct detail_instance {
 
 	char const	*header;	//!< Header format.
 	bool		locking;	//!< Whether the file should be locked.
+	bool		async;		//!< Buffer entries, and write them from a separate thread.
+	bool		fsync;		//!< fsync() after each batch of buffered entries.
+	bool		binary;		//!< Write entries in the binary format.
 
 	bool		log_srcdst;	//!< Add IP src/dst attributes to entries.
 
@@ -82,6 +85,9 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", PW_TYPE_BOOLEAN, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", PW_TYPE_BOOLEAN, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, rlm_detail_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("fsync", PW_TYPE_BOOLEAN, rlm_detail_t, fsync), .dflt = "no" },
+	{ FR_CONF_OFFSET("binary", PW_TYPE_BOOLEAN, rlm_detail_t, binary), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -138,6 +144,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->async) {
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+		if (exfile_async_enable(inst->ef, EXFILE_ASYNC_INTERVAL, EXFILE_ASYNC_MAX_PENDING, inst->fsync) < 0) {
+			cf_log_err_cs(conf, "Failed enabling buffered writes: %s", fr_strerror());
+			return -1;
+		}
+#else
+		cf_log_err_cs(conf, "'async = yes' is not supported on this system");
+		return -1;
+#endif
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -193,20 +211,78 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
-/*
- *	Wrapper for VPs allocated on the stack.
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+/** Entry being built in memory, for buffered writes
+ *
+ */
+typedef struct detail_buffer_t {
+	char		*data;		//!< The entry.
+	size_t		len;		//!< How much of data is used.
+} detail_buffer_t;
+
+/** Append to an in memory entry
+ *
+ * These must be declared separately as fopencookie and funopen have different prototypes.
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *stacked)
+#  ifdef HAVE_FOPENCOOKIE
+static ssize_t detail_buffer_write(void *cookie, char const *in, size_t len)
+#  else
+static int detail_buffer_write(void *cookie, char const *in, int len)
+#  endif
 {
-	VALUE_PAIR *vp;
+	detail_buffer_t	*buff = cookie;
+	size_t		size = talloc_array_length(buff->data);
+
+	if ((buff->len + len) > size) {
+		char *data;
+
+		data = talloc_realloc(NULL, buff->data, char, (buff->len + len) * 2);
+		if (!data) {
+			errno = ENOMEM;
+			return -1;
+		}
+		buff->data = data;
+	}
+
+	memcpy(buff->data + buff->len, in, len);
+	buff->len += len;
+
+	return len;
+}
+#endif
+
+/** Write a single attribute, with the operator '='
+ *
+ * The attribute is printed into a thread local buffer, so nothing is
+ * allocated, and long values aren't truncated.  The VALUE_PAIR may be
+ * on the stack.
+ */
+static int detail_pair_write(FILE *out, REQUEST *request, VALUE_PAIR const *vp)
+{
+	fr_sbuff_t	*sb;
+	VALUE_PAIR	tmp;
+
+	if (!vp->da) return 0;
 
-	vp = talloc(ctx, VALUE_PAIR);
-	if (!vp) return;
+	sb = fr_sbuff_thread_local();
+	if (!sb) return -1;
 
-	memcpy(vp, stacked, sizeof(*vp));
-	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, vp);
-	talloc_free(vp);
+	tmp = *vp;
+	tmp.op = T_OP_EQ;
+
+	if ((fr_sbuff_in_char(sb, '\t') < 0) ||
+	    (fr_sbuff_in_pair(sb, &tmp) < 0) ||
+	    (fr_sbuff_in_char(sb, '\n') < 0)) {
+		RERROR("Failed printing %s: %s", vp->da->name, fr_strerror());
+		return -1;
+	}
+
+	if (fwrite(fr_sbuff_start(sb), 1, fr_sbuff_used(sb), out) != fr_sbuff_used(sb)) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
 }
 
 
@@ -265,17 +341,21 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 		switch (packet->src_ipaddr.af) {
 		case AF_INET:
 			src_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_SRC_IP_ADDRESS);
+			src_vp.vp_type = PW_TYPE_IPV4_ADDR;
 			src_vp.vp_ipaddr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
 
 			dst_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_DST_IP_ADDRESS);
+			dst_vp.vp_type = PW_TYPE_IPV4_ADDR;
 			dst_vp.vp_ipaddr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
 			break;
 
 		case AF_INET6:
 			src_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_SRC_IPV6_ADDRESS);
+			src_vp.vp_type = PW_TYPE_IPV6_ADDR;
 			memcpy(&src_vp.vp_ipv6addr, &packet->src_ipaddr.ipaddr.ip6addr,
 			       sizeof(packet->src_ipaddr.ipaddr.ip6addr));
 			dst_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_DST_IPV6_ADDRESS);
+			dst_vp.vp_type = PW_TYPE_IPV6_ADDR;
 			memcpy(&dst_vp.vp_ipv6addr, &packet->dst_ipaddr.ipaddr.ip6addr,
 			       sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
 			break;
@@ -284,16 +364,18 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 			break;
 		}
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		if ((detail_pair_write(out, request, &src_vp) < 0) ||
+		    (detail_pair_write(out, request, &dst_vp) < 0)) return -1;
 
 		src_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_SRC_PORT);
+		src_vp.vp_type = PW_TYPE_INTEGER;
 		src_vp.vp_integer = packet->src_port;
 		dst_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_DST_PORT);
+		dst_vp.vp_type = PW_TYPE_INTEGER;
 		dst_vp.vp_integer = packet->dst_port;
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		if ((detail_pair_write(out, request, &src_vp) < 0) ||
+		    (detail_pair_write(out, request, &dst_vp) < 0)) return -1;
 	}
 
 	{
@@ -302,8 +384,6 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 		for (vp = fr_pair_cursor_init(&cursor, &packet->vps);
 		     vp;
 		     vp = fr_pair_cursor_next(&cursor)) {
-			FR_TOKEN op;
-
 			if (inst->ht && fr_hash_table_finddata(inst->ht, vp->da)) continue;
 
 			/*
@@ -314,10 +394,7 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 			/*
 			 *	Print all of the attributes, operator should always be '='.
 			 */
-			op = vp->op;
-			vp->op = T_OP_EQ;
-			fr_pair_fprint(out, vp);
-			vp->op = op;
+			if (detail_pair_write(out, request, vp) < 0) return -1;
 		}
 	}
 
@@ -342,6 +419,87 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	return 0;
 }
 
+/** Build a binary detail entry
+ *
+ * @param[out] out Where to write a pointer to the entry.  Allocated in the request.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
+ * @param[in] compat Write out entry in compatibility mode.
+ * @return
+ *	- >0 the length of the entry.
+ *	- 0 if there's nothing to write.
+ *	- -1 on error.
+ */
+static ssize_t detail_binary_build(uint8_t **out, rlm_detail_t const *inst, REQUEST *request,
+				   RADIUS_PACKET *packet, bool compat)
+{
+	uint8_t		*data, *p, *end;
+	detail_binary_t	hdr;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	if (!packet->vps) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	data = talloc_array(request, uint8_t, DETAIL_BINARY_HDR_LEN + DETAIL_BINARY_MAX_LEN);
+	if (!data) return -1;
+
+	p = data + DETAIL_BINARY_HDR_LEN;
+	end = data + talloc_array_length(data);
+
+	fr_pair_cursor_init(&cursor, &packet->vps);
+	while ((vp = fr_pair_cursor_current(&cursor))) {
+		ssize_t slen;
+
+		/*
+		 *	Skip suppressed attributes, passwords in the
+		 *	old format, and ones which have no wire format.
+		 */
+		if ((inst->ht && fr_hash_table_finddata(inst->ht, vp->da)) ||
+		    (compat && !vp->da->vendor && (vp->da->attr == PW_USER_PASSWORD)) ||
+		    vp->da->flags.internal || ((vp->da->vendor == 0) && (vp->da->attr >= 256))) {
+			fr_pair_cursor_next(&cursor);
+			continue;
+		}
+
+		if ((end - p) <= 2) {
+		too_big:
+			RWDEBUG("Entry is too large, ignoring %s and following attributes", vp->da->name);
+			break;
+		}
+
+		slen = detail_binary_encode_pair(p, end - p, &cursor);
+		if (slen < 0) {
+			REDEBUG("Failed encoding %s: %s", vp->da->name, fr_strerror());
+			talloc_free(data);
+			return -1;
+		}
+		if ((slen == 0) && (vp->vp_length != 0)) goto too_big;
+
+		p += slen;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.code = packet->code;
+	hdr.length = p - (data + DETAIL_BINARY_HDR_LEN);
+	hdr.timestamp = request->packet->timestamp.tv_sec;
+
+	if (packet->src_ipaddr.af == packet->dst_ipaddr.af) {
+		hdr.src_ipaddr = packet->src_ipaddr;
+		hdr.dst_ipaddr = packet->dst_ipaddr;
+		hdr.src_port = packet->src_port;
+		hdr.dst_port = packet->dst_port;
+	}
+
+	detail_binary_header_encode(data, &hdr);
+
+	*out = data;
+	return p - data;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -353,8 +511,8 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 
 	FILE		*outfp;
 
+	gid_t		gid = (gid_t) -1;
 #ifdef HAVE_GRP_H
-	gid_t		gid;
 	char		*endptr;
 #endif
 
@@ -388,27 +546,99 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 #endif
 #endif
 
-	outfd = exfile_open(inst->ef, request, buffer, inst->perm, true);
-	if (outfd < 0) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
-		return RLM_MODULE_FAIL;
-	}
-
 	if (inst->group != NULL) {
 		gid = strtol(inst->group, &endptr, 10);
 		if (*endptr != '\0') {
 			if (rad_getgid(request, &gid, inst->group) < 0) {
 				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
+				gid = (gid_t) -1;
 			}
 		}
+	}
+
+	/*
+	 *	Binary entries are always built in memory, and
+	 *	written in one go.
+	 */
+	if (inst->binary) {
+		uint8_t		*data = NULL;
+		ssize_t		len;
+		struct iovec	vector;
+		int		ret;
+
+		len = detail_binary_build(&data, inst, request, packet, compat);
+		if (len < 0) return RLM_MODULE_FAIL;
+		if (len == 0) return RLM_MODULE_OK;
+
+		vector.iov_base = data;
+		vector.iov_len = len;
+
+		ret = exfile_write(inst->ef, request, buffer, inst->perm, gid, &vector, 1);
+		talloc_free(data);
+		if (ret < 0) {
+			RERROR("Couldn't write to %s: %s", buffer, fr_strerror());
+			return RLM_MODULE_FAIL;
+		}
+
+		return RLM_MODULE_OK;
+	}
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+	/*
+	 *	Build the entry in memory, and hand it to the
+	 *	writer thread.
+	 */
+	if (inst->async) {
+		detail_buffer_t	buff = { .data = NULL, .len = 0 };
+		struct iovec	vector;
+		int		ret;
+#  ifdef HAVE_FOPENCOOKIE
+		cookie_io_functions_t io;
+
+		io.read = NULL;
+		io.seek = NULL;
+		io.close = NULL;
+		io.write = detail_buffer_write;
+
+		outfp = fopencookie(&buff, "w", io);
+#  else
+		outfp = funopen(&buff, NULL, detail_buffer_write, NULL, NULL);
+#  endif
+		if (!outfp) {
+			RERROR("Couldn't create buffer for %s: %s", buffer, fr_syserror(errno));
+			return RLM_MODULE_FAIL;
+		}
+
+		ret = detail_write(outfp, inst, request, packet, compat);
+		if ((fclose(outfp) < 0) || (ret < 0)) {
+			talloc_free(buff.data);
+			return RLM_MODULE_FAIL;
+		}
+
+		vector.iov_base = buff.data;
+		vector.iov_len = buff.len;
 
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
+		ret = exfile_write(inst->ef, request, buffer, inst->perm, gid, &vector, 1);
+		talloc_free(buff.data);
+		if (ret < 0) {
+			RERROR("Couldn't write to %s: %s", buffer, fr_strerror());
+			return RLM_MODULE_FAIL;
 		}
+
+		return RLM_MODULE_OK;
+	}
+#endif
+
+	outfd = exfile_open(inst->ef, request, buffer, inst->perm, true);
+	if (outfd < 0) {
+		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
+		return RLM_MODULE_FAIL;
+	}
+
+	if ((gid != (gid_t) -1) && (chown(buffer, -1, gid) == -1)) {
+		RDEBUG2("Unable to change system group of '%s'", buffer);
 	}
 
-skip_group:
 	/*
 	 *	Open the output fp for buffering.
 	 */
@@ -648,7 +648,7 @@ static eap_round_t *eap_round_build(eap_session_t *eap_session, eap_packet_raw_t
 	if (eap_round == NULL) return NULL;
 
 	eap_round->response->packet = (uint8_t *)eap_packet;
-	(void) talloc_steal(eap_round, eap_packet);
+	(void) talloc_steal(eap_round->response, eap_packet);
 	eap_round->response->code = eap_packet->code;
 	eap_round->response->id = eap_packet->id;
 	eap_round->response->type.num = eap_packet->data[0];
@@ -74,6 +74,8 @@ struct _eap_session {
 							//!< the response to the request in #prev_round.
 	eap_round_t 	*this_round;			//!< The EAP response we're processing, and the EAP request
 							//!< we're building.
+	eap_round_t	*spare_round;			//!< Round freed by the last rotation, reused by
+							//!< #eap_round_alloc.
 
 	void 		*opaque;			//!< Opaque data used by EAP methods.
 
@@ -81,6 +83,10 @@ struct _eap_session {
 							//!< Usually set to the process functino of an EAP submodule.
 	int		rounds;				//!< How many roundtrips have occurred this session.
 
+	TALLOC_CTX	*inner_pool;			//!< Inner requests of tunneled methods are allocated
+							//!< from this, so the memory is reused every round.
+	CONF_SECTION	*inner_server_cs;		//!< Virtual server inner requests were last sent to.
+
 	time_t		updated;			//!< The last time we received a packet for this EAP session.
 
 	bool		tls;				//!< Whether EAP method uses TLS.
@@ -143,6 +149,8 @@ typedef struct eap_tunnel_data_t {
 	eap_tunnel_callback_t	callback;
 } eap_tunnel_data_t;
 
+REQUEST		*eap_fake_request_alloc(eap_session_t *eap_session, REQUEST *request);
+
 rlm_rcode_t	eap_virtual_server(REQUEST *request, REQUEST *fake,
 				   eap_session_t *eap_session, char const *virtual_server);
 
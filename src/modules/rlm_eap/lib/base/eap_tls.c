@@ -78,6 +78,7 @@ FR_NAME_NUMBER const eap_tls_status_table[] = {
 	{ "established",		EAP_TLS_ESTABLISHED },
 	{ "fail",			EAP_TLS_FAIL },
 	{ "handled",			EAP_TLS_HANDLED },
+	{ "yield",			EAP_TLS_YIELD },
 
 	{ "start",			EAP_TLS_START_SEND },
 	{ "request",			EAP_TLS_RECORD_SEND },
@@ -281,6 +282,12 @@ int eap_tls_success(eap_session_t *eap_session)
 	 */
 	tls_cache_write(request, tls_session);
 
+	/*
+	 *	For the same reason, session tickets are only
+	 *	accepted once they've been marked here.
+	 */
+	tls_ticket_allow(request, tls_session);
+
 	/*
 	 *	Build the success packet
 	 */
@@ -774,6 +781,15 @@ ignore_length:
 	return EAP_TLS_RECORD_RECV_COMPLETE;
 }
 
+/** Resume the request once an asynchronous crypto operation has completed
+ *
+ */
+static void eap_tls_async_ready(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx, int fd)
+{
+	(void) unlang_event_fd_delete(request, ctx, fd);
+	unlang_resumable(request);
+}
+
 /** Continue with the handshake
  *
  * @param eap_session to continue.
@@ -782,17 +798,42 @@ ignore_length:
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
+ *	- EAP_TLS_YIELD if the handshake is waiting for an asynchronous crypto
+ *	  operation.  The request will be marked resumable when it completes.
  */
 static eap_tls_status_t eap_tls_handshake(eap_session_t *eap_session)
 {
 	REQUEST			*request = eap_session->request;
 	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
 	tls_session_t		*tls_session = eap_tls_session->tls_session;
+	int			ret;
 
 	/*
 	 *	Continue the TLS handshake
 	 */
-	if (!tls_session_handshake(eap_session->request, tls_session)) {
+	ret = tls_session_handshake(eap_session->request, tls_session);
+	if (ret == 2) {
+		int fd;
+
+		fd = tls_session_async_fd(tls_session);
+		if ((fd >= 0) && (unlang_event_fd_readable_add(request, eap_tls_async_ready, tls_session, fd) == 0)) {
+			RDEBUG2("Yielding until asynchronous crypto operation completes");
+			return EAP_TLS_YIELD;
+		}
+
+		/*
+		 *	No fd to wait on, or we couldn't insert the
+		 *	event, so block instead.
+		 */
+		do {
+			if (tls_session_async_wait(request, tls_session) < 0) {
+				ret = 0;
+				break;
+			}
+		} while ((ret = tls_session_handshake(eap_session->request, tls_session)) == 2);
+	}
+
+	if (!ret) {
 		REDEBUG("TLS receive handshake failed during operation");
 		tls_cache_deny(tls_session);
 		return EAP_TLS_FAIL;
@@ -875,6 +916,15 @@ eap_tls_status_t eap_tls_process(eap_session_t *eap_session)
 
 	SSL_set_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_REQUEST, request);
 
+	/*
+	 *	We yielded part way through the handshake, the
+	 *	response has already been verified and fed to OpenSSL.
+	 */
+	if (tls_session->async_pending) {
+		status = eap_tls_handshake(eap_session);
+		goto done;
+	}
+
 	/*
 	 *	Call eap_tls_verify to sanity check the incoming EAP data.
 	 */
@@ -924,13 +974,14 @@ eap_tls_status_t eap_tls_process(eap_session_t *eap_session)
 		}
 
 		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
+		 *	Queue the fragment for OpenSSL to read.
 		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
+		 *	It's left in the packet it arrived in, which is kept
+		 *	until OpenSSL has read it, so fragments are never
+		 *	copied into a reassembly buffer.
 		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if (tls_session_recv_borrow(tls_session, data, data_len, this_round->response->packet) < 0) {
+			REDEBUG("Failed adding TLS record fragment: %s", fr_strerror());
 			status = EAP_TLS_FAIL;
 			goto done;
 		}
@@ -92,6 +92,9 @@ typedef enum {
 	EAP_TLS_ESTABLISHED,       			//!< Session established, send success (or start phase2).
 	EAP_TLS_FAIL,       				//!< Fail, send fail.
 	EAP_TLS_HANDLED,	  			//!< TLS code has handled it.
+	EAP_TLS_YIELD,					//!< Waiting for an asynchronous crypto operation.
+							//!< Call eap_tls_process again when the request
+							//!< is resumed.
 
 	/*
 	 *	Composition states, we need to
@@ -392,6 +392,33 @@ void eap_add_reply(REQUEST *request,
 	REXDENT();
 }
 
+/** Allocate an inner request for a tunneled method
+ *
+ * Inner requests are allocated from a pool kept with the eap_session_t.
+ * They're freed at the end of every round, so the same memory is used
+ * for the request, its packets and attributes each time.
+ *
+ * @param[in] eap_session	of the tunneled method.
+ * @param[in] request		the outer request.
+ * @return
+ *	- The inner request.
+ *	- NULL on error.
+ */
+REQUEST *eap_fake_request_alloc(eap_session_t *eap_session, REQUEST *request)
+{
+	if (!eap_session->inner_pool) {
+		/*
+		 *	The eap_session_t is a pooled object itself,
+		 *	so the pool isn't allocated inside it.  It's
+		 *	freed with the eap_session_t.
+		 */
+		eap_session->inner_pool = talloc_pool(NULL, main_config.talloc_pool_size);
+		if (!eap_session->inner_pool) return NULL;
+	}
+
+	return request_alloc_fake_ctx(eap_session->inner_pool, request);
+}
+
 /** Send a fake request to a virtual server, managing the eap_session_t of the child
  *
  * If eap_session_t has a child, inject that into the fake request.
@@ -419,6 +446,17 @@ rlm_rcode_t eap_virtual_server(REQUEST *request, REQUEST *fake,
 
 	if (fake->server) {
 		RDEBUG2("Proxying tunneled request to virtual server \"%s\"", fake->server);
+
+		/*
+		 *	Look the server up once per session, instead
+		 *	of in every section of every round.
+		 */
+		if (!eap_session->inner_server_cs ||
+		    (strcmp(cf_section_name2(eap_session->inner_server_cs), fake->server) != 0)) {
+			eap_session->inner_server_cs = cf_section_sub_find_name2(main_config.config, "server",
+										 fake->server);
+		}
+		fake->server_cs = eap_session->inner_server_cs;
 	} else {
 		RDEBUG2("Proxying tunneled request");
 	}
@@ -71,6 +71,11 @@ typedef enum {
 	SIM_VECTOR_SRC_KI				//!< Should generate triplets locally using a Ki.
 } fr_sim_vector_src_t;
 
+/** Holds vectors acquired in batches until they're needed
+ *
+ */
+typedef struct fr_sim_vector_cache fr_sim_vector_cache_t;
+
 typedef struct gsm_vector {
 	uint8_t		rand[SIM_VECTOR_GSM_RAND_SIZE];			//!< RAND challenge to the SIM.
 	union {
@@ -204,6 +209,22 @@ int		fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 int		fr_sim_vector_umts_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 					      fr_sim_keys_t *keys, fr_sim_vector_src_t *src);
 
+fr_sim_vector_cache_t *fr_sim_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t lifetime);
+
+uint32_t	fr_sim_vector_cache_count(fr_sim_vector_cache_t *cache, char const *id, fr_sim_vector_type_t type);
+
+int		fr_sim_vector_gsm_from_cache(fr_sim_vector_cache_t *cache, eap_session_t *eap_session,
+					     fr_sim_keys_t *keys);
+
+void		fr_sim_vector_gsm_cache_store(fr_sim_vector_cache_t *cache, eap_session_t *eap_session,
+					      VALUE_PAIR *vps, int start, fr_sim_vector_src_t src);
+
+int		fr_sim_vector_umts_from_cache(fr_sim_vector_cache_t *cache, eap_session_t *eap_session,
+					      fr_sim_keys_t *keys);
+
+void		fr_sim_vector_umts_cache_store(fr_sim_vector_cache_t *cache, eap_session_t *eap_session,
+					       VALUE_PAIR *vps, int start, fr_sim_vector_src_t src);
+
 /*
  *	fips186prf.c
  */
@@ -32,13 +32,14 @@ RCSID("$Id$")
 #include "comp128.h"
 
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/heap.h>
 
-static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
-			      int idx, fr_sim_keys_t *keys)
+#include <pthread.h>
+
+static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, fr_sim_vector_gsm_t *vector)
 {
 	REQUEST	*request = eap_session->request;
 	VALUE_PAIR *vp, *version;
-	int i;
 
 	/*
 	 *	Generate a new RAND value, and derive Kc and SRES from Ki
@@ -59,29 +60,27 @@ static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 		return 1;
 	}
 
-	for (i = 0; i < SIM_VECTOR_GSM_RAND_SIZE; i++) {
-		keys->gsm.vector[idx].rand[i] = fr_rand();
-	}
+	fr_rand_buffer(vector->rand, SIM_VECTOR_GSM_RAND_SIZE);
 
 	switch (version->vp_integer) {
 	case 1:
-		comp128v1(keys->gsm.vector[idx].sres,
-			  keys->gsm.vector[idx].kc, vp->vp_octets,
-			  keys->gsm.vector[idx].rand);
+		comp128v1(vector->sres,
+			  vector->kc, vp->vp_octets,
+			  vector->rand);
 		break;
 
 	case 2:
-		comp128v23(keys->gsm.vector[idx].sres,
-			   keys->gsm.vector[idx].kc,
+		comp128v23(vector->sres,
+			   vector->kc,
 			   vp->vp_octets,
-			   keys->gsm.vector[idx].rand, true);
+			   vector->rand, true);
 		break;
 
 	case 3:
-		comp128v23(keys->gsm.vector[idx].sres,
-			   keys->gsm.vector[idx].kc,
+		comp128v23(vector->sres,
+			   vector->kc,
 			   vp->vp_octets,
-			   keys->gsm.vector[idx].rand, false);
+			   vector->rand, false);
 		break;
 
 	case 4:
@@ -96,7 +95,7 @@ static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 }
 
 static int vector_gsm_from_triplets(eap_session_t *eap_session, VALUE_PAIR *vps,
-				    int idx, fr_sim_keys_t *keys)
+				    int idx, fr_sim_vector_gsm_t *vector)
 {
 	REQUEST		*request = eap_session->request;
 	VALUE_PAIR	*rand = NULL, *sres = NULL, *kc = NULL;
@@ -140,9 +139,9 @@ static int vector_gsm_from_triplets(eap_session_t *eap_session, VALUE_PAIR *vps,
 		return -1;
 	}
 
-	memcpy(keys->gsm.vector[idx].kc, kc->vp_strvalue, SIM_VECTOR_GSM_KC_SIZE);
-	memcpy(keys->gsm.vector[idx].rand, rand->vp_octets, SIM_VECTOR_GSM_RAND_SIZE);
-	memcpy(keys->gsm.vector[idx].sres, sres->vp_octets, SIM_VECTOR_GSM_SRES_SIZE);
+	memcpy(vector->kc, kc->vp_strvalue, SIM_VECTOR_GSM_KC_SIZE);
+	memcpy(vector->rand, rand->vp_octets, SIM_VECTOR_GSM_RAND_SIZE);
+	memcpy(vector->sres, sres->vp_octets, SIM_VECTOR_GSM_SRES_SIZE);
 
 	return 0;
 }
@@ -156,7 +155,7 @@ static int vector_gsm_from_triplets(eap_session_t *eap_session, VALUE_PAIR *vps,
  *		   (IK[0]...IK[63]) ⊕ (IK[64]...IK[127)
  */
 static int vector_gsm_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *vps,
-				       int idx, fr_sim_keys_t *keys)
+				       int idx, fr_sim_vector_gsm_t *vector)
 {
 	REQUEST		*request = eap_session->request;
 	vp_cursor_t	cursor;
@@ -217,14 +216,14 @@ static int vector_gsm_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *v
 		return 1;
 	}
 
-	memcpy(keys->gsm.vector[idx].rand, rand->vp_octets, SIM_VECTOR_GSM_RAND_SIZE);
+	memcpy(vector->rand, rand->vp_octets, SIM_VECTOR_GSM_RAND_SIZE);
 
 	/*
 	 *	Fold CK and IK in 64bit quantities to produce Kc
 	 */
 	ck_ptr = (uint64_t const *)ck->vp_octets;
 	ik_ptr = (uint64_t const *)ik->vp_octets;
-	keys->gsm.vector[idx].kc_uint64 = ((ck_ptr[0] ^ ck_ptr[1]) ^ ik_ptr[0]) ^ ik_ptr[1];
+	vector->kc_uint64 = ((ck_ptr[0] ^ ck_ptr[1]) ^ ik_ptr[0]) ^ ik_ptr[1];
 
 	/*
 	 *	Have to pad XRES out to 16 octets if it's shorter than that.
@@ -241,7 +240,7 @@ static int vector_gsm_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *v
 	 *	Fold XRES into itself in 32bit quantities using xor to
 	 *	produce SRES.
 	 */
-	keys->gsm.vector[idx].sres_uint32 = ((xres_ptr[0] ^ xres_ptr[1]) ^ xres_ptr[2]) ^ xres_ptr[3];
+	vector->sres_uint32 = ((xres_ptr[0] ^ xres_ptr[1]) ^ xres_ptr[2]) ^ xres_ptr[3];
 
 	return 0;
 }
@@ -274,7 +273,7 @@ int fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 	switch (*src) {
 	default:
 	case SIM_VECTOR_SRC_KI:
-		ret = vector_gsm_from_ki(eap_session, vps, idx, keys);
+		ret = vector_gsm_from_ki(eap_session, vps, &keys->gsm.vector[idx]);
 		if (ret == 0) {
 			*src = SIM_VECTOR_SRC_KI;
 			break;
@@ -284,7 +283,7 @@ int fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 		/* FALL-THROUGH */
 
 	case SIM_VECTOR_SRC_TRIPLETS:
-		ret = vector_gsm_from_triplets(eap_session, vps, idx, keys);
+		ret = vector_gsm_from_triplets(eap_session, vps, idx, &keys->gsm.vector[idx]);
 		if (ret == 0) {
 			*src = SIM_VECTOR_SRC_TRIPLETS;
 			break;
@@ -294,7 +293,7 @@ int fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 		/* FALL-THROUGH */
 
 	case SIM_VECTOR_SRC_QUINTUPLETS:
-		ret = vector_gsm_from_quintuplets(eap_session, vps, idx, keys);
+		ret = vector_gsm_from_quintuplets(eap_session, vps, idx, &keys->gsm.vector[idx]);
 		if (ret == 0) {
 			*src = SIM_VECTOR_SRC_QUINTUPLETS;
 			break;
@@ -359,9 +358,7 @@ static int vector_umts_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 		return 1;
 	}
 
-	for (i = 0; i < SIM_VECTOR_UMTS_RAND_SIZE; i++) {
-		keys->umts.vector.rand[i] = fr_rand();
-	}
+	fr_rand_buffer(keys->umts.vector.rand, SIM_VECTOR_UMTS_RAND_SIZE);
 
 	switch (version->vp_integer) {
 	case 1:
@@ -402,10 +399,41 @@ static int vector_umts_from_ki(UNUSED eap_session_t *eap_session, UNUSED VALUE_P
 }
 #endif
 
+/** Find the idx'th instance of an attribute
+ *
+ */
+static VALUE_PAIR *vector_attr_find(VALUE_PAIR *vps, fr_dict_attr_t const *parent, unsigned int attr, int idx)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp = NULL;
+	int		i;
+
+	for (i = 0, fr_pair_cursor_init(&cursor, &vps);
+	     (i <= idx) && (vp = fr_pair_cursor_next_by_child_num(&cursor, parent, attr, TAG_ANY)); i++);
+
+	return vp;
+}
+
+/** Count the instances of an attribute
+ *
+ */
+static size_t vector_attr_count(VALUE_PAIR *vps, fr_dict_attr_t const *parent, unsigned int attr)
+{
+	vp_cursor_t	cursor;
+	size_t		num = 0;
+
+	for (fr_pair_cursor_init(&cursor, &vps);
+	     fr_pair_cursor_next_by_child_num(&cursor, parent, attr, TAG_ANY);
+	     num++);
+
+	return num;
+}
+
 /** Get one set of quintuplets from the request
  *
  */
-static int vector_umts_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *vps, fr_sim_keys_t *keys)
+static int vector_umts_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *vps,
+					int idx, fr_sim_vector_umts_t *vector)
 {
 	REQUEST		*request = eap_session->request;
 
@@ -414,84 +442,84 @@ static int vector_umts_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *
 	/*
 	 *	Fetch AUTN
 	 */
-	autn = fr_pair_find_by_child_num(vps, dict_aka_root, PW_EAP_AKA_AUTN, TAG_ANY);
+	autn = vector_attr_find(vps, dict_aka_root, PW_EAP_AKA_AUTN, idx);
 	if (!autn) {
-		RDEBUG3("No &control:PW_EAP_AKA_AUTN attribute found, not using UMTS quintuplets");
+		RDEBUG3("No &control:EAP-AKA-AUTN[%i] attribute found, not using UMTS quintuplets", idx);
 		return 1;
 	}
 
 	if (autn->vp_length > SIM_VECTOR_UMTS_AUTN_SIZE) {
-		REDEBUG("&control:EAP-AKA-AUTN incorrect length.  Expected "
-			STRINGIFY(SIM_VECTOR_UMTS_AUTN_SIZE) " bytes, got %zu bytes", autn->vp_length);
+		REDEBUG("&control:EAP-AKA-AUTN[%i] incorrect length.  Expected "
+			STRINGIFY(SIM_VECTOR_UMTS_AUTN_SIZE) " bytes, got %zu bytes", idx, autn->vp_length);
 		return -1;
 	}
 
 	/*
 	 *	Fetch CK
 	 */
-	ck = fr_pair_find_by_child_num(vps, dict_aka_root, PW_EAP_AKA_CK, TAG_ANY);
+	ck = vector_attr_find(vps, dict_aka_root, PW_EAP_AKA_CK, idx);
 	if (!ck) {
-		RDEBUG3("No &control:EAP-AKA-CK attribute found, not using UMTS quintuplets");
+		RDEBUG3("No &control:EAP-AKA-CK[%i] attribute found, not using UMTS quintuplets", idx);
 		return 1;
 	}
 
 	if (ck->vp_length > SIM_VECTOR_UMTS_CK_SIZE) {
-		REDEBUG("&control:EAP-AKA-CK incorrect length.  Expected "
-			STRINGIFY(EAP_AKA_XRES_MAX_SIZE) " bytes, got %zu bytes", ck->vp_length);
+		REDEBUG("&control:EAP-AKA-CK[%i] incorrect length.  Expected "
+			STRINGIFY(EAP_AKA_XRES_MAX_SIZE) " bytes, got %zu bytes", idx, ck->vp_length);
 		return -1;
 	}
 
 	/*
 	 *	Fetch IK
 	 */
-	ik = fr_pair_find_by_child_num(vps, dict_aka_root, PW_EAP_AKA_IK, TAG_ANY);
+	ik = vector_attr_find(vps, dict_aka_root, PW_EAP_AKA_IK, idx);
 	if (!ik) {
-		RDEBUG3("No &control:EAP-AKA-IK attribute found, not using UMTS quintuplets");
+		RDEBUG3("No &control:EAP-AKA-IK[%i] attribute found, not using UMTS quintuplets", idx);
 		return 1;
 	}
 
 	if (ik->vp_length > SIM_VECTOR_UMTS_IK_SIZE) {
-		REDEBUG("&control:EAP-AKA-IK incorrect length.  Expected "
-			STRINGIFY(SIM_VECTOR_UMTS_IK_SIZE) " bytes, got %zu bytes", ik->vp_length);
+		REDEBUG("&control:EAP-AKA-IK[%i] incorrect length.  Expected "
+			STRINGIFY(SIM_VECTOR_UMTS_IK_SIZE) " bytes, got %zu bytes", idx, ik->vp_length);
 		return -1;
 	}
 
 	/*
 	 *	Fetch RAND
 	 */
-	rand = fr_pair_find_by_child_num(vps, dict_aka_root, PW_EAP_AKA_RAND, TAG_ANY);
+	rand = vector_attr_find(vps, dict_aka_root, PW_EAP_AKA_RAND, idx);
 	if (!rand) {
-		RDEBUG3("No &control:EAP-AKA-Rand attribute found, not using quintuplet derivation");
+		RDEBUG3("No &control:EAP-AKA-Rand[%i] attribute found, not using quintuplet derivation", idx);
 		return 1;
 	}
 
 	if (rand->vp_length != SIM_VECTOR_UMTS_RAND_SIZE) {
-		REDEBUG("&control:EAP-AKA-RAND incorrect length.  Expected " STRINGIFY(SIM_VECTOR_UMTS_RAND_SIZE) " bytes, "
-			"got %zu bytes", rand->vp_length);
+		REDEBUG("&control:EAP-AKA-RAND[%i] incorrect length.  Expected " STRINGIFY(SIM_VECTOR_UMTS_RAND_SIZE) " bytes, "
+			"got %zu bytes", idx, rand->vp_length);
 		return -1;
 	}
 
 	/*
 	 *	Fetch XRES
 	 */
-	xres = fr_pair_find_by_child_num(vps, dict_aka_root, PW_EAP_AKA_XRES, TAG_ANY);
+	xres = vector_attr_find(vps, dict_aka_root, PW_EAP_AKA_XRES, idx);
 	if (!xres) {
-		RDEBUG3("No &control:EAP-AKA-XRES attribute found, not using UMTS quintuplets");
+		RDEBUG3("No &control:EAP-AKA-XRES[%i] attribute found, not using UMTS quintuplets", idx);
 		return 1;
 	}
 
 	if (xres->vp_length > SIM_VECTOR_UMTS_XRES_MAX_SIZE) {
-		REDEBUG("&control:EAP-AKA-XRES incorrect length.  Expected < "
-			STRINGIFY(EAP_AKA_XRES_MAX_SIZE) " bytes, got %zu bytes", xres->vp_length);
+		REDEBUG("&control:EAP-AKA-XRES[%i] incorrect length.  Expected < "
+			STRINGIFY(EAP_AKA_XRES_MAX_SIZE) " bytes, got %zu bytes", idx, xres->vp_length);
 		return -1;
 	}
 
-	memcpy(keys->umts.vector.autn, autn->vp_octets, SIM_VECTOR_UMTS_AUTN_SIZE);
-	memcpy(keys->umts.vector.ck, ck->vp_octets, SIM_VECTOR_UMTS_CK_SIZE);
-	memcpy(keys->umts.vector.ik, ik->vp_octets, SIM_VECTOR_UMTS_IK_SIZE);
-	memcpy(keys->umts.vector.rand, rand->vp_octets, SIM_VECTOR_UMTS_RAND_SIZE);
-	memcpy(keys->umts.vector.xres, xres->vp_octets, xres->vp_length);
-	keys->umts.vector.xres_len = xres->vp_length;	/* xres is variable length */
+	memcpy(vector->autn, autn->vp_octets, SIM_VECTOR_UMTS_AUTN_SIZE);
+	memcpy(vector->ck, ck->vp_octets, SIM_VECTOR_UMTS_CK_SIZE);
+	memcpy(vector->ik, ik->vp_octets, SIM_VECTOR_UMTS_IK_SIZE);
+	memcpy(vector->rand, rand->vp_octets, SIM_VECTOR_UMTS_RAND_SIZE);
+	memcpy(vector->xres, xres->vp_octets, xres->vp_length);
+	vector->xres_len = xres->vp_length;	/* xres is variable length */
 
 	return 0;
 }
@@ -531,7 +559,7 @@ int fr_sim_vector_umts_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 		/* FALL-THROUGH */
 
 	case SIM_VECTOR_SRC_QUINTUPLETS:
-		ret = vector_umts_from_quintuplets(eap_session, vps, keys);
+		ret = vector_umts_from_quintuplets(eap_session, vps, 0, &keys->umts.vector);
 		if (ret == 0) {
 			*src = SIM_VECTOR_SRC_QUINTUPLETS;
 			break;;
@@ -574,3 +602,422 @@ int fr_sim_vector_umts_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 
 	return 0;
 }
+
+/** Vectors issued for a subscriber which haven't been used yet
+ *
+ */
+typedef struct fr_sim_vector_cache_entry {
+	char const		*id;		//!< Identity the vectors were acquired for.
+	time_t			expires;	//!< When the vectors should no longer be used.
+	int			heap_id;	//!< Position in the expiry heap.
+
+	fr_sim_vector_type_t	type;		//!< Whether gsm or umts is populated.
+	uint32_t		num;		//!< Number of vectors in the array.
+	uint32_t		next;		//!< Next vector to hand out.
+	union {
+		fr_sim_vector_gsm_t	*gsm;		//!< GSM triplets.
+		fr_sim_vector_umts_t	*umts;		//!< UMTS quintuplets.
+	};
+} fr_sim_vector_cache_entry_t;
+
+/** Vectors acquired in batches, and handed out over multiple authentications
+ *
+ */
+struct fr_sim_vector_cache {
+	rbtree_t		*tree;		//!< Entries indexed by identity.
+	fr_heap_t		*heap;		//!< Entries ordered by expiry.
+
+	uint32_t		max_entries;	//!< Maximum number of subscribers to hold vectors for.
+	uint32_t		lifetime;	//!< How long vectors may be held before they're discarded.
+
+	pthread_mutex_t		mutex;		//!< Protects the tree and heap.
+};
+
+static int vector_cache_entry_cmp(void const *one, void const *two)
+{
+	fr_sim_vector_cache_entry_t const *a = one, *b = two;
+
+	return strcmp(a->id, b->id);
+}
+
+static int vector_cache_heap_cmp(void const *one, void const *two)
+{
+	fr_sim_vector_cache_entry_t const *a = one, *b = two;
+
+	return (a->expires > b->expires) - (a->expires < b->expires);
+}
+
+static int _vector_cache_free(fr_sim_vector_cache_t *cache)
+{
+	fr_heap_delete(cache->heap);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Create a cache for vectors acquired in batches
+ *
+ * When the backend provides more vectors than are needed for a single
+ * authentication, the surplus is stored here, and used for subsequent
+ * authentications of the same subscriber, avoiding a round trip to
+ * the HLR/HSS.
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of subscribers we hold vectors for.
+ *				When full, the entries closest to expiry are discarded.
+ * @param[in] lifetime		How long to keep vectors for, in seconds.
+ * @return
+ *	- A new vector cache.
+ *	- NULL on error.
+ */
+fr_sim_vector_cache_t *fr_sim_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t lifetime)
+{
+	fr_sim_vector_cache_t *cache;
+
+	cache = talloc_zero(ctx, fr_sim_vector_cache_t);
+	if (!cache) return NULL;
+
+	cache->tree = rbtree_create(cache, vector_cache_entry_cmp, rbtree_node_talloc_free, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+	error:
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+		fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	cache->heap = fr_heap_create(vector_cache_heap_cmp, offsetof(fr_sim_vector_cache_entry_t, heap_id));
+	if (!cache->heap) {
+		pthread_mutex_destroy(&cache->mutex);
+		fr_strerror_printf("Failed creating expiry heap");
+		goto error;
+	}
+	talloc_set_destructor(cache, _vector_cache_free);
+
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+
+	return cache;
+}
+
+/** Remove an entry from the cache and free it
+ *
+ * @note Must be called with the mutex held.
+ */
+static void vector_cache_entry_delete(fr_sim_vector_cache_t *cache, fr_sim_vector_cache_entry_t *entry)
+{
+	fr_heap_extract(cache->heap, entry);
+	rbtree_deletebydata(cache->tree, entry);	/* Frees entry */
+}
+
+/** Discard expired entries
+ *
+ * @note Must be called with the mutex held.
+ */
+static void vector_cache_expire(fr_sim_vector_cache_t *cache, time_t now)
+{
+	fr_sim_vector_cache_entry_t *entry;
+
+	while ((entry = fr_heap_peek(cache->heap)) && (entry->expires <= now)) {
+		vector_cache_entry_delete(cache, entry);
+	}
+}
+
+/** Find the unexpired entry associated with an identity
+ *
+ * @note Must be called with the mutex held.
+ */
+static fr_sim_vector_cache_entry_t *vector_cache_find(fr_sim_vector_cache_t *cache, char const *id,
+						      fr_sim_vector_type_t type, time_t now)
+{
+	fr_sim_vector_cache_entry_t find = { .id = id }, *entry;
+
+	vector_cache_expire(cache, now);
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry || (entry->type != type)) return NULL;
+
+	return entry;
+}
+
+/** Insert vectors into the cache, replacing any existing ones for the identity
+ *
+ * @note Must be called with the mutex held.
+ */
+static void vector_cache_insert(fr_sim_vector_cache_t *cache, fr_sim_vector_cache_entry_t *entry, time_t now)
+{
+	fr_sim_vector_cache_entry_t *old;
+
+	entry->expires = now + cache->lifetime;
+
+	old = rbtree_finddata(cache->tree, entry);
+	if (old) vector_cache_entry_delete(cache, old);
+
+	while (cache->max_entries && (rbtree_num_elements(cache->tree) >= cache->max_entries)) {
+		vector_cache_entry_delete(cache, fr_heap_peek(cache->heap));
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		return;
+	}
+	fr_heap_insert(cache->heap, entry);
+}
+
+/** Allocate a cache entry, to be populated and inserted
+ *
+ */
+static fr_sim_vector_cache_entry_t *vector_cache_entry_alloc(fr_sim_vector_cache_t *cache, char const *id,
+							     fr_sim_vector_type_t type)
+{
+	fr_sim_vector_cache_entry_t *entry;
+
+	entry = talloc_zero(cache, fr_sim_vector_cache_entry_t);
+	if (!entry) return NULL;
+
+	entry->id = talloc_typed_strdup(entry, id);
+	if (!entry->id) {
+		talloc_free(entry);
+		return NULL;
+	}
+	entry->type = type;
+	entry->heap_id = -1;
+
+	return entry;
+}
+
+/** Return how many authentications can be performed with the cached vectors for an identity
+ *
+ * Allows policies to skip fetching vectors from the backend,
+ * if there are enough cached already.
+ *
+ * @param[in] cache	to check.
+ * @param[in] id	to check for.
+ * @param[in] type	of vectors, either SIM_VECTOR_GSM or SIM_VECTOR_UMTS.
+ * @return the number of authentications the cached vectors are sufficient for.
+ */
+uint32_t fr_sim_vector_cache_count(fr_sim_vector_cache_t *cache, char const *id, fr_sim_vector_type_t type)
+{
+	fr_sim_vector_cache_entry_t	*entry;
+	uint32_t			count = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = vector_cache_find(cache, id, type, time(NULL));
+	if (entry) {
+		count = entry->num - entry->next;
+		if (type == SIM_VECTOR_GSM) count /= 3;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return count;
+}
+
+/** Retrieve GSM triplets from the vector cache
+ *
+ * @param[in] cache		to retrieve vectors from.
+ * @param[in] eap_session	The current eap_session.  Vectors are retrieved for
+ *				the identity of the session.
+ * @param[out] keys		EAP session keys to write all three triplets to.
+ * @return
+ *	- 1	Not enough vectors cached for the identity.
+ *	- 0	Vectors were retrieved OK.
+ */
+int fr_sim_vector_gsm_from_cache(fr_sim_vector_cache_t *cache, eap_session_t *eap_session, fr_sim_keys_t *keys)
+{
+	REQUEST				*request = eap_session->request;
+	fr_sim_vector_cache_entry_t	*entry;
+	uint32_t			remaining;
+
+	rad_assert(keys->vector_type == SIM_VECTOR_NONE);
+
+	if (!eap_session->identity) return 1;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = vector_cache_find(cache, eap_session->identity, SIM_VECTOR_GSM, time(NULL));
+	if (!entry || ((entry->num - entry->next) < 3)) {
+		pthread_mutex_unlock(&cache->mutex);
+		RDEBUG3("No cached GSM vectors for \"%s\"", eap_session->identity);
+		return 1;
+	}
+
+	memcpy(keys->gsm.vector, &entry->gsm[entry->next], sizeof(keys->gsm.vector));
+	entry->next += 3;
+
+	remaining = entry->num - entry->next;
+	if (remaining < 3) vector_cache_entry_delete(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	RDEBUG2("Using cached GSM vectors for \"%s\" (%u left)", eap_session->identity, remaining);
+
+	keys->vector_type = SIM_VECTOR_GSM;
+
+	return 0;
+}
+
+/** Store additional GSM triplets for use in subsequent authentications
+ *
+ * @param[in] cache		to store vectors in.
+ * @param[in] eap_session	The current eap_session.  Vectors are stored for the
+ *				identity of the session.
+ * @param[in] vps		List to hunt for triplets in.
+ * @param[in] start		Index of the first triplet to store.  Triplets before
+ *				this have already been used for the current authentication.
+ * @param[in] src		Where the triplets for the current authentication came from.
+ *				Vectors generated locally from Ki are not cached.
+ */
+void fr_sim_vector_gsm_cache_store(fr_sim_vector_cache_t *cache, eap_session_t *eap_session, VALUE_PAIR *vps,
+				   int start, fr_sim_vector_src_t src)
+{
+	REQUEST				*request = eap_session->request;
+	fr_sim_vector_cache_entry_t	*entry;
+	fr_sim_vector_gsm_t		vector;
+	size_t				num;
+	int				i, ret;
+
+	if (!eap_session->identity) return;
+
+	switch (src) {
+	case SIM_VECTOR_SRC_TRIPLETS:
+		num = vector_attr_count(vps, dict_sim_root, PW_EAP_SIM_RAND);
+		break;
+
+	case SIM_VECTOR_SRC_QUINTUPLETS:
+		num = vector_attr_count(vps, dict_aka_root, PW_EAP_AKA_RAND);
+		break;
+
+	default:
+		return;
+	}
+	if (num < (size_t)(start + 3)) return;	/* Not enough for another authentication */
+
+	entry = vector_cache_entry_alloc(cache, eap_session->identity, SIM_VECTOR_GSM);
+	if (!entry) return;
+
+	entry->gsm = talloc_array(entry, fr_sim_vector_gsm_t, num - start);
+	if (!entry->gsm) {
+		talloc_free(entry);
+		return;
+	}
+
+	for (i = start; entry->num < (num - start); i++) {
+		if (src == SIM_VECTOR_SRC_TRIPLETS) {
+			ret = vector_gsm_from_triplets(eap_session, vps, i, &vector);
+		} else {
+			ret = vector_gsm_from_quintuplets(eap_session, vps, i, &vector);
+		}
+		if (ret != 0) break;
+
+		entry->gsm[entry->num++] = vector;
+	}
+
+	if (entry->num < 3) {
+		talloc_free(entry);
+		return;
+	}
+
+	RDEBUG2("Caching %u additional GSM vectors for \"%s\"", entry->num, eap_session->identity);
+
+	pthread_mutex_lock(&cache->mutex);
+	vector_cache_insert(cache, entry, time(NULL));
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Retrieve a UMTS quintuplet from the vector cache
+ *
+ * @param[in] cache		to retrieve vectors from.
+ * @param[in] eap_session	The current eap_session.  Vectors are retrieved for
+ *				the identity of the session.
+ * @param[out] keys		UMTS keys.
+ * @return
+ *	- 1	No vectors cached for the identity.
+ *	- 0	Vector was retrieved OK.
+ */
+int fr_sim_vector_umts_from_cache(fr_sim_vector_cache_t *cache, eap_session_t *eap_session, fr_sim_keys_t *keys)
+{
+	REQUEST				*request = eap_session->request;
+	fr_sim_vector_cache_entry_t	*entry;
+	uint32_t			remaining;
+
+	rad_assert(keys->vector_type == SIM_VECTOR_NONE);
+
+	if (!eap_session->identity) return 1;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = vector_cache_find(cache, eap_session->identity, SIM_VECTOR_UMTS, time(NULL));
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		RDEBUG3("No cached UMTS vectors for \"%s\"", eap_session->identity);
+		return 1;
+	}
+
+	/*
+	 *	Quintuplets are handed out in the order the
+	 *	HSS issued them, so their sequence numbers
+	 *	increase.
+	 */
+	keys->umts.vector = entry->umts[entry->next++];
+
+	remaining = entry->num - entry->next;
+	if (remaining == 0) vector_cache_entry_delete(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	RDEBUG2("Using cached UMTS vector for \"%s\" (%u left)", eap_session->identity, remaining);
+
+	keys->vector_type = SIM_VECTOR_UMTS;
+
+	return 0;
+}
+
+/** Store additional UMTS quintuplets for use in subsequent authentications
+ *
+ * @param[in] cache		to store vectors in.
+ * @param[in] eap_session	The current eap_session.  Vectors are stored for the
+ *				identity of the session.
+ * @param[in] vps		List to hunt for quintuplets in.
+ * @param[in] start		Index of the first quintuplet to store.
+ * @param[in] src		Where the quintuplet for the current authentication came from.
+ *				Vectors generated locally from Ki are not cached.
+ */
+void fr_sim_vector_umts_cache_store(fr_sim_vector_cache_t *cache, eap_session_t *eap_session, VALUE_PAIR *vps,
+				    int start, fr_sim_vector_src_t src)
+{
+	REQUEST				*request = eap_session->request;
+	fr_sim_vector_cache_entry_t	*entry;
+	fr_sim_vector_umts_t		vector;
+	size_t				num;
+	int				i;
+
+	if (!eap_session->identity || (src != SIM_VECTOR_SRC_QUINTUPLETS)) return;
+
+	num = vector_attr_count(vps, dict_aka_root, PW_EAP_AKA_RAND);
+	if (num <= (size_t)start) return;
+
+	entry = vector_cache_entry_alloc(cache, eap_session->identity, SIM_VECTOR_UMTS);
+	if (!entry) return;
+
+	entry->umts = talloc_array(entry, fr_sim_vector_umts_t, num - start);
+	if (!entry->umts) {
+		talloc_free(entry);
+		return;
+	}
+
+	for (i = start; entry->num < (num - start); i++) {
+		if (vector_umts_from_quintuplets(eap_session, vps, i, &vector) != 0) break;
+
+		entry->umts[entry->num++] = vector;
+	}
+
+	if (entry->num == 0) {
+		talloc_free(entry);
+		return;
+	}
+
+	RDEBUG2("Caching %u additional UMTS vectors for \"%s\"", entry->num, eap_session->identity);
+
+	pthread_mutex_lock(&cache->mutex);
+	vector_cache_insert(cache, entry, time(NULL));
+	pthread_mutex_unlock(&cache->mutex);
+}
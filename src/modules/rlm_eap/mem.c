@@ -26,6 +26,14 @@ RCSID("$Id$")
 #include <stdio.h>
 #include "rlm_eap.h"
 
+/** Size of the pool allocated with each #eap_session_t
+ *
+ * Enough for the current and previous rounds, their packet headers,
+ * and the identity, so these don't need separate allocations.
+ */
+#define EAP_SESSION_POOL_OBJECTS	7
+#define EAP_SESSION_POOL_SIZE		((2 * sizeof(eap_round_t)) + (4 * sizeof(eap_packet_t)) + 128)
+
 /*
  * Allocate a new eap_packet_t
  */
@@ -33,6 +41,21 @@ eap_round_t *eap_round_alloc(eap_session_t *eap_session)
 {
 	eap_round_t	*eap_round;
 
+	/*
+	 *	Reuse the round released by the last
+	 *	call to eap_round_rotate().
+	 */
+	if (eap_session->spare_round) {
+		eap_round = eap_session->spare_round;
+		eap_session->spare_round = NULL;
+
+		memset(eap_round->response, 0, sizeof(*eap_round->response));
+		memset(eap_round->request, 0, sizeof(*eap_round->request));
+		eap_round->set_request_id = false;
+
+		return eap_round;
+	}
+
 	eap_round = talloc_zero(eap_session, eap_round_t);
 	if (!eap_round) return NULL;
 
@@ -50,6 +73,52 @@ eap_round_t *eap_round_alloc(eap_session_t *eap_session)
 	return eap_round;
 }
 
+/** Free the contents of an #eap_packet_t, leaving only the header fields
+ *
+ * @param[in] packet	to compact.
+ */
+static void eap_packet_compact(eap_packet_t *packet)
+{
+	talloc_free_children(packet);
+
+	packet->length = 0;
+	packet->type.length = 0;
+	packet->type.data = NULL;
+	packet->packet = NULL;
+}
+
+/** Make the current round the previous round
+ *
+ * Once a round is complete, only the code, id and type of its packets
+ * are needed to correlate the next response with the request we sent,
+ * so the packet data is freed.  The round which was previously the
+ * previous round is kept, and reused by the next call to #eap_round_alloc.
+ *
+ * @param[in] eap_session	to rotate the rounds of.
+ */
+void eap_round_rotate(eap_session_t *eap_session)
+{
+	eap_round_t	*eap_round = eap_session->this_round;
+
+	if (eap_round) {
+		eap_packet_compact(eap_round->response);
+		eap_packet_compact(eap_round->request);
+	}
+
+	if (eap_session->prev_round) {
+		if (!eap_session->spare_round && eap_session->prev_round->response && eap_session->prev_round->request) {
+			eap_packet_compact(eap_session->prev_round->response);
+			eap_packet_compact(eap_session->prev_round->request);
+			eap_session->spare_round = eap_session->prev_round;
+		} else {
+			talloc_free(eap_session->prev_round);
+		}
+	}
+
+	eap_session->prev_round = eap_round;
+	eap_session->this_round = NULL;
+}
+
 static int _eap_session_free(eap_session_t *eap_session)
 {
 	REQUEST *request = eap_session->request;
@@ -59,9 +128,16 @@ static int _eap_session_free(eap_session_t *eap_session)
 		eap_session->identity = NULL;
 	}
 
+	/*
+	 *	Not parented by the eap_session_t.  Inner requests
+	 *	which have been stolen from it are still valid.
+	 */
+	TALLOC_FREE(eap_session->inner_pool);
+
 #ifdef WITH_VERIFY_PTR
 	if (eap_session->prev_round) (void)rad_cond_assert(talloc_parent(eap_session->prev_round) == eap_session);
 	if (eap_session->this_round) (void)rad_cond_assert(talloc_parent(eap_session->this_round) == eap_session);
+	if (eap_session->spare_round) (void)rad_cond_assert(talloc_parent(eap_session->spare_round) == eap_session);
 #endif
 
 	/*
@@ -103,11 +179,17 @@ eap_session_t *eap_session_alloc(rlm_eap_t const *inst, REQUEST *request)
 {
 	eap_session_t	*eap_session;
 
-	eap_session = talloc_zero(NULL, eap_session_t);
+	/*
+	 *	Sessions may persist for many rounds, and there may
+	 *	be many of them.  Allocate the rounds and identity
+	 *	from a pool, so they don't fragment the heap.
+	 */
+	eap_session = talloc_pooled_object(NULL, eap_session_t, EAP_SESSION_POOL_OBJECTS, EAP_SESSION_POOL_SIZE);
 	if (!eap_session) {
 		ERROR("Failed allocating eap_session");
 		return NULL;
 	}
+	memset(eap_session, 0, sizeof(*eap_session));
 	eap_session->inst = inst;
 	eap_session->request = request;
 	eap_session->updated = request->packet->timestamp.tv_sec;
@@ -477,6 +477,7 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, eap_session_t *eap_session
 		case RLM_MODULE_NOOP:
 		case RLM_MODULE_UPDATED:
 		case RLM_MODULE_HANDLED:
+		case RLM_MODULE_YIELD:
 			break;
 		}
 		break;
@@ -485,6 +486,32 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, eap_session_t *eap_session
 	return rcode;
 }
 
+static rlm_rcode_t eap_authenticate_finish(rlm_eap_t *inst, eap_session_t *eap_session, rlm_rcode_t rcode);
+
+/** Continue an EAP method which yielded
+ *
+ * The submodule is called again with the same round of EAP.
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_eap_t		*inst = talloc_get_type_abort(instance, rlm_eap_t);
+	eap_session_t		*eap_session = talloc_get_type_abort(ctx, eap_session_t);
+	rlm_eap_method_t	*method = inst->methods[eap_session->type];
+	char const		*caller;
+	rlm_rcode_t		rcode;
+
+	RDEBUG2("Resuming submodule %s", method->submodule->name);
+
+	caller = request->module;
+	request->module = method->submodule->name;
+	rcode = eap_session->process(method->submodule_inst, eap_session);
+	request->module = caller;
+
+	if (rcode == RLM_MODULE_YIELD) return unlang_yield(request, mod_authenticate_resume, NULL, eap_session);
+
+	return eap_authenticate_finish(inst, eap_session, rcode);
+}
+
 static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_eap_t		*inst = talloc_get_type_abort(instance, rlm_eap_t);
@@ -527,6 +554,27 @@ static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST
 	 */
 	rcode = eap_method_select(inst, eap_session);
 
+	/*
+	 *	The submodule is waiting for something, e.g. an
+	 *	asynchronous crypto operation.  The eap_session
+	 *	stays thawed until we're resumed.
+	 */
+	if (rcode == RLM_MODULE_YIELD) return unlang_yield(request, mod_authenticate_resume, NULL, eap_session);
+
+	return eap_authenticate_finish(inst, eap_session, rcode);
+}
+
+/** Compose the reply once the submodule has finished with a round of EAP
+ *
+ * @param inst		of rlm_eap.
+ * @param eap_session	the submodule processed.
+ * @param rcode		returned by the submodule.
+ * @return the rcode for mod_authenticate.
+ */
+static rlm_rcode_t eap_authenticate_finish(rlm_eap_t *inst, eap_session_t *eap_session, rlm_rcode_t rcode)
+{
+	REQUEST			*request = eap_session->request;
+
 	/*
 	 *	The submodule failed.  Die.
 	 */
@@ -562,9 +610,7 @@ static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST
 	     (eap_session->this_round->response->type.num == PW_EAP_LEAP) &&
 	     (eap_session->this_round->request->code == PW_EAP_SUCCESS) &&
 	     (eap_session->this_round->request->type.num == 0))) {
-		talloc_free(eap_session->prev_round);
-		eap_session->prev_round = eap_session->this_round;
-		eap_session->this_round = NULL;
+		eap_round_rotate(eap_session);
 	} else {
 		RDEBUG2("Cleaning up EAP session");
 		eap_session_destroy(&eap_session);
@@ -747,9 +793,7 @@ static rlm_rcode_t mod_post_proxy(void *instance, UNUSED void *thread, REQUEST *
 		 */
 		if ((eap_session->this_round->request->code == PW_EAP_REQUEST) &&
 		    (eap_session->this_round->request->type.num >= PW_EAP_MD5)) {
-			talloc_free(eap_session->prev_round);
-			eap_session->prev_round = eap_session->this_round;
-			eap_session->this_round = NULL;
+			eap_round_rotate(eap_session);
 		} else {	/* couldn't have been LEAP, there's no tunnel */
 			RDEBUG2("Freeing eap_session");
 			eap_session_destroy(&eap_session);
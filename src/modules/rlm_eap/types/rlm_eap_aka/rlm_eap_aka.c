@@ -39,6 +39,22 @@ RCSID("$Id$")
 
 fr_dict_attr_t const *dict_aka_root;
 
+/** Instance data for rlm_eap_aka
+ *
+ */
+typedef struct {
+	uint32_t		vector_cache_size;	//!< Maximum number of subscribers to cache vectors for.
+	uint32_t		vector_cache_lifetime;	//!< How long cached vectors remain usable.
+
+	fr_sim_vector_cache_t	*vector_cache;		//!< Surplus vectors from previous authentications.
+} rlm_eap_aka_t;
+
+static CONF_PARSER submodule_config[] = {
+	{ FR_CONF_OFFSET("vector_cache_size", PW_TYPE_INTEGER, rlm_eap_aka_t, vector_cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("vector_cache_lifetime", PW_TYPE_INTEGER, rlm_eap_aka_t, vector_cache_lifetime), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
 static rlm_rcode_t mod_process(UNUSED void *arg, eap_session_t *eap_session);
 
 /*
@@ -368,8 +384,9 @@ static rlm_rcode_t mod_process(UNUSED void *arg, eap_session_t *eap_session)
 /** Initiate the EAP-SIM session by starting the state machine
  *
  */
-static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
+static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 {
+	rlm_eap_aka_t		*inst = instance;
 	REQUEST			*request = eap_session->request;
 	eap_aka_session_t	*eap_aka_session;
 	time_t			n;
@@ -383,9 +400,20 @@ static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_se
 	 *	Save the keying material, because it could change on a subsequent retrieval.
 	 */
 	RDEBUG2("New EAP-AKA session.  Acquiring AKA vectors");
-	if (fr_sim_vector_umts_from_attrs(eap_session, request->control, &eap_aka_session->keys, &src) < 0) {
-	    	REDEBUG("Failed retrieving AKA vectors");
-		return RLM_MODULE_FAIL;
+	if (!inst->vector_cache ||
+	    (fr_sim_vector_umts_from_cache(inst->vector_cache, eap_session, &eap_aka_session->keys) != 0)) {
+		if (fr_sim_vector_umts_from_attrs(eap_session, request->control, &eap_aka_session->keys, &src) < 0) {
+			REDEBUG("Failed retrieving AKA vectors");
+			return RLM_MODULE_FAIL;
+		}
+
+		/*
+		 *	Keep any additional quintuplets the backend
+		 *	gave us for the next authentication.
+		 */
+		if (inst->vector_cache) {
+			fr_sim_vector_umts_cache_store(inst->vector_cache, eap_session, request->control, 1, src);
+		}
 	}
 
 	/*
@@ -401,6 +429,54 @@ static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_se
 	return RLM_MODULE_OK;
 }
 
+/** Return the number of authentications the cached vectors for an identity will cover
+ *
+ * Example: "%{eap_aka_vectors:%{User-Name}}"
+ */
+static ssize_t vector_cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t outlen,
+				 void const *mod_inst, UNUSED void const *xlat_inst,
+				 UNUSED REQUEST *request, char const *fmt)
+{
+	rlm_eap_aka_t const *inst = mod_inst;
+
+	*out = talloc_asprintf(ctx, "%u", fr_sim_vector_cache_count(inst->vector_cache, fmt, SIM_VECTOR_UMTS));
+	return talloc_array_length(*out) - 1;
+}
+
+/*
+ *	Attach the module.
+ */
+static int mod_instantiate(UNUSED rlm_eap_config_t const *config, void *instance, CONF_SECTION *cs)
+{
+	rlm_eap_aka_t *inst = instance;
+
+	/*
+	 *	Allocated outside of the instance data, as
+	 *	that's read only after instantiation.
+	 */
+	if (inst->vector_cache_size) {
+		inst->vector_cache = fr_sim_vector_cache_alloc(NULL, inst->vector_cache_size,
+							       inst->vector_cache_lifetime);
+		if (!inst->vector_cache) {
+			cf_log_err_cs(cs, "Failed creating vector cache: %s", fr_strerror());
+			return -1;
+		}
+
+		xlat_register(inst, "eap_aka_vectors", vector_cache_xlat, NULL, NULL, 0, 0);
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_eap_aka_t *inst = instance;
+
+	TALLOC_FREE(inst->vector_cache);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	dict_aka_root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), PW_EAP_AKA_ROOT);
@@ -420,7 +496,12 @@ extern rlm_eap_submodule_t rlm_eap_aka;
 rlm_eap_submodule_t rlm_eap_aka = {
 	.name		= "eap_aka",
 	.magic		= RLM_MODULE_INIT,
+
+	.inst_size	= sizeof(rlm_eap_aka_t),
+	.config		= submodule_config,
 	.load		= mod_load,
+	.instantiate	= mod_instantiate,	/* Create new submodule instance */
+	.detach		= mod_detach,
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
 	.process	= mod_process,		/* Process next round of EAP method */
 };
@@ -388,6 +388,13 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	Waiting for an asynchronous crypto operation,
+	 *	we'll be called again when it completes.
+	 */
+	case EAP_TLS_YIELD:
+		return RLM_MODULE_YIELD;
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
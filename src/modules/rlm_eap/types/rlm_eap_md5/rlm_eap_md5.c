@@ -38,7 +38,6 @@ static rlm_rcode_t mod_process(UNUSED void *arg, eap_session_t *eap_session);
  */
 static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
 {
-	int		i;
 	MD5_PACKET	*reply;
 	REQUEST		*request = eap_session->request;
 
@@ -61,7 +60,7 @@ static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_se
 	/*
 	 *	Get a random challenge.
 	 */
-	for (i = 0; i < reply->value_size; i++) reply->value[i] = fr_rand();
+	fr_rand_buffer(reply->value, reply->value_size);
 	RDEBUG2("Issuing MD5 Challenge");
 
 	/*
@@ -415,7 +415,7 @@ static rlm_rcode_t CC_HINT(nonnull) process_reply(eap_session_t *eap_session, tl
 		 *	Access-Challenge is ignored.
 		 */
 		vp = NULL;
-		fr_pair_list_mcopy_by_num(t, &vp, &reply->vps, 0, PW_EAP_MESSAGE, TAG_ANY);
+		fr_pair_list_move_by_num(t, &vp, &reply->vps, 0, PW_EAP_MESSAGE, TAG_ANY);
 
 		/*
 		 *	Handle the ACK, by tunneling any necessary reply
@@ -698,7 +698,7 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 		break;
 
 	case PEAP_STATUS_WAIT_FOR_SOH_RESPONSE:
-		fake = request_alloc_fake(request);
+		fake = eap_fake_request_alloc(eap_session, request);
 		rad_assert(!fake->packet->vps);
 		eap_peap_soh_verify(fake, fake->packet, data, data_len);
 		setup_fake_request(request, fake, t);
@@ -798,7 +798,7 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 			goto finish;
 	}
 
-	fake = request_alloc_fake(request);
+	fake = eap_fake_request_alloc(eap_session, request);
 	rad_assert(!fake->packet->vps);
 
 	switch (t->status) {
@@ -964,8 +964,8 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 			 *	Tell the original request that it's going
 			 *	to be proxied.
 			 */
-			fr_pair_list_mcopy_by_num(request, &request->control, &fake->control, 0, PW_PROXY_TO_REALM,
-						  TAG_ANY);
+			fr_pair_list_move_by_num(request, &request->control, &fake->control, 0, PW_PROXY_TO_REALM,
+						 TAG_ANY);
 
 			/*
 			 *	Seed the proxy packet with the
@@ -1012,8 +1012,10 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 				 *	the eap_session with the fake request.
 				 *
 				 *	So we associate the fake request with
-				 *	this request.
+				 *	this request.  It has to outlive the
+				 *	round, so it's moved out of the pool.
 				 */
+				talloc_steal(request, fake);
 				ret = request_data_add(request, request->proxy,
 						       REQUEST_DATA_EAP_MSCHAP_TUNNEL_CALLBACK,
 						       fake, true, false, false);
@@ -1022,6 +1024,7 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 				/*
 				 *	Do NOT free the fake request!
 				 */
+				fake = NULL;
 				rcode = RLM_MODULE_UPDATED;
 				goto finish;
 			}
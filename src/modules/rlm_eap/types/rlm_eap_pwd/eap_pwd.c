@@ -41,6 +41,12 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 static uint8_t allzero[SHA256_DIGEST_LENGTH] = { 0x00 };
 
+/*
+ *	BN_CTX can't be shared between threads, so each thread
+ *	gets its own, the first time it needs one.
+ */
+fr_thread_local_setup(BN_CTX *, pwd_thread_bn_ctx)	/* macro */
+
 /* The random function H(x) = HMAC-SHA256(0^32, x) */
 #  define pwd_hmac_init(_ctx) HMAC_Init_ex(_ctx, allzero, SHA256_DIGEST_LENGTH, EVP_sha256(), NULL)
 #  define pwd_hmac_update HMAC_Update
@@ -102,16 +108,56 @@ static void eap_pwd_kdf(uint8_t *key, int keylen, char const *label,
 	HMAC_CTX_free(hmac_ctx);
 }
 
-int compute_password_element(pwd_session_t *session, uint16_t grp_num,
-			     char const *password, int password_len,
-			     char const *id_server, int id_server_len,
-			     char const *id_peer, int id_peer_len,
-			     uint32_t *token)
+static void _pwd_bn_ctx_free(void *bn_ctx)
 {
-	BIGNUM		*x_candidate = NULL, *rnd = NULL, *cofactor = NULL;
-	HMAC_CTX	*hmac_ctx = NULL;
-	uint8_t		pwe_digest[SHA256_DIGEST_LENGTH], *prf_buf = NULL, ctr;
-	int		nid, is_odd, prime_bit_len, prime_byte_len, ret = 0;
+	BN_CTX_free(bn_ctx);
+}
+
+/** Return the BN_CTX for the current thread
+ *
+ * @return
+ *	- The thread's BN_CTX.
+ *	- NULL on error.
+ */
+BN_CTX *pwd_bn_ctx(void)
+{
+	BN_CTX *bn_ctx;
+
+	bn_ctx = pwd_thread_bn_ctx;
+	if (!bn_ctx) {
+		bn_ctx = BN_CTX_new();
+		if (!bn_ctx) {
+			ERROR("Failed allocating BN context");
+			return NULL;
+		}
+		fr_thread_local_set_destructor(pwd_thread_bn_ctx, _pwd_bn_ctx_free, bn_ctx);
+	}
+
+	return bn_ctx;
+}
+
+static int _pwd_group_free(pwd_group_t *grp)
+{
+	BN_free(grp->cofactor);
+	BN_free(grp->order);
+	BN_free(grp->prime);
+	EC_GROUP_free(grp->group);
+
+	return 0;
+}
+
+/** Create a group, and look up its parameters
+ *
+ * @param[in] ctx	to allocate the group in.
+ * @param[in] grp_num	from the IANA registry for IKE D-H groups.
+ * @return
+ *	- The new group.
+ *	- NULL on error.
+ */
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num)
+{
+	pwd_group_t	*grp;
+	int		nid;
 
 	switch (grp_num) { /* from IANA registry for IKE D-H groups */
 	case 19:
@@ -136,48 +182,80 @@ int compute_password_element(pwd_session_t *session, uint16_t grp_num,
 
 	default:
 		ERROR("Unknown group %d", grp_num);
-	error:
-		ret = -1;
-		goto finish;
+		return NULL;
 	}
 
-	session->pwe = NULL;
-	session->order = NULL;
-	session->prime = NULL;
-	session->group = EC_GROUP_new_by_curve_name(nid);
-	if (!session->group) {
+	grp = talloc_zero(ctx, pwd_group_t);
+	if (!grp) return NULL;
+	talloc_set_destructor(grp, _pwd_group_free);
+
+	grp->num = grp_num;
+	grp->group = EC_GROUP_new_by_curve_name(nid);
+	if (!grp->group) {
 		ERROR("Unable to create EC_GROUP");
-		goto error;
+	error:
+		talloc_free(grp);
+		return NULL;
 	}
 
-	if (((rnd = BN_new()) == NULL) ||
-	    ((cofactor = BN_new()) == NULL) ||
-	    ((session->pwe = EC_POINT_new(session->group)) == NULL) ||
-	    ((session->order = BN_new()) == NULL) ||
-	    ((session->prime = BN_new()) == NULL) ||
-	    ((x_candidate = BN_new()) == NULL)) {
+	if (((grp->prime = BN_new()) == NULL) ||
+	    ((grp->order = BN_new()) == NULL) ||
+	    ((grp->cofactor = BN_new()) == NULL)) {
 		ERROR("Unable to create bignums");
 		goto error;
 	}
 
-	if (!EC_GROUP_get_curve_GFp(session->group, session->prime, NULL, NULL, NULL)) {
+	if (!EC_GROUP_get_curve_GFp(grp->group, grp->prime, NULL, NULL, NULL)) {
 		ERROR("Unable to get prime for GFp curve");
 		goto error;
 	}
 
-	if (!EC_GROUP_get_order(session->group, session->order, NULL)) {
+	if (!EC_GROUP_get_order(grp->group, grp->order, NULL)) {
 		ERROR("Unable to get order for curve");
 		goto error;
 	}
 
-	if (!EC_GROUP_get_cofactor(session->group, cofactor, NULL)) {
-		DEBUG("unable to get cofactor for curve");
+	if (!EC_GROUP_get_cofactor(grp->group, grp->cofactor, NULL)) {
+		ERROR("Unable to get cofactor for curve");
 		goto error;
 	}
 
+	return grp;
+}
+
+/** Derive the password element with hunting and pecking
+ *
+ * May be run on an offload thread, so mustn't allocate memory
+ * in the session.
+ */
+int compute_password_element(pwd_session_t *session, pwd_group_t const *grp,
+			     char const *password, int password_len,
+			     char const *id_server, int id_server_len,
+			     char const *id_peer, int id_peer_len,
+			     uint32_t *token, BN_CTX *bn_ctx)
+{
+	BIGNUM		*x_candidate = NULL, *rnd = NULL;
+	HMAC_CTX	*hmac_ctx = NULL;
+	uint8_t		pwe_digest[SHA256_DIGEST_LENGTH], *prf_buf = NULL, ctr;
+	int		is_odd, prime_bit_len, prime_byte_len, ret = 0;
+
+	session->group = grp->group;
+	session->prime = grp->prime;
+	session->order = grp->order;
+	session->cofactor = grp->cofactor;
+
+	if (((rnd = BN_new()) == NULL) ||
+	    ((session->pwe = EC_POINT_new(session->group)) == NULL) ||
+	    ((x_candidate = BN_new()) == NULL)) {
+		ERROR("Unable to create bignums");
+	error:
+		ret = -1;
+		goto finish;
+	}
+
 	prime_bit_len = BN_num_bits(session->prime);
 	prime_byte_len = BN_num_bytes(session->prime);
-	prf_buf = talloc_zero_array(session, uint8_t, prime_byte_len);
+	prf_buf = talloc_zero_array(NULL, uint8_t, prime_byte_len);
 	if (!prf_buf) {
 		ERROR("Unable to alloc space for prf buffer");
 		goto error;
@@ -187,7 +265,7 @@ int compute_password_element(pwd_session_t *session, uint16_t grp_num,
 	ctr = 0;
 	for (;;) {
 		if (ctr > 10) {
-			ERROR("Unable to find random point on curve for group %d, something's fishy", grp_num);
+			ERROR("Unable to find random point on curve for group %d, something's fishy", grp->num);
 			goto error;
 		}
 		ctr++;
@@ -230,7 +308,8 @@ int compute_password_element(pwd_session_t *session, uint16_t grp_num,
 		 * solve the quadratic equation, if it's not solvable then we
 		 * don't have a point
 		 */
-		if (!EC_POINT_set_compressed_coordinates_GFp(session->group, session->pwe, x_candidate, is_odd, NULL)) {
+		if (!EC_POINT_set_compressed_coordinates_GFp(session->group, session->pwe,
+							     x_candidate, is_odd, bn_ctx)) {
 			continue;
 		}
 
@@ -240,15 +319,15 @@ int compute_password_element(pwd_session_t *session, uint16_t grp_num,
 		 * says this is required by X9.62. We're not X9.62 but it can't
 		 * hurt just to be sure.
 		 */
-		if (!EC_POINT_is_on_curve(session->group, session->pwe, NULL)) {
+		if (!EC_POINT_is_on_curve(session->group, session->pwe, bn_ctx)) {
 			ERROR("Point is not on curve");
 			continue;
 		}
 
-		if (BN_cmp(cofactor, BN_value_one())) {
+		if (BN_cmp(session->cofactor, BN_value_one())) {
 			/* make sure the point is not in a small sub-group */
 			if (!EC_POINT_mul(session->group, session->pwe, NULL, session->pwe,
-				cofactor, NULL)) {
+				session->cofactor, bn_ctx)) {
 				ERROR("Cannot multiply generator by order");
 				continue;
 			}
@@ -262,12 +341,11 @@ int compute_password_element(pwd_session_t *session, uint16_t grp_num,
 		break;
 	}
 
-	session->group_num = grp_num;
+	session->group_num = grp->num;
 
 finish:
 	/* cleanliness and order.... */
 	HMAC_CTX_free(hmac_ctx);
-	BN_clear_free(cofactor);
 	BN_clear_free(x_candidate);
 	BN_clear_free(rnd);
 	talloc_free(prf_buf);
@@ -321,13 +399,13 @@ int process_peer_commit(pwd_session_t *session, uint8_t *in, size_t in_len, BN_C
 {
 	uint8_t		*ptr;
 	size_t		data_len;
-	BIGNUM		*x = NULL, *y = NULL, *cofactor = NULL;
+	BIGNUM		*x = NULL, *y = NULL;
+	BIGNUM const	*cofactor = session->cofactor;
 	EC_POINT	*K = NULL, *point = NULL;
 	int		res = 1;
 
 	if (((session->peer_scalar = BN_new()) == NULL) ||
 	    ((session->k = BN_new()) == NULL) ||
-	    ((cofactor = BN_new()) == NULL) ||
 	    ((x = BN_new()) == NULL) ||
 	    ((y = BN_new()) == NULL) ||
 	    ((point = EC_POINT_new(session->group)) == NULL) ||
@@ -337,11 +415,6 @@ int process_peer_commit(pwd_session_t *session, uint8_t *in, size_t in_len, BN_C
 		goto finish;
 	}
 
-	if (!EC_GROUP_get_cofactor(session->group, cofactor, NULL)) {
-		ERROR("Unable to get group co-factor");
-		goto finish;
-	}
-
 	/* element, x then y, followed by scalar */
 	ptr = (uint8_t *)in;
 	data_len = BN_num_bytes(session->prime);
@@ -369,7 +442,7 @@ int process_peer_commit(pwd_session_t *session, uint8_t *in, size_t in_len, BN_C
 
 	/* check to ensure peer's element is not in a small sub-group */
 	if (BN_cmp(cofactor, BN_value_one())) {
-		if (!EC_POINT_mul(session->group, point, NULL, session->peer_element, cofactor, NULL)) {
+		if (!EC_POINT_mul(session->group, point, NULL, session->peer_element, cofactor, bn_ctx)) {
 			ERROR("Unable to multiply element by co-factor");
 			goto finish;
 		}
@@ -390,7 +463,7 @@ int process_peer_commit(pwd_session_t *session, uint8_t *in, size_t in_len, BN_C
 
 	/* ensure that the shared key isn't in a small sub-group */
 	if (BN_cmp(cofactor, BN_value_one())) {
-		if (!EC_POINT_mul(session->group, K, NULL, K, cofactor, NULL)) {
+		if (!EC_POINT_mul(session->group, K, NULL, K, cofactor, bn_ctx)) {
 			ERROR("Unable to multiply k by co-factor");
 			goto finish;
 		}
@@ -416,7 +489,6 @@ int process_peer_commit(pwd_session_t *session, uint8_t *in, size_t in_len, BN_C
 finish:
 	EC_POINT_clear_free(K);
 	EC_POINT_clear_free(point);
-	BN_clear_free(cofactor);
 	BN_clear_free(x);
 	BN_clear_free(y);
 
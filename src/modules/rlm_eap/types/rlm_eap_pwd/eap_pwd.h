@@ -37,6 +37,8 @@
 RCSIDH(eap_pwd_h, "$Id$")
 #include "eap.h"
 
+#include <freeradius-devel/job_pool.h>
+
 #include <openssl/bn.h>
 #include <openssl/sha.h>
 #include <openssl/ec.h>
@@ -73,6 +75,19 @@ typedef struct _pwd_id_packet {
     char identity[];
 } CC_HINT(packed) pwd_id_packet_t;
 
+/** A group, set up once per instance
+ *
+ * Creating an EC_GROUP is expensive, and it's only read after that,
+ * so it's shared by all sessions and threads.
+ */
+typedef struct {
+    uint16_t num;
+    EC_GROUP *group;
+    BIGNUM *prime;
+    BIGNUM *order;
+    BIGNUM *cofactor;
+} pwd_group_t;
+
 typedef struct _pwd_session_t {
     uint16_t state;
 #define PWD_STATE_ID_REQ		1
@@ -90,10 +105,11 @@ typedef struct _pwd_session_t {
     uint8_t *out;     /* message to fragment */
     size_t out_pos;
     size_t out_len;
-    EC_GROUP *group;
+    EC_GROUP const *group;	/* these four belong to the pwd_group_t */
+    BIGNUM const *order;
+    BIGNUM const *prime;
+    BIGNUM const *cofactor;
     EC_POINT *pwe;
-    BIGNUM *order;
-    BIGNUM *prime;
     BIGNUM *k;
     BIGNUM *private_value;
     BIGNUM *peer_scalar;
@@ -101,13 +117,16 @@ typedef struct _pwd_session_t {
     EC_POINT *my_element;
     EC_POINT *peer_element;
     uint8_t my_confirm[SHA256_DIGEST_LENGTH];
+    fr_job_t *job;	/* computation running on an offload thread */
 } pwd_session_t;
 
-int compute_password_element(pwd_session_t *sess, uint16_t grp_num,
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num);
+BN_CTX *pwd_bn_ctx(void);
+int compute_password_element(pwd_session_t *sess, pwd_group_t const *grp,
 			     char const *password, int password_len,
 			     char const *id_server, int id_server_len,
 			     char const *id_peer, int id_peer_len,
-			     uint32_t *token);
+			     uint32_t *token, BN_CTX *bnctx);
 int compute_scalar_element(pwd_session_t *sess, BN_CTX *bnctx);
 int process_peer_commit (pwd_session_t *sess, uint8_t *in, size_t in_len, BN_CTX *bnctx);
 int compute_server_confirm(pwd_session_t *sess, uint8_t *out, BN_CTX *bnctx);
@@ -45,6 +45,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("group", PW_TYPE_INTEGER, rlm_eap_pwd_t, group), .dflt = "19" },
 	{ FR_CONF_OFFSET("fragment_size", PW_TYPE_INTEGER, rlm_eap_pwd_t, fragment_size), .dflt = "1020" },
+	{ FR_CONF_OFFSET("offload_threads", PW_TYPE_INTEGER, rlm_eap_pwd_t, offload_threads), .dflt = "0" },
 	{ FR_CONF_OFFSET("server_id", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_eap_pwd_t, server_id) },
 	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY,
 			 rlm_eap_pwd_t, virtual_server) },
@@ -121,6 +122,312 @@ static int send_pwd_request(pwd_session_t *session, eap_round_t *eap_round)
 	return 0;
 }
 
+typedef enum {
+	PWD_JOB_ID = 0,				//!< Derive the password element, and our scalar and element.
+	PWD_JOB_COMMIT				//!< Process the peer's commit, and derive the shared secret.
+} pwd_job_type_t;
+
+typedef struct pwd_offload_job pwd_offload_job_t;
+
+/** Expensive part of an EAP-pwd round, run by an offload thread
+ *
+ * The offload thread fills in the session's bignums and points, nothing
+ * else touches the session until the job is computed.  The password
+ * and peer's commit are copied into the job.
+ */
+struct pwd_offload_job {
+	pwd_job_type_t		type;
+	pwd_session_t		*session;
+	pwd_group_t const	*grp;
+	char const		*server_id;
+
+	char			*password;	//!< Known good password, for #PWD_JOB_ID.
+	size_t			password_len;
+
+	uint8_t			*in;		//!< Peer's commit, for #PWD_JOB_COMMIT.
+	size_t			in_len;
+
+	int			result;		//!< 0 on success, -1 on failure.
+};
+
+/*
+ *	Where completed jobs are sent for this worker.  Submodules
+ *	don't have per-thread instance data, so this is thread local,
+ *	and created the first time a worker queues a job.
+ */
+fr_thread_local_setup(fr_job_return_t *, pwd_offload_worker)	/* macro */
+
+static int _pwd_job_free(pwd_offload_job_t *job)
+{
+	if (job->password) memset(job->password, 0, job->password_len);
+
+	return 0;
+}
+
+/** Derive the password element, then our scalar and element
+ *
+ */
+static int pwd_id_compute(pwd_session_t *session, pwd_group_t const *grp, char const *server_id,
+			  char const *password, size_t password_len, BN_CTX *bn_ctx)
+{
+	if (compute_password_element(session, grp, password, password_len,
+				     server_id, strlen(server_id),
+				     session->peer_id, strlen(session->peer_id),
+				     &session->token, bn_ctx)) {
+		ERROR("Failed to obtain password element");
+		return -1;
+	}
+
+	if (compute_scalar_element(session, bn_ctx)) {
+		ERROR("Failed to compute server's scalar and element");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Run the expensive part of a round in an offload thread
+ *
+ */
+static void pwd_offload_run(UNUSED void *thread, void *data, UNUSED void *uctx)
+{
+	pwd_offload_job_t	*job = data;
+	BN_CTX			*bn_ctx;
+
+	bn_ctx = pwd_bn_ctx();
+	if (!bn_ctx) {
+		job->result = -1;
+		return;
+	}
+
+	switch (job->type) {
+	case PWD_JOB_ID:
+		job->result = pwd_id_compute(job->session, job->grp, job->server_id,
+					     job->password, job->password_len, bn_ctx);
+		break;
+
+	case PWD_JOB_COMMIT:
+		job->result = process_peer_commit(job->session, job->in, job->in_len, bn_ctx) ? -1 : 0;
+		break;
+	}
+}
+
+/** Fail a job which won't be run
+ *
+ */
+static void pwd_offload_fail(void *data, UNUSED void *uctx)
+{
+	pwd_offload_job_t *job = data;
+
+	job->result = -1;
+}
+
+/** Stop receiving completed jobs when the worker exits
+ *
+ * The event list is being freed too, so the pipe isn't removed from it.
+ */
+static void _pwd_offload_worker_free(void *arg)
+{
+	fr_job_return_detach(arg);
+}
+
+/** Get the pipe this worker receives completed jobs on, creating it if needed
+ *
+ * @param[in] offload	pool the worker queues jobs on.
+ * @param[in] request	being processed by the worker.
+ * @return
+ *	- The worker's fr_job_return_t.
+ *	- NULL if the request has no event list, or on error.
+ */
+static fr_job_return_t *pwd_offload_return(fr_job_pool_t *offload, REQUEST *request)
+{
+	fr_job_return_t *r;
+
+	r = pwd_offload_worker;
+	if (r) return r;
+
+	if (!request->el) return NULL;
+
+	r = fr_job_return_alloc(offload, request->el, unlang_resumable);
+	if (!r) return NULL;
+
+	fr_thread_local_set_destructor(pwd_offload_worker, _pwd_offload_worker_free, r);
+
+	return r;
+}
+
+/** Allocate a job, to be filled in, and passed to #pwd_job_send
+ *
+ * @param[out] out	the job to pass to #pwd_job_send.
+ * @param[in] r		of the worker processing the request.
+ * @param[in] request	to resume when the job completes.
+ * @param[in] session	the job computes values for.
+ * @param[in] type	of job.
+ * @return
+ *	- The data of the job.
+ *	- NULL on error.
+ */
+static pwd_offload_job_t *pwd_job_alloc(fr_job_t **out, fr_job_return_t *r, REQUEST *request,
+					pwd_session_t *session, pwd_job_type_t type)
+{
+	fr_job_t		*job;
+	pwd_offload_job_t	*pwd_job;
+
+	job = fr_job_alloc(r, request);
+	if (!job) return NULL;
+
+	pwd_job = talloc_zero(job, pwd_offload_job_t);
+	if (!pwd_job) {
+		fr_job_cancel(job);
+		return NULL;
+	}
+	talloc_set_destructor(pwd_job, _pwd_job_free);
+
+	pwd_job->session = session;
+	pwd_job->type = type;
+
+	*out = job;
+	return pwd_job;
+}
+
+/** Queue a job to be run by an offload thread
+ *
+ * The request is marked resumable when the job completes.
+ */
+static void pwd_job_send(fr_job_pool_t *offload, fr_job_t *job, pwd_offload_job_t *pwd_job)
+{
+	fr_job_send(offload, job, pwd_job);
+
+	pwd_job->session->job = job;
+}
+
+/** Send our commit, x and y of our element, followed by our scalar
+ *
+ */
+static rlm_rcode_t pwd_send_commit(REQUEST *request, pwd_session_t *session, eap_round_t *eap_round,
+				   BN_CTX *bn_ctx)
+{
+	BIGNUM		*x = NULL, *y = NULL;
+	uint8_t		*ptr;
+	uint16_t	offset;
+	rlm_rcode_t	rcode = RLM_MODULE_FAIL;
+
+	if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL)) {
+		REDEBUG("Server point allocation failed");
+		goto finish;
+	}
+
+	/*
+	 *	Element is a point, get both coordinates: x and y
+	 */
+	if (!EC_POINT_get_affine_coordinates_GFp(session->group, session->my_element, x, y, bn_ctx)) {
+		REDEBUG("Server point assignment failed");
+		goto finish;
+	}
+
+	/*
+	 *	Construct request
+	 */
+	session->out_len = BN_num_bytes(session->order) + (2 * BN_num_bytes(session->prime));
+	MEM(session->out = talloc_zero_array(session, uint8_t, session->out_len));
+
+	ptr = session->out;
+	offset = BN_num_bytes(session->prime) - BN_num_bytes(x);
+	BN_bn2bin(x, ptr + offset);
+
+	ptr += BN_num_bytes(session->prime);
+	offset = BN_num_bytes(session->prime) - BN_num_bytes(y);
+	BN_bn2bin(y, ptr + offset);
+
+	ptr += BN_num_bytes(session->prime);
+	offset = BN_num_bytes(session->order) - BN_num_bytes(session->my_scalar);
+	BN_bn2bin(session->my_scalar, ptr + offset);
+
+	session->state = PWD_STATE_COMMIT;
+	rcode = send_pwd_request(session, eap_round) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+
+finish:
+	BN_clear_free(x);
+	BN_clear_free(y);
+
+	return rcode;
+}
+
+/** Send our confirm, once the peer's commit has been processed
+ *
+ */
+static rlm_rcode_t pwd_send_confirm(REQUEST *request, pwd_session_t *session, eap_round_t *eap_round,
+				    BN_CTX *bn_ctx)
+{
+	/*
+	 *	Compute our confirm blob
+	 */
+	if (compute_server_confirm(session, session->my_confirm, bn_ctx)) {
+		REDEBUG("Failed computing confirm");
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Construct a response...which is just our confirm blob
+	 */
+	session->out_len = SHA256_DIGEST_LENGTH;
+	MEM(session->out = talloc_array(session, uint8_t, session->out_len));
+
+	memset(session->out, 0, session->out_len);
+	memcpy(session->out, session->my_confirm, SHA256_DIGEST_LENGTH);
+
+	session->state = PWD_STATE_CONFIRM;
+	return send_pwd_request(session, eap_round) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+}
+
+/** Continue a round after an offload thread has completed its job
+ *
+ */
+static rlm_rcode_t pwd_job_resume(REQUEST *request, pwd_session_t *session, eap_round_t *eap_round)
+{
+	fr_job_t		*job = session->job;
+	pwd_offload_job_t	*pwd_job = fr_job_data(job);
+	BN_CTX			*bn_ctx;
+	rlm_rcode_t		rcode;
+
+	session->job = NULL;
+	if (pwd_job->result < 0) {
+		REDEBUG("%s", (pwd_job->type == PWD_JOB_ID) ?
+			"Failed to derive password element, or server's scalar and element" :
+			"Failed processing peer's commit");
+		fr_job_cancel(job);
+		return RLM_MODULE_FAIL;
+	}
+
+	bn_ctx = pwd_bn_ctx();
+	if (!bn_ctx) {
+		fr_job_cancel(job);
+		return RLM_MODULE_FAIL;
+	}
+
+	switch (pwd_job->type) {
+	case PWD_JOB_ID:
+		rcode = pwd_send_commit(request, session, eap_round, bn_ctx);
+		break;
+
+	case PWD_JOB_COMMIT:
+		rcode = pwd_send_confirm(request, session, eap_round, bn_ctx);
+		break;
+
+	default:
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+	fr_job_cancel(job);
+
+	/*
+	 *	We processed the buffered fragments, get rid of them.
+	 */
+	TALLOC_FREE(session->in);
+
+	return rcode;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, eap_session_t *eap_session);
 static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 {
@@ -137,15 +444,28 @@ static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 	eap_round_t	*eap_round;
 	size_t		in_len;
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
-	uint16_t	offset;
 	uint8_t		exch, *in, *ptr, msk[MSK_EMSK_LEN], emsk[MSK_EMSK_LEN];
 	uint8_t		peer_confirm[SHA256_DIGEST_LENGTH];
-	BIGNUM		*x = NULL, *y = NULL;
+	BN_CTX		*bn_ctx;
+
+	fr_job_return_t		*t = NULL;
+	fr_job_t		*job;
+	pwd_offload_job_t	*pwd_job;
 
 	if (((eap_round = eap_session->this_round) == NULL) || !inst) return 0;
 
 	session = talloc_get_type_abort(eap_session->opaque, pwd_session_t);
 	request = eap_session->request;
+
+	/*
+	 *	An offload thread has done the expensive part
+	 *	of this round, send the result.
+	 */
+	if (session->job) return pwd_job_resume(request, session, eap_round);
+
+	bn_ctx = pwd_bn_ctx();
+	if (!bn_ctx) return RLM_MODULE_FAIL;
+	if (inst->offload) t = pwd_offload_return(inst->offload, request);
 	response = eap_session->this_round->response;
 	hdr = (pwd_hdr *)response->type.data;
 
@@ -328,60 +648,44 @@ static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 			return RLM_MODULE_REJECT;
 		}
 
-		if (compute_password_element(session, session->group_num,
-					     pw->vp_strvalue, pw->vp_length,
-					     inst->server_id, strlen(inst->server_id),
-					     session->peer_id, strlen(session->peer_id),
-					     &session->token)) {
-			REDEBUG("Failed to obtain password element");
-			talloc_free(fake);
-			return RLM_MODULE_FAIL;
-		}
-		TALLOC_FREE(fake);
-
 		/*
-		 *	Compute our scalar and element
+		 *	Hunting and pecking, and deriving our scalar
+		 *	and element, are slow.  If we have offload
+		 *	threads, do them there, and yield.
 		 */
-		if (compute_scalar_element(session, inst->bnctx)) {
-			REDEBUG("Failed to compute server's scalar and element");
-			return RLM_MODULE_FAIL;
-		}
-
-		if (((x = BN_new()) == NULL) || ((y = BN_new()) == NULL)) {
-			REDEBUG("Server point allocation failed");
-			return RLM_MODULE_FAIL;
+		if (t) {
+			pwd_job = pwd_job_alloc(&job, t, request, session, PWD_JOB_ID);
+			if (!pwd_job) {
+			oom:
+				REDEBUG("Failed allocating EAP-pwd job");
+				talloc_free(fake);
+				return RLM_MODULE_FAIL;
+			}
+
+			pwd_job->grp = inst->grp;
+			pwd_job->server_id = inst->server_id;
+			pwd_job->password_len = pw->vp_length;
+			pwd_job->password = talloc_memdup(pwd_job, pw->vp_strvalue, pw->vp_length);
+			if (!pwd_job->password) {
+				fr_job_cancel(job);
+				goto oom;
+			}
+			TALLOC_FREE(fake);
+
+			RDEBUG2("Deriving password element on an offload thread");
+			pwd_job_send(inst->offload, job, pwd_job);
+			return RLM_MODULE_YIELD;
 		}
 
-		/*
-		 *	Element is a point, get both coordinates: x and y
-		 */
-		if (!EC_POINT_get_affine_coordinates_GFp(session->group, session->my_element, x, y, inst->bnctx)) {
-			REDEBUG("Server point assignment failed");
-			BN_clear_free(x);
-			BN_clear_free(y);
+		if (pwd_id_compute(session, inst->grp, inst->server_id,
+				   pw->vp_strvalue, pw->vp_length, bn_ctx)) {
+			REDEBUG("Failed to derive password element, or server's scalar and element");
+			talloc_free(fake);
 			return RLM_MODULE_FAIL;
 		}
+		TALLOC_FREE(fake);
 
-		/*
-		 *	Construct request
-		 */
-		session->out_len = BN_num_bytes(session->order) + (2 * BN_num_bytes(session->prime));
-		MEM(session->out = talloc_zero_array(session, uint8_t, session->out_len));
-
-		ptr = session->out;
-		offset = BN_num_bytes(session->prime) - BN_num_bytes(x);
-		BN_bn2bin(x, ptr + offset);
-
-		ptr += BN_num_bytes(session->prime);
-		offset = BN_num_bytes(session->prime) - BN_num_bytes(y);
-		BN_bn2bin(y, ptr + offset);
-
-		ptr += BN_num_bytes(session->prime);
-		offset = BN_num_bytes(session->order) - BN_num_bytes(session->my_scalar);
-		BN_bn2bin(session->my_scalar, ptr + offset);
-
-		session->state = PWD_STATE_COMMIT;
-		rcode = send_pwd_request(session, eap_round) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+		rcode = pwd_send_commit(request, session, eap_round, bn_ctx);
 		break;
 
 	case PWD_STATE_COMMIT:
@@ -393,30 +697,27 @@ static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 		/*
 		 *	Process the peer's commit and generate the shared key, k
 		 */
-		if (process_peer_commit(session, in, in_len, inst->bnctx)) {
-			RDEBUG2("Failed processing peer's commit");
-			return RLM_MODULE_FAIL;
+		if (t) {
+			pwd_job = pwd_job_alloc(&job, t, request, session, PWD_JOB_COMMIT);
+			if (pwd_job) pwd_job->in = talloc_memdup(pwd_job, in, in_len);
+			if (!pwd_job || !pwd_job->in) {
+				REDEBUG("Failed allocating EAP-pwd job");
+				if (pwd_job) fr_job_cancel(job);
+				return RLM_MODULE_FAIL;
+			}
+			pwd_job->in_len = in_len;
+
+			RDEBUG2("Processing peer's commit on an offload thread");
+			pwd_job_send(inst->offload, job, pwd_job);
+			return RLM_MODULE_YIELD;
 		}
 
-		/*
-		 *	Compute our confirm blob
-		 */
-		if (compute_server_confirm(session, session->my_confirm, inst->bnctx)) {
-			REDEBUG("Failed computing confirm");
+		if (process_peer_commit(session, in, in_len, bn_ctx)) {
+			RDEBUG2("Failed processing peer's commit");
 			return RLM_MODULE_FAIL;
 		}
 
-		/*
-		 *	Construct a response...which is just our confirm blob
-		 */
-		session->out_len = SHA256_DIGEST_LENGTH;
-		MEM(session->out = talloc_array(session, uint8_t, session->out_len));
-
-		memset(session->out, 0, session->out_len);
-		memcpy(session->out, session->my_confirm, SHA256_DIGEST_LENGTH);
-
-		session->state = PWD_STATE_CONFIRM;
-		rcode = send_pwd_request(session, eap_round) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+		rcode = pwd_send_confirm(request, session, eap_round, bn_ctx);
 		break;
 
 	case PWD_STATE_CONFIRM:
@@ -429,7 +730,7 @@ static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 			RDEBUG2("PWD exchange is incorrect, not commit");
 			return RLM_MODULE_INVALID;
 		}
-		if (compute_peer_confirm(session, peer_confirm, inst->bnctx)) {
+		if (compute_peer_confirm(session, peer_confirm, bn_ctx)) {
 			REDEBUG("Cannot compute peer's confirm");
 			return RLM_MODULE_FAIL;
 		}
@@ -470,16 +771,22 @@ static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 
 static int _free_pwd_session(pwd_session_t *session)
 {
+	/*
+	 *	An offload thread may still be filling in the
+	 *	session, so wait for it to finish.
+	 */
+	if (session->job) {
+		fr_job_cancel_wait(session->job);
+		session->job = NULL;
+	}
+
 	BN_clear_free(session->private_value);
 	BN_clear_free(session->peer_scalar);
 	BN_clear_free(session->my_scalar);
 	BN_clear_free(session->k);
 	EC_POINT_clear_free(session->my_element);
 	EC_POINT_clear_free(session->peer_element);
-	EC_GROUP_free(session->group);
 	EC_POINT_clear_free(session->pwe);
-	BN_clear_free(session->order);
-	BN_clear_free(session->prime);
 
 	return 0;
 }
@@ -547,7 +854,8 @@ static int mod_detach(void *arg)
 
 	inst = (rlm_eap_pwd_t *) arg;
 
-	if (inst->bnctx) BN_CTX_free(inst->bnctx);
+	fr_job_pool_free(inst->offload);
+	talloc_free(inst->grp);
 
 	return 0;
 }
@@ -579,12 +887,24 @@ static int mod_instantiate(UNUSED rlm_eap_config_t const *config, void *instance
 		return -1;
 	}
 
-	inst->bnctx = BN_CTX_new();
-	if (!inst->bnctx) {
-		ERROR("Failed to get BN context");
+	/*
+	 *	Look up the group parameters once, they're only
+	 *	read by sessions.
+	 */
+	inst->grp = pwd_group_alloc(NULL, inst->group);
+	if (!inst->grp) return -1;
+
+	if (inst->offload_threads > 256) {
+		cf_log_err_by_name(cs, "offload_threads", "Number of offload threads must be 256 or less");
 		return -1;
 	}
 
+	if (inst->offload_threads) {
+		inst->offload = fr_job_pool_alloc(NULL, "EAP-pwd", inst->offload_threads,
+						  pwd_offload_run, pwd_offload_fail, NULL, NULL, NULL);
+		if (!inst->offload) return -1;
+	}
+
 	return 0;
 }
 
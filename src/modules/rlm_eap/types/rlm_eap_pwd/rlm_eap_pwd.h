@@ -40,12 +40,14 @@
 #include <freeradius-devel/modules.h>
 
 typedef struct rlm_eap_pwd {
-    BN_CTX *bnctx;
+	pwd_group_t	*grp;			//!< Shared by all sessions, only read after instantiation.
+	fr_job_pool_t	*offload;		//!< Threads deriving the password element, or NULL.
 
-    uint32_t	group;
-    uint32_t	fragment_size;
-    char const	*server_id;
-    char const	*virtual_server;
+	uint32_t	group;
+	uint32_t	fragment_size;
+	uint32_t	offload_threads;	//!< Number of threads to start.
+	char const	*server_id;
+	char const	*virtual_server;
 } rlm_eap_pwd_t;
 
 #endif  /* _RLM_EAP_PWD_H */
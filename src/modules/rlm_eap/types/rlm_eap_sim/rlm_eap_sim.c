@@ -41,6 +41,22 @@ RCSID("$Id$")
 
 fr_dict_attr_t const *dict_sim_root;
 
+/** Instance data for rlm_eap_sim
+ *
+ */
+typedef struct {
+	uint32_t		vector_cache_size;	//!< Maximum number of subscribers to cache vectors for.
+	uint32_t		vector_cache_lifetime;	//!< How long cached vectors remain usable.
+
+	fr_sim_vector_cache_t	*vector_cache;		//!< Surplus vectors from previous authentications.
+} rlm_eap_sim_t;
+
+static CONF_PARSER submodule_config[] = {
+	{ FR_CONF_OFFSET("vector_cache_size", PW_TYPE_INTEGER, rlm_eap_sim_t, vector_cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("vector_cache_lifetime", PW_TYPE_INTEGER, rlm_eap_sim_t, vector_cache_lifetime), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	build a reply to be sent.
  */
@@ -507,8 +523,9 @@ static rlm_rcode_t mod_process(UNUSED void *arg, eap_session_t *eap_session)
  *	Initiate the EAP-SIM session by starting the state machine
  *      and initiating the state.
  */
-static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
+static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 {
+	rlm_eap_sim_t		*inst = instance;
 	REQUEST			*request = eap_session->request;
 	eap_sim_session_t	*eap_sim_session;
 	time_t			n;
@@ -522,11 +539,22 @@ static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_se
 	 *	Save the keying material, because it could change on a subsequent retrieval.
 	 */
 	RDEBUG2("New EAP-SIM session.  Acquiring SIM vectors");
-	if ((fr_sim_vector_gsm_from_attrs(eap_session, request->control, 0, &eap_sim_session->keys, &src) != 0) ||
-	    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 1, &eap_sim_session->keys, &src) != 0) ||
-	    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 2, &eap_sim_session->keys, &src) != 0)) {
-	    	REDEBUG("Failed retrieving SIM vectors");
-		return RLM_MODULE_FAIL;
+	if (!inst->vector_cache ||
+	    (fr_sim_vector_gsm_from_cache(inst->vector_cache, eap_session, &eap_sim_session->keys) != 0)) {
+		if ((fr_sim_vector_gsm_from_attrs(eap_session, request->control, 0, &eap_sim_session->keys, &src) != 0) ||
+		    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 1, &eap_sim_session->keys, &src) != 0) ||
+		    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 2, &eap_sim_session->keys, &src) != 0)) {
+			REDEBUG("Failed retrieving SIM vectors");
+			return RLM_MODULE_FAIL;
+		}
+
+		/*
+		 *	Keep any additional triplets the backend
+		 *	gave us for the next authentication.
+		 */
+		if (inst->vector_cache) {
+			fr_sim_vector_gsm_cache_store(inst->vector_cache, eap_session, request->control, 3, src);
+		}
 	}
 
 	/*
@@ -542,14 +570,44 @@ static rlm_rcode_t mod_session_init(UNUSED void *instance, eap_session_t *eap_se
 	return RLM_MODULE_OK;
 }
 
+/** Return the number of authentications the cached vectors for an identity will cover
+ *
+ * Example: "%{eap_sim_vectors:%{User-Name}}"
+ */
+static ssize_t vector_cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t outlen,
+				 void const *mod_inst, UNUSED void const *xlat_inst,
+				 UNUSED REQUEST *request, char const *fmt)
+{
+	rlm_eap_sim_t const *inst = mod_inst;
+
+	*out = talloc_asprintf(ctx, "%u", fr_sim_vector_cache_count(inst->vector_cache, fmt, SIM_VECTOR_GSM));
+	return talloc_array_length(*out) - 1;
+}
+
 /*
  *	Attach the module.
  */
-static int mod_instantiate(UNUSED rlm_eap_config_t const *config, UNUSED void *instance, CONF_SECTION *cs)
+static int mod_instantiate(UNUSED rlm_eap_config_t const *config, void *instance, CONF_SECTION *cs)
 {
+	rlm_eap_sim_t *inst = instance;
 	fr_dict_attr_t const *da;
 	CONF_SECTION *subcs;
 
+	/*
+	 *	Allocated outside of the instance data, as
+	 *	that's read only after instantiation.
+	 */
+	if (inst->vector_cache_size) {
+		inst->vector_cache = fr_sim_vector_cache_alloc(NULL, inst->vector_cache_size,
+							       inst->vector_cache_lifetime);
+		if (!inst->vector_cache) {
+			cf_log_err_cs(cs, "Failed creating vector cache: %s", fr_strerror());
+			return -1;
+		}
+
+		xlat_register(inst, "eap_sim_vectors", vector_cache_xlat, NULL, NULL, 0, 0);
+	}
+
 	da = fr_dict_attr_child_by_num(dict_sim_root, PW_EAP_SIM_SUBTYPE);
 	if (!da) {
 		cf_log_err_cs(cs, "Failed to find EAP-Sim-Subtype attribute");
@@ -585,6 +643,15 @@ static int mod_instantiate(UNUSED rlm_eap_config_t const *config, UNUSED void *i
 	return 0;
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_eap_sim_t *inst = instance;
+
+	TALLOC_FREE(inst->vector_cache);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	dict_sim_root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), PW_EAP_SIM_ROOT);
@@ -604,8 +671,12 @@ extern rlm_eap_submodule_t rlm_eap_sim;
 rlm_eap_submodule_t rlm_eap_sim = {
 	.name		= "eap_sim",
 	.magic		= RLM_MODULE_INIT,
+
+	.inst_size	= sizeof(rlm_eap_sim_t),
+	.config		= submodule_config,
 	.load		= mod_load,
 	.instantiate	= mod_instantiate,	/* Create new submodule instance */
+	.detach		= mod_detach,
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
 	.process	= mod_process,		/* Process next round of EAP method */
 };
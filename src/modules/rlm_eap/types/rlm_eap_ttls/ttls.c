@@ -468,9 +468,7 @@ static rlm_rcode_t CC_HINT(nonnull) process_reply(NDEBUG_UNUSED eap_session_t *e
 						  REQUEST *request, RADIUS_PACKET *reply)
 {
 	rlm_rcode_t	rcode = RLM_MODULE_REJECT;
-	VALUE_PAIR	*vp, *tunnel_vps = NULL;
-	vp_cursor_t	cursor;
-	vp_cursor_t	to_tunnel;
+	VALUE_PAIR	*tunnel_vps = NULL;
 
 	ttls_tunnel_t	*t = tls_session->opaque;
 
@@ -499,45 +497,31 @@ static rlm_rcode_t CC_HINT(nonnull) process_reply(NDEBUG_UNUSED eap_session_t *e
 	 */
 	switch (reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
-	{
 		RDEBUG("Got tunneled Access-Accept");
 
-		fr_pair_cursor_init(&to_tunnel, &tunnel_vps);
 		rcode = RLM_MODULE_OK;
 
 		/*
-		 *	Copy what we need into the TTLS tunnel and leave
-		 *	the rest to be cleaned up.
+		 *	Move what we need into the TTLS tunnel and leave
+		 *	the rest to be cleaned up.  The reply is freed
+		 *	after this, so there's no need to copy.
 		 */
-		for (vp = fr_pair_cursor_init(&cursor, &reply->vps);
-		     vp;
-		     vp = fr_pair_cursor_next(&cursor)) {
-		     	switch (vp->da->vendor) {
-			case VENDORPEC_MICROSOFT:
-				if (vp->da->attr == PW_MSCHAP2_SUCCESS) {
-					RDEBUG("Got MS-CHAP2-Success, tunneling it to the client in a challenge");
-
-					rcode = RLM_MODULE_HANDLED;
-					t->authenticated = true;
-					fr_pair_cursor_prepend(&to_tunnel, fr_pair_copy(tls_session, vp));
-				}
-				break;
-
-			case VENDORPEC_UKERNA:
-				if (vp->da->attr == PW_UKERNA_CHBIND) {
-					rcode = RLM_MODULE_HANDLED;
-					t->authenticated = true;
-					fr_pair_cursor_prepend(&to_tunnel, fr_pair_copy(tls_session, vp));
-				}
-				break;
-
-			default:
-				break;
-			}
+		if (fr_pair_find_by_num(reply->vps, VENDORPEC_MICROSOFT, PW_MSCHAP2_SUCCESS, TAG_ANY)) {
+			RDEBUG("Got MS-CHAP2-Success, tunneling it to the client in a challenge");
+
+			rcode = RLM_MODULE_HANDLED;
+			t->authenticated = true;
+			fr_pair_list_move_by_num(tls_session, &tunnel_vps, &reply->vps,
+						 VENDORPEC_MICROSOFT, PW_MSCHAP2_SUCCESS, TAG_ANY);
 		}
-	}
-		break;
 
+		if (fr_pair_find_by_num(reply->vps, VENDORPEC_UKERNA, PW_UKERNA_CHBIND, TAG_ANY)) {
+			rcode = RLM_MODULE_HANDLED;
+			t->authenticated = true;
+			fr_pair_list_move_by_num(tls_session, &tunnel_vps, &reply->vps,
+						 VENDORPEC_UKERNA, PW_UKERNA_CHBIND, TAG_ANY);
+		}
+		break;
 
 	case PW_CODE_ACCESS_REJECT:
 		RDEBUG("Got tunneled Access-Reject");
@@ -553,38 +537,14 @@ static rlm_rcode_t CC_HINT(nonnull) process_reply(NDEBUG_UNUSED eap_session_t *e
 	case PW_CODE_ACCESS_CHALLENGE:
 		RDEBUG("Got tunneled Access-Challenge");
 
-		fr_pair_cursor_init(&to_tunnel, &tunnel_vps);
-
 		/*
-		 *	Copy what we need into the TTLS tunnel and leave
+		 *	Move what we need into the TTLS tunnel and leave
 		 *	the rest to be cleaned up.
 		 */
-		for (vp = fr_pair_cursor_init(&cursor, &reply->vps);
-		     vp;
-		     vp = fr_pair_cursor_next(&cursor)) {
-		     	switch (vp->da->vendor) {
-			case VENDORPEC_UKERNA:
-				if (vp->da->attr == PW_UKERNA_CHBIND) {
-					fr_pair_cursor_prepend(&to_tunnel, fr_pair_copy(tls_session, vp));
-				}
-				break;
-
-			case 0:
-				switch (vp->da->attr) {
-				case PW_EAP_MESSAGE:
-				case PW_REPLY_MESSAGE:
-					fr_pair_cursor_prepend(&to_tunnel, fr_pair_copy(tls_session, vp));
-					break;
-
-				default:
-					break;
-
-				}
-
-			default:
-				continue;
-			}
-		}
+		fr_pair_list_move_by_num(tls_session, &tunnel_vps, &reply->vps,
+					 VENDORPEC_UKERNA, PW_UKERNA_CHBIND, TAG_ANY);
+		fr_pair_list_move_by_num(tls_session, &tunnel_vps, &reply->vps, 0, PW_EAP_MESSAGE, TAG_ANY);
+		fr_pair_list_move_by_num(tls_session, &tunnel_vps, &reply->vps, 0, PW_REPLY_MESSAGE, TAG_ANY);
 		rcode = RLM_MODULE_HANDLED;
 		break;
 
@@ -788,7 +748,7 @@ PW_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 	/*
 	 *	Allocate a fake REQUEST structure.
 	 */
-	fake = request_alloc_fake(request);
+	fake = eap_fake_request_alloc(eap_session, request);
 
 	rad_assert(!fake->packet->vps);
 
@@ -915,8 +875,8 @@ PW_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 			 *	Tell the original request that it's going
 			 *	to be proxied.
 			 */
-			fr_pair_list_mcopy_by_num(request, &request->control, &fake->control, 0, PW_PROXY_TO_REALM,
-						  TAG_ANY);
+			fr_pair_list_move_by_num(request, &request->control, &fake->control, 0, PW_PROXY_TO_REALM,
+						 TAG_ANY);
 
 			/*
 			 *	Seed the proxy packet with the
@@ -956,8 +916,10 @@ PW_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 			 *	the eap_session with the fake request.
 			 *
 			 *	So we associate the fake request with
-			 *	this request.
+			 *	this request.  It has to outlive the
+			 *	round, so it's moved out of the pool.
 			 */
+			talloc_steal(request, fake);
 			ret = request_data_add(request, request->proxy, REQUEST_DATA_EAP_MSCHAP_TUNNEL_CALLBACK,
 					       fake, true, false, false);
 			rad_cond_assert(ret == 0);
@@ -276,9 +276,206 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 /*
  *  Dispatch an exec method
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED void *thread, REQUEST *request)
+#ifndef __MINGW32__
+/** State for a program we're waiting on, without blocking the worker
+ *
+ */
+typedef struct rlm_exec_async_t {
+	char			*cmd;		//!< Command being executed, for error messages.
+	pid_t			pid;		//!< Of the child, or -1 if it has been reaped.
+	int			fd;		//!< Reading from the child's stdout, or -1 if closed.
+
+	TALLOC_CTX		*output_ctx;	//!< To allocate output pairs in.
+	VALUE_PAIR		**output_pairs;	//!< Where output pairs go.  NULL if we don't parse them.
+	bool			reject;		//!< Set the reply code to Access-Reject on failure.
+
+	bool			timed_out;	//!< The child didn't exit in time.
+	size_t			len;		//!< Amount of output read so far.
+	char			answer[4096];	//!< Output of the child.
+} rlm_exec_async_t;
+
+/** Kill and reap the child if the request goes away while we're waiting on it
+ *
+ */
+static int _exec_async_free(rlm_exec_async_t *ea)
+{
+	int status;
+
+	if (ea->fd >= 0) close(ea->fd);
+
+	if (ea->pid > 0) {
+		kill(ea->pid, SIGTERM);
+		(void) rad_waitpid(ea->pid, &status);
+	}
+
+	return 0;
+}
+
+/** Read output from the child, and resume the request when there's no more
+ *
+ */
+static void exec_async_read(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx, int fd)
+{
+	rlm_exec_async_t	*ea = talloc_get_type_abort(ctx, rlm_exec_async_t);
+	ssize_t			slen;
+
+	slen = read(fd, ea->answer + ea->len, sizeof(ea->answer) - 1 - ea->len);
+	if (slen < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN)) return;
+
+		REDEBUG("Failed reading from child: %s", fr_syserror(errno));
+	}
+
+	if (slen > 0) {
+		ea->len += slen;
+		if (ea->len < (sizeof(ea->answer) - 1)) return;
+	}
+
+	/*
+	 *	EOF, error, or we've run out of buffer.  Either way
+	 *	there's nothing more to read.
+	 */
+	(void) unlang_event_timeout_delete(request, ea);
+	(void) unlang_event_fd_delete(request, ea, fd);
+	unlang_resumable(request);
+}
+
+/** The child didn't finish in time
+ *
+ */
+static void exec_async_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			       UNUSED struct timeval *fired)
+{
+	rlm_exec_async_t	*ea = talloc_get_type_abort(ctx, rlm_exec_async_t);
+
+	REDEBUG("Child PID %u (%s) is taking too much time: forcing failure and killing child.",
+		(unsigned int) ea->pid, ea->cmd);
+
+	ea->timed_out = true;
+	(void) unlang_event_fd_delete(request, ea, ea->fd);
+	unlang_resumable(request);
+}
+
+/** Process the output of the child once it's finished
+ *
+ */
+static rlm_rcode_t exec_async_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_exec_async_t	*ea = talloc_get_type_abort(ctx, rlm_exec_async_t);
+	rlm_rcode_t		rcode = RLM_MODULE_FAIL;
+	bool			reject = ea->reject;
+	VALUE_PAIR		*answer = NULL;
+	char			out[1024];
+	int			status;
+
+	/*
+	 *	The destructor kills and reaps the child.
+	 */
+	if (ea->timed_out) goto finish;
+
+	/*
+	 *	Make sure that the writer can't block while writing to
+	 *	a pipe that no one is reading from anymore.
+	 */
+	close(ea->fd);
+	ea->fd = -1;
+
+	/* Strip trailing new lines */
+	while ((ea->len > 0) && (ea->answer[ea->len - 1] == '\n')) ea->len--;
+	ea->answer[ea->len] = '\0';
+
+	out[0] = '\0';
+	status = radius_exec_program_finish(ea->output_ctx, out, sizeof(out), ea->output_pairs ? &answer : NULL,
+					    request, ea->cmd, ea->pid, ea->answer, ea->len);
+	if (status != -2) ea->pid = -1;
+
+	rcode = rlm_exec_status2rcode(request, out, strlen(out), status);
+
+	/*
+	 *	Move the answer over to the output pairs.
+	 */
+	if (ea->output_pairs) fr_pair_list_move(ea->output_ctx, ea->output_pairs, &answer);
+	fr_pair_list_free(&answer);
+
+finish:
+	talloc_free(ea);
+
+	if (reject) switch (rcode) {
+	case RLM_MODULE_FAIL:
+	case RLM_MODULE_INVALID:
+	case RLM_MODULE_REJECT:
+		request->reply->code = PW_CODE_ACCESS_REJECT;
+		break;
+
+	default:
+		break;
+	}
+
+	return rcode;
+}
+
+/** Start a program, and yield until it has finished
+ *
+ * Instead of blocking the worker in select() while the child runs, the
+ * child's stdout is watched by the request's event list, and the request is
+ * resumed when the child closes it, or the timeout fires.
+ *
+ * @param[in] inst		of rlm_exec.
+ * @param[in] request		The current request.
+ * @param[in] cmd		to execute.  Will be xlat expanded by #radius_start_program.
+ * @param[in] input_pairs	to put in the environment of the child.
+ * @param[in] output_ctx	to allocate output pairs in.
+ * @param[in] output_pairs	to add output pairs to.  NULL to discard the output.
+ * @param[in] reject		set the reply code to Access-Reject if the program fails.
+ * @return
+ *	- RLM_MODULE_YIELD if we're waiting for the program.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t exec_async_start(rlm_exec_t const *inst, REQUEST *request, char const *cmd,
+				    VALUE_PAIR *input_pairs, TALLOC_CTX *output_ctx, VALUE_PAIR **output_pairs,
+				    bool reject)
+{
+	rlm_exec_async_t	*ea;
+	struct timeval		when;
+
+	RDEBUG2("Executing: %s", cmd);
+
+	MEM(ea = talloc_zero(request, rlm_exec_async_t));
+	ea->cmd = talloc_strdup(ea, cmd);
+	ea->fd = -1;
+	ea->output_ctx = output_ctx;
+	ea->output_pairs = output_pairs;
+	ea->reject = reject;
+
+	ea->pid = radius_start_program(cmd, request, true, NULL, &ea->fd, input_pairs, inst->shell_escape);
+	if (ea->pid < 0) {
+		talloc_free(ea);
+		return RLM_MODULE_FAIL;
+	}
+	talloc_set_destructor(ea, _exec_async_free);
+
+	if (fr_nonblock(ea->fd) < 0) {
+		REDEBUG("Failed setting child's stdout to non-blocking: %s", fr_syserror(errno));
+	error:
+		talloc_free(ea);
+		return RLM_MODULE_FAIL;
+	}
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += inst->timeout;
+
+	if (unlang_event_fd_readable_add(request, exec_async_read, ea, ea->fd) < 0) goto error;
+	if (unlang_event_timeout_add(request, exec_async_timeout, ea, &when) < 0) {
+		(void) unlang_event_fd_delete(request, ea, ea->fd);
+		goto error;
+	}
+
+	return unlang_yield(request, exec_async_resume, NULL, ea);
+}
+#endif	/* __MINGW32__ */
+
+static rlm_rcode_t exec_dispatch(rlm_exec_t const *inst, REQUEST *request, bool reject)
 {
-	rlm_exec_t const	*inst = instance;
 	rlm_rcode_t		rcode;
 	int			status;
 
@@ -330,6 +527,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED voi
 		ctx = radius_list_ctx(request, inst->output_list);
 	}
 
+#ifndef __MINGW32__
+	/*
+	 *	Don't tie up the worker while the program runs.
+	 */
+	if (inst->wait) {
+		return exec_async_start(inst, request, inst->program, inst->input ? *input_pairs : NULL,
+					ctx ? ctx : request, output_pairs, reject);
+	}
+#endif
+
 	/*
 	 *	This function does it's own xlat of the input program
 	 *	to execute.
@@ -349,16 +556,32 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED voi
 	}
 	fr_pair_list_free(&answer);
 
+	if (reject) switch (rcode) {
+	case RLM_MODULE_FAIL:
+	case RLM_MODULE_INVALID:
+	case RLM_MODULE_REJECT:
+		request->reply->code = PW_CODE_ACCESS_REJECT;
+		break;
+
+	default:
+		break;
+	}
+
 	return rcode;
 }
 
+static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	return exec_dispatch(instance, request, false);
+}
+
 
 /*
  *	First, look for Exec-Program && Exec-Program-Wait.
  *
  *	Then, call exec_dispatch.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_exec_t const	*inst = instance;
 	rlm_rcode_t 		rcode;
@@ -379,9 +602,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread,
 			return RLM_MODULE_NOOP;
 		}
 
-		rcode = mod_exec_dispatch(instance, thread, request);
-		goto finish;
+		return exec_dispatch(inst, request, true);
+	}
+
+#ifndef __MINGW32__
+	if (we_wait) {
+		return exec_async_start(inst, request, vp->vp_strvalue, request->packet->vps,
+					request->reply, &request->reply->vps, true);
 	}
+#endif
 
 	tmp = NULL;
 	status = radius_exec_program(request, out, sizeof(out), &tmp, request, vp->vp_strvalue, request->packet->vps,
@@ -394,7 +623,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread,
 	fr_pair_list_move(request->reply, &request->reply->vps, &tmp);
 	fr_pair_list_free(&tmp);
 
-	finish:
 	switch (rcode) {
 	case RLM_MODULE_FAIL:
 	case RLM_MODULE_INVALID:
@@ -441,6 +669,12 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread,
 		return RLM_MODULE_NOOP;
 	}
 
+#ifndef __MINGW32__
+	if (we_wait) {
+		return exec_async_start(inst, request, vp->vp_strvalue, request->packet->vps, request, NULL, false);
+	}
+#endif
+
 	status = radius_exec_program(request, out, sizeof(out), NULL, request, vp->vp_strvalue, request->packet->vps,
 				     we_wait, inst->shell_escape, inst->timeout);
 	return rlm_exec_status2rcode(request, out, strlen(out), status);
@@ -132,10 +132,16 @@ static int64_t fr_pow(int64_t base, int64_t exp)
 
 /*
  *	Start of expression calculator.
+ *
+ *	Expressions are parsed into a tree, which is then evaluated.
+ *	If the argument of %{expr:...} is a literal, the tree is built
+ *	once when the configuration is loaded, with attribute
+ *	references resolved, and any constant sub-expressions folded.
  */
 typedef enum expr_token_t {
 	TOKEN_NONE = 0,
 	TOKEN_INTEGER,
+	TOKEN_ATTRIBUTE,
 
 	TOKEN_AND,
 	TOKEN_OR,
@@ -155,7 +161,8 @@ typedef enum expr_token_t {
 } expr_token_t;
 
 static int precedence[TOKEN_LAST + 1] = {
-	0, 0, 1, 1,		/* and or */
+	0, 0, 0,		/* none, integer, attribute */
+	1, 1,			/* and or */
 	2, 2, 3, 3,		/* shift add */
 	4, 4, 4, 5,		/* mul, pow */
 	0
@@ -179,26 +186,178 @@ static expr_map_t map[] =
 	{0,	TOKEN_LAST}
 };
 
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev);
+/** A node in a parsed expression
+ *
+ */
+typedef struct expr_node expr_node_t;
+struct expr_node {
+	expr_token_t	token;		//!< TOKEN_INTEGER, TOKEN_ATTRIBUTE, an operator, or
+					//!< TOKEN_NONE for a bracketed sub-expression.
+	int64_t		value;		//!< Value of a TOKEN_INTEGER.
+	vp_tmpl_t	*vpt;		//!< Attribute to sum the values of, for TOKEN_ATTRIBUTE.
+	bool		invert;		//!< Apply '~' to the result.
+	bool		negative;	//!< Negate the result.
+	expr_node_t	*lhs;		//!< Left operand, or the bracketed sub-expression.
+	expr_node_t	*rhs;		//!< Right operand.
+};
+
+/** Instance data for an %{expr:...} with a literal argument
+ *
+ */
+typedef struct rlm_expr_xlat_inst_t {
+	expr_node_t	*tree;		//!< The parsed expression.
+} rlm_expr_xlat_inst_t;
+
+static bool calc_result(int64_t lhs, expr_token_t op, int64_t rhs, int64_t *answer)
+{
+	switch (op) {
+	default:
+	case TOKEN_SUBTRACT:
+		rhs = -rhs;
+		/* FALL-THROUGH */
+
+	case TOKEN_ADD:
+		if ((rhs > 0) && (lhs > (int64_t) INT64_MAX - rhs)) {
+		overflow:
+			fr_strerror_printf("Numerical overflow in expression!");
+			return false;
+		}
+
+		if ((rhs < 0) && (lhs < (int64_t) INT64_MIN - rhs)) goto overflow;
+
+		*answer = lhs + rhs;
+		break;
+
+	case TOKEN_DIVIDE:
+		if (rhs == 0) {
+			fr_strerror_printf("Division by zero in expression!");
+			return false;
+		}
+
+		*answer = lhs / rhs;
+		break;
+
+	case TOKEN_REMAINDER:
+		if (rhs == 0) {
+			fr_strerror_printf("Division by zero!");
+			return false;
+		}
+
+		*answer = lhs % rhs;
+		break;
+
+	case TOKEN_MULTIPLY:
+		*answer = lhs * rhs;
+		break;
+
+	case TOKEN_LSHIFT:
+		if (rhs > 63) {
+			fr_strerror_printf("Shift must be less than 63 (was %lld)", (long long int) rhs);
+			return false;
+		}
+
+		*answer = lhs << rhs;
+		break;
+
+	case TOKEN_RSHIFT:
+		if (rhs > 63) {
+			fr_strerror_printf("Shift must be less than 63 (was %lld)", (long long int) rhs);
+			return false;
+		}
+
+		*answer = lhs >> rhs;
+		break;
+
+	case TOKEN_AND:
+		*answer = lhs & rhs;
+		break;
+
+	case TOKEN_OR:
+		*answer = lhs | rhs;
+		break;
+
+	case TOKEN_POWER:
+		if (rhs > 63) {
+			fr_strerror_printf("Exponent must be between 0-63 (was %lld)", (long long int) rhs);
+			return false;
+		}
+
+		if (lhs > 65535) {
+			fr_strerror_printf("Base must be between 0-65535 (was %lld)", (long long int) lhs);
+			return false;
+		}
+
+		*answer = fr_pow(lhs, rhs);
+		break;
+	}
+
+	return true;
+}
 
-static bool get_number(REQUEST *request, char const **string, int64_t *answer)
+/** Replace a node with its value, if all of its operands are constant
+ *
+ * If the calculation fails (division by zero, overflow), the node is left
+ * alone, so that the error is reported when the expression is evaluated.
+ */
+static void expr_fold(expr_node_t *node)
 {
 	int64_t x;
-	bool invert = false;
-	bool negative = false;
-	char const *p = *string;
-	vp_tmpl_t *vpt = NULL;
+
+	switch (node->token) {
+	case TOKEN_ATTRIBUTE:
+		return;
+
+	case TOKEN_INTEGER:
+		if (!node->invert && !node->negative) return;
+		x = node->value;
+		break;
+
+	case TOKEN_NONE:
+		if (node->lhs->token != TOKEN_INTEGER) return;
+		x = node->lhs->value;
+		break;
+
+	default:
+		if ((node->lhs->token != TOKEN_INTEGER) || (node->rhs->token != TOKEN_INTEGER)) return;
+		if (!calc_result(node->lhs->value, node->token, node->rhs->value, &x)) return;
+		break;
+	}
+
+	if (node->invert) x = ~x;
+	if (node->negative) x = -x;
+
+	talloc_free(node->lhs);
+	talloc_free(node->rhs);
+	memset(node, 0, sizeof(*node));
+
+	node->token = TOKEN_INTEGER;
+	node->value = x;
+}
+
+static bool expr_parse(TALLOC_CTX *ctx, char const **string, expr_node_t **out, expr_token_t prev);
+
+static bool expr_parse_number(TALLOC_CTX *ctx, char const **string, expr_node_t **out)
+{
+	int64_t		x;
+	char const	*p = *string;
+	expr_node_t	*node;
 
 	/*
 	 *	Look for a number.
 	 */
 	while (isspace((int) *p)) p++;
 
+	node = talloc_zero(ctx, expr_node_t);
+	if (!node) {
+		fr_strerror_printf("Out of memory");
+		return false;
+	}
+
 	/*
 	 *	~1 == 0xff...ffe
 	 */
 	if (*p == '~') {
-		invert = true;
+		node->invert = true;
 		p++;
 	}
 
@@ -211,13 +370,14 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	if ((*p == '0') && (p[1] == 'x')) {
 		char *end;
 
-		x = strtoul(p, &end, 16);
+		node->token = TOKEN_INTEGER;
+		node->value = strtoul(p, &end, 16);
 		p = end;
 		goto done;
 	}
 
 	if (*p == '-') {
-		negative = true;
+		node->negative = true;
 		p++;
 	}
 
@@ -225,78 +385,24 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 *	Look for an attribute.
 	 */
 	if (*p == '&') {
-		int		i, max, err;
-		ssize_t		slen;
-		VALUE_PAIR	*vp;
-		vp_cursor_t cursor;
+		ssize_t slen;
 
 		p += 1;
 
-		slen = tmpl_afrom_attr_substr(request, &vpt, p, REQUEST_CURRENT, PAIR_LIST_REQUEST, false, false);
+		slen = tmpl_afrom_attr_substr(node, &node->vpt, p, REQUEST_CURRENT, PAIR_LIST_REQUEST, false, false);
 		if (slen <= 0) {
-			REDEBUG("Failed parsing attribute name '%s': %s", p, fr_strerror());
+			fr_strerror_printf("Failed parsing attribute name '%s': %s", p, fr_strerror());
 			return false;
 		}
 
 		p += slen;
 
-		if (vpt->tmpl_num == NUM_COUNT) {
-			REDEBUG("Attribute count is not supported");
+		if (node->vpt->tmpl_num == NUM_COUNT) {
+			fr_strerror_printf("Attribute count is not supported");
 			return false;
 		}
 
-		if (vpt->tmpl_num == NUM_ALL) {
-			max = 65535;
-		} else {
-			max = 1;
-		}
-
-		x = 0;
-		for (i = 0, vp = tmpl_cursor_init(&err, &cursor, request, vpt);
-		     (i < max) && (vp != NULL);
-		     i++, vp = tmpl_cursor_next(&cursor, vpt)) {
-			int64_t y;
-
-			if (vp->vp_type != PW_TYPE_INTEGER64) {
-				value_box_t	value;
-
-				if (value_box_cast(vp, &value, PW_TYPE_INTEGER64, NULL, &vp->data) < 0) {
-					REDEBUG("Failed converting &%.*s to an integer value: %s", (int) vpt->len,
-						vpt->name, fr_strerror());
-					return false;
-				}
-				if (value.datum.integer64 > INT64_MAX) {
-				overflow:
-					if (vpt) talloc_free(vpt);
-					REDEBUG("Value of &%.*s (%"PRIu64 ") would overflow a signed 64bit integer "
-						"(our internal arithmetic type)", (int)vpt->len, vpt->name, value.datum.integer64);
-					return false;
-				}
-				y = (int64_t)value.datum.integer64;
-
-				RINDENT();
-				RDEBUG3("&%.*s --> %" PRIu64, (int)vpt->len, vpt->name, y);
-				REXDENT();
-			} else {
-				if (vp->vp_integer64 > INT64_MAX) goto overflow;
-				y = (int64_t)vp->vp_integer64;
-			}
-
-			/*
-			 *	Check for overflow without actually overflowing.
-			 */
-			if ((y > 0) && (x > (int64_t) INT64_MAX - y)) goto overflow;
-
-			if ((y < 0) && (x < (int64_t) INT64_MIN - y)) goto overflow;
-
-			x += y;
-		} /* loop over all found VPs */
-
-		if (err != 0) {
-			RWDEBUG("Can't find &%.*s.  Using 0 as operand value", (int)vpt->len, vpt->name);
-			goto done;
-		}
-
+		node->token = TOKEN_ATTRIBUTE;
 		goto done;
 	}
 
@@ -305,18 +411,20 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 */
 	if (*p == '(') {
 		p++;
-		if (!get_expression(request, &p, &x, TOKEN_NONE)) return false;
+		if (!expr_parse(node, &p, &node->lhs, TOKEN_NONE)) return false;
 
 		if (*p != ')') {
-			RDEBUG("No trailing ')'");
+			fr_strerror_printf("No trailing ')'");
 			return false;
 		}
 		p++;
+
+		node->token = TOKEN_NONE;
 		goto done;
 	}
 
 	if ((*p < '0') || (*p > '9')) {
-		RDEBUG2("Not a number at \"%s\"", p);
+		fr_strerror_printf("Not a number at \"%s\"", p);
 		return false;
 	}
 
@@ -331,105 +439,18 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 		p++;
 	}
 
-done:
-	if (vpt) talloc_free(vpt);
-
-	if (invert) x = ~x;
+	node->token = TOKEN_INTEGER;
+	node->value = x;
 
-	if (negative) x = -x;
+done:
+	expr_fold(node);
 
 	*string = p;
-	*answer = x;
+	*out = node;
 	return true;
 }
 
-static bool calc_result(REQUEST *request, int64_t lhs, expr_token_t op, int64_t rhs, int64_t *answer)
-{
-	switch (op) {
-	default:
-	case TOKEN_SUBTRACT:
-		rhs = -rhs;
-		/* FALL-THROUGH */
-
-	case TOKEN_ADD:
-		if ((rhs > 0) && (lhs > (int64_t) INT64_MAX - rhs)) {
-		overflow:
-			REDEBUG("Numerical overflow in expression!");
-			return false;
-		}
-
-		if ((rhs < 0) && (lhs < (int64_t) INT64_MIN - rhs)) goto overflow;
-
-		*answer = lhs + rhs;
-		break;
-
-	case TOKEN_DIVIDE:
-		if (rhs == 0) {
-			REDEBUG("Division by zero in expression!");
-			return false;
-		}
-
-		*answer = lhs / rhs;
-		break;
-
-	case TOKEN_REMAINDER:
-		if (rhs == 0) {
-			RDEBUG("Division by zero!");
-			return false;
-		}
-
-		*answer = lhs % rhs;
-		break;
-
-	case TOKEN_MULTIPLY:
-		*answer = lhs * rhs;
-		break;
-
-	case TOKEN_LSHIFT:
-		if (rhs > 63) {
-			RDEBUG("Shift must be less than 63 (was %lld)", (long long int) rhs);
-			return false;
-		}
-
-		*answer = lhs << rhs;
-		break;
-
-	case TOKEN_RSHIFT:
-		if (rhs > 63) {
-			RDEBUG("Shift must be less than 63 (was %lld)", (long long int) rhs);
-			return false;
-		}
-
-		*answer = lhs >> rhs;
-		break;
-
-	case TOKEN_AND:
-		*answer = lhs & rhs;
-		break;
-
-	case TOKEN_OR:
-		*answer = lhs | rhs;
-		break;
-
-	case TOKEN_POWER:
-		if (rhs > 63) {
-			REDEBUG("Exponent must be between 0-63 (was %lld)", (long long int) rhs);
-			return false;
-		}
-
-		if (lhs > 65535) {
-			REDEBUG("Base must be between 0-65535 (was %lld)", (long long int) lhs);
-			return false;
-		}
-
-		*answer = fr_pow(lhs, rhs);
-		break;
-	}
-
-	return true;
-}
-
-static bool get_operator(REQUEST *request, char const **string, expr_token_t *op)
+static bool get_operator(char const **string, expr_token_t *op)
 {
 	int		i;
 	char const	*p = *string;
@@ -457,20 +478,23 @@ static bool get_operator(REQUEST *request, char const **string, expr_token_t *op
 		return true;
 	}
 
-	RDEBUG("Expected operator at \"%s\"", p);
+	fr_strerror_printf("Expected operator at \"%s\"", p);
 	return false;
 }
 
-
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev)
+/** Parse an expression into a tree
+ *
+ * All nodes are allocated in ctx, callers should free ctx on error.
+ */
+static bool expr_parse(TALLOC_CTX *ctx, char const **string, expr_node_t **out, expr_token_t prev)
 {
-	int64_t		lhs, rhs;
+	expr_node_t	*lhs, *rhs, *node;
 	char const 	*p, *op_p;
 	expr_token_t	this;
 
 	p = *string;
 
-	if (!get_number(request, &p, &lhs)) return false;
+	if (!expr_parse_number(ctx, &p, &lhs)) return false;
 
 redo:
 	while (isspace((int) *p)) p++;
@@ -479,7 +503,7 @@ redo:
 	 *	A number by itself is OK.
 	 */
 	if (!*p || (*p == ')')) {
-		*answer = lhs;
+		*out = lhs;
 		*string = p;
 		return true;
 	}
@@ -488,7 +512,7 @@ redo:
 	 *	Peek at the operator.
 	 */
 	op_p = p;
-	if (!get_operator(request, &p, &this)) return false;
+	if (!get_operator(&p, &this)) return false;
 
 	/*
 	 *	a + b + c ... = (a + b) + c ...
@@ -498,7 +522,7 @@ redo:
 	 *	care of continuing.
 	 */
 	if (precedence[this] <= precedence[prev]) {
-		*answer = lhs;
+		*out = lhs;
 		*string = op_p;
 		return true;
 	}
@@ -506,42 +530,219 @@ redo:
 	/*
 	 *	a + b * c ... = a + (b * c) ...
 	 */
-	if (!get_expression(request, &p, &rhs, this)) return false;
+	if (!expr_parse(ctx, &p, &rhs, this)) return false;
 
-	if (!calc_result(request, lhs, this, rhs, answer)) return false;
+	node = talloc_zero(ctx, expr_node_t);
+	if (!node) {
+		fr_strerror_printf("Out of memory");
+		return false;
+	}
+	node->token = this;
+	node->lhs = lhs;
+	node->rhs = rhs;
+	expr_fold(node);
 
 	/*
-	 *	There may be more to calculate.  The answer we
-	 *	calculated here is now the LHS of the lower priority
+	 *	There may be more to calculate.  The node we
+	 *	built here is now the LHS of the lower priority
 	 *	operation which follows the current expression.  e.g.
 	 *
 	 *	a * b + c ... = (a * b) + c ...
 	 *	              =       d + c ...
 	 */
-	lhs = *answer;
+	lhs = node;
 	goto redo;
 }
 
+/** Parse a complete expression
+ *
+ * @param[in] ctx	to allocate the tree in.
+ * @param[out] out	The root of the tree.
+ * @param[in] fmt	expression to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the error in fr_strerror().
+ */
+static int expr_compile(TALLOC_CTX *ctx, expr_node_t **out, char const *fmt)
+{
+	char const *p = fmt;
+
+	if (!expr_parse(ctx, &p, out, TOKEN_NONE)) return -1;
+
+	if (*p) {
+		fr_strerror_printf("Invalid text after expression: %s", p);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Sum the values of an attribute reference
+ *
+ */
+static bool expr_eval_attr(REQUEST *request, vp_tmpl_t const *vpt, int64_t *answer)
+{
+	int		i, max, err;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	int64_t		x = 0;
+
+	if (vpt->tmpl_num == NUM_ALL) {
+		max = 65535;
+	} else {
+		max = 1;
+	}
+
+	for (i = 0, vp = tmpl_cursor_init(&err, &cursor, request, vpt);
+	     (i < max) && (vp != NULL);
+	     i++, vp = tmpl_cursor_next(&cursor, vpt)) {
+		int64_t		y;
+		uint64_t	num;
+
+		/*
+		 *	Integer types are used directly, everything
+		 *	else has to be cast.
+		 */
+		switch (vp->vp_type) {
+		case PW_TYPE_BYTE:
+			num = vp->vp_byte;
+			break;
+
+		case PW_TYPE_SHORT:
+			num = vp->vp_short;
+			break;
+
+		case PW_TYPE_INTEGER:
+			num = vp->vp_integer;
+			break;
+
+		case PW_TYPE_DATE:
+			num = vp->vp_date;
+			break;
+
+		case PW_TYPE_INTEGER64:
+			num = vp->vp_integer64;
+			break;
+
+		default:
+		{
+			value_box_t	value;
+
+			if (value_box_cast(vp, &value, PW_TYPE_INTEGER64, NULL, &vp->data) < 0) {
+				REDEBUG("Failed converting &%.*s to an integer value: %s", (int) vpt->len,
+					vpt->name, fr_strerror());
+				return false;
+			}
+			num = value.datum.integer64;
+
+			RINDENT();
+			RDEBUG3("&%.*s --> %" PRIu64, (int)vpt->len, vpt->name, num);
+			REXDENT();
+		}
+			break;
+		}
+
+		if (num > INT64_MAX) {
+			REDEBUG("Value of &%.*s (%"PRIu64 ") would overflow a signed 64bit integer "
+				"(our internal arithmetic type)", (int)vpt->len, vpt->name, num);
+			return false;
+		}
+		y = (int64_t)num;
+
+		/*
+		 *	Check for overflow without actually overflowing.
+		 */
+		if (((y > 0) && (x > (int64_t) INT64_MAX - y)) ||
+		    ((y < 0) && (x < (int64_t) INT64_MIN - y))) {
+			REDEBUG("Sum of &%.*s would overflow a signed 64bit integer "
+				"(our internal arithmetic type)", (int)vpt->len, vpt->name);
+			return false;
+		}
+
+		x += y;
+	} /* loop over all found VPs */
+
+	if (err != 0) RWDEBUG("Can't find &%.*s.  Using 0 as operand value", (int)vpt->len, vpt->name);
+
+	*answer = x;
+	return true;
+}
+
+static bool expr_eval(REQUEST *request, expr_node_t const *node, int64_t *answer)
+{
+	int64_t x, lhs, rhs;
+
+	switch (node->token) {
+	case TOKEN_INTEGER:
+		x = node->value;
+		break;
+
+	case TOKEN_ATTRIBUTE:
+		if (!expr_eval_attr(request, node->vpt, &x)) return false;
+		break;
+
+	case TOKEN_NONE:
+		if (!expr_eval(request, node->lhs, &x)) return false;
+		break;
+
+	default:
+		if (!expr_eval(request, node->lhs, &lhs)) return false;
+		if (!expr_eval(request, node->rhs, &rhs)) return false;
+
+		if (!calc_result(lhs, node->token, rhs, answer)) {
+			REDEBUG("%s", fr_strerror());
+			return false;
+		}
+		return true;
+	}
+
+	if (node->invert) x = ~x;
+
+	if (node->negative) x = -x;
+
+	*answer = x;
+	return true;
+}
+
+/** Pre-parse the argument of %{expr:...}, if it's a literal
+ *
+ */
+static int expr_xlat_instantiate(void *xlat_inst, UNUSED void *mod_inst, char const *fmt)
+{
+	rlm_expr_xlat_inst_t *inst = xlat_inst;
+
+	return expr_compile(inst, &inst->tree, fmt);
+}
+
 /*
  *  Do xlat of strings!
  */
 static ssize_t expr_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
-			 UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			 UNUSED void const *mod_inst, void const *xlat_inst,
 			 REQUEST *request, char const *fmt)
 {
-	int64_t		result;
-	char const 	*p;
-
-	p = fmt;
+	rlm_expr_xlat_inst_t const	*inst = xlat_inst;
+	expr_node_t			*tree;
+	TALLOC_CTX			*tree_ctx = NULL;
+	int64_t				result;
+	bool				ret;
+
+	if (inst && inst->tree) {
+		tree = inst->tree;
+	} else {
+		tree_ctx = talloc_new(request);
+		if (!tree_ctx) return -1;
 
-	if (!get_expression(request, &p, &result, TOKEN_NONE)) {
-		return -1;
+		if (expr_compile(tree_ctx, &tree, fmt) < 0) {
+			REDEBUG("%s", fr_strerror());
+			talloc_free(tree_ctx);
+			return -1;
+		}
 	}
 
-	if (*p) {
-		RDEBUG("Invalid text after expression: %s", p);
-		return -1;
-	}
+	ret = expr_eval(request, tree, &result);
+	talloc_free(tree_ctx);
+	if (!ret) return -1;
 
 	snprintf(*out, outlen, "%lld", (long long int) result);
 	return strlen(*out);
@@ -1787,7 +1988,8 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		inst->xlat_name = cf_section_name1(conf);
 	}
 
-	xlat_register(inst, inst->xlat_name, expr_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register(inst, inst->xlat_name, expr_xlat, NULL, expr_xlat_instantiate,
+		      sizeof(rlm_expr_xlat_inst_t), XLAT_DEFAULT_BUF_LEN);
 
 	xlat_register(inst, "rand", rand_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "randstr", randstr_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
@@ -36,36 +36,92 @@ typedef struct rlm_files_t {
 	char const *key;
 
 	char const *filename;
-	rbtree_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
-
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+
+	uint32_t reload_interval;
+
+	module_reload_t *reload;
 } rlm_files_t;
 
+/** A users file entry
+ *
+ */
+typedef struct files_entry_t files_entry_t;
+struct files_entry_t {
+	PAIR_LIST		*pl;		//!< Check and reply items.
+	bool			copy_check;	//!< Check items must be expanded, so are compared on a copy.
+	files_entry_t		*next;		//!< Next entry with the same key, in file order.
+};
+
+/** DEFAULT entries which start with the same "==" check item
+ *
+ * These can only match requests containing that attribute and value,
+ * so the others are never looked at.
+ */
+typedef struct files_default_t files_default_t;
+struct files_default_t {
+	VALUE_PAIR const	*vp;		//!< First check item of the entries.
+	files_entry_t		*head;		//!< Entries, in file order.
+	files_entry_t		**tail;
+	files_default_t		*next;		//!< Next group indexed by the same attribute.
+};
+
+/** An attribute DEFAULT entries are indexed by
+ *
+ */
+typedef struct files_index_attr_t files_index_attr_t;
+struct files_index_attr_t {
+	fr_dict_attr_t const	*da;
+	files_default_t		*groups;	//!< All groups indexed by this attribute.
+	uint32_t		num_groups;
+	files_index_attr_t	*next;
+};
+
+/** A parsed users file
+ *
+ */
+typedef struct files_index_t {
+	fr_hash_table_t		*users;		//!< Entries for named users, by name.
+	files_entry_t		*defaults;	//!< DEFAULT entries which aren't indexed, in file order.
+	fr_hash_table_t		*default_groups; //!< Indexed DEFAULT entries, by their first check item.
+	files_index_attr_t	*attrs;		//!< Attributes DEFAULT entries are indexed by.
+	uint32_t		num_groups;	//!< Total number of groups of DEFAULT entries.
+} files_index_t;
+
+/*
+ *	The parsed files.  Replaced as a whole when any of them change.
+ */
+typedef struct rlm_files_data_t {
+	files_index_t *common;
+	files_index_t *users;
+	files_index_t *auth_users;
+	files_index_t *acct_users;
+#ifdef WITH_PROXY
+	files_index_t *preproxy_users;
+	files_index_t *postproxy_users;
+#endif
+	files_index_t *postauth_users;
+} rlm_files_data_t;
+
 
 /*
  *     See if a VALUE_PAIR list contains Fall-Through = Yes
@@ -90,26 +146,189 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("postauth_usersfile", PW_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("compat", PW_TYPE_STRING | PW_TYPE_DEPRECATED, rlm_files_t, compat_mode) },
 	{ FR_CONF_OFFSET("key", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_files_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
 
-static int pairlist_cmp(void const *a, void const *b)
+static uint32_t files_entry_hash(void const *data)
+{
+	return fr_hash_string(((files_entry_t const *)data)->pl->name);
+}
+
+static int files_entry_cmp(void const *a, void const *b)
+{
+	return strcmp(((files_entry_t const *)a)->pl->name,
+		      ((files_entry_t const *)b)->pl->name);
+}
+
+/** Hash an attribute and its value
+ *
+ * Must agree with files_default_cmp, and with radius_compare_vps() as
+ * to which values are equal.
+ */
+static uint32_t files_default_hash(void const *data)
 {
-	return strcmp(((PAIR_LIST const *)a)->name,
-		      ((PAIR_LIST const *)b)->name);
+	VALUE_PAIR const	*vp = ((files_default_t const *)data)->vp;
+	uint32_t		hash;
+
+	hash = fr_hash(&vp->da, sizeof(vp->da));
+
+	switch (vp->vp_type) {
+	case PW_TYPE_STRING:
+		return fr_hash_update(vp->vp_strvalue, strlen(vp->vp_strvalue), hash);
+
+	case PW_TYPE_OCTETS:
+		return fr_hash_update(vp->vp_octets, vp->vp_length, hash);
+
+	case PW_TYPE_INTEGER:
+		return fr_hash_update(&vp->vp_integer, sizeof(vp->vp_integer), hash);
+
+	case PW_TYPE_IPV4_ADDR:
+		return fr_hash_update(&vp->vp_ipaddr, sizeof(vp->vp_ipaddr), hash);
+
+	default:
+		return hash;
+	}
+}
+
+static int files_default_cmp(void const *one, void const *two)
+{
+	VALUE_PAIR const	*a = ((files_default_t const *)one)->vp;
+	VALUE_PAIR const	*b = ((files_default_t const *)two)->vp;
+
+	if (a->da != b->da) return (a->da < b->da) ? -1 : 1;
+
+	switch (a->vp_type) {
+	case PW_TYPE_STRING:
+		return strcmp(a->vp_strvalue, b->vp_strvalue);
+
+	case PW_TYPE_OCTETS:
+		if (a->vp_length != b->vp_length) return (a->vp_length < b->vp_length) ? -1 : 1;
+		return memcmp(a->vp_octets, b->vp_octets, a->vp_length);
+
+	case PW_TYPE_INTEGER:
+		return (a->vp_integer > b->vp_integer) - (a->vp_integer < b->vp_integer);
+
+	case PW_TYPE_IPV4_ADDR:
+		return memcmp(&a->vp_ipaddr, &b->vp_ipaddr, sizeof(a->vp_ipaddr));
+
+	default:
+		return 0;
+	}
+}
+
+/** Find the check item a DEFAULT entry can be indexed by
+ *
+ * This is the first item paircompare() looks at, if it must be equal
+ * to a fixed value in the request.  Requests without that value can't
+ * match the entry, and paircompare() would have stopped at the first
+ * item, so skipping the entry changes nothing.
+ *
+ * @param[in] check	items of the entry.
+ * @return
+ *	- The check item.
+ *	- NULL if the entry can't be indexed.
+ */
+static VALUE_PAIR *files_index_key(VALUE_PAIR *check)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	for (vp = fr_pair_cursor_init(&cursor, &check); vp; vp = fr_pair_cursor_next(&cursor)) {
+		/*
+		 *	Set, not compared.
+		 */
+		if ((vp->op == T_OP_SET) || (vp->op == T_OP_ADD)) continue;
+
+		/*
+		 *	paircompare() skips these, or treats them specially.
+		 */
+		if (!vp->da->vendor) switch (vp->da->attr) {
+		case PW_CRYPT_PASSWORD:
+		case PW_AUTH_TYPE:
+		case PW_AUTZ_TYPE:
+		case PW_ACCT_TYPE:
+		case PW_SESSION_TYPE:
+		case PW_STRIP_USER_NAME:
+			continue;
+
+		case PW_USER_PASSWORD:
+			return NULL;
+
+		default:
+			break;
+		}
+
+		if ((vp->op != T_OP_CMP_EQ) || (vp->type != VT_DATA) || vp->da->flags.has_tag) return NULL;
+
+		switch (vp->vp_type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_IPV4_ADDR:
+			return vp;
+
+		default:
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/** Add a DEFAULT entry to the group for its first check item, creating it if needed
+ *
+ */
+static int files_index_default(files_index_t *index, files_entry_t *entry, VALUE_PAIR const *key)
+{
+	files_default_t		find = { .vp = key }, *group;
+	files_index_attr_t	*attr;
+
+	group = fr_hash_table_finddata(index->default_groups, &find);
+	if (!group) {
+		for (attr = index->attrs; attr; attr = attr->next) if (attr->da == key->da) break;
+		if (!attr) {
+			attr = talloc_zero(index, files_index_attr_t);
+			if (!attr) return -1;
+
+			attr->da = key->da;
+			attr->next = index->attrs;
+			index->attrs = attr;
+		}
+
+		group = talloc_zero(index, files_default_t);
+		if (!group) return -1;
+
+		group->vp = key;
+		group->tail = &group->head;
+		if (!fr_hash_table_insert(index->default_groups, group)) {
+			talloc_free(group);
+			return -1;
+		}
+
+		group->next = attr->groups;
+		attr->groups = group;
+		attr->num_groups++;
+		index->num_groups++;
+	}
+
+	*group->tail = entry;
+	group->tail = &entry->next;
+
+	return 0;
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree, char const *compat_mode_str)
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, files_index_t **pindex, char const *compat_mode_str)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
-	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
+	PAIR_LIST *entry;
+	files_index_t *index;
+	files_entry_t **default_tail;
 
 	if (!filename) {
-		*ptree = NULL;
+		*pindex = NULL;
 		return 0;
 	}
 
@@ -235,67 +454,80 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
+	index = talloc_zero(ctx, files_index_t);
+	if (!index) {
+	error:
 		pairlist_free(&users);
+		talloc_free(index);
 		return -1;
 	}
 
-	default_list = NULL;
-	default_tail = &default_list;
+	index->users = fr_hash_table_create(index, files_entry_hash, files_entry_cmp, NULL);
+	index->default_groups = fr_hash_table_create(index, files_default_hash, files_default_cmp, NULL);
+	if (!index->users || !index->default_groups) goto error;
+
+	default_tail = &index->defaults;
 
 	/*
 	 *	We've read the entries in linearly, but putting them
 	 *	into an indexed data structure would be much faster.
 	 *	Let's go fix that now.
 	 */
-	for (entry = users; entry != NULL; entry = next) {
+	while (users) {
+		files_entry_t	*fe, *user_list;
+		VALUE_PAIR	*vp, *key;
+		vp_cursor_t	cursor;
+
 		/*
 		 *	Remove this entry from the input list.
 		 */
-		next = entry->next;
+		entry = users;
+		users = entry->next;
 		entry->next = NULL;
-		(void) talloc_steal(tree, entry);
+		(void) talloc_steal(index, entry);
+
+		fe = talloc_zero(index, files_entry_t);
+		if (!fe) goto error;
+		fe->pl = entry;
 
 		/*
-		 *	DEFAULT entries get their own list.
+		 *	paircompare() expands check items in place, and
+		 *	regular expressions may allocate under them, so
+		 *	those have to be compared on a copy.  The rest
+		 *	are compared as they are.
 		 */
-		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
-
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					rbtree_free(tree);
-					return -1;
-				}
+		for (vp = fr_pair_cursor_init(&cursor, &entry->check); vp; vp = fr_pair_cursor_next(&cursor)) {
+			if ((vp->type == VT_XLAT) || (vp->op == T_OP_REG_EQ) || (vp->op == T_OP_REG_NE)) {
+				fe->copy_check = true;
+				break;
+			}
+		}
 
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
+		/*
+		 *	DEFAULT entries are grouped by their first
+		 *	check item, if they have a suitable one.
+		 */
+		if (strcmp(entry->name, "DEFAULT") == 0) {
+			key = files_index_key(entry->check);
+			if (key) {
+				if (files_index_default(index, fe, key) < 0) goto error;
+				continue;
 			}
 
-			default_tail = &entry->next;
+			*default_tail = fe;
+			default_tail = &fe->next;
 			continue;
 		}
 
 		/*
 		 *	Not DEFAULT, must be a normal user.
 		 */
-		user_list = rbtree_finddata(tree, entry);
+		user_list = fr_hash_table_finddata(index->users, fe);
 		if (!user_list) {
 			/*
 			 *	Insert the first one.
 			 */
-			if (!rbtree_insert(tree, entry)) goto error;
+			if (!fr_hash_table_insert(index->users, fe)) goto error;
 		} else {
 			/*
 			 *	Find the tail of this list, and add it
@@ -303,11 +535,11 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 			 */
 			while (user_list->next) user_list = user_list->next;
 
-			user_list->next = entry;
+			user_list->next = fe;
 		}
 	}
 
-	*ptree = tree;
+	*pindex = index;
 
 	return 0;
 }
@@ -315,14 +547,18 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	(Re-)read the "users" files into memory.
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+static int files_load(TALLOC_CTX *ctx, void **out, void const *instance)
 {
-	rlm_files_t *inst = instance;
+	rlm_files_t const *inst = instance;
+	rlm_files_data_t *data;
+
+	data = talloc_zero(ctx, rlm_files_data_t);
+	if (!data) return -1;
 
 #undef READFILE
-#define READFILE(_x, _y) do { if (getusersfile(inst, inst->_x, &inst->_y, inst->compat_mode) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+#define READFILE(_x, _y) do { if (getusersfile(data, inst->_x, &data->_y, inst->compat_mode) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
 
 	READFILE(filename, common);
 	READFILE(usersfile, users);
@@ -336,22 +572,105 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	READFILE(auth_usersfile, auth_users);
 	READFILE(postauth_usersfile, postauth_users);
 
+	*out = data;
+
 	return 0;
 }
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_files_t *inst = instance;
+	char const *name;
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
+
+	inst->reload = module_reload_alloc(inst, name, inst, files_load, inst->reload_interval);
+	if (!inst->reload) return -1;
+
+	if ((module_reload_watch(inst->reload, inst->filename) < 0) ||
+	    (module_reload_watch(inst->reload, inst->usersfile) < 0) ||
+	    (module_reload_watch(inst->reload, inst->acct_usersfile) < 0) ||
+#ifdef WITH_PROXY
+	    (module_reload_watch(inst->reload, inst->preproxy_usersfile) < 0) ||
+	    (module_reload_watch(inst->reload, inst->postproxy_usersfile) < 0) ||
+#endif
+	    (module_reload_watch(inst->reload, inst->auth_usersfile) < 0) ||
+	    (module_reload_watch(inst->reload, inst->postauth_usersfile) < 0)) return -1;
+
+	return module_reload_start(inst->reload);
+}
+
+/** Find the DEFAULT groups the request can match, and add them to the candidates
+ *
+ * @param[in] index		of the users file.
+ * @param[in] request_vps	attributes check items are compared with.
+ * @param[out] candidates	to add the first entry of each group to.
+ * @param[in] num		number of candidates added so far.
+ * @param[in] max		maximum number of candidates.
+ * @return the number of candidates.
+ */
+static size_t files_default_candidates(files_index_t const *index, VALUE_PAIR *request_vps,
+				       files_entry_t const **candidates, size_t num, size_t max)
+{
+	files_index_attr_t const	*attr;
+	files_default_t const		*group;
+	vp_cursor_t			cursor;
+	VALUE_PAIR			*vp;
+	size_t				i;
+
+	for (attr = index->attrs; attr; attr = attr->next) {
+		/*
+		 *	Modules may register a comparison for the
+		 *	attribute after the file was loaded.  Then
+		 *	the value in the request doesn't matter, and
+		 *	all of the groups have to be checked.
+		 */
+		if (radius_find_compare(attr->da)) {
+			for (group = attr->groups; group && (num < max); group = group->next) {
+				candidates[num++] = group->head;
+			}
+			continue;
+		}
+
+		for (vp = fr_pair_cursor_init(&cursor, &request_vps);
+		     vp && (num < max);
+		     vp = fr_pair_cursor_next(&cursor)) {
+			files_default_t find = { .vp = vp };
+
+			if (vp->da != attr->da) continue;
+
+			group = fr_hash_table_finddata(index->default_groups, &find);
+			if (!group) continue;
+
+			/*
+			 *	The request may contain the same value twice.
+			 */
+			for (i = 0; i < num; i++) if (candidates[i] == group->head) break;
+			if (i == num) candidates[num++] = group->head;
+		}
+	}
+
+	return num;
+}
+
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename,
+			       files_index_t const *index,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
-	char const	*name, *match;
-	VALUE_PAIR	*check_tmp;
-	VALUE_PAIR	*reply_tmp;
-	PAIR_LIST const *user_pl, *default_pl;
-	bool		found = false;
-	PAIR_LIST	my_pl;
-	char		buffer[256];
+	char const		*name;
+	VALUE_PAIR		*check_tmp;
+	VALUE_PAIR		*reply_tmp;
+	files_entry_t const	*user_fe;
+	files_entry_t const	**candidates;
+	size_t			num_candidates, max_candidates;
+	bool			found = false;
+	PAIR_LIST		my_pl;
+	files_entry_t		my_fe;
+	char			buffer[256];
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -369,73 +688,99 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!index) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	my_fe.pl = &my_pl;
+	user_fe = fr_hash_table_finddata(index->users, &my_fe);
+
+	/*
+	 *	The user's entries, the DEFAULT entries which aren't
+	 *	indexed, and any groups of DEFAULT entries the request
+	 *	could match.  Each list is in file order.
+	 */
+	max_candidates = 2 + index->num_groups;
+	candidates = talloc_array(request, files_entry_t const *, max_candidates);
+	if (!candidates) return RLM_MODULE_FAIL;
+
+	num_candidates = 0;
+	if (user_fe) candidates[num_candidates++] = user_fe;
+	if (index->defaults) candidates[num_candidates++] = index->defaults;
+	num_candidates = files_default_candidates(index, request_packet->vps, candidates,
+						  num_candidates, max_candidates);
 
 	/*
 	 *	Find the entry for the user.
 	 */
-	while (user_pl || default_pl) {
+	while (num_candidates > 0) {
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 		PAIR_LIST const *pl;
+		files_entry_t const *fe;
+		size_t i, next = 0;
 
 		/*
-		 *	Figure out which entry to match on.
+		 *	Figure out which entry to match on.  It's
+		 *	the first one in the file, of all the lists.
 		 */
+		for (i = 1; i < num_candidates; i++) {
+			if (candidates[i]->pl->lineno < candidates[next]->pl->lineno) next = i;
+		}
+		fe = candidates[next];
+		pl = fe->pl;
 
-		if (!default_pl && user_pl) {
-			pl = user_pl;
-			match = name;
-			user_pl = user_pl->next;
-
-		} else if (!user_pl && default_pl) {
-			pl = default_pl;
-			match = "DEFAULT";
-			default_pl = default_pl->next;
-
-		} else if (user_pl->lineno < default_pl->lineno) {
-			pl = user_pl;
-			match = name;
-			user_pl = user_pl->next;
-
+		if (fe->next) {
+			candidates[next] = fe->next;
 		} else {
-			pl = default_pl;
-			match = "DEFAULT";
-			default_pl = default_pl->next;
+			candidates[next] = candidates[--num_candidates];
 		}
 
-		check_tmp = fr_pair_list_copy(request, pl->check);
-		for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
-		     vp;
-		     vp = fr_pair_cursor_next(&cursor)) {
-			if (xlat_eval_do(request, vp) < 0) {
-				RWARN("Failed parsing expanded value for check item, skipping entry: %s", fr_strerror());
+		/*
+		 *	Compare on a copy if the check items need
+		 *	expanding, otherwise only copy them if they
+		 *	match.
+		 */
+		if (fe->copy_check) {
+			bool expanded = true;
+
+			check_tmp = fr_pair_list_copy(request, pl->check);
+			for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
+			     vp;
+			     vp = fr_pair_cursor_next(&cursor)) {
+				if (xlat_eval_do(request, vp) < 0) {
+					RWARN("Failed parsing expanded value for check item, skipping entry: %s",
+					      fr_strerror());
+					expanded = false;
+					break;
+				}
+			}
+
+			if (!expanded ||
+			    (paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps) != 0)) {
 				fr_pair_list_free(&check_tmp);
 				continue;
 			}
+		} else {
+			if (paircompare(request, request_packet->vps, pl->check, &reply_packet->vps) != 0) continue;
+
+			check_tmp = fr_pair_list_copy(request, pl->check);
 		}
 
-		if (paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps) == 0) {
-			RDEBUG2("Found match \"%s\" one line %d of %s", match, pl->lineno, filename);
-			found = true;
+		RDEBUG2("Found match \"%s\" one line %d of %s", pl->name, pl->lineno, filename);
+		found = true;
 
-			/* ctx may be reply or proxy */
-			reply_tmp = fr_pair_list_copy(reply_packet, pl->reply);
-			radius_pairmove(request, &reply_packet->vps, reply_tmp, true);
-			fr_pair_list_move(request, &request->control, &check_tmp);
-			fr_pair_list_free(&check_tmp);
+		/* ctx may be reply or proxy */
+		reply_tmp = fr_pair_list_copy(reply_packet, pl->reply);
+		radius_pairmove(request, &reply_packet->vps, reply_tmp, true);
+		fr_pair_list_move(request, &request->control, &check_tmp);
+		fr_pair_list_free(&check_tmp);
 
-			/*
-			 *	Fallthrough?
-			 */
-			if (!fall_through(pl->reply)) break;
-		}
+		/*
+		 *	Fallthrough?
+		 */
+		if (!fall_through(pl->reply)) break;
 	}
+	talloc_free(candidates);
 
 	/*
 	 *	Remove server internal parameters.
@@ -462,9 +807,10 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = module_reload_current(inst->reload);
 
 	return file_common(inst, request, inst->filename,
-			   inst->users ? inst->users : inst->common,
+			   data->users ? data->users : data->common,
 			   request->packet, request->reply);
 }
 
@@ -477,9 +823,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = module_reload_current(inst->reload);
 
 	return file_common(inst, request, inst->acct_usersfile,
-			   inst->acct_users ? inst->acct_users : inst->common,
+			   data->acct_users ? data->acct_users : data->common,
 			   request->packet, request->reply);
 }
 
@@ -487,18 +834,20 @@ static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, UNUSED void *thr
 static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = module_reload_current(inst->reload);
 
 	return file_common(inst, request, inst->preproxy_usersfile,
-			   inst->preproxy_users ? inst->preproxy_users : inst->common,
+			   data->preproxy_users ? data->preproxy_users : data->common,
 			   request->packet, request->proxy->packet);
 }
 
 static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = module_reload_current(inst->reload);
 
 	return file_common(inst, request, inst->postproxy_usersfile,
-			   inst->postproxy_users ? inst->postproxy_users : inst->common,
+			   data->postproxy_users ? data->postproxy_users : data->common,
 			   request->proxy->reply, request->reply);
 }
 #endif
@@ -506,18 +855,20 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, UNUSED void *
 static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = module_reload_current(inst->reload);
 
 	return file_common(inst, request, inst->auth_usersfile,
-			   inst->auth_users ? inst->auth_users : inst->common,
+			   data->auth_users ? data->auth_users : data->common,
 			   request->packet, request->reply);
 }
 
 static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = module_reload_current(inst->reload);
 
 	return file_common(inst, request, inst->postauth_usersfile,
-			   inst->postauth_users ? inst->postauth_users : inst->common,
+			   data->postauth_users ? data->postauth_users : data->common,
 			   request->packet, request->reply);
 }
 
@@ -527,6 +878,7 @@ extern rad_module_t rlm_files;
 rad_module_t rlm_files = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "files",
+	.type		= RLM_TYPE_PARALLEL_INSTANTIATE,
 	.inst_size	= sizeof(rlm_files_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
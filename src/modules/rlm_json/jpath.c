@@ -950,3 +950,421 @@ do { \
 	return p - in;
 }
 
+
+/** A single step in a compiled jpath program
+ *
+ */
+typedef struct jpath_step {
+	jpath_type_t		type;		//!< JPATH_SELECTOR_FIELD or JPATH_SELECTOR_INDEX.
+	char const		*field;		//!< Unescaped field name.
+	size_t			field_len;	//!< Length of the field name.
+	int32_t			index;		//!< Array index.
+} jpath_step_t;
+
+/** A compiled jpath expression
+ *
+ * Expressions which are a plain sequence of field names and array indexes
+ * (the common case, i.e. "$.foo.bar[0]") are flattened into an array of
+ * steps, which can be evaluated directly against the JSON text, without
+ * building a json-c tree for the whole document.
+ *
+ * Anything else (wildcards, slices, recursive descent, unions) is only
+ * evaluated against the json-c tree.
+ */
+struct fr_jpath_prog {
+	fr_jpath_node_t const	*head;		//!< The parsed expression.
+	jpath_step_t		*steps;		//!< Flattened expression, or NULL if it can't be streamed.
+	int			num_steps;	//!< Number of steps.
+};
+
+/** Compile a parsed jpath expression
+ *
+ * @param[in] ctx	to allocate the program in.
+ * @param[in] head	of the parsed expression.  Is reparented to the program.
+ * @return
+ *	- A new program.
+ *	- NULL on error.
+ */
+fr_jpath_prog_t *fr_jpath_compile(TALLOC_CTX *ctx, fr_jpath_node_t *head)
+{
+	fr_jpath_prog_t		*prog;
+	fr_jpath_node_t const	*node;
+	int			num = 0, i = 0;
+
+	prog = talloc_zero(ctx, fr_jpath_prog_t);
+	if (!prog) return NULL;
+
+	prog->head = talloc_steal(prog, head);
+
+	/*
+	 *	Figure out if the expression is a simple path.
+	 *	"$" on its own selects the whole document, which
+	 *	has to be parsed anyway.
+	 */
+	for (node = head->next; node; node = node->next) {
+		jpath_selector_t const *selector = node->selector;
+
+		if (selector->next) return prog;	/* Union */
+
+		switch (selector->type) {
+		case JPATH_SELECTOR_FIELD:
+			break;
+
+		case JPATH_SELECTOR_INDEX:
+			if (selector->slice[0] < 0) return prog;
+			break;
+
+		default:
+			return prog;
+		}
+		num++;
+	}
+
+	if (num > 0) {
+		prog->steps = talloc_array(prog, jpath_step_t, num);
+		if (!prog->steps) {
+			talloc_free(prog);
+			return NULL;
+		}
+	}
+
+	for (node = head->next; node; node = node->next, i++) {
+		jpath_selector_t const	*selector = node->selector;
+		jpath_step_t		*step = &prog->steps[i];
+
+		step->type = selector->type;
+		if (selector->type == JPATH_SELECTOR_FIELD) {
+			step->field = selector->field;
+			step->field_len = talloc_array_length(selector->field) - 1;
+		} else {
+			step->index = selector->slice[0];
+		}
+	}
+	prog->num_steps = num;
+
+	return prog;
+}
+
+/** Return the parsed expression a program was compiled from
+ *
+ */
+fr_jpath_node_t const *fr_jpath_prog_head(fr_jpath_prog_t const *prog)
+{
+	return prog->head;
+}
+
+/*
+ *	Maximum nesting we'll skip over when streaming.  Deeper
+ *	documents are handed to json-c.
+ */
+#define JPATH_STREAM_MAX_DEPTH	64
+
+static inline char const *jpath_stream_ws(char const *p, char const *end)
+{
+	while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r'))) p++;
+
+	return p;
+}
+
+/** Skip over a JSON string
+ *
+ * @param[in] p		pointing at the opening quote.
+ * @param[in] end	of the document.
+ * @return
+ *	- Pointer to the char after the closing quote.
+ *	- NULL if the string is unterminated.
+ */
+static char const *jpath_stream_string(char const *p, char const *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '\\') {
+			p++;
+			continue;
+		}
+		if (*p == '"') return p + 1;
+		if ((uint8_t)*p < 0x20) return NULL;
+	}
+
+	return NULL;
+}
+
+/** Skip over a JSON value (without validating it completely)
+ *
+ * @param[in] p		pointing at the first char of the value.
+ * @param[in] end	of the document.
+ * @return
+ *	- Pointer to the char after the value.
+ *	- NULL if the value is malformed, or too deeply nested.
+ */
+static char const *jpath_stream_value(char const *p, char const *end)
+{
+	char	stack[JPATH_STREAM_MAX_DEPTH];
+	int	depth = 0;
+
+	if (p >= end) return NULL;
+
+	switch (*p) {
+	case '"':
+		return jpath_stream_string(p, end);
+
+	case '{':
+	case '[':
+		break;
+
+	default:
+	{
+		char const *q = p;
+
+		while ((q < end) && (*q != '\0') && !strchr(",]} \t\r\n:", *q)) q++;
+
+		return (q == p) ? NULL : q;
+	}
+	}
+
+	while (p < end) {
+		switch (*p) {
+		case '"':
+			p = jpath_stream_string(p, end);
+			if (!p) return NULL;
+			continue;
+
+		case '{':
+		case '[':
+			if (depth == JPATH_STREAM_MAX_DEPTH) return NULL;
+			stack[depth++] = (*p == '{') ? '}' : ']';
+			break;
+
+		case '}':
+		case ']':
+			if (stack[--depth] != *p) return NULL;
+			if (depth == 0) return p + 1;
+			break;
+
+		default:
+			break;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/** Compare a JSON encoded object key against an unescaped field name
+ *
+ * @return
+ *	- 1 if they match.
+ *	- 0 if they don't.
+ *	- -1 if the key contains escapes we don't decode (\\u).
+ */
+static int jpath_stream_key_cmp(char const *key, char const *key_end, jpath_step_t const *step)
+{
+	char const	*f = step->field, *f_end = f + step->field_len;
+	char		c;
+
+	while (key < key_end) {
+		c = *key++;
+
+		if (c == '\\') {
+			if (key == key_end) return 0;
+
+			switch (*key++) {
+			case '"':	c = '"'; break;
+			case '\\':	c = '\\'; break;
+			case '/':	c = '/'; break;
+			case 'b':	c = '\b'; break;
+			case 'f':	c = '\f'; break;
+			case 'n':	c = '\n'; break;
+			case 'r':	c = '\r'; break;
+			case 't':	c = '\t'; break;
+			default:	return -1;
+			}
+		}
+
+		if ((f == f_end) || (*f++ != c)) {
+			/*
+			 *	Still need to know if there's a \u
+			 *	later on, as it may decode to a match.
+			 */
+			while (key < key_end) {
+				if ((key[0] == '\\') && ((key + 1) < key_end)) {
+					if (key[1] == 'u') return -1;
+					key += 2;
+					continue;
+				}
+				key++;
+			}
+			return 0;
+		}
+	}
+
+	return (f == f_end) ? 1 : 0;
+}
+
+/** Evaluate a compiled jpath expression against the text of a JSON document
+ *
+ * Only the values on the path are examined, everything else is skipped
+ * without being decoded, and json-c is only used to parse the final value.
+ *
+ * As with json-c, if an object contains duplicate keys, the last one wins.
+ *
+ * If the expression is too complex, or the document can't be understood
+ * (it's malformed, or contains constructs we don't handle), -2 is returned
+ * and the caller should parse the document, and call #fr_jpath_evaluate_leaf.
+ *
+ * @param[in,out] ctx	to allocate value_box_t in.
+ * @param[out] out	Where to write value_box_t.
+ * @param[in] dst_type	FreeRADIUS type to convert to.
+ * @param[in] dst_enumv	Enumeration values to allow string to integer conversions.
+ * @param[in] json	document to evaluate the expression against.
+ * @param[in] len	of the document.
+ * @param[in] prog	to evaluate.
+ * @return
+ *	- 1 on match.
+ *	- 0 on no match.
+ *	- -1 on error.
+ *	- -2 if the expression must be evaluated against the json-c tree.
+ */
+int fr_jpath_evaluate_stream(TALLOC_CTX *ctx, value_box_t **out,
+			     PW_TYPE dst_type, fr_dict_attr_t const *dst_enumv,
+			     char const *json, size_t len, fr_jpath_prog_t const *prog)
+{
+	char const	*p = json, *end = json + len;
+	char const	*value = NULL, *value_end = NULL;
+	char		*buff;
+	json_object	*object;
+	value_box_t	*vb;
+	int		i;
+
+	*out = NULL;
+
+	if (!prog->steps) return -2;
+
+	p = jpath_stream_ws(p, end);
+
+	for (i = 0; i < prog->num_steps; i++) {
+		jpath_step_t const *step = &prog->steps[i];
+
+		if (p == end) return -2;
+
+		value = NULL;
+
+		switch (step->type) {
+		case JPATH_SELECTOR_FIELD:
+		{
+			char const	*key, *key_end, *v;
+			int		ret;
+
+			if (*p != '{') goto check_type;
+
+			p = jpath_stream_ws(p + 1, end);
+			if ((p < end) && (*p == '}')) return 0;
+
+			for (;;) {
+				if ((p == end) || (*p != '"')) return -2;
+
+				key = p + 1;
+				p = jpath_stream_string(p, end);
+				if (!p) return -2;
+				key_end = p - 1;
+
+				p = jpath_stream_ws(p, end);
+				if ((p == end) || (*p != ':')) return -2;
+
+				v = jpath_stream_ws(p + 1, end);
+				p = jpath_stream_value(v, end);
+				if (!p) return -2;
+
+				ret = jpath_stream_key_cmp(key, key_end, step);
+				if (ret < 0) return -2;
+				if (ret == 1) {
+					value = v;
+					value_end = p;
+				}
+
+				p = jpath_stream_ws(p, end);
+				if (p == end) return -2;
+				if (*p == '}') break;
+				if (*p != ',') return -2;
+				p = jpath_stream_ws(p + 1, end);
+			}
+		}
+			break;
+
+		case JPATH_SELECTOR_INDEX:
+		{
+			int32_t	idx = 0;
+			char const *v;
+
+			if (*p != '[') goto check_type;
+
+			p = jpath_stream_ws(p + 1, end);
+			if ((p < end) && (*p == ']')) return 0;
+
+			for (;;) {
+				v = p;
+				p = jpath_stream_value(v, end);
+				if (!p) return -2;
+
+				if (idx++ == step->index) {
+					value = v;
+					value_end = p;
+					break;
+				}
+
+				p = jpath_stream_ws(p, end);
+				if (p == end) return -2;
+				if (*p == ']') break;
+				if (*p != ',') return -2;
+				p = jpath_stream_ws(p + 1, end);
+			}
+		}
+			break;
+
+		default:
+			rad_assert(0);
+			return -1;
+		}
+
+		if (!value) return 0;
+
+		p = value;
+		end = value_end;
+		continue;
+
+	check_type:
+		/*
+		 *	Field of a non-object, or index of a non-array.
+		 *	That's not a match, as long as the value is valid.
+		 */
+		if (!jpath_stream_value(p, end)) return -2;
+		return 0;
+	}
+
+	/*
+	 *	Let json-c decode the value we found, it needs
+	 *	a terminated string to parse numbers correctly.
+	 */
+	buff = talloc_bstrndup(NULL, value, value_end - value);
+	if (!buff) return -1;
+
+	object = json_tokener_parse(buff);
+	talloc_free(buff);
+	if (!object) return -2;
+
+	vb = talloc_zero(ctx, value_box_t);
+	if (!vb) {
+	error:
+		json_object_put(object);
+		return -1;
+	}
+
+	if (fr_json_object_to_value_box(vb, vb, object, dst_type, dst_enumv) < 0) {
+		talloc_free(vb);
+		goto error;
+	}
+	json_object_put(object);
+
+	*out = vb;
+
+	return 1;
+}
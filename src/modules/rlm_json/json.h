@@ -45,6 +45,7 @@ RCSIDH(json_h, "$Id$")
 
 /* jpath .c */
 typedef struct fr_jpath_node fr_jpath_node_t;
+typedef struct fr_jpath_prog fr_jpath_prog_t;
 
 size_t		fr_jpath_escape_func(UNUSED REQUEST *request, char *out, size_t outlen,
 				     char const *in, UNUSED void *arg);
@@ -57,6 +58,14 @@ char		*fr_jpath_asprint(TALLOC_CTX *ctx, fr_jpath_node_t const *head);
 
 ssize_t		fr_jpath_parse(TALLOC_CTX *ctx, fr_jpath_node_t **head, char const *in, size_t inlen);
 
+fr_jpath_prog_t	*fr_jpath_compile(TALLOC_CTX *ctx, fr_jpath_node_t *head);
+
+fr_jpath_node_t	const *fr_jpath_prog_head(fr_jpath_prog_t const *prog);
+
+int		fr_jpath_evaluate_stream(TALLOC_CTX *ctx, value_box_t **out,
+					 PW_TYPE dst_type, fr_dict_attr_t const *dst_enumv,
+					 char const *json, size_t len, fr_jpath_prog_t const *prog);
+
 /* json.c */
 int		fr_json_object_to_value_box(TALLOC_CTX *ctx, value_box_t *out, json_object *object,
 					    PW_TYPE dst_type, fr_dict_attr_t const *dst_enumv);
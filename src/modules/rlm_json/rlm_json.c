@@ -35,6 +35,22 @@ RCSID("$Id$")
 #include <ctype.h>
 #include "json.h"
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  define JPATH_CACHE_LOCK(_inst)	pthread_mutex_lock(&(_inst)->mutex)
+#  define JPATH_CACHE_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->mutex)
+#else
+#  define JPATH_CACHE_LOCK(_inst)
+#  define JPATH_CACHE_UNLOCK(_inst)
+#endif
+
+/*
+ *	Maximum number of dynamically expanded jpath expressions
+ *	we keep compiled.  Once the cache is full, new expressions
+ *	are compiled for each use.
+ */
+#define JPATH_CACHE_MAX		1024
+
 #ifndef HAVE_JSON
 #  error "rlm_json should not be built unless json-c is available"
 #endif
@@ -43,15 +59,126 @@ RCSID("$Id$")
  */
 typedef struct rlm_json_jpath_cache rlm_json_jpath_cache_t;
 struct rlm_json_jpath_cache {
-	fr_jpath_node_t		*jpath;		//!< First node in jpath expression.
+	fr_jpath_prog_t		*prog;		//!< Compiled jpath expression.
 	rlm_json_jpath_cache_t	*next;		//!< Next jpath cache entry.
 };
 
+/** A compiled jpath expression, keyed by the expression string
+ */
+typedef struct rlm_json_jpath_entry {
+	char const		*jpath_str;	//!< The expression.
+	ssize_t			slen;		//!< How much of the expression was parsed.
+	fr_jpath_prog_t		*prog;		//!< Compiled expression.
+} rlm_json_jpath_entry_t;
+
+typedef struct rlm_json {
+	fr_hash_table_t		*jpaths;	//!< Compiled jpath expressions, shared by the map
+						//!< and xlat functions.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects the cache of jpath expressions.
+#endif
+} rlm_json_t;
+
 typedef struct rlm_json_jpath_to_eval {
-	fr_jpath_node_t const	*jpath;
-	json_object		*root;
+	fr_jpath_prog_t const	*prog;		//!< Expression to evaluate.
+	char const		*json_str;	//!< The JSON document.
+	size_t			json_len;	//!< Length of the JSON document.
+	json_object		*root;		//!< The parsed document, or NULL if it hasn't
+						//!< needed parsing yet.
 } rlm_json_jpath_to_eval_t;
 
+static uint32_t jpath_entry_hash(void const *data)
+{
+	rlm_json_jpath_entry_t const *entry = data;
+
+	return fr_hash_string(entry->jpath_str);
+}
+
+static int jpath_entry_cmp(void const *one, void const *two)
+{
+	rlm_json_jpath_entry_t const *a = one, *b = two;
+
+	return strcmp(a->jpath_str, b->jpath_str);
+}
+
+/** Find a compiled jpath expression, or compile and cache a new one
+ *
+ * Only expressions which parse successfully are cached, so that the
+ * caller gets a useful error for the others.
+ *
+ * @param[in] ctx	to allocate the program in, if it isn't cached.
+ * @param[out] out	The compiled program.
+ * @param[out] cached	Set to false if the caller must free the program.
+ * @param[in] inst	of rlm_json.
+ * @param[in] jpath_str	\0 terminated expression to compile.
+ * @return as #fr_jpath_parse.
+ */
+static ssize_t jpath_compile(TALLOC_CTX *ctx, fr_jpath_prog_t const **out, bool *cached,
+			     rlm_json_t *inst, char const *jpath_str)
+{
+	rlm_json_jpath_entry_t	find, *entry;
+	fr_jpath_node_t		*head;
+	fr_jpath_prog_t		*prog;
+	ssize_t			slen;
+
+	*out = NULL;
+	*cached = false;
+
+	find.jpath_str = jpath_str;
+
+	JPATH_CACHE_LOCK(inst);
+	entry = fr_hash_table_finddata(inst->jpaths, &find);
+	if (entry) {
+		*out = entry->prog;
+		*cached = true;
+		JPATH_CACHE_UNLOCK(inst);
+		return entry->slen;
+	}
+	JPATH_CACHE_UNLOCK(inst);
+
+	slen = fr_jpath_parse(ctx, &head, jpath_str, strlen(jpath_str));
+	if (slen <= 0) return slen;
+
+	prog = fr_jpath_compile(ctx, head);
+	if (!prog) {
+		talloc_free(head);
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
+	*out = prog;
+
+	JPATH_CACHE_LOCK(inst);
+	if (fr_hash_table_num_elements(inst->jpaths) >= JPATH_CACHE_MAX) {
+	done:
+		JPATH_CACHE_UNLOCK(inst);
+		return slen;
+	}
+
+	/*
+	 *	Another thread may have compiled the same
+	 *	expression while we weren't holding the lock.
+	 */
+	entry = fr_hash_table_finddata(inst->jpaths, &find);
+	if (entry) goto done;
+
+	entry = talloc_zero(inst->jpaths, rlm_json_jpath_entry_t);
+	if (!entry) goto done;
+
+	entry->jpath_str = talloc_typed_strdup(entry, jpath_str);
+	entry->slen = slen;
+	entry->prog = talloc_steal(entry, prog);
+
+	if (!fr_hash_table_insert(inst->jpaths, entry)) {
+		talloc_steal(ctx, prog);
+		talloc_free(entry);
+		goto done;
+	}
+	*cached = true;
+	JPATH_CACHE_UNLOCK(inst);
+
+	return slen;
+}
+
 static ssize_t jsonquote_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 			      UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
 			      REQUEST *request, char const *fmt)
@@ -83,23 +210,26 @@ static ssize_t jsonquote_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
  * @return number of bytes written to out.
  */
 static ssize_t jpath_validate_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
-			    	   UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			    	   void const *mod_inst, UNUSED void const *xlat_inst,
 				   REQUEST *request, char const *fmt)
 {
-	fr_jpath_node_t *head;
-	ssize_t slen, ret;
-	char *jpath_str;
+	rlm_json_t		*inst;
+	fr_jpath_prog_t const	*prog;
+	bool			cached;
+	ssize_t			slen, ret;
+	char			*jpath_str;
+
+	memcpy(&inst, &mod_inst, sizeof(inst));
 
-	slen = fr_jpath_parse(request, &head, fmt, strlen(fmt));
+	slen = jpath_compile(request, &prog, &cached, inst, fmt);
 	if (slen <= 0) {
-		rad_assert(head == NULL);
+		rad_assert(prog == NULL);
 		return snprintf(*out, outlen, "%zu:%s", -(slen), fr_strerror());
 	}
-	rad_assert(talloc_get_type_abort(head, fr_jpath_node_t));
 
-	jpath_str = fr_jpath_asprint(request, head);
+	jpath_str = fr_jpath_asprint(request, fr_jpath_prog_head(prog));
 	ret = snprintf(*out, outlen, "%zu:%s", (size_t) slen, jpath_str);
-	talloc_free(head);
+	if (!cached) talloc_const_free(prog);
 	talloc_free(jpath_str);
 
 	return ret;
@@ -122,6 +252,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 	rlm_json_jpath_cache_t	*cache_inst = proc_inst;
 	vp_map_t const		*map;
 	ssize_t			slen;
+	fr_jpath_node_t		*head;
 	rlm_json_jpath_cache_t	*cache = cache_inst, **tail = &cache->next;
 
 	if (!src) {
@@ -145,7 +276,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 		switch (map->rhs->type) {
 		case TMPL_TYPE_UNPARSED:
 			p = map->rhs->name;
-			slen = fr_jpath_parse(cache, &cache->jpath, p, map->rhs->len);
+			slen = fr_jpath_parse(cache, &head, p, map->rhs->len);
 			if (slen <= 0) {
 				char		*spaces, *text;
 
@@ -168,7 +299,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 				return -1;
 			}
 			p = map->rhs->tmpl_value_box_datum.strvalue;
-			slen = fr_jpath_parse(cache, &cache->jpath, p, map->rhs->tmpl_value_box_length);
+			slen = fr_jpath_parse(cache, &head, p, map->rhs->tmpl_value_box_length);
 			if (slen <= 0) goto error;
 			break;
 
@@ -176,6 +307,13 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 			continue;
 		}
 
+		cache->prog = fr_jpath_compile(cache, head);
+		if (!cache->prog) {
+			talloc_free(head);
+			cf_log_err_cp(cp, "Failed compiling jpath expression");
+			return -1;
+		}
+
 		/*
 		 *	Slightly weird... This is here because our first
 		 *	list member was pre-allocated and passed to the
@@ -190,6 +328,29 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 	return 0;
 }
 
+/** Parse the JSON document, if it hasn't been parsed already
+ *
+ */
+static int json_doc_parse(REQUEST *request, rlm_json_jpath_to_eval_t *to_eval)
+{
+	struct json_tokener *tok;
+
+	if (to_eval->root) return 0;
+
+	tok = json_tokener_new();
+	if (!tok) return -1;
+
+	to_eval->root = json_tokener_parse_ex(tok, to_eval->json_str, (int)to_eval->json_len);
+	if (!to_eval->root) {
+		REMARKER(to_eval->json_str, tok->char_offset, json_tokener_error_desc(json_tokener_get_error(tok)));
+		json_tokener_free(tok);
+		return -1;
+	}
+	json_tokener_free(tok);
+
+	return 0;
+}
+
 /** Converts a string value into a #VALUE_PAIR
  *
  * @param[in,out] ctx to allocate #VALUE_PAIR (s).
@@ -212,8 +373,21 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *
 
 	*out = NULL;
 
+	/*
+	 *	Try and pull the value straight out of the JSON text,
+	 *	and only parse the whole document if we have to.
+	 */
+	if (!to_eval->root) {
+		ret = fr_jpath_evaluate_stream(request, &head, map->lhs->tmpl_da->type, map->lhs->tmpl_da,
+					       to_eval->json_str, to_eval->json_len, to_eval->prog);
+		if (ret != -2) goto done;
+
+		if (json_doc_parse(request, to_eval) < 0) return -1;
+	}
+
 	ret = fr_jpath_evaluate_leaf(request, &head, map->lhs->tmpl_da->type, map->lhs->tmpl_da,
-			     	     to_eval->root, to_eval->jpath);
+			     	     to_eval->root, fr_jpath_prog_head(to_eval->prog));
+done:
 	if (ret < 0) {
 		REDEBUG("Failed evaluating jpath: %s", fr_strerror());
 		return -1;
@@ -253,11 +427,11 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *
  *	- #RLM_MODULE_UPDATED if one or more #VALUE_PAIR were added to the #REQUEST.
  *	- #RLM_MODULE_FAIL if a fault occurred.
  */
-static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST *request,
+static rlm_rcode_t mod_map_proc(void *mod_inst, void *proc_inst, REQUEST *request,
 			      	vp_tmpl_t const *json, vp_map_t const *maps)
 {
+	rlm_json_t			*inst = mod_inst;
 	rlm_rcode_t			rcode = RLM_MODULE_UPDATED;
-	struct json_tokener		*tok;
 
 	rlm_json_jpath_cache_t		*cache = proc_inst;
 	vp_map_t const			*map;
@@ -270,16 +444,18 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 
 	if ((talloc_array_length(json_str) - 1) == 0) {
 		REDEBUG("Zero length string is not valid JSON data");
+		talloc_free(json_str);
 		return RLM_MODULE_FAIL;
 	}
 
-	tok = json_tokener_new();
-	to_eval.root = json_tokener_parse_ex(tok, json_str, (int)(talloc_array_length(json_str) - 1));
-	if (!to_eval.root) {
-		REMARKER(json_str, tok->char_offset, json_tokener_error_desc(json_tokener_get_error(tok)));
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
+	/*
+	 *	The document is only parsed if one of the
+	 *	expressions can't be evaluated against the
+	 *	JSON text directly.
+	 */
+	memset(&to_eval, 0, sizeof(to_eval));
+	to_eval.json_str = json_str;
+	to_eval.json_len = talloc_array_length(json_str) - 1;
 
 	for (map = maps; map; map = map->next) {
 		switch (map->rhs->type) {
@@ -288,7 +464,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 		 */
 		case TMPL_TYPE_UNPARSED:
 		case TMPL_TYPE_DATA:
-			to_eval.jpath = cache->jpath;
+			to_eval.prog = cache->prog;
 
 			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
 				rcode = RLM_MODULE_FAIL;
@@ -302,31 +478,33 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 		 */
 		default:
 		{
-			ssize_t		slen;
-			fr_jpath_node_t	*node;
-			char		*to_parse;
+			ssize_t			slen;
+			fr_jpath_prog_t const	*prog;
+			bool			cached;
+			char			*to_parse;
+			int			ret;
 
 			if (tmpl_aexpand(request, &to_parse, request, map->rhs, fr_jpath_escape_func, NULL) < 0) {
 				RERROR("Failed getting jpath data: %s", fr_strerror());
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
-			slen = fr_jpath_parse(request, &node, to_parse, talloc_array_length(to_parse) - 1);
+			slen = jpath_compile(request, &prog, &cached, inst, to_parse);
 			if (slen <= 0) {
 				REMARKER(to_parse, -(slen), fr_strerror());
 				talloc_free(to_parse);
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
-			to_eval.jpath = node;
+			to_eval.prog = prog;
 
-			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
-				talloc_free(node);
-				talloc_free(to_parse);
+			ret = map_to_request(request, map, _json_map_proc_get_value, &to_eval);
+			if (!cached) talloc_const_free(prog);
+			talloc_free(to_parse);
+			if (ret < 0) {
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
-			talloc_free(node);
 		}
 			break;
 		}
@@ -335,14 +513,28 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 
 finish:
 	talloc_free(json_str);
-	json_object_put(to_eval.root);
-	json_tokener_free(tok);
+	if (to_eval.root) json_object_put(to_eval.root);
 
 	return rcode;
 }
 
-static int mod_bootstrap(UNUSED CONF_SECTION *conf, void *instance)
+static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 {
+	rlm_json_t *inst = instance;
+
+	inst->jpaths = fr_hash_table_create(inst, jpath_entry_hash, jpath_entry_cmp, NULL);
+	if (!inst->jpaths) {
+		cf_log_err_cs(conf, "Failed creating jpath cache");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->mutex, NULL) != 0) {
+		cf_log_err_cs(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
 	xlat_register(instance, "jsonquote", jsonquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(instance, "jpathvalidate", jpath_validate_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
@@ -351,6 +543,17 @@ static int mod_bootstrap(UNUSED CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+static int mod_detach(UNUSED void *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	rlm_json_t *inst = instance;
+
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_json_version_print();
@@ -372,6 +575,8 @@ rad_module_t rlm_json = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "json",
 	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_json_t),
 	.load		= mod_load,
 	.bootstrap	= mod_bootstrap,
+	.detach		= mod_detach,
 };
@@ -31,6 +31,7 @@ USES_APPLE_DEPRECATED_API
 #ifdef KRB5_IS_THREAD_SAFE
 #  include <freeradius-devel/connection.h>
 #endif
+#include <freeradius-devel/job_pool.h>
 
 typedef struct rlm_krb5_handle {
 	krb5_context	context;
@@ -42,6 +43,8 @@ typedef struct rlm_krb5_handle {
 #endif
 } rlm_krb5_handle_t;
 
+typedef struct kdc_cache kdc_cache_t;
+
 /** Instance configuration for rlm_krb5
  *
  * Holds the configuration and preparsed data for a instance of rlm_krb5.
@@ -64,6 +67,13 @@ typedef struct rlm_krb5_t {
 
 	krb5_context		context;	//!< The kerberos context (cloned once per request).
 
+	uint32_t		kdc_threads;	//!< Number of threads to run KDC exchanges in.
+	uint32_t		cache_size;	//!< Maximum number of verified credentials to remember.
+	uint32_t		cache_lifetime;	//!< How long verified credentials are remembered for.
+
+	fr_job_pool_t		*async;		//!< Threads running KDC exchanges for all workers.
+	kdc_cache_t		*cache;		//!< Recently verified credentials.
+
 #ifndef HEIMDAL_KRB5
 	krb5_get_init_creds_opt		*gic_options;	//!< Options to pass to the get_initial_credentials
 							//!< function.
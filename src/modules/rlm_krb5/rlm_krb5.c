@@ -32,14 +32,387 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/sha1.h>
+#include <freeradius-devel/job_pool.h>
+
+#include <pthread.h>
+
 #include "krb5.h"
 
+typedef struct kdc_job kdc_job_t;
+
+typedef struct rlm_krb5_thread_t {
+	fr_job_return_t		*kdc_return;	//!< Where this worker receives completed KDC exchanges.
+} rlm_krb5_thread_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("keytab", PW_TYPE_STRING, rlm_krb5_t, keytabname) },
 	{ FR_CONF_OFFSET("service_principal", PW_TYPE_STRING, rlm_krb5_t, service_princ) },
+	{ FR_CONF_OFFSET("kdc_threads", PW_TYPE_INTEGER, rlm_krb5_t, kdc_threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_size", PW_TYPE_INTEGER, rlm_krb5_t, cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_lifetime", PW_TYPE_INTEGER, rlm_krb5_t, cache_lifetime), .dflt = "30" },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Credentials which were recently verified
+ *
+ * Entries are indexed by a digest of the principal name and the
+ * password, so the password isn't kept in memory.
+ */
+typedef struct kdc_cache_entry_t {
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< Digest of the principal and password.
+	time_t			expires;	//!< When the credentials must be verified again.
+	int32_t			heap_id;	//!< Position in the expiry heap.
+} kdc_cache_entry_t;
+
+/** Recently verified credentials, shared by all workers
+ *
+ */
+struct kdc_cache {
+	rbtree_t		*tree;		//!< Entries indexed by key.
+	fr_heap_t		*heap;		//!< Entries ordered by expiry.
+	pthread_mutex_t		mutex;		//!< Protects the tree and heap.
+
+	uint8_t			secret[16];	//!< Mixed into keys, so they can't be precomputed.
+	uint32_t		max_entries;	//!< Maximum number of entries.
+	uint32_t		lifetime;	//!< How long entries are valid for.
+};
+
+static int kdc_cache_entry_cmp(void const *one, void const *two)
+{
+	kdc_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static int kdc_cache_heap_cmp(void const *one, void const *two)
+{
+	kdc_cache_entry_t const *a = one, *b = two;
+
+	return (a->expires > b->expires) - (a->expires < b->expires);
+}
+
+static int _kdc_cache_free(kdc_cache_t *cache)
+{
+	fr_heap_delete(cache->heap);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for verified credentials
+ *
+ * @param[in] ctx		to allocate the cache in.  Must not be read only.
+ * @param[in] max_entries	Maximum number of entries.
+ * @param[in] lifetime		How long entries are valid for.
+ * @return
+ *	- New cache.
+ *	- NULL on error.
+ */
+static kdc_cache_t *kdc_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t lifetime)
+{
+	kdc_cache_t	*cache;
+	size_t		i;
+
+	cache = talloc_zero(ctx, kdc_cache_t);
+	if (!cache) return NULL;
+
+	cache->tree = rbtree_create(cache, kdc_cache_entry_cmp, rbtree_node_talloc_free, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+	error:
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+		fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	cache->heap = fr_heap_create(kdc_cache_heap_cmp, offsetof(kdc_cache_entry_t, heap_id));
+	if (!cache->heap) {
+		pthread_mutex_destroy(&cache->mutex);
+		fr_strerror_printf("Failed creating expiry heap");
+		goto error;
+	}
+	talloc_set_destructor(cache, _kdc_cache_free);
+
+	for (i = 0; i < sizeof(cache->secret); i++) cache->secret[i] = fr_rand();
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+
+	return cache;
+}
+
+/** Calculate the key for a principal name and password
+ *
+ */
+static void kdc_cache_key(kdc_cache_t const *cache, uint8_t key[SHA1_DIGEST_LENGTH],
+			  char const *username, char const *password)
+{
+	fr_sha1_ctx	sha1_context;
+
+	fr_sha1_init(&sha1_context);
+	fr_sha1_update(&sha1_context, cache->secret, sizeof(cache->secret));
+	fr_sha1_update(&sha1_context, (uint8_t const *) username, strlen(username) + 1);
+	fr_sha1_update(&sha1_context, (uint8_t const *) password, strlen(password));
+	fr_sha1_final(key, &sha1_context);
+}
+
+/** Check whether credentials were recently verified
+ *
+ * @param[in] cache	to check.
+ * @param[in] key	from #kdc_cache_key.
+ * @return
+ *	- true if the credentials were verified, and the entry hasn't expired.
+ *	- false otherwise.
+ */
+static bool kdc_cache_find(kdc_cache_t *cache, uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	kdc_cache_entry_t	find, *entry;
+	time_t			now = time(NULL);
+	bool			found;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&cache->mutex);
+	while ((entry = fr_heap_peek(cache->heap)) && (entry->expires <= now)) {
+		fr_heap_extract(cache->heap, entry);
+		rbtree_deletebydata(cache->tree, entry);	/* Frees entry */
+	}
+	found = (rbtree_finddata(cache->tree, &find) != NULL);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Remember that credentials were verified
+ *
+ * @param[in] cache	to insert into.
+ * @param[in] key	from #kdc_cache_key.
+ */
+static void kdc_cache_insert(kdc_cache_t *cache, uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	kdc_cache_entry_t	*entry, *old;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = talloc_zero(cache, kdc_cache_entry_t);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->expires = time(NULL) + cache->lifetime;
+	entry->heap_id = -1;
+
+	old = rbtree_finddata(cache->tree, entry);
+	if (old) {
+		fr_heap_extract(cache->heap, old);
+		rbtree_deletebydata(cache->tree, old);
+	}
+
+	while (rbtree_num_elements(cache->tree) >= cache->max_entries) {
+		old = fr_heap_peek(cache->heap);
+		fr_heap_extract(cache->heap, old);
+		rbtree_deletebydata(cache->tree, old);
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+	} else {
+		fr_heap_insert(cache->heap, entry);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+#ifdef HEIMDAL_KRB5
+/** Verify a password with the KDC (Heimdal)
+ *
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] conn	to use.
+ * @param[in] client	principal to verify.
+ * @param[in] password	supplied by the user.
+ * @param[in] request	for debug messages.  NULL if called from a KDC thread.
+ * @return
+ *	- 0 if the password is correct.
+ *	- A kerberos error code.
+ */
+static krb5_error_code krb5_verify_password(UNUSED rlm_krb5_t const *inst, rlm_krb5_handle_t *conn,
+					    krb5_principal client, char const *password, REQUEST *request)
+{
+	krb5_error_code ret;
+
+	/*
+	 *	Verify the user, using the options we set in instantiate
+	 */
+	if (request) RDEBUG("Verifying credentials");
+	ret = krb5_verify_user_opt(conn->context, client, password, &conn->options);
+	if (ret) return ret;
+
+	/*
+	 *	krb5_verify_user_opt adds the credentials to the ccache
+	 *	we specified with krb5_verify_opt_set_ccache.
+	 *
+	 *	To make sure we don't accumulate thousands of sets of
+	 *	credentials, remove them again here.
+	 *
+	 * @todo This should definitely be optional, which means writing code for the MIT
+	 *	 variant as well.
+	 */
+	{
+		krb5_cc_cursor cursor;
+		krb5_creds cred;
+
+		krb5_cc_start_seq_get(conn->context, conn->ccache, &cursor);
+		for (ret = krb5_cc_next_cred(conn->context, conn->ccache, &cursor, &cred);
+		     ret == 0;
+		     ret = krb5_cc_next_cred(conn->context, conn->ccache, &cursor, &cred)) {
+		     krb5_cc_remove_cred(conn->context, conn->ccache, 0, &cred);
+		}
+		krb5_cc_end_seq_get(conn->context, conn->ccache, &cursor);
+	}
+
+	return 0;
+}
+#else
+/** Verify a password with the KDC (MIT)
+ *
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] conn	to use.
+ * @param[in] client	principal to verify.
+ * @param[in] password	supplied by the user.
+ * @param[in] request	for debug messages.  NULL if called from a KDC thread.
+ * @return
+ *	- 0 if the password is correct.
+ *	- A kerberos error code.
+ */
+static krb5_error_code krb5_verify_password(rlm_krb5_t const *inst, rlm_krb5_handle_t *conn,
+					    krb5_principal client, char const *password, REQUEST *request)
+{
+	krb5_error_code ret;
+	krb5_creds	init_creds;
+	char		*pass;		/* compiler warnings */
+
+	memset(&init_creds, 0, sizeof(init_creds));
+
+	/*
+	 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it.
+	 */
+	memcpy(&pass, &password, sizeof(pass));
+	if (request) RDEBUG("Retrieving and decrypting TGT");
+	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, pass,
+					   NULL, NULL, 0, NULL, inst->gic_options);
+	if (ret) goto done;
+
+	if (request) RDEBUG("Attempting to authenticate against service principal");
+	ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server, conn->keytab, NULL, inst->vic_options);
+
+done:
+	krb5_free_cred_contents(conn->context, &init_creds);
+
+	return ret;
+}
+#endif
+
+#ifdef KRB5_IS_THREAD_SAFE
+/** A KDC exchange to be run by a KDC thread
+ *
+ * The username and password are copied into the job, so that it can
+ * be run without touching the request.
+ */
+struct kdc_job {
+	char			*username;	//!< To parse as the client principal.
+	char			*password;	//!< Supplied by the user.
+
+	bool			parse_failed;	//!< The username couldn't be parsed as a principal.
+	krb5_error_code		ret;		//!< Result of the exchange.
+	char			error[256];	//!< Error message for ret.
+};
+
+/** Parse the username, and verify the password
+ *
+ */
+static void kdc_job_run(rlm_krb5_t const *inst, rlm_krb5_handle_t *conn, kdc_job_t *job)
+{
+	krb5_principal client;
+
+	job->ret = krb5_parse_name(conn->context, job->username, &client);
+	if (job->ret) {
+		job->parse_failed = true;
+		goto error;
+	}
+
+	job->ret = krb5_verify_password(inst, conn, client, job->password, NULL);
+	krb5_free_principal(conn->context, client);
+	if (!job->ret) return;
+
+error:
+	strlcpy(job->error, rlm_krb5_error(inst, conn->context, job->ret), sizeof(job->error));
+}
+
+/** Give a KDC thread its own kerberos context and keytab
+ *
+ */
+static void *kdc_thread_alloc(TALLOC_CTX *ctx, void *uctx)
+{
+	return mod_conn_create(ctx, uctx, NULL);
+}
+
+/** Run a queued KDC exchange in a KDC thread
+ *
+ */
+static void kdc_thread_run(void *thread, void *data, void *uctx)
+{
+	kdc_job_run(uctx, thread, data);
+}
+
+/** Fail a KDC exchange which won't be run
+ *
+ */
+static void kdc_thread_fail(void *data, UNUSED void *uctx)
+{
+	kdc_job_t *job = data;
+
+	job->ret = KRB5_KDC_UNREACH;
+	strlcpy(job->error, "Module is shutting down", sizeof(job->error));
+}
+
+/** Queue a KDC exchange to be run by a KDC thread
+ *
+ * The request is marked resumable when the job completes.
+ *
+ * @param[in] pool		of KDC threads.
+ * @param[in] r			of the worker processing the request.
+ * @param[in] request		being authenticated.
+ * @return
+ *	- The queued job.
+ *	- NULL on error.
+ */
+static fr_job_t *kdc_job_send(fr_job_pool_t *pool, fr_job_return_t *r, REQUEST *request)
+{
+	fr_job_t	*job;
+	kdc_job_t	*kdc;
+
+	job = fr_job_alloc(r, request);
+	if (!job) return NULL;
+
+	kdc = talloc_zero(job, kdc_job_t);
+	if (!kdc) goto error;
+
+	kdc->username = talloc_strdup(kdc, request->username->vp_strvalue);
+	kdc->password = talloc_strdup(kdc, request->password->vp_strvalue);
+	if (!kdc->username || !kdc->password) goto error;
+
+	fr_job_send(pool, job, kdc);
+
+	return job;
+
+error:
+	fr_job_cancel(job);
+	return NULL;
+}
+#endif	/* KRB5_IS_THREAD_SAFE */
+
 static int mod_detach(void *instance)
 {
 	rlm_krb5_t *inst = instance;
@@ -56,8 +429,10 @@ static int mod_detach(void *instance)
 
 	if (inst->context) krb5_free_context(inst->context);
 #ifdef KRB5_IS_THREAD_SAFE
+	fr_job_pool_free(inst->async);
 	fr_connection_pool_free(inst->pool);
 #endif
+	talloc_free(inst->cache);
 
 	return 0;
 }
@@ -213,24 +588,96 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->conn = mod_conn_create(inst, inst, NULL);
 	if (!inst->conn) return -1;
 #endif
+
+	/*
+	 *	Instance data is read only after instantiation,
+	 *	so the cache and KDC threads can't be parented by it.
+	 */
+	if (inst->cache_size) {
+		if (!inst->cache_lifetime) {
+			cf_log_err_cs(conf, "cache_lifetime must be greater than 0");
+			return -1;
+		}
+
+		inst->cache = kdc_cache_alloc(NULL, inst->cache_size, inst->cache_lifetime);
+		if (!inst->cache) {
+			cf_log_err_cs(conf, "Failed creating credential cache: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	if (inst->kdc_threads) {
+#ifdef KRB5_IS_THREAD_SAFE
+		if (inst->kdc_threads > 256) {
+			cf_log_err_cs(conf, "kdc_threads '%u' is too large (maximum: 256)", inst->kdc_threads);
+			return -1;
+		}
+
+		inst->async = fr_job_pool_alloc(NULL, "KDC", inst->kdc_threads, kdc_thread_run, kdc_thread_fail,
+						kdc_thread_alloc, NULL, inst);
+		if (!inst->async) {
+			cf_log_err_cs(conf, "Unable to start KDC threads");
+			return -1;
+		}
+#else
+		cf_log_err_cs(conf, "kdc_threads requires a thread safe libkrb5");
+		return -1;
+#endif
+	}
+
 	return 0;
 }
 
-/** Common function for transforming a User-Name string into a principal.
+/** Create the pipe completed KDC exchanges are received on
  *
- * @param[out] client Where to write the client principal.
- * @param[in] inst of rlm_krb5.
- * @param[in] request Current request.
- * @param[in] context Kerberos context.
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_krb5_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static rlm_rcode_t krb5_parse_user(krb5_principal *client, rlm_krb5_t const *inst, REQUEST *request,
-				   krb5_context context)
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, UNUSED void *instance,
+				  UNUSED fr_event_list_t *el, UNUSED void *thread)
 {
-	krb5_error_code ret;
-	char *princ_name;
+#ifdef KRB5_IS_THREAD_SAFE
+	rlm_krb5_t		*inst = instance;
+	rlm_krb5_thread_t	*t = thread;
 
-	rad_cond_assert(inst);
+	if (!inst->async) return 0;
+
+	t->kdc_return = fr_job_return_alloc(inst->async, el, unlang_resumable);
+	if (!t->kdc_return) return -1;
+#endif
 
+	return 0;
+}
+
+/** Stop receiving completed KDC exchanges
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(UNUSED void *thread)
+{
+#ifdef KRB5_IS_THREAD_SAFE
+	rlm_krb5_thread_t	*t = thread;
+
+	fr_job_return_free(t->kdc_return);
+	t->kdc_return = NULL;
+#endif
+
+	return 0;
+}
+
+
+/** Check the request has the attributes we need to authenticate it
+ *
+ * @param[in] request Current request.
+ */
+static rlm_rcode_t krb5_check_user(REQUEST *request)
+{
 	/*
 	 * 	We can only authenticate user requests which HAVE
 	 * 	a User-Name attribute.
@@ -262,6 +709,24 @@ static rlm_rcode_t krb5_parse_user(krb5_principal *client, rlm_krb5_t const *ins
 		return RLM_MODULE_INVALID;
 	}
 
+	return RLM_MODULE_OK;
+}
+
+/** Common function for transforming a User-Name string into a principal.
+ *
+ * @param[out] client Where to write the client principal.
+ * @param[in] inst of rlm_krb5.
+ * @param[in] request Current request.
+ * @param[in] context Kerberos context.
+ */
+static rlm_rcode_t krb5_parse_user(krb5_principal *client, rlm_krb5_t const *inst, REQUEST *request,
+				   krb5_context context)
+{
+	krb5_error_code ret;
+	char *princ_name;
+
+	rad_cond_assert(inst);
+
 	ret = krb5_parse_name(context, request->username->vp_strvalue, client);
 	if (ret) {
 		REDEBUG("Failed parsing username as principal: %s", rlm_krb5_error(inst, context, ret));
@@ -282,191 +747,232 @@ static rlm_rcode_t krb5_parse_user(krb5_principal *client, rlm_krb5_t const *ins
 /** Log error message and return appropriate rcode
  *
  * Translate kerberos error codes into return codes.
- * @param inst of rlm_krb5.
  * @param request Current request.
  * @param ret code from kerberos.
- * @param conn used in the last operation.
+ * @param msg describing ret.
  */
-static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, REQUEST *request, rlm_krb5_handle_t *conn, int ret)
+static rlm_rcode_t krb5_process_error(REQUEST *request, krb5_error_code ret, char const *msg)
 {
 	rad_assert(ret != 0);
 
-	if (!rad_cond_assert(inst)) return RLM_MODULE_FAIL;
-	if (!rad_cond_assert(conn)) return RLM_MODULE_FAIL;	/* Silences warnings */
-
 	switch (ret) {
 	case KRB5_LIBOS_BADPWDMATCH:
 	case KRB5KRB_AP_ERR_BAD_INTEGRITY:
-		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Provided password was incorrect (%i): %s", ret, msg);
 		return RLM_MODULE_REJECT;
 
 	case KRB5KDC_ERR_KEY_EXP:
 	case KRB5KDC_ERR_CLIENT_REVOKED:
 	case KRB5KDC_ERR_SERVICE_REVOKED:
-		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Account has been locked out (%i): %s", ret, msg);
 		return RLM_MODULE_USERLOCK;
 
 	case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
-		RDEBUG("User not found (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		RDEBUG("User not found (%i): %s", ret, msg);
 		return RLM_MODULE_NOTFOUND;
 
 	default:
-		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Error verifying credentials (%i): %s", ret, msg);
 		return RLM_MODULE_FAIL;
 	}
 }
 
-#ifdef HEIMDAL_KRB5
-
-/*
- *	Validate user/pass (Heimdal)
+/** Check whether the credentials were recently verified
+ *
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] request	being authenticated.
+ * @param[out] key	to insert into the cache if the credentials are verified.
+ * @return
+ *	- true if the credentials were verified recently.
+ *	- false if they weren't, or there's no cache.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static bool krb5_cached(rlm_krb5_t const *inst, REQUEST *request, uint8_t key[SHA1_DIGEST_LENGTH])
 {
-	rlm_krb5_t const *inst = instance;
-	rlm_rcode_t rcode;
-	krb5_error_code ret;
+	if (!inst->cache) return false;
 
-	rlm_krb5_handle_t *conn;
+	kdc_cache_key(inst->cache, key, request->username->vp_strvalue, request->password->vp_strvalue);
+	if (!kdc_cache_find(inst->cache, key)) return false;
 
-	krb5_principal client;
+	RDEBUG("Credentials were verified recently, not contacting the KDC");
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	conn = fr_connection_get(inst->pool, request);
-	if (!conn) return RLM_MODULE_FAIL;
-#  else
-	conn = inst->conn;
-#  endif
+	return true;
+}
 
-	/*
-	 *	Zero out local storage
-	 */
-	memset(&client, 0, sizeof(client));
+#ifdef KRB5_IS_THREAD_SAFE
+/** A KDC exchange the request is waiting for
+ *
+ */
+typedef struct krb5_kdc_ctx_t {
+	fr_job_t		*job;		//!< Queued for a KDC thread.
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< To insert into the cache, if there's a cache.
+} krb5_kdc_ctx_t;
 
-	rcode = krb5_parse_user(&client, inst, request, conn->context);
-	if (rcode != RLM_MODULE_OK) goto cleanup;
+/** Cancel the KDC exchange, if it's still outstanding
+ *
+ * Jobs aren't parented by the kdc_ctx, as they may be freed by a KDC thread.
+ */
+static int _krb5_kdc_ctx_free(krb5_kdc_ctx_t *kdc_ctx)
+{
+	if (kdc_ctx->job) fr_job_cancel(kdc_ctx->job);
 
-	/*
-	 *	Verify the user, using the options we set in instantiate
-	 */
-	ret = krb5_verify_user_opt(conn->context, client, request->password->vp_strvalue, &conn->options);
-	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
-		goto cleanup;
+	return 0;
+}
+
+/** Process the result of the KDC exchange
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_krb5_t const	*inst = instance;
+	krb5_kdc_ctx_t		*kdc_ctx = talloc_get_type_abort(ctx, krb5_kdc_ctx_t);
+	kdc_job_t		*job = fr_job_data(kdc_ctx->job);
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	if (job->parse_failed) {
+		REDEBUG("Failed parsing username as principal: %s", job->error);
+		rcode = RLM_MODULE_FAIL;
+	} else if (job->ret) {
+		rcode = krb5_process_error(request, job->ret, job->error);
+	} else {
+		RDEBUG("Credentials verified");
+		if (inst->cache) kdc_cache_insert(inst->cache, kdc_ctx->key);
 	}
+	talloc_free(kdc_ctx);
 
-	/*
-	 *	krb5_verify_user_opt adds the credentials to the ccache
-	 *	we specified with krb5_verify_opt_set_ccache.
-	 *
-	 *	To make sure we don't accumulate thousands of sets of
-	 *	credentials, remove them again here.
-	 *
-	 * @todo This should definitely be optional, which means writing code for the MIT
-	 *	 variant as well.
-	 */
-	{
-		krb5_cc_cursor cursor;
-		krb5_creds cred;
+	return rcode;
+}
 
-		krb5_cc_start_seq_get(conn->context, conn->ccache, &cursor);
-		for (ret = krb5_cc_next_cred(conn->context, conn->ccache, &cursor, &cred);
-		     ret == 0;
-		     ret = krb5_cc_next_cred(conn->context, conn->ccache, &cursor, &cred)) {
-		     krb5_cc_remove_cred(conn->context, conn->ccache, 0, &cred);
-		}
-		krb5_cc_end_seq_get(conn->context, conn->ccache, &cursor);
-	}
+/** Stop waiting for the KDC exchange if the request is cancelled
+ *
+ */
+static void mod_authenticate_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				    fr_state_action_t action)
+{
+	krb5_kdc_ctx_t		*kdc_ctx = talloc_get_type_abort(ctx, krb5_kdc_ctx_t);
 
-cleanup:
-	if (client) {
-		krb5_free_principal(conn->context, client);
-	}
+	if (action != FR_ACTION_DONE) return;
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	fr_connection_release(inst->pool, request, conn);
-#  endif
-	return rcode;
+	RDEBUG("Cancelling pending KDC exchange");
+
+	talloc_free(kdc_ctx);
 }
 
-#else  /* HEIMDAL_KRB5 */
+/** Queue the KDC exchange for a KDC thread, and yield until it's been run
+ *
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] t		thread specific data.
+ * @param[in] request	being authenticated.
+ * @param[in] key	to insert into the cache, if the credentials are verified.
+ * @return
+ *	- RLM_MODULE_YIELD if the exchange was queued.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t krb5_kdc_yield(rlm_krb5_t const *inst, rlm_krb5_thread_t *t, REQUEST *request,
+				  uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	krb5_kdc_ctx_t		*kdc_ctx;
+
+	kdc_ctx = talloc_zero(request, krb5_kdc_ctx_t);
+	if (!kdc_ctx) return RLM_MODULE_FAIL;
+
+	memcpy(kdc_ctx->key, key, sizeof(kdc_ctx->key));
+
+	RDEBUG("Verifying credentials for \"%s\" with the KDC", request->username->vp_strvalue);
+	kdc_ctx->job = kdc_job_send(inst->async, t->kdc_return, request);
+	if (!kdc_ctx->job) {
+		REDEBUG("Failed queueing KDC exchange");
+		talloc_free(kdc_ctx);
+		return RLM_MODULE_FAIL;
+	}
+	talloc_set_destructor(kdc_ctx, _krb5_kdc_ctx_free);
+
+	return unlang_yield(request, mod_authenticate_resume, mod_authenticate_action, kdc_ctx);
+}
+#endif
 
 /*
- *  Validate userid/passwd (MIT)
+ *	Validate user/pass
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	rlm_krb5_t const *inst = instance;
-	rlm_rcode_t rcode;
-	krb5_error_code ret;
+	rlm_krb5_t const	*inst = instance;
+	rlm_rcode_t		rcode;
+	krb5_error_code		ret;
+	uint8_t			key[SHA1_DIGEST_LENGTH];
 
-	rlm_krb5_handle_t *conn;
+	rlm_krb5_handle_t	*conn;
 
-	krb5_principal client;
-	krb5_creds init_creds;
-	char *password;		/* compiler warnings */
+	krb5_principal		client;
 
 	rad_assert(inst->context);
 
-#  ifdef KRB5_IS_THREAD_SAFE
+	/*
+	 *	Check we have all the required VPs
+	 */
+	rcode = krb5_check_user(request);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	if (krb5_cached(inst, request, key)) return RLM_MODULE_OK;
+
+#ifdef KRB5_IS_THREAD_SAFE
+	{
+		rlm_krb5_thread_t *t = thread;
+
+		/*
+		 *	The KDC exchange can take a while, so hand it
+		 *	to a KDC thread if we have them.
+		 */
+		if (t->kdc_return) return krb5_kdc_yield(inst, t, request, key);
+	}
+
 	conn = fr_connection_get(inst->pool, request);
 	if (!conn) return RLM_MODULE_FAIL;
-#  else
+#else
 	conn = inst->conn;
-#  endif
+#endif
 
 	/*
 	 *	Zero out local storage
 	 */
 	memset(&client, 0, sizeof(client));
-	memset(&init_creds, 0, sizeof(init_creds));
 
 	/*
-	 *	Check we have all the required VPs, and convert the username
-	 *	into a principal.
+	 *	Convert the username into a principal.
 	 */
 	rcode = krb5_parse_user(&client, inst, request, conn->context);
 	if (rcode != RLM_MODULE_OK) goto cleanup;
 
-	/*
-	 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it.
-	 */
-	memcpy(&password, &request->password->vp_strvalue, sizeof(password));
-	RDEBUG("Retrieving and decrypting TGT");
-	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, password,
-					   NULL, NULL, 0, NULL, inst->gic_options);
+	ret = krb5_verify_password(inst, conn, client, request->password->vp_strvalue, request);
 	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
+		rcode = krb5_process_error(request, ret, rlm_krb5_error(inst, conn->context, ret));
 		goto cleanup;
 	}
 
-	RDEBUG("Attempting to authenticate against service principal");
-	ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server, conn->keytab, NULL, inst->vic_options);
-	if (ret) rcode = krb5_process_error(inst, request, conn, ret);
+	if (inst->cache) kdc_cache_insert(inst->cache, key);
 
 cleanup:
 	if (client) krb5_free_principal(conn->context, client);
-	krb5_free_cred_contents(conn->context, &init_creds);
 
-#  ifdef KRB5_IS_THREAD_SAFE
+#ifdef KRB5_IS_THREAD_SAFE
 	fr_connection_release(inst->pool, request, conn);
-#  endif
+#endif
 	return rcode;
 }
 
-#endif /* MIT_KRB5 */
-
 extern rad_module_t rlm_krb5;
 rad_module_t rlm_krb5 = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "krb5",
+	.magic			= RLM_MODULE_INIT,
+	.name			= "krb5",
 #ifdef KRB5_IS_THREAD_SAFE
-	.type		= RLM_TYPE_THREAD_SAFE,
+	.type			= RLM_TYPE_THREAD_SAFE,
 #endif
-	.inst_size	= sizeof(rlm_krb5_t),
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.inst_size		= sizeof(rlm_krb5_t),
+	.thread_inst_size	= sizeof(rlm_krb5_thread_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate
 	},
@@ -25,6 +25,7 @@
  * @copyright 2013-2015 The FreeRADIUS Server Project.
  */
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/heap.h>
 #include <ctype.h>
 
 #define LOG_PREFIX "rlm_ldap (%s) - "
@@ -254,6 +255,123 @@ finish:
 	return rcode;
 }
 
+/** Convert multiple group DNs into names with a single search
+ *
+ * Most directories don't allow filtering by DN directly, but many expose the DN as
+ * an attribute of the object ('distinguishedName' in Active Directory, 'entryDN'
+ * in OpenLDAP).  If 'group.dn_attribute' is set, the DNs are matched against it
+ * in one search, instead of one base search per DN.
+ *
+ * @param[in] ctx to allocate names in.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dns to resolve, must already be normalised.
+ * @param[in] count of DNs.
+ * @param[out] out Where to write the names.  Indexes match those of dns.  Entries for DNs
+ *	which didn't resolve are left NULL, and should be resolved individually.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_group_dn2name_bulk(TALLOC_CTX *ctx, rlm_ldap_t const *inst, REQUEST *request,
+					       ldap_handle_t **pconn, char * const *dns, int count, char **out)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+	ldap_rcode_t status;
+
+	char const *attrs[] = { inst->groupobj_name_attr, NULL };
+	LDAPMessage *result = NULL, *entry;
+
+	char const *base_dn = NULL;
+	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	char buffer[(LDAP_MAX_DN_STR_LEN * 3) + 1];
+
+	char *filter;
+	int i, resolved = 0;
+
+	for (i = 0; i < count; i++) out[i] = NULL;
+
+	if (!inst->groupobj_dn_attr || (count == 0)) return RLM_MODULE_OK;
+
+	if (!inst->groupobj_name_attr) {
+		REDEBUG("Told to resolve group DN to name but missing 'group.name_attribute' directive");
+
+		return RLM_MODULE_INVALID;
+	}
+
+	RDEBUG("Resolving %i group DN(s) to group name(s)", count);
+
+	filter = talloc_typed_asprintf(request, "%s%s%s",
+				       inst->groupobj_filter ? "(&" : "",
+				       inst->groupobj_filter ? inst->groupobj_filter : "",
+				       count > 1 ? "(|" : "");
+	for (i = 0; i < count; i++) {
+		rlm_ldap_escape_func(request, buffer, sizeof(buffer), dns[i], NULL);
+		filter = talloc_asprintf_append_buffer(filter, "(%s=%s)", inst->groupobj_dn_attr, buffer);
+	}
+	filter = talloc_asprintf_append_buffer(filter, "%s%s",
+					       inst->groupobj_filter ? ")" : "",
+					       count > 1 ? ")" : "");
+
+	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+			inst->groupobj_base_dn, rlm_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Failed creating base_dn");
+		talloc_free(filter);
+
+		return RLM_MODULE_INVALID;
+	}
+
+	status = rlm_ldap_search(&result, inst, request, pconn, base_dn, inst->groupobj_scope,
+				 filter, attrs, NULL, NULL);
+	switch (status) {
+	case LDAP_PROC_SUCCESS:
+		break;
+
+	case LDAP_PROC_NO_RESULT:
+		RDEBUG("Tried to resolve group DN(s) to names but got no results");
+		goto finish;
+
+	default:
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	for (entry = ldap_first_entry((*pconn)->handle, result);
+	     entry;
+	     entry = ldap_next_entry((*pconn)->handle, entry)) {
+		struct berval	**values;
+		char		*dn;
+
+		dn = ldap_get_dn((*pconn)->handle, entry);
+		if (!dn) continue;
+		rlm_ldap_normalise_dn(dn, dn);
+
+		for (i = 0; i < count; i++) {
+			if (!out[i] && (strcasecmp(dn, dns[i]) == 0)) break;
+		}
+		ldap_memfree(dn);
+		if (i == count) continue;
+
+		values = ldap_get_values_len((*pconn)->handle, entry, inst->groupobj_name_attr);
+		if (!values) continue;
+
+		out[i] = rlm_ldap_berval_to_string(ctx, values[0]);
+		ldap_value_free_len(values);
+
+		RDEBUG("Group DN \"%s\" resolves to name \"%s\"", dns[i], out[i]);
+		resolved++;
+	}
+
+	if (resolved < count) {
+		RDEBUG("Resolved %i of %i group DN(s), searching for the remainder individually", resolved, count);
+	}
+
+finish:
+	talloc_free(filter);
+	if (result) ldap_msgfree(result);
+
+	return rcode;
+}
+
 /** Convert group membership information into attributes
  *
  * @param[in] inst rlm_ldap configuration.
@@ -276,6 +394,10 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 	char *group_dn[LDAP_MAX_CACHEABLE + 1];
 	char **dn_p;
 
+	char *resolve_dn[LDAP_MAX_CACHEABLE];
+	char *resolved[LDAP_MAX_CACHEABLE];
+	int resolve_cnt = 0;
+
 	char *name;
 
 	VALUE_PAIR *vp, **list, *groups = NULL;
@@ -343,32 +465,44 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 				fr_pair_cursor_append(&groups_cursor, vp);
 			/*
 			 *	We were told to cache names but we got a DN, we now need to resolve
-			 *	this to a name.
-			 *	Only Active Directory supports filtering on DN, so we have to search
-			 *	for each individual group.
+			 *	this to a name.  Store all the DNs in an array so we can resolve them
+			 *	in one query if the directory supports it.
 			 */
 			} else {
-				char *dn;
+				resolve_dn[resolve_cnt] = rlm_ldap_berval_to_string(value_ctx, values[i]);
+				rlm_ldap_normalise_dn(resolve_dn[resolve_cnt], resolve_dn[resolve_cnt]);
+				resolve_cnt++;
+			}
+		}
+	}
+	*name_p = NULL;
 
-				dn = rlm_ldap_berval_to_string(value_ctx, values[i]);
-				rcode = rlm_ldap_group_dn2name(inst, request, pconn, dn, &name);
-				talloc_free(dn);
-				if (rcode != RLM_MODULE_OK) {
-					ldap_value_free_len(values);
-					talloc_free(value_ctx);
-					fr_pair_list_free(&groups);
+	rcode = rlm_ldap_group_dn2name_bulk(value_ctx, inst, request, pconn, resolve_dn, resolve_cnt, resolved);
+	if (rcode != RLM_MODULE_OK) {
+	error:
+		ldap_value_free_len(values);
+		talloc_free(value_ctx);
+		fr_pair_list_free(&groups);
 
-					return rcode;
-				}
+		return rcode;
+	}
 
-				MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
-				fr_pair_value_bstrncpy(vp, name, talloc_array_length(name) - 1);
-				fr_pair_cursor_append(&groups_cursor, vp);
-				talloc_free(name);
-			}
+	for (i = 0; i < resolve_cnt; i++) {
+		name = resolved[i];
+
+		/*
+		 *	Didn't resolve in bulk, search for the group directly.
+		 */
+		if (!name) {
+			rcode = rlm_ldap_group_dn2name(inst, request, pconn, resolve_dn[i], &name);
+			if (rcode != RLM_MODULE_OK) goto error;
 		}
+
+		MEM(vp = fr_pair_afrom_da(list_ctx, inst->cache_da));
+		fr_pair_value_bstrncpy(vp, name, talloc_array_length(name) - 1);
+		fr_pair_cursor_append(&groups_cursor, vp);
+		talloc_free(name);
 	}
-	*name_p = NULL;
 
 	rcode = rlm_ldap_group_name2dn(inst, request, pconn, group_name, group_dn, sizeof(group_dn));
 
@@ -404,56 +538,58 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 	return rcode;
 }
 
-/** Convert group membership information into attributes
+/** Expand the base DN and filter used to search for group objects referencing the user
  *
+ * @param[out] base_dn Where to write a pointer to the expanded base DN.
+ * @param[in] base_dn_buff Buffer to expand the base DN into, must be #LDAP_MAX_DN_STR_LEN bytes.
+ * @param[in] filter Buffer to write the filter to, must be #LDAP_MAX_FILTER_STR_LEN + 1 bytes.
  * @param[in] inst rlm_ldap configuration.
  * @param[in] request Current request.
- * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
- * @return One of the RLM_MODULE_* values.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn)
+static int rlm_ldap_groupobj_search_expand(char const **base_dn, char *base_dn_buff, char *filter,
+					   rlm_ldap_t const *inst, REQUEST *request)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
-	ldap_rcode_t status;
-	int ldap_errno;
-
-	LDAPMessage *result = NULL;
-	LDAPMessage *entry;
-
-	char const *base_dn;
-	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
-
 	char const *filters[] = { inst->groupobj_filter, inst->groupobj_membership_filter };
-	char filter[LDAP_MAX_FILTER_STR_LEN + 1];
-
-	char const *attrs[] = { inst->groupobj_name_attr, NULL };
-
-	VALUE_PAIR *vp;
-	char *dn;
-
-	rad_assert(inst->groupobj_base_dn);
-
-	if (!inst->groupobj_membership_filter) {
-		RDEBUG2("Skipping caching group objects as directive 'group.membership_filter' is not set");
-
-		return RLM_MODULE_OK;
-	}
 
 	if (rlm_ldap_xlat_filter(request,
 				 filters, sizeof(filters) / sizeof(*filters),
-				 filter, sizeof(filter)) < 0) {
-		return RLM_MODULE_INVALID;
+				 filter, LDAP_MAX_FILTER_STR_LEN + 1) < 0) {
+		return -1;
 	}
 
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+	if (tmpl_expand(base_dn, base_dn_buff, LDAP_MAX_DN_STR_LEN, request,
 			inst->groupobj_base_dn, rlm_ldap_escape_func, NULL) < 0) {
 		REDEBUG("Failed creating base_dn");
 
-		return RLM_MODULE_INVALID;
+		return -1;
 	}
 
-	status = rlm_ldap_search(&result, inst, request, pconn, base_dn,
-				 inst->groupobj_scope, filter, attrs, NULL, NULL);
+	return 0;
+}
+
+/** Convert the result of a group object search into attributes
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the search was performed on.
+ * @param[in] status of the search.
+ * @param[in] result of the search.  Will be freed.
+ * @return One of the RLM_MODULE_* values.
+ */
+rlm_rcode_t rlm_ldap_cacheable_groupobj_result(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
+					       ldap_rcode_t status, LDAPMessage *result)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+	int ldap_errno;
+
+	LDAPMessage *entry;
+
+	VALUE_PAIR *vp;
+	char *dn;
+
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -465,9 +601,9 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 		goto finish;
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, result);
+	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
 		goto finish;
@@ -476,9 +612,9 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 	RDEBUG("Adding cacheable group object memberships");
 	do {
 		if (inst->cacheable_group_dn) {
-			dn = ldap_get_dn((*pconn)->handle, entry);
+			dn = ldap_get_dn(conn->handle, entry);
 			if (!dn) {
-				ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+				ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 				REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
 				goto finish;
@@ -497,7 +633,7 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 		if (inst->cacheable_group_name) {
 			struct berval **values;
 
-			values = ldap_get_values_len((*pconn)->handle, entry, inst->groupobj_name_attr);
+			values = ldap_get_values_len(conn->handle, entry, inst->groupobj_name_attr);
 			if (!values) continue;
 
 			MEM(vp = pair_make_config(inst->cache_da->name, NULL, T_OP_ADD));
@@ -510,7 +646,7 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 
 			ldap_value_free_len(values);
 		}
-	} while ((entry = ldap_next_entry((*pconn)->handle, entry)));
+	} while ((entry = ldap_next_entry(conn->handle, entry)));
 
 finish:
 	if (result) ldap_msgfree(result);
@@ -518,6 +654,85 @@ finish:
 	return rcode;
 }
 
+/** Send a search for group objects referencing the user without waiting for the result
+ *
+ * The result should be retrieved with #rlm_ldap_search_async_result, and
+ * processed with #rlm_ldap_cacheable_groupobj_result.
+ *
+ * @param[out] msgid Where to write the message ID of the search.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[out] rcode The status of the operation if no search was sent, one of the RLM_MODULE_* values.
+ * @return
+ *	- #LDAP_PROC_NO_RESULT if there's nothing to search for.
+ *	- One of the other LDAP_PROC_* (#ldap_rcode_t) values, as for #rlm_ldap_search_async.
+ */
+ldap_rcode_t rlm_ldap_cacheable_groupobj_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request,
+					       ldap_handle_t **pconn, rlm_rcode_t *rcode)
+{
+	char const *base_dn;
+	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	char filter[LDAP_MAX_FILTER_STR_LEN + 1];
+	char const *attrs[] = { inst->groupobj_name_attr, NULL };
+
+	rad_assert(inst->groupobj_base_dn);
+
+	*msgid = -1;
+	*rcode = RLM_MODULE_OK;
+
+	if (!inst->groupobj_membership_filter) {
+		RDEBUG2("Skipping caching group objects as directive 'group.membership_filter' is not set");
+
+		return LDAP_PROC_NO_RESULT;
+	}
+
+	if (rlm_ldap_groupobj_search_expand(&base_dn, base_dn_buff, filter, inst, request) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return LDAP_PROC_ERROR;
+	}
+
+	return rlm_ldap_search_async(msgid, inst, request, pconn, base_dn, inst->groupobj_scope, filter, attrs,
+				     NULL, NULL);
+}
+
+/** Convert group membership information into attributes
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @return One of the RLM_MODULE_* values.
+ */
+rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn)
+{
+	ldap_rcode_t status;
+
+	LDAPMessage *result = NULL;
+
+	char const *base_dn;
+	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	char filter[LDAP_MAX_FILTER_STR_LEN + 1];
+
+	char const *attrs[] = { inst->groupobj_name_attr, NULL };
+
+	rad_assert(inst->groupobj_base_dn);
+
+	if (!inst->groupobj_membership_filter) {
+		RDEBUG2("Skipping caching group objects as directive 'group.membership_filter' is not set");
+
+		return RLM_MODULE_OK;
+	}
+
+	if (rlm_ldap_groupobj_search_expand(&base_dn, base_dn_buff, filter, inst, request) < 0) {
+		return RLM_MODULE_INVALID;
+	}
+
+	status = rlm_ldap_search(&result, inst, request, pconn, base_dn,
+				 inst->groupobj_scope, filter, attrs, NULL, NULL);
+
+	return rlm_ldap_cacheable_groupobj_result(inst, request, *pconn, status, result);
+}
+
 /** Query the LDAP directory to check if a group object includes a user object as a member
  *
  * @param[in] inst rlm_ldap configuration.
@@ -642,6 +857,9 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 	char const	*attrs[] = { inst->userobj_membership_attr, NULL };
 	int		i, count, ldap_errno;
 
+	TALLOC_CTX	*value_ctx = NULL;
+	char		**bulk = NULL;
+
 	RDEBUG2("Checking user object's %s attributes", inst->userobj_membership_attr);
 	RINDENT();
 	status = rlm_ldap_search(&result, inst, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs, NULL, NULL);
@@ -683,6 +901,40 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 	 */
 	name_is_dn = rlm_ldap_is_dn(check->vp_strvalue, check->vp_length);
 	count = ldap_count_values_len(values);
+
+	/*
+	 *	If we were given a group name, membership values which
+	 *	are DNs need resolving. Do as many as we can in one query.
+	 */
+	if (!name_is_dn && inst->groupobj_dn_attr) {
+		char	**dns, **names;
+		int	*idx, dn_cnt = 0;
+
+		MEM(value_ctx = talloc_new(request));
+		MEM(bulk = talloc_zero_array(value_ctx, char *, count));
+		MEM(dns = talloc_array(value_ctx, char *, count));
+		MEM(names = talloc_array(value_ctx, char *, count));
+		MEM(idx = talloc_array(value_ctx, int, count));
+
+		for (i = 0; i < count; i++) {
+			if (!rlm_ldap_is_dn(values[i]->bv_val, values[i]->bv_len)) continue;
+
+			dns[dn_cnt] = rlm_ldap_berval_to_string(value_ctx, values[i]);
+			rlm_ldap_normalise_dn(dns[dn_cnt], dns[dn_cnt]);
+			idx[dn_cnt++] = i;
+		}
+
+		RINDENT();
+		ret = rlm_ldap_group_dn2name_bulk(value_ctx, inst, request, pconn, dns, dn_cnt, names);
+		REXDENT();
+		if (ret != RLM_MODULE_OK) {
+			rcode = ret;
+			goto finish;
+		}
+
+		for (i = 0; i < dn_cnt; i++) bulk[idx[i]] = names[i];
+	}
+
 	for (i = 0; i < count; i++) {
 		value_is_dn = rlm_ldap_is_dn(values[i]->bv_val, values[i]->bv_len);
 
@@ -768,13 +1020,17 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 			bool eq = false;
 
 			value = rlm_ldap_berval_to_string(request, values[i]);
-			RINDENT();
-			ret = rlm_ldap_group_dn2name(inst, request, pconn, value, &resolved);
-			REXDENT();
-			talloc_free(value);
-			if (ret != RLM_MODULE_OK) {
-				rcode = ret;
-				goto finish;
+			if (bulk && bulk[i]) {
+				resolved = talloc_strdup(request, bulk[i]);
+			} else {
+				RINDENT();
+				ret = rlm_ldap_group_dn2name(inst, request, pconn, value, &resolved);
+				REXDENT();
+				if (ret != RLM_MODULE_OK) {
+					talloc_free(value);
+					rcode = ret;
+					goto finish;
+				}
 			}
 
 			if (((talloc_array_length(resolved) - 1) == check->vp_length) &&
@@ -783,10 +1039,12 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 			if (eq) {
 				RDEBUG("User found in group \"%s\". Comparison between membership: name "
 				       "(resolved from DN \"%s\"), check: name", check->vp_strvalue, value);
+				talloc_free(value);
 				rcode = RLM_MODULE_OK;
 
 				goto finish;
 			}
+			talloc_free(value);
 
 			continue;
 		}
@@ -794,6 +1052,7 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 	}
 
 finish:
+	talloc_free(value_ctx);
 	if (values) ldap_value_free_len(values);
 	if (result) ldap_msgfree(result);
 
@@ -839,3 +1098,374 @@ rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALU
 	RDEBUG2("Cached membership not found");
 	return RLM_MODULE_NOTFOUND;
 }
+
+/** Result of a dynamic membership check
+ *
+ */
+typedef struct ldap_group_check {
+	char const		*group;		//!< Name or normalised DN of the group.
+	bool			member;		//!< Whether the user is a member.
+	struct ldap_group_check	*next;		//!< Next check result for this user.
+} ldap_group_check_t;
+
+/** Group memberships of a single user object
+ *
+ */
+typedef struct ldap_group_cache_entry {
+	char const		*dn;		//!< Normalised DN of the user object.
+	time_t			expires;	//!< When the entry should be discarded.
+	size_t			heap_id;	//!< Offset used for the expiry heap.
+
+	bool			complete;	//!< memberships holds the full set written to the
+						//!< control list by authorize.
+	VALUE_PAIR		*memberships;	//!< Copies of the cache attributes.
+	ldap_group_check_t	*checks;	//!< Results of dynamic membership checks.
+} ldap_group_cache_entry_t;
+
+struct ldap_group_cache {
+	rbtree_t		*tree;		//!< Entries keyed by user DN.
+	fr_heap_t		*heap;		//!< Entries ordered by expiry.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects the tree and heap.
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#  define GROUP_CACHE_LOCK(_c)		pthread_mutex_lock(&(_c)->mutex)
+#  define GROUP_CACHE_UNLOCK(_c)	pthread_mutex_unlock(&(_c)->mutex)
+#else
+#  define GROUP_CACHE_LOCK(_c)
+#  define GROUP_CACHE_UNLOCK(_c)
+#endif
+
+static int group_cache_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const *a = one;
+	ldap_group_cache_entry_t const *b = two;
+
+	return strcasecmp(a->dn, b->dn);
+}
+
+static int group_cache_heap_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const *a = one;
+	ldap_group_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+static int _group_cache_free(ldap_group_cache_t *cache)
+{
+	ldap_group_cache_entry_t *entry;
+
+	if (cache->heap) {
+		while ((entry = fr_heap_peek(cache->heap))) {
+			fr_heap_extract(cache->heap, entry);
+			talloc_free(entry);
+		}
+		fr_heap_delete(cache->heap);
+	}
+	if (cache->tree) rbtree_free(cache->tree);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+
+	return 0;
+}
+
+/** Allocate the membership cache
+ *
+ * The cache is allocated outside of the instance data, as entries are added
+ * at runtime.  It must be freed with #rlm_ldap_group_cache_free.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @return
+ *	- The new cache.
+ *	- NULL on error.
+ */
+ldap_group_cache_t *rlm_ldap_group_cache_alloc(rlm_ldap_t const *inst)
+{
+	ldap_group_cache_t *cache;
+
+	cache = talloc_zero(NULL, ldap_group_cache_t);
+	if (!cache) return NULL;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+		talloc_free(cache);
+		return NULL;
+	}
+#endif
+	talloc_set_destructor(cache, _group_cache_free);
+
+	cache->tree = rbtree_create(cache, group_cache_cmp, NULL, 0);
+	cache->heap = fr_heap_create(group_cache_heap_cmp, offsetof(ldap_group_cache_entry_t, heap_id));
+	if (!cache->tree || !cache->heap) {
+		ERROR("Failed creating group membership cache");
+		talloc_free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/** Free the membership cache
+ *
+ * @param[in] cache to free.
+ */
+void rlm_ldap_group_cache_free(ldap_group_cache_t *cache)
+{
+	talloc_free(cache);
+}
+
+/** Remove an entry from the cache
+ *
+ * @note Must be called with the cache locked.
+ */
+static void group_cache_remove(ldap_group_cache_t *cache, ldap_group_cache_entry_t *entry)
+{
+	rbtree_deletebydata(cache->tree, entry);
+	fr_heap_extract(cache->heap, entry);
+	talloc_free(entry);
+}
+
+/** Find the live entry for a user DN
+ *
+ * Expired entries are removed as they're encountered.
+ *
+ * @note Must be called with the cache locked.
+ */
+static ldap_group_cache_entry_t *group_cache_find(ldap_group_cache_t *cache, char const *dn, time_t now)
+{
+	ldap_group_cache_entry_t *entry;
+
+	while ((entry = fr_heap_peek(cache->heap)) && (entry->expires <= now)) group_cache_remove(cache, entry);
+
+	return rbtree_finddata(cache->tree, &(ldap_group_cache_entry_t){ .dn = dn });
+}
+
+/** Find or create the entry for a user DN
+ *
+ * If the cache is full, the entry closest to expiring is discarded.
+ *
+ * @note Must be called with the cache locked.
+ */
+static ldap_group_cache_entry_t *group_cache_get(rlm_ldap_t const *inst, char const *dn, time_t now)
+{
+	ldap_group_cache_t		*cache = inst->group_cache;
+	ldap_group_cache_entry_t	*entry;
+
+	entry = group_cache_find(cache, dn, now);
+	if (entry) return entry;
+
+	if (inst->group_cache_size && (fr_heap_num_elements(cache->heap) >= inst->group_cache_size)) {
+		group_cache_remove(cache, fr_heap_peek(cache->heap));
+	}
+
+	entry = talloc_zero(cache, ldap_group_cache_entry_t);
+	if (!entry) return NULL;
+
+	entry->dn = talloc_strdup(entry, dn);
+	entry->expires = now + inst->group_cache_ttl;
+
+	if (!rbtree_insert(cache->tree, entry)) {
+	error:
+		talloc_free(entry);
+		return NULL;
+	}
+
+	if (fr_heap_insert(cache->heap, entry) < 0) {
+		rbtree_deletebydata(cache->tree, entry);
+		goto error;
+	}
+
+	return entry;
+}
+
+/** Add cached memberships for a user to the control list
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] dn of the user object.
+ * @return
+ *	- #RLM_MODULE_OK if the memberships were added.
+ *	- #RLM_MODULE_NOTFOUND if no complete set of memberships is cached.
+ */
+rlm_rcode_t rlm_ldap_group_cache_copy(rlm_ldap_t const *inst, REQUEST *request, char const *dn)
+{
+	ldap_group_cache_entry_t	*entry;
+	VALUE_PAIR			*vp, *copy;
+	vp_cursor_t			cursor, list;
+
+	if (!inst->group_cache) return RLM_MODULE_NOTFOUND;
+
+	GROUP_CACHE_LOCK(inst->group_cache);
+	entry = group_cache_find(inst->group_cache, dn, request->packet->timestamp.tv_sec);
+	if (!entry || !entry->complete) {
+		GROUP_CACHE_UNLOCK(inst->group_cache);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	RDEBUG("Adding cached memberships for \"%s\"", dn);
+	RINDENT();
+	fr_pair_cursor_init(&list, &request->control);
+	for (vp = fr_pair_cursor_init(&cursor, &entry->memberships);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		MEM(copy = fr_pair_copy(request, vp));
+		fr_pair_cursor_append(&list, copy);
+
+		RDEBUG("&control:%s += \"%s\"", inst->cache_da->name, copy->vp_strvalue);
+	}
+	REXDENT();
+	GROUP_CACHE_UNLOCK(inst->group_cache);
+
+	return RLM_MODULE_OK;
+}
+
+/** Record the memberships authorize wrote to the control list
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] dn of the user object.
+ */
+void rlm_ldap_group_cache_store(rlm_ldap_t const *inst, REQUEST *request, char const *dn)
+{
+	ldap_group_cache_entry_t	*entry;
+	VALUE_PAIR			*vp, *copy;
+	vp_cursor_t			cursor, memberships;
+
+	if (!inst->group_cache) return;
+
+	GROUP_CACHE_LOCK(inst->group_cache);
+	entry = group_cache_get(inst, dn, request->packet->timestamp.tv_sec);
+	if (!entry) {
+		GROUP_CACHE_UNLOCK(inst->group_cache);
+		return;
+	}
+
+	fr_pair_list_free(&entry->memberships);
+	fr_pair_cursor_init(&memberships, &entry->memberships);
+	for (vp = fr_pair_cursor_init(&cursor, &request->control);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (vp->da != inst->cache_da) continue;
+
+		copy = fr_pair_copy(entry, vp);
+		if (!copy) break;
+		fr_pair_cursor_append(&memberships, copy);
+	}
+	entry->complete = !vp;
+	GROUP_CACHE_UNLOCK(inst->group_cache);
+}
+
+/** Check the membership cache to see if a user is a member of a group
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] dn of the user object.
+ * @param[in] check vp containing the group value (name or normalised dn).
+ * @return
+ *	- #RLM_MODULE_OK if the user is a member.
+ *	- #RLM_MODULE_NOTFOUND if the user is not a member.
+ *	- #RLM_MODULE_INVALID if the cache can't answer, and a dynamic lookup is required.
+ */
+rlm_rcode_t rlm_ldap_group_cache_check(rlm_ldap_t const *inst, REQUEST *request, char const *dn,
+				       VALUE_PAIR const *check)
+{
+	ldap_group_cache_entry_t	*entry;
+	ldap_group_check_t		*gc;
+	VALUE_PAIR			*vp;
+	vp_cursor_t			cursor;
+	rlm_rcode_t			rcode = RLM_MODULE_INVALID;
+	bool				check_is_dn;
+
+	if (!inst->group_cache) return RLM_MODULE_INVALID;
+
+	check_is_dn = rlm_ldap_is_dn(check->vp_strvalue, check->vp_length);
+
+	GROUP_CACHE_LOCK(inst->group_cache);
+	entry = group_cache_find(inst->group_cache, dn, request->packet->timestamp.tv_sec);
+	if (!entry) goto finish;
+
+	for (gc = entry->checks; gc; gc = gc->next) {
+		if ((check_is_dn ? strcasecmp(gc->group, check->vp_strvalue) :
+				   strcmp(gc->group, check->vp_strvalue)) != 0) continue;
+
+		rcode = gc->member ? RLM_MODULE_OK : RLM_MODULE_NOTFOUND;
+		goto finish;
+	}
+
+	/*
+	 *	The complete set only tells us the user isn't a
+	 *	member, if it contains groups in the same form.
+	 */
+	if (!entry->complete ||
+	    (check_is_dn && !inst->cacheable_group_dn) || (!check_is_dn && !inst->cacheable_group_name)) goto finish;
+
+	rcode = RLM_MODULE_NOTFOUND;
+	for (vp = fr_pair_cursor_init(&cursor, &entry->memberships);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (fr_pair_cmp_op(T_OP_CMP_EQ, vp, check) == 1) {
+			rcode = RLM_MODULE_OK;
+			break;
+		}
+	}
+
+finish:
+	GROUP_CACHE_UNLOCK(inst->group_cache);
+
+	switch (rcode) {
+	case RLM_MODULE_OK:
+		RDEBUG2("User found. Matched membership cached for \"%s\"", dn);
+		break;
+
+	case RLM_MODULE_NOTFOUND:
+		RDEBUG2("User not found in membership cached for \"%s\"", dn);
+		break;
+
+	default:
+		break;
+	}
+
+	return rcode;
+}
+
+/** Record the result of a dynamic membership check
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] dn of the user object.
+ * @param[in] check vp containing the group value (name or normalised dn).
+ * @param[in] member whether the user is a member of the group.
+ */
+void rlm_ldap_group_cache_check_store(rlm_ldap_t const *inst, REQUEST *request, char const *dn,
+				      VALUE_PAIR const *check, bool member)
+{
+	ldap_group_cache_entry_t	*entry;
+	ldap_group_check_t		*gc;
+
+	if (!inst->group_cache) return;
+
+	GROUP_CACHE_LOCK(inst->group_cache);
+	entry = group_cache_get(inst, dn, request->packet->timestamp.tv_sec);
+	if (!entry) goto finish;
+
+	gc = talloc_zero(entry, ldap_group_check_t);
+	if (!gc) goto finish;
+
+	gc->group = talloc_bstrndup(gc, check->vp_strvalue, check->vp_length);
+	gc->member = member;
+	gc->next = entry->checks;
+	entry->checks = gc;
+
+finish:
+	GROUP_CACHE_UNLOCK(inst->group_cache);
+}
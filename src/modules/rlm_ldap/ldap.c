@@ -563,7 +563,9 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
  * @param[in] msgid	returned from last operation. May be -1 if no result
  *			processing is required.
  * @param[in] dn	Last search or bind DN.
- * @param[in] timeout	Override the default result timeout.
+ * @param[in] timeout	Override the default result timeout.  A zero timeout polls
+ *			for the result, returning #LDAP_PROC_CONTINUE if it hasn't
+ *			arrived yet.
  * @param[out] result	Where to write result, if NULL result will be freed.
  * @param[out] error	Where to write the error string, may be NULL, must
  *			not be freed.
@@ -632,6 +634,8 @@ ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
 	 */
 	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
 	if (lib_errno == 0) {
+		if (timeout && !fr_timeval_isset(timeout)) return LDAP_PROC_CONTINUE;
+
 		lib_errno = LDAP_TIMEOUT;
 
 		goto process_error;
@@ -1141,6 +1145,170 @@ finish:
 	return status;
 }
 
+/** Send a search to the LDAP directory without waiting for the result
+ *
+ * Binds as the administrative user if required, and sends the search.
+ * The result should be retrieved with #rlm_ldap_search_async_result once
+ * the connection's file descriptor becomes readable.
+ *
+ * @param[out] msgid Where to write the message ID of the search.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn to use as base for the search.
+ * @param[in] scope to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter to use, should be pre-escaped.
+ * @param[in] attrs to retrieve.
+ * @param[in] serverctrls Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls Search controls for ldap_search.  May be NULL.
+ * @return
+ *	- #LDAP_PROC_SUCCESS if the search was sent.
+ *	- #LDAP_PROC_RETRY if the connection failed.  The caller should reconnect.
+ *	- #LDAP_PROC_ERROR on any other error.
+ */
+ldap_rcode_t rlm_ldap_search_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request,
+				   ldap_handle_t **pconn,
+				   char const *dn, int scope, char const *filter, char const * const *attrs,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls)
+{
+	ldap_rcode_t	status;
+	struct timeval	tv;
+	char const 	*error = NULL;
+	char		*extra = NULL;
+	char		**search_attrs;
+
+	LDAPControl	*our_serverctrls[LDAP_MAX_CONTROLS];
+	LDAPControl	*our_clientctrls[LDAP_MAX_CONTROLS];
+
+	*msgid = -1;
+
+	rlm_ldap_control_merge(our_serverctrls, our_clientctrls,
+			       sizeof(our_serverctrls) / sizeof(*our_serverctrls),
+			       sizeof(our_clientctrls) / sizeof(*our_clientctrls),
+			       *pconn, serverctrls, clientctrls);
+
+	rad_assert(*pconn && (*pconn)->handle);
+
+	memcpy(&search_attrs, &attrs, sizeof(attrs));
+
+	/*
+	 *	Do all searches as the admin user.
+	 */
+	if ((*pconn)->rebound) {
+		status = rlm_ldap_bind(inst, request, pconn, (*pconn)->pool_inst->admin_identity,
+				       (*pconn)->pool_inst->admin_password, &(*pconn)->pool_inst->admin_sasl, true,
+				       NULL, NULL, NULL);
+		if (status != LDAP_PROC_SUCCESS) return LDAP_PROC_ERROR;
+
+		rad_assert(*pconn);
+
+		(*pconn)->rebound = false;
+	}
+
+	if (filter) {
+		RDEBUG("Sending search in \"%s\" with filter \"%s\", scope \"%s\"", dn, filter,
+		       fr_int2str(ldap_scope, scope, "<INVALID>"));
+	} else {
+		RDEBUG("Sending unfiltered search in \"%s\", scope \"%s\"", dn,
+		       fr_int2str(ldap_scope, scope, "<INVALID>"));
+	}
+
+	memset(&tv, 0, sizeof(tv));
+	tv.tv_sec = inst->res_timeout;
+
+	if (ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
+			    0, our_serverctrls, our_clientctrls, &tv, 0, msgid) == LDAP_SUCCESS) return LDAP_PROC_SUCCESS;
+
+	*msgid = -1;
+
+	/*
+	 *	No msgid, so this just processes the error
+	 *	recorded in the handle.
+	 */
+	status = rlm_ldap_result(inst, *pconn, -1, dn, NULL, NULL, &error, &extra);
+	if (status == LDAP_PROC_SUCCESS) status = LDAP_PROC_ERROR;
+
+	if (status == LDAP_PROC_RETRY) {
+		RWDEBUG("Failed sending search: %s", error);
+	} else {
+		REDEBUG("Failed sending search: %s", error);
+		if (extra) REDEBUG("%s", extra);
+	}
+	talloc_free(extra);
+
+	return status;
+}
+
+/** Check whether the result of a search sent with #rlm_ldap_search_async has arrived
+ *
+ * Never blocks.  Should be called when the connection's file descriptor
+ * becomes readable, and again each time it does, until it returns something
+ * other than #LDAP_PROC_CONTINUE.
+ *
+ * @param[out] result Where to store the result. Must be freed with ldap_msgfree if LDAP_PROC_SUCCESS is returned.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the search was sent on.
+ * @param[in] msgid of the search.
+ * @return
+ *	- #LDAP_PROC_CONTINUE if the result is incomplete.
+ *	- One of the other LDAP_PROC_* (#ldap_rcode_t) values, as for #rlm_ldap_search.
+ */
+ldap_rcode_t rlm_ldap_search_async_result(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+					  ldap_handle_t const *conn, int msgid)
+{
+	ldap_rcode_t	status;
+	struct timeval	tv = { 0, 0 };
+	char const 	*error = NULL;
+	char		*extra = NULL;
+	int		count;
+
+	*result = NULL;
+
+	status = rlm_ldap_result(inst, conn, msgid, NULL, &tv, result, &error, &extra);
+	switch (status) {
+	case LDAP_PROC_CONTINUE:
+		return status;
+
+	case LDAP_PROC_SUCCESS:
+		break;
+
+	case LDAP_PROC_BAD_DN:
+		RDEBUG("%s", error);
+		if (extra) RDEBUG("%s", extra);
+		goto finish;
+
+	case LDAP_PROC_RETRY:
+		RWDEBUG("Search failed: %s", error);
+		goto finish;
+
+	default:
+		REDEBUG("Failed performing search: %s", error);
+		if (extra) REDEBUG("%s", extra);
+		goto finish;
+	}
+
+	count = ldap_count_entries(conn->handle, *result);
+	if (count < 0) {
+		REDEBUG("Error counting results: %s", rlm_ldap_error_str(conn));
+		status = LDAP_PROC_ERROR;
+
+		ldap_msgfree(*result);
+		*result = NULL;
+	} else if (count == 0) {
+		RDEBUG("Search returned no results");
+		status = LDAP_PROC_NO_RESULT;
+
+		ldap_msgfree(*result);
+		*result = NULL;
+	}
+
+finish:
+	talloc_free(extra);
+
+	return status;
+}
+
 /** Modify something in the LDAP directory
  *
  * Binds as the administrative user and attempts to modify an LDAP object.
@@ -1249,105 +1417,63 @@ finish:
 	return status;
 }
 
-/** Retrieve the DN of a user object
- *
- * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
- * attributes passed and return the result in *result.
- *
- * This potentially allows for all authorization and authentication checks to be performed in one
- * ldap search operation, which is a big bonus given the number of crappy, slow *cough*AD*cough*
- * LDAP directory servers out there.
+/** Expand the base DN and filter used to search for user objects
  *
+ * @param[out] base_dn Where to write a pointer to the expanded base DN.
+ * @param[in] base_dn_buff Buffer to expand the base DN into, must be #LDAP_MAX_DN_STR_LEN bytes.
+ * @param[out] filter Where to write a pointer to the expanded filter.  NULL if no filter is configured.
+ * @param[in] filter_buff Buffer to expand the filter into, must be #LDAP_MAX_FILTER_STR_LEN bytes.
  * @param[in] inst rlm_ldap configuration.
  * @param[in] request Current request.
- * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
- * @param[in] attrs Additional attributes to retrieve, may be NULL.
- * @param[in] force Query even if the User-DN already exists.
- * @param[out] result Where to write the result, may be NULL in which case result is discarded.
- * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
- * @return The user's DN or NULL on error.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
-			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode)
+static int rlm_ldap_user_search_expand(char const **base_dn, char *base_dn_buff,
+				       char const **filter, char *filter_buff,
+				       rlm_ldap_t const *inst, REQUEST *request)
 {
-	static char const *tmp_attrs[] = { NULL };
-
-	ldap_rcode_t	status;
-	VALUE_PAIR	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
-	char const	*filter = NULL;
-	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
-	char const	*base_dn;
-	char	    	base_dn_buff[LDAP_MAX_DN_STR_LEN];
-	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
-
-	bool freeit = false;					//!< Whether the message should
-								//!< be freed after being processed.
-
-	*rcode = RLM_MODULE_FAIL;
-
-	if (!result) {
-		result = &tmp_msg;
-		freeit = true;
-	}
-	*result = NULL;
-
-	if (!attrs) {
-		memset(&attrs, 0, sizeof(tmp_attrs));
-	}
-
-	/*
-	 *	If the caller isn't looking for the result we can just return the current userdn value.
-	 */
-	if (!force) {
-		vp = fr_pair_find_by_num(request->control, 0, PW_LDAP_USERDN, TAG_ANY);
-		if (vp) {
-			RDEBUG("Using user DN from request \"%s\"", vp->vp_strvalue);
-			*rcode = RLM_MODULE_OK;
-			return vp->vp_strvalue;
-		}
-	}
-
-	/*
-	 *	Perform all searches as the admin user.
-	 */
-	if ((*pconn)->rebound) {
-		status = rlm_ldap_bind(inst, request, pconn, (*pconn)->pool_inst->admin_identity,
-				       (*pconn)->pool_inst->admin_password, &(*pconn)->pool_inst->admin_sasl, true,
-				       NULL, NULL, NULL);
-		if (status != LDAP_PROC_SUCCESS) {
-			*rcode = RLM_MODULE_FAIL;
-			return NULL;
-		}
-
-		rad_assert(*pconn);
-
-		(*pconn)->rebound = false;
-	}
+	*filter = NULL;
 
 	if (inst->userobj_filter) {
-		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
+		if (tmpl_expand(filter, filter_buff, LDAP_MAX_FILTER_STR_LEN, request, inst->userobj_filter,
 				rlm_ldap_escape_func, NULL) < 0) {
 			REDEBUG("Unable to create filter");
-			*rcode = RLM_MODULE_INVALID;
-
-			return NULL;
+			return -1;
 		}
 	}
 
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+	if (tmpl_expand(base_dn, base_dn_buff, LDAP_MAX_DN_STR_LEN, request,
 			inst->userobj_base_dn, rlm_ldap_escape_func, NULL) < 0) {
 		REDEBUG("Unable to create base_dn");
-		*rcode = RLM_MODULE_INVALID;
-
-		return NULL;
+		return -1;
 	}
 
-	status = rlm_ldap_search(result, inst, request, pconn, base_dn,
-				 inst->userobj_scope, filter, attrs, serverctrls, NULL);
+	return 0;
+}
+
+/** Process the result of a user object search
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the search was performed on.
+ * @param[in] status of the search.
+ * @param[in,out] result of the search.  Will be freed, and set to NULL, if the user
+ *	object wasn't found.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
+				      ldap_rcode_t status, LDAPMessage **result, rlm_rcode_t *rcode)
+{
+	VALUE_PAIR	*vp = NULL;
+	LDAPMessage	*entry = NULL;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn = NULL;
+
+	*rcode = RLM_MODULE_FAIL;
+
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -1358,11 +1484,10 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 		return NULL;
 
 	default:
-		*rcode = RLM_MODULE_FAIL;
 		return NULL;
 	}
 
-	rad_assert(*pconn);
+	rad_assert(conn);
 
 	/*
 	 *	Forbid the use of unsorted search results that
@@ -1370,16 +1495,16 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 	 *	security issue, and likely non deterministic.
 	 */
 	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
+		cnt = ldap_count_entries(conn->handle, *result);
 		if (cnt > 1) {
 			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
 				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
 			REDEBUG("The following entries were returned:");
 			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
+			for (entry = ldap_first_entry(conn->handle, *result);
 			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
+			     entry = ldap_next_entry(conn->handle, entry)) {
+				dn = ldap_get_dn(conn->handle, entry);
 				REDEBUG("%s", dn);
 				ldap_memfree(dn);
 			}
@@ -1389,18 +1514,18 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 		}
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
+	entry = ldap_first_entry(conn->handle, *result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s",
 			ldap_err2string(ldap_errno));
 
 		goto finish;
 	}
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
+	dn = ldap_get_dn(conn->handle, entry);
 	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
 		goto finish;
@@ -1424,7 +1549,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 	ldap_memfree(dn);
 
 finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
+	if ((*rcode != RLM_MODULE_OK) && *result) {
 		ldap_msgfree(*result);
 		*result = NULL;
 	}
@@ -1432,6 +1557,135 @@ finish:
 	return vp ? vp->vp_strvalue : NULL;
 }
 
+/** Send a search for a user object without waiting for the result
+ *
+ * The result should be retrieved with #rlm_ldap_search_async_result, and
+ * processed with #rlm_ldap_find_user_result.
+ *
+ * @param[out] msgid Where to write the message ID of the search.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] attrs Additional attributes to retrieve, may be NULL.
+ * @param[out] rcode The status of the operation if the search couldn't be sent,
+ *	one of the RLM_MODULE_* codes.
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values, as for #rlm_ldap_search_async.
+ */
+ldap_rcode_t rlm_ldap_find_user_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
+				      char const *attrs[], rlm_rcode_t *rcode)
+{
+	char const	*filter;
+	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const	*base_dn;
+	char	    	base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	*rcode = RLM_MODULE_FAIL;
+	*msgid = -1;
+
+	if (rlm_ldap_user_search_expand(&base_dn, base_dn_buff, &filter, filter_buff, inst, request) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return LDAP_PROC_ERROR;
+	}
+
+	return rlm_ldap_search_async(msgid, inst, request, pconn, base_dn,
+				     inst->userobj_scope, filter, attrs, serverctrls, NULL);
+}
+
+/** Retrieve the DN of a user object
+ *
+ * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
+ * attributes passed and return the result in *result.
+ *
+ * This potentially allows for all authorization and authentication checks to be performed in one
+ * ldap search operation, which is a big bonus given the number of crappy, slow *cough*AD*cough*
+ * LDAP directory servers out there.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] attrs Additional attributes to retrieve, may be NULL.
+ * @param[in] force Query even if the User-DN already exists.
+ * @param[out] result Where to write the result, may be NULL in which case result is discarded.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
+			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode)
+{
+	static char const *tmp_attrs[] = { NULL };
+
+	ldap_rcode_t	status;
+	VALUE_PAIR	*vp = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn;
+	char const	*filter;
+	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const	*base_dn;
+	char	    	base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	bool freeit = false;					//!< Whether the message should
+								//!< be freed after being processed.
+
+	*rcode = RLM_MODULE_FAIL;
+
+	if (!result) {
+		result = &tmp_msg;
+		freeit = true;
+	}
+	*result = NULL;
+
+	if (!attrs) {
+		memset(&attrs, 0, sizeof(tmp_attrs));
+	}
+
+	/*
+	 *	If the caller isn't looking for the result we can just return the current userdn value.
+	 */
+	if (!force) {
+		vp = fr_pair_find_by_num(request->control, 0, PW_LDAP_USERDN, TAG_ANY);
+		if (vp) {
+			RDEBUG("Using user DN from request \"%s\"", vp->vp_strvalue);
+			*rcode = RLM_MODULE_OK;
+			return vp->vp_strvalue;
+		}
+	}
+
+	/*
+	 *	Perform all searches as the admin user.
+	 */
+	if ((*pconn)->rebound) {
+		status = rlm_ldap_bind(inst, request, pconn, (*pconn)->pool_inst->admin_identity,
+				       (*pconn)->pool_inst->admin_password, &(*pconn)->pool_inst->admin_sasl, true,
+				       NULL, NULL, NULL);
+		if (status != LDAP_PROC_SUCCESS) {
+			*rcode = RLM_MODULE_FAIL;
+			return NULL;
+		}
+
+		rad_assert(*pconn);
+
+		(*pconn)->rebound = false;
+	}
+
+	if (rlm_ldap_user_search_expand(&base_dn, base_dn_buff, &filter, filter_buff, inst, request) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
+
+	status = rlm_ldap_search(result, inst, request, pconn, base_dn,
+				 inst->userobj_scope, filter, attrs, serverctrls, NULL);
+
+	dn = rlm_ldap_find_user_result(inst, request, *pconn, status, result, rcode);
+	if (freeit && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
+	}
+
+	return dn;
+}
+
 /** Check for presence of access attribute in result
  *
  * @param[in] inst rlm_ldap configuration.
@@ -145,12 +145,15 @@ static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("base_dn", PW_TYPE_TMPL, rlm_ldap_t, groupobj_base_dn), .dflt = "", .quote = T_SINGLE_QUOTED_STRING },
 
 	{ FR_CONF_OFFSET("name_attribute", PW_TYPE_STRING, rlm_ldap_t, groupobj_name_attr), .dflt = "cn" },
+	{ FR_CONF_OFFSET("dn_attribute", PW_TYPE_STRING, rlm_ldap_t, groupobj_dn_attr) },
 	{ FR_CONF_OFFSET("membership_attribute", PW_TYPE_STRING, rlm_ldap_t, userobj_membership_attr) },
 	{ FR_CONF_OFFSET("membership_filter", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_ldap_t, groupobj_membership_filter) },
 	{ FR_CONF_OFFSET("cacheable_name", PW_TYPE_BOOLEAN, rlm_ldap_t, cacheable_group_name), .dflt = "no" },
 	{ FR_CONF_OFFSET("cacheable_dn", PW_TYPE_BOOLEAN, rlm_ldap_t, cacheable_group_dn), .dflt = "no" },
 	{ FR_CONF_OFFSET("cache_attribute", PW_TYPE_STRING, rlm_ldap_t, cache_attribute) },
 	{ FR_CONF_OFFSET("group_attribute", PW_TYPE_STRING, rlm_ldap_t, group_attribute) },
+	{ FR_CONF_OFFSET("membership_cache_ttl", PW_TYPE_INTEGER, rlm_ldap_t, group_cache_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("membership_cache_max_entries", PW_TYPE_INTEGER, rlm_ldap_t, group_cache_size), .dflt = "4096" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -214,6 +217,9 @@ static CONF_PARSER option_config[] = {
 	/* timeout for search results */
 	{ FR_CONF_OFFSET("res_timeout", PW_TYPE_INTEGER, rlm_ldap_t, res_timeout), .dflt = "20" },
 
+	/* yield while waiting for search results */
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, rlm_ldap_t, async), .dflt = "no" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -631,6 +637,21 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+	/*
+	 *	Check if we've seen this user and group recently
+	 */
+	switch (rlm_ldap_group_cache_check(inst, request, user_dn, check)) {
+	case RLM_MODULE_OK:
+		found = true;
+		goto finish;
+
+	case RLM_MODULE_NOTFOUND:
+		goto finish;
+
+	default:
+		break;
+	}
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -641,6 +662,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			goto store;
 
 		default:
 			goto finish;
@@ -659,6 +681,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			goto store;
 
 		default:
 			goto finish;
@@ -667,6 +690,9 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+store:
+	rlm_ldap_group_cache_check_store(inst, request, user_dn, check, found);
+
 finish:
 	if (conn) mod_conn_release(inst, request, conn);
 
@@ -879,93 +905,73 @@ free_result:
 	return rcode;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+/** Check access, and cache group memberships from the user object
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] result of the user object search.
+ * @param[in] cached true if group memberships were added from the membership cache.
+ * @return One of the RLM_MODULE_* values.  Processing should only continue on #RLM_MODULE_OK.
+ */
+static rlm_rcode_t rlm_ldap_authorize_user(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
+					   LDAPMessage *result, bool cached)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-	ldap_rcode_t		status;
-	int			ldap_errno;
-	int			i;
-	rlm_ldap_t const	*inst = instance;
-	struct berval		**values;
-	VALUE_PAIR		*vp;
-	ldap_handle_t		*conn;
-	LDAPMessage		*result, *entry;
-	char const 		*dn = NULL;
-	rlm_ldap_map_exp_t	expanded; /* faster than allocing every time */
-
-	/*
-	 *	Don't be tempted to add a check for request->username
-	 *	or request->password here. rlm_ldap.authorize can be used for
-	 *	many things besides searching for users.
-	 */
-
-	if (rlm_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
-
-	conn = mod_conn_get(inst, request);
-	if (!conn) return RLM_MODULE_FAIL;
-
-	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
-	 */
-	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
-	}
-
-	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
-	}
-
-	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
-	}
-
-	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
-	}
-
-	expanded.attrs[expanded.count] = NULL;
-
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
-		goto finish;
-	}
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	LDAPMessage	*entry;
+	int		ldap_errno;
 
-	entry = ldap_first_entry(conn->handle, result);
+	entry = ldap_first_entry((*pconn)->handle, result);
 	if (!entry) {
-		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	/*
 	 *	Check for access.
 	 */
 	if (inst->userobj_access_attr) {
-		rcode = rlm_ldap_check_access(inst, request, conn, entry);
-		if (rcode != RLM_MODULE_OK) {
-			goto finish;
-		}
+		rcode = rlm_ldap_check_access(inst, request, *pconn, entry);
+		if (rcode != RLM_MODULE_OK) return rcode;
 	}
 
 	/*
 	 *	Check if we need to cache group memberships
 	 */
-	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
-		if (inst->userobj_membership_attr) {
-			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
-			if (rcode != RLM_MODULE_OK) {
-				goto finish;
-			}
-		}
-
-		rcode = rlm_ldap_cacheable_groupobj(inst, request, &conn);
-		if (rcode != RLM_MODULE_OK) {
-			goto finish;
-		}
+	if (!cached && (inst->cacheable_group_dn || inst->cacheable_group_name) && inst->userobj_membership_attr) {
+		rcode = rlm_ldap_cacheable_userobj(inst, request, pconn, entry, inst->userobj_membership_attr);
 	}
 
+	return rcode;
+}
+
+/** Retrieve passwords, and apply profiles and the user map
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn of the user object.
+ * @param[in] result of the user object search.
+ * @param[in] expanded attribute names and mapping information.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t rlm_ldap_authorize_apply(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
+					    char const *dn, LDAPMessage *result, rlm_ldap_map_exp_t *expanded)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	int			i;
+	struct berval		**values;
+	LDAPMessage		*entry;
+#ifdef WITH_EDIR
+	ldap_rcode_t		status;
+	VALUE_PAIR		*vp;
+#endif
+
+	entry = ldap_first_entry((*pconn)->handle, result);
+	if (!entry) return RLM_MODULE_FAIL;
+
 #ifdef WITH_EDIR
 	/*
 	 *	We already have a Cleartext-Password.  Skip edir.
@@ -985,7 +991,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		/*
 		 *	Retrive universal password
 		 */
-		res = nmasldap_get_password(conn->handle, dn, password, &pass_size);
+		res = nmasldap_get_password((*pconn)->handle, dn, password, &pass_size);
 		if (res != 0) {
 			REDEBUG("Failed to retrieve eDirectory password: (%i) %s", res, edir_errstr(res));
 			rcode = RLM_MODULE_FAIL;
@@ -1011,8 +1017,8 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 			/*
 			 *	Bind as the user
 			 */
-			conn->rebound = true;
-			status = rlm_ldap_bind(inst, request, &conn, dn, vp->vp_strvalue, NULL, true, NULL, NULL, NULL);
+			(*pconn)->rebound = true;
+			status = rlm_ldap_bind(inst, request, pconn, dn, vp->vp_strvalue, NULL, true, NULL, NULL, NULL);
 			switch (status) {
 			case LDAP_PROC_SUCCESS:
 				rcode = RLM_MODULE_OK;
@@ -1060,7 +1066,7 @@ skip_edir:
 			goto finish;
 		}
 
-		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &expanded)) {
+		switch (rlm_ldap_map_profile(inst, request, pconn, profile, expanded)) {
 		case RLM_MODULE_INVALID:
 			rcode = RLM_MODULE_INVALID;
 			goto finish;
@@ -1081,14 +1087,14 @@ skip_edir:
 	 *	Apply a SET of user profiles.
 	 */
 	if (inst->profile_attr) {
-		values = ldap_get_values_len(conn->handle, entry, inst->profile_attr);
+		values = ldap_get_values_len((*pconn)->handle, entry, inst->profile_attr);
 		if (values != NULL) {
 			for (i = 0; values[i] != NULL; i++) {
 				rlm_rcode_t ret;
 				char *value;
 
 				value = rlm_ldap_berval_to_string(request, values[i]);
-				ret = rlm_ldap_map_profile(inst, request, &conn, value, &expanded);
+				ret = rlm_ldap_map_profile(inst, request, pconn, value, expanded);
 				talloc_free(value);
 				if (ret == RLM_MODULE_FAIL) {
 					ldap_value_free_len(values);
@@ -1104,11 +1110,327 @@ skip_edir:
 	if (inst->user_map || inst->valuepair_attr) {
 		RDEBUG("Processing user attributes");
 		RINDENT();
-		if (rlm_ldap_map_do(inst, request, conn->handle, &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+		if (rlm_ldap_map_do(inst, request, (*pconn)->handle, expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 		REXDENT();
-		rlm_ldap_check_reply(inst, request, conn);
+		rlm_ldap_check_reply(inst, request, *pconn);
 	}
 
+finish:
+	return rcode;
+}
+
+/** Authorize state for requests waiting on LDAP searches
+ *
+ */
+typedef enum {
+	LDAP_AUTZ_FIND_USER = 0,			//!< Waiting for the user object.
+	LDAP_AUTZ_GROUPOBJ				//!< Waiting for group objects referencing the user.
+} ldap_autz_state_t;
+
+/** Holds the state of an authorize call while the request is yielded
+ *
+ */
+typedef struct ldap_autz_ctx {
+	rlm_ldap_t const	*inst;
+	REQUEST			*request;
+
+	ldap_handle_t		*conn;			//!< Held until authorize completes.
+	rlm_ldap_map_exp_t	expanded;		//!< Attributes to retrieve from the user object.
+
+	ldap_autz_state_t	state;			//!< Which search we're waiting for.
+	int			msgid;			//!< Of the outstanding search, or -1.
+	int			fd;			//!< Of the connection.
+	ldap_rcode_t		status;			//!< Of the last search.
+	bool			timed_out;		//!< No result arrived within res_timeout.
+
+	char const		*dn;			//!< Of the user object.
+	LDAPMessage		*result;		//!< User object.
+	LDAPMessage		*groups;		//!< Group objects referencing the user.
+} ldap_autz_ctx_t;
+
+static int _autz_ctx_free(ldap_autz_ctx_t *actx)
+{
+	/*
+	 *	Let the server know we're no longer interested,
+	 *	libldap will discard the result if it arrives.
+	 */
+	if (actx->conn && (actx->msgid >= 0)) ldap_abandon_ext(actx->conn->handle, actx->msgid, NULL, NULL);
+
+	if (actx->result) ldap_msgfree(actx->result);
+	if (actx->groups) ldap_msgfree(actx->groups);
+	talloc_free(actx->expanded.ctx);
+
+	if (actx->conn) mod_conn_release(actx->inst, actx->request, actx->conn);
+
+	return 0;
+}
+
+/** Called when the connection becomes readable
+ *
+ */
+static void mod_authorize_readable(REQUEST *request, void *instance, UNUSED void *thread, void *ctx,
+				   UNUSED int fd)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*actx = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+
+	actx->status = rlm_ldap_search_async_result(actx->state == LDAP_AUTZ_FIND_USER ?
+						    &actx->result : &actx->groups,
+						    inst, request, actx->conn, actx->msgid);
+	if (actx->status == LDAP_PROC_CONTINUE) return;
+
+	actx->msgid = -1;
+
+	(void) unlang_event_timeout_delete(request, actx);
+	(void) unlang_event_fd_delete(request, actx, actx->fd);
+	unlang_resumable(request);
+}
+
+/** Called if the result doesn't arrive within res_timeout
+ *
+ */
+static void mod_authorize_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				  UNUSED struct timeval *fired)
+{
+	ldap_autz_ctx_t		*actx = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+
+	actx->timed_out = true;
+	(void) unlang_event_fd_delete(request, actx, actx->fd);
+	unlang_resumable(request);
+}
+
+/** Stop waiting for search results if the request is cancelled
+ *
+ */
+static void mod_authorize_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				 fr_state_action_t action)
+{
+	ldap_autz_ctx_t		*actx = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending LDAP search");
+
+	(void) unlang_event_timeout_delete(request, actx);
+	(void) unlang_event_fd_delete(request, actx, actx->fd);
+	talloc_free(actx);
+}
+
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
+/** Wait for the result of the outstanding search
+ *
+ */
+static rlm_rcode_t mod_authorize_yield(rlm_ldap_t const *inst, REQUEST *request, ldap_autz_ctx_t *actx)
+{
+	struct timeval when;
+
+	if ((ldap_get_option(actx->conn->handle, LDAP_OPT_DESC, &actx->fd) != LDAP_OPT_SUCCESS) || (actx->fd < 0)) {
+		REDEBUG("Failed retrieving LDAP connection file descriptor");
+	error:
+		talloc_free(actx);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (unlang_event_fd_readable_add(request, mod_authorize_readable, actx, actx->fd) < 0) {
+		REDEBUG("Failed adding LDAP connection to event loop");
+		goto error;
+	}
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += inst->res_timeout;
+
+	if (unlang_event_timeout_add(request, mod_authorize_timeout, actx, &when) < 0) {
+		(void) unlang_event_fd_delete(request, actx, actx->fd);
+		goto error;
+	}
+
+	RDEBUG("Waiting for search result...");
+
+	return unlang_yield(request, mod_authorize_resume, mod_authorize_action, actx);
+}
+
+/** Process the result of a search, and send the next one
+ *
+ * If a search failed because of a connection error, or timed out, it's retried
+ * synchronously, the same as when async mode is disabled.
+ */
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*actx = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+	rlm_rcode_t		rcode = RLM_MODULE_FAIL;
+	bool			cached;
+
+	if (actx->timed_out) {
+		REDEBUG("Timed out while waiting for server to respond");
+		trigger_exec(NULL, inst->cs, "modules.ldap.timeout", true, NULL);
+
+		ldap_abandon_ext(actx->conn->handle, actx->msgid, NULL, NULL);
+		actx->msgid = -1;
+		actx->timed_out = false;
+		actx->status = LDAP_PROC_RETRY;
+	}
+
+	if (actx->state == LDAP_AUTZ_GROUPOBJ) goto groupobj;
+
+	if (actx->status == LDAP_PROC_RETRY) {
+		actx->dn = rlm_ldap_find_user(inst, request, &actx->conn, actx->expanded.attrs, true,
+					      &actx->result, &rcode);
+	} else {
+		actx->dn = rlm_ldap_find_user_result(inst, request, actx->conn, actx->status, &actx->result, &rcode);
+	}
+	if (!actx->dn) goto finish;
+
+	if (!inst->cacheable_group_dn && !inst->cacheable_group_name) {
+		cached = true;		/* Nothing to resolve */
+	} else {
+		cached = (rlm_ldap_group_cache_copy(inst, request, actx->dn) == RLM_MODULE_OK);
+	}
+
+	rcode = rlm_ldap_authorize_user(inst, request, &actx->conn, actx->result, cached);
+	if ((rcode != RLM_MODULE_OK) || cached) goto finish_user;
+
+	actx->state = LDAP_AUTZ_GROUPOBJ;
+	actx->status = rlm_ldap_cacheable_groupobj_async(&actx->msgid, inst, request, &actx->conn, &rcode);
+	switch (actx->status) {
+	case LDAP_PROC_SUCCESS:
+		return mod_authorize_yield(inst, request, actx);
+
+	case LDAP_PROC_NO_RESULT:	/* Nothing to search for */
+		rcode = RLM_MODULE_OK;
+		goto store;
+
+	case LDAP_PROC_RETRY:
+		break;
+
+	default:
+		goto finish;
+	}
+
+groupobj:
+	if (actx->status == LDAP_PROC_RETRY) {
+		rcode = rlm_ldap_cacheable_groupobj(inst, request, &actx->conn);
+	} else {
+		rcode = rlm_ldap_cacheable_groupobj_result(inst, request, actx->conn, actx->status, actx->groups);
+		actx->groups = NULL;
+	}
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+store:
+	rlm_ldap_group_cache_store(inst, request, actx->dn);
+
+finish_user:
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	rcode = rlm_ldap_authorize_apply(inst, request, &actx->conn, actx->dn, actx->result, &actx->expanded);
+
+finish:
+	talloc_free(actx);
+
+	return rcode;
+}
+
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	rlm_ldap_t const	*inst = instance;
+	ldap_handle_t		*conn;
+	LDAPMessage		*result = NULL;
+	char const 		*dn = NULL;
+	rlm_ldap_map_exp_t	expanded; /* faster than allocing every time */
+	ldap_autz_ctx_t		*actx;
+	bool			cached;
+
+	/*
+	 *	Don't be tempted to add a check for request->username
+	 *	or request->password here. rlm_ldap.authorize can be used for
+	 *	many things besides searching for users.
+	 */
+
+	if (rlm_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
+
+	conn = mod_conn_get(inst, request);
+	if (!conn) {
+		talloc_free(expanded.ctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 */
+	if (inst->userobj_access_attr) {
+		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
+	}
+
+	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
+	}
+
+	if (inst->profile_attr) {
+		expanded.attrs[expanded.count++] = inst->profile_attr;
+	}
+
+	if (inst->valuepair_attr) {
+		expanded.attrs[expanded.count++] = inst->valuepair_attr;
+	}
+
+	expanded.attrs[expanded.count] = NULL;
+
+	/*
+	 *	Send the search, and yield until the result arrives,
+	 *	instead of blocking the worker.  The connection is
+	 *	held until authorize completes.
+	 */
+	if (inst->async) {
+		MEM(actx = talloc_zero(request, ldap_autz_ctx_t));
+		actx->inst = inst;
+		actx->request = request;
+		actx->conn = conn;
+		actx->expanded = expanded;
+		actx->msgid = -1;
+		actx->fd = -1;
+		talloc_set_destructor(actx, _autz_ctx_free);
+
+		actx->state = LDAP_AUTZ_FIND_USER;
+		actx->status = rlm_ldap_find_user_async(&actx->msgid, inst, request, &actx->conn,
+							actx->expanded.attrs, &rcode);
+		switch (actx->status) {
+		case LDAP_PROC_SUCCESS:
+			return mod_authorize_yield(inst, request, actx);
+
+		case LDAP_PROC_RETRY:
+			return mod_authorize_resume(request, instance, thread, actx);
+
+		default:
+			talloc_free(actx);
+			return rcode;
+		}
+	}
+
+	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
+	if (!dn) goto finish;
+
+	/*
+	 *	Use the memberships we resolved for this user
+	 *	recently, instead of searching for them again.
+	 */
+	cached = (inst->cacheable_group_dn || inst->cacheable_group_name) &&
+		 (rlm_ldap_group_cache_copy(inst, request, dn) == RLM_MODULE_OK);
+
+	rcode = rlm_ldap_authorize_user(inst, request, &conn, result, cached);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	if (!cached && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		rcode = rlm_ldap_cacheable_groupobj(inst, request, &conn);
+		if (rcode != RLM_MODULE_OK) goto finish;
+
+		rlm_ldap_group_cache_store(inst, request, dn);
+	}
+
+	rcode = rlm_ldap_authorize_apply(inst, request, &conn, dn, result, &expanded);
+
 finish:
 	talloc_free(expanded.ctx);
 	if (result) ldap_msgfree(result);
@@ -1383,6 +1705,7 @@ static int mod_detach(void *instance)
 
 	fr_connection_pool_free(inst->pool);
 	talloc_free(inst->user_map);
+	rlm_ldap_group_cache_free(inst->group_cache);
 
 	return 0;
 }
@@ -1940,6 +2263,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) goto error;
 
+	/*
+	 *	Cache group memberships between requests.
+	 */
+	if (inst->group_cache_ttl > 0) {
+		inst->group_cache = rlm_ldap_group_cache_alloc(inst);
+		if (!inst->group_cache) goto error;
+	}
+
 	/*
 	 *	Bulk load dynamic clients.
 	 */
@@ -134,6 +134,7 @@ typedef enum {
 extern FR_NAME_NUMBER const ldap_supported_extensions[];
 
 typedef struct rlm_ldap_s rlm_ldap_t;
+typedef struct ldap_group_cache ldap_group_cache_t;
 
 typedef struct ldap_acct_section {
 	CONF_SECTION	*cs;				//!< Section configuration.
@@ -293,6 +294,9 @@ struct rlm_ldap_s {
 	 */
 	uint32_t	res_timeout;			//!< How long we wait for a result from the server.
 
+	bool		async;				//!< Yield the request while waiting for the results
+							//!< of user and group object searches in authorize.
+
 	/*
 	 *	User object attributes and filters
 	 */
@@ -324,6 +328,8 @@ struct rlm_ldap_s {
 	int		groupobj_scope;			//!< Search scope.
 
 	char const	*groupobj_name_attr;		//!< The name of the group.
+	char const	*groupobj_dn_attr;		//!< Attribute of the group object containing its DN,
+							//!< used to resolve many group DNs with a single search.
 	char const	*groupobj_membership_filter;	//!< Filter to only retrieve groups which contain
 							//!< the user as a member.
 
@@ -349,6 +355,11 @@ struct rlm_ldap_s {
 	fr_dict_attr_t const	*group_da;		//!< The DA associated with this specific instance of the
 							//!< rlm_ldap module.
 
+	uint32_t	group_cache_ttl;		//!< How long group memberships are cached for.
+	uint32_t	group_cache_size;		//!< Maximum number of user objects in the membership cache.
+
+	ldap_group_cache_t	*group_cache;		//!< Group memberships of recently seen user objects.
+
 	/*
 	 *	Dynamic clients
 	 */
@@ -502,6 +513,14 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 			     char const *dn, int scope, char const *filter, char const * const *attrs,
 			     LDAPControl **serverctrls, LDAPControl **clientctrls);
 
+ldap_rcode_t rlm_ldap_search_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request,
+				   ldap_handle_t **pconn,
+				   char const *dn, int scope, char const *filter, char const * const *attrs,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls);
+
+ldap_rcode_t rlm_ldap_search_async_result(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+					  ldap_handle_t const *conn, int msgid);
+
 ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 			     char const *dn, LDAPMod *mods[],
 			     LDAPControl **serverctrls, LDAPControl **clientctrls);
@@ -509,6 +528,12 @@ ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_hand
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+ldap_rcode_t rlm_ldap_find_user_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
+				      char const *attrs[], rlm_rcode_t *rcode);
+
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
+				      ldap_rcode_t status, LDAPMessage **result, rlm_rcode_t *rcode);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
 				  LDAPMessage *entry);
 
@@ -539,6 +564,12 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 
 rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn);
 
+ldap_rcode_t rlm_ldap_cacheable_groupobj_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request,
+					       ldap_handle_t **pconn, rlm_rcode_t *rcode);
+
+rlm_rcode_t rlm_ldap_cacheable_groupobj_result(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
+					       ldap_rcode_t status, LDAPMessage *result);
+
 rlm_rcode_t rlm_ldap_check_groupobj_dynamic(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 					    VALUE_PAIR *check);
 
@@ -547,6 +578,20 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+ldap_group_cache_t *rlm_ldap_group_cache_alloc(rlm_ldap_t const *inst);
+
+void rlm_ldap_group_cache_free(ldap_group_cache_t *cache);
+
+rlm_rcode_t rlm_ldap_group_cache_copy(rlm_ldap_t const *inst, REQUEST *request, char const *dn);
+
+void rlm_ldap_group_cache_store(rlm_ldap_t const *inst, REQUEST *request, char const *dn);
+
+rlm_rcode_t rlm_ldap_group_cache_check(rlm_ldap_t const *inst, REQUEST *request, char const *dn,
+				       VALUE_PAIR const *check);
+
+void rlm_ldap_group_cache_check_store(rlm_ldap_t const *inst, REQUEST *request, char const *dn,
+				      VALUE_PAIR const *check, bool member);
+
 /*
  *	attrmap.c - Attribute mapping code.
  */
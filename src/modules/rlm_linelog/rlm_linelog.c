@@ -58,6 +58,32 @@ typedef enum {
 	LINELOG_DST_TCP,				//!< Log via TCP.
 } linelog_dst_t;
 
+typedef enum {
+	LINELOG_OVERFLOW_INVALID = 0,
+	LINELOG_OVERFLOW_BLOCK,				//!< Wait for the writer to catch up.
+	LINELOG_OVERFLOW_DROP,				//!< Discard the line.
+	LINELOG_OVERFLOW_FILE,				//!< Write the line to a file.
+} linelog_overflow_t;
+
+static FR_NAME_NUMBER const linelog_overflow_table[] = {
+	{ "block",	LINELOG_OVERFLOW_BLOCK	},
+	{ "drop",	LINELOG_OVERFLOW_DROP	},
+	{ "file",	LINELOG_OVERFLOW_FILE	},
+
+	{  NULL , -1 }
+};
+
+/** Lines waiting to be sent
+ *
+ */
+typedef struct linelog_batch {
+	uint8_t			*data;			//!< Messages, back to back.
+	size_t			used;			//!< How much of data is in use.
+	uint32_t		*lens;			//!< Length of each message.
+	uint32_t		num;			//!< Number of messages.
+	uint32_t		alloced;		//!< Number of entries in lens.
+} linelog_batch_t;
+
 static FR_NAME_NUMBER const linelog_dst_table[] = {
 	{ "file",	LINELOG_DST_FILE	},
 	{ "syslog",	LINELOG_DST_SYSLOG	},
@@ -106,6 +132,8 @@ typedef struct linelog_instance_t {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_t		escape_func;		//!< Escape function.
+		bool			async;			//!< Buffer writes, and write them from a separate thread.
+		bool			fsync;			//!< fsync() after each batch of buffered writes.
 	} file;
 
 	struct {
@@ -116,6 +144,30 @@ typedef struct linelog_instance_t {
 	linelog_net_t		tcp;			//!< TCP server.
 	linelog_net_t		udp;			//!< UDP server.
 
+	struct {
+		bool			enable;			//!< Buffer messages, and send them from a separate thread.
+		uint32_t		interval;		//!< Maximum time messages are buffered, in milliseconds.
+		uint32_t		max_pending;		//!< Maximum amount of data buffered.
+		char const		*overflow_str;		//!< What to do when the buffer is full.
+		linelog_overflow_t	overflow;		//!< Resolved version of overflow_str.
+		char const		*overflow_file;		//!< Where messages go when overflow = file.
+		exfile_t		*ef;			//!< Exclusive file access handle for overflow_file.
+
+		bool			running;		//!< The writer thread has been started.
+		bool			stop;			//!< Tell the writer to flush and exit.
+		linelog_batch_t		*pending;		//!< Messages being added by the workers.
+		linelog_batch_t		*writing;		//!< Messages being sent by the writer.
+
+		uint64_t		flushed;		//!< Messages sent.
+		uint64_t		dropped;		//!< Messages discarded.
+		uint64_t		spilled;		//!< Messages written to overflow_file.
+
+		pthread_t		thread;			//!< The writer thread.
+		pthread_mutex_t		mutex;			//!< Protects everything in this struct.
+		pthread_cond_t		wakeup;			//!< Signalled to wake up the writer.
+		pthread_cond_t		drained;		//!< Signalled when the writer has taken a batch.
+	} buffer;
+
 	CONF_SECTION		*cs;			//!< #CONF_SECTION to use as the root for #log_ref lookups.
 } linelog_instance_t;
 
@@ -129,6 +181,8 @@ static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("permissions", PW_TYPE_INTEGER, linelog_instance_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", PW_TYPE_STRING, linelog_instance_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, linelog_instance_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, linelog_instance_t, file.async), .dflt = "no" },
+	{ FR_CONF_OFFSET("fsync", PW_TYPE_BOOLEAN, linelog_instance_t, file.fsync), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -157,6 +211,15 @@ static const CONF_PARSER tcp_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER buffer_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, linelog_instance_t, buffer.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("interval", PW_TYPE_INTEGER, linelog_instance_t, buffer.interval), .dflt = "100" },
+	{ FR_CONF_OFFSET("max_pending", PW_TYPE_INTEGER, linelog_instance_t, buffer.max_pending), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("overflow", PW_TYPE_STRING, linelog_instance_t, buffer.overflow_str), .dflt = "block" },
+	{ FR_CONF_OFFSET("overflow_file", PW_TYPE_FILE_OUTPUT, linelog_instance_t, buffer.overflow_file) },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", PW_TYPE_STRING | PW_TYPE_REQUIRED, linelog_instance_t, log_dst_str) },
 
@@ -173,6 +236,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("tcp", PW_TYPE_SUBSECTION, linelog_instance_t, tcp), .subcs= (void const *) tcp_config },
 	{ FR_CONF_OFFSET("udp", PW_TYPE_SUBSECTION, linelog_instance_t, udp), .subcs = (void const *) udp_config },
 
+	{ FR_CONF_POINTER("buffer", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) buffer_config },
+
 	/*
 	 *	Deprecated config items
 	 */
@@ -282,10 +347,440 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval con
 	return conn;
 }
 
+/** Get the write timeout for the current destination
+ *
+ */
+static struct timeval *linelog_timeout(linelog_instance_t *inst)
+{
+	struct timeval *timeout;
+
+	switch (inst->log_dst) {
+	case LINELOG_DST_UNIX:
+		timeout = &inst->unix_sock.timeout;
+		break;
+
+	case LINELOG_DST_UDP:
+		timeout = &inst->udp.timeout;
+		break;
+
+	case LINELOG_DST_TCP:
+		timeout = &inst->tcp.timeout;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (!timeout->tv_sec && !timeout->tv_usec) return NULL;
+
+	return timeout;
+}
+
+/** Write a batch of messages to a socket
+ *
+ * For UDP each message is sent as its own datagram.  For stream sockets
+ * the whole batch is written at once.
+ *
+ * @return
+ *	- The number of messages written.
+ *	- -1 on error, errno is set.
+ */
+static int linelog_batch_write(linelog_instance_t *inst, linelog_conn_t *conn, linelog_batch_t *batch)
+{
+	struct iovec	vector;
+	uint32_t	i;
+
+	if (inst->log_dst != LINELOG_DST_UDP) {
+		vector.iov_base = batch->data;
+		vector.iov_len = batch->used;
+
+		if (fr_writev(conn->sockfd, &vector, 1, linelog_timeout(inst)) < 0) return -1;
+
+		return batch->num;
+	}
+
+#ifdef HAVE_SENDMMSG
+	{
+#  define LINELOG_BURST (64)
+		struct mmsghdr	msgs[LINELOG_BURST];
+		struct iovec	iov[LINELOG_BURST];
+		uint8_t		*p = batch->data;
+		uint32_t	num, sent;
+		int		rcode;
+
+		for (i = 0; i < batch->num; i += num) {
+			uint32_t j;
+
+			num = batch->num - i;
+			if (num > LINELOG_BURST) num = LINELOG_BURST;
+
+			memset(msgs, 0, sizeof(msgs[0]) * num);
+			for (j = 0; j < num; j++) {
+				iov[j].iov_base = p;
+				iov[j].iov_len = batch->lens[i + j];
+				p += batch->lens[i + j];
+
+				msgs[j].msg_hdr.msg_iov = &iov[j];
+				msgs[j].msg_hdr.msg_iovlen = 1;
+			}
+
+			/*
+			 *	sendmmsg() may send only part of the
+			 *	burst.  If the socket is full, the rest
+			 *	of the batch is dropped, just as send()
+			 *	would drop it.
+			 */
+			sent = 0;
+			while (sent < num) {
+				rcode = sendmmsg(conn->sockfd, &msgs[sent], num - sent, 0);
+				if (rcode < 0) {
+					if (errno == EINTR) continue;
+					if ((i + sent) == 0) return -1;
+					return i + sent;
+				}
+				sent += rcode;
+			}
+		}
+	}
+#else
+	{
+		uint8_t *p = batch->data;
+
+		for (i = 0; i < batch->num; i++) {
+			if (send(conn->sockfd, p, batch->lens[i], 0) < 0) {
+				if (i == 0) return -1;
+				return i;
+			}
+			p += batch->lens[i];
+		}
+	}
+#endif
+
+	return batch->num;
+}
+
+/** Send a batch of messages, reconnecting if necessary
+ *
+ */
+static void linelog_flush(linelog_instance_t *inst, linelog_batch_t *batch)
+{
+	linelog_conn_t	*conn;
+	int		i, num, sent = 0;
+
+	conn = fr_connection_get(inst->pool, NULL);
+	if (!conn) goto finish;
+
+	num = fr_connection_pool_state(inst->pool)->num;
+	for (i = num; i >= 0; i--) {
+		char discard[64];
+
+		sent = linelog_batch_write(inst, conn, batch);
+		if (sent < 0) switch (errno) {
+		case EDESTADDRREQ:
+		case EPIPE:
+		case EBADF:
+		case ECONNRESET:
+		case ENETDOWN:
+		case ENETUNREACH:
+		case EADDRNOTAVAIL:
+			WARN("%s: Failed writing to socket: %s.  Will reconnect and try again...",
+			     inst->name, fr_syserror(errno));
+			sent = 0;
+			conn = fr_connection_reconnect(inst->pool, NULL, conn);
+			if (!conn) goto finish;
+			continue;
+
+		default:
+			ERROR("%s: Failed writing to socket: %s", inst->name, fr_syserror(errno));
+			sent = 0;
+			goto done;
+		}
+
+		/* Drain the receive buffer */
+		while (read(conn->sockfd, discard, sizeof(discard)) > 0);
+		break;
+	}
+
+done:
+	fr_connection_release(inst->pool, NULL, conn);
+
+finish:
+	if ((uint32_t) sent < batch->num) {
+		ERROR("%s: Dropped %u buffered messages", inst->name, batch->num - sent);
+	}
+
+	pthread_mutex_lock(&inst->buffer.mutex);
+	inst->buffer.flushed += sent;
+	inst->buffer.dropped += batch->num - sent;
+	pthread_mutex_unlock(&inst->buffer.mutex);
+
+	batch->used = 0;
+	batch->num = 0;
+}
+
+/** Take batches of buffered messages, and send them
+ *
+ */
+static void *linelog_writer(void *arg)
+{
+	linelog_instance_t	*inst = arg;
+	linelog_batch_t		*batch;
+	struct timespec		deadline;
+	struct timeval		now;
+	bool			stop;
+
+	pthread_mutex_lock(&inst->buffer.mutex);
+
+	for (;;) {
+		/*
+		 *	Sleep until there's something to write.
+		 */
+		while (!inst->buffer.pending->num && !inst->buffer.stop) {
+			pthread_cond_wait(&inst->buffer.wakeup, &inst->buffer.mutex);
+		}
+
+		/*
+		 *	Give the workers a chance to add more data,
+		 *	unless they've already added lots.
+		 */
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + (inst->buffer.interval / 1000);
+		deadline.tv_nsec = (now.tv_usec * 1000) + ((inst->buffer.interval % 1000) * 1000000);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!inst->buffer.stop && (inst->buffer.pending->used < (inst->buffer.max_pending / 2))) {
+			if (pthread_cond_timedwait(&inst->buffer.wakeup, &inst->buffer.mutex,
+						   &deadline) == ETIMEDOUT) break;
+		}
+
+		/*
+		 *	Swap the buffers, so the workers can keep
+		 *	adding messages while we send these.
+		 */
+		batch = inst->buffer.pending;
+		inst->buffer.pending = inst->buffer.writing;
+		inst->buffer.writing = batch;
+		stop = inst->buffer.stop;
+
+		pthread_cond_broadcast(&inst->buffer.drained);
+		pthread_mutex_unlock(&inst->buffer.mutex);
+
+		if (batch->num) linelog_flush(inst, batch);
+
+		if (stop) break;
+
+		pthread_mutex_lock(&inst->buffer.mutex);
+	}
+
+	return NULL;
+}
+
+/** Add a message to the buffer
+ *
+ * @return
+ *	- 0 on success, or if the message was dropped.
+ *	- -1 on failure.
+ */
+static int linelog_buffer_add(linelog_instance_t *inst, REQUEST *request,
+			      struct iovec const *vector, size_t vector_len)
+{
+	linelog_batch_t	*batch;
+	size_t		len = 0, i;
+	uint8_t		*p;
+
+	for (i = 0; i < vector_len; i++) len += vector[i].iov_len;
+	if (len == 0) return 0;
+
+	if (len > inst->buffer.max_pending) {
+		REDEBUG("Message is larger than max_pending (%u bytes)", inst->buffer.max_pending);
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->buffer.mutex);
+
+	if (!inst->buffer.running) {
+		if (pthread_create(&inst->buffer.thread, NULL, linelog_writer, inst) != 0) {
+			pthread_mutex_unlock(&inst->buffer.mutex);
+			REDEBUG("Failed creating writer thread: %s", fr_syserror(errno));
+			return -1;
+		}
+		inst->buffer.running = true;
+	}
+
+	/*
+	 *	The buffer is full.  Either wait for the writer to
+	 *	catch up, or get rid of the message.
+	 */
+	while (!inst->buffer.stop && ((inst->buffer.pending->used + len) > inst->buffer.max_pending)) {
+		switch (inst->buffer.overflow) {
+		case LINELOG_OVERFLOW_DROP:
+			inst->buffer.dropped++;
+			pthread_mutex_unlock(&inst->buffer.mutex);
+			RDEBUG("Buffer is full, dropping message");
+			return 0;
+
+		case LINELOG_OVERFLOW_FILE:
+			pthread_mutex_unlock(&inst->buffer.mutex);
+			RDEBUG("Buffer is full, writing message to \"%s\"", inst->buffer.overflow_file);
+
+			if (exfile_write(inst->buffer.ef, request, inst->buffer.overflow_file, 0600, -1,
+					 vector, vector_len) < 0) {
+				REDEBUG("Failed writing to \"%s\": %s", inst->buffer.overflow_file, fr_strerror());
+				return -1;
+			}
+
+			pthread_mutex_lock(&inst->buffer.mutex);
+			inst->buffer.spilled++;
+			pthread_mutex_unlock(&inst->buffer.mutex);
+			return 0;
+
+		default:
+			pthread_cond_signal(&inst->buffer.wakeup);
+			pthread_cond_wait(&inst->buffer.drained, &inst->buffer.mutex);
+			break;
+		}
+	}
+
+	batch = inst->buffer.pending;
+
+	/*
+	 *	We're shutting down, and the writer won't take
+	 *	another batch.
+	 */
+	if ((batch->used + len) > inst->buffer.max_pending) {
+		inst->buffer.dropped++;
+		pthread_mutex_unlock(&inst->buffer.mutex);
+		return 0;
+	}
+
+	if (batch->num == batch->alloced) {
+		uint32_t *lens;
+
+		lens = talloc_realloc(batch, batch->lens, uint32_t, batch->alloced * 2);
+		if (!lens) {
+			pthread_mutex_unlock(&inst->buffer.mutex);
+			REDEBUG("Out of memory");
+			return -1;
+		}
+		batch->lens = lens;
+		batch->alloced *= 2;
+	}
+
+	p = batch->data + batch->used;
+	for (i = 0; i < vector_len; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+
+	batch->used += len;
+	batch->lens[batch->num++] = len;
+
+	if ((batch->num == 1) || (batch->used >= (inst->buffer.max_pending / 2))) {
+		pthread_cond_signal(&inst->buffer.wakeup);
+	}
+
+	pthread_mutex_unlock(&inst->buffer.mutex);
+
+	return 0;
+}
+
+/** Set up buffering for network destinations
+ *
+ */
+static int linelog_buffer_init(linelog_instance_t *inst, CONF_SECTION *conf)
+{
+	int i;
+
+	inst->buffer.overflow = fr_str2int(linelog_overflow_table, inst->buffer.overflow_str,
+					   LINELOG_OVERFLOW_INVALID);
+	if (inst->buffer.overflow == LINELOG_OVERFLOW_INVALID) {
+		cf_log_err_cs(conf, "Invalid overflow \"%s\"", inst->buffer.overflow_str);
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("interval", inst->buffer.interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("interval", inst->buffer.interval, <=, 10000);
+	FR_INTEGER_BOUND_CHECK("max_pending", inst->buffer.max_pending, >=, 4096);
+
+	if (inst->buffer.overflow == LINELOG_OVERFLOW_FILE) {
+		if (!inst->buffer.overflow_file) {
+			cf_log_err_cs(conf, "No value provided for 'overflow_file'");
+			return -1;
+		}
+
+		inst->buffer.ef = module_exfile_init(inst, conf, 1, 30, true, NULL, NULL);
+		if (!inst->buffer.ef) {
+			cf_log_err_cs(conf, "Failed creating overflow file context");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		linelog_batch_t *batch;
+
+		batch = talloc_zero(inst, linelog_batch_t);
+		if (!batch) return -1;
+
+		batch->data = talloc_array(batch, uint8_t, inst->buffer.max_pending);
+		batch->alloced = 64;
+		batch->lens = talloc_array(batch, uint32_t, batch->alloced);
+		if (!batch->data || !batch->lens) return -1;
+
+		if (i == 0) {
+			inst->buffer.pending = batch;
+		} else {
+			inst->buffer.writing = batch;
+		}
+	}
+
+	if (pthread_mutex_init(&inst->buffer.mutex, NULL) != 0) {
+		cf_log_err_cs(conf, "Failed initialising mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (pthread_cond_init(&inst->buffer.wakeup, NULL) != 0) {
+		cf_log_err_cs(conf, "Failed initialising condition: %s", fr_syserror(errno));
+	error:
+		pthread_mutex_destroy(&inst->buffer.mutex);
+		return -1;
+	}
+
+	if (pthread_cond_init(&inst->buffer.drained, NULL) != 0) {
+		cf_log_err_cs(conf, "Failed initialising condition: %s", fr_syserror(errno));
+		pthread_cond_destroy(&inst->buffer.wakeup);
+		goto error;
+	}
+
+	return 0;
+}
+
 static int mod_detach(void *instance)
 {
 	linelog_instance_t *inst = instance;
 
+	/*
+	 *	Stop the writer, which sends everything which was
+	 *	buffered, before we close the connections.
+	 */
+	if (inst->buffer.pending) {
+		pthread_mutex_lock(&inst->buffer.mutex);
+		inst->buffer.stop = true;
+		pthread_cond_signal(&inst->buffer.wakeup);
+		pthread_mutex_unlock(&inst->buffer.mutex);
+
+		if (inst->buffer.running) pthread_join(inst->buffer.thread, NULL);
+
+		INFO("%s: Sent %" PRIu64 " buffered messages, dropped %" PRIu64 ", wrote %" PRIu64 " to overflow file",
+		     inst->name, inst->buffer.flushed, inst->buffer.dropped, inst->buffer.spilled);
+
+		pthread_cond_destroy(&inst->buffer.drained);
+		pthread_cond_destroy(&inst->buffer.wakeup);
+		pthread_mutex_destroy(&inst->buffer.mutex);
+	}
+
 	fr_connection_pool_free(inst->pool);
 
 	return 0;
@@ -342,6 +837,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			return -1;
 		}
 
+		if (inst->file.async &&
+		    (exfile_async_enable(inst->file.ef, EXFILE_ASYNC_INTERVAL, EXFILE_ASYNC_MAX_PENDING,
+					 inst->file.fsync) < 0)) {
+			cf_log_err_cs(conf, "Failed enabling buffered writes: %s", fr_strerror());
+			return -1;
+		}
+
+		inst->file.group = (gid_t) -1;
 		if (inst->file.group_str) {
 			char *endptr;
 
@@ -412,6 +915,16 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		break;
 	}
 
+	if (inst->buffer.enable) {
+		if ((inst->log_dst != LINELOG_DST_UNIX) && (inst->log_dst != LINELOG_DST_UDP) &&
+		    (inst->log_dst != LINELOG_DST_TCP)) {
+			cf_log_err_cs(conf, "Buffering can only be used with the unix, tcp and udp destinations");
+			return -1;
+		}
+
+		if (linelog_buffer_init(inst, cf_section_sub_find(conf, "buffer")) < 0) return -1;
+	}
+
 	inst->delimiter_len = talloc_array_length(inst->delimiter) - 1;
 	inst->cs = conf;
 
@@ -463,7 +976,6 @@ static size_t linelog_escape_func(UNUSED REQUEST *request,
 static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
 static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	int			fd = -1;
 	linelog_conn_t		*conn;
 	struct timeval		*timeout = NULL;
 
@@ -571,7 +1083,9 @@ build_vector:
 		#define VECTOR_INCREMENT 20
 		vp_cursor_t	cursor;
 		VALUE_PAIR	*vp;
-		int		alloced = VECTOR_INCREMENT, i;
+		int		alloced = VECTOR_INCREMENT, i, j;
+		fr_sbuff_t	*sb = NULL;
+		bool		*printed = NULL;
 
 		MEM(vector = talloc_array(request, struct iovec, alloced));
 		for (vp = tmpl_cursor_init(NULL, &cursor, request, vpt_p), i = 0;
@@ -582,6 +1096,10 @@ build_vector:
 			    (i >= alloced)) {
 				alloced += VECTOR_INCREMENT;
 				MEM(vector = talloc_realloc(request, vector, struct iovec, alloced));
+				if (printed) {
+					MEM(printed = talloc_realloc(vector, printed, bool, alloced));
+					memset(printed + (alloced - VECTOR_INCREMENT), 0, VECTOR_INCREMENT * sizeof(*printed));
+				}
 			}
 
 			switch (vp->vp_type) {
@@ -591,10 +1109,27 @@ build_vector:
 				vector[i].iov_len = vp->vp_length;
 				break;
 
+			/*
+			 *	Print everything else into one buffer,
+			 *	instead of allocating a string per value.
+			 *	The buffer may move as it grows, so record
+			 *	the offset, and fix up the pointers later.
+			 */
 			default:
-				p = fr_pair_value_asprint(vector, vp, '\0');
-				vector[i].iov_base = p;
-				vector[i].iov_len = talloc_array_length(p) - 1;
+			{
+				ssize_t len;
+
+				if (!sb) {
+					MEM(sb = fr_sbuff_alloc(vector, 0));
+					MEM(printed = talloc_zero_array(vector, bool, alloced));
+				}
+
+				vector[i].iov_base = (void *)(uintptr_t) fr_sbuff_used(sb);
+				len = fr_sbuff_in_pair_value(sb, vp, '\0');
+				MEM(len >= 0);
+				vector[i].iov_len = len;
+				printed[i] = true;
+			}
 				break;
 			}
 
@@ -607,6 +1142,10 @@ build_vector:
 				vector[i].iov_len = inst->delimiter_len;
 			}
 		}
+		if (sb) for (j = 0; j < i; j++) {
+			if (!printed[j]) continue;
+			vector[j].iov_base = fr_sbuff_start(sb) + (uintptr_t) vector[j].iov_base;
+		}
 		vector_p = vector;
 		vector_len = i;
 	}
@@ -667,28 +1206,12 @@ build_vector:
 			*p = '/';
 		}
 
-		fd = exfile_open(inst->file.ef, request, path, inst->file.permissions, true);
-		if (fd < 0) {
-			RERROR("Failed to open %s: %s", path, fr_syserror(errno));
+		if (exfile_write(inst->file.ef, request, path, inst->file.permissions, inst->file.group,
+				 vector_p, vector_len) < 0) {
+			RERROR("Failed writing to \"%s\": %s", path, fr_strerror());
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
-
-		if (inst->file.group_str && (chown(path, -1, inst->file.group) == -1)) {
-			RWARN("Unable to change system group of \"%s\": %s", path, fr_strerror());
-		}
-
-		if (writev(fd, vector_p, vector_len) < 0) {
-			RERROR("Failed writing to \"%s\": %s", path, fr_syserror(errno));
-			exfile_close(inst->file.ef, request, fd);
-
-			/* Assert on the extra fatal errors */
-			rad_assert((errno != EINVAL) && (errno != EFAULT));
-
-			return RLM_MODULE_FAIL;
-		}
-
-		exfile_close(inst->file.ef, request, fd);
 	}
 		break;
 
@@ -708,6 +1231,14 @@ build_vector:
 		if (inst->tcp.timeout.tv_sec || inst->tcp.timeout.tv_usec) timeout = &inst->tcp.timeout;
 
 	do_write:
+		/*
+		 *	Let the writer thread send it.
+		 */
+		if (inst->buffer.enable) {
+			if (linelog_buffer_add(inst, request, vector_p, vector_len) < 0) rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
 		num = fr_connection_pool_state(inst->pool)->num;
 		conn = fr_connection_get(inst->pool, request);
 		if (!conn) {
@@ -38,6 +38,8 @@ RCSID("$Id$")
 #define RLM_LUA_STACK_RESET()	lua_settop(L, _rlm_lua_stack_state)
 
 static _Thread_local REQUEST *rlm_lua_request;
+static _Thread_local char rlm_lua_ffi_buffer[1024];	//!< For values returned to FFI callers.
+static char rlm_lua_request_key;			//!< Registry key of the request table.
 
 /** Convert VALUE_PAIRs to Lua values
  *
@@ -511,6 +513,296 @@ static int _lua_pair_accessor_init(lua_State *L)
 	return 1;
 }
 
+/** Build the request table
+ *
+ * The table doesn't refer to any particular request, so it's built once
+ * per interpreter and kept in the registry.  Accessors created for
+ * attributes are cached in it, and reused by later calls.
+ *
+ * @param L Lua interpreter.
+ */
+static void rlm_lua_request_table(lua_State *L)
+{
+	lua_pushlightuserdata(L, &rlm_lua_request_key);
+
+	lua_newtable(L);		/* Attribute list table */
+	lua_pushcfunction(L, _lua_list_iterator_init);
+	lua_setfield(L, -2, "pairs");
+	lua_newtable(L);		/* Attribute list meta-table */
+	lua_pushinteger(L, PAIR_LIST_REQUEST);
+	lua_pushcclosure(L, _lua_pair_accessor_init, 1);
+	lua_setfield(L, -2, "__index");
+
+	lua_setmetatable(L, -2);
+
+	lua_settable(L, LUA_REGISTRYINDEX);
+}
+
+/** Get the list for an FFI call
+ *
+ */
+static VALUE_PAIR **rlm_lua_ffi_list(TALLOC_CTX **ctx, int list)
+{
+	REQUEST *request = rlm_lua_request;
+	VALUE_PAIR **vps;
+
+	if (!request) return NULL;
+
+	vps = radius_list(request, list);
+	if (!vps) return NULL;
+
+	if (ctx) {
+		*ctx = radius_list_ctx(request, list);
+		if (!*ctx) return NULL;
+	}
+
+	return vps;
+}
+
+/** Find an instance of an attribute
+ *
+ * Leaves the cursor positioned at the attribute if it's found.
+ */
+static VALUE_PAIR *rlm_lua_ffi_cursor_find(vp_cursor_t *cursor, VALUE_PAIR **vps, fr_dict_attr_t const *da, int index)
+{
+	VALUE_PAIR *vp = NULL;
+
+	fr_pair_cursor_init(cursor, vps);
+	for (; index >= 0; index--) {
+		vp = fr_pair_cursor_next_by_da(cursor, da, TAG_ANY);
+		if (!vp) return NULL;
+	}
+
+	return vp;
+}
+
+/** Keep the request's cached pointers valid after the request list is modified
+ *
+ */
+static void rlm_lua_ffi_list_changed(int list)
+{
+	REQUEST *request = rlm_lua_request;
+
+	if (list != PAIR_LIST_REQUEST) return;
+
+	request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+	request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
+	if (!request->password) request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_CHAP_PASSWORD,
+									  TAG_ANY);
+}
+
+/** FFI - Resolve an attribute name
+ *
+ */
+static fr_dict_attr_t const *_lua_ffi_attr_by_name(char const *name)
+{
+	return fr_dict_attr_by_name(NULL, name);
+}
+
+/** FFI - Find an instance of an attribute in a list
+ *
+ */
+static VALUE_PAIR *_lua_ffi_pair_find(int list, fr_dict_attr_t const *da, int index)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	**vps;
+
+	vps = rlm_lua_ffi_list(NULL, list);
+	if (!vps) return NULL;
+
+	return rlm_lua_ffi_cursor_find(&cursor, vps, da, index);
+}
+
+/** FFI - Get the value of an attribute
+ *
+ * Strings and octets are returned in place, without copying. Integers
+ * are written to num, and other types are printed to a thread local buffer.
+ *
+ * @return
+ *	- The value, and its length in len.
+ *	- NULL if the value was written to num.
+ */
+static char const *_lua_ffi_pair_value(VALUE_PAIR const *vp, size_t *len, int64_t *num)
+{
+	switch (vp->vp_type) {
+	case PW_TYPE_STRING:
+		*len = vp->vp_length;
+		return vp->vp_strvalue;
+
+	case PW_TYPE_OCTETS:
+		*len = vp->vp_length;
+		return (char const *)vp->vp_octets;
+
+	case PW_TYPE_BYTE:
+		*num = vp->vp_byte;
+		return NULL;
+
+	case PW_TYPE_SHORT:
+		*num = vp->vp_short;
+		return NULL;
+
+	case PW_TYPE_INTEGER:
+		*num = vp->vp_integer;
+		return NULL;
+
+	case PW_TYPE_SIGNED:
+		*num = vp->vp_signed;
+		return NULL;
+
+	default:
+		*len = truncate_len(fr_pair_value_snprint(rlm_lua_ffi_buffer, sizeof(rlm_lua_ffi_buffer), vp, '\0'),
+				    sizeof(rlm_lua_ffi_buffer));
+		return rlm_lua_ffi_buffer;
+	}
+}
+
+/** FFI - Set an instance of an attribute, adding it if it doesn't exist
+ *
+ */
+static int _lua_ffi_pair_set(int list, fr_dict_attr_t const *da, int index, char const *value, size_t len)
+{
+	REQUEST		*request = rlm_lua_request;
+	vp_cursor_t	cursor;
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	**vps, *vp, *new;
+
+	vps = rlm_lua_ffi_list(&ctx, list);
+	if (!vps) return -1;
+
+	MEM(new = fr_pair_afrom_da(ctx, da));
+	switch (da->type) {
+	case PW_TYPE_STRING:
+		fr_pair_value_bstrncpy(new, value, len);
+		break;
+
+	case PW_TYPE_OCTETS:
+		fr_pair_value_memcpy(new, (uint8_t const *)value, len);
+		break;
+
+	default:
+		if (fr_pair_value_from_str(new, value, len) < 0) {
+			REDEBUG("Failed setting %s: %s", da->name, fr_strerror());
+			talloc_free(new);
+			return -1;
+		}
+		break;
+	}
+
+	vp = rlm_lua_ffi_cursor_find(&cursor, vps, da, index);
+	if (vp) {
+		talloc_free(fr_pair_cursor_replace(&cursor, new));
+	} else {
+		fr_pair_cursor_append(&cursor, new);
+	}
+	rlm_lua_ffi_list_changed(list);
+
+	return 0;
+}
+
+/** FFI - Delete an instance of an attribute
+ *
+ */
+static int _lua_ffi_pair_delete(int list, fr_dict_attr_t const *da, int index)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	**vps, *vp;
+
+	vps = rlm_lua_ffi_list(NULL, list);
+	if (!vps) return -1;
+
+	vp = rlm_lua_ffi_cursor_find(&cursor, vps, da, index);
+	if (!vp) return 0;
+
+	fr_pair_cursor_remove(&cursor);
+	talloc_free(vp);
+	rlm_lua_ffi_list_changed(list);
+
+	return 0;
+}
+
+/** Give LuaJIT scripts access to attributes through the FFI
+ *
+ * Adds a global fr_pair table, with get, set and delete functions:
+ *
+ *	local name = fr_pair.get(fr_pair.request, "User-Name")
+ *	fr_pair.set(fr_pair.reply, "Reply-Message", 0, "Hello " .. name)
+ *
+ * The functions call into C directly, so no tables are built to access
+ * attributes.  The C functions are passed to the script as pointers, as
+ * the module's symbols may not be visible to ffi.load().
+ *
+ * @param inst Current instance of the rlm_lua module.
+ * @param L Lua interpreter.
+ * @return 0 on success, -1 on failure.
+ */
+static int rlm_lua_ffi_register(rlm_lua_t const *inst, lua_State *L)
+{
+	if (luaL_loadstring(L, "\
+		local ffi = require(\"ffi\")\
+		local p_attr, p_find, p_value, p_set, p_delete, l_request, l_reply, l_control, l_state = ...\
+		ffi.cdef [[\
+			typedef struct fr_lua_da fr_lua_da_t;\
+			typedef struct fr_lua_vp fr_lua_vp_t;\
+		]]\
+		local attr = ffi.cast(\"fr_lua_da_t const *(*)(char const *)\", p_attr)\
+		local find = ffi.cast(\"fr_lua_vp_t *(*)(int, fr_lua_da_t const *, int)\", p_find)\
+		local value = ffi.cast(\"char const *(*)(fr_lua_vp_t const *, size_t *, int64_t *)\", p_value)\
+		local set = ffi.cast(\"int (*)(int, fr_lua_da_t const *, int, char const *, size_t)\", p_set)\
+		local delete = ffi.cast(\"int (*)(int, fr_lua_da_t const *, int)\", p_delete)\
+		local len = ffi.new(\"size_t[1]\")\
+		local num = ffi.new(\"int64_t[1]\")\
+		local das = {}\
+		local function da(name)\
+			local d = das[name]\
+			if d == nil then\
+				d = attr(name)\
+				if d == nil then error(\"Unknown attribute \" .. name) end\
+				das[name] = d\
+			end\
+			return d\
+		end\
+		fr_pair = {\
+			request = l_request,\
+			reply = l_reply,\
+			control = l_control,\
+			state = l_state,\
+			get = function(list, name, index)\
+				local vp = find(list, da(name), index or 0)\
+				if vp == nil then return nil end\
+				local p = value(vp, len, num)\
+				if p == nil then return tonumber(num[0]) end\
+				return ffi.string(p, len[0])\
+			end,\
+			set = function(list, name, index, v)\
+				v = tostring(v)\
+				if set(list, da(name), index or 0, v, #v) < 0 then error(\"Failed setting \" .. name) end\
+			end,\
+			delete = function(list, name, index)\
+				delete(list, da(name), index or 0)\
+			end\
+		}\
+		") != 0) goto error;
+
+	lua_pushlightuserdata(L, (void *)_lua_ffi_attr_by_name);
+	lua_pushlightuserdata(L, (void *)_lua_ffi_pair_find);
+	lua_pushlightuserdata(L, (void *)_lua_ffi_pair_value);
+	lua_pushlightuserdata(L, (void *)_lua_ffi_pair_set);
+	lua_pushlightuserdata(L, (void *)_lua_ffi_pair_delete);
+	lua_pushinteger(L, PAIR_LIST_REQUEST);
+	lua_pushinteger(L, PAIR_LIST_REPLY);
+	lua_pushinteger(L, PAIR_LIST_CONTROL);
+	lua_pushinteger(L, PAIR_LIST_STATE);
+
+	if (lua_pcall(L, 9, 0, 0) != 0) {
+	error:
+		ERROR("rlm_lua (%s): Failed setting up FFI attribute access: %s", inst->xlat_name,
+		      lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Check whether the Lua interpreter were actually linked to is LuaJIT
  *
  * @param L Lua interpreter.
@@ -634,14 +926,21 @@ int rlm_lua_init(lua_State **out, rlm_lua_t const *instance)
 		goto error;
 	}
 
-	if (inst->jit) {
+	/*
+	 *	Check the interpreter itself, inst->jit isn't set
+	 *	until the first one has been created.
+	 */
+	if (rlm_lua_isjit(L)) {
 		DEBUG4("rlm_lua (%s): Initialised new LuaJIT interpreter %p", inst->xlat_name, L);
 		aux_jit_funcs_register(inst, L);
+		if (rlm_lua_ffi_register(inst, L) < 0) goto error;
 	} else {
 		DEBUG4("rlm_lua (%s): Initialised new Lua interpreter %p", inst->xlat_name, L);
 		aux_funcs_register(inst, L);
 	}
 
+	rlm_lua_request_table(L);
+
 	/*
 	 *	Verify all the functions were provided.
 	 */
@@ -769,7 +1068,6 @@ static lua_State *rlm_lua_get_interp(rlm_lua_t const *inst) {
 
 int do_lua(rlm_lua_t const *inst, REQUEST *request, char const *funcname)
 {
-	vp_cursor_t cursor;
 	lua_State *L;
 
 	rlm_lua_request = request;
@@ -780,24 +1078,13 @@ int do_lua(rlm_lua_t const *inst, REQUEST *request, char const *funcname)
 	RDEBUG2("Calling %s() in interpreter %p", funcname, L);
 
 	fr_pair_list_sort(&request->packet->vps, fr_pair_cmp_by_da_tag);
-	fr_pair_cursor_init(&cursor, &request->packet->vps);
 
 	/*
-	 *	Setup the environment
+	 *	Setup the environment.  The request table is
+	 *	reset each time, in case the script replaced it.
 	 */
-	lua_newtable(L);		/* Attribute list table */
-	lua_pushlightuserdata(L, &cursor);
-	lua_pushcclosure(L, _lua_list_iterator_init, 1);
-	lua_setfield(L, -2, "pairs");
-	lua_newtable(L);		/* Attribute list meta-table */
-	lua_pushinteger(L, PAIR_LIST_REQUEST);
-	lua_pushcclosure(L, _lua_pair_accessor_init, 1);
-	lua_setfield(L, -2, "__index");
-
-//	lua_pushcfunction(L, new_index);
-//	lua_setfield(L, -2, "__newindex");
-
-	lua_setmetatable(L, -2);
+	lua_pushlightuserdata(L, &rlm_lua_request_key);
+	lua_gettable(L, LUA_REGISTRYINDEX);
 	lua_setglobal(L, "request");
 
 	/*
@@ -25,7 +25,9 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/job_pool.h>
 
 #include <wbclient.h>
 #include <core/ntstatus.h>
@@ -41,72 +43,83 @@ RCSID("$Id$")
 
 #define NT_LENGTH 24
 
+#define WBCLIENT_NAME_LENGTH 500
+
+/** An authentication attempt against winbind
+ *
+ * Everything the call into libwbclient needs is copied into the job, so
+ * that it can be run by an I/O thread without touching the request.
+ */
+struct wbclient_job {
+	bool			retry;		//!< Retry with the normalised username on failure.
+	char			account_name[WBCLIENT_NAME_LENGTH];
+	char			domain_name[WBCLIENT_NAME_LENGTH];
+	bool			have_domain;
+	uint8_t			challenge[8];
+	uint8_t			response[NT_LENGTH];
+
+	bool			can_rehash;	//!< MS-CHAPv2, so the challenge can be recalculated on retry.
+	uint8_t			peer_challenge[16];
+	uint8_t			auth_challenge[16];
+
+	wbcErr			err;		//!< Result of wbcCtxAuthenticateUserEx.
+	bool			have_error;	//!< nt_status and display_string are valid.
+	uint32_t		nt_status;
+	char			display_string[256];
+	uint8_t			user_session_key[NT_DIGEST_LENGTH];
+	char			normalised[WBCLIENT_NAME_LENGTH];	//!< Username the retry was done with.
+};
+
 /** Use Winbind to normalise a username
  *
- * @param[in] tctx The talloc context where the result is parented from
  * @param[in] ctx The winbind context
  * @param[in] dom_name The domain of the user
  * @param[in] name The username (without the domain) to be normalised
- * @return The username with the casing according to the Winbind remote server,
- *         or NULL if the username could not be found.
+ * @param[out] out Where to write the name with the casing according to the Winbind remote server.
+ * @param[in] outlen Length of out.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the username could not be found.
  */
-static char *wbclient_normalise_username(TALLOC_CTX *tctx, struct wbcContext *ctx, char const *dom_name, char const *name)
+static int wbclient_normalise_username(struct wbcContext *ctx, char const *dom_name, char const *name,
+				       char *out, size_t outlen)
 {
 	struct wbcDomainSid sid;
 	enum wbcSidType name_type;
 	wbcErr err;
 	char *res_domain = NULL;
 	char *res_name = NULL;
-	char *res = NULL;
 
 	/* Step 1: Convert a name to a sid */
 	err = wbcCtxLookupName(ctx, dom_name, name, &sid, &name_type);
 	if (!WBC_ERROR_IS_OK(err))
-		return NULL;
+		return -1;
 
 	/* Step 2: Convert the sid back to a name */
 	err = wbcCtxLookupSid(ctx, &sid, &res_domain, &res_name, &name_type);
 	if (!WBC_ERROR_IS_OK(err))
-		return NULL;
+		return -1;
 
-	MEM(res = talloc_strdup(tctx, res_name));
+	strlcpy(out, res_name, outlen);
 
 	wbcFreeMemory(res_domain);
 	wbcFreeMemory(res_name);
 
-	return res;
+	return 0;
 }
 
-/*
- *	Check NTLM authentication direct to winbind via
- *	Samba's libwbclient library
+/** Copy everything needed to authenticate the user into a job
  *
- *	Returns:
- *	 0    success
- *	 -1   auth failure
- *	 -648 password expired
+ * @return
+ *	- 0 on success.
+ *	- -1 if the username or domain couldn't be expanded.
  */
-int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
-		     uint8_t const *challenge, uint8_t const *response,
-		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+static int wbclient_job_init(rlm_mschap_t const *inst, REQUEST *request, wbclient_job_t *job,
+			     uint8_t const *challenge, uint8_t const *response)
 {
-	int rcode = -1;
-	struct wbcContext *wb_ctx = NULL;
-	struct wbcAuthUserParams authparams;
-	wbcErr err;
-	int len;
-	struct wbcAuthUserInfo *info = NULL;
-	struct wbcAuthErrorInfo *error = NULL;
-	char user_name_buf[500];
-	char domain_name_buf[500];
-	uint8_t resp[NT_LENGTH];
-
-	/*
-	 * Clear the auth parameters - this is important, as
-	 * there are options that will cause wbcAuthenticateUserEx
-	 * to bomb out if not zero.
-	 */
-	memset(&authparams, 0, sizeof(authparams));
+	char const	*p;
+	char		buffer[WBCLIENT_NAME_LENGTH];
+	VALUE_PAIR	*vp_challenge, *vp_response;
 
 	/*
 	 * wb_username must be set for this function to be called
@@ -116,35 +129,76 @@ int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 	/*
 	 * Get the username and domain from the configuration
 	 */
-	len = tmpl_expand(&authparams.account_name, user_name_buf, sizeof(user_name_buf),
-			  request, inst->wb_username, NULL, NULL);
-	if (len < 0) {
+	if (tmpl_expand(&p, buffer, sizeof(buffer), request, inst->wb_username, NULL, NULL) < 0) {
 		REDEBUG2("Unable to expand winbind_username");
-		goto done;
+		return -1;
 	}
+	strlcpy(job->account_name, p, sizeof(job->account_name));
 
 	if (inst->wb_domain) {
-		len = tmpl_expand(&authparams.domain_name, domain_name_buf, sizeof(domain_name_buf),
-				  request, inst->wb_domain, NULL, NULL);
-		if (len < 0) {
+		if (tmpl_expand(&p, buffer, sizeof(buffer), request, inst->wb_domain, NULL, NULL) < 0) {
 			REDEBUG2("Unable to expand winbind_domain");
-			goto done;
+			return -1;
 		}
+		strlcpy(job->domain_name, p, sizeof(job->domain_name));
+		job->have_domain = true;
 	} else {
 		RWDEBUG2("No domain specified; authentication may fail because of this");
 	}
 
+	memcpy(job->challenge, challenge, sizeof(job->challenge));
+	memcpy(job->response, response, sizeof(job->response));
+
+	/*
+	 * The challenge has to be recalculated if we retry with a
+	 * different username, so remember what it was made from.
+	 */
+	job->retry = inst->wb_retry_with_normalised_username;
+	if (job->retry &&
+	    (vp_challenge = fr_pair_find_by_num(request->packet->vps, VENDORPEC_MICROSOFT,
+						PW_MSCHAP_CHALLENGE, TAG_ANY)) &&
+	    (vp_response = fr_pair_find_by_num(request->packet->vps, VENDORPEC_MICROSOFT,
+					       PW_MSCHAP2_RESPONSE, TAG_ANY)) &&
+	    (vp_challenge->vp_length >= 16) && (vp_response->vp_length >= 50)) {
+		memcpy(job->auth_challenge, vp_challenge->vp_octets, sizeof(job->auth_challenge));
+		memcpy(job->peer_challenge, vp_response->vp_octets + 2, sizeof(job->peer_challenge));
+		job->can_rehash = true;
+	}
+
+	RDEBUG2("sending authentication request user='%s' domain='%s'", job->account_name,
+		job->have_domain ? job->domain_name : "");
+
+	return 0;
+}
+
+/** Send the authentication request to winbind
+ *
+ * This blocks until winbind answers, and may be called from any thread.
+ * Nothing outside of the job is accessed.
+ */
+static void wbclient_job_run(struct wbcContext *wb_ctx, wbclient_job_t *job)
+{
+	struct wbcAuthUserParams authparams;
+	struct wbcAuthUserInfo *info = NULL;
+	struct wbcAuthErrorInfo *error = NULL;
+
+	/*
+	 * Clear the auth parameters - this is important, as
+	 * there are options that will cause wbcAuthenticateUserEx
+	 * to bomb out if not zero.
+	 */
+	memset(&authparams, 0, sizeof(authparams));
 
 	/*
 	 * Build the wbcAuthUserParams structure with what we know
 	 */
+	authparams.account_name = job->account_name;
+	if (job->have_domain) authparams.domain_name = job->domain_name;
 	authparams.level = WBC_AUTH_USER_LEVEL_RESPONSE;
 	authparams.password.response.nt_length = NT_LENGTH;
+	authparams.password.response.nt_data = job->response;
 
-	memcpy(resp, response, NT_LENGTH);
-	authparams.password.response.nt_data = resp;
-
-	memcpy(authparams.password.response.challenge, challenge,
+	memcpy(authparams.password.response.challenge, job->challenge,
 	       sizeof(authparams.password.response.challenge));
 
 	authparams.parameter_control |= WBC_MSV1_0_ALLOW_MSVCHAPV2 |
@@ -154,67 +208,75 @@ int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 	/*
 	 * Send auth request across to winbind
 	 */
-	wb_ctx = fr_connection_get(inst->wb_pool, request);
-	if (wb_ctx == NULL) {
-		RERROR("Unable to get winbind connection from pool");
-		goto done;
-	}
+	job->err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
 
-	RDEBUG2("sending authentication request user='%s' domain='%s'", authparams.account_name,
-									authparams.domain_name);
-
-	err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
-
-	if (err == WBC_ERR_AUTH_ERROR && inst->wb_retry_with_normalised_username) {
-		VALUE_PAIR *vp_response, *vp_challenge;
-		char *normalised_username = wbclient_normalise_username(request, wb_ctx, authparams.domain_name, authparams.account_name);
-		if (normalised_username) {
-			RDEBUG2("Starting retry, normalised username %s to %s", authparams.account_name, normalised_username);
-			if (strcmp(authparams.account_name, normalised_username) != 0) {
-				authparams.account_name = normalised_username;
-
-				/* Set PW_MS_CHAP_USER_NAME */
-				if (!fr_pair_make(request->packet, &request->packet->vps, "MS-CHAP-User-Name", normalised_username, T_OP_SET)) {
-					RERROR("Failed creating MS-CHAP-User-Name");
-					goto normalised_username_retry_failure;
-				}
-
-				RDEBUG2("retrying authentication request user='%s' domain='%s'", authparams.account_name,
-												authparams.domain_name);
-
-				/* Recalculate hash */
-				if (!(vp_challenge = fr_pair_find_by_num(request->packet->vps, PW_MSCHAP_CHALLENGE, VENDORPEC_MICROSOFT, TAG_ANY))) {
-					RERROR("Unable to get MS-CHAP-Challenge");
-					goto normalised_username_retry_failure;
-				}
-				if (!(vp_response = fr_pair_find_by_num(request->packet->vps, PW_MSCHAP2_RESPONSE, VENDORPEC_MICROSOFT, TAG_ANY))) {
-					RERROR("Unable to get MS-CHAP2-Response");
-					goto normalised_username_retry_failure;
-				}
-				mschap_challenge_hash(vp_response->vp_octets + 2,
-									vp_challenge->vp_octets,
-									normalised_username,
-									authparams.password.response.challenge);
-
-				err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
-			}
-normalised_username_retry_failure:
-			talloc_free(normalised_username);
+	if ((job->err == WBC_ERR_AUTH_ERROR) && job->retry && job->can_rehash &&
+	    (wbclient_normalise_username(wb_ctx, authparams.domain_name, authparams.account_name,
+					 job->normalised, sizeof(job->normalised)) == 0)) {
+		if (strcmp(authparams.account_name, job->normalised) == 0) {
+			job->normalised[0] = '\0';
+		} else {
+			authparams.account_name = job->normalised;
+
+			/* Recalculate hash */
+			mschap_challenge_hash(job->peer_challenge, job->auth_challenge, job->normalised,
+					      authparams.password.response.challenge);
+
+			if (info) wbcFreeMemory(info);
+			if (error) wbcFreeMemory(error);
+			info = NULL;
+			error = NULL;
+
+			job->err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
 		}
 	}
 
-	fr_connection_release(inst->wb_pool, request, wb_ctx);
+	if ((job->err == WBC_ERR_SUCCESS) && info) {
+		memcpy(job->user_session_key, info->user_session_key, NT_DIGEST_LENGTH);
+	}
+
+	if (error) {
+		job->have_error = true;
+		job->nt_status = error->nt_status;
+		if (error->display_string) strlcpy(job->display_string, error->display_string,
+						   sizeof(job->display_string));
+	}
+
+	if (info) wbcFreeMemory(info);
+	if (error) wbcFreeMemory(error);
+}
+
+/** Interpret the result of a job
+ *
+ *	Returns:
+ *	 0    success
+ *	 -1   auth failure
+ *	 -648 password expired
+ */
+static int wbclient_job_result(REQUEST *request, wbclient_job_t *job, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int rcode = -1;
+
+	if (job->normalised[0]) {
+		RDEBUG2("Retried with normalised username %s (was %s)", job->normalised, job->account_name);
+
+		/* Set PW_MS_CHAP_USER_NAME */
+		if (!fr_pair_make(request->packet, &request->packet->vps, "MS-CHAP-User-Name",
+				  job->normalised, T_OP_SET)) {
+			RERROR("Failed creating MS-CHAP-User-Name");
+		}
+	}
 
 	/*
 	 * Try and give some useful feedback on what happened. There are only
 	 * a few errors that can actually be returned from wbcCtxAuthenticateUserEx.
 	 */
-	switch (err) {
+	switch (job->err) {
 	case WBC_ERR_SUCCESS:
 		rcode = 0;
 		RDEBUG2("Authenticated successfully");
 		/* Grab the nthashhash from the result */
-		memcpy(nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+		memcpy(nthashhash, job->user_session_key, NT_DIGEST_LENGTH);
 		break;
 	case WBC_ERR_WINBIND_NOT_AVAILABLE:
 		RERROR("Unable to contact winbind!");
@@ -225,7 +287,7 @@ normalised_username_retry_failure:
 		REDEBUG2("Domain not found");
 		break;
 	case WBC_ERR_AUTH_ERROR:
-		if (!error) {
+		if (!job->have_error) {
 			REDEBUG2("Authentication failed");
 			break;
 		}
@@ -233,18 +295,18 @@ normalised_username_retry_failure:
 		/*
 		 * The password needs to be changed, so set rcode appropriately.
 		 */
-		if (error->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
-		    error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
+		if (job->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    job->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
 			rcode = -648;
 		}
 
 		/*
 		 * Return the NT_STATUS human readable error string, if there is one.
 		 */
-		if (error->display_string) {
-			REDEBUG2("%s [0x%X]", error->display_string, error->nt_status);
+		if (job->display_string[0]) {
+			REDEBUG2("%s [0x%X]", job->display_string, job->nt_status);
 		} else {
-			REDEBUG2("Authentication failed [0x%X]", error->nt_status);
+			REDEBUG2("Authentication failed [0x%X]", job->nt_status);
 		}
 		break;
 	default:
@@ -254,19 +316,147 @@ normalised_username_retry_failure:
 		 *   WBC_ERR_NO_MEMORY
 		 * neither of which are particularly likely.
 		 */
-		if (error && error->display_string) {
-			REDEBUG2("libwbclient error: wbcErr %d (%s)", err, error->display_string);
+		if (job->display_string[0]) {
+			REDEBUG2("libwbclient error: wbcErr %d (%s)", job->err, job->display_string);
 		} else {
-			REDEBUG2("libwbclient error: wbcErr %d", err);
+			REDEBUG2("libwbclient error: wbcErr %d", job->err);
 		}
 		break;
 	}
 
+	return rcode;
+}
 
-done:
-	if (info) wbcFreeMemory(info);
-	if (error) wbcFreeMemory(error);
+/*
+ *	Check NTLM authentication direct to winbind via
+ *	Samba's libwbclient library
+ *
+ *	Returns:
+ *	 0    success
+ *	 -1   auth failure
+ *	 -648 password expired
+ */
+int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
+		     uint8_t const *challenge, uint8_t const *response,
+		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	struct wbcContext	*wb_ctx;
+	wbclient_job_t		job;
 
-	return rcode;
+	memset(&job, 0, sizeof(job));
+
+	if (wbclient_job_init(inst, request, &job, challenge, response) < 0) return -1;
+
+	wb_ctx = fr_connection_get(inst->wb_pool, request);
+	if (wb_ctx == NULL) {
+		RERROR("Unable to get winbind connection from pool");
+		return -1;
+	}
+
+	wbclient_job_run(wb_ctx, &job);
+
+	fr_connection_release(inst->wb_pool, request, wb_ctx);
+
+	return wbclient_job_result(request, &job, nthashhash);
+}
+
+/** Create the winbind context an I/O thread runs its jobs with
+ *
+ * Each I/O thread has its own winbind context, so jobs run in parallel
+ * without needing a connection pool.
+ */
+static void *wbclient_io_thread_alloc(UNUSED TALLOC_CTX *ctx, UNUSED void *uctx)
+{
+	return wbcCtxCreate();
+}
+
+/** Free the winbind context of an I/O thread
+ *
+ */
+static void wbclient_io_thread_free(void *thread, UNUSED void *uctx)
+{
+	wbcCtxFree(thread);
 }
 
+/** Run a queued authentication in an I/O thread
+ *
+ */
+static void wbclient_io_run(void *thread, void *data, UNUSED void *uctx)
+{
+	wbclient_job_run(thread, data);
+}
+
+/** Fail an authentication which won't be run
+ *
+ */
+static void wbclient_io_fail(void *data, UNUSED void *uctx)
+{
+	wbclient_job_t *job = data;
+
+	job->err = WBC_ERR_UNKNOWN_FAILURE;
+}
+
+/** Start I/O threads to run winbind authentications
+ *
+ * @param[in] ctx		to allocate the pool in.  Must not be read only.
+ * @param[in] num_threads	Number of I/O threads to start.
+ * @return
+ *	- New pool of I/O threads.
+ *	- NULL on error.
+ */
+fr_job_pool_t *wbclient_async_alloc(TALLOC_CTX *ctx, uint32_t num_threads)
+{
+	return fr_job_pool_alloc(ctx, "winbind", num_threads, wbclient_io_run, wbclient_io_fail,
+				 wbclient_io_thread_alloc, wbclient_io_thread_free, NULL);
+}
+
+/** Queue an authentication to be run by an I/O thread
+ *
+ * The request is marked resumable when the job completes, and the
+ * result must then be collected with #wbclient_job_finish.
+ *
+ * @param[in] inst		of rlm_mschap.
+ * @param[in] r			of the worker processing the request.
+ * @param[in] request		being authenticated.
+ * @param[in] challenge		8 byte MS-CHAPv1 challenge.
+ * @param[in] response		24 byte NT response.
+ * @return
+ *	- The queued job.
+ *	- NULL on error.
+ */
+fr_job_t *wbclient_job_send(rlm_mschap_t const *inst, fr_job_return_t *r, REQUEST *request,
+			    uint8_t const *challenge, uint8_t const *response)
+{
+	fr_job_t		*job;
+	wbclient_job_t		*wb_job;
+
+	job = fr_job_alloc(r, request);
+	if (!job) return NULL;
+
+	wb_job = talloc_zero(job, wbclient_job_t);
+	if (!wb_job || (wbclient_job_init(inst, request, wb_job, challenge, response) < 0)) {
+		fr_job_cancel(job);
+		return NULL;
+	}
+
+	fr_job_send(inst->wb_async, job, wb_job);
+
+	return job;
+}
+
+/** Collect the result of a completed job, and free it
+ *
+ *	Returns:
+ *	 0    success
+ *	 -1   auth failure
+ *	 -648 password expired
+ */
+int wbclient_job_finish(REQUEST *request, fr_job_t *job, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int rcode;
+
+	rcode = wbclient_job_result(request, fr_job_data(job), nthashhash);
+	fr_job_cancel(job);
+
+	return rcode;
+}
@@ -5,8 +5,19 @@
 
 RCSIDH(auth_wbclient_h, "$Id$")
 
+#include <freeradius-devel/job_pool.h>
+
+typedef struct wbclient_job wbclient_job_t;
+
 int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 		     uint8_t const *challenge, uint8_t const *response,
 		     uint8_t nthashhash[NT_DIGEST_LENGTH]);
 
+fr_job_pool_t *wbclient_async_alloc(TALLOC_CTX *ctx, uint32_t num_threads);
+
+fr_job_t *wbclient_job_send(rlm_mschap_t const *inst, fr_job_return_t *r, REQUEST *request,
+			    uint8_t const *challenge, uint8_t const *response);
+
+int wbclient_job_finish(REQUEST *request, fr_job_t *job, uint8_t nthashhash[NT_DIGEST_LENGTH]);
+
 #endif /*_AUTH_WBCLIENT_H*/
@@ -0,0 +1,611 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ntlm_helper.c
+ * @brief NTLM authentication via persistent ntlm_auth helper processes
+ *
+ * Each worker thread keeps a small pool of ntlm_auth processes running
+ * with --helper-protocol=ntlm-server-1.  Queries are written to an idle
+ * helper's stdin, and the answer is read from its stdout by the thread's
+ * event list, so the request yields instead of forking a new ntlm_auth
+ * and blocking the worker until it exits.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/base64.h>
+
+#include <signal.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "ntlm_helper.h"
+
+#define NTLM_HELPER_BUFFER_SIZE	1024
+
+typedef struct mschap_ntlm_helper mschap_ntlm_helper_t;
+
+/** A query waiting for, or being answered by, a helper
+ *
+ */
+struct mschap_ntlm_query {
+	mschap_ntlm_pool_t	*pool;			//!< Pool the query was sent to.
+	REQUEST			*request;		//!< Resumed when the query completes.
+	mschap_ntlm_helper_t	*helper;		//!< Answering the query, NULL if queued or complete.
+	mschap_ntlm_query_t	*next;			//!< Next query waiting for a helper.
+
+	char			*msg;			//!< Lines to write to the helper.
+	size_t			msg_len;		//!< Length of msg.
+
+	bool			done;			//!< Query has completed (successfully or not).
+	bool			authenticated;		//!< Helper said "Authenticated: Yes".
+	bool			have_key;		//!< Helper returned a User-Session-Key.
+	uint8_t			key[NT_DIGEST_LENGTH];	//!< The nthashhash.
+	char			*error;			//!< Why the query failed.
+};
+
+/** A single ntlm_auth process
+ *
+ */
+struct mschap_ntlm_helper {
+	mschap_ntlm_pool_t	*pool;			//!< Pool this helper belongs to.
+	pid_t			pid;			//!< Of the helper, -1 if not running.
+	int			to_fd;			//!< Helper's stdin.
+	int			from_fd;		//!< Helper's stdout.
+
+	bool			busy;			//!< Waiting for the helper to finish an answer.
+	mschap_ntlm_query_t	*query;			//!< Being answered, NULL if the request went away.
+
+	char			buff[NTLM_HELPER_BUFFER_SIZE];	//!< Partial lines read from the helper.
+	size_t			len;			//!< Amount of data in buff.
+};
+
+/** Helpers and pending queries for one worker thread
+ *
+ */
+struct mschap_ntlm_pool {
+	fr_event_list_t		*el;			//!< Thread's event list, which watches from_fd.
+	char const		*program;		//!< ntlm_auth command line.
+	uint32_t		timeout;		//!< How long a query may take, in seconds.
+
+	mschap_ntlm_helper_t	*helpers;		//!< Array of helpers.
+	uint32_t		num_helpers;		//!< Number of elements in helpers.
+
+	mschap_ntlm_query_t	*head;			//!< Oldest query waiting for a helper.
+	mschap_ntlm_query_t	**tail;			//!< Where to link the next query.
+};
+
+static void ntlm_helper_dispatch(mschap_ntlm_pool_t *pool);
+
+/** Mark a query as complete, and resume the request which sent it
+ *
+ */
+static void ntlm_query_complete(mschap_ntlm_query_t *query, char const *error)
+{
+	if (query->done) return;
+
+	if (error && !query->error) query->error = talloc_typed_strdup(query, error);
+
+	if (query->helper) {
+		query->helper->query = NULL;
+		query->helper = NULL;
+	}
+	query->done = true;
+
+	if (query->request) unlang_resumable(query->request);
+}
+
+/** Stop a helper, failing any query it was answering
+ *
+ * The helper is started again the next time a query needs it.
+ */
+static void ntlm_helper_stop(mschap_ntlm_helper_t *helper, char const *error)
+{
+	int status;
+
+	if (helper->query) ntlm_query_complete(helper->query, error);
+
+	if (helper->from_fd >= 0) {
+		(void) fr_event_fd_delete(helper->pool->el, helper->from_fd);
+		close(helper->from_fd);
+		helper->from_fd = -1;
+	}
+	if (helper->to_fd >= 0) {
+		close(helper->to_fd);
+		helper->to_fd = -1;
+	}
+
+	if (helper->pid > 0) {
+		kill(helper->pid, SIGTERM);
+		(void) rad_waitpid(helper->pid, &status);
+		helper->pid = -1;
+	}
+
+	helper->busy = false;
+	helper->len = 0;
+}
+
+/** Process a line of the helper's answer
+ *
+ * @return
+ *	- 1 if this was the last line of the answer.
+ *	- 0 if more lines are expected.
+ */
+static int ntlm_helper_line(mschap_ntlm_helper_t *helper, char *line)
+{
+	mschap_ntlm_query_t	*query = helper->query;
+	char			*value;
+
+	if (strcmp(line, ".") == 0) return 1;
+
+	/*
+	 *	Request went away, the rest of the answer is discarded.
+	 */
+	if (!query) return 0;
+
+	value = strchr(line, ':');
+	if (!value) return 0;
+	*value++ = '\0';
+	if (*value == ':') value++;	/* "::" marks base64, not used in answers */
+	while (*value == ' ') value++;
+
+	if (strcasecmp(line, "Authenticated") == 0) {
+		query->authenticated = (strcasecmp(value, "Yes") == 0);
+
+	} else if (strcasecmp(line, "User-Session-Key") == 0) {
+		if (fr_hex2bin(query->key, sizeof(query->key), value, strlen(value)) == sizeof(query->key)) {
+			query->have_key = true;
+		}
+
+	} else if ((strcasecmp(line, "Authentication-Error") == 0) || (strcasecmp(line, "Error") == 0)) {
+		talloc_free(query->error);
+		query->error = talloc_typed_strdup(query, value);
+	}
+
+	return 0;
+}
+
+/** Read the helper's answer
+ *
+ */
+static void ntlm_helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	mschap_ntlm_helper_t	*helper = ctx;
+	mschap_ntlm_pool_t	*pool = helper->pool;
+	ssize_t			slen;
+	char			*p, *end, *eol;
+
+	slen = read(helper->from_fd, helper->buff + helper->len, sizeof(helper->buff) - helper->len);
+	if (slen < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN)) return;
+
+		ERROR("ntlm_auth helper PID %u: Failed reading answer: %s",
+		      (unsigned int) helper->pid, fr_syserror(errno));
+		goto restart;
+	}
+	if (slen == 0) {
+		ERROR("ntlm_auth helper PID %u exited", (unsigned int) helper->pid);
+		goto restart;
+	}
+	helper->len += slen;
+
+	p = helper->buff;
+	end = helper->buff + helper->len;
+	while ((eol = memchr(p, '\n', end - p))) {
+		*eol = '\0';
+
+		if (ntlm_helper_line(helper, p) == 1) {
+			if (helper->query) ntlm_query_complete(helper->query, NULL);
+			helper->busy = false;
+		}
+		p = eol + 1;
+	}
+
+	helper->len = end - p;
+	if (helper->len == sizeof(helper->buff)) {
+		ERROR("ntlm_auth helper PID %u: Answer line too long", (unsigned int) helper->pid);
+		goto restart;
+	}
+	if (helper->len) memmove(helper->buff, p, helper->len);
+
+	if (!helper->busy) ntlm_helper_dispatch(pool);
+	return;
+
+restart:
+	ntlm_helper_stop(helper, "ntlm_auth helper exited unexpectedly");
+	ntlm_helper_dispatch(pool);
+}
+
+static void ntlm_helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	mschap_ntlm_helper_t	*helper = ctx;
+	mschap_ntlm_pool_t	*pool = helper->pool;
+
+	ERROR("ntlm_auth helper PID %u: Error on pipe", (unsigned int) helper->pid);
+
+	ntlm_helper_stop(helper, "ntlm_auth helper exited unexpectedly");
+	ntlm_helper_dispatch(pool);
+}
+
+/** Start a helper process
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ntlm_helper_start(mschap_ntlm_helper_t *helper)
+{
+	mschap_ntlm_pool_t *pool = helper->pool;
+
+	helper->pid = radius_start_program(pool->program, NULL, true, &helper->to_fd, &helper->from_fd, NULL, false);
+	if (helper->pid < 0) {
+		ERROR("Failed starting ntlm_auth helper \"%s\"", pool->program);
+		helper->pid = -1;
+		helper->to_fd = helper->from_fd = -1;
+		return -1;
+	}
+
+	if ((fr_nonblock(helper->to_fd) < 0) || (fr_nonblock(helper->from_fd) < 0)) {
+		ERROR("Failed setting ntlm_auth helper pipes to non-blocking: %s", fr_syserror(errno));
+	error:
+		ntlm_helper_stop(helper, NULL);
+		return -1;
+	}
+
+	if (fr_event_fd_insert(pool->el, helper->from_fd, ntlm_helper_read, NULL, ntlm_helper_error, helper) < 0) {
+		ERROR("Failed inserting ntlm_auth helper pipe into event list: %s", fr_strerror());
+		(void) close(helper->from_fd);	/* Not in the event list, so don't let stop() delete it */
+		helper->from_fd = -1;
+		goto error;
+	}
+
+	DEBUG2("Started ntlm_auth helper PID %u", (unsigned int) helper->pid);
+
+	return 0;
+}
+
+/** Hand queued queries to idle helpers
+ *
+ */
+static void ntlm_helper_dispatch(mschap_ntlm_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; (i < pool->num_helpers) && pool->head; i++) {
+		mschap_ntlm_helper_t	*helper = &pool->helpers[i];
+		mschap_ntlm_query_t	*query;
+
+		if (helper->busy) continue;
+
+		query = pool->head;
+		pool->head = query->next;
+		if (!pool->head) pool->tail = &pool->head;
+		query->next = NULL;
+
+		if ((helper->pid < 0) && (ntlm_helper_start(helper) < 0)) {
+			ntlm_query_complete(query, "Failed starting ntlm_auth helper");
+			continue;
+		}
+
+		helper->busy = true;
+		helper->query = query;
+		query->helper = helper;
+
+		/*
+		 *	Queries are a few hundred bytes, and the helper
+		 *	has read everything we've written before it
+		 *	answers, so the pipe always has room.
+		 */
+		if (write(helper->to_fd, query->msg, query->msg_len) != (ssize_t) query->msg_len) {
+			ERROR("ntlm_auth helper PID %u: Failed writing query: %s",
+			      (unsigned int) helper->pid, fr_syserror(errno));
+			ntlm_helper_stop(helper, "Failed writing to ntlm_auth helper");
+		}
+	}
+}
+
+static int _ntlm_pool_free(mschap_ntlm_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->num_helpers; i++) ntlm_helper_stop(&pool->helpers[i], NULL);
+
+	return 0;
+}
+
+/** Allocate a pool of ntlm_auth helpers for a worker thread
+ *
+ * Helpers are started the first time they're needed, and restarted
+ * if they exit.
+ *
+ * @param[in] ctx	to allocate the pool in.
+ * @param[in] el	of the worker thread, which will read the helper's answers.
+ * @param[in] program	ntlm_auth command line, including --helper-protocol=ntlm-server-1.
+ * @param[in] processes	Maximum number of helpers to run.
+ * @param[in] timeout	How long to wait for an answer, before killing the helper.
+ * @return
+ *	- New pool.
+ *	- NULL on error.
+ */
+mschap_ntlm_pool_t *mschap_ntlm_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, char const *program,
+					   uint32_t processes, uint32_t timeout)
+{
+	mschap_ntlm_pool_t	*pool;
+	uint32_t		i;
+
+	rad_assert(processes > 0);
+
+	pool = talloc_zero(ctx, mschap_ntlm_pool_t);
+	if (!pool) return NULL;
+
+	pool->helpers = talloc_zero_array(pool, mschap_ntlm_helper_t, processes);
+	if (!pool->helpers) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	pool->el = el;
+	pool->program = program;
+	pool->timeout = timeout;
+	pool->num_helpers = processes;
+	pool->tail = &pool->head;
+
+	for (i = 0; i < processes; i++) {
+		pool->helpers[i].pool = pool;
+		pool->helpers[i].pid = -1;
+		pool->helpers[i].to_fd = -1;
+		pool->helpers[i].from_fd = -1;
+	}
+
+	talloc_set_destructor(pool, _ntlm_pool_free);
+
+	return pool;
+}
+
+/** The helper didn't answer in time
+ *
+ */
+static void ntlm_query_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			       UNUSED struct timeval *fired)
+{
+	mschap_ntlm_query_t	*query = talloc_get_type_abort(ctx, mschap_ntlm_query_t);
+	mschap_ntlm_pool_t	*pool = query->pool;
+	mschap_ntlm_query_t	**p;
+
+	/*
+	 *	A helper which doesn't answer is stuck, don't leave
+	 *	it around to swallow the next query.
+	 */
+	if (query->helper) {
+		REDEBUG("ntlm_auth helper PID %u is taking too much time: forcing failure and killing it",
+			(unsigned int) query->helper->pid);
+		ntlm_helper_stop(query->helper, "ntlm_auth helper timed out");
+		ntlm_helper_dispatch(pool);
+		return;
+	}
+
+	REDEBUG("Timed out waiting for an idle ntlm_auth helper");
+	for (p = &pool->head; *p; p = &(*p)->next) {
+		if (*p != query) continue;
+
+		*p = query->next;
+		if (!*p) pool->tail = p;
+		break;
+	}
+	ntlm_query_complete(query, "Timed out waiting for an idle ntlm_auth helper");
+}
+
+static int _ntlm_query_free(mschap_ntlm_query_t *query)
+{
+	mschap_ntlm_pool_t	*pool = query->pool;
+	mschap_ntlm_query_t	**p;
+
+	/*
+	 *	The helper stays busy until it has finished
+	 *	answering, the answer is just discarded.
+	 */
+	if (query->helper) {
+		query->helper->query = NULL;
+		query->helper = NULL;
+	}
+
+	for (p = &pool->head; *p; p = &(*p)->next) {
+		if (*p != query) continue;
+
+		*p = query->next;
+		if (!*p) pool->tail = p;
+		break;
+	}
+
+	if (query->request && !query->done) (void) unlang_event_timeout_delete(query->request, query);
+
+	return 0;
+}
+
+/** Encode a header value as base64
+ *
+ */
+static char *ntlm_base64(TALLOC_CTX *ctx, char const *in)
+{
+	size_t	inlen = strlen(in);
+	char	*out;
+
+	out = talloc_array(ctx, char, FR_BASE64_ENC_LENGTH(inlen) + 1);
+	if (!out) return NULL;
+
+	fr_base64_encode(out, FR_BASE64_ENC_LENGTH(inlen) + 1, (uint8_t const *) in, inlen);
+
+	return out;
+}
+
+/** Send an MS-CHAP challenge and response to a helper
+ *
+ * The query is answered asynchronously.  When it completes the request
+ * is marked resumable, and the caller should then call
+ * #mschap_ntlm_query_result.  Freeing the query cancels it.
+ *
+ * @param[in] ctx		to allocate the query in.
+ * @param[in] pool		to send the query to.
+ * @param[in] request		to resume when the query completes.
+ * @param[in] username		to authenticate.
+ * @param[in] domain		the user belongs to, may be NULL.
+ * @param[in] challenge		sent to the user.
+ * @param[in] response		the user's NT response, or LM response if lm is true.
+ * @param[in] lm		Whether response is an LM response.
+ * @return
+ *	- New query.
+ *	- NULL on error.
+ */
+mschap_ntlm_query_t *mschap_ntlm_query_send(TALLOC_CTX *ctx, mschap_ntlm_pool_t *pool, REQUEST *request,
+					    char const *username, char const *domain,
+					    uint8_t const challenge[8], uint8_t const response[24], bool lm)
+{
+	mschap_ntlm_query_t	*query;
+	char			*b64_username, *b64_domain = NULL;
+	char			hex_challenge[(8 * 2) + 1];
+	char			hex_response[(24 * 2) + 1];
+	struct timeval		when;
+
+	query = talloc_zero(ctx, mschap_ntlm_query_t);
+	if (!query) return NULL;
+	query->pool = pool;
+
+	b64_username = ntlm_base64(query, username);
+	if (domain && *domain) b64_domain = ntlm_base64(query, domain);
+
+	fr_bin2hex(hex_challenge, challenge, 8);
+	fr_bin2hex(hex_response, response, 24);
+
+	query->msg = talloc_typed_asprintf(query,
+					   "Username:: %s\n"
+					   "%s%s%s"
+					   "LANMAN-Challenge: %s\n"
+					   "%s: %s\n"
+					   "Request-User-Session-Key: Yes\n"
+					   ".\n",
+					   b64_username,
+					   b64_domain ? "NT-Domain:: " : "", b64_domain ? b64_domain : "",
+					   b64_domain ? "\n" : "",
+					   hex_challenge,
+					   lm ? "LANMAN-Response" : "NT-Response", hex_response);
+	if (!query->msg) {
+	error:
+		talloc_free(query);
+		return NULL;
+	}
+	query->msg_len = talloc_array_length(query->msg) - 1;
+
+	RDEBUG2("Sending %s response to ntlm_auth helper", lm ? "LM" : "NT");
+
+	talloc_set_destructor(query, _ntlm_query_free);
+
+	*pool->tail = query;
+	pool->tail = &query->next;
+
+	/*
+	 *	Nothing's resumed from within dispatch until
+	 *	query->request is set, so an immediate failure is
+	 *	just returned to the caller.
+	 */
+	ntlm_helper_dispatch(pool);
+	if (query->done) {
+		REDEBUG("%s", query->error);
+		goto error;
+	}
+	query->request = request;
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += pool->timeout;
+
+	if (unlang_event_timeout_add(request, ntlm_query_timeout, query, &when) < 0) {
+		REDEBUG("Failed adding timeout for ntlm_auth helper query");
+		goto error;
+	}
+
+	return query;
+}
+
+/** Process the helper's answer
+ *
+ * @param[in] request		which sent the query.
+ * @param[in] query		which has completed.  Is freed after the result is processed.
+ * @param[out] nthashhash	from the helper's User-Session-Key.
+ * @return
+ *	- 0 on success.
+ *	- -648 if the password has expired.
+ *	- -647 if the account is locked out.
+ *	- -691 if the account is disabled.
+ *	- -1 on any other failure.
+ */
+int mschap_ntlm_query_result(REQUEST *request, mschap_ntlm_query_t *query, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	char const	*error;
+	int		ret = -1;
+
+	memset(nthashhash, 0, NT_DIGEST_LENGTH);
+
+	if (!query->done) {
+		REDEBUG("Request resumed before ntlm_auth helper answered");
+		goto finish;
+	}
+
+	if (query->authenticated) {
+		if (!query->have_key) {
+			REDEBUG("Invalid output from ntlm_auth helper: No valid User-Session-Key");
+			goto finish;
+		}
+
+		memcpy(nthashhash, query->key, NT_DIGEST_LENGTH);
+		ret = 0;
+		goto finish;
+	}
+
+	error = query->error ? query->error : "Authentication failed";
+
+	/*
+	 *	Same error mapping as when ntlm_auth is run per request.
+	 */
+	if (strcasestr(error, "Password expired") ||
+	    strcasestr(error, "Must change password")) {
+		REDEBUG2("%s", error);
+		ret = -648;
+
+	} else if (strcasestr(error, "Account locked out") ||
+		   strcasestr(error, "0xC0000234")) {
+		REDEBUG2("%s", error);
+		ret = -647;
+
+	} else if (strcasestr(error, "Account disabled") ||
+		   strcasestr(error, "0xC0000072")) {
+		REDEBUG2("%s", error);
+		ret = -691;
+
+	} else {
+		REDEBUG("ntlm_auth helper says: %s", error);
+	}
+
+finish:
+	talloc_free(query);
+
+	return ret;
+}
@@ -0,0 +1,23 @@
+/* Copyright 2017 The FreeRADIUS server project */
+
+#ifndef _NTLM_HELPER_H
+#define _NTLM_HELPER_H
+
+RCSIDH(ntlm_helper_h, "$Id$")
+
+#include <freeradius-devel/event.h>
+
+typedef struct mschap_ntlm_pool mschap_ntlm_pool_t;
+typedef struct mschap_ntlm_query mschap_ntlm_query_t;
+
+mschap_ntlm_pool_t	*mschap_ntlm_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, char const *program,
+						uint32_t processes, uint32_t timeout);
+
+mschap_ntlm_query_t	*mschap_ntlm_query_send(TALLOC_CTX *ctx, mschap_ntlm_pool_t *pool, REQUEST *request,
+						char const *username, char const *domain,
+						uint8_t const challenge[8], uint8_t const response[24], bool lm);
+
+int			mschap_ntlm_query_result(REQUEST *request, mschap_ntlm_query_t *query,
+						 uint8_t nthashhash[NT_DIGEST_LENGTH]);
+
+#endif /*_NTLM_HELPER_H*/
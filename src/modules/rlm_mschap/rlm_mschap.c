@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include "rlm_mschap.h"
 #include "mschap.h"
 #include "smbdes.h"
+#include "ntlm_helper.h"
 
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
@@ -64,6 +65,31 @@ int od_mschap_auth(REQUEST *request, VALUE_PAIR *challenge, VALUE_PAIR * usernam
 #define ACB_AUTOLOCK	0x04000000	//!< Account auto locked.
 #define ACB_PW_EXPIRED	0x00020000	//!< Password Expired.
 
+typedef struct rlm_mschap_thread_t {
+	mschap_ntlm_pool_t	*ntlm_pool;		//!< ntlm_auth helpers run by this thread.
+#ifdef WITH_AUTH_WINBIND
+	fr_job_return_t		*wb_return;		//!< Receives completed winbind authentications.
+#endif
+} rlm_mschap_thread_t;
+
+/** State kept while authentication is in progress
+ *
+ * Allocated on the request if we have to yield for an ntlm_auth helper.
+ */
+typedef struct mschap_auth_ctx_t {
+	int			mschap_version;
+	VALUE_PAIR		*challenge;		//!< MS-CHAP-Challenge.
+	VALUE_PAIR		*response;		//!< MS-CHAP-Response or MS-CHAP2-Response.
+	VALUE_PAIR		*lm_password;
+	VALUE_PAIR		*smb_ctrl;
+	char const		*username_string;	//!< Used to create the MS-CHAPv2 challenge.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+	mschap_ntlm_query_t	*query;			//!< Outstanding ntlm_auth helper query.
+#ifdef WITH_AUTH_WINBIND
+	fr_job_t		*wb_job;		//!< Outstanding winbind authentication.
+#endif
+} mschap_auth_ctx_t;
+
 static int pdb_decode_acct_ctrl(char const *p)
 {
 	int acct_ctrl = 0;
@@ -548,6 +574,14 @@ static const CONF_PARSER passchange_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", PW_TYPE_STRING, rlm_mschap_t, ntlm_helper) },
+	{ FR_CONF_OFFSET("username", PW_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username), .dflt = "%{mschap:User-Name}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("domain", PW_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
+	{ FR_CONF_OFFSET("processes", PW_TYPE_INTEGER, rlm_mschap_t, ntlm_helper_processes), .dflt = "2" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	/*
 	 *	Cache the password by default.
@@ -559,12 +593,14 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ntlm_auth", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", PW_TYPE_INTEGER, rlm_mschap_t, ntlm_auth_timeout) },
 	{ FR_CONF_POINTER("passchange", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
+	{ FR_CONF_POINTER("ntlm_auth_helper", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
 	{ FR_CONF_OFFSET("allow_retry", PW_TYPE_BOOLEAN, rlm_mschap_t, allow_retry), .dflt = "yes" },
 	{ FR_CONF_OFFSET("retry_msg", PW_TYPE_STRING, rlm_mschap_t, retry_msg) },
 	{ FR_CONF_OFFSET("winbind_username", PW_TYPE_TMPL, rlm_mschap_t, wb_username) },
 	{ FR_CONF_OFFSET("winbind_domain", PW_TYPE_TMPL, rlm_mschap_t, wb_domain) },
 #ifdef WITH_AUTH_WINBIND
 	{ FR_CONF_OFFSET("winbind_retry_with_normalised_username", PW_TYPE_BOOLEAN, rlm_mschap_t, wb_retry_with_normalised_username), .dflt = "no" },
+	{ FR_CONF_OFFSET("winbind_async_threads", PW_TYPE_INTEGER, rlm_mschap_t, wb_async_threads), .dflt = "0" },
 #endif
 #ifdef __APPLE__
 	{ FR_CONF_OFFSET("use_open_directory", PW_TYPE_BOOLEAN, rlm_mschap_t, open_directory), .dflt = "yes" },
@@ -615,11 +651,32 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 #ifdef WITH_AUTH_WINBIND
 		inst->method = AUTH_WBCLIENT;
 
-		inst->wb_pool = module_connection_pool_init(conf, inst, mod_conn_create, NULL, NULL, NULL, NULL);
-		if (!inst->wb_pool) {
-			cf_log_err_cs(conf, "Unable to initialise winbind connection pool");
+		if (inst->wb_async_threads > 256) {
+			cf_log_err_cs(conf, "winbind_async_threads '%u' is too large (maximum: 256)",
+				      inst->wb_async_threads);
 			return -1;
 		}
+
+		/*
+		 *	The I/O threads each have their own winbind
+		 *	context, so the connection pool isn't needed.
+		 *	Instance data is read only after instantiation,
+		 *	so the queue can't be parented by it.
+		 */
+		if (inst->wb_async_threads) {
+			inst->wb_async = wbclient_async_alloc(NULL, inst->wb_async_threads);
+			if (!inst->wb_async) {
+				cf_log_err_cs(conf, "Unable to start winbind I/O threads");
+				return -1;
+			}
+		} else {
+			inst->wb_pool = module_connection_pool_init(conf, inst, mod_conn_create,
+								    NULL, NULL, NULL, NULL);
+			if (!inst->wb_pool) {
+				cf_log_err_cs(conf, "Unable to initialise winbind connection pool");
+				return -1;
+			}
+		}
 #else
 		cf_log_err_cs(conf, "'winbind' auth not enabled at compiled time");
 		return -1;
@@ -631,6 +688,21 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	if (inst->ntlm_helper) {
+		if (inst->ntlm_auth) {
+			cf_log_err_cs(conf, "'ntlm_auth' and 'ntlm_auth_helper' cannot be used together");
+			return -1;
+		}
+
+		if ((inst->ntlm_helper_processes < 1) || (inst->ntlm_helper_processes > 64)) {
+			cf_log_err_cs(conf, "ntlm_auth_helper processes '%u' must be between 1 and 64",
+				      inst->ntlm_helper_processes);
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("%s: using internal authentication", inst->xlat_name);
@@ -638,9 +710,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("%s : authenticating by calling 'ntlm_auth'", inst->xlat_name);
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("%s : authenticating via persistent 'ntlm_auth' helpers", inst->xlat_name);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
-		DEBUG("%s : authenticating directly to winbind", inst->xlat_name);
+		DEBUG("%s : authenticating directly to winbind%s", inst->xlat_name,
+		      inst->wb_async ? " from I/O threads" : "");
 		break;
 #endif
 	}
@@ -665,6 +741,55 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/** Create the thread's ntlm_auth helper pool
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_mschap_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_t		*inst = instance;
+	rlm_mschap_thread_t	*t = thread;
+
+#ifdef WITH_AUTH_WINBIND
+	if (inst->wb_async) {
+		t->wb_return = fr_job_return_alloc(inst->wb_async, el, unlang_resumable);
+		if (!t->wb_return) return -1;
+	}
+#endif
+
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
+
+	t->ntlm_pool = mschap_ntlm_pool_alloc(NULL, el, inst->ntlm_helper, inst->ntlm_helper_processes,
+					      inst->ntlm_auth_timeout);
+	if (!t->ntlm_pool) return -1;
+
+	return 0;
+}
+
+/** Stop the thread's ntlm_auth helpers
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_mschap_thread_t	*t = thread;
+
+	TALLOC_FREE(t->ntlm_pool);
+#ifdef WITH_AUTH_WINBIND
+	fr_job_return_free(t->wb_return);
+	t->wb_return = NULL;
+#endif
+
+	return 0;
+}
+
 /*
  *	Tidy up instance
  */
@@ -674,6 +799,7 @@ static int mod_detach(UNUSED void *instance)
 	rlm_mschap_t *inst = instance;
 
 	fr_connection_pool_free(inst->wb_pool);
+	fr_job_pool_free(inst->wb_async);
 #endif
 
 	return 0;
@@ -1751,6 +1877,245 @@ static rlm_rcode_t CC_HINT(nonnull) process_cpw_request(rlm_mschap_t const *inst
 }
 
 
+/** Check the result of authentication, and add MS-CHAP2-Success and MPPE keys to the reply
+ *
+ * @param[in] inst		of rlm_mschap.
+ * @param[in] request		being authenticated.
+ * @param[in] auth_ctx		challenge, response and nthashhash of the authentication attempt.
+ * @param[in] mschap_result	as returned by #do_mschap (or the ntlm_auth helper).
+ * @return
+ *	- RLM_MODULE_OK on success.
+ *	- The rcode returned by #mschap_error on failure.
+ */
+static rlm_rcode_t mschap_auth_finish(rlm_mschap_t const *inst, REQUEST *request, mschap_auth_ctx_t *auth_ctx,
+				      int mschap_result)
+{
+	VALUE_PAIR	*response = auth_ctx->response;
+	rlm_rcode_t	rcode;
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	rcode = mschap_error(inst, request, *response->vp_octets,
+			     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	if (auth_ctx->mschap_version == 2) {
+		char		msch2resp[42];
+		char const	*username_string = auth_ctx->username_string;
+
+#ifdef WITH_AUTH_WINBIND
+		if (inst->wb_retry_with_normalised_username) {
+			VALUE_PAIR *response_name;
+
+			if ((response_name = fr_pair_find_by_num(request->packet->vps, PW_MS_CHAP_USER_NAME, 0, TAG_ANY))) {
+				if (strcmp(username_string, response_name->vp_strvalue)) {
+					RDEBUG2("Changing username %s to %s", username_string, response_name->vp_strvalue);
+					username_string = response_name->vp_strvalue;
+				}
+			}
+		}
+#endif
+
+		mschap_auth_response(username_string,			/* without the domain */
+				     auth_ctx->nthashhash,		/* nt-hash-hash */
+				     response->vp_octets + 26,		/* peer response */
+				     response->vp_octets + 2,		/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
+				     msch2resp);			/* calculated MPPE key */
+		mschap_add_reply(request, *response->vp_octets, "MS-CHAP2-Success", msch2resp, 42);
+	}
+
+	/* now create MPPE attributes */
+	if (inst->use_mppe) {
+		uint8_t mppe_sendkey[34];
+		uint8_t mppe_recvkey[34];
+
+		switch (auth_ctx->mschap_version) {
+		case 1:
+			RDEBUG2("Adding MS-CHAPv1 MPPE keys");
+			memset(mppe_sendkey, 0, 32);
+			if (auth_ctx->lm_password) memcpy(mppe_sendkey, auth_ctx->lm_password->vp_octets, 8);
+
+			/*
+			 *	According to RFC 2548 we
+			 *	should send NT hash.  But in
+			 *	practice it doesn't work.
+			 *	Instead, we should send auth_ctx->nthashhash
+			 *
+			 *	This is an error in RFC 2548.
+			 */
+			/*
+			 *	do_mschap cares to zero auth_ctx->nthashhash if NT hash
+			 *	is not available.
+			 */
+			memcpy(mppe_sendkey + 8, auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+			mppe_add_reply(request, "MS-CHAP-MPPE-Keys", mppe_sendkey, 24);
+			break;
+
+		case 2:
+			RDEBUG2("Adding MS-CHAPv2 MPPE keys");
+			mppe_chap2_gen_keys128(auth_ctx->nthashhash, auth_ctx->response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+
+			mppe_add_reply(request, "MS-MPPE-Recv-Key", mppe_recvkey, 16);
+			mppe_add_reply(request, "MS-MPPE-Send-Key", mppe_sendkey, 16);
+			break;
+
+		default:
+			rad_assert(0);
+			break;
+		}
+
+		pair_make_reply("MS-MPPE-Encryption-Policy",
+			       (inst->require_encryption) ? "0x00000002":"0x00000001", T_OP_EQ);
+		pair_make_reply("MS-MPPE-Encryption-Types",
+			       (inst->require_strong) ? "0x00000004":"0x00000006", T_OP_EQ);
+	} /* else we weren't asked to use MPPE */
+
+	return RLM_MODULE_OK;
+}
+
+/** Process the ntlm_auth helper's or winbind's answer
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(ctx, mschap_auth_ctx_t);
+	int			mschap_result;
+	rlm_rcode_t		rcode;
+
+#ifdef WITH_AUTH_WINBIND
+	if (auth_ctx->wb_job) {
+		mschap_result = wbclient_job_finish(request, auth_ctx->wb_job, auth_ctx->nthashhash);
+		auth_ctx->wb_job = NULL;
+	} else
+#endif
+	{
+		mschap_result = mschap_ntlm_query_result(request, auth_ctx->query, auth_ctx->nthashhash);
+		auth_ctx->query = NULL;
+	}
+
+	rcode = mschap_auth_finish(instance, request, auth_ctx, mschap_result);
+	talloc_free(auth_ctx);
+
+	return rcode;
+}
+
+/** Stop waiting for the ntlm_auth helper or winbind if the request is cancelled
+ *
+ * Freeing the context cancels the query.  The answer is discarded.
+ */
+static void mod_authenticate_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				    fr_state_action_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(ctx, mschap_auth_ctx_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending MS-CHAP authentication");
+
+	talloc_free(auth_ctx);
+}
+
+#ifdef WITH_AUTH_WINBIND
+/** Cancel the winbind authentication, if it's still outstanding
+ *
+ * Jobs aren't parented by the auth_ctx, as they may be freed by an I/O thread.
+ */
+static int _mschap_auth_ctx_free(mschap_auth_ctx_t *auth_ctx)
+{
+	if (auth_ctx->wb_job) fr_job_cancel(auth_ctx->wb_job);
+
+	return 0;
+}
+
+/** Queue the challenge and response for a winbind I/O thread, and yield until it's been processed
+ *
+ * @param[in] inst		of rlm_mschap.
+ * @param[in] t			thread specific data.
+ * @param[in] request		being authenticated.
+ * @param[in] auth_ctx		to copy onto the request, and finish authentication with.
+ * @param[in] challenge		8 byte MS-CHAPv1 challenge.
+ * @param[in] response		24 byte NT response.
+ * @return
+ *	- RLM_MODULE_YIELD if the authentication was queued.
+ *	- The result of #mschap_auth_finish if it wasn't.
+ */
+static rlm_rcode_t mschap_wbclient_yield(rlm_mschap_t const *inst, rlm_mschap_thread_t *t, REQUEST *request,
+					 mschap_auth_ctx_t *auth_ctx, uint8_t const *challenge,
+					 uint8_t const *response)
+{
+	mschap_auth_ctx_t	*yield_ctx;
+
+	rad_assert(t->wb_return);
+
+	yield_ctx = talloc_memdup(request, auth_ctx, sizeof(*auth_ctx));
+	if (!yield_ctx) return mschap_auth_finish(inst, request, auth_ctx, -1);
+	talloc_set_type(yield_ctx, mschap_auth_ctx_t);
+
+	yield_ctx->wb_job = wbclient_job_send(inst, t->wb_return, request, challenge, response);
+	if (!yield_ctx->wb_job) {
+		talloc_free(yield_ctx);
+		return mschap_auth_finish(inst, request, auth_ctx, -1);
+	}
+	talloc_set_destructor(yield_ctx, _mschap_auth_ctx_free);
+
+	return unlang_yield(request, mod_authenticate_resume, mod_authenticate_action, yield_ctx);
+}
+#endif
+
+/** Send the challenge and response to an ntlm_auth helper, and yield until it answers
+ *
+ * @param[in] inst		of rlm_mschap.
+ * @param[in] t			thread specific data, holding the helper pool.
+ * @param[in] request		being authenticated.
+ * @param[in] auth_ctx		to copy onto the request, and finish authentication with.
+ * @param[in] challenge		8 byte MS-CHAPv1 challenge.
+ * @param[in] response		24 byte NT or LM response.
+ * @param[in] lm		Whether response is an LM response.
+ * @return
+ *	- RLM_MODULE_YIELD if the query was sent.
+ *	- The result of #mschap_auth_finish if it wasn't.
+ */
+static rlm_rcode_t mschap_auth_yield(rlm_mschap_t const *inst, rlm_mschap_thread_t *t, REQUEST *request,
+				     mschap_auth_ctx_t *auth_ctx, uint8_t const *challenge,
+				     uint8_t const *response, bool lm)
+{
+	mschap_auth_ctx_t	*yield_ctx;
+	char			*username = NULL, *domain = NULL;
+
+	rad_assert(t->ntlm_pool);
+
+	if (tmpl_aexpand(request, &username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding ntlm_auth_helper username");
+		return mschap_auth_finish(inst, request, auth_ctx, -1);
+	}
+
+	if (inst->ntlm_helper_domain &&
+	    (tmpl_aexpand(request, &domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0)) {
+		RWDEBUG2("Failed expanding ntlm_auth_helper domain, username must be full-username to work");
+		domain = NULL;
+	}
+
+	RDEBUG2("Authenticating \"%s\" via ntlm_auth helper", username);
+
+	yield_ctx = talloc_memdup(request, auth_ctx, sizeof(*auth_ctx));
+	if (yield_ctx) {
+		talloc_set_type(yield_ctx, mschap_auth_ctx_t);
+		yield_ctx->query = mschap_ntlm_query_send(yield_ctx, t->ntlm_pool, request, username, domain,
+							  challenge, response, lm);
+	}
+	talloc_free(username);
+	talloc_free(domain);
+
+	if (!yield_ctx || !yield_ctx->query) {
+		talloc_free(yield_ctx);
+		return mschap_auth_finish(inst, request, auth_ctx, -1);
+	}
+
+	return unlang_yield(request, mod_authenticate_resume, mod_authenticate_action, yield_ctx);
+}
+
 /*
  *	mod_authenticate() - authenticate user based on given
  *	attributes and configuration.
@@ -1768,7 +2133,7 @@ static rlm_rcode_t CC_HINT(nonnull) process_cpw_request(rlm_mschap_t const *inst
  *	If MS-CHAP2 succeeds we MUST return
  *	PW_MSCHAP2_SUCCESS
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_mschap_t const *inst = instance;
 	VALUE_PAIR *challenge = NULL;
@@ -1777,12 +2142,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	VALUE_PAIR *password = NULL;
 	VALUE_PAIR *lm_password, *nt_password, *smb_ctrl;
 	VALUE_PAIR *username;
-	uint8_t nthashhash[NT_DIGEST_LENGTH];
-	char msch2resp[42];
 	char const *username_string;
 	int mschap_version = 0;
 	int mschap_result;
 	MSCHAP_AUTH_METHOD auth_method;
+	mschap_auth_ctx_t auth_ctx = { .mschap_version = 0 };
 
 	/*
 	 *	If we have ntlm_auth configured, use it unless told
@@ -1848,6 +2212,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	}
 
 
+	auth_ctx.lm_password = lm_password;
+	auth_ctx.smb_ctrl = smb_ctrl;
+
 	/*
 	 *	Check to see if this is a change password request, and process
 	 *	it accordingly if so.
@@ -1907,7 +2274,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	 */
 	if (response) {
 		int		offset;
-		rlm_rcode_t	rcode;
 		mschap_version = 1;
 
 		/*
@@ -1940,22 +2306,30 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 			offset = 2;
 		}
 
+		auth_ctx.mschap_version = mschap_version;
+		auth_ctx.challenge = challenge;
+		auth_ctx.response = response;
+
+		if (auth_method == AUTH_NTLMAUTH_HELPER) {
+			return mschap_auth_yield(inst, thread, request, &auth_ctx, challenge->vp_octets,
+						 response->vp_octets + offset, (offset == 2));
+		}
+#ifdef WITH_AUTH_WINBIND
+		if ((auth_method == AUTH_WBCLIENT) && inst->wb_async) {
+			return mschap_wbclient_yield(inst, thread, request, &auth_ctx, challenge->vp_octets,
+						     response->vp_octets + offset);
+		}
+#endif
+
 		/*
 		 *	Do the MS-CHAP authentication.
 		 */
 		mschap_result = do_mschap(inst, request, password, challenge->vp_octets,
-					  response->vp_octets + offset, nthashhash, auth_method);
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		rcode = mschap_error(inst, request, *response->vp_octets,
-				     mschap_result, mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) return rcode;
+					  response->vp_octets + offset, auth_ctx.nthashhash, auth_method);
 	} else if ((response = fr_pair_find_by_num(request->packet->vps, VENDORPEC_MICROSOFT, PW_MSCHAP2_RESPONSE,
 						   TAG_ANY)) != NULL) {
 		uint8_t		mschapv1_challenge[16];
 		VALUE_PAIR	*name_attr, *response_name;
-		rlm_rcode_t	rcode;
 
 		mschap_version = 2;
 
@@ -2047,101 +2421,47 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 				      mschapv1_challenge);	/* resulting challenge */
 
 		RDEBUG2("Client is using MS-CHAPv2");
-		mschap_result = do_mschap(inst, request, nt_password, mschapv1_challenge,
-					  response->vp_octets + 26, nthashhash, auth_method);
 
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		rcode = mschap_error(inst, request, *response->vp_octets,
-				     mschap_result, mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) return rcode;
+		auth_ctx.mschap_version = mschap_version;
+		auth_ctx.challenge = challenge;
+		auth_ctx.response = response;
+		auth_ctx.username_string = username_string;
 
+		if (auth_method == AUTH_NTLMAUTH_HELPER) {
+			return mschap_auth_yield(inst, thread, request, &auth_ctx, mschapv1_challenge,
+						 response->vp_octets + 26, false);
+		}
 #ifdef WITH_AUTH_WINBIND
-		if (inst->wb_retry_with_normalised_username) {
-			if ((response_name = fr_pair_find_by_num(request->packet->vps, PW_MS_CHAP_USER_NAME, 0, TAG_ANY))) {
-				if (strcmp(username_string, response_name->vp_strvalue)) {
-					RDEBUG2("Changing username %s to %s", username_string, response_name->vp_strvalue);
-					username_string = response_name->vp_strvalue;
-				}
-			}
+		if ((auth_method == AUTH_WBCLIENT) && inst->wb_async) {
+			return mschap_wbclient_yield(inst, thread, request, &auth_ctx, mschapv1_challenge,
+						     response->vp_octets + 26);
 		}
 #endif
 
-		mschap_auth_response(username_string,		/* without the domain */
-				     nthashhash,		/* nt-hash-hash */
-				     response->vp_octets + 26,	/* peer response */
-				     response->vp_octets + 2,	/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
-				     msch2resp);		/* calculated MPPE key */
-		mschap_add_reply(request, *response->vp_octets, "MS-CHAP2-Success", msch2resp, 42);
-
-
+		mschap_result = do_mschap(inst, request, nt_password, mschapv1_challenge,
+					  response->vp_octets + 26, auth_ctx.nthashhash, auth_method);
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("You set 'Auth-Type = MS-CHAP' for a request that does not contain any MS-CHAP attributes!");
 		return RLM_MODULE_INVALID;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		uint8_t mppe_sendkey[34];
-		uint8_t mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Adding MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
-			if (lm_password) memcpy(mppe_sendkey, lm_password->vp_octets, 8);
-
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(request, "MS-CHAP-MPPE-Keys", mppe_sendkey, 24);
-			break;
-
-		case 2:
-			RDEBUG2("Adding MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
-
-			mppe_add_reply(request, "MS-MPPE-Recv-Key", mppe_recvkey, 16);
-			mppe_add_reply(request, "MS-MPPE-Send-Key", mppe_sendkey, 16);
-			break;
-
-		default:
-			rad_assert(0);
-			break;
-		}
-
-		pair_make_reply("MS-MPPE-Encryption-Policy",
-			       (inst->require_encryption) ? "0x00000002":"0x00000001", T_OP_EQ);
-		pair_make_reply("MS-MPPE-Encryption-Types",
-			       (inst->require_strong) ? "0x00000004":"0x00000006", T_OP_EQ);
-	} /* else we weren't asked to use MPPE */
-
-	return RLM_MODULE_OK;
+	return mschap_auth_finish(inst, request, &auth_ctx, mschap_result);
 #undef inst
 }
 
 extern rad_module_t rlm_mschap;
 rad_module_t rlm_mschap = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "mschap",
-	.type		= 0,
-	.inst_size	= sizeof(rlm_mschap_t),
-	.config		= module_config,
-	.bootstrap	= mod_bootstrap,
-	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "mschap",
+	.type			= 0,
+	.inst_size		= sizeof(rlm_mschap_t),
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
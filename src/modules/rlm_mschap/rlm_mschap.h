@@ -11,14 +11,17 @@ RCSIDH(rlm_mschap_h, "$Id$")
 #  include <wbclient.h>
 
 #include <freeradius-devel/connection.h>
+#include <freeradius-devel/job_pool.h>
+
 #endif
 
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 2
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	,AUTH_WBCLIENT       	= 3
 #endif
 } MSCHAP_AUTH_METHOD;
 
@@ -34,6 +37,10 @@ typedef struct rlm_mschap_t {
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
 	char const		*local_cpw;
+	char const		*ntlm_helper;		//!< ntlm_auth command line, in ntlm-server-1 mode.
+	vp_tmpl_t		*ntlm_helper_username;
+	vp_tmpl_t		*ntlm_helper_domain;
+	uint32_t		ntlm_helper_processes;	//!< Helpers to run, per worker thread.
 	char const		*auth_type;
 	bool			allow_retry;
 	char const		*retry_msg;
@@ -43,6 +50,8 @@ typedef struct rlm_mschap_t {
 #ifdef WITH_AUTH_WINBIND
 	fr_connection_pool_t	*wb_pool;
 	bool			wb_retry_with_normalised_username;
+	uint32_t		wb_async_threads;	//!< I/O threads to run winbind authentications in.
+	fr_job_pool_t		*wb_async;		//!< Runs authentications, if wb_async_threads is set.
 #endif
 #ifdef __APPLE__
 	bool			open_directory;
@@ -26,8 +26,9 @@
 
 /* NOTES:
 
-   This code makes no attempt to be fast! In fact, it is a very
-   slow implementation
+   The permutations and S-boxes below are expanded into nibble indexed
+   lookup tables the first time they're needed, so a block is a few
+   hundred table lookups rather than a bit at a time.
 
    This code is NOT a complete DES implementation. It implements only
    the minimum necessary for SMB authentication, as used by all SMB
@@ -50,6 +51,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/libradius.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "smbdes.h"
 
 
@@ -154,115 +156,116 @@ static const uchar sbox[8][4][16] = {
 	 {7, 11,  4,  1,  9, 12, 14,  2,  0,  6, 10, 13, 15,  3,  5,  8},
 	 {2,  1, 14,  7,  4, 10,  8, 13, 15, 12,  9,  0,  3,  5,  6, 11}}};
 
-static void permute(char *out, char const *in, uchar const *p, int n)
-{
-	int i;
-	for (i=0;i<n;i++)
-		out[i] = in[p[i]-1];
-}
+/*
+ *	Each permutation is applied a nibble of input at a time, with
+ *	the output bits set by every possible value of every nibble
+ *	precomputed.  Values are right aligned, with DES bit 1 as the
+ *	most significant bit.
+ */
+static uint64_t ip_table[16][16];	/* perm3, 64 -> 64 */
+static uint64_t fp_table[16][16];	/* perm6, 64 -> 64 */
+static uint64_t pc1_table[16][16];	/* perm1, 64 -> 56 */
+static uint64_t pc2_table[14][16];	/* perm2, 56 -> 48 */
+static uint64_t e_table[8][16];		/* perm4, 32 -> 48 */
+static uint32_t sp_table[8][64];	/* sbox followed by perm5 */
 
-static void lshift(char *d, int count, int n)
-{
-	char out[64];
-	int i;
-	for (i=0;i<n;i++)
-		out[i] = d[(i+count)%n];
-	for (i=0;i<n;i++)
-		d[i] = out[i];
-}
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 
-static void concat(char *out, char *in1, char *in2, int l1, int l2)
+static void perm_init(uint64_t table[][16], uchar const *p, int n)
 {
-	while (l1--)
-		*out++ = *in1++;
-	while (l2--)
-		*out++ = *in2++;
+	int i, v;
+
+	for (i = 0; i < n; i++) {
+		int j = p[i] - 1;
+
+		for (v = 0; v < 16; v++) {
+			if (v & (1 << (3 - (j % 4)))) table[j / 4][v] |= ((uint64_t) 1) << (n - 1 - i);
+		}
+	}
 }
 
-static void xor(char *out, char *in1, char *in2, int n)
+static inline uint64_t permute(uint64_t const table[][16], uint64_t in, int w)
 {
-	int i;
-	for (i=0;i<n;i++)
-		out[i] = in1[i] ^ in2[i];
+	uint64_t	out = 0;
+	int		k;
+
+	for (k = 0; k < (w / 4); k++) out |= table[k][(in >> (w - (4 * (k + 1)))) & 0x0f];
+
+	return out;
 }
 
-static void dohash(char *out, char *in, char *key)
+static void tables_init(void)
 {
-	int i, j, k;
-	char pk1[56];
-	char c[28];
-	char d[28];
-	char cd[56];
-	char ki[16][48];
-	char pd1[64];
-	char l[32], r[32];
-	char rl[64];
-
-	permute(pk1, key, perm1, 56);
-
-	for (i=0;i<28;i++)
-		c[i] = pk1[i];
-	for (i=0;i<28;i++)
-		d[i] = pk1[i+28];
-
-	for (i=0;i<16;i++) {
-		lshift(c, sc[i], 28);
-		lshift(d, sc[i], 28);
-
-		concat(cd, c, d, 28, 28);
-		permute(ki[i], cd, perm2, 48);
-	}
+	static uint64_t p_table[8][16];	/* perm5, 32 -> 32, only needed to build sp_table */
+	int j, b;
+
+	perm_init(ip_table, perm3, 64);
+	perm_init(fp_table, perm6, 64);
+	perm_init(pc1_table, perm1, 56);
+	perm_init(pc2_table, perm2, 48);
+	perm_init(e_table, perm4, 48);
+	perm_init(p_table, perm5, 32);
+
+	for (j = 0; j < 8; j++) {
+		for (b = 0; b < 64; b++) {
+			int m, n;
 
-	permute(pd1, in, perm3, 64);
+			m = ((b >> 4) & 0x02) | (b & 0x01);
+			n = (b >> 1) & 0x0f;
 
-	for (j=0;j<32;j++) {
-		l[j] = pd1[j];
-		r[j] = pd1[j+32];
+			sp_table[j][b] = permute(p_table, ((uint64_t) sbox[j][m][n]) << (28 - (4 * j)), 32);
+		}
 	}
+}
 
-	for (i=0;i<16;i++) {
-		char er[48];
-		char erk[48];
-		char b[8][6];
-		char cb[32];
-		char pcb[32];
-		char r2[32];
+static void dohash(uint8_t out[8], uint8_t const in[8], uint8_t const key[8])
+{
+	int		i, j;
+	uint64_t	block = 0, k = 0, pk1;
+	uint64_t	ki[16];
+	uint32_t	c, d, l, r;
 
-		permute(er, r, perm4, 48);
+	(void) pthread_once(&tables_once, tables_init);
 
-		xor(erk, er, ki[i], 48);
+	for (i = 0; i < 8; i++) {
+		block = (block << 8) | in[i];
+		k = (k << 8) | key[i];
+	}
 
-		for (j=0;j<8;j++)
-			for (k=0;k<6;k++)
-				b[j][k] = erk[j*6 + k];
+	pk1 = permute(pc1_table, k, 64);
+	c = (pk1 >> 28) & 0x0fffffff;
+	d = pk1 & 0x0fffffff;
 
-		for (j=0;j<8;j++) {
-			int m, n;
-			m = (b[j][0]<<1) | b[j][5];
+	for (i = 0; i < 16; i++) {
+		c = ((c << sc[i]) | (c >> (28 - sc[i]))) & 0x0fffffff;
+		d = ((d << sc[i]) | (d >> (28 - sc[i]))) & 0x0fffffff;
 
-			n = (b[j][1]<<3) | (b[j][2]<<2) | (b[j][3]<<1) | b[j][4];
+		ki[i] = permute(pc2_table, (((uint64_t) c) << 28) | d, 56);
+	}
 
-			for (k=0;k<4;k++)
-				b[j][k] = (sbox[j][m][n] & (1<<(3-k)))?1:0;
-		}
+	block = permute(ip_table, block, 64);
+	l = block >> 32;
+	r = block & 0xffffffff;
 
-		for (j=0;j<8;j++)
-			for (k=0;k<4;k++)
-				cb[j*4+k] = b[j][k];
-		permute(pcb, cb, perm5, 32);
+	for (i = 0; i < 16; i++) {
+		uint64_t	erk;
+		uint32_t	f = 0;
 
-		xor(r2, l, pcb, 32);
+		erk = permute(e_table, r, 32) ^ ki[i];
 
-		for (j=0;j<32;j++)
-			l[j] = r[j];
+		for (j = 0; j < 8; j++) f |= sp_table[j][(erk >> (42 - (6 * j))) & 0x3f];
 
-		for (j=0;j<32;j++)
-			r[j] = r2[j];
+		f ^= l;
+		l = r;
+		r = f;
 	}
 
-	concat(rl, r, l, 32, 32);
+	block = permute(fp_table, (((uint64_t) r) << 32) | l, 64);
 
-	permute(out, rl, perm6, 64);
+	for (i = 7; i >= 0; i--) {
+		out[i] = block & 0xff;
+		block >>= 8;
+	}
 }
 
 static void str_to_key(unsigned char *str,unsigned char *key)
@@ -285,30 +288,11 @@ static void str_to_key(unsigned char *str,unsigned char *key)
 
 void smbhash(unsigned char *out, unsigned char const *in, unsigned char *key)
 {
-	int i;
-	char outb[64];
-	char inb[64];
-	char keyb[64];
 	unsigned char key2[8];
 
 	str_to_key(key, key2);
 
-	for (i=0;i<64;i++) {
-		inb[i] = (in[i/8] & (1<<(7-(i%8)))) ? 1 : 0;
-		keyb[i] = (key2[i/8] & (1<<(7-(i%8)))) ? 1 : 0;
-		outb[i] = 0;
-	}
-
-	dohash(outb, inb, keyb);
-
-	for (i=0;i<8;i++) {
-		out[i] = 0;
-	}
-
-	for (i=0;i<64;i++) {
-		if (outb[i])
-			out[i/8] |= (1<<(7-(i%8)));
-	}
+	dohash(out, in, key2);
 }
 
 /*
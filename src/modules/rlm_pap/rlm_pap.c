@@ -30,8 +30,10 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/base64.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/job_pool.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #include "../../include/md5.h"
 #include "../../include/sha1.h"
@@ -47,14 +49,31 @@ USES_APPLE_DEPRECATED_API
  *      a lot cleaner to do so, and a pointer to the structure can
  *      be used as the instance handle.
  */
+typedef struct pap_crypt_job pap_crypt_job_t;
+typedef struct pap_crypt_cache pap_crypt_cache_t;
+
 typedef struct rlm_pap_t {
-	char const	*name;
-	int		auth_type;
-	bool		normify;
+	char const		*name;
+	int			auth_type;
+	bool			normify;
+
+	uint32_t		crypt_threads;		//!< Number of threads to check Crypt-Password with.
+	uint32_t		crypt_cache_size;	//!< Maximum number of successful crypt checks to remember.
+	uint32_t		crypt_cache_lifetime;	//!< How long successful crypt checks are remembered for.
+
+	fr_job_pool_t		*crypt_pool;		//!< Threads running crypt checks for all workers.
+	pap_crypt_cache_t	*crypt_cache;		//!< Successful crypt checks.
 } rlm_pap_t;
 
+typedef struct rlm_pap_thread_t {
+	fr_job_return_t		*crypt_return;		//!< Where this worker receives completed crypt checks.
+} rlm_pap_thread_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", PW_TYPE_BOOLEAN, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_OFFSET("crypt_threads", PW_TYPE_INTEGER, rlm_pap_t, crypt_threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("crypt_cache_size", PW_TYPE_INTEGER, rlm_pap_t, crypt_cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("crypt_cache_lifetime", PW_TYPE_INTEGER, rlm_pap_t, crypt_cache_lifetime), .dflt = "30" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -98,6 +117,247 @@ static const FR_NAME_NUMBER header_names[] = {
 	{ NULL, 0 }
 };
 
+/** A successful crypt check
+ *
+ * Entries are indexed by a digest of the known good crypt and the
+ * password which matched it, so neither is kept in memory.
+ */
+typedef struct pap_crypt_cache_entry_t {
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< Digest of the crypt and password.
+	time_t			expires;	//!< When the check must be performed again.
+	int32_t			heap_id;	//!< Position in the expiry heap.
+} pap_crypt_cache_entry_t;
+
+/** Successful crypt checks, shared by all workers
+ *
+ */
+struct pap_crypt_cache {
+	rbtree_t		*tree;		//!< Entries indexed by key.
+	fr_heap_t		*heap;		//!< Entries ordered by expiry.
+	pthread_mutex_t		mutex;		//!< Protects the tree and heap.
+
+	uint8_t			secret[16];	//!< Mixed into keys, so they can't be precomputed.
+	uint32_t		max_entries;	//!< Maximum number of entries.  0 = unlimited.
+	uint32_t		lifetime;	//!< How long entries are valid for.
+};
+
+static int crypt_cache_entry_cmp(void const *one, void const *two)
+{
+	pap_crypt_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static int crypt_cache_heap_cmp(void const *one, void const *two)
+{
+	pap_crypt_cache_entry_t const *a = one, *b = two;
+
+	return (a->expires > b->expires) - (a->expires < b->expires);
+}
+
+static int _crypt_cache_free(pap_crypt_cache_t *cache)
+{
+	fr_heap_delete(cache->heap);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for successful crypt checks
+ *
+ * @param[in] ctx		to allocate the cache in.  Must not be read only.
+ * @param[in] max_entries	Maximum number of entries.  0 = unlimited.
+ * @param[in] lifetime		How long entries are valid for.
+ * @return
+ *	- New cache.
+ *	- NULL on error.
+ */
+static pap_crypt_cache_t *crypt_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t lifetime)
+{
+	pap_crypt_cache_t	*cache;
+	size_t			i;
+
+	cache = talloc_zero(ctx, pap_crypt_cache_t);
+	if (!cache) return NULL;
+
+	cache->tree = rbtree_create(cache, crypt_cache_entry_cmp, rbtree_node_talloc_free, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+	error:
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+		fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	cache->heap = fr_heap_create(crypt_cache_heap_cmp, offsetof(pap_crypt_cache_entry_t, heap_id));
+	if (!cache->heap) {
+		pthread_mutex_destroy(&cache->mutex);
+		fr_strerror_printf("Failed creating expiry heap");
+		goto error;
+	}
+	talloc_set_destructor(cache, _crypt_cache_free);
+
+	for (i = 0; i < sizeof(cache->secret); i++) cache->secret[i] = fr_rand();
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+
+	return cache;
+}
+
+/** Calculate the key for a password and known good crypt
+ *
+ */
+static void crypt_cache_key(pap_crypt_cache_t const *cache, uint8_t key[SHA1_DIGEST_LENGTH],
+			    char const *password, char const *reference)
+{
+	fr_sha1_ctx	sha1_context;
+
+	fr_sha1_init(&sha1_context);
+	fr_sha1_update(&sha1_context, cache->secret, sizeof(cache->secret));
+	fr_sha1_update(&sha1_context, (uint8_t const *) reference, strlen(reference) + 1);
+	fr_sha1_update(&sha1_context, (uint8_t const *) password, strlen(password));
+	fr_sha1_final(key, &sha1_context);
+}
+
+/** Check whether the password recently matched the crypt
+ *
+ * @param[in] cache	to check.
+ * @param[in] key	from #crypt_cache_key.
+ * @return
+ *	- true if the password matched, and the entry hasn't expired.
+ *	- false otherwise.
+ */
+static bool crypt_cache_find(pap_crypt_cache_t *cache, uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	pap_crypt_cache_entry_t	find, *entry;
+	time_t			now = time(NULL);
+	bool			found;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&cache->mutex);
+	while ((entry = fr_heap_peek(cache->heap)) && (entry->expires <= now)) {
+		fr_heap_extract(cache->heap, entry);
+		rbtree_deletebydata(cache->tree, entry);	/* Frees entry */
+	}
+	found = (rbtree_finddata(cache->tree, &find) != NULL);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Remember that a password matched a crypt
+ *
+ * @param[in] cache	to insert into.
+ * @param[in] key	from #crypt_cache_key.
+ */
+static void crypt_cache_insert(pap_crypt_cache_t *cache, uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	pap_crypt_cache_entry_t	*entry, *old;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = talloc_zero(cache, pap_crypt_cache_entry_t);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->expires = time(NULL) + cache->lifetime;
+	entry->heap_id = -1;
+
+	old = rbtree_finddata(cache->tree, entry);
+	if (old) {
+		fr_heap_extract(cache->heap, old);
+		rbtree_deletebydata(cache->tree, old);
+	}
+
+	while (cache->max_entries && (rbtree_num_elements(cache->tree) >= cache->max_entries)) {
+		old = fr_heap_peek(cache->heap);
+		fr_heap_extract(cache->heap, old);
+		rbtree_deletebydata(cache->tree, old);
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+	} else {
+		fr_heap_insert(cache->heap, entry);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** A crypt check to be run by a crypt thread
+ *
+ * The password and crypt are copied into the job, so that it can
+ * be run without touching the request.
+ */
+struct pap_crypt_job {
+	char			*password;	//!< Supplied by the user.
+	char			*reference;	//!< Known good crypt.
+
+	int			result;		//!< Of fr_crypt_check.
+};
+
+/** Run a crypt check in a crypt thread
+ *
+ */
+static void crypt_job_run(UNUSED void *thread, void *data, UNUSED void *uctx)
+{
+	pap_crypt_job_t *job = data;
+
+	job->result = fr_crypt_check(job->password, job->reference);
+}
+
+/** Fail a crypt check which won't be run
+ *
+ */
+static void crypt_job_fail(void *data, UNUSED void *uctx)
+{
+	pap_crypt_job_t *job = data;
+
+	job->result = -1;
+}
+
+/** Queue a crypt check to be run by a crypt thread
+ *
+ * The request is marked resumable when the job completes.
+ *
+ * @param[in] pool		of crypt threads.
+ * @param[in] r			of the worker processing the request.
+ * @param[in] request		being authenticated.
+ * @param[in] password		supplied by the user.
+ * @param[in] reference		known good crypt.
+ * @return
+ *	- The queued job.
+ *	- NULL on error.
+ */
+static fr_job_t *crypt_job_send(fr_job_pool_t *pool, fr_job_return_t *r, REQUEST *request,
+				char const *password, char const *reference)
+{
+	fr_job_t		*job;
+	pap_crypt_job_t		*crypt;
+
+	job = fr_job_alloc(r, request);
+	if (!job) return NULL;
+
+	crypt = talloc_zero(job, pap_crypt_job_t);
+	if (!crypt) goto error;
+
+	crypt->password = talloc_strdup(crypt, password);
+	crypt->reference = talloc_strdup(crypt, reference);
+	if (!crypt->password || !crypt->reference) goto error;
+
+	fr_job_send(pool, job, crypt);
+
+	return job;
+
+error:
+	fr_job_cancel(job);
+	return NULL;
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_pap_t		*inst = instance;
@@ -115,6 +375,85 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->auth_type = 0;
 	}
 
+	if (inst->crypt_threads > 256) {
+		cf_log_err_cs(conf, "crypt_threads '%u' is too large (maximum: 256)", inst->crypt_threads);
+		return -1;
+	}
+
+	/*
+	 *	Instance data is read only after instantiation,
+	 *	so the cache and queue can't be parented by it.
+	 */
+	if (inst->crypt_cache_size) {
+		if (!inst->crypt_cache_lifetime) {
+			cf_log_err_cs(conf, "crypt_cache_lifetime must be greater than 0");
+			return -1;
+		}
+
+		inst->crypt_cache = crypt_cache_alloc(NULL, inst->crypt_cache_size, inst->crypt_cache_lifetime);
+		if (!inst->crypt_cache) {
+			cf_log_err_cs(conf, "Failed creating crypt cache: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	if (inst->crypt_threads) {
+		inst->crypt_pool = fr_job_pool_alloc(NULL, "crypt", inst->crypt_threads,
+						     crypt_job_run, crypt_job_fail, NULL, NULL, NULL);
+		if (!inst->crypt_pool) {
+			cf_log_err_cs(conf, "Unable to start crypt threads");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Create the pipe completed crypt checks are received on
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_pap_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_pap_t		*inst = instance;
+	rlm_pap_thread_t	*t = thread;
+
+	if (!inst->crypt_pool) return 0;
+
+	t->crypt_return = fr_job_return_alloc(inst->crypt_pool, el, unlang_resumable);
+	if (!t->crypt_return) return -1;
+
+	return 0;
+}
+
+/** Stop receiving completed crypt checks
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_pap_thread_t	*t = thread;
+
+	fr_job_return_free(t->crypt_return);
+	t->crypt_return = NULL;
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_pap_t	*inst = instance;
+
+	fr_job_pool_free(inst->crypt_pool);
+	talloc_free(inst->crypt_cache);
+
 	return 0;
 }
 
@@ -537,19 +876,49 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_clear(UNUSED rlm_pap_t const *inst,
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(UNUSED rlm_pap_t const *inst, REQUEST *request, VALUE_PAIR *vp)
+/** Check whether the password was recently found to match the Crypt-Password
+ *
+ * @param[in] inst	of rlm_pap.
+ * @param[in] request	being authenticated.
+ * @param[in] vp	Crypt-Password.
+ * @param[out] key	to insert into the cache if the password matches.
+ * @return
+ *	- true if the password matched recently.
+ *	- false if it didn't, or there's no cache.
+ */
+static bool pap_crypt_cached(rlm_pap_t const *inst, REQUEST *request, VALUE_PAIR *vp,
+			     uint8_t key[SHA1_DIGEST_LENGTH])
+{
+	if (!inst->crypt_cache) return false;
+
+	crypt_cache_key(inst->crypt_cache, key, request->password->vp_strvalue, vp->vp_strvalue);
+	if (!crypt_cache_find(inst->crypt_cache, key)) return false;
+
+	RDEBUG("Password matched \"known good\" Crypt-Password recently, not checking it again");
+
+	return true;
+}
+
+static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(rlm_pap_t const *inst, REQUEST *request, VALUE_PAIR *vp)
 {
+	uint8_t key[SHA1_DIGEST_LENGTH];
+
 	if (RDEBUG_ENABLED3) {
 		RDEBUG3("Comparing with \"known good\" Crypt-Password \"%s\"", vp->vp_strvalue);
 	} else {
 		RDEBUG("Comparing with \"known-good\" Crypt-password");
 	}
 
+	if (pap_crypt_cached(inst, request, vp, key)) return RLM_MODULE_OK;
+
 	if (fr_crypt_check(request->password->vp_strvalue,
 			   vp->vp_strvalue) != 0) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
 		return RLM_MODULE_REJECT;
 	}
+
+	if (inst->crypt_cache) crypt_cache_insert(inst->crypt_cache, key);
+
 	return RLM_MODULE_OK;
 }
 
@@ -936,12 +1305,126 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_ns_mta_md5(UNUSED rlm_pap_t const *
 }
 
 
+/** Log the result of comparing passwords
+ *
+ */
+static rlm_rcode_t pap_auth_result(REQUEST *request, rlm_rcode_t rc)
+{
+	if (rc == RLM_MODULE_REJECT) {
+		RDEBUG("Passwords don't match");
+	}
+
+	if (rc == RLM_MODULE_OK) {
+		RDEBUG("User authenticated successfully");
+	}
+
+	return rc;
+}
+
+/** A crypt check the request is waiting for
+ *
+ */
+typedef struct pap_crypt_ctx_t {
+	fr_job_t		*job;		//!< Queued for a crypt thread.
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< To insert into the cache, if there's a cache.
+} pap_crypt_ctx_t;
+
+/** Cancel the crypt check, if it's still outstanding
+ *
+ * Jobs aren't parented by the crypt_ctx, as they may be freed by a crypt thread.
+ */
+static int _pap_crypt_ctx_free(pap_crypt_ctx_t *crypt_ctx)
+{
+	if (crypt_ctx->job) fr_job_cancel(crypt_ctx->job);
+
+	return 0;
+}
+
+/** Process the result of the crypt check
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_pap_t const		*inst = instance;
+	pap_crypt_ctx_t		*crypt_ctx = talloc_get_type_abort(ctx, pap_crypt_ctx_t);
+	pap_crypt_job_t		*job = fr_job_data(crypt_ctx->job);
+	rlm_rcode_t		rc;
+
+	if (job->result != 0) {
+		REDEBUG("Crypt digest does not match \"known good\" digest");
+		rc = RLM_MODULE_REJECT;
+	} else {
+		if (inst->crypt_cache) crypt_cache_insert(inst->crypt_cache, crypt_ctx->key);
+		rc = RLM_MODULE_OK;
+	}
+	talloc_free(crypt_ctx);
+
+	return pap_auth_result(request, rc);
+}
+
+/** Stop waiting for the crypt check if the request is cancelled
+ *
+ */
+static void mod_authenticate_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				    fr_state_action_t action)
+{
+	pap_crypt_ctx_t		*crypt_ctx = talloc_get_type_abort(ctx, pap_crypt_ctx_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending crypt check");
+
+	talloc_free(crypt_ctx);
+}
+
+/** Queue the Crypt-Password check for a crypt thread, and yield until it's been run
+ *
+ * @param[in] inst	of rlm_pap.
+ * @param[in] t		thread specific data.
+ * @param[in] request	being authenticated.
+ * @param[in] vp	Crypt-Password.
+ * @return
+ *	- RLM_MODULE_YIELD if the check was queued.
+ *	- RLM_MODULE_OK if the password matched recently.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t pap_crypt_yield(rlm_pap_t const *inst, rlm_pap_thread_t *t, REQUEST *request, VALUE_PAIR *vp)
+{
+	pap_crypt_ctx_t		*crypt_ctx;
+
+	if (RDEBUG_ENABLED3) {
+		RDEBUG3("Comparing with \"known good\" Crypt-Password \"%s\"", vp->vp_strvalue);
+	} else {
+		RDEBUG("Comparing with \"known-good\" Crypt-password");
+	}
+
+	crypt_ctx = talloc_zero(request, pap_crypt_ctx_t);
+	if (!crypt_ctx) return RLM_MODULE_FAIL;
+
+	if (pap_crypt_cached(inst, request, vp, crypt_ctx->key)) {
+		talloc_free(crypt_ctx);
+		return pap_auth_result(request, RLM_MODULE_OK);
+	}
+
+	crypt_ctx->job = crypt_job_send(inst->crypt_pool, t->crypt_return, request,
+					request->password->vp_strvalue, vp->vp_strvalue);
+	if (!crypt_ctx->job) {
+		REDEBUG("Failed queueing crypt check");
+		talloc_free(crypt_ctx);
+		return RLM_MODULE_FAIL;
+	}
+	talloc_set_destructor(crypt_ctx, _pap_crypt_ctx_free);
+
+	return unlang_yield(request, mod_authenticate_resume, mod_authenticate_action, crypt_ctx);
+}
+
 /*
  *	Authenticate the user via one of any well-known password.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_pap_t const *inst = instance;
+	rlm_pap_thread_t *t = thread;
 	VALUE_PAIR	*vp;
 	rlm_rcode_t	rc = RLM_MODULE_INVALID;
 	vp_cursor_t	cursor;
@@ -1041,20 +1524,18 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		return RLM_MODULE_FAIL;
 	}
 
+	/*
+	 *	Crypt can be slow enough to hold up the worker,
+	 *	so hand it to a crypt thread if we have them.
+	 */
+	if ((auth_func == &pap_auth_crypt) && t->crypt_return) return pap_crypt_yield(inst, t, request, vp);
+
 	/*
 	 *	Authenticate, and return.
 	 */
 	rc = auth_func(inst, request, vp);
 
-	if (rc == RLM_MODULE_REJECT) {
-		RDEBUG("Passwords don't match");
-	}
-
-	if (rc == RLM_MODULE_OK) {
-		RDEBUG("User authenticated successfully");
-	}
-
-	return rc;
+	return pap_auth_result(request, rc);
 }
 
 
@@ -1069,11 +1550,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
  */
 extern rad_module_t rlm_pap;
 rad_module_t rlm_pap = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "pap",
-	.inst_size	= sizeof(rlm_pap_t),
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "pap",
+	.inst_size		= sizeof(rlm_pap_t),
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -29,6 +29,10 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 struct mypasswd {
 	struct mypasswd *next;
 	char *listflag;
@@ -347,8 +351,29 @@ int main(void){
 }
 
 #else  /* TEST */
+/** Where to find the lines for a key in a memory mapped file
+ *
+ * Sorted by hash, then by position in the file, last line first.
+ */
+typedef struct passwd_index_entry_t {
+	uint32_t		hash;		//!< Of the key.
+	uint32_t		len;		//!< Of the line.
+	uint64_t		offset;		//!< Of the start of the line.
+} passwd_index_entry_t;
+
+/** A passwd file which is looked up in place
+ *
+ */
+typedef struct passwd_mmap_t {
+	uint8_t const		*data;		//!< Mapping of the file.
+	size_t			data_len;
+	passwd_index_entry_t	*index;
+	size_t			num_entries;
+} passwd_mmap_t;
+
 typedef struct rlm_passwd_t {
 	struct hashtable	*ht;
+	passwd_mmap_t		*map;
 	struct mypasswd		*pwdfmt;
 	char const		*filename;
 	char const		*format;
@@ -361,6 +386,7 @@ typedef struct rlm_passwd_t {
 	uint32_t		listable;
 	fr_dict_attr_t const		*keyattr;
 	bool			ignore_empty;
+	bool			mmap;
 } rlm_passwd_t;
 
 static const CONF_PARSER module_config[] = {
@@ -375,9 +401,196 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", PW_TYPE_BOOLEAN, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", PW_TYPE_INTEGER, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("mmap", PW_TYPE_BOOLEAN, rlm_passwd_t, mmap), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Allocate an entry large enough for any line read with fgets(buffer, 1024)
+ *
+ */
+static struct mypasswd *passwd_mmap_entry_alloc(TALLOC_CTX *ctx, int nfields, size_t *len)
+{
+	struct mypasswd *pw;
+
+	*len = sizeof(struct mypasswd) + nfields * sizeof (char*) + nfields * sizeof (char ) + 1024 + 1;
+	MEM(pw = (struct mypasswd *)talloc_zero_array(ctx, uint8_t, *len));
+
+	return pw;
+}
+
+/** Copy a line of the file, and split it into fields
+ *
+ * @return
+ *	- true if the line is an entry.
+ *	- false if it should be ignored.
+ */
+static bool passwd_mmap_line(rlm_passwd_t const *inst, uint8_t const *line, size_t len,
+			     struct mypasswd *pw, size_t pwlen)
+{
+	char buffer[1024];
+
+	if (len >= sizeof(buffer)) return false;
+	memcpy(buffer, line, len);
+	buffer[len] = '\0';
+
+	if (!*buffer || (*buffer == '\n') ||
+	    (inst->ignore_nislike && ((*buffer == '+') || (*buffer == '-')))) return false;
+
+	if (!string_to_entry(buffer, inst->nfields, *inst->delimiter ? *inst->delimiter : ':', pw, pwlen)) return false;
+
+	return (pw->field[inst->keyfield] && *pw->field[inst->keyfield]);
+}
+
+/** Check whether an entry has a key
+ *
+ * The key field is modified if it's a list.
+ */
+static bool passwd_mmap_match(rlm_passwd_t const *inst, struct mypasswd *pw, char const *name)
+{
+	char *list, *nextlist;
+
+	if (!inst->listable) return (strcmp(pw->field[inst->keyfield], name) == 0);
+
+	for (list = pw->field[inst->keyfield], nextlist = list; nextlist; list = nextlist) {
+		for (nextlist = list; *nextlist && *nextlist != ','; nextlist++);
+		if (!*nextlist) {
+			nextlist = NULL;
+		} else {
+			*nextlist++ = '\0';
+		}
+		if (strcmp(list, name) == 0) return true;
+	}
+
+	return false;
+}
+
+static int passwd_index_entry_cmp(void const *one, void const *two)
+{
+	passwd_index_entry_t const *a = one, *b = two;
+
+	if (a->hash != b->hash) return (a->hash < b->hash) ? -1 : 1;
+
+	/*
+	 *	The hash table returns the last line first,
+	 *	so we do too.
+	 */
+	return (a->offset < b->offset) - (a->offset > b->offset);
+}
+
+static int _passwd_mmap_free(passwd_mmap_t *map)
+{
+	void *data;
+
+	if (map->data) {
+		memcpy(&data, &map->data, sizeof(data)); /* const */
+		munmap(data, map->data_len);
+	}
+
+	return 0;
+}
+
+/** Map the file, and index the keys of every line
+ *
+ * Only the position of each line is kept.  Lines are split
+ * again when they're used.
+ */
+static passwd_mmap_t *passwd_mmap_alloc(TALLOC_CTX *ctx, rlm_passwd_t const *inst)
+{
+	passwd_mmap_t		*map;
+	struct mypasswd		*pw;
+	size_t			pwlen, alloced = 0;
+	uint8_t const		*p, *q, *end;
+	struct stat		st;
+	int			fd;
+
+	map = talloc_zero(ctx, passwd_mmap_t);
+	if (!map) return NULL;
+	talloc_set_destructor(map, _passwd_mmap_free);
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		ERROR("Failed opening %s: %s", inst->filename, fr_syserror(errno));
+	error:
+		talloc_free(map);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("Failed reading %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		goto error;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return map;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		ERROR("Failed mapping %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+	map->data = p;
+	map->data_len = st.st_size;
+
+	pw = passwd_mmap_entry_alloc(map, inst->nfields, &pwlen);
+	end = map->data + map->data_len;
+
+	for (; p < end; p = q) {
+		size_t	len;
+		char	*list, *nextlist;
+
+		q = memchr(p, '\n', end - p);
+		q = q ? q + 1 : end;
+		len = q - p;
+
+		if (len >= 1024) {
+			WARN("Ignoring line longer than 1023 characters in %s", inst->filename);
+			continue;
+		}
+
+		if (!passwd_mmap_line(inst, p, len, pw, pwlen)) continue;
+
+		/*
+		 *	One index entry for every key in the list.
+		 */
+		for (list = pw->field[inst->keyfield], nextlist = list; nextlist; list = nextlist) {
+			if (inst->listable) {
+				for (nextlist = list; *nextlist && *nextlist != ','; nextlist++);
+				if (*nextlist) {
+					*nextlist++ = '\0';
+				} else {
+					nextlist = NULL;
+				}
+			} else {
+				nextlist = NULL;
+			}
+
+			if (map->num_entries == alloced) {
+				alloced = alloced ? alloced * 2 : 1024;
+				map->index = talloc_realloc(map, map->index, passwd_index_entry_t, alloced);
+				if (!map->index) {
+					ERROR("Out of memory");
+					goto error;
+				}
+			}
+
+			map->index[map->num_entries].hash = fr_hash_string(list);
+			map->index[map->num_entries].len = len;
+			map->index[map->num_entries].offset = p - map->data;
+			map->num_entries++;
+		}
+	}
+	talloc_free(pw);
+
+	if (map->num_entries) qsort(map->index, map->num_entries, sizeof(map->index[0]), passwd_index_entry_cmp);
+
+	return map;
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	int			nfields = 0, keyfield = -1, listable = 0;
@@ -431,7 +644,8 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			      inst->format);
 		return -1;
 	}
-	if (! (inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
+	if (!inst->mmap &&
+	    !(inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
 		ERROR("Can't build hashtable from passwd file");
 		return -1;
 	}
@@ -478,6 +692,15 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	DEBUG3("nfields: %d keyfield %d(%s) listable: %s", nfields, keyfield,
 	       inst->pwdfmt->field[keyfield], listable ? "yes" : "no");
 
+	if (inst->mmap) {
+		inst->map = passwd_mmap_alloc(inst, inst);
+		if (!inst->map) {
+			ERROR("Can't build index from passwd file");
+			return -1;
+		}
+		DEBUG3("Indexed %zu keys in %s", inst->map->num_entries, inst->filename);
+	}
+
 	return 0;
 
 #undef inst
@@ -513,6 +736,48 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, REQUEST *reque
 	}
 }
 
+/** Add the attributes from every line of a memory mapped file with a key
+ *
+ * @return the number of lines found.
+ */
+static int passwd_mmap_find(REQUEST *request, rlm_passwd_t const *inst, char const *name)
+{
+	passwd_mmap_t const	*map = inst->map;
+	struct mypasswd		*pw;
+	size_t			pwlen;
+	uint32_t		hash;
+	size_t			lo = 0, hi = map->num_entries, j;
+	int			found = 0;
+
+	hash = fr_hash_string(name);
+
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+
+		if (map->index[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo == map->num_entries) || (map->index[lo].hash != hash)) return 0;
+
+	pw = passwd_mmap_entry_alloc(request, inst->nfields, &pwlen);
+
+	for (j = lo; (j < map->num_entries) && (map->index[j].hash == hash); j++) {
+		if (!passwd_mmap_line(inst, map->data + map->index[j].offset, map->index[j].len, pw, pwlen) ||
+		    !passwd_mmap_match(inst, pw, name)) continue;
+
+		result_add(request, inst, request, &request->control, pw, 0, "config");
+		result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+		result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+		found++;
+	}
+	talloc_free(pw);
+
+	return found;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_passwd_t const	*inst = instance;
@@ -535,6 +800,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 		 *	Ensure we have the string form of the attribute
 		 */
 		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
+		if (inst->map) {
+			if (!passwd_mmap_find(request, inst, buffer)) continue;
+			goto next;
+		}
+
 		if (!(pw = get_pw_nam(buffer, inst->ht, &last_found)) ) {
 			continue;
 		}
@@ -544,6 +814,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 			result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
 		} while ((pw = get_next(buffer, inst->ht, &last_found)));
 
+	next:
 		found++;
 
 		if (!inst->allow_multiple) {
@@ -562,6 +833,7 @@ extern rad_module_t rlm_passwd;
 rad_module_t rlm_passwd = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "passwd",
+	.type		= RLM_TYPE_PARALLEL_INSTANTIATE,
 	.inst_size	= sizeof(rlm_passwd_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
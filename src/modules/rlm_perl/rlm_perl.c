@@ -75,6 +75,8 @@ typedef struct rlm_perl_t {
 #endif
 	char const	*xlat_name;
 	char const	*perl_flags;
+	bool		tied_hashes;		//!< Give Perl tied hashes which read and write
+						//!< the attribute lists directly.
 	PerlInterpreter	*perl;
 	bool		perl_parsed;
 	pthread_key_t	*thread_key;
@@ -117,6 +119,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("func_start_accounting", PW_TYPE_STRING, rlm_perl_t, func_start_accounting) },
 
 	{ FR_CONF_OFFSET("func_stop_accounting", PW_TYPE_STRING, rlm_perl_t, func_stop_accounting) },
+
+	{ FR_CONF_OFFSET("tied_hashes", PW_TYPE_BOOLEAN, rlm_perl_t, tied_hashes), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -330,6 +334,409 @@ static XS(XS_radiusd_xlat)
 	XSRETURN(1);
 }
 
+static int pairadd_sv(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, char *key, SV *sv, FR_TOKEN op,
+		      const char *hash_name, const char *list_name);
+
+/*
+ *	Tied hashes
+ *
+ *	With "tied_hashes", %RAD_REQUEST etc. are tied to objects of
+ *	class radiusd::list, which hold the number of the list they
+ *	refer to.  Values are only converted when Perl reads them,
+ *	and assignments modify the list straight away, so nothing
+ *	has to be copied in or out around each call.
+ */
+
+/** Names of the hashes, as seen by the Perl script
+ *
+ */
+static char const *perl_hash_name(pair_lists_t list)
+{
+	switch (list) {
+	case PAIR_LIST_REQUEST:
+		return "RAD_REQUEST";
+
+	case PAIR_LIST_REPLY:
+		return "RAD_REPLY";
+
+	case PAIR_LIST_CONTROL:
+		return "RAD_CONFIG";
+
+	case PAIR_LIST_STATE:
+		return "RAD_STATE";
+
+#ifdef WITH_PROXY
+	case PAIR_LIST_PROXY_REQUEST:
+		return "RAD_REQUEST_PROXY";
+
+	case PAIR_LIST_PROXY_REPLY:
+		return "RAD_REQUEST_PROXY_REPLY";
+#endif
+
+	default:
+		return "<INVALID>";
+	}
+}
+
+/** Get the hash key for an attribute
+ *
+ * Tagged attributes use <attribute>:<tag>, the same as perl_store_vps().
+ */
+static char const *perl_vp_key(VALUE_PAIR const *vp, char *buffer, size_t len)
+{
+	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
+		snprintf(buffer, len, "%s:%d", vp->da->name, vp->tag);
+		return buffer;
+	}
+
+	return vp->da->name;
+}
+
+/** Convert the value of an attribute to a Perl scalar
+ *
+ */
+static SV *perl_vp_to_sv(VALUE_PAIR const *vp)
+{
+	char	buffer[1024];
+	size_t	len;
+
+	switch (vp->vp_type) {
+	case PW_TYPE_STRING:
+		return newSVpvn(vp->vp_strvalue, vp->vp_length);
+
+	case PW_TYPE_OCTETS:
+		return newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+
+	default:
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, 0);
+		return newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
+	}
+}
+
+/** Get the list a tied hash refers to
+ *
+ * @return
+ *	- The list.
+ *	- NULL if the list isn't available for this request.
+ */
+static VALUE_PAIR **perl_tied_list(REQUEST **request_p, TALLOC_CTX **ctx, pair_lists_t *list, SV *self)
+{
+	REQUEST		*request = rlm_perl_request;
+	VALUE_PAIR	**vps;
+
+	*request_p = request;
+	if (!request || !SvROK(self)) return NULL;
+
+	*list = SvIV(SvRV(self));
+
+	vps = radius_list(request, *list);
+	if (!vps) return NULL;
+
+	if (ctx) {
+		*ctx = radius_list_ctx(request, *list);
+		if (!*ctx) return NULL;
+	}
+
+	return vps;
+}
+
+/** Keep the request's cached pointers valid after the request list changes
+ *
+ */
+static void perl_tied_list_changed(REQUEST *request, pair_lists_t list)
+{
+	if (list != PAIR_LIST_REQUEST) return;
+
+	request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+	request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
+	if (!request->password) request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_CHAP_PASSWORD,
+									  TAG_ANY);
+}
+
+/** Convert all attributes with a key
+ *
+ * @return
+ *	- A scalar if there's one attribute.
+ *	- A reference to an array of scalars if there's more than one.
+ *	- NULL if there are none.
+ */
+static SV *perl_tied_fetch(VALUE_PAIR **vps, char const *key)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	SV		*first = NULL;
+	AV		*av = NULL;
+	char		buffer[256];
+
+	for (vp = fr_pair_cursor_init(&cursor, vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (strcmp(perl_vp_key(vp, buffer, sizeof(buffer)), key) != 0) continue;
+
+		if (!first) {
+			first = perl_vp_to_sv(vp);
+			continue;
+		}
+
+		if (!av) {
+			av = newAV();
+			av_push(av, first);
+		}
+		av_push(av, perl_vp_to_sv(vp));
+	}
+
+	if (av) return newRV_noinc((SV *)av);
+
+	return first;
+}
+
+/** Remove all attributes with a key
+ *
+ */
+static void perl_tied_delete(VALUE_PAIR **vps, char const *key)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		buffer[256];
+
+	for (vp = fr_pair_cursor_init(&cursor, vps); vp; ) {
+		bool head;
+
+		if (strcmp(perl_vp_key(vp, buffer, sizeof(buffer)), key) != 0) {
+			vp = fr_pair_cursor_next(&cursor);
+			continue;
+		}
+
+		/*
+		 *	Removing the head of the list moves the cursor
+		 *	forward, removing any other pair moves it back.
+		 */
+		head = (*vps == vp);
+		fr_pair_cursor_remove(&cursor);
+		talloc_free(vp);
+
+		vp = head ? fr_pair_cursor_current(&cursor) : fr_pair_cursor_next(&cursor);
+	}
+}
+
+static XS(XS_radiusd_list_FETCH)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+	SV		*sv;
+
+	if (items != 2) croak("Usage: radiusd::list::FETCH(self, key)");
+
+	vps = perl_tied_list(&request, NULL, &list, ST(0));
+	if (!vps) XSRETURN_UNDEF;
+
+	sv = perl_tied_fetch(vps, SvPV_nolen(ST(1)));
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_STORE)
+{
+	dXSARGS;
+	REQUEST		*request;
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+	char		*key;
+	SV		*sv;
+
+	if (items != 3) croak("Usage: radiusd::list::STORE(self, key, value)");
+
+	vps = perl_tied_list(&request, &ctx, &list, ST(0));
+	if (!vps) XSRETURN_EMPTY;
+
+	key = SvPV_nolen(ST(1));
+	sv = ST(2);
+
+	/*
+	 *	Assignments replace all attributes with the key,
+	 *	as they would when copying the hash back.
+	 */
+	perl_tied_delete(vps, key);
+
+	if (SvROK(sv) && (SvTYPE(SvRV(sv)) == SVt_PVAV)) {
+		AV	*av = (AV *)SvRV(sv);
+		I32	len, j;
+
+		len = av_len(av);
+		for (j = 0; j <= len; j++) {
+			SV **av_sv;
+
+			av_sv = av_fetch(av, j, 0);
+			if (!av_sv) continue;
+
+			(void) pairadd_sv(ctx, request, vps, key, *av_sv, T_OP_ADD,
+					  perl_hash_name(list), fr_int2str(pair_lists, list, "<INVALID>"));
+		}
+	} else {
+		(void) pairadd_sv(ctx, request, vps, key, sv, T_OP_EQ,
+				  perl_hash_name(list), fr_int2str(pair_lists, list, "<INVALID>"));
+	}
+
+	perl_tied_list_changed(request, list);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_list_DELETE)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+	char		*key;
+	SV		*sv;
+
+	if (items != 2) croak("Usage: radiusd::list::DELETE(self, key)");
+
+	vps = perl_tied_list(&request, NULL, &list, ST(0));
+	if (!vps) XSRETURN_UNDEF;
+
+	key = SvPV_nolen(ST(1));
+
+	sv = perl_tied_fetch(vps, key);
+	if (!sv) XSRETURN_UNDEF;
+
+	perl_tied_delete(vps, key);
+	perl_tied_list_changed(request, list);
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_CLEAR)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+
+	if (items != 1) croak("Usage: radiusd::list::CLEAR(self)");
+
+	vps = perl_tied_list(&request, NULL, &list, ST(0));
+	if (!vps) XSRETURN_EMPTY;
+
+	fr_pair_list_free(vps);
+	perl_tied_list_changed(request, list);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_list_EXISTS)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		*key;
+	char		buffer[256];
+
+	if (items != 2) croak("Usage: radiusd::list::EXISTS(self, key)");
+
+	vps = perl_tied_list(&request, NULL, &list, ST(0));
+	if (!vps) XSRETURN_NO;
+
+	key = SvPV_nolen(ST(1));
+
+	for (vp = fr_pair_cursor_init(&cursor, vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (strcmp(perl_vp_key(vp, buffer, sizeof(buffer)), key) == 0) XSRETURN_YES;
+	}
+
+	XSRETURN_NO;
+}
+
+/*
+ *	Keys are returned in the order of the sorted list, the same
+ *	as hv_iterinit() would for a copied hash.  NEXTKEY finds the
+ *	last key again, so each step is O(n).
+ */
+static XS(XS_radiusd_list_FIRSTKEY)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+	char		buffer[256];
+
+	if (items != 1) croak("Usage: radiusd::list::FIRSTKEY(self)");
+
+	vps = perl_tied_list(&request, NULL, &list, ST(0));
+	if (!vps || !*vps) XSRETURN_UNDEF;
+
+	fr_pair_list_sort(vps, fr_pair_cmp_by_da_tag);
+
+	ST(0) = sv_2mortal(newSVpv(perl_vp_key(*vps, buffer, sizeof(buffer)), 0));
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_NEXTKEY)
+{
+	dXSARGS;
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+	pair_lists_t	list;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		*last;
+	bool		found = false;
+	char		buffer[256];
+
+	if (items != 2) croak("Usage: radiusd::list::NEXTKEY(self, lastkey)");
+
+	vps = perl_tied_list(&request, NULL, &list, ST(0));
+	if (!vps) XSRETURN_UNDEF;
+
+	last = SvPV_nolen(ST(1));
+
+	for (vp = fr_pair_cursor_init(&cursor, vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		char const *key = perl_vp_key(vp, buffer, sizeof(buffer));
+
+		if (strcmp(key, last) == 0) {
+			found = true;
+			continue;
+		}
+		if (!found) continue;
+
+		ST(0) = sv_2mortal(newSVpv(key, 0));
+		XSRETURN(1);
+	}
+
+	XSRETURN_UNDEF;
+}
+
+/** Tie one of the %RAD_* hashes to an attribute list
+ *
+ * Does nothing if the hash is already tied, which it will be
+ * after the first call in each interpreter.
+ */
+static void perl_tie_hv(HV *hv, pair_lists_t list)
+{
+	SV *obj;
+
+	if (SvRMAGICAL((SV *)hv) && mg_find((SV *)hv, PERL_MAGIC_tied)) return;
+
+	hv_clear(hv);
+
+	obj = sv_bless(newRV_noinc(newSViv(list)), gv_stashpv("radiusd::list", GV_ADD));
+	sv_magic((SV *)hv, obj, PERL_MAGIC_tied, NULL, 0);
+	SvREFCNT_dec(obj);
+}
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -339,6 +746,14 @@ static void xs_init(pTHX)
 
 	newXS("radiusd::radlog",XS_radiusd_radlog, "rlm_perl");
 	newXS("radiusd::xlat",XS_radiusd_xlat, "rlm_perl");
+
+	newXS("radiusd::list::FETCH", XS_radiusd_list_FETCH, "rlm_perl");
+	newXS("radiusd::list::STORE", XS_radiusd_list_STORE, "rlm_perl");
+	newXS("radiusd::list::DELETE", XS_radiusd_list_DELETE, "rlm_perl");
+	newXS("radiusd::list::CLEAR", XS_radiusd_list_CLEAR, "rlm_perl");
+	newXS("radiusd::list::EXISTS", XS_radiusd_list_EXISTS, "rlm_perl");
+	newXS("radiusd::list::FIRSTKEY", XS_radiusd_list_FIRSTKEY, "rlm_perl");
+	newXS("radiusd::list::NEXTKEY", XS_radiusd_list_NEXTKEY, "rlm_perl");
 }
 
 /*
@@ -876,6 +1291,21 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
 		rad_state_hv = get_hv("RAD_STATE", 1);
 
+		if (inst->tied_hashes) {
+			perl_tie_hv(rad_request_hv, PAIR_LIST_REQUEST);
+			perl_tie_hv(rad_reply_hv, PAIR_LIST_REPLY);
+			perl_tie_hv(rad_config_hv, PAIR_LIST_CONTROL);
+			perl_tie_hv(rad_state_hv, PAIR_LIST_STATE);
+#ifdef WITH_PROXY
+			rad_request_proxy_hv = get_hv("RAD_REQUEST_PROXY", 1);
+			rad_request_proxy_reply_hv = get_hv("RAD_REQUEST_PROXY_REPLY", 1);
+
+			perl_tie_hv(rad_request_proxy_hv, PAIR_LIST_PROXY_REQUEST);
+			perl_tie_hv(rad_request_proxy_reply_hv, PAIR_LIST_PROXY_REPLY);
+#endif
+			goto call;
+		}
+
 		perl_store_vps(request->packet, request, &request->packet->vps, rad_request_hv, "RAD_REQUEST", "request");
 		perl_store_vps(request->reply, request, &request->reply->vps, rad_reply_hv, "RAD_REPLY", "reply");
 		perl_store_vps(request, request, &request->control, rad_config_hv, "RAD_CONFIG", "control");
@@ -900,6 +1330,7 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		}
 #endif
 
+	call:
 		/*
 		 * Store pointer to request structure globally so radiusd::xlat works
 		 */
@@ -936,6 +1367,11 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		FREETMPS;
 		LEAVE;
 
+		/*
+		 *	Changes to tied hashes have already been made.
+		 */
+		if (inst->tied_hashes) return exitstatus;
+
 		vp = NULL;
 		if ((get_hv_content(request->packet, request, rad_request_hv, &vp, "RAD_REQUEST", "request")) == 0) {
 			fr_pair_list_free(&request->packet->vps);
@@ -83,8 +83,20 @@ typedef struct rlm_python_t {
 
 	PyObject	*pythonconf_dict;	//!< Configuration parameters defined in the module
 						//!< made available to the python script.
+
+	fr_hash_table_t	*attr_names;		//!< Python strings for attribute names, so they're
+						//!< not built for every call.  Protected by the GIL.
 } rlm_python_t;
 
+/** A Python string for an attribute name
+ *
+ */
+typedef struct python_attr_name {
+	fr_dict_attr_t const	*da;		//!< Attribute the name is for.
+	int8_t			tag;		//!< Tag, if the attribute has one.
+	PyObject		*name;		//!< Python reference to the name.
+} python_attr_name_t;
+
 /** Tracks a python module inst/thread state pair
  *
  * Multiple instances of python create multiple interpreters and each
@@ -332,6 +344,90 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
 }
 
 
+static uint32_t python_attr_name_hash(void const *data)
+{
+	python_attr_name_t const *a = data;
+	uint32_t hash;
+
+	hash = fr_hash(&a->da, sizeof(a->da));
+	return fr_hash_update(&a->tag, sizeof(a->tag), hash);
+}
+
+static int python_attr_name_cmp(void const *one, void const *two)
+{
+	python_attr_name_t const *a = one, *b = two;
+
+	if (a->da != b->da) return (a->da < b->da) ? -1 : 1;
+
+	return a->tag - b->tag;
+}
+
+/** Callback for hash table delete, must be called with the GIL held
+ *
+ */
+static void _python_attr_name_free(void *data)
+{
+	python_attr_name_t *a = data;
+
+	Py_XDECREF(a->name);
+	talloc_free(a);
+}
+
+/** Create a Python string for the name of an attribute
+ *
+ * Names of attributes in the dictionary are kept, and the same
+ * string is returned for every call.  Must be called with the
+ * GIL held.
+ *
+ * @param[in] inst	of rlm_python.
+ * @param[in] vp	to get the name of.
+ * @return
+ *	- A new reference to the name.
+ *	- NULL on error.
+ */
+static PyObject *python_attr_name(rlm_python_t const *inst, VALUE_PAIR const *vp)
+{
+	python_attr_name_t	find, *found;
+	PyObject		*name;
+
+	find.da = vp->da;
+	find.tag = vp->da->flags.has_tag ? vp->tag : 0;
+
+	if (inst->attr_names && !vp->da->flags.is_unknown) {
+		found = fr_hash_table_finddata(inst->attr_names, &find);
+		if (found) {
+			Py_INCREF(found->name);
+			return found->name;
+		}
+	}
+
+	/* Look at the fr_pair_fprint_name? */
+
+	if (vp->da->flags.has_tag) {
+		name = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
+	} else {
+		name = PyString_FromString(vp->da->name);
+	}
+	if (!name) return NULL;
+
+	/*
+	 *	Unknown attributes are freed with the VALUE_PAIR,
+	 *	so their addresses can be reused.
+	 */
+	if (!inst->attr_names || vp->da->flags.is_unknown) return name;
+
+	found = talloc(NULL, python_attr_name_t);
+	if (!found) return name;
+
+	*found = find;
+	found->name = name;
+	Py_INCREF(name);
+
+	if (!fr_hash_table_insert(inst->attr_names, found)) _python_attr_name_free(found);
+
+	return name;
+}
+
 /*
  *	This is the core Python function that the others wrap around.
  *	Pass the value-pair print strings in a tuple.
@@ -339,19 +435,12 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
  *	FIXME: We're not checking the errors. If we have errors, what
  *	do we do?
  */
-static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
+static int mod_populate_vptuple(rlm_python_t const *inst, PyObject *pp, VALUE_PAIR *vp)
 {
 	PyObject *attribute = NULL;
 	PyObject *value = NULL;
 
-	/* Look at the fr_pair_fprint_name? */
-
-	if (vp->da->flags.has_tag) {
-		attribute = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
-	} else {
-		attribute = PyString_FromString(vp->da->name);
-	}
-
+	attribute = python_attr_name(inst, vp);
 	if (!attribute) return -1;
 
 	PyTuple_SET_ITEM(pp, 0, attribute);
@@ -430,7 +519,7 @@ static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
 	return 0;
 }
 
-static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char const *funcname)
+static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request, PyObject *pFunc, char const *funcname)
 {
 	vp_cursor_t	cursor;
 	VALUE_PAIR      *vp;
@@ -478,7 +567,7 @@ static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char cons
 				goto finish;
 			}
 
-			if (mod_populate_vptuple(pp, vp) == 0) {
+			if (mod_populate_vptuple(inst, pp, vp) == 0) {
 				/* Put the tuple inside the container */
 				PyTuple_SET_ITEM(pArgs, i, pp);
 			} else {
@@ -681,7 +770,7 @@ static rlm_rcode_t do_python(rlm_python_t const *inst, REQUEST *request, PyObjec
 	RDEBUG3("Using thread state %p", this_thread->state);
 
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	ret = do_python_single(request, pFunc, funcname);
+	ret = do_python_single(inst, request, pFunc, funcname);
 	PyEval_SaveThread();
 
 	return ret;
@@ -997,6 +1086,17 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (python_interpreter_init(inst, conf) < 0) return -1;
 
+	/*
+	 *	Written to by worker threads, so it can't be
+	 *	parented by the instance data.
+	 */
+	inst->attr_names = fr_hash_table_create(NULL, python_attr_name_hash, python_attr_name_cmp,
+						_python_attr_name_free);
+	if (!inst->attr_names) {
+		ERROR("Failed creating attribute name table");
+		return -1;
+	}
+
 	/*
 	 *	Switch to our module specific main thread
 	 */
@@ -1024,7 +1124,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	/*
 	 *	Call the instantiate function.
 	 */
-	code = do_python_single(NULL, inst->instantiate.function, "instantiate");
+	code = do_python_single(inst, NULL, inst->instantiate.function, "instantiate");
 	if (code < 0) {
 	error:
 		python_error_log();	/* Needs valid thread with GIL */
@@ -1046,7 +1146,7 @@ static int mod_detach(void *instance)
 	 */
 	PyEval_RestoreThread(inst->sub_interpreter);
 
-	ret = do_python_single(NULL, inst->detach.function, "detach");
+	ret = do_python_single(inst, NULL, inst->detach.function, "detach");
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
 	PYTHON_FUNC_DESTROY(instantiate);
@@ -1057,6 +1157,9 @@ static int mod_detach(void *instance)
 	PYTHON_FUNC_DESTROY(checksimul);
 	PYTHON_FUNC_DESTROY(detach);
 
+	fr_hash_table_free(inst->attr_names);	/* Needs the GIL */
+	inst->attr_names = NULL;
+
 	Py_DecRef(inst->pythonconf_dict);
 	Py_DecRef(inst->module);
 
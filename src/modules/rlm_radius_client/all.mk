@@ -1,3 +1,5 @@
 TARGET		:= rlm_radius_client.a
 
 SOURCES		:= rlm_radius_client.c
+
+TGT_PREREQS	:= libfreeradius-util.a
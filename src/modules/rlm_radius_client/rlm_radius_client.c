@@ -28,6 +28,17 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/udp.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/util/track.h>
+#include <freeradius-devel/util/time.h>
+
+/*
+ *	Retransmission timers, in microseconds.  These are the
+ *	values from RFC 5080 Section 2.2.1, with a lower bound
+ *	for fast home servers.
+ */
+#define RTO_INITIAL	(2 * USEC)		//!< Before we have any RTT samples.
+#define RTO_MIN		(100 * 1000)		//!< Lower bound on the computed timeout.
+#define RTO_MAX		(16 * USEC)		//!< Upper bound after backoff.
 
 typedef struct radius_client_instance {
 	char const		*name;			//!< Module instance name.
@@ -37,6 +48,8 @@ typedef struct radius_client_instance {
 
 	fr_ipaddr_t		src_ipaddr;		// Src IP for outgoing packets
 
+	uint32_t		max_connections;	//!< Maximum number of sockets per thread.
+
 	home_server_t		*home_server;		// home servers to send packets to
 	pthread_key_t		key;
 } rlm_radius_client_instance_t;
@@ -50,39 +63,164 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("listen", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) listen_config },
 
 	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING, rlm_radius_client_instance_t, virtual_server) },
+	{ FR_CONF_OFFSET("max_connections", PW_TYPE_INTEGER, rlm_radius_client_instance_t, max_connections), .dflt = "16" },
 	CONF_PARSER_TERMINATOR
 };
 
-typedef struct radius_client_conn {
+typedef struct radius_client_conn rlm_radius_client_conn_t;
+typedef struct rlm_radius_client_request rlm_radius_client_request_t;
+
+/** A socket connected to the home server
+ *
+ * Each socket has its own set of 256 IDs, so we open more sockets
+ * when there are more than 256 packets outstanding.
+ */
+typedef struct radius_client_socket {
+	rlm_radius_client_conn_t		*conn;
+	int					fd;
+	fr_tracking_t				*ft;		//!< Which IDs are in use.
+	rlm_radius_client_request_t		*requests[256];	//!< Outstanding requests, indexed by ID.
+} rlm_radius_client_socket_t;
+
+/** Per-thread state for talking to the home server
+ *
+ */
+struct radius_client_conn {
 	rlm_radius_client_instance_t const	*inst;
-	int					num_fds;
-	int					sockfd;
-	fr_packet_list_t			*pl;
 	fr_event_list_t				*el;
-} rlm_radius_client_conn_t;
 
-typedef struct rlm_radius_client_request {
+	int					num_sockets;
+	rlm_radius_client_socket_t		**sockets;	//!< max_connections of them.
+
+	bool					has_rtt;	//!< Whether we have any RTT samples.
+	uint32_t				srtt;		//!< Smoothed RTT, in microseconds.
+	uint32_t				rttvar;		//!< RTT variance, in microseconds.
+
+	int					state;		//!< HOME_STATE_ALIVE or HOME_STATE_ZOMBIE.
+	uint32_t				response_timeouts; //!< Requests which timed out in a row.
+	uint32_t				num_received_pings; //!< Status-Server replies in a row.
+	RADIUS_PACKET				*ping;		//!< Status-Server packet in flight.
+	rlm_radius_client_socket_t		*ping_sock;	//!< Socket the ping was sent on.
+	fr_event_timer_t			*ping_ev;	//!< When we send, or time out, the ping.
+};
+
+struct rlm_radius_client_request {
 	rlm_radius_client_instance_t const	*inst;
 	REQUEST					*request;
 	rlm_rcode_t				rcode;
 
 	rlm_radius_client_conn_t		*conn;
+	rlm_radius_client_socket_t		*sock;		//!< Socket the ID was allocated from,
+								//!< or NULL if we don't have an ID.
+
+	struct timeval				start;		//!< When the packet was first sent.
+	uint32_t				rto;		//!< Current retransmission timeout, in usec.
+	fr_event_timer_t			*ev;		//!< Retransmission timer.
 
 	RADIUS_PACKET				*packet;	/* the packet we sent */
 	RADIUS_PACKET				*reply;		/* the reply from the home server */
 
 	REQUEST					*child;		/* the child request */
-} rlm_radius_client_request_t;
+};
+
+static void mod_ping_send(struct timeval *now, void *ctx);
+
+/** Convert microseconds to a timeval, and add it to a time
+ *
+ */
+static void mod_timeval_add_usec(struct timeval *out, struct timeval const *when, uint32_t usec)
+{
+	struct timeval delay;
+
+	delay.tv_sec = usec / USEC;
+	delay.tv_usec = usec % USEC;
+
+	fr_timeval_add(out, when, &delay);
+}
+
+/** Update the RTT estimate, as per RFC 6298
+ *
+ */
+static void mod_rtt_update(rlm_radius_client_conn_t *conn, uint32_t rtt)
+{
+	uint32_t delta;
+
+	if (!conn->has_rtt) {
+		conn->has_rtt = true;
+		conn->srtt = rtt;
+		conn->rttvar = rtt / 2;
+		return;
+	}
+
+	delta = (conn->srtt > rtt) ? conn->srtt - rtt : rtt - conn->srtt;
+
+	conn->rttvar -= conn->rttvar >> 2;
+	conn->rttvar += delta >> 2;
+	conn->srtt -= conn->srtt >> 3;
+	conn->srtt += rtt >> 3;
+}
+
+/** The initial retransmission timeout for a new packet
+ *
+ */
+static uint32_t mod_rto_initial(rlm_radius_client_conn_t const *conn)
+{
+	uint32_t rto;
+
+	if (!conn->has_rtt) return RTO_INITIAL;
+
+	rto = conn->srtt + 4 * conn->rttvar;
+	if (rto < RTO_MIN) rto = RTO_MIN;
+	if (rto > RTO_MAX) rto = RTO_MAX;
+
+	return rto;
+}
+
+/** Send (or re-send) a packet on a connected socket
+ *
+ */
+static int mod_packet_send(RADIUS_PACKET *packet, char const *secret)
+{
+	if (!packet->data) {
+		if (fr_radius_encode(packet, NULL, secret) < 0) return -1;
+		if (fr_radius_sign(packet, NULL, secret) < 0) return -1;
+	}
+
+#ifndef NDEBUG
+	if ((fr_debug_lvl > 3) && fr_log_fp) fr_radius_print_hex(packet);
+#endif
+
+	return udp_send(packet->sockfd, packet->data, packet->data_len, UDP_FLAGS_CONNECTED,
+			&packet->src_ipaddr, packet->src_port, packet->if_index,
+			&packet->dst_ipaddr, packet->dst_port);
+}
+
+/** Release the ID (if any) used by a request
+ *
+ */
+static void mod_id_free(rlm_radius_client_request_t *ccr)
+{
+	rlm_radius_client_socket_t *sock = ccr->sock;
+
+	if (!sock) return;
+
+	rad_assert(sock->requests[ccr->packet->id] == ccr);
+
+	sock->requests[ccr->packet->id] = NULL;
+	(void) fr_radius_tracking_entry_delete(sock->ft, ccr->packet->id);
+
+	ccr->sock = NULL;
+	ccr->child->in_request_hash = false;
+}
 
 /** Clean up whatever intermediate state we're in.
  *
  */
 static void mod_cleanup(REQUEST *request, rlm_radius_client_request_t *ccr)
 {
-	if (ccr->child->in_request_hash) {
-		(void) fr_packet_list_yank(ccr->conn->pl, ccr->packet);
-		ccr->child->in_request_hash = false;
-	}
+	if (ccr->ev) fr_event_timer_delete(ccr->conn->el, &ccr->ev);
+
+	mod_id_free(ccr);
 
 	/*
 	 *	Set Failed-Home-Server-IP if we didn't get an answer.
@@ -103,12 +241,166 @@ static void mod_cleanup(REQUEST *request, rlm_radius_client_request_t *ccr)
 	TALLOC_FREE(ccr);
 }
 
-static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
+/** A request timed out.  Maybe mark the home server as a zombie.
+ *
+ */
+static void mod_response_timeout(rlm_radius_client_conn_t *conn)
+{
+	home_server_t *home = conn->inst->home_server;
+	struct timeval now;
+
+	conn->response_timeouts++;
+
+	if (home->ping_check != HOME_PING_CHECK_STATUS_SERVER) return;
+
+	if (conn->state != HOME_STATE_ALIVE) return;
+
+	if (conn->response_timeouts < home->max_response_timeouts) return;
+
+	/*
+	 *	Fail new requests immediately, instead of having
+	 *	them all wait for response_window.  That lets
+	 *	"redundant" sections fail over to another home
+	 *	server quickly.
+	 */
+	WARN("%s: Marking home server %s as zombie after %u timeouts", conn->inst->name, home->name,
+	     conn->response_timeouts);
+
+	conn->state = HOME_STATE_ZOMBIE;
+	conn->num_received_pings = 0;
+
+	gettimeofday(&now, NULL);
+	mod_ping_send(&now, conn);
+}
+
+/** Forget about the ping we sent.
+ *
+ */
+static void mod_ping_free(rlm_radius_client_conn_t *conn)
+{
+	if (!conn->ping) return;
+
+	(void) fr_radius_tracking_entry_delete(conn->ping_sock->ft, conn->ping->id);
+	conn->ping_sock = NULL;
+	TALLOC_FREE(conn->ping);
+}
+
+/** Schedule the next Status-Server packet
+ *
+ */
+static void mod_ping_schedule(rlm_radius_client_conn_t *conn, struct timeval *now, uint32_t delay)
+{
+	struct timeval when;
+
+	when = *now;
+	when.tv_sec += delay;
+
+	if (fr_event_timer_insert(conn->el, mod_ping_send, conn, &when, &conn->ping_ev) < 0) {
+		ERROR("%s: Failed inserting ping timer: %s", conn->inst->name, fr_strerror());
+	}
+}
+
+/** The ping timed out, or it's time for a new one.
+ *
+ */
+static void mod_ping_send(struct timeval *now, void *ctx)
 {
 	rlm_radius_client_conn_t *conn = ctx;
+	home_server_t *home = conn->inst->home_server;
+	rlm_radius_client_socket_t *sock;
+	fr_tracking_entry_t *entry;
+	RADIUS_PACKET *packet;
+
+	/*
+	 *	No answer to the previous ping.  Start counting
+	 *	again, and wait a while before sending another one.
+	 */
+	if (conn->ping) {
+		mod_ping_free(conn);
+		conn->num_received_pings = 0;
+		mod_ping_schedule(conn, now, home->ping_interval);
+		return;
+	}
+
+	if (conn->state == HOME_STATE_ALIVE) return;
+
+	sock = conn->sockets[0];
+	entry = fr_radius_tracking_entry_alloc(sock->ft, fr_time());
+	if (!entry) {
+		mod_ping_schedule(conn, now, home->ping_interval);
+		return;
+	}
+
+	packet = fr_radius_alloc(conn, true);
+	if (!packet) {
+		(void) fr_radius_tracking_entry_delete(sock->ft, entry->id);
+		return;
+	}
+
+	packet->code = PW_CODE_STATUS_SERVER;
+	packet->id = entry->id;
+	packet->sockfd = sock->fd;
+	packet->dst_ipaddr = home->ipaddr;
+	packet->dst_port = home->port;
+	packet->src_ipaddr.af = AF_UNSPEC;
+	packet->timestamp = *now;
+
+	fr_pair_make(packet, &packet->vps, "Message-Authenticator", "0x00", T_OP_SET);
+
+	DEBUG("%s: Sending Status-Server to home server %s - ID %u", conn->inst->name, home->name, packet->id);
+
+	if (mod_packet_send(packet, home->secret) < 0) {
+		DEBUG("%s: Failed sending Status-Server: %s", conn->inst->name, fr_strerror());
+	}
+
+	conn->ping = packet;
+	conn->ping_sock = sock;
+
+	mod_ping_schedule(conn, now, home->ping_timeout);
+}
+
+/** Received a reply to our Status-Server
+ *
+ */
+static void mod_ping_reply(rlm_radius_client_conn_t *conn, RADIUS_PACKET *reply)
+{
+	home_server_t *home = conn->inst->home_server;
+	struct timeval now;
+
+	if (fr_radius_verify(reply, conn->ping, home->secret) < 0) {
+		DEBUG("%s: Status-Server reply verification failed for home server %s",
+		      conn->inst->name, home->name);
+		return;
+	}
+
+	if (conn->ping_ev) fr_event_timer_delete(conn->el, &conn->ping_ev);
+	mod_ping_free(conn);
+
+	conn->num_received_pings++;
+
+	if (conn->num_received_pings >= home->num_pings_to_alive) {
+		INFO("%s: Marking home server %s alive", conn->inst->name, home->name);
+		conn->state = HOME_STATE_ALIVE;
+		conn->response_timeouts = 0;
+		return;
+	}
+
+	/*
+	 *	Answers only count if they're in a row, so send the
+	 *	next one as soon as this one has been answered.
+	 */
+	gettimeofday(&now, NULL);
+	mod_ping_send(&now, conn);
+}
+
+static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	rlm_radius_client_socket_t *sock = ctx;
+	rlm_radius_client_conn_t *conn = sock->conn;
 	rlm_radius_client_request_t *ccr;
-	RADIUS_PACKET *reply, **packet_p;
+	RADIUS_PACKET *reply;
 	REQUEST *request;
+	struct timeval now;
 	char buffer[INET6_ADDRSTRLEN];
 
 	/*
@@ -122,8 +414,14 @@ static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
 		return;
 	}
 
-	packet_p = fr_packet_list_find_byreply(conn->pl, reply);
-	if (!packet_p) {
+	if (conn->ping && (conn->ping_sock == sock) && (reply->id == conn->ping->id)) {
+		mod_ping_reply(conn, reply);
+		fr_radius_free(&reply);
+		return;
+	}
+
+	ccr = sock->requests[reply->id];
+	if (!ccr) {
 		DEBUG("Received unknown reply %s packet from home server %s port %d - ID %u - ignoring",
 		       fr_packet_codes[reply->code],
 		       inet_ntop(reply->src_ipaddr.af,
@@ -134,10 +432,6 @@ static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
 		return;
 	}
 
-	/*
-	 *	Walk back up the chain of structs.
-	 */
-	ccr = fr_packet2myptr(rlm_radius_client_request_t, packet, packet_p);
 	request = ccr->request;
 
 	RDEBUG("Received reply %s packet from home server %s port %d - ID %u",
@@ -158,34 +452,81 @@ static void mod_event_fd(UNUSED fr_event_list_t *el, int fd, void *ctx)
 
 	RDEBUG("Received response from home server");
 
+	/*
+	 *	Only packets which weren't retransmitted give
+	 *	useful RTT samples (Karn's algorithm).
+	 */
+	if (ccr->packet->count == 1) {
+		struct timeval rtt;
+
+		gettimeofday(&now, NULL);
+		fr_timeval_subtract(&rtt, &now, &ccr->start);
+		mod_rtt_update(conn, rtt.tv_sec * USEC + rtt.tv_usec);
+	}
+	conn->response_timeouts = 0;
+
 	/*
 	 *	Reply is valid, run the packet through the "recv FOO" stage.
 	 */
-	fr_packet_list_id_free(conn->pl, ccr->packet, true);
-	ccr->child->in_request_hash = false;
+	mod_id_free(ccr);
 	ccr->child->reply = talloc_steal(ccr->child, reply);
 	ccr->reply = reply;
 
 	/*
-	 *	We've received the response.  Remove the timeout
-	 *	handler, and resume.
+	 *	We've received the response.  Remove the
+	 *	retransmission timer, and resume.
 	 */
-	unlang_event_timeout_delete(ccr->request, ccr);
+	if (ccr->ev) fr_event_timer_delete(conn->el, &ccr->ev);
 
 	ccr->rcode = RLM_MODULE_OK;
 	unlang_resumable(ccr->request);
 }
 
-static void mod_proxy_no_reply(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
-			       UNUSED struct timeval *now)
+/** Retransmit the packet, or give up if we've been waiting too long
+ *
+ */
+static void mod_retransmit(struct timeval *now, void *ctx)
 {
 	rlm_radius_client_request_t *ccr = ctx;
+	REQUEST *request = ccr->request;
+	RADIUS_PACKET *packet = ccr->packet;
+	home_server_t *home = ccr->inst->home_server;
+	struct timeval end, when;
 
-	mod_cleanup(request, ccr);
+	fr_timeval_add(&end, &ccr->start, &home->response_window);
 
-	unlang_resumable(request);
-}
+	if (fr_timeval_cmp(now, &end) >= 0) {
+		RDEBUG("No response from home server %s after %d packet(s)", home->name, packet->count);
+
+		mod_id_free(ccr);
+		mod_response_timeout(ccr->conn);
+		unlang_resumable(request);
+		return;
+	}
+
+	RDEBUG("Retransmitting %s packet to home server %s - ID %u",
+	       fr_packet_codes[packet->code], home->name, packet->id);
+
+	if (mod_packet_send(packet, home->secret) < 0) {
+		RDEBUG("Failed retransmitting packet: %s", fr_strerror());
+	}
+	packet->count++;
+
+	/*
+	 *	Back off, but don't wait past the response window.
+	 */
+	ccr->rto *= 2;
+	if (ccr->rto > RTO_MAX) ccr->rto = RTO_MAX;
+
+	mod_timeval_add_usec(&when, now, ccr->rto);
+	if (fr_timeval_cmp(&when, &end) > 0) when = end;
 
+	if (fr_event_timer_insert(ccr->conn->el, mod_retransmit, ccr, &when, &ccr->ev) < 0) {
+		RERROR("Failed inserting retransmission timer: %s", fr_strerror());
+		mod_id_free(ccr);
+		unlang_resumable(request);
+	}
+}
 
 static rlm_rcode_t mod_resume_recv(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
 {
@@ -263,6 +604,12 @@ static void mod_action_dup(REQUEST *request, void *instance, UNUSED void *thread
 
 	if (action != FR_ACTION_DUP) return;
 
+	/*
+	 *	We've given up on the packet, and are waiting for
+	 *	"recv timeout" to finish.
+	 */
+	if (!ccr->sock) return;
+
 	/*
 	 *	We retransmit only a few kinds of packets.
 	 */
@@ -280,7 +627,7 @@ static void mod_action_dup(REQUEST *request, void *instance, UNUSED void *thread
 			 buffer, sizeof(buffer)),
 	       packet->dst_port, packet->id);
 
-	fr_radius_send(packet, NULL, inst->home_server->secret);
+	(void) mod_packet_send(packet, inst->home_server->secret);
 	packet->count++;
 }
 
@@ -290,20 +637,17 @@ static void mod_action_dup(REQUEST *request, void *instance, UNUSED void *thread
  */
 static void mod_conn_free(void *ctx)
 {
-	int i, max_fd;
-	fd_set fds;
+	int i;
 	rlm_radius_client_conn_t *conn = ctx;
 
 	DEBUG("Cleaning up sockets for module %s", conn->inst->name);
 
-	max_fd = fr_packet_list_fd_set(conn->pl, &fds);
-	for (i = 0; i < max_fd; i++) {
-		if (!FD_ISSET(i, &fds)) continue;
+	if (conn->ping_ev) fr_event_timer_delete(conn->el, &conn->ping_ev);
 
-		if (close(i) < 0) DEBUG3("Closing socket failed: %s", fr_syserror(errno));
-		fr_event_fd_delete(conn->el, i);
+	for (i = 0; i < conn->num_sockets; i++) {
+		fr_event_fd_delete(conn->el, conn->sockets[i]->fd);
+		if (close(conn->sockets[i]->fd) < 0) DEBUG3("Closing socket failed: %s", fr_syserror(errno));
 	}
-	fr_packet_list_free(conn->pl);
 
 	talloc_free(conn);
 }
@@ -317,12 +661,9 @@ static int mod_ccr_free(rlm_radius_client_request_t *ccr)
 
 	if (!ccr->child) return 0;
 
-	if (ccr->child->in_request_hash) {
-		(void) fr_packet_list_yank(ccr->conn->pl, ccr->packet);
-		ccr->child->in_request_hash = false;
-	}
+	if (ccr->ev) fr_event_timer_delete(ccr->conn->el, &ccr->ev);
 
-	unlang_event_timeout_delete(ccr->request, ccr);
+	mod_id_free(ccr);
 
 	return 0;
 }
@@ -330,53 +671,53 @@ static int mod_ccr_free(rlm_radius_client_request_t *ccr)
 /** Create and add a new socket to the connecton handle.
  *
  */
-static int mod_fd_add(fr_event_list_t *el, rlm_radius_client_conn_t *conn, rlm_radius_client_instance_t const *inst)
+static rlm_radius_client_socket_t *mod_socket_add(rlm_radius_client_conn_t *conn)
 {
-	int			sockfd;
-	fr_ipaddr_t const	*server_ipaddr = &inst->src_ipaddr;
-	uint16_t		server_port = 0;
-	fr_ipaddr_t		ipaddr;
+	rlm_radius_client_instance_t const *inst = conn->inst;
+	rlm_radius_client_socket_t *sock;
+	fr_ipaddr_t const *src_ipaddr;
 
 	/*
 	 *	Too many outbound sockets is probably a bad idea.
 	 */
-	if (conn->num_fds > 16) {
-		ERROR("Too many open sockets (%d)", conn->num_fds);
-		return -1;
+	if (conn->num_sockets >= (int) inst->max_connections) {
+		ERROR("%s: Too many open sockets (%d)", inst->name, conn->num_sockets);
+		return NULL;
 	}
 
-	sockfd = fr_socket(server_ipaddr, server_port);
-	if (sockfd < 0) {
-		ERROR("Error opening socket");
-		return 0;
+	sock = talloc_zero(conn, rlm_radius_client_socket_t);
+	if (!sock) return NULL;
+
+	sock->conn = conn;
+	sock->ft = fr_radius_tracking_create(sock);
+	if (!sock->ft) {
+		talloc_free(sock);
+		return NULL;
 	}
 
-	/*
-	 *	Always set the socket as non-blocking.
-	 */
-	fr_nonblock(sockfd);
+	src_ipaddr = (inst->src_ipaddr.af != AF_UNSPEC) ? &inst->src_ipaddr : &inst->home_server->src_ipaddr;
 
 	/*
-	 *	The default destination is anywhere.
+	 *	Connected sockets only receive packets from the home
+	 *	server, and let the kernel tell us about ICMP errors.
 	 */
-	memset(&ipaddr, 0, sizeof(ipaddr));
-	ipaddr.af = AF_INET;
-
-	if (!fr_packet_list_socket_add(conn->pl, sockfd, IPPROTO_UDP, &ipaddr, 0, NULL)) {
-		DEBUG("Failed adding socket: %s", fr_strerror());
-		close(sockfd);
-		return -1;
+	sock->fd = fr_socket_client_udp(src_ipaddr, &inst->home_server->ipaddr, inst->home_server->port, true);
+	if (sock->fd < 0) {
+		ERROR("%s: Error opening socket: %s", inst->name, fr_strerror());
+		talloc_free(sock);
+		return NULL;
 	}
 
-	if (fr_event_fd_insert(el, sockfd, mod_event_fd, NULL, NULL, conn) < 0) {
-		DEBUG("Failed adding event for socket: %s", fr_strerror());
-		close(sockfd);
-		return -1;
+	if (fr_event_fd_insert(conn->el, sock->fd, mod_event_fd, NULL, NULL, sock) < 0) {
+		ERROR("%s: Failed adding event for socket: %s", inst->name, fr_strerror());
+		close(sock->fd);
+		talloc_free(sock);
+		return NULL;
 	}
 
-	conn->num_fds++;
+	conn->sockets[conn->num_sockets++] = sock;
 
-	return sockfd;
+	return sock;
 }
 
 /*
@@ -386,14 +727,15 @@ static void *mod_conn_create(fr_event_list_t *el, rlm_radius_client_instance_t
 {
 	rlm_radius_client_conn_t *conn;
 
-	conn = talloc(NULL, rlm_radius_client_conn_t);
+	conn = talloc_zero(NULL, rlm_radius_client_conn_t);
+	if (!conn) return NULL;
+
 	conn->inst = inst;
-	conn->pl = fr_packet_list_create(1);
-	conn->num_fds = 0;
 	conn->el = el;
+	conn->state = HOME_STATE_ALIVE;
 
-	if (mod_fd_add(el, conn, inst) < 0) {
-		fr_packet_list_free(conn->pl);
+	conn->sockets = talloc_zero_array(conn, rlm_radius_client_socket_t *, inst->max_connections);
+	if (!conn->sockets || !mod_socket_add(conn)) {
 		talloc_free(conn);
 		return NULL;
 	}
@@ -401,11 +743,43 @@ static void *mod_conn_create(fr_event_list_t *el, rlm_radius_client_instance_t
 	return conn;
 }
 
+/** Allocate an ID for a request, opening another socket if they're all full
+ *
+ */
+static int mod_id_alloc(rlm_radius_client_conn_t *conn, rlm_radius_client_request_t *ccr)
+{
+	int i;
+	rlm_radius_client_socket_t *sock = NULL;
+	fr_tracking_entry_t *entry;
+
+	for (i = 0; i < conn->num_sockets; i++) {
+		if (!fr_radius_tracking_full(conn->sockets[i]->ft)) {
+			sock = conn->sockets[i];
+			break;
+		}
+	}
+
+	if (!sock) {
+		sock = mod_socket_add(conn);
+		if (!sock) return -1;
+	}
+
+	entry = fr_radius_tracking_entry_alloc(sock->ft, fr_time());
+	if (!entry) return -1;
+
+	ccr->packet->id = entry->id;
+	ccr->packet->sockfd = sock->fd;
+	ccr->sock = sock;
+	sock->requests[entry->id] = ccr;
+
+	return 0;
+}
+
 
 static rlm_rcode_t mod_wait_for_reply(REQUEST *request, rlm_radius_client_instance_t const *inst,
 				      rlm_radius_client_request_t *ccr)
 {
-	struct timeval now, timeout;
+	struct timeval when;
 	RADIUS_PACKET *packet = ccr->child->packet;
 	char buffer[INET6_ADDRSTRLEN];
 
@@ -417,14 +791,24 @@ static rlm_rcode_t mod_wait_for_reply(REQUEST *request, rlm_radius_client_instan
 			 buffer, sizeof(buffer)),
 	       packet->dst_port, packet->id);
 
-	(void) fr_radius_send(packet, NULL, inst->home_server->secret);
+	if (mod_packet_send(packet, inst->home_server->secret) < 0) {
+		RDEBUG("Failed sending packet: %s", fr_strerror());
+	}
 	packet->count++;
 
-	timeout = ccr->inst->home_server->response_window;
-	gettimeofday(&now, NULL);
-	fr_timeval_add(&timeout, &now, &timeout);
+	/*
+	 *	Retransmit based on how quickly the home server has
+	 *	been answering, until the response window expires.
+	 */
+	gettimeofday(&ccr->start, NULL);
+	ccr->rto = mod_rto_initial(ccr->conn);
 
-	unlang_event_timeout_add(request, mod_proxy_no_reply, ccr, &timeout);
+	mod_timeval_add_usec(&when, &ccr->start, ccr->rto);
+	if (fr_event_timer_insert(ccr->conn->el, mod_retransmit, ccr, &when, &ccr->ev) < 0) {
+		RERROR("Failed inserting retransmission timer: %s", fr_strerror());
+		mod_cleanup(request, ccr);
+		return RLM_MODULE_FAIL;
+	}
 
 	return unlang_yield(request, mod_resume_continue, mod_action_dup, ccr);
 }
@@ -480,11 +864,19 @@ static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, void *thread, RE
 		}
 	}
 
+	/*
+	 *	Don't wait for a home server which isn't answering.
+	 */
+	if (conn->state != HOME_STATE_ALIVE) {
+		REDEBUG("Home server %s is not responding", inst->home_server->name);
+		return RLM_MODULE_FAIL;
+	}
+
 	/*
 	 *	We need to tie the child to both the parent, to the
 	 *	module instance, and to the connection it's using.
 	 */
-	MEM(ccr = talloc(request, rlm_radius_client_request_t));
+	MEM(ccr = talloc_zero(request, rlm_radius_client_request_t));
 
 	ccr->inst = inst;
 	ccr->request = request;
@@ -517,7 +909,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, void *thread, RE
 	packet->dst_ipaddr = inst->home_server->ipaddr;
 	packet->dst_port = inst->home_server->port;
 
-	packet->src_ipaddr = inst->home_server->src_ipaddr;
+	/*
+	 *	The socket is bound and connected, so we don't need
+	 *	to set the source address.
+	 */
+	packet->src_ipaddr.af = AF_UNSPEC;
 	packet->src_port = 0;
 
 #ifndef NDEBUG
@@ -569,18 +965,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, void *thread, RE
 	 *	Grab an ID.  If we can't, try to create
 	 *	another socket, which will give us more IDs.
 	 */
-	if (!fr_packet_list_id_alloc(conn->pl, IPPROTO_UDP, &ccr->packet, NULL)) {
-		if (mod_fd_add(request->el, conn, inst) < 0) {
-			talloc_free(ccr);
-			REDEBUG("Failed adding more sockets");
-			return RLM_MODULE_FAIL;
-		}
-
-		if (!fr_packet_list_id_alloc(conn->pl, IPPROTO_UDP, &ccr->packet, NULL)) {
-			talloc_free(ccr);
-			REDEBUG("Failed allocating ID: %s", fr_strerror());
-			return RLM_MODULE_FAIL;
-		}
+	if (mod_id_alloc(conn, ccr) < 0) {
+		talloc_free(ccr);
+		REDEBUG("Failed allocating ID: All sockets are full");
+		return RLM_MODULE_FAIL;
 	}
 	child->in_request_hash = true;
 
@@ -678,11 +1066,15 @@ static int mod_bootstrap(CONF_SECTION *config, void *instance)
 	}
 #endif
 
-	if (home->ping_check != HOME_PING_CHECK_NONE) {
-		cf_log_err_cs(config, "Only home servers of 'status_check = none' is allowed.");
+	if ((home->ping_check != HOME_PING_CHECK_NONE) &&
+	    (home->ping_check != HOME_PING_CHECK_STATUS_SERVER)) {
+		cf_log_err_cs(config, "Only home servers of 'status_check = none' or 'status_check = status-server' are allowed.");
 		return -1;
 	}
 
+	FR_INTEGER_BOUND_CHECK("max_connections", inst->max_connections, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_connections", inst->max_connections, <=, 256);
+
 	DEBUG("%s: Adding home server %s", inst->name, home->name);
 
 	inst->home_server = home;
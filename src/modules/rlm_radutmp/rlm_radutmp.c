@@ -29,6 +29,8 @@ RCSID("$Id$")
 #include	<freeradius-devel/rad_assert.h>
 
 #include	<fcntl.h>
+#include	<ctype.h>
+#include	<sys/stat.h>
 
 #include "config.h"
 
@@ -36,25 +38,55 @@ RCSID("$Id$")
 
 static char const porttypes[] = "ASITX";
 
-/*
- *	used for caching radutmp lookups in the accounting component. The
- *	session (checksimul) component doesn't use it, but probably should.
+/** The first record in the file for a NAS and port
+ *
+ */
+typedef struct radutmp_port {
+	uint32_t		nas_address;
+	unsigned int		nas_port;
+	off_t			offset;		//!< Where the record is in the file.
+} radutmp_port_t;
+
+/** The records for users who are logged in with one name
+ *
  */
-typedef struct nas_port {
-	uint32_t		nasaddr;
-	uint16_t		port;
-	off_t			offset;
-	struct nas_port 	*next;
-} NAS_PORT;
+typedef struct radutmp_login {
+	char			login[RUT_NAMESIZE + 1];	//!< Normalised login name.
+	off_t			*offsets;	//!< Of the P_LOGIN records for this name.
+	uint32_t		num;		//!< How many records there are.
+} radutmp_login_t;
+
+/** An index of one radutmp file
+ *
+ * The file is still the canonical store, and radwho reads it
+ * directly.  The index lets accounting updates and checksimul find
+ * the records they need without reading the whole file.
+ *
+ * If the file is changed by anything other than this module, the
+ * index is rebuilt the next time it's used.
+ */
+typedef struct radutmp_index {
+	char const		*filename;	//!< The (expanded) file name.
+	TALLOC_CTX		*ctx;		//!< Holds the tables, freed on rebuild.
+	fr_hash_table_t		*ports;		//!< radutmp_port_t, by NAS address and port.
+	fr_hash_table_t		*logins;	//!< radutmp_login_t, by login name.
+
+	bool			valid;		//!< Whether the tables match the file.
+	dev_t			dev;		//!< What the file looked like after we last
+	ino_t			ino;		//!< wrote to it.
+	off_t			size;
+	time_t			mtime;
+} radutmp_index_t;
 
 typedef struct rlm_radutmp_t {
-	NAS_PORT	*nas_port_list;
 	char const	*filename;
 	char const	*username;
 	bool		case_sensitive;
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+	bool		index;			//!< Whether we index the files.
+	fr_hash_table_t	*indexes;		//!< radutmp_index_t, by file name.
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -64,18 +96,298 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("check_with_nas", PW_TYPE_BOOLEAN, rlm_radutmp_t, check_nas), .dflt = "yes" },
 	{ FR_CONF_OFFSET("permissions", PW_TYPE_INTEGER, rlm_radutmp_t, permission), .dflt = "0644" },
 	{ FR_CONF_OFFSET("caller_id", PW_TYPE_BOOLEAN, rlm_radutmp_t, caller_id_ok), .dflt = "no" },
+	{ FR_CONF_OFFSET("index", PW_TYPE_BOOLEAN, rlm_radutmp_t, index), .dflt = "yes" },
 	CONF_PARSER_TERMINATOR
 };
 
+static uint32_t radutmp_port_hash(void const *data)
+{
+	radutmp_port_t const *a = data;
+	uint32_t hash;
+
+	hash = fr_hash(&a->nas_address, sizeof(a->nas_address));
+	return fr_hash_update(&a->nas_port, sizeof(a->nas_port), hash);
+}
+
+static int radutmp_port_cmp(void const *one, void const *two)
+{
+	radutmp_port_t const *a = one;
+	radutmp_port_t const *b = two;
+
+	if (a->nas_address != b->nas_address) return (a->nas_address < b->nas_address) ? -1 : +1;
+
+	return (a->nas_port > b->nas_port) - (a->nas_port < b->nas_port);
+}
+
+static uint32_t radutmp_login_hash(void const *data)
+{
+	radutmp_login_t const *a = data;
+
+	return fr_hash_string(a->login);
+}
+
+static int radutmp_login_cmp(void const *one, void const *two)
+{
+	radutmp_login_t const *a = one;
+	radutmp_login_t const *b = two;
+
+	return strcmp(a->login, b->login);
+}
+
+static uint32_t radutmp_index_hash(void const *data)
+{
+	radutmp_index_t const *a = data;
+
+	return fr_hash_string(a->filename);
+}
+
+static int radutmp_index_cmp(void const *one, void const *two)
+{
+	radutmp_index_t const *a = one;
+	radutmp_index_t const *b = two;
+
+	return strcmp(a->filename, b->filename);
+}
+
+/** Normalise a login name, so that it can be used as a key
+ *
+ * Names are compared using at most RUT_NAMESIZE characters, and
+ * without regard to case if we're not case sensitive.
+ */
+static void radutmp_login_key(char out[RUT_NAMESIZE + 1], char const *login, bool case_sensitive)
+{
+	size_t i;
+
+	for (i = 0; (i < RUT_NAMESIZE) && login[i]; i++) {
+		out[i] = case_sensitive ? login[i] : tolower((uint8_t) login[i]);
+	}
+	out[i] = '\0';
+}
+
+/** Add a P_LOGIN record to the index
+ *
+ */
+static int radutmp_index_login_add(rlm_radutmp_t const *inst, radutmp_index_t *index,
+				   struct radutmp const *u, off_t offset)
+{
+	radutmp_login_t my_login, *login;
+
+	radutmp_login_key(my_login.login, u->login, inst->case_sensitive);
+
+	login = fr_hash_table_finddata(index->logins, &my_login);
+	if (!login) {
+		login = talloc_zero(index->ctx, radutmp_login_t);
+		if (!login) return -1;
+
+		strlcpy(login->login, my_login.login, sizeof(login->login));
+		if (!fr_hash_table_insert(index->logins, login)) {
+			talloc_free(login);
+			return -1;
+		}
+	}
+
+	login->offsets = talloc_realloc(login, login->offsets, off_t, login->num + 1);
+	if (!login->offsets) return -1;
+	login->offsets[login->num++] = offset;
+
+	return 0;
+}
+
+/** Remove a P_LOGIN record from the index
+ *
+ */
+static void radutmp_index_login_remove(rlm_radutmp_t const *inst, radutmp_index_t *index,
+				       struct radutmp const *u, off_t offset)
+{
+	radutmp_login_t my_login, *login;
+	uint32_t	i;
+
+	radutmp_login_key(my_login.login, u->login, inst->case_sensitive);
+
+	login = fr_hash_table_finddata(index->logins, &my_login);
+	if (!login) return;
+
+	for (i = 0; i < login->num; i++) {
+		if (login->offsets[i] != offset) continue;
+
+		login->offsets[i] = login->offsets[--login->num];
+		break;
+	}
+
+	if (!login->num) {
+		fr_hash_table_delete(index->logins, login);
+		talloc_free(login);
+	}
+}
+
+/** Remember what the file looks like, so we can tell if someone else changed it
+ *
+ */
+static void radutmp_index_stamp(radutmp_index_t *index, int fd)
+{
+	struct stat buf;
+
+	if (fstat(fd, &buf) < 0) {
+		index->valid = false;
+		return;
+	}
+
+	index->dev = buf.st_dev;
+	index->ino = buf.st_ino;
+	index->size = buf.st_size;
+	index->mtime = buf.st_mtime;
+}
+
+/** Update the index after a record has been written
+ *
+ * @param[in] inst	of the module.
+ * @param[in] index	to update, may be NULL.
+ * @param[in] fd	the record was written to.
+ * @param[in] old	the record which was overwritten, or NULL if the record was appended.
+ * @param[in] new	the record which was written.
+ * @param[in] offset	of the record.
+ */
+static void radutmp_index_update(rlm_radutmp_t const *inst, radutmp_index_t *index, int fd,
+				 struct radutmp const *old, struct radutmp const *new, off_t offset)
+{
+	if (!index || !index->valid) return;
+
+	if (old && (old->type == P_LOGIN)) radutmp_index_login_remove(inst, index, old, offset);
+
+	if (!old) {
+		radutmp_port_t *port;
+
+		port = talloc_zero(index->ctx, radutmp_port_t);
+		if (!port) goto fail;
+
+		port->nas_address = new->nas_address;
+		port->nas_port = new->nas_port;
+		port->offset = offset;
+		if (!fr_hash_table_insert(index->ports, port)) {
+			talloc_free(port);
+			goto fail;
+		}
+	}
+
+	if ((new->type == P_LOGIN) && (radutmp_index_login_add(inst, index, new, offset) < 0)) {
+	fail:
+		index->valid = false;
+		return;
+	}
+
+	radutmp_index_stamp(index, fd);
+}
+
+/** (Re-)build the index from the file
+ *
+ */
+static int radutmp_index_build(REQUEST *request, rlm_radutmp_t const *inst, radutmp_index_t *index, int fd)
+{
+	struct radutmp	u;
+	off_t		offset = 0;
+	ssize_t		len;
+
+	index->valid = false;
+
+	TALLOC_FREE(index->ctx);
+	index->ctx = talloc_new(index);
+	if (!index->ctx) return -1;
+
+	index->ports = fr_hash_table_create(index->ctx, radutmp_port_hash, radutmp_port_cmp, NULL);
+	index->logins = fr_hash_table_create(index->ctx, radutmp_login_hash, radutmp_login_cmp, NULL);
+	if (!index->ports || !index->logins) return -1;
+
+	while ((len = pread(fd, &u, sizeof(u), offset)) == sizeof(u)) {
+		radutmp_port_t my_port, *port;
+
+		my_port.nas_address = u.nas_address;
+		my_port.nas_port = u.nas_port;
+		if (!fr_hash_table_finddata(index->ports, &my_port)) {
+			port = talloc_memdup(index->ctx, &my_port, sizeof(my_port));
+			if (!port) return -1;
+			port->offset = offset;
+
+			if (!fr_hash_table_insert(index->ports, port)) return -1;
+		}
+
+		if ((u.type == P_LOGIN) && (radutmp_index_login_add(inst, index, &u, offset) < 0)) return -1;
+
+		offset += sizeof(u);
+	}
+
+	if (len < 0) {
+		REDEBUG("Failed reading %s: %s", index->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	RDEBUG3("Indexed %" PRIu64 " records in %s", (uint64_t) (offset / sizeof(u)), index->filename);
+
+	index->valid = true;
+	radutmp_index_stamp(index, fd);
+
+	return 0;
+}
+
+/** Get an up to date index for a file
+ *
+ * The file must be locked.
+ *
+ * @return
+ *	- The index.
+ *	- NULL if indexing is disabled, or failed.  The caller should scan the file.
+ */
+static radutmp_index_t *radutmp_index_get(REQUEST *request, rlm_radutmp_t *inst, char const *filename, int fd)
+{
+	radutmp_index_t	my_index, *index;
+	struct stat	buf;
+
+	if (!inst->index) return NULL;
+
+	if (!inst->indexes) {
+		inst->indexes = fr_hash_table_create(inst, radutmp_index_hash, radutmp_index_cmp, NULL);
+		if (!inst->indexes) return NULL;
+	}
+
+	my_index.filename = filename;
+	index = fr_hash_table_finddata(inst->indexes, &my_index);
+	if (!index) {
+		index = talloc_zero(inst->indexes, radutmp_index_t);
+		if (!index) return NULL;
+
+		index->filename = talloc_typed_strdup(index, filename);
+		if (!index->filename || !fr_hash_table_insert(inst->indexes, index)) {
+			talloc_free(index);
+			return NULL;
+		}
+	}
+
+	if (fstat(fd, &buf) < 0) return NULL;
+
+	if (index->valid &&
+	    (buf.st_dev == index->dev) && (buf.st_ino == index->ino) &&
+	    (buf.st_size == index->size) && (buf.st_mtime == index->mtime)) return index;
+
+	if (index->valid) RDEBUG2("%s was changed by another process, re-indexing it", filename);
+
+	if (radutmp_index_build(request, inst, index, fd) < 0) {
+		index->valid = false;
+		return NULL;
+	}
+
+	return index;
+}
+
 
 #ifdef WITH_ACCOUNTING
 /*
  *	Zap all users on a NAS from the radutmp file.
  */
-static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t nasaddr, time_t t)
+static rlm_rcode_t radutmp_zap(REQUEST *request, rlm_radutmp_t *inst, char const *filename, uint32_t nasaddr, time_t t)
 {
-	struct radutmp	u;
+	struct radutmp	u, old;
 	int		fd;
+	off_t		offset = 0;
+	radutmp_index_t	*index;
 
 	if (t == 0) time(&t);
 
@@ -94,29 +406,30 @@ static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t
 		return RLM_MODULE_FAIL;
 	}
 
+	index = radutmp_index_get(request, inst, filename, fd);
+
 	/*
-	*	Find the entry for this NAS / portno combination.
+	*	Find the entries for this NAS.
 	*/
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+	for (offset = 0; pread(fd, &u, sizeof(u), offset) == sizeof(u); offset += sizeof(u)) {
 		if ((nasaddr != 0 && nasaddr != u.nas_address) || u.type != P_LOGIN) {
 			continue;
 		}
 		/*
 		 *	Match. Zap it.
 		 */
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
-			REDEBUG("radutmp_zap: negative lseek!");
-			lseek(fd, (off_t)0, SEEK_SET);
-		}
+		old = u;
 		u.type = P_IDLE;
 		u.time = t;
 
-		if (write(fd, &u, sizeof(u)) < 0) {
+		if (pwrite(fd, &u, sizeof(u), offset) < 0) {
 			REDEBUG("Failed writing: %s", fr_syserror(errno));
 
+			if (index) index->valid = false;
 			close(fd);
 			return RLM_MODULE_FAIL;
 		}
+		radutmp_index_update(inst, index, fd, &old, &u, offset);
 	}
 	close(fd);	/* and implicitely release the locks */
 
@@ -124,19 +437,58 @@ static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t
 }
 
 /*
- *	Lookup a NAS_PORT in the nas_port_list
+ *	Check an existing record for the NAS / port against the new one.
+ *
+ *	Returns 1 if the record should be updated, 0 if it should be
+ *	skipped, and -1 if nothing should be written.
  */
-static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, uint16_t port)
+static int radutmp_record_check(REQUEST *request, int status, struct radutmp *ut, struct radutmp const *u,
+				char const *nas)
 {
-	NAS_PORT	*cl;
+	/*
+	 *	Don't compare stop records to unused entries.
+	 */
+	if (status == PW_STATUS_STOP && u->type == P_IDLE) {
+		return 0;
+	}
 
-	for(cl = nas_port_list; cl; cl = cl->next) {
-		if (nasaddr == cl->nasaddr &&
-			port == cl->port)
-			break;
+	if ((status == PW_STATUS_STOP) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) != 0) {
+		/*
+		 *	Don't complain if this is not a
+		 *	login record (some clients can
+		 *	send _only_ logout records).
+		 */
+		if (u->type == P_LOGIN) {
+			RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u->nas_port);
+		}
+
+		return -1;
+	}
+
+	if ((status == PW_STATUS_START) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0  &&
+	    u->time >= ut->time) {
+		if (u->type == P_LOGIN) {
+			RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u->nas_port);
+			return -1;
+		}
+
+		RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u->nas_port);
+		return -1;
+	}
+
+	/*
+	 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
+	 *	rather rewrite this mess -- miquels.
+	 */
+	if ((status == PW_STATUS_ALIVE) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0  &&
+	    u->type == P_LOGIN) {
+		/*
+		 *	Keep the original login time.
+		 */
+		ut->time = u->time;
 	}
 
-	return cl;
+	return 1;
 }
 
 
@@ -158,7 +510,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	rlm_radutmp_t	*inst = instance;
 	char		ip_name[INET_ADDRSTRLEN]; /* 255.255.255.255 */
 	char const	*nas;
-	NAS_PORT	*cache;
+	radutmp_index_t	*index;
+	off_t		offset;
 	int		r;
 
 	char		*filename = NULL;
@@ -323,14 +676,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	 */
 	if (status == PW_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		rcode = radutmp_zap(request, inst, filename, ut.nas_address, ut.time);
 
 		goto finish;
 	}
 
 	if (status == PW_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		rcode = radutmp_zap(request, inst, filename, ut.nas_address, ut.time);
 
 		goto finish;
 	}
@@ -400,107 +753,55 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 
 	/*
 	 *	Find the entry for this NAS / portno combination.
+	 *	The index knows where it is; otherwise we read the
+	 *	file until we find a match.
 	 */
-	if ((cache = nas_port_find(inst->nas_port_list, ut.nas_address, ut.nas_port)) != NULL) {
-		if (lseek(fd, (off_t)cache->offset, SEEK_SET) < 0) {
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
-		}
-	}
-
 	r = 0;
-	off = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		off += sizeof(u);
-		if ((u.nas_address != ut.nas_address) || (u.nas_port != ut.nas_port)) {
-			continue;
-		}
-
-		/*
-		 *	Don't compare stop records to unused entries.
-		 */
-		if (status == PW_STATUS_STOP && u.type == P_IDLE) {
-			continue;
-		}
-
-		if ((status == PW_STATUS_STOP) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) != 0) {
-			/*
-			 *	Don't complain if this is not a
-			 *	login record (some clients can
-			 *	send _only_ logout records).
-			 */
-			if (u.type == P_LOGIN) {
-				RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u.nas_port);
+	index = radutmp_index_get(request, inst, filename, fd);
+	if (index) {
+		radutmp_port_t my_port, *port;
+
+		my_port.nas_address = ut.nas_address;
+		my_port.nas_port = ut.nas_port;
+		port = fr_hash_table_finddata(index->ports, &my_port);
+		if (port) {
+			offset = port->offset;
+			if (pread(fd, &u, sizeof(u), offset) != sizeof(u)) {
+				REDEBUG("Failed reading %s: %s", filename, fr_syserror(errno));
+				index->valid = false;
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
 			}
-
-			r = -1;
-			break;
+			r = radutmp_record_check(request, status, &ut, &u, nas);
+		} else {
+			offset = index->size;
 		}
-
-		if ((status == PW_STATUS_START) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.time >= ut.time) {
-			if (u.type == P_LOGIN) {
-				RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u.nas_port);
-				r = -1;
-				break;
+	} else {
+		for (offset = 0; pread(fd, &u, sizeof(u), offset) == sizeof(u); offset += sizeof(u)) {
+			if ((u.nas_address != ut.nas_address) || (u.nas_port != ut.nas_port)) {
+				continue;
 			}
 
-			RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u.nas_port);
-			r = -1;
-			break;
-		}
-
-		/*
-		 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
-		 *	rather rewrite this mess -- miquels.
-		 */
-		if ((status == PW_STATUS_ALIVE) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.type == P_LOGIN) {
-			/*
-			 *	Keep the original login time.
-			 */
-			ut.time = u.time;
-		}
-
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
-			RWDEBUG("negative lseek!");
-			lseek(fd, (off_t)0, SEEK_SET);
-			off = 0;
-		} else {
-			off -= sizeof(u);
+			r = radutmp_record_check(request, status, &ut, &u, nas);
+			if (r != 0) break;
 		}
-
-		r = 1;
-		break;
-	} /* read the file until we find a match */
+	}
 
 	/*
 	 *	Found the entry, do start/update it with
-	 *	the information from the packet.
+	 *	the information from the packet.  If there wasn't
+	 *	one, offset is the end of the file.
 	 */
 	if ((r >= 0) && (status == PW_STATUS_START || status == PW_STATUS_ALIVE)) {
-		/*
-		 *	Remember where the entry was, because it's
-		 *	easier than searching through the entire file.
-		 */
-		if (!cache) {
-			cache = talloc_zero(NULL, NAS_PORT);
-			if (cache) {
-				cache->nasaddr = ut.nas_address;
-				cache->port = ut.nas_port;
-				cache->offset = off;
-				cache->next = inst->nas_port_list;
-				inst->nas_port_list = cache;
-			}
-		}
-
 		ut.type = P_LOGIN;
-		if (write(fd, &ut, sizeof(u)) < 0) {
+		if (pwrite(fd, &ut, sizeof(ut), offset) < 0) {
 			REDEBUG("Failed writing: %s", fr_syserror(errno));
+			if (index) index->valid = false;
 
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
+		radutmp_index_update(inst, index, fd, (r > 0) ? &u : NULL, &ut, offset);
 	}
 
 	/*
@@ -509,15 +810,19 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	 */
 	if (status == PW_STATUS_STOP) {
 		if (r > 0) {
+			struct radutmp old = u;
+
 			u.type = P_IDLE;
 			u.time = ut.time;
 			u.delay = ut.delay;
-			if (write(fd, &u, sizeof(u)) < 0) {
+			if (pwrite(fd, &u, sizeof(u), offset) < 0) {
 				REDEBUG("Failed writing: %s", fr_syserror(errno));
+				if (index) index->valid = false;
 
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
+			radutmp_index_update(inst, index, fd, &old, &u, offset);
 		} else if (r == 0) {
 			RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut.nas_port);
 		}
@@ -555,18 +860,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 	uint32_t	ipno = 0;
 	char const     	*call_num = NULL;
 	rlm_radutmp_t	*inst = instance;
+	radutmp_index_t	*index;
+	off_t		*offsets = NULL;
+	uint32_t	i, num = 0;
 
+	char		*filename = NULL;
 	char		*expanded = NULL;
 	ssize_t		len;
 
 	/*
 	 *	Get the filename, via xlat.
 	 */
-	if (xlat_aeval(request, &expanded, request, inst->filename, NULL, NULL) < 0) {
+	if (xlat_aeval(request, &filename, request, inst->filename, NULL, NULL) < 0) {
 		return RLM_MODULE_FAIL;
 	}
 
-	fd = open(expanded, O_RDWR);
+	fd = open(filename, O_RDWR);
 	if (fd < 0) {
 		/*
 		 *	If the file doesn't exist, then no users
@@ -574,20 +883,19 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 		 */
 		if (errno == ENOENT) {
 			request->simul_count=0;
+			talloc_free(filename);
 			return RLM_MODULE_OK;
 		}
 
 		/*
 		 *	Error accessing the file.
 		 */
-		REDEBUG("Error accessing file %s: %s", expanded, fr_syserror(errno));
+		REDEBUG("Error accessing file %s: %s", filename, fr_syserror(errno));
 		rcode = RLM_MODULE_FAIL;
 
 		goto finish;
 	}
 
-	TALLOC_FREE(expanded);
-
 	len = xlat_aeval(request, &expanded, request, inst->username, NULL, NULL);
 	if (len < 0) {
 		rcode = RLM_MODULE_FAIL;
@@ -601,6 +909,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 		goto finish;
 	}
 
+	/*
+	 *	lock the file while reading/writing.
+	 */
+	rad_lockfd(fd, LOCK_LEN);
+
 	/*
 	 *	WTF?  This is probably wrong... we probably want to
 	 *	be able to check users across multiple session accounting
@@ -609,13 +922,37 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 	request->simul_count = 0;
 
 	/*
-	 *	Loop over utmp, counting how many people MAY be logged in.
+	 *	The index has the records for each user, so we don't
+	 *	have to read the whole file.  The offsets are copied,
+	 *	as zapping stale sessions below updates the index.
 	 */
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) ||
-		    (!inst->case_sensitive && (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) &&
-		     (u.type == P_LOGIN)) {
-			++request->simul_count;
+	index = radutmp_index_get(request, inst, filename, fd);
+	if (index) {
+		radutmp_login_t my_login, *login;
+
+		radutmp_login_key(my_login.login, expanded, inst->case_sensitive);
+		login = fr_hash_table_finddata(index->logins, &my_login);
+		if (login) {
+			num = login->num;
+			offsets = talloc_memdup(request, login->offsets, sizeof(offsets[0]) * num);
+			if (!offsets) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+		}
+		request->simul_count = num;
+
+	} else {
+		/*
+		 *	Loop over utmp, counting how many people MAY be logged in.
+		 */
+		for (i = 0; pread(fd, &u, sizeof(u), (off_t) i * sizeof(u)) == sizeof(u); i++) {
+			if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) ||
+			    (!inst->case_sensitive && (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) &&
+			     (u.type == P_LOGIN)) {
+				++request->simul_count;
+			}
 		}
 	}
 
@@ -628,7 +965,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 
 		goto finish;
 	}
-	lseek(fd, (off_t)0, SEEK_SET);
 
 	/*
 	 *	Setup some stuff, like for MPP detection.
@@ -641,11 +977,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 		call_num = vp->vp_strvalue;
 	}
 
-	/*
-	 *	lock the file while reading/writing.
-	 */
-	rad_lockfd(fd, LOCK_LEN);
-
 	/*
 	 *	FIXME: If we get a 'Start' for a user/nas/port which is
 	 *	listed, but for which we did NOT get a 'Stop', then
@@ -653,7 +984,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 	 *	static IP's like DSL.
 	 */
 	request->simul_count = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+	for (i = 0; index ? (i < num) : true; i++) {
+		off_t offset = index ? offsets[i] : (off_t) i * sizeof(u);
+
+		if (pread(fd, &u, sizeof(u), offset) != sizeof(u)) {
+			if (index) continue;
+			break;
+		}
+
 		if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) || (!inst->case_sensitive &&
 		    (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) && (u.type == P_LOGIN)) {
 			char session_id[sizeof(u.session_id) + 1];
@@ -722,7 +1060,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, UNUSED void *
 	}
 	finish:
 
+	talloc_free(offsets);
 	talloc_free(expanded);
+	talloc_free(filename);
 
 	if (fd > -1) {
 		close(fd);		/* and implicitely release the locks */
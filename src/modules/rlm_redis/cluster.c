@@ -85,9 +85,9 @@
  *   indexes in the fr_redis_cluster_t.node array.  We use 8bit unsigned integers instead of
  *   pointers to save space.  Using pointers, the node[] array would need 784K, using IDs
  *   it uses 112K.  Still not light on memory, but a bit more acceptable.
- *   Currently the key_slot array is shadowed by key_slot_pending, used to stage new key_slot
- *   mappings.  This doubles the memory used.  We may want to consider allocating key_slot_pending
- *   only during remappings and freeing it after.
+ *   There are two #cluster_slot_map_t, the live map, and one used to stage new key_slot
+ *   mappings.  This doubles the memory used, but means the live map is never modified, and
+ *   workers can resolve keys to nodes without taking the cluster mutex.
  *
  * Mapping/Remapping the cluster
  * -----------------------------
@@ -103,9 +103,9 @@
  *     4. Connecting to nodes that were in the result, but not in the tree.
  *        Note: If we can't connect to any of the masters, we count the map as invalid, roll
  *        back any newly connected nodes, and error out. Slave failure is OK.
- *     5. Mapping keyslot ranges to nodes in the key_slot_pending array.
+ *     5. Mapping keyslot ranges to nodes in the staging map.
  *     6. Verifying there are no holes in the ranges (if there are, we roll back and error out).
- *     7. Applying the new keyslot ranges.
+ *     7. Publishing the staging map as the live map.
  *     8. Removing nodes no longer used by the key slots, and adding them back to the free
  *        nodes queue.
  *
@@ -234,6 +234,18 @@ typedef struct cluster_key_slot {
 	uint8_t			master;			//!< R/W node (master) for this key slot.
 } cluster_key_slot_t;
 
+/** A versioned snapshot of the key slot to node mappings
+ *
+ * Readers load the live map without holding the cluster mutex.  A reader may still
+ * be using a map when the remap after next reuses it, so readers check the version
+ * is the same before and after copying a key slot, and retry if it's changed.
+ */
+typedef struct cluster_slot_map {
+	uint64_t		version;		//!< Odd while the map is being written.
+	uint32_t		num_nodes;		//!< Number of nodes in use when the map was published.
+	cluster_key_slot_t	key_slot[KEY_SLOTS];	//!< Lookup table of slots to nodes.
+} cluster_slot_map_t;
+
 /** A redis cluster
  *
  * Holds all the structures and collections of nodes, to represent a Redis cluster.
@@ -259,8 +271,10 @@ struct fr_redis_cluster {
 	fr_fifo_t		*free_nodes;		//!< Queue of free nodes (or nodes waiting to be reused).
 	rbtree_t		*used_nodes;		//!< Tree of used nodes.
 
-	cluster_key_slot_t	key_slot[KEY_SLOTS];		//!< Lookup table of slots to pools.
-	cluster_key_slot_t	key_slot_pending[KEY_SLOTS];	//!< Pending key slot table.
+	cluster_slot_map_t	map[2];			//!< Live and staging key slot maps.
+	cluster_slot_map_t	*live;			//!< Map used to resolve keys to nodes.  Only
+							//!< accessed atomically.
+	uint64_t		version;		//!< Version of the live map.
 
 	pthread_mutex_t		mutex;			//!< Mutex to synchronise cluster operations.
 };
@@ -478,6 +492,20 @@ static cluster_rcode_t cluster_node_conf_from_redirect(uint16_t *key_slot, fr_so
 	return CLUSTER_OP_SUCCESS;
 }
 
+/** Make a staged key slot map the live map
+ *
+ * @note Must be called with the cluster mutex held, or before the cluster is shared.
+ *
+ * @param[in] cluster to publish the map in.
+ * @param[in] map to publish.  Its version must be odd.
+ */
+static void cluster_map_publish(fr_redis_cluster_t *cluster, cluster_slot_map_t *map)
+{
+	cluster->version += 2;
+	__atomic_store_n(&map->version, cluster->version, __ATOMIC_RELEASE);
+	__atomic_store_n(&cluster->live, map, __ATOMIC_RELEASE);
+}
+
 /** Apply a cluster map received from a cluster node
  *
  * @note Errors may be retrieved with fr_strerror().
@@ -523,6 +551,8 @@ static cluster_rcode_t cluster_map_apply(fr_redis_cluster_t *cluster, redisReply
 
 	cluster_rcode_t	rcode;
 
+	cluster_slot_map_t *slots;			// Map being staged.
+
 	uint8_t		rollback[UINT8_MAX];		// Set of nodes to re-add to the queue on failure.
 	bool		active[UINT8_MAX];		// Set of nodes active in the new cluster map.
 	bool		master[UINT8_MAX];		// Master nodes.
@@ -568,9 +598,16 @@ do { \
 	cluster->remapping = true;
 
 	/*
-	 *	Must be cleared with the mutex held
+	 *	Must be written with the mutex held.
+	 *
+	 *	Readers which loaded this map before the last
+	 *	remap may still be using it.  Marking it as
+	 *	being written makes them retry with the live map.
 	 */
-	memset(&cluster->key_slot_pending, 0, sizeof(cluster->key_slot_pending));
+	slots = (cluster->live == &cluster->map[0]) ? &cluster->map[1] : &cluster->map[0];
+	__atomic_store_n(&slots->version, cluster->version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(slots->key_slot, 0, sizeof(slots->key_slot));
 
 	/*
 	 *	Insert new nodes and markup the keyslot indexes
@@ -674,8 +711,7 @@ do { \
 		 *	specified by the range for this map.
 		 */
 		for (k = map->element[0]->integer; k <= map->element[1]->integer; k++) {
-			memcpy(&cluster->key_slot_pending[k], &tmpl_slot,
-			       sizeof(*(cluster->key_slot_pending)));
+			memcpy(&slots->key_slot[k], &tmpl_slot, sizeof(slots->key_slot[k]));
 		}
 	}
 
@@ -691,7 +727,7 @@ do { \
 	 *	error out.
 	 */
 	for (i = 0; i < KEY_SLOTS; i++) {
-		if (cluster->key_slot_pending[i].master == 0) {
+		if (slots->key_slot[i].master == 0) {
 			fr_strerror_printf("Cluster is misconfigured, no node assigned for key %zu", i);
 			rcode = CLUSTER_OP_BAD_INPUT;
 			goto error;
@@ -702,12 +738,13 @@ do { \
 	 *	We have connections/pools for all the nodes in
 	 *	the new map, apply it to the live cluster.
 	 *
-	 *	Other workers may be using the key slot table,
-	 *	but that's ok. Nodes and pools are never freed,
+	 *	Other workers may be using the old map, but
+	 *	that's ok. Nodes and pools are never freed,
 	 *	so the worst that will happen, is they'll hit
 	 *	the wrong node for the key, and get redirected.
 	 */
-	memcpy(&cluster->key_slot, &cluster->key_slot_pending, sizeof(cluster->key_slot));
+	slots->num_nodes = rbtree_num_elements(cluster->used_nodes);
+	cluster_map_publish(cluster, slots);
 
 	/*
 	 *	Anything not in the active set of nodes gets
@@ -1550,43 +1587,65 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, struct timev
  * If there's only a single node in the cluster, then we avoid the CRC16
  * and just use key slot 0.
  *
+ * The cluster mutex is not needed.  The key slot is copied from the live map,
+ * and the copy is discarded and retried if the map was rewritten while
+ * we were copying it.
+ *
+ * @param[out] out Where to write a copy of the key slot.
  * @param cluster to determine key slot for.
  * @param request The current request.
  * @param key the key to resolve.
  * @param key_len the length of the key.
- * @return pointer to key slot key resolves to.
+ * @return index of the key slot the key resolves to.
  */
-static cluster_key_slot_t *cluster_slot_by_key(fr_redis_cluster_t *cluster, REQUEST *request,
-					       uint8_t const *key, size_t key_len)
+static uint16_t cluster_slot_by_key(cluster_key_slot_t *out, fr_redis_cluster_t *cluster, REQUEST *request,
+				    uint8_t const *key, size_t key_len)
 {
-	cluster_key_slot_t *key_slot;
+	cluster_slot_map_t	*map;
+	uint64_t		version;
+	uint16_t		slot = 0;
+	bool			single;
 
 	if (!key || (key_len == 0)) {
-		key_slot = &cluster->key_slot[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
-		RDEBUG2("Key rand() -> slot %zu", key_slot - cluster->key_slot);
+		slot = (uint16_t)(fr_rand() & (KEY_SLOTS - 1));
+		RDEBUG2("Key rand() -> slot %u", slot);
+		key = NULL;
+	}
+
+	for (;;) {
+		map = __atomic_load_n(&cluster->live, __ATOMIC_ACQUIRE);
+		version = __atomic_load_n(&map->version, __ATOMIC_ACQUIRE);
+		if (version & 0x01) continue;		/* Being rewritten, the live map will have changed */
+
+		/*
+		 *	Avoid CRC16 if we're operating with one cluster node or
+		 *	without clustering.
+		 */
+		single = (map->num_nodes <= 1);
+		if (key) slot = single ? 0 : cluster_key_hash(key, key_len);
 
-		return key_slot;
+		*out = map->key_slot[slot];
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->version, __ATOMIC_RELAXED) == version) break;
 	}
 
-	/*
-	 *	Avoid CRC16 if we're operating with one cluster node or
-	 *	without clustering.
-	 */
-	if (rbtree_num_elements(cluster->used_nodes) > 1) {
-		key_slot = &cluster->key_slot[cluster_key_hash(key, key_len)];
-		if (RDEBUG_ENABLED2) {
-			char *p;
-
-			p = fr_asprint(request, (char const *)key, key_len, '"');
-			RDEBUG2("Key \"%s\" -> slot %zu", p, key_slot - cluster->key_slot);
-			talloc_free(p);
-		}
+	if (!key) return slot;
 
-		return key_slot;
+	if (single) {
+		RDEBUG3("Single node available, skipping key selection");
+		return slot;
 	}
-	RDEBUG3("Single node available, skipping key selection");
 
-	return &cluster->key_slot[0];
+	if (RDEBUG_ENABLED2) {
+		char *p;
+
+		p = fr_asprint(request, (char const *)key, key_len, '"');
+		RDEBUG2("Key \"%s\" -> slot %u", p, slot);
+		talloc_free(p);
+	}
+
+	return slot;
 }
 
 /** Resolve a key to a pool, and reserve a connection in that pool
@@ -1637,7 +1696,8 @@ fr_redis_rcode_t fr_redis_cluster_state_init(fr_redis_cluster_state_t *state, fr
 					     uint8_t const *key, size_t key_len, bool read_only)
 {
 	cluster_node_t		*node;
-	cluster_key_slot_t	*key_slot;
+	cluster_key_slot_t	key_slot;
+	uint16_t		slot;
 	uint8_t			first, i;
 	int			used_nodes;
 
@@ -1654,23 +1714,23 @@ fr_redis_rcode_t fr_redis_cluster_state_init(fr_redis_cluster_state_t *state, fr
 	}
 
 again:
-	key_slot = cluster_slot_by_key(cluster, request, key, key_len);
+	slot = cluster_slot_by_key(&key_slot, cluster, request, key, key_len);
 
 	/*
 	 *	1. Try each of the slaves for the key slot
 	 *	2. Fall through to trying the master, and a single alternate node.
 	 */
 	if (read_only) {
-		first = fr_rand() & key_slot->slave_num;
-		for (i = 0; i < key_slot->slave_num; i++) {
+		first = fr_rand() & key_slot.slave_num;
+		for (i = 0; i < key_slot.slave_num; i++) {
 			uint8_t node_id;
 
-			node_id = key_slot->slave[(first + i) % key_slot->slave_num];
+			node_id = key_slot.slave[(first + i) % key_slot.slave_num];
 			node = &cluster->node[node_id];
 			*conn = fr_connection_get(node->pool, request);
 			if (!*conn) {
-				RDEBUG2("[%i] No connections available (key slot %zu slave %i)",
-					node->id, key_slot - cluster->key_slot, (first + i) % key_slot->slave_num);
+				RDEBUG2("[%i] No connections available (key slot %u slave %i)",
+					node->id, slot, (first + i) % key_slot.slave_num);
 				cluster->remap_needed = true;
 				continue;	/* Continue until we find a live pool */
 			}
@@ -1686,11 +1746,11 @@ again:
 	 *	3. If there are no pools, or we can't reserve a handle,
 	 *	   give up.
 	 */
-	node = &cluster->node[key_slot->master];
+	node = &cluster->node[key_slot.master];
 	*conn = fr_connection_get(node->pool, request);
 	if (!*conn) {
-		RDEBUG2("[%i] No connections available (key slot %zu master)",
-			node->id, key_slot - cluster->key_slot);
+		RDEBUG2("[%i] No connections available (key slot %u master)",
+			node->id, slot);
 		cluster->remap_needed = true;
 
 		if (cluster_node_find_live(&node, conn, request, cluster, node) < 0) return REDIS_RCODE_RECONNECT;
@@ -1839,7 +1899,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	 */
 	case REDIS_RCODE_RECONNECT:
 	{
-		cluster_key_slot_t *key_slot;
+		cluster_key_slot_t key_slot;
 
 		RERROR("[%i] Failed communicating with %s:%i: %s", state->node->id, state->node->name,
 		       state->node->addr.port, fr_strerror());
@@ -1855,8 +1915,8 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 		/*
 		 *	Refresh the key slot
 		 */
-		key_slot = cluster_slot_by_key(cluster, request, state->key, state->key_len);
-		state->node = &cluster->node[key_slot->master];
+		(void) cluster_slot_by_key(&key_slot, cluster, request, state->key, state->key_len);
+		state->node = &cluster->node[key_slot.master];
 
 		*conn = fr_connection_get(state->node->pool, request);
 		if (!*conn) {
@@ -2008,6 +2068,72 @@ int fr_redis_cluster_pool_by_node_addr(fr_connection_pool_t **pool, fr_redis_clu
 	return 0;
 }
 
+/** Resolve a key to the address of the master node for its key slot
+ *
+ * For callers which manage their own connections to each node, such as the
+ * multiplexed interface in mux.c.
+ *
+ * @param[out] out Where to write the address of the node.
+ * @param[in] cluster to search for the node in.
+ * @param[in] request The current request.
+ * @param[in] key to resolve.  If NULL, or key_len is 0, a random key slot is used.
+ * @param[in] key_len Length of the key.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there are no nodes in the cluster.
+ */
+int fr_redis_cluster_node_addr_by_key(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, REQUEST *request,
+				      uint8_t const *key, size_t key_len)
+{
+	cluster_key_slot_t	key_slot;
+
+	if (__atomic_load_n(&cluster->live, __ATOMIC_ACQUIRE)->num_nodes == 0) {
+		fr_strerror_printf("No nodes in cluster");
+		return -1;
+	}
+
+	(void) cluster_slot_by_key(&key_slot, cluster, request, key, key_len);
+
+	/*
+	 *	Nodes are never freed, and the address of a node
+	 *	only changes when it's reused for a different
+	 *	address, after being removed from the live map.
+	 */
+	*out = cluster->node[key_slot.master].addr;
+
+	return 0;
+}
+
+/** Resolve a -MOVED or -ASK redirect to the address of the node we were redirected to
+ *
+ * The node is added to the cluster if it wasn't known before.  A -MOVED redirect
+ * means that our key slot map is out of date, so the cluster is flagged for remapping
+ * on the next operation which uses a pooled connection.
+ *
+ * @param[out] out Where to write the address of the node.
+ * @param[in] cluster the redirect was received from.
+ * @param[in] reply containing the redirect.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_redis_cluster_node_addr_by_redirect(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, redisReply *reply)
+{
+	cluster_node_t	*node;
+
+	if (cluster_redirect(&node, cluster, reply) < 0) return -1;
+
+	if (strncmp(REDIS_ERROR_MOVED_STR, reply->str, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) {
+		pthread_mutex_lock(&cluster->mutex);
+		cluster->remap_needed = true;
+		pthread_mutex_unlock(&cluster->mutex);
+	}
+
+	*out = node->addr;
+
+	return 0;
+}
+
 /** Private ctx structure to pass to _cluster_role_walk
  *
  */
@@ -2196,6 +2322,7 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	int			af = AF_UNSPEC;		/* AF of first server */
 
 	int			num_nodes;
+	cluster_slot_map_t	*map;
 	fr_redis_cluster_t	*cluster;
 
 	rad_assert(triggers_enabled || !trigger_prefix);
@@ -2295,6 +2422,7 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 
 	cluster->conf = conf;
 
+	cluster->live = &cluster->map[0];
 	pthread_mutex_init(&cluster->mutex, NULL);
 	talloc_set_destructor(cluster, _fr_redis_cluster_free);
 
@@ -2451,7 +2579,12 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	 *	hopefully we'll get one when we start processing
 	 *	requests.
 	 */
-	for (s = 0; s < KEY_SLOTS; s++) cluster->key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
+	map = (cluster->live == &cluster->map[0]) ? &cluster->map[1] : &cluster->map[0];
+	map->version = cluster->version + 1;
+	memset(map->key_slot, 0, sizeof(map->key_slot));
+	for (s = 0; s < KEY_SLOTS; s++) map->key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
+	map->num_nodes = num_nodes;
+	cluster_map_publish(cluster, map);
 
 	return cluster;
 }
@@ -81,6 +81,10 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
  */
 int fr_redis_cluster_pool_by_node_addr(fr_connection_pool_t **pool, fr_redis_cluster_t *cluster,
 				       fr_socket_addr_t *node, bool create);
+int fr_redis_cluster_node_addr_by_key(fr_socket_addr_t *out, fr_redis_cluster_t *cluster, REQUEST *request,
+				      uint8_t const *key, size_t key_len);
+int fr_redis_cluster_node_addr_by_redirect(fr_socket_addr_t *out, fr_redis_cluster_t *cluster,
+					   redisReply *reply);
 ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_addr_t *out[],
 					   fr_redis_cluster_t *cluster, bool is_master, bool is_slave);
 
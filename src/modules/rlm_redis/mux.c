@@ -0,0 +1,510 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mux.c
+ * @brief Pipeline commands from many requests over per-thread Redis connections.
+ *
+ * The pooled interface (#fr_redis_cluster_state_init) reserves a connection per
+ * request, and blocks the worker until the reply arrives.  This interface writes
+ * commands from many requests to a small number of connections per node, using
+ * #fr_mux_t, and the worker's event list.  Callers enqueue a command, yield, and
+ * collect the reply when the request is resumed.
+ *
+ * Redis replies to pipelined commands in the order they were sent, so the ID of
+ * each command is the number of commands previously written to the connection.
+ *
+ * Key slots are resolved using the cluster's slot map.  -MOVED and -ASK redirects
+ * are followed by re-sending the command to the node the cluster code resolves the
+ * redirect to.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "%s - "
+#define LOG_PREFIX_ARGS rmux->log_prefix
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/connection_mux.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "mux.h"
+
+/** Position of a reply which nobody is waiting for
+ *
+ * Used for the replies to ASKING, which is written before commands sent
+ * because of an -ASK redirect.
+ */
+typedef struct redis_mux_skip {
+	uint64_t		raw;		//!< Position of the reply on the connection.
+	struct redis_mux_skip	*next;		//!< Next reply to discard.
+} redis_mux_skip_t;
+
+/** An open connection to a node
+ *
+ */
+typedef struct {
+	redisContext		*handle;	//!< Hiredis context.  Only used for its socket and reader.
+	uint64_t		sent;		//!< Number of commands written.
+	uint64_t		received;	//!< Number of replies read.
+	redis_mux_skip_t	*skip;		//!< Replies to discard, in the order they'll arrive.
+	redis_mux_skip_t	**skip_tail;	//!< Where the next reply to discard should be linked.
+} redis_mux_handle_t;
+
+/** A node, and this thread's connections to it
+ *
+ */
+typedef struct {
+	fr_socket_addr_t	addr;		//!< Address of the node.
+	char			name[FR_IPADDR_STRLEN];	//!< Address of the node, as text.
+	fr_redis_mux_t		*rmux;		//!< The set of nodes this node belongs to.
+	fr_mux_t		*mux;		//!< Connections to the node.
+} redis_mux_node_t;
+
+struct fr_redis_mux {
+	CONF_SECTION		*cs;		//!< Passed to #fr_mux_alloc for each node.
+	fr_event_list_t		*el;		//!< This thread's event list.
+	fr_mux_wake_t		wake;		//!< Passed to #fr_mux_alloc for each node.
+	fr_redis_cluster_t	*cluster;	//!< Used to resolve keys and redirects to nodes.
+	fr_redis_conf_t const	*conf;		//!< Database number, password and redirect limits.
+	char const		*log_prefix;	//!< Prepended to log messages.
+
+	rbtree_t		*nodes;		//!< redis_mux_node_t by address.
+};
+
+/** A command, and what's needed to re-send it after a redirect
+ *
+ */
+typedef struct {
+	redis_mux_node_t	*node;		//!< Node the command was last written to.
+	int			argc;		//!< Number of arguments.
+	char const		**argv;		//!< Arguments.
+	size_t			*argv_len;	//!< Length of each argument.
+	bool			asking;		//!< Write ASKING before the command.
+	uint32_t		redirects;	//!< Number of redirects we've followed.
+	uint32_t		retries;	//!< Number of -TRYAGAIN replies we've received.
+} redis_mux_cmd_t;
+
+/** Wraps a hiredis reply, so it can be passed around as talloced memory
+ *
+ */
+typedef struct {
+	redisReply		*reply;
+} redis_mux_reply_t;
+
+static int _redis_mux_reply_free(redis_mux_reply_t *r)
+{
+	fr_redis_reply_free(r->reply);
+
+	return 0;
+}
+
+static int _redis_mux_handle_free(redis_mux_handle_t *h)
+{
+	redisFree(h->handle);
+
+	return 0;
+}
+
+static int redis_mux_node_cmp(void const *one, void const *two)
+{
+	redis_mux_node_t const *a = one, *b = two;
+	int ret;
+
+	ret = fr_ipaddr_cmp(&a->addr.ipaddr, &b->addr.ipaddr);
+	if (ret != 0) return ret;
+
+	return (a->addr.port > b->addr.port) - (a->addr.port < b->addr.port);
+}
+
+/** Run a command on a connection which has just been opened
+ *
+ * @param[in] rmux	the connection belongs to.
+ * @param[in] node	the connection is to.
+ * @param[in] handle	to run the command with.
+ * @param[in] what	we're doing, for error messages.
+ * @param[in] reply	to the command, which is freed.
+ * @return
+ *	- 0 if the server replied with OK.
+ *	- -1 on failure.
+ */
+static int redis_mux_open_check(fr_redis_mux_t *rmux, redis_mux_node_t *node, redisContext *handle,
+				char const *what, redisReply *reply)
+{
+	if (!reply) {
+		ERROR("%s: Failed %s: %s", node->name, what, handle->errstr);
+		return -1;
+	}
+
+	if ((reply->type != REDIS_REPLY_STATUS) || (strcmp(reply->str, "OK") != 0)) {
+		ERROR("%s: Failed %s: %s", node->name, what,
+		      reply->str ? reply->str : fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		fr_redis_reply_free(reply);
+		return -1;
+	}
+	fr_redis_reply_free(reply);
+
+	return 0;
+}
+
+/** Open a connection to a node
+ *
+ * Authentication and database selection are done synchronously, before the
+ * connection is handed to the mux.
+ */
+static void *redis_mux_open(TALLOC_CTX *ctx, int *fd, void *uctx, struct timeval const *timeout)
+{
+	redis_mux_node_t	*node = uctx;
+	fr_redis_mux_t		*rmux = node->rmux;
+	redis_mux_handle_t	*h;
+	redisContext		*handle;
+
+	DEBUG2("%s: Connecting to %s:%i", node->name, node->name, node->addr.port);
+
+	handle = redisConnectWithTimeout(node->name, node->addr.port, *timeout);
+	if (!handle || handle->err) {
+		ERROR("%s: Connection failed: %s", node->name, handle ? handle->errstr : "unknown error");
+		if (handle) redisFree(handle);
+		return NULL;
+	}
+
+	if ((rmux->conf->password &&
+	     (redis_mux_open_check(rmux, node, handle, "authenticating",
+				   redisCommand(handle, "AUTH %s", rmux->conf->password)) < 0)) ||
+	    (rmux->conf->database &&
+	     (redis_mux_open_check(rmux, node, handle, "selecting database",
+				   redisCommand(handle, "SELECT %i", rmux->conf->database)) < 0))) {
+		redisFree(handle);
+		return NULL;
+	}
+
+	h = talloc_zero(ctx, redis_mux_handle_t);
+	if (!h) {
+		redisFree(handle);
+		return NULL;
+	}
+	h->handle = handle;
+	h->skip_tail = &h->skip;
+	talloc_set_destructor(h, _redis_mux_handle_free);
+
+	*fd = handle->fd;
+
+	return h;
+}
+
+/** Write a command to a connection
+ *
+ * The write blocks if the socket buffer is full.  Replies are read when the
+ * event loop says the socket is readable.
+ */
+static int redis_mux_send(uint64_t *id, void *handle, UNUSED void *uctx, UNUSED REQUEST *request,
+			  void *rctx, UNUSED uint64_t seq)
+{
+	redis_mux_handle_t	*h = handle;
+	redis_mux_cmd_t		*cmd = rctx;
+	int			done = 0;
+
+	if (cmd->asking) {
+		redis_mux_skip_t *skip;
+
+		skip = talloc_zero(h, redis_mux_skip_t);
+		if (!skip) return -1;
+
+		if (redisAppendCommand(h->handle, "ASKING") != REDIS_OK) {
+			talloc_free(skip);
+			return -1;
+		}
+		skip->raw = h->sent++;
+		*h->skip_tail = skip;
+		h->skip_tail = &skip->next;
+	}
+
+	if (redisAppendCommandArgv(h->handle, cmd->argc, cmd->argv, cmd->argv_len) != REDIS_OK) return -1;
+	*id = h->sent++;
+
+	do {
+		if (redisBufferWrite(h->handle, &done) != REDIS_OK) return -1;
+	} while (!done);
+
+	return 0;
+}
+
+/** Read replies from a connection, and deliver them to the requests waiting for them
+ *
+ */
+static int redis_mux_recv(fr_mux_conn_t *mc, void *handle, UNUSED void *uctx)
+{
+	redis_mux_handle_t	*h = handle;
+	void			*reply;
+
+	if (redisBufferRead(h->handle) != REDIS_OK) return -1;
+
+	for (;;) {
+		redis_mux_reply_t	*r;
+		uint64_t		raw;
+
+		reply = NULL;
+		if (redisReaderGetReply(h->handle->reader, &reply) != REDIS_OK) return -1;
+		if (!reply) break;
+
+		raw = h->received++;
+		if (h->skip && (h->skip->raw == raw)) {
+			redis_mux_skip_t *next = h->skip->next;
+
+			talloc_free(h->skip);
+			h->skip = next;
+			if (!h->skip) h->skip_tail = &h->skip;
+
+			fr_redis_reply_free(reply);
+			continue;
+		}
+
+		r = talloc_zero(NULL, redis_mux_reply_t);
+		if (!r) {
+			fr_redis_reply_free(reply);
+			return -1;
+		}
+		r->reply = reply;
+		talloc_set_destructor(r, _redis_mux_reply_free);
+
+		(void) fr_mux_reply(mc, raw, r);
+	}
+
+	return 0;
+}
+
+static fr_mux_funcs_t const redis_mux_funcs = {
+	.open	= redis_mux_open,
+	.send	= redis_mux_send,
+	.recv	= redis_mux_recv
+};
+
+/** Find or create the set of connections to a node
+ *
+ * @param[in] rmux	to search.
+ * @param[in] addr	of the node.
+ * @return
+ *	- The node.
+ *	- NULL on error.
+ */
+static redis_mux_node_t *redis_mux_node_find(fr_redis_mux_t *rmux, fr_socket_addr_t const *addr)
+{
+	redis_mux_node_t	find, *node;
+
+	find.addr = *addr;
+	node = rbtree_finddata(rmux->nodes, &find);
+	if (node) return node;
+
+	node = talloc_zero(rmux->nodes, redis_mux_node_t);
+	if (!node) return NULL;
+
+	node->addr = *addr;
+	node->rmux = rmux;
+	fr_inet_ntop(node->name, sizeof(node->name), &node->addr.ipaddr);
+
+	node->mux = fr_mux_alloc(node, rmux->cs, rmux->el, rmux->wake,
+				 &redis_mux_funcs, node, rmux->log_prefix);
+	if (!node->mux || !rbtree_insert(rmux->nodes, node)) {
+		talloc_free(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+/** Allocate a set of pipelined connections for a worker thread
+ *
+ * Connections to each node are opened the first time a command is sent to it.
+ *
+ * @param[in] ctx		to allocate the mux in.  Usually thread instance data.
+ * @param[in] cs		containing the #fr_mux_t configuration (connections,
+ *				max_inflight, timeout etc.), used for every node.
+ * @param[in] el		The event list serviced by this thread.
+ * @param[in] wake		Called to resume requests, usually unlang_resumable().
+ * @param[in] cluster		to resolve keys and redirects with.
+ * @param[in] conf		Common Redis configuration.
+ * @param[in] log_prefix	to prepend to log messages.
+ * @return
+ *	- New mux.
+ *	- NULL on error.
+ */
+fr_redis_mux_t *fr_redis_mux_alloc(TALLOC_CTX *ctx, CONF_SECTION *cs, fr_event_list_t *el, fr_mux_wake_t wake,
+				   fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf,
+				   char const *log_prefix)
+{
+	fr_redis_mux_t *rmux;
+
+	rmux = talloc_zero(ctx, fr_redis_mux_t);
+	if (!rmux) return NULL;
+
+	rmux->cs = cs;
+	rmux->el = el;
+	rmux->wake = wake;
+	rmux->cluster = cluster;
+	rmux->conf = conf;
+	rmux->log_prefix = talloc_typed_strdup(rmux, log_prefix);
+
+	rmux->nodes = rbtree_create(rmux, redis_mux_node_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!rmux->nodes) {
+		talloc_free(rmux);
+		return NULL;
+	}
+
+	return rmux;
+}
+
+/** Write a command to the node responsible for a key
+ *
+ * Once this function returns 0, the caller should yield, and call
+ * #fr_redis_mux_result when the request is resumed.
+ *
+ * @param[in] rmux	to write the command with.
+ * @param[in] request	The current request.
+ * @param[in] key	to resolve to a node.  If NULL a random key slot will be used.
+ * @param[in] key_len	Length of the key.
+ * @param[in] argc	Number of arguments.
+ * @param[in] argv	Arguments.  Copied, so may be freed once this function returns.
+ * @param[in] argv_len	Length of each argument.
+ * @return
+ *	- 0 if the command was sent.
+ *	- -1 on error.
+ */
+int fr_redis_mux_enqueue(fr_redis_mux_t *rmux, REQUEST *request, uint8_t const *key, size_t key_len,
+			 int argc, char const **argv, size_t const *argv_len)
+{
+	redis_mux_cmd_t		*cmd;
+	fr_socket_addr_t	addr;
+	int			i;
+
+	if (fr_redis_cluster_node_addr_by_key(&addr, rmux->cluster, request, key, key_len) < 0) {
+		REDEBUG("Failed resolving key to node: %s", fr_strerror());
+		return -1;
+	}
+
+	cmd = talloc_zero(request, redis_mux_cmd_t);
+	if (!cmd) return -1;
+
+	cmd->argc = argc;
+	cmd->argv = talloc_array(cmd, char const *, argc);
+	cmd->argv_len = talloc_array(cmd, size_t, argc);
+	if (!cmd->argv || !cmd->argv_len) {
+	error:
+		talloc_free(cmd);
+		return -1;
+	}
+
+	for (i = 0; i < argc; i++) {
+		cmd->argv[i] = talloc_memdup(cmd->argv, argv[i], argv_len[i]);
+		if (!cmd->argv[i]) goto error;
+		cmd->argv_len[i] = argv_len[i];
+	}
+
+	cmd->node = redis_mux_node_find(rmux, &addr);
+	if (!cmd->node) goto error;
+
+	if (fr_mux_enqueue(cmd->node->mux, request, cmd) < 0) goto error;
+
+	(void) request_data_add(request, rmux, 0, cmd, true, false, false);
+
+	return 0;
+}
+
+/** Get the reply to a command, following redirects if necessary
+ *
+ * @param[out] out	Where to write the reply.  Must be freed with #fr_redis_reply_free.
+ * @param[in] rmux	the command was enqueued with.
+ * @param[in] request	The current request.
+ * @return
+ *	- REDIS_RCODE_TRY_AGAIN if the command was re-sent.  The caller should yield again,
+ *	  and call this function when the request is resumed.
+ *	- REDIS_RCODE_SUCCESS with the reply in out.
+ *	- Another #fr_redis_rcode_t on failure, with any reply in out.
+ */
+fr_redis_rcode_t fr_redis_mux_result(redisReply **out, fr_redis_mux_t *rmux, REQUEST *request)
+{
+	redis_mux_cmd_t		*cmd;
+	redis_mux_reply_t	*r;
+	redisReply		*reply = NULL;
+	fr_redis_rcode_t	status;
+	fr_socket_addr_t	addr;
+
+	*out = NULL;
+
+	cmd = request_data_get(request, rmux, 0);
+	if (!cmd) {
+		REDEBUG("No command was sent");
+		return REDIS_RCODE_ERROR;
+	}
+
+	r = fr_mux_result(cmd->node->mux, request);
+	if (!r) {
+		REDEBUG("No reply from %s:%i", cmd->node->name, cmd->node->addr.port);
+		talloc_free(cmd);
+		return REDIS_RCODE_RECONNECT;
+	}
+	reply = r->reply;
+	r->reply = NULL;
+	talloc_free(r);
+
+	status = fr_redis_command_status(NULL, reply);
+	switch (status) {
+	case REDIS_RCODE_MOVE:
+	case REDIS_RCODE_ASK:
+		if (cmd->redirects++ >= rmux->conf->max_redirects) {
+			REDEBUG("Reached max_redirects (%u)", rmux->conf->max_redirects);
+			break;
+		}
+
+		if (fr_redis_cluster_node_addr_by_redirect(&addr, rmux->cluster, reply) < 0) {
+			REDEBUG("Failed following redirect: %s", fr_strerror());
+			break;
+		}
+		RDEBUG2("Following redirect \"%s\"", reply->str);
+
+		cmd->asking = (status == REDIS_RCODE_ASK);
+		goto resend;
+
+	case REDIS_RCODE_TRY_AGAIN:
+		if (cmd->retries++ >= rmux->conf->max_retries) {
+			REDEBUG("Reached max_retries (%u)", rmux->conf->max_retries);
+			break;
+		}
+		addr = cmd->node->addr;
+		cmd->asking = false;
+
+	resend:
+		cmd->node = redis_mux_node_find(rmux, &addr);
+		if (!cmd->node || (fr_mux_enqueue(cmd->node->mux, request, cmd) < 0)) {
+			REDEBUG("Failed re-sending command");
+			status = REDIS_RCODE_ERROR;
+			break;
+		}
+		fr_redis_reply_free(reply);
+		(void) request_data_add(request, rmux, 0, cmd, true, false, false);
+
+		return REDIS_RCODE_TRY_AGAIN;
+
+	default:
+		break;
+	}
+
+	talloc_free(cmd);
+	*out = reply;
+
+	return status;
+}
@@ -0,0 +1,47 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mux.h
+ * @brief Pipeline commands from many requests over per-thread Redis connections.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+#ifndef LIBFREERADIUS_REDIS_MUX_H
+#define	LIBFREERADIUS_REDIS_MUX_H
+
+RCSIDH(redis_mux_h, "$Id$")
+
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/connection_mux.h>
+#include "redis.h"
+#include "cluster.h"
+
+typedef struct fr_redis_mux fr_redis_mux_t;
+
+fr_redis_mux_t		*fr_redis_mux_alloc(TALLOC_CTX *ctx, CONF_SECTION *cs, fr_event_list_t *el, fr_mux_wake_t wake,
+					    fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf,
+					    char const *log_prefix);
+
+int			fr_redis_mux_enqueue(fr_redis_mux_t *rmux, REQUEST *request,
+					     uint8_t const *key, size_t key_len,
+					     int argc, char const **argv, size_t const *argv_len);
+
+fr_redis_rcode_t	fr_redis_mux_result(redisReply **out, fr_redis_mux_t *rmux, REQUEST *request);
+
+#endif /* LIBFREERADIUS_REDIS_MUX_H */
@@ -93,14 +93,69 @@ typedef struct rlm_redis_ippool {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	uint32_t		batch_size;	//!< Maximum number of accounting driven lease updates to
+						//!< write to a pool with one script invocation.  0 disables
+						//!< batching.
+	struct timeval		batch_interval;	//!< Maximum time an update waits for the rest of its batch.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+/** A lease update, waiting to be written as part of a batch
+ *
+ */
+typedef struct ippool_batch_entry {
+	REQUEST			*request;	//!< Waiting for the batch to be written, or NULL.
+
+	char			*ip_str;	//!< Address as provided by requested_address.
+	char			ip_arg[FR_IPADDR_PREFIX_STRLEN];	//!< Address as passed to the script.
+	uint8_t			*device_id;	//!< Device identifier.
+	size_t			device_id_len;
+	uint8_t			*gateway_id;	//!< Gateway identifier.
+	size_t			gateway_id_len;
+	uint32_t		expires;	//!< Lease time.
+
+	redisReply		*reply;		//!< Result for this lease, once the batch has been written.
+	bool			done;		//!< The batch containing this entry has been written.
+	struct ippool_batch_entry *next;	//!< Next entry in the batch.
+} ippool_batch_entry_t;
+
+/** Lease updates for a single pool
+ *
+ * All the keys of a pool are in the same key slot, so the updates can be
+ * written to one node, and applied by one script invocation.
+ */
+typedef struct {
+	uint8_t			*pool;		//!< Pool name.
+	size_t			pool_len;	//!< Length of the pool name.
+
+	ippool_batch_entry_t	*head;		//!< Oldest entry in the current batch.
+	ippool_batch_entry_t	**tail;		//!< Where the next entry should be linked.
+	uint32_t		num_entries;	//!< Number of entries in the current batch.
+} ippool_batch_t;
+
+/** Thread specific rlm_redis_ippool instance data
+ *
+ */
+typedef struct {
+	rlm_redis_ippool_t const *inst;		//!< Instance of rlm_redis_ippool.
+	fr_event_list_t		*el;		//!< This thread's event list.
+
+	rbtree_t		*batches;	//!< ippool_batch_t by pool name.
+	fr_event_timer_t	*ev;		//!< Writes all batches once batch_interval has passed.
+} rlm_redis_ippool_thread_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("size", PW_TYPE_INTEGER, rlm_redis_ippool_t, batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("interval", PW_TYPE_TIMEVAL, rlm_redis_ippool_t, batch_interval), .dflt = "0.1" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("pool_name", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_redis_ippool_t, pool_name) },
 
@@ -125,6 +180,8 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_POINTER("batch", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -267,6 +324,50 @@ static char lua_update_cmd[] =
 	"return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", found[1], found[4] }"EOL;	/* 24 */
 static char lua_update_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
+/** Lua script for updating many leases in the same pool
+ *
+ * Performs the same operations as #lua_update_cmd for each lease.
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ * - ARGV[n] Expires in (seconds).
+ * - ARGV[n + 1] IP address to update.
+ * - ARGV[n + 2] Device identifier.
+ * - ARGV[n + 3] Gateway identifier.
+ *
+ * Returns @verbatim array { { <rcode>[, <range>] }, ... } @endverbatim with one
+ * element per lease, in the order the leases were passed in.
+ */
+static char lua_update_batch_cmd[] =
+	"local ret = {}" EOL								/* 1 */
+	"local pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 2 */
+
+	"for i = 2, #ARGV, 4 do" EOL							/* 3 */
+	"  local expires = ARGV[i]" EOL							/* 4 */
+	"  local ip = ARGV[i + 1]" EOL							/* 5 */
+	"  local device = ARGV[i + 2]" EOL						/* 6 */
+	"  local address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip" EOL	/* 7 */
+	"  local found = redis.call('HMGET', address_key, 'range', 'device', 'gateway', 'counter' )" EOL	/* 8 */
+	"  if not found[1] then" EOL							/* 9 */
+	"    ret[#ret + 1] = {" STRINGIFY(_IPPOOL_RCODE_NOT_FOUND) "}" EOL		/* 10 */
+	"  elseif found[2] ~= device then" EOL						/* 11 */
+	"    ret[#ret + 1] = {" STRINGIFY(_IPPOOL_RCODE_DEVICE_MISMATCH) ", found[2]}" EOL	/* 12 */
+	"  else" EOL									/* 13 */
+	"    redis.call('ZADD', pool_key, 'XX', ARGV[1] + expires, ip)" EOL		/* 14 */
+	"    local device_key = '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. device" EOL	/* 15 */
+	"    if redis.call('EXPIRE', device_key, expires) == 0 then" EOL		/* 16 */
+	"      redis.call('SET', device_key, ip)" EOL					/* 17 */
+	"      redis.call('EXPIRE', device_key, expires)" EOL				/* 18 */
+	"    end" EOL									/* 19 */
+	"    if ARGV[i + 3] ~= found[3] then" EOL					/* 20 */
+	"      redis.call('HSET', address_key, 'gateway', ARGV[i + 3])" EOL		/* 21 */
+	"    end" EOL									/* 22 */
+	"    ret[#ret + 1] = { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", found[1], found[4] }" EOL	/* 23 */
+	"  end" EOL									/* 24 */
+	"end" EOL									/* 25 */
+	"return ret" EOL;								/* 26 */
+static char lua_update_batch_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
 /** Lua script for releasing leases
  *
  * - KEYS[1] The pool name.
@@ -402,7 +503,7 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
-/** Execute a script against Redis cluster
+/** Execute a formatted script command against Redis cluster
  *
  * Handles uploading the script to the server if required.
  *
@@ -418,15 +519,15 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
  * @param[in] wait_timeout How long to wait for slaves.
  * @param[in] digest of script.
  * @param[in] script to upload.
- * @param[in] cmd EVALSHA command to execute.
- * @param[in] ... Arguments for the eval command.
+ * @param[in] cmd EVALSHA command to execute, in the Redis protocol format.
+ * @param[in] cmd_len Length of the command.
  * @return status of the command.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, uint32_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static fr_redis_rcode_t ippool_script_formatted(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+						uint8_t const *key, size_t key_len,
+						uint32_t wait_num, uint32_t wait_timeout,
+						char const digest[], char const *script,
+						char const *cmd, size_t cmd_len)
 {
 	fr_redis_conn_t			*conn;
 	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
@@ -436,21 +537,13 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	fr_redis_rcode_t		s_ret, status;
 	unsigned int			pipelined = 0;
 
-	va_list				ap;
-
 	*out = NULL;
 
-	va_start(ap, cmd);
-
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
 	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendFormattedCommand(conn->handle, cmd, cmd_len);
 		pipelined = 1;
 		if (wait_num) {
 			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, wait_timeout);
@@ -469,9 +562,7 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	     	RDEBUG3("Loading script 0x%s", digest);
 		redisAppendCommand(conn->handle, "MULTI");
 		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendFormattedCommand(conn->handle, cmd, cmd_len);
 		redisAppendCommand(conn->handle, "EXEC");
 		pipelined = 4;
 		if (wait_num) {
@@ -543,10 +634,55 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	}
 
 finish:
-	va_end(ap);
 	return s_ret;
 }
 
+/** Execute a script against Redis cluster
+ *
+ * The command is formatted once, and re-sent as is if we're redirected.
+ *
+ * @param[out] out Where to write Redis reply object resulting from the command.
+ * @param[in] request The current request.
+ * @param[in] cluster configuration.
+ * @param[in] key to use to determine the cluster node.
+ * @param[in] key_len length of the key.
+ * @param[in] wait_num If > 0 wait until this many slaves have replicated the data
+ *	from the last command.
+ * @param[in] wait_timeout How long to wait for slaves.
+ * @param[in] digest of script.
+ * @param[in] script to upload.
+ * @param[in] cmd EVALSHA command to execute.
+ * @param[in] ... Arguments for the eval command.
+ * @return status of the command.
+ */
+static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+				      uint8_t const *key, size_t key_len,
+				      uint32_t wait_num, uint32_t wait_timeout,
+				      char const digest[], char const *script,
+				      char const *cmd, ...)
+{
+	fr_redis_rcode_t	status;
+	char			*formatted;
+	int			len;
+	va_list			ap;
+
+	*out = NULL;
+
+	va_start(ap, cmd);
+	len = redisvFormatCommand(&formatted, cmd, ap);
+	va_end(ap);
+	if (len < 0) {
+		REDEBUG("Failed formatting script command");
+		return REDIS_RCODE_ERROR;
+	}
+
+	status = ippool_script_formatted(out, request, cluster, key, key_len, wait_num, wait_timeout,
+					 digest, script, formatted, (size_t)len);
+	free(formatted);
+
+	return status;
+}
+
 /** Allocate a new IP address from a pool
  *
  */
@@ -758,77 +894,33 @@ finish:
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Process the result of a lease update
+ *
+ * Writes the range and expiry attributes to the request.
  *
+ * @param[in] inst	of rlm_redis_ippool.
+ * @param[in] request	The current request.
+ * @param[in] reply	to #lua_update_cmd, or one element of the reply to #lua_update_batch_cmd.
+ * @param[in] expires	Lease time.
+ * @return the rcode returned by the script, or IPPOOL_RCODE_FAIL.
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUEST *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *device_id, size_t device_id_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
-					  uint32_t expires)
+static ippool_rcode_t ippool_update_reply(rlm_redis_ippool_t const *inst, REQUEST *request,
+					  redisReply *reply, uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+	ippool_rcode_t		ret;
 
 	vp_tmpl_t		range_rhs = { .name = "", .type = TMPL_TYPE_DATA, .tmpl_value_box_type = PW_TYPE_STRING, .quote = T_DOUBLE_QUOTED_STRING };
 	vp_map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
 
-	gettimeofday(&now, NULL);
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!device_id) device_id = (uint8_t const *)"";
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->ipaddr.ip4addr.s_addr),
-				       device_id, device_id_len,
-				       gateway_id, gateway_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       device_id, device_id_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -837,11 +929,10 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process Range identifier
@@ -856,8 +947,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 			range_map.rhs->tmpl_value_box_length = reply->element[1]->len;
 			range_map.rhs->tmpl_value_box_type = PW_TYPE_STRING;
 			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
+				return IPPOOL_RCODE_FAIL;
 			}
 			break;
 
@@ -867,8 +957,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[1])",
 				fr_int2str(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -892,11 +981,72 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 		expiry_map.rhs->tmpl_value_box_length = sizeof(expiry_map.rhs->tmpl_value_box_datum.integer);
 		expiry_map.rhs->tmpl_value_box_type = PW_TYPE_INTEGER;
 		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
+	return ret;
+}
+
+/** Update an existing IP address in a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUEST *request,
+					  uint8_t const *key_prefix, size_t key_prefix_len,
+					  fr_ipaddr_t *ip,
+					  uint8_t const *device_id, size_t device_id_len,
+					  uint8_t const *gateway_id, size_t gateway_id_len,
+					  uint32_t expires)
+{
+	struct			timeval now;
+	redisReply		*reply = NULL;
+
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	gettimeofday(&now, NULL);
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!device_id) device_id = (uint8_t const *)"";
+	if (!gateway_id) gateway_id = (uint8_t const *)"";
+
+	if ((ip->af == AF_INET) && inst->ipv4_integer) {
+		status = ippool_script(&reply, request, inst->cluster,
+				       key_prefix, key_prefix_len,
+				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
+				       lua_update_digest, lua_update_cmd,
+				       "EVALSHA %s 1 %b %u %u %u %b %b",
+				       lua_update_digest,
+				       key_prefix, key_prefix_len,
+				       (unsigned int)now.tv_sec, expires,
+				       htonl(ip->ipaddr.ip4addr.s_addr),
+				       device_id, device_id_len,
+				       gateway_id, gateway_id_len);
+	} else {
+		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
+
+		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
+		status = ippool_script(&reply, request, inst->cluster,
+				       key_prefix, key_prefix_len,
+				       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
+				       lua_update_digest, lua_update_cmd,
+				       "EVALSHA %s 1 %b %u %u %s %b %b",
+				       lua_update_digest,
+				       key_prefix, key_prefix_len,
+				       (unsigned int)now.tv_sec, expires,
+				       ip_buff,
+				       device_id, device_id_len,
+				       gateway_id, gateway_id_len);
+	}
+	if (status != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	ret = ippool_update_reply(inst, request, reply, expires);
+
 finish:
 	fr_redis_reply_free(reply);
 
@@ -1025,7 +1175,345 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action)
+/** Convert the result of a lease update to a module rcode
+ *
+ * @param[in] inst	of rlm_redis_ippool.
+ * @param[in] request	The current request.
+ * @param[in] ret	Result of the update.
+ * @param[in] ip_str	Address which was updated.
+ * @return an rlm_rcode_t.
+ */
+static rlm_rcode_t ippool_update_rcode(rlm_redis_ippool_t const *inst, REQUEST *request,
+				       ippool_rcode_t ret, char const *ip_str)
+{
+	switch (ret) {
+	case IPPOOL_RCODE_SUCCESS:
+		RDEBUG2("IP address lease updated");
+
+		/*
+		 *	Copy over the input IP address to the reply attribute
+		 */
+		if (inst->copy_on_update) {
+			vp_tmpl_t ip_rhs = {
+				.name = "",
+				.type = TMPL_TYPE_DATA,
+				.quote = T_BARE_WORD,
+			};
+			vp_map_t ip_map = {
+				.lhs = inst->allocated_address_attr,
+				.op = T_OP_SET,
+				.rhs = &ip_rhs
+			};
+
+			ip_rhs.tmpl_value_box_length = strlen(ip_str);
+			ip_rhs.tmpl_value_box_datum.strvalue = ip_str;
+			ip_rhs.tmpl_value_box_type = PW_TYPE_STRING;
+
+			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
+		}
+		return RLM_MODULE_UPDATED;
+
+	/*
+	 *	It's useful to be able to identify the 'not found' case
+	 *	as we can relay to a server where the IP address might
+	 *	be found.  This extremely useful for migrations.
+	 */
+	case IPPOOL_RCODE_NOT_FOUND:
+		REDEBUG("IP address is not a member of the specified pool");
+		return RLM_MODULE_NOTFOUND;
+
+	case IPPOOL_RCODE_EXPIRED:
+		REDEBUG("IP address lease already expired at time of renewal");
+		return RLM_MODULE_INVALID;
+
+	case IPPOOL_RCODE_DEVICE_MISMATCH:
+		REDEBUG("IP address lease allocated to another device");
+		return RLM_MODULE_INVALID;
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
+static int ippool_batch_cmp(void const *one, void const *two)
+{
+	ippool_batch_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->pool, b->pool, a->pool_len < b->pool_len ? a->pool_len : b->pool_len);
+	if (ret != 0) return ret;
+
+	return (a->pool_len > b->pool_len) - (a->pool_len < b->pool_len);
+}
+
+static int _ippool_batch_entry_free(ippool_batch_entry_t *entry)
+{
+	fr_redis_reply_free(entry->reply);
+
+	return 0;
+}
+
+/** Write all the lease updates queued for a pool with one script invocation
+ *
+ * Requests waiting for the batch are marked resumable, and
+ * collect their results from the entry.
+ *
+ * @param[in] t		Thread specific instance data.
+ * @param[in] batch	to write.
+ * @param[in] current	Entry belonging to the caller, which shouldn't be resumed or freed.
+ */
+static void ippool_batch_flush(rlm_redis_ippool_thread_t *t, ippool_batch_t *batch, ippool_batch_entry_t *current)
+{
+	rlm_redis_ippool_t const	*inst = t->inst;
+	ippool_batch_entry_t		*head, *entry, *next;
+	REQUEST				*request = NULL, *fake = NULL;
+	redisReply			*reply = NULL;
+	fr_redis_rcode_t		status;
+
+	struct timeval			now;
+	char				now_str[21];
+	char const			**argv;
+	size_t				*argv_len;
+	char				*cmd;
+	int				argc, len, i;
+	uint32_t			count;
+
+	head = batch->head;
+	count = batch->num_entries;
+	batch->head = NULL;
+	batch->tail = &batch->head;
+	batch->num_entries = 0;
+
+	if (!head) return;
+
+	/*
+	 *	Log against one of the requests waiting for
+	 *	the batch.  If they've all gone away, the
+	 *	leases still need updating.
+	 */
+	for (entry = head; entry; entry = entry->next) {
+		if (entry->request) {
+			request = entry->request;
+			break;
+		}
+	}
+	if (!request) MEM(request = fake = request_alloc(NULL));
+
+	argc = 5 + (4 * count);
+	MEM(argv = talloc_array(NULL, char const *, argc));
+	MEM(argv_len = talloc_array(argv, size_t, argc));
+
+	gettimeofday(&now, NULL);
+	snprintf(now_str, sizeof(now_str), "%u", (unsigned int)now.tv_sec);
+
+#define SET_ARGV(_i, _str, _len) do { argv[_i] = (char const *)(_str); argv_len[_i] = (_len); } while (0)
+	SET_ARGV(0, "EVALSHA", sizeof("EVALSHA") - 1);
+	SET_ARGV(1, lua_update_batch_digest, strlen(lua_update_batch_digest));
+	SET_ARGV(2, "1", 1);
+	SET_ARGV(3, batch->pool, batch->pool_len);
+	SET_ARGV(4, now_str, strlen(now_str));
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	for (i = 5, entry = head; entry; i += 4, entry = entry->next) {
+		char *expires_str;
+
+		MEM(expires_str = talloc_asprintf(argv, "%u", entry->expires));
+		SET_ARGV(i, expires_str, talloc_array_length(expires_str) - 1);
+		SET_ARGV(i + 1, entry->ip_arg, strlen(entry->ip_arg));
+		SET_ARGV(i + 2, entry->device_id ? (char const *)entry->device_id : "", entry->device_id_len);
+		SET_ARGV(i + 3, entry->gateway_id ? (char const *)entry->gateway_id : "", entry->gateway_id_len);
+	}
+#undef SET_ARGV
+
+	len = redisFormatCommandArgv(&cmd, argc, argv, argv_len);
+	if (len < 0) {
+		REDEBUG("Failed formatting batched lease update");
+		goto done;
+	}
+
+	RDEBUG2("Writing batch of %u lease update(s) to pool \"%.*s\"", count, (int)batch->pool_len, batch->pool);
+
+	status = ippool_script_formatted(&reply, request, inst->cluster,
+					 batch->pool, batch->pool_len,
+					 inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
+					 lua_update_batch_digest, lua_update_batch_cmd,
+					 cmd, (size_t)len);
+	free(cmd);
+	if (status != REDIS_RCODE_SUCCESS) goto done;
+
+	if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements != count)) {
+		REDEBUG("Expected result to be array of %u elements, got \"%s\" (%zu elements)", count,
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"),
+			reply->type == REDIS_REPLY_ARRAY ? reply->elements : 0);
+		goto done;
+	}
+
+	for (i = 0, entry = head; entry; i++, entry = entry->next) {
+		entry->reply = reply->element[i];
+		reply->element[i] = NULL;		/* Prevent double free */
+	}
+
+done:
+	fr_redis_reply_free(reply);			/* This works because hiredis checks for NULL elements */
+	talloc_free(argv);
+	talloc_free(fake);
+
+	for (entry = head; entry; entry = next) {
+		next = entry->next;
+		entry->next = NULL;
+		entry->done = true;
+
+		if (entry == current) continue;
+
+		if (entry->request) {
+			unlang_resumable(entry->request);
+			continue;
+		}
+
+		if (!entry->reply) ERROR("Failed writing batched lease update for %s", entry->ip_str);
+		talloc_free(entry);
+	}
+}
+
+static int _ippool_batch_flush_walk(void *ctx, void *data)
+{
+	ippool_batch_flush(ctx, data, NULL);
+
+	return 0;
+}
+
+static void ippool_batch_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	rlm_redis_ippool_thread_t *t = ctx;
+
+	rbtree_walk(t->batches, RBTREE_IN_ORDER, _ippool_batch_flush_walk, t);
+}
+
+static rlm_rcode_t ippool_batch_result(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_batch_entry_t *entry)
+{
+	if (!entry->reply) return RLM_MODULE_FAIL;
+
+	return ippool_update_rcode(inst, request,
+				   ippool_update_reply(inst, request, entry->reply, entry->expires), entry->ip_str);
+}
+
+static rlm_rcode_t ippool_batch_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_redis_ippool_t const	*inst = instance;
+	ippool_batch_entry_t		*entry = talloc_get_type_abort(ctx, ippool_batch_entry_t);
+	rlm_rcode_t			rcode;
+
+	rcode = ippool_batch_result(inst, request, entry);
+	talloc_free(entry);
+
+	return rcode;
+}
+
+/** Stop waiting for the batch if the request is cancelled
+ *
+ * The lease is still updated when the batch is written.
+ */
+static void ippool_batch_action(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				fr_state_action_t action)
+{
+	ippool_batch_entry_t *entry = talloc_get_type_abort(ctx, ippool_batch_entry_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (entry->done) {
+		talloc_free(entry);
+		return;
+	}
+	entry->request = NULL;
+}
+
+/** Add a lease update to the batch for its pool
+ *
+ * The batch is written once batch_size updates have been queued, or batch_interval
+ * has passed.  The request yields until then.
+ */
+static rlm_rcode_t ippool_batch_enqueue(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+					REQUEST *request, uint8_t const *key_prefix, size_t key_prefix_len,
+					fr_ipaddr_t *ip, char const *ip_str,
+					uint8_t const *device_id, size_t device_id_len,
+					uint8_t const *gateway_id, size_t gateway_id_len,
+					uint32_t expires)
+{
+	ippool_batch_t		*batch, find;
+	ippool_batch_entry_t	*entry;
+	rlm_rcode_t		rcode;
+	struct timeval		now, when;
+
+	memcpy(&find.pool, &key_prefix, sizeof(find.pool));
+	find.pool_len = key_prefix_len;
+
+	batch = rbtree_finddata(t->batches, &find);
+	if (!batch) {
+		MEM(batch = talloc_zero(t->batches, ippool_batch_t));
+		MEM(batch->pool = talloc_memdup(batch, key_prefix, key_prefix_len));
+		batch->pool_len = key_prefix_len;
+		batch->tail = &batch->head;
+
+		if (!rbtree_insert(t->batches, batch)) {
+			talloc_free(batch);
+			return RLM_MODULE_FAIL;
+		}
+	}
+
+	/*
+	 *	Copy everything the update needs, as the
+	 *	request may be gone by the time the batch
+	 *	is written.
+	 */
+	MEM(entry = talloc_zero(NULL, ippool_batch_entry_t));
+	talloc_set_destructor(entry, _ippool_batch_entry_free);
+
+	entry->request = request;
+	MEM(entry->ip_str = talloc_typed_strdup(entry, ip_str));
+	if ((ip->af == AF_INET) && inst->ipv4_integer) {
+		snprintf(entry->ip_arg, sizeof(entry->ip_arg), "%u", htonl(ip->ipaddr.ip4addr.s_addr));
+	} else {
+		IPPOOL_SPRINT_IP(entry->ip_arg, ip, ip->prefix);
+	}
+	if (device_id) MEM(entry->device_id = talloc_memdup(entry, device_id, device_id_len));
+	entry->device_id_len = device_id_len;
+	if (gateway_id) MEM(entry->gateway_id = talloc_memdup(entry, gateway_id, gateway_id_len));
+	entry->gateway_id_len = gateway_id_len;
+	entry->expires = expires;
+
+	*batch->tail = entry;
+	batch->tail = &entry->next;
+	batch->num_entries++;
+
+	RDEBUG2("Queued lease update for batch write, %u update(s) queued", batch->num_entries);
+
+	if (batch->num_entries < inst->batch_size) {
+		if (!t->ev) {
+			gettimeofday(&now, NULL);
+			fr_timeval_add(&when, &now, &inst->batch_interval);
+
+			if (fr_event_timer_insert(t->el, ippool_batch_timeout, t, &when, &t->ev) < 0) {
+				RWDEBUG("Failed inserting batch timer, writing batch now");
+				goto flush;
+			}
+		}
+
+		return unlang_yield(request, ippool_batch_resume, ippool_batch_action, entry);
+	}
+
+flush:
+	ippool_batch_flush(t, batch, entry);
+
+	rcode = ippool_batch_result(inst, request, entry);
+	talloc_free(entry);
+
+	return rcode;
+}
+
+static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+			      REQUEST *request, ippool_action_t action)
 {
 	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
 	uint8_t const	*key_prefix, *device_id = NULL, *gateway_id = NULL;
@@ -1125,55 +1613,15 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, device_id, device_id_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address lease updated");
-
-			/*
-			 *	Copy over the input IP address to the reply attribute
-			 */
-			if (inst->copy_on_update) {
-				vp_tmpl_t ip_rhs = {
-					.name = "",
-					.type = TMPL_TYPE_DATA,
-					.quote = T_BARE_WORD,
-				};
-				vp_map_t ip_map = {
-					.lhs = inst->allocated_address_attr,
-					.op = T_OP_SET,
-					.rhs = &ip_rhs
-				};
-
-				ip_rhs.tmpl_value_box_length = strlen(ip_str);
-				ip_rhs.tmpl_value_box_datum.strvalue = ip_str;
-				ip_rhs.tmpl_value_box_type = PW_TYPE_STRING;
-
-				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
-			}
-			return RLM_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("IP address is not a member of the specified pool");
-			return RLM_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_EXPIRED:
-			REDEBUG("IP address lease already expired at time of renewal");
-			return RLM_MODULE_INVALID;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("IP address lease allocated to another device");
-			return RLM_MODULE_INVALID;
-
-		default:
-			return RLM_MODULE_FAIL;
-		}
+		if (t) return ippool_batch_enqueue(inst, t, request, key_prefix, key_prefix_len, &ip, ip_str,
+						   device_id, device_id_len, gateway_id, gateway_id_len,
+						   (uint32_t)expires);
+
+		return ippool_update_rcode(inst, request,
+					   redis_ippool_update(inst, request, key_prefix, key_prefix_len,
+							       &ip, device_id, device_id_len,
+							       gateway_id, gateway_id_len, (uint32_t)expires),
+					   ip_str);
 	}
 
 	case POOL_ACTION_RELEASE:
@@ -1227,17 +1675,18 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 	}
 }
 
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
+	rlm_redis_ippool_thread_t	*t = thread;
 	VALUE_PAIR			*vp;
 
 	/*
 	 *	Pool-Action override
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, PW_POOL_ACTION, TAG_ANY);
-	if (vp) return mod_action(inst, request, vp->vp_integer);
+	if (vp) return mod_action(inst, NULL, request, vp->vp_integer);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1249,16 +1698,20 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	}
 
 	switch (vp->vp_integer) {
+	/*
+	 *	Lease extensions driven by accounting may be
+	 *	batched with others for the same pool.
+	 */
 	case PW_STATUS_START:
 	case PW_STATUS_ALIVE:
-		return mod_action(inst, request, POOL_ACTION_UPDATE);
+		return mod_action(inst, inst->batch_size ? t : NULL, request, POOL_ACTION_UPDATE);
 
 	case PW_STATUS_STOP:
-		return mod_action(inst, request, POOL_ACTION_RELEASE);
+		return mod_action(inst, NULL, request, POOL_ACTION_RELEASE);
 
 	case PW_STATUS_ACCOUNTING_OFF:
 	case PW_STATUS_ACCOUNTING_ON:
-		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(inst, NULL, request, POOL_ACTION_BULK_RELEASE);
 
 	default:
 		return RLM_MODULE_NOOP;
@@ -1276,7 +1729,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, PW_POOL_ACTION, TAG_ANY);
-	return mod_action(inst, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
+	return mod_action(inst, NULL, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
 }
 
 static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
@@ -1290,7 +1743,7 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, PW_POOL_ACTION, TAG_ANY);
-	return mod_action(inst, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
+	return mod_action(inst, NULL, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
 }
 
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
@@ -1328,6 +1781,11 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		fr_sha1_final(digest, &sha1_ctx);
 		fr_bin2hex(lua_update_digest, digest, sizeof(digest));
 
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_update_batch_cmd, sizeof(lua_update_batch_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_update_batch_digest, digest, sizeof(digest));
+
 		fr_sha1_init(&sha1_ctx);
 		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_release_cmd, sizeof(lua_release_cmd) - 1);
 		fr_sha1_final(digest, &sha1_ctx);
@@ -1340,6 +1798,36 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (!inst->offer_time) inst->offer_time = inst->lease_time;
 
+	if (inst->batch_size && !timerisset(&inst->batch_interval)) {
+		cf_log_err_cs(conf, "batch.interval must be greater than zero if batch.size is set");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_thread_t *t = thread;
+
+	t->inst = instance;
+	t->el = el;
+
+	MEM(t->batches = rbtree_create(t, ippool_batch_cmp, NULL, RBTREE_FLAG_NONE));
+
+	return 0;
+}
+
+/** Write any batched lease updates before the thread exits
+ *
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_redis_ippool_thread_t *t = thread;
+
+	if (t->ev) fr_event_timer_delete(t->el, &t->ev);
+	rbtree_walk(t->batches, RBTREE_IN_ORDER, _ippool_batch_flush_walk, t);
+
 	return 0;
 }
 
@@ -1359,6 +1847,9 @@ rad_module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.load		= mod_load,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
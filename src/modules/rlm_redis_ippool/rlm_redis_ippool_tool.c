@@ -27,12 +27,15 @@
 RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/rad_assert.h>
+#include <pthread.h>
 
 #include "redis.h"
 #include "cluster.h"
 #include "redis_ippool.h"
 
 #define MAX_PIPELINED 100000
+#define MAX_WORKERS 64
+#define SCAN_COUNT 1000
 
 /** Pool management actions
  *
@@ -43,6 +46,7 @@ typedef enum ippool_tool_action {
 	IPPOOL_TOOL_REMOVE,			//!< Remove one or more IP addresses.
 	IPPOOL_TOOL_RELEASE,			//!< Release one or more IP addresses.
 	IPPOOL_TOOL_SHOW,			//!< Show one or more IP addresses.
+	IPPOOL_TOOL_SHOW_ALL,			//!< Show all IP addresses in the pool.
 	IPPOOL_TOOL_MODIFY			//!< Modify attributes of one or more IP addresses.
 } ippool_tool_action_t;
 
@@ -98,8 +102,22 @@ typedef struct redis_driver_conf {
 typedef struct ippool_tool {
 	void			*driver;
 	CONF_SECTION		*cs;
+
+	ippool_tool_operation_t	*ops;		//!< Operations to perform, in the order they were specified.
+	size_t			num_ops;
 } ippool_tool_t;
 
+/** Performs all the operations on pools held by one or more Redis nodes
+ *
+ */
+typedef struct ippool_tool_worker {
+	ippool_tool_t		*conf;
+	fr_socket_addr_t	*nodes;		//!< Nodes this worker is responsible for.
+	ippool_tool_operation_t	**ops;		//!< Operations to perform, in order.
+	int			ret;		//!< -1 if any operation failed.
+	pthread_t		thread;
+} ippool_tool_worker_t;
+
 typedef int (*redis_ippool_queue_t)(redis_driver_conf_t *inst, fr_redis_conn_t *conn,
 				    uint8_t const *key_prefix, size_t key_prefix_len,
 				    uint8_t const *range, size_t range_len,
@@ -125,6 +143,9 @@ do { \
 #define EOL "\n"
 
 static char const *name;
+static bool progress;				//!< Print progress after each pipelined batch.
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Stops lease output from
+									//!< workers interleaving.
 /** Lua script for releasing a lease
  *
  * - KEYS[1] The pool name.
@@ -197,7 +218,8 @@ static char lua_remove_cmd[] =
 	"return 1" EOL;									/* 12 */
 
 static void NEVER_RETURNS usage(int ret) {
-	INFO("Usage: %s -adrsm range... [-p prefix_len]... [-x]... [-oShf] server[:port] [pool] [range id]", name);
+	INFO("Usage: %s -adrsm range... [-p prefix_len]... [-b file]... [-j workers] [-x]... [-oAShfP] "
+	     "server[:port] [pool] [range id]", name);
 	INFO("Pool management:");
 	INFO("  -a range               Add address(es)/prefix(es) to the pool.");
 	INFO("  -d range               Delete address(es)/prefix(es) in this range.");
@@ -211,6 +233,10 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("                         instance of an -adrsm argument, only.");
 	INFO("  -m range               Change the range id to the one specified for addresses");
 	INFO("                         in this range.");
+	INFO("  -A                     Show all addresses/prefixes in the pool.");
+	INFO("  -b file                Add the ranges listed in file.  Each line is a range,");
+	INFO("                         optionally followed by a pool and range id.  A -p");
+	INFO("                         argument which follows applies to every range in the file.");
 	INFO("  -l                     List available pools.");
 //	INFO("  -L                     List available ranges in pool [NYI]");
 //	INFO("  -i file                Import entries from ISC lease file [NYI]");
@@ -222,6 +248,9 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("Configuration:");
 	INFO("  -h                     Print this help message and exit");
 	INFO("  -x                     Increase the verbosity level");
+	INFO("  -j workers             Number of threads used to operate on pools held by");
+	INFO("                         different Redis nodes in parallel (defaults to 1)");
+	INFO("  -P                     Print progress after each batch of pipelined commands");
 //	INFO("  -o attr=value          Set option, these are specific to the backends [NYI]");
 	INFO("  -f file                Load connection options from a FreeRADIUS (radisud) format config file");
 	INFO(" ");
@@ -458,13 +487,22 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 
 	fr_ipaddr_t			ipaddr = op->start, acked;
 	int				s_ret = REDIS_RCODE_SUCCESS;
-	REQUEST				*request = request_alloc(inst);
+	REQUEST				*request;
 	redisReply			**replies = NULL;
 
 	unsigned int			pipelined = 0;
+	uint64_t			processed = 0;
+
+	/*
+	 *	Not parented by inst, as this may be called
+	 *	from multiple workers at the same time.
+	 */
+	request = request_alloc(NULL);
+	if (!request) return -1;
 
 	while (more) {
 		size_t	reply_cnt = 0;
+		int	batch = 0;
 
 		/* Record our progress */
 		acked = ipaddr;
@@ -488,9 +526,13 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 				if (enqueued < 0) break;
 				pipelined += enqueued;
 			}
+			batch = i;
 
-			if (!replies) replies = talloc_zero_array(inst, redisReply *, pipelined);
-			if (!replies) return 0;
+			if (!replies) replies = talloc_zero_array(NULL, redisReply *, pipelined);
+			if (!replies) {
+				talloc_free(request);
+				return -1;
+			}
 
 			reply_cnt = fr_redis_pipeline_result(&pipelined, &status, replies,
 							     talloc_array_length(replies), conn);
@@ -517,22 +559,81 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 		}
 		fr_redis_pipeline_free(replies, reply_cnt);
 		TALLOC_FREE(replies);
+
+		processed += batch;
+		if (progress) {
+			char ip_buff[FR_IPADDR_PREFIX_STRLEN];
+
+			IPPOOL_SPRINT_IP(ip_buff, &ipaddr, op->prefix);
+			INFO("%s: %" PRIu64 " address(es)/prefix(es) processed, next %s", op->name, processed,
+			     more ? ip_buff : "none");
+		}
 	}
 	talloc_free(request);
 
 	return 0;
 }
 
-/** Enqueue commands to retrieve lease information
+/** Print information about a lease
  *
+ * Leases are printed as they're retrieved, so showing a large range
+ * doesn't require all of the leases to be held in memory.
  */
-static int _driver_show_lease_process(void *out, fr_ipaddr_t const *ipaddr, redisReply const *reply)
+static void lease_print(ippool_tool_lease_t const *lease)
 {
-	size_t existing;
-	ippool_tool_lease_t ***modified = out;
-	ippool_tool_lease_t *lease;
+	char		ip_buff[FR_IPADDR_PREFIX_STRLEN];
+	char		time_buff[30];
+	struct		tm tm;
+	struct		timeval now;
+	fr_ipaddr_t	ipaddr = lease->ipaddr;
+	char		*device = NULL;
+	char		*gateway = NULL;
+	char		*range = NULL;
+	bool		is_active;
+
+	gettimeofday(&now, NULL);
+	is_active = now.tv_sec <= lease->next_event;
+	if (lease->next_event) {
+		strftime(time_buff, sizeof(time_buff), "%b %e %Y %H:%M:%S %Z",
+			 localtime_r(&(lease->next_event), &tm));
+	} else {
+		time_buff[0] = '\0';
+	}
+	IPPOOL_SPRINT_IP(ip_buff, &ipaddr, ipaddr.prefix);
+
+	if (lease->range) range = fr_asprint(NULL, (char const *)lease->range, lease->range_len, '\0');
+	if (lease->device) device = fr_asprint(NULL, (char const *)lease->device, lease->device_len, '\0');
+	if (lease->gateway) gateway = fr_asprint(NULL, (char const *)lease->gateway, lease->gateway_len, '\0');
+
+	pthread_mutex_lock(&output_mutex);
+	INFO("--");
+	if (range) INFO("range           : %s", range);
+	INFO("address/prefix  : %s", ip_buff);
+	INFO("active          : %s", is_active ? "yes" : "no");
+
+	if (is_active) {
+		if (*time_buff) INFO("lease expires   : %s", time_buff);
+		if (device) INFO("device id       : %s", device);
+		if (gateway) INFO("gateway id      : %s", gateway);
+	} else {
+		if (*time_buff) INFO("lease expired   : %s", time_buff);
+		if (device) INFO("last device id  : %s", device);
+		if (gateway) INFO("last gateway id : %s", gateway);
+	}
+	pthread_mutex_unlock(&output_mutex);
 
-	if (!*modified) *modified = talloc_array(NULL, ippool_tool_lease_t *, 1);
+	talloc_free(range);
+	talloc_free(device);
+	talloc_free(gateway);
+}
+
+/** Print lease information as it's retrieved
+ *
+ */
+static int _driver_show_lease_process(void *out, fr_ipaddr_t const *ipaddr, redisReply const *reply)
+{
+	uint64_t		*shown = out;
+	ippool_tool_lease_t	lease;
 
 	/*
 	 *	The exec command is the only one that produces an array.
@@ -542,29 +643,30 @@ static int _driver_show_lease_process(void *out, fr_ipaddr_t const *ipaddr, redi
 
 	if (reply->element[0]->type == REDIS_REPLY_NIL) return 0;	/* A nil result (IP didn't exist) */
 	if (reply->element[0]->type != REDIS_REPLY_STRING) return -1;	/* Something bad */
-	lease = talloc_zero(*modified, ippool_tool_lease_t);
-	lease->ipaddr = *ipaddr;
-	lease->next_event = (time_t)strtoull(reply->element[0]->str, NULL, 10);
+
+	/*
+	 *	The lease only points into the reply, as
+	 *	it's printed immediately.
+	 */
+	memset(&lease, 0, sizeof(lease));
+	lease.ipaddr = *ipaddr;
+	lease.next_event = (time_t)strtoull(reply->element[0]->str, NULL, 10);
 
 	if (reply->element[1]->type == REDIS_REPLY_STRING) {
-		lease->device = talloc_memdup(lease, reply->element[1]->str, reply->element[1]->len);
-		lease->device_len = reply->element[1]->len;
+		lease.device = (uint8_t const *)reply->element[1]->str;
+		lease.device_len = reply->element[1]->len;
 	}
 	if (reply->element[2]->type == REDIS_REPLY_STRING) {
-		lease->gateway = talloc_memdup(lease, reply->element[2]->str, reply->element[2]->len);
-		lease->gateway_len = reply->element[2]->len;
+		lease.gateway = (uint8_t const *)reply->element[2]->str;
+		lease.gateway_len = reply->element[2]->len;
 	}
 	if (reply->element[3]->type == REDIS_REPLY_STRING) {
-		lease->range = talloc_memdup(lease, reply->element[3]->str, reply->element[3]->len);
-		lease->range_len = reply->element[3]->len;
+		lease.range = (uint8_t const *)reply->element[3]->str;
+		lease.range_len = reply->element[3]->len;
 	}
 
-	/*
-	 *	Grow the result array...
-	 */
-	existing = talloc_array_length(*modified);
-	MEM(*modified = talloc_realloc(NULL, *modified, ippool_tool_lease_t *, existing + 1));
-	(*modified)[existing - 1] = lease;
+	lease_print(&lease);
+	(*shown)++;
 
 	return 0;
 }
@@ -606,6 +708,152 @@ static inline int driver_show_lease(void *out, void *instance, ippool_tool_opera
 	return driver_do_lease(out, instance, op, _driver_show_lease_enqueue, _driver_show_lease_process);
 }
 
+/** Show every lease in a pool
+ *
+ * Iterates over the pool's expiry heap with ZSCAN, so the range of the
+ * pool doesn't need to be known, and only SCAN_COUNT leases are held in
+ * memory at a time.  The address data for each page is retrieved with
+ * a single pipeline.
+ *
+ * @note ZSCAN may return the same lease more than once, if the pool
+ *	is modified whilst we're iterating over it.
+ */
+static int driver_show_pool(void *out, void *instance, ippool_tool_operation_t const *op)
+{
+	redis_driver_conf_t		*inst = talloc_get_type_abort(instance, redis_driver_conf_t);
+	uint64_t			*shown = out;
+
+	uint8_t				key[IPPOOL_MAX_POOL_KEY_SIZE];
+	uint8_t				*key_p = key;
+	char				cursor[21] = "0";
+
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	int				s_ret = REDIS_RCODE_SUCCESS;
+
+	REQUEST				*request;
+	redisReply			*reply = NULL, *members;
+	redisReply			**replies = NULL;
+	size_t				reply_cnt = 0, i;
+	unsigned int			pipelined = 0;
+
+	IPPOOL_BUILD_KEY(key, key_p, op->pool, op->pool_len);
+
+	request = request_alloc(NULL);
+	if (!request) return -1;
+
+	do {
+		for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request,
+							 op->pool, op->pool_len, true);
+		     s_ret == REDIS_RCODE_TRY_AGAIN;
+		     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+			reply = redisCommand(conn->handle, "ZSCAN %b %s COUNT %i", key, key_p - key,
+					     cursor, SCAN_COUNT);
+			status = fr_redis_command_status(conn, reply);
+		}
+		if (s_ret != REDIS_RCODE_SUCCESS) {
+			ERROR("Failed scanning pool: %s", fr_strerror());
+		error:
+			fr_redis_reply_free(reply);
+			fr_redis_pipeline_free(replies, reply_cnt);
+			talloc_free(replies);
+			talloc_free(request);
+			return -1;
+		}
+
+		if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements != 2) ||
+		    (reply->element[0]->type != REDIS_REPLY_STRING) ||
+		    (reply->element[1]->type != REDIS_REPLY_ARRAY) || (reply->element[1]->elements % 2)) {
+			ERROR("Failed scanning pool: Unexpected reply to ZSCAN");
+			goto error;
+		}
+		strlcpy(cursor, reply->element[0]->str, sizeof(cursor));
+		members = reply->element[1];
+
+		if (members->elements == 0) goto next;
+
+		/*
+		 *	Members and scores are interleaved
+		 */
+		MEM(replies = talloc_zero_array(NULL, redisReply *, members->elements / 2));
+
+		for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request,
+							 op->pool, op->pool_len, true);
+		     s_ret == REDIS_RCODE_TRY_AGAIN;
+		     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &replies[0])) {
+			status = REDIS_RCODE_SUCCESS;
+
+			for (i = 0; i < members->elements; i += 2) {
+				uint8_t		ip_key[IPPOOL_MAX_IP_KEY_SIZE];
+				uint8_t		*ip_key_p = ip_key;
+
+				IPPOOL_BUILD_IP_KEY_FROM_STR(ip_key, ip_key_p, op->pool, op->pool_len,
+							     members->element[i]->str);
+				redisAppendCommand(conn->handle, "HMGET %b device gateway range",
+						   ip_key, ip_key_p - ip_key);
+				pipelined++;
+			}
+
+			reply_cnt = fr_redis_pipeline_result(&pipelined, &status, replies,
+							     talloc_array_length(replies), conn);
+			for (i = 0; i < reply_cnt; i++) fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
+		}
+		if (s_ret != REDIS_RCODE_SUCCESS) {
+			ERROR("Failed retrieving lease information: %s", fr_strerror());
+			goto error;
+		}
+
+		for (i = 0; i < reply_cnt; i++) {
+			redisReply		*member = members->element[i * 2];
+			redisReply		*score = members->element[(i * 2) + 1];
+			redisReply		*data = replies[i];
+			ippool_tool_lease_t	lease;
+
+			if ((member->type != REDIS_REPLY_STRING) || (score->type != REDIS_REPLY_STRING)) continue;
+
+			memset(&lease, 0, sizeof(lease));
+			if (fr_inet_pton(&lease.ipaddr, member->str, member->len, AF_UNSPEC, false, false) < 0) {
+				WARN("Skipping \"%s\": %s", member->str, fr_strerror());
+				continue;
+			}
+			lease.next_event = (time_t)strtoull(score->str, NULL, 10);
+
+			if ((data->type == REDIS_REPLY_ARRAY) && (data->elements == 3)) {
+				if (data->element[0]->type == REDIS_REPLY_STRING) {
+					lease.device = (uint8_t const *)data->element[0]->str;
+					lease.device_len = data->element[0]->len;
+				}
+				if (data->element[1]->type == REDIS_REPLY_STRING) {
+					lease.gateway = (uint8_t const *)data->element[1]->str;
+					lease.gateway_len = data->element[1]->len;
+				}
+				if (data->element[2]->type == REDIS_REPLY_STRING) {
+					lease.range = (uint8_t const *)data->element[2]->str;
+					lease.range_len = data->element[2]->len;
+				}
+			}
+
+			lease_print(&lease);
+			(*shown)++;
+		}
+
+		fr_redis_pipeline_free(replies, reply_cnt);
+		TALLOC_FREE(replies);
+		reply_cnt = 0;
+
+		if (progress) INFO("%s: %" PRIu64 " address(es)/prefix(es) retrieved", op->name, *shown);
+
+	next:
+		fr_redis_reply_free(reply);
+		reply = NULL;
+	} while (!((cursor[0] == '0') && (cursor[1] == '\0')));	/* Cursor value of 0 means no more results */
+
+	talloc_free(request);
+
+	return 0;
+}
+
 /** Count the number of leases we released
  *
  */
@@ -1138,6 +1386,29 @@ static int driver_get_stats(ippool_tool_stats_t *out, void *instance, uint8_t co
 	return 0;
 }
 
+/** Find the node holding a pool
+ *
+ * @param[out] out Address of the node.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] key_prefix Pool name.
+ * @param[in] key_prefix_len Length of the pool name.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int driver_get_node(fr_socket_addr_t *out, void *instance, uint8_t const *key_prefix, size_t key_prefix_len)
+{
+	redis_driver_conf_t	*inst = talloc_get_type_abort(instance, redis_driver_conf_t);
+	REQUEST			*request = request_alloc(inst);
+	int			ret;
+
+	ret = fr_redis_cluster_node_addr_by_key(out, inst->cluster, request, key_prefix, key_prefix_len);
+	if (ret < 0) ERROR("Failed finding node for pool: %s", fr_strerror());
+	talloc_free(request);
+
+	return ret;
+}
+
 /** Driver initialization function
  *
  */
@@ -1341,15 +1612,288 @@ static int parse_ip_range(fr_ipaddr_t *start_out, fr_ipaddr_t *end_out, char con
 	return 0;
 }
 
+/** Add an operation to the end of the list of operations
+ *
+ * @param[in] conf to add the operation to.
+ * @param[in] action to perform.
+ * @param[in] range string, parsed later.
+ * @return the new operation.
+ */
+static ippool_tool_operation_t *operation_add(ippool_tool_t *conf, ippool_tool_action_t action, char const *range)
+{
+	ippool_tool_operation_t *op;
+
+	if (conf->num_ops == talloc_array_length(conf->ops)) {
+		MEM(conf->ops = talloc_realloc(conf, conf->ops, ippool_tool_operation_t,
+					       conf->num_ops ? (conf->num_ops * 2) : 16));
+	}
+
+	op = &conf->ops[conf->num_ops++];
+	memset(op, 0, sizeof(*op));
+	op->action = action;
+	op->name = range;
+
+	return op;
+}
+
+/** Unescape sequences in a pool name or range id
+ *
+ */
+static uint8_t *arg_unescape(TALLOC_CTX *ctx, char const *in)
+{
+	uint8_t	*arg;
+	size_t	len;
+
+	/*
+	 *	Be forgiving about zero length strings...
+	 */
+	len = strlen(in);
+	MEM(arg = talloc_array(ctx, uint8_t, len));
+	len = fr_value_str_unescape(arg, in, len, '"');
+	rad_assert(len);
+
+	MEM(arg = talloc_realloc(ctx, arg, uint8_t, len));
+
+	return arg;
+}
+
+/** Read ranges to add from a file
+ *
+ * Each line is a range, optionally followed by the pool and range id to
+ * add it to.  Blank lines, and lines starting with '#' are ignored.
+ *
+ * @param[in] conf to add the operations to.
+ * @param[in] filename to read.
+ * @return
+ *	- The number of ranges read.
+ *	- -1 on failure.
+ */
+static ssize_t bulk_file_read(ippool_tool_t *conf, char const *filename)
+{
+	FILE	*fp;
+	char	buff[1024];
+	int	lineno = 0;
+	ssize_t	count = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		ERROR("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(buff, sizeof(buff), fp)) {
+		ippool_tool_operation_t	*op;
+		char			*range, *pool, *range_id, *last;
+		size_t			len;
+
+		lineno++;
+
+		len = strlen(buff);
+		if ((len == (sizeof(buff) - 1)) && (buff[len - 1] != '\n') && !feof(fp)) {
+			ERROR("%s[%i]: Line too long", filename, lineno);
+		error:
+			fclose(fp);
+			return -1;
+		}
+
+		range = strtok_r(buff, " \t\r\n", &last);
+		if (!range || (range[0] == '#')) continue;
+
+		pool = strtok_r(NULL, " \t\r\n", &last);
+		range_id = pool ? strtok_r(NULL, " \t\r\n", &last) : NULL;
+		if (range_id && strtok_r(NULL, " \t\r\n", &last)) {
+			ERROR("%s[%i]: Too many fields, expected <range> [<pool> [<range id>]]", filename, lineno);
+			goto error;
+		}
+
+		op = operation_add(conf, IPPOOL_TOOL_ADD, talloc_strdup(conf, range));
+		if (pool) {
+			op->pool = arg_unescape(conf, pool);
+			op->pool_len = talloc_array_length(op->pool);
+		}
+		if (range_id) {
+			op->range = arg_unescape(conf, range_id);
+			op->range_len = talloc_array_length(op->range);
+		}
+		count++;
+	}
+	fclose(fp);
+
+	return count;
+}
+
+/** Perform a single operation, and print the result
+ *
+ */
+static int operation_run(ippool_tool_t *conf, ippool_tool_operation_t const *op)
+{
+	uint64_t count = 0;
+
+	switch (op->action) {
+	case IPPOOL_TOOL_ADD:
+		if (driver_add_lease(&count, conf->driver, op) < 0) return -1;
+		INFO("Added %" PRIu64 " address(es)/prefix(es)", count);
+		break;
+
+	case IPPOOL_TOOL_REMOVE:
+		if (driver_remove_lease(&count, conf->driver, op) < 0) return -1;
+		INFO("Removed %" PRIu64 " address(es)/prefix(es)", count);
+		break;
+
+	case IPPOOL_TOOL_RELEASE:
+		if (driver_release_lease(&count, conf->driver, op) < 0) return -1;
+		INFO("Released %" PRIu64 " address(es)/prefix(es)", count);
+		break;
+
+	case IPPOOL_TOOL_SHOW:
+		if (driver_show_lease(&count, conf->driver, op) < 0) return -1;
+		INFO("Retrieved information for %" PRIu64 " address(es)/prefix(es)", count);
+		break;
+
+	case IPPOOL_TOOL_SHOW_ALL:
+		if (driver_show_pool(&count, conf->driver, op) < 0) return -1;
+		INFO("Retrieved information for %" PRIu64 " address(es)/prefix(es)", count);
+		break;
+
+	case IPPOOL_TOOL_MODIFY:
+		if (driver_modify_lease(&count, conf->driver, op) < 0) return -1;
+		INFO("Modified %" PRIu64 " address(es)/prefix(es)", count);
+		break;
+
+	case IPPOOL_TOOL_NOOP:
+		break;
+	}
+
+	return 0;
+}
+
+/** Perform all the operations assigned to a worker, stopping at the first failure
+ *
+ */
+static void *worker_thread(void *arg)
+{
+	ippool_tool_worker_t	*worker = arg;
+	size_t			i;
+
+	for (i = 0; i < talloc_array_length(worker->ops); i++) {
+		if (operation_run(worker->conf, worker->ops[i]) < 0) {
+			worker->ret = -1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/** Perform all the operations, in parallel where they're on pools held by different nodes
+ *
+ * Operations on pools held by the same node are performed in order, by the
+ * same worker.  Redis nodes process commands in a single thread, so a second
+ * worker sending commands to the same node wouldn't make it any faster.
+ *
+ * @param[in] conf holding the operations.
+ * @param[in] num_workers Maximum number of threads to run.
+ * @return
+ *	- 0 if all operations succeeded.
+ *	- -1 if any operation failed.
+ */
+static int operations_run(ippool_tool_t *conf, uint32_t num_workers)
+{
+	ippool_tool_worker_t	*workers;
+	uint32_t		used = 0, started;
+	size_t			i, j, k, n;
+	int			ret = 0;
+
+	if ((num_workers <= 1) || (conf->num_ops <= 1)) {
+		for (i = 0; i < conf->num_ops; i++) if (operation_run(conf, &conf->ops[i]) < 0) return -1;
+		return 0;
+	}
+
+	MEM(workers = talloc_zero_array(conf, ippool_tool_worker_t, num_workers));
+
+	for (i = 0; i < conf->num_ops; i++) {
+		ippool_tool_operation_t	*op = &conf->ops[i];
+		ippool_tool_worker_t	*worker = NULL;
+		fr_socket_addr_t	node;
+
+		if (driver_get_node(&node, conf->driver, op->pool, op->pool_len) < 0) {
+			talloc_free(workers);
+			return -1;
+		}
+
+		/*
+		 *	Find the worker responsible for the node...
+		 */
+		for (j = 0; (j < used) && !worker; j++) {
+			for (k = 0; k < talloc_array_length(workers[j].nodes); k++) {
+				if ((workers[j].nodes[k].port == node.port) &&
+				    (fr_ipaddr_cmp(&workers[j].nodes[k].ipaddr, &node.ipaddr) == 0)) {
+					worker = &workers[j];
+					break;
+				}
+			}
+		}
+
+		/*
+		 *	...or give the node to an idle worker, or
+		 *	the one responsible for the fewest nodes.
+		 */
+		if (!worker) {
+			if (used < num_workers) {
+				worker = &workers[used++];
+				worker->conf = conf;
+			} else {
+				worker = &workers[0];
+				for (j = 1; j < used; j++) {
+					if (talloc_array_length(workers[j].nodes) <
+					    talloc_array_length(worker->nodes)) worker = &workers[j];
+				}
+			}
+
+			n = talloc_array_length(worker->nodes);
+			MEM(worker->nodes = talloc_realloc(workers, worker->nodes, fr_socket_addr_t, n + 1));
+			worker->nodes[n] = node;
+		}
+
+		n = talloc_array_length(worker->ops);
+		MEM(worker->ops = talloc_realloc(workers, worker->ops, ippool_tool_operation_t *, n + 1));
+		worker->ops[n] = op;
+	}
+
+	DEBUG("Performing %zu operation(s) with %u worker(s)", conf->num_ops, used);
+
+	for (started = 0; started < used; started++) {
+		int err;
+
+		err = pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]);
+		if (err != 0) {
+			ERROR("Failed creating worker: %s", fr_syserror(err));
+			ret = -1;
+			break;
+		}
+	}
+
+	for (j = 0; j < started; j++) {
+		pthread_join(workers[j].thread, NULL);
+		if (workers[j].ret < 0) ret = -1;
+	}
+
+	talloc_free(workers);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
-	static ippool_tool_operation_t	ops[128];
-	ippool_tool_operation_t		*p = ops, *end = ops + (sizeof(ops) / sizeof(*ops));
+	ippool_tool_operation_t		*p;
+	size_t				prefix_from = 0;	/* First operation -p applies to */
+	uint32_t			num_workers = 1;
 
 	int				opt;
 
 	uint8_t				*range_arg = NULL;
 	uint8_t				*pool_arg = NULL;
+	char const			*pool_name = NULL;
 	bool				do_export = false, print_stats = false, list_pools = false;
 	bool				need_pool = false;
 	char				*do_import = NULL;
@@ -1370,17 +1914,12 @@ int main(int argc, char *argv[])
 
 #define ADD_ACTION(_action) \
 do { \
-	if ((size_t)(p - ops) >= sizeof(ops)) { \
-		ERROR("Too many actions, max is " STRINGIFY(sizeof(ops))); \
-		usage(64); \
-	} \
-	p->action = _action; \
-	p->name = optarg; \
-	p++; \
+	prefix_from = conf->num_ops; \
+	operation_add(conf, _action, optarg); \
 	need_pool = true; \
 } while (0);
 
-	while ((opt = getopt(argc, argv, "a:d:r:s:Sm:p:ilLhxo:f:")) != EOF)
+	while ((opt = getopt(argc, argv, "a:Ab:d:j:r:s:Sm:p:ilLhxo:f:P")) != EOF)
 	switch (opt) {
 	case 'a':
 		ADD_ACTION(IPPOOL_TOOL_ADD);
@@ -1402,12 +1941,24 @@ do { \
 		ADD_ACTION(IPPOOL_TOOL_MODIFY);
 		break;
 
+	case 'A':
+		prefix_from = conf->num_ops;
+		operation_add(conf, IPPOOL_TOOL_SHOW_ALL, NULL);
+		need_pool = true;
+		break;
+
+	case 'b':
+		prefix_from = conf->num_ops;
+		if (bulk_file_read(conf, optarg) < 0) exit(1);
+		break;
+
 	case 'p':
 	{
 		unsigned long tmp;
 		char *q;
+		size_t i;
 
-		if (p == ops) {
+		if (conf->num_ops == 0) {
 			ERROR("Prefix may only be specified after a pool management action");
 			usage(64);
 		}
@@ -1418,10 +1969,28 @@ do { \
 
 		}
 
-		(p - 1)->prefix = (uint8_t)tmp & 0xff;
+		for (i = prefix_from; i < conf->num_ops; i++) conf->ops[i].prefix = (uint8_t)tmp & 0xff;
 	}
 		break;
 
+	case 'j':
+	{
+		unsigned long tmp;
+		char *q;
+
+		tmp = strtoul(optarg, &q, 10);
+		if ((q != (optarg + strlen(optarg))) || (tmp < 1) || (tmp > MAX_WORKERS)) {
+			ERROR("Workers must be an integer value between 1 and " STRINGIFY(MAX_WORKERS));
+			usage(64);
+		}
+		num_workers = (uint32_t)tmp;
+	}
+		break;
+
+	case 'P':
+		progress = true;
+		break;
+
 	case 'i':
 		do_import = optarg;
 		break;
@@ -1481,33 +2050,13 @@ do { \
 	 *	Unescape sequences in the pool name
 	 */
 	if (argv[1] && (argv[1][0] != '\0')) {
-		uint8_t	*arg;
-		size_t	len;
-
-		/*
-		 *	Be forgiving about zero length strings...
-		 */
-		len = strlen(argv[1]);
-		MEM(arg = talloc_array(conf, uint8_t, len));
-		len = fr_value_str_unescape(arg, argv[1], len, '"');
-		rad_assert(len);
-
-		MEM(pool_arg = talloc_realloc(conf, arg, uint8_t, len));
+		pool_name = argv[1];
+		pool_arg = arg_unescape(conf, argv[1]);
 	}
 
-	if (argc >= 3 && (argv[2][0] != '\0')) {
-		uint8_t	*arg;
-		size_t	len;
-
-		len = strlen(argv[2]);
-		MEM(arg = talloc_array(conf, uint8_t, len));
-		len = fr_value_str_unescape(arg, argv[2], len, '"');
-		rad_assert(len);
+	if (argc >= 3 && (argv[2][0] != '\0')) range_arg = arg_unescape(conf, argv[2]);
 
-		MEM(range_arg = talloc_realloc(conf, arg, uint8_t, len));
-	}
-
-	if (!do_import && !do_export && !list_pools && !print_stats && (p == ops)) {
+	if (!do_import && !do_export && !list_pools && !print_stats && (conf->num_ops == 0)) {
 		ERROR("Nothing to do!");
 		exit(1);
 	}
@@ -1620,137 +2169,31 @@ do { \
 	 *	Fixup the operations without specific pools or ranges
 	 *	and parse the IP ranges.
 	 */
-	end = p;
-	for (p = ops; p < end; p++) {
-		if (parse_ip_range(&p->start, &p->end, p->name, p->prefix) < 0) usage(64);
-		if (!p->prefix) p->prefix = IPADDR_LEN(p->start.af);
-
+	for (p = conf->ops; p < (conf->ops + conf->num_ops); p++) {
 		if (!p->pool) {
+			if (!pool_arg) {
+				ERROR("Need pool to operate on");
+				usage(64);
+			}
 			p->pool = pool_arg;
 			p->pool_len = talloc_array_length(pool_arg);
 		}
-		if (!p->range && range_arg) {
-			p->range = range_arg;
-			p->range_len = talloc_array_length(range_arg);
-		}
-	}
 
-	for (p = ops; (p < end) && (p->start.af != AF_UNSPEC); p++) switch (p->action) {
-	case IPPOOL_TOOL_ADD:
-	{
-		uint64_t count = 0;
-
-		if (driver_add_lease(&count, conf->driver, p) < 0) {
-			exit(1);
+		if (p->action == IPPOOL_TOOL_SHOW_ALL) {
+			p->name = pool_name;
+			continue;
 		}
-		INFO("Added %" PRIu64 " address(es)/prefix(es)", count);
-	}
-		break;
 
-	case IPPOOL_TOOL_REMOVE:
-	{
-		uint64_t count = 0;
-
-		if (driver_remove_lease(&count, conf->driver, p) < 0) {
-			exit(1);
-		}
-		INFO("Removed %" PRIu64 " address(es)/prefix(es)", count);
-	}
-		continue;
-
-	case IPPOOL_TOOL_RELEASE:
-	{
-		uint64_t count = 0;
-
-		if (driver_release_lease(&count, conf->driver, p) < 0) {
-			exit(1);
-		}
-		INFO("Released %" PRIu64 " address(es)/prefix(es)", count);
-	}
-		continue;
-
-	case IPPOOL_TOOL_SHOW:
-	{
-		ippool_tool_lease_t **leases = NULL;
-		size_t len, i;
-
-		if (driver_show_lease(&leases, conf->driver, p) < 0) {
-			exit(1);
-		}
-		rad_assert(leases);
-
-		len = talloc_array_length(leases);
-		INFO("Retrieved information for %zu address(es)/prefix(es)", len - 1);
-		for (i = 0; i < (len - 1); i++) {
-			char	ip_buff[FR_IPADDR_PREFIX_STRLEN];
-			char	time_buff[30];
-			struct	tm tm;
-			struct	timeval now;
-			char	*device = NULL;
-			char	*gateway = NULL;
-			char	*range = NULL;
-			bool	is_active;
-
-#ifndef NDEBUG
-			leases[i] = talloc_get_type_abort(leases[i], ippool_tool_lease_t);
-#endif
-
-			gettimeofday(&now, NULL);
-			is_active = now.tv_sec <= leases[i]->next_event;
-			if (leases[i]->next_event) {
-				strftime(time_buff, sizeof(time_buff), "%b %e %Y %H:%M:%S %Z",
-					 localtime_r(&(leases[i]->next_event), &tm));
-			} else {
-				time_buff[0] = '\0';
-			}
-			IPPOOL_SPRINT_IP(ip_buff, &(leases[i]->ipaddr), leases[i]->ipaddr.prefix);
-
-			if (leases[i]->range) {
-				range = fr_asprint(leases, (char const *)leases[i]->range,
-						   leases[i]->range_len, '\0');
-			}
-
-			INFO("--");
-			if (range) INFO("range           : %s", range);
-			INFO("address/prefix  : %s", ip_buff);
-			INFO("active          : %s", is_active ? "yes" : "no");
-
-			if (leases[i]->device) {
-				device = fr_asprint(leases, (char const *)leases[i]->device,
-						    leases[i]->device_len, '\0');
-			}
-			if (leases[i]->gateway) {
-				gateway = fr_asprint(leases, (char const *)leases[i]->gateway,
-						     leases[i]->gateway_len, '\0');
-			}
-			if (is_active) {
-				if (*time_buff) INFO("lease expires   : %s", time_buff);
-				if (device) INFO("device id       : %s", device);
-				if (gateway) INFO("gateway id      : %s", gateway);
-			} else {
-				if (*time_buff) INFO("lease expired   : %s", time_buff);
-				if (device) INFO("last device id  : %s", device);
-				if (gateway) INFO("last gateway id : %s", gateway);
-			}
-		}
-		talloc_free(leases);
-	}
-		continue;
-
-	case IPPOOL_TOOL_MODIFY:
-	{
-		uint64_t count = 0;
+		if (parse_ip_range(&p->start, &p->end, p->name, p->prefix) < 0) usage(64);
+		if (!p->prefix) p->prefix = IPADDR_LEN(p->start.af);
 
-		if (driver_modify_lease(&count, conf->driver, p) < 0) {
-			exit(1);
+		if (!p->range && range_arg) {
+			p->range = range_arg;
+			p->range_len = talloc_array_length(range_arg);
 		}
-		INFO("Modified %" PRIu64 " address(es)/prefix(es)", count);
 	}
-		continue;
 
-	case IPPOOL_TOOL_NOOP:
-		break;
-	}
+	if (operations_run(conf, num_workers) < 0) exit(1);
 
 	talloc_free(conf);
 
@@ -0,0 +1,224 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_redis_state.c
+ * @brief Share session-state between servers using Redis.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/state.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "../rlm_redis/redis.h"
+#include "../rlm_redis/cluster.h"
+
+#define REDIS_STATE_MAX_KEY	(256)
+
+typedef struct rlm_redis_state {
+	fr_redis_conf_t		*conf;		//!< Connection parameters for the Redis server.
+						//!< Must be first field in this struct.
+
+	char const		*name;		//!< Instance name.
+	fr_redis_cluster_t	*cluster;	//!< Pool O pools
+
+	char const		*prefix;	//!< Prepended to the state value to make the key.
+	size_t			prefix_len;
+} rlm_redis_state_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+
+	{ FR_CONF_OFFSET("prefix", PW_TYPE_STRING, rlm_redis_state_t, prefix), .dflt = "state:" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Build the Redis key for a state value
+ *
+ */
+static ssize_t redis_state_key(uint8_t *out, size_t outlen, rlm_redis_state_t const *inst,
+			       uint8_t const *key, size_t key_len)
+{
+	if ((inst->prefix_len + key_len) > outlen) return -1;
+
+	memcpy(out, inst->prefix, inst->prefix_len);
+	memcpy(out + inst->prefix_len, key, key_len);
+
+	return inst->prefix_len + key_len;
+}
+
+static int mod_state_store(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len,
+			   uint8_t const *data, size_t data_len, uint32_t ttl)
+{
+	rlm_redis_state_t const		*inst = talloc_get_type_abort(uctx, rlm_redis_state_t);
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+	uint8_t				buffer[REDIS_STATE_MAX_KEY];
+	ssize_t				len;
+
+	len = redis_state_key(buffer, sizeof(buffer), inst, key, key_len);
+	if (len < 0) return -1;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, buffer, len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "SET %b %b EX %u", buffer, (size_t)len, data, data_len, ttl);
+		status = fr_redis_command_status(conn, reply);
+	}
+	fr_redis_reply_free(reply);
+
+	return (s_ret == REDIS_RCODE_SUCCESS) ? 0 : -1;
+}
+
+static ssize_t mod_state_fetch(TALLOC_CTX *ctx, uint8_t **out, void *uctx, REQUEST *request,
+			       uint8_t const *key, size_t key_len)
+{
+	rlm_redis_state_t const		*inst = talloc_get_type_abort(uctx, rlm_redis_state_t);
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+	uint8_t				buffer[REDIS_STATE_MAX_KEY];
+	ssize_t				len;
+
+	len = redis_state_key(buffer, sizeof(buffer), inst, key, key_len);
+	if (len < 0) return -1;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, buffer, len, true);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "GET %b", buffer, (size_t)len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+	error:
+		fr_redis_reply_free(reply);
+		return -1;
+	}
+	if (!rad_cond_assert(reply)) goto error;
+
+	switch (reply->type) {
+	case REDIS_REPLY_NIL:
+		len = 0;
+		break;
+
+	case REDIS_REPLY_STRING:
+		*out = talloc_memdup(ctx, reply->str, reply->len);
+		if (!*out) goto error;
+		len = reply->len;
+		break;
+
+	default:
+		REDEBUG("Unexpected reply type fetching state: %s",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		goto error;
+	}
+	fr_redis_reply_free(reply);
+
+	return len;
+}
+
+static void mod_state_remove(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_redis_state_t const		*inst = talloc_get_type_abort(uctx, rlm_redis_state_t);
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+	uint8_t				buffer[REDIS_STATE_MAX_KEY];
+	ssize_t				len;
+
+	len = redis_state_key(buffer, sizeof(buffer), inst, key, key_len);
+	if (len < 0) return;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, buffer, len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "DEL %b", buffer, (size_t)len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	fr_redis_reply_free(reply);
+}
+
+static fr_state_backend_t const redis_state_backend = {
+	.name		= "redis",
+	.store		= mod_state_store,
+	.fetch		= mod_state_fetch,
+	.remove		= mod_state_remove
+};
+
+static int mod_detach(UNUSED void *instance)
+{
+	fr_state_backend_register(NULL, NULL);
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_redis_state_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->prefix_len = talloc_array_length(inst->prefix) - 1;
+	if (inst->prefix_len >= (REDIS_STATE_MAX_KEY / 2)) {
+		cf_log_err_cs(conf, "'prefix' must be less than %i characters", REDIS_STATE_MAX_KEY / 2);
+		return -1;
+	}
+
+	inst->cluster = fr_redis_cluster_alloc(inst, conf, inst->conf, true, NULL, NULL, NULL);
+	if (!inst->cluster) return -1;
+
+	/*
+	 *	There's only one state tree, so only one instance
+	 *	can be its backend.
+	 */
+	fr_state_backend_register(&redis_state_backend, inst);
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	fr_redis_version_print();
+
+	return 0;
+}
+
+extern rad_module_t rlm_redis_state;
+rad_module_t rlm_redis_state = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "redis_state",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_redis_state_t),
+	.config		= module_config,
+	.load		= mod_load,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach
+};
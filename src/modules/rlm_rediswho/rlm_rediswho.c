@@ -35,6 +35,7 @@ RCSID("$Id$")
 
 #include "../rlm_redis/redis.h"
 #include "../rlm_redis/cluster.h"
+#include "../rlm_redis/mux.h"
 
 typedef struct rlm_rediswho {
 	fr_redis_conf_t		*conf;		//!< Connection parameters for the Redis server.
@@ -51,8 +52,79 @@ typedef struct rlm_rediswho {
 	char const		*insert;	//!< Command for inserting session data
 	char const		*trim;		//!< Command for trimming the session list.
 	char const		*expire;	//!< Command for expiring entries.
+
+	bool			script;		//!< Run all of the commands with one Lua script.
+
+	CONF_SECTION		*pipeline;	//!< If present, pipeline commands over per-thread connections.
 } rlm_rediswho_t;
 
+typedef struct {
+	fr_redis_mux_t		*rmux;		//!< Pipelined connections to each node.
+} rlm_rediswho_thread_t;
+
+/** Which command a pipelined request is waiting for the reply to
+ *
+ */
+typedef enum {
+	REDISWHO_INSERT = 0,
+	REDISWHO_TRIM,
+	REDISWHO_EXPIRE,
+	REDISWHO_DONE
+} rediswho_state_t;
+
+typedef struct {
+	char const		*cmds[REDISWHO_DONE];	//!< Commands to run, indexed by #rediswho_state_t.
+	rediswho_state_t	state;		//!< Command we're currently running.
+	int			count;		//!< Result of the insert command.
+} rediswho_async_t;
+
+/*
+ *	Runs the insert, trim and expire commands on the server, so
+ *	that each accounting request is one round trip.
+ *
+ *	ARGV[1] is trim_count, then each command is given as the
+ *	number of arguments, followed by the arguments.  The trim and
+ *	expire commands are only run if the insert succeeded, as
+ *	mod_accounting_all() would do.
+ */
+static char const rediswho_script[] =
+	"local i = 2\n"
+	"local function run(skip)\n"
+	"  local n = tonumber(ARGV[i])\n"
+	"  local argv = {}\n"
+	"  for j = 1, n do argv[j] = ARGV[i + j] end\n"
+	"  i = i + n + 1\n"
+	"  if skip or (n == 0) then return 0 end\n"
+	"  return redis.call(unpack(argv))\n"
+	"end\n"
+	"local count = run(false)\n"
+	"if (type(count) ~= 'number') or (count <= 0) then return count end\n"
+	"local trim_count = tonumber(ARGV[1])\n"
+	"run(not ((trim_count >= 0) and (count > trim_count)))\n"
+	"run(false)\n"
+	"return count\n";
+
+/*
+ *	EVAL, the script, numkeys, the key, trim_count, and three
+ *	commands with their argument counts.
+ */
+#define REDISWHO_SCRIPT_ARGS	(5 + (3 * (MAX_REDIS_ARGS + 1)))
+
+/** The arguments for running the script
+ *
+ */
+typedef struct {
+	int			argc;
+	char const		*argv[REDISWHO_SCRIPT_ARGS];
+	size_t			argv_len[REDISWHO_SCRIPT_ARGS];
+
+	uint8_t const		*key;		//!< Key of the insert command.
+	size_t			key_len;
+
+	char			argv_buf[3][MAX_REDIS_COMMAND_LEN];
+	char			numbers[4][16];	//!< trim_count, and the argument counts.
+} rediswho_script_args_t;
+
 static CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("insert", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_XLAT, rlm_rediswho_t, insert) },
 	{ FR_CONF_OFFSET("trim", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_rediswho_t, trim) }, /* required only if trim_count > 0 */
@@ -64,6 +136,7 @@ static CONF_PARSER module_config[] = {
 	REDIS_COMMON_CONFIG,
 
 	{ FR_CONF_OFFSET("trim_count", PW_TYPE_SIGNED, rlm_rediswho_t, trim_count), .dflt = "-1" },
+	{ FR_CONF_OFFSET("script", PW_TYPE_BOOLEAN, rlm_rediswho_t, script), .dflt = "no" },
 
 	/*
 	 *	These all smash the same variables, because we don't care about them right now.
@@ -76,6 +149,58 @@ static CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Expand a command, and find the key it operates on.
+ */
+static int rediswho_expand(REQUEST *request, char const *fmt, char const **argv, char *argv_buf, size_t argv_buf_len,
+			   uint8_t const **key, size_t *key_len)
+{
+	int argc;
+
+	argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, argv, false, argv_buf_len, argv_buf);
+ 	if (argc < 0) return -1;
+
+	/*
+	 *	If we've got multiple arguments, the second one is usually the key.
+	 *	The Redis docs say commands should be analysed first to get key
+	 *	positions, but this involves sending them to the server, which is
+	 *	just as expensive as sending them to the wrong server and receiving
+	 *	a redirect.
+	 */
+	*key = NULL;
+	*key_len = 0;
+	if (argc > 1) {
+		*key = (uint8_t const *)argv[1];
+	 	*key_len = strlen((char const *)*key);
+	}
+
+	return argc;
+}
+
+/*
+ *	Get the number of entries from the reply to a command.
+ */
+static int rediswho_reply(REQUEST *request, redisReply *reply)
+{
+	int ret = -1;
+
+	switch (reply->type) {
+	case REDIS_REPLY_INTEGER:
+		RDEBUG2("Query response %lld", reply->integer);
+		if (reply->integer > 0) ret = reply->integer;
+		break;
+
+	case REDIS_REPLY_STRING:
+		REDEBUG2("Query response %s", reply->str);
+		break;
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
 /*
  *	Query the database executing a command with no result rows
  */
@@ -90,8 +215,8 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	redisReply		*reply = NULL;
 	int			s_ret;
 
-	uint8_t	const		*key = NULL;
-	size_t			key_len = 0;
+	uint8_t	const		*key;
+	size_t			key_len;
 
 	int			argc;
 	char const		*argv[MAX_REDIS_ARGS];
@@ -99,27 +224,117 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 
 	if (!fmt || !*fmt) return 0;
 
-	argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, argv, false, sizeof(argv_buf), argv_buf);
+	argc = rediswho_expand(request, fmt, argv, argv_buf, sizeof(argv_buf), &key, &key_len);
  	if (argc < 0) return -1;
 
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		RERROR("Failed inserting accounting data");
+	error:
+		fr_redis_reply_free(reply);
+		return -1;
+	}
+	if (!rad_cond_assert(reply)) goto error;
+
+	ret = rediswho_reply(request, reply);
+	fr_redis_reply_free(reply);
+
+	return ret;
+}
+
+/*
+ *	Expand the commands into the arguments for the script.
+ */
+static int rediswho_script_expand(rlm_rediswho_t const *inst, REQUEST *request, rediswho_script_args_t *args,
+				  char const *insert, char const *trim, char const *expire)
+{
+	char const	*cmds[3] = { insert, trim, expire };
+	uint8_t const	*key;
+	size_t		key_len;
+	int		i, argc, cmd_argc;
+
+	args->argv[0] = "EVAL";
+	args->argv[1] = rediswho_script;
+	args->argv[2] = "1";
+	/* argv[3] is the key, filled in below */
+	snprintf(args->numbers[0], sizeof(args->numbers[0]), "%i", inst->trim_count);
+	args->argv[4] = args->numbers[0];
+	argc = 5;
+
+	args->key = NULL;
+	args->key_len = 0;
+
+	for (i = 0; i < 3; i++) {
+		char const *num_p = args->numbers[i + 1];
+
+		args->argv[argc++] = num_p;
+
+		if (!cmds[i] || !*cmds[i]) {
+			cmd_argc = 0;
+		} else {
+			cmd_argc = rediswho_expand(request, cmds[i], &args->argv[argc], args->argv_buf[i],
+						   sizeof(args->argv_buf[i]), &key, &key_len);
+			if (cmd_argc < 0) return -1;
+
+			if (!args->key) {
+				args->key = key;
+				args->key_len = key_len;
+			}
+		}
+		snprintf(args->numbers[i + 1], sizeof(args->numbers[i + 1]), "%i", cmd_argc);
+		argc += cmd_argc;
+	}
+
 	/*
-	 *	If we've got multiple arguments, the second one is usually the key.
-	 *	The Redis docs say commands should be analysed first to get key
-	 *	positions, but this involves sending them to the server, which is
-	 *	just as expensive as sending them to the wrong server and receiving
-	 *	a redirect.
+	 *	Redis requires keys to be declared.  All of the
+	 *	commands should operate on the same key, so that
+	 *	they're on the same node.
 	 */
-	if (argc > 1) {
-		key = (uint8_t const *)argv[1];
-	 	key_len = strlen((char const *)key);
+	if (!args->key) {
+		REDEBUG("The insert command must operate on a key");
+		return -1;
 	}
+	args->argv[3] = (char const *) args->key;
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
+	for (i = 0; i < argc; i++) args->argv_len[i] = strlen(args->argv[i]);
+	args->argc = argc;
+
+	return argc;
+}
+
+/*
+ *	Run the insert, trim and expire commands with one script.
+ */
+static int rediswho_script_command(rlm_rediswho_t const *inst, REQUEST *request,
+				   char const *insert, char const *trim, char const *expire)
+{
+	fr_redis_conn_t		*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	redisReply		*reply = NULL;
+	int			s_ret, ret;
+	rediswho_script_args_t	*args;
+
+	MEM(args = talloc(request, rediswho_script_args_t));
+	if (rediswho_script_expand(inst, request, args, insert, trim, expire) < 0) {
+		talloc_free(args);
+		return -1;
+	}
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request,
+						 args->key, args->key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
+		reply = redisCommandArgv(conn->handle, args->argc, args->argv, args->argv_len);
 		status = fr_redis_command_status(conn, reply);
 	}
+	talloc_free(args);
+
 	if (s_ret != REDIS_RCODE_SUCCESS) {
 		RERROR("Failed inserting accounting data");
 	error:
@@ -128,22 +343,143 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	}
 	if (!rad_cond_assert(reply)) goto error;
 
-	switch (reply->type) {
-	case REDIS_REPLY_INTEGER:
-		RDEBUG2("Query response %lld", reply->integer);
-		if (reply->integer > 0) ret = reply->integer;
-		break;
+	ret = rediswho_reply(request, reply);
+	fr_redis_reply_free(reply);
 
-	case REDIS_REPLY_STRING:
-		REDEBUG2("Query response %s", reply->str);
-		break;
+	return ret;
+}
 
-	default:
-		break;
+/*
+ *	Write a command to the pipelined connections.
+ *
+ *	Returns 1 if the command was sent, 0 if there was
+ *	no command to send, or -1 on error.
+ */
+static int rediswho_command_send(rlm_rediswho_thread_t *t, REQUEST *request, char const *fmt)
+{
+	uint8_t	const		*key;
+	size_t			key_len;
+
+	int			argc, i;
+	char const		*argv[MAX_REDIS_ARGS];
+	size_t			argv_len[MAX_REDIS_ARGS];
+	char			argv_buf[MAX_REDIS_COMMAND_LEN];
+
+	if (!fmt || !*fmt) return 0;
+
+	argc = rediswho_expand(request, fmt, argv, argv_buf, sizeof(argv_buf), &key, &key_len);
+ 	if (argc < 0) return -1;
+
+	for (i = 0; i < argc; i++) argv_len[i] = strlen(argv[i]);
+
+	if (fr_redis_mux_enqueue(t->rmux, request, key, key_len, argc, argv, argv_len) < 0) {
+		RERROR("Failed sending accounting data");
+		return -1;
+	}
+
+	return 1;
+}
+
+static rlm_rcode_t mod_accounting_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
+/*
+ *	Send the next command in the sequence, and yield until its reply arrives.
+ */
+static rlm_rcode_t mod_accounting_next(rlm_rediswho_t const *inst, rlm_rediswho_thread_t *t, REQUEST *request,
+				       rediswho_async_t *actx)
+{
+	int ret;
+
+	for (; actx->state < REDISWHO_DONE; actx->state++) {
+		/* Only trim if necessary */
+		if ((actx->state == REDISWHO_TRIM) &&
+		    !((inst->trim_count >= 0) && (actx->count > inst->trim_count))) continue;
+
+		ret = rediswho_command_send(t, request, actx->cmds[actx->state]);
+		if (ret < 0) {
+			talloc_free(actx);
+			return RLM_MODULE_FAIL;
+		}
+		if (ret > 0) return unlang_yield(request, mod_accounting_resume, NULL, actx);
 	}
+	talloc_free(actx);
+
+	return RLM_MODULE_OK;
+}
+
+static rlm_rcode_t mod_accounting_resume(REQUEST *request, void *instance, void *thread, void *ctx)
+{
+	rlm_rediswho_t const	*inst = instance;
+	rlm_rediswho_thread_t	*t = thread;
+	rediswho_async_t	*actx = talloc_get_type_abort(ctx, rediswho_async_t);
+	fr_redis_rcode_t	status;
+	redisReply		*reply;
+	int			ret;
+
+	status = fr_redis_mux_result(&reply, t->rmux, request);
+	if (status == REDIS_RCODE_TRY_AGAIN) return unlang_yield(request, mod_accounting_resume, NULL, actx);
+	if (status != REDIS_RCODE_SUCCESS) {
+		RERROR("Failed inserting accounting data");
+		fr_redis_reply_free(reply);
+		talloc_free(actx);
+		return RLM_MODULE_FAIL;
+	}
+
+	ret = rediswho_reply(request, reply);
 	fr_redis_reply_free(reply);
 
-	return ret;
+	if (actx->state == REDISWHO_INSERT) actx->count = ret;
+	actx->state++;
+
+	return mod_accounting_next(inst, t, request, actx);
+}
+
+static rlm_rcode_t mod_accounting_script_resume(REQUEST *request, UNUSED void *instance, void *thread,
+						UNUSED void *ctx)
+{
+	rlm_rediswho_thread_t	*t = thread;
+	fr_redis_rcode_t	status;
+	redisReply		*reply;
+	int			ret;
+
+	status = fr_redis_mux_result(&reply, t->rmux, request);
+	if (status == REDIS_RCODE_TRY_AGAIN) return unlang_yield(request, mod_accounting_script_resume, NULL, NULL);
+	if (status != REDIS_RCODE_SUCCESS) {
+		RERROR("Failed inserting accounting data");
+		fr_redis_reply_free(reply);
+		return RLM_MODULE_FAIL;
+	}
+
+	ret = rediswho_reply(request, reply);
+	fr_redis_reply_free(reply);
+
+	return (ret < 0) ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+}
+
+/*
+ *	Send the script over the pipelined connections, and yield until
+ *	its reply arrives.
+ */
+static rlm_rcode_t mod_accounting_script(rlm_rediswho_t const *inst, rlm_rediswho_thread_t *t, REQUEST *request,
+					 char const *insert, char const *trim, char const *expire)
+{
+	rediswho_script_args_t	*args;
+	int			ret;
+
+	MEM(args = talloc(request, rediswho_script_args_t));
+	if (rediswho_script_expand(inst, request, args, insert, trim, expire) < 0) {
+		talloc_free(args);
+		return RLM_MODULE_FAIL;
+	}
+
+	ret = fr_redis_mux_enqueue(t->rmux, request, args->key, args->key_len, args->argc, args->argv, args->argv_len);
+	talloc_free(args);
+	if (ret < 0) {
+		RERROR("Failed sending accounting data");
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_yield(request, mod_accounting_script_resume, NULL, NULL);
 }
 
 static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *request,
@@ -165,9 +501,10 @@ static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *reque
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rediswho_t const	*inst = instance;
+	rlm_rediswho_thread_t	*t = thread;
 	rlm_rcode_t		rcode;
 	VALUE_PAIR		*vp;
 	fr_dict_enum_t		*dv;
@@ -196,6 +533,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	trim = cf_pair_value(cf_pair_find(cs, "trim"));
 	expire = cf_pair_value(cf_pair_find(cs, "expire"));
 
+	if (inst->script) {
+		if (t->rmux) return mod_accounting_script(inst, t, request, insert, trim, expire);
+
+		if (rediswho_script_command(inst, request, insert, trim, expire) < 0) return RLM_MODULE_FAIL;
+		return RLM_MODULE_OK;
+	}
+
+	if (t->rmux) {
+		rediswho_async_t *actx;
+
+		MEM(actx = talloc_zero(request, rediswho_async_t));
+		actx->cmds[REDISWHO_INSERT] = insert;
+		actx->cmds[REDISWHO_TRIM] = trim;
+		actx->cmds[REDISWHO_EXPIRE] = expire;
+
+		return mod_accounting_next(inst, t, request, actx);
+	}
+
 	rcode = mod_accounting_all(inst, request, insert, trim, expire);
 
 	return rcode;
@@ -219,6 +574,31 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->cluster = fr_redis_cluster_alloc(inst, conf, inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	inst->pipeline = cf_section_sub_find(conf, "pipeline");
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_rediswho_t		*inst = instance;
+	rlm_rediswho_thread_t	*t = thread;
+
+	if (!inst->pipeline) return 0;
+
+	t->rmux = fr_redis_mux_alloc(t, inst->pipeline, el, unlang_resumable,
+				     inst->cluster, inst->conf, inst->name);
+	if (!t->rmux) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_rediswho_thread_t *t = thread;
+
+	TALLOC_FREE(t->rmux);
+
 	return 0;
 }
 
@@ -239,6 +619,9 @@ rad_module_t rlm_rediswho = {
 	.load		= mod_load,
 	.instantiate	= mod_instantiate,
 	.bootstrap	= mod_bootstrap,
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
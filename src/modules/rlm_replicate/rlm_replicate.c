@@ -26,6 +26,359 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+/** Packets waiting to be sent to one destination
+ *
+ * The packets are stored back to back.  Their lengths are in the
+ * RADIUS headers.
+ */
+typedef struct replicate_batch {
+	uint8_t			*data;			//!< Encoded packets, back to back.
+	size_t			used;			//!< How much of data is in use.
+	uint32_t		num;			//!< Number of packets.
+} replicate_batch_t;
+
+/** A destination we replicate to asynchronously
+ *
+ */
+typedef struct replicate_dst {
+	fr_ipaddr_t		src_ipaddr;		//!< Address we send from.
+	fr_ipaddr_t		ipaddr;			//!< Address we send to.
+	uint16_t		port;			//!< Port we send to.
+	int			fd;			//!< Connected UDP socket.
+
+	replicate_batch_t	*pending;		//!< Packets being added by the workers.
+	replicate_batch_t	*writing;		//!< Packets being sent by the sender.
+
+	time_t			second;			//!< The second the rate limit applies to.
+	uint32_t		this_second;		//!< Packets queued in that second.
+
+	uint64_t		sent;			//!< Packets sent.
+	uint64_t		dropped;		//!< Packets dropped because the queue was full,
+							//!< or they couldn't be sent.
+	uint64_t		limited;		//!< Packets dropped by the rate limit.
+
+	struct replicate_dst	*next;			//!< Next destination.
+} replicate_dst_t;
+
+typedef struct rlm_replicate_t {
+	char const		*name;			//!< Module instance name.
+
+	struct {
+		bool			enable;			//!< Queue packets for the sender thread.
+		uint32_t		interval;		//!< Maximum time packets are queued, in milliseconds.
+		uint32_t		max_pending;		//!< Maximum amount of data queued per destination.
+		uint32_t		rate_limit;		//!< Maximum packets per second per destination.
+
+#ifdef HAVE_PTHREAD_H
+		replicate_dst_t		*dsts;			//!< All destinations we've seen.
+		uint32_t		num_pending;		//!< Packets queued for all destinations.
+
+		bool			running;		//!< Whether the sender thread has been started.
+		bool			stop;			//!< Tell the sender to exit.
+		pthread_t		thread;			//!< The sender thread.
+		pthread_mutex_t		mutex;			//!< Protects everything in this struct.
+		pthread_cond_t		wakeup;			//!< Signalled to wake up the sender.
+#endif
+	} queue;
+} rlm_replicate_t;
+
+static const CONF_PARSER queue_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_replicate_t, queue.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("interval", PW_TYPE_INTEGER, rlm_replicate_t, queue.interval), .dflt = "10" },
+	{ FR_CONF_OFFSET("max_pending", PW_TYPE_INTEGER, rlm_replicate_t, queue.max_pending), .dflt = "262144" },
+	{ FR_CONF_OFFSET("rate_limit", PW_TYPE_INTEGER, rlm_replicate_t, queue.rate_limit), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_POINTER("queue", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) queue_config },
+	CONF_PARSER_TERMINATOR
+};
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+/** Send a batch of packets to a destination
+ *
+ * @return the number of packets sent.
+ */
+static uint32_t replicate_batch_write(replicate_dst_t *dst, replicate_batch_t *batch)
+{
+	uint8_t		*p = batch->data;
+	uint32_t	i;
+	char		discard[64];
+
+#ifdef HAVE_SENDMMSG
+#  define REPLICATE_BURST (64)
+	struct mmsghdr	msgs[REPLICATE_BURST];
+	struct iovec	iov[REPLICATE_BURST];
+	uint32_t	num, sent;
+	int		rcode;
+
+	for (i = 0; i < batch->num; i += num) {
+		uint32_t j;
+
+		num = batch->num - i;
+		if (num > REPLICATE_BURST) num = REPLICATE_BURST;
+
+		memset(msgs, 0, sizeof(msgs[0]) * num);
+		for (j = 0; j < num; j++) {
+			iov[j].iov_base = p;
+			iov[j].iov_len = (p[2] << 8) | p[3];
+			p += iov[j].iov_len;
+
+			msgs[j].msg_hdr.msg_iov = &iov[j];
+			msgs[j].msg_hdr.msg_iovlen = 1;
+		}
+
+		/*
+		 *	The socket is non-blocking.  If it's full, the
+		 *	rest of the batch is dropped, just as the
+		 *	network would drop it.
+		 */
+		sent = 0;
+		while (sent < num) {
+			rcode = sendmmsg(dst->fd, &msgs[sent], num - sent, 0);
+			if (rcode < 0) {
+				if (errno == EINTR) continue;
+				i += sent;
+				goto done;
+			}
+			sent += rcode;
+		}
+	}
+#else
+	for (i = 0; i < batch->num; i++) {
+		size_t len = (p[2] << 8) | p[3];
+
+		if (send(dst->fd, p, len, 0) < 0) break;
+		p += len;
+	}
+#endif
+
+#ifdef HAVE_SENDMMSG
+done:
+#endif
+	if (i < batch->num) {
+		char buffer[INET6_ADDRSTRLEN];
+
+		ERROR("Failed replicating %u packets to %s port %u: %s", batch->num - i,
+		      inet_ntop(dst->ipaddr.af, &dst->ipaddr.ipaddr, buffer, sizeof(buffer)),
+		      dst->port, fr_syserror(errno));
+	}
+
+	/*
+	 *	We ignore any replies, but they still have to be
+	 *	read, or the socket buffer fills up.
+	 */
+	while (read(dst->fd, discard, sizeof(discard)) > 0);
+
+	return i;
+}
+
+/** Take batches of queued packets, and send them
+ *
+ */
+static void *replicate_sender(void *arg)
+{
+	rlm_replicate_t		*inst = arg;
+	replicate_dst_t		*dst;
+	replicate_batch_t	*batch;
+	struct timespec		deadline;
+	struct timeval		now;
+	uint32_t		sent;
+	bool			stop;
+
+	pthread_mutex_lock(&inst->queue.mutex);
+
+	for (;;) {
+		/*
+		 *	Sleep until there's something to send.
+		 */
+		while (!inst->queue.num_pending && !inst->queue.stop) {
+			pthread_cond_wait(&inst->queue.wakeup, &inst->queue.mutex);
+		}
+
+		/*
+		 *	Give the workers a chance to add more packets,
+		 *	so that they're sent in larger batches.
+		 */
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + (inst->queue.interval / 1000);
+		deadline.tv_nsec = (now.tv_usec * 1000) + ((inst->queue.interval % 1000) * 1000000);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!inst->queue.stop) {
+			if (pthread_cond_timedwait(&inst->queue.wakeup, &inst->queue.mutex,
+						   &deadline) == ETIMEDOUT) break;
+		}
+		stop = inst->queue.stop;
+		inst->queue.num_pending = 0;
+
+		/*
+		 *	Destinations are only ever added to the head of
+		 *	the list, so we can walk it without the lock.
+		 *	Swap the buffers of each destination, so the
+		 *	workers can keep adding packets while we send
+		 *	these.
+		 */
+		for (dst = inst->queue.dsts; dst; dst = dst->next) {
+			if (!dst->pending->num) continue;
+
+			batch = dst->pending;
+			dst->pending = dst->writing;
+			dst->writing = batch;
+			pthread_mutex_unlock(&inst->queue.mutex);
+
+			sent = replicate_batch_write(dst, batch);
+
+			pthread_mutex_lock(&inst->queue.mutex);
+			dst->sent += sent;
+			dst->dropped += batch->num - sent;
+			batch->used = 0;
+			batch->num = 0;
+		}
+
+		if (stop) break;
+	}
+
+	pthread_mutex_unlock(&inst->queue.mutex);
+
+	return NULL;
+}
+
+/** Find or create the queue for a home server
+ *
+ * Must be called with the mutex held.
+ */
+static replicate_dst_t *replicate_dst_find(rlm_replicate_t *inst, REQUEST *request, home_server_t const *home)
+{
+	replicate_dst_t	*dst;
+	int		i;
+
+	for (dst = inst->queue.dsts; dst; dst = dst->next) {
+		if ((dst->port == home->port) &&
+		    (fr_ipaddr_cmp(&dst->ipaddr, &home->ipaddr) == 0) &&
+		    (fr_ipaddr_cmp(&dst->src_ipaddr, &home->src_ipaddr) == 0)) return dst;
+	}
+
+	dst = talloc_zero(inst, replicate_dst_t);
+	if (!dst) {
+	oom:
+		REDEBUG("Out of memory");
+		return NULL;
+	}
+	dst->src_ipaddr = home->src_ipaddr;
+	dst->ipaddr = home->ipaddr;
+	dst->port = home->port;
+
+	for (i = 0; i < 2; i++) {
+		replicate_batch_t *batch;
+
+		batch = talloc_zero(dst, replicate_batch_t);
+		if (!batch) {
+			talloc_free(dst);
+			goto oom;
+		}
+		batch->data = talloc_array(batch, uint8_t, inst->queue.max_pending);
+		if (!batch->data) {
+			talloc_free(dst);
+			goto oom;
+		}
+
+		if (i == 0) {
+			dst->pending = batch;
+		} else {
+			dst->writing = batch;
+		}
+	}
+
+	dst->fd = fr_socket_client_udp(&home->src_ipaddr, &home->ipaddr, home->port, true);
+	if (dst->fd < 0) {
+		REDEBUG("Failed opening socket: %s", fr_strerror());
+		talloc_free(dst);
+		return NULL;
+	}
+
+	dst->next = inst->queue.dsts;
+	inst->queue.dsts = dst;
+
+	return dst;
+}
+
+/** Queue an encoded packet for a home server
+ *
+ * @return
+ *	- 0 if the packet was queued, or dropped.
+ *	- -1 on error.
+ */
+static int replicate_queue(rlm_replicate_t *inst, REQUEST *request, home_server_t const *home,
+			   RADIUS_PACKET const *packet)
+{
+	replicate_dst_t	*dst;
+	time_t		now;
+
+	pthread_mutex_lock(&inst->queue.mutex);
+
+	if (!inst->queue.running) {
+		if (pthread_create(&inst->queue.thread, NULL, replicate_sender, inst) != 0) {
+			pthread_mutex_unlock(&inst->queue.mutex);
+			REDEBUG("Failed creating sender thread: %s", fr_syserror(errno));
+			return -1;
+		}
+		inst->queue.running = true;
+	}
+
+	dst = replicate_dst_find(inst, request, home);
+	if (!dst) {
+		pthread_mutex_unlock(&inst->queue.mutex);
+		return -1;
+	}
+
+	if (inst->queue.rate_limit) {
+		now = time(NULL);
+		if (now != dst->second) {
+			dst->second = now;
+			dst->this_second = 0;
+		}
+
+		if (dst->this_second >= inst->queue.rate_limit) {
+			dst->limited++;
+			pthread_mutex_unlock(&inst->queue.mutex);
+			RDEBUG2("Rate limit reached for home server %s, dropping packet", home->log_name);
+			return 0;
+		}
+		dst->this_second++;
+	}
+
+	/*
+	 *	Replication is fire and forget, so we never make the
+	 *	worker wait for the sender.
+	 */
+	if ((dst->pending->used + packet->data_len) > inst->queue.max_pending) {
+		dst->dropped++;
+		pthread_mutex_unlock(&inst->queue.mutex);
+		RDEBUG2("Queue for home server %s is full, dropping packet", home->log_name);
+		return 0;
+	}
+
+	memcpy(dst->pending->data + dst->pending->used, packet->data, packet->data_len);
+	dst->pending->used += packet->data_len;
+	dst->pending->num++;
+
+	if (inst->queue.num_pending++ == 0) pthread_cond_signal(&inst->queue.wakeup);
+
+	pthread_mutex_unlock(&inst->queue.mutex);
+
+	return 0;
+}
+#endif
+
 #ifdef WITH_PROXY
 
 /** Allocate a request packet
@@ -97,6 +450,12 @@ error:
  * to forward authentication requests to multiple realms and process
  * the responses, this function will not allow you to do that.
  *
+ * The packet is encoded once, and only re-signed for each destination,
+ * unless the destinations have different secrets, or the packet is an
+ * Access-Request, which needs a new authenticator each time.  If the
+ * queue is enabled, the encoded packets are handed to the sender
+ * thread instead of being sent by the worker.
+ *
  * @param[in] instance 	of this module.
  * @param[in] request 	The current request.
  * @param[in] list	of attributes to copy to the duplicate packet.
@@ -107,10 +466,12 @@ error:
  *	- #RLM_MODULE_NOOP if no replications succeeded.
  *	- #RLM_MODULE_OK if successful.
  */
-static rlm_rcode_t replicate_packet(UNUSED void const *instance, REQUEST *request, pair_lists_t list, PW_CODE code)
+static rlm_rcode_t replicate_packet(void *instance, REQUEST *request, pair_lists_t list, PW_CODE code)
 {
+	rlm_replicate_t *inst = instance;
 	int rcode;
 	bool pass1 = true;
+	char const *encoded_secret = NULL;
 
 	vp_cursor_t cursor;
 	VALUE_PAIR *vp;
@@ -182,23 +543,26 @@ static rlm_rcode_t replicate_packet(UNUSED void const *instance, REQUEST *reques
 		 */
 		if (pass1) {
 			packet->id = fr_rand() & 0xff;
-			packet->sockfd = fr_socket(&home->src_ipaddr, 0);
-			if (packet->sockfd < 0) {
-				REDEBUG("Failed opening socket: %s", fr_strerror());
-				rcode = RLM_MODULE_FAIL;
-				goto done;
+			if (!inst->queue.enable) {
+				packet->sockfd = fr_socket(&home->src_ipaddr, 0);
+				if (packet->sockfd < 0) {
+					REDEBUG("Failed opening socket: %s", fr_strerror());
+					rcode = RLM_MODULE_FAIL;
+					goto done;
+				}
 			}
 			pass1 = false;
 		} else {
-			size_t i;
+			packet->id = (packet->id + 1) & 0xff;
 
-			for (i = 0; i < sizeof(packet->vector); i++) {
-				packet->vector[i] = fr_rand() & 0xff;
-			}
+			if (packet->code == PW_CODE_ACCESS_REQUEST) {
+				size_t i;
 
-			packet->id++;
-			TALLOC_FREE(packet->data);
-			packet->data_len = 0;
+				for (i = 0; i < sizeof(packet->vector); i++) {
+					packet->vector[i] = fr_rand() & 0xff;
+				}
+				encoded_secret = NULL;
+			}
 		}
 
 		/*
@@ -210,9 +574,37 @@ static rlm_rcode_t replicate_packet(UNUSED void const *instance, REQUEST *reques
 		packet->src_port = 0;
 
 		/*
-		 *	Encode, sign and then send the packet.
+		 *	Encode the packet if we haven't already encoded
+		 *	it with this secret, then sign it.
 		 */
+		if (!encoded_secret || (strcmp(encoded_secret, home->secret) != 0)) {
+			TALLOC_FREE(packet->data);
+			packet->data_len = 0;
+
+			if (fr_radius_encode(packet, NULL, home->secret) < 0) {
+			encode_error:
+				REDEBUG("Failed encoding packet: %s", fr_strerror());
+				rcode = RLM_MODULE_FAIL;
+				goto done;
+			}
+			encoded_secret = home->secret;
+		}
+		packet->data[1] = packet->id;
+		if (fr_radius_sign(packet, NULL, home->secret) < 0) goto encode_error;
+
 		RDEBUG("Replicating %s list to Realm \"%s\"", fr_int2str(pair_lists, list, "<INVALID>"), realm->name);
+
+#ifdef HAVE_PTHREAD_H
+		if (inst->queue.enable) {
+			if (replicate_queue(inst, request, home, packet) < 0) {
+				rcode = RLM_MODULE_FAIL;
+				goto done;
+			}
+			rcode = RLM_MODULE_OK;
+			continue;
+		}
+#endif
+
 		if (fr_radius_send(packet, NULL, home->secret) < 0) {
 			REDEBUG("Failed replicating packet: %s", fr_strerror());
 			rcode = RLM_MODULE_FAIL;
@@ -235,7 +627,7 @@ done:
 	return rcode;
 }
 #else
-static rlm_rcode_t replicate_packet(UNUSED void const *instance,
+static rlm_rcode_t replicate_packet(UNUSED void *instance,
 				    UNUSED REQUEST *request,
 				    UNUSED pair_lists_t list,
 				    UNUSED unsigned int code)
@@ -274,6 +666,74 @@ static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, UNUSED void *th
 }
 #endif
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_replicate_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	if (!inst->queue.enable) return 0;
+
+#if !defined(HAVE_PTHREAD_H) || !defined(WITH_PROXY)
+	cf_log_err_cs(conf, "Queueing replicated packets requires threads and proxy support");
+	return -1;
+#else
+	FR_INTEGER_BOUND_CHECK("interval", inst->queue.interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("interval", inst->queue.interval, <=, 1000);
+	FR_INTEGER_BOUND_CHECK("max_pending", inst->queue.max_pending, >=, MAX_PACKET_LEN);
+
+	if (pthread_mutex_init(&inst->queue.mutex, NULL) != 0) {
+		ERROR("%s: Failed initializing mutex: %s", inst->name, fr_syserror(errno));
+		return -1;
+	}
+
+	if (pthread_cond_init(&inst->queue.wakeup, NULL) != 0) {
+		ERROR("%s: Failed initializing condition variable: %s", inst->name, fr_syserror(errno));
+		pthread_mutex_destroy(&inst->queue.mutex);
+		inst->queue.enable = false;
+		return -1;
+	}
+
+	return 0;
+#endif
+}
+
+static int mod_detach(void *instance)
+{
+#if defined(HAVE_PTHREAD_H) && defined(WITH_PROXY)
+	rlm_replicate_t	*inst = instance;
+	replicate_dst_t	*dst;
+
+	if (!inst->queue.enable) return 0;
+
+	/*
+	 *	Send everything which is still queued.
+	 */
+	pthread_mutex_lock(&inst->queue.mutex);
+	inst->queue.stop = true;
+	pthread_cond_signal(&inst->queue.wakeup);
+	pthread_mutex_unlock(&inst->queue.mutex);
+
+	if (inst->queue.running) pthread_join(inst->queue.thread, NULL);
+
+	for (dst = inst->queue.dsts; dst; dst = dst->next) {
+		char buffer[INET6_ADDRSTRLEN];
+
+		INFO("%s: Replicated %" PRIu64 " packets to %s port %u, dropped %" PRIu64 ", rate limited %" PRIu64,
+		     inst->name, dst->sent, inet_ntop(dst->ipaddr.af, &dst->ipaddr.ipaddr, buffer, sizeof(buffer)),
+		     dst->port, dst->dropped, dst->limited);
+
+		close(dst->fd);
+	}
+
+	pthread_cond_destroy(&inst->queue.wakeup);
+	pthread_mutex_destroy(&inst->queue.mutex);
+#endif
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -288,6 +748,10 @@ rad_module_t rlm_replicate = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "replicate",
 	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_replicate_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_ACCOUNTING]	= mod_accounting,
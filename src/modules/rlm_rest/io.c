@@ -404,9 +404,10 @@ int rest_io_request_enqueue(rlm_rest_thread_t *t, REQUEST *request, void *handle
  */
 int rest_io_init(rlm_rest_thread_t *thread)
 {
-	CURLMcode	ret;
-	CURLM		*mandle;
-	char const	*option = "unknown";
+	rlm_rest_t const	*inst = thread->inst;
+	CURLMcode		ret;
+	CURLM			*mandle;
+	char const		*option = "unknown";
 
 	mandle = thread->mandle = curl_multi_init();
 	if (!thread->mandle) {
@@ -420,6 +421,25 @@ int rest_io_init(rlm_rest_thread_t *thread)
 	SET_OPTION(CURLMOPT_SOCKETFUNCTION, _rest_io_event_modify);
 	SET_OPTION(CURLMOPT_SOCKETDATA, thread);
 
+	/*
+	 *	All easy handles added to the multi handle share
+	 *	its connection cache, so connections are reused
+	 *	between requests serviced by this thread.
+	 */
+	if (inst->max_connections) SET_OPTION(CURLMOPT_MAXCONNECTS, (long)inst->max_connections);
+#if LIBCURL_VERSION_NUM >= 0x071e00	/* 7.30.0 */
+	if (inst->max_host_connections) SET_OPTION(CURLMOPT_MAX_HOST_CONNECTIONS, (long)inst->max_host_connections);
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072b00	/* 7.43.0 */
+	SET_OPTION(CURLMOPT_PIPELINING, inst->multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074300	/* 7.67.0 */
+	if (inst->max_concurrent_streams) {
+		SET_OPTION(CURLMOPT_MAX_CONCURRENT_STREAMS, (long)inst->max_concurrent_streams);
+	}
+#endif
+
 	return 0;
 
 error:
@@ -184,6 +184,29 @@ const FR_NAME_NUMBER http_auth_table[] = {
 	{  NULL , -1 }
 };
 
+/** Conversion table for HTTP protocol versions
+ *
+ * Maps the textual version config values to the libcurl CURL_HTTP_VERSION_*
+ * values.  Versions not supported by the libcurl we were built against
+ * are omitted.
+ */
+const FR_NAME_NUMBER http_version_table[] = {
+	{ "default",				CURL_HTTP_VERSION_NONE	},
+	{ "1.0",				CURL_HTTP_VERSION_1_0	},
+	{ "1.1",				CURL_HTTP_VERSION_1_1	},
+#if LIBCURL_VERSION_NUM >= 0x072100	/* 7.33.0 */
+	{ "2.0",				CURL_HTTP_VERSION_2_0	},
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00	/* 7.47.0 */
+	{ "2.0-tls",				CURL_HTTP_VERSION_2TLS	},
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100	/* 7.49.0 */
+	{ "2.0-prior-knowledge",		CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE },
+#endif
+
+	{  NULL , -1 }
+};
+
 /** Conversion table for "Content-Type" header values.
  *
  * Used by rest_response_header for parsing incoming headers.
@@ -223,6 +246,34 @@ typedef struct rest_custom_data {
 } rest_custom_data_t;
 
 #ifdef HAVE_JSON
+/** State of the streaming JSON encoder
+ *
+ * Attributes are encoded one name at a time into a small scratch buffer,
+ * which is copied out to libcurl's buffer as space permits.
+ */
+typedef struct rest_json_data {
+	rlm_rest_t const	*instance;	//!< This instance of rlm_rest.
+
+	VALUE_PAIR	**vps;		//!< Attributes to encode, grouped by name.
+	size_t		count;		//!< Number of attributes in vps.
+	size_t		next;		//!< Index of the next attribute to encode.
+
+	char		*buff;		//!< Encoded data not yet sent.
+	size_t		len;		//!< Length of the data in buff.
+	size_t		sent;		//!< How much of buff we've sent so far.
+} rest_json_data_t;
+
+/** State of the incremental JSON decoder
+ *
+ * Response data is fed to the tokenizer as it's received, so that the
+ * body doesn't need to be parsed again once the transfer completes.
+ */
+typedef struct rest_json_decoder {
+	json_tokener	*tok;		//!< Tokenizer state between calls.
+	json_object	*json;		//!< Root object, once the body has been parsed.
+	bool		error;		//!< Body is malformed.
+} rest_json_decoder_t;
+
 /** Flags to control the conversion of JSON values to VALUE_PAIRs.
  *
  * These fields are set when parsing the expanded format for value pairs in
@@ -295,6 +346,7 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED struct timeval con
 
 	curl_ctx->headers = NULL; /* CURL needs this to be NULL */
 	curl_ctx->request.instance = inst;
+	curl_ctx->response.instance = inst;
 
 	randle->ctx = curl_ctx;
 	randle->candle = candle;
@@ -513,14 +565,289 @@ no_space:
 }
 
 #ifdef HAVE_JSON
+/** Sort attributes by the position of the first attribute with the same name
+ *
+ */
+typedef struct {
+	VALUE_PAIR	*vp;
+	size_t		first;		//!< Index of the first attribute with the same da.
+	size_t		idx;		//!< Original position in the list.
+} rest_json_sort_t;
+
+static int rest_json_sort_da(void const *one, void const *two)
+{
+	rest_json_sort_t const *a = one, *b = two;
+
+	if (a->vp->da < b->vp->da) return -1;
+	if (a->vp->da > b->vp->da) return +1;
+
+	return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+static int rest_json_sort_first(void const *one, void const *two)
+{
+	rest_json_sort_t const *a = one, *b = two;
+
+	if (a->first != b->first) return (a->first > b->first) - (a->first < b->first);
+
+	return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+/** Build the list of attributes to encode
+ *
+ * Attributes with the same name are encoded as a single JSON key, so must
+ * be adjacent.  Order is otherwise preserved.
+ *
+ * @param[in] data	encoder state.
+ * @param[in] vps	list to encode.
+ */
+static void rest_json_data_init(rest_json_data_t *data, VALUE_PAIR **vps)
+{
+	vp_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	rest_json_sort_t	*sort;
+	size_t			i, count = 0;
+	rlm_rest_t const	*inst = data->instance;
+
+	for (vp = fr_pair_cursor_init(&cursor, vps); vp; vp = fr_pair_cursor_next(&cursor)) count++;
+
+	data->count = count;
+	data->next = 0;
+	data->len = data->sent = 0;
+	if (!count) return;
+
+	MEM(data->vps = talloc_array(data, VALUE_PAIR *, count));
+	MEM(sort = talloc_array(NULL, rest_json_sort_t, count));
+
+	for (vp = fr_pair_cursor_init(&cursor, vps), i = 0; vp; vp = fr_pair_cursor_next(&cursor), i++) {
+		sort[i].vp = vp;
+		sort[i].idx = i;
+	}
+
+	qsort(sort, count, sizeof(*sort), rest_json_sort_da);
+	for (i = 0; i < count; i++) {
+		sort[i].first = ((i > 0) && (sort[i - 1].vp->da == sort[i].vp->da)) ? sort[i - 1].first : sort[i].idx;
+	}
+	qsort(sort, count, sizeof(*sort), rest_json_sort_first);
+
+	for (i = 0; i < count; i++) data->vps[i] = sort[i].vp;
+	talloc_free(sort);
+}
+
+/** Append raw data to the scratch buffer
+ *
+ */
+static void rest_json_append(rest_json_data_t *data, char const *in, size_t inlen)
+{
+	rlm_rest_t const	*inst = data->instance;
+	size_t			alloc = talloc_array_length(data->buff);
+
+	if ((data->len + inlen) > alloc) {
+		alloc = (alloc * 2) > (data->len + inlen) ? (alloc * 2) : (data->len + inlen);
+		MEM(data->buff = talloc_realloc(data, data->buff, char, alloc));
+	}
+	memcpy(data->buff + data->len, in, inlen);
+	data->len += inlen;
+}
+
+/** Append a quoted and escaped JSON string to the scratch buffer
+ *
+ */
+static void rest_json_append_string(rest_json_data_t *data, char const *in, size_t inlen)
+{
+	char const	*p = in, *end = in + inlen, *q;
+	char		esc[7];
+
+	rest_json_append(data, "\"", 1);
+	while (p < end) {
+		/*
+		 *	Copy runs of characters which don't need escaping
+		 */
+		for (q = p; (q < end) && (*q != '"') && (*q != '\\') && ((uint8_t)*q >= 0x20); q++);
+		if (q > p) rest_json_append(data, p, q - p);
+		if (q == end) break;
+
+		switch (*q) {
+		case '"':
+			rest_json_append(data, "\\\"", 2);
+			break;
+
+		case '\\':
+			rest_json_append(data, "\\\\", 2);
+			break;
+
+		case '\b':
+			rest_json_append(data, "\\b", 2);
+			break;
+
+		case '\f':
+			rest_json_append(data, "\\f", 2);
+			break;
+
+		case '\n':
+			rest_json_append(data, "\\n", 2);
+			break;
+
+		case '\r':
+			rest_json_append(data, "\\r", 2);
+			break;
+
+		case '\t':
+			rest_json_append(data, "\\t", 2);
+			break;
+
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", (uint8_t)*q);
+			rest_json_append(data, esc, 6);
+			break;
+		}
+		p = q + 1;
+	}
+	rest_json_append(data, "\"", 1);
+}
+
+/** Append the JSON representation of a value
+ *
+ * Produces the same output as json_object_from_value_box.
+ */
+static void rest_json_append_value(rest_json_data_t *data, value_box_t const *value)
+{
+	rlm_rest_t const	*inst = data->instance;
+	char			buffer[256];
+	char			*tmp;
+	size_t			len;
+
+	switch (value->type) {
+	case PW_TYPE_STRING:
+		rest_json_append_string(data, value->datum.strvalue, value->length);
+		return;
+
+	case PW_TYPE_BOOLEAN:
+		if (value->datum.byte) {
+			rest_json_append(data, "true", 4);
+		} else {
+			rest_json_append(data, "false", 5);
+		}
+		return;
+
+	case PW_TYPE_BYTE:
+		len = snprintf(buffer, sizeof(buffer), "%u", (unsigned int) value->datum.byte);
+		break;
+
+	case PW_TYPE_SHORT:
+		len = snprintf(buffer, sizeof(buffer), "%u", (unsigned int) value->datum.ushort);
+		break;
+
+	case PW_TYPE_INTEGER:
+		len = snprintf(buffer, sizeof(buffer), "%u", value->datum.integer);
+		break;
+
+	case PW_TYPE_INTEGER64:
+		if (value->datum.integer64 > INT64_MAX) goto do_string;
+		len = snprintf(buffer, sizeof(buffer), "%" PRIu64, value->datum.integer64);
+		break;
+
+	case PW_TYPE_SIGNED:
+		len = snprintf(buffer, sizeof(buffer), "%d", value->datum.sinteger);
+		break;
+
+	default:
+	do_string:
+		len = value_box_snprint(buffer, sizeof(buffer), value, '\0');
+		if (!is_truncated(len, sizeof(buffer))) {
+			rest_json_append_string(data, buffer, len);
+			return;
+		}
+
+		MEM(tmp = value_box_asprint(NULL, value, '\0'));
+		rest_json_append_string(data, tmp, talloc_array_length(tmp) - 1);
+		talloc_free(tmp);
+		return;
+	}
+
+	rest_json_append(data, buffer, len);
+}
+
+/** Encode all the attributes with the next name into the scratch buffer
+ *
+ * @param[in] data	encoder state.
+ * @return
+ *	- true if more data was encoded.
+ *	- false if there are no more attributes.
+ */
+static bool rest_json_encode_next(rest_json_data_t *data)
+{
+	VALUE_PAIR		*vp;
+	fr_dict_attr_t const	*da;
+	fr_dict_enum_t const	*dv;
+	char const		*type;
+	size_t			i, start = data->next, end;
+
+	data->len = data->sent = 0;
+
+	if (start > data->count) return false;
+
+	/*
+	 *	Finished the last attribute, close the object
+	 */
+	if (start == data->count) {
+		if (!start) rest_json_append(data, "{", 1);
+		rest_json_append(data, "}", 1);
+		data->next++;
+		return true;
+	}
+
+	da = data->vps[start]->da;
+	for (end = start + 1; (end < data->count) && (data->vps[end]->da == da); end++);
+
+	rest_json_append(data, start ? "," : "{", 1);
+	rest_json_append_string(data, da->name, strlen(da->name));
+
+	type = fr_int2str(dict_attr_types, data->vps[start]->vp_type, "<INVALID>");
+	rest_json_append(data, ":{\"type\":", 9);
+	rest_json_append_string(data, type, strlen(type));
+
+	rest_json_append(data, ",\"value\":[", 10);
+	for (i = start; i < end; i++) {
+		if (i > start) rest_json_append(data, ",", 1);
+		rest_json_append_value(data, &data->vps[i]->data);
+	}
+	rest_json_append(data, "]", 1);
+
+	/*
+	 *	Add a mapping array
+	 */
+	if (da->flags.has_value) {
+		rest_json_append(data, ",\"mapping\":[", 12);
+		for (i = start; i < end; i++) {
+			vp = data->vps[i];
+
+			if (i > start) rest_json_append(data, ",", 1);
+
+			dv = fr_dict_enum_by_da(NULL, vp->da, vp->vp_integer);
+			if (dv) {
+				rest_json_append_string(data, dv->name, strlen(dv->name));
+			} else {
+				rest_json_append(data, "null", 4);
+			}
+		}
+		rest_json_append(data, "]", 1);
+	}
+	rest_json_append(data, "}", 1);
+
+	data->next = end;
+
+	return true;
+}
+
 /** Encodes VALUE_PAIR linked list in JSON format
  *
  * This is a stream function matching the rest_read_t prototype. Multiple
  * successive calls will return additional encoded VALUE_PAIRs.
  *
- * Only complete attribute headers
- * @verbatim "<name>":{"type":"<type>","value":[' @endverbatim
- * and complete attribute values will be written to ptr.
+ * Attributes are written directly from the request list, without building
+ * an intermediary JSON tree.  Each key is encoded into a small scratch
+ * buffer, and the data is split between calls as needed.
  *
  * If an attribute occurs multiple times in the request the attribute values
  * will be concatenated into a single value array.
@@ -554,39 +881,46 @@ no_space:
 static size_t rest_encode_json(void *out, size_t size, size_t nmemb, void *userdata)
 {
 	rlm_rest_request_t	*ctx = userdata;
-	REQUEST *request = ctx->request;
-	rest_custom_data_t *data = ctx->encoder;
+	REQUEST			*request = ctx->request;
+	rest_json_data_t	*data = ctx->encoder;
 
-	size_t freespace = (size * nmemb) - 1;		/* account for the \0 byte here */
-	size_t len;
-	size_t to_copy;
-	const char *encoded;
+	char			*p = out;
+	size_t			freespace = (size * nmemb) - 1;		/* account for the \0 byte here */
+	size_t			len;
 
 	rad_assert(freespace > 0);
 
-	if (ctx->state == READ_STATE_INIT) {
-		encoded = fr_json_afrom_pair_list(data, &request->packet->vps, NULL);
-		if (!encoded) return -1;
-
-		data->start = data->p = encoded;
-		data->len = strlen(encoded);
+	/* Allow manual chunking */
+	if ((ctx->chunk) && (ctx->chunk <= freespace)) {
+		freespace = (ctx->chunk - 1);
+	}
 
-		RDEBUG3("JSON Data: %s", encoded);
-		RDEBUG3("Returning %zd bytes of JSON data", data->len);
+	if (ctx->state == READ_STATE_END) return 0;
 
+	if (ctx->state == READ_STATE_INIT) {
+		rest_json_data_init(data, &request->packet->vps);
 		ctx->state = READ_STATE_ATTR_BEGIN;
 	}
 
-	to_copy = data->len - (data->p - data->start);
-	len = to_copy > freespace ? freespace : to_copy;
+	while (freespace > 0) {
+		if ((data->sent == data->len) && !rest_json_encode_next(data)) {
+			ctx->state = READ_STATE_END;
+			break;
+		}
 
-	if (len == 0) {
-		return 0;
-	} else {
-		memcpy(out, data->p, len);
-		data->p += len;
-		return len;
+		len = data->len - data->sent;
+		if (len > freespace) len = freespace;
+
+		memcpy(p, data->buff + data->sent, len);
+		data->sent += len;
+		p += len;
+		freespace -= len;
 	}
+
+	len = p - (char *)out;
+	RDEBUG3("Returning %zd bytes of JSON data", len);
+
+	return len;
 }
 #endif
 
@@ -1205,6 +1539,9 @@ static int json_pair_make(rlm_rest_t const *instance, rlm_rest_section_t const *
  * which decrements the reference count of the root node by one, and frees
  * the entire tree.
  *
+ * If the body was parsed as it was received, the tree built by
+ * rest_response_body_json is used instead.
+ *
  * @see rest_encode_json
  * @see json_pair_make
  *
@@ -1219,26 +1556,46 @@ static int json_pair_make(rlm_rest_t const *instance, rlm_rest_section_t const *
  *	- -1 on unrecoverable error.
  */
 static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const *section,
-			    REQUEST *request, UNUSED void *handle, char *raw, UNUSED size_t rawlen)
+			    REQUEST *request, void *handle, char *raw, UNUSED size_t rawlen)
 {
-	char const *p = raw;
+	rlm_rest_curl_context_t	*ctx = ((rlm_rest_handle_t *)handle)->ctx;
+	rest_json_decoder_t	*decoder = ctx->response.decoder;
+	char const		*p = raw;
 
 	struct json_object *json;
 
 	int ret;
 
+	/*
+	 *  Already parsed as the data arrived
+	 */
+	if (decoder && decoder->json) {
+		json = decoder->json;
+		decoder->json = NULL;
+		goto parsed;
+	}
+
 	/*
 	 *  Empty response?
 	 */
 	while (isspace(*p)) p++;
 	if (*p == '\0') return 0;
 
-	json = json_tokener_parse(p);
-	if (!json) {
+	if (decoder && decoder->error) {
+	malformed:
 		REDEBUG("Malformed JSON data \"%s\"", raw);
 		return -1;
 	}
 
+	/*
+	 *  The tokenizer may still be waiting for the end of a
+	 *  top level number or literal.
+	 */
+	json = json_tokener_parse(p);
+	if (!json) goto malformed;
+
+parsed:
+
 	ret = json_pair_make(instance, section, request, json, 0, REST_BODY_MAX_ATTRS);
 
 	/*
@@ -1457,10 +1814,52 @@ malformed:
 	return (t - s);
 }
 
+#ifdef HAVE_JSON
+static int _rest_json_decoder_free(rest_json_decoder_t *decoder)
+{
+	if (decoder->tok) json_tokener_free(decoder->tok);
+	if (decoder->json) json_object_put(decoder->json);
+
+	return 0;
+}
+
+/** Feed JSON body data to the tokenizer as it's received
+ *
+ * @param[in] ctx	response context.
+ * @param[in] in	body data.
+ * @param[in] inlen	length of the body data.
+ */
+static void rest_response_body_json(rlm_rest_response_t *ctx, char const *in, size_t inlen)
+{
+	rlm_rest_t const	*inst = ctx->instance;
+	rest_json_decoder_t	*decoder = ctx->decoder;
+
+	if (!decoder) {
+		MEM(decoder = talloc_zero(NULL, rest_json_decoder_t));
+		talloc_set_destructor(decoder, _rest_json_decoder_free);
+		ctx->decoder = decoder;
+
+		decoder->tok = json_tokener_new();
+		if (!decoder->tok) decoder->error = true;
+	}
+
+	/*
+	 *  Anything after the root object is ignored, the same
+	 *  as json_tokener_parse.
+	 */
+	if (decoder->json || decoder->error) return;
+
+	decoder->json = json_tokener_parse_ex(decoder->tok, in, inlen);
+	if (!decoder->json && (json_tokener_get_error(decoder->tok) != json_tokener_continue)) decoder->error = true;
+}
+#endif
+
+
 /** Processes incoming HTTP body data from libcurl.
  *
  * Writes incoming body data to an intermediary buffer for later parsing by
- * one of the decode functions.
+ * one of the decode functions.  JSON data is also passed to the tokenizer
+ * as it arrives.
  *
  * @param[in] ptr Char buffer where inbound header data is written
  * @param[in] size Multiply by nmemb to get the length of ptr.
@@ -1527,6 +1926,9 @@ static size_t rest_response_body(void *ptr, size_t size, size_t nmemb, void *use
 		strlcpy(ctx->buffer + ctx->used, p, t + 1);
 		ctx->used += t;
 
+#ifdef HAVE_JSON
+		if (ctx->type == HTTP_BODY_JSON) rest_response_body_json(ctx, p, t);
+#endif
 		break;
 	}
 
@@ -1750,6 +2152,19 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 	SET_OPTION(CURLOPT_PROTOCOLS, (CURLPROTO_HTTP | CURLPROTO_HTTPS));
 #endif
 
+	/*
+	 *	Connection reuse and HTTP/2
+	 */
+	if (inst->http_version != CURL_HTTP_VERSION_NONE) SET_OPTION(CURLOPT_HTTP_VERSION, inst->http_version);
+#if LIBCURL_VERSION_NUM >= 0x072b00	/* 7.43.0 */
+	/*
+	 *	Wait for a connection to the host which may be
+	 *	multiplexed, instead of opening a new one.
+	 */
+	if (inst->multiplex) SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+	if (inst->share) SET_OPTION(CURLOPT_SHARE, inst->share);
+
 	/*
 	 *	FreeRADIUS custom headers
 	 */
@@ -2006,9 +2421,11 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 #ifdef HAVE_JSON
 	case HTTP_BODY_JSON:
 	{
-		rest_custom_data_t *data;
+		rest_json_data_t *data;
 
-		data = talloc_zero(request, rest_custom_data_t);
+		data = talloc_zero(request, rest_json_data_t);
+		if (!data) return -1;
+		data->instance = inst;
 		ctx->request.encoder = data;
 
 		rest_request_init(request, &ctx->request);
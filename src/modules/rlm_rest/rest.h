@@ -30,6 +30,10 @@ RCSIDH(other_h, "$Id$")
 #define CURL_NO_OLDIES 1
 #include <curl/curl.h>
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 /*
  *	The common JSON library (also tells us if we have json-c)
  */
@@ -98,6 +102,8 @@ extern const FR_NAME_NUMBER http_body_type_table[];
 
 extern const FR_NAME_NUMBER http_content_type_table[];
 
+extern const FR_NAME_NUMBER http_version_table[];
+
 /*
  *	Structure for section configuration
  */
@@ -149,6 +155,20 @@ typedef struct {
 
 	fr_connection_pool_t	*pool;		//!< Pointer to the connection pool.
 
+	char const		*http_version_str;	//!< The string version of the HTTP protocol version.
+	long			http_version;		//!< CURL_HTTP_VERSION_* to negotiate.
+	bool			multiplex;		//!< Multiplex transfers to the same host over a
+							//!< single HTTP/2 connection.
+	uint32_t		max_connections;	//!< Size of each thread's connection cache.
+	uint32_t		max_host_connections;	//!< Maximum connections to a single host, per thread.
+	uint32_t		max_concurrent_streams;	//!< Maximum streams per HTTP/2 connection.
+	bool			share_sessions;		//!< Share DNS and TLS session caches between threads.
+
+	CURLSH			*share;			//!< DNS and TLS session caches shared between threads.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		share_mutex[CURL_LOCK_DATA_LAST];	//!< Protect the shared caches.
+#endif
+
 	rlm_rest_section_t	xlat;		//!< Configuration specific to xlat.
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
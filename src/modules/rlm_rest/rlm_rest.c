@@ -88,9 +88,20 @@ static const CONF_PARSER xlat_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER http_config[] = {
+	{ FR_CONF_OFFSET("version", PW_TYPE_STRING, rlm_rest_t, http_version_str), .dflt = "default" },
+	{ FR_CONF_OFFSET("multiplex", PW_TYPE_BOOLEAN, rlm_rest_t, multiplex), .dflt = "yes" },
+	{ FR_CONF_OFFSET("max_connections", PW_TYPE_INTEGER, rlm_rest_t, max_connections), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_host_connections", PW_TYPE_INTEGER, rlm_rest_t, max_host_connections), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_concurrent_streams", PW_TYPE_INTEGER, rlm_rest_t, max_concurrent_streams), .dflt = "100" },
+	{ FR_CONF_OFFSET("share_sessions", PW_TYPE_BOOLEAN, rlm_rest_t, share_sessions), .dflt = "yes" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_DEPRECATED("connect_timeout", PW_TYPE_TIMEVAL, rlm_rest_t, connect_timeout) },
 	{ FR_CONF_OFFSET("connect_proxy", PW_TYPE_STRING, rlm_rest_t, connect_proxy) },
+	{ FR_CONF_POINTER("http", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) http_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -353,6 +364,33 @@ finish:
 }
 #endif
 
+/** Reserve a handle, or wait for one to become free
+ *
+ * @param[out] out	Where to write the handle.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] resume	Called when the request is resumed after waiting.
+ *			Should call the module method again.
+ * @return
+ *	- RLM_MODULE_OK if a handle was reserved.
+ *	- RLM_MODULE_YIELD if the request is waiting for a handle.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t rlm_rest_handle_get(void **out, rlm_rest_thread_t *t, REQUEST *request,
+				       fr_unlang_resume_t resume)
+{
+	switch (fr_connection_get_async(out, t->pool, request)) {
+	case 0:
+		return RLM_MODULE_OK;
+
+	case 1:
+		return unlang_yield(request, resume, NULL, NULL);
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
 static rlm_rcode_t mod_authorize_result(REQUEST *request, void *instance, void *thread, void *ctx)
 {
 	rlm_rest_t const		*inst = instance;
@@ -435,6 +473,8 @@ finish:
 	return rcode;
 }
 
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
 /*
  *	Find the named user in this modules database.  Create the set
  *	of attribute-value pairs to check and reply with for this user
@@ -448,12 +488,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread,
 	rlm_rest_section_t const	*section = &inst->authorize;
 
 	void				*handle;
+	rlm_rcode_t			rcode;
 	int				ret;
 
 	if (!section->name) return RLM_MODULE_NOOP;
 
-	handle = fr_connection_get(t->pool, request);
-	if (!handle) return RLM_MODULE_FAIL;
+	rcode = rlm_rest_handle_get(&handle, t, request, mod_authorize_resume);
+	if (rcode != RLM_MODULE_OK) return rcode;
 
 	ret = rlm_rest_perform(instance, thread, section, handle, request, NULL, NULL);
 	if (ret < 0) {
@@ -466,6 +507,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread,
 	return unlang_yield(request, mod_authorize_result, rest_io_action, handle);
 }
 
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, void *thread, UNUSED void *ctx)
+{
+	return mod_authorize(instance, thread, request);
+}
+
 static rlm_rcode_t mod_authenticate_result(REQUEST *request, void *instance, void *thread, void *ctx)
 {
 	rlm_rest_t const		*inst = instance;
@@ -548,6 +594,8 @@ finish:
 	return rcode;
 }
 
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
 /*
  *	Authenticate the user with the given password.
  */
@@ -556,8 +604,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *threa
 	rlm_rest_t const		*inst = instance;
 	rlm_rest_thread_t		*t = thread;
 	rlm_rest_section_t const	*section = &inst->authenticate;
-	rlm_rest_handle_t		*handle;
+	void				*handle;
 
+	rlm_rcode_t			rcode;
 	int				ret;
 
 	VALUE_PAIR const		*username;
@@ -579,8 +628,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *threa
 		return RLM_MODULE_INVALID;
 	}
 
-	handle = fr_connection_get(t->pool, request);
-	if (!handle) return RLM_MODULE_FAIL;
+	rcode = rlm_rest_handle_get(&handle, t, request, mod_authenticate_resume);
+	if (rcode != RLM_MODULE_OK) return rcode;
 
 	ret = rlm_rest_perform(instance, thread, section,
 			       handle, request, username->vp_strvalue, password->vp_strvalue);
@@ -594,6 +643,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *threa
 	return unlang_yield(request, mod_authenticate_result, NULL, handle);
 }
 
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, void *thread, UNUSED void *ctx)
+{
+	return mod_authenticate(instance, thread, request);
+}
+
 static rlm_rcode_t mod_accounting_result(REQUEST *request, void *instance, void *thread, void *ctx)
 {
 	rlm_rest_t const		*inst = instance;
@@ -644,6 +698,8 @@ finish:
 	return rcode;
 }
 
+static rlm_rcode_t mod_accounting_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
 /*
  *	Send accounting info to a REST API endpoint
  */
@@ -654,12 +710,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread,
 	rlm_rest_section_t const	*section = &inst->accounting;
 
 	void				*handle;
+	rlm_rcode_t			rcode;
 	int				ret;
 
 	if (!section->name) return RLM_MODULE_NOOP;
 
-	handle = fr_connection_get(t->pool, request);
-	if (!handle) return RLM_MODULE_FAIL;
+	rcode = rlm_rest_handle_get(&handle, t, request, mod_accounting_resume);
+	if (rcode != RLM_MODULE_OK) return rcode;
 
 	ret = rlm_rest_perform(inst, thread, section, handle, request, NULL, NULL);
 	if (ret < 0) {
@@ -672,6 +729,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread,
 	return unlang_yield(request, mod_accounting_result, NULL, handle);
 }
 
+static rlm_rcode_t mod_accounting_resume(REQUEST *request, void *instance, void *thread, UNUSED void *ctx)
+{
+	return mod_accounting(instance, thread, request);
+}
+
 static rlm_rcode_t mod_post_auth_result(REQUEST *request, void *instance, void *thread, void *ctx)
 {
 	rlm_rest_t const		*inst = instance;
@@ -722,6 +784,8 @@ finish:
 	return rcode;
 }
 
+static rlm_rcode_t mod_post_auth_resume(REQUEST *request, void *instance, void *thread, void *ctx);
+
 /*
  *	Send post-auth info to a REST API endpoint
  */
@@ -732,12 +796,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread,
 	rlm_rest_section_t const	*section = &inst->post_auth;
 
 	void				*handle;
+	rlm_rcode_t			rcode;
 	int				ret;
 
 	if (!section->name) return RLM_MODULE_NOOP;
 
-	handle = fr_connection_get(t->pool, request);
-	if (!handle) return RLM_MODULE_FAIL;
+	rcode = rlm_rest_handle_get(&handle, t, request, mod_post_auth_resume);
+	if (rcode != RLM_MODULE_OK) return rcode;
 
 	ret = rlm_rest_perform(inst, thread, section, handle, request, NULL, NULL);
 	if (ret < 0) {
@@ -751,6 +816,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread,
 	return unlang_yield(request, mod_post_auth_result, NULL, handle);
 }
 
+static rlm_rcode_t mod_post_auth_resume(REQUEST *request, void *instance, void *thread, UNUSED void *ctx)
+{
+	return mod_post_auth(instance, thread, request);
+}
+
 static int parse_sub_section(CONF_SECTION *parent, CONF_PARSER const *config_items,
 			     rlm_rest_section_t *config, char const *name)
 {
@@ -916,6 +986,12 @@ static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_e
 		return -1;
 	}
 
+	/*
+	 *	The pool is only used by this thread, so requests
+	 *	can wait for connections instead of failing.
+	 */
+	fr_connection_pool_thread_local(t->pool, el, unlang_resumable);
+
 	return rest_io_init(t);
 }
 
@@ -937,6 +1013,62 @@ static int mod_thread_detach(void *thread)
 	return 0;
 }
 
+#ifdef HAVE_PTHREAD_H
+static void _rest_share_lock(UNUSED CURL *candle, curl_lock_data data, UNUSED curl_lock_access access, void *uctx)
+{
+	rlm_rest_t *inst = uctx;
+
+	pthread_mutex_lock(&inst->share_mutex[data]);
+}
+
+static void _rest_share_unlock(UNUSED CURL *candle, curl_lock_data data, void *uctx)
+{
+	rlm_rest_t *inst = uctx;
+
+	pthread_mutex_unlock(&inst->share_mutex[data]);
+}
+
+/** Create the DNS and TLS session caches shared between threads
+ *
+ * Connections are still per-thread, but new connections can skip the
+ * DNS lookup, and resume TLS sessions negotiated by other threads,
+ * which avoids most of the cost of a new TLS connection.
+ *
+ * @param[in] inst	of rlm_rest.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rest_share_init(rlm_rest_t *inst)
+{
+	CURLSHcode	ret;
+	size_t		i;
+
+	for (i = 0; i < (sizeof(inst->share_mutex) / sizeof(*inst->share_mutex)); i++) {
+		pthread_mutex_init(&inst->share_mutex[i], NULL);
+	}
+
+	inst->share = curl_share_init();
+	if (!inst->share) {
+		ERROR("Curl share handle instantiation failed");
+		return -1;
+	}
+
+	if (((ret = curl_share_setopt(inst->share, CURLSHOPT_LOCKFUNC, _rest_share_lock)) != CURLSHE_OK) ||
+	    ((ret = curl_share_setopt(inst->share, CURLSHOPT_UNLOCKFUNC, _rest_share_unlock)) != CURLSHE_OK) ||
+	    ((ret = curl_share_setopt(inst->share, CURLSHOPT_USERDATA, inst)) != CURLSHE_OK) ||
+	    ((ret = curl_share_setopt(inst->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS)) != CURLSHE_OK) ||
+	    ((ret = curl_share_setopt(inst->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION)) != CURLSHE_OK)) {
+		ERROR("Failed configuring curl share handle: %s (%i)", curl_share_strerror(ret), ret);
+		curl_share_cleanup(inst->share);
+		inst->share = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -977,6 +1109,53 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	inst->http_version = fr_str2int(http_version_table, inst->http_version_str, -1);
+	if (inst->http_version < 0) {
+		cf_log_err_cs(conf, "Invalid HTTP version \"%s\" (or not supported by libcurl " LIBCURL_VERSION ")",
+			      inst->http_version_str);
+		return -1;
+	}
+
+	if ((inst->http_version != CURL_HTTP_VERSION_NONE) && (inst->http_version != CURL_HTTP_VERSION_1_0) &&
+	    (inst->http_version != CURL_HTTP_VERSION_1_1) &&
+	    !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2)) {
+		cf_log_err_cs(conf, "HTTP version \"%s\" requested, but libcurl was built without HTTP/2 support",
+			      inst->http_version_str);
+		return -1;
+	}
+
+#if LIBCURL_VERSION_NUM < 0x072b00	/* 7.43.0 */
+	if (inst->multiplex) {
+		WARN("rlm_rest (%s) - libcurl " LIBCURL_VERSION " does not support multiplexing", inst->xlat_name);
+		inst->multiplex = false;
+	}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->share_sessions && (rest_share_init(inst) < 0)) return -1;
+#endif
+
+	return 0;
+}
+
+/** Free the caches shared between threads
+ *
+ */
+static int mod_detach(void *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	rlm_rest_t	*inst = instance;
+	size_t		i;
+
+	if (inst->share) {
+		curl_share_cleanup(inst->share);
+
+		for (i = 0; i < (sizeof(inst->share_mutex) / sizeof(*inst->share_mutex)); i++) {
+			pthread_mutex_destroy(&inst->share_mutex[i]);
+		}
+	}
+#endif
+
 	return 0;
 }
 
@@ -1070,6 +1249,7 @@ rad_module_t rlm_rest = {
 	.unload			= mod_unload,
 	.bootstrap		= mod_bootstrap,
 	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
 	.thread_instantiate	= mod_thread_instantiate,
 	.thread_detach		= mod_thread_detach,
 	.methods = {
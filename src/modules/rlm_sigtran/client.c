@@ -25,6 +25,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/eap.aka.h>
 #include <freeradius-devel/eap.sim.h>
@@ -128,27 +129,111 @@ int sigtran_client_thread_register(void)
 }
 
 /** Signal that libosmo should unregister the other side of the pipe
+ *
+ * The event loop fails any transactions still outstanding for this thread,
+ * and writes them back before acknowledging the unregistration.  Those
+ * are read here, and freed if their requests were cancelled.
  *
  * @param req_pipe_fd The rlm_sigtran side of the req_pipe.
  */
 int sigtran_client_thread_unregister(int req_pipe_fd)
 {
 	sigtran_transaction_t	*txn;
+	void			*ptr;
+	ssize_t			len;
 
 	txn = talloc_zero(NULL, sigtran_transaction_t);
 	txn->request.type = SIGTRAN_REQUEST_THREAD_UNREGISTER;
 
-	if ((sigtran_client_do_ctrl_transaction(txn) < 0) || (txn->response.type != SIGTRAN_RESPONSE_OK)) {
+	if ((fr_blocking(req_pipe_fd) < 0) || (write(req_pipe_fd, &txn, sizeof(txn)) < 0)) {
+		ERROR("req_pipe (%i) write failed: %s", req_pipe_fd, fr_syserror(errno));
+	error:
 		ERROR("Failed unregistering thread");
 		talloc_free(txn);
+		close(req_pipe_fd);
 		return -1;
 	}
+
+	for (;;) {
+		sigtran_transaction_t *found;
+
+		len = read(req_pipe_fd, &ptr, sizeof(ptr));
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("req_pipe (%i) read failed : %s", req_pipe_fd, fr_syserror(errno));
+			goto error;
+		}
+		if (len != sizeof(ptr)) {
+			ERROR("req_pipe (%i) data too short, expected %zu bytes, got %zi bytes",
+			      req_pipe_fd, sizeof(ptr), len);
+			goto error;
+		}
+		if (ptr == txn) break;
+
+		/*
+		 *	Late result for a request which is still
+		 *	around, it frees the transaction when it's
+		 *	cancelled.
+		 */
+		found = talloc_get_type_abort(ptr, sigtran_transaction_t);
+		if (found->ctx.request) {
+			found->ctx.done = true;
+			continue;
+		}
+		talloc_free(found);
+	}
+
+	if (txn->response.type != SIGTRAN_RESPONSE_OK) goto error;
+
 	talloc_free(txn);
 	close(req_pipe_fd);
 
 	return 0;
 }
 
+/** Resume the requests of completed transactions
+ *
+ * Called by the worker's event loop when MAP results are written to its req_pipe.
+ */
+void sigtran_client_thread_read(UNUSED fr_event_list_t *el, int fd, UNUSED void *ctx)
+{
+	sigtran_transaction_t	*txns[32];
+	ssize_t			slen;
+	size_t			i;
+
+	slen = read(fd, txns, sizeof(txns));
+	if (slen < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN)) return;
+
+		ERROR("req_pipe (%i) read failed : %s", fd, fr_syserror(errno));
+		return;
+	}
+	rad_assert((slen % sizeof(txns[0])) == 0);
+
+	for (i = 0; i < (slen / sizeof(txns[0])); i++) {
+		sigtran_transaction_t *txn;
+
+		if (!txns[i]) {
+			ERROR("req_pipe (%i) received NULL transaction", fd);
+			continue;
+		}
+		txn = talloc_get_type_abort(txns[i], sigtran_transaction_t);
+
+		/*
+		 *	Request was cancelled while the MAP
+		 *	transaction was outstanding.
+		 */
+		if (!txn->ctx.request) {
+			talloc_free(txn);
+			continue;
+		}
+
+		txn->ctx.done = true;
+		unlang_resumable(txn->ctx.request);
+	}
+}
+
 /** Create a new connection
  *
  * Register the required links for a connection.
@@ -198,20 +283,22 @@ int sigtran_client_link_down(sigtran_conn_t const **conn)
 	return 0;
 }
 
-/** Create a MAP_SEND_AUTH_INFO request
+/** Create a MAP_SEND_AUTH_INFO request, and send it to the event loop
+ *
+ * The request is marked resumable when the result is written to the req_pipe,
+ * and the result must then be collected with #sigtran_client_map_send_auth_info_result.
  *
  * @param inst		of rlm_sigtran.
  * @param request	The current request.
  * @param conn		current connection.
- * @param fd		file descriptor on which the transaction is done
+ * @param fd		The worker's side of the req_pipe.
  * @return
- *	- 0 on success.
- *	- -1 on failure.
+ *	- The outstanding transaction.
+ *	- NULL on failure.
  */
-rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *request,
-					      sigtran_conn_t const *conn, int fd)
+sigtran_transaction_t *sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST *request,
+							 sigtran_conn_t const *conn, int fd)
 {
-	rlm_rcode_t				rcode;
 	sigtran_transaction_t			*txn;
 	sigtran_map_send_auth_info_req_t	*req;
 	char					*imsi;
@@ -219,6 +306,10 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 
 	rad_assert((fd != ctrl_pipe[0]) && (fd != ctrl_pipe[1]));
 
+	/*
+	 *	Written to by the event loop, so not
+	 *	parented by the request.
+	 */
 	txn = talloc_zero(NULL, sigtran_transaction_t);
 	txn->request.type = SIGTRAN_REQUEST_MAP_SEND_AUTH_INFO;
 
@@ -229,7 +320,7 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 		ERROR("Failed retrieving version");
 	error:
 		talloc_free(txn);
-		return RLM_MODULE_FAIL;
+		return NULL;
 	}
 
 	switch (req->version) {
@@ -261,11 +352,34 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 		goto error;
 	}
 
-	if (sigtran_client_do_transaction(fd, txn) < 0) {
-		ERROR("Failed sending MAP_SEND_AUTH_INFO request");
+	/*
+	 *	Writes of less than PIPE_BUF are atomic, so this
+	 *	either succeeds or fails, even though the pipe is
+	 *	non-blocking.
+	 */
+	if (write(fd, &txn, sizeof(txn)) < 0) {
+		ERROR("Failed sending MAP_SEND_AUTH_INFO request: %s", fr_syserror(errno));
 		goto error;
 	}
 
+	return txn;
+}
+
+/** Convert the vectors in a MAP_SEND_AUTH_INFO response to control attributes, and free the transaction
+ *
+ * @param request	The current request.
+ * @param txn		which has been completed by the event loop.
+ * @return
+ *	- RLM_MODULE_OK if vectors were added.
+ *	- RLM_MODULE_NOOP, RLM_MODULE_NOTFOUND, or RLM_MODULE_FAIL depending
+ *	  on the response.
+ */
+rlm_rcode_t sigtran_client_map_send_auth_info_result(REQUEST *request, sigtran_transaction_t *txn)
+{
+	rlm_rcode_t				rcode;
+
+	rad_assert(txn->ctx.done);
+
 	/*
 	 *	Process response
 	 */
@@ -293,7 +407,8 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 				root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), PW_EAP_SIM_ROOT);
 				if (!root) {
 					REDEBUG("Can't find dict root for EAP-SIM");
-					goto error;
+					rcode = RLM_MODULE_FAIL;
+					goto done;
 				}
 
 				RDEBUG2("SIM auth vector %i", i);
@@ -331,7 +446,8 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 				root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), PW_EAP_AKA_ROOT);
 				if (!root) {
 					REDEBUG("Can't find dict root for EAP-AKA");
-					goto error;
+					rcode = RLM_MODULE_FAIL;
+					goto done;
 				}
 
 				RDEBUG2("UMTS auth vector %i", i);
@@ -387,7 +503,25 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 		rcode = RLM_MODULE_FAIL;
 		break;
 	}
+
+done:
 	talloc_free(txn);
 
 	return rcode;
 }
+
+/** Stop waiting for a transaction
+ *
+ * If the transaction is still outstanding, it's freed when the event loop
+ * writes it back.
+ *
+ * @param txn	to cancel.
+ */
+void sigtran_client_txn_cancel(sigtran_transaction_t *txn)
+{
+	if (txn->ctx.done) {
+		talloc_free(txn);
+		return;
+	}
+	txn->ctx.request = NULL;
+}
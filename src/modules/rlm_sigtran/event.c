@@ -389,6 +389,13 @@ static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 
 	case SIGTRAN_REQUEST_THREAD_UNREGISTER:
 		DEBUG3("Deregistering req_pipe (%i).  Signalled by worker", ofd->fd);
+
+		/*
+		 *	The worker reads the results of any transactions
+		 *	it still has outstanding, before it reads this
+		 *	response, and closes its side of the pipe.
+		 */
+		sigtran_tcap_flush(ofd, NULL);
 		txn->response.type = SIGTRAN_RESPONSE_OK;
 
 		if (sigtran_event_submit(ofd, txn) < 0) goto fatal_error;
@@ -406,6 +413,7 @@ static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 
 	case SIGTRAN_REQUEST_LINK_DOWN:
 		DEBUG3("Taking link down");
+		sigtran_tcap_flush(NULL, txn->request.data);
 		if (event_link_down(talloc_get_type_abort(txn->request.data, sigtran_conn_t)) < 0) {
 			txn->response.type = SIGTRAN_RESPONSE_FAIL;
 		} else {
@@ -421,7 +429,7 @@ static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 		if (sigtran_tcap_outgoing(NULL, req->conn, txn, ofd) < 0) {
 			txn->response.type = SIGTRAN_RESPONSE_FAIL;
 		} else {
-			return 0;	/* Keep caller blocked until we get a response */
+			return 0;	/* Result is written to the pipe when we get a response */
 		}
 	}
 		break;
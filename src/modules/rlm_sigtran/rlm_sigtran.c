@@ -62,8 +62,6 @@ static uint32_t	sigtran_instances = 0;
 
 unsigned int __hack_opc, __hack_dpc;
 
-fr_thread_local_setup(int *, req_pipe);
-
 static const FR_NAME_NUMBER m3ua_traffic_mode_table[] = {
 	{ "override",  1 },
 	{ "loadshare", 2 },
@@ -140,6 +138,7 @@ static const CONF_PARSER sccp_config[] = {
 
 static const CONF_PARSER map_config[] = {
 	{ FR_CONF_OFFSET("version", PW_TYPE_TMPL, rlm_sigtran_t, conn_conf.map_version), .dflt = "2", .quote = T_BARE_WORD},
+	{ FR_CONF_OFFSET("max_outstanding", PW_TYPE_INTEGER, rlm_sigtran_t, conn_conf.map_max_outstanding), .dflt = "32" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -156,43 +155,46 @@ static const CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
-/** Signal the multiplexer that this thread is exiting
+/** Add the vectors from the HLR's response to the control list
  *
  */
-static void _req_pipe_unregister(void *fd_ptr)
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
 {
-	int fd = *talloc_get_type_abort(fd_ptr, int);
+	sigtran_transaction_t *txn = talloc_get_type_abort(ctx, sigtran_transaction_t);
 
-	sigtran_client_thread_unregister(fd);	/* Also closes our side */
+	return sigtran_client_map_send_auth_info_result(request, txn);
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+/** Stop waiting for the HLR if the request is cancelled
+ *
+ * The result is discarded when it arrives.
+ */
+static void mod_authorize_action(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				 fr_state_action_t action)
 {
-	rlm_sigtran_t const	*inst = instance;
-	int			*fd_ptr, fd;
+	sigtran_transaction_t *txn = talloc_get_type_abort(ctx, sigtran_transaction_t);
 
-	/*
-	 *	Retrieve the thread specific pipe we use
-	 *	to communicate with the multiplexer.
-	 */
-	fd_ptr = req_pipe;
-	if (!fd_ptr) {
-		fd_ptr = talloc(NULL, int);
-		fd = sigtran_client_thread_register();
-		if (fd < 0) {
-			RERROR("Failed registering thread with multiplexer");
-			talloc_free(fd_ptr);
-			return RLM_MODULE_FAIL;
-		}
-		*fd_ptr = fd;
-		fr_thread_local_set_destructor(req_pipe, _req_pipe_unregister, fd_ptr);
-	} else {
-		fd = *fd_ptr;
-	}
+	if (action != FR_ACTION_DONE) return;
 
-	return sigtran_client_map_send_auth_info(inst, request, inst->conn, fd);
+	RDEBUG("Cancelling pending MAP_SEND_AUTH_INFO request");
+
+	sigtran_client_txn_cancel(txn);
 }
 
+/** Send a MAP_SEND_AUTH_INFO request to the HLR, and yield until it responds
+ *
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	rlm_sigtran_t const	*inst = instance;
+	rlm_sigtran_thread_t	*t = thread;
+	sigtran_transaction_t	*txn;
+
+	txn = sigtran_client_map_send_auth_info(inst, request, inst->conn, t->fd);
+	if (!txn) return RLM_MODULE_FAIL;
+
+	return unlang_yield(request, mod_authorize_resume, mod_authorize_action, txn);
+}
 
 /** Convert our sccp address config structure into sockaddr_sccp
  *
@@ -331,6 +333,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	MTP3_PC_CHECK(dpc);
 	MTP3_PC_CHECK(opc);
 
+	/*
+	 *	Transaction IDs are 8 bits, and are shared
+	 *	between all instances.
+	 */
+	FR_INTEGER_BOUND_CHECK("max_outstanding", inst->conn_conf.map_max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_outstanding", inst->conn_conf.map_max_outstanding, <=, UINT8_MAX);
+
 	if (sigtran_sccp_sockaddr_from_conf(inst, inst, &inst->conn_conf.sccp_called_sockaddr,
 					    &inst->conn_conf.sccp_called, conf) < 0) return -1;
 	if (sigtran_sccp_sockaddr_from_conf(inst, inst, &inst->conn_conf.sccp_calling_sockaddr,
@@ -359,6 +368,59 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/** Register a req_pipe with the multiplexer, and watch it for results
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_sigtran_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sigtran_t		*inst = instance;
+	rlm_sigtran_thread_t	*t = thread;
+
+	t->inst = inst;
+	t->el = el;
+
+	t->fd = sigtran_client_thread_register();
+	if (t->fd < 0) {
+		ERROR("Failed registering thread with multiplexer");
+		return -1;
+	}
+
+	if ((fr_nonblock(t->fd) < 0) ||
+	    (fr_event_fd_insert(el, t->fd, sigtran_client_thread_read, NULL, NULL, t) < 0)) {
+		ERROR("Failed watching req_pipe");
+		sigtran_client_thread_unregister(t->fd);
+		t->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Signal the multiplexer that this thread is exiting
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_sigtran_thread_t	*t = thread;
+
+	if (t->fd < 0) return 0;
+
+	(void) fr_event_fd_delete(t->el, t->fd);
+	sigtran_client_thread_unregister(t->fd);	/* Also closes our side */
+	t->fd = -1;
+
+	return 0;
+}
+
 /**
  * Cleanup internal state.
  */
@@ -384,13 +446,16 @@ static int mod_detach(UNUSED void *instance)
  */
 extern rad_module_t rlm_sigtran;
 rad_module_t rlm_sigtran = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "sigtran",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_sigtran_t),
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "sigtran",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_sigtran_t),
+	.thread_inst_size	= sizeof(rlm_sigtran_thread_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 	}
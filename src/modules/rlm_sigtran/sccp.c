@@ -51,6 +51,9 @@
 static uint32_t	last_txn_id = 0;	//!< Global transaction ID
 static rbtree_t *txn_tree = NULL;	//!< Global transaction tree... Should really be per module.
 static uint32_t	txn_tree_inst = 0;
+static LLIST_HEAD(txn_backlog);		//!< Transactions waiting for a free slot on their connection.
+
+static void sigtran_tcap_backlog_run(sigtran_conn_t *conn);
 
 /** Compare rounds of a transaction
  *
@@ -69,14 +72,34 @@ static int sigtran_txn_cmp(void const *a, void const *b)
 	return 0;
 }
 
+/** Hand a completed transaction back to the worker which sent it
+ *
+ * The transaction must already have been removed from the txn_tree.
+ * Frees a slot on the connection, which is used to send the oldest
+ * transaction waiting in the backlog for it.
+ *
+ * @param[in] conn	the transaction was sent on.
+ * @param[in] txn	to return.
+ */
+static void sigtran_tcap_complete(sigtran_conn_t *conn, sigtran_transaction_t *txn)
+{
+	rad_assert(conn->outstanding > 0);
+	conn->outstanding--;
+
+	if (sigtran_event_submit(txn->ctx.ofd, txn) < 0) {
+		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
+	}
+
+	sigtran_tcap_backlog_run(conn);
+}
+
 static void sigtran_tcap_timeout(void *data)
 {
-	REQUEST *request;
 	sigtran_transaction_t *txn = talloc_get_type_abort(data, sigtran_transaction_t);
+	sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+								      sigtran_map_send_auth_info_req_t);
 
-	request = txn->ctx.request;
-
-	REDEBUG("OTID %u Invoke ID %u timeout", txn->ctx.otid, txn->ctx.invoke_id);
+	ERROR("OTID %u Invoke ID %u timeout", txn->ctx.otid, txn->ctx.invoke_id);
 
 	/*
 	 *	Remove the outstanding transaction
@@ -85,21 +108,23 @@ static void sigtran_tcap_timeout(void *data)
 
 	txn->response.type = SIGTRAN_RESPONSE_FAIL;
 
-	if (sigtran_event_submit(txn->ctx.ofd, txn) < 0) {
-		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
-		return;
-	}
+	sigtran_tcap_complete(talloc_get_type_abort(req->conn, sigtran_conn_t), txn);
 }
 
-/** Send a request with static MAP data in it
+/** Encode a MAP request with static MAP data in it, and send it
  *
  * SCCP will add its headers and call sigtran_sccp_outgoing
  *
+ * @note The request can't be logged to here, it belongs to another thread
+ *	which may be freeing it.
+ *
+ * @param[in] conn	to send the request on.
+ * @param[in] txn	to send.
  * @return
  *	- 0 on success.
- *	- <0 on failure.
+ *	- <0 on failure.  The caller must inform the worker.
  */
-int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transaction_t *txn, UNUSED struct osmo_fd *ofd)
+static int sigtran_tcap_send(sigtran_conn_t *conn, sigtran_transaction_t *txn)
 {
 	static uint8_t tcap_map_raw_v2[] = {
 		0x62, 0x43, 0x48, 0x01, 0x01, 0x6b, 0x80, 0x28, /* 0x00 */
@@ -124,52 +149,49 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x01, /* 0x40 */
 		0x00, 0x00 };					/* 0x48 */
 
-	REQUEST	*request = txn->ctx.request;
 	sigtran_map_send_auth_info_req_t *req =
 		talloc_get_type_abort(txn->request.data, sigtran_map_send_auth_info_req_t);
 
 	struct msgb			*msg;
 
-	sigtran_conn_t			*conn = talloc_get_type_abort(ctx, sigtran_conn_t);
 	struct mtp_m3ua_client_link 	*m3ua_client = talloc_get_type_abort(conn->mtp3_link->data,
 									     struct mtp_m3ua_client_link);
+	unsigned int			i;
 
 	rad_assert(req->imsi);
 
 	if (!mtp_m3ua_link_is_up(m3ua_client)) {
-		REDEBUG("Link not yet active, dropping the request");
+		ERROR("Link not yet active, dropping the request");
 
 		return -1;
 	}
 
-	if (rbtree_num_elements(txn_tree) > UINT8_MAX) {
-		REDEBUG("Too many outstanding requests, dropping the request");
+	if (rbtree_num_elements(txn_tree) >= UINT8_MAX) {
+		ERROR("Too many outstanding requests, dropping the request");
 
 		return -1;
 	}
 
 	switch (req->version) {
 	case 2:
-		RDEBUG4("Allocating buffer for MAP v2, %zu bytes", sizeof(tcap_map_raw_v2));
+		DEBUG4("Allocating buffer for MAP v2, %zu bytes", sizeof(tcap_map_raw_v2));
 		msg = msgb_alloc(sizeof(tcap_map_raw_v2), "sccp: tcap_map");
 		msg->l3h = msgb_put(msg, sizeof(tcap_map_raw_v2));
 		memcpy(msg->l3h, tcap_map_raw_v2, sizeof(tcap_map_raw_v2));
 
 		*(msg->l3h + 0x3a) = talloc_array_length(req->imsi);
 		memcpy(msg->l3h + 0x3b, req->imsi, talloc_array_length(req->imsi));
-		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v2), "MAPv2 Request");
 
 		break;
 
 	case 3:
-		RDEBUG4("Allocating buffer for MAP v3, %zu bytes", sizeof(tcap_map_raw_v3));
+		DEBUG4("Allocating buffer for MAP v3, %zu bytes", sizeof(tcap_map_raw_v3));
 		msg = msgb_alloc(sizeof(tcap_map_raw_v3), "sccp: tcap_map");
 		msg->l3h = msgb_put(msg, sizeof(tcap_map_raw_v3));
 		memcpy(msg->l3h, tcap_map_raw_v3, sizeof(tcap_map_raw_v3));
 
 		*(msg->l3h + 0x3c) = talloc_array_length(req->imsi);
 		memcpy(msg->l3h + 0x3d, req->imsi, talloc_array_length(req->imsi));
-		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v3), "MAPv3 Request");
 
 		break;
 
@@ -178,25 +200,22 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 	}
 
 	/*
-	 *	Set the transaction ID
+	 *	Set the transaction ID.  Many transactions may be
+	 *	outstanding, so skip any IDs which are still in use.
 	 */
-	txn->ctx.otid = (last_txn_id++) & UINT8_MAX;			/* 8 bit for now */
-
 	txn->ctx.invoke_id++;						/* Needs to be two operations */
 	txn->ctx.invoke_id &= 0x7f;					/* Invoke ID is 7bits */
-	RDEBUG2("Sending request with OTID %u Invoke ID %u", txn->ctx.otid, txn->ctx.invoke_id);
+	for (i = 0; i <= UINT8_MAX; i++) {
+		txn->ctx.otid = (last_txn_id++) & UINT8_MAX;		/* 8 bit for now */
+		if (!rbtree_finddata(txn_tree, txn)) break;
+	}
+	DEBUG2("Sending request with OTID %u Invoke ID %u", txn->ctx.otid, txn->ctx.invoke_id);
 
 	if (!rbtree_insert(txn_tree, txn)) {
-		RERROR("Failed inserting transaction, maybe at txn limit?");
+		ERROR("Failed inserting transaction, maybe at txn limit?");
 
 		msgb_free(msg);
 
-		txn->response.type = SIGTRAN_RESPONSE_FAIL;
-
-		if (sigtran_event_submit(ofd, txn) < 0) {
-			ERROR("Failed informing event client of result: %s", fr_syserror(errno));
-			return -1;
-		}
 		return -1;
 	}
 
@@ -206,8 +225,16 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 	*(msg->l3h + 0x04) = txn->ctx.otid;
 	*(msg->l3h + 0x35) = txn->ctx.invoke_id;
 
+	if (DEBUG_ENABLED4) {
+		char *hex;
+
+		hex = fr_abin2hex(NULL, msg->l3h, msgb_l3len(msg));
+		DEBUG4("MAPv%u Request: 0x%s", req->version, hex);
+		talloc_free(hex);
+	}
+
 	sccp_write(msg, &conn->conf->sccp_calling_sockaddr, &conn->conf->sccp_called_sockaddr,
-		   SCCP_PROTOCOL_RETURN_MESSAGE << 4 | SCCP_PROTOCOL_CLASS_0, ctx);	/* Class is connectionless (ish) */
+		   SCCP_PROTOCOL_RETURN_MESSAGE << 4 | SCCP_PROTOCOL_CLASS_0, conn);	/* Class is connectionless (ish) */
 
 	msgb_free(msg);
 
@@ -216,9 +243,147 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 
 	osmo_timer_schedule(&txn->ctx.timer, 1, 0);
 
+	conn->outstanding++;
+
 	return 0;
 }
 
+/** Send the transactions waiting for a free slot on a connection
+ *
+ * Transactions are sent in the order they were received.  Any which can't be
+ * sent are failed.
+ *
+ * @param[in] conn	which may have free slots.
+ */
+static void sigtran_tcap_backlog_run(sigtran_conn_t *conn)
+{
+	sigtran_transaction_t *txn, *next;
+
+	llist_for_each_entry_safe(txn, next, &txn_backlog, ctx.entry) {
+		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+									      sigtran_map_send_auth_info_req_t);
+
+		if (conn->outstanding >= conn->conf->map_max_outstanding) break;
+		if (req->conn != conn) continue;
+
+		llist_del(&txn->ctx.entry);
+		if (sigtran_tcap_send(conn, txn) < 0) {
+			txn->response.type = SIGTRAN_RESPONSE_FAIL;
+
+			if (sigtran_event_submit(txn->ctx.ofd, txn) < 0) {
+				ERROR("Failed informing event client of result: %s", fr_syserror(errno));
+			}
+		}
+	}
+}
+
+/** Send a MAP request, or queue it until the connection has a free slot
+ *
+ * At most map_max_outstanding transactions are sent to the HLR at once on each
+ * connection.  The rest wait in the backlog, and are sent as earlier transactions
+ * complete, or time out.
+ *
+ * @return
+ *	- 0 on success.  The worker will be informed of the result later.
+ *	- <0 on failure.  The caller must inform the worker.
+ */
+int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transaction_t *txn, UNUSED struct osmo_fd *ofd)
+{
+	sigtran_conn_t *conn = talloc_get_type_abort(ctx, sigtran_conn_t);
+
+	if (conn->outstanding >= conn->conf->map_max_outstanding) {
+		DEBUG3("%u transactions outstanding, queueing request", conn->outstanding);
+		llist_add_tail(&txn->ctx.entry, &txn_backlog);
+		return 0;
+	}
+
+	return sigtran_tcap_send(conn, txn);
+}
+
+typedef struct {
+	struct osmo_fd		*ofd;		//!< Fail transactions received on this FD.
+	sigtran_conn_t const	*conn;		//!< Fail transactions sent on this connection.
+	struct llist_head	failed;		//!< Transactions removed from the tree.
+} sigtran_tcap_flush_ctx_t;
+
+static int _sigtran_tcap_flush(void *ctx, void *data)
+{
+	sigtran_tcap_flush_ctx_t		*flush = ctx;
+	sigtran_transaction_t			*txn = talloc_get_type_abort(data, sigtran_transaction_t);
+	sigtran_map_send_auth_info_req_t	*req = talloc_get_type_abort(txn->request.data,
+									     sigtran_map_send_auth_info_req_t);
+
+	if ((flush->ofd && (txn->ctx.ofd != flush->ofd)) || (flush->conn && (req->conn != flush->conn))) return 0;
+
+	osmo_timer_del(&txn->ctx.timer);
+	llist_add_tail(&txn->ctx.entry, &flush->failed);
+
+	return 2;	/* Delete and continue */
+}
+
+/** Fail all the transactions received on an FD, or sent on a connection
+ *
+ * Used when a worker unregisters, or a link is taken down, so no transaction
+ * outlives the FD its result is written to, or the connection it was sent on.
+ *
+ * @param[in] ofd	the transactions were received on.  May be NULL.
+ * @param[in] conn	the transactions were sent on.  May be NULL.
+ */
+void sigtran_tcap_flush(struct osmo_fd *ofd, sigtran_conn_t const *conn)
+{
+	sigtran_tcap_flush_ctx_t	flush = { .ofd = ofd, .conn = conn };
+	sigtran_transaction_t		*txn, *next;
+
+	INIT_LLIST_HEAD(&flush.failed);
+
+	/*
+	 *	Transactions still in the backlog haven't been sent yet.
+	 */
+	llist_for_each_entry_safe(txn, next, &txn_backlog, ctx.entry) {
+		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+									      sigtran_map_send_auth_info_req_t);
+
+		if ((ofd && (txn->ctx.ofd != ofd)) || (conn && (req->conn != conn))) continue;
+
+		llist_move_tail(&txn->ctx.entry, &flush.failed);
+	}
+
+	if (txn_tree) rbtree_walk(txn_tree, RBTREE_DELETE_ORDER, _sigtran_tcap_flush, &flush);
+
+	/*
+	 *	Only inform the workers once the transactions
+	 *	are out of the tree, as they may then be freed.
+	 */
+	llist_for_each_entry_safe(txn, next, &flush.failed, ctx.entry) {
+		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+									      sigtran_map_send_auth_info_req_t);
+		sigtran_conn_t *sent_conn = NULL;
+
+		llist_del(&txn->ctx.entry);
+
+		/*
+		 *	Only transactions which were sent have a timer,
+		 *	and hold a slot on their connection.
+		 */
+		if (txn->ctx.timer.cb) {
+			sent_conn = talloc_get_type_abort(req->conn, sigtran_conn_t);
+
+			rad_assert(sent_conn->outstanding > 0);
+			sent_conn->outstanding--;
+		}
+
+		txn->response.type = SIGTRAN_RESPONSE_FAIL;
+		if (sigtran_event_submit(txn->ctx.ofd, txn) < 0) {
+			ERROR("Failed informing event client of result: %s", fr_syserror(errno));
+		}
+
+		/*
+		 *	Other workers may be waiting for the slot.
+		 */
+		if (sent_conn && !conn) sigtran_tcap_backlog_run(sent_conn);
+	}
+}
+
 /** Incoming data
  *
  * This should be called by the SCCP functions to give us result data
@@ -236,8 +401,6 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 	sigtran_map_send_auth_info_req_t *req;
 	sigtran_map_send_auth_info_res_t *res;
 
-	REQUEST			*request;
-	struct osmo_fd		*ofd;
 	sigtran_vector_t	**last;
 
 	memset(&find, 0, sizeof(find));
@@ -271,8 +434,6 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 
 	txn = talloc_get_type_abort(found, sigtran_transaction_t);
 	req = talloc_get_type_abort(txn->request.data, sigtran_map_send_auth_info_req_t);
-	request = txn->ctx.request;
-	ofd = txn->ctx.ofd;
 	osmo_timer_del(&txn->ctx.timer);			/* Remove the timeout timer */
 
 	MEM(res = talloc_zero(txn, sigtran_map_send_auth_info_res_t));
@@ -283,10 +444,10 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 #define sigtran_memdup(_x) \
 	do { \
 		p++; \
-		RDEBUG4("Start 0x%02x len %u", (unsigned int)(tcap - p), p[0]); \
+		DEBUG4("Start 0x%02x len %u", (unsigned int)(p - tcap), p[0]); \
 		if (p[0] >= (len - (p - tcap))) { \
-			REDEBUG("Invalid length %u specified for vector component", p[0]); \
-			return -1; \
+			ERROR("Invalid length %u specified for vector component", p[0]); \
+			goto error; \
 		} \
 		vec->_x = talloc_memdup(vec, p + 1, p[0]); \
 		p += p[0] + 1; \
@@ -304,7 +465,7 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 		p = tcap + 0x40;
 		while (p < end) {
 			if ((p[0] != 0x30) || (p[1] != 0x22)) {
-				RDEBUG4("Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
+				DEBUG4("Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
 				break;
 			}
 			p += 2;
@@ -333,12 +494,20 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 		*last = vec;
 	}
 
-	if (sigtran_event_submit(ofd, txn) < 0) {
-		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
-		return -1;
-	}
+	sigtran_tcap_complete(talloc_get_type_abort(req->conn, sigtran_conn_t), txn);
 
 	return 0;
+
+error:
+	/*
+	 *	The worker is still waiting for a result
+	 */
+	talloc_free(res);
+	txn->response.type = SIGTRAN_RESPONSE_FAIL;
+	txn->response.data = NULL;
+	sigtran_tcap_complete(talloc_get_type_abort(req->conn, sigtran_conn_t), txn);
+
+	return -1;
 }
 
 /** Wrapper to pass data down to MTP3 layer for processing
@@ -68,9 +68,10 @@ typedef enum {
 
 /** Request and response from the event loop
  *
- * We allocate the whole thing on the client side, as the client
- * will be blocked waiting on the response from the event loop,
- * and won't mind extra memory being allocated from this ctx.
+ * We allocate the whole thing on the client side.  Once the pointer has
+ * been written to the event loop, only the event loop touches the
+ * transaction, until it writes the pointer back.  The event loop may
+ * allocate the response data in this ctx.
  */
 typedef struct sigtran_transaction {
 	struct {
@@ -83,10 +84,12 @@ typedef struct sigtran_transaction {
 	} response;
 
 	struct {
-		REQUEST			*request;
+		REQUEST			*request;	//!< Waiting for the result, NULL if it was cancelled.
+							//!< Only accessed by the worker.
+		bool			done;		//!< Result has been received by the worker.
 		struct osmo_fd		*ofd;		//!< The FD the txn was received on.
 		struct osmo_timer_list	timer;		//!< Timer data.
-
+		struct llist_head	entry;		//!< Entry in the backlog of txns waiting to be sent.
 
 		uint32_t		otid;		//!< Transaction ID.
 		uint8_t			invoke_id;	//!< Sequence number (within transaction).
@@ -166,6 +169,8 @@ typedef struct sigtran_conn_conf {
 	struct sockaddr_sccp		sccp_called_sockaddr;		//!< Parsed version of the above
 
 	vp_tmpl_t			*map_version;			//!< Application context version.
+	uint32_t			map_max_outstanding;		//!< Maximum number of transactions to send
+									//!< to the HLR before queueing new ones.
 } sigtran_conn_conf_t;
 
 /** Represents a connection to a remote SS7 entity
@@ -178,6 +183,9 @@ typedef struct sigtran_conn {
 	struct bsc_data		*bsc_data;
 	struct mtp_link_set	*mtp3_link_set;
 	struct mtp_link		*mtp3_link;
+
+	uint32_t		outstanding;				//!< Transactions sent, awaiting a response.
+								//!< Only accessed by the event loop.
 } sigtran_conn_t;
 
 /** MAP send auth info request.
@@ -233,6 +241,12 @@ typedef struct rlm_sigtran {
 	vp_tmpl_t		*imsi;					//!< Subscriber identifier.
 } rlm_sigtran_t;
 
+typedef struct rlm_sigtran_thread {
+	rlm_sigtran_t const	*inst;					//!< Instance of rlm_sigtran.
+	fr_event_list_t		*el;					//!< Event list serviced by this thread.
+	int			fd;					//!< Our side of the req_pipe.
+} rlm_sigtran_thread_t;
+
 extern int ctrl_pipe[2];
 extern uint8_t const ascii_to_tbcd[];
 extern uint8_t const is_char_tbcd[];
@@ -246,12 +260,18 @@ int	sigtran_client_thread_register(void);
 
 int	sigtran_client_thread_unregister(int req_pipe_fd);
 
+void	sigtran_client_thread_read(fr_event_list_t *el, int fd, void *ctx);
+
 int	sigtran_client_link_up(sigtran_conn_t const **out, sigtran_conn_conf_t const *conf);
 
 int	sigtran_client_link_down(sigtran_conn_t const **conn);
 
-rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *request,
-					      sigtran_conn_t const *conn, int fd);
+sigtran_transaction_t *sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST *request,
+							 sigtran_conn_t const *conn, int fd);
+
+rlm_rcode_t sigtran_client_map_send_auth_info_result(REQUEST *request, sigtran_transaction_t *txn);
+
+void	sigtran_client_txn_cancel(sigtran_transaction_t *txn);
 
 /*
  *	event.c
@@ -267,6 +287,8 @@ int	sigtran_event_submit(struct osmo_fd *ofd, sigtran_transaction_t *txn);
  */
 int	sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transaction_t *txn, struct osmo_fd *ofd);
 
+void	sigtran_tcap_flush(struct osmo_fd *ofd, sigtran_conn_t const *conn);
+
 void	sigtran_sccp_incoming(struct mtp_link_set *set, struct msgb *msg, int sls);
 
 int	sigtran_sscp_init(sigtran_conn_t *conn);
@@ -52,8 +52,28 @@ typedef struct rlm_sql_cassandra_conn {
 	TALLOC_CTX		*log_ctx;			//!< Prevent unneeded memory allocation by keeping a
 								//!< permanent pool, to store log entries.
 	sql_log_entry_t		last_error;
+
+	CassFuture		*future;			//!< Query sent with sql_query_send, which we're
+								//!< waiting for.
+	CassBatch		*batch;				//!< Statements queued between BEGIN and COMMIT.
+
+	int			pipe[2];			//!< Written to by libcassandra's IO thread when
+								//!< the future is ready.
+	bool			sync_done;			//!< The last query sent with sql_query_send ran
+								//!< synchronously.
+	sql_rcode_t		sync_rcode;			//!< And this was the result.
 } rlm_sql_cassandra_conn_t;
 
+/** A statement prepared on the session
+ *
+ * The session is shared by all connections, so statements only
+ * need to be prepared once.
+ */
+typedef struct {
+	void const		*id;				//!< rlm_sql_stmt_t id.
+	CassPrepared const	*prepared;			//!< Prepared statement handle.
+} rlm_sql_cassandra_prepared_t;
+
 /** Cassandra driver instance
  *
  */
@@ -66,12 +86,22 @@ typedef struct rlm_sql_cassandra {
 	pthread_mutex_t		connect_mutex;			//!< Mutex to prevent multiple connections attempting
 								//!< to connect a keyspace concurrently.
 
+	rbtree_t		*prepared;			//!< Statements prepared on the session.
+	pthread_mutex_t		prepared_mutex;			//!< Protects the prepared tree.
+
 	/*
 	 *	Configuration options
 	 */
 	char const		*consistency_str;		//!< Level of consistency required.
 	CassConsistency		consistency;			//!< Level of consistency converted to a constant.
 
+	bool			async;				//!< Don't block the worker while waiting for a
+								//!< query to complete.
+
+	char const		*batch_type_str;		//!< Type of batch to send between BEGIN and COMMIT.
+	int			batch_type;			//!< Batch type converted to a constant, or -1 for
+								//!< no batching.
+
 	uint32_t		protocol_version;		//!< The protocol version.
 
 	uint32_t		connections_per_host;		//!< Number of connections to each server in each
@@ -177,6 +207,13 @@ static const FR_NAME_NUMBER consistency_levels[] = {
 	{ NULL, 0 }
 };
 
+static const FR_NAME_NUMBER batch_types[] = {
+	{ "none",		-1 },
+	{ "logged",		CASS_BATCH_TYPE_LOGGED },
+	{ "unlogged",		CASS_BATCH_TYPE_UNLOGGED },
+	{ NULL, 0 }
+};
+
 static const FR_NAME_NUMBER verify_cert_table[] = {
 	{ "no",			CASS_SSL_VERIFY_NONE },
 	{ "yes",		CASS_SSL_VERIFY_PEER_CERT },
@@ -213,6 +250,9 @@ static CONF_PARSER tls_config[] = {
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("consistency", PW_TYPE_STRING, rlm_sql_cassandra_t, consistency_str), .dflt = "quorum" },
 
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, rlm_sql_cassandra_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("batch_type", PW_TYPE_STRING, rlm_sql_cassandra_t, batch_type_str), .dflt = "unlogged" },
+
 	{ FR_CONF_OFFSET("protocol_version", PW_TYPE_INTEGER, rlm_sql_cassandra_t, protocol_version) },
 
 	{ FR_CONF_OFFSET("connections_per_host", PW_TYPE_INTEGER, rlm_sql_cassandra_t, connections_per_host) },
@@ -348,18 +388,45 @@ static int _sql_socket_destructor(rlm_sql_cassandra_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	The IO thread writes to our pipe when the
+	 *	future is ready, so we have to wait for it.
+	 */
+	if (conn->future) {
+		cass_future_wait(conn->future);
+		cass_future_free(conn->future);
+	}
+	if (conn->batch) cass_batch_free(conn->batch);
 	if (conn->iterator) cass_iterator_free(conn->iterator);
 	if (conn->result) cass_result_free(conn->result);
 
+	if (conn->pipe[0] >= 0) close(conn->pipe[0]);
+	if (conn->pipe[1] >= 0) close(conn->pipe[1]);
+
 	return 0;
 }
 
+static int _sql_prepared_free(rlm_sql_cassandra_prepared_t *entry)
+{
+	cass_prepared_free(entry->prepared);
+
+	return 0;
+}
+
+static int sql_prepared_cmp(void const *one, void const *two)
+{
+	rlm_sql_cassandra_prepared_t const *a = one, *b = two;
+
+	return (a->id > b->id) - (a->id < b->id);
+}
+
 static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config, struct timeval const *timeout)
 {
 	rlm_sql_cassandra_conn_t	*conn;
 	rlm_sql_cassandra_t		*inst = config->driver;
 
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_cassandra_conn_t));
+	conn->pipe[0] = conn->pipe[1] = -1;
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
 	/*
@@ -399,22 +466,30 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	}
 	conn->log_ctx = talloc_pool(conn, 1024);	/* Pre-allocate some memory for log messages */
 
+	if (inst->async) {
+		if (pipe(conn->pipe) < 0) {
+			ERROR("Failed creating pipe: %s", fr_syserror(errno));
+			return RLM_SQL_ERROR;
+		}
+
+		if ((fr_nonblock(conn->pipe[0]) < 0) || (fr_nonblock(conn->pipe[1]) < 0)) {
+			ERROR("Failed setting pipe to non-blocking: %s", fr_syserror(errno));
+			return RLM_SQL_ERROR;
+		}
+	}
+
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+/** Get the result of a query, waiting for it if necessary
+ *
+ * @param[in] conn	the query was sent on.
+ * @param[in] future	of the query.  Is freed.
+ * @return the same codes as sql_query.
+ */
+static sql_rcode_t sql_future_result(rlm_sql_cassandra_conn_t *conn, CassFuture *future)
 {
-	rlm_sql_cassandra_conn_t	*conn = handle->conn;
-	rlm_sql_cassandra_t	*conf = config->driver;
-	CassStatement			*statement;
-	CassFuture			*future;
-	CassError			ret;
-
-	statement = cass_statement_new_n(query, talloc_array_length(query) - 1, 0);
-	if (conf->consistency_str) cass_statement_set_consistency(statement, conf->consistency);
-
-	future = cass_session_execute(conf->session, statement);
-	cass_statement_free(statement);
+	CassError	ret;
 
 	ret = cass_future_error_code(future);
 	if (ret != CASS_OK) {
@@ -441,6 +516,348 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
 	return RLM_SQL_OK;
 }
 
+/** Find a statement prepared on the session, preparing it if this is the first time it's been used
+ *
+ */
+static sql_rcode_t sql_prepare(CassPrepared const **out, rlm_sql_cassandra_conn_t *conn,
+			       rlm_sql_cassandra_t *conf, rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_cassandra_prepared_t	*entry, *found;
+	CassFuture			*future;
+	CassError			ret;
+
+	pthread_mutex_lock(&conf->prepared_mutex);
+	entry = rbtree_finddata(conf->prepared, &(rlm_sql_cassandra_prepared_t){ .id = stmt->id });
+	pthread_mutex_unlock(&conf->prepared_mutex);
+	if (entry) {
+		*out = entry->prepared;
+		return RLM_SQL_OK;
+	}
+
+	/*
+	 *	Don't hold the mutex for a round trip.  If another
+	 *	connection prepares the same statement at the same
+	 *	time, we just use theirs.
+	 */
+	future = cass_session_prepare_n(conf->session, stmt->query, strlen(stmt->query));
+	ret = cass_future_error_code(future);
+	if (ret != CASS_OK) {
+		char const	*error;
+		size_t		len;
+
+		cass_future_error_message(future, &error, &len);
+		sql_set_last_error(conn, error, len);
+		cass_future_free(future);
+
+		return ((ret == CASS_ERROR_SERVER_SYNTAX_ERROR) || (ret == CASS_ERROR_SERVER_INVALID_QUERY)) ?
+			RLM_SQL_QUERY_INVALID : RLM_SQL_ERROR;
+	}
+
+	pthread_mutex_lock(&conf->prepared_mutex);
+	found = rbtree_finddata(conf->prepared, &(rlm_sql_cassandra_prepared_t){ .id = stmt->id });
+	if (found) {
+		pthread_mutex_unlock(&conf->prepared_mutex);
+		cass_future_free(future);
+		*out = found->prepared;
+		return RLM_SQL_OK;
+	}
+
+	MEM(entry = talloc_zero(conf->prepared, rlm_sql_cassandra_prepared_t));
+	entry->id = stmt->id;
+	entry->prepared = cass_future_get_prepared(future);
+	talloc_set_destructor(entry, _sql_prepared_free);
+
+	if (!rbtree_insert(conf->prepared, entry)) {
+		pthread_mutex_unlock(&conf->prepared_mutex);
+		cass_future_free(future);
+		talloc_free(entry);
+		return RLM_SQL_ERROR;
+	}
+	pthread_mutex_unlock(&conf->prepared_mutex);
+	cass_future_free(future);
+
+	*out = entry->prepared;
+
+	return RLM_SQL_OK;
+}
+
+/** Bind the value of a placeholder, converting it to the type of the column
+ *
+ * Expansions are always strings, but Cassandra won't convert them
+ * to other types for us.
+ */
+static CassError sql_bind_value(CassStatement *statement, CassPrepared const *prepared, int i, char const *value)
+{
+	CassDataType const	*type;
+	char			*end;
+	long long		num;
+	double			dbl;
+	CassInet		inet;
+
+	type = cass_prepared_parameter_data_type(prepared, i);
+	if (!type) return cass_statement_bind_string(statement, i, value);
+
+	switch (cass_data_type_type(type)) {
+	case CASS_VALUE_TYPE_INT:
+	case CASS_VALUE_TYPE_BIGINT:
+	case CASS_VALUE_TYPE_COUNTER:
+	case CASS_VALUE_TYPE_TIMESTAMP:
+		if (!*value) return cass_statement_bind_null(statement, i);
+
+		num = strtoll(value, &end, 10);
+		if (*end) return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
+
+		switch (cass_data_type_type(type)) {
+		case CASS_VALUE_TYPE_INT:
+			return cass_statement_bind_int32(statement, i, (cass_int32_t) num);
+
+		/*
+		 *	Timestamps are in milliseconds, our
+		 *	expansions produce seconds.
+		 */
+		case CASS_VALUE_TYPE_TIMESTAMP:
+			num *= 1000;
+			/* FALL-THROUGH */
+
+		default:
+			return cass_statement_bind_int64(statement, i, (cass_int64_t) num);
+		}
+
+	case CASS_VALUE_TYPE_DOUBLE:
+	case CASS_VALUE_TYPE_FLOAT:
+		if (!*value) return cass_statement_bind_null(statement, i);
+
+		dbl = strtod(value, &end);
+		if (*end) return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
+
+		if (cass_data_type_type(type) == CASS_VALUE_TYPE_FLOAT) {
+			return cass_statement_bind_float(statement, i, (cass_float_t) dbl);
+		}
+		return cass_statement_bind_double(statement, i, dbl);
+
+	case CASS_VALUE_TYPE_BOOLEAN:
+		if (!*value) return cass_statement_bind_null(statement, i);
+
+		return cass_statement_bind_bool(statement, i, ((strcmp(value, "1") == 0) ||
+							       (strcasecmp(value, "true") == 0) ||
+							       (strcasecmp(value, "yes") == 0)) ? cass_true : cass_false);
+
+	case CASS_VALUE_TYPE_INET:
+		if (!*value) return cass_statement_bind_null(statement, i);
+
+		if (cass_inet_from_string(value, &inet) != CASS_OK) return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
+		return cass_statement_bind_inet(statement, i, inet);
+
+	default:
+		return cass_statement_bind_string(statement, i, value);
+	}
+}
+
+/** Create a statement for a query, or a prepared statement
+ *
+ */
+static sql_rcode_t sql_statement_alloc(CassStatement **out, rlm_sql_cassandra_conn_t *conn,
+				       rlm_sql_cassandra_t *conf, char const *query, rlm_sql_stmt_t const *stmt)
+{
+	CassStatement		*statement;
+	CassPrepared const	*prepared;
+	CassError		ret;
+	sql_rcode_t		rcode;
+	int			i;
+
+	if (!stmt) {
+		statement = cass_statement_new_n(query, strlen(query), 0);
+	} else {
+		rcode = sql_prepare(&prepared, conn, conf, stmt);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		statement = cass_prepared_bind(prepared);
+		for (i = 0; i < stmt->num_params; i++) {
+			ret = sql_bind_value(statement, prepared, i, stmt->values[i]);
+			if (ret != CASS_OK) {
+				sql_set_last_error_printf(conn, "Failed binding value \"%s\" to parameter %i: %s",
+							  stmt->values[i], i + 1, cass_error_desc(ret));
+				cass_statement_free(statement);
+				return RLM_SQL_QUERY_INVALID;
+			}
+		}
+	}
+
+	if (conf->consistency_str) cass_statement_set_consistency(statement, conf->consistency);
+
+	*out = statement;
+
+	return RLM_SQL_OK;
+}
+
+/** Run a query or prepared statement, or add it to the current batch
+ *
+ * rlm_sql writes batched accounting queries between BEGIN and COMMIT.
+ * Cassandra has no transactions, so those are turned into a batch
+ * which is sent in one round trip at COMMIT.
+ */
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+			       rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	rlm_sql_cassandra_t		*conf = config->driver;
+	CassStatement			*statement;
+	CassFuture			*future;
+	CassError			ret;
+	sql_rcode_t			rcode;
+
+	if (!stmt && (conf->batch_type >= 0)) {
+		if (strcmp(query, "BEGIN") == 0) {
+			if (conn->batch) cass_batch_free(conn->batch);
+
+			conn->batch = cass_batch_new((CassBatchType) conf->batch_type);
+			if (conf->consistency_str) cass_batch_set_consistency(conn->batch, conf->consistency);
+
+			return RLM_SQL_OK;
+		}
+
+		if (conn->batch && (strcmp(query, "ROLLBACK") == 0)) {
+			cass_batch_free(conn->batch);
+			conn->batch = NULL;
+
+			return RLM_SQL_OK;
+		}
+
+		if (conn->batch && (strcmp(query, "COMMIT") == 0)) {
+			future = cass_session_execute_batch(conf->session, conn->batch);
+			cass_batch_free(conn->batch);
+			conn->batch = NULL;
+
+			return sql_future_result(conn, future);
+		}
+	}
+
+	rcode = sql_statement_alloc(&statement, conn, conf, query, stmt);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	if (conn->batch) {
+		ret = cass_batch_add_statement(conn->batch, statement);
+		cass_statement_free(statement);
+		if (ret != CASS_OK) {
+			sql_set_last_error_printf(conn, "Failed adding query to batch: %s", cass_error_desc(ret));
+			return RLM_SQL_ERROR;
+		}
+
+		return RLM_SQL_OK;
+	}
+
+	future = cass_session_execute(conf->session, statement);
+	cass_statement_free(statement);
+
+	return sql_future_result(conn, future);
+}
+
+static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	return sql_execute(handle, config, query, NULL);
+}
+
+static sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, rlm_sql_config_t *config, rlm_sql_stmt_t const *stmt)
+{
+	return sql_execute(handle, config, NULL, stmt);
+}
+
+/** Called by one of libcassandra's IO threads, when a future is ready
+ *
+ * Wakes up the worker waiting on the connection's pipe.
+ */
+static void _sql_future_ready(UNUSED CassFuture *future, void *data)
+{
+	rlm_sql_cassandra_conn_t *conn = data;
+
+	if (write(conn->pipe[1], "", 1) < 0) {
+		/* Pipe is full, the worker will be woken up anyway */
+	}
+}
+
+/** Send a query without waiting for the result
+ *
+ * If async is off, or we're building a batch, the query is run
+ * immediately, and the result is returned by the first call to
+ * sql_query_poll().
+ */
+static sql_rcode_t sql_query_send(int *fd, rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+				  rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	rlm_sql_cassandra_t		*conf = config->driver;
+	CassStatement			*statement;
+	char				buffer[64];
+	sql_rcode_t			rcode;
+
+	if (!conf->async || conn->batch) {
+		conn->sync_rcode = sql_execute(handle, config, query, stmt);
+		conn->sync_done = true;
+		*fd = -1;
+
+		return RLM_SQL_OK;
+	}
+
+	rcode = sql_statement_alloc(&statement, conn, conf, query, stmt);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/*
+	 *	Clear out any stale notifications.
+	 */
+	while (read(conn->pipe[0], buffer, sizeof(buffer)) > 0);
+
+	conn->future = cass_session_execute(conf->session, statement);
+	cass_statement_free(statement);
+	conn->sync_done = false;
+
+	/*
+	 *	If the future is already ready, the callback is
+	 *	run immediately.
+	 */
+	if (cass_future_set_callback(conn->future, _sql_future_ready, conn) != CASS_OK) {
+		conn->sync_rcode = sql_future_result(conn, conn->future);
+		conn->future = NULL;
+		conn->sync_done = true;
+		*fd = -1;
+
+		return RLM_SQL_OK;
+	}
+
+	*fd = conn->pipe[0];
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_poll(bool *done, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	CassFuture			*future;
+	char				buffer[64];
+
+	if (conn->sync_done) {
+		*done = true;
+		return conn->sync_rcode;
+	}
+
+	if (!conn->future) {
+		*done = true;
+		return RLM_SQL_ERROR;
+	}
+
+	if (!cass_future_ready(conn->future)) {
+		*done = false;
+		return RLM_SQL_OK;
+	}
+
+	while (read(conn->pipe[0], buffer, sizeof(buffer)) > 0);
+
+	future = conn->future;
+	conn->future = NULL;
+	*done = true;
+
+	return sql_future_result(conn, future);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_cassandra_conn_t *conn = handle->conn;
@@ -678,11 +1095,14 @@ static int mod_detach(void *instance)
 {
 	rlm_sql_cassandra_t *inst = instance;
 
+	TALLOC_FREE(inst->prepared);				/* must be freed before the session */
+
 	if (inst->ssl) cass_ssl_free(inst->ssl);
 	if (inst->session) cass_session_free(inst->session);	/* also synchronously closes the session */
 	if (inst->cluster) cass_cluster_free(inst->cluster);
 
 	pthread_mutex_destroy(&inst->connect_mutex);
+	pthread_mutex_destroy(&inst->prepared_mutex);
 
 	return 0;
 }
@@ -710,6 +1130,12 @@ do {\
 		return -1;
 	}
 
+	if (pthread_mutex_init(&inst->prepared_mutex, NULL) < 0) {
+		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+	MEM(inst->prepared = rbtree_create(inst, sql_prepared_cmp, NULL, 0));
+
 	/*
 	 *	This has to be done before we call cf_section_parse
 	 *	as it sets default values, and creates the section.
@@ -746,6 +1172,13 @@ do {\
 		inst->consistency = (CassConsistency)consistency;
 	}
 
+	inst->batch_type = fr_str2int(batch_types, inst->batch_type_str, -2);
+	if (inst->batch_type < -1) {
+		ERROR("Invalid batch type \"%s\", must be one of 'none', 'logged', 'unlogged'",
+		      inst->batch_type_str);
+		return -1;
+	}
+
 	if (inst->protocol_version) {
 		DO_CASS_OPTION("protocol_version",
 			       cass_cluster_set_protocol_version(inst->cluster, inst->protocol_version));
@@ -949,5 +1382,8 @@ rlm_sql_driver_t rlm_sql_cassandra = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_query_send			= sql_query_send,
+	.sql_query_poll			= sql_query_poll,
+	.sql_query_stmt			= sql_query_stmt
 };
@@ -49,6 +49,14 @@ RCSID("$Id$")
 
 #include "rlm_sql.h"
 
+/*
+ *	mysql_real_query_nonblocking() was added in MySQL 8.0.16.
+ *	MariaDB's client library has a different non-blocking API.
+ */
+#if defined(MYSQL_VERSION_ID) && (MYSQL_VERSION_ID >= 80016) && !defined(MARIADB_BASE_VERSION)
+#  define MYSQL_ASYNC 1
+#endif
+
 typedef enum {
 	SERVER_WARNINGS_AUTO = 0,
 	SERVER_WARNINGS_YES,
@@ -66,8 +74,24 @@ typedef struct rlm_sql_mysql_conn {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+#ifdef MYSQL_ASYNC
+	char		*async_query;			//!< Query being sent asynchronously.  The same
+							//!< arguments must be passed on every call.
+	enum net_async_status async_status;		//!< Status of the last non-blocking call.
+#endif
+	rbtree_t	*stmts;				//!< Statements prepared on this connection.
+	bool		stmt_executed;			//!< The last query was a prepared statement.
+	int		stmt_affected_rows;		//!< Rows affected by the last prepared statement.
 } rlm_sql_mysql_conn_t;
 
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	void const	*id;				//!< rlm_sql_stmt_t id.
+	MYSQL_STMT	*stmt;				//!< Prepared statement handle.
+} rlm_sql_mysql_stmt_t;
+
 typedef struct rlm_sql_mysql_config {
 	char const *tls_ca_file;		//!< Path to the CA used to validate the server's certificate.
 	char const *tls_ca_path;		//!< Directory containing CAs that may be used to validate the
@@ -108,6 +132,12 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Statements must be closed before the
+	 *	connection they were prepared on.
+	 */
+	TALLOC_FREE(conn->stmts);
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -115,6 +145,20 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 	return 0;
 }
 
+static int _sql_stmt_free(rlm_sql_mysql_stmt_t *entry)
+{
+	mysql_stmt_close(entry->stmt);
+
+	return 0;
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_mysql_stmt_t const *a = one, *b = two;
+
+	return (a->id > b->id) - (a->id < b->id);
+}
+
 static int mod_instantiate(UNUSED rlm_sql_config_t const *config, void *instance, UNUSED CONF_SECTION *cs)
 {
 	rlm_sql_mysql_t		*inst = instance;
@@ -331,6 +375,7 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 		return RLM_SQL_RECONNECT;
 	}
 
+	conn->stmt_executed = false;
 	mysql_query(conn->sock, query);
 	rcode = sql_check_error(conn->sock, 0);
 	if (rcode != RLM_SQL_OK) {
@@ -344,6 +389,167 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
+/** Log an error from a prepared statement, and determine an action
+ *
+ * Statement errors aren't available from the connection handle, so
+ * sql_error() can't retrieve them.
+ */
+static sql_rcode_t sql_stmt_error(MYSQL_STMT *stmt)
+{
+	unsigned int stmt_errno = mysql_stmt_errno(stmt);
+
+	ERROR("ERROR %u (%s): %s", stmt_errno, mysql_stmt_sqlstate(stmt), mysql_stmt_error(stmt));
+
+	return sql_check_error(NULL, stmt_errno);
+}
+
+/** Execute a prepared statement, preparing it first if this connection hasn't seen it before
+ *
+ */
+static sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				  rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	rlm_sql_mysql_stmt_t	*entry;
+	MYSQL_BIND		*bind = NULL;
+	sql_rcode_t		rcode;
+	int			i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!conn->stmts) MEM(conn->stmts = rbtree_create(conn, sql_stmt_cmp, NULL, 0));
+
+	entry = rbtree_finddata(conn->stmts, &(rlm_sql_mysql_stmt_t){ .id = stmt->id });
+	if (!entry) {
+		MEM(entry = talloc_zero(conn->stmts, rlm_sql_mysql_stmt_t));
+		entry->id = stmt->id;
+		entry->stmt = mysql_stmt_init(conn->sock);
+		if (!entry->stmt) {
+			ERROR("Failed allocating statement: %s", mysql_error(conn->sock));
+			talloc_free(entry);
+			return RLM_SQL_ERROR;
+		}
+		talloc_set_destructor(entry, _sql_stmt_free);
+
+		if (mysql_stmt_prepare(entry->stmt, stmt->query, strlen(stmt->query)) != 0) {
+			rcode = sql_stmt_error(entry->stmt);
+			talloc_free(entry);
+			return rcode;
+		}
+
+		if (!rbtree_insert(conn->stmts, entry)) {
+			talloc_free(entry);
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	/*
+	 *	All parameters are sent as strings, and
+	 *	converted by the server.
+	 */
+	if (stmt->num_params > 0) {
+		MEM(bind = talloc_zero_array(conn, MYSQL_BIND, stmt->num_params));
+		for (i = 0; i < stmt->num_params; i++) {
+			bind[i].buffer_type = MYSQL_TYPE_STRING;
+			memcpy(&bind[i].buffer, &stmt->values[i], sizeof(bind[i].buffer));
+			bind[i].buffer_length = strlen(stmt->values[i]);
+			bind[i].length = &bind[i].buffer_length;
+		}
+
+		if (mysql_stmt_bind_param(entry->stmt, bind) != 0) {
+			talloc_free(bind);
+			return sql_stmt_error(entry->stmt);
+		}
+	}
+
+	i = mysql_stmt_execute(entry->stmt);
+	talloc_free(bind);
+	if (i != 0) return sql_stmt_error(entry->stmt);
+
+	conn->stmt_executed = true;
+	conn->stmt_affected_rows = (int) mysql_stmt_affected_rows(entry->stmt);
+	mysql_stmt_free_result(entry->stmt);
+
+	return RLM_SQL_OK;
+}
+
+#ifdef MYSQL_ASYNC
+/** Start sending a query, without waiting for the result
+ *
+ * Prepared statements are executed synchronously, and the result
+ * is made available to the first call to sql_query_poll().
+ */
+static sql_rcode_t sql_query_send(int *fd, rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				  char const *query, rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (stmt) {
+		sql_rcode_t rcode;
+
+		rcode = sql_query_stmt(handle, config, stmt);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		conn->async_status = NET_ASYNC_COMPLETE;
+		*fd = conn->sock->net.fd;
+
+		return RLM_SQL_OK;
+	}
+
+	conn->stmt_executed = false;
+	talloc_free(conn->async_query);
+	MEM(conn->async_query = talloc_strdup(conn, query));
+
+	conn->async_status = mysql_real_query_nonblocking(conn->sock, conn->async_query,
+							  talloc_array_length(conn->async_query) - 1);
+	*fd = conn->sock->net.fd;
+
+	return RLM_SQL_OK;
+}
+
+/** Continue a query started with sql_query_send()
+ *
+ * @note The caller only waits for the fd to become readable, which is fine
+ *	for queries that fit in the socket's send buffer.
+ */
+static sql_rcode_t sql_query_poll(bool *done, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	sql_rcode_t rcode;
+	char const *info;
+
+	if (conn->async_status == NET_ASYNC_NOT_READY) {
+		conn->async_status = mysql_real_query_nonblocking(conn->sock, conn->async_query,
+								  talloc_array_length(conn->async_query) - 1);
+		if (conn->async_status == NET_ASYNC_NOT_READY) {
+			*done = false;
+			return RLM_SQL_OK;
+		}
+	}
+
+	*done = true;
+	TALLOC_FREE(conn->async_query);
+
+	rcode = sql_check_error(conn->sock, 0);
+	if (rcode != RLM_SQL_OK) return rcode;
+	if (conn->async_status == NET_ASYNC_ERROR) return RLM_SQL_ERROR;
+
+	/* Only returns non-null string for INSERTS */
+	info = mysql_info(conn->sock);
+	if (info) DEBUG2("%s", info);
+
+	return RLM_SQL_OK;
+}
+#endif
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -724,6 +930,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt_executed) return conn->stmt_affected_rows;
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -767,5 +975,10 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_stmt			= sql_query_stmt,
+#ifdef MYSQL_ASYNC
+	.sql_query_send			= sql_query_send,
+	.sql_query_poll			= sql_query_poll
+#endif
 };
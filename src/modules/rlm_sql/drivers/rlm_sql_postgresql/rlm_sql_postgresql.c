@@ -69,8 +69,19 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+
+	rbtree_t	*stmts;		//!< Statements prepared on this connection.
+	uint32_t	stmt_num;	//!< Used to generate statement names.
 } rlm_sql_postgres_conn_t;
 
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	void const	*id;		//!< rlm_sql_stmt_t id.
+	char		name[32];	//!< Name the statement was prepared with.
+} rlm_sql_postgres_stmt_t;
+
 static CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("send_application_name", PW_TYPE_BOOLEAN, rlm_sql_postgres_t, send_application_name), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
@@ -163,6 +174,13 @@ static int _sql_socket_destructor(rlm_sql_postgres_conn_t *conn)
 	return 0;
 }
 
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_postgres_stmt_t const *a = one, *b = two;
+
+	return (a->id > b->id) - (a->id < b->id);
+}
+
 static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
 					    UNUSED struct timeval const *timeout)
 {
@@ -172,6 +190,8 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
+	MEM(conn->stmts = rbtree_create(conn, sql_stmt_cmp, NULL, 0));
+
 	DEBUG2("Connecting using parameters: %s", inst->db_string);
 	conn->db = PQconnectdb(inst->db_string);
 	if (!conn->db) {
@@ -192,12 +212,12 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
+static sql_rcode_t sql_result_status(rlm_sql_postgres_conn_t *conn);
+
 static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
 					      char const *query)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
-	ExecStatusType status;
-	int numfields = 0;
 
 	if (!conn->db) {
 		ERROR("Socket not connected");
@@ -214,6 +234,17 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	 */
 	conn->result = PQexec(conn->db, query);
 
+	return sql_result_status(conn);
+}
+
+/** Map the status of the current result to an rlm_sql return code
+ *
+ */
+static sql_rcode_t sql_result_status(rlm_sql_postgres_conn_t *conn)
+{
+	ExecStatusType status;
+	int numfields = 0;
+
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -288,6 +319,149 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t
 	return sql_query(handle, config, query);
 }
 
+/** Prepare a statement, if it hasn't already been prepared on this connection
+ *
+ * @param[out] name	the statement was prepared with.
+ * @param[in] conn	to prepare the statement on.
+ * @param[in] stmt	to prepare.
+ * @return the same codes as sql_query.
+ */
+static sql_rcode_t sql_stmt_prepare(char const **name, rlm_sql_postgres_conn_t *conn, rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_postgres_stmt_t	*entry;
+	sql_rcode_t		ret;
+
+	entry = rbtree_finddata(conn->stmts, &(rlm_sql_postgres_stmt_t){ .id = stmt->id });
+	if (entry) {
+		*name = entry->name;
+		return RLM_SQL_OK;
+	}
+
+	MEM(entry = talloc_zero(conn->stmts, rlm_sql_postgres_stmt_t));
+	entry->id = stmt->id;
+	snprintf(entry->name, sizeof(entry->name), "fr_stmt_%u", conn->stmt_num++);
+
+	DEBUG2("Preparing statement %s", entry->name);
+
+	/*
+	 *	Let the server infer the parameter types
+	 *	from the context they're used in.
+	 */
+	conn->result = PQprepare(conn->db, entry->name, stmt->query, stmt->num_params, NULL);
+	ret = sql_result_status(conn);
+	if (ret != RLM_SQL_OK) {
+		talloc_free(entry);
+		return ret;
+	}
+	PQclear(conn->result);
+	conn->result = NULL;
+
+	if (!rbtree_insert(conn->stmts, entry)) {
+		talloc_free(entry);
+		return RLM_SQL_ERROR;
+	}
+	*name = entry->name;
+
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						   rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char const		*name;
+	sql_rcode_t		ret;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	ret = sql_stmt_prepare(&name, conn, stmt);
+	if (ret != RLM_SQL_OK) return ret;
+
+	/*
+	 *	All parameters are sent as text
+	 */
+	conn->result = PQexecPrepared(conn->db, name, stmt->num_params, stmt->values, NULL, NULL, 0);
+
+	return sql_result_status(conn);
+}
+
+/** Send a query, without waiting for the result
+ *
+ */
+static CC_HINT(nonnull (1, 2)) sql_rcode_t sql_query_send(int *fd, rlm_sql_handle_t *handle,
+							  UNUSED rlm_sql_config_t *config,
+							  char const *query, rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char const		*name;
+	sql_rcode_t		ret;
+	int			sent;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *	Preparing only happens once per connection,
+	 *	so it's done synchronously.
+	 */
+	if (stmt) {
+		ret = sql_stmt_prepare(&name, conn, stmt);
+		if (ret != RLM_SQL_OK) return ret;
+
+		sent = PQsendQueryPrepared(conn->db, name, stmt->num_params, stmt->values, NULL, NULL, 0);
+	} else {
+		sent = PQsendQuery(conn->db, query);
+	}
+
+	if (!sent) {
+		ERROR("Failed sending query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	*fd = PQsocket(conn->db);
+
+	return RLM_SQL_OK;
+}
+
+/** Read whatever is available, and process the result once it's complete
+ *
+ * A query sent with PQsendQuery() may produce several results. We keep the
+ * last one, as PQexec() does, and the query is only complete once
+ * PQgetResult() returns NULL.  PQgetResult() only blocks if PQisBusy().
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_poll(bool *done, rlm_sql_handle_t *handle,
+						   UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	PGresult		*result;
+
+	*done = false;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading query result: %s", PQerrorMessage(conn->db));
+		*done = true;
+		return RLM_SQL_RECONNECT;
+	}
+
+	while (!PQisBusy(conn->db)) {
+		result = PQgetResult(conn->db);
+		if (!result) {
+			*done = true;
+			return sql_result_status(conn);
+		}
+
+		if (conn->result) PQclear(conn->result);
+		conn->result = result;
+	}
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
@@ -528,6 +702,7 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
 //	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,	/* Needs more testing */
+	.flags				= RLM_SQL_FLAGS_PARAM_NUMBERED,
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.load				= mod_load,
 	.config				= driver_config,
@@ -542,5 +717,8 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_send			= sql_query_send,
+	.sql_query_poll			= sql_query_poll,
+	.sql_query_stmt			= sql_query_stmt
 };
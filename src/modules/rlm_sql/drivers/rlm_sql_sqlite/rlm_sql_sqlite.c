@@ -30,6 +30,7 @@ RCSID("$Id$")
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 
 #include <sqlite3.h>
 
@@ -49,20 +50,96 @@ RCSID("$Id$")
 typedef sqlite_int64 sqlite3_int64;
 #endif
 
+/*
+ *	WAL needs >= 3.7.0, and we need sqlite3_stmt_readonly() (3.7.4)
+ *	to tell which queries should go to the writer thread.
+ */
+#if SQLITE_VERSION_NUMBER >= 3007004
+#  define HAVE_SQLITE_WRITER 1
+#endif
+
+typedef struct sqlite_write sqlite_write_t;
+
+/** A query waiting for, or written by, the writer thread
+ *
+ */
+struct sqlite_write {
+	sqlite_write_t	*next;		//!< Next write in the queue, or in the batch.
+
+	char const	*query;		//!< Copy of the query.
+	void const	*stmt_id;	//!< rlm_sql_stmt_t id, if the query is a prepared statement.
+	char		**values;	//!< Copies of the parameters of the prepared statement.
+	int		num_params;
+
+	int		status;		//!< Of the query, or of the commit.
+	int		changes;	//!< Number of rows the query changed.
+	char		*error;		//!< Message for the status.
+
+	int		fd;		//!< Written to when the query is done.
+	bool		done;		//!< The writer has finished with the query.
+	bool		orphaned;	//!< The connection went away while the query was being written.
+};
+
+/** The single writer thread, and its own database handle
+ *
+ */
+typedef struct {
+	sqlite3		*db;
+	rbtree_t	*stmts;		//!< Statements prepared on the writer's handle.
+	uint32_t	max_batch;	//!< Maximum number of queries per transaction.
+
+	pthread_t	thread;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	sqlite_write_t	*head;		//!< Queries waiting to be written.
+	sqlite_write_t	**tail;
+	bool		stop;		//!< Tell the thread to exit once the queue is empty.
+	bool		running;	//!< Whether the thread was started.
+} sqlite_writer_t;
+
 typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
+	bool statement_cached;		//!< statement belongs to stmts, and should be reset, not finalized.
 	int col_count;
+	rbtree_t *stmts;		//!< Statements prepared on this connection.
+
+	sqlite_writer_t *writer;	//!< Writes go to this thread, if set.
+	sqlite_write_t *write;		//!< The last query sent to the writer.
+	int pipe[2];			//!< The writer tells us when our query is done.
+	bool sync_done;			//!< The last query sent with sql_query_send ran synchronously.
+	sql_rcode_t sync_rcode;		//!< And this was the result.
 } rlm_sql_sqlite_conn_t;
 
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	void const	*id;		//!< rlm_sql_stmt_t id.
+	sqlite3_stmt	*stmt;		//!< Prepared statement handle.
+} rlm_sql_sqlite_stmt_t;
+
 typedef struct rlm_sql_sqlite {
 	char const	*filename;
 	uint32_t	busy_timeout;
+	bool		wal;			//!< Use write-ahead logging.
+
+	bool		writer_enable;		//!< Send all writes to a single writer thread.
+	uint32_t	writer_max_batch;	//!< Maximum number of writes per transaction.
+	sqlite_writer_t	*writer;
 } rlm_sql_sqlite_t;
 
+static const CONF_PARSER writer_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, rlm_sql_sqlite_t, writer_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_batch", PW_TYPE_INTEGER, rlm_sql_sqlite_t, writer_max_batch), .dflt = "256" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED, rlm_sql_sqlite_t, filename) },
 	{ FR_CONF_OFFSET("busy_timeout", PW_TYPE_INTEGER, rlm_sql_sqlite_t, busy_timeout), .dflt = "200" },
+	{ FR_CONF_OFFSET("wal", PW_TYPE_BOOLEAN, rlm_sql_sqlite_t, wal), .dflt = "no" },
+	{ FR_CONF_POINTER("writer", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) writer_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -368,12 +445,31 @@ static int sql_loadfile(TALLOC_CTX *ctx, sqlite3 *db, char const *filename)
 }
 #endif
 
+#ifdef HAVE_SQLITE_WRITER
+static void sql_writer_release(rlm_sql_sqlite_conn_t *conn);
+#endif
+
 static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 {
 	int status = 0;
 
 	DEBUG2("Socket destructor called, closing socket");
 
+#ifdef HAVE_SQLITE_WRITER
+	/*
+	 *	The writer may still be working on our last query.
+	 */
+	if (conn->writer) sql_writer_release(conn);
+	if (conn->pipe[0] >= 0) close(conn->pipe[0]);
+	if (conn->pipe[1] >= 0) close(conn->pipe[1]);
+#endif
+
+	/*
+	 *	sqlite3_close() fails if there are
+	 *	unfinalized statements.
+	 */
+	TALLOC_FREE(conn->stmts);
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -383,6 +479,20 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 	return 0;
 }
 
+static int _sql_stmt_free(rlm_sql_sqlite_stmt_t *entry)
+{
+	(void) sqlite3_finalize(entry->stmt);
+
+	return 0;
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_sqlite_stmt_t const *a = one, *b = two;
+
+	return (a->id > b->id) - (a->id < b->id);
+}
+
 static void _sql_greatest(sqlite3_context *ctx, int num_values, sqlite3_value **values)
 {
 	int i;
@@ -398,60 +508,427 @@ static void _sql_greatest(sqlite3_context *ctx, int num_values, sqlite3_value **
 	sqlite3_result_int64(ctx, max);
 }
 
-static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
-					    UNUSED struct timeval const *timeout)
+/** Open a handle to the database, and set it up
+ *
+ * @param[out] out	Where to write the handle.  Must be closed by the
+ *			caller, even on error.
+ * @param[in] inst	of the driver.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sql_db_open(sqlite3 **out, rlm_sql_sqlite_t const *inst)
 {
-	rlm_sql_sqlite_conn_t *conn;
-	rlm_sql_sqlite_t *inst = config->driver;
-
 	int status;
 
-	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_sqlite_conn_t));
-	talloc_set_destructor(conn, _sql_socket_destructor);
-
 	INFO("Opening SQLite database \"%s\"", inst->filename);
 #ifdef HAVE_SQLITE3_OPEN_V2
-	status = sqlite3_open_v2(inst->filename, &(conn->db), SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+	status = sqlite3_open_v2(inst->filename, out, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
 #else
-	status = sqlite3_open(inst->filename, &(conn->db));
+	status = sqlite3_open(inst->filename, out);
 #endif
 
-	if (!conn->db || (sql_check_error(conn->db, status) != RLM_SQL_OK)) {
-		sql_print_error(conn->db, status, "Error opening SQLite database \"%s\"", inst->filename);
-		return RLM_SQL_ERROR;
+	if (!*out || (sql_check_error(*out, status) != RLM_SQL_OK)) {
+		sql_print_error(*out, status, "Error opening SQLite database \"%s\"", inst->filename);
+		return -1;
 	}
-	status = sqlite3_busy_timeout(conn->db, inst->busy_timeout);
-	if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
-		sql_print_error(conn->db, status, "Error setting busy timeout");
-		return RLM_SQL_ERROR;
+	status = sqlite3_busy_timeout(*out, inst->busy_timeout);
+	if (sql_check_error(*out, status) != RLM_SQL_OK) {
+		sql_print_error(*out, status, "Error setting busy timeout");
+		return -1;
 	}
 
 	/*
 	 *	Enable extended return codes for extra debugging info.
 	 */
 #ifdef HAVE_SQLITE3_EXTENDED_RESULT_CODES
-	status = sqlite3_extended_result_codes(conn->db, 1);
-	if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
-		sql_print_error(conn->db, status, "Error enabling extended result codes");
-		return RLM_SQL_ERROR;
+	status = sqlite3_extended_result_codes(*out, 1);
+	if (sql_check_error(*out, status) != RLM_SQL_OK) {
+		sql_print_error(*out, status, "Error enabling extended result codes");
+		return -1;
 	}
 #endif
 
 #ifdef HAVE_SQLITE3_CREATE_FUNCTION_V2
-	status = sqlite3_create_function_v2(conn->db, "GREATEST", -1, SQLITE_ANY, NULL,
+	status = sqlite3_create_function_v2(*out, "GREATEST", -1, SQLITE_ANY, NULL,
 					    _sql_greatest, NULL, NULL, NULL);
 #else
-	status = sqlite3_create_function(conn->db, "GREATEST", -1, SQLITE_ANY, NULL,
+	status = sqlite3_create_function(*out, "GREATEST", -1, SQLITE_ANY, NULL,
 					 _sql_greatest, NULL, NULL);
 #endif
-	if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
-		sql_print_error(conn->db, status, "Failed registering 'GREATEST' sql function");
-		return RLM_SQL_ERROR;
+	if (sql_check_error(*out, status) != RLM_SQL_OK) {
+		sql_print_error(*out, status, "Failed registering 'GREATEST' sql function");
+		return -1;
+	}
+
+	/*
+	 *	Readers don't block the writer, and the writer doesn't
+	 *	block readers.  The journal mode is persistent, but is
+	 *	cheap to set again.  NORMAL is safe with WAL, and avoids
+	 *	an fsync for every commit.
+	 */
+	if (inst->wal) {
+		status = sqlite3_exec(*out, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+		if (sql_check_error(*out, status) != RLM_SQL_OK) {
+			sql_print_error(*out, status, "Error enabling write-ahead logging");
+			return -1;
+		}
+
+		status = sqlite3_exec(*out, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+		if (sql_check_error(*out, status) != RLM_SQL_OK) {
+			sql_print_error(*out, status, "Error setting synchronous mode");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					    UNUSED struct timeval const *timeout)
+{
+	rlm_sql_sqlite_conn_t *conn;
+	rlm_sql_sqlite_t *inst = config->driver;
+
+	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_sqlite_conn_t));
+	conn->pipe[0] = conn->pipe[1] = -1;
+	talloc_set_destructor(conn, _sql_socket_destructor);
+
+	if (sql_db_open(&conn->db, inst) < 0) return RLM_SQL_ERROR;
+
+#ifdef HAVE_SQLITE_WRITER
+	if (inst->writer) {
+		if (pipe(conn->pipe) < 0) {
+			ERROR("Failed creating pipe for writer thread: %s", fr_syserror(errno));
+			return RLM_SQL_ERROR;
+		}
+
+		if ((fr_nonblock(conn->pipe[0]) < 0) || (fr_nonblock(conn->pipe[1]) < 0)) {
+			ERROR("Failed setting pipe to non-blocking: %s", fr_syserror(errno));
+			return RLM_SQL_ERROR;
+		}
+
+		conn->writer = inst->writer;
 	}
+#endif
 
 	return RLM_SQL_OK;
 }
 
+#ifdef HAVE_SQLITE_WRITER
+/** Run one query on the writer's handle
+ *
+ */
+static void sql_writer_run(sqlite_writer_t *writer, sqlite_write_t *w)
+{
+	sqlite3_stmt		*statement = NULL;
+	rlm_sql_sqlite_stmt_t	*entry = NULL;
+	char const		*z_tail;
+	int			status, i;
+
+	if (w->stmt_id) {
+		entry = rbtree_finddata(writer->stmts, &(rlm_sql_sqlite_stmt_t){ .id = w->stmt_id });
+		if (!entry) {
+			MEM(entry = talloc_zero(writer->stmts, rlm_sql_sqlite_stmt_t));
+			entry->id = w->stmt_id;
+
+			status = sqlite3_prepare_v2(writer->db, w->query, strlen(w->query), &entry->stmt, &z_tail);
+			if (status != SQLITE_OK) {
+				talloc_free(entry);
+				goto error;
+			}
+			talloc_set_destructor(entry, _sql_stmt_free);
+
+			if (!rbtree_insert(writer->stmts, entry)) {
+				talloc_free(entry);
+				status = SQLITE_ERROR;
+				goto error;
+			}
+		}
+		statement = entry->stmt;
+
+		for (i = 0; i < w->num_params; i++) {
+			status = sqlite3_bind_text(statement, i + 1, w->values[i], -1, SQLITE_TRANSIENT);
+			if (status != SQLITE_OK) goto error;
+		}
+	} else {
+		status = sqlite3_prepare_v2(writer->db, w->query, strlen(w->query), &statement, &z_tail);
+		if (status != SQLITE_OK) goto error;
+	}
+
+	status = sqlite3_step(statement);
+	if ((status == SQLITE_DONE) || (status == SQLITE_ROW)) {
+		w->status = SQLITE_OK;
+		w->changes = sqlite3_changes(writer->db);
+	} else {
+	error:
+		w->status = status;
+		w->changes = 0;
+		w->error = talloc_typed_strdup(w, sqlite3_errmsg(writer->db));
+	}
+
+	if (entry) {
+		(void) sqlite3_reset(statement);
+		(void) sqlite3_clear_bindings(statement);
+	} else if (statement) {
+		(void) sqlite3_finalize(statement);
+	}
+}
+
+/** Mark the queries in a batch as failed, because the transaction was rolled back
+ *
+ */
+static void sql_writer_fail(sqlite_write_t *head, sqlite_write_t *end, int status, char const *error)
+{
+	sqlite_write_t *w;
+
+	for (w = head; w != end; w = w->next) {
+		if (w->status != SQLITE_OK) continue;
+
+		w->status = status;
+		w->changes = 0;
+		w->error = talloc_typed_strdup(w, error);
+	}
+}
+
+/** Write queued queries, one transaction per batch
+ *
+ * While a batch is being written, more queries are queued, so the
+ * batches get bigger as the load increases.
+ */
+static void *sql_writer_thread(void *arg)
+{
+	sqlite_writer_t	*writer = arg;
+
+	pthread_mutex_lock(&writer->mutex);
+	for (;;) {
+		sqlite_write_t	*head, *w, *next, **last;
+		uint32_t	count = 0;
+		bool		in_transaction;
+		int		status;
+
+		while (!writer->head && !writer->stop) pthread_cond_wait(&writer->cond, &writer->mutex);
+		if (!writer->head) break;
+
+		/*
+		 *	Take up to max_batch queries off the queue.
+		 */
+		head = writer->head;
+		last = &writer->head;
+		while (*last && (count < writer->max_batch)) {
+			last = &(*last)->next;
+			count++;
+		}
+		writer->head = *last;
+		*last = NULL;
+		if (!writer->head) writer->tail = &writer->head;
+		pthread_mutex_unlock(&writer->mutex);
+
+		status = sqlite3_exec(writer->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+		in_transaction = (status == SQLITE_OK);
+		if (!in_transaction) sql_print_error(writer->db, status, "Failed starting transaction, "
+						     "writing queries individually");
+
+		for (w = head; w; w = w->next) {
+			sql_writer_run(writer, w);
+
+			/*
+			 *	Some errors roll back the whole transaction,
+			 *	not just the query.  The queries written so
+			 *	far are lost, so tell their callers.
+			 */
+			if (in_transaction && (w->status != SQLITE_OK) && sqlite3_get_autocommit(writer->db)) {
+				sql_writer_fail(head, w, w->status, w->error);
+				in_transaction = false;
+			}
+		}
+
+		if (in_transaction) {
+			status = sqlite3_exec(writer->db, "COMMIT", NULL, NULL, NULL);
+			if (status != SQLITE_OK) {
+				sql_print_error(writer->db, status, "Failed committing batch of %u queries", count);
+				sql_writer_fail(head, NULL, status, sqlite3_errmsg(writer->db));
+				(void) sqlite3_exec(writer->db, "ROLLBACK", NULL, NULL, NULL);
+			}
+		}
+
+		DEBUG3("Wrote batch of %u queries", count);
+
+		pthread_mutex_lock(&writer->mutex);
+		for (w = head; w; w = next) {
+			next = w->next;
+			w->next = NULL;
+
+			if (w->orphaned) {
+				talloc_free(w);
+				continue;
+			}
+
+			w->done = true;
+			if (write(w->fd, "", 1) < 0) {
+				ERROR("Failed signalling connection: %s", fr_syserror(errno));
+			}
+		}
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+/** Queue a query for the writer thread
+ *
+ * @param[in] conn	the query is being run on.
+ * @param[in] query	to write.  Ignored if stmt is not NULL.
+ * @param[in] stmt	to write, or NULL.
+ */
+static void sql_writer_send(rlm_sql_sqlite_conn_t *conn, char const *query, rlm_sql_stmt_t const *stmt)
+{
+	sqlite_writer_t	*writer = conn->writer;
+	sqlite_write_t	*w;
+	char		buffer[64];
+	int		i;
+
+	sql_writer_release(conn);
+
+	/*
+	 *	Clear out any stale notifications.
+	 */
+	while (read(conn->pipe[0], buffer, sizeof(buffer)) > 0);
+
+	MEM(w = talloc_zero(NULL, sqlite_write_t));
+	if (stmt) {
+		w->stmt_id = stmt->id;
+		MEM(w->query = talloc_typed_strdup(w, stmt->query));
+		w->num_params = stmt->num_params;
+		MEM(w->values = talloc_array(w, char *, stmt->num_params));
+		for (i = 0; i < stmt->num_params; i++) MEM(w->values[i] = talloc_typed_strdup(w->values,
+											     stmt->values[i]));
+	} else {
+		MEM(w->query = talloc_typed_strdup(w, query));
+	}
+	w->fd = conn->pipe[1];
+
+	pthread_mutex_lock(&writer->mutex);
+	*writer->tail = w;
+	writer->tail = &w->next;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+
+	conn->write = w;
+}
+
+/** Check whether the writer has finished with our query
+ *
+ * @param[in] conn	the query was sent on.
+ * @param[in] wait	block until the writer has finished.
+ * @return
+ *	- true if the query is done.
+ *	- false if it's still waiting to be written.
+ */
+static bool sql_writer_done(rlm_sql_sqlite_conn_t *conn, bool wait)
+{
+	char	buffer[64];
+	bool	done;
+
+	if (!conn->write) return true;
+
+	for (;;) {
+		fd_set fds;
+
+		pthread_mutex_lock(&conn->writer->mutex);
+		done = conn->write->done;
+		pthread_mutex_unlock(&conn->writer->mutex);
+
+		if (done || !wait) break;
+
+		FD_ZERO(&fds);
+		FD_SET(conn->pipe[0], &fds);
+		(void) select(conn->pipe[0] + 1, &fds, NULL, NULL, NULL);
+	}
+
+	/*
+	 *	The pipe is only used to wake us up.
+	 */
+	if (done) while (read(conn->pipe[0], buffer, sizeof(buffer)) > 0);
+
+	return done;
+}
+
+/** Free the last query the connection sent to the writer
+ *
+ * If the writer is still working on it, the writer frees it instead.
+ */
+static void sql_writer_release(rlm_sql_sqlite_conn_t *conn)
+{
+	sqlite_writer_t	*writer = conn->writer;
+	sqlite_write_t	*w = conn->write, **last;
+
+	if (!w) return;
+	conn->write = NULL;
+
+	pthread_mutex_lock(&writer->mutex);
+	if (w->done) {
+		pthread_mutex_unlock(&writer->mutex);
+		talloc_free(w);
+		return;
+	}
+
+	/*
+	 *	Still in the queue, we can just take it out.
+	 */
+	for (last = &writer->head; *last; last = &(*last)->next) {
+		if (*last == w) break;
+	}
+	if (*last) {
+		*last = w->next;
+		if (writer->tail == &w->next) writer->tail = last;
+		pthread_mutex_unlock(&writer->mutex);
+		talloc_free(w);
+		return;
+	}
+
+	/*
+	 *	The writer is working on it.
+	 */
+	w->orphaned = true;
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+/** Stop the writer thread, and close its handle
+ *
+ */
+static int _sql_writer_free(sqlite_writer_t *writer)
+{
+	if (writer->running) {
+		pthread_mutex_lock(&writer->mutex);
+		writer->stop = true;
+		pthread_cond_signal(&writer->cond);
+		pthread_mutex_unlock(&writer->mutex);
+
+		pthread_join(writer->thread, NULL);
+	}
+
+	TALLOC_FREE(writer->stmts);
+	if (writer->db) (void) sqlite3_close(writer->db);
+
+	pthread_mutex_destroy(&writer->mutex);
+	pthread_cond_destroy(&writer->cond);
+
+	return 0;
+}
+
+/** Send a query to the writer, and wait for it to be written
+ *
+ */
+static sql_rcode_t sql_writer_query(rlm_sql_sqlite_conn_t *conn, char const *query, rlm_sql_stmt_t const *stmt)
+{
+	sql_writer_send(conn, query, stmt);
+	(void) sql_writer_done(conn, true);
+
+	return sql_error_to_rcode(conn->write->status);
+}
+#endif
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
 {
 	rlm_sql_sqlite_conn_t	*conn = handle->conn;
@@ -486,10 +963,121 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	rcode = sql_check_error(conn->db, status);
 	if (rcode != RLM_SQL_OK) return rcode;
 
+#ifdef HAVE_SQLITE_WRITER
+	if (conn->writer && !sqlite3_stmt_readonly(conn->statement)) {
+		(void) sqlite3_finalize(conn->statement);
+		conn->statement = NULL;
+
+		return sql_writer_query(conn, query, NULL);
+	}
+#endif
+
 	status = sqlite3_step(conn->statement);
 	return sql_check_error(conn->db, status);
 }
 
+/** Execute a prepared statement, preparing it first if this connection hasn't seen it before
+ *
+ * The statement is reset in sql_free_result(), so it can be reused.
+ */
+static sql_rcode_t sql_query_stmt(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				  rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_sqlite_stmt_t	*entry;
+	char const		*z_tail;
+	sql_rcode_t		rcode;
+	int			status, i;
+
+	if (!conn->stmts) MEM(conn->stmts = rbtree_create(conn, sql_stmt_cmp, NULL, 0));
+
+	entry = rbtree_finddata(conn->stmts, &(rlm_sql_sqlite_stmt_t){ .id = stmt->id });
+	if (!entry) {
+		MEM(entry = talloc_zero(conn->stmts, rlm_sql_sqlite_stmt_t));
+		entry->id = stmt->id;
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &entry->stmt, &z_tail);
+#else
+		status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &entry->stmt, &z_tail);
+#endif
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) {
+			talloc_free(entry);
+			return rcode;
+		}
+		talloc_set_destructor(entry, _sql_stmt_free);
+
+		if (!rbtree_insert(conn->stmts, entry)) {
+			talloc_free(entry);
+			return RLM_SQL_ERROR;
+		}
+	}
+
+#ifdef HAVE_SQLITE_WRITER
+	/*
+	 *	The statement is still prepared here, so we know
+	 *	whether this connection can run it.
+	 */
+	if (conn->writer && !sqlite3_stmt_readonly(entry->stmt)) return sql_writer_query(conn, NULL, stmt);
+#endif
+
+	conn->statement = entry->stmt;
+	conn->statement_cached = true;
+	conn->col_count = 0;
+
+	for (i = 0; i < stmt->num_params; i++) {
+		status = sqlite3_bind_text(entry->stmt, i + 1, stmt->values[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	status = sqlite3_step(entry->stmt);
+	return sql_check_error(conn->db, status);
+}
+
+#ifdef HAVE_SQLITE_WRITER
+/** Send a query to the writer thread, without waiting for it to be written
+ *
+ * If there's no writer, the query is run immediately, and the result
+ * is returned by the first call to sql_query_poll().
+ */
+static sql_rcode_t sql_query_send(int *fd, rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+				  rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	if (!conn->writer) {
+		conn->sync_rcode = stmt ? sql_query_stmt(handle, config, stmt) : sql_query(handle, config, query);
+		conn->sync_done = true;
+		*fd = -1;
+
+		return RLM_SQL_OK;
+	}
+
+	sql_writer_send(conn, query, stmt);
+	conn->sync_done = false;
+	*fd = conn->pipe[0];
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_poll(bool *done, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	if (conn->sync_done) {
+		*done = true;
+		return conn->sync_rcode;
+	}
+
+	*done = sql_writer_done(conn, false);
+	if (!*done) return RLM_SQL_OK;
+
+	return sql_error_to_rcode(conn->write->status);
+}
+#endif
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -610,11 +1198,21 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		if (conn->statement_cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->statement_cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
 
+#ifdef HAVE_SQLITE_WRITER
+	if (conn->write) sql_writer_release(conn);
+#endif
+
 	/*
 	 *	There's no point in checking the code returned by finalize
 	 *	as it'll have already been encountered elsewhere in the code.
@@ -645,6 +1243,9 @@ static size_t sql_error(UNUSED TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UN
 	rad_assert(outlen > 0);
 
 	error = sqlite3_errmsg(conn->db);
+#ifdef HAVE_SQLITE_WRITER
+	if (conn->write) error = conn->write->error;
+#endif
 	if (!error) return 0;
 
 	out[0].type = L_ERR;
@@ -663,6 +1264,10 @@ static int sql_affected_rows(rlm_sql_handle_t *handle,
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
 
+#ifdef HAVE_SQLITE_WRITER
+	if (conn->write) return conn->write->changes;
+#endif
+
 	if (conn->db) return sqlite3_changes(conn->db);
 
 	return -1;
@@ -775,6 +1380,52 @@ static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_
 #endif
 	}
 
+	if (inst->writer_enable) {
+#ifdef HAVE_SQLITE_WRITER
+		sqlite_writer_t	*writer;
+		int		ret;
+
+		if (!inst->wal) {
+			cf_log_err_cs(cs, "'writer' requires 'wal = yes', otherwise readers block the writer");
+			return -1;
+		}
+
+		if (config->accounting.batch_size) {
+			cf_log_err_cs(cs, "'writer' can't be used with accounting 'batch', the writer already "
+				      "batches queries");
+			return -1;
+		}
+
+		if (!inst->writer_max_batch) inst->writer_max_batch = 1;
+
+		MEM(writer = talloc_zero(inst, sqlite_writer_t));
+		writer->max_batch = inst->writer_max_batch;
+		writer->tail = &writer->head;
+		pthread_mutex_init(&writer->mutex, NULL);
+		pthread_cond_init(&writer->cond, NULL);
+		talloc_set_destructor(writer, _sql_writer_free);
+
+		if (sql_db_open(&writer->db, inst) < 0) {
+			talloc_free(writer);
+			return -1;
+		}
+		MEM(writer->stmts = rbtree_create(writer, sql_stmt_cmp, NULL, 0));
+
+		ret = pthread_create(&writer->thread, NULL, sql_writer_thread, writer);
+		if (ret != 0) {
+			ERROR("Failed creating writer thread: %s", fr_syserror(ret));
+			talloc_free(writer);
+			return -1;
+		}
+		writer->running = true;
+
+		inst->writer = writer;
+#else
+		cf_log_err_cs(cs, "'writer' requires SQLite >= 3.7.4");
+		return -1;
+#endif
+	}
+
 	return 0;
 }
 
@@ -802,6 +1453,10 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
+#ifdef HAVE_SQLITE_WRITER
+	.sql_query_send			= sql_query_send,
+	.sql_query_poll			= sql_query_poll,
+#endif
 	.sql_num_fields			= sql_num_fields,
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fetch_row			= sql_fetch_row,
@@ -809,5 +1464,6 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_query_stmt			= sql_query_stmt
 };
@@ -33,6 +33,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/map_proc.h>
 #include <freeradius-devel/token.h>
 #include <freeradius-devel/rad_assert.h>
@@ -42,6 +43,55 @@ RCSID("$Id$")
 
 #include "rlm_sql.h"
 
+/** A redundant set of accounting queries, waiting to be written as part of a batch
+ *
+ */
+typedef struct sql_batch_entry {
+	REQUEST			*request;	//!< Waiting for the batch to be committed, or NULL.
+	char			**query;	//!< Expanded queries in the redundant set.
+	int			num_queries;	//!< Number of queries in the set.
+	rlm_rcode_t		rcode;		//!< Result of the set, once written.
+	bool			done;		//!< The batch containing this entry has been written.
+	struct sql_batch_entry	*next;		//!< Next entry in the batch.
+} sql_batch_entry_t;
+
+/** Thread specific rlm_sql instance data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;		//!< Instance of rlm_sql.
+	fr_event_list_t		*el;		//!< This thread's event list.
+
+	sql_batch_entry_t	*head;		//!< Oldest entry in the current batch.
+	sql_batch_entry_t	**tail;		//!< Where the next entry should be linked.
+	uint32_t		num_entries;	//!< Number of entries in the current batch.
+	fr_event_timer_t	*ev;		//!< Writes the batch once batch_interval has passed.
+
+	uint64_t		*replica_latency;	//!< Smoothed authorize latency (usec) of each replica.
+	rbtree_t		*cache;		//!< Authorize query results, keyed by expanded query.
+} rlm_sql_thread_t;
+
+/** The result of an authorize query, cached by the thread which ran it
+ *
+ */
+typedef struct {
+	char const		*query;		//!< Expanded query.
+	VALUE_PAIR		*vps;		//!< Pairs the query produced.
+	int			rows;		//!< Number of rows the query returned.
+	time_t			expires;	//!< When the entry should no longer be used.
+} sql_cache_entry_t;
+
+/*
+ *	One in this many authorize requests is sent to a random replica,
+ *	so the latency estimates of the others don't go stale.
+ */
+#define SQL_REPLICA_EXPLORE	16
+
+/*
+ *	Latency of a replica which had no connections available.
+ */
+#define SQL_REPLICA_DOWN	UINT64_MAX
+
 /*
  *	So we can do pass2 xlat checks on the queries.
  */
@@ -63,9 +113,17 @@ static const CONF_PARSER type_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("size", PW_TYPE_INTEGER, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("interval", PW_TYPE_TIMEVAL, rlm_sql_config_t, accounting.batch_interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("wait", PW_TYPE_BOOLEAN, rlm_sql_config_t, accounting.batch_wait), .dflt = "yes" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
+	{ FR_CONF_POINTER("batch", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
 
 	{ FR_CONF_POINTER("type", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) type_config },
 	CONF_PARSER_TERMINATOR
@@ -79,6 +137,12 @@ static const CONF_PARSER postauth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER authorize_cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", PW_TYPE_INTEGER, rlm_sql_config_t, authorize_cache_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_sql_config_t, authorize_cache_max), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_sql_config_t, sql_driver_name), .dflt = "rlm_sql_null" },
 	{ FR_CONF_OFFSET("server", PW_TYPE_STRING, rlm_sql_config_t, sql_server), .dflt = "" },	/* Must be zero length so drivers can determine if it was set */
@@ -96,6 +160,9 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("default_user_profile", PW_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("client_query", PW_TYPE_STRING, rlm_sql_config_t, client_query), .dflt = "SELECT id,nasname,shortname,type,secret FROM nas" },
 	{ FR_CONF_OFFSET("open_query", PW_TYPE_STRING, rlm_sql_config_t, connect_query) },
+	{ FR_CONF_OFFSET("prepared_statements", PW_TYPE_BOOLEAN, rlm_sql_config_t, prepared_statements), .dflt = "no" },
+	{ FR_CONF_OFFSET("read_replica", PW_TYPE_STRING | PW_TYPE_MULTI, rlm_sql_config_t, read_replicas) },
+	{ FR_CONF_POINTER("authorize_cache", PW_TYPE_SUBSECTION, NULL), .subcs = (void const *) authorize_cache_config },
 
 	{ FR_CONF_OFFSET("authorize_check_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
 	{ FR_CONF_OFFSET("authorize_reply_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
@@ -853,8 +920,183 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	return 1;
 }
 
-static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
-					  sql_fall_through_t *do_fall_through)
+static int sql_cache_entry_cmp(void const *one, void const *two)
+{
+	sql_cache_entry_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static void sql_cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int sql_cache_entry_expire(void *ctx, void *data)
+{
+	time_t			*now = ctx;
+	sql_cache_entry_t	*entry = data;
+
+	return (entry->expires <= *now) ? 2 : 0;
+}
+
+/** Run an authorize query, using this thread's cached result if there is one
+ *
+ * Results (including ones with no rows) are cached for authorize_cache.ttl seconds,
+ * keyed by the expanded query, so repeated authorizations of the same user don't
+ * go to the database.
+ *
+ * @param[in] ctx	to allocate pairs in.
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] t		Thread specific instance data.
+ * @param[in] request	The current request.
+ * @param[in,out] handle	to query the database with.
+ * @param[out] pair	Where to add the pairs.
+ * @param[in] query	Expanded query.
+ * @return
+ *	- The number of rows the query returned.
+ *	- -1 on error.
+ */
+static int sql_getvpdata_cached(TALLOC_CTX *ctx, rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+				rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query)
+{
+	sql_cache_entry_t	find, *entry;
+	VALUE_PAIR		*vps = NULL;
+	time_t			now;
+	int			rows;
+
+	if (!t->cache) return sql_getvpdata(ctx, inst, request, handle, pair, query);
+
+	now = time(NULL);
+
+	find.query = query;
+	entry = rbtree_finddata(t->cache, &find);
+	if (entry) {
+		if (entry->expires > now) {
+			RDEBUG2("Using cached result for query: %s", query);
+
+			if (entry->vps) {
+				vps = fr_pair_list_copy(ctx, entry->vps);
+				if (!vps) {
+					REDEBUG("Failed copying cached pairs");
+					return -1;
+				}
+				fr_pair_add(pair, vps);
+			}
+
+			return entry->rows;
+		}
+		rbtree_deletebydata(t->cache, entry);
+	}
+
+	rows = sql_getvpdata(ctx, inst, request, handle, &vps, query);
+	if (rows < 0) return rows;
+
+	if (rbtree_num_elements(t->cache) >= inst->config->authorize_cache_max) {
+		rbtree_walk(t->cache, RBTREE_DELETE_ORDER, sql_cache_entry_expire, &now);
+	}
+
+	if (rbtree_num_elements(t->cache) < inst->config->authorize_cache_max) {
+		entry = talloc_zero(t->cache, sql_cache_entry_t);
+		if (!entry) goto done;
+
+		entry->query = talloc_typed_strdup(entry, query);
+		entry->rows = rows;
+		entry->expires = now + inst->config->authorize_cache_ttl;
+		if (vps) {
+			entry->vps = fr_pair_list_copy(entry, vps);
+			if (!entry->vps) {
+				talloc_free(entry);
+				goto done;
+			}
+		}
+
+		if (!rbtree_insert(t->cache, entry)) talloc_free(entry);
+	}
+
+done:
+	fr_pair_add(pair, vps);
+
+	return rows;
+}
+
+/** Reserve a connection for authorize queries
+ *
+ * Replicas are tried in order of their smoothed latency, apart from one request in
+ * #SQL_REPLICA_EXPLORE, which tries a random replica first.  The primary is only
+ * used if none of the replicas have a connection available.
+ *
+ * @param[out] replica	Index of the replica the connection belongs to, or -1 for the primary.
+ * @param[in] inst	rlm_sql instance.
+ * @param[in] t		Thread specific instance data.
+ * @param[in] request	The current request.
+ * @return
+ *	- A connection handle.
+ *	- NULL if no connections were available.
+ */
+static rlm_sql_handle_t *sql_read_handle_get(int *replica, rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					     REQUEST *request)
+{
+	rlm_sql_handle_t	*handle;
+	int			i, first = 0;
+
+	*replica = -1;
+
+	if (inst->num_replicas == 0) return fr_connection_get(inst->pool, request);
+
+	if ((fr_rand() % SQL_REPLICA_EXPLORE) == 0) {
+		first = fr_rand() % inst->num_replicas;
+	} else {
+		for (i = 1; i < inst->num_replicas; i++) {
+			if (t->replica_latency[i] < t->replica_latency[first]) first = i;
+		}
+	}
+
+	for (i = 0; i < inst->num_replicas; i++) {
+		int idx = (first + i) % inst->num_replicas;
+
+		handle = fr_connection_get(inst->replicas[idx]->pool, request);
+		if (handle) {
+			RDEBUG3("Using read replica \"%s\"", inst->replicas[idx]->name);
+			*replica = idx;
+			return handle;
+		}
+
+		t->replica_latency[idx] = SQL_REPLICA_DOWN;
+	}
+
+	RWDEBUG("No read replicas available, using primary");
+
+	return fr_connection_get(inst->pool, request);
+}
+
+/** Update the smoothed latency of a replica
+ *
+ * @param[in] t		Thread specific instance data.
+ * @param[in] replica	the connection was reserved from.
+ * @param[in] start	When the connection was reserved.
+ */
+static void sql_read_latency_update(rlm_sql_thread_t *t, int replica, struct timeval const *start)
+{
+	struct timeval	now;
+	uint64_t	sample, *latency;
+
+	if (replica < 0) return;
+
+	gettimeofday(&now, NULL);
+	sample = ((uint64_t) (now.tv_sec - start->tv_sec) * 1000000) + (now.tv_usec - start->tv_usec);
+
+	latency = &t->replica_latency[replica];
+	if (!*latency || (*latency == SQL_REPLICA_DOWN)) {
+		*latency = sample;
+		return;
+	}
+
+	*latency = *latency - (*latency / 8) + (sample / 8);
+}
+
+static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+					  rlm_sql_handle_t **handle, sql_fall_through_t *do_fall_through)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *sql_group = NULL;
@@ -926,7 +1168,7 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded);
+			rows = sql_getvpdata_cached(request, inst, t, request, handle, &check_tmp, expanded);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
@@ -976,7 +1218,7 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t const *inst, REQUEST *reques
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded);
+			rows = sql_getvpdata_cached(request->reply, inst, t, request, handle, &reply_tmp, expanded);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
@@ -1160,6 +1402,98 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 }
 
 
+static int sql_batch_pair_cmp(void const *one, void const *two)
+{
+	return (one > two) - (one < two);
+}
+
+/** Record which queries may be batched
+ *
+ * Queries may be batched if the section containing them has "batch = yes".
+ */
+static void sql_batch_pairs_add(rbtree_t *tree, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci;
+	CONF_PAIR	*cp;
+	bool		batch = false;
+
+	if (cf_pair_find(cs, "batch")) {
+		if (cf_pair_parse(cs, "batch", FR_ITEM_POINTER(PW_TYPE_BOOLEAN, &batch), NULL, T_INVALID) < 0) return;
+	}
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			sql_batch_pairs_add(tree, cf_item_to_section(ci));
+			continue;
+		}
+
+		if (!batch || !cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		if (strcmp(cf_pair_attr(cp), "batch") == 0) continue;
+
+		rbtree_insert(tree, cp);
+	}
+}
+
+static int sql_stmt_tmpl_cmp(void const *one, void const *two)
+{
+	sql_stmt_tmpl_t const *a = one, *b = two;
+
+	return (a->cp > b->cp) - (a->cp < b->cp);
+}
+
+/** Add templates for all the queries in a section, and its subsections
+ *
+ */
+static void sql_stmt_tmpls_add(rlm_sql_t const *inst, rbtree_t *tree, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci;
+	CONF_PAIR	*cp;
+	sql_stmt_tmpl_t	*tmpl;
+	char const	*attr;
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			sql_stmt_tmpls_add(inst, tree, cf_item_to_section(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		attr = cf_pair_attr(cp);
+		if ((strcmp(attr, "reference") == 0) || (strcmp(attr, "logfile") == 0)) continue;
+
+		tmpl = sql_stmt_tmpl_alloc(tree, cp, (inst->driver->flags & RLM_SQL_FLAGS_PARAM_NUMBERED));
+		if (!tmpl) {
+			cf_log_warn_cp(cp, "Query can't be prepared, it will be expanded and escaped as normal");
+			continue;
+		}
+
+		if (!rbtree_insert(tree, tmpl)) talloc_free(tmpl);
+	}
+}
+
+/** Build prepared statement templates for an accounting or post-auth section
+ *
+ * Sections which log their queries to a file are skipped, as the log
+ * should contain the expanded queries.
+ */
+static void sql_stmt_tmpls_init(rlm_sql_t *inst, sql_acct_section_t *section)
+{
+	if (!section->cs || section->logfile) return;
+
+	section->stmts = rbtree_create(inst, sql_stmt_tmpl_cmp, NULL, 0);
+	if (!section->stmts) return;
+
+	sql_stmt_tmpls_add(inst, section->stmts, section->cs);
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_sql_t *inst = instance;
@@ -1207,6 +1541,75 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->config->postauth.cs = cf_section_sub_find(conf, "post-auth");
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	if (inst->config->accounting.batch_size) {
+		if (inst->config->logfile || inst->config->accounting.logfile) {
+			WARN("Ignoring accounting batch as queries are being written to a logfile");
+			inst->config->accounting.batch_size = 0;
+		} else if (!timerisset(&inst->config->accounting.batch_interval)) {
+			cf_log_err_cs(inst->config->accounting.cs, "Batch interval must be greater than zero");
+			return -1;
+		} else {
+			MEM(inst->config->accounting.batched = rbtree_create(inst, sql_batch_pair_cmp, NULL, 0));
+			sql_batch_pairs_add(inst->config->accounting.batched, inst->config->accounting.cs);
+		}
+	}
+
+	if (inst->config->prepared_statements) {
+		if (!inst->driver->sql_query_stmt) {
+			WARN("Ignoring prepared_statements as driver %s does not support them", inst->driver->name);
+			inst->config->prepared_statements = false;
+		} else if (inst->config->logfile) {
+			WARN("Ignoring prepared_statements as queries are being written to a logfile");
+			inst->config->prepared_statements = false;
+		} else {
+			sql_stmt_tmpls_init(inst, &inst->config->accounting);
+			sql_stmt_tmpls_init(inst, &inst->config->postauth);
+		}
+	}
+
+	/*
+	 *	Read replicas are other instances of rlm_sql, using
+	 *	the same driver, which authorize queries are sent to.
+	 */
+	if (inst->config->read_replicas) {
+		CONF_SECTION	*modules = cf_section_sub_find(main_config.config, "modules");
+		int		i;
+
+		for (i = 0; inst->config->read_replicas[i]; i++);
+
+		MEM(inst->replicas = talloc_array(inst, rlm_sql_t const *, i));
+
+		for (i = 0; inst->config->read_replicas[i]; i++) {
+			char const		*name = inst->config->read_replicas[i];
+			module_instance_t	*mi;
+			rlm_sql_t const		*replica;
+
+			mi = module_find(modules, name);
+			if (!mi) {
+				cf_log_err_cs(conf, "Failed to find read replica \"%s\"", name);
+				return -1;
+			}
+
+			if (strcmp(mi->module->name, "sql") != 0) {
+				cf_log_err_cs(conf, "Read replica \"%s\" is not an instance of the rlm_sql module", name);
+				return -1;
+			}
+
+			replica = mi->data;
+			if (replica == inst) {
+				cf_log_err_cs(conf, "Module cannot be its own read replica");
+				return -1;
+			}
+
+			if (replica->driver != inst->driver) {
+				cf_log_err_cs(conf, "Read replica \"%s\" must use driver %s", name, inst->driver->name);
+				return -1;
+			}
+
+			inst->replicas[inst->num_replicas++] = replica;
+		}
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1256,13 +1659,17 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rcode_t rcode = RLM_MODULE_NOOP;
 
 	rlm_sql_t const *inst = instance;
+	rlm_sql_thread_t *t = thread;
 	rlm_sql_handle_t  *handle;
+	fr_connection_pool_t *pool;
+	int	replica;
+	struct timeval	start;
 
 	VALUE_PAIR *check_tmp = NULL;
 	VALUE_PAIR *reply_tmp = NULL;
@@ -1298,8 +1705,12 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
+	 *
+	 *	If there are read replicas, all the queries below are sent to one of them.
 	 */
-	handle = fr_connection_get(inst->pool, request);
+	gettimeofday(&start, NULL);
+	handle = sql_read_handle_get(&replica, inst, t, request);
+	pool = (replica < 0) ? inst->pool : inst->replicas[replica]->pool;
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto error;
@@ -1319,7 +1730,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 			goto error;
 		}
 
-		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded);
+		rows = sql_getvpdata_cached(request, inst, t, request, &handle, &check_tmp, expanded);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("Failed getting check attributes");
@@ -1367,7 +1778,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 			goto error;
 		}
 
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded);
+		rows = sql_getvpdata_cached(request->reply, inst, t, request, &handle, &reply_tmp, expanded);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
@@ -1402,7 +1813,7 @@ skipreply:
 		rlm_rcode_t ret;
 
 		RDEBUG3("... falling-through to group processing");
-		ret = rlm_sql_process_groups(inst, request, &handle, &do_fall_through);
+		ret = rlm_sql_process_groups(inst, t, request, &handle, &do_fall_through);
 		switch (ret) {
 		/*
 		 *	Nothing bad happened, continue...
@@ -1457,7 +1868,7 @@ skipreply:
 			goto error;
 		}
 
-		ret = rlm_sql_process_groups(inst, request, &handle, &do_fall_through);
+		ret = rlm_sql_process_groups(inst, t, request, &handle, &do_fall_through);
 		switch (ret) {
 		/*
 		 *	Nothing bad happened, continue...
@@ -1492,7 +1903,8 @@ release:
 		rcode = RLM_MODULE_NOTFOUND;
 	}
 
-	fr_connection_release(inst->pool, request, handle);
+	fr_connection_release(pool, request, handle);
+	if (handle) sql_read_latency_update(t, replica, &start);
 	sql_unset_user(inst, request);
 
 	return rcode;
@@ -1502,195 +1914,646 @@ error:
 	fr_pair_list_free(&reply_tmp);
 	sql_unset_user(inst, request);
 
-	fr_connection_release(inst->pool, request, handle);
+	fr_connection_release(pool, request, handle);
 
 	return rcode;
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
- *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
+/** State for a redundant set of accounting or post-auth queries
  *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+ */
+typedef struct {
+	sql_acct_section_t	*section;	//!< Section the queries came from.
+	rlm_sql_handle_t	*handle;	//!< Reserved for the lifetime of the request.
+	CONF_PAIR		*pair;		//!< Query currently being executed.
+	char const		*attr;		//!< Name shared by the redundant set of queries.
+	char			*expanded;	//!< Expanded query, kept in case we need to resend it.
+	rlm_sql_stmt_t		*stmt;		//!< Prepared statement, used instead of expanded
+						//!< if the query has a template.
+	int			fd;		//!< Watched for the query result.
+	sql_rcode_t		sql_ret;	//!< Result of the query.
+} sql_acct_ctx_t;
+
+/** Release the handle, and free the query state
  *
  */
-static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+static rlm_rcode_t acct_finish(rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx, rlm_rcode_t rcode)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	fr_connection_release(inst->pool, request, actx->handle);
+	sql_unset_user(inst, request);
+	talloc_free(actx);
 
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
+	return rcode;
+}
 
-	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
+/** Process the result of a query from the redundant set
+ *
+ * @param[out] rcode	to return from the module, if the set is finished.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	The current request.
+ * @param[in] actx	State of the redundant set.
+ * @return
+ *	- true if we're done, and *rcode should be returned.
+ *	- false if the next query in the set should be tried.
+ */
+static bool acct_query_result(rlm_rcode_t *rcode, rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx)
+{
+	int numaffected;
 
-	char			path[FR_MAX_STRING_LEN];
-	char			*p = path;
-	char			*expanded = NULL;
+	TALLOC_FREE(actx->expanded);
+	TALLOC_FREE(actx->stmt);
+	RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, actx->sql_ret, "<INVALID>"));
 
-	rad_assert(section);
+	switch (actx->sql_ret) {
+	/*
+	 *  Query was a success! Now we just need to check if it did anything.
+	 */
+	case RLM_SQL_OK:
+		break;
 
-	if (section->reference[0] != '.') {
-		*p++ = '.';
-	}
+	/*
+	 *  A general, unrecoverable server fault.
+	 */
+	case RLM_SQL_ERROR:
+	default:
+	/*
+	 *  If we get RLM_SQL_RECONNECT it means all connections in the pool
+	 *  were exhausted, and we couldn't create a new connection,
+	 *  so we do not need to call fr_connection_release.
+	 */
+	case RLM_SQL_RECONNECT:
+		*rcode = acct_finish(inst, request, actx, RLM_MODULE_FAIL);
+		return true;
 
-	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
+	/*
+	 *  Query was invalid, this is a terminal error, but we still need
+	 *  to do cleanup, as the connection handle is still valid.
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		*rcode = acct_finish(inst, request, actx, RLM_MODULE_INVALID);
+		return true;
 
-		goto finish;
+	/*
+	 *  Driver found an error (like a unique key constraint violation)
+	 *  that hinted it might be a good idea to try an alternative query.
+	 */
+	case RLM_SQL_ALT_QUERY:
+		goto next;
 	}
+	rad_assert(actx->handle);
 
 	/*
-	 *	If we can't find a matching config item we do
-	 *	nothing so return RLM_MODULE_NOOP.
+	 *  We need to have updated something for the query to have been
+	 *  counted as successful.
 	 */
-	item = cf_reference_item(NULL, section->cs, path);
-	if (!item) {
-		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
+	numaffected = (inst->driver->sql_affected_rows)(actx->handle, inst->config);
+	(inst->driver->sql_finish_query)(actx->handle, inst->config);
+	RDEBUG("%i record(s) updated", numaffected);
 
-		goto finish;
+	if (numaffected > 0) {	/* A query succeeded, were done! */
+		*rcode = acct_finish(inst, request, actx, RLM_MODULE_OK);
+		return true;
 	}
-	if (cf_item_is_section(item)){
-		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
 
-		goto finish;
+next:
+	/*
+	 *  We assume all entries with the same name form a redundant
+	 *  set of queries.
+	 */
+	actx->pair = cf_pair_find_next(actx->section->cs, actx->pair, actx->attr);
+	if (!actx->pair) {
+		RDEBUG("No additional queries configured");
+		*rcode = acct_finish(inst, request, actx, RLM_MODULE_NOOP);
+		return true;
 	}
 
-	pair = cf_item_to_pair(item);
-	attr = cf_pair_attr(pair);
-
-	RDEBUG2("Using query template '%s'", attr);
-
-	handle = fr_connection_get(inst->pool, request);
-	if (!handle) {
-		rcode = RLM_MODULE_FAIL;
+	RDEBUG("Trying next query...");
 
-		goto finish;
-	}
+	return false;
+}
 
-	sql_set_user(inst, request, NULL);
+/** Called when the result of an accounting or post-auth query arrives
+ *
+ */
+static void acct_query_readable(REQUEST *request, void *instance, UNUSED void *thread, void *ctx, int fd)
+{
+	rlm_sql_t const		*inst = instance;
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(ctx, sql_acct_ctx_t);
 
-	while (true) {
-		value = cf_pair_value(pair);
-		if (!value) {
-			RDEBUG("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
+	if (!rlm_sql_query_poll(&actx->sql_ret, inst, request, actx->handle)) return;
 
-			goto finish;
-		}
+	unlang_event_fd_delete(request, actx, fd);
+	unlang_resumable(request);
+}
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+/** Stop waiting for a query result if the request is cancelled
+ *
+ * The query is still running on the connection, so the connection
+ * can't be reused.
+ */
+static void acct_query_action(REQUEST *request, void *instance, UNUSED void *thread, void *ctx,
+			      fr_state_action_t action)
+{
+	rlm_sql_t const		*inst = instance;
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(ctx, sql_acct_ctx_t);
 
-			goto finish;
-		}
+	if (action != FR_ACTION_DONE) return;
 
-		if (!*expanded) {
-			RDEBUG("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
-			talloc_free(expanded);
+	RDEBUG("Cancelling pending SQL query");
 
-			goto finish;
-		}
+	unlang_event_fd_delete(request, actx, actx->fd);
+	fr_connection_close(inst->pool, request, actx->handle);
+	sql_unset_user(inst, request);
+	talloc_free(actx);
+}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+static rlm_rcode_t acct_query_resume(REQUEST *request, void *instance, void *thread, void *ctx);
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
-		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
+/** Evaluate the parameters of a prepared statement
+ *
+ * Values are bound as parameters, so aren't escaped.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int acct_stmt_alloc(rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx,
+			   sql_stmt_tmpl_t const *tmpl)
+{
+	rlm_sql_stmt_t	*stmt;
+	char		*value;
+	int		i;
+
+	MEM(stmt = talloc_zero(actx, rlm_sql_stmt_t));
+	stmt->id = tmpl;
+	stmt->query = tmpl->query;
+	stmt->num_params = tmpl->num_params;
+	MEM(stmt->values = talloc_array(stmt, char const *, tmpl->num_params));
+
+	for (i = 0; i < tmpl->num_params; i++) {
+		if (xlat_aeval(stmt, &value, request, tmpl->xlat[i], NULL, NULL) < 0) {
+			talloc_free(stmt);
+			return -1;
+		}
+		RDEBUG3("Parameter %i: '%s'", i + 1, value);
+		stmt->values[i] = value;
+	}
+	actx->stmt = stmt;
+
+	return 0;
+}
+
+/** Run queries from the redundant set until one updates rows
+ *
+ * If the driver supports it, the query is sent, and the request
+ * yields until the result arrives.
+ */
+static rlm_rcode_t acct_query(rlm_sql_t const *inst, REQUEST *request, sql_acct_ctx_t *actx)
+{
+	rlm_rcode_t	rcode;
+	char const	*value;
+	sql_stmt_tmpl_t	*tmpl = NULL;
 
+	while (true) {
+		value = cf_pair_value(actx->pair);
+		if (!value) {
+			RDEBUG("Ignoring null query");
+			return acct_finish(inst, request, actx, RLM_MODULE_NOOP);
+		}
+
+		if (actx->section->stmts) {
+			tmpl = rbtree_finddata(actx->section->stmts, &(sql_stmt_tmpl_t){ .cp = actx->pair });
+		}
+
+		if (tmpl) {
+			if (acct_stmt_alloc(inst, request, actx, tmpl) < 0) {
+				return acct_finish(inst, request, actx, RLM_MODULE_FAIL);
+			}
+		} else {
+			if (xlat_aeval(actx, &actx->expanded, request, value, inst->sql_escape_func, actx->handle) < 0) {
+				return acct_finish(inst, request, actx, RLM_MODULE_FAIL);
+			}
+
+			if (!*actx->expanded) {
+				RDEBUG("Ignoring null query");
+				return acct_finish(inst, request, actx, RLM_MODULE_NOOP);
+			}
+
+			rlm_sql_query_log(inst, request, actx->section, actx->expanded);
+		}
+
+		if (!inst->driver->sql_query_send) {
+			actx->sql_ret = actx->stmt ? rlm_sql_query_stmt(inst, request, &actx->handle, actx->stmt) :
+						     rlm_sql_query(inst, request, &actx->handle, actx->expanded);
+		} else {
+			actx->sql_ret = rlm_sql_query_send(&actx->fd, inst, request, &actx->handle,
+							   actx->expanded, actx->stmt);
+
+			/*
+			 *	The result may already be available,
+			 *	otherwise wait for it.
+			 */
+			if ((actx->sql_ret == RLM_SQL_OK) &&
+			    !rlm_sql_query_poll(&actx->sql_ret, inst, request, actx->handle)) {
+				if (unlang_event_fd_readable_add(request, acct_query_readable, actx, actx->fd) < 0) {
+					REDEBUG("Failed adding SQL connection to event loop");
+					fr_connection_close(inst->pool, request, actx->handle);
+					actx->handle = NULL;
+					return acct_finish(inst, request, actx, RLM_MODULE_FAIL);
+				}
+
+				return unlang_yield(request, acct_query_resume, acct_query_action, actx);
+			}
+		}
+
+		if (acct_query_result(&rcode, inst, request, actx)) return rcode;
+	}
+}
+
+static rlm_rcode_t acct_query_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_t const		*inst = instance;
+	sql_acct_ctx_t		*actx = talloc_get_type_abort(ctx, sql_acct_ctx_t);
+	rlm_rcode_t		rcode;
+
+	/*
+	 *	The connection went away while we were waiting,
+	 *	try again synchronously with a new one.
+	 */
+	if (actx->sql_ret == RLM_SQL_RECONNECT) {
+		actx->handle = fr_connection_reconnect(inst->pool, request, actx->handle);
+		if (actx->handle) {
+			actx->sql_ret = actx->stmt ? rlm_sql_query_stmt(inst, request, &actx->handle, actx->stmt) :
+						     rlm_sql_query(inst, request, &actx->handle, actx->expanded);
+		}
+	}
+
+	if (acct_query_result(&rcode, inst, request, actx)) return rcode;
+
+	return acct_query(inst, request, actx);
+}
+
+/** Run a redundant set of queries from a batch
+ *
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in,out] handle	to run the queries on.  May be set to NULL
+ *			if the connection failed.
+ * @param[in] entry	containing the queries.
+ * @param[in] txn	Whether the queries are part of a transaction.  If they are,
+ *			any error aborts the transaction.
+ * @return
+ *	- 0 if entry->rcode has been set.
+ *	- -1 if the transaction should be rolled back.
+ */
+static int batch_entry_run(rlm_sql_t const *inst, rlm_sql_handle_t **handle, sql_batch_entry_t *entry, bool txn)
+{
+	REQUEST		*request = entry->request;
+	sql_rcode_t	sql_ret;
+	int		i, numaffected;
+
+	for (i = 0; i < entry->num_queries; i++) {
+		if (!*handle) break;
+
+		sql_ret = rlm_sql_query(inst, request, handle, entry->query[i]);
 		switch (sql_ret) {
-		/*
-		 *  Query was a success! Now we just need to check if it did anything.
-		 */
 		case RLM_SQL_OK:
 			break;
 
-		/*
-		 *  A general, unrecoverable server fault.
-		 */
+		case RLM_SQL_ALT_QUERY:
+			if (txn) return -1;
+			continue;
+
+		case RLM_SQL_QUERY_INVALID:
+			if (txn) return -1;
+			entry->rcode = RLM_MODULE_INVALID;
+			return 0;
+
 		case RLM_SQL_ERROR:
-		/*
-		 *  If we get RLM_SQL_RECONNECT it means all connections in the pool
-		 *  were exhausted, and we couldn't create a new connection,
-		 *  so we do not need to call fr_connection_release.
-		 */
 		case RLM_SQL_RECONNECT:
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
+		default:
+			if (txn) return -1;
+			entry->rcode = RLM_MODULE_FAIL;
+			return 0;
+		}
 
-		/*
-		 *  Query was invalid, this is a terminal error, but we still need
-		 *  to do cleanup, as the connection handle is still valid.
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rcode = RLM_MODULE_INVALID;
-			goto finish;
+		numaffected = (inst->driver->sql_affected_rows)(*handle, inst->config);
+		(inst->driver->sql_finish_query)(*handle, inst->config);
+		if (numaffected > 0) {
+			entry->rcode = RLM_MODULE_OK;
+			return 0;
+		}
+	}
 
-		/*
-		 *  Driver found an error (like a unique key constraint violation)
-		 *  that hinted it might be a good idea to try an alternative query.
-		 */
-		case RLM_SQL_ALT_QUERY:
-			goto next;
+	if (!*handle) {
+		if (txn) return -1;
+		entry->rcode = RLM_MODULE_FAIL;
+		return 0;
+	}
+
+	entry->rcode = RLM_MODULE_NOOP;
+	return 0;
+}
+
+/** Run a transaction control statement
+ *
+ */
+static bool batch_txn_query(rlm_sql_t const *inst, rlm_sql_handle_t **handle, char const *query)
+{
+	if (!*handle || (rlm_sql_query(inst, NULL, handle, query) != RLM_SQL_OK)) return false;
+
+	(inst->driver->sql_finish_query)(*handle, inst->config);
+
+	return true;
+}
+
+/** Write all the queued query sets in a single transaction
+ *
+ * If anything in the transaction fails, it's rolled back, and each
+ * set is written individually, falling through its redundant queries
+ * as normal.
+ *
+ * Requests waiting for the batch are marked resumable.
+ *
+ * @param[in] t		Thread specific instance data.
+ * @param[in] current	Entry belonging to the caller, which shouldn't be resumed or freed.
+ */
+static void batch_flush(rlm_sql_thread_t *t, sql_batch_entry_t *current)
+{
+	rlm_sql_t const		*inst = t->inst;
+	sql_batch_entry_t	*head, *entry, *next;
+	rlm_sql_handle_t	*handle;
+	uint32_t		count;
+
+	if (t->ev) fr_event_timer_delete(t->el, &t->ev);
+
+	head = t->head;
+	count = t->num_entries;
+	t->head = NULL;
+	t->tail = &t->head;
+	t->num_entries = 0;
+
+	if (!head) return;
+
+	DEBUG2("Writing batch of %u accounting query set(s)", count);
+
+	handle = fr_connection_get(inst->pool, NULL);
+	if (!handle) {
+		for (entry = head; entry; entry = entry->next) entry->rcode = RLM_MODULE_FAIL;
+		goto done;
+	}
+
+	/*
+	 *	Only one commit for the whole batch.
+	 */
+	if ((count > 1) && batch_txn_query(inst, &handle, "BEGIN")) {
+		for (entry = head; entry; entry = entry->next) {
+			if (batch_entry_run(inst, &handle, entry, true) < 0) break;
 		}
-		rad_assert(handle);
+		if (!entry && batch_txn_query(inst, &handle, "COMMIT")) goto release;
 
-		/*
-		 *  We need to have updated something for the query to have been
-		 *  counted as successful.
-		 */
-		numaffected = (inst->driver->sql_affected_rows)(handle, inst->config);
-		(inst->driver->sql_finish_query)(handle, inst->config);
-		RDEBUG("%i record(s) updated", numaffected);
+		WARN("Batch failed, rolling back and writing query sets individually");
+		if (!handle || !batch_txn_query(inst, &handle, "ROLLBACK")) {
+			if (handle) fr_connection_close(inst->pool, NULL, handle);
+			handle = fr_connection_get(inst->pool, NULL);
+		}
+	}
 
-		if (numaffected > 0) break;	/* A query succeeded, were done! */
-	next:
-		/*
-		 *  We assume all entries with the same name form a redundant
-		 *  set of queries.
-		 */
-		pair = cf_pair_find_next(section->cs, pair, attr);
+	for (entry = head; entry; entry = entry->next) {
+		if (!handle) {
+			entry->rcode = RLM_MODULE_FAIL;
+			continue;
+		}
+		(void) batch_entry_run(inst, &handle, entry, false);
+	}
 
-		if (!pair) {
-			RDEBUG("No additional queries configured");
-			rcode = RLM_MODULE_NOOP;
+release:
+	if (handle) fr_connection_release(inst->pool, NULL, handle);
 
-			goto finish;
+done:
+	for (entry = head; entry; entry = next) {
+		next = entry->next;
+		entry->next = NULL;
+		entry->done = true;
+
+		if (entry == current) continue;
+
+		if (entry->request) {
+			unlang_resumable(entry->request);
+			continue;
+		}
+
+		if ((entry->rcode == RLM_MODULE_FAIL) || (entry->rcode == RLM_MODULE_INVALID)) {
+			ERROR("Failed writing batched accounting queries");
 		}
+		talloc_free(entry);
+	}
+}
+
+static void batch_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	batch_flush(ctx, NULL);
+}
+
+static rlm_rcode_t acct_batch_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	sql_batch_entry_t	*entry = talloc_get_type_abort(ctx, sql_batch_entry_t);
+	rlm_rcode_t		rcode = entry->rcode;
+
+	talloc_free(entry);
+
+	return rcode;
+}
+
+/** Stop waiting for the batch if the request is cancelled
+ *
+ * The queries are still written when the batch is.
+ */
+static void acct_batch_action(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			      fr_state_action_t action)
+{
+	sql_batch_entry_t	*entry = talloc_get_type_abort(ctx, sql_batch_entry_t);
 
-		RDEBUG("Trying next query...");
+	if (action != FR_ACTION_DONE) return;
+
+	if (entry->done) {
+		talloc_free(entry);
+		return;
 	}
+	entry->request = NULL;
+}
+
+/** Expand a redundant set of queries, and add them to the current batch
+ *
+ * The batch is written once batch_size sets have been queued, or batch_interval
+ * has passed.  If batch_wait is set the request yields until then.
+ */
+static rlm_rcode_t acct_batch_enqueue(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+				      sql_acct_section_t *section, rlm_sql_handle_t *handle, CONF_PAIR *pair)
+{
+	sql_batch_entry_t	*entry;
+	char const		*attr = cf_pair_attr(pair);
+	char const		*value;
+	char			*expanded;
+	rlm_rcode_t		rcode;
+	struct timeval		now, when;
 
+	MEM(entry = talloc_zero(NULL, sql_batch_entry_t));
+
+	sql_set_user(inst, request, NULL);
+
+	/*
+	 *	Expand the whole set now, as the request may
+	 *	be gone by the time the batch is written.
+	 */
+	for (; pair; pair = cf_pair_find_next(section->cs, pair, attr)) {
+		value = cf_pair_value(pair);
+		if (!value) break;
+
+		if (xlat_aeval(entry, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+			fr_connection_release(inst->pool, request, handle);
+			sql_unset_user(inst, request);
+			talloc_free(entry);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (!*expanded) {
+			talloc_free(expanded);
+			break;
+		}
+
+		MEM(entry->query = talloc_realloc(entry, entry->query, char *, entry->num_queries + 1));
+		entry->query[entry->num_queries++] = expanded;
+	}
 
-finish:
-	talloc_free(expanded);
 	fr_connection_release(inst->pool, request, handle);
 	sql_unset_user(inst, request);
 
+	if (!entry->num_queries) {
+		RDEBUG("Ignoring null query");
+		talloc_free(entry);
+		return RLM_MODULE_NOOP;
+	}
+
+	if (section->batch_wait) entry->request = request;
+
+	*t->tail = entry;
+	t->tail = &entry->next;
+	t->num_entries++;
+
+	RDEBUG2("Queued %i query(s) for batch write, %u set(s) queued", entry->num_queries, t->num_entries);
+
+	if (t->num_entries < section->batch_size) {
+		if (!t->ev) {
+			gettimeofday(&now, NULL);
+			fr_timeval_add(&when, &now, &section->batch_interval);
+
+			if (fr_event_timer_insert(t->el, batch_timeout, t, &when, &t->ev) < 0) {
+				RWDEBUG("Failed inserting batch timer, writing batch now");
+				goto flush;
+			}
+		}
+
+		if (!section->batch_wait) return RLM_MODULE_OK;
+
+		return unlang_yield(request, acct_batch_resume, acct_batch_action, entry);
+	}
+
+flush:
+	batch_flush(t, entry);
+
+	rcode = section->batch_wait ? entry->rcode : RLM_MODULE_OK;
+	talloc_free(entry);
+
 	return rcode;
 }
 
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ */
+static rlm_rcode_t acct_redundant(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request,
+				  sql_acct_section_t *section)
+{
+	sql_acct_ctx_t		*actx;
+	rlm_sql_handle_t	*handle;
+
+	CONF_ITEM		*item;
+	CONF_PAIR 		*pair;
+
+	char			path[FR_MAX_STRING_LEN];
+	char			*p = path;
+
+	rad_assert(section);
+
+	if (section->reference[0] != '.') {
+		*p++ = '.';
+	}
+
+	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
+		sql_unset_user(inst, request);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	If we can't find a matching config item we do
+	 *	nothing so return RLM_MODULE_NOOP.
+	 */
+	item = cf_reference_item(NULL, section->cs, path);
+	if (!item) {
+		RWDEBUG("No such configuration item %s", path);
+		sql_unset_user(inst, request);
+		return RLM_MODULE_NOOP;
+	}
+	if (cf_item_is_section(item)){
+		RWDEBUG("Sections are not supported as references");
+		sql_unset_user(inst, request);
+		return RLM_MODULE_NOOP;
+	}
+
+	pair = cf_item_to_pair(item);
+
+	RDEBUG2("Using query template '%s'", cf_pair_attr(pair));
+
+	handle = fr_connection_get(inst->pool, request);
+	if (!handle) {
+		sql_unset_user(inst, request);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (section->batched && rbtree_finddata(section->batched, pair)) {
+		return acct_batch_enqueue(inst, t, request, section, handle, pair);
+	}
+
+	MEM(actx = talloc_zero(request, sql_acct_ctx_t));
+	actx->section = section;
+	actx->handle = handle;
+	actx->pair = pair;
+	actx->attr = cf_pair_attr(pair);
+	actx->fd = -1;
+
+	sql_set_user(inst, request, NULL);
+
+	return acct_query(inst, request, actx);
+}
+
 #ifdef WITH_ACCOUNTING
 
 /*
  *	Accounting: Insert or update session data in our sql table
  */
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sql_t const *inst = instance;
 
 	if (inst->config->accounting.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->accounting);
+		return acct_redundant(inst, thread, request, &inst->config->accounting);
 	}
 
 	return RLM_MODULE_NOOP;
@@ -1899,13 +2762,13 @@ release:
 /*
  *	Postauth: Write a record of the authentication attempt
  */
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sql_t const *inst = instance;
 
 	if (inst->config->postauth.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->postauth);
+		return acct_redundant(inst, thread, request, &inst->config->postauth);
 	}
 
 	return RLM_MODULE_NOOP;
@@ -1916,6 +2779,54 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
  */
 
 
+/** Initialise the batch queue, replica latencies and authorize cache for this thread
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_sql_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sql_thread_t	*t = thread;
+
+	t->inst = instance;
+	t->el = el;
+	t->tail = &t->head;
+
+	if (t->inst->num_replicas) {
+		t->replica_latency = talloc_zero_array(NULL, uint64_t, t->inst->num_replicas);
+		if (!t->replica_latency) return -1;
+	}
+
+	if (t->inst->config->authorize_cache_ttl) {
+		t->cache = rbtree_create(NULL, sql_cache_entry_cmp, sql_cache_entry_free, 0);
+		if (!t->cache) return -1;
+	}
+
+	return 0;
+}
+
+/** Write any query sets still waiting in this thread's batch, and free the authorize cache
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_sql_thread_t	*t = thread;
+
+	batch_flush(t, NULL);
+
+	talloc_free(t->replica_latency);
+	talloc_free(t->cache);
+
+	return 0;
+}
+
 /* globally exported name */
 extern rad_module_t rlm_sql;
 rad_module_t rlm_sql = {
@@ -1923,9 +2834,12 @@ rad_module_t rlm_sql = {
 	.name		= "sql",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_sql_t),
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
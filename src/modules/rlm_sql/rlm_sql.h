@@ -82,6 +82,15 @@ typedef struct sql_acct_section {
 	char const		*logfile;
 
 	char const		**query;			/* for xlat parsing */
+
+	rbtree_t		*stmts;				//!< Queries which can be run as prepared
+								//!< statements, keyed by CONF_PAIR.
+
+	uint32_t		batch_size;			//!< Maximum number of redundant query sets to
+								//!< queue.  0 disables batching.
+	struct timeval		batch_interval;			//!< Maximum time a query set may be queued for.
+	bool			batch_wait;			//!< Return only once the batch has been committed.
+	rbtree_t		*batched;			//!< Queries which may be batched, keyed by CONF_PAIR.
 } sql_acct_section_t;
 
 typedef struct sql_config {
@@ -136,6 +145,18 @@ typedef struct sql_config {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepared_statements;		//!< Run accounting and post-auth queries as
+								//!< prepared statements, binding expansions
+								//!< as parameters.
+
+	char const		**read_replicas;		//!< Names of rlm_sql instances authorize
+								//!< queries may be sent to instead of
+								//!< this one.
+	uint32_t		authorize_cache_ttl;		//!< How long authorize query results are
+								//!< cached for.  0 disables the cache.
+	uint32_t		authorize_cache_max;		//!< Maximum number of cached results
+								//!< per thread.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -167,6 +188,30 @@ extern const FR_NAME_NUMBER sql_rcode_table[];
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_PARAM_NUMBERED	2			//!< Placeholders are $1, $2... instead of ?.
+
+/** A query with its values bound as parameters
+ *
+ * Drivers should prepare the query the first time they see a given id on
+ * a connection, and reuse the prepared statement after that.
+ */
+typedef struct {
+	void const		*id;				//!< Unique to the query, and stable for the
+								//!< lifetime of the module instance.
+	char const		*query;				//!< Query with placeholders.
+	int			num_params;			//!< Number of placeholders.
+	char const		**values;			//!< Value for each placeholder.
+} rlm_sql_stmt_t;
+
+/** A configured query split into a placeholder query, and the expansions producing its values
+ *
+ */
+typedef struct {
+	CONF_PAIR const		*cp;				//!< The query was read from.
+	char const		*query;				//!< Query with placeholders.
+	int			num_params;			//!< Number of placeholders.
+	char const		**xlat;				//!< Expansion producing each value.
+} sql_stmt_tmpl_t;
 
 /** Retrieve errors from the last query operation
  *
@@ -218,6 +263,29 @@ typedef struct rlm_sql_driver_t {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional asynchronous interface.
+	 *
+	 *	sql_query_send submits a query without waiting for the result,
+	 *	and writes out the fd the result will arrive on.
+	 *
+	 *	sql_query_poll is called whenever that fd becomes readable.
+	 *	It sets *done, and returns the same codes as sql_query, once the
+	 *	result has been received.  Until then it returns RLM_SQL_OK with
+	 *	*done set to false.
+	 *
+	 *	If stmt is not NULL, sql_query_send should run it instead of query.
+	 */
+	sql_rcode_t (*sql_query_send)(int *fd, rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+				      rlm_sql_stmt_t const *stmt);
+	sql_rcode_t (*sql_query_poll)(bool *done, rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	/*
+	 *	Optional prepared statement interface.  Returns the same codes
+	 *	as sql_query.
+	 */
+	sql_rcode_t (*sql_query_stmt)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, rlm_sql_stmt_t const *stmt);
 } rlm_sql_driver_t;
 
 struct sql_inst {
@@ -226,6 +294,9 @@ struct sql_inst {
 	rlm_sql_config_t	*config;
 	CONF_SECTION		*cs;
 
+	rlm_sql_t const		**replicas;		//!< Instances used for authorize queries.
+	int			num_replicas;		//!< Number of read replicas.
+
 	fr_dict_attr_t const	*sql_user;		//!< Cached pointer to SQL-User-Name
 							//!< dictionary attribute.
 	exfile_t		*ef;
@@ -258,7 +329,11 @@ int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, rlm_sql_stmt_t const *stmt) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_send(int *fd, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query, rlm_sql_stmt_t const *stmt) CC_HINT(nonnull (1, 2, 4));
+bool		rlm_sql_query_poll(sql_rcode_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle) CC_HINT(nonnull (1, 2, 4));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
+sql_stmt_tmpl_t	*sql_stmt_tmpl_alloc(TALLOC_CTX *ctx, CONF_PAIR const *cp, bool numbered);
 #endif
@@ -308,6 +308,61 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
 	talloc_free_children(handle->log_ctx);
 }
 
+/** Log errors from a query, and release the result if the query failed
+ *
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	the query was run on.
+ * @param[in] ret	returned by the driver.
+ * @return ret, or #RLM_SQL_ALT_QUERY if the driver can't distinguish constraint
+ *	violations from other errors.
+ */
+static sql_rcode_t sql_query_result(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				    sql_rcode_t ret)
+{
+	switch (ret) {
+	case RLM_SQL_OK:
+	default:
+		break;
+
+	/*
+	 *	These are bad and should make rlm_sql return invalid
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, handle, false);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	/*
+	 *	Server or client errors.
+	 *
+	 *	If the driver claims to be able to distinguish between
+	 *	duplicate row errors and other errors, and we hit a
+	 *	general error treat it as a failure.
+	 *
+	 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
+	 */
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, handle, false);
+			(inst->driver->sql_finish_query)(handle, inst->config);
+			break;
+		}
+		ret = RLM_SQL_ALT_QUERY;
+		/* FALL-THROUGH */
+
+	/*
+	 *	Driver suggested using an alternative query
+	 */
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, handle, true);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+	}
+
+	return ret;
+}
+
 /** Call the driver's sql_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
@@ -351,58 +406,63 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
 
 		ret = (inst->driver->sql_query)(*handle, inst->config, query);
-		switch (ret) {
-		case RLM_SQL_OK:
-			break;
 
 		/*
 		 *	Run through all available sockets until we exhaust all existing
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
-		case RLM_SQL_RECONNECT:
+		if (ret == RLM_SQL_RECONNECT) {
 			*handle = fr_connection_reconnect(inst->pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
 			continue;
+		}
 
-		/*
-		 *	These are bad and should make rlm_sql return invalid
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
-			break;
+		return sql_query_result(inst, request, *handle, ret);
+	}
 
-		/*
-		 *	Server or client errors.
-		 *
-		 *	If the driver claims to be able to distinguish between
-		 *	duplicate row errors and other errors, and we hit a
-		 *	general error treat it as a failure.
-		 *
-		 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
-		 */
-		case RLM_SQL_ERROR:
-			if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
-				rlm_sql_print_error(inst, request, *handle, false);
-				(inst->driver->sql_finish_query)(*handle, inst->config);
-				break;
-			}
-			ret = RLM_SQL_ALT_QUERY;
-			/* FALL-THROUGH */
+	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
 
-		/*
-		 *	Driver suggested using an alternative query
-		 */
-		case RLM_SQL_ALT_QUERY:
-			rlm_sql_print_error(inst, request, *handle, true);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
-			break;
+	return RLM_SQL_ERROR;
+}
+
+/** Call the driver's sql_query_stmt method, reconnecting if necessary.
+ *
+ * Should only be called if the driver provides sql_query_stmt.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	to query the database with. *handle should not be NULL, as this indicates
+ *			previous reconnection attempt has failed.
+ * @param[in] stmt	to execute.
+ * @return the same codes as #rlm_sql_query.
+ */
+sql_rcode_t rlm_sql_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			       rlm_sql_stmt_t const *stmt)
+{
+	int ret = RLM_SQL_ERROR;
+	int i, count;
 
+	rad_assert(*handle);
+	rad_assert(inst->driver->sql_query_stmt);
+
+	count = inst->pool ? fr_connection_pool_state(inst->pool)->num : 0;
+
+	for (i = 0; i < (count + 1); i++) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing prepared query: %s", stmt->query);
+
+		ret = (inst->driver->sql_query_stmt)(*handle, inst->config, stmt);
+		if (ret == RLM_SQL_RECONNECT) {
+			*handle = fr_connection_reconnect(inst->pool, request, *handle);
+			if (!*handle) return RLM_SQL_RECONNECT;
+			continue;
 		}
 
-		return ret;
+		return sql_query_result(inst, request, *handle, ret);
 	}
 
 	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
@@ -410,11 +470,102 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	return RLM_SQL_ERROR;
 }
 
+/** Submit a query to the driver without waiting for the result, reconnecting if necessary
+ *
+ * Should only be called if the driver provides sql_query_send.  The caller
+ * should wait for fd to become readable, then call #rlm_sql_query_poll.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param[out] fd	to watch for the result.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	to query the database with. *handle should not be NULL, as this indicates
+ *			previous reconnection attempt has failed.
+ * @param[in] query	to execute. Should not be zero length.
+ * @param[in] stmt	to execute instead of query.  May be NULL.  The driver
+ *			must provide sql_query_stmt.
+ * @return
+ *	- #RLM_SQL_OK if the query was sent.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ */
+sql_rcode_t rlm_sql_query_send(int *fd, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			       char const *query, rlm_sql_stmt_t const *stmt)
+{
+	int ret = RLM_SQL_ERROR;
+	int i, count;
+
+	rad_assert(*handle);
+	rad_assert(inst->driver->sql_query_send && inst->driver->sql_query_poll);
+	rad_assert(!stmt || inst->driver->sql_query_stmt);
+
+	if (stmt) query = stmt->query;
+
+	if (query[0] == '\0') {
+		if (request) REDEBUG("Zero length query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	count = inst->pool ? fr_connection_pool_state(inst->pool)->num : 0;
+
+	for (i = 0; i < (count + 1); i++) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Sending %squery: %s", stmt ? "prepared " : "", query);
+
+		ret = (inst->driver->sql_query_send)(fd, *handle, inst->config, query, stmt);
+		switch (ret) {
+		case RLM_SQL_OK:
+			return RLM_SQL_OK;
+
+		case RLM_SQL_RECONNECT:
+			*handle = fr_connection_reconnect(inst->pool, request, *handle);
+			if (!*handle) return RLM_SQL_RECONNECT;
+			continue;
+
+		default:
+			return sql_query_result(inst, request, *handle, ret);
+		}
+	}
+
+	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
+
+/** Check whether the result of a query submitted with #rlm_sql_query_send has arrived
+ *
+ * @param[out] out	Result of the query, as returned by #rlm_sql_query, except
+ *			that #RLM_SQL_RECONNECT does not reconnect the handle.  The
+ *			caller should reconnect and run the query again.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	the query was sent on.
+ * @return
+ *	- true if the query completed, and out has been written.
+ *	- false if the result hasn't arrived yet.
+ */
+bool rlm_sql_query_poll(sql_rcode_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle)
+{
+	bool		done = false;
+	sql_rcode_t	ret;
+
+	ret = (inst->driver->sql_query_poll)(&done, handle, inst->config);
+	if (!done) return false;
+
+	*out = (ret == RLM_SQL_RECONNECT) ? ret : sql_query_result(inst, request, handle, ret);
+
+	return true;
+}
+
 /** Call the driver's sql_select_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
  *	after they're done with the result.
  *
+ * @note The handle may belong to a read replica of inst, in which case it's reconnected
+ *	using the replica's pool.
+ *
  * @param inst #rlm_sql_t instance data.
  * @param request Current request.
  * @param handle to query the database with. *handle should not be NULL, as this indicates
@@ -429,6 +580,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_connection_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	rad_assert(*handle);
@@ -441,9 +593,14 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by mod_conn_create.
+	 *  The handle may have come from a read replica's pool.
 	 */
-	count = inst->pool ? fr_connection_pool_state(inst->pool)->num : 0;
+	pool = (*handle)->inst ? (*handle)->inst->pool : inst->pool;
+
+	/*
+	 *  pool may be NULL is this function is called by mod_conn_create.
+	 */
+	count = pool ? fr_connection_pool_state(pool)->num : 0;
 
 	/*
 	 *  For sanity, for when no connections are viable, and we can't make a new one
@@ -461,7 +618,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -558,3 +715,187 @@ void rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section
 	talloc_free(expanded);
 	exfile_close(inst->ef, request, fd);
 }
+
+/** Find the end of an expansion
+ *
+ * @param[in] p	pointing to the '%' which starts the expansion.
+ * @return
+ *	- A pointer to the first char after the expansion.
+ *	- NULL if this isn't an expansion we understand.
+ */
+static char const *sql_stmt_xlat_end(char const *p)
+{
+	int depth = 0;
+
+	rad_assert(*p == '%');
+	p++;
+
+	if (*p != '{') return isalpha((uint8_t) *p) ? p + 1 : NULL;
+
+	do {
+		switch (*p) {
+		case '\0':
+			return NULL;
+
+		case '\\':
+			if (!p[1]) return NULL;
+			p++;
+			break;
+
+		case '{':
+			depth++;
+			break;
+
+		case '}':
+			depth--;
+			break;
+
+		default:
+			break;
+		}
+		p++;
+	} while (depth > 0);
+
+	return p;
+}
+
+/** Split a query into a parameterised query, and the expansions producing each parameter
+ *
+ * Expansions which make up the whole of an SQL string literal (e.g. '%{User-Name}')
+ * are replaced with placeholders.  Queries which contain expansions anywhere else
+ * can't be converted, and must be expanded and escaped as normal.
+ *
+ * @param[in] ctx	to allocate the template in.
+ * @param[in] cp	containing the query.
+ * @param[in] numbered	Whether the driver uses $1, $2 style placeholders, or ?.
+ * @return
+ *	- A new template.
+ *	- NULL if the query can't be converted.
+ */
+sql_stmt_tmpl_t *sql_stmt_tmpl_alloc(TALLOC_CTX *ctx, CONF_PAIR const *cp, bool numbered)
+{
+	sql_stmt_tmpl_t	*tmpl;
+	char const	*p, *q, *end, *value;
+	char		*out;
+	char		quote;
+	bool		xlat;
+
+	value = cf_pair_value(cp);
+	if (!value || !*value) return NULL;
+
+	tmpl = talloc_zero(ctx, sql_stmt_tmpl_t);
+	if (!tmpl) return NULL;
+	tmpl->cp = cp;
+
+	out = talloc_strdup(tmpl, "");
+	if (!out) goto error;
+
+	p = value;
+	while (*p) {
+		switch (*p) {
+		case '\'':
+		case '"':
+		case '`':
+			quote = *p;
+			xlat = false;
+
+			/*
+			 *	Find the end of the literal, noting
+			 *	whether there are expansions inside it.
+			 */
+			q = p + 1;
+			while (*q) {
+				if ((*q == '\\') && q[1]) {
+					q += 2;
+					continue;
+				}
+
+				if (*q == '%') {
+					if (q[1] == '%') {
+						q += 2;
+						continue;
+					}
+
+					end = sql_stmt_xlat_end(q);
+					if (!end) goto error;
+					xlat = true;
+					q = end;
+					continue;
+				}
+
+				if (*q == quote) {
+					if (q[1] != quote) break;
+					q += 2;
+					continue;
+				}
+				q++;
+			}
+			if (!*q) goto error;	/* Unterminated */
+
+			if (!xlat) {
+				char const *r;
+
+				/*
+				 *	Copy the literal, unescaping %%
+				 */
+				for (r = p; r <= q; r++) {
+					if ((r[0] == '%') && (r[1] == '%')) r++;
+					out = talloc_asprintf_append_buffer(out, "%c", *r);
+					if (!out) goto error;
+				}
+				p = q + 1;
+				break;
+			}
+
+			/*
+			 *	Only a literal which is exactly one
+			 *	string expansion can be bound.
+			 */
+			if ((quote != '\'') || (p[1] != '%') || (sql_stmt_xlat_end(p + 1) != q)) goto error;
+
+			p++;
+			tmpl->xlat = talloc_realloc(tmpl, tmpl->xlat, char const *, tmpl->num_params + 1);
+			if (!tmpl->xlat) goto error;
+			tmpl->xlat[tmpl->num_params] = talloc_strndup(tmpl->xlat, p, q - p);
+			if (!tmpl->xlat[tmpl->num_params]) goto error;
+			tmpl->num_params++;
+
+			if (numbered) {
+				out = talloc_asprintf_append_buffer(out, "$%i", tmpl->num_params);
+			} else {
+				out = talloc_strdup_append_buffer(out, "?");
+			}
+			if (!out) goto error;
+
+			p = q + 1;
+			break;
+
+		/*
+		 *	Unquoted expansions may produce SQL
+		 *	(e.g. %{%{Acct-Session-Time}:-NULL}),
+		 *	so can't be bound.
+		 */
+		case '%':
+			if (p[1] != '%') goto error;
+
+			out = talloc_asprintf_append_buffer(out, "%c", *p);
+			if (!out) goto error;
+			p += 2;
+			break;
+
+		default:
+			out = talloc_asprintf_append_buffer(out, "%c", *p);
+			if (!out) goto error;
+			p++;
+			break;
+		}
+	}
+
+	tmpl->query = out;
+
+	return tmpl;
+
+error:
+	talloc_free(tmpl);
+	return NULL;
+}
@@ -67,6 +67,7 @@ typedef struct rlm_sqlcounter_t {
 
 	char const	*sqlmod_inst;	//!< Instance of SQL module to use, usually just 'sql'.
 	char const	*query;		//!< SQL query to retrieve current session time.
+	char const	*update_query;	//!< SQL query to add a stopped session to a running total.
 	char const	*reset;  	//!< Daily, weekly, monthly, never or user defined.
 
 	time_t		reset_time;
@@ -78,6 +79,7 @@ static const CONF_PARSER module_config[] = {
 
 
 	{ FR_CONF_OFFSET("query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_REQUIRED, rlm_sqlcounter_t, query) },
+	{ FR_CONF_OFFSET("update_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sqlcounter_t, update_query) },
 	{ FR_CONF_OFFSET("reset", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_sqlcounter_t, reset) },
 
 	{ FR_CONF_OFFSET("key", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE, rlm_sqlcounter_t, key_attr), .dflt = "&request:User-Name", .quote = T_BARE_WORD },
@@ -329,38 +331,68 @@ static size_t sqlcounter_expand(char *out, int outlen, rlm_sqlcounter_t const *i
 }
 
 
-/*
- *	See if the counter matches.
+/** Run a counter query using the xlat of the SQL module
+ *
+ * @param[out] out	Where to write the result.  Allocated in the context of the request.
+ * @param[in] inst	rlm_sqlcounter instance.
+ * @param[in] request	The current request.
+ * @param[in] fmt	query to run.  May contain the %%b, %%e and %%k substitutions.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
-		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+static int sqlcounter_query(char **out, rlm_sqlcounter_t const *inst, REQUEST *request, char const *fmt)
 {
-	rlm_sqlcounter_t const *inst = instance;
-	uint64_t counter;
-
 	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
 	size_t len;
 
 	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
+	if (sqlcounter_expand(subst, sizeof(subst), inst, request, fmt) <= 0) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
+	if (xlat_aeval(request, out, request, query, NULL, NULL) < 0) return -1;
+
+	return 0;
+}
+
+/** Start a new counter period if the current one has ended
+ *
+ */
+static void sqlcounter_reset_check(rlm_sqlcounter_t *inst, REQUEST *request)
+{
+	if (inst->reset_time && (inst->reset_time <= request->packet->timestamp.tv_sec)) {
+		/*
+		 *	Re-set the next time and prev_time for this counters range
+		 */
+		inst->last_reset = inst->reset_time;
+		find_next_reset(inst,request->packet->timestamp.tv_sec);
 	}
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
+		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+{
+	rlm_sqlcounter_t const *inst = instance;
+	uint64_t counter = 0;
+
+	char *expanded = NULL;
+
+	if (sqlcounter_query(&expanded, inst, request, inst->query) < 0) return RLM_MODULE_FAIL;
 
 	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
 		RDEBUG2("No integer found in string \"%s\"", expanded);
@@ -387,22 +419,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
 	char *expanded = NULL;
 
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
 	 */
-	if (inst->reset_time && (inst->reset_time <= request->packet->timestamp.tv_sec)) {
-		/*
-		 *	Re-set the next time and prev_time for this counters range
-		 */
-		inst->last_reset = inst->reset_time;
-		find_next_reset(inst,request->packet->timestamp.tv_sec);
-	}
+	sqlcounter_reset_check(inst, request);
 
 	/*
 	 *      Look for the key.  User-Name is special.  It means
@@ -424,32 +447,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 		return RLM_MODULE_NOOP;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-	talloc_free(expanded);
+	if (sqlcounter_query(&expanded, inst, request, inst->query) < 0) return RLM_MODULE_FAIL;
 
 	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
 		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
 			expanded);
 		counter = 0;
 	}
+	talloc_free(expanded);
 
 	/*
 	 *	Check if check item > counter
@@ -525,6 +530,35 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 	return RLM_MODULE_OK;
 }
 
+/** Add the length of a stopped session to the running total for its key
+ *
+ * Runs update_query, so that the authorize query can read a single
+ * total, instead of summing the accounting records for the period.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	rlm_sqlcounter_t	*inst = instance;
+	VALUE_PAIR		*vp;
+	char			*expanded = NULL;
+
+	if (!inst->update_query) return RLM_MODULE_NOOP;
+
+	vp = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_STATUS_TYPE, TAG_ANY);
+	if (!vp || (vp->vp_integer != PW_STATUS_STOP)) return RLM_MODULE_NOOP;
+
+	sqlcounter_reset_check(inst, request);
+
+	if (tmpl_find_vp(NULL, request, inst->key_attr) < 0) {
+		RWDEBUG2("Couldn't find key attribute, %s, doing nothing...", inst->key_attr->tmpl_da->name);
+		return RLM_MODULE_NOOP;
+	}
+
+	if (sqlcounter_query(&expanded, inst, request, inst->update_query) < 0) return RLM_MODULE_FAIL;
+	talloc_free(expanded);
+
+	return RLM_MODULE_OK;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -627,7 +661,8 @@ rad_module_t rlm_sqlcounter = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.methods = {
-		[MOD_AUTHORIZE]		= mod_authorize
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_ACCOUNTING]	= mod_accounting
 	},
 };
 
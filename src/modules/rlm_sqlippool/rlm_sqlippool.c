@@ -59,6 +59,15 @@ typedef struct rlm_sqlippool_t {
 
 	char const	*pool_check;		//!< Query to check for the existence of the pool.
 
+						/* Prefetch sequence */
+	uint32_t	prefetch_size;		//!< How many addresses to reserve at once.  0 disables
+						//!< prefetching.
+	struct timeval	prefetch_interval;	//!< How long allocations may wait before being written.
+	char const	*prefetch_find;		//!< SQL query to find a batch of unused IPs.
+	char const	*prefetch_reserve;	//!< SQL query to reserve an IP for this server.
+	char const	*prefetch_update;	//!< SQL query to mark a reserved IP as used.
+	char const	*prefetch_release;	//!< SQL query to release an unused reserved IP.
+
 						/* Start sequence */
 	char const	*start_begin;		//!< SQL query to begin.
 	char const	*start_update;		//!< SQL query to update an IP entry.
@@ -96,6 +105,40 @@ typedef struct rlm_sqlippool_t {
 
 } rlm_sqlippool_t;
 
+/** Addresses reserved from one pool by a thread
+ *
+ */
+typedef struct {
+	char const	*name;			//!< Pool-Name the addresses were found with.
+	char		**addrs;		//!< Reserved addresses.
+	uint32_t	num_addrs;		//!< Number of addresses reserved.
+	uint32_t	next;			//!< Index of the next address to hand out.
+	time_t		expires;		//!< When the reservations should no longer be used.
+} sqlippool_prefetch_t;
+
+/** An allocation which hasn't been written to the database yet
+ *
+ */
+typedef struct sqlippool_pending {
+	char			*query;		//!< Expanded prefetch_update query.
+	struct sqlippool_pending *next;		//!< Next allocation to write.
+} sqlippool_pending_t;
+
+/** Thread specific rlm_sqlippool instance data
+ *
+ */
+typedef struct {
+	rlm_sqlippool_t		*inst;		//!< Instance of rlm_sqlippool.
+	fr_event_list_t		*el;		//!< This thread's event list.
+
+	rbtree_t		*pools;		//!< sqlippool_prefetch_t, keyed by Pool-Name.
+
+	sqlippool_pending_t	*head;		//!< Oldest allocation waiting to be written.
+	sqlippool_pending_t	**tail;		//!< Where the next allocation should be linked.
+	uint32_t		num_pending;	//!< Number of allocations waiting to be written.
+	fr_event_timer_t	*ev;		//!< Writes allocations once prefetch_interval has passed.
+} rlm_sqlippool_thread_t;
+
 static CONF_PARSER message_config[] = {
 	{ FR_CONF_OFFSET("exists", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET("success", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, log_success) },
@@ -131,6 +174,19 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("pool_check", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, pool_check), .dflt = "" },
 
 
+	{ FR_CONF_OFFSET("prefetch_size", PW_TYPE_INTEGER, rlm_sqlippool_t, prefetch_size), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("prefetch_interval", PW_TYPE_TIMEVAL, rlm_sqlippool_t, prefetch_interval), .dflt = "1.0" },
+
+	{ FR_CONF_OFFSET("prefetch_find", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, prefetch_find), .dflt = "" },
+
+	{ FR_CONF_OFFSET("prefetch_reserve", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, prefetch_reserve), .dflt = "" },
+
+	{ FR_CONF_OFFSET("prefetch_update", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, prefetch_update), .dflt = "" },
+
+	{ FR_CONF_OFFSET("prefetch_release", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, prefetch_release), .dflt = "" },
+
+
 	{ FR_CONF_OFFSET("start_begin", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, start_begin), .dflt = "START TRANSACTION" },
 
 	{ FR_CONF_OFFSET("start_update", PW_TYPE_STRING | PW_TYPE_XLAT , rlm_sqlippool_t, start_update), .dflt = "" },
@@ -244,6 +300,35 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
 	return strlen(out);
 }
 
+/** Expand a sqlippool query
+ *
+ * @param[out] out Where to write the expanded query.  Allocated in the context of the request.
+ * @param[in] fmt sql query to expand.
+ * @param[in] handle sql connection handle, used for escaping.
+ * @param[in] data Instance of rlm_sqlippool.
+ * @param[in] request Current request.
+ * @param[in] param ip address string.
+ * @param[in] param_len ip address string len.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int sqlippool_query_expand(char **out, char const *fmt, rlm_sql_handle_t *handle,
+				  rlm_sqlippool_t *data, REQUEST *request,
+				  char *param, int param_len)
+{
+	char query[MAX_QUERY_LEN];
+
+	/*
+	 *	@todo this needs to die (should just be done in xlat expansion)
+	 */
+	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+
+	if (xlat_aeval(request, out, request, query, data->sql_inst->sql_escape_func, handle) < 0) return -1;
+
+	return 0;
+}
+
 /** Perform a single sqlippool query
  *
  * Mostly wrapper around sql_query which does some special sqlippool sequence substitutions and expands
@@ -263,7 +348,6 @@ static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
 			     rlm_sqlippool_t *data, REQUEST *request,
 			     char *param, int param_len)
 {
-	char query[MAX_QUERY_LEN];
 	char *expanded = NULL;
 
 	int ret;
@@ -273,12 +357,9 @@ static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
 	 */
 	if (!fmt || !*fmt) return 0;
 
-	/*
-	 *	@todo this needs to die (should just be done in xlat expansion)
-	 */
-	sqlippool_expand(query, sizeof(query), fmt, data, param, param_len);
+	if (!*handle) return -1;
 
-	if (xlat_aeval(request, &expanded, request, query, data->sql_inst->sql_escape_func, *handle) < 0) return -1;
+	if (sqlippool_query_expand(&expanded, fmt, *handle, data, request, param, param_len) < 0) return -1;
 
 	ret = data->sql_inst->sql_query(data->sql_inst, request, handle, expanded);
 	if (ret < 0){
@@ -399,6 +480,21 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	inst->sql_inst = (rlm_sql_t *) sql_inst->data;
 
+	if (inst->prefetch_size) {
+		if (!inst->prefetch_find || !*inst->prefetch_find ||
+		    !inst->prefetch_reserve || !*inst->prefetch_reserve ||
+		    !inst->prefetch_update || !*inst->prefetch_update) {
+			cf_log_err_cs(conf, "prefetch_find, prefetch_reserve and prefetch_update must be set "
+				      "when prefetch_size is non-zero");
+			return -1;
+		}
+
+		if (!timerisset(&inst->prefetch_interval)) {
+			cf_log_err_cs(conf, "prefetch_interval must be greater than zero");
+			return -1;
+		}
+	}
+
 	if (strcmp(inst->sql_inst->driver->name, "sql") != 0) {
 		cf_log_err_cs(conf, "Module \"%s\" is not an instance of the rlm_sql module",
 			      inst->sql_instance_name);
@@ -430,16 +526,280 @@ static int do_logging(REQUEST *request, char const *str, int rcode)
 	return rcode;
 }
 
+static int sqlippool_prefetch_cmp(void const *one, void const *two)
+{
+	sqlippool_prefetch_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static void sqlippool_prefetch_free(void *data)
+{
+	talloc_free(data);
+}
+
+/** Run a query which isn't associated with a request
+ *
+ * The query is not xlat expanded, so may only use the sqlippool substitutions.
+ *
+ * @param[in] inst	Instance of rlm_sqlippool.
+ * @param[in,out] handle	to run the query with.  May be NULL'd if reconnecting fails.
+ * @param[in] fmt	query to run.
+ * @param[in] param	ip address string.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlippool_command_raw(rlm_sqlippool_t *inst, rlm_sql_handle_t **handle, char const *fmt, char *param)
+{
+	char query[MAX_QUERY_LEN];
+
+	if (!fmt || !*fmt) return 0;
+	if (!*handle) return -1;
+
+	sqlippool_expand(query, sizeof(query), fmt, inst, param, param ? strlen(param) : 0);
+
+	if (inst->sql_inst->sql_query(inst->sql_inst, NULL, handle, query) < 0) return -1;
+
+	if (*handle) (inst->sql_inst->driver->sql_finish_query)(*handle, inst->sql_inst->config);
+
+	return 0;
+}
+
+/** Write allocations which were handed out from reserved addresses
+ *
+ * All the pending prefetch_update queries are written in a single transaction.
+ *
+ * @param[in] t		Thread specific instance data.
+ * @param[in] handle	to write with, or NULL to reserve one.
+ */
+static void sqlippool_pending_flush(rlm_sqlippool_thread_t *t, rlm_sql_handle_t *handle)
+{
+	rlm_sqlippool_t		*inst = t->inst;
+	sqlippool_pending_t	*head, *entry, *next;
+	uint32_t		count;
+	bool			reserved = false;
+
+	if (t->ev) fr_event_timer_delete(t->el, &t->ev);
+
+	head = t->head;
+	count = t->num_pending;
+	t->head = NULL;
+	t->tail = &t->head;
+	t->num_pending = 0;
+
+	if (!head) return;
+
+	DEBUG2("Writing %u prefetched allocation(s)", count);
+
+	if (!handle) {
+		handle = fr_connection_get(inst->sql_inst->pool, NULL);
+		if (!handle) {
+			ERROR("Failed reserving SQL connection, %u allocation(s) not written", count);
+			goto done;
+		}
+		reserved = true;
+	}
+
+	if (sqlippool_command_raw(inst, &handle, inst->allocate_begin, NULL) < 0) goto error;
+
+	for (entry = head; entry; entry = entry->next) {
+		if (inst->sql_inst->sql_query(inst->sql_inst, NULL, &handle, entry->query) < 0) goto error;
+		(inst->sql_inst->driver->sql_finish_query)(handle, inst->sql_inst->config);
+	}
+
+	if (sqlippool_command_raw(inst, &handle, inst->allocate_commit, NULL) < 0) {
+	error:
+		ERROR("Failed writing %u prefetched allocation(s)", count);
+		(void) sqlippool_command_raw(inst, &handle, "ROLLBACK", NULL);
+	}
+
+	if (reserved && handle) fr_connection_release(inst->sql_inst->pool, NULL, handle);
+
+done:
+	for (entry = head; entry; entry = next) {
+		next = entry->next;
+		talloc_free(entry);
+	}
+}
+
+static void sqlippool_pending_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	sqlippool_pending_flush(ctx, NULL);
+}
+
+/** Reserve a batch of addresses from a pool
+ *
+ * Runs prefetch_find, then prefetch_reserve for each address found, in one transaction.
+ *
+ * @param[in] inst	Instance of rlm_sqlippool.
+ * @param[in] p		to fill.
+ * @param[in,out] handle	to query the database with.
+ * @param[in] request	The current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlippool_prefetch_fill(rlm_sqlippool_t *inst, sqlippool_prefetch_t *p,
+				   rlm_sql_handle_t **handle, REQUEST *request)
+{
+	char		*expanded = NULL;
+	rlm_sql_row_t	row;
+	uint32_t	i;
+	int		ret;
+
+	TALLOC_FREE(p->addrs);
+	p->num_addrs = 0;
+	p->next = 0;
+
+	p->addrs = talloc_zero_array(p, char *, inst->prefetch_size);
+	if (!p->addrs) return -1;
+
+	if (sqlippool_command(inst->allocate_begin, handle, inst, request, NULL, 0) < 0) return -1;
+
+	if (sqlippool_query_expand(&expanded, inst->prefetch_find, *handle, inst, request, NULL, 0) < 0) {
+		return -1;
+	}
+	ret = inst->sql_inst->sql_select_query(inst->sql_inst, request, handle, expanded);
+	talloc_free(expanded);
+	if (ret != 0) {
+		REDEBUG("Failed finding addresses to reserve");
+		return -1;
+	}
+
+	while ((p->num_addrs < inst->prefetch_size) &&
+	       (inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, handle) == RLM_SQL_OK) && row) {
+		if (!row[0]) continue;
+
+		p->addrs[p->num_addrs] = talloc_typed_strdup(p->addrs, row[0]);
+		if (!p->addrs[p->num_addrs]) break;
+		p->num_addrs++;
+	}
+	if (*handle) (inst->sql_inst->driver->sql_finish_select_query)(*handle, inst->sql_inst->config);
+
+	for (i = 0; i < p->num_addrs; i++) {
+		if (sqlippool_command(inst->prefetch_reserve, handle, inst, request,
+				      p->addrs[i], strlen(p->addrs[i])) < 0) {
+			p->num_addrs = 0;
+			return -1;
+		}
+	}
+
+	if (sqlippool_command(inst->allocate_commit, handle, inst, request, NULL, 0) < 0) {
+		p->num_addrs = 0;
+		return -1;
+	}
+
+	/*
+	 *	Stop using the reservations well before they expire.
+	 */
+	p->expires = time(NULL) + (inst->lease_duration / 2);
+
+	RDEBUG2("Reserved %u address(es) from pool %s", p->num_addrs, p->name);
+
+	return 0;
+}
+
+/** Allocate an address from the addresses this thread has reserved
+ *
+ * The prefetch_update query is expanded now, but written later as part of a batch.
+ *
+ * @param[in] inst	Instance of rlm_sqlippool.
+ * @param[in] t		Thread specific instance data.
+ * @param[in] request	The current request.
+ * @param[in,out] handle	to query the database with.
+ * @param[in] pool_name	to allocate from.
+ * @return
+ *	- RLM_MODULE_OK if an address was allocated.
+ *	- RLM_MODULE_NOTFOUND if no addresses could be reserved, and the normal
+ *	  allocation sequence should be used instead.
+ *	- RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t sqlippool_prefetch_alloc(rlm_sqlippool_t *inst, rlm_sqlippool_thread_t *t, REQUEST *request,
+					    rlm_sql_handle_t **handle, char const *pool_name)
+{
+	sqlippool_prefetch_t	find, *p;
+	sqlippool_pending_t	*entry;
+	VALUE_PAIR		*vp;
+	char			*addr;
+	struct timeval		now, when;
+
+	find.name = pool_name;
+	p = rbtree_finddata(t->pools, &find);
+	if (!p) {
+		p = talloc_zero(t->pools, sqlippool_prefetch_t);
+		if (!p) return RLM_MODULE_FAIL;
+
+		p->name = talloc_typed_strdup(p, pool_name);
+		if (!p->name || !rbtree_insert(t->pools, p)) {
+			talloc_free(p);
+			return RLM_MODULE_FAIL;
+		}
+	}
+
+	if ((p->next >= p->num_addrs) || (p->expires <= time(NULL))) {
+		if (sqlippool_prefetch_fill(inst, p, handle, request) < 0) {
+			if (*handle) (void) sqlippool_command(inst->allocate_commit, handle, inst, request, NULL, 0);
+			return RLM_MODULE_FAIL;
+		}
+		if (p->num_addrs == 0) return RLM_MODULE_NOTFOUND;
+	}
+
+	addr = p->addrs[p->next++];
+
+	vp = fr_pair_afrom_num(request->reply, 0, inst->framed_ip_address);
+	if (!vp || (fr_pair_value_from_str(vp, addr, strlen(addr)) < 0)) {
+		REDEBUG("Invalid IP number [%s] returned from prefetch query", addr);
+		talloc_free(vp);
+		return RLM_MODULE_FAIL;
+	}
+
+	entry = talloc_zero(NULL, sqlippool_pending_t);
+	if (!entry) {
+		talloc_free(vp);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (sqlippool_query_expand(&entry->query, inst->prefetch_update, *handle, inst, request,
+				   addr, strlen(addr)) < 0) {
+		talloc_free(entry);
+		talloc_free(vp);
+		return RLM_MODULE_FAIL;
+	}
+	talloc_steal(entry, entry->query);
+
+	*t->tail = entry;
+	t->tail = &entry->next;
+	t->num_pending++;
+
+	RDEBUG("Allocated IP %s from reserved addresses", addr);
+	fr_pair_add(&request->reply->vps, vp);
+
+	if (t->num_pending >= inst->prefetch_size) {
+		sqlippool_pending_flush(t, *handle);
+	} else if (!t->ev) {
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &now, &inst->prefetch_interval);
+
+		if (fr_event_timer_insert(t->el, sqlippool_pending_timeout, t, &when, &t->ev) < 0) {
+			RWDEBUG("Failed inserting prefetch timer, writing allocations now");
+			sqlippool_pending_flush(t, *handle);
+		}
+	}
+
+	return RLM_MODULE_OK;
+}
 
 /*
  *	Allocate an IP number from the pool.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sqlippool_t *inst = instance;
+	rlm_sqlippool_thread_t *t = thread;
 	char allocation[FR_MAX_STRING_LEN];
 	int allocation_len;
-	VALUE_PAIR *vp;
+	VALUE_PAIR *vp, *pool_name;
 	rlm_sql_handle_t *handle;
 	time_t now;
 
@@ -452,7 +812,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 		return do_logging(request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_num(request->control, 0, PW_POOL_NAME, TAG_ANY) == NULL) {
+	pool_name = fr_pair_find_by_num(request->control, 0, PW_POOL_NAME, TAG_ANY);
+	if (!pool_name) {
 		RDEBUG("No Pool-Name defined");
 
 		return do_logging(request, inst->log_nopool, RLM_MODULE_NOOP);
@@ -484,6 +845,34 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 		DO_PART(allocate_commit);
 	}
 
+	/*
+	 *	Hand out one of the addresses this thread has
+	 *	reserved, falling back to the normal sequence if
+	 *	the pool has none left to reserve.
+	 */
+	if (inst->prefetch_size && handle) {
+		rlm_rcode_t rcode;
+
+		rcode = sqlippool_prefetch_alloc(inst, t, request, &handle, pool_name->vp_strvalue);
+		switch (rcode) {
+		case RLM_MODULE_OK:
+			fr_connection_release(inst->sql_inst->pool, request, handle);
+			return do_logging(request, inst->log_success, RLM_MODULE_OK);
+
+		case RLM_MODULE_NOTFOUND:
+			break;
+
+		default:
+			fr_connection_release(inst->sql_inst->pool, request, handle);
+			return do_logging(request, inst->log_failed, rcode);
+		}
+	}
+
+	if (!handle) {
+		REDEBUG("Lost SQL connection");
+		return RLM_MODULE_FAIL;
+	}
+
 	DO_PART(allocate_begin);
 
 	allocation_len = sqlippool_query1(allocation, sizeof(allocation),
@@ -690,6 +1079,81 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	return rcode;
 }
 
+/** Initialise the reserved addresses and pending allocations for this thread
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_sqlippool_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_thread_t	*t = thread;
+
+	t->inst = instance;
+	t->el = el;
+	t->tail = &t->head;
+
+	if (!t->inst->prefetch_size) return 0;
+
+	t->pools = rbtree_create(NULL, sqlippool_prefetch_cmp, sqlippool_prefetch_free, 0);
+	if (!t->pools) return -1;
+
+	return 0;
+}
+
+typedef struct {
+	rlm_sqlippool_t		*inst;
+	rlm_sql_handle_t	*handle;
+} sqlippool_release_ctx_t;
+
+static int sqlippool_prefetch_release(void *ctx, void *data)
+{
+	sqlippool_release_ctx_t	*rctx = ctx;
+	rlm_sqlippool_t		*inst = rctx->inst;
+	sqlippool_prefetch_t	*p = data;
+	uint32_t		i;
+
+	for (i = p->next; i < p->num_addrs; i++) {
+		if (sqlippool_command_raw(inst, &rctx->handle, inst->prefetch_release, p->addrs[i]) < 0) {
+			ERROR("Failed releasing reserved address %s", p->addrs[i]);
+		}
+	}
+
+	return 0;
+}
+
+/** Write pending allocations, and release any addresses this thread reserved but didn't use
+ *
+ * @param[in] thread	specific data to destroy.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_sqlippool_thread_t	*t = thread;
+	rlm_sqlippool_t		*inst = t->inst;
+	sqlippool_release_ctx_t	rctx = { .inst = inst };
+
+	if (!t->pools) return 0;
+
+	sqlippool_pending_flush(t, NULL);
+
+	if (inst->prefetch_release && *inst->prefetch_release) {
+		rctx.handle = fr_connection_get(inst->sql_inst->pool, NULL);
+		if (rctx.handle) {
+			rbtree_walk(t->pools, RBTREE_IN_ORDER, sqlippool_prefetch_release, &rctx);
+			if (rctx.handle) fr_connection_release(inst->sql_inst->pool, NULL, rctx.handle);
+		}
+	}
+
+	talloc_free(t->pools);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -705,8 +1169,11 @@ rad_module_t rlm_sqlippool = {
 	.name		= "sqlippool",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_sqlippool_t),
+	.thread_inst_size	= sizeof(rlm_sqlippool_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_post_auth
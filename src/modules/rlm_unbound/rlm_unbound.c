@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/log.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unbound.h>
 
 typedef struct rlm_unbound_t {
@@ -150,30 +151,44 @@ static int rrlabels_tostr(char *out, char *rr, size_t left)
 	return offset;
 }
 
+/** Wait for libunbound to answer a query
+ *
+ * Instead of sleeping for increasing intervals, wait for the context's
+ * file descriptor to become readable, so the answer is processed as
+ * soon as it arrives.
+ *
+ * Other workers, and the event loop, call ub_process() on the same
+ * context, and may run our callback for us.  So we never wait more
+ * than a few milliseconds without checking whether that's happened.
+ */
 static int ub_common_wait(rlm_unbound_t const *inst, REQUEST *request,
 			  char const *name, struct ub_result **ub, int async_id)
 {
-	useconds_t iv, waited;
+	struct timeval	start, now;
+	int		fd;
+
+	fd = ub_fd(inst->ub);
+	gettimeofday(&start, NULL);
 
-	iv = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
 	ub_process(inst->ub);
 
-	for (waited = 0; (void const *)*ub == (void const *)inst; waited += iv, iv *= 2) {
+	while ((void const *)*ub == (void const *)inst) {
+		struct pollfd	pfd;
+		int		elapsed, wait;
 
-		if (waited + iv > (useconds_t)inst->timeout * 1000) {
-			usleep(inst->timeout * 1000 - waited);
-			ub_process(inst->ub);
-			break;
-		}
+		gettimeofday(&now, NULL);
+		elapsed = ((now.tv_sec - start.tv_sec) * 1000) + ((now.tv_usec - start.tv_usec) / 1000);
+		if (elapsed >= (int)inst->timeout) break;
 
-		usleep(iv);
+		wait = inst->timeout - elapsed;
+		if (wait > 10) wait = 10;
 
-		/* Check if already handled by event loop */
-		if ((void const *)*ub != (void const *)inst) {
-			break;
-		}
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		(void) poll(&pfd, 1, wait);	/* A negative fd is ignored, and we just sleep */
 
-		/* In case we are running single threaded */
 		ub_process(inst->ub);
 	}
 
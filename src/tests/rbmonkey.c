@@ -10,18 +10,8 @@
  */
 
 /* RED-BLACK tree description */
-typedef enum {
-	BLACK,
-	RED
-} node_colour_t;
-
-struct rbnode_t {
-    rbnode_t		*left;		//!< left child
-    rbnode_t		*right;		//!< right child
-    rbnode_t		*parent;	//!< Parent
-    node_colour_t	colour;		//!< Node colour (BLACK, RED)
-    void		*data;		//!< data stored in node
-};
+#define BLACK	(0)
+#define RED	(1)
 
 struct rbtree_t {
 #ifndef NDEBUG
@@ -34,8 +24,22 @@ struct rbtree_t {
 	bool			replace;
 	bool			lock;
 	pthread_mutex_t		mutex;
+
+	bool			pool;
+	rbnode_t		*spare;
+
+	bool			intrusive;
+	size_t			offset;
 };
 
+/*
+ *	Data with an embedded node, for intrusive trees.
+ */
+typedef struct rbmonkey_t {
+	uint32_t		value;
+	rbnode_t		node;
+} rbmonkey_t;
+
 /* Storage for the NIL pointer. */
 static rbnode_t *NIL;
 
@@ -182,16 +186,33 @@ again:
 	fprintf(stderr, "filter = %x mask = %x n= %i\n",
 		thresh, mask, n);
 
-	t = rbtree_create(NULL, comp, free, RBTREE_FLAG_LOCK);
+	/*
+	 *	Cycle through normal, pooled, and intrusive nodes.
+	 */
+	switch (rep % 3) {
+	case 0:
+		t = rbtree_create(NULL, comp, rbtree_node_talloc_free, RBTREE_FLAG_LOCK);
+		break;
+
+	case 1:
+		t = rbtree_create(NULL, comp, rbtree_node_talloc_free, RBTREE_FLAG_LOCK | RBTREE_FLAG_POOL);
+		break;
+
+	default:
+		t = rbtree_create_intrusive(NULL, comp, rbtree_node_talloc_free,
+					    offsetof(rbmonkey_t, node), RBTREE_FLAG_LOCK);
+		break;
+	}
+
 	/* Find out the value of the NIL node */
 	NIL = t->root->left;
 
 	for (i = 0; i < n; i++) {
-		int *p;
-		p = talloc(NULL, int);
-		*p = fr_rand();
-		vals[i] = *p;
-		rbtree_insert(t, p);
+		rbmonkey_t *p;
+		p = talloc(NULL, rbmonkey_t);
+		p->value = fr_rand();
+		vals[i] = p->value;
+		if (!rbtree_insert(t, p)) talloc_free(p);
 	}
 
 	i = rbcount(t);
@@ -1,8 +1,8 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk time_histogram_test.mk track_test.mk receiver_test.mk hash_test.mk coro_test.mk codec_bench.mk value_bench.mk
 
 #
 #  These require pthread.
 #
 ifneq "$(findstring thread,${CFLAGS})" ""
-SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk
+SUBMAKEFILES += channel_test.mk spsc_queue_test.mk worker_test.mk radius1_test.mk schedule_test.mk schedule_numa_test.mk radius_schedule_test.mk schedule_bench.mk cmap_test.mk
 endif
@@ -48,10 +48,10 @@ static void NEVER_RETURNS usage(void)
 
 int main(int argc, char *argv[])
 {
-	int c, i, rcode = 0;
+	int c, i, num, rcode = 0;
 	int size;
 	intptr_t val;
-	void *data;
+	void *data, **array;
 	fr_atomic_queue_t *aq;
 	TALLOC_CTX	*autofree = talloc_init("main");
 
@@ -164,6 +164,59 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	/*
+	 *	Now do the same thing, but in bursts.  Push enough to
+	 *	fill the queue, plus one more, which shouldn't fit.
+	 */
+	array = talloc_array(autofree, void *, size + 1);
+	for (i = 0; i <= size; i++) {
+		val = i + OFFSET;
+		array[i] = (void *) val;
+	}
+
+	num = fr_atomic_queue_push_n(aq, array, size + 1);
+	if (num != size) {
+		fprintf(stderr, "Burst push expected %d, got %d\n", size, num);
+		exit(1);
+	}
+
+	if (fr_atomic_queue_push_n(aq, array + size, 1) != 0) {
+		fprintf(stderr, "Burst pushed an entry past the end of the queue.");
+		exit(1);
+	}
+
+	/*
+	 *	Pop them in two bursts, to check that the tail wraps
+	 *	around correctly.
+	 */
+	memset(array, 0, (size + 1) * sizeof(array[0]));
+
+	num = fr_atomic_queue_pop_n(aq, array, 1);
+	if (num != 1) {
+		fprintf(stderr, "Burst pop expected 1, got %d\n", num);
+		exit(1);
+	}
+
+	num = fr_atomic_queue_pop_n(aq, array + 1, size + 1);
+	if (num != (size - 1)) {
+		fprintf(stderr, "Burst pop expected %d, got %d\n", size - 1, num);
+		exit(1);
+	}
+
+	for (i = 0; i < size; i++) {
+		val = (intptr_t) array[i];
+		if (val != (i + OFFSET)) {
+			fprintf(stderr, "Burst pop expected %d, got %d\n",
+				i + OFFSET, (int) val);
+			exit(1);
+		}
+	}
+
+	if (fr_atomic_queue_pop_n(aq, array, 1) != 0) {
+		fprintf(stderr, "Burst popped an entry past the end of the queue.");
+		exit(1);
+	}
+
 	talloc_free(autofree);
 
 	return rcode;
@@ -25,6 +25,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/rad_assert.h>
+#include <inttypes.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -34,8 +35,6 @@ RCSID("$Id$")
 #include <pthread.h>
 #endif
 
-#include <sys/event.h>
-
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
 #define MAX_KEVENTS		(10)
@@ -192,7 +191,7 @@ check_close:
 		MPRINT1("Master waiting on events.\n");
 		rad_assert(num_messages <= max_messages);
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
+		num_events = fr_event_kq_wait(kq_master, events, MAX_KEVENTS, NULL);
 		MPRINT1("Master kevent returned %d\n", num_events);
 
 		if (num_events < 0) {
@@ -322,7 +321,7 @@ static void *channel_worker(void *arg)
 
 		MPRINT1("\tWorker waiting on events.\n");
 
-		num_events = kevent(kq_worker, NULL, 0, events, MAX_KEVENTS, NULL);
+		num_events = fr_event_kq_wait(kq_worker, events, MAX_KEVENTS, NULL);
 		MPRINT1("\tWorker kevent returned %d events\n", num_events);
 
 		if (num_events < 0) {
@@ -477,6 +476,7 @@ int main(int argc, char *argv[])
 	TALLOC_CTX	*autofree = talloc_init("main");
 	pthread_attr_t	attr;
 	pthread_t	master_id, worker_id;
+	fr_time_t	start, elapsed;
 
 	fr_time_start();
 
@@ -518,10 +518,10 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq_master = kqueue();
+	kq_master = fr_event_kq_create();
 	rad_assert(kq_master >= 0);
 
-	kq_worker = kqueue();
+	kq_worker = fr_event_kq_create();
 	rad_assert(kq_worker >= 0);
 
 	aq_master = fr_atomic_queue_create(autofree, max_control_plane);
@@ -548,12 +548,24 @@ int main(int argc, char *argv[])
 	(void) pthread_attr_init(&attr);
 	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	start = fr_time();
+
 	(void) pthread_create(&master_id, &attr, channel_master, channel);
 	(void) pthread_create(&worker_id, &attr, channel_worker, channel);
 
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
+	elapsed = fr_time() - start;
+
+	/*
+	 *	Each message goes through the channel twice, once as
+	 *	a request, and once as a reply.
+	 */
+	printf("%d messages in %" PRIu64 ".%06" PRIu64 "s, %.0f round trips/s\n",
+	       max_messages, elapsed / NANOSEC, (elapsed % NANOSEC) / 1000,
+	       elapsed ? ((double) max_messages * NANOSEC) / elapsed : 0.0);
+
 	close(kq_master);
 	close(kq_worker);
 
@@ -0,0 +1,258 @@
+/*
+ * cmap_test.c	Tests for concurrent hash maps
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/cmap.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MAX_THREADS	(16)
+
+static int		debug_lvl = 0;
+static int		num_entries = 65536;
+static int		num_lookups = 1000000;
+
+typedef struct cmap_entry_t {
+	uint32_t	key;
+	uint32_t	value;
+} cmap_entry_t;
+
+typedef struct cmap_thread_t {
+	pthread_t	id;
+	fr_cmap_t	*cmap;
+	int		num;		//!< which thread this is
+	int		found;		//!< how many lookups found an entry
+	int		bad;		//!< how many lookups found the wrong entry
+} cmap_thread_t;
+
+static cmap_entry_t	*entries;
+
+static uint32_t cmap_entry_hash(void const *data)
+{
+	cmap_entry_t const *entry = data;
+
+	return fr_hash(&entry->key, sizeof(entry->key));
+}
+
+static int cmap_entry_cmp(void const *one, void const *two)
+{
+	cmap_entry_t const *a = one;
+	cmap_entry_t const *b = two;
+
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static int cmap_entry_check(void *ctx, void *data)
+{
+	cmap_entry_t const *key = ctx;
+	cmap_entry_t const *entry = data;
+
+	return (entry->value == (key->key ^ 0xabcdef)) ? 1 : 0;
+}
+
+/*
+ *	Even numbered threads look up entries.  Odd numbered threads
+ *	delete and re-insert the entries in their own range.
+ */
+static void *cmap_thread(void *arg)
+{
+	int i;
+	cmap_thread_t *t = arg;
+	cmap_entry_t my_entry;
+
+	for (i = 0; i < num_lookups; i++) {
+		uint32_t k = (((uint32_t) i * 7919) + t->num) % num_entries;
+
+		if ((t->num & 1) == 0) {
+			int rcode;
+
+			my_entry.key = k;
+			rcode = fr_cmap_find(t->cmap, &my_entry, cmap_entry_check, &my_entry);
+			if (rcode < 0) continue;
+
+			t->found++;
+			if (rcode != 1) t->bad++;
+			continue;
+		}
+
+		if ((k % MAX_THREADS) != (uint32_t) t->num) continue;
+
+		if (!fr_cmap_yank(t->cmap, &entries[k])) {
+			t->bad++;
+			continue;
+		}
+
+		if (!fr_cmap_insert(t->cmap, &entries[k])) t->bad++;
+	}
+
+	return NULL;
+}
+
+static int cmap_count(void *ctx, UNUSED void *data)
+{
+	int *count = ctx;
+
+	(*count)++;
+	return 0;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: cmap_test [OPTS]\n");
+	fprintf(stderr, "  -n <num>               Number of entries.\n");
+	fprintf(stderr, "  -l <num>               Number of lookups per thread.\n");
+	fprintf(stderr, "  -t <num>               Number of threads.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, count, num_threads = 8;
+	fr_cmap_t *cmap;
+	cmap_entry_t my_entry;
+	cmap_thread_t threads[MAX_THREADS];
+
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hl:n:t:x")) != EOF) switch (c) {
+		case 'l':
+			num_lookups = atoi(optarg);
+			break;
+
+		case 'n':
+			num_entries = atoi(optarg);
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			if ((num_threads < 1) || (num_threads > MAX_THREADS)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (num_entries < MAX_THREADS) usage();
+
+	cmap = fr_cmap_create(autofree, 0, cmap_entry_hash, cmap_entry_cmp, NULL);
+	if (!cmap) {
+		fprintf(stderr, "Failed creating map\n");
+		exit(1);
+	}
+
+	entries = talloc_array(autofree, cmap_entry_t, num_entries);
+	for (i = 0; i < num_entries; i++) {
+		entries[i].key = i;
+		entries[i].value = i ^ 0xabcdef;
+
+		if (!fr_cmap_insert(cmap, &entries[i])) {
+			fprintf(stderr, "Failed inserting %d\n", i);
+			exit(1);
+		}
+	}
+
+	if (fr_cmap_insert(cmap, &entries[0])) {
+		fprintf(stderr, "Inserted duplicate entry\n");
+		exit(1);
+	}
+
+	if (fr_cmap_num_elements(cmap) != num_entries) {
+		fprintf(stderr, "Expected %d entries, got %d\n", num_entries, fr_cmap_num_elements(cmap));
+		exit(1);
+	}
+
+	/*
+	 *	Readers and writers, all at the same time.
+	 */
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < num_threads; i++) {
+		threads[i].cmap = cmap;
+		threads[i].num = i;
+
+		if (pthread_create(&threads[i].id, NULL, cmap_thread, &threads[i]) != 0) {
+			fprintf(stderr, "Failed creating thread %d\n", i);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].id, NULL);
+
+		if (threads[i].bad) {
+			fprintf(stderr, "Thread %d had %d bad results\n", i, threads[i].bad);
+			exit(1);
+		}
+
+		if (debug_lvl) printf("thread %d found %d\n", i, threads[i].found);
+	}
+
+	/*
+	 *	Everything should be back where it started.
+	 */
+	for (i = 0; i < num_entries; i++) {
+		my_entry.key = i;
+
+		if (fr_cmap_finddata(cmap, &my_entry) != &entries[i]) {
+			fprintf(stderr, "Failed finding %d\n", i);
+			exit(1);
+		}
+	}
+
+	count = 0;
+	(void) fr_cmap_walk(cmap, cmap_count, &count);
+	if (count != num_entries) {
+		fprintf(stderr, "Walked %d entries, expected %d\n", count, num_entries);
+		exit(1);
+	}
+
+	for (i = 0; i < num_entries; i += 2) {
+		if (!fr_cmap_delete(cmap, &entries[i])) {
+			fprintf(stderr, "Failed deleting %d\n", i);
+			exit(1);
+		}
+	}
+
+	if (fr_cmap_num_elements(cmap) != (num_entries - ((num_entries + 1) / 2))) {
+		fprintf(stderr, "Wrong number of entries after delete\n");
+		exit(1);
+	}
+
+	if (debug_lvl) printf("All tests passed\n");
+
+	talloc_free(autofree);
+
+	return 0;
+}
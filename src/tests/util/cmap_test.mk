@@ -0,0 +1,6 @@
+TARGET := cmap_test
+
+SOURCES		:= cmap_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
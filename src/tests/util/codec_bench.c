@@ -0,0 +1,928 @@
+/*
+ * codec_bench.c	Throughput benchmark for the RADIUS, DHCP and TACACS encoders and decoders
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+/*
+ *	A corpus of packets is loaded from a built-in set of
+ *	representative packets, from files of hex strings, and from
+ *	pcap files.  Each operation (decode, encode, sign, verify) is
+ *	then run over the corpus, round robin, and timed.
+ *
+ *	The results are printed as one JSON object per line, per
+ *	protocol and operation, so that runs against different
+ *	releases can be compared by scripts.
+ */
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/radpaths.h>
+#include <freeradius-devel/dhcp.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_TACACS
+#  include "../../modules/proto_tacacs/tacacs.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/*
+ *	Count allocations, so that we can report allocations per
+ *	packet.  The program's allocator calls go through here, and on
+ *	to glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_uint_fast64_t num_allocations;
+
+#define COUNT_ALLOCATIONS (1)
+
+void *malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+/*
+ *	The time stamp counter isn't the same as core cycles on CPUs
+ *	which scale their frequency, but it's close enough to compare
+ *	runs on the same machine.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#  define COUNT_CYCLES (1)
+#  define CYCLES() __builtin_ia32_rdtsc()
+#endif
+
+typedef enum {
+	BENCH_RADIUS = 0,
+	BENCH_DHCP,
+	BENCH_TACACS,
+	BENCH_PROTO_MAX
+} bench_proto_t;
+
+typedef enum {
+	BENCH_DECODE = 0,
+	BENCH_ENCODE,
+	BENCH_SIGN,
+	BENCH_VERIFY,
+	BENCH_OP_MAX
+} bench_op_t;
+
+static char const *proto_names[BENCH_PROTO_MAX] = {
+	[BENCH_RADIUS] = "radius",
+	[BENCH_DHCP] = "dhcp",
+	[BENCH_TACACS] = "tacacs"
+};
+
+static char const *op_names[BENCH_OP_MAX] = {
+	[BENCH_DECODE] = "decode",
+	[BENCH_ENCODE] = "encode",
+	[BENCH_SIGN] = "sign",
+	[BENCH_VERIFY] = "verify"
+};
+
+/** A packet in the corpus
+ *
+ */
+typedef struct bench_packet_t {
+	bench_proto_t	proto;
+	RADIUS_PACKET	*packet;		//!< As received, for decoding and verifying.
+	RADIUS_PACKET	*encoded;		//!< Encoded from vps, for encoding and signing.
+	VALUE_PAIR	*vps;			//!< Decoded from packet.
+	bool		ok[BENCH_OP_MAX];	//!< Which operations work for this packet.
+} bench_packet_t;
+
+typedef int (*bench_func_t)(bench_packet_t *p);
+
+static int		debug_lvl = 0;
+static char		*secret;
+static bench_packet_t	*corpus;
+static int		corpus_len;
+
+/*
+ *	Representative requests.  These are what a server spends most
+ *	of its time decoding.
+ */
+static char const *radius_builtin[] = {
+	/* Access-Request with User-Password, NAS and station information, and Message-Authenticator */
+	"0101008f101112131415161718191a1b1c1d1e1f0105626f620212d2ebb02b61e464fb7a975abab9c9a5b6"
+	"0406c00002010506000000013d060000000f1e1930302d31312d32322d33332d34342d35353a62656e6368"
+	"1f1336362d37372d38382d39392d41412d42420c06000005780606000000025708657468302f3150120"
+	"2ec7a3be7a200e8490cf05bc0f78cde",
+
+	/* Accounting-Request Interim-Update, with counters and a Cisco-AVPair */
+	"040200ae9d8350ba80fb879f24c00c10dc9ccc9c2806000000032c0f35613162326333642d303030310105"
+	"626f620406c00002010506000000013d060000000f08060a00002a2a06075bcd152b063ade68b12f060000"
+	"303930060000d4312e0600000e10370659682f001f1336362d37372d38382d39392d41412d42421a310000"
+	"0009012b61756469742d73657373696f6e2d69643d30613030303030313030303030303165356131623263"
+	"3364",
+
+	NULL
+};
+
+/*
+ *	Options for a DHCP-Discover, the header is built in dhcp_builtin_add().
+ */
+static uint8_t const dhcp_discover_options[] = {
+	0x63, 0x82, 0x53, 0x63,						/* magic cookie */
+	53, 1, 1,							/* DHCP-Message-Type = Discover */
+	61, 7, 0x01, 0x00, 0x11, 0x22, 0x33, 0x44, 0x55,		/* DHCP-Client-Identifier */
+	55, 8, 1, 3, 6, 15, 28, 51, 58, 59,				/* DHCP-Parameter-Request-List */
+	57, 2, 0x05, 0xdc,						/* DHCP-DHCP-Maximum-Msg-Size */
+	12, 5, 'b', 'e', 'n', 'c', 'h',					/* DHCP-Hostname */
+	255								/* End */
+};
+
+/*
+ *	Unencrypted authentication, authorization and accounting
+ *	requests, from src/tests/unit/tacacs.txt.
+ */
+static char const *tacacs_builtin[] = {
+	"c1010101 2b5ad28a 0000001c 01000203 03050705 626f6270 74732f36 312e312e 312e3168 656c6c6f",
+
+	"c0020101 a177c45e 0000002f 06000203 03050702 0b0b626f 62707473 2f36312e 312e312e 31736572"
+	"76696365 3d707070 70726f74 6f636f6c 3d6970",
+
+	"c0030101 62b06130 00000054 02060002 03030507 04150d0b 0b626f62 7074732f 36312e31 2e312e31"
+	"73746172 745f7469 6d653d31 34383039 36393935 35746173 6b5f6964 3d313639 39387365 72766963"
+	"653d7070 7070726f 746f636f 6c3d6970",
+
+	NULL
+};
+
+/*
+ *	RADIUS
+ */
+static int radius_decode(bench_packet_t *p)
+{
+	decode_fail_t	reason;
+	int		ret;
+
+	if (!fr_radius_ok(p->packet, false, &reason)) return -1;
+
+	ret = fr_radius_decode(p->packet, NULL, secret);
+	fr_pair_list_free(&p->packet->vps);
+
+	return ret;
+}
+
+static int radius_encode(bench_packet_t *p)
+{
+	int ret;
+
+	TALLOC_FREE(p->encoded->data);
+	p->encoded->data_len = 0;
+
+	p->encoded->vps = p->vps;
+	ret = fr_radius_encode(p->encoded, NULL, secret);
+	p->encoded->vps = NULL;
+
+	return ret;
+}
+
+static int radius_sign(bench_packet_t *p)
+{
+	return fr_radius_sign(p->encoded, NULL, secret);
+}
+
+static int radius_verify(bench_packet_t *p)
+{
+	return fr_radius_verify(p->packet, NULL, secret);
+}
+
+/*
+ *	DHCP
+ */
+static int dhcp_decode(bench_packet_t *p)
+{
+	int ret;
+
+	ret = fr_dhcp_decode(p->packet);
+	fr_pair_list_free(&p->packet->vps);
+
+	return ret;
+}
+
+static int dhcp_encode(bench_packet_t *p)
+{
+	int ret;
+
+	TALLOC_FREE(p->encoded->data);
+	p->encoded->data_len = 0;
+
+	p->encoded->vps = p->vps;
+	ret = fr_dhcp_encode(p->encoded);
+	p->encoded->vps = NULL;
+
+	return ret;
+}
+
+#ifdef WITH_TACACS
+/*
+ *	TACACS
+ */
+static int tacacs_bench_decode(bench_packet_t *p)
+{
+	int ret;
+
+	ret = tacacs_decode(p->packet);
+	fr_pair_list_free(&p->packet->vps);
+
+	return ret;
+}
+
+static int tacacs_bench_encode(bench_packet_t *p)
+{
+	int ret;
+
+	TALLOC_FREE(p->encoded->data);
+	p->encoded->data_len = 0;
+
+	p->encoded->vps = p->vps;
+	ret = tacacs_encode(p->encoded, NULL);
+	p->encoded->vps = NULL;
+
+	return ret;
+}
+#endif
+
+static bench_func_t bench_funcs[BENCH_PROTO_MAX][BENCH_OP_MAX] = {
+	[BENCH_RADIUS] = {
+		[BENCH_DECODE] = radius_decode,
+		[BENCH_ENCODE] = radius_encode,
+		[BENCH_SIGN] = radius_sign,
+		[BENCH_VERIFY] = radius_verify
+	},
+	[BENCH_DHCP] = {
+		[BENCH_DECODE] = dhcp_decode,
+		[BENCH_ENCODE] = dhcp_encode
+	},
+#ifdef WITH_TACACS
+	[BENCH_TACACS] = {
+		[BENCH_DECODE] = tacacs_bench_decode,
+		[BENCH_ENCODE] = tacacs_bench_encode
+	},
+#endif
+};
+
+/** Add a packet to the corpus
+ *
+ * The packet is decoded, and re-encoded, so that the encoders have
+ * attributes to work on.  Each operation is run once, and is only
+ * benchmarked for packets where it succeeds.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the packet can't be decoded, or is a reply.
+ */
+static int corpus_add(TALLOC_CTX *ctx, bench_proto_t proto, uint8_t const *data, size_t data_len)
+{
+	bench_packet_t	*p;
+	RADIUS_PACKET	*packet = NULL;
+	int		i;
+
+	switch (proto) {
+	case BENCH_RADIUS:
+	{
+		decode_fail_t reason;
+
+		packet = fr_radius_alloc(ctx, false);
+		if (!packet) return -1;
+
+		packet->data = talloc_memdup(packet, data, data_len);
+		packet->data_len = data_len;
+		if (!fr_radius_ok(packet, false, &reason)) {
+			MPRINT1("Skipping RADIUS packet: %s\n", fr_strerror());
+		error:
+			talloc_free(packet);
+			return -1;
+		}
+
+		/*
+		 *	Replies can't be decoded without the request.
+		 */
+		switch (packet->code) {
+		case PW_CODE_ACCESS_REQUEST:
+		case PW_CODE_ACCOUNTING_REQUEST:
+		case PW_CODE_COA_REQUEST:
+		case PW_CODE_DISCONNECT_REQUEST:
+		case PW_CODE_STATUS_SERVER:
+			break;
+
+		default:
+			MPRINT1("Skipping RADIUS reply code %u\n", packet->code);
+			goto error;
+		}
+	}
+		break;
+
+	case BENCH_DHCP:
+	{
+		fr_ipaddr_t ipaddr;
+
+		memset(&ipaddr, 0, sizeof(ipaddr));
+		ipaddr.af = AF_INET;
+
+		packet = fr_dhcp_packet_ok(data, data_len, ipaddr, 68, ipaddr, 67);
+		if (!packet) {
+			MPRINT1("Skipping DHCP packet: %s\n", fr_strerror());
+			return -1;
+		}
+		talloc_steal(ctx, packet);
+
+		packet->data = talloc_memdup(packet, data, data_len);
+		packet->data_len = data_len;
+	}
+		break;
+
+	case BENCH_TACACS:
+#ifdef WITH_TACACS
+		/*
+		 *	We'd need the secret of each client to decrypt
+		 *	the body, and that isn't what we're measuring.
+		 */
+		if ((data_len < sizeof(tacacs_packet_hdr_t)) ||
+		    !(((tacacs_packet_hdr_t const *) data)->flags & TAC_PLUS_UNENCRYPTED_FLAG)) {
+			MPRINT1("Skipping encrypted, or short TACACS packet\n");
+			return -1;
+		}
+
+		packet = fr_radius_alloc(ctx, false);
+		if (!packet) return -1;
+
+		packet->data = talloc_memdup(packet, data, data_len);
+		packet->data_len = data_len;
+		break;
+#else
+		return -1;
+#endif
+
+	default:
+		return -1;
+	}
+
+	if (!packet->data) {
+		talloc_free(packet);
+		return -1;
+	}
+
+	p = talloc_realloc(ctx, corpus, bench_packet_t, corpus_len + 1);
+	if (!p) {
+		talloc_free(packet);
+		return -1;
+	}
+	corpus = p;
+	p = &corpus[corpus_len];
+	memset(p, 0, sizeof(*p));
+	p->proto = proto;
+	p->packet = packet;
+
+	/*
+	 *	Decode it for real, so the encoders have something
+	 *	to encode.
+	 */
+	switch (proto) {
+	case BENCH_RADIUS:
+		if (fr_radius_decode(packet, NULL, secret) < 0) break;
+		p->ok[BENCH_DECODE] = true;
+		break;
+
+	case BENCH_DHCP:
+		if (fr_dhcp_decode(packet) < 0) break;
+		p->ok[BENCH_DECODE] = true;
+		break;
+
+#ifdef WITH_TACACS
+	case BENCH_TACACS:
+		if (tacacs_decode(packet) < 0) break;
+		p->ok[BENCH_DECODE] = true;
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	if (!p->ok[BENCH_DECODE]) {
+		MPRINT1("Skipping %s packet: %s\n", proto_names[proto], fr_strerror());
+		fr_pair_list_free(&packet->vps);
+		talloc_free(packet);
+		return -1;
+	}
+
+	p->vps = packet->vps;
+	packet->vps = NULL;
+	(void) talloc_steal(ctx, p->vps);
+
+	p->encoded = fr_radius_alloc(ctx, false);
+	if (!p->encoded) {
+		talloc_free(packet);
+		return -1;
+	}
+	p->encoded->code = packet->code;
+	p->encoded->id = packet->id;
+
+	/*
+	 *	Find out which of the other operations work for
+	 *	this packet.  Encoding first, as signing needs an
+	 *	encoded packet.
+	 */
+	for (i = BENCH_ENCODE; i < BENCH_OP_MAX; i++) {
+		if (!bench_funcs[proto][i]) continue;
+
+		p->ok[i] = (bench_funcs[proto][i](p) == 0);
+		if (!p->ok[i]) MPRINT1("Can't %s %s packet: %s\n", op_names[i], proto_names[proto], fr_strerror());
+		if ((i == BENCH_ENCODE) && !p->ok[i]) break;
+	}
+
+	corpus_len++;
+
+	return 0;
+}
+
+/** Convert a hex string to binary, ignoring whitespace
+ *
+ * @return the number of bytes written to out, or -1 on error.
+ */
+static ssize_t hex_decode(uint8_t *out, size_t outlen, char const *in)
+{
+	uint8_t		*p = out;
+	char const	*q = in;
+
+	while (*q) {
+		if (isspace((int) *q)) {
+			q++;
+			continue;
+		}
+
+		if (!isxdigit((int) q[0]) || !isxdigit((int) q[1])) return -1;
+		if ((size_t) (p - out) >= outlen) return -1;
+
+		if (fr_hex2bin(p, 1, q, 2) != 1) return -1;
+		p++;
+		q += 2;
+	}
+
+	return p - out;
+}
+
+static void corpus_add_hex(TALLOC_CTX *ctx, bench_proto_t proto, char const *hex)
+{
+	uint8_t	data[MAX_PACKET_LEN];
+	ssize_t	len;
+
+	len = hex_decode(data, sizeof(data), hex);
+	if (len <= 0) {
+		fprintf(stderr, "codec_bench: Invalid hex string for %s packet\n", proto_names[proto]);
+		exit(1);
+	}
+
+	(void) corpus_add(ctx, proto, data, len);
+}
+
+static void dhcp_builtin_add(TALLOC_CTX *ctx)
+{
+	uint8_t data[300];
+
+	memset(data, 0, sizeof(data));
+	data[0] = 1;				/* BOOTREQUEST */
+	data[1] = 1;				/* Ethernet */
+	data[2] = 6;				/* Hardware address length */
+	data[4] = 0x39;				/* Transaction ID */
+	data[5] = 0x03;
+	data[6] = 0xf3;
+	data[7] = 0x26;
+	data[10] = 0x80;			/* Broadcast flag */
+	memcpy(data + 28, "\x00\x11\x22\x33\x44\x55", 6);
+	memcpy(data + 236, dhcp_discover_options, sizeof(dhcp_discover_options));
+
+	(void) corpus_add(ctx, BENCH_DHCP, data, sizeof(data));
+}
+
+/** Load packets from a file of hex strings
+ *
+ * Each line is the protocol, followed by the packet in hex, e.g.
+ * "radius 01 01 00 14 ...".  Blank lines and comments are ignored.
+ */
+static void corpus_load_file(TALLOC_CTX *ctx, char const *filename)
+{
+	FILE	*fp;
+	char	buffer[(MAX_PACKET_LEN * 3) + 64];
+	int	lineno = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "codec_bench: Failed opening %s: %s\n", filename, fr_syserror(errno));
+		exit(1);
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		char	*p = buffer;
+		int	proto;
+
+		lineno++;
+
+		while (isspace((int) *p)) p++;
+		if (!*p || (*p == '#')) continue;
+
+		for (proto = 0; proto < BENCH_PROTO_MAX; proto++) {
+			size_t len = strlen(proto_names[proto]);
+
+			if ((strncmp(p, proto_names[proto], len) == 0) && isspace((int) p[len])) {
+				p += len;
+				break;
+			}
+		}
+		if (proto == BENCH_PROTO_MAX) {
+			fprintf(stderr, "codec_bench: %s[%d]: Expected radius, dhcp or tacacs\n", filename, lineno);
+			exit(1);
+		}
+
+		corpus_add_hex(ctx, proto, p);
+	}
+
+	fclose(fp);
+}
+
+#ifdef HAVE_LIBPCAP
+/** Load RADIUS and DHCP packets from a pcap file
+ *
+ * TACACS runs over TCP, and isn't loaded, as we don't reassemble streams.
+ */
+static void corpus_load_pcap(TALLOC_CTX *ctx, char const *filename)
+{
+	pcap_t			*pcap;
+	char			errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data;
+	int			link_layer, ret;
+	int			loaded = 0;
+
+	pcap = pcap_open_offline(filename, errbuf);
+	if (!pcap) {
+		fprintf(stderr, "codec_bench: Failed opening %s: %s\n", filename, errbuf);
+		exit(1);
+	}
+	link_layer = pcap_datalink(pcap);
+
+	while ((ret = pcap_next_ex(pcap, &header, &data)) == 1) {
+		uint8_t const		*p = data, *end = data + header->caplen;
+		udp_header_t const	*udp;
+		ssize_t			offset;
+		uint16_t		src_port, dst_port;
+		bench_proto_t		proto;
+		uint8_t			ip_p;
+
+		offset = fr_link_layer_offset(data, header->caplen, link_layer);
+		if (offset < 0) continue;
+		p += offset;
+
+		if ((end - p) < 1) continue;
+
+		switch ((p[0] & 0xf0) >> 4) {
+		case 4:
+		{
+			ip_header_t const *ip = (ip_header_t const *) p;
+
+			if ((end - p) < (ssize_t) sizeof(*ip)) continue;
+			ip_p = ip->ip_p;
+			p += IP_HL(ip) * 4;
+		}
+			break;
+
+		case 6:
+		{
+			ip_header6_t const *ip6 = (ip_header6_t const *) p;
+
+			if ((end - p) < (ssize_t) sizeof(*ip6)) continue;
+			ip_p = ip6->ip_next;
+			p += sizeof(*ip6);
+		}
+			break;
+
+		default:
+			continue;
+		}
+
+		if ((ip_p != IPPROTO_UDP) || ((end - p) < (ssize_t) sizeof(*udp))) continue;
+
+		udp = (udp_header_t const *) p;
+		p += sizeof(*udp);
+		src_port = ntohs(udp->src);
+		dst_port = ntohs(udp->dst);
+
+#define IS_PORT(_a, _b) ((src_port == (_a)) || (dst_port == (_a)) || (src_port == (_b)) || (dst_port == (_b)))
+		if (IS_PORT(1812, 1813) || IS_PORT(1645, 1646) || IS_PORT(3799, 3799)) {
+			proto = BENCH_RADIUS;
+		} else if (IS_PORT(67, 68)) {
+			proto = BENCH_DHCP;
+		} else {
+			continue;
+		}
+
+		if (corpus_add(ctx, proto, p, end - p) == 0) loaded++;
+	}
+
+	if (ret == -1) {
+		fprintf(stderr, "codec_bench: Failed reading %s: %s\n", filename, pcap_geterr(pcap));
+		exit(1);
+	}
+
+	pcap_close(pcap);
+
+	MPRINT1("Loaded %d packets from %s\n", loaded, filename);
+}
+#endif
+
+/** Run one operation over all of the packets it works for
+ *
+ */
+static void bench_run(bench_proto_t proto, bench_op_t op, uint64_t iterations)
+{
+	bench_packet_t	**packets;
+	bench_func_t	func = bench_funcs[proto][op];
+	int		i, num = 0;
+	uint64_t	n, failed = 0, bytes = 0;
+	fr_time_t	start, elapsed;
+#ifdef COUNT_CYCLES
+	uint64_t	cycles;
+#endif
+#ifdef COUNT_ALLOCATIONS
+	uint64_t	allocations;
+#endif
+
+	if (!func) return;
+
+	packets = talloc_array(NULL, bench_packet_t *, corpus_len);
+	if (!packets) return;
+
+	for (i = 0; i < corpus_len; i++) {
+		if ((corpus[i].proto == proto) && corpus[i].ok[op]) packets[num++] = &corpus[i];
+	}
+
+	if (!num) {
+		talloc_free(packets);
+		return;
+	}
+
+	/*
+	 *	Warm the caches.
+	 */
+	for (i = 0; i < num; i++) (void) func(packets[i]);
+
+#ifdef COUNT_ALLOCATIONS
+	allocations = atomic_load(&num_allocations);
+#endif
+#ifdef COUNT_CYCLES
+	cycles = CYCLES();
+#endif
+	start = fr_time();
+
+	for (n = 0; n < iterations; n++) {
+		bench_packet_t *p = packets[n % num];
+
+		if (func(p) < 0) failed++;
+		bytes += p->packet->data_len;
+	}
+
+	elapsed = fr_time() - start;
+#ifdef COUNT_CYCLES
+	cycles = CYCLES() - cycles;
+#endif
+#ifdef COUNT_ALLOCATIONS
+	allocations = atomic_load(&num_allocations) - allocations;
+#endif
+
+	printf("{\"protocol\": \"%s\", \"operation\": \"%s\", \"packets\": %d, \"iterations\": %" PRIu64 ", "
+	       "\"failed\": %" PRIu64 ", \"elapsed_usec\": %" PRIu64 ", \"pps\": %.0f, \"ns_per_packet\": %.1f, "
+	       "\"mbytes_per_sec\": %.1f, \"cycles_per_packet\": ",
+	       proto_names[proto], op_names[op], num, iterations,
+	       failed, elapsed / 1000, elapsed ? ((double) iterations * NANOSEC) / elapsed : 0.0,
+	       ((double) elapsed) / iterations,
+	       elapsed ? (((double) bytes * NANOSEC) / elapsed) / (1024 * 1024) : 0.0);
+#ifdef COUNT_CYCLES
+	printf("%.0f, ", ((double) cycles) / iterations);
+#else
+	printf("null, ");
+#endif
+	printf("\"allocations_per_packet\": ");
+#ifdef COUNT_ALLOCATIONS
+	printf("%.2f}\n", ((double) allocations) / iterations);
+#else
+	printf("null}\n");
+#endif
+
+	talloc_free(packets);
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: codec_bench [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Run each operation num times (defaults to 100000).\n");
+	fprintf(stderr, "  -d <raddb>             Set user dictionary directory (defaults to " RADDBDIR ").\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -f <file>              Load packets from file.  Each line is the protocol\n");
+	fprintf(stderr, "                         (radius, dhcp or tacacs) followed by the packet in hex.\n");
+	fprintf(stderr, "  -n                     Don't load the built-in packets.\n");
+	fprintf(stderr, "  -p <protocol>          Only benchmark this protocol.\n");
+#ifdef HAVE_LIBPCAP
+	fprintf(stderr, "  -r <file>              Load RADIUS and DHCP packets from a pcap file.\n");
+#endif
+	fprintf(stderr, "  -s <secret>            Shared secret of the packets (defaults to testing123).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, i, j;
+	uint64_t	iterations = 100000;
+	bool		builtin = true;
+	int		only = -1;
+	char const	*radius_dir = RADDBDIR;
+	char const	*dict_dir = DICTDIR;
+	char const	**files;
+#ifdef HAVE_LIBPCAP
+	char const	**pcaps;
+#endif
+	int		num_files = 0, num_pcaps = 0;
+	bool		have_proto[BENCH_PROTO_MAX] = { [BENCH_RADIUS] = true };
+	fr_dict_t	*dict = NULL;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	files = talloc_zero_array(autofree, char const *, argc);
+#ifdef HAVE_LIBPCAP
+	pcaps = talloc_zero_array(autofree, char const *, argc);
+#endif
+	secret = talloc_strdup(autofree, "testing123");
+
+	while ((c = getopt(argc, argv, "c:d:D:f:hnp:r:s:x")) != EOF) switch (c) {
+		case 'c':
+			iterations = strtoull(optarg, NULL, 10);
+			if (!iterations) usage();
+			break;
+
+		case 'd':
+			radius_dir = optarg;
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'f':
+			files[num_files++] = optarg;
+			break;
+
+		case 'n':
+			builtin = false;
+			break;
+
+		case 'p':
+			for (only = 0; only < BENCH_PROTO_MAX; only++) {
+				if (strcmp(optarg, proto_names[only]) == 0) break;
+			}
+			if (only == BENCH_PROTO_MAX) usage();
+			break;
+
+#ifdef HAVE_LIBPCAP
+		case 'r':
+			pcaps[num_pcaps++] = optarg;
+			break;
+#endif
+
+		case 's':
+			talloc_free(secret);
+			secret = talloc_strdup(autofree, optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!builtin && !num_files && !num_pcaps) {
+		fprintf(stderr, "codec_bench: No packets to benchmark\n");
+		exit(1);
+	}
+
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("codec_bench");
+		exit(1);
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("codec_bench");
+		exit(1);
+	}
+
+	if (fr_dict_read(dict, radius_dir, FR_DICTIONARY_FILE) == -1) {
+		fr_perror("codec_bench");
+		exit(1);
+	}
+
+	/*
+	 *	Protocols whose dictionaries are missing are skipped.
+	 */
+	if (dhcp_init() < 0) {
+		MPRINT1("Not benchmarking DHCP: %s\n", fr_strerror());
+	} else {
+		have_proto[BENCH_DHCP] = true;
+	}
+
+#ifdef WITH_TACACS
+	dict_tacacs_root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), PW_TACACS_ROOT);
+	if (!dict_tacacs_root) {
+		MPRINT1("Not benchmarking TACACS: Missing TACACS-Root attribute\n");
+	} else {
+		have_proto[BENCH_TACACS] = true;
+	}
+#endif
+
+	if (builtin) {
+		for (i = 0; radius_builtin[i]; i++) corpus_add_hex(autofree, BENCH_RADIUS, radius_builtin[i]);
+		if (have_proto[BENCH_DHCP]) dhcp_builtin_add(autofree);
+		if (have_proto[BENCH_TACACS]) {
+			for (i = 0; tacacs_builtin[i]; i++) corpus_add_hex(autofree, BENCH_TACACS, tacacs_builtin[i]);
+		}
+	}
+
+	for (i = 0; i < num_files; i++) corpus_load_file(autofree, files[i]);
+#ifdef HAVE_LIBPCAP
+	for (i = 0; i < num_pcaps; i++) corpus_load_pcap(autofree, pcaps[i]);
+#endif
+
+	if (!corpus_len) {
+		fprintf(stderr, "codec_bench: None of the packets could be decoded\n");
+		exit(1);
+	}
+
+	for (i = 0; i < BENCH_PROTO_MAX; i++) {
+		if (!have_proto[i] || ((only >= 0) && (i != only))) continue;
+
+		for (j = 0; j < BENCH_OP_MAX; j++) bench_run(i, j, iterations);
+	}
+
+	talloc_free(autofree);
+	talloc_free(dict);
+
+	return 0;
+}
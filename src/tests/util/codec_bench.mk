@@ -0,0 +1,6 @@
+TARGET := codec_bench
+
+SOURCES		:= codec_bench.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-dhcp.a libfreeradius-tacacs.a
+TGT_LDLIBS	:= $(LIBS)
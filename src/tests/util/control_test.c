@@ -26,7 +26,6 @@ RCSID("$Id$")
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/rad_assert.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -84,12 +83,17 @@ static void *control_master(UNUSED void *arg)
 	wait_for_events:
 		MPRINT1("Master waiting for events.\n");
 
-		num_events = kevent(kq, NULL, 0, &kev, 1, NULL);
+		num_events = fr_event_kq_wait(kq, &kev, 1, NULL);
 		if (num_events < 0) {
 			fprintf(stderr, "Failed reading kevent: %s\n", strerror(errno));
 			exit(1);
 		}
 
+		/*
+		 *	Tell the senders to signal us again.
+		 */
+		(void) fr_control_message_service_kevent(control, &kev);
+
 		MPRINT1("Master draining the control plane.\n");
 
 		while (true) {
@@ -185,7 +189,7 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq = kqueue();
+	kq = fr_event_kq_create();
 	rad_assert(kq >= 0);
 
 	aq = fr_atomic_queue_create(autofree, aq_size);
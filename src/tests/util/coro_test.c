@@ -0,0 +1,201 @@
+/*
+ * coro_test.c	Tests for coroutines
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/coro.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define NUM_YIELDS	(5)
+
+static int		debug_lvl = 0;
+
+typedef struct coro_test_t {
+	int		count;		//!< how many times we've run
+	int		rcode;		//!< what fr_coro_yield() last returned
+} coro_test_t;
+
+/*
+ *	Recurse a bit before yielding, so that the yield happens from
+ *	deep inside of the coroutine stack.
+ */
+static int coro_test_wait(coro_test_t *t, int depth)
+{
+	char buffer[256];
+
+	memset(buffer, depth, sizeof(buffer));
+
+	if (depth > 0) return coro_test_wait(t, depth - 1) + (buffer[0] - depth);
+
+	t->rcode = fr_coro_yield();
+
+	return t->rcode;
+}
+
+static int coro_test_run(void *ctx)
+{
+	coro_test_t *t = ctx;
+
+	while (t->count < NUM_YIELDS) {
+		t->count++;
+
+		if (coro_test_wait(t, 8) < 0) return -1;
+	}
+
+	return 42;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: coro_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, rcode;
+	fr_coro_pool_t *pool;
+	fr_coro_t *coro, *other;
+	coro_test_t t, u;
+
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	pool = fr_coro_pool_create(autofree, 64 * 1024, 1);
+	if (!pool) {
+#ifndef HAVE_UCONTEXT_H
+		if (debug_lvl) printf("Coroutines are not supported\n");
+		talloc_free(autofree);
+		return 0;
+#else
+		fprintf(stderr, "Failed creating coroutine pool\n");
+		exit(1);
+#endif
+	}
+
+	if (fr_coro_yield() >= 0) {
+		fprintf(stderr, "Yielded when not in a coroutine\n");
+		exit(1);
+	}
+
+	/*
+	 *	Run two coroutines, interleaved.
+	 */
+	memset(&t, 0, sizeof(t));
+	memset(&u, 0, sizeof(u));
+
+	coro = fr_coro_alloc(pool);
+	other = fr_coro_alloc(pool);
+	if (!coro || !other) {
+		fprintf(stderr, "Failed allocating coroutines\n");
+		exit(1);
+	}
+
+	if ((fr_coro_start(coro, coro_test_run, &t) != 1) ||
+	    (fr_coro_start(other, coro_test_run, &u) != 1)) {
+		fprintf(stderr, "Coroutines did not yield\n");
+		exit(1);
+	}
+
+	if (fr_coro_current() != NULL) {
+		fprintf(stderr, "Still in a coroutine after it yielded\n");
+		exit(1);
+	}
+
+	for (i = 1; i < NUM_YIELDS; i++) {
+		if ((t.count != i) || (u.count != i)) {
+			fprintf(stderr, "Expected count %d, got %d and %d\n", i, t.count, u.count);
+			exit(1);
+		}
+
+		if ((fr_coro_resume(coro, false) != 1) || (fr_coro_resume(other, false) != 1)) {
+			fprintf(stderr, "Coroutines did not yield on pass %d\n", i);
+			exit(1);
+		}
+	}
+
+	rcode = fr_coro_resume(coro, false);
+	if ((rcode != 0) || (fr_coro_result(coro) != 42) || (t.count != NUM_YIELDS)) {
+		fprintf(stderr, "Coroutine did not finish (resume %d, result %d)\n", rcode, fr_coro_result(coro));
+		exit(1);
+	}
+
+	/*
+	 *	Cancelling a coroutine makes fr_coro_yield() fail.
+	 */
+	rcode = fr_coro_resume(other, true);
+	if ((rcode != 0) || (fr_coro_result(other) != -1) || (u.rcode != -1)) {
+		fprintf(stderr, "Cancelled coroutine did not finish (resume %d, result %d)\n",
+			rcode, fr_coro_result(other));
+		exit(1);
+	}
+
+	fr_coro_release(coro);
+	fr_coro_release(other);
+
+	/*
+	 *	The pool keeps one idle coroutine, and re-uses it.
+	 */
+	for (i = 0; i < 1000; i++) {
+		memset(&t, 0, sizeof(t));
+
+		coro = fr_coro_alloc(pool);
+		if (!coro) {
+			fprintf(stderr, "Failed allocating coroutine %d\n", i);
+			exit(1);
+		}
+
+		rcode = fr_coro_start(coro, coro_test_run, &t);
+		while (rcode == 1) rcode = fr_coro_resume(coro, false);
+
+		if ((rcode != 0) || (fr_coro_result(coro) != 42)) {
+			fprintf(stderr, "Re-used coroutine %d failed\n", i);
+			exit(1);
+		}
+
+		fr_coro_release(coro);
+	}
+
+	if (debug_lvl) {
+		fr_coro_pool_debug(pool, stdout);
+		printf("All tests passed\n");
+	}
+
+	talloc_free(autofree);
+
+	return 0;
+}
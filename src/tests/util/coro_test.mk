@@ -0,0 +1,6 @@
+TARGET := coro_test
+
+SOURCES		:= coro_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,216 @@
+/*
+ * hash_test.c	Tests for deleting entries during a hash table walk
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/hash.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define NUM_ENTRIES	(4096)
+
+static int		debug_lvl = 0;
+
+#define MPRINT1 if (debug_lvl) printf
+
+typedef struct {
+	uint32_t	key;
+	int		visited;	//!< How many times the walk passed us to the callback.
+	bool		deleted;	//!< Removed from the table.
+} hash_test_entry_t;
+
+typedef struct {
+	fr_hash_table_t		*ht;
+	hash_test_entry_t	*entries;
+	uint32_t		num_entries;
+	char const		*mode;		//!< What the callback deletes.
+} hash_test_ctx_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: hash_test [OPTS]\n");
+	fprintf(stderr, "  -n <num>               Insert num entries (defaults to 4096).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	Keys are mixed by fr_hash(), so small integers still
+ *	end up with all the collisions and chains we need.
+ */
+static uint32_t entry_hash(void const *data)
+{
+	hash_test_entry_t const *e = data;
+
+	return fr_hash(&e->key, sizeof(e->key));
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	hash_test_entry_t const *a = one, *b = two;
+
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static void entry_delete(hash_test_ctx_t *ctx, hash_test_entry_t *e)
+{
+	if (e->deleted) return;
+
+	if (!fr_hash_table_delete(ctx->ht, e)) {
+		fprintf(stderr, "%s: failed deleting entry %u\n", ctx->mode, e->key);
+		exit(1);
+	}
+	e->deleted = true;
+}
+
+/*
+ *	Delete the current entry, its neighbour, or some other
+ *	entry which may or may not have been visited yet.
+ */
+static int walk_delete(void *uctx, void *data)
+{
+	hash_test_ctx_t		*ctx = uctx;
+	hash_test_entry_t	*e = data;
+
+	if (e->deleted) {
+		fprintf(stderr, "%s: walk visited deleted entry %u\n", ctx->mode, e->key);
+		exit(1);
+	}
+	e->visited++;
+
+	if (strcmp(ctx->mode, "current") == 0) {
+		entry_delete(ctx, e);
+
+	} else if (strcmp(ctx->mode, "other") == 0) {
+		entry_delete(ctx, &ctx->entries[e->key ^ 1]);
+
+	} else if (strcmp(ctx->mode, "random") == 0) {
+		if ((random() & 0x01) != 0) entry_delete(ctx, &ctx->entries[random() % ctx->num_entries]);
+	}
+
+	return 0;
+}
+
+static void check_walk(hash_test_entry_t *entries, uint32_t num_entries, char const *mode)
+{
+	hash_test_ctx_t	ctx;
+	uint32_t	i, num_deleted = 0, num_visited = 0;
+
+	memset(entries, 0, sizeof(*entries) * num_entries);
+
+	ctx.ht = fr_hash_table_create(NULL, entry_hash, entry_cmp, NULL);
+	if (!ctx.ht) {
+		fprintf(stderr, "Failed creating hash table\n");
+		exit(1);
+	}
+	ctx.entries = entries;
+	ctx.num_entries = num_entries;
+	ctx.mode = mode;
+
+	for (i = 0; i < num_entries; i++) {
+		entries[i].key = i;
+		if (!fr_hash_table_insert(ctx.ht, &entries[i])) {
+			fprintf(stderr, "%s: failed inserting entry %u\n", mode, i);
+			exit(1);
+		}
+	}
+
+	(void) fr_hash_table_walk(ctx.ht, walk_delete, &ctx);
+
+	/*
+	 *	Every entry is visited at most once.  Entries still in
+	 *	the table must have been visited, and the only ones
+	 *	which can be missed are those deleted before the walk
+	 *	got to them.
+	 */
+	for (i = 0; i < num_entries; i++) {
+		if (entries[i].visited > 1) {
+			fprintf(stderr, "%s: entry %u visited %d times\n", mode, i, entries[i].visited);
+			exit(1);
+		}
+
+		if (entries[i].deleted) {
+			num_deleted++;
+		} else if (!entries[i].visited) {
+			fprintf(stderr, "%s: entry %u was never visited\n", mode, i);
+			exit(1);
+		}
+
+		if (entries[i].visited) num_visited++;
+	}
+
+	if (fr_hash_table_num_elements(ctx.ht) != (int) (num_entries - num_deleted)) {
+		fprintf(stderr, "%s: table has %d entries, expected %u\n",
+			mode, fr_hash_table_num_elements(ctx.ht), num_entries - num_deleted);
+		exit(1);
+	}
+
+	MPRINT1("%s: visited %u, deleted %u of %u entries\n", mode, num_visited, num_deleted, num_entries);
+
+	fr_hash_table_free(ctx.ht);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	uint32_t		num_entries = NUM_ENTRIES;
+	hash_test_entry_t	*entries;
+
+	while ((c = getopt(argc, argv, "n:hx")) != EOF) switch (c) {
+		case 'n':
+			num_entries = strtoul(optarg, NULL, 10);
+			if ((num_entries < 2) || (num_entries & 0x01)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	entries = talloc_array(NULL, hash_test_entry_t, num_entries);
+	if (!entries) {
+		fprintf(stderr, "Failed allocating entries\n");
+		exit(1);
+	}
+
+	srandom(1);
+
+	check_walk(entries, num_entries, "none");
+	check_walk(entries, num_entries, "current");
+	check_walk(entries, num_entries, "other");
+	check_walk(entries, num_entries, "random");
+
+	talloc_free(entries);
+
+	return 0;
+}
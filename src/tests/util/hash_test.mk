@@ -0,0 +1,6 @@
+TARGET := hash_test
+
+SOURCES		:= hash_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
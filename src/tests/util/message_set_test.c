@@ -395,6 +395,72 @@ int main(int argc, char *argv[])
 	rcode = fr_message_set_messages_used(ms);
 	rad_assert(rcode == 0);
 
+	/*
+	 *	A capped message set refuses to grow past the cap,
+	 *	and says so before allocations start failing.
+	 */
+	{
+		fr_message_set_t *capped;
+		fr_message_set_memory_t mem;
+		bool pressure = false;
+		int num;
+
+		capped = fr_message_set_create(autofree, ARRAY_SIZE, sizeof(fr_message_t), ARRAY_SIZE * 1024);
+		if (!capped) {
+			fprintf(stderr, "Failed creating capped message set\n");
+			exit(1);
+		}
+
+		fr_message_set_memory(capped, &mem);
+		fr_message_set_memory_max(capped, mem.size * 4);
+
+		for (num = 0; num < MY_ARRAY_SIZE; num++) {
+			fr_message_t *m;
+
+			if (fr_message_set_pressure(capped)) pressure = true;
+
+			m = fr_message_reserve(capped, 1024);
+			if (!m) break;
+
+			messages[num] = (fr_test_t *) fr_message_alloc(capped, m, 1000);
+		}
+
+		fr_message_set_memory(capped, &mem);
+		MPRINT1("CAPPED allocated %d, size %zd, used %zd, max %zd\n", num, mem.size, mem.used, mem.max);
+
+		if (num == MY_ARRAY_SIZE) {
+			fprintf(stderr, "Capped message set did not stop growing\n");
+			exit(1);
+		}
+
+		if (!pressure || !fr_message_set_pressure(capped)) {
+			fprintf(stderr, "Capped message set did not signal memory pressure\n");
+			exit(1);
+		}
+
+		if (mem.size > mem.max) {
+			fprintf(stderr, "Capped message set grew past the cap (%zd > %zd)\n", mem.size, mem.max);
+			exit(1);
+		}
+
+		for (i = 0; i < num; i++) {
+			fr_message_done(&messages[i]->m);
+			messages[i] = NULL;
+		}
+
+		if (fr_message_set_pressure(capped)) {
+			fprintf(stderr, "Capped message set is still under pressure after messages are done\n");
+			exit(1);
+		}
+
+		fr_message_set_gc(capped);
+		fr_message_set_memory(capped, &mem);
+		if (mem.used != 0) {
+			fprintf(stderr, "Capped message set still has %zd bytes used\n", mem.used);
+			exit(1);
+		}
+	}
+
 	talloc_free(autofree);
 
 	return rcode;
@@ -37,8 +37,6 @@ RCSID("$Id$")
 #include <pthread.h>
 #include <signal.h>
 
-#include <sys/event.h>
-
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
 #define MAX_KEVENTS		(10)
@@ -228,7 +226,7 @@ static void master_process(TALLOC_CTX *ctx)
 	/*
 	 *	Create the KQ and associated sockets.
 	 */
-	kq_master = kqueue();
+	kq_master = fr_event_kq_create();
 	rad_assert(kq_master >= 0);
 
 	aq_master = fr_atomic_queue_create(ctx, max_control_plane);
@@ -251,8 +249,7 @@ static void master_process(TALLOC_CTX *ctx)
 	/*
 	 *	Set up the KQ filter for reading.
 	 */
-	EV_SET(&events[0], sockfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_master, events, 1, NULL, 0, NULL) < 0) {
+	if (fr_event_kq_fd_add(kq_master, sockfd, EVFILT_READ) < 0) {
 		fprintf(stderr, "Failed setting KQ for EVFILT_READ: %s\n", fr_strerror());
 		exit(1);
 	}
@@ -311,7 +308,7 @@ static void master_process(TALLOC_CTX *ctx)
 
 		MPRINT1("Master waiting on events.\n");
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
+		num_events = fr_event_kq_wait(kq_master, events, MAX_KEVENTS, NULL);
 		MPRINT1("Master kevent returned %d\n", num_events);
 
 		if (num_events < 0) {
@@ -28,7 +28,6 @@ RCSID("$Id$")
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/rad_assert.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -111,6 +110,26 @@ static fr_transport_final_t test_process(REQUEST *request, fr_transport_action_t
 	return FR_TRANSPORT_REPLY;
 }
 
+static fr_channel_class_t test_classify(UNUSED void const *packet_ctx, uint8_t const *data, size_t data_len)
+{
+	if (data_len < 20) return FR_CHANNEL_CLASS_AUTH;
+
+	switch (data[0]) {
+	case PW_CODE_ACCOUNTING_REQUEST:
+		return FR_CHANNEL_CLASS_ACCT;
+
+	case PW_CODE_COA_REQUEST:
+	case PW_CODE_DISCONNECT_REQUEST:
+		return FR_CHANNEL_CLASS_COA;
+
+	case PW_CODE_STATUS_SERVER:
+		return FR_CHANNEL_CLASS_STATUS;
+
+	default:
+		return FR_CHANNEL_CLASS_AUTH;
+	}
+}
+
 static fr_transport_t transport = {
 	.name = "schedule-test",
 	.id = 1,
@@ -118,6 +137,7 @@ static fr_transport_t transport = {
 	.encode = test_encode,
 	.nak = test_nak,
 	.process = test_process,
+	.classify = test_classify,
 };
 
 static fr_transport_t *transports = &transport;
@@ -125,9 +145,12 @@ static fr_transport_t *transports = &transport;
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: schedule_test [OPTS]\n");
+	fprintf(stderr, "  -m <num>               Start with num worker threads, and spawn more as needed\n");
 	fprintf(stderr, "  -n <num>               Start num network threads\n");
+	fprintf(stderr, "  -N <cpus>              Pin network threads to a CPU set, e.g. 0-3,8.\n");
 	fprintf(stderr, "  -i <address>[:port]    Set IP address and optional port.\n");
 	fprintf(stderr, "  -s <secret>            Set shared secret.\n");
+	fprintf(stderr, "  -W <cpus>              Pin worker threads to a CPU set.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
 	exit(1);
@@ -138,6 +161,8 @@ int main(int argc, char *argv[])
 	int c;
 	int num_networks = 1;
 	int num_workers = 2;
+	int min_workers = 0;
+	char const *worker_cpus = NULL, *receiver_cpus = NULL;
 	uint16_t	port16 = 0;
 	int sockfd;
 	TALLOC_CTX	*autofree = talloc_init("main");
@@ -152,7 +177,7 @@ int main(int argc, char *argv[])
 	my_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
 	my_port = 1812;
 
-	while ((c = getopt(argc, argv, "i:n:s:w:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "i:m:n:N:s:w:W:x")) != EOF) switch (c) {
 		case 'i':
 			if (fr_inet_pton_port(&my_ipaddr, &port16, optarg, -1, AF_INET, true, false) < 0) {
 				fprintf(stderr, "Failed parsing ipaddr: %s\n", fr_strerror());
@@ -161,6 +186,11 @@ int main(int argc, char *argv[])
 			my_port = port16;
 			break;
 
+		case 'm':
+			min_workers = atoi(optarg);
+			if ((min_workers < 0) || (min_workers > 1024)) usage();
+			break;
+
 		case 'n':
 			num_networks = atoi(optarg);
 			if ((num_networks <= 0) || (num_networks > 16)) usage();
@@ -175,6 +205,14 @@ int main(int argc, char *argv[])
 			if ((num_workers <= 0) || (num_workers > 1024)) usage();
 			break;
 
+		case 'N':
+			receiver_cpus = optarg;
+			break;
+
+		case 'W':
+			worker_cpus = optarg;
+			break;
+
 		case 'x':
 			debug_lvl++;
 			fr_debug_lvl++;
@@ -190,7 +228,8 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, 1, &transports, NULL, NULL);
+	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, min_workers, 1, &transports, NULL, NULL,
+				   worker_cpus, receiver_cpus);
 	if (!sched) {
 		fprintf(stderr, "schedule_test: Failed to create scheduler\n");
 		exit(1);
@@ -202,6 +241,21 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+#ifdef SO_REUSEPORT
+	/*
+	 *	Allow the scheduler to shard the socket across
+	 *	multiple network threads.
+	 */
+	if (num_networks > 1) {
+		int on = 1;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			fprintf(stderr, "radius_test: Failed setting SO_REUSEPORT: %s\n", fr_syserror(errno));
+			exit(1);
+		}
+	}
+#endif
+
 	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
 		fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
 		exit(1);
@@ -211,8 +265,7 @@ int main(int argc, char *argv[])
 	/*
 	 *	Set up the KQ filter for reading.
 	 */
-	EV_SET(&events[0], sockfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_master, events, 1, NULL, 0, NULL) < 0) {
+	if (fr_event_kq_fd_add(kq_master, sockfd, EVFILT_READ) < 0) {
 		fprintf(stderr, "Failed setting KQ for EVFILT_READ: %s\n", fr_strerror());
 		exit(1);
 	}
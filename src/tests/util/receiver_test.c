@@ -0,0 +1,188 @@
+/*
+ * receiver_test.c	Tests for the receiver's ordering of workers
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+/*
+ *	The worker heap and the functions which re-order it are
+ *	private to the receiver, so we include the source.
+ */
+#include "../../util/receiver.c"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define NUM_WORKERS	(8)
+
+static int		debug_lvl = 0;
+
+#define MPRINT1 if (debug_lvl) printf
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: receiver_test [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Dispatch num requests (defaults to 100000).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/** Check that the head of a heap is the least loaded of its workers
+ *
+ */
+static void check_heap(fr_heap_t *heap, fr_receiver_worker_t *workers, bool closing, size_t expected, uint64_t n)
+{
+	fr_receiver_worker_t	*head;
+	int			i;
+
+	if (fr_heap_num_elements(heap) != expected) {
+		fprintf(stderr, "Request %" PRIu64 ": heap has %zu workers, expected %zu\n",
+			n, fr_heap_num_elements(heap), expected);
+		exit(1);
+	}
+
+	head = fr_heap_peek(heap);
+	if (!head) return;
+
+	for (i = 0; i < NUM_WORKERS; i++) {
+		if (workers[i].closing != closing) continue;
+
+		if (worker_cmp(&workers[i], head) < 0) {
+			fprintf(stderr, "Request %" PRIu64 ": worker %d has backlog %" PRIu64
+				", but the heap prefers worker %d with backlog %" PRIu64 "\n",
+				n, i, workers[i].predicted, (int) (head - workers), head->predicted);
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i, num_closing = 0;
+	uint64_t		n, iterations = 100000;
+	fr_receiver_t		*rc;
+	fr_receiver_worker_t	workers[NUM_WORKERS], *w;
+	fr_channel_data_t	cd;
+
+	TALLOC_CTX		*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "c:hx")) != EOF) switch (c) {
+		case 'c':
+			iterations = strtoull(optarg, NULL, 10);
+			if (!iterations) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	rc = talloc_zero(autofree, fr_receiver_t);
+	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
+	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
+	if (!rc->workers || !rc->closing) {
+		fprintf(stderr, "Failed creating heaps\n");
+		exit(1);
+	}
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < NUM_WORKERS; i++) {
+		workers[i].processing_time = PROCESSING_TIME_INITIAL;
+		(void) fr_heap_insert(rc->workers, &workers[i]);
+	}
+
+	srandom(1);
+
+	for (n = 0; n < iterations; n++) {
+		/*
+		 *	Dispatch the way fr_receiver_send_request() does.
+		 */
+		w = fr_heap_pop(rc->workers);
+		if (!w) {
+			fprintf(stderr, "Request %" PRIu64 ": no workers in the heap\n", n);
+			exit(1);
+		}
+		for (i = 0; i < NUM_WORKERS; i++) {
+			if (workers[i].closing || (&workers[i] == w)) continue;
+
+			if (worker_cmp(&workers[i], w) < 0) {
+				fprintf(stderr, "Request %" PRIu64 ": dispatched to worker %d, but worker %d "
+					"is less loaded\n", n, (int) (w - workers), i);
+				exit(1);
+			}
+		}
+
+		w->num_outstanding++;
+		w->predicted = w->num_outstanding * w->processing_time;
+		(void) fr_heap_insert(rc->workers, w);
+
+		/*
+		 *	Replies arrive from random workers, with
+		 *	processing times which change, so the worker
+		 *	has to be moved somewhere else in the heap.
+		 */
+		while ((random() & 0x03) != 0) {
+			w = &workers[random() % NUM_WORKERS];
+			if (!w->num_outstanding) break;
+
+			memset(&cd, 0, sizeof(cd));
+			cd.reply.processing_time = PROCESSING_TIME_INITIAL / 2 + (random() % PROCESSING_TIME_INITIAL);
+			cd.reply.cpu_time = w->cpu_time + cd.reply.processing_time;
+
+			fr_receiver_worker_update(rc, w, &cd);
+		}
+
+		check_heap(rc->workers, workers, false, NUM_WORKERS - num_closing, n);
+		check_heap(rc->closing, workers, true, num_closing, n);
+
+		/*
+		 *	Half way through, start closing a couple of
+		 *	workers.  Their replies re-order the closing
+		 *	heap instead.
+		 */
+		if ((n == (iterations / 2)) && (num_closing == 0)) {
+			for (i = 0; i < 2; i++) {
+				w = &workers[i];
+				(void) fr_heap_extract(rc->workers, w);
+				w->closing = true;
+				(void) fr_heap_insert(rc->closing, w);
+				num_closing++;
+			}
+			MPRINT1("Closing workers 0 and 1 after %" PRIu64 " requests\n", n);
+		}
+	}
+
+	for (i = 0; i < NUM_WORKERS; i++) {
+		MPRINT1("Worker %d outstanding %" PRIu64 " backlog %" PRIu64 "\n",
+			i, workers[i].num_outstanding, workers[i].predicted);
+	}
+
+	talloc_free(autofree);
+
+	return 0;
+}
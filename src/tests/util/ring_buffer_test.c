@@ -108,6 +108,7 @@ static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: ring_buffer_test [OPTS]\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
+	fprintf(stderr, "  -m                     Use an mmap'd ring buffer, with huge pages if possible.\n");
 	fprintf(stderr, "  -s <string>            Set random seed to <string>.\n");
 
 	exit(1);
@@ -120,10 +121,15 @@ int main(int argc, char *argv[])
 	int i, start, end;
 	fr_ring_buffer_t *rb;
 	uint32_t	seed;
+	bool		use_mmap = false;
 
 	TALLOC_CTX	*autofree = talloc_init("main");
 
-	while ((c = getopt(argc, argv, "hs:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "hms:x")) != EOF) switch (c) {
+		case 'm':
+			use_mmap = true;
+			break;
+
 		case 's':
 			seed_string = optarg;
 			seed_string_len = strlen(optarg);
@@ -142,7 +148,12 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	rb = fr_ring_buffer_create(autofree, ARRAY_SIZE * 1024);
+	if (use_mmap) {
+		rb = fr_ring_buffer_create_mmap(autofree, ARRAY_SIZE * 1024,
+						FR_RING_BUFFER_HUGE_PAGES | FR_RING_BUFFER_POPULATE);
+	} else {
+		rb = fr_ring_buffer_create(autofree, ARRAY_SIZE * 1024);
+	}
 	if (!rb) {
 		fprintf(stderr, "Failed creating ring buffer\n");
 		exit(1);
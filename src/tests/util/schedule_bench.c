@@ -0,0 +1,563 @@
+/*
+ * schedule_bench.c	Throughput and latency benchmark for the scheduler
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+/*
+ *	A synthetic transport is driven through fr_schedule_t, over a
+ *	loopback UDP socket.  The main thread is the client.  It sends
+ *	packets in bursts, keeps a window of packets outstanding, and
+ *	measures the round trip time of each reply.
+ *
+ *	The results are printed as one JSON object, so that runs can
+ *	be compared by scripts.
+ */
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/util/schedule.h>
+#include <freeradius-devel/inet.h>
+#include <freeradius-devel/radius.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <poll.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+/*
+ *	Offset of the sequence number in the packets.  It's where the
+ *	RADIUS authentication vector would be.
+ */
+#define SEQ_OFFSET	(4)
+#define REPLY_SIZE	(20)
+
+/*
+ *	Stop waiting for replies if none arrive for this long.
+ */
+#define REPLY_TIMEOUT	(1000)
+
+static int		debug_lvl = 0;
+static int		yield_percent = 0;
+static int		yield_usec = 100;
+
+/*
+ *	@todo fix this...
+ *
+ *	Declare these here until we move all of the new field to the REQUEST.
+ */
+extern int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
+extern int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/*
+ *	Count allocations, so that we can report allocations per
+ *	packet.  The program's allocator calls go through here, and on
+ *	to glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_uint_fast64_t num_allocations;
+
+#define COUNT_ALLOCATIONS (1)
+
+void *malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+/*
+ *	The request number holds the sequence number of the packet,
+ *	shifted up by one.  The low bit says the request has already
+ *	yielded once.
+ */
+#define REQUEST_SEQ(_request)		((_request)->number >> 1)
+#define REQUEST_YIELDED(_request)	((_request)->number & 0x01)
+
+/*
+ *	Pending resumption of a yielded request.  It's parented by the
+ *	request, so that the timer is deleted if the request is freed
+ *	before it fires.
+ */
+typedef struct bench_yield_t {
+	REQUEST			*request;
+	fr_event_list_t		*el;
+	fr_event_timer_t	*ev;
+} bench_yield_t;
+
+static int _bench_yield_free(bench_yield_t *y)
+{
+	if (y->ev) (void) fr_event_timer_delete(y->el, &y->ev);
+
+	return 0;
+}
+
+static void bench_resume(UNUSED struct timeval *now, void *ctx)
+{
+	bench_yield_t *y = ctx;
+	REQUEST *request = y->request;
+
+	y->ev = NULL;
+	talloc_free(y);
+
+	MPRINT1("\t\tRESUME --- request %" PRIu64 "\n", REQUEST_SEQ(request));
+
+	(void) fr_heap_insert(request->runnable, request);
+}
+
+static int bench_decode(UNUSED void const *packet_ctx, uint8_t *const data, size_t data_len, REQUEST *request)
+{
+	uint64_t seq;
+
+	if (data_len < (SEQ_OFFSET + sizeof(seq))) return -1;
+
+	memcpy(&seq, data + SEQ_OFFSET, sizeof(seq));
+	request->number = seq << 1;
+
+	return 0;
+}
+
+static ssize_t bench_encode(UNUSED void const *packet_ctx, REQUEST *request, uint8_t *buffer, size_t buffer_len)
+{
+	uint64_t seq = REQUEST_SEQ(request);
+
+	if (buffer_len < REPLY_SIZE) return -1;
+
+	memset(buffer, 0, REPLY_SIZE);
+	buffer[0] = PW_CODE_ACCESS_ACCEPT;
+	buffer[1] = seq & 0xff;
+	buffer[3] = REPLY_SIZE;
+	memcpy(buffer + SEQ_OFFSET, &seq, sizeof(seq));
+
+	return REPLY_SIZE;
+}
+
+static size_t bench_nak(UNUSED void const *packet_ctx, uint8_t *const packet, size_t packet_len,
+			UNUSED uint8_t *reply, UNUSED size_t reply_len)
+{
+	MPRINT1("\t\tNAK !!! request %d size %zd\n", packet[1], packet_len);
+
+	return 10;
+}
+
+static fr_transport_final_t bench_process(REQUEST *request, fr_transport_action_t action)
+{
+	bench_yield_t *y;
+	struct timeval when;
+
+	if (action == FR_TRANSPORT_ACTION_DONE) return FR_TRANSPORT_DONE;
+
+	/*
+	 *	Pick which requests yield with a cheap hash of the
+	 *	sequence number, so that runs are repeatable.
+	 */
+	if (!yield_percent || REQUEST_YIELDED(request) ||
+	    (((REQUEST_SEQ(request) * 2654435761U) % 100) >= (uint64_t) yield_percent)) {
+		return FR_TRANSPORT_REPLY;
+	}
+
+	request->number |= 0x01;
+
+	y = talloc_zero(request, bench_yield_t);
+	if (!y) return FR_TRANSPORT_REPLY;
+
+	y->request = request;
+	y->el = request->el;
+
+	gettimeofday(&when, NULL);
+	when.tv_usec += yield_usec;
+	when.tv_sec += when.tv_usec / USEC;
+	when.tv_usec %= USEC;
+
+	if (fr_event_timer_insert(request->el, bench_resume, y, &when, &y->ev) < 0) {
+		talloc_free(y);
+		return FR_TRANSPORT_REPLY;
+	}
+	talloc_set_destructor(y, _bench_yield_free);
+
+	return FR_TRANSPORT_YIELD;
+}
+
+static fr_transport_t transport = {
+	.name = "schedule-bench",
+	.id = 1,
+	.decode = bench_decode,
+	.encode = bench_encode,
+	.nak = bench_nak,
+	.process = bench_process,
+};
+
+static fr_transport_t *transports = &transport;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: schedule_bench [OPTS]\n");
+	fprintf(stderr, "  -b <num>               Send packets in bursts of num.\n");
+	fprintf(stderr, "  -c <num>               Send num packets in total.\n");
+	fprintf(stderr, "  -i <usec>              Wait usec between bursts.  0 sends as fast as the window allows.\n");
+	fprintf(stderr, "  -m <num>               Start with num worker threads, and spawn more as needed\n");
+	fprintf(stderr, "  -n <num>               Start num network threads\n");
+	fprintf(stderr, "  -N <cpus>              Pin network threads to a CPU set, e.g. 0-3,8.\n");
+	fprintf(stderr, "  -o <num>               Keep at most num packets outstanding.\n");
+	fprintf(stderr, "  -s <size>              Size of the request packets.\n");
+	fprintf(stderr, "  -w <num>               Start num worker threads\n");
+	fprintf(stderr, "  -W <cpus>              Pin worker threads to a CPU set.\n");
+	fprintf(stderr, "  -y <percent>           Percentage of requests which yield once.\n");
+	fprintf(stderr, "  -Y <usec>              How long yielded requests wait before being resumed.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int num_networks = 1;
+	int num_workers = 2;
+	int min_workers = 0;
+	char const *worker_cpus = NULL, *receiver_cpus = NULL;
+	int burst = 32;
+	int burst_usec = 0;
+	int max_outstanding = 256;
+	int packet_size = 64;
+	uint64_t num_packets = 100000;
+	uint64_t num_sent = 0, num_replies = 0, num_outstanding = 0, num_bad = 0;
+	int port = 0;
+	int sockfd, client;
+	uint8_t *packet, reply[4096];
+	fr_time_t *sent_time;
+	fr_time_t start, now, next_burst, last_reply, elapsed;
+	fr_ipaddr_t ipaddr;
+	struct sockaddr_storage server;
+	socklen_t server_len;
+	fr_time_histogram_t *latency;
+	TALLOC_CTX	*autofree = talloc_init("main");
+	fr_schedule_t	*sched;
+#ifdef COUNT_ALLOCATIONS
+	uint64_t allocations;
+#endif
+
+	fr_time_start();
+
+	fr_log_init(&default_log, false);
+
+	while ((c = getopt(argc, argv, "b:c:hi:m:n:N:o:s:w:W:xy:Y:")) != EOF) switch (c) {
+		case 'b':
+			burst = atoi(optarg);
+			if (burst <= 0) usage();
+			break;
+
+		case 'c':
+			num_packets = strtoull(optarg, NULL, 10);
+			if (!num_packets) usage();
+			break;
+
+		case 'i':
+			burst_usec = atoi(optarg);
+			if (burst_usec < 0) usage();
+			break;
+
+		case 'm':
+			min_workers = atoi(optarg);
+			if ((min_workers < 0) || (min_workers > 1024)) usage();
+			break;
+
+		case 'n':
+			num_networks = atoi(optarg);
+			if ((num_networks <= 0) || (num_networks > 16)) usage();
+			break;
+
+		case 'o':
+			max_outstanding = atoi(optarg);
+			if (max_outstanding <= 0) usage();
+			break;
+
+		case 's':
+			packet_size = atoi(optarg);
+			if ((packet_size < 20) || (packet_size > 4096)) usage();
+			break;
+
+		case 'w':
+			num_workers = atoi(optarg);
+			if ((num_workers <= 0) || (num_workers > 1024)) usage();
+			break;
+
+		case 'N':
+			receiver_cpus = optarg;
+			break;
+
+		case 'W':
+			worker_cpus = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			fr_debug_lvl++;
+			break;
+
+		case 'y':
+			yield_percent = atoi(optarg);
+			if ((yield_percent < 0) || (yield_percent > 100)) usage();
+			break;
+
+		case 'Y':
+			yield_usec = atoi(optarg);
+			if ((yield_usec < 0) || (yield_usec >= USEC)) usage();
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (min_workers > num_workers) usage();
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	ipaddr.af = AF_INET;
+	ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, min_workers, 1, &transports, NULL, NULL,
+				   worker_cpus, receiver_cpus);
+	if (!sched) {
+		fprintf(stderr, "schedule_bench: Failed to create scheduler\n");
+		exit(1);
+	}
+
+	sockfd = fr_socket_server_base(IPPROTO_UDP, &ipaddr, &port, NULL, true);
+	if (sockfd < 0) {
+		fprintf(stderr, "schedule_bench: Failed creating socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+#ifdef SO_REUSEPORT
+	if (num_networks > 1) {
+		int on = 1;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			fprintf(stderr, "schedule_bench: Failed setting SO_REUSEPORT: %s\n", fr_syserror(errno));
+			exit(1);
+		}
+	}
+#endif
+
+	if (fr_socket_server_bind(sockfd, &ipaddr, &port, NULL) < 0) {
+		fprintf(stderr, "schedule_bench: Failed binding to socket: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	/*
+	 *	The kernel picked the port.
+	 */
+	server_len = sizeof(server);
+	if (getsockname(sockfd, (struct sockaddr *) &server, &server_len) < 0) {
+		fprintf(stderr, "schedule_bench: Failed getting socket address: %s\n", fr_syserror(errno));
+		exit(1);
+	}
+
+	(void) fr_schedule_socket_add(sched, sockfd, &sockfd, &transport);
+
+	client = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((client < 0) ||
+	    (connect(client, (struct sockaddr *) &server, server_len) < 0) ||
+	    (fr_nonblock(client) < 0)) {
+		fprintf(stderr, "schedule_bench: Failed creating client socket: %s\n", fr_syserror(errno));
+		exit(1);
+	}
+
+	packet = talloc_zero_array(autofree, uint8_t, packet_size);
+	sent_time = talloc_zero_array(autofree, fr_time_t, num_packets);
+	latency = fr_time_histogram_create(autofree);
+	if (!packet || !sent_time || !latency) {
+		fprintf(stderr, "schedule_bench: Out of memory\n");
+		exit(1);
+	}
+
+	packet[0] = PW_CODE_ACCESS_REQUEST;
+	packet[2] = (packet_size >> 8) & 0xff;
+	packet[3] = packet_size & 0xff;
+
+	/*
+	 *	Let the receivers pick up the socket.
+	 */
+	usleep(100 * 1000);
+
+#ifdef COUNT_ALLOCATIONS
+	allocations = atomic_load(&num_allocations);
+#endif
+
+	start = last_reply = next_burst = fr_time();
+
+	while (num_replies < num_packets) {
+		int i;
+		ssize_t len;
+		struct pollfd pfd;
+
+		now = fr_time();
+
+		/*
+		 *	Send a burst, if it's time, and there's room in
+		 *	the window.
+		 */
+		if ((num_sent < num_packets) && (now >= next_burst)) {
+			for (i = 0; i < burst; i++) {
+				if (num_sent >= num_packets) break;
+				if (num_outstanding >= (uint64_t) max_outstanding) break;
+
+				packet[1] = num_sent & 0xff;
+				memcpy(packet + SEQ_OFFSET, &num_sent, sizeof(num_sent));
+
+				sent_time[num_sent] = fr_time();
+				if (send(client, packet, packet_size, 0) < 0) break;
+
+				num_sent++;
+				num_outstanding++;
+			}
+
+			if (burst_usec) next_burst = now + ((fr_time_t) burst_usec * 1000);
+		}
+
+		/*
+		 *	Read all of the replies.
+		 */
+		while ((len = recv(client, reply, sizeof(reply), 0)) > 0) {
+			uint64_t seq;
+
+			now = fr_time();
+
+			if ((len < REPLY_SIZE) || (reply[0] != PW_CODE_ACCESS_ACCEPT)) {
+				num_bad++;
+				continue;
+			}
+
+			memcpy(&seq, reply + SEQ_OFFSET, sizeof(seq));
+			if ((seq >= num_sent) || !sent_time[seq]) {
+				num_bad++;
+				continue;
+			}
+
+			fr_time_histogram_add(latency, now - sent_time[seq]);
+			sent_time[seq] = 0;
+
+			num_replies++;
+			if (num_outstanding > 0) num_outstanding--;
+			last_reply = now;
+		}
+
+		/*
+		 *	Packets which are never answered would stall
+		 *	the window forever.
+		 */
+		if ((now - last_reply) > ((fr_time_t) REPLY_TIMEOUT * 1000000)) {
+			MPRINT1("Timed out waiting for replies\n");
+			break;
+		}
+
+		/*
+		 *	Wait for replies if the window is full, or we're
+		 *	waiting for the next burst.
+		 */
+		if ((num_sent >= num_packets) || (num_outstanding >= (uint64_t) max_outstanding) ||
+		    (burst_usec && (now < next_burst))) {
+			int timeout = 1;
+
+			pfd.fd = client;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+
+			if (burst_usec && (num_outstanding < (uint64_t) max_outstanding) && (now < next_burst)) {
+				timeout = (next_burst - now) / 1000000;
+			}
+
+			(void) poll(&pfd, 1, timeout);
+		}
+	}
+
+	elapsed = fr_time() - start;
+
+#ifdef COUNT_ALLOCATIONS
+	allocations = atomic_load(&num_allocations) - allocations;
+#endif
+
+	printf("{\"networks\": %d, \"workers\": %d, \"min_workers\": %d, \"packet_size\": %d, "
+	       "\"burst\": %d, \"burst_usec\": %d, \"outstanding\": %d, "
+	       "\"yield_percent\": %d, \"yield_usec\": %d, "
+	       "\"sent\": %" PRIu64 ", \"replies\": %" PRIu64 ", \"lost\": %" PRIu64 ", \"bad\": %" PRIu64 ", "
+	       "\"elapsed_usec\": %" PRIu64 ", \"pps\": %.0f, "
+	       "\"latency_usec\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}, "
+	       "\"allocations_per_packet\": ",
+	       num_networks, num_workers, min_workers, packet_size,
+	       burst, burst_usec, max_outstanding,
+	       yield_percent, yield_usec,
+	       num_sent, num_replies, num_sent - num_replies, num_bad,
+	       elapsed / 1000, elapsed ? ((double) num_replies * NANOSEC) / elapsed : 0.0,
+	       fr_time_histogram_percentile(latency, 50) / 1000.0,
+	       fr_time_histogram_percentile(latency, 90) / 1000.0,
+	       fr_time_histogram_percentile(latency, 99) / 1000.0,
+	       fr_time_histogram_percentile(latency, 99.9) / 1000.0,
+	       fr_time_histogram_percentile(latency, 100) / 1000.0);
+#ifdef COUNT_ALLOCATIONS
+	printf("%.2f}\n", num_sent ? ((double) allocations) / num_sent : 0.0);
+#else
+	printf("null}\n");
+#endif
+
+	if (debug_lvl) fr_time_histogram_debug(latency, "latency", stdout);
+
+	close(client);
+
+	(void) fr_schedule_destroy(sched);
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+TARGET := schedule_bench
+
+SOURCES		:= schedule_bench.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
+
@@ -0,0 +1,274 @@
+/*
+ * schedule_numa_test.c	Tests for the scheduler's CPU sets and NUMA worker selection
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+/*
+ *	The CPU set parser and the worker selection are private to
+ *	the scheduler, so we include the source.
+ */
+#include "../../util/schedule.c"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MAX_THREADS	(8)
+
+static int		debug_lvl = 0;
+
+#define MPRINT1 if (debug_lvl) printf
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: schedule_numa_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/** Check that a CPU set parses to the expected CPUs
+ *
+ */
+static void test_parse(TALLOC_CTX *ctx, char const *str, int expected, int const *cpus)
+{
+	int	num, i;
+	int	*out;
+
+	num = fr_schedule_cpus_parse(ctx, &out, str);
+	if (num != expected) {
+		fprintf(stderr, "CPU set '%s': parsed %d CPUs, expected %d\n", str, num, expected);
+		exit(1);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (out[i] != cpus[i]) {
+			fprintf(stderr, "CPU set '%s': CPU %d is %d, expected %d\n", str, i, out[i], cpus[i]);
+			exit(1);
+		}
+	}
+
+	MPRINT1("CPU set '%s': OK\n", str);
+	talloc_free(out);
+}
+
+/** Check which workers each network thread would open channels to
+ *
+ *  CPU n is placed on the NUMA node given by the node arrays, the
+ *  same way fr_schedule_create() would fill them in from sysfs.
+ *
+ * @param[in] name of the test.
+ * @param[in] max_workers the number of workers.
+ * @param[in] min_workers the number of permanent workers, or 0.
+ * @param[in] worker_nodes the node of each worker.
+ * @param[in] max_inputs the number of network threads.
+ * @param[in] receiver_nodes the node of each network thread.
+ * @param[in] expected a bitmap of the workers used, per network thread.
+ */
+static void test_local(char const *name, int max_workers, int min_workers, int *worker_nodes,
+		       int max_inputs, int *receiver_nodes, uint32_t const *expected)
+{
+	int			i, j;
+	fr_schedule_t		sc;
+	fr_schedule_worker_t	sw[MAX_THREADS];
+	fr_schedule_receiver_t	sr[MAX_THREADS];
+
+	memset(&sc, 0, sizeof(sc));
+	sc.max_workers = max_workers;
+	sc.min_workers = min_workers;
+	sc.max_inputs = max_inputs;
+	sc.num_worker_cpus = max_workers;
+	sc.worker_nodes = worker_nodes;
+	sc.num_receiver_cpus = max_inputs;
+	sc.receiver_nodes = receiver_nodes;
+
+	for (i = 0; i < max_workers; i++) {
+		memset(&sw[i], 0, sizeof(sw[i]));
+		sw[i].id = i;
+		sw[i].cpu = i;
+		sw[i].node = worker_nodes[i];
+	}
+
+	for (i = 0; i < max_inputs; i++) {
+		uint32_t used = 0;
+
+		memset(&sr[i], 0, sizeof(sr[i]));
+		sr[i].id = i;
+		sr[i].cpu = i;
+		sr[i].node = receiver_nodes[i];
+
+		for (j = 0; j < max_workers; j++) {
+			if (fr_schedule_worker_local(&sc, &sr[i], &sw[j])) used |= (1 << j);
+		}
+
+		if (used != expected[i]) {
+			fprintf(stderr, "%s: network thread %d uses workers 0x%02x, expected 0x%02x\n",
+				name, i, used, expected[i]);
+			exit(1);
+		}
+	}
+
+	MPRINT1("%s: OK\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	fr_schedule_t	*sc;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_log_init(&default_log, false);
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	/*
+	 *	CPU sets.
+	 */
+	{
+		int const cpus[] = { 0, 1, 2, 3, 8, 10, 11 };
+
+		test_parse(autofree, "0", 1, cpus);
+		test_parse(autofree, "0-3", 4, cpus);
+		test_parse(autofree, "0-3,8,10-11", 7, cpus);
+		test_parse(autofree, "", 0, cpus);
+		test_parse(autofree, "3-1", -1, cpus);
+		test_parse(autofree, "0,", 1, cpus);
+		test_parse(autofree, "0,,1", -1, cpus);
+		test_parse(autofree, "a", -1, cpus);
+	}
+
+	/*
+	 *	No NUMA information, every network thread uses every worker.
+	 */
+	{
+		int		wn[] = { -1, -1, -1, -1 };
+		int		rn[] = { -1, -1 };
+		uint32_t const	expected[] = { 0x0f, 0x0f };
+
+		test_local("no nodes", 4, 0, wn, 2, rn, expected);
+	}
+
+	/*
+	 *	Workers and network threads on both nodes, each network
+	 *	thread sticks to its own node.
+	 */
+	{
+		int		wn[] = { 0, 0, 1, 1 };
+		int		rn[] = { 0, 1 };
+		uint32_t const	expected[] = { 0x03, 0x0c };
+
+		test_local("split", 4, 0, wn, 2, rn, expected);
+	}
+
+	/*
+	 *	No network thread on node 1, so its workers are shared.
+	 */
+	{
+		int		wn[] = { 0, 0, 1, 1 };
+		int		rn[] = { 0, 0 };
+		uint32_t const	expected[] = { 0x0f, 0x0f };
+
+		test_local("remote workers", 4, 0, wn, 2, rn, expected);
+	}
+
+	/*
+	 *	No workers on node 1.  Every worker's node has a network
+	 *	thread, but the network thread on node 1 still has to get
+	 *	workers, so it uses all of them.
+	 */
+	{
+		int		wn[] = { 0, 0, 0, 0 };
+		int		rn[] = { 0, 1 };
+		uint32_t const	expected[] = { 0x0f, 0x0f };
+
+		test_local("no local workers", 4, 0, wn, 2, rn, expected);
+	}
+
+	{
+		int		wn[] = { 0, 0, 2, 2 };
+		int		rn[] = { 0, 1, 2 };
+		uint32_t const	expected[] = { 0x03, 0x0f, 0x0c };
+
+		test_local("no local workers, three nodes", 4, 0, wn, 3, rn, expected);
+	}
+
+	/*
+	 *	Only worker 0 is permanent.  The node 1 workers may be
+	 *	retired, so the network thread on node 1 can't rely on
+	 *	them alone.
+	 */
+	{
+		int		wn[] = { 0, 1, 1, 1 };
+		int		rn[] = { 0, 1 };
+		uint32_t const	expected[] = { 0x01, 0x0f };
+
+		test_local("elastic workers", 4, 1, wn, 2, rn, expected);
+	}
+
+	{
+		int		wn[] = { 0, 1, 0, 1 };
+		int		rn[] = { 0, 1 };
+		uint32_t const	expected[] = { 0x05, 0x0a };
+
+		test_local("elastic workers, both nodes", 4, 2, wn, 2, rn, expected);
+	}
+
+	/*
+	 *	The CPU sets are parsed, and their nodes filled in, when
+	 *	the scheduler is created.  With no threads it doesn't
+	 *	start anything, so we can look at the result.
+	 */
+	sc = fr_schedule_create(autofree, &default_log, 0, 0, 0, 0, NULL, NULL, NULL, "0-1", "0");
+	if (!sc) {
+		fprintf(stderr, "Failed creating scheduler with CPU sets\n");
+		exit(1);
+	}
+
+	if ((sc->num_worker_cpus != 2) || (sc->num_receiver_cpus != 1) ||
+	    !sc->worker_nodes || !sc->receiver_nodes ||
+	    (sc->worker_nodes[0] != fr_schedule_cpu_node(0)) ||
+	    (sc->receiver_nodes[0] != fr_schedule_cpu_node(0))) {
+		fprintf(stderr, "Scheduler CPU sets were not set up\n");
+		exit(1);
+	}
+	MPRINT1("CPU 0 is on node %d\n", sc->worker_nodes[0]);
+	talloc_free(sc);
+
+	sc = fr_schedule_create(autofree, &default_log, 0, 0, 0, 0, NULL, NULL, NULL, "0-", NULL);
+	if (sc) {
+		fprintf(stderr, "Created scheduler with invalid CPU set\n");
+		exit(1);
+	}
+
+	talloc_free(autofree);
+
+	return 0;
+}
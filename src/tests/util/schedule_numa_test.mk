@@ -0,0 +1,6 @@
+TARGET := schedule_numa_test
+
+SOURCES		:= schedule_numa_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
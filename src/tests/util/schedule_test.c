@@ -29,7 +29,6 @@ RCSID("$Id$")
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/rad_assert.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -117,7 +116,9 @@ static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: schedule_test [OPTS]\n");
 	fprintf(stderr, "  -n <num>               Start num network threads\n");
+	fprintf(stderr, "  -N <cpus>              Pin network threads to a CPU set, e.g. 0-3,8.\n");
 	fprintf(stderr, "  -w <num>               Start num worker threads\n");
+	fprintf(stderr, "  -W <cpus>              Pin worker threads to a CPU set.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
 	exit(1);
@@ -128,6 +129,7 @@ int main(int argc, char *argv[])
 	int c;
 	int num_networks = 1;
 	int num_workers = 2;
+	char const *worker_cpus = NULL, *receiver_cpus = NULL;
 	TALLOC_CTX	*autofree = talloc_init("main");
 	fr_schedule_t	*sched;
 
@@ -135,7 +137,7 @@ int main(int argc, char *argv[])
 
 	fr_log_init(&default_log, false);
 
-	while ((c = getopt(argc, argv, "n:w:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "n:N:w:W:x")) != EOF) switch (c) {
 		case 'n':
 			num_networks = atoi(optarg);
 			if ((num_networks <= 0) || (num_networks > 16)) usage();
@@ -146,6 +148,14 @@ int main(int argc, char *argv[])
 			if ((num_workers <= 0) || (num_workers > 1024)) usage();
 			break;
 
+		case 'N':
+			receiver_cpus = optarg;
+			break;
+
+		case 'W':
+			worker_cpus = optarg;
+			break;
+
 		case 'x':
 			debug_lvl++;
 			fr_debug_lvl++;
@@ -161,7 +171,8 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, 1, &transports, NULL, NULL);
+	sched = fr_schedule_create(autofree, &default_log, num_networks, num_workers, 0, 1, &transports, NULL, NULL,
+				   worker_cpus, receiver_cpus);
 	if (!sched) {
 		fprintf(stderr, "schedule_test: Failed to create scheduler\n");
 		exit(1);
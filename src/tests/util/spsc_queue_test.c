@@ -0,0 +1,313 @@
+/*
+ * spsc_queue_test.c	Tests for single producer, single consumer queues
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/spsc_queue.h>
+#include <freeradius-devel/util/atomic_queue.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define OFFSET	(1024)
+#define BURST	(32)
+
+static int		debug_lvl = 0;
+static int		bench_size = 1024;
+static uint64_t		bench_messages = 0;
+static bool		bench_atomic = false;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: spsc_queue_test [OPTS]\n");
+	fprintf(stderr, "  -b <num>               Benchmark passing num messages between two threads.\n");
+	fprintf(stderr, "  -s size                set queue size.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/*
+ *	The benchmark passes BURST messages at a time, as the channels
+ *	do.  The producer yields when the queue is full, and the
+ *	consumer yields when it's empty.
+ */
+static void *bench_producer(void *arg)
+{
+	uint64_t i, sent = 0;
+	void *array[BURST];
+
+	for (i = 0; i < BURST; i++) array[i] = (void *) (intptr_t) (i + OFFSET);
+
+	while (sent < bench_messages) {
+		int num = BURST;
+
+		if ((bench_messages - sent) < BURST) num = bench_messages - sent;
+
+		if (bench_atomic) {
+			num = fr_atomic_queue_push_n(arg, array, num);
+		} else {
+			num = fr_spsc_queue_push_n(arg, array, num);
+		}
+
+		if (!num) sched_yield();
+		sent += num;
+	}
+
+	return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+	uint64_t received = 0;
+	void *array[BURST];
+
+	while (received < bench_messages) {
+		int num;
+
+		if (bench_atomic) {
+			num = fr_atomic_queue_pop_n(arg, array, BURST);
+		} else {
+			num = fr_spsc_queue_pop_n(arg, array, BURST);
+		}
+
+		if (!num) sched_yield();
+		received += num;
+	}
+
+	return NULL;
+}
+
+static void bench(TALLOC_CTX *ctx, bool atomic)
+{
+	void *queue;
+	fr_time_t start, elapsed;
+	pthread_t producer, consumer;
+
+	bench_atomic = atomic;
+
+	if (atomic) {
+		queue = fr_atomic_queue_create(ctx, bench_size);
+	} else {
+		queue = fr_spsc_queue_create(ctx, bench_size);
+	}
+	if (!queue) {
+		fprintf(stderr, "Failed creating queue\n");
+		exit(1);
+	}
+
+	start = fr_time();
+
+	(void) pthread_create(&consumer, NULL, bench_consumer, queue);
+	(void) pthread_create(&producer, NULL, bench_producer, queue);
+
+	(void) pthread_join(producer, NULL);
+	(void) pthread_join(consumer, NULL);
+
+	elapsed = fr_time() - start;
+
+	printf("%-6s %" PRIu64 " messages in %" PRIu64 ".%06" PRIu64 "s, %.0f messages/s\n",
+	       atomic ? "atomic" : "spsc", bench_messages,
+	       elapsed / NANOSEC, (elapsed % NANOSEC) / 1000,
+	       elapsed ? ((double) bench_messages * NANOSEC) / elapsed : 0.0);
+
+	talloc_free(queue);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, num, rcode = 0;
+	int size;
+	intptr_t val;
+	void *data, **array;
+	fr_spsc_queue_t *sq;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	size = 5;
+
+	while ((c = getopt(argc, argv, "b:hs:x")) != EOF) switch (c) {
+		case 'b':
+			bench_messages = strtoull(optarg, NULL, 10);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+#if 0
+	argc -= (optind - 1);
+	argv += (optind - 1);
+#endif
+
+	if (size <= 0) usage();
+
+	fr_time_start();
+
+	sq = fr_spsc_queue_create(autofree, size);
+	if (!sq) {
+		fprintf(stderr, "Failed creating queue\n");
+		exit(1);
+	}
+
+	/*
+	 *	Fill and empty the queue a few times, so that the
+	 *	indexes wrap around the array.  The array is larger
+	 *	than "size" when "size" isn't a power of two.
+	 */
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < size; i++) {
+			val = i + OFFSET;
+			data = (void *) val;
+
+			if (!fr_spsc_queue_push(sq, data)) {
+				fprintf(stderr, "Failed pushing at %d\n", i);
+				exit(1);
+			}
+		}
+
+		/*
+		 *	Queue is full.  No more pushes are allowed.
+		 */
+		val = size + OFFSET;
+		data = (void *) val;
+
+		if (fr_spsc_queue_push(sq, data)) {
+			fprintf(stderr, "Pushed an entry past the end of the queue.\n");
+			exit(1);
+		}
+
+#ifndef NDEBUG
+		if (debug_lvl) {
+			printf("Full\n");
+			fr_spsc_queue_debug(sq, stdout);
+		}
+#endif
+
+		for (i = 0; i < size; i++) {
+			if (!fr_spsc_queue_pop(sq, &data)) {
+				fprintf(stderr, "Failed popping at %d\n", i);
+				exit(1);
+			}
+
+			val = (intptr_t) data;
+			if (val != (i + OFFSET)) {
+				fprintf(stderr, "Pop expected %d, got %d\n",
+					i + OFFSET, (int) val);
+				exit(1);
+			}
+		}
+
+		/*
+		 *	Queue is empty.  No more pops are allowed.
+		 */
+		if (fr_spsc_queue_pop(sq, &data)) {
+			fprintf(stderr, "Popped an entry past the end of the queue.\n");
+			exit(1);
+		}
+	}
+
+	/*
+	 *	Now do the same thing, but in bursts.  Push enough to
+	 *	fill the queue, plus one more, which shouldn't fit.
+	 */
+	array = talloc_array(autofree, void *, size + 1);
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i <= size; i++) {
+			val = i + OFFSET;
+			array[i] = (void *) val;
+		}
+
+		num = fr_spsc_queue_push_n(sq, array, size + 1);
+		if (num != size) {
+			fprintf(stderr, "Burst push expected %d, got %d\n", size, num);
+			exit(1);
+		}
+
+		if (fr_spsc_queue_push_n(sq, array + size, 1) != 0) {
+			fprintf(stderr, "Burst pushed an entry past the end of the queue.\n");
+			exit(1);
+		}
+
+		/*
+		 *	Pop them in two bursts, to check that the tail
+		 *	wraps around correctly.
+		 */
+		memset(array, 0, (size + 1) * sizeof(array[0]));
+
+		num = fr_spsc_queue_pop_n(sq, array, 1);
+		if (num != 1) {
+			fprintf(stderr, "Burst pop expected 1, got %d\n", num);
+			exit(1);
+		}
+
+		num = fr_spsc_queue_pop_n(sq, array + 1, size + 1);
+		if (num != (size - 1)) {
+			fprintf(stderr, "Burst pop expected %d, got %d\n", size - 1, num);
+			exit(1);
+		}
+
+		for (i = 0; i < size; i++) {
+			val = (intptr_t) array[i];
+			if (val != (i + OFFSET)) {
+				fprintf(stderr, "Burst pop expected %d, got %d\n",
+					i + OFFSET, (int) val);
+				exit(1);
+			}
+		}
+
+		if (fr_spsc_queue_pop_n(sq, array, 1) != 0) {
+			fprintf(stderr, "Burst popped an entry past the end of the queue.\n");
+			exit(1);
+		}
+	}
+
+	/*
+	 *	Compare the SPSC queue with the MPMC atomic queue, for
+	 *	one producer and one consumer.
+	 */
+	if (bench_messages) {
+		bench_size = size;
+		bench(autofree, true);
+		bench(autofree, false);
+	}
+
+	talloc_free(autofree);
+
+	return rcode;
+}
@@ -0,0 +1,6 @@
+TARGET := spsc_queue_test
+
+SOURCES		:= spsc_queue_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,136 @@
+/*
+ * time_histogram_test.c	Tests for latency histograms
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/time.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define NUM_VALUES (100000)
+
+static int		debug_lvl = 0;
+
+/*
+ *	The histogram should be accurate to within 1/16 of the value.
+ */
+static void check_percentile(fr_time_histogram_t *th, double percentile, fr_time_t expected)
+{
+	fr_time_t value, delta = expected / 16;
+
+	value = fr_time_histogram_percentile(th, percentile);
+	if ((value + delta < expected) || (value > expected + delta)) {
+		fprintf(stderr, "p%g expected %" PRIu64 ", got %" PRIu64 "\n", percentile, expected, value);
+		exit(1);
+	}
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: time_histogram_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	uint64_t i;
+	fr_time_histogram_t *th, *total;
+
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	th = fr_time_histogram_create(autofree);
+	total = fr_time_histogram_create(autofree);
+	if (!th || !total) {
+		fprintf(stderr, "Failed creating histograms\n");
+		exit(1);
+	}
+
+	if (fr_time_histogram_percentile(th, 50) != 0) {
+		fprintf(stderr, "Empty histogram has a non-zero percentile\n");
+		exit(1);
+	}
+
+	/*
+	 *	1us to 100ms, evenly spread.
+	 */
+	for (i = 1; i <= NUM_VALUES; i++) {
+		fr_time_histogram_add(th, i * 1000);
+	}
+
+	if (debug_lvl) fr_time_histogram_debug(th, "test", stdout);
+
+	if (fr_time_histogram_count(th) != NUM_VALUES) {
+		fprintf(stderr, "Expected %d values, got %" PRIu64 "\n", NUM_VALUES, fr_time_histogram_count(th));
+		exit(1);
+	}
+
+	check_percentile(th, 50, 50 * 1000 * 1000);
+	check_percentile(th, 99, 99 * 1000 * 1000);
+	check_percentile(th, 99.9, 99900 * 1000);
+
+	/*
+	 *	Merging the same histogram twice doesn't change the percentiles.
+	 */
+	fr_time_histogram_merge(total, th);
+	fr_time_histogram_merge(total, th);
+
+	if (fr_time_histogram_count(total) != (2 * NUM_VALUES)) {
+		fprintf(stderr, "Expected %d merged values, got %" PRIu64 "\n", 2 * NUM_VALUES,
+			fr_time_histogram_count(total));
+		exit(1);
+	}
+
+	if ((fr_time_histogram_percentile(total, 50) != fr_time_histogram_percentile(th, 50)) ||
+	    (fr_time_histogram_percentile(total, 99) != fr_time_histogram_percentile(th, 99))) {
+		fprintf(stderr, "Merged percentiles are different\n");
+		exit(1);
+	}
+
+	/*
+	 *	Small values are exact.
+	 */
+	fr_time_histogram_add(th, 0);
+	if (fr_time_histogram_percentile(th, 0) != 0) {
+		fprintf(stderr, "Expected p0 to be 0\n");
+		exit(1);
+	}
+
+	talloc_free(autofree);
+
+	return 0;
+}
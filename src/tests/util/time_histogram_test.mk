@@ -0,0 +1,6 @@
+TARGET := time_histogram_test
+
+SOURCES		:= time_histogram_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,155 @@
+/*
+ * track_test.c	Tests for the RADIUS tracking table
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/track.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: track_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i;
+	fr_tracking_t *ft;
+	fr_tracking_entry_t *entry, *other;
+	fr_channel_address_t address;
+	uint8_t packet[20];
+
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	ft = fr_radius_tracking_create(autofree);
+	if (!ft) {
+		fprintf(stderr, "Failed creating tracking table\n");
+		exit(1);
+	}
+
+	/*
+	 *	Allocate all of the IDs, in order.
+	 */
+	for (i = 0; i < 256; i++) {
+		entry = fr_radius_tracking_entry_alloc(ft, i + 1);
+		if (!entry || (entry->id != i)) {
+			fprintf(stderr, "Failed allocating ID %d\n", i);
+			exit(1);
+		}
+	}
+
+	if (!fr_radius_tracking_full(ft) || fr_radius_tracking_entry_alloc(ft, 1000)) {
+		fprintf(stderr, "Allocated an ID from a full table\n");
+		exit(1);
+	}
+
+	/*
+	 *	New allocations get the oldest freed ID.
+	 */
+	if ((fr_radius_tracking_entry_delete(ft, 200) < 0) ||
+	    (fr_radius_tracking_entry_delete(ft, 7) < 0)) {
+		fprintf(stderr, "Failed deleting entries\n");
+		exit(1);
+	}
+
+	if (fr_radius_tracking_entry_delete(ft, 7) == 0) {
+		fprintf(stderr, "Deleted an unused entry\n");
+		exit(1);
+	}
+
+	if (fr_radius_tracking_num_entries(ft) != 254) {
+		fprintf(stderr, "Expected 254 entries, got %d\n", fr_radius_tracking_num_entries(ft));
+		exit(1);
+	}
+
+	entry = fr_radius_tracking_entry_alloc(ft, 1000);
+	other = fr_radius_tracking_entry_alloc(ft, 1001);
+	if (!entry || !other || (entry->id != 200) || (other->id != 7)) {
+		fprintf(stderr, "Allocations did not use the oldest free IDs\n");
+		exit(1);
+	}
+
+	/*
+	 *	Duplicate detection, per client.
+	 */
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 1;
+	packet[1] = 42;
+	packet[3] = 20;
+	packet[4] = 0xaa;
+
+	memset(&address, 0, sizeof(address));
+	address.src_ipaddr.af = AF_INET;
+	address.src_ipaddr.ipaddr.ip4addr.s_addr = htonl(0x7f000001);
+	address.src_port = 1812;
+
+	if ((fr_radius_tracking_address_insert(ft, &address, packet, 2000, &entry) != FR_TRACKING_NEW) ||
+	    (fr_radius_tracking_address_insert(ft, &address, packet, 2001, &other) != FR_TRACKING_SAME) ||
+	    (entry != other)) {
+		fprintf(stderr, "Failed detecting a duplicate packet\n");
+		exit(1);
+	}
+
+	/*
+	 *	Same ID from a different port is a different client.
+	 */
+	address.src_port = 1813;
+	if ((fr_radius_tracking_address_insert(ft, &address, packet, 2002, &other) != FR_TRACKING_NEW) ||
+	    (entry == other)) {
+		fprintf(stderr, "Packets from different clients were treated as duplicates\n");
+		exit(1);
+	}
+
+	/*
+	 *	Same ID with a different authenticator is a new packet.
+	 */
+	packet[4] = 0xbb;
+	if (fr_radius_tracking_address_insert(ft, &address, packet, 2003, &other) != FR_TRACKING_DIFFERENT) {
+		fprintf(stderr, "Failed detecting a different packet with the same ID\n");
+		exit(1);
+	}
+
+	if (debug_lvl) printf("All tests passed\n");
+
+	talloc_free(autofree);
+
+	return 0;
+}
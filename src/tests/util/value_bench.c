@@ -0,0 +1,290 @@
+/*
+ * value_bench.c	Throughput benchmark for parsing strings into values
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+/*
+ *	Each string in the corpus is parsed with value_box_from_str(),
+ *	round robin, and timed.  The corpus has the representations
+ *	seen in SQL rows, detail files and the configuration, and some
+ *	which only the generic parsers understand, so both can be
+ *	compared.
+ *
+ *	The results are printed as one JSON object per line, per
+ *	type, in the same format as codec_bench.
+ */
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/*
+ *	Count allocations, so that we can check the fixed size types
+ *	don't allocate.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_uint_fast64_t num_allocations;
+
+#define COUNT_ALLOCATIONS (1)
+
+void *malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&num_allocations, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define COUNT_CYCLES (1)
+#  define CYCLES() __builtin_ia32_rdtsc()
+#endif
+
+/** A string to parse
+ *
+ */
+typedef struct {
+	PW_TYPE		type;
+	char const	*value;
+} bench_value_t;
+
+static bench_value_t const corpus[] = {
+	{ PW_TYPE_INTEGER,	"0" },
+	{ PW_TYPE_INTEGER,	"1812" },
+	{ PW_TYPE_INTEGER,	"4294967295" },
+	{ PW_TYPE_INTEGER,	"0x0714" },		/* generic */
+
+	{ PW_TYPE_SHORT,	"1813" },
+	{ PW_TYPE_BYTE,		"17" },
+
+	{ PW_TYPE_INTEGER64,	"18446744073709551615" },
+	{ PW_TYPE_INTEGER64,	"1234567890123" },
+
+	{ PW_TYPE_DATE,		"1491826600" },
+	{ PW_TYPE_DATE,		"Apr 10 2017 12:16:40 UTC" },
+	{ PW_TYPE_DATE,		"Apr  9 2017 03:05:00 BST" },
+	{ PW_TYPE_DATE,		"10 Apr 2017" },	/* generic */
+
+	{ PW_TYPE_IPV4_ADDR,	"192.0.2.1" },
+	{ PW_TYPE_IPV4_ADDR,	"10.10.10.10" },
+	{ PW_TYPE_IPV4_ADDR,	"192.0.2.1/32" },
+	{ PW_TYPE_IPV4_ADDR,	"*" },			/* generic */
+
+	{ PW_TYPE_IPV4_PREFIX,	"192.0.2.0/24" },
+	{ PW_TYPE_IPV4_PREFIX,	"10/8" },		/* generic */
+
+	{ PW_TYPE_IPV6_ADDR,	"2001:db8::1" },
+	{ PW_TYPE_IPV6_ADDR,	"fe80::21b:21ff:fe2c:7e0d" },
+
+	{ PW_TYPE_IPV6_PREFIX,	"2001:db8::/32" },
+
+	{ PW_TYPE_ETHERNET,	"00:11:22:aa:bb:cc" },
+	{ PW_TYPE_ETHERNET,	"0:11:22:a:bb:c" },	/* generic */
+
+	{ PW_TYPE_STRING,	"bob@example.com" },
+	{ PW_TYPE_OCTETS,	"0x0102030405060708" },
+};
+
+#define CORPUS_LEN (sizeof(corpus) / sizeof(corpus[0]))
+
+static int debug_lvl = 0;
+
+#define MPRINT1 if (debug_lvl) printf
+
+/** Parse all of the strings of one type
+ *
+ */
+static void bench_run(PW_TYPE type, uint64_t iterations)
+{
+	bench_value_t const	*values[CORPUS_LEN];
+	size_t			i, num = 0;
+	uint64_t		n, failed = 0;
+	fr_time_t		start, elapsed;
+	value_box_t		box;
+	PW_TYPE			dst_type;
+#ifdef COUNT_CYCLES
+	uint64_t		cycles;
+#endif
+#ifdef COUNT_ALLOCATIONS
+	uint64_t		allocations;
+#endif
+
+	for (i = 0; i < CORPUS_LEN; i++) {
+		if (corpus[i].type != type) continue;
+
+		dst_type = type;
+		memset(&box, 0, sizeof(box));
+		if (value_box_from_str(NULL, &box, &dst_type, NULL, corpus[i].value, -1, '\0') < 0) {
+			MPRINT1("Not benchmarking \"%s\": %s\n", corpus[i].value, fr_strerror());
+			continue;
+		}
+		value_box_clear(&box);
+
+		values[num++] = &corpus[i];
+	}
+	if (!num) return;
+
+#ifdef COUNT_ALLOCATIONS
+	allocations = atomic_load(&num_allocations);
+#endif
+#ifdef COUNT_CYCLES
+	cycles = CYCLES();
+#endif
+	start = fr_time();
+
+	for (n = 0; n < iterations; n++) {
+		bench_value_t const *v = values[n % num];
+
+		dst_type = type;
+		if (value_box_from_str(NULL, &box, &dst_type, NULL, v->value, -1, '\0') < 0) {
+			failed++;
+			continue;
+		}
+
+		if ((type == PW_TYPE_STRING) || (type == PW_TYPE_OCTETS)) talloc_free(box.datum.ptr);
+	}
+
+	elapsed = fr_time() - start;
+#ifdef COUNT_CYCLES
+	cycles = CYCLES() - cycles;
+#endif
+#ifdef COUNT_ALLOCATIONS
+	allocations = atomic_load(&num_allocations) - allocations;
+#endif
+
+	printf("{\"type\": \"%s\", \"values\": %zu, \"iterations\": %" PRIu64 ", \"failed\": %" PRIu64 ", "
+	       "\"elapsed_usec\": %" PRIu64 ", \"ns_per_value\": %.1f, \"cycles_per_value\": ",
+	       fr_int2str(dict_attr_types, type, "<INVALID>"), num, iterations, failed,
+	       elapsed / 1000, ((double) elapsed) / iterations);
+#ifdef COUNT_CYCLES
+	printf("%.0f, ", ((double) cycles) / iterations);
+#else
+	printf("null, ");
+#endif
+	printf("\"allocations_per_value\": ");
+#ifdef COUNT_ALLOCATIONS
+	printf("%.2f}\n", ((double) allocations) / iterations);
+#else
+	printf("null}\n");
+#endif
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: value_bench [OPTS]\n");
+	fprintf(stderr, "  -c <num>               Parse num strings of each type (defaults to 1000000).\n");
+	fprintf(stderr, "  -l                     Allow hostname lookups when parsing addresses.\n");
+	fprintf(stderr, "  -t <type>              Only benchmark this type.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	size_t		i, j;
+	uint64_t	iterations = 1000000;
+	int		only = PW_TYPE_INVALID;
+	PW_TYPE		seen[CORPUS_LEN];
+	size_t		num_seen = 0;
+
+	fr_time_start();
+
+	/*
+	 *	Hostname lookups are off by default, as they'd make
+	 *	the results depend on the resolver.
+	 */
+	fr_hostname_lookups = false;
+
+	while ((c = getopt(argc, argv, "c:hlt:x")) != EOF) switch (c) {
+		case 'c':
+			iterations = strtoull(optarg, NULL, 10);
+			if (!iterations) usage();
+			break;
+
+		case 'l':
+			fr_hostname_lookups = true;
+			break;
+
+		case 't':
+			only = fr_str2int(dict_attr_types, optarg, PW_TYPE_INVALID);
+			if (only == PW_TYPE_INVALID) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("value_bench");
+		exit(1);
+	}
+
+	/*
+	 *	One run per type, in the order they're listed.
+	 */
+	for (i = 0; i < CORPUS_LEN; i++) {
+		if ((only != PW_TYPE_INVALID) && (corpus[i].type != (PW_TYPE) only)) continue;
+
+		for (j = 0; j < num_seen; j++) if (seen[j] == corpus[i].type) break;
+		if (j < num_seen) continue;
+
+		seen[num_seen++] = corpus[i].type;
+		bench_run(corpus[i].type, iterations);
+	}
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := value_bench
+
+SOURCES		:= value_bench.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
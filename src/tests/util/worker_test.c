@@ -33,8 +33,6 @@ RCSID("$Id$")
 #include <pthread.h>
 #include <signal.h>
 
-#include <sys/event.h>
-
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
 #define MAX_KEVENTS		(10)
@@ -321,7 +319,7 @@ check_close:
 		MPRINT1("Master waiting on events.\n");
 		rad_assert(num_messages <= max_messages);
 
-		num_events = kevent(kq_master, NULL, 0, events, MAX_KEVENTS, NULL);
+		num_events = fr_event_kq_wait(kq_master, events, MAX_KEVENTS, NULL);
 		MPRINT1("Master kevent returned %d\n", num_events);
 
 		if (num_events < 0) {
@@ -514,7 +512,7 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
-	kq_master = kqueue();
+	kq_master = fr_event_kq_create();
 	rad_assert(kq_master >= 0);
 
 	aq_master = fr_atomic_queue_create(autofree, max_control_plane);
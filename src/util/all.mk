@@ -1,7 +1,7 @@
 TARGET	:= libfreeradius-util.a
 
-SOURCES	:=	ring_buffer.c message.c atomic_queue.c queue.c time.c channel.c track.c worker.c \
-		schedule.c receiver.c control.c
+SOURCES	:=	ring_buffer.c message.c atomic_queue.c spsc_queue.c queue.c time.c channel.c track.c worker.c \
+		schedule.c receiver.c control.c coro.c
 
 TGT_PREREQS	:= libfreeradius-radius.la
 TGT_LDLIBS	:= $(LIBS)
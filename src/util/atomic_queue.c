@@ -241,6 +241,150 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+
+/** Push multiple pointers into the atomic queue
+ *
+ *  A contiguous run of free entries is claimed with one update of
+ *  the head index.  Fewer than "num" entries may be pushed if the
+ *  queue is nearly full.
+ *
+ * @param[in] aq the queue
+ * @param[in] data the array of pointers to push.  None may be NULL.
+ * @param[in] num the number of entries in the data array
+ * @return
+ *	- 0 on queue full
+ *	- the number of entries pushed
+ */
+int fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void **data, int num)
+{
+	int i, count;
+	int64_t head;
+	fr_atomic_queue_entry_t *entry;
+
+	if (!data || (num <= 0)) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		entry = &aq->entry[ head % aq->size ];
+		seq = aquire(entry->seq);
+		diff = (seq - head);
+
+		/*
+		 *	head is larger than the current entry, the queue is full.
+		 */
+		if (diff < 0) return 0;
+
+		/*
+		 *	Someone else has already written to this entry.  Get the new head pointer, and continue.
+		 */
+		if (diff > 0) {
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	The first entry is free.  See how many of the
+		 *	following ones are free, too.  Entries can't be
+		 *	claimed by anyone else until the head moves
+		 *	past them, so the CAS below protects all of
+		 *	them.
+		 */
+		for (count = 1; count < num; count++) {
+			entry = &aq->entry[ (head + count) % aq->size ];
+			if (aquire(entry->seq) != (head + count)) break;
+		}
+
+		if (atomic_compare_exchange_strong_explicit(&aq->head, &head, head + count,
+							    memory_order_release, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 *	Store the data in the queue, and increment the entries
+	 *	with the new index.
+	 */
+	for (i = 0; i < count; i++) {
+		entry = &aq->entry[ (head + i) % aq->size ];
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	return count;
+}
+
+
+/** Pop multiple pointers from the atomic queue
+ *
+ *  A contiguous run of full entries is claimed with one update of
+ *  the tail index.
+ *
+ * @param[in] aq the queue
+ * @param[out] p_data where to write the data
+ * @param[in] num the maximum number of entries to pop
+ * @return
+ *	- 0 on queue empty
+ *	- the number of entries popped
+ */
+int fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **p_data, int num)
+{
+	int i, count;
+	int64_t tail;
+	fr_atomic_queue_entry_t *entry;
+
+	if (!p_data || (num <= 0)) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		entry = &aq->entry[ tail % aq->size ];
+		seq = aquire(entry->seq);
+
+		diff = (seq - (tail + 1));
+
+		/*
+		 *	tail is smaller than the current entry, the queue is empty.
+		 */
+		if (diff < 0) return 0;
+
+		if (diff > 0) {
+			tail = load(aq->tail);
+			continue;
+		}
+
+		for (count = 1; count < num; count++) {
+			entry = &aq->entry[ (tail + count) % aq->size ];
+			if (aquire(entry->seq) != (tail + count + 1)) break;
+		}
+
+		if (atomic_compare_exchange_strong_explicit(&aq->tail, &tail, tail + count,
+							    memory_order_release, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 *	Copy the pointers to the caller BEFORE updating the
+	 *	queue entries, and then mark the entries unused.
+	 */
+	for (i = 0; i < count; i++) {
+		entry = &aq->entry[ (tail + i) % aq->size ];
+		p_data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	return count;
+}
+
 #ifndef NDEBUG
 
 #if 0
@@ -37,6 +37,8 @@ typedef struct fr_atomic_queue_t fr_atomic_queue_t;
 fr_atomic_queue_t *fr_atomic_queue_create(TALLOC_CTX *ctx, int size);
 bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
 bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data);
+int fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void **data, int num);
+int fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **p_data, int num);
 
 #ifndef NDEBUG
 void fr_atomic_queue_debug(fr_atomic_queue_t *aq, FILE *fp);
@@ -24,8 +24,17 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/autoconf.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/util/control.h>
+#include <freeradius-devel/util/spsc_queue.h>
 #include <freeradius-devel/rad_assert.h>
 
 /*
@@ -48,7 +57,13 @@ RCSID("$Id$")
 #define SIGNAL_INTERVAL (1000000)
 
 /**
- *	Size of the atomic queues.
+ *	The worker signals the master at least once every this many
+ *	replies, even if the master is active.
+ */
+#define SIGNAL_BATCH (1000)
+
+/**
+ *	Size of the queues.
  *
  *	The queue reader MUST service the queue occasionally,
  *	otherwise the writer will not be able to write.  If it's too
@@ -59,7 +74,7 @@ RCSID("$Id$")
  *	The reader SHOULD service the queues at inter-packet latency.
  *	i.e. at 1M pps, the queue will get serviced every microsecond.
  */
-#define ATOMIC_QUEUE_SIZE (1024)
+#define CHANNEL_QUEUE_SIZE (1024)
 
 typedef enum fr_channel_signal_t {
 	FR_CHANNEL_SIGNAL_ERROR			= FR_CHANNEL_ERROR,
@@ -84,7 +99,7 @@ typedef struct fr_channel_control_t {
 
 /**
  *  One end of a channel, which consists of a kqueue descriptor, and
- *  an atomic queue.  The atomic queue is there to get bulk data
+ *  an SPSC queue.  The queue is there to get bulk data
  *  through, because it's more efficient than pushing 1M+ events per
  *  second through a kqueue.
  */
@@ -101,6 +116,10 @@ typedef struct fr_channel_end_t {
 
 	size_t			num_resignals;	//!< number of signals resent
 
+	size_t			num_suppressed;	//!< number of signals we didn't send, because one was pending
+
+	atomic_bool		signal_pending;	//!< we've signalled the other end, and it hasn't seen the signal
+
 	size_t			num_kevents;	//!< number of times we've looked at kevents
 
 	uint64_t		sequence;	//!< sequence number for this channel.
@@ -117,7 +136,8 @@ typedef struct fr_channel_end_t {
 
 	fr_time_t		last_sent_signal; //!< the last time when we signaled the other end
 
-	fr_atomic_queue_t	*aq;		//!< the queue of messages - visible only to this channel
+	fr_spsc_queue_t		*sq;		//!< the queue of messages - visible only to this channel.
+						//!< Each end has exactly one writer and one reader.
 } fr_channel_end_t;
 
 /**
@@ -129,6 +149,9 @@ typedef struct fr_channel_t {
 
 	bool			active;		//!< is this channel active?
 
+	fr_time_t		signal_interval; //!< coalesce worker signals within this window
+	uint64_t		signal_batch;	//!< signal at least once every this many messages
+
 	fr_channel_end_t	end[2];		//!< two ends of the channel
 } fr_channel_t;
 
@@ -150,14 +173,14 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
 	ch = talloc_zero(ctx, fr_channel_t);
 	if (!ch) return NULL;
 
-	ch->end[TO_WORKER].aq = fr_atomic_queue_create(ch, ATOMIC_QUEUE_SIZE);
-	if (!ch->end[TO_WORKER].aq) {
+	ch->end[TO_WORKER].sq = fr_spsc_queue_create(ch, CHANNEL_QUEUE_SIZE);
+	if (!ch->end[TO_WORKER].sq) {
 		talloc_free(ch);
 		return NULL;
 	}
 
-	ch->end[FROM_WORKER].aq = fr_atomic_queue_create(ch, ATOMIC_QUEUE_SIZE);
-	if (!ch->end[FROM_WORKER].aq) {
+	ch->end[FROM_WORKER].sq = fr_spsc_queue_create(ch, CHANNEL_QUEUE_SIZE);
+	if (!ch->end[FROM_WORKER].sq) {
 		talloc_free(ch);
 		return NULL;
 	}
@@ -194,6 +217,12 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
 	ch->end[FROM_WORKER].last_read_other = when;
 	ch->end[FROM_WORKER].last_sent_signal = when;
 
+	atomic_init(&ch->end[TO_WORKER].signal_pending, false);
+	atomic_init(&ch->end[FROM_WORKER].signal_pending, false);
+
+	ch->signal_interval = SIGNAL_INTERVAL;
+	ch->signal_batch = SIGNAL_BATCH;
+
 	ch->active = true;
 
 	return ch;
@@ -203,7 +232,7 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
 /** Send a message via a kq user signal
  *
  *  Note that the caller doesn't care about data in the event, that is
- *  sent via the atomic queue.  The kevent code takes care of
+ *  sent via the queue.  The kevent code takes care of
  *  delivering the signal once, even if it's sent by multiple master
  *  threads.
  *
@@ -212,6 +241,11 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
  *  end[1].  We also send which end in 'which' (0, 1) to further help
  *  the recipient.
  *
+ *  Data signals are coalesced.  If we've signalled the other end, and
+ *  it hasn't yet serviced that signal, then it will drain the queue
+ *  after servicing the signal.  So there's no need to send another
+ *  one.
+ *
  * @param[in] ch the channel
  * @param[in] when the time when the data is ready.  Typically taken from the message.
  * @param[in] end the end of the channel that the message was written to
@@ -224,6 +258,18 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 {
 	fr_channel_control_t cc;
 
+	/*
+	 *	Our push to the queue happens before checking
+	 *	the flag.  The other end clears the flag before
+	 *	draining the queue.  So if the flag is still set, the
+	 *	other end is guaranteed to see the new message.
+	 */
+	if (((which == FR_CHANNEL_SIGNAL_DATA_TO_WORKER) || (which == FR_CHANNEL_SIGNAL_DATA_FROM_WORKER)) &&
+	    atomic_exchange(&end->signal_pending, true)) {
+		end->num_suppressed++;
+		return 0;
+	}
+
 	end->last_sent_signal = when;
 	end->num_signals++;
 
@@ -231,7 +277,16 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	cc.ack = end->ack;
 	cc.ch = ch;
 
-	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
+	/*
+	 *	If the signal wasn't sent, the other end won't clear
+	 *	the flag.  So we have to.
+	 */
+	if (fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc)) < 0) {
+		atomic_store(&end->signal_pending, false);
+		return -1;
+	}
+
+	return 0;
 }
 
 #define IALPHA (8)
@@ -255,49 +310,81 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
  */
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_data_t **p_reply)
 {
-	uint64_t sequence;
+	if (fr_channel_send_request_n(ch, &cd, 1, p_reply) < 1) return -1;
+
+	return 0;
+}
+
+/** Send a burst of request messages into the channel
+ *
+ *  The messages are pushed onto the queue in one operation, and the
+ *  other end is signalled (at most) once for the whole burst.
+ *
+ *  The caller should check the reply pointer, as with
+ *  fr_channel_send_request().  If fewer than "num" messages are sent,
+ *  the caller should try sending the rest to another channel.
+ *
+ * @param[in] ch the channel
+ * @param[in] cd the array of messages to send
+ * @param[in] num the number of messages in the array
+ * @param[out] p_reply a pointer to a reply message
+ * @return
+ *	- <0 on error
+ *	- the number of messages sent
+ */
+int fr_channel_send_request_n(fr_channel_t *ch, fr_channel_data_t **cd, int num, fr_channel_data_t **p_reply)
+{
+	int i, sent;
 	fr_time_t when, message_interval;
 	fr_channel_end_t *master;
 
 	master = &(ch->end[TO_WORKER]);
-	when = cd->m.when;
 
-	sequence = master->sequence + 1;
-	cd->live.sequence = sequence;
-	cd->live.ack = master->ack;
+	for (i = 0; i < num; i++) {
+		cd[i]->live.sequence = master->sequence + i + 1;
+		cd[i]->live.ack = master->ack;
+	}
 
 	/*
-	 *	Push the message onto the queue for the other end.  If
-	 *	the push fails, the caller should try another queue.
+	 *	Push the messages onto the queue for the other end.
+	 *	If the push fails, the caller should try another
+	 *	queue.
 	 */
-	if (!fr_atomic_queue_push(master->aq, cd)) {
+	sent = fr_spsc_queue_push_n(master->sq, (void **) cd, num);
+	if (!sent) {
 		MPRINT("QUEUE FULL!\n");
 		*p_reply = fr_channel_recv_reply(ch);
 		return -1;
 	}
 
-	master->sequence = sequence;
-	message_interval = when - master->last_write;
+	master->sequence += sent;
 
-	if (!master->message_interval) {
-		master->message_interval = message_interval;
-	} else {
-		master->message_interval = RTT(master->message_interval, message_interval);
-	}
+	for (i = 0; i < sent; i++) {
+		when = cd[i]->m.when;
+		message_interval = when - master->last_write;
 
-	rad_assert(master->last_write <= when);
-	master->last_write = when;
+		if (!master->message_interval) {
+			master->message_interval = message_interval;
+		} else {
+			master->message_interval = RTT(master->message_interval, message_interval);
+		}
+
+		rad_assert(master->last_write <= when);
+		master->last_write = when;
+	}
 
-	master->num_outstanding++;
-	master->num_packets++;
+	master->num_outstanding += sent;
+	master->num_packets += sent;
 
 	MPRINT("MASTER requests %zd, num_outstanding %zd\n", master->num_packets, master->num_outstanding);
 
+	when = cd[sent - 1]->m.when;
+
 #if ENABLE_SKIPS
 	/*
-	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
+	 *	We just sent the first packets.  There can't possibly be a reply, so don't bother looking.
 	 */
-	if (master->num_outstanding == 1) {
+	if (master->num_outstanding == (uint64_t) sent) {
 		*p_reply = NULL;
 
 
@@ -305,7 +392,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 		 *	There is at least one old packet which is
 		 *	outstanding, look for a reply.
 		 */
-	} else if (master->num_outstanding > 1) {
+	} else if (master->num_outstanding > (uint64_t) sent) {
 		*p_reply = fr_channel_recv_reply(ch);
 
 		/*
@@ -316,7 +403,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 		if (!*p_reply ||
 		    ((*p_reply && (master->num_outstanding > 1)))) {
 			MPRINT("MASTER SKIPS signal\n");
-			return 0;
+			return sent;
 		}
 	}
 #endif
@@ -325,27 +412,22 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 	 *	Tell the other end that there is new data ready.
 	 */
 	MPRINT("MASTER SIGNALS\n");
-	return fr_channel_data_ready(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
+	if (fr_channel_data_ready(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER) < 0) return -1;
+
+	return sent;
 }
 
-/** Receive a reply message from the channel
+/** Update the channel for a reply message we've received
  *
  * @param[in] ch the channel
- * @return
- *	- NULL on no data to receive
- *	- the message on success
+ * @param[in] cd the reply message
  */
-fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch)
+static void fr_channel_reply_update(fr_channel_t *ch, fr_channel_data_t *cd)
 {
-	fr_channel_data_t *cd;
 	fr_channel_end_t *master;
-	fr_atomic_queue_t *aq;
 
-	aq = ch->end[FROM_WORKER].aq;
 	master = &(ch->end[TO_WORKER]);
 
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return NULL;
-
 	/*
 	 *	We want an exponential moving average for round trip
 	 *	time, where "alpha" is a number between [0,1)
@@ -380,29 +462,60 @@ fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch)
 
 	rad_assert(master->last_read_other <= cd->m.when);
 	master->last_read_other = cd->m.when;
-
-	return cd;
 }
 
-
-/** Receive a request message from the channel
+/** Receive a reply message from the channel
  *
  * @param[in] ch the channel
  * @return
  *	- NULL on no data to receive
  *	- the message on success
  */
-fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch)
+fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch)
 {
 	fr_channel_data_t *cd;
+
+	if (!fr_spsc_queue_pop(ch->end[FROM_WORKER].sq, (void **) &cd)) return NULL;
+
+	fr_channel_reply_update(ch, cd);
+
+	return cd;
+}
+
+/** Receive a burst of reply messages from the channel
+ *
+ * @param[in] ch the channel
+ * @param[out] cd the array where the messages are written
+ * @param[in] num the maximum number of messages to receive
+ * @return
+ *	- 0 on no data to receive
+ *	- the number of messages received
+ */
+int fr_channel_recv_reply_n(fr_channel_t *ch, fr_channel_data_t **cd, int num)
+{
+	int i, received;
+
+	received = fr_spsc_queue_pop_n(ch->end[FROM_WORKER].sq, (void **) cd, num);
+
+	for (i = 0; i < received; i++) {
+		fr_channel_reply_update(ch, cd[i]);
+	}
+
+	return received;
+}
+
+
+/** Update the channel for a request message we've received
+ *
+ * @param[in] ch the channel
+ * @param[in] cd the request message
+ */
+static void fr_channel_request_update(fr_channel_t *ch, fr_channel_data_t *cd)
+{
 	fr_channel_end_t *worker;
-	fr_atomic_queue_t *aq;
 
-	aq = ch->end[TO_WORKER].aq;
 	worker = &(ch->end[FROM_WORKER]);
 
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return NULL;
-
 	rad_assert(cd->live.sequence > worker->ack);
 	rad_assert(cd->live.sequence >= worker->sequence); /* must have more requests than replies */
 
@@ -412,10 +525,49 @@ fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch)
 
 	rad_assert(worker->last_read_other <= cd->m.when);
 	worker->last_read_other = cd->m.when;
+}
+
+/** Receive a request message from the channel
+ *
+ * @param[in] ch the channel
+ * @return
+ *	- NULL on no data to receive
+ *	- the message on success
+ */
+fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch)
+{
+	fr_channel_data_t *cd;
+
+	if (!fr_spsc_queue_pop(ch->end[TO_WORKER].sq, (void **) &cd)) return NULL;
+
+	fr_channel_request_update(ch, cd);
 
 	return cd;
 }
 
+/** Receive a burst of request messages from the channel
+ *
+ * @param[in] ch the channel
+ * @param[out] cd the array where the messages are written
+ * @param[in] num the maximum number of messages to receive
+ * @return
+ *	- 0 on no data to receive
+ *	- the number of messages received
+ */
+int fr_channel_recv_request_n(fr_channel_t *ch, fr_channel_data_t **cd, int num)
+{
+	int i, received;
+
+	received = fr_spsc_queue_pop_n(ch->end[TO_WORKER].sq, (void **) cd, num);
+
+	for (i = 0; i < received; i++) {
+		fr_channel_request_update(ch, cd[i]);
+	}
+
+	return received;
+}
+
+
 /** Send a reply message into the channel
  *
  *  The message should be initialized, other than "sequence" and "ack".
@@ -446,7 +598,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	cd->live.sequence = sequence;
 	cd->live.ack = worker->ack;
 
-	if (!fr_atomic_queue_push(worker->aq, cd)) {
+	if (!fr_spsc_queue_push(worker->sq, cd)) {
 		*p_request = fr_channel_recv_request(ch);
 		return -1;
 	}
@@ -501,14 +653,13 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	 *	need to send a new signal.  But we DO send a signal if
 	 *	we haven't seen an ACK for a few packets.
 	 *
-	 *	FIXME: make these limits configurable, or include
-	 *	predictions about packet processing time?
+	 *	The limits can be changed via fr_channel_signal_config().
 	 */
 	rad_assert(worker->their_view_of_my_sequence <= worker->sequence);
 #if ENABLE_SKIPS
-	if (((worker->sequence - worker->their_view_of_my_sequence) <= 1000) &&
-	    ((when - worker->last_read_other < SIGNAL_INTERVAL) ||
-	     ((when - worker->last_sent_signal) < SIGNAL_INTERVAL))) {
+	if (((worker->sequence - worker->their_view_of_my_sequence) <= ch->signal_batch) &&
+	    ((when - worker->last_read_other < ch->signal_interval) ||
+	     ((when - worker->last_sent_signal) < ch->signal_interval))) {
 		MPRINT("\tWORKER SKIPS signal\n");
 		return 0;
 	}
@@ -586,14 +737,26 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 	*p_channel = ch = cc.ch;
 
 	switch (cs) {
+		/*
+		 *	The caller is about to drain the queue, so the
+		 *	sender can signal us again for new data.
+		 */
+	case FR_CHANNEL_SIGNAL_DATA_TO_WORKER:
+		atomic_store(&ch->end[TO_WORKER].signal_pending, false);
+		MPRINT("channel got %d\n", cs);
+		return (fr_channel_event_t) cs;
+
+	case FR_CHANNEL_SIGNAL_DATA_FROM_WORKER:
+		atomic_store(&ch->end[FROM_WORKER].signal_pending, false);
+		MPRINT("channel got %d\n", cs);
+		return (fr_channel_event_t) cs;
+
 		/*
 		 *	These all have the same numbers as the channel
 		 *	events, and have no extra processing.  We just
 		 *	return them as-is.
 		 */
 	case FR_CHANNEL_SIGNAL_ERROR:
-	case FR_CHANNEL_SIGNAL_DATA_TO_WORKER:
-	case FR_CHANNEL_SIGNAL_DATA_FROM_WORKER:
 	case FR_CHANNEL_SIGNAL_OPEN:
 	case FR_CHANNEL_SIGNAL_CLOSE:
 		MPRINT("channel got %d\n", cs);
@@ -825,17 +988,47 @@ int fr_channel_signal_open(fr_channel_t *ch)
 	return fr_control_message_send(ch->end[TO_WORKER].control, ch->end[TO_WORKER].rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Configure signal coalescing for a channel
+ *
+ *  The worker skips signalling the master if the master has read a
+ *  message, or been signalled, within the last "interval".  It still
+ *  signals once the master falls "batch" messages behind.
+ *
+ * @param[in] ch the channel
+ * @param[in] interval the coalescing window, in microseconds
+ * @param[in] batch the maximum number of messages between signals
+ */
+void fr_channel_signal_config(fr_channel_t *ch, uint32_t interval, uint32_t batch)
+{
+	ch->signal_interval = ((fr_time_t) interval) * 1000;
+	ch->signal_batch = batch;
+}
+
+/** Get the signal counters for a channel
+ *
+ * @param[in] ch the channel
+ * @param[out] sent the number of signals sent, by both ends
+ * @param[out] suppressed the number of signals which were coalesced
+ */
+void fr_channel_signal_stats(fr_channel_t *ch, size_t *sent, size_t *suppressed)
+{
+	*sent = ch->end[TO_WORKER].num_signals + ch->end[FROM_WORKER].num_signals;
+	*suppressed = ch->end[TO_WORKER].num_suppressed + ch->end[FROM_WORKER].num_suppressed;
+}
+
 void fr_channel_debug(fr_channel_t *ch, FILE *fp)
 {
 	fprintf(fp, "to worker\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[TO_WORKER].num_signals);
 	fprintf(fp, "\tnum_signals re-sent = %zd\n", ch->end[TO_WORKER].num_resignals);
+	fprintf(fp, "\tnum_signals suppressed = %zd\n", ch->end[TO_WORKER].num_suppressed);
 	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[TO_WORKER].num_kevents);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[TO_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[TO_WORKER].ack);
 
 	fprintf(fp, "to receive\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[FROM_WORKER].num_signals);
+	fprintf(fp, "\tnum_signals suppressed = %zd\n", ch->end[FROM_WORKER].num_suppressed);
 	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[FROM_WORKER].num_kevents);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[FROM_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[FROM_WORKER].ack);
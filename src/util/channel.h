@@ -27,9 +27,9 @@ RCSIDH(channel_h, "$Id$")
 
 #include <freeradius-devel/util/message.h>
 #include <freeradius-devel/util/control.h>
+#include <freeradius-devel/inet.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +55,36 @@ typedef enum fr_channel_event_t {
 	FR_CHANNEL_EMPTY,
 } fr_channel_event_t;
 
+/**
+ *  Traffic classes.  Workers share their time between the classes
+ *  by weight, so that a flood of one kind of traffic can't starve
+ *  the others.
+ */
+typedef enum fr_channel_class_t {
+	FR_CHANNEL_CLASS_AUTH = 0,		//!< authentication, e.g. Access-Request
+	FR_CHANNEL_CLASS_ACCT,			//!< accounting
+	FR_CHANNEL_CLASS_COA,			//!< CoA and Disconnect
+	FR_CHANNEL_CLASS_STATUS,		//!< Status-Server
+	FR_CHANNEL_CLASS_DETAIL,		//!< replayed from a detail file
+	FR_CHANNEL_CLASS_MAX
+} fr_channel_class_t;
+
+/**
+ *  Addressing information for a packet.
+ *
+ *  For requests, this is where the packet came from and where it was
+ *  sent to.  For replies, the source and destination are swapped, so
+ *  that the receiver can send the reply without looking anything up.
+ */
+typedef struct fr_channel_address_t {
+	fr_ipaddr_t		src_ipaddr;	//!< source IP address
+	fr_ipaddr_t		dst_ipaddr;	//!< destination IP address
+	uint16_t		src_port;	//!< source port
+	uint16_t		dst_port;	//!< destination port
+	int			if_index;	//!< interface the packet was received on
+	int			sockfd;		//!< receiver socket the packet was read from
+} fr_channel_address_t;
+
 /**
  *  Channel information which is added to a message.
  *
@@ -88,6 +118,8 @@ typedef struct fr_channel_data_t {
 	void			*ctx;		//!< packet context.  Usually socket information
 	uint32_t		transport;	//!< transport ID for this packet
 	uint32_t		priority;	//!< priority of this packet.  0=high, 65535=low.
+	fr_channel_class_t	traffic_class;	//!< traffic class of this packet
+	fr_channel_address_t	address;	//!< where the packet came from / is going to
 
 	union {
 		struct {
@@ -107,10 +139,13 @@ typedef struct fr_channel_data_t {
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_control_t *worker) CC_HINT(nonnull);
 
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm, fr_channel_data_t **p_reply) CC_HINT(nonnull);
+int fr_channel_send_request_n(fr_channel_t *ch, fr_channel_data_t **cm, int num, fr_channel_data_t **p_reply) CC_HINT(nonnull);
 fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_recv_request_n(fr_channel_t *ch, fr_channel_data_t **cm, int num) CC_HINT(nonnull);
 
 int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cm, fr_channel_data_t **p_request) CC_HINT(nonnull);
 fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_recv_reply_n(fr_channel_t *ch, fr_channel_data_t **cm, int num) CC_HINT(nonnull);
 
 int fr_channel_worker_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
 
@@ -121,6 +156,9 @@ bool fr_channel_active(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_signal_open(fr_channel_t *ch) CC_HINT(nonnull);
 
+void fr_channel_signal_config(fr_channel_t *ch, uint32_t interval, uint32_t batch) CC_HINT(nonnull);
+void fr_channel_signal_stats(fr_channel_t *ch, size_t *sent, size_t *suppressed) CC_HINT(nonnull);
+
 int fr_channel_signal_worker_close(fr_channel_t *ch) CC_HINT(nonnull);
 int fr_channel_worker_ack_close(fr_channel_t *ch) CC_HINT(nonnull);
 
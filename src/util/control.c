@@ -24,16 +24,29 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/autoconf.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/ring_buffer.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include <string.h>
-#include <sys/event.h>
 
 #define FR_CONTROL_SIGNAL	(1024)
 #define FR_CONTROL_MAX_IDENT	(32)
 
+/*
+ *	How many messages we pop before dispatching them.  Duplicate
+ *	messages within one batch are delivered only once.
+ */
+#define FR_CONTROL_BATCH	(32)
+
 /*
  *	Debugging, mainly for channel_test
  */
@@ -67,6 +80,7 @@ typedef struct fr_control_ctx_t {
 	uint32_t			id;		//!< id of this callback
 	void				*ctx;		//!< context for the callback
 	fr_control_callback_t		callback;	//!< the function to call
+	bool				coalesce;	//!< deliver duplicate messages only once
 } fr_control_ctx_t;
 
 
@@ -75,13 +89,26 @@ typedef struct fr_control_ctx_t {
  */
 struct fr_control_t {
 	int			kq;			//!< destination KQ
+	int			user_fd;		//!< handle for our user event in the KQ
 
 	fr_atomic_queue_t	*aq;			//!< destination AQ
 
+	atomic_bool		signal_pending;		//!< the KQ has been signalled, and the AQ not yet drained
+
 	fr_control_ctx_t 	ident[FR_CONTROL_MAX_IDENT];	//!< callbacks
 };
 
 
+/** Remove our user event from the KQ
+ *
+ */
+static int _fr_control_free(fr_control_t *c)
+{
+	if (c->user_fd >= 0) (void) fr_event_kq_user_delete(c->kq, c->user_fd, FR_CONTROL_SIGNAL);
+
+	return 0;
+}
+
 /** Create a control-plane signaling path.
  *
  * @param[in] ctx the talloc context
@@ -94,13 +121,14 @@ struct fr_control_t {
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq)
 {
 	fr_control_t *c;
-	struct kevent kev;
 
 	c = talloc_zero(ctx, fr_control_t);
 	if (!c) return NULL;
 
 	c->kq = kq;
+	c->user_fd = -1;
 	c->aq = aq;
+	atomic_init(&c->signal_pending, false);
 
 	/*
 	 *	Tell the KQ to listen on our events.
@@ -113,12 +141,16 @@ fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq)
 	 *
 	 *	The implementation here is perhaps a bit less optimal,
 	 *	but it's clean, and it works.
+	 *
+	 *	On Linux, each control gets its own eventfd, but they
+	 *	all use the same ident.
 	 */
-	EV_SET(&kev, FR_CONTROL_SIGNAL, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
-	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+	c->user_fd = fr_event_kq_user_add(kq, FR_CONTROL_SIGNAL);
+	if (c->user_fd < 0) {
 		talloc_free(c);
 		return NULL;
 	}
+	talloc_set_destructor(c, _fr_control_free);
 
 	return c;
 }
@@ -282,6 +314,10 @@ int fr_control_message_push(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
  *
  *  This function is called ONLY from the originating thread.
  *
+ *  The recipient is only woken up if it hasn't already been woken
+ *  up, and not yet drained its queue.  So a burst of messages from
+ *  any number of senders costs one kevent.
+ *
  * @param[in] c the control structure
  * @param[in] rb the callers ring buffer for message allocation.
  * @param[in] id the ident of this message.
@@ -293,8 +329,6 @@ int fr_control_message_push(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
  */
 int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id, void *data, size_t data_size)
 {
-	struct kevent kev;
-
 #ifndef NDEBUG
 	(void) talloc_get_type_abort(c, fr_control_t);
 #endif
@@ -303,8 +337,20 @@ int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
 		return -1;
 	}
 
-	EV_SET(&kev, FR_CONTROL_SIGNAL, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	return kevent(c->kq, &kev, 1, NULL, 0, NULL);
+	/*
+	 *	Our push to the queue happens before checking the
+	 *	flag.  The recipient clears the flag before draining
+	 *	the queue.  So if the flag is still set, the recipient
+	 *	is guaranteed to see the new message.
+	 */
+	if (atomic_exchange(&c->signal_pending, true)) return 0;
+
+	if (fr_event_kq_user_trigger(c->user_fd, FR_CONTROL_SIGNAL) < 0) {
+		atomic_store(&c->signal_pending, false);
+		return -1;
+	}
+
+	return 0;
 }
 
 
@@ -353,6 +399,10 @@ ssize_t fr_control_message_pop(fr_atomic_queue_t *aq, uint32_t *p_id, void *data
  *
  *  This function is called ONLY from the receiving thread.
  *
+ *  Callers which drain the queue with fr_control_message_pop()
+ *  MUST call this function first, so that the senders know to
+ *  signal us again.  fr_control_service() does this itself.
+ *
  * @param[in] c the control structure
  * @param[in] kev the kevent for this receiver
  * @return
@@ -360,10 +410,12 @@ ssize_t fr_control_message_pop(fr_atomic_queue_t *aq, uint32_t *p_id, void *data
  *	- 0 this kevent is not for us.
  *	- >0 this kevent is for us
  */
-int fr_control_message_service_kevent(UNUSED fr_control_t *c, struct kevent const *kev)
+int fr_control_message_service_kevent(fr_control_t *c, struct kevent const *kev)
 {
 	if (kev->ident != FR_CONTROL_SIGNAL) return 0;
 
+	atomic_store(&c->signal_pending, false);
+
 	return 1;
 }
 
@@ -424,23 +476,149 @@ int fr_control_callback_delete(fr_control_t *c, uint32_t id)
 	c->ident[id].id = 0;
 	c->ident[id].ctx = NULL;
 	c->ident[id].callback = NULL;
+	c->ident[id].coalesce = false;
 
 	return 0;
 }
 
-void fr_control_service(fr_control_t *c, void *data, size_t data_size, fr_time_t now)
+/** Deliver duplicate messages for an ID only once
+ *
+ *  Messages are popped in batches.  When coalescing is enabled, a
+ *  message which has the same data as an earlier message in the same
+ *  batch is dropped.  This is only safe for messages which are
+ *  "something changed, go look" notifications.  The callback runs
+ *  after the whole batch is popped, so it sees everything which the
+ *  dropped messages were about.
+ *
+ * @param[in] c the control structure
+ * @param[in] id the ident of the messages
+ * @param[in] coalesce whether or not to coalesce duplicate messages
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_control_coalesce_set(fr_control_t *c, uint32_t id, bool coalesce)
 {
-	uint32_t id = 0;
-	size_t message_size;
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(c, fr_control_t);
+#endif
 
-	while (true) {
-		message_size = fr_control_message_pop(c->aq, &id, data, data_size);
-		if (!message_size) return;
+	if (id >= FR_CONTROL_MAX_IDENT) return -1;
+
+	c->ident[id].coalesce = coalesce;
+
+	return 0;
+}
+
+/**
+ *  A message which has been popped, but not yet dispatched.
+ */
+typedef struct fr_control_pending_t {
+	uint32_t			id;		//!< ID of this message
+	size_t				data_size;	//!< size of the data
+	uint8_t				data[FR_CONTROL_MAX_SIZE]; //!< the data
+} fr_control_pending_t;
+
+/** Check if a message duplicates one which is already in the batch
+ *
+ */
+static bool fr_control_duplicate(fr_control_pending_t const *batch, int num, uint32_t id,
+				 void const *data, size_t data_size)
+{
+	int i;
 
-		if (id >= FR_CONTROL_MAX_IDENT) continue;
+	for (i = 0; i < num; i++) {
+		if (batch[i].id != id) continue;
+		if (batch[i].data_size != data_size) continue;
+		if (memcmp(batch[i].data, data, data_size) != 0) continue;
 
-		if (!c->ident[id].callback) continue;
+		return true;
+	}
+
+	return false;
+}
+
+/** Dispatch all pending control-plane messages
+ *
+ *  This function is called ONLY from the receiving thread.
+ *
+ *  Messages are popped in batches, and then passed to their
+ *  callbacks in order.  See fr_control_coalesce_set().
+ *
+ * @param[in] c the control structure
+ * @param[in] data a buffer for messages larger than FR_CONTROL_MAX_SIZE
+ * @param[in] data_size the size of the buffer
+ * @param[in] now the current time
+ */
+void fr_control_service(fr_control_t *c, void *data, size_t data_size, fr_time_t now)
+{
+	int i, num;
+	uint32_t id = 0;
+	ssize_t message_size;
+	bool done = false;
+	fr_control_pending_t batch[FR_CONTROL_BATCH];
 
-		c->ident[id].callback(c->ident[id].ctx, data, message_size, now);
+	/*
+	 *	Tell the senders to signal us again for any message
+	 *	which they push after this.
+	 */
+	atomic_store(&c->signal_pending, false);
+
+	while (!done) {
+		for (num = 0; num < FR_CONTROL_BATCH; num++) {
+			message_size = fr_control_message_pop(c->aq, &id, data, data_size);
+			if (message_size == 0) {
+				done = true;
+				break;
+			}
+
+			/*
+			 *	The caller's buffer is too small.
+			 */
+			if (message_size < 0) {
+				num--;
+				continue;
+			}
+
+			if (id >= FR_CONTROL_MAX_IDENT) {
+				num--;
+				continue;
+			}
+
+			if (!c->ident[id].callback) {
+				num--;
+				continue;
+			}
+
+			/*
+			 *	Too big to batch.  Dispatch everything
+			 *	before it, and then it.
+			 */
+			if ((size_t) message_size > FR_CONTROL_MAX_SIZE) {
+				for (i = 0; i < num; i++) {
+					c->ident[batch[i].id].callback(c->ident[batch[i].id].ctx, batch[i].data,
+								     batch[i].data_size, now);
+				}
+
+				c->ident[id].callback(c->ident[id].ctx, data, message_size, now);
+				num = -1;
+				continue;
+			}
+
+			if (c->ident[id].coalesce && fr_control_duplicate(batch, num, id, data, message_size)) {
+				MPRINT("CONTROL coalesced message for ID %u\n", id);
+				num--;
+				continue;
+			}
+
+			batch[num].id = id;
+			batch[num].data_size = message_size;
+			memcpy(batch[num].data, data, message_size);
+		}
+
+		for (i = 0; i < num; i++) {
+			c->ident[batch[i].id].callback(c->ident[batch[i].id].ctx, batch[i].data,
+						     batch[i].data_size, now);
+		}
 	}
 }
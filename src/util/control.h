@@ -28,9 +28,9 @@ RCSIDH(control_h, "$Id$")
 #include <freeradius-devel/util/atomic_queue.h>
 #include <freeradius-devel/util/ring_buffer.h>
 #include <freeradius-devel/util/time.h>
+#include <freeradius-devel/event.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +55,7 @@ typedef	void (*fr_control_callback_t)(void *ctx, void const *data, size_t data_s
  */
 #define FR_CONTROL_ID_CHANNEL (1)
 #define FR_CONTROL_ID_SOCKET  (2)
+#define FR_CONTROL_ID_WORKER  (3)
 
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq);
 void fr_control_free(fr_control_t *c);
@@ -69,6 +70,7 @@ ssize_t fr_control_message_pop(fr_atomic_queue_t *aq, uint32_t *p_id, void *data
 
 int fr_control_callback_add(fr_control_t *c, uint32_t id, void *ctx, fr_control_callback_t callback) CC_HINT(nonnull(1,4));
 int fr_control_callback_delete(fr_control_t *c, uint32_t id) CC_HINT(nonnull);
+int fr_control_coalesce_set(fr_control_t *c, uint32_t id, bool coalesce) CC_HINT(nonnull);
 
 void fr_control_service(fr_control_t *c, void *data, size_t data_size, fr_time_t now) CC_HINT(nonnull);
 
@@ -0,0 +1,414 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Coroutines on pooled stacks.
+ * @file util/coro.c
+ *
+ *  A coroutine runs a function on its own stack.  The function can
+ *  call fr_coro_yield() from anywhere in its call chain, which
+ *  switches back to whoever started or resumed the coroutine.  A
+ *  later fr_coro_resume() continues from where the function yielded.
+ *
+ *  This lets code which is written as a series of blocking calls
+ *  give up the thread while it waits, without being rewritten as a
+ *  state machine.
+ *
+ *  Stacks are mmap'd, with a guard page below them, so that a stack
+ *  overflow crashes instead of silently corrupting memory.  Mapping
+ *  a stack is expensive, so finished coroutines are kept in a pool,
+ *  and re-used.
+ *
+ *  Coroutines belong to the thread which created the pool.  They
+ *  MUST NOT be resumed from any other thread.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/autoconf.h>
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/threads.h>
+#include <freeradius-devel/util/coro.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_UCONTEXT_H
+#  include <ucontext.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ *	The smallest stack we allow.
+ */
+#define STACK_SIZE_MIN	(16 * 1024)
+
+struct fr_coro_pool_t {
+	size_t			stack_size;	//!< usable size of each stack
+	size_t			page_size;	//!< size of the guard page
+
+	int			max_idle;	//!< maximum number of idle coroutines to keep
+	int			num_idle;	//!< number of idle coroutines
+	int			num_active;	//!< number of coroutines which have been allocated, and not released
+	uint64_t		num_created;	//!< number of stacks we've mapped
+
+	fr_coro_t		*idle;		//!< list of idle coroutines
+};
+
+struct fr_coro_t {
+#ifdef HAVE_UCONTEXT_H
+	ucontext_t		ctx;		//!< the coroutine
+	ucontext_t		caller;		//!< whoever started or resumed the coroutine
+#endif
+
+	fr_coro_pool_t		*pool;		//!< the pool we came from
+	fr_coro_t		*next;		//!< next in the idle list
+
+	uint8_t			*stack;		//!< start of the mapping, including the guard page
+	size_t			mmap_size;	//!< size of the mapping
+
+	fr_coro_func_t		func;		//!< the function to run
+	void			*uctx;		//!< context for the function
+	int			rcode;		//!< what the function returned
+
+	bool			started;	//!< the function has been started
+	bool			done;		//!< the function has returned
+	bool			cancelled;	//!< tell the function to stop waiting
+};
+
+/*
+ *	The coroutine which is currently running on this thread.
+ */
+static _Thread_local fr_coro_t *fr_coro_running;
+
+/** Unmap the stack of a coroutine
+ *
+ */
+static int _coro_free(fr_coro_t *coro)
+{
+	if (coro->stack) (void) munmap(coro->stack, coro->mmap_size);
+
+	return 0;
+}
+
+/** Create a pool of coroutines
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] stack_size the size of each stack.  It is rounded up to a multiple of the page size.
+ * @param[in] max_idle how many released coroutines to keep for re-use
+ * @return
+ *	- NULL on error
+ *	- fr_coro_pool_t on success
+ */
+fr_coro_pool_t *fr_coro_pool_create(TALLOC_CTX *ctx, size_t stack_size, int max_idle)
+{
+#ifdef HAVE_UCONTEXT_H
+	fr_coro_pool_t *pool;
+
+	if (max_idle < 0) return NULL;
+
+	if (stack_size < STACK_SIZE_MIN) stack_size = STACK_SIZE_MIN;
+
+	pool = talloc_zero(ctx, fr_coro_pool_t);
+	if (!pool) return NULL;
+
+	pool->page_size = (size_t) sysconf(_SC_PAGESIZE);
+	pool->stack_size = (stack_size + pool->page_size - 1) & ~(pool->page_size - 1);
+	pool->max_idle = max_idle;
+
+	return pool;
+#else
+	fr_strerror_printf("Coroutines are not supported on this platform");
+	return NULL;
+#endif
+}
+
+/** Get a coroutine from a pool
+ *
+ *  The coroutine MUST be started before it is resumed.
+ *
+ * @param[in] pool the pool
+ * @return
+ *	- NULL on error
+ *	- fr_coro_t on success
+ */
+fr_coro_t *fr_coro_alloc(fr_coro_pool_t *pool)
+{
+	fr_coro_t *coro;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(pool, fr_coro_pool_t);
+#endif
+
+	if (pool->idle) {
+		coro = pool->idle;
+		pool->idle = coro->next;
+		pool->num_idle--;
+		goto done;
+	}
+
+	coro = talloc_zero(pool, fr_coro_t);
+	if (!coro) return NULL;
+
+	coro->pool = pool;
+	coro->mmap_size = pool->stack_size + pool->page_size;
+
+	coro->stack = mmap(NULL, coro->mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (coro->stack == MAP_FAILED) {
+		coro->stack = NULL;
+		talloc_free(coro);
+		return NULL;
+	}
+	talloc_set_destructor(coro, _coro_free);
+
+	/*
+	 *	Stacks grow down, so the guard page goes at the
+	 *	start of the mapping.
+	 */
+	if (mprotect(coro->stack, pool->page_size, PROT_NONE) < 0) {
+		talloc_free(coro);
+		return NULL;
+	}
+
+	pool->num_created++;
+
+done:
+	coro->next = NULL;
+	coro->func = NULL;
+	coro->uctx = NULL;
+	coro->rcode = 0;
+	coro->started = false;
+	coro->done = false;
+	coro->cancelled = false;
+
+	pool->num_active++;
+
+	return coro;
+}
+
+/** Return a coroutine to its pool
+ *
+ *  The coroutine MUST NOT be suspended.  Its stack is re-used by
+ *  the next coroutine, so anything which points to the stack is
+ *  invalid.
+ *
+ * @param[in] coro the coroutine to release
+ */
+void fr_coro_release(fr_coro_t *coro)
+{
+	fr_coro_pool_t *pool = coro->pool;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(coro, fr_coro_t);
+#endif
+
+	rad_assert(coro != fr_coro_running);
+	rad_assert(!coro->started || coro->done);
+
+	pool->num_active--;
+
+	if (pool->num_idle >= pool->max_idle) {
+		talloc_free(coro);
+		return;
+	}
+
+	coro->next = pool->idle;
+	pool->idle = coro;
+	pool->num_idle++;
+}
+
+#ifdef HAVE_UCONTEXT_H
+/** Run the coroutine function
+ *
+ *  makecontext() can only portably pass int arguments, so we find
+ *  the coroutine from the thread-local pointer instead.  When we
+ *  return, the context switches to coro->caller.
+ */
+static void fr_coro_entry(void)
+{
+	fr_coro_t *coro = fr_coro_running;
+
+	coro->rcode = coro->func(coro->uctx);
+	coro->done = true;
+
+	fr_coro_running = NULL;
+}
+#endif
+
+/** Start a coroutine
+ *
+ *  The function runs until it returns, or until it calls
+ *  fr_coro_yield().
+ *
+ * @param[in] coro the coroutine, from fr_coro_alloc()
+ * @param[in] func the function to run
+ * @param[in] ctx for the function
+ * @return
+ *	- <0 on error
+ *	- 0 the function returned.  Its return code is available from fr_coro_result()
+ *	- 1 the function yielded.
+ */
+int fr_coro_start(fr_coro_t *coro, fr_coro_func_t func, void *ctx)
+{
+#ifdef HAVE_UCONTEXT_H
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(coro, fr_coro_t);
+#endif
+
+	if (coro->started) return -1;
+
+	if (getcontext(&coro->ctx) < 0) return -1;
+
+	coro->ctx.uc_stack.ss_sp = coro->stack + coro->pool->page_size;
+	coro->ctx.uc_stack.ss_size = coro->pool->stack_size;
+	coro->ctx.uc_link = &coro->caller;
+
+	makecontext(&coro->ctx, fr_coro_entry, 0);
+
+	coro->func = func;
+	coro->uctx = ctx;
+	coro->started = true;
+
+	return fr_coro_resume(coro, false);
+#else
+	return -1;
+#endif
+}
+
+/** Resume a coroutine which has yielded
+ *
+ * @param[in] coro the coroutine
+ * @param[in] cancel tell the coroutine to stop waiting.  fr_coro_yield() returns -1
+ *	in the coroutine, and all later calls to fr_coro_yield() fail.
+ * @return
+ *	- <0 on error
+ *	- 0 the function returned.  Its return code is available from fr_coro_result()
+ *	- 1 the function yielded again.
+ */
+int fr_coro_resume(fr_coro_t *coro, bool cancel)
+{
+#ifdef HAVE_UCONTEXT_H
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(coro, fr_coro_t);
+#endif
+
+	if (!coro->started) return -1;
+
+	if (coro->done) return 0;
+
+	/*
+	 *	Coroutines don't nest.
+	 */
+	if (fr_coro_running) return -1;
+
+	if (cancel) coro->cancelled = true;
+
+	fr_coro_running = coro;
+
+	if (swapcontext(&coro->caller, &coro->ctx) < 0) {
+		fr_coro_running = NULL;
+		return -1;
+	}
+
+	rad_assert(fr_coro_running == NULL);
+
+	if (coro->done) return 0;
+
+	return 1;
+#else
+	return -1;
+#endif
+}
+
+/** Yield from the current coroutine
+ *
+ *  The caller MUST arrange for something to call fr_coro_resume()
+ *  later, or for the coroutine to be cancelled.
+ *
+ * @return
+ *	- <0 if we're not running in a coroutine, or the coroutine was cancelled.
+ *	- 0 when the coroutine is resumed.
+ */
+int fr_coro_yield(void)
+{
+#ifdef HAVE_UCONTEXT_H
+	fr_coro_t *coro = fr_coro_running;
+
+	if (!coro || coro->cancelled) return -1;
+
+	fr_coro_running = NULL;
+
+	if (swapcontext(&coro->ctx, &coro->caller) < 0) {
+		fr_coro_running = coro;
+		return -1;
+	}
+
+	rad_assert(fr_coro_running == coro);
+
+	if (coro->cancelled) return -1;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/** Get the return code of a coroutine function
+ *
+ * @param[in] coro the coroutine
+ * @return what the function returned.  Only valid if fr_coro_start() or fr_coro_resume() returned 0.
+ */
+int fr_coro_result(fr_coro_t const *coro)
+{
+	return coro->rcode;
+}
+
+/** Get the coroutine which is running on this thread
+ *
+ * @return
+ *	- NULL if we're not running in a coroutine
+ *	- fr_coro_t the current coroutine.
+ */
+fr_coro_t *fr_coro_current(void)
+{
+	return fr_coro_running;
+}
+
+/** Print debug information about a coroutine pool
+ *
+ * @param[in] pool the pool
+ * @param[in] fp the file where the debug output is printed.
+ */
+void fr_coro_pool_debug(fr_coro_pool_t *pool, FILE *fp)
+{
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(pool, fr_coro_pool_t);
+#endif
+
+	fprintf(fp, "coroutine stacks = %zd bytes\n", pool->stack_size);
+	fprintf(fp, "\tnum_active = %d\n", pool->num_active);
+	fprintf(fp, "\tnum_idle = %d (max %d)\n", pool->num_idle, pool->max_idle);
+	fprintf(fp, "\tnum_created = %" PRIu64 "\n", pool->num_created);
+}
@@ -0,0 +1,60 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_CORO_H
+#define _FR_CORO_H
+/**
+ * $Id$
+ *
+ * @file util/coro.h
+ * @brief Coroutines on pooled stacks.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSIDH(coro_h, "$Id$")
+
+#include <talloc.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_coro_pool_t fr_coro_pool_t;
+typedef struct fr_coro_t fr_coro_t;
+
+/**
+ *  The function which is run on the coroutine stack.
+ */
+typedef int (*fr_coro_func_t)(void *ctx);
+
+fr_coro_pool_t *fr_coro_pool_create(TALLOC_CTX *ctx, size_t stack_size, int max_idle);
+fr_coro_t *fr_coro_alloc(fr_coro_pool_t *pool) CC_HINT(nonnull);
+void fr_coro_release(fr_coro_t *coro) CC_HINT(nonnull);
+
+int fr_coro_start(fr_coro_t *coro, fr_coro_func_t func, void *ctx) CC_HINT(nonnull(1,2));
+int fr_coro_resume(fr_coro_t *coro, bool cancel) CC_HINT(nonnull);
+int fr_coro_yield(void);
+int fr_coro_result(fr_coro_t const *coro) CC_HINT(nonnull);
+fr_coro_t *fr_coro_current(void);
+
+void fr_coro_pool_debug(fr_coro_pool_t *pool, FILE *fp) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_CORO_H */
@@ -109,8 +109,64 @@ struct fr_message_set_t {
 	fr_ring_buffer_t	*mr_array[MSG_ARRAY_SIZE]; //!< array of message arrays
 
 	fr_ring_buffer_t	*rb_array[MSG_ARRAY_SIZE]; //!< array of ring buffers
+
+	int			rb_flags;	//!< fr_ring_buffer_create_mmap() flags for the packet ring buffers
+
+	size_t			max_memory;	//!< cap on the total size of all rings, 0 for no cap
 };
 
+/** Add up the size and usage of an array of rings
+ *
+ * @param[in] array of rings
+ * @param[in] max the highest used entry in the array
+ * @param[out] p_size the total size of the rings
+ * @param[out] p_used the total bytes used in the rings
+ */
+static void fr_message_array_usage(fr_ring_buffer_t **array, int max, size_t *p_size, size_t *p_used)
+{
+	int i;
+
+	*p_size = *p_used = 0;
+
+	for (i = 0; i <= max; i++) {
+		*p_size += fr_ring_buffer_size(array[i]);
+		*p_used += fr_ring_buffer_used(array[i]);
+	}
+}
+
+/** Check if the message set may allocate another ring
+ *
+ * @param[in] ms the message set
+ * @param[in] size of the new ring
+ * @return
+ *	- true if the new ring would fit under the memory cap
+ *	- false if it would not.
+ */
+static bool fr_message_set_may_grow(fr_message_set_t *ms, size_t size)
+{
+	size_t mr_size, rb_size, used;
+
+	if (!ms->max_memory) return true;
+
+	fr_message_array_usage(ms->mr_array, ms->mr_max, &mr_size, &used);
+	fr_message_array_usage(ms->rb_array, ms->rb_max, &rb_size, &used);
+
+	return ((mr_size + rb_size + size) <= ms->max_memory);
+}
+
+/** Create a packet ring buffer for a message set
+ *
+ * @param[in] ms the message set
+ * @param[in] size of the ring buffer
+ * @return a ring buffer, or NULL on failure.
+ */
+static fr_ring_buffer_t *fr_message_set_rb_create(fr_message_set_t *ms, size_t size)
+{
+	if (!ms->rb_flags) return fr_ring_buffer_create(ms, size);
+
+	return fr_ring_buffer_create_mmap(ms, size, ms->rb_flags);
+}
+
 
 /** Create a message set
  *
@@ -123,6 +179,26 @@ struct fr_message_set_t {
  *	- newly allocated fr_message_set_t on success
  */
 fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_t message_size, size_t ring_buffer_size)
+{
+	return fr_message_set_create_mmap(ctx, num_messages, message_size, ring_buffer_size, 0);
+}
+
+/** Create a message set, with the packet ring buffers backed by anonymous memory mappings
+ *
+ *  All of the packet ring buffers, including the ones which are
+ *  allocated when the message set grows, use the same flags.
+ *
+ * @param[in] ctx the context for talloc
+ * @param[in] num_messages size of the initial message array.  MUST be a power of 2.
+ * @param[in] message_size the size of each message, INCLUDING fr_message_t, which MUST be at the start of the struct
+ * @param[in] ring_buffer_size of the ring buffer.  MUST be a power of 2.
+ * @param[in] rb_flags flags for fr_ring_buffer_create_mmap().  0 means to use talloc'd ring buffers.
+ * @return
+ *	- NULL on error
+ *	- newly allocated fr_message_set_t on success
+ */
+fr_message_set_t *fr_message_set_create_mmap(TALLOC_CTX *ctx, int num_messages, size_t message_size,
+					     size_t ring_buffer_size, int rb_flags)
 {
 	fr_message_set_t *ms;
 
@@ -147,8 +223,9 @@ fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_
 	message_size += 15;
 	message_size &= ~(size_t) 15;
 	ms->message_size = message_size;
+	ms->rb_flags = rb_flags;
 
-	ms->rb_array[0] = fr_ring_buffer_create(ms, ring_buffer_size);
+	ms->rb_array[0] = fr_message_set_rb_create(ms, ring_buffer_size);
 	if (!ms->rb_array[0]) {
 		talloc_free(ms);
 		return NULL;
@@ -599,6 +676,7 @@ static fr_message_t *fr_message_ring_alloc(fr_message_set_t *ms, fr_ring_buffer_
 static fr_message_t *fr_message_get_message(fr_message_set_t *ms, bool *p_cleaned)
 {
 	int i;
+	size_t size;
 	fr_message_t *m;
 	fr_ring_buffer_t *mr;
 
@@ -676,7 +754,13 @@ static fr_message_t *fr_message_get_message(fr_message_set_t *ms, bool *p_cleane
 	 *	Allocate another message ring, double the size
 	 *	of the previous maximum.
 	 */
-	mr = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
+	size = fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2;
+	if (!fr_message_set_may_grow(ms, size)) {
+		MPRINT("MESSAGE RING AT MEMORY CAP\n");
+		return NULL;
+	}
+
+	mr = fr_ring_buffer_create(ms, size);
 	if (!mr) return NULL;
 
 	/*
@@ -715,6 +799,7 @@ static fr_message_t *fr_message_get_ring_buffer(fr_message_set_t *ms, fr_message
 						bool cleaned_up)
 {
 	int i;
+	size_t size;
 	fr_ring_buffer_t *rb;
 
 	/*
@@ -795,7 +880,13 @@ alloc_rb:
 	 *	Allocate another message ring, double the size
 	 *	of the previous maximum.
 	 */
-	rb = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2);
+	size = fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2;
+	if (!fr_message_set_may_grow(ms, size)) {
+		MPRINT("RING BUFFER AT MEMORY CAP\n");
+		goto cleanup;
+	}
+
+	rb = fr_message_set_rb_create(ms, size);
 	if (!rb) goto cleanup;
 
 	MPRINT("RING BUFFER DOUBLES\n");
@@ -1049,6 +1140,11 @@ fr_message_t *fr_message_alloc_reserve(fr_message_set_t *ms, fr_message_t *m, si
 			m->status = FR_MESSAGE_DONE;
 			return NULL;
 		}
+
+		/*
+		 *	The remaining data is already in place.
+		 */
+		return m2;
 	}
 
 	/*
@@ -1191,6 +1287,104 @@ int fr_message_set_messages_used(fr_message_set_t *ms)
 	return used;
 }
 
+/** Set a cap on the memory used by a message set
+ *
+ *  Once the cap is reached, the message set stops allocating new
+ *  rings, and allocations fail instead.  Callers should check
+ *  fr_message_set_pressure() before allocating, and stop accepting
+ *  new work while the message set is under pressure.
+ *
+ *  The cap does not apply to the rings which already exist.
+ *
+ * @param[in] ms the message set
+ * @param[in] max the maximum total size of all rings, in bytes.  0 means no cap.
+ */
+void fr_message_set_memory_max(fr_message_set_t *ms, size_t max)
+{
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(ms, fr_message_set_t);
+#endif
+
+	ms->max_memory = max;
+}
+
+/** Get the memory used by a message set
+ *
+ *  The numbers include both the message rings, and the packet ring
+ *  buffers.  Messages which are done but not yet cleaned up are
+ *  counted as used.
+ *
+ * @param[in] ms the message set
+ * @param[out] mem where the sizes are written
+ */
+void fr_message_set_memory(fr_message_set_t *ms, fr_message_set_memory_t *mem)
+{
+	size_t size, used;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(ms, fr_message_set_t);
+#endif
+
+	fr_message_array_usage(ms->mr_array, ms->mr_max, &mem->size, &mem->used);
+	fr_message_array_usage(ms->rb_array, ms->rb_max, &size, &used);
+
+	mem->size += size;
+	mem->used += used;
+	mem->free = mem->size - mem->used;
+	mem->max = ms->max_memory;
+}
+
+/** Check if a message set is close to its memory cap
+ *
+ *  The set is under pressure when either the message rings or the
+ *  packet ring buffers are at least 3/4 full, and can't grow
+ *  without going over the cap.
+ *
+ *  Messages which are done are cleaned up before deciding, so this
+ *  function MUST only be called from the thread which owns the
+ *  message set.
+ *
+ * @param[in] ms the message set
+ * @return
+ *	- true if the caller should stop allocating messages
+ *	- false otherwise.
+ */
+bool fr_message_set_pressure(fr_message_set_t *ms)
+{
+	int i;
+	size_t mr_size, mr_used, rb_size, rb_used;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(ms, fr_message_set_t);
+#endif
+
+	if (!ms->max_memory) return false;
+
+	/*
+	 *	Check the numbers first, then clean up and check
+	 *	again.  That way the common case doesn't touch the
+	 *	messages at all.
+	 */
+	for (i = 0; i < 2; i++) {
+		bool mr_full, rb_full;
+
+		fr_message_array_usage(ms->mr_array, ms->mr_max, &mr_size, &mr_used);
+		fr_message_array_usage(ms->rb_array, ms->rb_max, &rb_size, &rb_used);
+
+		mr_full = ((ms->mr_max + 1) >= MSG_ARRAY_SIZE) ||
+			  ((mr_size + rb_size + (fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2)) > ms->max_memory);
+		rb_full = ((ms->rb_max + 1) >= MSG_ARRAY_SIZE) ||
+			  ((mr_size + rb_size + (fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2)) > ms->max_memory);
+
+		if (!(mr_full && ((mr_used * 4) >= (mr_size * 3))) &&
+		    !(rb_full && ((rb_used * 4) >= (rb_size * 3)))) return false;
+
+		if (i == 0) fr_message_gc(ms, 128);
+	}
+
+	return true;
+}
+
 /** Garbage collect the message set.
  *
  *  This function should ONLY be called just before freeing the
@@ -1239,6 +1433,7 @@ void fr_message_set_debug(fr_message_set_t *ms, FILE *fp)
 
 	fprintf(fp, "message arrays = %d\t(current %d)\n", ms->mr_max + 1, ms->mr_current);
 	fprintf(fp, "ring buffers   = %d\t(current %d)\n", ms->rb_max + 1, ms->rb_current);
+	if (ms->max_memory) fprintf(fp, "memory max     = %zd\n", ms->max_memory);
 
 	for (i = 0; i <= ms->mr_max; i++) {
 		fr_ring_buffer_t *mr = ms->mr_array[i];
@@ -51,7 +51,19 @@ typedef struct fr_message_t {
 	size_t			rb_size;	//!< cache-aligned size in the ring buffer
 } fr_message_t;
 
+/**
+ *  Memory used by a message set, in bytes.
+ */
+typedef struct fr_message_set_memory_t {
+	size_t			size;		//!< total size of all of the rings
+	size_t			used;		//!< bytes used in the rings
+	size_t			free;		//!< bytes free in the rings
+	size_t			max;		//!< cap on the total size of the rings, 0 for no cap
+} fr_message_set_memory_t;
+
 fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_t message_size, size_t ring_buffer_size) CC_HINT(nonnull);
+fr_message_set_t *fr_message_set_create_mmap(TALLOC_CTX *ctx, int num_messages, size_t message_size,
+					     size_t ring_buffer_size, int rb_flags) CC_HINT(nonnull);
 
 fr_message_t *fr_message_reserve(fr_message_set_t *ms, size_t reserve_size) CC_HINT(nonnull);
 fr_message_t *fr_message_alloc(fr_message_set_t *ms, fr_message_t *m, size_t actual_packet_size) CC_HINT(nonnull(1));
@@ -63,6 +75,9 @@ int fr_message_done(fr_message_t *m) CC_HINT(nonnull);
 fr_message_t *fr_message_localize(TALLOC_CTX *ctx, fr_message_t *m, size_t message_size) CC_HINT(nonnull);
 
 int fr_message_set_messages_used(fr_message_set_t *ms) CC_HINT(nonnull);
+void fr_message_set_memory_max(fr_message_set_t *ms, size_t max) CC_HINT(nonnull);
+void fr_message_set_memory(fr_message_set_t *ms, fr_message_set_memory_t *mem) CC_HINT(nonnull);
+bool fr_message_set_pressure(fr_message_set_t *ms) CC_HINT(nonnull);
 void fr_message_set_gc(fr_message_set_t *ms) CC_HINT(nonnull);
 
 void fr_message_set_debug(fr_message_set_t *ms, FILE *fp) CC_HINT(nonnull);
@@ -26,12 +26,15 @@ RCSID("$Id$")
 
 #include <talloc.h>
 
+#include <sys/socket.h>
+
 #include <freeradius-devel/event.h>
 #include <freeradius-devel/util/queue.h>
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/worker.h>
 #include <freeradius-devel/util/receiver.h>
+#include <freeradius-devel/udpfromto.h>
 
 #include <freeradius-devel/rad_assert.h>
 
@@ -44,20 +47,93 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
+/*
+ *	The initial guess at how long a worker takes to process one
+ *	packet.  This is replaced with real numbers as soon as the
+ *	worker starts sending us replies.
+ */
+#define PROCESSING_TIME_INITIAL	(NANOSEC / 10000)
+
+/*
+ *	Maximum size of a packet read from a socket.
+ */
+#define MAX_PACKET_SIZE		(4096)
+
+/*
+ *	How many replies we pull from a channel at a time.
+ */
+#define DRAIN_BURST		(32)
+
+/*
+ *	How many packets we read from a socket at a time.  Each packet
+ *	gets MAX_PACKET_SIZE of the ring buffer, so that the packets
+ *	can be read in place.
+ */
+#define RECV_BURST		(32)
+
+/*
+ *	How many replies we write to a socket at a time.
+ */
+#define SEND_BURST		(32)
+
+/*
+ *	Room for the udpfromto control messages of one packet.
+ */
+#define CMSG_BUF_SIZE		(256)
+
+/*
+ *	Default cap on the memory used by the packet message set.
+ */
+#define MEMORY_MAX		(256 * 1024 * 1024)
+
+/*
+ *	How often we check the message set while the sockets are
+ *	paused.  Replies usually wake us up sooner.
+ */
+#define PAUSE_CHECK_USEC	(10000)
+
+#define IALPHA (8)
+#define RTT(_old, _new) ((_new + ((IALPHA - 1) * _old)) / IALPHA)
+
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
 typedef struct fr_receiver_worker_t {
-	int			heap_id;		//!< workers are in a heap
 	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent
 	fr_time_t		processing_time;	//!< predicted processing time for one packet
 
+	uint64_t		num_outstanding;	//!< number of requests sent to the worker, with no reply
+	fr_time_t		predicted;		//!< predicted time to process all outstanding requests
+
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
+
+	int			heap_id;		//!< workers are in a heap.  Not the first
+							//!< field, as fr_heap treats offset 0 as "no index".
+	bool			closing;		//!< no new requests, close the channel once it's idle
+	fr_dlist_t		entry;			//!< in the list of all workers
 } fr_receiver_worker_t;
 
+/**
+ *  A message asking the receiver to start or stop using a worker.
+ */
+typedef struct fr_receiver_worker_msg_t {
+	fr_worker_t		*worker;		//!< the worker
+	bool			add;			//!< add the worker, or remove it
+} fr_receiver_worker_msg_t;
+
 typedef struct fr_receiver_socket_t {
 	int			fd;			//!< the file descriptor
 	void			*ctx;			//!< transport context
 	fr_transport_t		*transport;		//!< the transport
 	int			heap_id;		//!< for the heap
+
+	struct sockaddr_storage	local;			//!< the address the socket is bound to
+	socklen_t		local_len;		//!< length of the local address
+
+	bool			recv;			//!< read with fr_event_recv_insert()
+	bool			paused;			//!< not being read
+
+	fr_dlist_t		entry;			//!< in the list of all sockets
 } fr_receiver_socket_t;
 
 
@@ -72,14 +148,29 @@ struct fr_receiver_t {
 
 	fr_event_list_t		*el;			//!< our event list
 
+	fr_message_set_t	*ms;			//!< message buffers for packets we read from the network
+
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
-	fr_heap_t		*workers;		//!< workers, ordered by total CPU time spent
+	fr_heap_t		*workers;		//!< workers, ordered by predicted backlog
 	fr_heap_t		*closing;		//!< workers which are being closed
+	fr_dlist_t		worker_list;		//!< all workers, including ones which are being closed
+
+	int			num_workers;		//!< number of workers we're sending packets to
 
 	uint64_t		num_requests;		//!< number of requests we sent
 	uint64_t		num_replies;		//!< number of replies we received
+	uint64_t		num_dropped;		//!< number of packets we read, but had no memory for
+
+	fr_log_t const		*log;			//!< where errors are logged
+
+	bool			io_uring;		//!< let the kernel receive packets with io_uring, where possible
+
+	bool			paused;			//!< not reading the sockets, because of memory pressure
+	uint64_t		num_paused;		//!< number of times we paused the sockets
+	fr_event_timer_t	*pause_ev;		//!< re-check the memory pressure while paused
 
 	fr_heap_t		*sockets;		//!< list of sockets we're managing
+	fr_dlist_t		socket_list;		//!< list of sockets, for pausing and resuming them
 
 	uint32_t		num_transports;		//!< how many transport layers we have
 	fr_transport_t		**transports;		//!< array of active transports.
@@ -97,11 +188,19 @@ static int socket_cmp(void const *one, void const *two)
 	return 0;
 }
 
+/*
+ *	Order the workers by how much work they have queued up.  If
+ *	two workers have the same backlog, prefer the one which has
+ *	used less CPU time.
+ */
 static int worker_cmp(void const *one, void const *two)
 {
 	fr_receiver_worker_t const *a = one;
 	fr_receiver_worker_t const *b = two;
 
+	if (a->predicted < b->predicted) return -1;
+	if (a->predicted > b->predicted) return +1;
+
 	if (a->cpu_time < b->cpu_time) return -1;
 	if (a->cpu_time > b->cpu_time) return +1;
 
@@ -122,6 +221,42 @@ static int reply_cmp(void const *one, void const *two)
 	return 0;
 }
 
+/** Update the receivers view of a worker, from a reply it sent us.
+ *
+ *  The worker is re-ordered in the heap, so that the next request
+ *  goes to the worker with the smallest predicted backlog.
+ *
+ * @param[in] rc the receiver
+ * @param[in] w the worker which sent the reply
+ * @param[in] cd the reply
+ */
+static void fr_receiver_worker_update(fr_receiver_t *rc, fr_receiver_worker_t *w, fr_channel_data_t const *cd)
+{
+	int in_heap;
+	fr_heap_t *heap = w->closing ? rc->closing : rc->workers;
+
+	/*
+	 *	The worker may have been popped off of the heap by
+	 *	fr_receiver_send_request().  If so, the caller will
+	 *	insert it back.
+	 */
+	in_heap = fr_heap_extract(heap, w);
+
+	if (w->num_outstanding > 0) w->num_outstanding--;
+
+	/*
+	 *	NAKs have zero processing time, so we ignore them for
+	 *	the purpose of predicting processing time.
+	 */
+	if (cd->reply.processing_time) {
+		w->processing_time = RTT(w->processing_time, cd->reply.processing_time);
+	}
+	w->cpu_time = cd->reply.cpu_time;
+	w->predicted = w->num_outstanding * w->processing_time;
+
+	if (in_heap) (void) fr_heap_insert(heap, w);
+}
+
 /** Drain the input channel
  *
  * @param[in] rc the receiver
@@ -130,35 +265,50 @@ static int reply_cmp(void const *one, void const *two)
  */
 static void fr_receiver_drain_input(fr_receiver_t *rc, fr_channel_t *ch, fr_channel_data_t *cd)
 {
-	if (!cd) {
-		cd = fr_channel_recv_reply(ch);
-		if (!cd) {
+	int i, num;
+	fr_receiver_worker_t *w;
+	fr_channel_data_t *burst[DRAIN_BURST];
+
+	if (cd) {
+		burst[0] = cd;
+		num = 1;
+	} else {
+		num = fr_channel_recv_reply_n(ch, burst, DRAIN_BURST);
+		if (!num) {
 			MPRINT("\tno data?\n");
 			return;
 		}
 	}
 
+	w = fr_channel_master_ctx_get(ch);
+	rad_assert(w != NULL);
+
 	do {
-		rc->num_replies++;
-		MPRINT("MASTER received reply %zd\n", rc->num_replies);
+		for (i = 0; i < num; i++) {
+			cd = burst[i];
 
-		cd->channel.ch = ch;
-		(void) fr_heap_insert(rc->replies, cd);
-	} while ((cd = fr_channel_recv_reply(ch)) != NULL);
+			rc->num_replies++;
+			MPRINT("MASTER received reply %zd\n", rc->num_replies);
 
-	/*
-	 *	@todo get CPU time and processing time from the message, and update the worker.
-	 */
+			fr_receiver_worker_update(rc, w, cd);
+
+			cd->channel.ch = ch;
+			(void) fr_heap_insert(rc->replies, cd);
+		}
+	} while ((num = fr_channel_recv_reply_n(ch, burst, DRAIN_BURST)) > 0);
 }
 
-#if 0
 /** Send a message on the "best" channel.
  *
  * @param rc the receiver
  * @param cd the message we've received
+ * @return
+ *	- <0 on error, or no channel could accept the message
+ *	- 0 on success
  */
 static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 {
+	int rcode;
 	fr_receiver_worker_t *worker;
 	fr_channel_data_t *reply;
 
@@ -167,10 +317,10 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 #endif
 
 	/*
-	 *	Grab the worker with the least total CPU time.
+	 *	Grab the worker with the smallest predicted backlog.
 	 */
 	worker = fr_heap_pop(rc->workers);
-	if (!worker) return 0;
+	if (!worker) return -1;
 
 	/*
 	 *	Send the message to the channel.  If we fail, recurse.
@@ -186,29 +336,30 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 	 *	allocate another one, and hand it to the scheduler.
 	 */
 	if (fr_channel_send_request(worker->channel, cd, &reply) < 0) {
-		int rcode;
-
 		rcode = fr_receiver_send_request(rc, cd);
 
 		/*
-		 *	Mark this channel as still busy, for some
-		 *	future time.  This process ensures that we
-		 *	don't immediately pop it off the heap and try
-		 *	to send it another request.
+		 *	The send failed, so the worker isn't servicing
+		 *	it's queue.  Insert it back into the heap, and
+		 *	drain any replies it did manage to send us.
+		 *	The replies will re-order the heap based on
+		 *	the workers actual load.
 		 */
-		worker->cpu_time = cd->m.when + worker->processing_time;
 		(void) fr_heap_insert(rc->workers, worker);
+		if (reply) fr_receiver_drain_input(rc, worker->channel, reply);
 
 		return rcode;
 	}
 
 	/*
-	 *	We're projecting that the worker will use more CPU
-	 *	time to process this request.  The CPU time will be
-	 *	updated with a more accurate number when we receive a
+	 *	We're projecting that the worker will spend more time
+	 *	processing this request.  The prediction will be
+	 *	updated with more accurate numbers when we receive a
 	 *	reply from this channel.
 	 */
-	worker->cpu_time += worker->processing_time;
+	worker->num_outstanding++;
+	worker->predicted = worker->num_outstanding * worker->processing_time;
+	rc->num_requests++;
 
 	/*
 	 *	Insert the worker back into the heap of workers.
@@ -223,13 +374,197 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 
 	return 0;
 }
+
+/** Send a burst of replies to one socket
+ *
+ * @param[in] sockfd the socket to write to
+ * @param[in] burst the replies to send
+ * @param[in] num the number of replies
+ */
+static void fr_receiver_send_replies(int sockfd, fr_channel_data_t **burst, int num)
+{
+	int i;
+#if defined(HAVE_SENDMMSG) && defined(WITH_UDPFROMTO)
+	int			sent;
+	struct mmsghdr		msgs[SEND_BURST];
+	struct iovec		iov[SEND_BURST];
+	udpfromto_mmsg_t	addr[SEND_BURST];
+#else
+	struct sockaddr_storage	to[SEND_BURST];
+	socklen_t		to_len;
+#  ifdef HAVE_SENDMMSG
+	int			sent, rcode;
+	struct mmsghdr		msgs[SEND_BURST];
+	struct iovec		iov[SEND_BURST];
+#  endif
+#  ifdef WITH_UDPFROMTO
+	struct sockaddr_storage	from;
+	socklen_t		from_len;
+#  endif
 #endif
 
+	rad_assert(num <= SEND_BURST);
+
+#if defined(HAVE_SENDMMSG) && defined(WITH_UDPFROMTO)
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+
+	for (i = 0; i < num; i++) {
+		fr_channel_address_t *address = &burst[i]->address;
+
+		iov[i].iov_base = burst[i]->m.data;
+		iov[i].iov_len = burst[i]->m.data_size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+		if (fr_ipaddr_to_sockaddr(&address->dst_ipaddr, address->dst_port,
+					  &addr[i].to, &addr[i].to_len) < 0) {
+			addr[i].to_len = 0;
+		}
+
+		/*
+		 *	Send the reply from the address the request was
+		 *	sent to, for sockets bound to a wildcard address.
+		 */
+		addr[i].if_index = address->if_index;
+		if (fr_is_inaddr_any(&address->src_ipaddr) ||
+		    (fr_ipaddr_to_sockaddr(&address->src_ipaddr, address->src_port,
+					   &addr[i].from, &addr[i].from_len) < 0)) {
+			addr[i].from_len = 0;
+		}
+	}
+
+	/*
+	 *	If the socket is full, the rest of the replies are
+	 *	dropped, just as sendto() would drop them.
+	 */
+	sent = sendmmsgfromto(sockfd, msgs, addr, num, MSG_DONTWAIT);
+	if (sent < num) {
+		MPRINT("MASTER failed sending %d replies\n", (sent < 0) ? num : num - sent);
+	}
+#else
+#  ifdef HAVE_SENDMMSG
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+#  endif
+
+	for (i = 0; i < num; i++) {
+		fr_channel_address_t *address = &burst[i]->address;
+
+		if (fr_ipaddr_to_sockaddr(&address->dst_ipaddr, address->dst_port, &to[i], &to_len) < 0) {
+			to_len = 0;
+		}
+
+#  ifdef HAVE_SENDMMSG
+		iov[i].iov_base = burst[i]->m.data;
+		iov[i].iov_len = burst[i]->m.data_size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &to[i];
+		msgs[i].msg_hdr.msg_namelen = to_len;
+#  elif defined(WITH_UDPFROMTO)
+		if (fr_is_inaddr_any(&address->src_ipaddr) ||
+		    (fr_ipaddr_to_sockaddr(&address->src_ipaddr, address->src_port, &from, &from_len) < 0)) {
+			from_len = 0;
+		}
+
+		(void) sendfromto(sockfd, burst[i]->m.data, burst[i]->m.data_size, 0,
+				  (struct sockaddr *) &from, from_len,
+				  (struct sockaddr *) &to[i], to_len, address->if_index);
+#  else
+		(void) sendto(sockfd, burst[i]->m.data, burst[i]->m.data_size, 0,
+			      (struct sockaddr *) &to[i], to_len);
+#  endif
+	}
+
+#  ifdef HAVE_SENDMMSG
+	/*
+	 *	sendmmsg() may send only part of the burst.  Keep
+	 *	going until it's all sent, or the socket is full.  If
+	 *	the socket is full, the remaining replies are dropped,
+	 *	just as sendto() would drop them.
+	 */
+	sent = 0;
+	while (sent < num) {
+		rcode = sendmmsg(sockfd, &msgs[sent], num - sent, MSG_DONTWAIT);
+		if (rcode <= 0) {
+			MPRINT("MASTER failed sending %d replies\n", num - sent);
+			break;
+		}
+		sent += rcode;
+	}
+#  endif
+#endif
+
+	for (i = 0; i < num; i++) {
+		fr_message_done(&burst[i]->m);
+	}
+}
+
+/** Send all of the pending replies
+ *
+ *  The replies are taken from the heap in priority order.
+ *  Consecutive replies for the same socket are written with one
+ *  system call.
+ *
+ * @param[in] rc the receiver
+ */
+static void fr_receiver_flush_replies(fr_receiver_t *rc)
+{
+	int num = 0;
+	fr_channel_data_t *cd;
+	fr_channel_data_t *burst[SEND_BURST];
+
+	while ((cd = fr_heap_pop(rc->replies)) != NULL) {
+		/*
+		 *	Replies which can't be sent are dropped.
+		 */
+		if (cd->address.dst_ipaddr.af == AF_UNSPEC) {
+			fr_message_done(&cd->m);
+			continue;
+		}
+
+		if ((num == SEND_BURST) ||
+		    ((num > 0) && (burst[0]->address.sockfd != cd->address.sockfd))) {
+			fr_receiver_send_replies(burst[0]->address.sockfd, burst, num);
+			num = 0;
+		}
+
+		burst[num++] = cd;
+	}
+
+	if (num > 0) fr_receiver_send_replies(burst[0]->address.sockfd, burst, num);
+}
+
+/** Close the channels to workers which are being removed
+ *
+ *  We wait until the worker has replied to all of our requests, and
+ *  the replies have been sent.  Otherwise the worker would free the
+ *  replies out from under us.
+ *
+ *  The closing workers are ordered by backlog, so the idle ones are
+ *  at the top of the heap.
+ *
+ * @param[in] rc the receiver
+ */
+static void fr_receiver_close_workers(fr_receiver_t *rc)
+{
+	fr_receiver_worker_t *w;
+
+	while (((w = fr_heap_peek(rc->closing)) != NULL) && !w->num_outstanding) {
+		(void) fr_heap_pop(rc->closing);
+
+		MPRINT("MASTER closing channel to worker %p\n", w->worker);
+		(void) fr_channel_signal_worker_close(w->channel);
+	}
+}
+
 /** Run the event loop 'idle' callback
  *
- *  This function MUST DO NO WORK.  All it does is check if there's
- *  work, and tell the event code to return to the main loop if
- *  there's work to do.
+ *  This function is called on every pass through the event loop.
+ *  The only work it does is to send the replies which were
+ *  received during the last pass, so that they can be written to
+ *  the network in bursts.  Otherwise, all it does is check if
+ *  there's work, and tell the event code to return to the main
+ *  loop if there's work to do.
  *
  * @param[in] ctx the receiver
  * @param[in] wake the time when the event loop will wake up.
@@ -242,7 +577,9 @@ static int fr_receiver_idle(void *ctx, struct timeval *wake)
 	talloc_get_type_abort(rc, fr_receiver_t);
 #endif
 
-	rad_cond_assert(rc->el != NULL); /* temporary until we actually use rc here */
+	if (fr_heap_num_elements(rc->replies) > 0) fr_receiver_flush_replies(rc);
+
+	if (fr_heap_num_elements(rc->closing) > 0) fr_receiver_close_workers(rc);
 
 	if (!wake) {
 		// ready to process requests
@@ -306,26 +643,569 @@ static void fr_receiver_channel_callback(void *ctx, void const *data, size_t dat
 		break;
 
 	case FR_CHANNEL_CLOSE:
+	{
+		fr_receiver_worker_t *w;
+
 		MPRINT("MASTER aq channel close\n");
-		///
+		rad_assert(ch != NULL);
+
+		/*
+		 *	The worker has acknowledged the close, and
+		 *	won't touch the channel again.
+		 */
+		w = fr_channel_master_ctx_get(ch);
+		rad_assert(w != NULL);
+		rad_assert(w->closing);
+
+		FR_DLIST_REMOVE(w->entry);
+		talloc_free(w);
+	}
 		break;
 	}
 }
 
-static void fr_receiver_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED void *ctx)
+/** Stop sending requests to a worker, and close the channel to it
+ *
+ *  The channel is closed once all outstanding requests have been
+ *  replied to.
+ *
+ * @param[in] rc the receiver
+ * @param[in] worker the worker to remove
+ * @return
+ *	- <0 if we aren't using the worker
+ *	- 0 on success
+ */
+static int fr_receiver_worker_remove(fr_receiver_t *rc, fr_worker_t *worker)
 {
-//	fr_receiver_socket_t *m = ctx;
-//	fr_receiver_t *rc = talloc_parent(m);
+	fr_dlist_t *entry;
+
+	for (entry = FR_DLIST_FIRST(rc->worker_list);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(rc->worker_list, entry)) {
+		fr_receiver_worker_t *w;
+
+		w = fr_ptr_to_type(fr_receiver_worker_t, entry, entry);
+		if ((w->worker != worker) || w->closing) continue;
+
+		(void) fr_heap_extract(rc->workers, w);
+		rc->num_workers--;
+
+		w->closing = true;
+		(void) fr_heap_insert(rc->closing, w);
+		return 0;
+	}
+
+	return -1;
+}
+
+/** Handle a control message asking us to add or remove a worker
+ *
+ * @param[in] ctx the receiver
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_receiver_worker_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_receiver_t *rc = ctx;
+	fr_receiver_worker_msg_t msg;
+
+	rad_assert(data_size == sizeof(msg));
+
+	if (data_size != sizeof(msg)) return;
+
+	memcpy(&msg, data, sizeof(msg));
+
+	if (msg.add) {
+		if (fr_receiver_worker_add(rc, msg.worker) < 0) {
+			MPRINT("MASTER failed adding worker %p\n", msg.worker);
+		}
+		return;
+	}
+
+	if (fr_receiver_worker_remove(rc, msg.worker) < 0) {
+		MPRINT("MASTER asked to remove unknown worker %p\n", msg.worker);
+	}
+}
+
+/** Fill in the addressing information for a packet we've read
+ *
+ * @param[in] s the socket the packet was read from
+ * @param[out] address the addressing information
+ * @param[in] from the source address of the packet
+ * @param[in] from_len length of the source address
+ * @param[in] msgh the message header from recvmsg(), or NULL
+ */
+static void fr_receiver_address(fr_receiver_socket_t *s, fr_channel_address_t *address,
+				struct sockaddr_storage const *from, socklen_t from_len,
+				UNUSED struct msghdr *msgh)
+{
+	struct sockaddr_storage to;
+	socklen_t to_len;
+
+	memset(address, 0, sizeof(*address));
+	address->sockfd = s->fd;
+
+	if (fr_ipaddr_from_sockaddr(from, from_len, &address->src_ipaddr, &address->src_port) < 0) {
+		address->src_ipaddr.af = AF_UNSPEC;
+		address->dst_ipaddr.af = AF_UNSPEC;
+		return;
+	}
+
+	/*
+	 *	Start with the address the socket is bound to.  If
+	 *	it's a wildcard, udpfromto tells us the real one.
+	 */
+	memcpy(&to, &s->local, s->local_len);
+	to_len = s->local_len;
+
+#ifdef WITH_UDPFROMTO
+	if (msgh) udpfromto_cmsg_to(msgh, (struct sockaddr *) &to, &to_len, &address->if_index, NULL);
+#endif
+
+	/*
+	 *	The reply address is the source of the request, so
+	 *	this only affects which address we reply from.
+	 */
+	if (fr_ipaddr_from_sockaddr(&to, to_len, &address->dst_ipaddr, &address->dst_port) < 0) {
+		memset(&address->dst_ipaddr, 0, sizeof(address->dst_ipaddr));
+		address->dst_ipaddr.af = address->src_ipaddr.af;
+	}
+}
+
+/** Find the traffic class of a packet we've read
+ *
+ * @param[in] s the socket the packet was read from
+ * @param[in] cd the message containing the packet
+ * @return the traffic class
+ */
+static inline fr_channel_class_t fr_receiver_classify(fr_receiver_socket_t *s, fr_channel_data_t *cd)
+{
+	fr_channel_class_t tc;
+
+	if (!s->transport->classify) return FR_CHANNEL_CLASS_AUTH;
+
+	tc = s->transport->classify(s->ctx, cd->m.data, cd->m.data_size);
+	if (tc >= FR_CHANNEL_CLASS_MAX) return FR_CHANNEL_CLASS_AUTH;
+
+	return tc;
+}
+
+static struct timeval const pause_check = { 0, PAUSE_CHECK_USEC };
+
+static void fr_receiver_pause(fr_receiver_t *rc);
+static void fr_receiver_pause_check(struct timeval *now, void *ctx);
+
+/** Read a packet from a socket, and send it to a worker.
+ *
+ * @param[in] el the event list
+ * @param[in] sockfd the socket which is ready to read
+ * @param[in] ctx the fr_receiver_socket_t
+ */
+static void fr_receiver_read(UNUSED fr_event_list_t *el, int sockfd, void *ctx)
+{
+	fr_receiver_socket_t *s = ctx;
+	fr_receiver_t *rc = talloc_parent(s);
+	fr_channel_data_t *cd;
+	fr_time_t now;
+#ifdef HAVE_RECVMMSG
+	int i, num;
+	fr_channel_data_t *next;
+	struct mmsghdr msgs[RECV_BURST];
+	struct iovec iov[RECV_BURST];
+	struct sockaddr_storage from[RECV_BURST];
+#  ifdef WITH_UDPFROMTO
+	char cbuf[RECV_BURST][CMSG_BUF_SIZE];
+#  endif
+#else
 	ssize_t data_size;
 	struct sockaddr_storage ss;
 	socklen_t salen = sizeof(ss);
-	uint8_t buffer[256];
+#endif
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(rc, fr_receiver_t);
+#endif
+
+	/*
+	 *	The workers aren't keeping up, and the message set is
+	 *	nearly at its memory cap.  Stop reading, and let the
+	 *	kernel buffer the packets.
+	 */
+	if (fr_message_set_pressure(rc->ms)) {
+		fr_receiver_pause(rc);
+		return;
+	}
+
+#ifdef HAVE_RECVMMSG
+	/*
+	 *	Reserve room for a full burst, and read the packets
+	 *	directly into the ring buffer.
+	 */
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, RECV_BURST * MAX_PACKET_SIZE);
+	if (!cd) {
+		MPRINT("MASTER failed reserving message\n");
+		return;
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RECV_BURST; i++) {
+		iov[i].iov_base = cd->m.data + (i * MAX_PACKET_SIZE);
+		iov[i].iov_len = MAX_PACKET_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+#  ifdef WITH_UDPFROMTO
+		msgs[i].msg_hdr.msg_control = cbuf[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+#  endif
+	}
+
+	num = recvmmsg(sockfd, msgs, RECV_BURST, MSG_DONTWAIT, NULL);
+	if (num <= 0) {
+		(void) fr_message_alloc(rc->ms, &cd->m, 0);
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	now = fr_time();
+
+	for (i = 0; i < num; i++) {
+		next = NULL;
+
+		if (!cd) {
+			/*
+			 *	Splitting the burst failed, so the
+			 *	remaining packets are no longer in a
+			 *	reserved message.  Copy each one to a new
+			 *	message.  That may start at, or before
+			 *	the packet, so the copy can overlap.
+			 */
+			cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, MAX_PACKET_SIZE);
+			if (!cd) {
+				rc->num_dropped += num - i;
+				fr_log(rc->log, L_ERR, "Receiver failed reserving message, dropping %d packets\n", num - i);
+				break;
+			}
+			memmove(cd->m.data, iov[i].iov_base, msgs[i].msg_len);
+			(void) fr_message_alloc(rc->ms, &cd->m, msgs[i].msg_len);
+
+		/*
+		 *	Each packet keeps its MAX_PACKET_SIZE slot, so
+		 *	that the next message starts exactly where
+		 *	the next packet was read.  The last packet
+		 *	only needs as much room as it actually uses.
+		 *
+		 *	If we can't split the burst, this packet still
+		 *	has its slot, and the rest are copied above.
+		 */
+		} else if (i < (num - 1)) {
+			next = (fr_channel_data_t *) fr_message_alloc_reserve(rc->ms, &cd->m, MAX_PACKET_SIZE,
+									      (num - i - 1) * MAX_PACKET_SIZE);
+			if (!next) {
+				MPRINT("MASTER failed splitting burst\n");
+			}
+			rad_assert(!next || (next->m.data == (cd->m.data + MAX_PACKET_SIZE)));
+		} else {
+			(void) fr_message_alloc(rc->ms, &cd->m, msgs[i].msg_len);
+		}
 
-	data_size = recvfrom(sockfd, buffer, sizeof(buffer), 0,
+		cd->m.data_size = msgs[i].msg_len;
+		cd->m.when = now;
+		cd->ctx = s->ctx;
+		cd->transport = s->transport->id;
+		cd->priority = 0;
+		cd->traffic_class = fr_receiver_classify(s, cd);
+		cd->request.start_time = NULL;
+		fr_receiver_address(s, &cd->address, &from[i], msgs[i].msg_hdr.msg_namelen, &msgs[i].msg_hdr);
+
+		/*
+		 *	No worker could take the packet.  Drop it.
+		 */
+		if (fr_receiver_send_request(rc, cd) < 0) {
+			MPRINT("MASTER failed sending request\n");
+			fr_message_done(&cd->m);
+		}
+
+		cd = next;
+	}
+
+#else
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, MAX_PACKET_SIZE);
+	if (!cd) {
+		MPRINT("MASTER failed reserving message\n");
+		return;
+	}
+
+	data_size = recvfrom(sockfd, cd->m.data, cd->m.rb_size, 0,
 			     (struct sockaddr *) &ss, &salen);
-	fprintf(stderr, "Got packet size %zd\n", data_size);
+	if (data_size <= 0) {
+		(void) fr_message_alloc(rc->ms, &cd->m, 0);
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	(void) fr_message_alloc(rc->ms, &cd->m, data_size);
+
+	now = fr_time();
+
+	cd->m.when = now;
+	cd->ctx = s->ctx;
+	cd->transport = s->transport->id;
+	cd->priority = 0;
+	cd->traffic_class = fr_receiver_classify(s, cd);
+	cd->request.start_time = NULL;
+	fr_receiver_address(s, &cd->address, &ss, salen, NULL);
+
+	/*
+	 *	No worker could take the packet.  Drop it.
+	 */
+	if (fr_receiver_send_request(rc, cd) < 0) {
+		MPRINT("MASTER failed sending request\n");
+		fr_message_done(&cd->m);
+	}
+#endif
+}
+
+/** Handle a packet which the kernel received for us
+ *
+ *  The packet is in an event list buffer, so we copy it to the
+ *  message set.
+ *
+ * @param[in] el the event list
+ * @param[in] sockfd the socket the packet was received on
+ * @param[in] msg the name and control data
+ * @param[in] data the packet
+ * @param[in] data_len the length of the packet
+ * @param[in] ctx the fr_receiver_socket_t
+ */
+static void fr_receiver_recv(UNUSED fr_event_list_t *el, UNUSED int sockfd, struct msghdr *msg,
+			     uint8_t *data, size_t data_len, void *ctx)
+{
+	fr_receiver_socket_t *s = ctx;
+	fr_receiver_t *rc = talloc_parent(s);
+	fr_channel_data_t *cd;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(rc, fr_receiver_t);
+#endif
+
+	if (data_len == 0) return;
+
+	/*
+	 *	The kernel has already taken this packet off of the
+	 *	socket, so we deliver it if we can.  The rest wait
+	 *	in the kernel until we resume.
+	 */
+	if (fr_message_set_pressure(rc->ms)) fr_receiver_pause(rc);
+
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, data_len);
+	if (!cd) {
+		MPRINT("MASTER failed reserving message\n");
+		return;
+	}
+
+	memcpy(cd->m.data, data, data_len);
+	(void) fr_message_alloc(rc->ms, &cd->m, data_len);
+
+	cd->m.when = fr_time();
+	cd->ctx = s->ctx;
+	cd->transport = s->transport->id;
+	cd->priority = 0;
+	cd->traffic_class = fr_receiver_classify(s, cd);
+	cd->request.start_time = NULL;
+	fr_receiver_address(s, &cd->address, msg->msg_name, msg->msg_namelen, msg);
+
+	/*
+	 *	No worker could take the packet.  Drop it.
+	 */
+	if (fr_receiver_send_request(rc, cd) < 0) {
+		MPRINT("MASTER failed sending request\n");
+		fr_message_done(&cd->m);
+	}
+}
+
+static void fr_receiver_recv_error(fr_event_list_t *el, int sockfd, void *ctx);
+
+/** Start reading from a socket
+ *
+ * @param[in] rc the receiver
+ * @param[in] s the socket
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_receiver_listen(fr_receiver_t *rc, fr_receiver_socket_t *s)
+{
+	if (rc->io_uring &&
+	    (fr_event_recv_insert(rc->el, s->fd, MAX_PACKET_SIZE, CMSG_BUF_SIZE,
+				  fr_receiver_recv, fr_receiver_recv_error, s) == 0)) {
+		s->recv = true;
+		return 0;
+	}
+
+	s->recv = false;
+	return fr_event_fd_insert(rc->el, s->fd, fr_receiver_read, NULL, NULL, s);
+}
+
+/** Stop reading from a socket
+ *
+ * @param[in] rc the receiver
+ * @param[in] s the socket
+ */
+static void fr_receiver_unlisten(fr_receiver_t *rc, fr_receiver_socket_t *s)
+{
+	if (s->recv) {
+		(void) fr_event_recv_delete(rc->el, s->fd);
+		return;
+	}
 
-	fprintf(stderr, "READ FROM SOCKET %d - %zd bytes\n", sockfd, data_size);
+	(void) fr_event_fd_delete(rc->el, s->fd);
+}
+
+/** The kernel can't receive packets for us on this socket
+ *
+ *  Go back to reading the socket ourselves.  The socket has already
+ *  been removed from the event list.
+ *
+ * @param[in] el the event list
+ * @param[in] sockfd the socket
+ * @param[in] ctx the fr_receiver_socket_t
+ */
+static void fr_receiver_recv_error(fr_event_list_t *el, int sockfd, void *ctx)
+{
+	fr_receiver_socket_t *s = ctx;
+	fr_receiver_t *rc = talloc_parent(s);
+	struct timeval when;
+
+	MPRINT("MASTER falling back to reading socket %d\n", sockfd);
+
+	s->recv = false;
+	if (fr_event_fd_insert(el, sockfd, fr_receiver_read, NULL, NULL, s) == 0) return;
+
+	fr_log(rc->log, L_ERR, "Receiver failed re-adding socket %d: %s\n", sockfd, fr_strerror());
+
+	/*
+	 *	Pause the socket, so that fr_receiver_pause_check()
+	 *	tries to add it again.
+	 */
+	s->paused = true;
+	if (rc->pause_ev) return;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &pause_check);
+
+	if (fr_event_timer_insert(el, fr_receiver_pause_check, rc, &when, &rc->pause_ev) < 0) {
+		fr_log(rc->log, L_ERR, "Receiver failed scheduling retry, socket %d will not be read: %s\n",
+		       sockfd, fr_strerror());
+	}
+}
+
+/** Check if the paused sockets can be read again
+ *
+ * @param[in] now the current time
+ * @param[in] ctx the receiver
+ */
+static void fr_receiver_pause_check(UNUSED struct timeval *now, void *ctx)
+{
+	fr_receiver_t *rc = ctx;
+	fr_dlist_t *entry;
+	struct timeval when;
+	int failed = 0;
+
+	rc->pause_ev = NULL;
+
+	if (fr_message_set_pressure(rc->ms)) {
+		gettimeofday(&when, NULL);
+		fr_timeval_add(&when, &when, &pause_check);
+
+		if (fr_event_timer_insert(rc->el, fr_receiver_pause_check, rc, &when, &rc->pause_ev) == 0) return;
+
+		/*
+		 *	We can't check again later, so resume now.
+		 *	The next read will pause the sockets again if
+		 *	they need to be paused.
+		 */
+	}
+
+	MPRINT("MASTER resuming sockets\n");
+
+	for (entry = FR_DLIST_FIRST(rc->socket_list);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(rc->socket_list, entry)) {
+		fr_receiver_socket_t *s;
+
+		s = fr_ptr_to_type(fr_receiver_socket_t, entry, entry);
+		if (!s->paused) continue;
+
+		if (fr_receiver_listen(rc, s) < 0) {
+			fr_log(rc->log, L_ERR, "Receiver failed resuming socket %d: %s\n", s->fd, fr_strerror());
+			failed++;
+			continue;
+		}
+		s->paused = false;
+	}
+
+	rc->paused = false;
+
+	/*
+	 *	Sockets which couldn't be resumed stay paused, and we
+	 *	try them again later.
+	 */
+	if (!failed) return;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &pause_check);
+
+	if (fr_event_timer_insert(rc->el, fr_receiver_pause_check, rc, &when, &rc->pause_ev) < 0) {
+		fr_log(rc->log, L_ERR, "Receiver failed scheduling retry, %d sockets will not be read: %s\n",
+		       failed, fr_strerror());
+	}
+}
+
+/** Stop reading from the sockets
+ *
+ *  The sockets are resumed once the message set is no longer under
+ *  memory pressure.
+ *
+ * @param[in] rc the receiver
+ */
+static void fr_receiver_pause(fr_receiver_t *rc)
+{
+	fr_dlist_t *entry;
+	struct timeval when;
+
+	if (rc->paused) return;
+
+	MPRINT("MASTER pausing sockets\n");
+
+	/*
+	 *	If we can't check again later, we can't pause.  The
+	 *	check may already be scheduled, to retry sockets which
+	 *	couldn't be resumed.
+	 */
+	if (!rc->pause_ev) {
+		gettimeofday(&when, NULL);
+		fr_timeval_add(&when, &when, &pause_check);
+
+		if (fr_event_timer_insert(rc->el, fr_receiver_pause_check, rc, &when, &rc->pause_ev) < 0) return;
+	}
+
+	for (entry = FR_DLIST_FIRST(rc->socket_list);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(rc->socket_list, entry)) {
+		fr_receiver_socket_t *s;
+
+		s = fr_ptr_to_type(fr_receiver_socket_t, entry, entry);
+		if (s->paused) continue;
+
+		fr_receiver_unlisten(rc, s);
+		s->paused = true;
+	}
+
+	rc->paused = true;
+	rc->num_paused++;
 }
 
 /** Handle a receiver control message callback for a new socket
@@ -348,13 +1228,34 @@ static void fr_receiver_socket_callback(void *ctx, void const *data, size_t data
 	rad_assert(m != NULL);
 	memcpy(m, data, sizeof(*m));
 
-	if (fr_event_fd_insert(rc->el, m->fd, fr_receiver_read, NULL, NULL, m) < 0) {
+	/*
+	 *	Remember where the socket is bound, so that replies
+	 *	can be sent from the right address.
+	 */
+	m->local_len = sizeof(m->local);
+	if (getsockname(m->fd, (struct sockaddr *) &m->local, &m->local_len) < 0) {
+		memset(&m->local, 0, sizeof(m->local));
+		m->local_len = sizeof(m->local);
+	}
+
+#ifdef WITH_UDPFROMTO
+	(void) udpfromto_init(m->fd);
+#endif
+
+	/*
+	 *	If we're paused, the socket is added to the event
+	 *	list when the other sockets are resumed.
+	 */
+	m->recv = false;
+	m->paused = rc->paused;
+	if (!rc->paused && (fr_receiver_listen(rc, m) < 0)) {
 		fprintf(stderr, "FAILED ADDING NEW SOCKET\n");
 		close(m->fd);
 		return;
 	}
 
 	(void) fr_heap_insert(rc->sockets, m);
+	FR_DLIST_INSERT_TAIL(rc->socket_list, m->entry);
 
 	fprintf(stderr, "GOT NEW SOCKET\n");
 }
@@ -407,6 +1308,11 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 	rc = talloc_zero(ctx, fr_receiver_t);
 	if (!rc) return NULL;
 
+	FR_DLIST_INIT(rc->worker_list);
+	FR_DLIST_INIT(rc->socket_list);
+
+	rc->log = &default_log;
+
 	rc->el = fr_event_list_create(rc, fr_receiver_idle, rc);
 	if (!rc->el) {
 		talloc_free(rc);
@@ -434,16 +1340,38 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 		return NULL;
 	}
 
+	/*
+	 *	@todo make these configurable
+	 */
+	rc->ms = fr_message_set_create_mmap(rc, 1024, sizeof(fr_channel_data_t), (1 << 20),
+					    FR_RING_BUFFER_HUGE_PAGES | FR_RING_BUFFER_POPULATE);
+	if (!rc->ms) {
+		talloc_free(rc);
+		return NULL;
+	}
+	fr_message_set_memory_max(rc->ms, MEMORY_MAX);
+
 	if (fr_control_callback_add(rc->control, FR_CONTROL_ID_CHANNEL, rc, fr_receiver_channel_callback) < 0) {
 		talloc_free(rc);
 		return NULL;
 	}
 
+	/*
+	 *	Channel signals are "go look at the channel"
+	 *	notifications, so duplicates can be dropped.
+	 */
+	(void) fr_control_coalesce_set(rc->control, FR_CONTROL_ID_CHANNEL, true);
+
 	if (fr_control_callback_add(rc->control, FR_CONTROL_ID_SOCKET, rc, fr_receiver_socket_callback) < 0) {
 		talloc_free(rc);
 		return NULL;
 	}
 
+	if (fr_control_callback_add(rc->control, FR_CONTROL_ID_WORKER, rc, fr_receiver_worker_callback) < 0) {
+		talloc_free(rc);
+		return NULL;
+	}
+
 	if (fr_event_user_insert(rc->el, fr_receiver_evfilt_user, rc) < 0) {
 		talloc_free(rc);
 		return NULL;
@@ -464,13 +1392,13 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 		return NULL;
 	}
 
-	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
 	if (!rc->workers) {
 		talloc_free(rc);
 		return NULL;
 	}
 
-	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
 	if (!rc->closing) {
 		talloc_free(rc);
 		return NULL;
@@ -570,3 +1498,164 @@ int fr_receiver_socket_add(fr_receiver_t *rc, int fd, void *ctx, fr_transport_t
 
 	return fr_control_message_send(rc->control, rc->rb, FR_CONTROL_ID_SOCKET, &m, sizeof(m));
 }
+
+/** Set the cap on the memory used for packets read from the network
+ *
+ *  When the packet buffers get close to the cap, the receiver stops
+ *  reading from its sockets until the workers catch up.
+ *
+ *  This function MUST be called from the receiver thread, or before
+ *  the receiver is running.
+ *
+ * @param rc the receiver
+ * @param max the maximum memory, in bytes.  0 means no cap.
+ */
+void fr_receiver_memory_max_set(fr_receiver_t *rc, size_t max)
+{
+	fr_message_set_memory_max(rc->ms, max);
+}
+
+/** Set where the receiver logs errors
+ *
+ *  This function MUST be called before the receiver is running.
+ *
+ * @param rc the receiver
+ * @param log the log destination
+ */
+void fr_receiver_log_set(fr_receiver_t *rc, fr_log_t const *log)
+{
+	rc->log = log;
+}
+
+/** Let the kernel receive packets for us with io_uring
+ *
+ *  Packets are then read without a system call for each one.  If
+ *  io_uring isn't available, the sockets are read as usual.
+ *
+ *  This function MUST be called before any sockets are added.
+ *
+ * @param rc the receiver
+ * @param enable whether or not to use io_uring
+ */
+void fr_receiver_io_uring_set(fr_receiver_t *rc, bool enable)
+{
+	rc->io_uring = enable;
+}
+
+/** Get the memory used for packets read from the network
+ *
+ *  This function MUST be called from the receiver thread.
+ *
+ * @param rc the receiver
+ * @param[out] mem where the sizes are written
+ */
+void fr_receiver_memory(fr_receiver_t *rc, fr_message_set_memory_t *mem)
+{
+	fr_message_set_memory(rc->ms, mem);
+}
+
+/** Add a worker to a receiver
+ *
+ *  A channel is created to the worker, and the worker is told that
+ *  the channel is open.  The worker is then eligible to receive
+ *  requests from this receiver.
+ *
+ *  This function MUST be called from the receiver thread, or before
+ *  the receiver is running.
+ *
+ * @param rc the receiver
+ * @param worker the worker
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_receiver_worker_add(fr_receiver_t *rc, fr_worker_t *worker)
+{
+	fr_receiver_worker_t *w;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(rc, fr_receiver_t);
+#endif
+
+	w = talloc_zero(rc, fr_receiver_worker_t);
+	if (!w) return -1;
+
+	w->worker = worker;
+	w->processing_time = PROCESSING_TIME_INITIAL;
+
+	w->channel = fr_worker_channel_create(worker, w, rc->control);
+	if (!w->channel) {
+		talloc_free(w);
+		return -1;
+	}
+
+	fr_channel_master_ctx_add(w->channel, w);
+
+	if (fr_channel_signal_open(w->channel) < 0) {
+		talloc_free(w);
+		return -1;
+	}
+
+	(void) fr_heap_insert(rc->workers, w);
+	FR_DLIST_INSERT_TAIL(rc->worker_list, w->entry);
+	rc->num_workers++;
+
+	return 0;
+}
+
+/** Send a control message to a receiver, asking it to add or remove a worker
+ *
+ * @param[in] rc the receiver
+ * @param[in] rb the callers ring buffer for control-plane messages
+ * @param[in] worker the worker
+ * @param[in] add add the worker, or remove it
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_receiver_worker_signal(fr_receiver_t *rc, fr_ring_buffer_t *rb, fr_worker_t *worker, bool add)
+{
+	fr_receiver_worker_msg_t msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.worker = worker;
+	msg.add = add;
+
+	return fr_control_message_send(rc->control, rb, FR_CONTROL_ID_WORKER, &msg, sizeof(msg));
+}
+
+/** Tell a running receiver to start using a worker
+ *
+ *  WARNING: This may be called from another thread!  The receiver
+ *  calls fr_receiver_worker_add() when it gets the message.
+ *
+ * @param[in] rc the receiver
+ * @param[in] rb the callers ring buffer for control-plane messages
+ * @param[in] worker the worker
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_receiver_worker_signal_add(fr_receiver_t *rc, fr_ring_buffer_t *rb, fr_worker_t *worker)
+{
+	return fr_receiver_worker_signal(rc, rb, worker, true);
+}
+
+/** Tell a running receiver to stop using a worker
+ *
+ *  WARNING: This may be called from another thread!  The receiver
+ *  stops sending new requests to the worker, and closes the
+ *  channel once the outstanding requests have been replied to.  The
+ *  worker sees the number of its channels go down as they're closed.
+ *
+ * @param[in] rc the receiver
+ * @param[in] rb the callers ring buffer for control-plane messages
+ * @param[in] worker the worker
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_receiver_worker_signal_remove(fr_receiver_t *rc, fr_ring_buffer_t *rb, fr_worker_t *worker)
+{
+	return fr_receiver_worker_signal(rc, rb, worker, false);
+}
@@ -25,6 +25,8 @@
  */
 RCSIDH(receiver_h, "$Id$")
 
+#include <freeradius-devel/fr_log.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,7 +38,15 @@ void fr_receiver_exit(fr_receiver_t *rc);
 int fr_receiver_destroy(fr_receiver_t *rc) CC_HINT(nonnull);
 void fr_receiver(fr_receiver_t *rc) CC_HINT(nonnull);
 
+void fr_receiver_memory_max_set(fr_receiver_t *rc, size_t max) CC_HINT(nonnull);
+void fr_receiver_memory(fr_receiver_t *rc, fr_message_set_memory_t *mem) CC_HINT(nonnull);
+void fr_receiver_io_uring_set(fr_receiver_t *rc, bool enable) CC_HINT(nonnull);
+void fr_receiver_log_set(fr_receiver_t *rc, fr_log_t const *log) CC_HINT(nonnull);
+
 int fr_receiver_socket_add(fr_receiver_t *rc, int fd, void *ctx, fr_transport_t *transport) CC_HINT(nonnull);
+int fr_receiver_worker_add(fr_receiver_t *rc, fr_worker_t *worker) CC_HINT(nonnull);
+int fr_receiver_worker_signal_add(fr_receiver_t *rc, fr_ring_buffer_t *rb, fr_worker_t *worker) CC_HINT(nonnull);
+int fr_receiver_worker_signal_remove(fr_receiver_t *rc, fr_ring_buffer_t *rb, fr_worker_t *worker) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }
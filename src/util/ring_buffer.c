@@ -27,6 +27,18 @@ RCSID("$Id$")
 #include <freeradius-devel/util/ring_buffer.h>
 #include <freeradius-devel/rad_assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ *	The size of a huge page.  We only try the default size which
+ *	is available on x86_64, and most other 64-bit platforms.
+ */
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
 
 /*
  *	Ring buffers are allocated in a block.
@@ -42,6 +54,9 @@ struct fr_ring_buffer_t {
 	size_t		reserved;	//!< amount of reserved data at write_offset
 
 	bool		closed;		//!< whether allocations are closed
+
+	size_t		mmap_size;	//!< size of the mapping, if the buffer was mmap'd
+	bool		locked;		//!< whether the buffer is mlock'd
 };
 
 
@@ -75,6 +90,97 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 	return rb;
 }
 
+/** Unmap the buffer of an mmap'd ring buffer
+ *
+ */
+static int _ring_buffer_munmap(fr_ring_buffer_t *rb)
+{
+	if (rb->locked) (void) munlock(rb->buffer, rb->mmap_size);
+	(void) munmap(rb->buffer, rb->mmap_size);
+
+	return 0;
+}
+
+/** Create a ring buffer which is backed by an anonymous memory mapping
+ *
+ *  This is for large ring buffers which are used at high packet
+ *  rates.  Huge pages mean fewer TLB misses, and populating the
+ *  mapping up front means that there are no page faults when the
+ *  buffer is first used.
+ *
+ *  If huge pages are not available, the buffer falls back to
+ *  normal pages.  If locking the buffer fails, the creation fails.
+ *
+ * @param[in] ctx a talloc context
+ * @param[in] size of the raw ring buffer array to allocate.
+ * @param[in] flags FR_RING_BUFFER_HUGE_PAGES, FR_RING_BUFFER_POPULATE, and / or FR_RING_BUFFER_LOCK.
+ * @return a ring buffer, or NULL on failure.
+ */
+fr_ring_buffer_t *fr_ring_buffer_create_mmap(TALLOC_CTX *ctx, size_t size, int flags)
+{
+	int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	size_t page_size;
+	void *buffer = MAP_FAILED;
+	fr_ring_buffer_t *rb;
+
+	if (!size) return NULL;
+
+	rb = talloc_zero(ctx, fr_ring_buffer_t);
+	if (!rb) return NULL;
+
+#ifdef MAP_POPULATE
+	if ((flags & FR_RING_BUFFER_POPULATE) != 0) mmap_flags |= MAP_POPULATE;
+#endif
+
+#ifdef MAP_HUGETLB
+	if ((flags & FR_RING_BUFFER_HUGE_PAGES) != 0) {
+		rb->mmap_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+
+		buffer = mmap(NULL, rb->mmap_size, PROT_READ | PROT_WRITE, mmap_flags | MAP_HUGETLB, -1, 0);
+	}
+#endif
+
+	/*
+	 *	No huge pages were requested, or none are available.
+	 *	Use normal pages.
+	 */
+	if (buffer == MAP_FAILED) {
+		page_size = (size_t) sysconf(_SC_PAGESIZE);
+		rb->mmap_size = (size + page_size - 1) & ~(page_size - 1);
+
+		buffer = mmap(NULL, rb->mmap_size, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+		if (buffer == MAP_FAILED) {
+			talloc_free(rb);
+			return NULL;
+		}
+
+#ifdef MADV_HUGEPAGE
+		/*
+		 *	Ask for transparent huge pages instead.
+		 */
+		if ((flags & FR_RING_BUFFER_HUGE_PAGES) != 0) (void) madvise(buffer, rb->mmap_size, MADV_HUGEPAGE);
+#endif
+	}
+
+	rb->buffer = buffer;
+	rb->size = size;
+	talloc_set_destructor(rb, _ring_buffer_munmap);
+
+#ifndef MAP_POPULATE
+	if ((flags & FR_RING_BUFFER_POPULATE) != 0) memset(rb->buffer, 0, rb->mmap_size);
+#endif
+
+	if ((flags & FR_RING_BUFFER_LOCK) != 0) {
+		if (mlock(rb->buffer, rb->mmap_size) < 0) {
+			talloc_free(rb);
+			return NULL;
+		}
+		rb->locked = true;
+	}
+
+	return rb;
+}
+
 
 /** Reserve room in the ring buffer.
  *
@@ -36,7 +36,15 @@ extern "C" {
 
 typedef struct fr_ring_buffer_t fr_ring_buffer_t;
 
+/*
+ *	Flags for fr_ring_buffer_create_mmap()
+ */
+#define FR_RING_BUFFER_HUGE_PAGES	(1 << 0)	//!< try to use 2MB huge pages
+#define FR_RING_BUFFER_POPULATE		(1 << 1)	//!< fault in all of the pages at creation time
+#define FR_RING_BUFFER_LOCK		(1 << 2)	//!< mlock() the buffer into memory
+
 fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size);
+fr_ring_buffer_t *fr_ring_buffer_create_mmap(TALLOC_CTX *ctx, size_t size, int flags);
 
 uint8_t *fr_ring_buffer_reserve(fr_ring_buffer_t *rb, size_t size) CC_HINT(nonnull);
 uint8_t *fr_ring_buffer_alloc(fr_ring_buffer_t *rb, size_t size) CC_HINT(nonnull);
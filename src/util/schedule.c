@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/autoconf.h>
+#include <freeradius-devel/libradius.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include <freeradius-devel/util/schedule.h>
@@ -32,6 +33,24 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/receiver.h>
 
+#include <sys/socket.h>
+#include <ctype.h>
+#include <time.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #define PTHREAD_MUTEX_LOCK   pthread_mutex_lock
@@ -51,6 +70,31 @@ RCSID("$Id$")
 
 #define SEMAPHORE_LOCKED	(0)
 
+#define MAX_CPUS		(1024)
+
+/*
+ *	When the number of workers is elastic, check their load ten
+ *	times a second.
+ */
+#define SCALE_INTERVAL		(NANOSEC / 10)
+
+/*
+ *	Spawn another worker if the average number of messages waiting
+ *	per worker is larger than this, or if any message has waited
+ *	longer than this.
+ */
+#define SCALE_UP_DEPTH		(16)
+#define SCALE_UP_WAIT		(NANOSEC / 100)
+
+/*
+ *	Retire one worker after the others have been able to carry
+ *	the load for this long.  The others are considered able to
+ *	carry the load when they would be less than half busy without
+ *	it.
+ */
+#define SCALE_DOWN_IDLE		(10 * (fr_time_t) NANOSEC)
+#define SCALE_DOWN_BUSY		(2)
+
 #ifdef __APPLE__
 #include <mach/task.h>
 #include <mach/mach_init.h>
@@ -77,6 +121,7 @@ typedef enum fr_schedule_child_status_t {
 	FR_CHILD_FREE = 0,			//!< child is free
 	FR_CHILD_INITIALIZING,			//!< initialized, but not running
 	FR_CHILD_RUNNING,			//!< running, and in the running queue
+	FR_CHILD_RETIRING,			//!< running, and waiting for its channels to be closed before exiting
 	FR_CHILD_EXITED,			//!< exited, and in the exited queue
 	FR_CHILD_FAIL				//!< failed, and in the exited queue
 } fr_schedule_child_status_t;
@@ -92,10 +137,17 @@ typedef struct fr_schedule_worker_t {
 	fr_time_t	cpu_time;		//!< how much CPU time this worker has used
 	int		heap_id;		//!< for the heap of workers
 
+	int		num_receivers;		//!< how many receivers were told to use this worker
+	fr_time_t	running;		//!< time spent running requests, as of the last load check
+
+	int		cpu;			//!< the CPU we're pinned to, or -1
+	int		node;			//!< the NUMA node of that CPU, or -1
+
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
+	TALLOC_CTX	*ctx;			//!< the workers talloc context, freed by the scheduler
 } fr_schedule_worker_t;
 
 /**
@@ -104,6 +156,11 @@ typedef struct fr_schedule_worker_t {
 typedef struct fr_schedule_receiver_t {
 	pthread_t	pthread_id;		//!< the thread of this receiver
 
+	int		id;			//!< a unique ID
+
+	int		cpu;			//!< the CPU we're pinned to, or -1
+	int		node;			//!< the NUMA node of that CPU, or -1
+
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
 	fr_schedule_child_status_t status;	//!< status of the worker
@@ -121,6 +178,17 @@ struct fr_schedule_t {
 
 	int		max_inputs;		//!< number of network threads
 	int		max_workers;		//!< max number of worker threads
+	int		min_workers;		//!< min number of worker threads, or 0 for a fixed number
+
+	int		num_inputs;		//!< number of running network threads
+
+	int		num_worker_cpus;	//!< number of CPUs in the worker CPU set
+	int		*worker_cpus;		//!< CPUs to pin workers to
+	int		*worker_nodes;		//!< NUMA node of each worker CPU
+	int		num_receiver_cpus;	//!< number of CPUs in the receiver CPU set
+	int		*receiver_cpus;		//!< CPUs to pin network threads to
+	int		*receiver_nodes;	//!< NUMA node of each receiver CPU
+	int		next_input;		//!< next network thread to get a socket
 
 	int		num_workers;		//!< number of worker threads
 	int		num_workers_exited;	//!< number of exited workers
@@ -131,13 +199,25 @@ struct fr_schedule_t {
 	sem_t		semaphore;		//!< for inter-thread signaling
 #endif
 
+	atomic_bool	scaling;		//!< is the scaler thread running?
+	fr_time_t	checked_load;		//!< when the scaler last checked the load
+	fr_time_t	idle_since;		//!< when the workers became able to carry the load with one fewer
+
 	fr_schedule_thread_instantiate_t	worker_thread_instantiate;	//!< thread instantiation callback
 	void					*worker_instantiate_ctx;	//!< thread instantiation context
 
 	fr_heap_t	*workers;		//!< heap of workers
 	fr_heap_t	*done_workers;		//!< heap of done workers
 
-	fr_schedule_receiver_t *sr;		//!< pointer to the (one) network thread
+	fr_schedule_worker_t **sw;		//!< array of workers, indexed by ID
+
+	fr_worker_t	**siblings;		//!< array of running workers, for work stealing
+	fr_ring_buffer_t *rb;			//!< for control-plane messages we send to workers
+
+	fr_schedule_receiver_t **sr;		//!< array of network threads
+
+	int		num_fds;		//!< number of sockets we opened for sharding
+	int		*fds;			//!< sockets we opened, and need to close
 
 	uint32_t	num_transports;		//!< how many transport layers we have
 	fr_transport_t	**transports;		//!< array of active transports.
@@ -159,6 +239,215 @@ static int worker_cmp(void const *one, void const *two)
 }
 
 
+/** Parse a CPU set
+ *
+ *  The CPU set is a comma separated list of CPUs, or ranges of CPUs,
+ *  e.g. "0-3,8,10-11".
+ *
+ * @param[in] ctx the talloc context
+ * @param[out] out the array of CPUs
+ * @param[in] str the CPU set to parse
+ * @return
+ *	- <0 on error
+ *	- the number of CPUs in the set
+ */
+static int fr_schedule_cpus_parse(TALLOC_CTX *ctx, int **out, char const *str)
+{
+	int num = 0;
+	int *cpus = NULL;
+	char const *p = str;
+
+	*out = NULL;
+
+	while (*p) {
+		int i, first, last;
+		char *q;
+
+		first = strtoul(p, &q, 10);
+		if (q == p) goto error;
+		last = first;
+
+		if (*q == '-') {
+			p = q + 1;
+			last = strtoul(p, &q, 10);
+			if ((q == p) || (last < first)) goto error;
+		}
+
+		if ((last - first) >= MAX_CPUS) goto error;
+
+		cpus = talloc_realloc(ctx, cpus, int, num + (last - first) + 1);
+		if (!cpus) return -1;
+
+		for (i = first; i <= last; i++) {
+			cpus[num++] = i;
+		}
+
+		if (*q == ',') q++;
+		else if (*q) goto error;
+
+		p = q;
+	}
+
+	*out = cpus;
+	return num;
+
+error:
+	talloc_free(cpus);
+	return -1;
+}
+
+
+/** Find the NUMA node of a CPU
+ *
+ * @param[in] cpu the CPU
+ * @return
+ *	- <0 if the node is unknown
+ *	- the node of the CPU
+ */
+static int fr_schedule_cpu_node(int cpu)
+{
+#if defined(__linux__) && defined(HAVE_DIRENT_H)
+	int node = -1;
+	DIR *dir;
+	struct dirent *dp;
+	char path[64];
+
+	if (cpu < 0) return -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+	dir = opendir(path);
+	if (!dir) return -1;
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (strncmp(dp->d_name, "node", 4) != 0) continue;
+		if (!isdigit((int) dp->d_name[4])) continue;
+
+		node = atoi(dp->d_name + 4);
+		break;
+	}
+	closedir(dir);
+
+	return node;
+#else
+	return -1;
+#endif
+}
+
+
+/** Pin the calling thread to a CPU
+ *
+ *  This is done before the thread allocates any memory.  The kernel
+ *  then places the threads ring buffers and queues on the local NUMA
+ *  node when they are first touched.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] cpu the CPU to pin to, or -1 for no pinning
+ */
+static void fr_schedule_thread_pin(fr_schedule_t *sc, int cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	int rcode;
+	cpu_set_t cpuset;
+
+	if (cpu < 0) return;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+
+	rcode = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	if (rcode != 0) {
+		fr_log(sc->log, L_DBG, "Failed pinning thread to CPU %d: %s\n", cpu, strerror(rcode));
+	}
+#else
+	if (cpu >= 0) fr_log(sc->log, L_DBG, "Ignoring CPU %d, thread pinning is not supported\n", cpu);
+#endif
+}
+
+
+/** Find the NUMA nodes of a CPU set
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] cpus the CPU set
+ * @param[in] num the number of CPUs in the set
+ * @return
+ *	- NULL on error
+ *	- an array of nodes, one for each CPU in the set
+ */
+static int *fr_schedule_cpus_nodes(TALLOC_CTX *ctx, int const *cpus, int num)
+{
+	int i;
+	int *nodes;
+
+	nodes = talloc_array(ctx, int, num);
+	if (!nodes) return NULL;
+
+	for (i = 0; i < num; i++) {
+		nodes[i] = fr_schedule_cpu_node(cpus[i]);
+	}
+
+	return nodes;
+}
+
+
+/** Check if a NUMA node always has a worker
+ *
+ *  Only the first min_workers workers are never retired, so elastic
+ *  workers don't count.  Worker IDs wrap around the worker CPU set.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] node the NUMA node
+ * @return
+ *	- true if a permanent worker is pinned to the node
+ *	- false if the node may have no workers
+ */
+static bool fr_schedule_node_has_workers(fr_schedule_t *sc, int node)
+{
+	int i, num;
+
+	num = sc->min_workers ? sc->min_workers : sc->max_workers;
+	if (num > sc->num_worker_cpus) num = sc->num_worker_cpus;
+
+	for (i = 0; i < num; i++) {
+		if (sc->worker_nodes[i] == node) return true;
+	}
+
+	return false;
+}
+
+
+/** Check if a worker should be used by a network thread
+ *
+ *  Network threads prefer workers on their own NUMA node.  A worker
+ *  on a node with no network threads is used by all of them.  A
+ *  network thread on a node with no workers uses every worker, as
+ *  otherwise it would have nowhere to send packets.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] sr the network thread
+ * @param[in] sw the worker
+ * @return
+ *	- true if the network thread should use the worker
+ *	- false if the worker is remote
+ */
+static bool fr_schedule_worker_local(fr_schedule_t *sc, fr_schedule_receiver_t *sr, fr_schedule_worker_t *sw)
+{
+	int i;
+
+	if ((sr->node < 0) || (sw->node < 0)) return true;
+
+	if (sr->node == sw->node) return true;
+
+	if (!fr_schedule_node_has_workers(sc, sr->node)) return true;
+
+	for (i = 0; i < sc->max_inputs; i++) {
+		if (sc->receiver_nodes[i % sc->num_receiver_cpus] == sw->node) return false;
+	}
+
+	return true;
+}
+
+
 /** Get a workers KQ
  *
  * @param[in] sc the scheduler
@@ -190,6 +479,35 @@ int fr_schedule_get_worker_kq(fr_schedule_t *sc)
 }
 
 
+/** Add up the latency histograms of all running workers
+ *
+ * @param[in] sc the scheduler
+ * @param[in] stage the processing stage
+ * @param[in] out the histogram to update
+ * @return
+ *	- <0 on error
+ *	- the number of workers which were added to the histogram
+ */
+int fr_schedule_latency(fr_schedule_t *sc, fr_time_stage_t stage, fr_time_histogram_t *out)
+{
+	int i, num = 0;
+
+	if ((stage < 0) || (stage >= FR_TIME_STAGE_MAX)) return -1;
+
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+
+	for (i = 0; i < sc->max_workers; i++) {
+		if (!sc->sw[i] || !sc->sw[i]->worker || (sc->sw[i]->status != FR_CHILD_RUNNING)) continue;
+
+		(void) fr_worker_latency(sc->sw[i]->worker, stage, out);
+		num++;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	return num;
+}
+
 /** Initialize and run the worker thread.
  *
  * @param[in] arg the fr_schedule_worker_t
@@ -198,12 +516,15 @@ int fr_schedule_get_worker_kq(fr_schedule_t *sc)
 static void *fr_schedule_worker_thread(void *arg)
 {
 	TALLOC_CTX *ctx;
+	fr_worker_t *worker;
 	fr_schedule_worker_t *sw = arg;
 	fr_schedule_t *sc = sw->sc;
 	fr_schedule_child_status_t status = FR_CHILD_FAIL;
 
 	fr_log(sc->log, L_DBG, "Worker %d starting\n", sw->id);
 
+	fr_schedule_thread_pin(sc, sw->cpu);
+
 	ctx = talloc_init("worker");
 	if (!ctx) goto fail;
 
@@ -244,23 +565,34 @@ static void *fr_schedule_worker_thread(void *arg)
 	fr_log(sc->log, L_DBG, "Worker %d finished\n", sw->id);
 
 	/*
-	 *	Talloc ordering issues. We want to be independent of
-	 *	how talloc walks it's children, and ensure that some
-	 *	things are freed in a specific order.
-	 */
-	fr_worker_destroy(sw->worker);
-	sw->worker = NULL;
-
-	/*
-	 *	Remove ourselves from the list of live workers.
+	 *	Remove ourselves from the list of live workers, so
+	 *	that no one else looks at the worker while we're
+	 *	destroying it.
 	 */
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
 	(void) fr_heap_extract(sc->workers, sw);
 	sc->num_workers--;
+	worker = sw->worker;
+	sw->worker = NULL;
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
+	/*
+	 *	Talloc ordering issues. We want to be independent of
+	 *	how talloc walks it's children, and ensure that some
+	 *	things are freed in a specific order.
+	 */
+	fr_worker_destroy(worker);
+
 	status = FR_CHILD_EXITED;
 
+	/*
+	 *	Our siblings may still be sending us replies for
+	 *	requests they stole from us.  The scheduler frees the
+	 *	context once all of the workers have exited.
+	 */
+	sw->ctx = ctx;
+	ctx = NULL;
+
 fail:
 	if (ctx) talloc_free(ctx);
 
@@ -291,11 +623,16 @@ fail:
  */
 static void *fr_schedule_receiver_thread(void *arg)
 {
+	int i;
 	TALLOC_CTX *ctx;
 	fr_schedule_receiver_t *sr = arg;
 	fr_schedule_t *sc = sr->sc;
 	fr_schedule_child_status_t status = FR_CHILD_FAIL;
 
+	fr_log(sc->log, L_DBG, "Receiver %d starting\n", sr->id);
+
+	fr_schedule_thread_pin(sc, sr->cpu);
+
 	ctx = talloc_init("receiver");
 	if (!ctx) goto fail;
 
@@ -303,9 +640,34 @@ static void *fr_schedule_receiver_thread(void *arg)
 	if (!sr->rc) {
 		goto fail;
 	}
+	fr_receiver_log_set(sr->rc, sc->log);
+
+	/*
+	 *	Open a channel to every worker.  The receiver then
+	 *	decides on a per-request basis which worker gets the
+	 *	packet, based on the workers predicted backlog.
+	 *
+	 *	When the threads are pinned, we skip workers on other
+	 *	NUMA nodes, so that the channels don't bounce cache
+	 *	lines between sockets.
+	 */
+	for (i = 0; i < sc->max_workers; i++) {
+		if (!sc->sw[i] || !sc->sw[i]->worker) continue;
+
+		if (!fr_schedule_worker_local(sc, sr, sc->sw[i])) continue;
+
+		if (fr_receiver_worker_add(sr->rc, sc->sw[i]->worker) < 0) {
+			fr_log(sc->log, L_DBG, "Receiver failed adding worker %d\n", i);
+			fr_receiver_destroy(sr->rc);
+			sr->rc = NULL;
+			goto fail;
+		}
+	}
 
 	sr->status = FR_CHILD_RUNNING;
 
+	fr_log(sc->log, L_DBG, "Receiver %d running\n", sr->id);
+
 	/*
 	 *	Tell the originator that the thread has started.
 	 */
@@ -316,6 +678,8 @@ static void *fr_schedule_receiver_thread(void *arg)
 	 */
 	fr_receiver(sr->rc);
 
+	fr_log(sc->log, L_DBG, "Receiver %d finished\n", sr->id);
+
 	/*
 	 *	Talloc ordering issues. We want to be independent of
 	 *	how talloc walks it's children, and ensure that some
@@ -340,27 +704,303 @@ fail:
 }
 
 
+/** Spawn a worker thread
+ *
+ *  The caller has to wait on the semaphore for the worker to start.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] id the ID of the worker, which is also its slot in sc->sw
+ * @return
+ *	- NULL on error
+ *	- the new worker
+ */
+static fr_schedule_worker_t *fr_schedule_worker_spawn(fr_schedule_t *sc, int id)
+{
+	int rcode;
+	pthread_attr_t attr;
+	fr_schedule_worker_t *sw;
+
+	/*
+	 *	Create a worker "glue" structure
+	 */
+	sw = talloc_zero(sc, fr_schedule_worker_t);
+	if (!sw) return NULL;
+
+	sw->id = id;
+	sw->sc = sc;
+	sw->status = FR_CHILD_INITIALIZING;
+
+	if (sc->num_worker_cpus) {
+		sw->cpu = sc->worker_cpus[id % sc->num_worker_cpus];
+		sw->node = sc->worker_nodes[id % sc->num_worker_cpus];
+	} else {
+		sw->cpu = sw->node = -1;
+	}
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	rcode = pthread_create(&sw->pthread_id, &attr, fr_schedule_worker_thread, sw);
+	(void) pthread_attr_destroy(&attr);
+	if (rcode != 0) {
+		fr_log(sc->log, L_DBG, "Failed to create worker %d: %s\n", id, strerror(rcode));
+		talloc_free(sw);
+		return NULL;
+	}
+
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	sc->sw[id] = sw;
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	return sw;
+}
+
+/** Forget about a worker which has exited, and free it
+ *
+ *  The worker MUST be in the "done" heap.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] sw the worker
+ */
+static void fr_schedule_worker_free(fr_schedule_t *sc, fr_schedule_worker_t *sw)
+{
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	(void) fr_heap_extract(sc->done_workers, sw);
+	sc->num_workers_exited--;
+	sc->sw[sw->id] = NULL;
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	talloc_free(sw->ctx);
+	talloc_free(sw);
+}
+
+/** Spawn another worker, and tell the receivers to use it
+ *
+ * @param[in] sc the scheduler
+ * @return
+ *	- <0 on error, or if we're already running the maximum number of workers
+ *	- 0 on success
+ */
+static int fr_schedule_worker_grow(fr_schedule_t *sc)
+{
+	int i, id = -1;
+	fr_schedule_worker_t *sw;
+
+	for (i = sc->min_workers; i < sc->max_workers; i++) {
+		if (sc->sw[i]) continue;
+
+		id = i;
+		break;
+	}
+	if (id < 0) return -1;
+
+	fr_log(sc->log, L_DBG, "Spawning worker %d\n", id);
+
+	sw = fr_schedule_worker_spawn(sc, id);
+	if (!sw) return -1;
+
+	SEM_WAIT_INTR(&sc->semaphore);
+
+	if (sw->status != FR_CHILD_RUNNING) {
+		fr_log(sc->log, L_DBG, "Worker %d failed to start\n", id);
+		fr_schedule_worker_free(sc, sw);
+		return -1;
+	}
+
+	for (i = 0; i < sc->num_inputs; i++) {
+		if (sc->sr[i]->status != FR_CHILD_RUNNING) continue;
+
+		if (!fr_schedule_worker_local(sc, sc->sr[i], sw)) continue;
+
+		if (fr_receiver_worker_signal_add(sc->sr[i]->rc, sc->rb, sw->worker) < 0) {
+			fr_log(sc->log, L_DBG, "Failed telling receiver %d about worker %d\n", i, id);
+			continue;
+		}
+		sw->num_receivers++;
+	}
+
+	return 0;
+}
+
+/** Tell the receivers to stop using a worker
+ *
+ *  The worker exits once all of its channels have been closed.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] sw the worker to retire
+ */
+static void fr_schedule_worker_retire(fr_schedule_t *sc, fr_schedule_worker_t *sw)
+{
+	int i;
+
+	fr_log(sc->log, L_DBG, "Retiring worker %d\n", sw->id);
+
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	(void) fr_heap_extract(sc->workers, sw);
+	sw->status = FR_CHILD_RETIRING;
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	for (i = 0; i < sc->num_inputs; i++) {
+		if (sc->sr[i]->status != FR_CHILD_RUNNING) continue;
+
+		(void) fr_receiver_worker_signal_remove(sc->sr[i]->rc, sc->rb, sw->worker);
+	}
+}
+
+/** Check the load of the workers, and spawn or retire workers as necessary
+ *
+ *  Only the scaler thread spawns and retires workers, and it is the
+ *  only writer of sc->sw once the scheduler is running.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] now the current time
+ */
+static void fr_schedule_scale(fr_schedule_t *sc, fr_time_t now)
+{
+	int i, num_running = 0;
+	uint64_t depth = 0;
+	fr_time_t wait = 0, running = 0, elapsed;
+	fr_worker_load_t load;
+	fr_schedule_worker_t *sw, *idle = NULL;
+
+	elapsed = now - sc->checked_load;
+	sc->checked_load = now;
+
+	for (i = 0; i < sc->max_workers; i++) {
+		sw = sc->sw[i];
+		if (!sw) continue;
+
+		fr_worker_load(sw->worker, &load);
+
+		/*
+		 *	Finish retiring workers whose channels have
+		 *	all been closed.
+		 */
+		if (sw->status == FR_CHILD_RETIRING) {
+			if (load.num_channels > 0) continue;
+
+			fr_log(sc->log, L_DBG, "Worker %d retired\n", sw->id);
+
+			fr_worker_exit(sw->worker);
+			SEM_WAIT_INTR(&sc->semaphore);
+			fr_schedule_worker_free(sc, sw);
+			continue;
+		}
+
+		if (sw->status != FR_CHILD_RUNNING) continue;
+
+		num_running++;
+		depth += load.depth;
+		if (load.wait > wait) wait = load.wait;
+		if (load.running > sw->running) running += load.running - sw->running;
+		sw->running = load.running;
+
+		/*
+		 *	The minimum workers are never retired.  The
+		 *	others can be retired once every receiver has
+		 *	opened a channel to them, and they have nothing
+		 *	to do.
+		 */
+		if ((i >= sc->min_workers) && !load.depth && (load.num_channels == sw->num_receivers)) idle = sw;
+	}
+
+	if (!num_running) return;
+
+	/*
+	 *	The workers aren't keeping up.
+	 */
+	if ((depth > (uint64_t) (SCALE_UP_DEPTH * num_running)) || (wait > SCALE_UP_WAIT)) {
+		sc->idle_since = 0;
+		(void) fr_schedule_worker_grow(sc);
+		return;
+	}
+
+	/*
+	 *	Check if one fewer worker could carry the load.
+	 */
+	if (!idle || (depth >= (uint64_t) num_running) ||
+	    ((running * SCALE_DOWN_BUSY) >= (elapsed * (num_running - 1)))) {
+		sc->idle_since = 0;
+		return;
+	}
+
+	if (!sc->idle_since) {
+		sc->idle_since = now;
+		return;
+	}
+
+	if ((now - sc->idle_since) < SCALE_DOWN_IDLE) return;
+
+	/*
+	 *	Retire one worker per idle period, so that we don't
+	 *	go from the peak to the minimum all at once.
+	 */
+	sc->idle_since = 0;
+	fr_schedule_worker_retire(sc, idle);
+}
+
+/** Run the scaler thread.
+ *
+ * @param[in] arg the fr_schedule_t
+ * @return NULL
+ */
+static void *fr_schedule_scaler_thread(void *arg)
+{
+	fr_schedule_t *sc = arg;
+	struct timespec ts;
+
+	fr_log(sc->log, L_DBG, "Scaler running\n");
+
+	sc->checked_load = fr_time();
+
+	while (atomic_load(&sc->scaling)) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = SCALE_INTERVAL;
+		(void) nanosleep(&ts, NULL);
+
+		if (!atomic_load(&sc->scaling)) break;
+
+		fr_schedule_scale(sc, fr_time());
+	}
+
+	fr_log(sc->log, L_DBG, "Scaler exiting\n");
+
+	/*
+	 *	Tell the scheduler we're done.
+	 */
+	sem_post(&sc->semaphore);
+
+	return NULL;
+}
+
+
 /** Create a scheduler and spawn the child threads.
  *
  * @param[in] ctx the talloc context
  * @param[in] log the destination for all logging messages
  * @param[in] max_inputs the number of network threads
- * @param[in] max_workers the number of worker threads
+ * @param[in] max_workers the maximum number of worker threads
+ * @param[in] min_workers the number of worker threads to start with, or 0 to always run max_workers.
+ *	More workers are spawned when the workers can't keep up, and retired
+ *	when they're idle.
  * @param[in] num_transports the number of transports in the transport array
  * @param[in] transports the array of transports.
  * @param[in] worker_thread_instantiate callback for new worker threads
  * @param[in] worker_thread_ctx context for callback
+ * @param[in] worker_cpus the CPU set to pin workers to, or NULL
+ * @param[in] receiver_cpus the CPU set to pin network threads to, or NULL
  * @return
  *	- NULL on error
  *	- fr_schedule_t new scheduler
  */
-fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs, int max_workers,
+fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs, int max_workers, int min_workers,
 				  uint32_t num_transports, fr_transport_t **transports,
 				  fr_schedule_thread_instantiate_t worker_thread_instantiate,
-				  void *worker_thread_ctx)
+				  void *worker_thread_ctx,
+				  char const *worker_cpus, char const *receiver_cpus)
 {
 #ifdef HAVE_PTHREAD_H
-	int i, num_workers;
+	int i, num_workers, start_workers;
 	int rcode;
 	pthread_attr_t attr;
 
@@ -372,11 +1012,14 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	 */
 	if ((!max_inputs && max_workers) || (max_workers && !max_inputs)) return NULL;
 
+	if ((min_workers < 0) || (min_workers > max_workers)) return NULL;
+
 	sc = talloc_zero(ctx, fr_schedule_t);
 	if (!sc) return NULL;
 
 	sc->max_inputs = max_inputs;
 	sc->max_workers = max_workers;
+	if (min_workers < max_workers) sc->min_workers = min_workers;
 	sc->log = log;
 
 	sc->worker_thread_instantiate = worker_thread_instantiate;
@@ -386,6 +1029,36 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	sc->num_transports = num_transports;
 	sc->transports = transports;
 
+	if (worker_cpus) {
+		sc->num_worker_cpus = fr_schedule_cpus_parse(sc, &sc->worker_cpus, worker_cpus);
+		if (sc->num_worker_cpus <= 0) {
+			fr_log(sc->log, L_ERR, "Invalid worker CPU set '%s'\n", worker_cpus);
+			talloc_free(sc);
+			return NULL;
+		}
+
+		sc->worker_nodes = fr_schedule_cpus_nodes(sc, sc->worker_cpus, sc->num_worker_cpus);
+		if (!sc->worker_nodes) {
+			talloc_free(sc);
+			return NULL;
+		}
+	}
+
+	if (receiver_cpus) {
+		sc->num_receiver_cpus = fr_schedule_cpus_parse(sc, &sc->receiver_cpus, receiver_cpus);
+		if (sc->num_receiver_cpus <= 0) {
+			fr_log(sc->log, L_ERR, "Invalid receiver CPU set '%s'\n", receiver_cpus);
+			talloc_free(sc);
+			return NULL;
+		}
+
+		sc->receiver_nodes = fr_schedule_cpus_nodes(sc, sc->receiver_cpus, sc->num_receiver_cpus);
+		if (!sc->receiver_nodes) {
+			talloc_free(sc);
+			return NULL;
+		}
+	}
+
 	/*
 	 *	No inputs or workers, we're single threaded mode.
 	 */
@@ -416,6 +1089,12 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 		return NULL;
 	}
 
+	sc->sw = talloc_zero_array(sc, fr_schedule_worker_t *, sc->max_workers);
+	if (!sc->sw) {
+		talloc_free(sc);
+		return NULL;
+	}
+
 	memset(&sc->semaphore, 0, sizeof(sc->semaphore));
 	if (sem_init(&sc->semaphore, 0, SEMAPHORE_LOCKED) != 0) {
 		talloc_free(sc);
@@ -423,30 +1102,15 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	}
 
 	/*
-	 *	Create all of the workers.
+	 *	Create all of the workers, or just the minimum if the
+	 *	number of workers is elastic.
 	 */
+	start_workers = sc->min_workers ? sc->min_workers : sc->max_workers;
 	num_workers = 0;
-	for (i = 0; i < sc->max_workers; i++) {
-		fr_schedule_worker_t *sw;
-
-		fr_log(sc->log, L_DBG, "Creating %d/%d workers\n", i, sc->max_workers);
+	for (i = 0; i < start_workers; i++) {
+		fr_log(sc->log, L_DBG, "Creating %d/%d workers\n", i, start_workers);
 
-		/*
-		 *	Create a worker "glue" structure
-		 */
-		sw = talloc_zero(sc, fr_schedule_worker_t);
-		if (!sw) break;
-
-		sw->id = i;
-		sw->sc = sc;
-		sw->status = FR_CHILD_INITIALIZING;
-
-		rcode = pthread_create(&sw->pthread_id, &attr, fr_schedule_worker_thread, sw);
-		if (rcode != 0) {
-			fr_log(sc->log, L_DBG, "Failed to create worker %d: %s\n", i, strerror(errno));
-			talloc_free(sw);
-			break;
-		}
+		if (!fr_schedule_worker_spawn(sc, i)) break;
 
 		num_workers++;
 	}
@@ -460,7 +1124,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	}
 
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
-	if (sc->num_workers != sc->max_workers) {
+	if (sc->num_workers != start_workers) {
 		int num_workers_exited = sc->num_workers_exited;
 		fr_schedule_worker_t *sw;
 
@@ -480,6 +1144,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 			PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 			rad_assert(sw != NULL);
 
+			sc->sw[sw->id] = NULL;
 			talloc_free(sw);
 		}
 
@@ -514,18 +1179,95 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
 	/*
-	 *	Create the network thread
+	 *	Tell each worker about its siblings, so that idle
+	 *	workers can steal work from busy ones.
+	 *
+	 *	Workers which are spawned later aren't siblings, so
+	 *	that retiring them doesn't leave dangling pointers in
+	 *	the sibling array.
 	 */
-	sc->sr = talloc_zero(sc, fr_schedule_receiver_t);
-	sc->sr->sc = sc;
-	
-	rcode = pthread_create(&sc->sr->pthread_id, &attr, fr_schedule_receiver_thread, sc->sr);
-	if (rcode != 0) goto fail;
+	if ((num_workers > 1) || sc->min_workers) {
+		sc->rb = fr_ring_buffer_create(sc, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+		if (!sc->rb && sc->min_workers) goto fail;
+	}
 
-	SEM_WAIT_INTR(&sc->semaphore);
-	if (sc->sr->status != FR_CHILD_RUNNING) {
+	if (num_workers > 1) {
+		sc->siblings = talloc_zero_array(sc, fr_worker_t *, num_workers);
+
+		if (sc->rb && sc->siblings) {
+			for (i = 0; i < num_workers; i++) {
+				sc->siblings[i] = sc->sw[i]->worker;
+			}
+
+			for (i = 0; i < num_workers; i++) {
+				if (fr_worker_siblings_set(sc->sw[i]->worker, sc->rb, num_workers, sc->siblings) < 0) {
+					fr_log(sc->log, L_DBG, "Failed telling worker %d about its siblings\n", i);
+				}
+			}
+		}
+	}
+
+	/*
+	 *	Create the network threads.  Each one has its own
+	 *	channel to every worker.
+	 */
+	sc->sr = talloc_zero_array(sc, fr_schedule_receiver_t *, sc->max_inputs);
+	if (!sc->sr) goto fail;
+
+	for (i = 0; i < sc->max_inputs; i++) {
+		fr_schedule_receiver_t *sr;
+
+		fr_log(sc->log, L_DBG, "Creating %d/%d receivers\n", i, sc->max_inputs);
+
+		sr = talloc_zero(sc, fr_schedule_receiver_t);
+		if (!sr) goto fail;
+
+		sr->id = i;
+		sr->sc = sc;
+		sr->status = FR_CHILD_INITIALIZING;
+
+		if (sc->num_receiver_cpus) {
+			sr->cpu = sc->receiver_cpus[i % sc->num_receiver_cpus];
+			sr->node = sc->receiver_nodes[i % sc->num_receiver_cpus];
+		} else {
+			sr->cpu = sr->node = -1;
+		}
+
+		rcode = pthread_create(&sr->pthread_id, &attr, fr_schedule_receiver_thread, sr);
+		if (rcode != 0) {
+			fr_log(sc->log, L_DBG, "Failed to create receiver %d: %s\n", i, strerror(errno));
+			talloc_free(sr);
+			goto fail;
+		}
+
+		SEM_WAIT_INTR(&sc->semaphore);
+		if (sr->status != FR_CHILD_RUNNING) {
+			talloc_free(sr);
+			goto fail;
+		}
+
+		sc->sr[i] = sr;
+		sc->num_inputs++;
+	}
+
+	/*
+	 *	Start the thread which spawns and retires workers.
+	 */
+	if (sc->min_workers) {
+		pthread_t scaler_id;
+
+		atomic_store(&sc->scaling, true);
+
+		rcode = pthread_create(&scaler_id, &attr, fr_schedule_scaler_thread, sc);
+		if (rcode != 0) {
+			fr_log(sc->log, L_DBG, "Failed to create scaler: %s\n", strerror(rcode));
+			atomic_store(&sc->scaling, false);
+			goto fail;
+		}
+	}
+
+	if (0) {
 	fail:
-		TALLOC_FREE(sc->sr);
 		fr_schedule_destroy(sc);
 		return NULL;
 	}
@@ -555,6 +1297,15 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 
 	fr_log(sc->log, L_DBG, "Destroying scheduler\n");
 
+	/*
+	 *	Stop the scaler first, so that the set of workers
+	 *	doesn't change underneath us.
+	 */
+	if (atomic_load(&sc->scaling)) {
+		atomic_store(&sc->scaling, false);
+		SEM_WAIT_INTR(&sc->semaphore);
+	}
+
 	/*
 	 *	Signal the workers to exit.  They will push themselves
 	 *	onto the "exited" stack when they're done.
@@ -565,6 +1316,15 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	while ((sw = fr_heap_pop(sc->workers)) != NULL) {
 		fr_worker_exit(sw->worker);
 	}
+
+	/*
+	 *	Retiring workers aren't in the heap.
+	 */
+	for (i = 0; i < sc->max_workers; i++) {
+		if (!sc->sw[i] || (sc->sw[i]->status != FR_CHILD_RETIRING)) continue;
+
+		fr_worker_exit(sc->sw[i]->worker);
+	}
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
 	/*
@@ -578,13 +1338,32 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	}
 
 	/*
-	 *	If the network thread is running, tell it to exit.
+	 *	Tell the running network threads to exit.
 	 */
-	if (sc->sr->status == FR_CHILD_RUNNING) {
-		fr_receiver_exit(sc->sr->rc);
+	for (i = 0; i < sc->num_inputs; i++) {
+		if (sc->sr[i]->status != FR_CHILD_RUNNING) continue;
+
+		fr_receiver_exit(sc->sr[i]->rc);
 		SEM_WAIT_INTR(&sc->semaphore);
 	}
 
+	/*
+	 *	Close the sockets we opened for sharding.
+	 */
+	for (i = 0; i < sc->num_fds; i++) {
+		close(sc->fds[i]);
+	}
+
+	/*
+	 *	All of the workers have exited, so none of them can
+	 *	refer to each other.  It's now safe to free them.
+	 */
+	for (i = 0; i < sc->max_workers; i++) {
+		if (!sc->sw[i]) continue;
+
+		TALLOC_FREE(sc->sw[i]->ctx);
+	}
+
 	sem_destroy(&sc->semaphore);
 #endif	/* HAVE_PTHREAD_H */
 
@@ -597,7 +1376,57 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	return 0;
 }
 
+/** Open another socket bound to the same address as an existing one
+ *
+ *  This only works if the original socket is a datagram socket, and
+ *  was bound with SO_REUSEPORT set.  The kernel then shards incoming
+ *  packets across all of the sockets.
+ *
+ * @param[in] fd the original socket
+ * @return
+ *	- <0 on error
+ *	- the new socket
+ */
+static int fr_schedule_socket_shard(int fd)
+{
+#ifdef SO_REUSEPORT
+	int on, type, newfd;
+	socklen_t len;
+	struct sockaddr_storage salocal;
+
+	on = 0;
+	len = sizeof(on);
+	if ((getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, &len) < 0) || !on) return -1;
+
+	len = sizeof(type);
+	if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0) || (type != SOCK_DGRAM)) return -1;
+
+	len = sizeof(salocal);
+	if (getsockname(fd, (struct sockaddr *) &salocal, &len) < 0) return -1;
+
+	newfd = socket(salocal.ss_family, type, 0);
+	if (newfd < 0) return -1;
+
+	on = 1;
+	if ((setsockopt(newfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) ||
+	    (fr_nonblock(newfd) < 0) ||
+	    (bind(newfd, (struct sockaddr *) &salocal, len) < 0)) {
+		close(newfd);
+		return -1;
+	}
+
+	return newfd;
+#else
+	return -1;
+#endif
+}
+
 /** Add a socket to a scheduler.
+ *
+ *  If the socket was bound with SO_REUSEPORT, each network thread
+ *  gets its own socket bound to the same address, and the kernel
+ *  shards packets across them.  Otherwise, sockets are given to the
+ *  network threads in round-robin order.
  *
  * @param sc the scheduler
  * @param fd the file descriptor for the socket
@@ -606,7 +1435,51 @@ int fr_schedule_destroy(fr_schedule_t *sc)
  */
 int fr_schedule_socket_add(fr_schedule_t *sc, int fd, void *ctx, fr_transport_t *transport)
 {
-	return fr_receiver_socket_add(sc->sr->rc, fd, ctx, transport);
+	int i, rcode;
+
+	if (!sc->num_inputs) return -1;
+
+	/*
+	 *	The original socket goes to the next network thread.
+	 */
+	rcode = fr_receiver_socket_add(sc->sr[sc->next_input]->rc, fd, ctx, transport);
+	if (rcode < 0) return rcode;
+
+	if (sc->num_inputs > 1) {
+		int newfd, num, *fds;
+
+		fds = talloc_realloc(sc, sc->fds, int, sc->num_fds + sc->num_inputs - 1);
+		if (!fds) goto next;
+		sc->fds = fds;
+
+		/*
+		 *	Give every other network thread its own
+		 *	socket.
+		 */
+		num = 0;
+		for (i = 0; i < sc->num_inputs; i++) {
+			if (i == sc->next_input) continue;
+
+			newfd = fr_schedule_socket_shard(fd);
+			if (newfd < 0) break;
+
+			if (fr_receiver_socket_add(sc->sr[i]->rc, newfd, ctx, transport) < 0) {
+				close(newfd);
+				continue;
+			}
+
+			sc->fds[sc->num_fds++] = newfd;
+			num++;
+		}
+
+		if (num > 0) return 0;
+	}
+
+next:
+	sc->next_input++;
+	if (sc->next_input >= sc->num_inputs) sc->next_input = 0;
+
+	return 0;
 }
 
 
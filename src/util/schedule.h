@@ -35,13 +35,15 @@ extern "C" {
 typedef struct fr_schedule_t fr_schedule_t;
 typedef int (*fr_schedule_thread_instantiate_t)(void *ctx);
 
-fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs, int max_workers,
+fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs, int max_workers, int min_workers,
 				  uint32_t num_transports, fr_transport_t **transports,
 				  fr_schedule_thread_instantiate_t worker_thread_instantiate,
-				  void *worker_thread_ctx);
+				  void *worker_thread_ctx,
+				  char const *worker_cpus, char const *receiver_cpus);
 /* schedulers are async, so there's no fr_schedule_run() */
 int fr_schedule_destroy(fr_schedule_t *sc);
 int fr_schedule_get_worker_kq(fr_schedule_t *sc);
+int fr_schedule_latency(fr_schedule_t *sc, fr_time_stage_t stage, fr_time_histogram_t *out) CC_HINT(nonnull);
 
 int fr_schedule_socket_add(fr_schedule_t *sc, int fd, void *ctx, fr_transport_t *transport) CC_HINT(nonnull);
 
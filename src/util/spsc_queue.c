@@ -0,0 +1,286 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Single producer, single consumer thread-safe queues.
+ * @file util/spsc_queue.c
+ *
+ *  Each channel end has exactly one writer and one reader, so it
+ *  doesn't need the per-entry sequence numbers and CAS loops of the
+ *  MPMC fr_atomic_queue_t.  The producer owns the head, and the
+ *  consumer owns the tail.  Each side keeps a cached copy of the
+ *  other side's index on its own cache line, and only reloads the
+ *  shared index when the cached copy says the queue is full (or
+ *  empty).  In the common case, a push or pop touches no cache line
+ *  which is written by the other thread.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdalign.h>
+
+#include <freeradius-devel/autoconf.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#include <freeradius-devel/util/spsc_queue.h>
+
+#define load(_var)           atomic_load_explicit(&_var, memory_order_relaxed)
+#define aquire(_var)         atomic_load_explicit(&_var, memory_order_acquire)
+#define store(_store, _var)  atomic_store_explicit(&_store, _var, memory_order_release);
+
+struct fr_spsc_queue_t {
+	/*
+	 *	Written by the producer.
+	 */
+	alignas(128) atomic_uint_fast64_t head;	//!< next entry to write
+	uint64_t	cached_tail;		//!< the producers view of the tail
+
+	/*
+	 *	Written by the consumer.
+	 */
+	alignas(128) atomic_uint_fast64_t tail;	//!< next entry to read
+	uint64_t	cached_head;		//!< the consumers view of the head
+
+	/*
+	 *	Read-only after creation.
+	 */
+	alignas(128) uint64_t size;		//!< maximum number of entries in the queue
+	uint64_t	mask;			//!< for turning an index into an array offset
+
+	void		*entry[1];
+};
+
+/** Create fixed-size SPSC queue.
+ *
+ *  The array is rounded up to a power of two, so that indexes can be
+ *  masked instead of divided.  The queue still holds at most "size"
+ *  entries.
+ *
+ * @param[in] ctx the talloc ctx
+ * @param[in] size the number of entries in the queue
+ * @return
+ *     - NULL on error
+ *     - fr_spsc_queue_t *, a pointer to the allocated and initialized queue
+ */
+fr_spsc_queue_t *fr_spsc_queue_create(TALLOC_CTX *ctx, int size)
+{
+	uint64_t array_size;
+	fr_spsc_queue_t *sq;
+
+	if ((size <= 0) || (size > (1 << 30))) return NULL;
+
+	for (array_size = 1; array_size < (uint64_t) size; array_size <<= 1) {
+		/* nothing */
+	}
+
+	/*
+	 *	Allocate a contiguous blob for the header and queue.
+	 *	This helps with memory locality.
+	 *
+	 *	Since we're allocating a blob, we should also set the
+	 *	name of the data, too.
+	 */
+	sq = talloc_zero_size(ctx, sizeof(*sq) + (array_size - 1) * sizeof(sq->entry[0]));
+	if (!sq) return NULL;
+
+	talloc_set_name(sq, "fr_spsc_queue_t");
+
+	sq->size = size;
+	sq->mask = array_size - 1;
+	sq->cached_head = 0;
+	sq->cached_tail = 0;
+
+	/*
+	 *	Set the head / tail indexes, and force other CPUs to
+	 *	see the writes.
+	 */
+	store(sq->head, 0);
+	store(sq->tail, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return sq;
+}
+
+/** Push a pointer into the SPSC queue
+ *
+ *  This function MUST only be called by the producer.
+ *
+ * @param[in] sq the queue
+ * @param[in] data the data to push
+ * @return
+ *	- true on successful push
+ *	- false on queue full
+ */
+bool fr_spsc_queue_push(fr_spsc_queue_t *sq, void *data)
+{
+	uint64_t head;
+
+	if (!data) return false;
+
+	head = load(sq->head);
+
+	if ((head - sq->cached_tail) >= sq->size) {
+		sq->cached_tail = aquire(sq->tail);
+		if ((head - sq->cached_tail) >= sq->size) return false;
+	}
+
+	sq->entry[head & sq->mask] = data;
+	store(sq->head, head + 1);
+
+	return true;
+}
+
+/** Pop a pointer from the SPSC queue
+ *
+ *  This function MUST only be called by the consumer.
+ *
+ * @param[in] sq the queue
+ * @param[in] p_data where to write the data
+ * @return
+ *	- true on successful pop
+ *	- false on queue empty
+ */
+bool fr_spsc_queue_pop(fr_spsc_queue_t *sq, void **p_data)
+{
+	uint64_t tail;
+
+	if (!p_data) return false;
+
+	tail = load(sq->tail);
+
+	if (tail == sq->cached_head) {
+		sq->cached_head = aquire(sq->head);
+		if (tail == sq->cached_head) return false;
+	}
+
+	*p_data = sq->entry[tail & sq->mask];
+	store(sq->tail, tail + 1);
+
+	return true;
+}
+
+/** Push multiple pointers into the SPSC queue
+ *
+ *  As many pointers as will fit are pushed.  The head is updated
+ *  once for the whole burst.
+ *
+ *  This function MUST only be called by the producer.
+ *
+ * @param[in] sq the queue
+ * @param[in] data the array of pointers to push
+ * @param[in] num the number of pointers in the array
+ * @return the number of pointers which were pushed
+ */
+int fr_spsc_queue_push_n(fr_spsc_queue_t *sq, void **data, int num)
+{
+	int i;
+	uint64_t head, room;
+
+	if (!data || (num <= 0)) return 0;
+
+	head = load(sq->head);
+
+	room = sq->size - (head - sq->cached_tail);
+	if (room < (uint64_t) num) {
+		sq->cached_tail = aquire(sq->tail);
+		room = sq->size - (head - sq->cached_tail);
+		if (!room) return 0;
+	}
+
+	if ((uint64_t) num > room) num = room;
+
+	for (i = 0; i < num; i++) {
+		sq->entry[(head + i) & sq->mask] = data[i];
+	}
+	store(sq->head, head + num);
+
+	return num;
+}
+
+/** Pop multiple pointers from the SPSC queue
+ *
+ *  The tail is updated once for the whole burst.
+ *
+ *  This function MUST only be called by the consumer.
+ *
+ * @param[in] sq the queue
+ * @param[out] p_data where to write the pointers
+ * @param[in] num the maximum number of pointers to pop
+ * @return the number of pointers which were popped
+ */
+int fr_spsc_queue_pop_n(fr_spsc_queue_t *sq, void **p_data, int num)
+{
+	int i;
+	uint64_t tail, avail;
+
+	if (!p_data || (num <= 0)) return 0;
+
+	tail = load(sq->tail);
+
+	avail = sq->cached_head - tail;
+	if (avail < (uint64_t) num) {
+		sq->cached_head = aquire(sq->head);
+		avail = sq->cached_head - tail;
+		if (!avail) return 0;
+	}
+
+	if ((uint64_t) num > avail) num = avail;
+
+	/*
+	 *	Copy the pointers to the caller BEFORE updating the
+	 *	tail, which lets the producer re-use the entries.
+	 */
+	for (i = 0; i < num; i++) {
+		p_data[i] = sq->entry[(tail + i) & sq->mask];
+	}
+	store(sq->tail, tail + num);
+
+	return num;
+}
+
+#ifndef NDEBUG
+/**  Dump an SPSC queue.
+ *
+ *  Absolutely NOT thread-safe.
+ *
+ * @param[in] sq the queue
+ * @param[in] fp where the debugging information will be printed.
+ */
+void fr_spsc_queue_debug(fr_spsc_queue_t *sq, FILE *fp)
+{
+	uint64_t i, head, tail;
+
+	head = load(sq->head);
+	tail = load(sq->tail);
+
+	fprintf(fp, "SQ %p size %" PRIu64 ", head %" PRIu64 ", tail %" PRIu64 "\n",
+		sq, sq->size, head, tail);
+
+	for (i = tail; i < head; i++) {
+		fprintf(fp, "\t[%" PRIu64 "] = { %p }\n", i & sq->mask, sq->entry[i & sq->mask]);
+	}
+}
+#endif
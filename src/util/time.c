@@ -28,6 +28,12 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/util/time.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /*
  *	Avoid too many ifdef's later in the code.
  */
@@ -259,3 +265,202 @@ void fr_time_tracking_debug(fr_time_tracking_t *tt, FILE *fp)
 	DPRINT(running);
 	DPRINT(waiting);
 }
+
+/*
+ *	Histograms are log-linear, in the style of HDR histograms.
+ *	Each power of two is split into 2^HISTOGRAM_SUB_BITS linear
+ *	buckets, which gives a relative error of about 6%.
+ */
+#define HISTOGRAM_SUB_BITS	(4)
+#define HISTOGRAM_SUB_COUNT	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS	((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct fr_time_histogram_t {
+	atomic_uint_fast64_t	count;				//!< number of values in the histogram
+	atomic_uint_fast64_t	buckets[HISTOGRAM_BUCKETS];	//!< counts, indexed by bucket
+};
+
+char const *fr_time_stage_names[FR_TIME_STAGE_MAX] = {
+	[FR_TIME_STAGE_QUEUE] =		"queue",
+	[FR_TIME_STAGE_DECODE] =	"decode",
+	[FR_TIME_STAGE_RUN] =		"run",
+	[FR_TIME_STAGE_YIELDED] =	"yielded",
+	[FR_TIME_STAGE_ENCODE] =	"encode",
+};
+
+/** Find the bucket for a value
+ *
+ */
+static inline int histogram_index(fr_time_t value)
+{
+	int msb;
+
+	if (value < HISTOGRAM_SUB_COUNT) return value;
+
+#ifdef __GNUC__
+	msb = 63 - __builtin_clzll(value);
+#else
+	for (msb = 63; (value & (((uint64_t) 1) << msb)) == 0; msb--) {
+		/* nothing */
+	}
+#endif
+
+	return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+		((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+/** Find the smallest value which is counted in a bucket
+ *
+ */
+static inline fr_time_t histogram_value(int index)
+{
+	int group, msb;
+
+	if (index < HISTOGRAM_SUB_COUNT) return index;
+
+	group = index >> HISTOGRAM_SUB_BITS;
+	msb = group + HISTOGRAM_SUB_BITS - 1;
+
+	return ((fr_time_t) (HISTOGRAM_SUB_COUNT + (index & (HISTOGRAM_SUB_COUNT - 1)))) << (msb - HISTOGRAM_SUB_BITS);
+}
+
+/** Create a latency histogram
+ *
+ * @param[in] ctx the talloc context
+ * @return
+ *	- NULL on error
+ *	- fr_time_histogram_t on success
+ */
+fr_time_histogram_t *fr_time_histogram_create(TALLOC_CTX *ctx)
+{
+	int i;
+	fr_time_histogram_t *th;
+
+	th = talloc_zero(ctx, fr_time_histogram_t);
+	if (!th) return NULL;
+
+	atomic_init(&th->count, 0);
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		atomic_init(&th->buckets[i], 0);
+	}
+
+	return th;
+}
+
+/** Add a value to a histogram
+ *
+ *  This function MUST only be called by the thread which owns the
+ *  histogram.  As there is only one writer, the counters don't
+ *  need atomic read-modify-write operations.  They only need to be
+ *  stored atomically, so that readers in other threads see
+ *  consistent values.
+ *
+ * @param[in] th the histogram
+ * @param[in] value to add
+ */
+void fr_time_histogram_add(fr_time_histogram_t *th, fr_time_t value)
+{
+	atomic_uint_fast64_t *bucket;
+
+	bucket = &th->buckets[histogram_index(value)];
+
+	atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+	atomic_store_explicit(&th->count, atomic_load_explicit(&th->count, memory_order_relaxed) + 1,
+			      memory_order_release);
+}
+
+/** Add the counts from one histogram to another
+ *
+ *  This function can be called from any thread.  The destination
+ *  MUST NOT be in use by any other thread.  The source may still
+ *  be updated while it is being read, in which case the result
+ *  will include some (but not all) of the concurrent updates.
+ *
+ * @param[in] dst the histogram to update
+ * @param[in] src the histogram to read
+ */
+void fr_time_histogram_merge(fr_time_histogram_t *dst, fr_time_histogram_t const *src)
+{
+	int i;
+	uint64_t count, total = 0;
+
+	(void) atomic_load_explicit(&src->count, memory_order_acquire);
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		count = atomic_load_explicit(&src->buckets[i], memory_order_relaxed);
+		if (!count) continue;
+
+		atomic_store_explicit(&dst->buckets[i],
+				      atomic_load_explicit(&dst->buckets[i], memory_order_relaxed) + count,
+				      memory_order_relaxed);
+		total += count;
+	}
+
+	/*
+	 *	The count is the sum of the buckets we actually read,
+	 *	so that the percentiles are consistent.
+	 */
+	atomic_store_explicit(&dst->count, atomic_load_explicit(&dst->count, memory_order_relaxed) + total,
+			      memory_order_release);
+}
+
+/** Return the number of values in a histogram
+ *
+ * @param[in] th the histogram
+ * @return the number of values
+ */
+uint64_t fr_time_histogram_count(fr_time_histogram_t const *th)
+{
+	return atomic_load_explicit(&th->count, memory_order_acquire);
+}
+
+/** Return a percentile from a histogram
+ *
+ *  The result is the largest value which is counted in the same
+ *  bucket as the percentile.
+ *
+ * @param[in] th the histogram
+ * @param[in] percentile to find, e.g. 99.9
+ * @return
+ *	- 0 if the histogram is empty
+ *	- the value at that percentile
+ */
+fr_time_t fr_time_histogram_percentile(fr_time_histogram_t const *th, double percentile)
+{
+	int i;
+	uint64_t count, target, seen = 0;
+
+	count = atomic_load_explicit(&th->count, memory_order_acquire);
+	if (!count) return 0;
+
+	if (percentile < 0) percentile = 0;
+	if (percentile > 100) percentile = 100;
+
+	target = (uint64_t) ((percentile * count) / 100.0 + 0.5);
+	if (!target) target = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += atomic_load_explicit(&th->buckets[i], memory_order_relaxed);
+		if (seen >= target) break;
+	}
+
+	if (i >= (HISTOGRAM_BUCKETS - 1)) return UINT64_MAX;
+
+	return histogram_value(i + 1) - 1;
+}
+
+/** Print debug information about a histogram
+ *
+ * @param[in] th the histogram
+ * @param[in] name the name to print
+ * @param[in] fp the file where the debug output is printed.
+ */
+void fr_time_histogram_debug(fr_time_histogram_t const *th, char const *name, FILE *fp)
+{
+	fprintf(fp, "	%s count = %" PRIu64 " p50 = %" PRIu64 " p99 = %" PRIu64 " p999 = %" PRIu64 "\n",
+		name, fr_time_histogram_count(th),
+		fr_time_histogram_percentile(th, 50),
+		fr_time_histogram_percentile(th, 99),
+		fr_time_histogram_percentile(th, 99.9));
+}
@@ -31,6 +31,7 @@ RCSIDH(time_h, "$Id$")
 #include <freeradius-devel/missing.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <talloc.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -75,6 +76,25 @@ typedef struct fr_time_tracking_t {
 	fr_dlist_t	list;			//!< for linking a request to various lists
 } fr_time_tracking_t;
 
+/**
+ *  The stages of processing a request, for latency histograms.
+ */
+typedef enum fr_time_stage_t {
+	FR_TIME_STAGE_QUEUE = 0,		//!< waiting in the worker queue, before decode
+	FR_TIME_STAGE_DECODE,			//!< decoding the packet
+	FR_TIME_STAGE_RUN,			//!< running the request
+	FR_TIME_STAGE_YIELDED,			//!< yielded, waiting for something to resume it
+	FR_TIME_STAGE_ENCODE,			//!< encoding the reply
+	FR_TIME_STAGE_MAX
+} fr_time_stage_t;
+
+/**
+ *  A latency histogram.
+ *
+ *  Each histogram has a single writer, and any number of readers.
+ */
+typedef struct fr_time_histogram_t fr_time_histogram_t;
+
 #define NANOSEC (1000000000)
 #define USEC	(1000000)
 
@@ -100,6 +120,15 @@ void fr_time_tracking_yield(fr_time_tracking_t *tt, fr_time_t when, fr_time_trac
 void fr_time_tracking_resume(fr_time_tracking_t *tt, fr_time_t when) CC_HINT(nonnull);
 void fr_time_tracking_debug(fr_time_tracking_t *tt, FILE *fp) CC_HINT(nonnull);
 
+extern char const *fr_time_stage_names[FR_TIME_STAGE_MAX];
+
+fr_time_histogram_t *fr_time_histogram_create(TALLOC_CTX *ctx);
+void fr_time_histogram_add(fr_time_histogram_t *th, fr_time_t value) CC_HINT(nonnull);
+void fr_time_histogram_merge(fr_time_histogram_t *dst, fr_time_histogram_t const *src) CC_HINT(nonnull);
+uint64_t fr_time_histogram_count(fr_time_histogram_t const *th) CC_HINT(nonnull);
+fr_time_t fr_time_histogram_percentile(fr_time_histogram_t const *th, double percentile) CC_HINT(nonnull);
+void fr_time_histogram_debug(fr_time_histogram_t const *th, char const *name, FILE *fp) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,8 +25,11 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/util/track.h>
+#include <freeradius-devel/hash.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <string.h>
+
 /**
  *  RADIUS-specific tracking table.
  *
@@ -39,16 +42,30 @@ RCSID("$Id$")
  *  clean up the replies.  The heap should contain nothing more than
  *  the time and the ID of the packet which needs cleaning up.
  *
- *  @todo add an "allocation" heap, ordered by when the entry was
- *  freed.  This is so that new allocations are O(1), and use the
- *  oldest unused ID.
+ *  Unused entries are kept in a free list, ordered by when the entry
+ *  was freed.  New allocations are O(1), and use the oldest unused
+ *  ID.
+ *
+ *  A table can also hold tables for individual clients, keyed by
+ *  source IP address and port.  That gives duplicate detection keyed
+ *  by (src, port, id, authenticator) for a socket which receives
+ *  packets from many clients.
  */
 struct fr_tracking_t {
 	int		num_entries;	//!< number of used entries.
 
+	fr_dlist_t	free_list;	//!< unused entries, least recently freed first
+
+	fr_ipaddr_t	src_ipaddr;	//!< client address, for per-client tables
+	uint16_t	src_port;	//!< client port, for per-client tables
+
+	fr_hash_table_t	*clients;	//!< per-client tracking tables
+
 	fr_tracking_entry_t packet[256];
 };
 
+#define ENTRY_FROM_LIST(_p) ((fr_tracking_entry_t *) (((uint8_t *) (_p)) - offsetof(fr_tracking_entry_t, list)))
+
 /** Create a tracking table for one type of RADIUS packets.
  *
  * @param[in] ctx the talloc ctx
@@ -58,6 +75,7 @@ struct fr_tracking_t {
  */
 fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx)
 {
+	int i;
 	fr_tracking_t *ft;
 
 	if (!ctx) return NULL;
@@ -66,6 +84,16 @@ fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx)
 	if (!ft) return NULL;
 
 	ft->num_entries = 0;
+
+	/*
+	 *	Start off with the IDs in order.
+	 */
+	FR_DLIST_INIT(ft->free_list);
+	for (i = 0; i < 256; i++) {
+		ft->packet[i].id = i;
+		FR_DLIST_INSERT_TAIL(ft->free_list, ft->packet[i].list);
+	}
+
 	return ft;
 }
 
@@ -91,6 +119,11 @@ int fr_radius_tracking_entry_delete(fr_tracking_t *ft, uint8_t id)
 	entry->timestamp = 0;
 	ft->num_entries--;
 
+	/*
+	 *	This is now the most recently freed entry.
+	 */
+	FR_DLIST_INSERT_TAIL(ft->free_list, entry->list);
+
 	/*
 	 *	Mark the reply (if any) as done.
 	 */
@@ -129,6 +162,8 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t
 	 *	The entry is unused, insert it.
 	 */
 	if (entry->timestamp == 0) {
+		FR_DLIST_REMOVE(entry->list);
+
 		entry->timestamp = timestamp;
 		memcpy(&entry->data[0], packet + 2, 18);
 		*p_entry = entry;
@@ -192,3 +227,158 @@ int fr_radius_tracking_entry_reply(fr_tracking_t *ft, uint8_t id,
 
 	return 0;
 }
+
+/** Allocate an unused entry
+ *
+ *  The entry is the one which has been unused for the longest time.
+ *  The caller should fill in entry->data once the packet has been
+ *  encoded.
+ *
+ * @param[in] ft the tracking table
+ * @param[in] timestamp when the packet is being sent.  MUST NOT be 0.
+ * @return
+ *	- NULL if all of the IDs are in use
+ *	- the new entry on success.  The allocated ID is entry->id.
+ */
+fr_tracking_entry_t *fr_radius_tracking_entry_alloc(fr_tracking_t *ft, fr_time_t timestamp)
+{
+	fr_dlist_t *head;
+	fr_tracking_entry_t *entry;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(ft, fr_tracking_t);
+#endif
+
+	rad_assert(timestamp != 0);
+
+	head = FR_DLIST_FIRST(ft->free_list);
+	if (!head) return NULL;
+
+	entry = ENTRY_FROM_LIST(head);
+	rad_assert(entry->timestamp == 0);
+
+	FR_DLIST_REMOVE(entry->list);
+
+	entry->timestamp = timestamp;
+	memset(&entry->data[0], 0, sizeof(entry->data));
+	ft->num_entries++;
+
+	return entry;
+}
+
+/** Return the number of entries which are in use
+ *
+ * @param[in] ft the tracking table
+ * @return the number of used entries
+ */
+int fr_radius_tracking_num_entries(fr_tracking_t const *ft)
+{
+	return ft->num_entries;
+}
+
+/** Check if all of the IDs are in use
+ *
+ * @param[in] ft the tracking table
+ * @return
+ *	- true if there are no free IDs
+ *	- false if there are free IDs
+ */
+bool fr_radius_tracking_full(fr_tracking_t const *ft)
+{
+	return (ft->num_entries == 256);
+}
+
+static uint32_t tracking_client_hash(void const *data)
+{
+	uint32_t hash;
+	fr_tracking_t const *ft = data;
+
+	hash = fr_hash(&ft->src_port, sizeof(ft->src_port));
+
+	if (ft->src_ipaddr.af == AF_INET) {
+		return fr_hash_update(&ft->src_ipaddr.ipaddr.ip4addr, sizeof(ft->src_ipaddr.ipaddr.ip4addr), hash);
+	}
+
+	return fr_hash_update(&ft->src_ipaddr.ipaddr.ip6addr, sizeof(ft->src_ipaddr.ipaddr.ip6addr), hash);
+}
+
+static int tracking_client_cmp(void const *one, void const *two)
+{
+	fr_tracking_t const *a = one;
+	fr_tracking_t const *b = two;
+
+	if (a->src_port < b->src_port) return -1;
+	if (a->src_port > b->src_port) return +1;
+
+	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
+}
+
+/** Find the tracking table for one client
+ *
+ * @param[in] ft the parent tracking table
+ * @param[in] src_ipaddr the client IP address
+ * @param[in] src_port the client port
+ * @param[in] create whether to create the client table if it doesn't exist
+ * @return
+ *	- NULL on error, or the table doesn't exist
+ *	- fr_tracking_t * on success
+ */
+fr_tracking_t *fr_radius_tracking_client(fr_tracking_t *ft, fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+					 bool create)
+{
+	fr_tracking_t my_client, *client;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(ft, fr_tracking_t);
+#endif
+
+	if (!ft->clients) {
+		if (!create) return NULL;
+
+		ft->clients = fr_hash_table_create(ft, tracking_client_hash, tracking_client_cmp, NULL);
+		if (!ft->clients) return NULL;
+	}
+
+	my_client.src_ipaddr = *src_ipaddr;
+	my_client.src_port = src_port;
+
+	client = fr_hash_table_finddata(ft->clients, &my_client);
+	if (client || !create) return client;
+
+	client = fr_radius_tracking_create(ft);
+	if (!client) return NULL;
+
+	client->src_ipaddr = *src_ipaddr;
+	client->src_port = src_port;
+
+	if (!fr_hash_table_insert(ft->clients, client)) {
+		talloc_free(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+/** Insert a (possibly new) packet from a client
+ *
+ *  This is fr_radius_tracking_entry_insert(), using the table for
+ *  the client which sent the packet.
+ *
+ * @param[in] ft the parent tracking table
+ * @param[in] address where the packet came from
+ * @param[in] packet the packet to insert
+ * @param[in] timestamp when this packet was received
+ * @param[out] p_entry pointer to newly inserted entry.
+ * @return the same as fr_radius_tracking_entry_insert()
+ */
+fr_tracking_status_t fr_radius_tracking_address_insert(fr_tracking_t *ft, fr_channel_address_t const *address,
+						       uint8_t *packet, fr_time_t timestamp,
+						       fr_tracking_entry_t **p_entry)
+{
+	fr_tracking_t *client;
+
+	client = fr_radius_tracking_client(ft, &address->src_ipaddr, address->src_port, true);
+	if (!client) return FR_TRACKING_UNUSED;
+
+	return fr_radius_tracking_entry_insert(client, packet, timestamp, p_entry);
+}
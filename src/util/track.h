@@ -43,6 +43,8 @@ typedef struct fr_tracking_t fr_tracking_t;
 typedef struct fr_tracking_entry_t {
 	fr_time_t		timestamp;	//!< when the request was received
 	fr_channel_data_t	*reply;		//!< the reply (if any)
+	fr_dlist_t		list;		//!< for the free list, when the entry is unused
+	uint8_t			id;		//!< the RADIUS ID of this entry
 	uint8_t			data[18];	//!< 2 byte length + authentication vector
 } fr_tracking_entry_t;
 
@@ -63,6 +65,16 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_t *ft, uint8_t
 int fr_radius_tracking_entry_reply(fr_tracking_t *ft, uint8_t id,
 				   fr_channel_data_t *cd) CC_HINT(nonnull);
 
+fr_tracking_entry_t *fr_radius_tracking_entry_alloc(fr_tracking_t *ft, fr_time_t timestamp) CC_HINT(nonnull);
+int fr_radius_tracking_num_entries(fr_tracking_t const *ft) CC_HINT(nonnull);
+bool fr_radius_tracking_full(fr_tracking_t const *ft) CC_HINT(nonnull);
+
+fr_tracking_t *fr_radius_tracking_client(fr_tracking_t *ft, fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+					 bool create) CC_HINT(nonnull);
+fr_tracking_status_t fr_radius_tracking_address_insert(fr_tracking_t *ft, fr_channel_address_t const *address,
+						       uint8_t *packet, fr_time_t timestamp,
+						       fr_tracking_entry_t **p_entry) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,6 +27,7 @@ RCSIDH(transport_h, "$Id$")
 
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/channel.h>
+#include <freeradius-devel/util/coro.h>
 //#include <freeradius-devel/util/io.h>
 
 #ifdef __cplusplus
@@ -86,6 +87,11 @@ typedef int (*fr_transport_decode_t)(void const *packet_ctx, uint8_t *const data
 typedef size_t (*fr_transport_nak_t)(void const *packet_ctx, uint8_t *const packet, size_t packet_len,
 				      uint8_t *reply, size_t reply_len);
 
+/**
+ *  Have a raw packet, and find its traffic class (master).
+ */
+typedef fr_channel_class_t (*fr_transport_classify_t)(void const *packet_ctx, uint8_t const *data, size_t data_len);
+
 /**
  *  Have a REQUEST, and encode it to raw packet.
  */
@@ -125,6 +131,7 @@ typedef struct fr_transport_t {
 	fr_transport_nak_t		nak;		//!< function to send a NAK
 	fr_transport_send_reply_t	send_reply;	//!< function to send a reply (worker -> master)
 	fr_transport_process_t		process;	//!< process a request
+	fr_transport_classify_t		classify;	//!< find the traffic class of a packet (master, optional)
 } fr_transport_t;
 
 typedef enum fr_transport_status_t {
@@ -159,9 +166,12 @@ struct rad_request {
 	fr_time_t		*original_recv_time;
 	fr_event_list_t		*el;
 	fr_transport_process_t	process_async;
+	fr_coro_t		*coro;			//!< the stack the request is running on, if any
 	fr_time_tracking_t	tracking;
+	fr_time_t		decode_time;		//!< how long it took to decode the request
 	fr_channel_t		*channel;
 	void			*packet_ctx;
+	fr_channel_address_t	address;		//!< addressing information from the request packet
 	fr_transport_t		*transport;
 };
 #endif
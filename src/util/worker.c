@@ -37,9 +37,12 @@
  *  The lifecycle of a packet MUST be carefully managed.  Initially,
  *  messages are put into the "to_decode" heap.  If the messages sit
  *  in the heap for too long, they are localized and put into the
- *  "localized" heap.  Each heap is ordered by (priority, time), so
- *  that high priority packets take precedence over low priority
- *  packets.
+ *  "localized" heap.  Each heap has one sub-heap per traffic class
+ *  (auth, acct, CoA, etc.), and the worker takes messages from the
+ *  sub-heaps by weighted fair queueing, so that a flood of one class
+ *  can't starve the others.  Each sub-heap is ordered by (priority,
+ *  time), so that high priority packets take precedence over low
+ *  priority packets.
  *
  *  Both queues have linked lists of received packets, ordered by
  *  time.  This list is used to clean up packets which have been in
@@ -57,14 +60,34 @@
  *  yeilded, it is placed onto the yielded list in the worker
  *  "tracking" data structure.
  *
+ *  Requests may also be run on coroutines, with their own stacks.
+ *  Code which is written as a series of blocking calls can then
+ *  call fr_worker_coro_wait() to give the worker back to the event
+ *  loop, without being rewritten as a state machine.
+ *
+ *  Workers may also steal work from each other.  When a worker has a
+ *  large "to_decode" heap, and a sibling is idle, it offers some of
+ *  the messages to the sibling via a lock-free atomic queue.  The
+ *  sibling decodes and runs the requests, and hands the replies back
+ *  to the original worker, which owns the channel.
+ *
  * @copyright 2016 Alan DeKok <aland@freeradius.org>
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/autoconf.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #include <freeradius-devel/util/worker.h>
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/util/message.h>
+#include <freeradius-devel/util/coro.h>
 #include <freeradius-devel/rad_assert.h>
 
 /*
@@ -76,12 +99,85 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
+/*
+ *	When a worker has more than STEAL_THRESHOLD messages waiting
+ *	to be decoded, it offers up to STEAL_BATCH of them to an idle
+ *	sibling.  Messages which aren't stolen within STEAL_TIMEOUT are
+ *	taken back.
+ */
+#define STEAL_THRESHOLD		(8)
+#define STEAL_BATCH		(16)
+#define STEAL_QUEUE_SIZE	(64)
+#define STEAL_TIMEOUT		(NANOSEC / 100)
+
+/*
+ *	How many messages we pull from a channel at a time.
+ */
+#define DRAIN_BURST		(32)
+
+/*
+ *	How many idle coroutine stacks we keep for re-use.
+ */
+#define CORO_IDLE		(64)
+
+/*
+ *	How many freed REQUESTs we keep for re-use.
+ */
+#define REQUEST_CACHE_SIZE	(256)
+
+/*
+ *	How often we check the memory used by a REQUEST, and the
+ *	largest talloc pool we allocate for one.
+ */
+#define REQUEST_POOL_SAMPLE	(64)
+#define REQUEST_POOL_MAX	(1024 * 1024)
+
+#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
+
+/**
+ *  Signals sent between workers, and from the scheduler.
+ */
+typedef enum fr_worker_signal_t {
+	FR_WORKER_SIGNAL_SIBLINGS = 0,		//!< here is the list of sibling workers
+	FR_WORKER_SIGNAL_OFFER,			//!< the sender has work for us to steal
+	FR_WORKER_SIGNAL_REPLY,			//!< send this reply for a stolen request
+} fr_worker_signal_t;
+
+typedef struct fr_worker_control_t {
+	fr_worker_signal_t	signal;		//!< the signal to send
+	fr_worker_t		*worker;	//!< the worker who sent the signal
+	fr_channel_t		*ch;		//!< the channel for the reply
+	fr_channel_data_t	*reply;		//!< the reply to send
+
+	int			num_siblings;	//!< number of sibling workers
+	fr_worker_t		**siblings;	//!< array of sibling workers
+} fr_worker_control_t;
+
 /**
- *  Track things by priority and time.
+ *  Per-channel data for the worker which owns the channel.
+ */
+typedef struct fr_worker_channel_t {
+	fr_worker_t		*worker;	//!< the worker which owns the channel
+	fr_message_set_t	*ms;		//!< replies are allocated from here
+} fr_worker_channel_t;
+
+/*
+ *	Weighted fair queueing.  Each time a message is taken from a
+ *	traffic class, the virtual time of that class advances by
+ *	WFQ_SCALE / weight.  The class with the smallest virtual time
+ *	goes next.
+ */
+#define WFQ_SCALE		(1 << 16)
+
+/**
+ *  Track things by traffic class, priority and time.
  */
 typedef struct fr_worker_heap_t {
 	fr_dlist_t	list;			//!< list of things, ordered by time.
-	fr_heap_t	*heap;			//!< heap, ordered by priority
+	fr_heap_t	*heap[FR_CHANNEL_CLASS_MAX]; //!< one heap per traffic class, ordered by priority
+	uint64_t	vtime[FR_CHANNEL_CLASS_MAX]; //!< virtual time of each traffic class
+	uint64_t	now;			//!< virtual time of the last message taken from the heaps
+	int		num_elements;		//!< number of messages in all of the heaps
 } fr_worker_heap_t;
 
 
@@ -95,7 +191,9 @@ struct fr_worker_t {
 
 	fr_control_t		*control;	//!< the control plane
 
-	fr_message_set_t	*ms;		//!< replies are allocated from here.
+	fr_message_set_t	*ms;		//!< replies to stolen requests are allocated from here.
+
+	fr_ring_buffer_t	*rb;		//!< for control-plane messages we send to other workers
 
 	fr_event_list_t		*el;		//!< our event list
 
@@ -107,6 +205,11 @@ struct fr_worker_t {
 
 	size_t			talloc_pool_size; //!< for each REQUEST
 
+	fr_dlist_t		request_cache;	//!< freed REQUESTs, with their talloc pools, for re-use
+	int			num_cached;	//!< number of REQUESTs in the cache
+	int			num_reused;	//!< number of REQUESTs taken from the cache
+	uint32_t		num_freed;	//!< number of REQUESTs freed, for sampling their size
+
 	fr_time_t		checked_timeout; //!< when we last checked the tails of the queues
 
 	fr_worker_heap_t	to_decode;	//!< messages from the master, to be decoded or localized
@@ -121,9 +224,34 @@ struct fr_worker_t {
 	int			num_decoded;	//!< number of messages which have been decoded
 	int			num_replies;	//!< number of messages which were replied to
 	int			num_timeouts;	//!< number of messages which timed out
+	int			num_dropped;	//!< number of messages dropped because they would miss their deadline
+
+	fr_time_t		deadline;	//!< how long the client waits for a reply before it retransmits
+
+	atomic_bool		idle;		//!< we're sleeping, and will steal work from siblings
+
+	fr_atomic_queue_t	*aq_steal;	//!< messages offered to idle siblings
+	fr_time_t		offered;	//!< when we last offered messages to a sibling
+	int			num_offered;	//!< number of messages offered to siblings
+	int			num_stolen;	//!< number of messages stolen from siblings
+
+	int			num_siblings;	//!< number of sibling workers
+	fr_worker_t		**siblings;	//!< sibling workers, including ourselves
 
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
+	fr_coro_pool_t		*coro_pool;	//!< stacks for requests, or NULL to run requests on the worker stack
+	int			num_coro_yields; //!< number of times a request yielded from its own stack
+
+	atomic_uint_fast64_t	load_depth;	//!< published number of messages and requests waiting to be processed
+	atomic_uint_fast64_t	load_wait;	//!< published time the oldest message has been waiting
+	atomic_int		load_channels;	//!< published number of open channels
+	atomic_uint_fast64_t	load_running;	//!< published total time spent running requests
+
+	uint64_t		wfq_cost[FR_CHANNEL_CLASS_MAX]; //!< virtual time cost of a message, by traffic class
+
+	fr_time_histogram_t	*latency[FR_TIME_STAGE_MAX]; //!< per-stage latency of the requests we've processed
+
 	uint32_t       		num_transports;	//!< how many transport layers we have
 	fr_transport_t		**transports;	//!< array of active transports.
 
@@ -135,29 +263,96 @@ struct fr_worker_t {
  *	the same code.
  */
 #define WORKER_HEAP_INIT(_name, _func, _type, _member) do { \
+		int _i; \
 		FR_DLIST_INIT(worker->_name.list); \
-		worker->_name.heap = fr_heap_create(_func, offsetof(_type, _member)); \
-		if (!worker->_name.heap) { \
-			talloc_free(worker); \
-			return NULL; \
+		for (_i = 0; _i < FR_CHANNEL_CLASS_MAX; _i++) { \
+			worker->_name.heap[_i] = fr_heap_create_arity(_func, offsetof(_type, _member), 4); \
+			if (!worker->_name.heap[_i]) { \
+				talloc_free(worker); \
+				return NULL; \
+			} \
 		} \
 	} while (0)
 
 #define WORKER_HEAP_INSERT(_name, _var, _member) do { \
 		FR_DLIST_INSERT_HEAD(worker->_name.list, _var->_member); \
-		(void) fr_heap_insert(worker->_name.heap, _var);        \
+		fr_worker_heap_insert(&worker->_name, _var);        \
 	} while (0)
 
 #define WORKER_HEAP_POP(_name, _var, _member) do { \
-		_var = fr_heap_pop(worker->_name.heap); \
+		_var = fr_worker_heap_pop(worker, &worker->_name); \
 		if (_var) FR_DLIST_REMOVE(_var->_member); \
 	} while (0)
 
 #define WORKER_HEAP_EXTRACT(_name, _var, _member) do { \
-               (void) fr_heap_extract(worker->_name.heap, _var); \
+               fr_worker_heap_extract(&worker->_name, _var); \
                FR_DLIST_REMOVE(_var->_member); \
        } while (0)
 
+/** Insert a message into a worker heap
+ *
+ *  A traffic class which has been idle doesn't get credit for the
+ *  time it was idle.  Its virtual time catches up to the current
+ *  virtual time, so that it can't starve the other classes.
+ *
+ * @param[in] wh the worker heap
+ * @param[in] cd the message to insert
+ */
+static void fr_worker_heap_insert(fr_worker_heap_t *wh, fr_channel_data_t *cd)
+{
+	fr_channel_class_t tc = cd->traffic_class;
+
+	rad_assert(tc < FR_CHANNEL_CLASS_MAX);
+
+	if ((fr_heap_num_elements(wh->heap[tc]) == 0) && (wh->vtime[tc] < wh->now)) {
+		wh->vtime[tc] = wh->now;
+	}
+
+	(void) fr_heap_insert(wh->heap[tc], cd);
+	wh->num_elements++;
+}
+
+/** Take the next message from a worker heap, using weighted fair queueing
+ *
+ *  Within a traffic class, messages are taken in (priority, time)
+ *  order.
+ *
+ * @param[in] worker the worker
+ * @param[in] wh the worker heap
+ * @return
+ *	- NULL if the heap is empty
+ *	- the next message
+ */
+static fr_channel_data_t *fr_worker_heap_pop(fr_worker_t *worker, fr_worker_heap_t *wh)
+{
+	int i, tc = -1;
+
+	if (!wh->num_elements) return NULL;
+
+	for (i = 0; i < FR_CHANNEL_CLASS_MAX; i++) {
+		if (fr_heap_num_elements(wh->heap[i]) == 0) continue;
+
+		if ((tc < 0) || (wh->vtime[i] < wh->vtime[tc])) tc = i;
+	}
+	rad_assert(tc >= 0);
+
+	wh->now = wh->vtime[tc];
+	wh->vtime[tc] += worker->wfq_cost[tc];
+	wh->num_elements--;
+
+	return fr_heap_pop(wh->heap[tc]);
+}
+
+/** Remove a message from a worker heap
+ *
+ * @param[in] wh the worker heap
+ * @param[in] cd the message to remove
+ */
+static void fr_worker_heap_extract(fr_worker_heap_t *wh, fr_channel_data_t *cd)
+{
+	if (fr_heap_extract(wh->heap[cd->traffic_class], cd)) wh->num_elements--;
+}
+
 
 /** Drain the input channel
  *
@@ -167,20 +362,224 @@ struct fr_worker_t {
  */
 static void fr_worker_drain_input(fr_worker_t *worker, fr_channel_t *ch, fr_channel_data_t *cd)
 {
-	if (!cd) {
-		cd = fr_channel_recv_request(ch);
-		if (!cd) {
+	int i, num;
+	fr_channel_data_t *burst[DRAIN_BURST];
+
+	if (cd) {
+		burst[0] = cd;
+		num = 1;
+	} else {
+		num = fr_channel_recv_request_n(ch, burst, DRAIN_BURST);
+		if (!num) {
 			MPRINT("\tno data?\n");
 			return;
 		}
 	}
 
 	do {
-		worker->num_requests++;
-		MPRINT("\tWORKER received request %zd\n", worker->num_requests);
-		cd->channel.ch = ch;
+		for (i = 0; i < num; i++) {
+			cd = burst[i];
+
+			worker->num_requests++;
+			MPRINT("\tWORKER received request %zd\n", worker->num_requests);
+			cd->channel.ch = ch;
+			WORKER_HEAP_INSERT(to_decode, cd, request.list);
+		}
+	} while ((num = fr_channel_recv_request_n(ch, burst, DRAIN_BURST)) > 0);
+}
+
+
+/** Get the message set used to allocate a reply on a channel
+ *
+ *  The message set of a channel belongs to the worker which owns the
+ *  channel.  Requests stolen from a sibling are replied to from our
+ *  own message set.
+ *
+ * @param[in] worker the worker
+ * @param[in] ch the channel
+ * @return the message set
+ */
+static fr_message_set_t *fr_worker_reply_ms(fr_worker_t *worker, fr_channel_t *ch)
+{
+	fr_worker_channel_t *wc;
+
+	wc = fr_channel_worker_ctx_get(ch);
+	rad_assert(wc != NULL);
+
+	if (wc->worker == worker) return wc->ms;
+
+	return worker->ms;
+}
+
+
+/** Send a reply on a channel
+ *
+ *  If we own the channel, the reply is sent directly.  Otherwise the
+ *  request was stolen, and the reply is sent to the worker which
+ *  owns the channel.  That worker then sends the reply for us.
+ *
+ * @param[in] worker the worker
+ * @param[in] ch the channel
+ * @param[in] reply the reply to send
+ */
+static void fr_worker_reply_push(fr_worker_t *worker, fr_channel_t *ch, fr_channel_data_t *reply)
+{
+	fr_channel_data_t *cd;
+	fr_worker_channel_t *wc;
+
+	wc = fr_channel_worker_ctx_get(ch);
+	rad_assert(wc != NULL);
+
+	if (wc->worker != worker) {
+		fr_worker_control_t msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.signal = FR_WORKER_SIGNAL_REPLY;
+		msg.worker = worker;
+		msg.ch = ch;
+		msg.reply = reply;
+
+		if (fr_control_message_send(wc->worker->control, worker->rb, FR_CONTROL_ID_WORKER, &msg, sizeof(msg)) < 0) {
+			MPRINT("\tWORKER fails sending stolen reply\n");
+			fr_message_done(&reply->m);
+		}
+		return;
+	}
+
+	/*
+	 *	Send the reply, which also polls the request queue.
+	 */
+	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+		MPRINT("\tWORKER fails sending reply\n");
+		cd = NULL;
+	}
+
+	worker->num_replies++;
+
+	/*
+	 *	Drain the incoming TO_WORKER queue.  We do this every
+	 *	time we're done processing a request.
+	 */
+	if (cd) fr_worker_drain_input(worker, ch, cd);
+}
+
+
+/** Offer messages to an idle sibling
+ *
+ *  Only messages which have not been decoded or localized are
+ *  offered.  Those messages belong to the network thread, and can be
+ *  processed by any worker.
+ *
+ * @param[in] worker the worker
+ * @param[in] now the current time
+ */
+static void fr_worker_steal_offer(fr_worker_t *worker, fr_time_t now)
+{
+	int i, num;
+	fr_channel_data_t *cd;
+	fr_worker_t *sibling = NULL;
+	fr_worker_control_t msg;
+
+	if (worker->to_decode.num_elements <= STEAL_THRESHOLD) return;
+
+	for (i = 0; i < worker->num_siblings; i++) {
+		if (worker->siblings[i] == worker) continue;
+
+		if (!atomic_load_explicit(&worker->siblings[i]->idle, memory_order_acquire)) continue;
+
+		sibling = worker->siblings[i];
+		break;
+	}
+	if (!sibling) return;
+
+	for (num = 0; num < STEAL_BATCH; num++) {
+		if (worker->to_decode.num_elements <= STEAL_THRESHOLD) break;
+
+		WORKER_HEAP_POP(to_decode, cd, request.list);
+		if (!cd) break;
+
+		if (!fr_atomic_queue_push(worker->aq_steal, cd)) {
+			WORKER_HEAP_INSERT(to_decode, cd, request.list);
+			break;
+		}
+	}
+
+	if (!num) return;
+
+	worker->num_offered += num;
+	worker->offered = now;
+
+	/*
+	 *	Mark the sibling as busy, so that we don't offer it
+	 *	more work until it goes back to sleep.
+	 */
+	atomic_store_explicit(&sibling->idle, false, memory_order_release);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.signal = FR_WORKER_SIGNAL_OFFER;
+	msg.worker = worker;
+
+	(void) fr_control_message_send(sibling->control, worker->rb, FR_CONTROL_ID_WORKER, &msg, sizeof(msg));
+}
+
+
+/** Steal messages from a sibling
+ *
+ * @param[in] worker the worker
+ * @param[in] victim the sibling to steal from
+ * @return the number of messages stolen
+ */
+static int fr_worker_steal(fr_worker_t *worker, fr_worker_t *victim)
+{
+	int num;
+	fr_channel_data_t *cd;
+
+	for (num = 0; num < STEAL_BATCH; num++) {
+		if (!fr_atomic_queue_pop(victim->aq_steal, (void **) &cd)) break;
+
 		WORKER_HEAP_INSERT(to_decode, cd, request.list);
-	} while ((cd = fr_channel_recv_request(ch)) != NULL);
+	}
+
+	worker->num_stolen += num;
+
+	return num;
+}
+
+
+/** Handle a control message from another worker, or from the scheduler
+ *
+ * @param[in] ctx the worker
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_worker_worker_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_worker_control_t msg;
+	fr_worker_t *worker = ctx;
+
+	rad_assert(data_size == sizeof(msg));
+	if (data_size != sizeof(msg)) return;
+
+	memcpy(&msg, data, sizeof(msg));
+
+	switch (msg.signal) {
+	case FR_WORKER_SIGNAL_SIBLINGS:
+		MPRINT("\tWORKER got %d siblings\n", msg.num_siblings);
+		worker->num_siblings = msg.num_siblings;
+		worker->siblings = msg.siblings;
+		break;
+
+	case FR_WORKER_SIGNAL_OFFER:
+		MPRINT("\tWORKER got offer of work\n");
+		(void) fr_worker_steal(worker, msg.worker);
+		break;
+
+	case FR_WORKER_SIGNAL_REPLY:
+		MPRINT("\tWORKER got reply for stolen request\n");
+		fr_worker_reply_push(worker, msg.ch, msg.reply);
+		break;
+	}
 }
 
 
@@ -196,7 +595,7 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 	int i;
 	bool ok;
 	fr_channel_t *ch;
-	fr_message_set_t *ms;
+	fr_worker_channel_t *wc;
 	fr_channel_event_t ce;
 	fr_worker_t *worker = ctx;
 
@@ -239,11 +638,15 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 			worker->channel[i] = ch;
 			MPRINT("\treceived channel %p into array entry %d\n", ch, i);
 
-			ms = fr_message_set_create(worker, worker->message_set_size,
-						   sizeof(fr_channel_data_t),
-						   worker->ring_buffer_size);
-			rad_assert(ms != NULL);
-			fr_channel_worker_ctx_add(ch, ms);
+			wc = talloc_zero(worker, fr_worker_channel_t);
+			rad_assert(wc != NULL);
+
+			wc->worker = worker;
+			wc->ms = fr_message_set_create(wc, worker->message_set_size,
+						       sizeof(fr_channel_data_t),
+						       worker->ring_buffer_size);
+			rad_assert(wc->ms != NULL);
+			fr_channel_worker_ctx_add(ch, wc);
 
 			worker->num_channels++;
 			ok = true;
@@ -264,6 +667,15 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 
 			if (worker->channel[i] != ch) continue;
 
+			wc = fr_channel_worker_ctx_get(ch);
+			rad_assert(wc != NULL);
+			fr_message_set_gc(wc->ms);
+			talloc_free(wc);
+
+			worker->channel[i] = NULL;
+			rad_assert(worker->num_channels > 0);
+			worker->num_channels--;
+
 			/*
 			 *	@todo check the status, and
 			 *	put the channel into a
@@ -271,17 +683,13 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 			 *	close it right now.  Then,
 			 *	wake up after a time and try
 			 *	to close it again.
+			 *
+			 *	The receiver may free the
+			 *	channel as soon as it sees the
+			 *	ACK, so we can't touch it
+			 *	after this.
 			 */
 			(void) fr_channel_worker_ack_close(ch);
-
-			ms = fr_channel_worker_ctx_get(ch);
-			rad_assert(ms != NULL);
-			fr_message_set_gc(ms);
-			talloc_free(ms);
-
-			worker->channel[i] = NULL;
-			rad_assert(worker->num_channels > 0);
-			worker->num_channels--;
 			ok = true;
 			break;
 		}
@@ -322,6 +730,24 @@ static void fr_worker_evfilt_user(UNUSED int kq, struct kevent const *kev, void
 }
 
 
+/** Fill in the addressing information for a reply
+ *
+ *  The reply goes back out the socket the request came in on, from
+ *  the address the request was sent to.
+ *
+ * @param[out] out the reply address
+ * @param[in] in the request address
+ */
+static void fr_worker_reply_address(fr_channel_address_t *out, fr_channel_address_t const *in)
+{
+	out->src_ipaddr = in->dst_ipaddr;
+	out->src_port = in->dst_port;
+	out->dst_ipaddr = in->src_ipaddr;
+	out->dst_port = in->src_port;
+	out->if_index = in->if_index;
+	out->sockfd = in->sockfd;
+}
+
 /** Send a NAK to the network thread
  *
  *  The network thread believes that a worker is running a request until that request has been NAK'd.
@@ -344,7 +770,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	 */
 	ch = cd->channel.ch;
 
-	ms = fr_channel_worker_ctx_get(ch);
+	ms = fr_worker_reply_ms(worker, ch);
 	rad_assert(ms != NULL);
 
 	/*
@@ -371,25 +797,107 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	reply->ctx = cd->ctx;
 	reply->priority = cd->priority;
 	reply->transport = cd->transport;
+	fr_worker_reply_address(&reply->address, &cd->address);
 
 	/*
 	 *	Mark the original message as done.
 	 */
 	fr_message_done(&cd->m);
 
+	fr_worker_reply_push(worker, ch, reply);
+}
+
+
+/** Allocate a REQUEST
+ *
+ *  Each REQUEST is at the start of its own talloc pool, so that
+ *  everything allocated for the request comes from one block of
+ *  memory.  Freed requests are cached, so that in the common case we
+ *  don't call malloc() or free() at all.
+ *
+ * @param[in] worker the worker
+ * @return
+ *	- NULL on error
+ *	- REQUEST on success
+ */
+static REQUEST *fr_worker_request_alloc(fr_worker_t *worker)
+{
+	fr_dlist_t *entry;
+	REQUEST *request;
+	TALLOC_CTX *ctx;
+
+	entry = FR_DLIST_FIRST(worker->request_cache);
+	if (entry) {
+		request = fr_ptr_to_type(REQUEST, time_order, entry);
+		FR_DLIST_REMOVE(request->time_order);
+		worker->num_cached--;
+		worker->num_reused++;
+
+		memset(request, 0, sizeof(*request));
+		return request;
+	}
+
+#ifndef HAVE_TALLOC_POOLED_OBJECT
 	/*
-	 *	Send the reply, which also polls the request queue.
+	 *	Get a talloc pool specifically for this packet.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		MPRINT("\tWORKER fails sending reply\n");
-		cd = NULL;
-	}
+	ctx = talloc_pool(worker, worker->talloc_pool_size);
+	if (!ctx) return NULL;
 
-	worker->num_replies++;
+	talloc_set_name_const(ctx, "REQUEST");
 
-	if (cd) fr_worker_drain_input(worker, ch, cd);
+	request = (REQUEST *) ctx;
+	memset(request, 0, sizeof(*request));
+#else
+	request = ctx = talloc_pooled_object(worker, REQUEST, 1, worker->talloc_pool_size);
+	if (!request) return NULL;
+
+	memset(request, 0, sizeof(*request));
+#endif
+
+	return request;
 }
 
+/** Free a REQUEST
+ *
+ *  Everything allocated from the request is freed, which resets its
+ *  talloc pool.  The REQUEST itself goes back into the cache.
+ *
+ * @param[in] worker the worker
+ * @param[in] request the request to free.  It MUST NOT be in any list or heap.
+ */
+static void fr_worker_request_free(fr_worker_t *worker, REQUEST *request)
+{
+	/*
+	 *	Every so often, check how much memory a request used.
+	 *	If it didn't fit in the pool, talloc fell back to
+	 *	malloc() for the rest, and freeing it is slow.  Grow
+	 *	the pools for new requests, and don't re-use this one.
+	 */
+	if ((worker->num_freed++ % REQUEST_POOL_SAMPLE) == 0) {
+		size_t used = talloc_total_size(request);
+
+		if ((used > worker->talloc_pool_size) && (worker->talloc_pool_size < REQUEST_POOL_MAX)) {
+			used += used / 4;
+			used = (used + 1023) & ~((size_t) 1023);
+			if (used > REQUEST_POOL_MAX) used = REQUEST_POOL_MAX;
+
+			worker->talloc_pool_size = used;
+			talloc_free(request);
+			return;
+		}
+	}
+
+	if (worker->num_cached >= REQUEST_CACHE_SIZE) {
+		talloc_free(request);
+		return;
+	}
+
+	talloc_free_children(request);
+
+	FR_DLIST_INSERT_HEAD(worker->request_cache, request->time_order);
+	worker->num_cached++;
+}
 
 /** Reply to a request
  *
@@ -401,9 +909,10 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
  */
 static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size)
 {
-	fr_channel_data_t *reply, *cd;
+	fr_channel_data_t *reply;
 	fr_channel_t *ch;
 	fr_message_set_t *ms;
+	fr_time_t encode_start, now, run;
 
 	/*
 	 *	Allocate and send the reply.
@@ -411,77 +920,223 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	ch = request->channel;
 	rad_assert(ch != NULL);
 
-	ms = fr_channel_worker_ctx_get(ch);
+	ms = fr_worker_reply_ms(worker, ch);
 	rad_assert(ms != NULL);
 
-	reply = (fr_channel_data_t *) fr_message_reserve(ms, size);
-	rad_assert(reply != NULL);
+	reply = (fr_channel_data_t *) fr_message_reserve(ms, size);
+	rad_assert(reply != NULL);
+
+	/*
+	 *	Encode it, if required.
+	 */
+	encode_start = 0;
+	if (size) {
+		ssize_t encoded;
+
+		encode_start = fr_time();
+
+		encoded = request->transport->encode(request->packet_ctx, request, reply->m.data, reply->m.rb_size);
+		if (encoded < 0) {
+			MPRINT("\tWORKER fails encode\n");
+			encoded = 0;
+		}
+
+		/*
+		 *	Resize the buffer to the actual packet size.
+		 */
+		reply = (fr_channel_data_t *) fr_message_alloc(ms, &reply->m, encoded);
+		rad_assert(reply != NULL);
+	}
+
+	/*
+	 *	The request is done.  Track that.
+	 */
+	now = fr_time();
+	fr_time_tracking_end(&request->tracking, now, &worker->tracking);
+
+	/*
+	 *	Running time includes decoding and encoding, so take
+	 *	them out.
+	 */
+	if (!encode_start) encode_start = now;
+	run = request->tracking.running;
+	if (run > (request->decode_time + (now - encode_start))) {
+		run -= request->decode_time + (now - encode_start);
+	} else {
+		run = 0;
+	}
+
+	fr_time_histogram_add(worker->latency[FR_TIME_STAGE_RUN], run);
+	fr_time_histogram_add(worker->latency[FR_TIME_STAGE_YIELDED], request->tracking.waiting);
+	fr_time_histogram_add(worker->latency[FR_TIME_STAGE_ENCODE], now - encode_start);
+
+	/*
+	 *	Fill in the rest of the fields in the channel message.
+	 *
+	 *	sequence / ack will be filled in by fr_channel_send_reply()
+	 */
+	reply->m.when = request->tracking.when;
+	reply->reply.cpu_time = worker->tracking.running;
+	reply->reply.processing_time = request->tracking.running;
+	reply->reply.request_time = request->recv_time;
+
+	reply->ctx = request->packet_ctx;
+	reply->priority = request->priority;
+	reply->transport = request->transport->id;
+	fr_worker_reply_address(&reply->address, &request->address);
+
+	fr_worker_reply_push(worker, ch, reply);
+
+	FR_DLIST_REMOVE(request->time_order);
+	fr_worker_request_free(worker, request);
+}
+
+
+/** Check if a message will miss its deadline
+ *
+ *  The message will be finished no earlier than after the messages
+ *  ahead of it, plus itself, have been processed.  If that's after
+ *  the client gives up on the request, there's no point in doing any
+ *  work for it.
+ *
+ * @param[in] worker the worker
+ * @param[in] cd the message to check
+ * @param[in] now the current time
+ * @param[in] ahead the number of messages which will be processed before this one
+ * @return
+ *	- true if the message will miss its deadline
+ *	- false if it may still make it, or we have no estimate of the processing time
+ */
+static bool fr_worker_deadline_missed(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now, int ahead)
+{
+	if (!worker->tracking.predicted) return false;
+
+	return ((cd->m.when + worker->deadline) < (now + (ahead + 1) * worker->tracking.predicted));
+}
+
+/** Drop messages which can't be processed before their deadline
+ *
+ *  The list is walked from the oldest message.  We assume that the
+ *  messages are processed roughly in time order, so each message we
+ *  keep is "ahead" of the younger ones.  This isn't exact, as
+ *  weighted fair queueing will take younger messages from busy
+ *  traffic classes first.  But it's cheap, and NAKing a message
+ *  here is much less work than decoding and running a request which
+ *  the client has already given up on.
+ *
+ * @param[in] worker the worker
+ * @param[in] wh the worker heap to check
+ * @param[in] now the current time
+ * @param[in] ahead the number of messages which will be processed before anything in this heap
+ * @return the number of messages in this heap which were kept, plus "ahead"
+ */
+static int fr_worker_drop_late(fr_worker_t *worker, fr_worker_heap_t *wh, fr_time_t now, int ahead)
+{
+	fr_dlist_t *entry, *prev;
+
+	if (!worker->tracking.predicted) return ahead + wh->num_elements;
+
+	for (entry = FR_DLIST_TAIL(wh->list); entry != NULL; entry = prev) {
+		fr_channel_data_t *cd;
+
+		prev = (entry->prev == &wh->list) ? NULL : entry->prev;
+		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
+
+		/*
+		 *	Once a message has enough slack to wait for
+		 *	everything in the queue, so do all of the
+		 *	younger ones.
+		 */
+		if ((cd->m.when + worker->deadline) >= (now + (ahead + wh->num_elements + 1) * worker->tracking.predicted)) {
+			return ahead + wh->num_elements;
+		}
+
+		if (!fr_worker_deadline_missed(worker, cd, now, ahead)) {
+			ahead++;
+			continue;
+		}
+
+		fr_worker_heap_extract(wh, cd);
+		FR_DLIST_REMOVE(cd->request.list);
+
+		worker->num_dropped++;
+		fr_worker_nak(worker, cd, now);
+	}
+
+	return ahead;
+}
+
+/** Run the process function of a request on its coroutine
+ *
+ * @param[in] ctx the request
+ * @return the fr_transport_final_t from the process function
+ */
+static int fr_worker_coro_run(void *ctx)
+{
+	REQUEST *request = ctx;
 
-	/*
-	 *	Encode it, if required.
-	 */
-	if (size) {
-		ssize_t encoded;
+	return request->process_async(request, FR_TRANSPORT_ACTION_RUN);
+}
 
-		encoded = request->transport->encode(request->packet_ctx, request, reply->m.data, reply->m.rb_size);
-		if (encoded < 0) {
-			MPRINT("\tWORKER fails encode\n");
-			encoded = 0;
-		}
+/** Call the process function of a request
+ *
+ *  If coroutines are enabled, requests run on their own stack.  A
+ *  request which yields from its stack is resumed where it left off.
+ *  Telling such a request that it's done cancels the wait, so that
+ *  it can unwind, and return.
+ *
+ * @param[in] worker the worker
+ * @param[in] request the request
+ * @param[in] action what the process function should do
+ * @return what the process function returned
+ */
+static fr_transport_final_t fr_worker_process(fr_worker_t *worker, REQUEST *request, fr_transport_action_t action)
+{
+	int rcode;
 
+	if (!request->coro) {
 		/*
-		 *	Resize the buffer to the actual packet size.
+		 *	Requests which are done without ever having
+		 *	run don't need a stack.
 		 */
-		cd = (fr_channel_data_t *) fr_message_alloc(ms, &reply->m, encoded);
-		rad_assert(cd == reply);
-	}
-
-	/*
-	 *	The request is done.  Track that.
-	 */
-	fr_time_tracking_end(&request->tracking, fr_time(), &worker->tracking);
+		if (!worker->coro_pool || (action == FR_TRANSPORT_ACTION_DONE)) {
+			return request->process_async(request, action);
+		}
 
-	/*
-	 *	Fill in the rest of the fields in the channel message.
-	 *
-	 *	sequence / ack will be filled in by fr_channel_send_reply()
-	 */
-	reply->m.when = request->tracking.when;
-	reply->reply.cpu_time = worker->tracking.running;
-	reply->reply.processing_time = request->tracking.running;
-	reply->reply.request_time = request->recv_time;
+		request->coro = fr_coro_alloc(worker->coro_pool);
+		if (!request->coro) return request->process_async(request, action);
 
-	reply->ctx = request->packet_ctx;
-	reply->priority = request->priority;
-	reply->transport = request->transport->id;
+		rcode = fr_coro_start(request->coro, fr_worker_coro_run, request);
+		if (rcode < 0) {
+			fr_coro_release(request->coro);
+			request->coro = NULL;
+			return request->process_async(request, action);
+		}
+	} else {
+		rcode = fr_coro_resume(request->coro, (action == FR_TRANSPORT_ACTION_DONE));
+	}
 
 	/*
-	 *	Send the reply, which also polls the request queue.
+	 *	The request is still waiting on its stack.  If we
+	 *	couldn't switch to it, it will be cleaned up when it
+	 *	times out.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		MPRINT("\tWORKER fails sending reply\n");
-		cd = NULL;
+	if (rcode != 0) {
+		if (rcode > 0) worker->num_coro_yields++;
+		return FR_TRANSPORT_YIELD;
 	}
 
-	worker->num_replies++;
-
 	/*
-	 *	Drain the incoming TO_WORKER queue.  We do this every
-	 *	time we're done processing a request.
+	 *	The process function returned, so we don't need the
+	 *	stack any more.
 	 */
-	if (cd) fr_worker_drain_input(worker, ch, cd);
+	rcode = fr_coro_result(request->coro);
+	fr_coro_release(request->coro);
+	request->coro = NULL;
 
-	/*
-	 *	@todo Use a talloc pool for the request.  Clean it up,
-	 *	and insert it back into a slab allocator.
-	 */
-	FR_DLIST_REMOVE(request->time_order);
-	talloc_free(request);
+	return (fr_transport_final_t) rcode;
 }
 
-
-#define fr_ptr_to_type(TYPE, MEMBER, PTR) (TYPE *) (((char *)PTR) - offsetof(TYPE, MEMBER))
-
 /** Check timeouts on the various queues
  *
  *  This function checks and enforces timeouts on the multiple worker
@@ -497,6 +1152,27 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 	fr_time_t waiting;
 	fr_dlist_t *entry;
 
+	/*
+	 *	Take back any messages which our siblings didn't
+	 *	steal.  They're then subject to the normal timeouts.
+	 */
+	if (worker->offered && ((now - worker->offered) > STEAL_TIMEOUT)) {
+		fr_channel_data_t *cd;
+
+		while (fr_atomic_queue_pop(worker->aq_steal, (void **) &cd)) {
+			WORKER_HEAP_INSERT(to_decode, cd, request.list);
+		}
+		worker->offered = 0;
+	}
+
+	/*
+	 *	Drop messages which won't be done before the client
+	 *	retransmits.  Localized messages are processed first,
+	 *	so they're ahead of everything in "to_decode".
+	 */
+	(void) fr_worker_drop_late(worker, &worker->to_decode, now,
+				   fr_worker_drop_late(worker, &worker->localized, now, 0));
+
 	/*
 	 *	Check the "localized" queue for old packets.
 	 *
@@ -568,7 +1244,7 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		FR_DLIST_REMOVE(request->time_order);
 		(void) fr_heap_extract(worker->runnable, request);
 
-		final = request->process_async(request, FR_TRANSPORT_ACTION_DONE);
+		final = fr_worker_process(worker, request, FR_TRANSPORT_ACTION_DONE);
 
 		if (final != FR_TRANSPORT_DONE) {
 			FR_DLIST_INSERT_TAIL(worker->waiting_to_die, request->time_order);
@@ -592,7 +1268,7 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 
 		request = fr_ptr_to_type(REQUEST, time_order, entry);
 
-		final = request->process_async(request, FR_TRANSPORT_ACTION_DONE);
+		final = fr_worker_process(worker, request, FR_TRANSPORT_ACTION_DONE);
 
 		if (final == FR_TRANSPORT_DONE) {
 			FR_DLIST_REMOVE(worker->waiting_to_die);
@@ -618,9 +1294,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	int rcode;
 	fr_channel_data_t *cd;
 	REQUEST *request;
-#ifndef HAVE_TALLOC_POOLED_OBJECT
-	TALLOC_CTX *ctx;
-#endif
+	fr_time_t decoded;
 
 	/*
 	 *	Grab a runnable request, and resume it.
@@ -652,24 +1326,23 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 			MPRINT("\tIGNORING old message\n");
 			fr_worker_nak(worker, cd, fr_time());
 			cd = NULL;
+			continue;
 		}
-	} while (!cd);
-
-#ifndef HAVE_TALLOC_POOLED_OBJECT
-	/*
-	 *	Get a talloc pool specifically for this packet.
-	 */
-	ctx = talloc_pool(worker, worker->talloc_pool_size);
-	if (!ctx) goto nak;
 
-	talloc_set_name_const(ctx, "REQUEST");
+		/*
+		 *	The client will have given up before we're
+		 *	done.  Don't bother decoding it.
+		 */
+		if (fr_worker_deadline_missed(worker, cd, now, 0)) {
+			MPRINT("\tDROPPING late message\n");
+			worker->num_dropped++;
+			fr_worker_nak(worker, cd, now);
+			cd = NULL;
+		}
+	} while (!cd);
 
-	request = (REQUEST *) ctx;
-	memset(request, 0, sizeof(*request));
-#else
-	request = ctx = talloc_pooled_object(worker, REQUEST, 1, worker->talloc_pool_size);
+	request = fr_worker_request_alloc(worker);
 	if (!request) goto nak;
-#endif
 
 	/*
 	 *	Receive a message to the worker queue, and decode it
@@ -695,19 +1368,26 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	request->runnable = worker->runnable;
 	request->el = worker->el;
 	request->packet_ctx = cd->ctx;
+	request->address = cd->address;
+
+	fr_time_histogram_add(worker->latency[FR_TIME_STAGE_QUEUE], (now > cd->m.when) ? (now - cd->m.when) : 0);
 
 	/*
 	 *	Now that the "request" structure has been initialized, go decode the packet.
 	 */
 	rcode = worker->transports[cd->transport]->decode(cd->ctx, cd->m.data, cd->m.data_size, request);
+	decoded = fr_time();
 	if (rcode < 0) {
 		MPRINT("\tFAILED decode of request %zd\n", request->number);
-		talloc_free(ctx);
+		fr_worker_request_free(worker, request);
 nak:
 		fr_worker_nak(worker, cd, fr_time());
 		return NULL;
 	}
 
+	request->decode_time = decoded - now;
+	fr_time_histogram_add(worker->latency[FR_TIME_STAGE_DECODE], request->decode_time);
+
 	/*
 	 *	Hoist run-time checks here.
 	 */
@@ -732,6 +1412,7 @@ nak:
 	 *	transitions.
 	 */
 	request->process_async = request->transport->process;
+	request->coro = NULL;
 	fr_time_tracking_start(&request->tracking, now);
 
 	return request;
@@ -759,10 +1440,10 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 	 */
 	if ((*request->original_recv_time == request->recv_time) &&
 	    fr_channel_active(request->channel)) {
-		final = request->process_async(request, FR_TRANSPORT_ACTION_RUN);
+		final = fr_worker_process(worker, request, FR_TRANSPORT_ACTION_RUN);
 
 	} else {
-		final = request->process_async(request, FR_TRANSPORT_ACTION_DONE);
+		final = fr_worker_process(worker, request, FR_TRANSPORT_ACTION_DONE);
 
 		/*
 		 *	If the request isn't done, put it into the
@@ -804,7 +1485,8 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
  *
  *  This function MUST DO NO WORK.  All it does is check if there's
  *  work, and tell the event code to return to the main loop if
- *  there's work to do.
+ *  there's work to do.  The exception is that when there's no work,
+ *  we try to steal some from our siblings.
  *
  * @param[in] ctx the worker
  * @param[in] wake the time when the event loop will wake up.
@@ -818,8 +1500,8 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 #ifndef NDEBUG
 	talloc_get_type_abort(worker, fr_worker_t);
 	rad_assert(worker->runnable != NULL);
-	rad_assert(worker->to_decode.heap != NULL);
-	rad_assert(worker->localized.heap != NULL);
+	rad_assert(worker->to_decode.heap[0] != NULL);
+	rad_assert(worker->localized.heap[0] != NULL);
 #endif
 
 	/*
@@ -834,8 +1516,8 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 	 *	channels that we're sleeping.
 	 */
 	sleeping = (fr_heap_num_elements(worker->runnable) == 0);
-	if (sleeping) sleeping = (fr_heap_num_elements(worker->localized.heap) == 0);
-	if (sleeping) sleeping = (fr_heap_num_elements(worker->to_decode.heap) == 0);
+	if (sleeping) sleeping = (worker->localized.num_elements == 0);
+	if (sleeping) sleeping = (worker->to_decode.num_elements == 0);
 
 	/*
 	 *	Tell the event loop that there is new work to do.  We
@@ -844,10 +1526,25 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 	 */
 	if (!sleeping) return 1;
 
-	MPRINT("\tWORKER sleeping running %zd, localized %zd, to_decode %zd\n",
+	/*
+	 *	We're about to go to sleep.  See if any sibling has
+	 *	offered work that nobody else has taken.
+	 */
+	for (i = 0; i < worker->num_siblings; i++) {
+		if (worker->siblings[i] == worker) continue;
+
+		if (fr_worker_steal(worker, worker->siblings[i]) > 0) return 1;
+	}
+
+	/*
+	 *	Tell our siblings that we're willing to take work.
+	 */
+	if (worker->num_siblings) atomic_store_explicit(&worker->idle, true, memory_order_release);
+
+	MPRINT("\tWORKER sleeping running %zd, localized %d, to_decode %d\n",
 	       fr_heap_num_elements(worker->runnable),
-	       fr_heap_num_elements(worker->localized.heap),
-	       fr_heap_num_elements(worker->to_decode.heap));
+	       worker->localized.num_elements,
+	       worker->to_decode.num_elements);
 	MPRINT("\tWORKER requests %d, decoded %d, replied %d\n",
 	       worker->num_requests, worker->num_decoded, worker->num_replies);
 
@@ -926,6 +1623,10 @@ void fr_worker_destroy(fr_worker_t *worker)
 		fr_message_done(&cd->m);
 	}
 
+	while (fr_atomic_queue_pop(worker->aq_steal, (void **) &cd)) {
+		fr_message_done(&cd->m);
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -952,7 +1653,7 @@ void fr_worker_destroy(fr_worker_t *worker)
  */
 fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_transport_t **transports)
 {
-	int max_channels = 64;
+	int i, max_channels = 64;
 	fr_worker_t *worker;
 
 	if (!num_transports || !transports) return NULL;
@@ -970,7 +1671,7 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 	 *	@todo make these configurable
 	 */
 	worker->max_channels = max_channels;
-	worker->talloc_pool_size = 4096; /* at least enough for a REQUEST */
+	worker->talloc_pool_size = 4096; /* at least enough for a REQUEST, grows as needed */
 	worker->message_set_size = 1024;
 	worker->ring_buffer_size = (1 << 16);
 
@@ -993,6 +1694,30 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 	memset(&worker->tracking, 0, sizeof(worker->tracking));
 	FR_DLIST_INIT(worker->tracking.list);
 
+	/*
+	 *	Authentication and Status-Server have time-critical
+	 *	clients, so they get the most time.
+	 */
+	worker->wfq_cost[FR_CHANNEL_CLASS_AUTH] = WFQ_SCALE / 16;
+	worker->wfq_cost[FR_CHANNEL_CLASS_ACCT] = WFQ_SCALE / 4;
+	worker->wfq_cost[FR_CHANNEL_CLASS_COA] = WFQ_SCALE / 8;
+	worker->wfq_cost[FR_CHANNEL_CLASS_STATUS] = WFQ_SCALE / 16;
+	worker->wfq_cost[FR_CHANNEL_CLASS_DETAIL] = WFQ_SCALE / 1;
+
+	/*
+	 *	Most NASes retransmit after a few seconds, but the
+	 *	queues time out messages after one second anyways.
+	 */
+	worker->deadline = NANOSEC;
+
+	for (i = 0; i < FR_TIME_STAGE_MAX; i++) {
+		worker->latency[i] = fr_time_histogram_create(worker);
+		if (!worker->latency[i]) {
+			talloc_free(worker);
+			return NULL;
+		}
+	}
+
 	worker->kq = fr_event_list_kq(worker->el);
 	rad_assert(worker->kq >= 0);
 
@@ -1013,6 +1738,38 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 		return NULL;
 	}
 
+	/*
+	 *	Channel signals are "go look at the channel"
+	 *	notifications, so duplicates can be dropped.
+	 */
+	(void) fr_control_coalesce_set(worker->control, FR_CONTROL_ID_CHANNEL, true);
+
+	if (fr_control_callback_add(worker->control, FR_CONTROL_ID_WORKER, worker, fr_worker_worker_callback) < 0) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	worker->rb = fr_ring_buffer_create(worker, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+	if (!worker->rb) {
+		talloc_free(worker);
+		return NULL;
+	}
+
+	worker->aq_steal = fr_atomic_queue_create(worker, STEAL_QUEUE_SIZE);
+	if (!worker->aq_steal) {
+		talloc_free(worker);
+		return NULL;
+	}
+	atomic_init(&worker->idle, false);
+
+	worker->ms = fr_message_set_create(worker, worker->message_set_size,
+					   sizeof(fr_channel_data_t),
+					   worker->ring_buffer_size);
+	if (!worker->ms) {
+		talloc_free(worker);
+		return NULL;
+	}
+
 	if (fr_event_user_insert(worker->el, fr_worker_evfilt_user, worker) < 0) {
 		talloc_free(worker);
 		return NULL;
@@ -1021,13 +1778,14 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 	WORKER_HEAP_INIT(to_decode, worker_message_cmp, fr_channel_data_t, channel.heap_id);
 	WORKER_HEAP_INIT(localized, worker_message_cmp, fr_channel_data_t, channel.heap_id);
 
-	worker->runnable = fr_heap_create(worker_request_cmp, offsetof(REQUEST, heap_id));
+	worker->runnable = fr_heap_create_arity(worker_request_cmp, offsetof(REQUEST, heap_id), 4);
 	if (!worker->runnable) {
 		talloc_free(worker);
 		return NULL;
 	}
 	FR_DLIST_INIT(worker->time_order);
 	FR_DLIST_INIT(worker->waiting_to_die);
+	FR_DLIST_INIT(worker->request_cache);
 
 	worker->num_transports = num_transports;
 	worker->transports = transports;
@@ -1058,18 +1816,56 @@ void fr_worker_exit(fr_worker_t *worker)
 }
 
 
+/** Publish the load of the worker, so that the scheduler can see it
+ *
+ * @param[in] worker the worker
+ * @param[in] now the current time
+ */
+static void fr_worker_load_update(fr_worker_t *worker, fr_time_t now)
+{
+	fr_dlist_t *entry;
+	fr_time_t wait = 0;
+	fr_channel_data_t *cd;
+
+	entry = FR_DLIST_TAIL(worker->localized.list);
+	if (entry) {
+		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
+		if (now > cd->m.when) wait = now - cd->m.when;
+	}
+
+	entry = FR_DLIST_TAIL(worker->to_decode.list);
+	if (entry) {
+		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
+		if ((now > cd->m.when) && ((now - cd->m.when) > wait)) wait = now - cd->m.when;
+	}
+
+	atomic_store_explicit(&worker->load_depth,
+			      worker->localized.num_elements + worker->to_decode.num_elements +
+			      fr_heap_num_elements(worker->runnable), memory_order_relaxed);
+	atomic_store_explicit(&worker->load_wait, wait, memory_order_relaxed);
+	atomic_store_explicit(&worker->load_running, worker->tracking.running, memory_order_relaxed);
+	atomic_store_explicit(&worker->load_channels, worker->num_channels, memory_order_release);
+}
+
 /** The main worker function.
  *
  * @param[in] worker the worker data structure to manage
  */
 void fr_worker(fr_worker_t *worker)
 {
+	fr_time_t now = fr_time();
+
 	while (true) {
 		bool wait_for_event;
 		int num_events;
-		fr_time_t now;
 		REQUEST *request;
 
+		/*
+		 *	Tell the scheduler how busy we are, before we
+		 *	go to sleep.
+		 */
+		fr_worker_load_update(worker, now);
+
 		/*
 		 *	There are runnable requests.  We still service
 		 *	the event loop, but we don't wait for events.
@@ -1085,6 +1881,8 @@ void fr_worker(fr_worker_t *worker)
 		MPRINT("\tGot num_events %d\n", num_events);
 		if (num_events < 0) break;
 
+		if (worker->num_siblings) atomic_store_explicit(&worker->idle, false, memory_order_release);
+
 		/*
 		 *	Service outstanding events.
 		 */
@@ -1103,6 +1901,11 @@ void fr_worker(fr_worker_t *worker)
 			fr_worker_check_timeouts(worker, now);
 		}
 
+		/*
+		 *	If we're busy, offer work to idle siblings.
+		 */
+		if (worker->num_siblings) fr_worker_steal_offer(worker, now);
+
 		/*
 		 *	Get a runnable request.  If there isn't one, continue.
 		 */
@@ -1145,15 +1948,217 @@ void worker_resume_request(REQUEST *request)
  */
 void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 {
+	int i;
+
 	fprintf(fp, "\tkq = %d\n", worker->kq);
 	fprintf(fp, "\tnum_channels = %d\n", worker->num_channels);
 	fprintf(fp, "\tnum_requests = %d\n", worker->num_requests);
+	fprintf(fp, "\tnum_offered = %d\n", worker->num_offered);
+	fprintf(fp, "\tnum_stolen = %d\n", worker->num_stolen);
+	fprintf(fp, "\tnum_timeouts = %d\n", worker->num_timeouts);
+	fprintf(fp, "\tnum_dropped = %d\n", worker->num_dropped);
+	fprintf(fp, "\tnum_coro_yields = %d\n", worker->num_coro_yields);
+	fprintf(fp, "\tnum_reused = %d (cached %d)\n", worker->num_reused, worker->num_cached);
+	fprintf(fp, "\ttalloc_pool_size = %zd\n", worker->talloc_pool_size);
 
 	fprintf(fp, "\tcalculated (predicted) total CPU time = %zd\n", worker->tracking.predicted * worker->num_requests);
 	fprintf(fp, "\tcalculated (counted) per request time = %zd\n", worker->tracking.running / worker->num_requests);
 
 	fr_time_tracking_debug(&worker->tracking, fp);
 
+	if (worker->coro_pool) fr_coro_pool_debug(worker->coro_pool, fp);
+
+	for (i = 0; i < FR_TIME_STAGE_MAX; i++) {
+		fr_time_histogram_debug(worker->latency[i], fr_time_stage_names[i], fp);
+	}
+}
+
+/** Set the weight of a traffic class
+ *
+ *  When all classes have messages waiting, each class gets a share
+ *  of the worker in proportion to its weight.  The defaults are 16
+ *  for auth and Status-Server, 8 for CoA, 4 for accounting, and 1
+ *  for detail file replay.
+ *
+ *  This function MUST be called from the worker thread, or before
+ *  the worker is running.
+ *
+ * @param[in] worker the worker
+ * @param[in] traffic_class the traffic class
+ * @param[in] weight the weight, from 1 to 65536
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_class_weight_set(fr_worker_t *worker, fr_channel_class_t traffic_class, uint32_t weight)
+{
+	if ((traffic_class < 0) || (traffic_class >= FR_CHANNEL_CLASS_MAX)) return -1;
+
+	if (!weight || (weight > WFQ_SCALE)) return -1;
+
+	worker->wfq_cost[traffic_class] = WFQ_SCALE / weight;
+
+	return 0;
+}
+
+/** Set the deadline for requests in the worker
+ *
+ *  This is how long the client waits for a reply before it
+ *  retransmits, typically the NAS retransmit interval.  Messages
+ *  which are predicted to miss the deadline are NAKed without being
+ *  decoded, which frees up time for the requests which can still
+ *  make it.
+ *
+ *  This function MUST be called from the worker thread, or before
+ *  the worker is running.
+ *
+ * @param[in] worker the worker
+ * @param[in] deadline the deadline, relative to when the packet was received
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_deadline_set(fr_worker_t *worker, fr_time_t deadline)
+{
+	if (!deadline) return -1;
+
+	worker->deadline = deadline;
+
+	return 0;
+}
+
+/** Run requests on their own stacks
+ *
+ *  Each request is run on a coroutine, which lets the process
+ *  function call fr_worker_coro_wait() from anywhere in its call
+ *  chain.  The stacks are pooled, so requests which never wait only
+ *  pay for the context switches.
+ *
+ *  This function MUST be called before the worker is running.
+ *
+ * @param[in] worker the worker
+ * @param[in] stack_size the size of each request stack
+ * @return
+ *	- <0 on error, including when coroutines are not supported
+ *	- 0 on success
+ */
+int fr_worker_coro_stack_set(fr_worker_t *worker, size_t stack_size)
+{
+	if (worker->coro_pool) return -1;
+
+	worker->coro_pool = fr_coro_pool_create(worker, stack_size, CORO_IDLE);
+	if (!worker->coro_pool) return -1;
+
+	return 0;
+}
+
+/**
+ *  A request which is waiting on its own stack for a socket.
+ */
+typedef struct fr_worker_coro_wait_t {
+	REQUEST			*request;	//!< the waiting request
+	bool			ready;		//!< the socket is ready
+} fr_worker_coro_wait_t;
+
+/** Mark a waiting request as runnable
+ *
+ * @param[in] el the event list
+ * @param[in] fd the socket which is ready
+ * @param[in] ctx the fr_worker_coro_wait_t
+ */
+static void fr_worker_coro_ready(fr_event_list_t *el, int fd, void *ctx)
+{
+	fr_worker_coro_wait_t *wait = ctx;
+
+	(void) fr_event_fd_delete(el, fd);
+
+	wait->ready = true;
+	(void) fr_heap_insert(wait->request->runnable, wait->request);
+}
+
+/** Wait for a socket, from inside of a request
+ *
+ *  The request yields to the worker event loop, and is resumed when
+ *  the socket is ready.  This lets drivers which use blocking-style
+ *  calls on non-blocking sockets wait without blocking the worker.
+ *
+ *  This function MUST only be called from the process function of a
+ *  request which is running on its own stack.  See
+ *  fr_worker_coro_stack_set().
+ *
+ * @param[in] request the request
+ * @param[in] fd the socket to wait for
+ * @param[in] want_write wait for the socket to be writable, instead of readable.
+ * @return
+ *	- <0 on error, or if the request was told to stop
+ *	- 0 when the socket is ready.
+ */
+int fr_worker_coro_wait(REQUEST *request, int fd, bool want_write)
+{
+	fr_worker_coro_wait_t wait;
+
+	if (!request->coro || (fr_coro_current() != request->coro)) return -1;
+
+	wait.request = request;
+	wait.ready = false;
+
+	if (fr_event_fd_insert(request->el, fd,
+			       want_write ? NULL : fr_worker_coro_ready,
+			       want_write ? fr_worker_coro_ready : NULL,
+			       fr_worker_coro_ready, &wait) < 0) {
+		return -1;
+	}
+
+	/*
+	 *	"wait" is on our stack, which stays around until we
+	 *	return.
+	 */
+	if ((fr_coro_yield() < 0) || !wait.ready) {
+		if (!wait.ready) (void) fr_event_fd_delete(request->el, fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Get the load of a worker
+ *
+ *  The load is published by the worker once per pass through its
+ *  event loop, so it may be slightly out of date.
+ *
+ *  This function may be called from any thread, so long as the
+ *  worker is running.
+ *
+ * @param[in] worker the worker
+ * @param[out] load the load of the worker
+ */
+void fr_worker_load(fr_worker_t *worker, fr_worker_load_t *load)
+{
+	load->num_channels = atomic_load_explicit(&worker->load_channels, memory_order_acquire);
+	load->depth = atomic_load_explicit(&worker->load_depth, memory_order_relaxed);
+	load->wait = atomic_load_explicit(&worker->load_wait, memory_order_relaxed);
+	load->running = atomic_load_explicit(&worker->load_running, memory_order_relaxed);
+}
+
+/** Add the latency histogram for one stage of the worker to another histogram
+ *
+ *  This function may be called from any thread, so long as the
+ *  worker is running.
+ *
+ * @param[in] worker the worker
+ * @param[in] stage the processing stage
+ * @param[in] out the histogram to update
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_latency(fr_worker_t const *worker, fr_time_stage_t stage, fr_time_histogram_t *out)
+{
+	if ((stage < 0) || (stage >= FR_TIME_STAGE_MAX)) return -1;
+
+	fr_time_histogram_merge(out, worker->latency[stage]);
+
+	return 0;
 }
 
 /** Create a channel to the worker
@@ -1175,3 +2180,29 @@ fr_channel_t *fr_worker_channel_create(fr_worker_t const *worker, TALLOC_CTX *ct
 
 	return fr_channel_create(ctx, master, worker->control);
 }
+
+/** Tell a worker which siblings it can steal work from
+ *
+ *  WARNING: This may be called from another thread!  The siblings
+ *  are sent to the worker via the control plane.  The array MUST
+ *  remain valid until all of the workers have exited.
+ *
+ * @param[in] worker the worker
+ * @param[in] rb the callers ring buffer for control-plane messages
+ * @param[in] num_siblings the number of workers in the siblings array
+ * @param[in] siblings the array of workers.  It may include this worker.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_siblings_set(fr_worker_t *worker, fr_ring_buffer_t *rb, int num_siblings, fr_worker_t **siblings)
+{
+	fr_worker_control_t msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.signal = FR_WORKER_SIGNAL_SIBLINGS;
+	msg.num_siblings = num_siblings;
+	msg.siblings = siblings;
+
+	return fr_control_message_send(worker->control, rb, FR_CONTROL_ID_WORKER, &msg, sizeof(msg));
+}
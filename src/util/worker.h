@@ -43,13 +43,30 @@ extern "C" {
  */
 typedef struct fr_worker_t fr_worker_t;
 
+/**
+ *  A snapshot of how busy a worker is.
+ */
+typedef struct fr_worker_load_t {
+	uint64_t	depth;			//!< messages and requests waiting to be processed
+	fr_time_t	wait;			//!< how long the oldest message has been waiting
+	fr_time_t	running;		//!< total time spent running requests
+	int		num_channels;		//!< number of open channels
+} fr_worker_load_t;
+
 fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_transport_t **transports);
 void fr_worker_destroy(fr_worker_t *worker) CC_HINT(nonnull);
 int fr_worker_kq(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_exit(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_debug(fr_worker_t *worker, FILE *fp) CC_HINT(nonnull);
+int fr_worker_class_weight_set(fr_worker_t *worker, fr_channel_class_t traffic_class, uint32_t weight) CC_HINT(nonnull);
+int fr_worker_deadline_set(fr_worker_t *worker, fr_time_t deadline) CC_HINT(nonnull);
+int fr_worker_coro_stack_set(fr_worker_t *worker, size_t stack_size) CC_HINT(nonnull);
+int fr_worker_coro_wait(REQUEST *request, int fd, bool want_write) CC_HINT(nonnull);
+void fr_worker_load(fr_worker_t *worker, fr_worker_load_t *load) CC_HINT(nonnull);
+int fr_worker_latency(fr_worker_t const *worker, fr_time_stage_t stage, fr_time_histogram_t *out) CC_HINT(nonnull);
 fr_channel_t *fr_worker_channel_create(fr_worker_t const *worker, TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
+int fr_worker_siblings_set(fr_worker_t *worker, fr_ring_buffer_t *rb, int num_siblings, fr_worker_t **siblings) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }